@@ -3,10 +3,15 @@
 #include "ai_display.h"
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 /* Global display instance */
 anbs_display_t *g_anbs_display = NULL;
@@ -19,9 +24,18 @@ static void anbs_draw_panel_borders(anbs_display_t *display);
 static int anbs_refresh_panel_content(anbs_display_t *display, anbs_panel_id_t panel_id);
 
 /**
- * Initialize the ANBS display system
+ * Initialize the ANBS display system on the backend ANBS_DISPLAY_BACKEND
+ * names
  */
 int anbs_display_init(anbs_display_t **display)
+{
+    return anbs_display_init_backend(display, NULL);
+}
+
+/**
+ * Initialize the ANBS display system, sending frames to BACKEND
+ */
+int anbs_display_init_backend(anbs_display_t **display, const anbs_display_backend_t *backend)
 {
     anbs_display_t *disp;
     int i;
@@ -44,9 +58,17 @@ int anbs_display_init(anbs_display_t **display)
     disp->active_panel = ANBS_PANEL_TERMINAL;
     disp->ai_command_active = false;
     disp->health_agent_count = 0;
+    disp->render_wake_fd = -1;
+    disp->backend = backend ? backend : anbs_display_backend_from_env();
+
+    /* Frame pacing */
+    const char *interval = getenv("ANBS_REFRESH_INTERVAL_MS");
+    disp->refresh_interval_ms = interval && atoi(interval) > 0 ? atoi(interval) : ANBS_REFRESH_INTERVAL_MS;
+    interval = getenv("ANBS_HEALTH_REFRESH_MS");
+    disp->health_interval_ms = interval && atoi(interval) > 0 ? atoi(interval) : ANBS_HEALTH_REFRESH_MS;
 
     /* Get initial terminal size */
-    if (anbs_get_terminal_size(&disp->term_width, &disp->term_height) != 0) {
+    if (disp->backend->size(disp, &disp->term_width, &disp->term_height) != 0) {
         free(disp);
         return -1;
     }
@@ -69,7 +91,8 @@ int anbs_display_init(anbs_display_t **display)
 
     /* Initialize text buffers for all panels */
     for (i = 0; i < ANBS_PANEL_COUNT; i++) {
-        if (anbs_text_buffer_init(&disp->panels[i].buffer, ANBS_MAX_TEXT_BUFFER_LINES) != 0) {
+        if (anbs_text_buffer_init(&disp->panels[i].buffer, ANBS_MAX_TEXT_BUFFER_LINES,
+                                  ANBS_MAX_TEXT_BUFFER_BYTES) != 0) {
             /* Cleanup already initialized buffers */
             for (int j = 0; j < i; j++) {
                 anbs_text_buffer_cleanup(disp->panels[j].buffer);
@@ -79,6 +102,22 @@ int anbs_display_init(anbs_display_t **display)
         }
     }
 
+    /* Index the scrollback for search if asked to */
+    const char *index = getenv("ANBS_SCROLLBACK_INDEX");
+    if (index && atoi(index) > 0) {
+        for (i = 0; i < ANBS_PANEL_COUNT; i++) {
+            anbs_text_buffer_enable_index(disp->panels[i].buffer);
+        }
+    }
+
+    /* Keep scrollback the RAM ring drops in a spill file, unless told not to */
+    const char *spill = getenv("ANBS_SCROLLBACK_SPILL");
+    if (!spill || atoi(spill) != 0) {
+        for (i = 0; i < ANBS_PANEL_COUNT; i++) {
+            anbs_text_buffer_enable_spill(disp->panels[i].buffer, getenv("ANBS_SCROLLBACK_DIR"));
+        }
+    }
+
     /* Setup panel layout */
     if (anbs_display_setup_panels(disp) != 0) {
         anbs_display_cleanup(disp);
@@ -101,6 +140,20 @@ int anbs_display_init(anbs_display_t **display)
     g_anbs_display = disp;
     *display = disp;
 
+    /* Hand ncurses to the render thread unless told not to */
+    const char *render = getenv("ANBS_RENDER_THREAD");
+    const char *pty = getenv("ANBS_PTY");
+    if (!render || atoi(render) != 0) {
+        /* Only the render thread reads child output, so the pty needs it */
+        if ((!pty || atoi(pty) != 0) && anbs_pty_open(disp) != 0) {
+            ANBS_DEBUG_LOG("No pseudo-terminal; commands write to the terminal directly");
+        }
+        if (anbs_display_start_render_thread(disp) != 0) {
+            ANBS_DEBUG_LOG("Render thread did not start; drawing from each caller");
+            anbs_pty_close(disp);
+        }
+    }
+
     ANBS_DEBUG_LOG("ANBS display system initialized successfully");
     return 0;
 }
@@ -113,10 +166,10 @@ static int anbs_init_ncurses(anbs_display_t *display)
     ANBS_DEBUG_LOG("Initializing NCurses");
 
     /* Initialize NCurses */
-    display->main_screen = initscr();
-    if (!display->main_screen) {
+    if (display->backend->open(display) != 0) {
         return -1;
     }
+    display->main_screen = stdscr;
 
     display->ncurses_initialized = true;
 
@@ -142,7 +195,8 @@ static int anbs_init_ncurses(anbs_display_t *display)
 
     /* Clear screen */
     clear();
-    refresh();
+    wnoutrefresh(stdscr);
+    display->backend->flush(display);
 
     ANBS_DEBUG_LOG("NCurses initialized successfully");
     return 0;
@@ -326,6 +380,8 @@ static void anbs_draw_panel_borders(anbs_display_t *display)
 
     /* Add junction character */
     mvaddch(separator_y, separator_x, '+');
+
+    display->screen_dirty = true;
 }
 
 /**
@@ -353,10 +409,14 @@ int anbs_display_resize(anbs_display_t *display)
     int new_width, new_height;
     int i;
 
+    if (anbs_render_defer(display, ANBS_RENDER_RESIZE, 0, 0, NULL, 0)) {
+        return 0;
+    }
+
     ANBS_DEBUG_LOG("Handling terminal resize");
 
     /* Get new terminal size */
-    if (anbs_get_terminal_size(&new_width, &new_height) != 0) {
+    if (display->backend->size(display, &new_width, &new_height) != 0) {
         return -1;
     }
 
@@ -387,6 +447,13 @@ int anbs_display_resize(anbs_display_t *display)
     for (i = 0; i < ANBS_PANEL_COUNT; i++) {
         panel_t *panel = &display->panels[i];
 
+        /* Reuse the window where possible, which also keeps its contents */
+        if (panel->window &&
+            wresize(panel->window, panel->height, panel->width) == OK &&
+            mvwin(panel->window, panel->start_y, panel->start_x) == OK) {
+            continue;
+        }
+
         /* Delete old window */
         if (panel->window) {
             delwin(panel->window);
@@ -410,10 +477,11 @@ int anbs_display_resize(anbs_display_t *display)
         }
     }
 
-    /* Redraw everything */
-    clear();
+    /* Redraw everything, without clearing the terminal first */
+    erase();
     anbs_draw_panel_borders(display);
     anbs_display_refresh_all(display);
+    anbs_pty_resize(display);
 
     display->last_resize = time(NULL);
 
@@ -421,6 +489,17 @@ int anbs_display_resize(anbs_display_t *display)
     return 0;
 }
 
+/**
+ * Milliseconds on the monotonic clock
+ */
+long long anbs_display_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 /**
  * Refresh all panels
  */
@@ -432,18 +511,112 @@ int anbs_display_refresh_all(anbs_display_t *display)
         return -1;
     }
 
-    /* Refresh main screen */
-    refresh();
+    if (anbs_render_defer(display, ANBS_RENDER_REFRESH_ALL, 0, 0, NULL, 0)) {
+        return 0;
+    }
 
-    /* Refresh all panels */
+    /* The main screen goes out first, so every panel is laid over it again */
+    display->screen_dirty = true;
     for (i = 0; i < ANBS_PANEL_COUNT; i++) {
-        if (display->panels[i].visible && display->panels[i].window) {
-            wrefresh(display->panels[i].window);
+        if (display->panels[i].window) {
+            touchwin(display->panels[i].window);
+            display->panels[i].dirty = true;
         }
     }
 
-    display->last_refresh = time(NULL);
-    display->refresh_count++;
+    return anbs_display_flush(display);
+}
+
+/**
+ * Refresh one panel now
+ */
+int anbs_display_refresh_panel(anbs_display_t *display, anbs_panel_id_t panel_id)
+{
+    if (!display || panel_id < 0 || panel_id >= ANBS_PANEL_COUNT) {
+        return -1;
+    }
+
+    if (anbs_render_defer(display, ANBS_RENDER_REFRESH_PANEL, panel_id, 0, NULL, 0)) {
+        return 0;
+    }
+
+    anbs_display_mark_dirty(display, panel_id);
+    return anbs_display_flush(display);
+}
+
+/**
+ * Note that a panel was drawn on; the next frame sends it
+ */
+void anbs_display_mark_dirty(anbs_display_t *display, anbs_panel_id_t panel_id)
+{
+    if (display && panel_id >= 0 && panel_id < ANBS_PANEL_COUNT) {
+        display->panels[panel_id].dirty = true;
+    }
+}
+
+/**
+ * Send a frame if one is due.  Writers call this after drawing, so a
+ * burst of output costs one terminal update per refresh interval; what
+ * the last writes of a burst leave behind goes out with the next tick
+ * or anbs_display_flush().
+ */
+int anbs_display_tick(anbs_display_t *display)
+{
+    if (!display || !display->ncurses_initialized) {
+        return -1;
+    }
+
+    /* Health updates held back by their own rate limit */
+    anbs_health_tick(display);
+
+    if (anbs_display_now_ms() - display->last_frame_ms < display->refresh_interval_ms) {
+        return 0;
+    }
+
+    /* However many SIGWINCHs came in, lay out again once per frame */
+    if (display->resize_pending) {
+        display->resize_pending = 0;
+        anbs_display_resize(display);
+    }
+
+    return anbs_display_flush(display);
+}
+
+/**
+ * Send every dirty panel to the terminal in a single update
+ */
+int anbs_display_flush(anbs_display_t *display)
+{
+    bool drawn = false;
+    int i;
+
+    if (!display || !display->ncurses_initialized) {
+        return -1;
+    }
+
+    if (display->screen_dirty) {
+        wnoutrefresh(stdscr);
+        display->screen_dirty = false;
+        drawn = true;
+    }
+
+    for (i = 0; i < ANBS_PANEL_COUNT; i++) {
+        panel_t *panel = &display->panels[i];
+
+        if (panel->dirty && panel->visible && panel->window) {
+            wnoutrefresh(panel->window);
+            panel->last_refresh = time(NULL);
+            drawn = true;
+        }
+        panel->dirty = false;
+    }
+
+    if (drawn) {
+        display->backend->flush(display);
+        display->last_refresh = time(NULL);
+        display->refresh_count++;
+    }
+    display->last_frame_ms = anbs_display_now_ms();
 
     return 0;
 }
@@ -457,20 +630,47 @@ int anbs_terminal_write(anbs_display_t *display, const char *text)
         return -1;
     }
 
+    if (anbs_render_defer(display, ANBS_RENDER_TERMINAL, 0, 0, text, strlen(text))) {
+        return 0;
+    }
+
     panel_t *panel = &display->panels[ANBS_PANEL_TERMINAL];
 
     /* Add text to buffer */
     anbs_text_buffer_append(panel->buffer, text);
 
+    /* Keep a scrolled-back view where it is */
+    if (panel->scroll_offset > 0) {
+        panel->scroll_offset++;
+        return 0;
+    }
+
     /* Write to window */
     if (panel->window && panel->visible) {
         wprintw(panel->window, "%s", text);
-        wrefresh(panel->window);
+        anbs_display_mark_dirty(display, ANBS_PANEL_TERMINAL);
+        anbs_display_tick(display);
     }
 
     return 0;
 }
 
+/**
+ * Echo typed input to the terminal panel without waiting for a frame
+ */
+int anbs_terminal_echo(anbs_display_t *display, const char *text)
+{
+    if (text && anbs_render_defer(display, ANBS_RENDER_ECHO, 0, 0, text, strlen(text))) {
+        return 0;
+    }
+
+    if (anbs_terminal_write(display, text) != 0) {
+        return -1;
+    }
+
+    return anbs_display_flush(display);
+}
+
 /**
  * Write AI response to chat panel
  */
@@ -480,6 +680,10 @@ int anbs_ai_chat_write(anbs_display_t *display, const char *response)
         return -1;
     }
 
+    if (anbs_render_defer(display, ANBS_RENDER_AI_CHAT, 0, 0, response, strlen(response))) {
+        return 0;
+    }
+
     panel_t *panel = &display->panels[ANBS_PANEL_AI_CHAT];
 
     /* Add response to buffer with AI formatting */
@@ -488,6 +692,12 @@ int anbs_ai_chat_write(anbs_display_t *display, const char *response)
 
     anbs_text_buffer_append(panel->buffer, formatted_response);
 
+    /* Keep a scrolled-back view where it is */
+    if (panel->scroll_offset > 0) {
+        panel->scroll_offset++;
+        return 0;
+    }
+
     /* Write to window with color */
     if (panel->window && panel->visible) {
         if (display->color_supported) {
@@ -497,7 +707,8 @@ int anbs_ai_chat_write(anbs_display_t *display, const char *response)
         if (display->color_supported) {
             wattroff(panel->window, COLOR_PAIR(ANBS_COLOR_AI_RESPONSE));
         }
-        wrefresh(panel->window);
+        anbs_display_mark_dirty(display, ANBS_PANEL_AI_CHAT);
+        anbs_display_tick(display);
     }
 
     return 0;
@@ -508,9 +719,22 @@ int anbs_ai_chat_write(anbs_display_t *display, const char *response)
  */
 void anbs_signal_resize_handler(int sig)
 {
-    if (g_anbs_display) {
-        anbs_display_resize(g_anbs_display);
+    anbs_display_t *display = g_anbs_display;
+    int saved_errno = errno;
+    uint64_t one = 1;
+
+    if (!display) {
+        return;
     }
+
+    /* Only note it; the next frame's tick lays the panels out again */
+    display->resize_pending = 1;
+    if (display->render_wake_fd >= 0 &&
+        write(display->render_wake_fd, &one, sizeof(one)) < 0) {
+        /* Already awake */
+    }
+
+    errno = saved_errno;
 }
 
 /**
@@ -545,6 +769,10 @@ void anbs_display_cleanup(anbs_display_t *display)
 
     ANBS_DEBUG_LOG("Cleaning up ANBS display system");
 
+    anbs_display_stop_render_thread(display);
+    anbs_pty_close(display);
+    anbs_text_buffer_search_end(display->search);
+
     /* Cleanup panels */
     for (i = 0; i < ANBS_PANEL_COUNT; i++) {
         if (display->panels[i].window) {
@@ -557,7 +785,7 @@ void anbs_display_cleanup(anbs_display_t *display)
 
     /* Cleanup NCurses */
     if (display->ncurses_initialized) {
-        endwin();
+        display->backend->close(display);
     }
 
     /* Clear global reference */
@@ -620,6 +848,10 @@ int anbs_status_write(anbs_display_t *display, const char *status)
         return -1;
     }
 
+    if (anbs_render_defer(display, ANBS_RENDER_STATUS, 0, 0, status, strlen(status))) {
+        return 0;
+    }
+
     panel_t *panel = &display->panels[ANBS_PANEL_STATUS];
 
     if (panel->window && panel->visible) {
@@ -635,8 +867,580 @@ int anbs_status_write(anbs_display_t *display, const char *status)
             wattroff(panel->window, COLOR_PAIR(ANBS_COLOR_STATUS));
         }
 
-        wrefresh(panel->window);
+        anbs_display_mark_dirty(display, ANBS_PANEL_STATUS);
+        anbs_display_tick(display);
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Redraw a panel from its history with the line SCROLL_OFFSET lines
+ * above the newest at the bottom, highlighting history line HIGHLIGHT.
+ * Long lines wrap onto further rows, so lines are counted back from the
+ * bottom by their cached row counts until the panel is full.  Only the
+ * lines on screen are fetched, however long the history.
+ */
+static void anbs_display_show_lines(anbs_display_t *display, anbs_panel_id_t panel_id,
+                                    unsigned long scroll_offset, long highlight)
+{
+    panel_t *panel = &display->panels[panel_id];
+    unsigned long first, last, total, index;
+    int width, height, border, row, rows, skip;
+
+    if (!panel->window || !panel->visible) {
+        return;
+    }
+
+    border = panel->has_border ? 1 : 0;
+    width = panel->width - 2 * border;
+    height = panel->height - 2 * border;
+    total = anbs_text_buffer_history_lines(panel->buffer);
+
+    werase(panel->window);
+    if (panel->has_border) {
+        anbs_panel_draw_border(panel, NULL);
+    }
+
+    if (total == 0 || width <= 0 || height <= 0) {
+        anbs_display_mark_dirty(display, panel_id);
+        return;
+    }
+
+    /* Find the first line shown and how many of its rows fall off the top */
+    if (total <= (unsigned long)height) {
+        last = total - 1;
+    } else if (scroll_offset > total - height) {
+        last = height - 1;
+    } else {
+        last = total - 1 - scroll_offset;
+    }
+    first = last;
+    rows = anbs_text_buffer_line_rows(panel->buffer, first, width);
+    while (rows < height && first > 0) {
+        first--;
+        rows += anbs_text_buffer_line_rows(panel->buffer, first, width);
+    }
+    skip = rows > height ? rows - height : 0;
+
+    row = 0;
+    for (index = first; index <= last && row < height; index++) {
+        const char *text = anbs_text_buffer_history_line(panel->buffer, index);
+        size_t length;
+
+        if (!text) {
+            row++;
+            continue;
+        }
+
+        length = strcspn(text, "\n");
+        if (highlight >= 0 && index == (unsigned long)highlight) {
+            wattron(panel->window, A_REVERSE);
+        }
+        do {
+            size_t n = anbs_text_fit(text, length, width, NULL);
+
+            /* A character wider than the panel still gets its own row */
+            if (n == 0 && length > 0) {
+                n = 1;
+            }
+            if (skip > 0) {
+                skip--;
+            } else {
+                mvwaddnstr(panel->window, row + border, border, text, (int)n);
+                row++;
+            }
+            text += n;
+            length -= n;
+        } while (length > 0 && row < height);
+        if (highlight >= 0 && index == (unsigned long)highlight) {
+            wattroff(panel->window, A_REVERSE);
+        }
+    }
+
+    anbs_display_mark_dirty(display, panel_id);
+}
+
+/**
+ * Feed a key to search-as-you-type over a panel's scrollback, opening
+ * the search on the first key.  Typing narrows the search and backspace
+ * widens it; Ctrl-R and Ctrl-S step to older and newer matches, Ctrl-T
+ * toggles case and Ctrl-X regular expressions; Enter or Escape closes
+ * it.  Returns 1 while the search is open and 0 once it is closed.
+ */
+int anbs_display_search_key(anbs_display_t *display, anbs_panel_id_t panel_id, int key)
+{
+    char status[320];
+    unsigned long scroll_offset = 0;
+    long highlight = -1;
+    size_t length;
+    int count, line;
+
+    if (!display || panel_id < 0 || panel_id >= ANBS_PANEL_COUNT) {
+        return -1;
+    }
+
+    if (anbs_render_defer(display, ANBS_RENDER_SEARCH_KEY, panel_id, key, NULL, 0)) {
+        return key == 27 || key == '\n' || key == '\r' || key == KEY_ENTER ? 0 : 1;
+    }
+
+    /* Open the search */
+    if (!display->search) {
+        if (anbs_text_buffer_search_begin(display->panels[panel_id].buffer,
+                                          display->search_flags, &display->search) != 0) {
+            return -1;
+        }
+        display->search_panel = panel_id;
+        display->search_current = 0;
+        display->search_query[0] = '\0';
+    }
+    panel_id = display->search_panel;
+
+    length = strlen(display->search_query);
+    switch (key) {
+        case 27:
+        case '\n':
+        case '\r':
+        case KEY_ENTER:
+            anbs_text_buffer_search_end(display->search);
+            display->search = NULL;
+            display->panels[panel_id].scroll_offset = 0;
+            anbs_display_show_lines(display, panel_id, 0, -1);
+            anbs_status_write(display, "");
+            anbs_display_flush(display);
+            return 0;
+        case KEY_BACKSPACE:
+        case 127:
+        case 8:
+            if (length > 0) {
+                display->search_query[length - 1] = '\0';
+            }
+            display->search_current = 0;
+            break;
+        case 18:
+        case KEY_UP:
+            display->search_current++;
+            break;
+        case 19:
+        case KEY_DOWN:
+            if (display->search_current > 0) {
+                display->search_current--;
+            }
+            break;
+        case 20:
+        case 24:
+            /* Modes are fixed per search, so start a new one */
+            display->search_flags ^= key == 20 ? ANBS_SEARCH_IGNORE_CASE : ANBS_SEARCH_REGEX;
+            anbs_text_buffer_search_end(display->search);
+            display->search = NULL;
+            if (anbs_text_buffer_search_begin(display->panels[panel_id].buffer,
+                                              display->search_flags, &display->search) != 0) {
+                return -1;
+            }
+            display->search_current = 0;
+            break;
+        default:
+            if (key < 0 || key > 255 || !isprint(key) ||
+                length + 1 >= sizeof(display->search_query)) {
+                return 1;
+            }
+            display->search_query[length] = (char)key;
+            display->search_query[length + 1] = '\0';
+            display->search_current = 0;
+            break;
+    }
+
+    /* Matches come oldest first; show the newest unless stepped back */
+    count = anbs_text_buffer_search_update(display->search, display->search_query);
+    if (count < 0) {
+        snprintf(status, sizeof(status), "search: %s (incomplete pattern)",
+                 display->search_query);
+        line = -1;
+    } else {
+        if (display->search_current >= count) {
+            display->search_current = count > 0 ? count - 1 : 0;
+        }
+        line = anbs_text_buffer_search_line(display->search, count - 1 - display->search_current);
+        snprintf(status, sizeof(status), "search%s%s: %s (%d of %d)",
+                 display->search_flags & ANBS_SEARCH_IGNORE_CASE ? " -i" : "",
+                 display->search_flags & ANBS_SEARCH_REGEX ? " -E" : "",
+                 display->search_query, count > 0 ? display->search_current + 1 : 0, count);
+    }
+
+    /* Center the match in the panel where the history allows it */
+    if (line >= 0) {
+        panel_t *panel = &display->panels[panel_id];
+        unsigned long total = anbs_text_buffer_history_lines(panel->buffer);
+        unsigned long below;
+        int height = panel->height - (panel->has_border ? 2 : 0);
+
+        highlight = (long)(total - panel->buffer->line_count) + line;
+        below = total - 1 - highlight;
+        scroll_offset = below > (unsigned long)(height - 1) / 2 ? below - (height - 1) / 2 : 0;
+    }
+
+    /* Typing expects an answer now, not at the next frame */
+    anbs_display_show_lines(display, panel_id, scroll_offset, highlight);
+    anbs_status_write(display, status);
+    anbs_display_flush(display);
+    return 1;
+}
+
+/**
+ * Scroll a panel LINES lines back through its history, or forward when
+ * LINES is negative.  New output is held off the screen until the panel
+ * is scrolled back to the bottom.
+ */
+int anbs_display_scroll(anbs_display_t *display, anbs_panel_id_t panel_id, long lines)
+{
+    panel_t *panel;
+    unsigned long total, limit;
+    int height;
+
+    if (!display || panel_id < 0 || panel_id >= ANBS_PANEL_COUNT) {
+        return -1;
+    }
+
+    if (anbs_render_defer(display, ANBS_RENDER_SCROLL, panel_id, lines, NULL, 0)) {
+        return 0;
+    }
+
+    panel = &display->panels[panel_id];
+    height = panel->height - (panel->has_border ? 2 : 0);
+    total = anbs_text_buffer_history_lines(panel->buffer);
+    limit = total > (unsigned long)height ? total - height : 0;
+
+    if (lines < 0 && (unsigned long)-lines >= panel->scroll_offset) {
+        panel->scroll_offset = 0;
+    } else if (lines < 0) {
+        panel->scroll_offset -= (unsigned long)-lines;
+    } else {
+        panel->scroll_offset += (unsigned long)lines;
+    }
+    if (panel->scroll_offset > limit) {
+        panel->scroll_offset = limit;
+    }
+
+    anbs_display_show_lines(display, panel_id, panel->scroll_offset, -1);
+    return anbs_display_tick(display);
+}
+
+/* One deferred display call */
+typedef struct {
+    anbs_render_op_t op;
+    int panel;
+    long arg;
+    size_t size;
+    char data[];               /* Text, NUL-terminated, or a copied struct */
+} anbs_render_cmd_t;
+
+/* Calls from one producing thread; only it pushes, only the render
+   thread pops */
+typedef struct anbs_render_queue {
+    atomic_size_t head;        /* Next slot to pop */
+    atomic_size_t tail;        /* Next slot to push */
+    anbs_render_cmd_t *slots[ANBS_RENDER_QUEUE_SLOTS];
+    struct anbs_render_queue *next;
+} anbs_render_queue_t;
+
+/* Render threads started so far, to tell queues of an old display apart */
+static atomic_ulong anbs_render_generations;
+
+/* This thread's queue, valid for display generation tls_render_generation */
+static __thread anbs_render_queue_t *tls_render_queue;
+static __thread unsigned long tls_render_generation;
+
+/* Set on the render thread itself, whose calls always run directly */
+static __thread bool tls_render_thread;
+
+/**
+ * This thread's queue to the render thread, registered on first use
+ */
+static anbs_render_queue_t *anbs_render_queue_get(anbs_display_t *display)
+{
+    anbs_render_queue_t *queue;
+
+    if (tls_render_queue && tls_render_generation == display->render_generation) {
+        return tls_render_queue;
+    }
+
+    queue = (anbs_render_queue_t *)calloc(1, sizeof(anbs_render_queue_t));
+    if (!queue) {
+        return NULL;
+    }
+
+    /* Push onto the queue list; the render thread only ever walks it */
+    queue->next = atomic_load(&display->render_queues);
+    while (!atomic_compare_exchange_weak(&display->render_queues, &queue->next, queue)) {
+    }
+
+    tls_render_queue = queue;
+    tls_render_generation = display->render_generation;
+    return queue;
+}
+
+/**
+ * Hand a display call to the render thread when one is running and the
+ * caller is not it.  Returns true if the call was queued (or dropped,
+ * the caller's queue being full) and must not also run here.
+ */
+bool anbs_render_defer(anbs_display_t *display, anbs_render_op_t op, int panel, long arg,
+                       const void *data, size_t size)
+{
+    anbs_render_queue_t *queue;
+    anbs_render_cmd_t *cmd;
+    size_t tail;
+
+    if (!display || tls_render_thread || !atomic_load(&display->render_running)) {
+        return false;
+    }
+
+    queue = anbs_render_queue_get(display);
+    if (!queue) {
+        atomic_fetch_add(&display->render_dropped, 1);
+        return true;
+    }
+
+    /* Never wait for the terminal: drop rather than block */
+    tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == ANBS_RENDER_QUEUE_SLOTS) {
+        atomic_fetch_add(&display->render_dropped, 1);
+        return true;
+    }
+
+    cmd = (anbs_render_cmd_t *)malloc(sizeof(anbs_render_cmd_t) + size + 1);
+    if (!cmd) {
+        atomic_fetch_add(&display->render_dropped, 1);
+        return true;
+    }
+    cmd->op = op;
+    cmd->panel = panel;
+    cmd->arg = arg;
+    cmd->size = size;
+    if (size > 0) {
+        memcpy(cmd->data, data, size);
+    }
+    cmd->data[size] = '\0';
+
+    queue->slots[tail % ANBS_RENDER_QUEUE_SLOTS] = cmd;
+    atomic_store(&queue->tail, tail + 1);
+
+    /* Only the first call since the render thread last looked wakes it */
+    if (!atomic_exchange(&display->render_wake_pending, true)) {
+        uint64_t one = 1;
+
+        if (write(display->render_wake_fd, &one, sizeof(one)) < 0) {
+            /* The counter is already nonzero, so it is awake anyway */
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Make a deferred call, now on the render thread
+ */
+static void anbs_render_run(anbs_display_t *display, anbs_render_cmd_t *cmd)
+{
+    health_data_t health;
+
+    switch (cmd->op) {
+        case ANBS_RENDER_TERMINAL:
+            anbs_terminal_write(display, cmd->data);
+            break;
+        case ANBS_RENDER_ECHO:
+            anbs_terminal_echo(display, cmd->data);
+            break;
+        case ANBS_RENDER_AI_CHAT:
+            anbs_ai_chat_write(display, cmd->data);
+            break;
+        case ANBS_RENDER_STATUS:
+            anbs_status_write(display, cmd->data);
+            break;
+        case ANBS_RENDER_HEALTH:
+            if (cmd->size == sizeof(health)) {
+                memcpy(&health, cmd->data, sizeof(health));
+                anbs_health_update(display, &health);
+            }
+            break;
+        case ANBS_RENDER_SEARCH_KEY:
+            anbs_display_search_key(display, (anbs_panel_id_t)cmd->panel, (int)cmd->arg);
+            break;
+        case ANBS_RENDER_SCROLL:
+            anbs_display_scroll(display, (anbs_panel_id_t)cmd->panel, cmd->arg);
+            break;
+        case ANBS_RENDER_RESIZE:
+            anbs_display_resize(display);
+            break;
+        case ANBS_RENDER_REFRESH_ALL:
+            anbs_display_refresh_all(display);
+            break;
+        case ANBS_RENDER_REFRESH_PANEL:
+            anbs_display_refresh_panel(display, (anbs_panel_id_t)cmd->panel);
+            break;
+    }
+}
+
+/**
+ * Run every queued call, each thread's in the order it made them
+ */
+static void anbs_render_drain(anbs_display_t *display)
+{
+    anbs_render_queue_t *queue;
+
+    for (queue = atomic_load(&display->render_queues); queue; queue = queue->next) {
+        size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        size_t tail = atomic_load(&queue->tail);
+
+        while (head != tail) {
+            anbs_render_cmd_t *cmd = queue->slots[head % ANBS_RENDER_QUEUE_SLOTS];
+
+            anbs_render_run(display, cmd);
+            free(cmd);
+            head++;
+            atomic_store_explicit(&queue->head, head, memory_order_release);
+        }
+    }
+}
+
+/**
+ * Milliseconds until the next frame is due, or -1 if nothing is waiting
+ * for one
+ */
+static int anbs_render_timeout(anbs_display_t *display)
+{
+    long long now = anbs_display_now_ms();
+    long long wait = -1;
+    int i;
+
+    for (i = 0; i < ANBS_PANEL_COUNT && !display->panels[i].dirty; i++) {
+    }
+    if (i < ANBS_PANEL_COUNT || display->screen_dirty || display->resize_pending) {
+        wait = display->last_frame_ms + display->refresh_interval_ms - now;
+        if (wait < 0) {
+            wait = 0;
+        }
+    }
+
+    /* Or until held back health updates may be drawn */
+    if (display->health_pending) {
+        long long health = display->health_last_ms + display->health_interval_ms - now;
+
+        if (health < 0) {
+            health = 0;
+        }
+        if (wait < 0 || health < wait) {
+            wait = health;
+        }
+    }
+
+    return (int)wait;
+}
+
+/**
+ * Render thread: run what other threads queued, then send a frame when
+ * one is due
+ */
+static void *anbs_render_main(void *arg)
+{
+    anbs_display_t *display = (anbs_display_t *)arg;
+    struct pollfd pfd[2];
+    uint64_t count;
+
+    tls_render_thread = true;
+    anbs_thread_name("anbs-render");
+    pfd[0].fd = display->render_wake_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = anbs_pty_fd(display);
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        bool running = atomic_load(&display->render_running);
+
+        /* Clear the flag before looking, so a push after this wakes us */
+        atomic_store(&display->render_wake_pending, false);
+        anbs_render_drain(display);
+
+        if (!running) {
+            anbs_display_flush(display);
+            break;
+        }
+
+        anbs_display_tick(display);
+
+        if (poll(pfd, pfd[1].fd >= 0 ? 2 : 1, anbs_render_timeout(display)) <= 0) {
+            continue;
+        }
+        if ((pfd[0].revents & POLLIN) &&
+            read(display->render_wake_fd, &count, sizeof(count)) < 0) {
+            /* Nothing to read yet; loop and look anyway */
+        }
+        if (pfd[1].revents & POLLIN) {
+            anbs_pty_drain(display);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the render thread.  From then on every display call made on
+ * another thread is queued for it, so ncurses is only used from one
+ * thread and callers never wait on the terminal.
+ */
+int anbs_display_start_render_thread(anbs_display_t *display)
+{
+    if (!display) {
+        return -1;
+    }
+
+    if (atomic_load(&display->render_running)) {
+        return 0;
+    }
+
+    display->render_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (display->render_wake_fd < 0) {
+        return -1;
+    }
+
+    display->render_generation = atomic_fetch_add(&anbs_render_generations, 1) + 1;
+    atomic_store(&display->render_running, true);
+    if (pthread_create(&display->render_thread, NULL, anbs_render_main, display) != 0) {
+        atomic_store(&display->render_running, false);
+        close(display->render_wake_fd);
+        display->render_wake_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the render thread once it has run what is queued; display calls
+ * run on their caller's thread again afterwards
+ */
+void anbs_display_stop_render_thread(anbs_display_t *display)
+{
+    anbs_render_queue_t *queue, *next;
+    uint64_t one = 1;
+
+    if (!display || !atomic_load(&display->render_running)) {
+        return;
+    }
+
+    atomic_store(&display->render_running, false);
+    if (write(display->render_wake_fd, &one, sizeof(one)) < 0) {
+        /* Already awake */
+    }
+    pthread_join(display->render_thread, NULL);
+
+    /* Calls that raced the stop run here instead */
+    anbs_render_drain(display);
+    for (queue = atomic_exchange(&display->render_queues, NULL); queue; queue = next) {
+        next = queue->next;
+        free(queue);
+    }
+
+    close(display->render_wake_fd);
+    display->render_wake_fd = -1;
+}
@@ -6,6 +6,10 @@
 #include <ncurses.h>
 #include <time.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../include/probes.h"  /* ai_core's USDT probes, provider anbs */
 
 /* Display system configuration */
 #define ANBS_MIN_TERMINAL_WIDTH   120
@@ -13,7 +17,11 @@
 #define ANBS_DEFAULT_TERMINAL_RATIO 60  /* Terminal panel width percentage */
 #define ANBS_DEFAULT_AI_CHAT_RATIO  50  /* AI chat panel height percentage */
 #define ANBS_MAX_TEXT_BUFFER_LINES  1000
-#define ANBS_REFRESH_INTERVAL_MS    16   /* 60 FPS target */
+#define ANBS_MAX_TEXT_BUFFER_BYTES  (256 * 1024)  /* Text held per panel */
+#define ANBS_REFRESH_INTERVAL_MS    16   /* 60 FPS target; frames are at most this often */
+#define ANBS_RENDER_QUEUE_SLOTS     4096 /* Calls each thread can have waiting for the render thread */
+#define ANBS_HEALTH_REFRESH_MS      250  /* Health panel redraws at most this often */
+#define ANBS_HEALTH_MAX_ROWS        64   /* Health panel rows remembered for diffing */
 
 /* Panel identifiers */
 typedef enum {
@@ -32,6 +40,20 @@ typedef enum {
     OUTPUT_STATUS            /* Status messages */
 } output_destination_t;
 
+/* Display calls the render thread makes on another thread's behalf */
+typedef enum {
+    ANBS_RENDER_TERMINAL = 0,  /* anbs_terminal_write() */
+    ANBS_RENDER_ECHO,          /* anbs_terminal_echo() */
+    ANBS_RENDER_AI_CHAT,       /* anbs_ai_chat_write() */
+    ANBS_RENDER_STATUS,        /* anbs_status_write() */
+    ANBS_RENDER_HEALTH,        /* anbs_health_update() */
+    ANBS_RENDER_SEARCH_KEY,    /* anbs_display_search_key() */
+    ANBS_RENDER_SCROLL,        /* anbs_display_scroll() */
+    ANBS_RENDER_RESIZE,        /* anbs_display_resize() */
+    ANBS_RENDER_REFRESH_ALL,   /* anbs_display_refresh_all() */
+    ANBS_RENDER_REFRESH_PANEL  /* anbs_display_refresh_panel() */
+} anbs_render_op_t;
+
 /* Color scheme definitions */
 #define ANBS_COLOR_TERMINAL    1  /* White on black */
 #define ANBS_COLOR_AI_CHAT     2  /* Cyan on dark blue */
@@ -55,16 +77,63 @@ typedef enum {
 #define ANBS_BORDER_JUNCTION_B "┴"
 #define ANBS_BORDER_CROSS      "┼"
 
-/* Text buffer for efficient scrolling */
+/* Text buffer for efficient scrolling.  Lines are stored NUL-terminated
+   and back to back in one circular byte ring, and a circular array of
+   offsets indexes them; the oldest lines go when either ring is full. */
 typedef struct {
-    char **lines;              /* Circular buffer of text lines */
+    char *bytes;               /* Byte ring */
+    size_t byte_capacity;      /* Byte ring size */
+    size_t byte_head;          /* Where the next line goes */
+    bool byte_wrapped;         /* Newer lines restarted at offset 0 */
+    size_t *offsets;           /* Line ring: where each line starts */
+    struct anbs_line_layout *layouts;  /* Line ring: cached wrapping */
     int max_lines;             /* Buffer size (configurable) */
     int current_line;          /* Current write position */
-    int display_start;         /* Top visible line */
+    int display_start;         /* Slot of the oldest line */
     int line_count;            /* Total lines in buffer */
+    unsigned long appended;    /* Lines ever appended; numbers lines for search */
+    struct anbs_trigram_index *index;  /* Optional search index */
+    struct anbs_spill *spill;  /* Dropped lines kept on disk, if enabled */
     bool dirty;                /* Needs refresh */
 } text_buffer_t;
 
+/* Scrollback search modes */
+#define ANBS_SEARCH_IGNORE_CASE 0x1
+#define ANBS_SEARCH_REGEX       0x2
+
+/* An incremental scrollback search (text_buffer.c) */
+typedef struct anbs_search anbs_search_t;
+
+/* Pseudo-terminal children write into (terminal_pty.c) */
+typedef struct anbs_pty anbs_pty_t;
+
+/* Where frames go (display_backend.c).  Both backends run ncurses; the
+   terminal one on the real terminal, the headless one on an off-screen
+   screen whose output is counted rather than shown. */
+struct anbs_display;
+typedef struct anbs_display_backend {
+    const char *name;
+    int (*open)(struct anbs_display *display);     /* Set up stdscr */
+    int (*size)(struct anbs_display *display, int *width, int *height);
+    void (*flush)(struct anbs_display *display);   /* Send a frame */
+    void (*close)(struct anbs_display *display);
+} anbs_display_backend_t;
+
+extern const anbs_display_backend_t anbs_terminal_backend;
+extern const anbs_display_backend_t anbs_headless_backend;
+
+/* What the headless backend has been sent */
+typedef struct {
+    unsigned long frames;          /* Flushes that reached the screen */
+    unsigned long long bytes;      /* Terminal output, all frames */
+    unsigned long long cells;      /* Screen cells changed, all frames */
+    size_t last_bytes;             /* The same for the latest frame */
+    unsigned long last_cells;
+} anbs_headless_stats_t;
+
+/* Headless screen state (display_backend.c) */
+typedef struct anbs_headless anbs_headless_t;
+
 /* Health monitoring data */
 typedef struct {
     char agent_id[64];         /* Agent identifier */
@@ -86,12 +155,16 @@ typedef struct {
     bool visible;              /* Panel visibility */
     bool has_border;           /* Draw border around panel */
     int color_pair;            /* Color scheme */
+    bool dirty;                /* Drawn on since the last frame */
+    unsigned long scroll_offset;   /* Lines scrolled back from the newest */
     time_t last_refresh;       /* Last refresh timestamp */
 } panel_t;
 
 /* Main ANBS display structure */
 typedef struct anbs_display {
     /* NCurses management */
+    const anbs_display_backend_t *backend;  /* Where frames go */
+    anbs_headless_t *headless; /* NULL unless the backend is headless */
     WINDOW *main_screen;       /* Full terminal window */
     bool ncurses_initialized;  /* NCurses init status */
     bool color_supported;      /* Terminal color support */
@@ -114,44 +187,121 @@ typedef struct anbs_display {
     /* Performance tracking */
     time_t last_resize;        /* Last resize event */
     time_t last_refresh;       /* Last full refresh */
-    int refresh_count;         /* Refresh counter */
+    int refresh_count;         /* Frames sent to the terminal */
+    int refresh_interval_ms;   /* Shortest gap between frames */
+    long long last_frame_ms;   /* Monotonic time of the last frame */
+    bool screen_dirty;         /* Borders drawn since the last frame */
 
     /* Health monitoring */
     health_data_t health_data[10];  /* Up to 10 AI agents */
     int health_agent_count;         /* Number of active agents */
+    bool health_pending;            /* Updates not drawn yet */
+    int health_interval_ms;         /* Shortest gap between health redraws */
+    long long health_last_ms;       /* Monotonic time of the last redraw */
+
+    /* What the health panel shows, so a redraw only touches what changed */
+    health_data_t health_drawn[10];     /* Agent data the rows were made from */
+    const char *health_drawn_icon[10];  /* Status icon they were made with */
+    const char *health_drawn_text[10];  /* And status text */
+    char health_agent_rows[10][2][256]; /* Each agent's two rows */
+    int health_agent_color[10];
+    char health_rows[ANBS_HEALTH_MAX_ROWS][256];  /* Text now in each row */
+    int health_row_colors[ANBS_HEALTH_MAX_ROWS];
+    int health_row_count;           /* Rows holding text */
+    WINDOW *health_window;          /* Window the rows are in */
+    int health_width, health_height;    /* Its size then */
+    bool health_border;             /* And whether it had a border */
 
     /* Command detection */
     bool ai_command_active;    /* Currently processing AI command */
     char current_ai_command[256];   /* Current AI command text */
+
+    /* Search-as-you-type over a panel's scrollback */
+    anbs_search_t *search;     /* NULL unless a search is open */
+    int search_panel;          /* Panel being searched */
+    int search_flags;          /* ANBS_SEARCH_* */
+    int search_current;        /* Match shown, counted from the newest */
+    char search_query[256];    /* What has been typed so far */
+
+    /* Render thread: once started, the only thread calling ncurses */
+    pthread_t render_thread;
+    atomic_bool render_running;
+    int render_wake_fd;        /* eventfd producers poke when it sleeps */
+    atomic_bool render_wake_pending;   /* A poke is already on its way */
+    volatile sig_atomic_t resize_pending;   /* SIGWINCH seen */
+    _Atomic(struct anbs_render_queue *) render_queues;  /* One per producing thread */
+    unsigned long render_generation;   /* Tells this thread's queue from a stale one */
+    atomic_ulong render_dropped;       /* Calls lost to a full queue */
+
+    /* External command output, read by the render thread */
+    anbs_pty_t *pty;           /* NULL unless children write to a pty */
 } anbs_display_t;
 
 /* Function declarations */
 
 /* Core display management */
 int anbs_display_init(anbs_display_t **display);
+int anbs_display_init_backend(anbs_display_t **display, const anbs_display_backend_t *backend);
+const anbs_display_backend_t *anbs_display_backend_from_env(void);
+int anbs_headless_stats(anbs_display_t *display, anbs_headless_stats_t *stats);
+int anbs_headless_row(anbs_display_t *display, int row, char *text, size_t size);
+int anbs_headless_resize(anbs_display_t *display, int width, int height);
 int anbs_display_setup_panels(anbs_display_t *display);
 int anbs_display_configure_colors(anbs_display_t *display);
 void anbs_display_cleanup(anbs_display_t *display);
+int anbs_display_start_render_thread(anbs_display_t *display);
+void anbs_display_stop_render_thread(anbs_display_t *display);
+bool anbs_render_defer(anbs_display_t *display, anbs_render_op_t op, int panel, long arg,
+                       const void *data, size_t size);
 
 /* Window management */
 int anbs_display_resize(anbs_display_t *display);
 int anbs_display_refresh_all(anbs_display_t *display);
 int anbs_display_refresh_panel(anbs_display_t *display, anbs_panel_id_t panel_id);
+void anbs_display_mark_dirty(anbs_display_t *display, anbs_panel_id_t panel_id);
+int anbs_display_tick(anbs_display_t *display);
+long long anbs_display_now_ms(void);
+int anbs_display_flush(anbs_display_t *display);
 int anbs_display_toggle_split_mode(anbs_display_t *display);
 int anbs_display_toggle_borders(anbs_display_t *display);
 
 /* Panel operations */
 int anbs_terminal_write(anbs_display_t *display, const char *text);
+int anbs_terminal_echo(anbs_display_t *display, const char *text);
 int anbs_ai_chat_write(anbs_display_t *display, const char *response);
 int anbs_health_update(anbs_display_t *display, const health_data_t *data);
+int anbs_health_tick(anbs_display_t *display);
 int anbs_status_write(anbs_display_t *display, const char *status);
+int anbs_display_search_key(anbs_display_t *display, anbs_panel_id_t panel_id, int key);
+int anbs_display_scroll(anbs_display_t *display, anbs_panel_id_t panel_id, long lines);
 
 /* Text buffer management */
-int anbs_text_buffer_init(text_buffer_t **buffer, int max_lines);
+int anbs_text_buffer_init(text_buffer_t **buffer, int max_lines, size_t max_bytes);
 int anbs_text_buffer_append(text_buffer_t *buffer, const char *line);
 int anbs_text_buffer_get_lines(text_buffer_t *buffer, char ***lines, int start, int count);
+const char *anbs_text_buffer_get_line(text_buffer_t *buffer, int display_index);
+int anbs_text_buffer_enable_spill(text_buffer_t *buffer, const char *dir);
+unsigned long anbs_text_buffer_history_lines(text_buffer_t *buffer);
+const char *anbs_text_buffer_history_line(text_buffer_t *buffer, unsigned long index);
+int anbs_text_buffer_line_rows(text_buffer_t *buffer, unsigned long index, int columns);
 void anbs_text_buffer_cleanup(text_buffer_t *buffer);
 
+/* Scrollback search */
+int anbs_text_buffer_enable_index(text_buffer_t *buffer);
+int anbs_text_buffer_search_begin(text_buffer_t *buffer, int flags, anbs_search_t **search);
+int anbs_text_buffer_search_update(anbs_search_t *search, const char *query);
+int anbs_text_buffer_search_count(const anbs_search_t *search);
+int anbs_text_buffer_search_line(const anbs_search_t *search, int match);
+void anbs_text_buffer_search_end(anbs_search_t *search);
+
+/* Child output capture */
+int anbs_pty_open(anbs_display_t *display);
+void anbs_pty_close(anbs_display_t *display);
+int anbs_pty_fd(anbs_display_t *display);
+void anbs_pty_resize(anbs_display_t *display);
+int anbs_pty_drain(anbs_display_t *display);
+void anbs_pty_attach_child(void);
+
 /* Panel management */
 int anbs_panel_init(panel_t *panel, int width, int height, int start_x, int start_y);
 int anbs_panel_resize(panel_t *panel, int width, int height, int start_x, int start_y);
@@ -169,16 +319,24 @@ int anbs_clear_ai_command_active(anbs_display_t *display);
 
 /* Utility functions */
 int anbs_get_terminal_size(int *width, int *height);
+size_t anbs_text_fit(const char *text, size_t length, int columns, int *used);
+int anbs_text_width(const char *text, size_t length);
+int anbs_text_rows(const char *text, size_t length, int columns);
 bool anbs_terminal_supports_color(void);
 bool anbs_terminal_supports_unicode(void);
 int anbs_calculate_panel_dimensions(anbs_display_t *display);
 const char *anbs_format_timestamp(time_t timestamp);
 const char *anbs_format_health_status(const health_data_t *data);
+void anbs_thread_name(const char *name);
 
 /* Signal handling */
 void anbs_signal_resize_handler(int sig);
 int anbs_install_signal_handlers(void);
 
+/* Startup profile spans, recorded only under --startup-profile */
+int anbs_startup_enter(const char *kind, const char *label);
+void anbs_startup_leave(int slot, int functions);
+
 /* Global display instance */
 extern anbs_display_t *g_anbs_display;
 
@@ -190,18 +348,40 @@ extern anbs_display_t *g_anbs_display;
 #define ANBS_HEALTH_PANEL() (&g_anbs_display->panels[ANBS_PANEL_HEALTH])
 #define ANBS_STATUS_PANEL() (&g_anbs_display->panels[ANBS_PANEL_STATUS])
 
-/* Debug macros */
+/* Debug macros.  Messages at or under ANBS_LOG_LEVEL (default debug) go
+   to a per-thread ring that a background thread writes to ANBS_LOG_FILE;
+   the level is checked before anything is formatted, and each call site
+   may log at most ANBS_LOG_RATE lines per second (default 100). */
+typedef enum {
+    ANBS_LOG_ERROR = 0,
+    ANBS_LOG_WARN,
+    ANBS_LOG_INFO,
+    ANBS_LOG_DEBUG
+} anbs_log_level_t;
+
 #ifdef ANBS_DEBUG
-#define ANBS_DEBUG_LOG(fmt, ...) \
+typedef struct {
+    unsigned int second;        /* coarse clock second COUNT belongs to */
+    unsigned int count;
+} anbs_log_site_t;
+
+extern int anbs_log_threshold;
+bool anbs_log_admit(anbs_log_site_t *site, int level);
+void anbs_log_write(int level, const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#define ANBS_LOG(level, fmt, ...) \
     do { \
-        FILE *debug_file = fopen("/tmp/anbs_debug.log", "a"); \
-        if (debug_file) { \
-            fprintf(debug_file, "[%s:%d] " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
-            fclose(debug_file); \
+        static anbs_log_site_t anbs_log_site_; \
+        if ((level) <= __atomic_load_n(&anbs_log_threshold, __ATOMIC_RELAXED) && \
+            anbs_log_admit(&anbs_log_site_, (level))) { \
+            anbs_log_write((level), __FILE__, __LINE__, fmt, ##__VA_ARGS__); \
         } \
     } while (0)
 #else
-#define ANBS_DEBUG_LOG(fmt, ...)
+#define ANBS_LOG(level, fmt, ...)
 #endif
 
+#define ANBS_DEBUG_LOG(fmt, ...) ANBS_LOG(ANBS_LOG_DEBUG, fmt, ##__VA_ARGS__)
+
 #endif /* ANBS_AI_DISPLAY_H */
\ No newline at end of file
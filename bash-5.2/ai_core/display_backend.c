@@ -0,0 +1,291 @@
+/* display_backend.c - Terminal and headless backends for the ANBS display */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE            /* memfd_create */
+#endif
+
+#include "ai_display.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Headless output is counted, then thrown away once it grows past this */
+#define ANBS_HEADLESS_OUTPUT_BYTES (1024 * 1024)
+
+struct anbs_headless {
+    SCREEN *screen;
+    FILE *out;                 /* Backed by a memfd, never a terminal */
+    FILE *in;                  /* /dev/null */
+    int fd;
+    int width, height;         /* Size the screen reports */
+    off_t counted;             /* Output up to here is in the stats */
+    chtype *cells;             /* Screen as of the last frame */
+    int cells_width, cells_height;
+    anbs_headless_stats_t stats;
+};
+
+/* Terminal backend: ncurses on the shell's own terminal */
+
+static int anbs_terminal_open(anbs_display_t *display)
+{
+    (void)display;
+    return initscr() ? 0 : -1;
+}
+
+static int anbs_terminal_size(anbs_display_t *display, int *width, int *height)
+{
+    (void)display;
+    return anbs_get_terminal_size(width, height);
+}
+
+static void anbs_terminal_flush(anbs_display_t *display)
+{
+    (void)display;
+    doupdate();
+}
+
+static void anbs_terminal_close(anbs_display_t *display)
+{
+    (void)display;
+    endwin();
+}
+
+const anbs_display_backend_t anbs_terminal_backend = {
+    "terminal",
+    anbs_terminal_open,
+    anbs_terminal_size,
+    anbs_terminal_flush,
+    anbs_terminal_close
+};
+
+/* Headless backend: ncurses on a screen nobody sees */
+
+/**
+ * Size a headless screen starts at: ANBS_HEADLESS_COLUMNS by
+ * ANBS_HEADLESS_LINES, or the smallest the layout allows
+ */
+static void anbs_headless_default_size(int *width, int *height)
+{
+    const char *columns = getenv("ANBS_HEADLESS_COLUMNS");
+    const char *lines = getenv("ANBS_HEADLESS_LINES");
+
+    *width = columns && atoi(columns) > 0 ? atoi(columns) : ANBS_MIN_TERMINAL_WIDTH;
+    *height = lines && atoi(lines) > 0 ? atoi(lines) : ANBS_MIN_TERMINAL_HEIGHT;
+}
+
+static void anbs_headless_free(anbs_headless_t *headless)
+{
+    if (headless->screen) {
+        delscreen(headless->screen);
+    }
+    if (headless->out) {
+        fclose(headless->out);
+    } else if (headless->fd >= 0) {
+        close(headless->fd);
+    }
+    if (headless->in) {
+        fclose(headless->in);
+    }
+    free(headless->cells);
+    free(headless);
+}
+
+/**
+ * Start ncurses with its output going to an in-memory file.  The
+ * terminal type is ANBS_HEADLESS_TERM, xterm-256color by default, so
+ * the bytes counted are the ones a real terminal of that kind would get.
+ */
+static int anbs_headless_open(anbs_display_t *display)
+{
+    anbs_headless_t *headless;
+    const char *term = getenv("ANBS_HEADLESS_TERM");
+
+    headless = (anbs_headless_t *)calloc(1, sizeof(anbs_headless_t));
+    if (!headless) {
+        return -1;
+    }
+    anbs_headless_default_size(&headless->width, &headless->height);
+
+    headless->fd = memfd_create("anbs-headless", MFD_CLOEXEC);
+    if (headless->fd >= 0) {
+        headless->out = fdopen(headless->fd, "w");
+    }
+    headless->in = fopen("/dev/null", "r");
+    if (!headless->out || !headless->in) {
+        anbs_headless_free(headless);
+        return -1;
+    }
+
+    headless->screen = newterm(term && *term ? term : "xterm-256color",
+                               headless->out, headless->in);
+    if (!headless->screen) {
+        anbs_headless_free(headless);
+        return -1;
+    }
+    set_term(headless->screen);
+    resizeterm(headless->height, headless->width);
+
+    display->headless = headless;
+    return 0;
+}
+
+static int anbs_headless_size(anbs_display_t *display, int *width, int *height)
+{
+    if (!display->headless) {
+        anbs_headless_default_size(width, height);
+        return 0;
+    }
+
+    *width = display->headless->width;
+    *height = display->headless->height;
+    return 0;
+}
+
+/**
+ * Send a frame and count it: the bytes ncurses wrote, and the cells
+ * that differ from the screen after the previous frame
+ */
+static void anbs_headless_flush(anbs_display_t *display)
+{
+    anbs_headless_t *headless = display->headless;
+    unsigned long changed = 0;
+    off_t end;
+    int width = COLS, height = LINES;
+    int cur_y, cur_x, y;
+
+    doupdate();
+    fflush(headless->out);
+
+    end = ftello(headless->out);
+    headless->stats.last_bytes = end > headless->counted ? (size_t)(end - headless->counted) : 0;
+    headless->counted = end;
+    if (end > ANBS_HEADLESS_OUTPUT_BYTES && ftruncate(headless->fd, 0) == 0) {
+        rewind(headless->out);
+        headless->counted = 0;
+    }
+
+    /* A new size starts from a blank screen */
+    if (headless->cells_width != width || headless->cells_height != height) {
+        chtype *cells = (chtype *)calloc((size_t)width * height, sizeof(chtype));
+
+        if (cells) {
+            free(headless->cells);
+            headless->cells = cells;
+            headless->cells_width = width;
+            headless->cells_height = height;
+        }
+    }
+
+    /* curscr's cursor is where ncurses thinks the terminal's is */
+    if (headless->cells && headless->cells_width == width) {
+        chtype row[width + 1];
+
+        getyx(curscr, cur_y, cur_x);
+        for (y = 0; y < height; y++) {
+            chtype *cells = headless->cells + (size_t)y * width;
+            int n = mvwinchnstr(curscr, y, 0, row, width);
+            int x;
+
+            for (x = 0; x < n; x++) {
+                if (cells[x] != row[x]) {
+                    cells[x] = row[x];
+                    changed++;
+                }
+            }
+        }
+        wmove(curscr, cur_y, cur_x);
+    }
+
+    headless->stats.last_cells = changed;
+    headless->stats.cells += changed;
+    headless->stats.bytes += headless->stats.last_bytes;
+    headless->stats.frames++;
+}
+
+static void anbs_headless_close(anbs_display_t *display)
+{
+    endwin();
+    if (display->headless) {
+        anbs_headless_free(display->headless);
+        display->headless = NULL;
+    }
+}
+
+const anbs_display_backend_t anbs_headless_backend = {
+    "headless",
+    anbs_headless_open,
+    anbs_headless_size,
+    anbs_headless_flush,
+    anbs_headless_close
+};
+
+/**
+ * Backend named by ANBS_DISPLAY_BACKEND, the terminal unless it says
+ * "headless"
+ */
+const anbs_display_backend_t *anbs_display_backend_from_env(void)
+{
+    const char *name = getenv("ANBS_DISPLAY_BACKEND");
+
+    if (name && strcmp(name, anbs_headless_backend.name) == 0) {
+        return &anbs_headless_backend;
+    }
+    return &anbs_terminal_backend;
+}
+
+/**
+ * Copy what the headless backend has sent so far into STATS
+ */
+int anbs_headless_stats(anbs_display_t *display, anbs_headless_stats_t *stats)
+{
+    if (!display || !display->headless || !stats) {
+        return -1;
+    }
+
+    *stats = display->headless->stats;
+    return 0;
+}
+
+/**
+ * Copy screen row ROW of the headless screen, as of the last frame and
+ * without trailing blanks, into TEXT.  Returns its length.
+ */
+int anbs_headless_row(anbs_display_t *display, int row, char *text, size_t size)
+{
+    int cur_y, cur_x, n;
+
+    if (!display || !display->headless || !text || size == 0 || row < 0 || row >= LINES) {
+        return -1;
+    }
+
+    getyx(curscr, cur_y, cur_x);
+    n = mvwinnstr(curscr, row, 0, text, size - 1 < (size_t)COLS ? (int)(size - 1) : COLS);
+    wmove(curscr, cur_y, cur_x);
+    if (n < 0) {
+        text[0] = '\0';
+        return -1;
+    }
+
+    while (n > 0 && text[n - 1] == ' ') {
+        n--;
+    }
+    text[n] = '\0';
+    return n;
+}
+
+/**
+ * Make the headless screen WIDTH by HEIGHT and lay the panels out
+ * again, as a SIGWINCH would on a terminal
+ */
+int anbs_headless_resize(anbs_display_t *display, int width, int height)
+{
+    if (!display || !display->headless || width <= 0 || height <= 0) {
+        return -1;
+    }
+
+    display->headless->width = width;
+    display->headless->height = height;
+    return anbs_display_resize(display);
+}
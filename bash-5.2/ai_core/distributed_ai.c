@@ -1,21 +1,65 @@
 /* distributed_ai.c - Distributed AI consciousness system for ANBS */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE            /* accept4 */
+#endif
+
 #include "ai_display.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <json-c/json.h>
 #include <uuid/uuid.h>
+#include <zlib.h>
 
-#define MAX_AI_AGENTS 10
 #define MAX_MESSAGE_SIZE 8192
 #define DISCOVERY_PORT 9876
 #define COMM_PORT_BASE 9877
+#define COMPRESS_MIN 512          /* shorter messages go out as plain JSON */
+#define MAX_WIRE_SIZE (MAX_MESSAGE_SIZE * 2 + 1024) /* largest decoded message */
+#define MSGPACK_MESSAGE 0x96      /* fixarray of the six ai_message_t fields */
+#define AGENT_FRAME_HEADER 4      /* big-endian length before each stream message */
+#define AGENT_IO_TIMEOUT_S 2      /* connect and send limit on agent links */
+#define AGENT_REDIAL_MAX_S 30     /* longest wait between dials of a dead peer */
+#define AGENT_OUTBOX_MAX (1024 * 1024) /* bytes queued for one peer before sends fail */
+#define AGENT_WIRE_MSGPACK 0x1    /* frame flags from the peer's capabilities */
+#define AGENT_WIRE_ZLIB 0x2
+#define TASK_TIMEOUT_S 30         /* how long a submitted task may wait for its response */
+#define TASK_RETAIN_S 300         /* finished tasks stay in the status report this long */
+#define SCATTER_RETRIES 2         /* default extra attempts for a failed shard */
+#define STEAL_INTERVAL_MS 200     /* an idle executor looks for work this often */
+#define STEAL_TIMEOUT_MS 1000     /* a steal unanswered by then is given up */
+#define AGENT_EXPIRE_S 600        /* peers silent this long are forgotten */
+#define AGENT_TABLE_MAX 4096      /* known peers, so a flood can't exhaust memory */
+#define TASK_TABLE_MAX 65536      /* tracked tasks, likewise */
+#define AGENT_PORT_RANGE 10       /* listener ports tried from the base */
+#define AGENT_QUEUE_LIMIT 5       /* outstanding tasks per agent */
+#define AGENT_RTT_DEFAULT_MS 50.0 /* assumed until a heartbeat comes back */
+#define AGENT_EWMA_ALPHA 0.2      /* weight of the newest round trip or task outcome */
+#define ID_TABLE_MIN 16
+#define GOSSIP_INTERVAL_MS 1000   /* default protocol period */
+#define GOSSIP_FANOUT 3           /* default indirect probes for a missed ack */
+#define GOSSIP_SUSPECT_MS 5000    /* default time a suspect has to refute */
+#define GOSSIP_FANOUT_MAX 16
+#define GOSSIP_PIGGYBACK_MAX 8    /* membership updates per datagram */
+#define GOSSIP_RETRANSMIT_MULT 3  /* updates go out this many times log2(members) */
+#define GOSSIP_RELAYS 16          /* indirect probes relayed at once */
+#define GOSSIP_BOOTSTRAP_PERIODS 10 /* broadcast this often while alone without seeds */
+#define GOSSIP_MAX_SEEDS 32
+#define GOSSIP_CAPS "zlib,msgpack" /* what our gossip record advertises */
 
 typedef enum {
     AGENT_STATUS_OFFLINE = 0,
@@ -36,10 +80,43 @@ typedef enum {
     MSG_TYPE_CAPABILITY_QUERY,
     MSG_TYPE_CAPABILITY_RESPONSE,
     MSG_TYPE_COORDINATION,
-    MSG_TYPE_SHUTDOWN
+    MSG_TYPE_SHUTDOWN,
+    MSG_TYPE_GOSSIP_PING,
+    MSG_TYPE_GOSSIP_ACK,
+    MSG_TYPE_GOSSIP_PING_REQ,
+    MSG_TYPE_MEMORY_DIGEST,
+    MSG_TYPE_MEMORY_DELTA,
+    MSG_TYPE_TASK_STEAL,
+    MSG_TYPE_TASK_GRANT
 } message_type_t;
 
+/* SWIM member states, in order of precedence at equal incarnation */
+typedef enum {
+    MEMBER_ALIVE = 0,
+    MEMBER_SUSPECT,
+    MEMBER_DEAD
+} member_state_t;
+
+/* Header of anything kept in an id_table_t; it must come first */
+typedef struct id_entry {
+    const char *id;                 /* points into the owning struct */
+    uint32_t hash;
+    size_t slot;                    /* index in the table's items */
+    struct id_entry *hash_next;
+} id_entry_t;
+
+/* Entries indexed by ID: dense ITEMS for scans, chained BUCKETS for
+   lookups.  Both grow by doubling. */
+typedef struct {
+    void **items;
+    size_t count;
+    size_t capacity;
+    id_entry_t **buckets;
+    size_t bucket_count;            /* zero or a power of two */
+} id_table_t;
+
 typedef struct {
+    id_entry_t entry;               /* keyed by agent_id */
     char agent_id[64];
     char hostname[256];
     char ip_address[64];
@@ -52,7 +129,16 @@ typedef struct {
     char capabilities[512];
     char current_task[256];
     pthread_t comm_thread;
-    int socket_fd;
+    struct agent_link *link;        /* persistent outbound stream, or NULL */
+    double rtt_ms;                  /* EWMA of heartbeat round trips, 0 until measured */
+    double success_rate;            /* EWMA of task outcomes, 1 when all are answered */
+    int tasks_completed;
+    int backlog;                    /* tasks waiting on the peer, as it last said */
+    member_state_t member_state;    /* SWIM view of the peer */
+    uint32_t incarnation;           /* the peer's own counter; higher refutes */
+    uint64_t suspect_deadline_us;   /* declared dead unless refuted by then */
+    int gossip_left;                /* piggybacks left for its latest state */
+    int gossip_port;                /* UDP membership port */
 } ai_agent_t;
 
 typedef struct {
@@ -65,35 +151,269 @@ typedef struct {
     char payload[MAX_MESSAGE_SIZE];
 } ai_message_t;
 
-typedef struct {
+typedef struct task_session {
+    id_entry_t entry;               /* keyed by session_id */
     char session_id[64];
     char task_description[512];
     char assigned_agent[64];
+    char previous_owner[64];        /* who held it before a steal moved it */
+    char requester[64];             /* for tasks we run: who gets the result */
     time_t created;
     time_t started;
     time_t completed;
     int priority;
     char result[2048];
     char status[64];
+    void (*callback)(const char *result, void *arg);  /* async submitters, until called */
+    void *callback_arg;
+    int waiters;                    /* synchronous submitters; keeps the task from GC */
+    struct task_session *run_prev;  /* run queue links, for tasks we run */
+    struct task_session *run_next;
 } task_session_t;
 
+/* One shard of a scatter-gather call, guarded by its job's MUTEX */
+typedef enum {
+    SHARD_QUEUED = 0,
+    SHARD_RUNNING,
+    SHARD_DONE,
+    SHARD_FAILED
+} shard_state_t;
+
+struct scatter_job;
+
 typedef struct {
-    ai_agent_t agents[MAX_AI_AGENTS];
-    int agent_count;
+    struct scatter_job *job;
+    shard_state_t state;
+    int attempts;
+    char *result;
+} scatter_shard_t;
+
+typedef struct scatter_job {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            /* signalled as each shard's task finishes */
+    scatter_shard_t *shards;
+    size_t running;
+    int retries;
+} scatter_job_t;
+
+/* A probe relayed for a PING-REQ: the ack to our ping SEQ answers the
+   requester's REQUESTER_SEQ */
+typedef struct {
+    uint32_t seq;
+    uint32_t requester_seq;
+    struct sockaddr_in requester;
+    uint64_t expires_us;
+} gossip_relay_t;
+
+/* An inbound stream from a peer, read on the shared event loop */
+typedef struct agent_conn {
+    int fd;
+    struct sockaddr_in peer;
+    unsigned char *rx;              /* AGENT_FRAME_HEADER + MAX_WIRE_SIZE bytes */
+    size_t rx_len;
+    struct agent_conn *next;
+} agent_conn_t;
+
+/* A message waiting for a peer's stream.  Only the payload's bytes are
+   allocated. */
+typedef struct agent_frame {
+    struct agent_frame *next;
+    int wire;                       /* AGENT_WIRE_* */
+    size_t size;                    /* bytes allocated, counted against the outbox */
+    ai_message_t msg;
+} agent_frame_t;
+
+/* A persistent outbound stream to one peer.  Senders push onto OUTBOX
+   without a lock; the rest belongs to the loop thread, which encodes,
+   dials and writes without blocking.  Dropping the agent marks its link
+   closing, and the loop frees it after one last flush. */
+typedef struct agent_link {
+    agent_frame_t *outbox;          /* newest first, atomic */
+    size_t queued;                  /* bytes in OUTBOX and PENDING, atomic */
+    time_t next_dial;               /* no redial before this after a failure, atomic */
+    struct sockaddr_in addr;
+    char agent_id[64];
+    int fd;                         /* -1 until dialled */
+    int connecting;
+    int delivered;                  /* a frame went out on this stream */
+    int dial_failures;
+    agent_frame_t *pending;         /* oldest first */
+    agent_frame_t *pending_tail;
+    unsigned char *tx;              /* the frame being written */
+    size_t tx_len;
+    size_t tx_sent;
+    size_t tx_size;                 /* its SIZE, released once written */
+    int scheduled;                  /* on the ready list, under LINKS_MUTEX */
+    int closing;                    /* likewise */
+    struct agent_link *ready_next;
+    struct agent_link *next;        /* every live link, under LINKS_MUTEX */
+} agent_link_t;
+
+typedef struct {
+    id_table_t agents;              /* ai_agent_t by agent ID */
     char local_agent_id[64];
-    int discovery_socket;
-    pthread_t discovery_thread;
+    pthread_t membership_thread;
     pthread_t coordination_thread;
     pthread_mutex_t agents_mutex;
-    task_session_t active_tasks[100];
-    int task_count;
+    id_table_t tasks;               /* task_session_t by session ID */
     pthread_mutex_t tasks_mutex;
+    pthread_cond_t tasks_cond;      /* broadcast whenever a task finishes */
     anbs_display_t *display;
     int running;
+    int listen_fd;
+    int listen_port;
+    agent_conn_t *conns;
+    pthread_mutex_t conns_mutex;
+    agent_link_t *links;
+    agent_link_t *links_ready;      /* waiting for the loop */
+    pthread_mutex_t links_mutex;
+    pthread_cond_t links_cond;      /* broadcast as links are freed */
+    int link_wake_fd;               /* eventfd that sends the loop to LINKS_READY */
+    int prompt_affinity;            /* ANBS_AGENT_AFFINITY=prompt: route by the task text */
+    int replicate_memory;           /* exchange @memory entries with peers */
+
+    /* Tasks peers asked us to run, oldest first, under TASKS_MUTEX.  The
+       executor takes from the head; peers that run dry steal from the
+       tail, where a task has the longest wait ahead of it. */
+    task_session_t *run_head;
+    task_session_t *run_tail;
+    int run_length;
+    int executing;                  /* the executor is running a task */
+    pthread_cond_t run_cond;
+    pthread_t executor_thread;
+    uint64_t steal_sent_us;         /* our steal in flight, or 0 */
+    unsigned long tasks_stolen;     /* taken from peers */
+    unsigned long tasks_granted;    /* given to peers */
+
+    /* SWIM membership; the probe state is only touched by gossip_thread() */
+    int gossip_fd;
+    int gossip_port;
+    uint32_t incarnation;           /* ours, bumped to refute suspicion */
+    int gossip_interval_ms;
+    int gossip_fanout;
+    int gossip_suspect_ms;
+    size_t gossip_cursor;           /* rotates which updates get piggybacked */
+    struct sockaddr_in seeds[GOSSIP_MAX_SEEDS];
+    int seed_count;
+    uint32_t probe_seq;
+    char probe_target[64];          /* empty when no probe is outstanding */
+    uint64_t probe_sent_us;
+    int probe_acked;
+    int probe_indirect;
+    size_t probe_cursor;
+    unsigned long gossip_periods;
+    gossip_relay_t relays[GOSSIP_RELAYS];
 } distributed_ai_system_t;
 
 static distributed_ai_system_t *g_ai_system = NULL;
 
+/* Shared I/O loop (event_loop.c) */
+extern int anbs_event_add(int fd, uint32_t events, void (*handler)(int fd, uint32_t events, void *arg), void *arg);
+extern int anbs_event_modify(int fd, uint32_t events);
+extern int anbs_event_remove(int fd);
+
+/* Memory replication (memory_system.c) */
+extern int anbs_memory_replica_digest(char *out, size_t size);
+extern int anbs_memory_replica_delta(const char *digest, char *out, size_t size, int *more);
+extern int anbs_memory_replica_apply(const char *delta);
+
+/* OpenMetrics writers from performance/metrics.c */
+extern void anbs_metrics_export_family(FILE *out, const char *name, const char *type, const char *help);
+extern void anbs_metrics_export_sample(FILE *out, const char *name, const char *labels, double value);
+
+/* FNV-1a over an agent or session ID */
+static uint32_t id_hash(const char *id) {
+    uint32_t hash = 2166136261u;
+
+    while (*id) {
+        hash ^= (unsigned char)*id++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Index ITEM, whose entry.id is set, growing TABLE as needed */
+static int id_table_insert(id_table_t *table, void *item) {
+    id_entry_t *entry = item;
+    size_t bucket;
+
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : ID_TABLE_MIN;
+        void **items = realloc(table->items, capacity * sizeof(void *));
+        if (!items) {
+            return -1;
+        }
+        table->items = items;
+        table->capacity = capacity;
+    }
+
+    /* Keep chains about one entry long */
+    if (table->count >= table->bucket_count) {
+        size_t bucket_count = table->bucket_count ? table->bucket_count * 2 : ID_TABLE_MIN;
+        id_entry_t **buckets = calloc(bucket_count, sizeof(id_entry_t *));
+        if (!buckets) {
+            return -1;
+        }
+        for (size_t i = 0; i < table->count; i++) {
+            id_entry_t *moved = table->items[i];
+            bucket = moved->hash & (bucket_count - 1);
+            moved->hash_next = buckets[bucket];
+            buckets[bucket] = moved;
+        }
+        free(table->buckets);
+        table->buckets = buckets;
+        table->bucket_count = bucket_count;
+    }
+
+    entry->hash = id_hash(entry->id);
+    bucket = entry->hash & (table->bucket_count - 1);
+    entry->hash_next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    entry->slot = table->count;
+    table->items[table->count++] = entry;
+    return 0;
+}
+
+/* The entry for ID in TABLE, or NULL */
+static void *id_table_find(const id_table_t *table, const char *id) {
+    uint32_t hash;
+
+    if (!table->bucket_count) {
+        return NULL;
+    }
+    hash = id_hash(id);
+    for (id_entry_t *entry = table->buckets[hash & (table->bucket_count - 1)]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->id, id) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Unindex ITEM.  The last item takes its slot, so scans that remove as
+   they go walk the items backwards. */
+static void id_table_remove(id_table_t *table, void *item) {
+    id_entry_t *entry = item;
+    id_entry_t **link = &table->buckets[entry->hash & (table->bucket_count - 1)];
+    id_entry_t *last;
+
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    last = table->items[--table->count];
+    table->items[entry->slot] = last;
+    last->slot = entry->slot;
+}
+
+/* Release TABLE's index; the caller frees the entries */
+static void id_table_free(id_table_t *table) {
+    free(table->items);
+    free(table->buckets);
+    memset(table, 0, sizeof(id_table_t));
+}
+
 /* Generate unique agent ID */
 static void generate_agent_id(char *agent_id, size_t size) {
     uuid_t uuid;
@@ -142,70 +462,631 @@ static int create_message(message_type_t type, const char *recipient,
     return 0;
 }
 
-/* Send message to agent */
-static int send_message_to_agent(const ai_agent_t *agent, const ai_message_t *msg) {
-    if (!agent || !msg) {
+/* MessagePack writers.  Each returns the advanced cursor, or NULL once
+   the message would pass END. */
+static unsigned char *msgpack_put_uint(unsigned char *p, const unsigned char *end, uint64_t v) {
+    int bytes;
+
+    if (v < 0x80) {
+        if (end - p < 1) {
+            return NULL;
+        }
+        *p++ = (unsigned char)v;
+        return p;
+    }
+    if (v <= 0xff) {
+        bytes = 1;
+        *p = 0xcc;
+    } else if (v <= 0xffff) {
+        bytes = 2;
+        *p = 0xcd;
+    } else if (v <= 0xffffffffULL) {
+        bytes = 4;
+        *p = 0xce;
+    } else {
+        bytes = 8;
+        *p = 0xcf;
+    }
+    if (end - p < 1 + bytes) {
+        return NULL;
+    }
+    p++;
+    for (int i = bytes - 1; i >= 0; i--) {
+        *p++ = (unsigned char)(v >> (i * 8));
+    }
+    return p;
+}
+
+static unsigned char *msgpack_put_str(unsigned char *p, const unsigned char *end,
+                                      const char *str, size_t len) {
+    if (!p) {
+        return NULL;
+    }
+    if (len < 32) {
+        if (end - p < 1) {
+            return NULL;
+        }
+        *p++ = 0xa0 | (unsigned char)len;
+    } else if (len <= 0xff) {
+        if (end - p < 2) {
+            return NULL;
+        }
+        *p++ = 0xd9;
+        *p++ = (unsigned char)len;
+    } else if (len <= 0xffff) {
+        if (end - p < 3) {
+            return NULL;
+        }
+        *p++ = 0xda;
+        *p++ = (unsigned char)(len >> 8);
+        *p++ = (unsigned char)len;
+    } else {
+        return NULL;
+    }
+    if ((size_t)(end - p) < len) {
+        return NULL;
+    }
+    memcpy(p, str, len);
+    return p + len;
+}
+
+/* Encode MSG as a MessagePack array [type, sender, recipient, session,
+   timestamp, payload] into OUT.  The position of each field is the
+   schema, so no keys go on the wire.  Returns the length, or 0 if it
+   doesn't fit. */
+static size_t pack_message(const ai_message_t *msg, unsigned char *out, size_t size) {
+    const unsigned char *end = out + size;
+    size_t payload_len = msg->payload_size < MAX_MESSAGE_SIZE ? msg->payload_size : MAX_MESSAGE_SIZE - 1;
+    unsigned char *p = out;
+
+    if (size < 1) {
+        return 0;
+    }
+    *p++ = MSGPACK_MESSAGE;
+    p = msgpack_put_uint(p, end, (uint64_t)msg->type);
+    p = msgpack_put_str(p, end, msg->sender_id, strnlen(msg->sender_id, sizeof(msg->sender_id)));
+    p = msgpack_put_str(p, end, msg->recipient_id, strnlen(msg->recipient_id, sizeof(msg->recipient_id)));
+    p = msgpack_put_str(p, end, msg->session_id, strnlen(msg->session_id, sizeof(msg->session_id)));
+    p = p ? msgpack_put_uint(p, end, msg->timestamp > 0 ? (uint64_t)msg->timestamp : 0) : NULL;
+    p = msgpack_put_str(p, end, msg->payload, payload_len);
+    return p ? (size_t)(p - out) : 0;
+}
+
+/* MessagePack readers over [*P, END).  Return 0 and advance *P, or -1 on
+   a truncated or unexpected item. */
+static int msgpack_get_uint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    int bytes;
+
+    if (*p >= end) {
+        return -1;
+    }
+    if (**p < 0x80) {
+        *v = *(*p)++;
+        return 0;
+    }
+    switch (**p) {
+        case 0xcc:
+            bytes = 1;
+            break;
+        case 0xcd:
+            bytes = 2;
+            break;
+        case 0xce:
+            bytes = 4;
+            break;
+        case 0xcf:
+            bytes = 8;
+            break;
+        default:
+            return -1;
+    }
+    if (end - *p < 1 + bytes) {
         return -1;
     }
+    (*p)++;
+    *v = 0;
+    while (bytes--) {
+        *v = (*v << 8) | *(*p)++;
+    }
+    return 0;
+}
 
-    /* Create JSON representation */
-    json_object *root = json_object_new_object();
-    json_object *type_obj = json_object_new_int(msg->type);
-    json_object *sender_obj = json_object_new_string(msg->sender_id);
-    json_object *recipient_obj = json_object_new_string(msg->recipient_id);
-    json_object *session_obj = json_object_new_string(msg->session_id);
-    json_object *timestamp_obj = json_object_new_int64(msg->timestamp);
-    json_object *payload_obj = json_object_new_string(msg->payload);
-
-    json_object_object_add(root, "type", type_obj);
-    json_object_object_add(root, "sender", sender_obj);
-    json_object_object_add(root, "recipient", recipient_obj);
-    json_object_object_add(root, "session", session_obj);
-    json_object_object_add(root, "timestamp", timestamp_obj);
-    json_object_object_add(root, "payload", payload_obj);
-
-    const char *json_str = json_object_to_json_string(root);
-
-    /* Send via UDP for discovery, TCP for regular communication */
-    int result = -1;
-    if (msg->type == MSG_TYPE_DISCOVERY) {
-        /* UDP broadcast */
-        int sock = socket(AF_INET, SOCK_DGRAM, 0);
-        if (sock >= 0) {
-            int broadcast = 1;
-            setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast));
+/* Read a string into DST of SIZE bytes, truncating like the JSON path,
+   and return its stored length in *STORED if not NULL */
+static int msgpack_get_str(const unsigned char **p, const unsigned char *end,
+                           char *dst, size_t size, size_t *stored) {
+    size_t len, copy;
 
-            struct sockaddr_in addr;
-            addr.sin_family = AF_INET;
-            addr.sin_port = htons(DISCOVERY_PORT);
-            addr.sin_addr.s_addr = INADDR_BROADCAST;
+    if (*p >= end) {
+        return -1;
+    }
+    if ((**p & 0xe0) == 0xa0) {
+        len = *(*p)++ & 0x1f;
+    } else if (**p == 0xd9 && end - *p >= 2) {
+        len = (*p)[1];
+        *p += 2;
+    } else if (**p == 0xda && end - *p >= 3) {
+        len = ((size_t)(*p)[1] << 8) | (*p)[2];
+        *p += 3;
+    } else {
+        return -1;
+    }
+    if ((size_t)(end - *p) < len) {
+        return -1;
+    }
 
-            result = sendto(sock, json_str, strlen(json_str), 0,
-                          (struct sockaddr*)&addr, sizeof(addr));
-            close(sock);
-        }
+    copy = len < size ? len : size - 1;
+    memcpy(dst, *p, copy);
+    dst[copy] = '\0';
+    *p += len;
+    if (stored) {
+        *stored = copy;
+    }
+    return 0;
+}
+
+/* Decode a message written by pack_message() */
+static int unpack_message(const unsigned char *data, size_t len, ai_message_t *msg) {
+    const unsigned char *p = data + 1, *end = data + len;
+    uint64_t type, timestamp;
+
+    memset(msg, 0, sizeof(ai_message_t));
+    if (len < 1 || data[0] != MSGPACK_MESSAGE ||
+        msgpack_get_uint(&p, end, &type) != 0 ||
+        msgpack_get_str(&p, end, msg->sender_id, sizeof(msg->sender_id), NULL) != 0 ||
+        msgpack_get_str(&p, end, msg->recipient_id, sizeof(msg->recipient_id), NULL) != 0 ||
+        msgpack_get_str(&p, end, msg->session_id, sizeof(msg->session_id), NULL) != 0 ||
+        msgpack_get_uint(&p, end, &timestamp) != 0 ||
+        msgpack_get_str(&p, end, msg->payload, sizeof(msg->payload), &msg->payload_size) != 0) {
+        ANBS_DEBUG_LOG("Discarded a malformed MessagePack message");
+        return -1;
+    }
+    msg->type = (message_type_t)type;
+    msg->timestamp = (time_t)timestamp;
+    return 0;
+}
+
+/* Compress the *LEN encoded bytes for a peer that advertised
+   compress=zlib.  Returns a malloc'd zlib stream and sets *LEN, or NULL
+   when the message is short or doesn't shrink.  A zlib header never
+   starts with '{' or MSGPACK_MESSAGE, so receivers tell the encodings
+   apart by the first byte. */
+static unsigned char *encode_message(const void *data, size_t *len) {
+    uLongf compressed_len;
+    unsigned char *compressed;
+
+    if (*len < COMPRESS_MIN) {
+        return NULL;
+    }
+
+    compressed_len = compressBound(*len);
+    compressed = malloc(compressed_len);
+    if (!compressed) {
+        return NULL;
+    }
+    if (compress2(compressed, &compressed_len, (const Bytef *)data, *len, Z_BEST_SPEED) != Z_OK ||
+        compressed_len >= *len) {
+        free(compressed);
+        return NULL;
+    }
+
+    *len = compressed_len;
+    return compressed;
+}
+
+/* Encode MSG as one length-prefixed stream frame.  Peers that advertised
+   encoding=msgpack get the binary form; older peers get JSON.  Returns a
+   malloc'd frame and sets *LEN, or NULL. */
+static unsigned char *frame_encode(const ai_message_t *msg, int wire, size_t *len) {
+    unsigned char packed[MAX_WIRE_SIZE];
+    json_object *root = NULL;
+    const void *encoded;
+    size_t wire_len = 0;
+
+    if (wire & AGENT_WIRE_MSGPACK) {
+        wire_len = pack_message(msg, packed, sizeof(packed));
+    }
+
+    if (wire_len > 0) {
+        encoded = packed;
     } else {
-        /* TCP connection */
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock >= 0) {
-            struct sockaddr_in addr;
-            addr.sin_family = AF_INET;
-            addr.sin_port = htons(agent->port);
-            inet_pton(AF_INET, agent->ip_address, &addr.sin_addr);
+        /* Create JSON representation */
+        root = json_object_new_object();
+        json_object_object_add(root, "type", json_object_new_int(msg->type));
+        json_object_object_add(root, "sender", json_object_new_string(msg->sender_id));
+        json_object_object_add(root, "recipient", json_object_new_string(msg->recipient_id));
+        json_object_object_add(root, "session", json_object_new_string(msg->session_id));
+        json_object_object_add(root, "timestamp", json_object_new_int64(msg->timestamp));
+        json_object_object_add(root, "payload", json_object_new_string(msg->payload));
+
+        encoded = json_object_to_json_string(root);
+        wire_len = strlen(encoded);
+    }
+
+    unsigned char *compressed = (wire & AGENT_WIRE_ZLIB) ? encode_message(encoded, &wire_len) : NULL;
+    unsigned char *frame = malloc(AGENT_FRAME_HEADER + wire_len);
+
+    if (frame) {
+        frame[0] = (unsigned char)(wire_len >> 24);
+        frame[1] = (unsigned char)(wire_len >> 16);
+        frame[2] = (unsigned char)(wire_len >> 8);
+        frame[3] = (unsigned char)wire_len;
+        memcpy(frame + AGENT_FRAME_HEADER, compressed ? (const void *)compressed : encoded, wire_len);
+        *len = AGENT_FRAME_HEADER + wire_len;
+    }
+
+    ANBS_DEBUG_LOG("Encoded message type %d for %s%s%s", msg->type, msg->recipient_id,
+                   root ? "" : " (msgpack)", compressed ? " (compressed)" : "");
+
+    if (root) {
+        json_object_put(root);
+    }
+    free(compressed);
+    return frame;
+}
+
+/* Queue LINK for the loop thread, marking it CLOSING if asked; any thread */
+static void link_schedule(agent_link_t *link, int closing) {
+    int wake = 0;
 
-            if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-                result = send(sock, json_str, strlen(json_str), 0);
+    pthread_mutex_lock(&g_ai_system->links_mutex);
+    if (closing) {
+        link->closing = 1;
+    }
+    if (!link->scheduled) {
+        link->scheduled = 1;
+        link->ready_next = g_ai_system->links_ready;
+        g_ai_system->links_ready = link;
+        wake = 1;
+    }
+    pthread_mutex_unlock(&g_ai_system->links_mutex);
+
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t ignored = write(g_ai_system->link_wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+/* Free LINK's queued frames, the one being written included */
+static void link_drop_queued(agent_link_t *link) {
+    agent_frame_t *frame = __atomic_exchange_n(&link->outbox, NULL, __ATOMIC_ACQUIRE);
+    size_t dropped = 0, bytes = 0;
+
+    while (frame) {
+        agent_frame_t *next = frame->next;
+        bytes += frame->size;
+        free(frame);
+        frame = next;
+        dropped++;
+    }
+    while (link->pending) {
+        frame = link->pending;
+        link->pending = frame->next;
+        bytes += frame->size;
+        free(frame);
+        dropped++;
+    }
+    link->pending_tail = NULL;
+    if (link->tx) {
+        bytes += link->tx_size;
+        free(link->tx);
+        link->tx = NULL;
+        dropped++;
+    }
+    __atomic_sub_fetch(&link->queued, bytes, __ATOMIC_RELAXED);
+
+    if (dropped > 0) {
+        ANBS_DEBUG_LOG("Dropped %zu messages for agent %s", dropped, link->agent_id);
+    }
+}
+
+/* Release LINK's stream on the loop thread.  A peer that never took a
+   frame counts as a failed dial: those back off exponentially and drop
+   the queue, so an unreachable peer costs one connect per interval
+   rather than one per message.  A stream that dies after working is
+   redialled at once and the unfinished frame sent again. */
+static void link_reset(agent_link_t *link) {
+    if (link->fd >= 0) {
+        anbs_event_remove(link->fd);
+        close(link->fd);
+        link->fd = -1;
+    }
+    link->tx_sent = 0;
+    link->connecting = 0;
+
+    if (!link->delivered) {
+        ANBS_DEBUG_LOG("Failed to connect to agent %s", link->agent_id);
+        link->dial_failures++;
+        __atomic_store_n(&link->next_dial,
+                         time(NULL) + (link->dial_failures < 5 ? 1 << link->dial_failures : AGENT_REDIAL_MAX_S),
+                         __ATOMIC_RELAXED);
+        link_drop_queued(link);
+    }
+    link->delivered = 0;
+}
+
+static void link_flush(agent_link_t *link);
+
+/* Watch LINK's stream on the loop thread: finish its dial, resume
+   blocked writes, and notice the peer closing it */
+static void link_on_event(int fd, uint32_t events, void *arg) {
+    agent_link_t *link = arg;
+
+    if (link->connecting) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error != 0 ||
+            (events & (EPOLLERR | EPOLLHUP))) {
+            link_reset(link);
+            return;
+        }
+        link->connecting = 0;
+        link->dial_failures = 0;
+        __atomic_store_n(&link->next_dial, 0, __ATOMIC_RELAXED);
+    }
+
+    /* Peers never write on our outbound stream, so readable means closed */
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+        link_reset(link);
+    }
+    link_flush(link);
+}
+
+/* Start dialling LINK's peer on the loop thread */
+static int link_dial(agent_link_t *link) {
+    int one = 1, syn_retries = 2;
+    unsigned int user_timeout = AGENT_IO_TIMEOUT_S * 1000;
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (sock < 0) {
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(sock, IPPROTO_TCP, TCP_SYNCNT, &syn_retries, sizeof(syn_retries));
+    setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+
+    if ((connect(sock, (struct sockaddr *)&link->addr, sizeof(link->addr)) != 0 && errno != EINPROGRESS) ||
+        anbs_event_add(sock, EPOLLIN | EPOLLRDHUP | EPOLLOUT, link_on_event, link) != 0) {
+        close(sock);
+        return -1;
+    }
+
+    link->fd = sock;
+    link->connecting = 1;
+    return 0;
+}
+
+/* Write what LINK's stream will take on the loop thread, dialling first
+   if there is anything to send */
+static void link_flush(agent_link_t *link) {
+    agent_frame_t *frame = __atomic_exchange_n(&link->outbox, NULL, __ATOMIC_ACQUIRE);
+    agent_frame_t *oldest = NULL, *newest = frame;
+
+    /* The outbox is newest first */
+    while (frame) {
+        agent_frame_t *next = frame->next;
+        frame->next = oldest;
+        oldest = frame;
+        frame = next;
+    }
+    if (oldest) {
+        if (link->pending_tail) {
+            link->pending_tail->next = oldest;
+        } else {
+            link->pending = oldest;
+        }
+        link->pending_tail = newest;
+    }
+
+    if (!link->tx && !link->pending) {
+        if (link->fd >= 0 && !link->connecting) {
+            anbs_event_modify(link->fd, EPOLLIN | EPOLLRDHUP);
+        }
+        return;
+    }
+    if (link->fd < 0) {
+        if (__atomic_load_n(&link->next_dial, __ATOMIC_RELAXED) > time(NULL)) {
+            link_drop_queued(link);
+        } else if (link_dial(link) != 0) {
+            link_reset(link);
+        }
+        return;
+    }
+    if (link->connecting) {
+        return;
+    }
+
+    for (;;) {
+        if (!link->tx) {
+            frame = link->pending;
+            if (!frame) {
+                break;
             }
-            close(sock);
+            link->pending = frame->next;
+            if (!link->pending) {
+                link->pending_tail = NULL;
+            }
+            link->tx = frame_encode(&frame->msg, frame->wire, &link->tx_len);
+            link->tx_size = frame->size;
+            link->tx_sent = 0;
+            free(frame);
+            if (!link->tx) {
+                __atomic_sub_fetch(&link->queued, link->tx_size, __ATOMIC_RELAXED);
+                continue;
+            }
+        }
+
+        ssize_t n = send(link->fd, link->tx + link->tx_sent, link->tx_len - link->tx_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            link->tx_sent += n;
+            if (link->tx_sent == link->tx_len) {
+                free(link->tx);
+                link->tx = NULL;
+                link->delivered = 1;
+                __atomic_sub_fetch(&link->queued, link->tx_size, __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            anbs_event_modify(link->fd, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+            return;
+        }
+        link_reset(link);
+        link_flush(link);
+        return;
     }
 
-    json_object_put(root);
+    anbs_event_modify(link->fd, EPOLLIN | EPOLLRDHUP);
+}
+
+/* Close LINK and free it with its queue, once it is off the registry */
+static void link_free(agent_link_t *link) {
+    if (link->fd >= 0) {
+        anbs_event_remove(link->fd);
+        close(link->fd);
+    }
+    link_drop_queued(link);
+    free(link);
+}
+
+/* Take LINK off the registry and free it on the loop thread */
+static void link_release(agent_link_t *link) {
+    agent_link_t **prev;
+
+    pthread_mutex_lock(&g_ai_system->links_mutex);
+    for (prev = &g_ai_system->links; *prev; prev = &(*prev)->next) {
+        if (*prev == link) {
+            *prev = link->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&g_ai_system->links_cond);
+    pthread_mutex_unlock(&g_ai_system->links_mutex);
+
+    link_free(link);
+}
+
+/* Serve the links senders queued, on the loop thread */
+static void link_on_wake(int fd, uint32_t events, void *arg) {
+    uint64_t count;
+    ssize_t ignored = read(fd, &count, sizeof(count));
+    (void)ignored;
+    (void)events;
+    (void)arg;
+
+    for (;;) {
+        agent_link_t *link;
+        int closing;
+
+        pthread_mutex_lock(&g_ai_system->links_mutex);
+        link = g_ai_system->links_ready;
+        if (link) {
+            g_ai_system->links_ready = link->ready_next;
+            link->scheduled = 0;
+            closing = link->closing;
+        }
+        pthread_mutex_unlock(&g_ai_system->links_mutex);
+        if (!link) {
+            break;
+        }
+
+        /* Nothing can queue on a closing link, so this pass is its last */
+        link_flush(link);
+        if (closing) {
+            link_release(link);
+        }
+    }
+}
+
+/* Hand AGENT's outbound stream to the loop to close, with AGENTS_MUTEX
+   held.  Messages already queued get one last chance to go out. */
+static void agent_close_locked(ai_agent_t *agent) {
+    if (agent->link) {
+        link_schedule(agent->link, 1);
+        agent->link = NULL;
+    }
+}
+
+/* AGENT's outbound stream, created if need be, with AGENTS_MUTEX held */
+static agent_link_t *agent_link_locked(ai_agent_t *agent) {
+    agent_link_t *link = agent->link;
+
+    if (link) {
+        return link;
+    }
+
+    link = calloc(1, sizeof(agent_link_t));
+    if (!link) {
+        return NULL;
+    }
+    link->addr.sin_family = AF_INET;
+    link->addr.sin_port = htons(agent->port);
+    if (inet_pton(AF_INET, agent->ip_address, &link->addr.sin_addr) != 1) {
+        free(link);
+        return NULL;
+    }
+    strncpy(link->agent_id, agent->agent_id, sizeof(link->agent_id) - 1);
+    link->fd = -1;
+
+    pthread_mutex_lock(&g_ai_system->links_mutex);
+    link->next = g_ai_system->links;
+    g_ai_system->links = link;
+    pthread_mutex_unlock(&g_ai_system->links_mutex);
+
+    agent->link = link;
+    return link;
+}
+
+/* Queue a message for AGENT's persistent stream, with AGENTS_MUTEX held.
+   The loop thread encodes and writes it, so this never blocks on the
+   network.  Fails at once for a peer we are backing off from, or one so
+   slow that AGENT_OUTBOX_MAX bytes are already waiting for it; anything
+   lost after queueing shows up as a missing reply. */
+static int send_message_to_agent(ai_agent_t *agent, const ai_message_t *msg) {
+    agent_link_t *link;
+    agent_frame_t *frame;
+    size_t payload_len, size;
+
+    if (!agent || !msg) {
+        return -1;
+    }
+
+    link = agent_link_locked(agent);
+    if (!link || __atomic_load_n(&link->next_dial, __ATOMIC_RELAXED) > time(NULL)) {
+        return -1;
+    }
+
+    payload_len = msg->payload_size < MAX_MESSAGE_SIZE ? msg->payload_size : MAX_MESSAGE_SIZE - 1;
+    size = offsetof(agent_frame_t, msg.payload) + payload_len + 1;
+    if (__atomic_load_n(&link->queued, __ATOMIC_RELAXED) + size > AGENT_OUTBOX_MAX) {
+        ANBS_DEBUG_LOG("Agent %s is not keeping up; message type %d not sent", agent->agent_id, msg->type);
+        return -1;
+    }
 
-    ANBS_DEBUG_LOG("Sent message type %d to %s: %s", msg->type, agent->agent_id,
-                   result > 0 ? "success" : "failed");
+    frame = malloc(size);
+    if (!frame) {
+        return -1;
+    }
+    memcpy(&frame->msg, msg, offsetof(ai_message_t, payload) + payload_len);
+    frame->msg.payload[payload_len] = '\0';
+    frame->msg.payload_size = payload_len;
+    frame->size = size;
+    frame->wire = (strstr(agent->capabilities, "encoding=msgpack") ? AGENT_WIRE_MSGPACK : 0) |
+                  (strstr(agent->capabilities, "compress=zlib") ? AGENT_WIRE_ZLIB : 0);
+
+    __atomic_add_fetch(&link->queued, size, __ATOMIC_RELAXED);
+    frame->next = __atomic_load_n(&link->outbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&link->outbox, &frame->next, frame, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
 
-    return result > 0 ? 0 : -1;
+    link_schedule(link, 0);
+    return 0;
 }
 
 /* Parse received message */
@@ -253,66 +1134,269 @@ static int parse_message(const char *json_str, ai_message_t *msg) {
     return 0;
 }
 
-/* Handle received message */
-static void handle_message(const ai_message_t *msg) {
-    if (!msg || !g_ai_system) {
-        return;
+/* Parse LEN bytes as received: JSON or MessagePack, either of them
+   possibly compressed by encode_message() */
+static int decode_message(const unsigned char *data, size_t len, ai_message_t *msg) {
+    unsigned char plain[MAX_WIRE_SIZE + 1];
+    uLongf plain_len = MAX_WIRE_SIZE;
+
+    if (len == 0) {
+        return -1;
     }
 
-    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    if (data[0] != '{' && data[0] != MSGPACK_MESSAGE) {
+        if (uncompress(plain, &plain_len, data, len) != Z_OK || plain_len == 0) {
+            ANBS_DEBUG_LOG("Discarded a message that is neither JSON, MessagePack nor zlib");
+            return -1;
+        }
+        data = plain;
+        len = plain_len;
+    }
 
-    switch (msg->type) {
-        case MSG_TYPE_DISCOVERY: {
-            /* Another agent is discovering - respond with our info */
-            ai_message_t response;
-            char payload[512];
+    if (data[0] == MSGPACK_MESSAGE) {
+        return unpack_message(data, len, msg);
+    }
+    if (data[0] != '{') {
+        return -1;
+    }
 
-            snprintf(payload, sizeof(payload),
-                    "capabilities=terminal,ai_commands,memory_search,file_analysis;"
-                    "status=online;load=%.1f;memory=%.1f",
-                    0.0, 0.0); /* TODO: Get actual system stats */
+    if (len > MAX_WIRE_SIZE) {
+        len = MAX_WIRE_SIZE;
+    }
+    memmove(plain, data, len);
+    plain[len] = '\0';
 
-            create_message(MSG_TYPE_HANDSHAKE, msg->sender_id, payload, &response);
+    return parse_message((const char *)plain, msg);
+}
 
-            /* Find agent or create new entry */
-            ai_agent_t *agent = NULL;
-            for (int i = 0; i < g_ai_system->agent_count; i++) {
-                if (strcmp(g_ai_system->agents[i].agent_id, msg->sender_id) == 0) {
-                    agent = &g_ai_system->agents[i];
-                    break;
-                }
-            }
+/* Microseconds on the monotonic clock, for heartbeat round trips */
+static uint64_t agent_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-            if (!agent && g_ai_system->agent_count < MAX_AI_AGENTS) {
-                agent = &g_ai_system->agents[g_ai_system->agent_count++];
-                strncpy(agent->agent_id, msg->sender_id, sizeof(agent->agent_id) - 1);
-                agent->port = COMM_PORT_BASE + g_ai_system->agent_count;
-                agent->status = AGENT_STATUS_DISCOVERING;
-            }
+/* Give TASK's queue slot on its agent back and fold whether it was
+   ANSWERED into the agent's success rate, with both mutexes held */
+static void task_release_locked(task_session_t *task, int answered) {
+    ai_agent_t *agent = id_table_find(&g_ai_system->agents, task->assigned_agent);
 
-            if (agent) {
-                agent->last_seen = time(NULL);
-                /* TODO: Send handshake response */
+    if (!agent) {
+        return;
+    }
+    if (agent->task_queue_size > 0) {
+        agent->task_queue_size--;
+    }
+    agent->success_rate += AGENT_EWMA_ALPHA * ((answered ? 1.0 : 0.0) - agent->success_rate);
+    if (answered) {
+        agent->tasks_completed++;
+    }
+}
+
+/* A new table entry for agent ID, or NULL if there is no room, with
+   AGENTS_MUTEX held */
+static ai_agent_t *agent_add_locked(const char *id) {
+    ai_agent_t *agent;
+
+    if (g_ai_system->agents.count >= AGENT_TABLE_MAX) {
+        return NULL;
+    }
+    agent = calloc(1, sizeof(ai_agent_t));
+    if (!agent) {
+        return NULL;
+    }
+    strncpy(agent->agent_id, id, sizeof(agent->agent_id) - 1);
+    agent->entry.id = agent->agent_id;
+    agent->status = AGENT_STATUS_DISCOVERING;
+    agent->success_rate = 1.0;
+    agent->last_seen = time(NULL);
+    if (id_table_insert(&g_ai_system->agents, agent) != 0) {
+        free(agent);
+        return NULL;
+    }
+    return agent;
+}
+
+/* Point AGENT's stream at IP:PORT, with AGENTS_MUTEX held.  A peer that
+   moved gets a fresh stream and a fresh backoff. */
+static void agent_set_address_locked(ai_agent_t *agent, const char *ip, int port) {
+    if (strcmp(ip, agent->ip_address) != 0 || port != agent->port) {
+        agent_close_locked(agent);
+        strncpy(agent->ip_address, ip, sizeof(agent->ip_address) - 1);
+        agent->port = port;
+    }
+}
+
+/* The table entry for MSG's sender, added if there is room, with
+   AGENTS_MUTEX held.  Handshake payloads carry the peer's capabilities
+   and listening port; FROM, when known, gives its address. */
+static ai_agent_t *agent_lookup_locked(const ai_message_t *msg, const struct sockaddr_in *from) {
+    ai_agent_t *agent = id_table_find(&g_ai_system->agents, msg->sender_id);
+    const char *port_field;
+    char ip[64];
+
+    if (!agent) {
+        agent = agent_add_locked(msg->sender_id);
+    }
+    if (!agent) {
+        return NULL;
+    }
+
+    strncpy(agent->capabilities, msg->payload, sizeof(agent->capabilities) - 1);
+    port_field = strstr(msg->payload, ";port=");
+
+    if (from && inet_ntop(AF_INET, &from->sin_addr, ip, sizeof(ip))) {
+        agent_set_address_locked(agent, ip, port_field ? atoi(port_field + 6) : COMM_PORT_BASE);
+    }
+    return agent;
+}
+
+/* Fold one round trip of RTT_MS into AGENT's estimate */
+static void agent_observe_rtt_locked(ai_agent_t *agent, double rtt_ms) {
+    agent->rtt_ms = agent->rtt_ms > 0 ? agent->rtt_ms + AGENT_EWMA_ALPHA * (rtt_ms - agent->rtt_ms) : rtt_ms;
+}
+
+/* xorshift64 draw for placement and gossip, with AGENTS_MUTEX held */
+static uint64_t agent_random(void) {
+    static uint64_t state = 0;
+
+    if (state == 0) {
+        state = agent_now_us() ^ ((uint64_t)getpid() << 32) ^ 0x9e3779b97f4a7c15ULL;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/* Send our memory version vector to AGENT_ID, or to a random online
+   agent if it is NULL; the answer carries the entries we lack */
+static void replica_pull(const char *agent_id) {
+    char digest[MAX_MESSAGE_SIZE];
+    ai_agent_t *agent = NULL;
+    ai_message_t msg;
+    size_t online = 0;
+
+    if (anbs_memory_replica_digest(digest, sizeof(digest)) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    if (agent_id) {
+        agent = id_table_find(&g_ai_system->agents, agent_id);
+    } else {
+        for (size_t i = 0; i < g_ai_system->agents.count; i++) {
+            ai_agent_t *candidate = g_ai_system->agents.items[i];
+            if (candidate->status == AGENT_STATUS_ONLINE && agent_random() % ++online == 0) {
+                agent = candidate;
             }
-            break;
         }
+    }
+    if (agent && agent->status == AGENT_STATUS_ONLINE) {
+        create_message(MSG_TYPE_MEMORY_DIGEST, agent->agent_id, digest, &msg);
+        send_message_to_agent(agent, &msg);
+    }
+    pthread_mutex_unlock(&g_ai_system->agents_mutex);
+}
+
+/* Answer a peer's memory version vector with a delta of what it lacks,
+   or merge a delta we asked for.  A delta that had to stop short says
+   so in its first line, and we ask again until we have caught up. */
+static void replica_handle(const ai_message_t *msg) {
+    char delta[MAX_MESSAGE_SIZE];
+    ai_message_t reply;
+    ai_agent_t *agent;
+    int more = 0;
+
+    if (!g_ai_system->replicate_memory) {
+        return;
+    }
+
+    if (msg->type == MSG_TYPE_MEMORY_DELTA) {
+        anbs_memory_replica_apply(msg->payload);
+        if (strncmp(msg->payload, "more\n", 5) == 0) {
+            replica_pull(msg->sender_id);
+        }
+        return;
+    }
+
+    if (anbs_memory_replica_delta(msg->payload, delta + 5, sizeof(delta) - 5, &more) <= 0) {
+        return;
+    }
+    memcpy(delta, more ? "more\n" : "done\n", 5);
+
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    agent = id_table_find(&g_ai_system->agents, msg->sender_id);
+    if (agent) {
+        create_message(MSG_TYPE_MEMORY_DELTA, agent->agent_id, delta, &reply);
+        send_message_to_agent(agent, &reply);
+    }
+    pthread_mutex_unlock(&g_ai_system->agents_mutex);
+}
+
+/* Append TASK to the run queue, with TASKS_MUTEX held */
+static void run_push_locked(task_session_t *task) {
+    task->run_next = NULL;
+    task->run_prev = g_ai_system->run_tail;
+    if (g_ai_system->run_tail) {
+        g_ai_system->run_tail->run_next = task;
+    } else {
+        g_ai_system->run_head = task;
+    }
+    g_ai_system->run_tail = task;
+    g_ai_system->run_length++;
+    pthread_cond_signal(&g_ai_system->run_cond);
+}
+
+/* Take TASK off the run queue, with TASKS_MUTEX held */
+static void run_unlink_locked(task_session_t *task) {
+    if (task->run_prev) {
+        task->run_prev->run_next = task->run_next;
+    } else {
+        g_ai_system->run_head = task->run_next;
+    }
+    if (task->run_next) {
+        task->run_next->run_prev = task->run_prev;
+    } else {
+        g_ai_system->run_tail = task->run_prev;
+    }
+    task->run_prev = task->run_next = NULL;
+    g_ai_system->run_length--;
+}
+
+/* Handle a message received from FROM, which is NULL if unknown */
+static void handle_message(const ai_message_t *msg, const struct sockaddr_in *from) {
+    void (*done)(const char *result, void *arg) = NULL;
+    void *done_arg = NULL;
+    char done_result[2048];
+
+    if (!msg || !g_ai_system) {
+        return;
+    }
+
+    /* Replication reads and writes the memory store, so it stays clear of
+       the agent locks until it has something to send */
+    if (msg->type == MSG_TYPE_MEMORY_DIGEST || msg->type == MSG_TYPE_MEMORY_DELTA) {
+        replica_handle(msg);
+        return;
+    }
+
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
 
+    switch (msg->type) {
         case MSG_TYPE_HANDSHAKE: {
-            /* Agent responding to our discovery */
-            for (int i = 0; i < g_ai_system->agent_count; i++) {
-                if (strcmp(g_ai_system->agents[i].agent_id, msg->sender_id) == 0) {
-                    g_ai_system->agents[i].status = AGENT_STATUS_ONLINE;
-                    g_ai_system->agents[i].last_seen = time(NULL);
-                    strncpy(g_ai_system->agents[i].capabilities, msg->payload,
-                           sizeof(g_ai_system->agents[i].capabilities) - 1);
-
-                    if (g_ai_system->display) {
-                        char status_msg[256];
-                        snprintf(status_msg, sizeof(status_msg),
-                                "Connected to AI agent: %s", msg->sender_id);
-                        anbs_status_write(g_ai_system->display, status_msg);
-                    }
-                    break;
+            /* Agent announcing itself over its stream */
+            ai_agent_t *agent = agent_lookup_locked(msg, from);
+
+            if (agent && agent->member_state != MEMBER_DEAD) {
+                agent->status = AGENT_STATUS_ONLINE;
+                agent->last_seen = time(NULL);
+
+                if (g_ai_system->display) {
+                    char status_msg[256];
+                    snprintf(status_msg, sizeof(status_msg),
+                            "Connected to AI agent: %s", msg->sender_id);
+                    anbs_status_write(g_ai_system->display, status_msg);
                 }
             }
             break;
@@ -322,205 +1406,1148 @@ static void handle_message(const ai_message_t *msg) {
             /* Another agent requesting task execution */
             pthread_mutex_lock(&g_ai_system->tasks_mutex);
 
-            if (g_ai_system->task_count < 100) {
-                task_session_t *task = &g_ai_system->active_tasks[g_ai_system->task_count++];
+            /* A retransmitted request is answered once */
+            task_session_t *task = NULL;
+            if (!id_table_find(&g_ai_system->tasks, msg->session_id) &&
+                g_ai_system->tasks.count < TASK_TABLE_MAX) {
+                task = calloc(1, sizeof(task_session_t));
+            }
+            if (task) {
                 strncpy(task->session_id, msg->session_id, sizeof(task->session_id) - 1);
+                task->entry.id = task->session_id;
+                if (id_table_insert(&g_ai_system->tasks, task) != 0) {
+                    free(task);
+                    pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+                    break;
+                }
                 strncpy(task->task_description, msg->payload, sizeof(task->task_description) - 1);
                 strncpy(task->assigned_agent, g_ai_system->local_agent_id, sizeof(task->assigned_agent) - 1);
+                strncpy(task->requester, msg->sender_id, sizeof(task->requester) - 1);
                 task->created = msg->timestamp;
-                task->started = time(NULL);
                 task->priority = 5; /* Default priority */
-                strcpy(task->status, "processing");
+                strcpy(task->status, "queued");
+
+                /* executor_thread() runs it and replies */
+                run_push_locked(task);
+            }
+
+            pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+            break;
+        }
+
+        case MSG_TYPE_TASK_RESPONSE: {
+            /* Response to our task request */
+            pthread_mutex_lock(&g_ai_system->tasks_mutex);
+
+            task_session_t *task = id_table_find(&g_ai_system->tasks, msg->session_id);
+            if (task && strcmp(task->status, "submitted") == 0) {
+                strncpy(task->result, msg->payload, sizeof(task->result) - 1);
+                task->completed = time(NULL);
+                strcpy(task->status, "completed");
+                task_release_locked(task, 1);
+
+                /* Answered by a peer that stole it from the agent we chose */
+                if (strcmp(msg->sender_id, task->assigned_agent) != 0) {
+                    memcpy(task->previous_owner, task->assigned_agent, sizeof(task->previous_owner));
+                    strncpy(task->assigned_agent, msg->sender_id, sizeof(task->assigned_agent) - 1);
+                }
+                pthread_cond_broadcast(&g_ai_system->tasks_cond);
+
+                /* Called once the locks are dropped */
+                if (task->callback) {
+                    done = task->callback;
+                    done_arg = task->callback_arg;
+                    memcpy(done_result, task->result, sizeof(done_result));
+                    task->callback = NULL;
+                }
+
+                if (g_ai_system->display) {
+                    char result_msg[1024];
+                    snprintf(result_msg, sizeof(result_msg),
+                            "🤖 Distributed AI: %s\n", msg->payload);
+                    anbs_ai_chat_write(g_ai_system->display, result_msg);
+                    anbs_display_refresh_panel(g_ai_system->display, ANBS_PANEL_AI_CHAT);
+                }
+            }
+
+            pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+            break;
+        }
+
+        case MSG_TYPE_HEARTBEAT: {
+            /* Agent health update */
+            ai_agent_t *agent = id_table_find(&g_ai_system->agents, msg->sender_id);
+            if (agent) {
+                const char *ping = strstr(msg->payload, ";ping=");
+                const char *pong = strstr(msg->payload, ";pong=");
+
+                agent->last_seen = time(NULL);
+                if (agent->member_state != MEMBER_DEAD) {
+                    agent->status = AGENT_STATUS_ONLINE;
+                }
+
+                /* Our own stamp coming back measures the round trip */
+                if (pong) {
+                    uint64_t sent = strtoull(pong + 6, NULL, 10), now = agent_now_us();
+                    if (sent > 0 && now > sent) {
+                        agent_observe_rtt_locked(agent, (now - sent) / 1000.0);
+                    }
+                }
+
+                /* Echo the peer's stamp so it can do the same */
+                if (ping) {
+                    ai_message_t echo;
+                    char payload[128];
+
+                    snprintf(payload, sizeof(payload), "tasks=%d;queued=%d;pong=%llu", agent->task_queue_size,
+                             __atomic_load_n(&g_ai_system->run_length, __ATOMIC_RELAXED),
+                             strtoull(ping + 6, NULL, 10));
+                    create_message(MSG_TYPE_HEARTBEAT, agent->agent_id, payload, &echo);
+                    send_message_to_agent(agent, &echo);
+                }
+
+                /* The peer's backlog tells our executor where to steal */
+                const char *queued = strstr(msg->payload, "queued=");
+                if (queued) {
+                    agent->backlog = atoi(queued + 7);
+                }
+
+                /* TODO: Parse CPU and memory info from payload */
+            }
+            break;
+        }
+
+        case MSG_TYPE_TASK_STEAL: {
+            /* A peer ran dry: give it the newest waiting task, unless the
+               executor is about to start our only one.  A peer never gets
+               back a task it asked for itself. */
+            ai_agent_t *thief = id_table_find(&g_ai_system->agents, msg->sender_id);
+            char payload[MAX_MESSAGE_SIZE];
+            ai_message_t grant;
+
+            if (!thief) {
+                break;
+            }
+            pthread_mutex_lock(&g_ai_system->tasks_mutex);
+
+            task_session_t *task = NULL;
+            if (g_ai_system->run_length >= 2 || g_ai_system->executing) {
+                for (task = g_ai_system->run_tail; task; task = task->run_prev) {
+                    if (strcmp(task->requester, thief->agent_id) != 0) {
+                        break;
+                    }
+                }
+            }
+
+            if (task) {
+                run_unlink_locked(task);
+                snprintf(payload, sizeof(payload), "queued=%d;requester=%s\n%s",
+                         g_ai_system->run_length, task->requester, task->task_description);
+                create_message(MSG_TYPE_TASK_GRANT, thief->agent_id, payload, &grant);
+                strncpy(grant.session_id, task->session_id, sizeof(grant.session_id) - 1);
+
+                if (send_message_to_agent(thief, &grant) == 0) {
+                    strncpy(task->previous_owner, g_ai_system->local_agent_id, sizeof(task->previous_owner) - 1);
+                    strncpy(task->assigned_agent, thief->agent_id, sizeof(task->assigned_agent) - 1);
+                    strcpy(task->status, "stolen");
+                    task->completed = time(NULL);
+                    g_ai_system->tasks_granted++;
+                } else {
+                    run_push_locked(task);
+                }
+            } else {
+                snprintf(payload, sizeof(payload), "queued=%d\n", g_ai_system->run_length);
+                create_message(MSG_TYPE_TASK_GRANT, thief->agent_id, payload, &grant);
+                send_message_to_agent(thief, &grant);
+            }
+
+            pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+            break;
+        }
+
+        case MSG_TYPE_TASK_GRANT: {
+            /* The answer to our steal: a task to run, or just the
+               peer's backlog */
+            ai_agent_t *victim = id_table_find(&g_ai_system->agents, msg->sender_id);
+            const char *queued = strstr(msg->payload, "queued=");
+            const char *field = strstr(msg->payload, ";requester=");
+            const char *body = strchr(msg->payload, '\n');
+            char requester[64];
+
+            if (victim && queued) {
+                victim->backlog = atoi(queued + 7);
+            }
+            g_ai_system->steal_sent_us = 0;
+
+            if (!msg->session_id[0] || !field || !body ||
+                sscanf(field + 11, "%63[^\n]", requester) != 1) {
+                break;
+            }
+
+            pthread_mutex_lock(&g_ai_system->tasks_mutex);
+            task_session_t *task = NULL;
+            if (!id_table_find(&g_ai_system->tasks, msg->session_id) &&
+                g_ai_system->tasks.count < TASK_TABLE_MAX) {
+                task = calloc(1, sizeof(task_session_t));
+            }
+            if (task) {
+                strncpy(task->session_id, msg->session_id, sizeof(task->session_id) - 1);
+                task->entry.id = task->session_id;
+                if (id_table_insert(&g_ai_system->tasks, task) != 0) {
+                    free(task);
+                } else {
+                    strncpy(task->task_description, body + 1, sizeof(task->task_description) - 1);
+                    strncpy(task->assigned_agent, g_ai_system->local_agent_id, sizeof(task->assigned_agent) - 1);
+                    strncpy(task->previous_owner, msg->sender_id, sizeof(task->previous_owner) - 1);
+                    strncpy(task->requester, requester, sizeof(task->requester) - 1);
+                    task->created = msg->timestamp;
+                    task->priority = 5;
+                    strcpy(task->status, "queued");
+                    g_ai_system->tasks_stolen++;
+                    run_push_locked(task);
+                }
+            }
+            pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+            break;
+        }
+
+        default:
+            ANBS_DEBUG_LOG("Unknown message type %d from %s", msg->type, msg->sender_id);
+            break;
+    }
+
+    pthread_mutex_unlock(&g_ai_system->agents_mutex);
+
+    if (done) {
+        done(done_result, done_arg);
+    }
+}
+
+/* Close inbound stream CONN and release it */
+static void agent_conn_free(agent_conn_t *conn) {
+    close(conn->fd);
+    free(conn->rx);
+    free(conn);
+}
+
+/* Stop reading CONN on the loop thread once its peer has gone.  Cleanup
+   may already have taken the list, in which case it frees CONN. */
+static void agent_conn_drop(agent_conn_t *conn) {
+    agent_conn_t **link;
+    int owned = 0;
+
+    pthread_mutex_lock(&g_ai_system->conns_mutex);
+    for (link = &g_ai_system->conns; *link; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            owned = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_ai_system->conns_mutex);
+
+    anbs_event_remove(conn->fd);
+    if (owned) {
+        agent_conn_free(conn);
+    }
+}
+
+/* Handle every complete length-prefixed message buffered on CONN */
+static int agent_conn_process(agent_conn_t *conn) {
+    size_t offset = 0;
+
+    while (conn->rx_len - offset >= AGENT_FRAME_HEADER) {
+        const unsigned char *frame = conn->rx + offset;
+        size_t len = ((size_t)frame[0] << 24) | ((size_t)frame[1] << 16) |
+                     ((size_t)frame[2] << 8) | frame[3];
+        ai_message_t msg;
+
+        if (len == 0 || len > MAX_WIRE_SIZE) {
+            ANBS_DEBUG_LOG("Dropped agent stream with a %zu byte message", len);
+            return -1;
+        }
+        if (conn->rx_len - offset < AGENT_FRAME_HEADER + len) {
+            break;
+        }
+        if (decode_message(frame + AGENT_FRAME_HEADER, len, &msg) == 0) {
+            handle_message(&msg, &conn->peer);
+        }
+        offset += AGENT_FRAME_HEADER + len;
+    }
+
+    memmove(conn->rx, conn->rx + offset, conn->rx_len - offset);
+    conn->rx_len -= offset;
+    return 0;
+}
+
+/* Read an inbound stream on the loop thread */
+static void agent_on_stream(int fd, uint32_t events, void *arg) {
+    agent_conn_t *conn = arg;
+    (void)events;
+
+    for (;;) {
+        ssize_t n = recv(fd, conn->rx + conn->rx_len,
+                         AGENT_FRAME_HEADER + MAX_WIRE_SIZE - conn->rx_len, 0);
+
+        if (n > 0) {
+            conn->rx_len += n;
+            if (agent_conn_process(conn) != 0) {
+                break;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        break;
+    }
+
+    agent_conn_drop(conn);
+}
+
+/* Accept peers' streams on the loop thread */
+static void agent_on_accept(int fd, uint32_t events, void *arg) {
+    (void)events;
+    (void)arg;
+
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        agent_conn_t *conn;
+        int sock = accept4(fd, (struct sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        conn = calloc(1, sizeof(agent_conn_t));
+        if (conn) {
+            conn->rx = malloc(AGENT_FRAME_HEADER + MAX_WIRE_SIZE);
+        }
+        if (!conn || !conn->rx) {
+            free(conn);
+            close(sock);
+            continue;
+        }
+        conn->fd = sock;
+        conn->peer = peer;
+
+        pthread_mutex_lock(&g_ai_system->conns_mutex);
+        conn->next = g_ai_system->conns;
+        g_ai_system->conns = conn;
+        pthread_mutex_unlock(&g_ai_system->conns_mutex);
+
+        if (anbs_event_add(sock, EPOLLIN | EPOLLRDHUP, agent_on_stream, conn) != 0) {
+            agent_conn_drop(conn);
+        }
+    }
+}
+
+/* Listen for peers' streams on the first free port from ANBS_AGENT_PORT
+   (default COMM_PORT_BASE); the port goes out in our gossip record */
+static int agent_listen(void) {
+    const char *env = getenv("ANBS_AGENT_PORT");
+    int base = env && atoi(env) > 0 ? atoi(env) : COMM_PORT_BASE;
+
+    for (int port = base; port < base + AGENT_PORT_RANGE; port++) {
+        struct sockaddr_in addr;
+        int reuse = 1;
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (sock < 0) {
+            return -1;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+            listen(sock, SOMAXCONN) == 0 &&
+            anbs_event_add(sock, EPOLLIN, agent_on_accept, NULL) == 0) {
+            g_ai_system->listen_fd = sock;
+            g_ai_system->listen_port = port;
+            ANBS_DEBUG_LOG("Agent streams accepted on port %d", port);
+            return 0;
+        }
+        close(sock);
+    }
+
+    ANBS_DEBUG_LOG("No free port for agent streams from %d", base);
+    return -1;
+}
+
+/* Piggyback retransmissions for a fresh update: a few times log2 of the
+   membership, enough to reach every member with high probability.  The
+   caller holds AGENTS_MUTEX. */
+static int gossip_retransmits_locked(void) {
+    size_t members = g_ai_system->agents.count + 1;
+    int rounds = 1;
+
+    while (members >>= 1) {
+        rounds++;
+    }
+    return GOSSIP_RETRANSMIT_MULT * rounds;
+}
+
+/* Move AGENT to STATE and queue the news for gossip, with AGENTS_MUTEX
+   held.  Suspects stay usable until they are declared dead. */
+static void member_mark_locked(ai_agent_t *agent, member_state_t state, uint64_t now) {
+    member_state_t was = agent->member_state;
+
+    agent->member_state = state;
+    agent->gossip_left = gossip_retransmits_locked();
+
+    switch (state) {
+        case MEMBER_ALIVE:
+            agent->suspect_deadline_us = 0;
+            agent->status = AGENT_STATUS_ONLINE;
+            agent->last_seen = time(NULL);
+            break;
+        case MEMBER_SUSPECT:
+            agent->suspect_deadline_us = now + (uint64_t)g_ai_system->gossip_suspect_ms * 1000;
+            agent->status = AGENT_STATUS_ONLINE;
+            break;
+        case MEMBER_DEAD:
+            agent->status = AGENT_STATUS_OFFLINE;
+            agent_close_locked(agent);
+            break;
+    }
+
+    if (state != was) {
+        ANBS_DEBUG_LOG("Agent %s is %s", agent->agent_id,
+                       state == MEMBER_ALIVE ? "alive" : state == MEMBER_SUSPECT ? "suspect" : "dead");
+    }
+}
+
+/* The UDP address AGENT gossips on, with AGENTS_MUTEX held */
+static int gossip_addr_locked(const ai_agent_t *agent, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(agent->gossip_port > 0 ? agent->gossip_port : DISCOVERY_PORT);
+    return inet_pton(AF_INET, agent->ip_address, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+/* Append AGENT's record to a gossip payload, with AGENTS_MUTEX held */
+static int gossip_put_member_locked(char *out, size_t size, const ai_agent_t *agent) {
+    static const char states[] = { 'a', 's', 'd' };
+    const char *compress = strstr(agent->capabilities, "compress=zlib") ? "zlib" : "";
+    const char *encoding = strstr(agent->capabilities, "encoding=msgpack") ? "msgpack" : "";
+    char caps[32];
+
+    snprintf(caps, sizeof(caps), "%s%s%s", compress, *compress && *encoding ? "," : "", encoding);
+    return snprintf(out, size, "%c %u %s %d %d %s %s\n", states[agent->member_state],
+                    agent->incarnation, agent->ip_address[0] ? agent->ip_address : "-",
+                    agent->port, agent->gossip_port, caps[0] ? caps : "-", agent->agent_id);
+}
+
+/* Build a gossip payload, with AGENTS_MUTEX held: a header naming the
+   probe, our own record in SELF_STATE, then the updates that still have
+   retransmissions left.  A suspected TARGET hears about it first so it
+   can refute. */
+static void gossip_payload_locked(char *payload, size_t size, uint32_t seq,
+                                  const char *target, char self_state) {
+    size_t count = g_ai_system->agents.count;
+    ai_agent_t *about = target ? id_table_find(&g_ai_system->agents, target) : NULL;
+    int updates = 0;
+    int offset;
+
+    offset = snprintf(payload, size, "seq=%u;target=%s\n%c %u - %d %d " GOSSIP_CAPS " %s\n",
+                      seq, target ? target : "", self_state, g_ai_system->incarnation,
+                      g_ai_system->listen_port, g_ai_system->gossip_port,
+                      g_ai_system->local_agent_id);
+
+    if (about && about->member_state == MEMBER_SUSPECT) {
+        offset += gossip_put_member_locked(payload + offset, size - offset, about);
+        updates++;
+    }
+
+    /* Rotate the starting point so every update gets its turn */
+    for (size_t k = 0; k < count && updates < GOSSIP_PIGGYBACK_MAX &&
+         offset < (int)size - 256; k++) {
+        ai_agent_t *agent = g_ai_system->agents.items[(g_ai_system->gossip_cursor + k) % count];
+
+        if (agent->gossip_left > 0 && agent != about) {
+            offset += gossip_put_member_locked(payload + offset, size - offset, agent);
+            agent->gossip_left--;
+            updates++;
+        }
+    }
+    g_ai_system->gossip_cursor++;
+}
+
+/* Send a gossip message of TYPE to ADDR */
+static void gossip_send(const struct sockaddr_in *addr, message_type_t type, uint32_t seq,
+                        const char *target, char self_state) {
+    char payload[4096];
+    unsigned char wire[MAX_WIRE_SIZE];
+    ai_message_t msg;
+    size_t len;
+
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    gossip_payload_locked(payload, sizeof(payload), seq, target, self_state);
+    pthread_mutex_unlock(&g_ai_system->agents_mutex);
+    create_message(type, NULL, payload, &msg);
+
+    len = pack_message(&msg, wire, sizeof(wire));
+    if (len > 0) {
+        sendto(g_ai_system->gossip_fd, wire, len, 0, (const struct sockaddr *)addr, sizeof(*addr));
+    }
+}
+
+/* Merge one gossiped record about ID, with AGENTS_MUTEX held.  IP is
+   NULL when the record gives no address.  A higher incarnation wins; at
+   equal incarnation dead beats suspect beats alive.  Suspicion of
+   ourselves is refuted by outbidding its incarnation. */
+static void gossip_apply_locked(char state, uint32_t incarnation, const char *ip, int port,
+                                int gossip_port, const char *caps, const char *id,
+                                int from_sender, uint64_t now) {
+    member_state_t next = state == 'a' ? MEMBER_ALIVE : state == 's' ? MEMBER_SUSPECT : MEMBER_DEAD;
+    ai_agent_t *agent;
+    int fresh = 0;
+
+    if (strcmp(id, g_ai_system->local_agent_id) == 0) {
+        if (next != MEMBER_ALIVE && incarnation >= g_ai_system->incarnation) {
+            g_ai_system->incarnation = incarnation + 1;
+            ANBS_DEBUG_LOG("Refuting suspicion at incarnation %u", g_ai_system->incarnation);
+        }
+        return;
+    }
+
+    agent = id_table_find(&g_ai_system->agents, id);
+    if (!agent) {
+        /* No point learning about strangers only to bury them */
+        if (next == MEMBER_DEAD || !(agent = agent_add_locked(id))) {
+            return;
+        }
+        fresh = 1;
+    }
+
+    /* A member is the authority on its own address */
+    if (ip && (fresh || from_sender)) {
+        agent_set_address_locked(agent, ip, port);
+        agent->gossip_port = gossip_port;
+        snprintf(agent->capabilities, sizeof(agent->capabilities), "capabilities=gossip;%s%s",
+                 strstr(caps, "zlib") ? "compress=zlib;" : "",
+                 strstr(caps, "msgpack") ? "encoding=msgpack" : "");
+    }
+    if (from_sender && next == MEMBER_ALIVE) {
+        agent->last_seen = time(NULL);
+    }
+
+    if (fresh || incarnation > agent->incarnation ||
+        (incarnation == agent->incarnation && next > agent->member_state)) {
+        agent->incarnation = incarnation;
+        member_mark_locked(agent, next, now);
+    }
+}
+
+/* Apply every record in a gossip payload from FROM */
+static void gossip_merge(const ai_message_t *msg, const struct sockaddr_in *from) {
+    char copy[MAX_MESSAGE_SIZE];
+    char *save = NULL;
+    uint64_t now = agent_now_us();
+    char sender_ip[64];
+
+    if (!inet_ntop(AF_INET, &from->sin_addr, sender_ip, sizeof(sender_ip))) {
+        return;
+    }
+    strncpy(copy, msg->payload, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    for (char *line = strtok_r(copy, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char state, ip[64], caps[64], id[64];
+        unsigned int incarnation;
+        int port, gossip_port, from_sender;
+
+        if (sscanf(line, "%c %u %63s %d %d %63s %63s", &state, &incarnation, ip,
+                   &port, &gossip_port, caps, id) != 7 || !strchr("asd", state)) {
+            continue;
+        }
+        from_sender = strcmp(id, msg->sender_id) == 0;
+
+        /* Our own record goes out without an address; use the source */
+        gossip_apply_locked(state, incarnation,
+                            strcmp(ip, "-") != 0 ? ip : from_sender ? sender_ip : NULL,
+                            port, gossip_port, caps, id, from_sender, now);
+    }
+    pthread_mutex_unlock(&g_ai_system->agents_mutex);
+}
+
+/* Handle one gossip datagram from FROM on the gossip thread */
+static void gossip_receive(const ai_message_t *msg, const struct sockaddr_in *from) {
+    distributed_ai_system_t *sys = g_ai_system;
+    unsigned int seq = 0;
+    char target[64] = "";
+
+    sscanf(msg->payload, "seq=%u;target=%63[^\n]", &seq, target);
+
+    switch (msg->type) {
+        case MSG_TYPE_DISCOVERY:
+            /* A bootstrap broadcast: a ping tells the sender about us,
+               and its ack tells us about it */
+            gossip_send(from, MSG_TYPE_GOSSIP_PING, 0, NULL, 'a');
+            break;
+
+        case MSG_TYPE_GOSSIP_PING:
+            gossip_merge(msg, from);
+            gossip_send(from, MSG_TYPE_GOSSIP_ACK, seq, NULL, 'a');
+            break;
+
+        case MSG_TYPE_GOSSIP_PING_REQ: {
+            /* Probe TARGET on the requester's behalf */
+            struct sockaddr_in addr;
+            ai_agent_t *agent;
+            int found = 0;
+
+            gossip_merge(msg, from);
+            pthread_mutex_lock(&sys->agents_mutex);
+            agent = id_table_find(&sys->agents, target);
+            found = agent && gossip_addr_locked(agent, &addr) == 0;
+            pthread_mutex_unlock(&sys->agents_mutex);
+            if (!found) {
+                break;
+            }
+
+            for (int i = 0; i < GOSSIP_RELAYS; i++) {
+                gossip_relay_t *relay = &sys->relays[i];
+
+                if (relay->seq == 0) {
+                    relay->seq = ++sys->probe_seq;
+                    relay->requester_seq = seq;
+                    relay->requester = *from;
+                    relay->expires_us = agent_now_us() + (uint64_t)sys->gossip_interval_ms * 1000;
+                    gossip_send(&addr, MSG_TYPE_GOSSIP_PING, relay->seq, target, 'a');
+                    break;
+                }
+            }
+            break;
+        }
+
+        case MSG_TYPE_GOSSIP_ACK:
+            gossip_merge(msg, from);
+            if (seq == 0) {
+                break;
+            }
+
+            if (seq == sys->probe_seq && sys->probe_target[0]) {
+                sys->probe_acked = 1;
+
+                /* Only a direct ack times the path to the target */
+                if (strcmp(msg->sender_id, sys->probe_target) == 0) {
+                    uint64_t now = agent_now_us();
+
+                    pthread_mutex_lock(&sys->agents_mutex);
+                    ai_agent_t *agent = id_table_find(&sys->agents, sys->probe_target);
+                    if (agent && now > sys->probe_sent_us) {
+                        agent_observe_rtt_locked(agent, (now - sys->probe_sent_us) / 1000.0);
+                    }
+                    pthread_mutex_unlock(&sys->agents_mutex);
+                }
+                break;
+            }
+
+            /* An ack for a probe we relayed goes back to the requester */
+            for (int i = 0; i < GOSSIP_RELAYS; i++) {
+                gossip_relay_t *relay = &sys->relays[i];
+
+                if (relay->seq == seq) {
+                    relay->seq = 0;
+                    gossip_send(&relay->requester, MSG_TYPE_GOSSIP_ACK, relay->requester_seq, NULL, 'a');
+                    break;
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* Up to MAX random members other than EXCEPT that aren't dead, with
+   AGENTS_MUTEX held.  Returns how many addresses were filled. */
+static int gossip_pick_locked(struct sockaddr_in *addrs, int max, const char *except) {
+    size_t count = g_ai_system->agents.count;
+    size_t start;
+    int picked = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    start = agent_random() % count;
+
+    for (size_t k = 0; k < count && picked < max; k++) {
+        ai_agent_t *agent = g_ai_system->agents.items[(start + k) % count];
+
+        if (agent->member_state != MEMBER_DEAD &&
+            (!except || strcmp(agent->agent_id, except) != 0) &&
+            gossip_addr_locked(agent, &addrs[picked]) == 0) {
+            picked++;
+        }
+    }
+    return picked;
+}
+
+/* Ask a few other members to probe a target that hasn't acked within a
+   third of the period */
+static void gossip_check_probe(uint64_t now) {
+    distributed_ai_system_t *sys = g_ai_system;
+    struct sockaddr_in addrs[GOSSIP_FANOUT_MAX];
+    int picked;
+
+    if (!sys->probe_target[0] || sys->probe_acked || sys->probe_indirect ||
+        now < sys->probe_sent_us + (uint64_t)sys->gossip_interval_ms * 1000 / 3) {
+        return;
+    }
+    sys->probe_indirect = 1;
+
+    pthread_mutex_lock(&sys->agents_mutex);
+    picked = gossip_pick_locked(addrs, sys->gossip_fanout, sys->probe_target);
+    pthread_mutex_unlock(&sys->agents_mutex);
+
+    for (int i = 0; i < picked; i++) {
+        gossip_send(&addrs[i], MSG_TYPE_GOSSIP_PING_REQ, sys->probe_seq, sys->probe_target, 'a');
+    }
+}
+
+/* One protocol period: judge the last probe, age suspicions, and probe
+   the next member.  Alone, rejoin through the seeds, or with none
+   configured fall back to a broadcast now and then. */
+static void gossip_tick(uint64_t now) {
+    distributed_ai_system_t *sys = g_ai_system;
+    struct sockaddr_in addr;
+    char target[64] = "";
+
+    pthread_mutex_lock(&sys->agents_mutex);
+
+    /* No ack, direct or relayed, in a whole period */
+    if (sys->probe_target[0] && !sys->probe_acked) {
+        ai_agent_t *agent = id_table_find(&sys->agents, sys->probe_target);
+        if (agent && agent->member_state == MEMBER_ALIVE) {
+            member_mark_locked(agent, MEMBER_SUSPECT, now);
+        }
+    }
+    sys->probe_target[0] = '\0';
+
+    for (size_t i = 0; i < sys->agents.count; i++) {
+        ai_agent_t *agent = sys->agents.items[i];
+        if (agent->member_state == MEMBER_SUSPECT && now >= agent->suspect_deadline_us) {
+            member_mark_locked(agent, MEMBER_DEAD, now);
+        }
+    }
+
+    /* Round robin over the live members bounds detection time */
+    for (size_t k = 0; k < sys->agents.count; k++) {
+        ai_agent_t *agent = sys->agents.items[(sys->probe_cursor + k) % sys->agents.count];
+
+        if (agent->member_state != MEMBER_DEAD && gossip_addr_locked(agent, &addr) == 0) {
+            strncpy(target, agent->agent_id, sizeof(target) - 1);
+            sys->probe_cursor += k + 1;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&sys->agents_mutex);
+
+    for (int i = 0; i < GOSSIP_RELAYS; i++) {
+        if (sys->relays[i].seq && now >= sys->relays[i].expires_us) {
+            sys->relays[i].seq = 0;
+        }
+    }
+
+    if (target[0]) {
+        memcpy(sys->probe_target, target, sizeof(target));
+        sys->probe_seq++;
+        if (sys->probe_seq == 0) {
+            sys->probe_seq++;
+        }
+        sys->probe_sent_us = now;
+        sys->probe_acked = 0;
+        sys->probe_indirect = 0;
+        gossip_send(&addr, MSG_TYPE_GOSSIP_PING, sys->probe_seq, target, 'a');
+    } else if (sys->seed_count > 0) {
+        for (int i = 0; i < sys->seed_count; i++) {
+            gossip_send(&sys->seeds[i], MSG_TYPE_GOSSIP_PING, 0, NULL, 'a');
+        }
+    } else if (sys->gossip_periods % GOSSIP_BOOTSTRAP_PERIODS == 0) {
+        unsigned char wire[MAX_WIRE_SIZE];
+        ai_message_t msg;
+        size_t len;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(DISCOVERY_PORT);
+        addr.sin_addr.s_addr = INADDR_BROADCAST;
+
+        create_message(MSG_TYPE_DISCOVERY, NULL, "", &msg);
+        len = pack_message(&msg, wire, sizeof(wire));
+        if (len > 0) {
+            sendto(sys->gossip_fd, wire, len, 0, (struct sockaddr *)&addr, sizeof(addr));
+        }
+    }
+    sys->gossip_periods++;
+}
+
+/* Resolve ANBS_GOSSIP_SEEDS, a comma-separated list of host[:port] */
+static void gossip_resolve_seeds(void) {
+    const char *env = getenv("ANBS_GOSSIP_SEEDS");
+    char list[1024];
+    char *save = NULL;
+
+    if (!env) {
+        return;
+    }
+    strncpy(list, env, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+
+    for (char *seed = strtok_r(list, ", ", &save); seed && g_ai_system->seed_count < GOSSIP_MAX_SEEDS;
+         seed = strtok_r(NULL, ", ", &save)) {
+        struct addrinfo hints, *res = NULL;
+        char *colon = strrchr(seed, ':');
+        char port[16];
+
+        snprintf(port, sizeof(port), "%d", colon ? atoi(colon + 1) : DISCOVERY_PORT);
+        if (colon) {
+            *colon = '\0';
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        if (getaddrinfo(seed, port, &hints, &res) == 0 && res) {
+            memcpy(&g_ai_system->seeds[g_ai_system->seed_count++], res->ai_addr,
+                   sizeof(struct sockaddr_in));
+        } else {
+            ANBS_DEBUG_LOG("Cannot resolve gossip seed %s", seed);
+        }
+        if (res) {
+            freeaddrinfo(res);
+        }
+    }
+}
+
+/* Bind the gossip socket on the first free port from ANBS_GOSSIP_PORT
+   (default DISCOVERY_PORT).  Only the default port hears bootstrap
+   broadcasts. */
+static int gossip_open(void) {
+    const char *env = getenv("ANBS_GOSSIP_PORT");
+    int base = env && atoi(env) > 0 ? atoi(env) : DISCOVERY_PORT;
+
+    for (int port = base; port < base + AGENT_PORT_RANGE; port++) {
+        struct sockaddr_in addr;
+        int broadcast = 1;
+        int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+        if (sock < 0) {
+            return -1;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast));
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            g_ai_system->gossip_fd = sock;
+            g_ai_system->gossip_port = port;
+            return 0;
+        }
+        close(sock);
+    }
+
+    ANBS_DEBUG_LOG("No free gossip port from %d", base);
+    return -1;
+}
+
+/* SWIM membership: each period probe one member, falling back to
+   indirect probes through a few others, and spread what we learn on the
+   back of those messages.  Failures are detected within a few periods
+   plus the suspicion timeout, however many members there are. */
+static void *gossip_thread(void *arg) {
+    distributed_ai_system_t *sys = g_ai_system;
+    unsigned char buffer[MAX_WIRE_SIZE];
+    uint64_t next_tick = agent_now_us();
+    struct sockaddr_in addrs[GOSSIP_FANOUT_MAX];
+    int picked;
+
+    anbs_thread_name("anbs-gossip");
+    gossip_resolve_seeds();
+    ANBS_DEBUG_LOG("Gossip membership on port %d with %d seeds", sys->gossip_port, sys->seed_count);
+
+    while (sys->running) {
+        uint64_t now = agent_now_us();
+        uint64_t wake;
+        struct pollfd pfd = { .fd = sys->gossip_fd, .events = POLLIN };
+
+        if (now >= next_tick) {
+            gossip_tick(now);
+            next_tick = now + (uint64_t)sys->gossip_interval_ms * 1000;
+        }
+        gossip_check_probe(now);
+
+        wake = next_tick;
+        if (sys->probe_target[0] && !sys->probe_acked && !sys->probe_indirect) {
+            uint64_t indirect = sys->probe_sent_us + (uint64_t)sys->gossip_interval_ms * 1000 / 3;
+            if (indirect < wake) {
+                wake = indirect;
+            }
+        }
+
+        if (poll(&pfd, 1, wake > now ? (int)((wake - now) / 1000) + 1 : 0) <= 0) {
+            continue;
+        }
+
+        for (;;) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t bytes = recvfrom(sys->gossip_fd, buffer, sizeof(buffer), MSG_DONTWAIT,
+                                     (struct sockaddr *)&from, &from_len);
+            ai_message_t msg;
+
+            if (bytes <= 0) {
+                break;
+            }
+            if (decode_message(buffer, bytes, &msg) == 0 &&
+                strcmp(msg.sender_id, sys->local_agent_id) != 0) {
+                gossip_receive(&msg, &from);
+            }
+        }
+    }
+
+    /* Leaving: say so rather than make everyone detect it */
+    pthread_mutex_lock(&sys->agents_mutex);
+    picked = gossip_pick_locked(addrs, sys->gossip_fanout, NULL);
+    pthread_mutex_unlock(&sys->agents_mutex);
+    for (int i = 0; i < picked; i++) {
+        gossip_send(&addrs[i], MSG_TYPE_GOSSIP_ACK, 0, NULL, 'd');
+    }
+    return NULL;
+}
 
-                /* TODO: Actually execute the task */
-                snprintf(task->result, sizeof(task->result),
-                        "Task processed by %s: %s", g_ai_system->local_agent_id, msg->payload);
-                task->completed = time(NULL);
-                strcpy(task->status, "completed");
+/* Fail async tasks whose response is overdue, and forget finished tasks
+   nobody is waiting on once TASK_RETAIN_S has passed.  Synchronous
+   submitters time out on their own. */
+static void task_expire(void) {
+    struct expired_task {
+        void (*callback)(const char *result, void *arg);
+        void *arg;
+    } *expired = NULL;
+    time_t now = time(NULL);
+    size_t count = 0;
 
-                /* Send response */
-                ai_message_t response;
-                create_message(MSG_TYPE_TASK_RESPONSE, msg->sender_id, task->result, &response);
-                strncpy(response.session_id, msg->session_id, sizeof(response.session_id) - 1);
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    pthread_mutex_lock(&g_ai_system->tasks_mutex);
 
-                /* TODO: Actually send the response */
-            }
+    if (g_ai_system->tasks.count > 0) {
+        expired = malloc(g_ai_system->tasks.count * sizeof(struct expired_task));
+    }
 
-            pthread_mutex_unlock(&g_ai_system->tasks_mutex);
-            break;
+    for (size_t i = g_ai_system->tasks.count; i-- > 0; ) {
+        task_session_t *task = g_ai_system->tasks.items[i];
+
+        if (strcmp(task->status, "submitted") == 0) {
+            if (task->callback && expired && now - task->created >= TASK_TIMEOUT_S) {
+                strcpy(task->status, "timeout");
+                task->completed = now;
+                task_release_locked(task, 0);
+                expired[count].callback = task->callback;
+                expired[count].arg = task->callback_arg;
+                task->callback = NULL;
+                count++;
+            }
+        } else if (task->waiters == 0 && task->completed && now - task->completed >= TASK_RETAIN_S) {
+            id_table_remove(&g_ai_system->tasks, task);
+            free(task);
         }
+    }
 
-        case MSG_TYPE_TASK_RESPONSE: {
-            /* Response to our task request */
-            pthread_mutex_lock(&g_ai_system->tasks_mutex);
+    pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+    pthread_mutex_unlock(&g_ai_system->agents_mutex);
 
-            for (int i = 0; i < g_ai_system->task_count; i++) {
-                task_session_t *task = &g_ai_system->active_tasks[i];
-                if (strcmp(task->session_id, msg->session_id) == 0) {
-                    strncpy(task->result, msg->payload, sizeof(task->result) - 1);
-                    task->completed = time(NULL);
-                    strcpy(task->status, "completed");
-
-                    if (g_ai_system->display) {
-                        char result_msg[1024];
-                        snprintf(result_msg, sizeof(result_msg),
-                                "🤖 Distributed AI: %s\n", msg->payload);
-                        anbs_ai_chat_write(g_ai_system->display, result_msg);
-                        anbs_display_refresh_panel(g_ai_system->display, ANBS_PANEL_AI_CHAT);
-                    }
-                    break;
-                }
-            }
+    for (size_t i = 0; i < count; i++) {
+        expired[i].callback(NULL, expired[i].arg);
+    }
+    free(expired);
+}
 
-            pthread_mutex_unlock(&g_ai_system->tasks_mutex);
-            break;
-        }
+/* Ask the peer with the longest backlog for one of its waiting tasks.
+   One steal is in flight at a time; its TASK_GRANT clears it. */
+static void task_steal(void) {
+    uint64_t now = agent_now_us();
+    ai_agent_t *victim = NULL;
 
-        case MSG_TYPE_HEARTBEAT: {
-            /* Agent health update */
-            for (int i = 0; i < g_ai_system->agent_count; i++) {
-                if (strcmp(g_ai_system->agents[i].agent_id, msg->sender_id) == 0) {
-                    g_ai_system->agents[i].last_seen = time(NULL);
-                    g_ai_system->agents[i].status = AGENT_STATUS_ONLINE;
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
 
-                    /* Parse heartbeat data */
-                    /* TODO: Parse CPU, memory, task queue info from payload */
-                    break;
-                }
-            }
-            break;
+    if (g_ai_system->steal_sent_us &&
+        now - g_ai_system->steal_sent_us < (uint64_t)STEAL_TIMEOUT_MS * 1000) {
+        pthread_mutex_unlock(&g_ai_system->agents_mutex);
+        return;
+    }
+
+    for (size_t i = 0; i < g_ai_system->agents.count; i++) {
+        ai_agent_t *agent = g_ai_system->agents.items[i];
+        if (agent->status == AGENT_STATUS_ONLINE && agent->backlog > 0 &&
+            (!victim || agent->backlog > victim->backlog)) {
+            victim = agent;
         }
+    }
 
-        default:
-            ANBS_DEBUG_LOG("Unknown message type %d from %s", msg->type, msg->sender_id);
-            break;
+    if (victim) {
+        ai_message_t steal;
+        create_message(MSG_TYPE_TASK_STEAL, victim->agent_id, "", &steal);
+        if (send_message_to_agent(victim, &steal) == 0) {
+            g_ai_system->steal_sent_us = now;
+            victim->backlog--; /* until its grant says otherwise */
+        } else {
+            victim->backlog = 0;
+        }
     }
 
     pthread_mutex_unlock(&g_ai_system->agents_mutex);
 }
 
-/* Discovery thread */
-static void *discovery_thread(void *arg) {
-    int sock;
-    struct sockaddr_in addr, sender_addr;
-    socklen_t sender_len;
-    char buffer[MAX_MESSAGE_SIZE];
+/* Executor thread: runs the tasks peers give us one at a time, in
+   arrival order, and goes stealing whenever the run queue is empty. */
+static void *executor_thread(void *arg) {
+    anbs_thread_name("anbs-executor");
+    pthread_mutex_lock(&g_ai_system->tasks_mutex);
 
-    /* Create UDP socket for discovery */
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        ANBS_DEBUG_LOG("Failed to create discovery socket");
-        return NULL;
-    }
+    while (g_ai_system->running) {
+        task_session_t *task = g_ai_system->run_head;
+
+        if (!task) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += STEAL_INTERVAL_MS / 1000;
+            deadline.tv_nsec += (long)(STEAL_INTERVAL_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&g_ai_system->run_cond, &g_ai_system->tasks_mutex, &deadline);
 
-    int reuse = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (!g_ai_system->run_head && g_ai_system->running) {
+                pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+                task_steal();
+                pthread_mutex_lock(&g_ai_system->tasks_mutex);
+            }
+            continue;
+        }
 
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(DISCOVERY_PORT);
+        char description[sizeof(task->task_description)];
+        char result[sizeof(task->result)];
 
-    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        ANBS_DEBUG_LOG("Failed to bind discovery socket");
-        close(sock);
-        return NULL;
-    }
+        run_unlink_locked(task);
+        memcpy(description, task->task_description, sizeof(description));
+        task->started = time(NULL);
+        strcpy(task->status, "processing");
+        g_ai_system->executing = 1;
+        pthread_mutex_unlock(&g_ai_system->tasks_mutex);
 
-    ANBS_DEBUG_LOG("Discovery thread started on port %d", DISCOVERY_PORT);
+        /* TODO: Actually execute the task */
+        snprintf(result, sizeof(result), "Task processed by %s: %s",
+                 g_ai_system->local_agent_id, description);
 
-    while (g_ai_system && g_ai_system->running) {
-        sender_len = sizeof(sender_addr);
-        int bytes = recvfrom(sock, buffer, sizeof(buffer) - 1, 0,
-                           (struct sockaddr*)&sender_addr, &sender_len);
+        pthread_mutex_lock(&g_ai_system->agents_mutex);
+        pthread_mutex_lock(&g_ai_system->tasks_mutex);
 
-        if (bytes > 0) {
-            buffer[bytes] = '\0';
+        memcpy(task->result, result, sizeof(task->result));
+        task->completed = time(NULL);
+        strcpy(task->status, "completed");
+        g_ai_system->executing = 0;
 
-            ai_message_t msg;
-            if (parse_message(buffer, &msg) == 0) {
-                /* Don't handle our own discovery messages */
-                if (strcmp(msg.sender_id, g_ai_system->local_agent_id) != 0) {
-                    handle_message(&msg);
-                }
-            }
+        /* Reply over the requester's stream */
+        ai_agent_t *requester = id_table_find(&g_ai_system->agents, task->requester);
+        if (requester) {
+            ai_message_t response;
+            create_message(MSG_TYPE_TASK_RESPONSE, requester->agent_id, task->result, &response);
+            strncpy(response.session_id, task->session_id, sizeof(response.session_id) - 1);
+            send_message_to_agent(requester, &response);
         }
 
-        usleep(100000); /* 100ms delay */
+        pthread_mutex_unlock(&g_ai_system->agents_mutex);
     }
 
-    close(sock);
+    pthread_mutex_unlock(&g_ai_system->tasks_mutex);
     return NULL;
 }
 
-/* Coordination thread */
+/* Coordination thread.  Membership is gossip_thread()'s; this exchanges
+   load over the streams and collects garbage. */
 static void *coordination_thread(void *arg) {
+    anbs_thread_name("anbs-coord");
     while (g_ai_system && g_ai_system->running) {
-        /* Send periodic discovery broadcasts */
-        ai_message_t discovery_msg;
         char payload[256];
 
-        snprintf(payload, sizeof(payload),
-                "capabilities=terminal,ai_commands,memory_search,file_analysis;"
-                "status=online");
-
-        create_message(MSG_TYPE_DISCOVERY, NULL, payload, &discovery_msg);
-
-        /* Broadcast discovery */
-        ai_agent_t broadcast_agent = {0};
-        strcpy(broadcast_agent.ip_address, "255.255.255.255");
-        broadcast_agent.port = DISCOVERY_PORT;
-
-        send_message_to_agent(&broadcast_agent, &discovery_msg);
+        /* Anti-entropy: one peer a cycle fills in our @memory */
+        if (g_ai_system->replicate_memory) {
+            replica_pull(NULL);
+        }
 
         /* Send heartbeats to known agents */
         pthread_mutex_lock(&g_ai_system->agents_mutex);
 
-        for (int i = 0; i < g_ai_system->agent_count; i++) {
-            ai_agent_t *agent = &g_ai_system->agents[i];
-
-            if (agent->status == AGENT_STATUS_ONLINE) {
-                time_t now = time(NULL);
+        for (size_t i = g_ai_system->agents.count; i-- > 0; ) {
+            ai_agent_t *agent = g_ai_system->agents.items[i];
+            time_t now = time(NULL);
 
-                /* Check if agent is still alive */
-                if (now - agent->last_seen > 30) {
-                    agent->status = AGENT_STATUS_OFFLINE;
-                    continue;
-                }
+            /* Forget peers that have been gone a while */
+            if (agent->status != AGENT_STATUS_ONLINE && now - agent->last_seen > AGENT_EXPIRE_S) {
+                id_table_remove(&g_ai_system->agents, agent);
+                agent_close_locked(agent);
+                free(agent);
+                continue;
+            }
 
+            if (agent->status == AGENT_STATUS_ONLINE) {
                 /* Send heartbeat */
                 ai_message_t heartbeat;
                 snprintf(payload, sizeof(payload),
-                        "load=%.1f;memory=%.1f;tasks=%d",
-                        agent->cpu_load, agent->memory_usage, agent->task_queue_size);
+                        "load=%.1f;memory=%.1f;tasks=%d;queued=%d;ping=%llu",
+                        agent->cpu_load, agent->memory_usage, agent->task_queue_size,
+                        __atomic_load_n(&g_ai_system->run_length, __ATOMIC_RELAXED),
+                        (unsigned long long)agent_now_us());
 
                 create_message(MSG_TYPE_HEARTBEAT, agent->agent_id, payload, &heartbeat);
                 send_message_to_agent(agent, &heartbeat);
             }
         }
 
-        pthread_mutex_unlock(&g_ai_system->agents_mutex);
-
         /* Update health display */
         if (g_ai_system->display) {
-            for (int i = 0; i < g_ai_system->agent_count; i++) {
-                ai_agent_t *agent = &g_ai_system->agents[i];
+            for (size_t i = 0; i < g_ai_system->agents.count; i++) {
+                ai_agent_t *agent = g_ai_system->agents.items[i];
 
                 health_data_t health;
                 memset(&health, 0, sizeof(health));
 
                 strncpy(health.agent_id, agent->agent_id, sizeof(health.agent_id) - 1);
                 health.online = (agent->status == AGENT_STATUS_ONLINE);
-                health.latency_ms = 50; /* TODO: Measure actual latency */
+                health.latency_ms = (int)(agent->rtt_ms > 0 ? agent->rtt_ms : AGENT_RTT_DEFAULT_MS);
                 health.cpu_load = agent->cpu_load;
                 health.memory_usage = agent->memory_usage;
-                health.commands_processed = 0; /* TODO: Track commands */
-                health.success_rate = 99.0; /* TODO: Calculate actual rate */
+                health.commands_processed = agent->tasks_completed;
+                health.success_rate = agent->success_rate * 100.0;
                 health.last_update = agent->last_seen;
 
                 anbs_health_update(g_ai_system->display, &health);
             }
         }
 
+        pthread_mutex_unlock(&g_ai_system->agents_mutex);
+
+        task_expire();
+
         sleep(10); /* 10 second coordination cycle */
     }
 
@@ -532,6 +2559,7 @@ int anbs_distributed_ai_init(anbs_display_t *display) {
     if (g_ai_system) {
         return 0; /* Already initialized */
     }
+    int startup_slot = anbs_startup_enter("ai_core", "distributed ai");
 
     g_ai_system = calloc(1, sizeof(distributed_ai_system_t));
     if (!g_ai_system) {
@@ -542,11 +2570,54 @@ int anbs_distributed_ai_init(anbs_display_t *display) {
     g_ai_system->display = display;
     g_ai_system->running = 1;
 
+    const char *affinity = getenv("ANBS_AGENT_AFFINITY");
+    g_ai_system->prompt_affinity = affinity && strcmp(affinity, "prompt") == 0;
+
+    const char *env = getenv("ANBS_MEMORY_REPLICATION");
+    g_ai_system->replicate_memory = !env || strcmp(env, "0") != 0;
+
+    env = getenv("ANBS_GOSSIP_INTERVAL_MS");
+    g_ai_system->gossip_interval_ms = env && atoi(env) > 0 ? atoi(env) : GOSSIP_INTERVAL_MS;
+    env = getenv("ANBS_GOSSIP_FANOUT");
+    g_ai_system->gossip_fanout = env && atoi(env) > 0 ? atoi(env) : GOSSIP_FANOUT;
+    if (g_ai_system->gossip_fanout > GOSSIP_FANOUT_MAX) {
+        g_ai_system->gossip_fanout = GOSSIP_FANOUT_MAX;
+    }
+    env = getenv("ANBS_GOSSIP_SUSPECT_MS");
+    g_ai_system->gossip_suspect_ms = env && atoi(env) > 0 ? atoi(env) : GOSSIP_SUSPECT_MS;
+
     pthread_mutex_init(&g_ai_system->agents_mutex, NULL);
     pthread_mutex_init(&g_ai_system->tasks_mutex, NULL);
+    pthread_mutex_init(&g_ai_system->conns_mutex, NULL);
+    pthread_mutex_init(&g_ai_system->links_mutex, NULL);
+
+    /* Task waits measure against the monotonic clock */
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_ai_system->tasks_cond, &cond_attr);
+    pthread_cond_init(&g_ai_system->run_cond, &cond_attr);
+    pthread_cond_init(&g_ai_system->links_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    /* Outbound streams are written by the event loop */
+    g_ai_system->link_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_ai_system->link_wake_fd < 0 ||
+        anbs_event_add(g_ai_system->link_wake_fd, EPOLLIN, link_on_wake, NULL) != 0) {
+        g_ai_system->listen_fd = -1;
+        g_ai_system->gossip_fd = -1;
+        anbs_distributed_ai_cleanup();
+        return -1;
+    }
 
-    /* Start discovery thread */
-    if (pthread_create(&g_ai_system->discovery_thread, NULL, discovery_thread, NULL) != 0) {
+    /* Without a listener we can still reach peers, they just can't reach us */
+    g_ai_system->listen_fd = -1;
+    agent_listen();
+
+    /* Start membership; without a gossip socket no peer can find us */
+    g_ai_system->gossip_fd = -1;
+    if (gossip_open() != 0 ||
+        pthread_create(&g_ai_system->membership_thread, NULL, gossip_thread, NULL) != 0) {
         anbs_distributed_ai_cleanup();
         return -1;
     }
@@ -557,94 +2628,458 @@ int anbs_distributed_ai_init(anbs_display_t *display) {
         return -1;
     }
 
+    /* Start running the tasks peers hand us */
+    if (pthread_create(&g_ai_system->executor_thread, NULL, executor_thread, NULL) != 0) {
+        anbs_distributed_ai_cleanup();
+        return -1;
+    }
+
     ANBS_DEBUG_LOG("Distributed AI system initialized with agent ID: %s", g_ai_system->local_agent_id);
 
     if (display) {
         anbs_status_write(display, "Distributed AI system online - discovering agents...");
     }
 
+    anbs_startup_leave(startup_slot, -1);
     return 0;
 }
 
-/* Submit task to distributed AI network */
-int anbs_distributed_ai_submit_task(const char *task_description, char **result) {
-    if (!g_ai_system || !task_description) {
-        return -1;
+/* Whether AGENT can take another task */
+static int agent_eligible(const ai_agent_t *agent) {
+    return agent->status == AGENT_STATUS_ONLINE && agent->task_queue_size < AGENT_QUEUE_LIMIT;
+}
+
+/* Expected cost of one more task on AGENT: its round trip scaled by the
+   work already queued there, inflated for agents that drop tasks */
+static double agent_cost(const ai_agent_t *agent) {
+    double rtt = agent->rtt_ms > 0 ? agent->rtt_ms : AGENT_RTT_DEFAULT_MS;
+    double success = agent->success_rate > 0.1 ? agent->success_rate : 0.1;
+
+    return rtt * (agent->task_queue_size + 1) / success;
+}
+
+/* Power of two choices: the cheaper of two eligible agents drawn at
+   random, with AGENTS_MUTEX held.  Falls back to a reservoir sample over
+   the whole table when random probes keep missing. */
+static ai_agent_t *agent_pick_locked(void) {
+    size_t count = g_ai_system->agents.count, eligible = 0;
+    ai_agent_t *choice[2];
+    int found = 0;
+
+    if (count == 0) {
+        return NULL;
     }
 
-    /* Find best available agent */
-    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    for (int probe = 0; probe < 8 && found < 2; probe++) {
+        ai_agent_t *agent = g_ai_system->agents.items[agent_random() % count];
+        if (agent_eligible(agent) && (found == 0 || agent != choice[0])) {
+            choice[found++] = agent;
+        }
+    }
+
+    if (found < 2) {
+        found = 0;
+        for (size_t i = 0; i < count; i++) {
+            ai_agent_t *agent = g_ai_system->agents.items[i];
+            if (!agent_eligible(agent)) {
+                continue;
+            }
+            if (found < 2) {
+                choice[found++] = agent;
+            } else {
+                size_t slot = agent_random() % (eligible + 1);
+                if (slot < 2) {
+                    choice[slot] = agent;
+                }
+            }
+            eligible++;
+        }
+    }
+
+    if (found == 0) {
+        return NULL;
+    }
+    if (found == 1 || agent_cost(choice[0]) <= agent_cost(choice[1])) {
+        return choice[0];
+    }
+    return choice[1];
+}
 
-    ai_agent_t *best_agent = NULL;
-    for (int i = 0; i < g_ai_system->agent_count; i++) {
-        ai_agent_t *agent = &g_ai_system->agents[i];
-        if (agent->status == AGENT_STATUS_ONLINE && agent->task_queue_size < 5) {
-            if (!best_agent || agent->task_queue_size < best_agent->task_queue_size) {
-                best_agent = agent;
+/* FNV-1a over a routing key.  Prompt keys are hashed case-folded with
+   whitespace runs collapsed, so trivially different repeats still meet. */
+static uint64_t task_key_hash(const char *key, int normalize) {
+    uint64_t hash = 14695981039346656037ULL;
+    int space = 0;
+
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        unsigned char c = *p;
+
+        if (normalize) {
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                space = 1;
+                continue;
+            }
+            if (space) {
+                hash ^= ' ';
+                hash *= 1099511628211ULL;
+                space = 0;
+            }
+            if (c >= 'A' && c <= 'Z') {
+                c += 'a' - 'A';
             }
         }
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Rendezvous hashing: the online agent scoring highest for KEY_HASH
+   owns the key, so repeats reuse its caches and a membership change
+   only moves the keys of agents that came or went.  A saturated owner
+   hands over to the runner-up, and load-based placement takes over
+   when both are full.  AGENTS_MUTEX is held. */
+static ai_agent_t *agent_pick_for_key_locked(uint64_t key_hash) {
+    ai_agent_t *best = NULL, *second = NULL;
+    uint64_t best_score = 0, second_score = 0;
+
+    for (size_t i = 0; i < g_ai_system->agents.count; i++) {
+        ai_agent_t *agent = g_ai_system->agents.items[i];
+        uint64_t score;
+
+        if (agent->status != AGENT_STATUS_ONLINE) {
+            continue;
+        }
+
+        /* splitmix64 finalizer over the key and agent hashes */
+        score = key_hash ^ (agent->entry.hash * 0x9e3779b97f4a7c15ULL);
+        score = (score ^ (score >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        score = (score ^ (score >> 27)) * 0x94d049bb133111ebULL;
+        score ^= score >> 31;
+
+        if (!best || score > best_score) {
+            second = best;
+            second_score = best_score;
+            best = agent;
+            best_score = score;
+        } else if (!second || score > second_score) {
+            second = agent;
+            second_score = score;
+        }
+    }
+
+    if (best && agent_eligible(best)) {
+        return best;
+    }
+    if (second && agent_eligible(second)) {
+        return second;
+    }
+    return agent_pick_locked();
+}
+
+/* Send TASK_DESCRIPTION to the agent that owns KEY, if given, or else to
+   one chosen by agent_pick_locked().  Returns the
+   task, or NULL with *ERROR set.  A task without CALLBACK counts the
+   caller as a waiter, so it stays allocated until the caller lets go. */
+static task_session_t *task_dispatch(const char *task_description, const char *key,
+                                     void (*callback)(const char *result, void *arg),
+                                     void *arg, const char **error) {
+    uint64_t key_hash = 0;
+
+    /* Callers' keys name a task class exactly; prompts are normalized */
+    if (key) {
+        key_hash = task_key_hash(key, 0);
+    } else if (g_ai_system->prompt_affinity) {
+        key_hash = task_key_hash(task_description, 1);
     }
 
+    /* Find best available agent */
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
+
+    ai_agent_t *best_agent = key_hash ? agent_pick_for_key_locked(key_hash) : agent_pick_locked();
+
     if (!best_agent) {
         pthread_mutex_unlock(&g_ai_system->agents_mutex);
-        *result = strdup("No available AI agents in distributed network");
-        return -1;
+        *error = "No available AI agents in distributed network";
+        return NULL;
     }
 
     /* Create task session */
     pthread_mutex_lock(&g_ai_system->tasks_mutex);
 
-    if (g_ai_system->task_count >= 100) {
+    task_session_t *task = NULL;
+    if (g_ai_system->tasks.count < TASK_TABLE_MAX) {
+        task = calloc(1, sizeof(task_session_t));
+    }
+    if (task) {
+        uuid_t uuid;
+        uuid_generate(uuid);
+        uuid_unparse(uuid, task->session_id);
+        task->entry.id = task->session_id;
+        if (id_table_insert(&g_ai_system->tasks, task) != 0) {
+            free(task);
+            task = NULL;
+        }
+    }
+    if (!task) {
         pthread_mutex_unlock(&g_ai_system->tasks_mutex);
         pthread_mutex_unlock(&g_ai_system->agents_mutex);
-        *result = strdup("Task queue full");
-        return -1;
+        *error = "Task queue full";
+        return NULL;
     }
 
-    task_session_t *task = &g_ai_system->active_tasks[g_ai_system->task_count++];
-    uuid_t uuid;
-    uuid_generate(uuid);
-    uuid_unparse(uuid, task->session_id);
-
     strncpy(task->task_description, task_description, sizeof(task->task_description) - 1);
     strncpy(task->assigned_agent, best_agent->agent_id, sizeof(task->assigned_agent) - 1);
     task->created = time(NULL);
     task->priority = 5;
     strcpy(task->status, "submitted");
+    task->callback = callback;
+    task->callback_arg = arg;
+    task->waiters = callback ? 0 : 1;
 
     /* Send task request */
     ai_message_t task_msg;
     create_message(MSG_TYPE_TASK_REQUEST, best_agent->agent_id, task_description, &task_msg);
     strncpy(task_msg.session_id, task->session_id, sizeof(task_msg.session_id) - 1);
 
-    send_message_to_agent(best_agent, &task_msg);
+    if (send_message_to_agent(best_agent, &task_msg) != 0) {
+        strcpy(task->status, "failed");
+        task->completed = time(NULL);
+        task->callback = NULL;
+        task->waiters = 0;
+        pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+        pthread_mutex_unlock(&g_ai_system->agents_mutex);
+        *error = "Failed to reach the selected AI agent";
+        return NULL;
+    }
 
     best_agent->task_queue_size++;
+    PROBE3(anbs, task__dispatch, task->session_id, best_agent->agent_id, best_agent->task_queue_size);
 
     pthread_mutex_unlock(&g_ai_system->tasks_mutex);
     pthread_mutex_unlock(&g_ai_system->agents_mutex);
+    return task;
+}
 
-    /* Wait for result (simplified - in practice would use callbacks) */
-    int timeout = 30; /* 30 seconds */
-    while (timeout > 0) {
-        pthread_mutex_lock(&g_ai_system->tasks_mutex);
+/* Submit task to distributed AI network and wait for its response.
+   Tasks with the same KEY go to the same agent while it has room; a NULL
+   KEY routes by load, or by the prompt under ANBS_AGENT_AFFINITY=prompt. */
+int anbs_distributed_ai_submit_task_keyed(const char *task_description, const char *key, char **result) {
+    const char *error = NULL;
+    struct timespec deadline;
+    task_session_t *task;
 
-        if (strcmp(task->status, "completed") == 0) {
-            *result = strdup(task->result);
-            pthread_mutex_unlock(&g_ai_system->tasks_mutex);
-            return 0;
+    if (!g_ai_system || !task_description) {
+        return -1;
+    }
+
+    task = task_dispatch(task_description, key, NULL, NULL, &error);
+    if (!task) {
+        *result = strdup(error);
+        return -1;
+    }
+
+    /* handle_message() broadcasts when the response lands */
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += TASK_TIMEOUT_S;
+
+    pthread_mutex_lock(&g_ai_system->tasks_mutex);
+    while (strcmp(task->status, "completed") != 0) {
+        if (pthread_cond_timedwait(&g_ai_system->tasks_cond, &g_ai_system->tasks_mutex, &deadline) == ETIMEDOUT) {
+            break;
         }
+    }
 
+    if (strcmp(task->status, "completed") == 0) {
+        *result = strdup(task->result);
+        task->waiters--;
         pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&g_ai_system->tasks_mutex);
 
-        sleep(1);
-        timeout--;
+    /* Retake the locks in order to hand the agent's queue slot back,
+       unless the response slipped in meanwhile */
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    pthread_mutex_lock(&g_ai_system->tasks_mutex);
+    task->waiters--;
+    if (strcmp(task->status, "submitted") == 0) {
+        strcpy(task->status, "timeout");
+        task->completed = time(NULL);
+        task_release_locked(task, 0);
+    } else if (strcmp(task->status, "completed") == 0) {
+        *result = strdup(task->result);
+        pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+        pthread_mutex_unlock(&g_ai_system->agents_mutex);
+        return 0;
     }
+    pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+    pthread_mutex_unlock(&g_ai_system->agents_mutex);
 
     *result = strdup("Task timeout - no response from distributed AI network");
     return -1;
 }
 
+/* Submit task to distributed AI network and wait for its response */
+int anbs_distributed_ai_submit_task(const char *task_description, char **result) {
+    return anbs_distributed_ai_submit_task_keyed(task_description, NULL, result);
+}
+
+/* Submit task to distributed AI network without waiting.  CALLBACK runs
+   once, on the thread that received the response, with the result or
+   with NULL if the task failed or timed out.  Returns 0 if the task was
+   sent; otherwise CALLBACK is not called. */
+int anbs_distributed_ai_submit_task_async(const char *task_description,
+                                          void (*callback)(const char *result, void *arg),
+                                          void *arg) {
+    const char *error = NULL;
+
+    if (!g_ai_system || !task_description || !callback) {
+        return -1;
+    }
+
+    if (!task_dispatch(task_description, NULL, callback, arg, &error)) {
+        ANBS_DEBUG_LOG("Async task not submitted: %s", error);
+        return -1;
+    }
+    return 0;
+}
+
+/* A failed shard goes back in the queue while it has attempts left */
+static shard_state_t scatter_requeue(const scatter_job_t *job, const scatter_shard_t *shard) {
+    return shard->attempts <= job->retries ? SHARD_QUEUED : SHARD_FAILED;
+}
+
+/* A shard's task finished: keep the answer, or queue the shard again */
+static void scatter_on_result(const char *result, void *arg) {
+    scatter_shard_t *shard = arg;
+    scatter_job_t *job = shard->job;
+
+    pthread_mutex_lock(&job->mutex);
+    shard->result = result ? strdup(result) : NULL;
+    shard->state = shard->result ? SHARD_DONE : scatter_requeue(job, shard);
+    job->running--;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->mutex);
+}
+
+/* Join RESULTS in shard order, marking the shards that failed */
+static char *scatter_merge(const scatter_shard_t *shards, size_t count) {
+    size_t size = 1, offset = 0;
+    char *merged;
+
+    for (size_t i = 0; i < count; i++) {
+        size += 64 + (shards[i].result ? strlen(shards[i].result) : 0);
+    }
+    merged = malloc(size);
+    if (!merged) {
+        return NULL;
+    }
+    merged[0] = '\0';
+
+    for (size_t i = 0; i < count; i++) {
+        if (shards[i].result) {
+            offset += snprintf(merged + offset, size - offset, "### Shard %zu\n%s\n\n",
+                               i + 1, shards[i].result);
+        } else {
+            offset += snprintf(merged + offset, size - offset, "### Shard %zu\n[failed after %d attempts]\n\n",
+                               i + 1, shards[i].attempts);
+        }
+    }
+    return merged;
+}
+
+/* Run COUNT independent SHARDS of one task across the network at once
+   and wait for all of them.  A shard whose agent fails or times out is
+   sent again, up to ANBS_SCATTER_RETRIES more times; placement steers
+   the retry away from agents that have been failing.  RESULTS[i] gets
+   shard i's answer, or NULL if it never got one.  If MERGED is not
+   NULL it gets every answer joined in shard order.  Returns the number
+   of shards that failed, or -1 on bad arguments. */
+int anbs_distributed_ai_scatter_gather(const char *const *shards, size_t count,
+                                       char **results, char **merged) {
+    const char *env = getenv("ANBS_SCATTER_RETRIES");
+    scatter_job_t job;
+    size_t failed = 0;
+    int queued;
+
+    if (!g_ai_system || !shards || !results || count == 0) {
+        return -1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.retries = env && atoi(env) >= 0 ? atoi(env) : SCATTER_RETRIES;
+    job.shards = calloc(count, sizeof(scatter_shard_t));
+    if (!job.shards) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        job.shards[i].job = &job;
+    }
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    /* Async tasks always call back, answered or expired, so waiting for
+       the running count to drain also keeps JOB alive long enough */
+    pthread_mutex_lock(&job.mutex);
+    for (;;) {
+        queued = 0;
+        for (size_t i = 0; i < count; i++) {
+            scatter_shard_t *shard = &job.shards[i];
+            const char *error = NULL;
+
+            if (shard->state != SHARD_QUEUED) {
+                continue;
+            }
+            shard->state = SHARD_RUNNING;
+            shard->attempts++;
+            job.running++;
+            pthread_mutex_unlock(&job.mutex);
+
+            task_session_t *task = task_dispatch(shards[i], NULL, scatter_on_result, shard, &error);
+
+            pthread_mutex_lock(&job.mutex);
+            if (!task) {
+                ANBS_DEBUG_LOG("Shard %zu not sent: %s", i + 1, error);
+                job.running--;
+                shard->state = scatter_requeue(&job, shard);
+            }
+            queued |= shard->state == SHARD_QUEUED;
+        }
+
+        /* Answers that came back meanwhile may have requeued shards */
+        for (size_t i = 0; i < count && !queued; i++) {
+            queued = job.shards[i].state == SHARD_QUEUED;
+        }
+        if (queued) {
+            continue;
+        }
+        if (job.running == 0) {
+            break;
+        }
+        pthread_cond_wait(&job.cond, &job.mutex);
+    }
+    pthread_mutex_unlock(&job.mutex);
+
+    for (size_t i = 0; i < count; i++) {
+        results[i] = job.shards[i].result;
+        if (!results[i]) {
+            failed++;
+        }
+    }
+    if (merged) {
+        *merged = scatter_merge(job.shards, count);
+    }
+    if (failed) {
+        ANBS_DEBUG_LOG("Scatter-gather: %zu of %zu shards failed", failed, count);
+    }
+
+    pthread_mutex_destroy(&job.mutex);
+    pthread_cond_destroy(&job.cond);
+    free(job.shards);
+    return (int)failed;
+}
+
 /* Get distributed AI network status */
 int anbs_distributed_ai_get_status(char **status_report) {
     if (!g_ai_system) {
@@ -658,28 +3093,34 @@ int anbs_distributed_ai_get_status(char **status_report) {
                       "Distributed AI Network Status\n");
     offset += snprintf(report + offset, sizeof(report) - offset,
                       "Local Agent ID: %s\n", g_ai_system->local_agent_id);
-    offset += snprintf(report + offset, sizeof(report) - offset,
-                      "Connected Agents: %d\n\n", g_ai_system->agent_count);
 
     pthread_mutex_lock(&g_ai_system->agents_mutex);
 
-    for (int i = 0; i < g_ai_system->agent_count; i++) {
-        ai_agent_t *agent = &g_ai_system->agents[i];
+    offset += snprintf(report + offset, sizeof(report) - offset,
+                      "Connected Agents: %zu\n\n", g_ai_system->agents.count);
+
+    /* Stop listing agents once the report is full */
+    for (size_t i = 0; i < g_ai_system->agents.count && offset < (int)sizeof(report) - 512; i++) {
+        ai_agent_t *agent = g_ai_system->agents.items[i];
         const char *status_str = "";
 
         switch (agent->status) {
             case AGENT_STATUS_OFFLINE: status_str = "OFFLINE"; break;
             case AGENT_STATUS_DISCOVERING: status_str = "DISCOVERING"; break;
             case AGENT_STATUS_CONNECTING: status_str = "CONNECTING"; break;
-            case AGENT_STATUS_ONLINE: status_str = "ONLINE"; break;
+            case AGENT_STATUS_ONLINE:
+                status_str = agent->member_state == MEMBER_SUSPECT ? "SUSPECT" : "ONLINE";
+                break;
             case AGENT_STATUS_BUSY: status_str = "BUSY"; break;
             case AGENT_STATUS_ERROR: status_str = "ERROR"; break;
         }
 
         offset += snprintf(report + offset, sizeof(report) - offset,
-                          "Agent: %s\n  Status: %s\n  Last Seen: %ld seconds ago\n  Load: %.1f%%\n\n",
+                          "Agent: %s\n  Status: %s\n  Last Seen: %ld seconds ago\n  Load: %.1f%%\n"
+                          "  RTT: %.1f ms\n  Success: %.0f%%\n\n",
                           agent->agent_id, status_str,
-                          time(NULL) - agent->last_seen, agent->cpu_load);
+                          time(NULL) - agent->last_seen, agent->cpu_load,
+                          agent->rtt_ms, agent->success_rate * 100.0);
     }
 
     pthread_mutex_unlock(&g_ai_system->agents_mutex);
@@ -687,12 +3128,12 @@ int anbs_distributed_ai_get_status(char **status_report) {
     pthread_mutex_lock(&g_ai_system->tasks_mutex);
 
     offset += snprintf(report + offset, sizeof(report) - offset,
-                      "Active Tasks: %d\n", g_ai_system->task_count);
+                      "Active Tasks: %zu\n", g_ai_system->tasks.count);
 
-    for (int i = 0; i < g_ai_system->task_count && i < 10; i++) {
-        task_session_t *task = &g_ai_system->active_tasks[i];
+    for (size_t i = 0; i < g_ai_system->tasks.count && i < 10 && offset < (int)sizeof(report) - 600; i++) {
+        task_session_t *task = g_ai_system->tasks.items[i];
         offset += snprintf(report + offset, sizeof(report) - offset,
-                          "  Task %d: %s (%s)\n", i + 1, task->task_description, task->status);
+                          "  Task %zu: %s (%s)\n", i + 1, task->task_description, task->status);
     }
 
     pthread_mutex_unlock(&g_ai_system->tasks_mutex);
@@ -701,6 +3142,47 @@ int anbs_distributed_ai_get_status(char **status_report) {
     return 0;
 }
 
+/* Write the agent network's OpenMetrics families to OUT */
+int anbs_distributed_ai_export_metrics(FILE *out) {
+    static const char *const status_labels[] = {
+        "status=\"offline\"", "status=\"discovering\"", "status=\"connecting\"",
+        "status=\"online\"", "status=\"busy\"", "status=\"error\""
+    };
+    int by_status[AGENT_STATUS_ERROR + 1] = { 0 };
+    size_t task_count;
+    unsigned long stolen, granted;
+
+    if (!g_ai_system || !out) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    for (size_t i = 0; i < g_ai_system->agents.count; i++) {
+        ai_agent_t *agent = g_ai_system->agents.items[i];
+        if (agent->status <= AGENT_STATUS_ERROR) {
+            by_status[agent->status]++;
+        }
+    }
+    pthread_mutex_unlock(&g_ai_system->agents_mutex);
+
+    pthread_mutex_lock(&g_ai_system->tasks_mutex);
+    task_count = g_ai_system->tasks.count;
+    stolen = g_ai_system->tasks_stolen;
+    granted = g_ai_system->tasks_granted;
+    pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+
+    anbs_metrics_export_family(out, "anbs_agents", "gauge", "Known AI agents, by status");
+    for (int i = 0; i <= AGENT_STATUS_ERROR; i++) {
+        anbs_metrics_export_sample(out, "anbs_agents", status_labels[i], by_status[i]);
+    }
+    anbs_metrics_export_family(out, "anbs_agent_tasks", "gauge", "Distributed tasks being tracked");
+    anbs_metrics_export_sample(out, "anbs_agent_tasks", NULL, task_count);
+    anbs_metrics_export_family(out, "anbs_agent_steals_total", "counter", "Queued tasks moved between agents");
+    anbs_metrics_export_sample(out, "anbs_agent_steals_total", "direction=\"in\"", (double)stolen);
+    anbs_metrics_export_sample(out, "anbs_agent_steals_total", "direction=\"out\"", (double)granted);
+    return 0;
+}
+
 /* Cleanup distributed AI system */
 void anbs_distributed_ai_cleanup(void) {
     if (!g_ai_system) {
@@ -712,8 +3194,8 @@ void anbs_distributed_ai_cleanup(void) {
     /* Send shutdown messages to agents */
     pthread_mutex_lock(&g_ai_system->agents_mutex);
 
-    for (int i = 0; i < g_ai_system->agent_count; i++) {
-        ai_agent_t *agent = &g_ai_system->agents[i];
+    for (size_t i = 0; i < g_ai_system->agents.count; i++) {
+        ai_agent_t *agent = g_ai_system->agents.items[i];
         if (agent->status == AGENT_STATUS_ONLINE) {
             ai_message_t shutdown_msg;
             create_message(MSG_TYPE_SHUTDOWN, agent->agent_id, "System shutting down", &shutdown_msg);
@@ -724,16 +3206,87 @@ void anbs_distributed_ai_cleanup(void) {
     pthread_mutex_unlock(&g_ai_system->agents_mutex);
 
     /* Wait for threads to finish */
-    if (g_ai_system->discovery_thread) {
-        pthread_join(g_ai_system->discovery_thread, NULL);
+    if (g_ai_system->membership_thread) {
+        pthread_join(g_ai_system->membership_thread, NULL);
+    }
+    if (g_ai_system->gossip_fd >= 0) {
+        close(g_ai_system->gossip_fd);
     }
 
     if (g_ai_system->coordination_thread) {
         pthread_join(g_ai_system->coordination_thread, NULL);
     }
 
+    if (g_ai_system->executor_thread) {
+        pthread_mutex_lock(&g_ai_system->tasks_mutex);
+        pthread_cond_broadcast(&g_ai_system->run_cond);
+        pthread_mutex_unlock(&g_ai_system->tasks_mutex);
+        pthread_join(g_ai_system->executor_thread, NULL);
+    }
+
+    /* Stop accepting, then take the inbound streams from the loop */
+    if (g_ai_system->listen_fd >= 0) {
+        anbs_event_remove(g_ai_system->listen_fd);
+        close(g_ai_system->listen_fd);
+    }
+    pthread_mutex_lock(&g_ai_system->conns_mutex);
+    agent_conn_t *conn = g_ai_system->conns;
+    g_ai_system->conns = NULL;
+    pthread_mutex_unlock(&g_ai_system->conns_mutex);
+    while (conn) {
+        agent_conn_t *next = conn->next;
+        anbs_event_remove(conn->fd);
+        agent_conn_free(conn);
+        conn = next;
+    }
+
+    pthread_mutex_lock(&g_ai_system->agents_mutex);
+    for (size_t i = 0; i < g_ai_system->agents.count; i++) {
+        ai_agent_t *agent = g_ai_system->agents.items[i];
+        agent_close_locked(agent);
+        free(agent);
+    }
+    id_table_free(&g_ai_system->agents);
+    pthread_mutex_unlock(&g_ai_system->agents_mutex);
+
+    /* Give the loop a moment to flush and free the closing links, then
+       take back whatever it didn't get to */
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += AGENT_IO_TIMEOUT_S;
+    pthread_mutex_lock(&g_ai_system->links_mutex);
+    while (g_ai_system->links && g_ai_system->link_wake_fd >= 0 &&
+           pthread_cond_timedwait(&g_ai_system->links_cond, &g_ai_system->links_mutex, &deadline) == 0) {
+    }
+    pthread_mutex_unlock(&g_ai_system->links_mutex);
+
+    if (g_ai_system->link_wake_fd >= 0) {
+        anbs_event_remove(g_ai_system->link_wake_fd);
+        close(g_ai_system->link_wake_fd);
+    }
+    while (g_ai_system->links) {
+        agent_link_t *link = g_ai_system->links;
+        g_ai_system->links = link->next;
+        link_free(link);
+    }
+
+    /* Nothing can answer outstanding async tasks now */
+    for (size_t i = 0; i < g_ai_system->tasks.count; i++) {
+        task_session_t *task = g_ai_system->tasks.items[i];
+        if (task->callback) {
+            task->callback(NULL, task->callback_arg);
+        }
+        free(task);
+    }
+    id_table_free(&g_ai_system->tasks);
+
     pthread_mutex_destroy(&g_ai_system->agents_mutex);
     pthread_mutex_destroy(&g_ai_system->tasks_mutex);
+    pthread_mutex_destroy(&g_ai_system->conns_mutex);
+    pthread_mutex_destroy(&g_ai_system->links_mutex);
+    pthread_cond_destroy(&g_ai_system->tasks_cond);
+    pthread_cond_destroy(&g_ai_system->run_cond);
+    pthread_cond_destroy(&g_ai_system->links_cond);
 
     free(g_ai_system);
     g_ai_system = NULL;
@@ -0,0 +1,585 @@
+/* embedder.c - Pluggable text embedders for the ANBS memory system */
+
+#include "ai_display.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <curl/curl.h>
+#include <json-c/json.h>
+
+/* ANBS_EMBEDDER picks the model that turns memories and queries into
+   vectors:
+
+     features        character and keyword counts; no model, the default
+     plugin:PATH     a shared object running a local model (ONNX Runtime,
+                     ggml, ...) behind the small ABI below
+     http            an OpenAI-compatible /v1/embeddings endpoint
+
+   Each embedder declares its dimension, whether its vectors come out at
+   unit length, how many texts one inference call takes and how many
+   calls may run at once.  anbs_embedder_embed() cuts its input into
+   batches of that size and, when there is more than one, runs them on
+   the worker pool with the caller taking batches too.  An embedder that
+   cannot be opened falls back to features, so a missing model costs
+   search quality and nothing else.
+
+   A plugin exports, with C linkage:
+
+     int anbs_embed_dimension(void);                             required
+     int anbs_embed_batch(const char *const *texts, int count,
+                          float *out);                           required
+     int anbs_embed_open(const char *model);                     optional
+     int anbs_embed_normalized(void);                            optional
+     int anbs_embed_max_batch(void);                             optional
+     int anbs_embed_threads(void);                               optional
+     void anbs_embed_close(void);                                optional
+
+   anbs_embed_open() gets ANBS_EMBED_MODEL (or NULL) and returns 0 once
+   the model is loaded.  anbs_embed_batch() writes COUNT rows of
+   dimension floats to OUT and returns 0, or -1 if the batch failed.
+   Unless anbs_embed_threads() says more, calls are never concurrent. */
+#define EMBED_MAX_DIMENSION 4096
+#define EMBED_MAX_THREADS 16
+#define FEATURES_DIMENSION 288      /* 285 features, padded to 16 floats */
+#define FEATURES_BATCH 256
+#define PLUGIN_DEFAULT_BATCH 32
+#define HTTP_DEFAULT_URL "https://api.openai.com/v1/embeddings"
+#define HTTP_DEFAULT_MODEL "text-embedding-3-small"
+#define HTTP_BATCH 64               /* inputs per request */
+#define HTTP_PARALLEL 4             /* requests in flight */
+#define HTTP_TIMEOUT_MS 10000
+
+/* Shared worker pool from performance/optimize.c */
+extern int anbs_optimize_submit(void (*run)(void *arg), void *arg);
+
+typedef struct anbs_embedder anbs_embedder_t;
+
+struct anbs_embedder {
+    char id[64];                /* names the vector space; "features" for the built-in one */
+    int dimension;
+    int normalized;             /* vectors come out at unit length */
+    int max_batch;              /* texts per inference call */
+    int parallel;               /* inference calls that may run at once */
+    int (*embed)(anbs_embedder_t *e, const char *const *texts, int count, float *out);
+    void (*close)(anbs_embedder_t *e);
+    void *state;
+};
+
+/* Models the http embedder knows the shape of; any other needs
+   ANBS_EMBED_DIM */
+static const struct {
+    const char *model;
+    int dimension;
+    int normalized;
+    int shortens;               /* takes a "dimensions" parameter */
+} http_models[] = {
+    { "text-embedding-3-small", 1536, 1, 1 },
+    { "text-embedding-3-large", 3072, 1, 1 },
+    { "text-embedding-ada-002", 1536, 1, 0 },
+    { "nomic-embed-text", 768, 0, 0 },
+    { "all-minilm", 384, 0, 0 },
+    { "mxbai-embed-large", 1024, 0, 0 },
+};
+
+/* Built-in embedder */
+
+/* Simple text embedding using character frequency analysis.  Only the
+   first 285 of its FEATURES_DIMENSION features are ever set. */
+static void generate_simple_embedding(const char *text, float *embedding) {
+    /* Clear embedding */
+    memset(embedding, 0, FEATURES_DIMENSION * sizeof(float));
+
+    int len = strlen(text);
+    if (len == 0) return;
+
+    /* Character frequency analysis */
+    int char_freq[256] = {0};
+    for (int i = 0; i < len; i++) {
+        char_freq[(unsigned char)text[i]]++;
+    }
+
+    /* Normalize frequencies and map to embedding space */
+    for (int i = 0; i < 256 && i < FEATURES_DIMENSION; i++) {
+        embedding[i] = (float)char_freq[i] / len;
+    }
+
+    /* Add word length features */
+    int word_count = 1;
+    int total_word_len = 0;
+    int current_word_len = 0;
+
+    for (int i = 0; i < len; i++) {
+        if (isspace(text[i])) {
+            if (current_word_len > 0) {
+                total_word_len += current_word_len;
+                word_count++;
+                current_word_len = 0;
+            }
+        } else {
+            current_word_len++;
+        }
+    }
+    if (current_word_len > 0) {
+        total_word_len += current_word_len;
+    }
+
+    /* Add statistical features to embedding */
+    if (FEATURES_DIMENSION > 256) {
+        embedding[256] = (float)word_count / len;  /* Word density */
+        embedding[257] = (float)total_word_len / word_count;  /* Average word length */
+        embedding[258] = len > 100 ? 1.0 : (float)len / 100;  /* Text length feature */
+    }
+
+    /* Add semantic features based on common programming terms */
+    const char *prog_keywords[] = {
+        "function", "class", "variable", "loop", "if", "else", "return",
+        "import", "export", "const", "let", "var", "async", "await",
+        "bash", "shell", "command", "script", "file", "directory",
+        "error", "debug", "fix", "issue", "problem", "solution"
+    };
+
+    int prog_keyword_count = sizeof(prog_keywords) / sizeof(prog_keywords[0]);
+    for (int i = 0; i < prog_keyword_count && (259 + i) < FEATURES_DIMENSION; i++) {
+        if (strstr(text, prog_keywords[i])) {
+            embedding[259 + i] = 1.0;
+        }
+    }
+}
+
+static int features_embed(anbs_embedder_t *e, const char *const *texts, int count, float *out) {
+    for (int i = 0; i < count; i++) {
+        generate_simple_embedding(texts[i] ? texts[i] : "", out + (size_t)i * e->dimension);
+    }
+    return 0;
+}
+
+static void features_open(anbs_embedder_t *e) {
+    snprintf(e->id, sizeof(e->id), "features");
+    e->dimension = FEATURES_DIMENSION;
+    e->normalized = 0;
+    e->max_batch = FEATURES_BATCH;
+    e->parallel = 1;
+    e->embed = features_embed;
+    e->close = NULL;
+    e->state = NULL;
+}
+
+/* Plugin embedder */
+
+typedef struct {
+    void *handle;
+    int (*batch)(const char *const *texts, int count, float *out);
+    void (*close)(void);
+} plugin_state_t;
+
+static int plugin_embed(anbs_embedder_t *e, const char *const *texts, int count, float *out) {
+    plugin_state_t *plugin = e->state;
+
+    return plugin->batch(texts, count, out) == 0 ? 0 : -1;
+}
+
+static void plugin_close(anbs_embedder_t *e) {
+    plugin_state_t *plugin = e->state;
+
+    if (plugin->close) {
+        plugin->close();
+    }
+    dlclose(plugin->handle);
+    free(plugin);
+}
+
+static int plugin_open(anbs_embedder_t *e, const char *path) {
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        ANBS_DEBUG_LOG("Embedder plugin %s: %s", path, dlerror());
+        return -1;
+    }
+
+    int (*open_model)(const char *) = (int (*)(const char *))dlsym(handle, "anbs_embed_open");
+    int (*dimension)(void) = (int (*)(void))dlsym(handle, "anbs_embed_dimension");
+    int (*normalized)(void) = (int (*)(void))dlsym(handle, "anbs_embed_normalized");
+    int (*max_batch)(void) = (int (*)(void))dlsym(handle, "anbs_embed_max_batch");
+    int (*threads)(void) = (int (*)(void))dlsym(handle, "anbs_embed_threads");
+    plugin_state_t *plugin = calloc(1, sizeof(plugin_state_t));
+
+    if (plugin) {
+        plugin->handle = handle;
+        plugin->batch = (int (*)(const char *const *, int, float *))dlsym(handle, "anbs_embed_batch");
+        plugin->close = (void (*)(void))dlsym(handle, "anbs_embed_close");
+    }
+    if (!plugin || !dimension || !plugin->batch) {
+        ANBS_DEBUG_LOG("Embedder plugin %s lacks anbs_embed_dimension or anbs_embed_batch", path);
+        free(plugin);
+        dlclose(handle);
+        return -1;
+    }
+
+    const char *model = getenv("ANBS_EMBED_MODEL");
+    if (open_model && open_model(model && *model ? model : NULL) != 0) {
+        ANBS_DEBUG_LOG("Embedder plugin %s could not load %s", path, model ? model : "its model");
+        free(plugin);
+        dlclose(handle);
+        return -1;
+    }
+
+    const char *base = strrchr(path, '/');
+    snprintf(e->id, sizeof(e->id), "plugin:%s%s%s", base ? base + 1 : path,
+             model && *model ? ":" : "", model && *model ? model : "");
+    e->dimension = dimension();
+    e->normalized = normalized ? normalized() != 0 : 0;
+    e->max_batch = max_batch && max_batch() > 0 ? max_batch() : PLUGIN_DEFAULT_BATCH;
+    e->parallel = threads && threads() > 0 ? threads() : 1;
+    e->embed = plugin_embed;
+    e->close = plugin_close;
+    e->state = plugin;
+    return 0;
+}
+
+/* Remote embedder */
+
+typedef struct {
+    char url[512];
+    char model[128];
+    char *auth;                 /* "Authorization: Bearer ..." or NULL */
+    int dimensions;             /* sent as "dimensions", or 0 */
+} http_state_t;
+
+typedef struct {
+    char *data;
+    size_t size;
+} http_body_t;
+
+static size_t http_write(void *data, size_t size, size_t nmemb, void *arg) {
+    http_body_t *body = arg;
+    size_t bytes = size * nmemb;
+    char *grown = realloc(body->data, body->size + bytes + 1);
+
+    if (!grown) {
+        return 0;
+    }
+    memcpy(grown + body->size, data, bytes);
+    body->data = grown;
+    body->size += bytes;
+    body->data[body->size] = '\0';
+    return bytes;
+}
+
+/* One handle per thread keeps its connection to the endpoint open
+   between batches */
+static __thread CURL *t_http_curl;
+
+static int http_embed(anbs_embedder_t *e, const char *const *texts, int count, float *out) {
+    http_state_t *http = e->state;
+    CURL *curl = t_http_curl ? t_http_curl : (t_http_curl = curl_easy_init());
+
+    if (!curl) {
+        return -1;
+    }
+
+    json_object *request = json_object_new_object();
+    json_object *input = json_object_new_array();
+    for (int i = 0; i < count; i++) {
+        json_object_array_add(input, json_object_new_string(texts[i] ? texts[i] : ""));
+    }
+    json_object_object_add(request, "model", json_object_new_string(http->model));
+    json_object_object_add(request, "input", input);
+    if (http->dimensions > 0) {
+        json_object_object_add(request, "dimensions", json_object_new_int(http->dimensions));
+    }
+
+    struct curl_slist *headers = curl_slist_append(NULL, "Content-Type: application/json");
+    if (http->auth) {
+        headers = curl_slist_append(headers, http->auth);
+    }
+
+    http_body_t body = { NULL, 0 };
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, http->url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_object_to_json_string_ext(request, JSON_C_TO_STRING_PLAIN));
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)HTTP_TIMEOUT_MS);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+    long status = 0;
+    CURLcode rc = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_slist_free_all(headers);
+    json_object_put(request);
+
+    int filled = 0;
+    json_object *response = rc == CURLE_OK && status == 200 && body.data ? json_tokener_parse(body.data) : NULL;
+    json_object *data;
+    if (response && json_object_object_get_ex(response, "data", &data) &&
+        json_object_is_type(data, json_type_array)) {
+        int rows = (int)json_object_array_length(data);
+        for (int r = 0; r < rows; r++) {
+            json_object *item = json_object_array_get_idx(data, r);
+            json_object *index, *embedding;
+            int i = item && json_object_object_get_ex(item, "index", &index) ? json_object_get_int(index) : r;
+
+            if (i < 0 || i >= count || !json_object_object_get_ex(item, "embedding", &embedding) ||
+                (int)json_object_array_length(embedding) != e->dimension) {
+                continue;
+            }
+            for (int d = 0; d < e->dimension; d++) {
+                out[(size_t)i * e->dimension + d] =
+                    (float)json_object_get_double(json_object_array_get_idx(embedding, d));
+            }
+            filled++;
+        }
+    } else {
+        ANBS_DEBUG_LOG("Embedding request to %s failed: %s, status %ld", http->url,
+                       curl_easy_strerror(rc), status);
+    }
+    json_object_put(response);
+    free(body.data);
+    return filled == count ? 0 : -1;
+}
+
+static void http_close(anbs_embedder_t *e) {
+    http_state_t *http = e->state;
+
+    free(http->auth);
+    free(http);
+}
+
+static int http_open(anbs_embedder_t *e) {
+    const char *url = getenv("ANBS_EMBED_URL");
+    const char *model = getenv("ANBS_EMBED_MODEL");
+    const char *dim = getenv("ANBS_EMBED_DIM");
+    const char *key = getenv("ANBS_EMBED_KEY");
+    http_state_t *http = calloc(1, sizeof(http_state_t));
+
+    if (!http) {
+        return -1;
+    }
+    if (!key || !*key) {
+        key = getenv("OPENAI_API_KEY");
+    }
+    snprintf(http->url, sizeof(http->url), "%s", url && *url ? url : HTTP_DEFAULT_URL);
+    snprintf(http->model, sizeof(http->model), "%s", model && *model ? model : HTTP_DEFAULT_MODEL);
+
+    /* Ollama names tags "model:tag"; the shape belongs to the model */
+    size_t name = strcspn(http->model, ":");
+    int known = -1;
+    for (size_t i = 0; i < sizeof(http_models) / sizeof(http_models[0]); i++) {
+        if (strlen(http_models[i].model) == name && strncmp(http->model, http_models[i].model, name) == 0) {
+            known = (int)i;
+            break;
+        }
+    }
+
+    e->dimension = dim && atoi(dim) > 0 ? atoi(dim) : known >= 0 ? http_models[known].dimension : 0;
+    if (e->dimension <= 0) {
+        ANBS_DEBUG_LOG("Embedding model %s needs ANBS_EMBED_DIM", http->model);
+        free(http);
+        return -1;
+    }
+    if (known >= 0 && e->dimension != http_models[known].dimension) {
+        if (!http_models[known].shortens) {
+            ANBS_DEBUG_LOG("Embedding model %s has %d dimensions, not %d", http->model,
+                           http_models[known].dimension, e->dimension);
+            free(http);
+            return -1;
+        }
+        http->dimensions = e->dimension;
+    }
+    if (key && *key && (http->auth = malloc(strlen(key) + 23))) {
+        sprintf(http->auth, "Authorization: Bearer %s", key);
+    }
+
+    snprintf(e->id, sizeof(e->id), "http:%s:%d", http->model, e->dimension);
+    e->normalized = known >= 0 && http_models[known].normalized;
+    e->max_batch = HTTP_BATCH;
+    e->parallel = HTTP_PARALLEL;
+    e->embed = http_embed;
+    e->close = http_close;
+    e->state = http;
+    return 0;
+}
+
+/* Open the embedder SPEC names, as ANBS_EMBEDDER does; NULL or anything
+   unusable gives the built-in one */
+anbs_embedder_t *anbs_embedder_open(const char *spec) {
+    anbs_embedder_t *e = calloc(1, sizeof(anbs_embedder_t));
+    int rc = -1;
+
+    if (!e) {
+        return NULL;
+    }
+    if (spec && strncmp(spec, "plugin:", 7) == 0) {
+        rc = plugin_open(e, spec + 7);
+    } else if (spec && strcmp(spec, "http") == 0) {
+        rc = http_open(e);
+    } else if (spec && *spec && strcmp(spec, "features") != 0) {
+        ANBS_DEBUG_LOG("Unknown embedder %s", spec);
+    }
+
+    if (rc == 0 && (e->dimension <= 0 || e->dimension > EMBED_MAX_DIMENSION)) {
+        ANBS_DEBUG_LOG("Embedder %s has unusable dimension %d", e->id, e->dimension);
+        if (e->close) {
+            e->close(e);
+        }
+        rc = -1;
+    }
+    if (rc != 0) {
+        features_open(e);
+    }
+    if (e->parallel > EMBED_MAX_THREADS) {
+        e->parallel = EMBED_MAX_THREADS;
+    }
+
+    ANBS_DEBUG_LOG("Embedder %s: %d dimensions, batches of %d, %d at once",
+                   e->id, e->dimension, e->max_batch, e->parallel);
+    return e;
+}
+
+void anbs_embedder_close(anbs_embedder_t *e) {
+    if (e) {
+        if (e->close) {
+            e->close(e);
+        }
+        free(e);
+    }
+}
+
+const char *anbs_embedder_id(const anbs_embedder_t *e) {
+    return e->id;
+}
+
+int anbs_embedder_dimension(const anbs_embedder_t *e) {
+    return e->dimension;
+}
+
+bool anbs_embedder_normalized(const anbs_embedder_t *e) {
+    return e->normalized != 0;
+}
+
+/* Batches of one anbs_embedder_embed() call, claimed in turn by the
+   caller and the pool tasks helping it.  The caller waits for the
+   batches rather than the tasks, so a task the pool has yet to start
+   never holds it up; the last holder frees the job. */
+typedef struct {
+    anbs_embedder_t *e;
+    const char *const *texts;
+    int count;
+    float *out;
+    int stride;
+    int batches;
+    int next;                   /* first unclaimed batch */
+    int finished;               /* batches embedded or failed */
+    int failed;
+    int refs;                   /* the caller and each submitted task */
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} embed_job_t;
+
+static void embed_job_release(embed_job_t *job) {
+    if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&job->mutex);
+        pthread_cond_destroy(&job->done);
+        free(job);
+    }
+}
+
+/* Run claimed batches until none are left */
+static void embed_job_run(embed_job_t *job) {
+    anbs_embedder_t *e = job->e;
+    float *scratch = NULL;
+
+    for (;;) {
+        int b = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (b >= job->batches) {
+            break;
+        }
+
+        int first = b * e->max_batch;
+        int n = job->count - first < e->max_batch ? job->count - first : e->max_batch;
+        float *rows = job->out + (size_t)first * job->stride;
+        float *out = rows;
+        int failed = 0;
+
+        if (job->stride != e->dimension) {
+            if (!scratch) {
+                scratch = malloc((size_t)e->max_batch * e->dimension * sizeof(float));
+            }
+            out = scratch;
+        }
+        if (!out || e->embed(e, job->texts + first, n, out) != 0) {
+            memset(rows, 0, (size_t)n * job->stride * sizeof(float));
+            failed = 1;
+        } else if (out == scratch) {
+            for (int i = 0; i < n; i++) {
+                float *row = rows + (size_t)i * job->stride;
+                memcpy(row, scratch + (size_t)i * e->dimension, e->dimension * sizeof(float));
+                memset(row + e->dimension, 0, (job->stride - e->dimension) * sizeof(float));
+            }
+        }
+
+        pthread_mutex_lock(&job->mutex);
+        job->failed |= failed;
+        if (++job->finished == job->batches) {
+            pthread_cond_signal(&job->done);
+        }
+        pthread_mutex_unlock(&job->mutex);
+    }
+    free(scratch);
+}
+
+static void embed_job_task(void *arg) {
+    embed_job_run(arg);
+    embed_job_release(arg);
+}
+
+/* Embed COUNT texts into the rows of OUT, STRIDE floats apart; a row
+   wider than the embedder is zero-padded.  Rows of a batch that fails
+   are zero.  Returns 0, or -1 if any batch failed. */
+int anbs_embedder_embed(anbs_embedder_t *e, const char *const *texts, int count, float *out, int stride) {
+    if (!e || !texts || !out || count < 0 || stride < e->dimension) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    embed_job_t *job = calloc(1, sizeof(embed_job_t));
+    if (!job) {
+        return -1;
+    }
+    job->e = e;
+    job->texts = texts;
+    job->count = count;
+    job->out = out;
+    job->stride = stride;
+    job->batches = (count + e->max_batch - 1) / e->max_batch;
+    job->refs = 1;
+    pthread_mutex_init(&job->mutex, NULL);
+    pthread_cond_init(&job->done, NULL);
+
+    int helpers = (job->batches < e->parallel ? job->batches : e->parallel) - 1;
+    for (int i = 0; i < helpers; i++) {
+        __atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+        if (anbs_optimize_submit(embed_job_task, job) != 0) {
+            __atomic_sub_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    embed_job_run(job);
+
+    pthread_mutex_lock(&job->mutex);
+    while (job->finished < job->batches) {
+        pthread_cond_wait(&job->done, &job->mutex);
+    }
+    int failed = job->failed;
+    pthread_mutex_unlock(&job->mutex);
+
+    embed_job_release(job);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,268 @@
+/* event_loop.c - Shared I/O event loop for ANBS sockets */
+
+#include "ai_display.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define EVENT_BATCH 64             /* events taken per epoll_wait */
+
+/* One watched descriptor.  Removed watches are kept until the loop
+   finishes the batch that may still name them. */
+typedef struct event_watch {
+    int fd;
+    uint32_t events;
+    void (*handler)(int fd, uint32_t events, void *arg);
+    void *arg;
+    int removed;
+    struct event_watch *next;
+} event_watch_t;
+
+typedef struct {
+    int epoll_fd;
+    int wake_fd;                    /* eventfd that interrupts epoll_wait */
+    pthread_t thread;
+    int running;
+    pthread_mutex_t mutex;
+    pthread_cond_t pass_cond;       /* signalled after every batch */
+    uint64_t passes;
+    event_watch_t *watches;
+    event_watch_t *retired;
+} event_loop_t;
+
+static event_loop_t g_loop = {
+    .epoll_fd = -1,
+    .wake_fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .pass_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Interrupt the loop's epoll_wait */
+static void event_wake(void) {
+    uint64_t one = 1;
+    ssize_t ignored = write(g_loop.wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+/* Dispatch events until the process exits.  Handlers run one at a time on
+   this thread and must not block. */
+static void *event_loop_thread(void *arg) {
+    struct epoll_event events[EVENT_BATCH];
+    (void)arg;
+    anbs_thread_name("anbs-events");
+
+    for (;;) {
+        int n = epoll_wait(g_loop.epoll_fd, events, EVENT_BATCH, -1);
+
+        if (n < 0 && errno != EINTR) {
+            ANBS_DEBUG_LOG("Event loop failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            event_watch_t *watch = events[i].data.ptr;
+            int removed;
+
+            if (!watch) {
+                uint64_t count;
+                ssize_t ignored = read(g_loop.wake_fd, &count, sizeof(count));
+                (void)ignored;
+                continue;
+            }
+
+            pthread_mutex_lock(&g_loop.mutex);
+            removed = watch->removed;
+            pthread_mutex_unlock(&g_loop.mutex);
+            if (!removed) {
+                watch->handler(watch->fd, events[i].events, watch->arg);
+            }
+        }
+
+        /* Nothing from this batch refers to retired watches any more */
+        pthread_mutex_lock(&g_loop.mutex);
+        while (g_loop.retired) {
+            event_watch_t *watch = g_loop.retired;
+            g_loop.retired = watch->next;
+            free(watch);
+        }
+        g_loop.passes++;
+        pthread_cond_broadcast(&g_loop.pass_cond);
+        pthread_mutex_unlock(&g_loop.mutex);
+    }
+
+    pthread_mutex_lock(&g_loop.mutex);
+    g_loop.running = 0;
+    pthread_cond_broadcast(&g_loop.pass_cond);
+    pthread_mutex_unlock(&g_loop.mutex);
+    return NULL;
+}
+
+/* A forked child has no loop thread; it starts its own if it needs one.
+   The parent's descriptors stay the parent's. */
+static void event_loop_atfork_child(void) {
+    event_watch_t *watch, *next;
+
+    for (watch = g_loop.watches; watch; watch = next) {
+        next = watch->next;
+        free(watch);
+    }
+    for (watch = g_loop.retired; watch; watch = next) {
+        next = watch->next;
+        free(watch);
+    }
+    if (g_loop.epoll_fd >= 0) {
+        close(g_loop.epoll_fd);
+    }
+    if (g_loop.wake_fd >= 0) {
+        close(g_loop.wake_fd);
+    }
+
+    memset(&g_loop, 0, sizeof(g_loop));
+    g_loop.epoll_fd = -1;
+    g_loop.wake_fd = -1;
+    pthread_mutex_init(&g_loop.mutex, NULL);
+    pthread_cond_init(&g_loop.pass_cond, NULL);
+}
+
+/* Start the loop thread, with G_LOOP.MUTEX held */
+static int event_loop_start_locked(void) {
+    static int hooks_registered = 0;
+    struct epoll_event wake = { .events = EPOLLIN, .data.ptr = NULL };
+
+    if (g_loop.running) {
+        return 0;
+    }
+
+    g_loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    g_loop.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_loop.epoll_fd < 0 || g_loop.wake_fd < 0 ||
+        epoll_ctl(g_loop.epoll_fd, EPOLL_CTL_ADD, g_loop.wake_fd, &wake) != 0 ||
+        pthread_create(&g_loop.thread, NULL, event_loop_thread, NULL) != 0) {
+        ANBS_DEBUG_LOG("Failed to start event loop");
+        if (g_loop.epoll_fd >= 0) {
+            close(g_loop.epoll_fd);
+        }
+        if (g_loop.wake_fd >= 0) {
+            close(g_loop.wake_fd);
+        }
+        g_loop.epoll_fd = g_loop.wake_fd = -1;
+        return -1;
+    }
+    pthread_detach(g_loop.thread);
+    g_loop.running = 1;
+
+    if (!hooks_registered) {
+        pthread_atfork(NULL, NULL, event_loop_atfork_child);
+        hooks_registered = 1;
+    }
+    return 0;
+}
+
+/* The live watch for FD, with G_LOOP.MUTEX held */
+static event_watch_t *event_find_locked(int fd) {
+    for (event_watch_t *watch = g_loop.watches; watch; watch = watch->next) {
+        if (watch->fd == fd) {
+            return watch;
+        }
+    }
+    return NULL;
+}
+
+/* Call HANDLER on the loop thread whenever FD has any of EVENTS (EPOLLIN,
+   EPOLLOUT, ...).  FD should be non-blocking.  Returns 0 or -1. */
+int anbs_event_add(int fd, uint32_t events, void (*handler)(int fd, uint32_t events, void *arg), void *arg) {
+    event_watch_t *watch;
+    struct epoll_event ev;
+
+    pthread_mutex_lock(&g_loop.mutex);
+    if (event_loop_start_locked() != 0 || event_find_locked(fd)) {
+        pthread_mutex_unlock(&g_loop.mutex);
+        return -1;
+    }
+
+    watch = calloc(1, sizeof(event_watch_t));
+    if (!watch) {
+        pthread_mutex_unlock(&g_loop.mutex);
+        return -1;
+    }
+    watch->fd = fd;
+    watch->events = events;
+    watch->handler = handler;
+    watch->arg = arg;
+
+    ev.events = events;
+    ev.data.ptr = watch;
+    if (epoll_ctl(g_loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        pthread_mutex_unlock(&g_loop.mutex);
+        free(watch);
+        return -1;
+    }
+    watch->next = g_loop.watches;
+    g_loop.watches = watch;
+    pthread_mutex_unlock(&g_loop.mutex);
+    return 0;
+}
+
+/* Change the events watched on FD */
+int anbs_event_modify(int fd, uint32_t events) {
+    event_watch_t *watch;
+    struct epoll_event ev;
+    int result = -1;
+
+    pthread_mutex_lock(&g_loop.mutex);
+    watch = event_find_locked(fd);
+    if (watch && watch->events == events) {
+        result = 0;
+    } else if (watch) {
+        ev.events = events;
+        ev.data.ptr = watch;
+        result = epoll_ctl(g_loop.epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        if (result == 0) {
+            watch->events = events;
+        }
+    }
+    pthread_mutex_unlock(&g_loop.mutex);
+    return result;
+}
+
+/* Stop watching FD.  Once this returns its handler is not running and
+   won't be called again, so the caller may close FD and free the handler's
+   argument.  Handlers may remove their own descriptor; the owner removing
+   it again afterwards still waits for the handler to return.  Returns -1
+   if FD was not watched. */
+int anbs_event_remove(int fd) {
+    event_watch_t **link, *watch = NULL;
+    uint64_t pass;
+
+    pthread_mutex_lock(&g_loop.mutex);
+    for (link = &g_loop.watches; *link; link = &(*link)->next) {
+        if ((*link)->fd == fd) {
+            watch = *link;
+            *link = watch->next;
+            break;
+        }
+    }
+    if (watch) {
+        epoll_ctl(g_loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        watch->removed = 1;
+        watch->next = g_loop.retired;
+        g_loop.retired = watch;
+    }
+
+    /* Off the loop thread, wait out the batch that may be running the
+       handler */
+    if (g_loop.running && !pthread_equal(pthread_self(), g_loop.thread)) {
+        pass = g_loop.passes;
+        event_wake();
+        while (g_loop.passes == pass && g_loop.running) {
+            pthread_cond_wait(&g_loop.pass_cond, &g_loop.mutex);
+        }
+    }
+    pthread_mutex_unlock(&g_loop.mutex);
+    return watch ? 0 : -1;
+}
@@ -5,6 +5,8 @@
 #include <string.h>
 #include <stdio.h>
 
+static int anbs_health_draw(anbs_display_t *display);
+
 /**
  * Update health data for an AI agent
  */
@@ -16,6 +18,10 @@ int anbs_health_update(anbs_display_t *display, const health_data_t *data)
         return -1;
     }
 
+    if (anbs_render_defer(display, ANBS_RENDER_HEALTH, 0, 0, data, sizeof(*data))) {
+        return 0;
+    }
+
     /* Find existing agent or empty slot */
     for (i = 0; i < 10; i++) {
         if (strcmp(display->health_data[i].agent_id, data->agent_id) == 0) {
@@ -43,19 +49,82 @@ int anbs_health_update(anbs_display_t *display, const health_data_t *data)
         display->health_agent_count = slot + 1;
     }
 
-    /* Refresh health panel */
-    anbs_health_refresh_display(display);
+    /* Agents report every cycle; the tick draws them at most every
+       health_interval_ms */
+    display->health_pending = true;
+    anbs_display_tick(display);
 
     return 0;
 }
 
 /**
- * Refresh the health monitoring display
+ * Draw held back health updates if the panel's rate limit allows it
  */
-int anbs_health_refresh_display(anbs_display_t *display)
+int anbs_health_tick(anbs_display_t *display)
+{
+    long long now;
+
+    if (!display || !display->health_pending) {
+        return 0;
+    }
+
+    now = anbs_display_now_ms();
+    if (now - display->health_last_ms < display->health_interval_ms) {
+        return 0;
+    }
+
+    display->health_pending = false;
+    display->health_last_ms = now;
+    return anbs_health_draw(display);
+}
+
+/**
+ * Put TEXT in content row ROW of the health panel unless it is already
+ * there, clearing whatever the row held before
+ */
+static void anbs_health_put_row(anbs_display_t *display, panel_t *panel, int row,
+                                const char *text, int color)
+{
+    int height = panel->height - (panel->has_border ? 2 : 0);
+
+    if (row < 0 || row >= ANBS_HEALTH_MAX_ROWS || row >= height) {
+        return;
+    }
+
+    if (display->health_row_colors[row] == color &&
+        strcmp(display->health_rows[row], text) == 0) {
+        return;
+    }
+
+    anbs_panel_set_cursor(panel, 0, row);
+    wclrtoeol(panel->window);
+    if (panel->has_border) {
+        mvwaddch(panel->window, row + 1, panel->width - 1, ACS_VLINE);
+    }
+
+    anbs_panel_set_cursor(panel, 0, row);
+    if (color) {
+        anbs_panel_write_colored(panel, text, color);
+    } else {
+        anbs_panel_write_text(panel, text);
+    }
+
+    snprintf(display->health_rows[row], sizeof(display->health_rows[row]), "%s", text);
+    display->health_row_colors[row] = color;
+    if (row >= display->health_row_count) {
+        display->health_row_count = row + 1;
+    }
+    panel->dirty = true;
+}
+
+/**
+ * Redraw the rows of the health panel that changed since it was last
+ * drawn, or all of it once its window, size or border changed
+ */
+static int anbs_health_draw(anbs_display_t *display)
 {
     panel_t *panel;
-    int i, line = 0;
+    int i, row, line = 0;
     char status_line[256];
     time_t now;
 
@@ -70,62 +139,80 @@ int anbs_health_refresh_display(anbs_display_t *display)
 
     now = time(NULL);
 
-    /* Clear panel */
-    anbs_panel_clear(panel);
+    /* Nothing on screen can be reused: clear panel */
+    if (panel->window != display->health_window ||
+        panel->width != display->health_width ||
+        panel->height != display->health_height ||
+        panel->has_border != display->health_border) {
+        anbs_panel_clear(panel);
 
-    /* Draw border with title */
-    if (panel->has_border) {
-        anbs_panel_draw_border(panel, "Vertex Health");
-        anbs_panel_set_cursor(panel, 0, 0);
+        /* Draw border with title */
+        if (panel->has_border) {
+            anbs_panel_draw_border(panel, "Vertex Health");
+        }
+
+        memset(display->health_rows, 0, sizeof(display->health_rows));
+        memset(display->health_row_colors, 0, sizeof(display->health_row_colors));
+        display->health_row_count = 0;
+        display->health_window = panel->window;
+        display->health_width = panel->width;
+        display->health_height = panel->height;
+        display->health_border = panel->has_border;
+        panel->dirty = true;
     }
 
     /* Display health data for each agent */
     for (i = 0; i < display->health_agent_count; i++) {
         health_data_t *health = &display->health_data[i];
+        const char *status_icon, *status_text;
 
         if (strlen(health->agent_id) == 0) {
             continue;
         }
 
-        /* Format status line */
-        const char *status_icon = anbs_health_get_status_icon(health, now);
-        const char *status_text = anbs_health_get_status_text(health, now);
-
-        snprintf(status_line, sizeof(status_line),
-                "%s %-12s %s %3dms Load:%2.0f%%",
-                status_icon,
-                health->agent_id,
-                status_text,
-                health->latency_ms,
-                health->cpu_load);
-
-        /* Write status line with appropriate color */
-        int color = anbs_health_get_status_color(health, now);
-        anbs_panel_set_cursor(panel, 0, line);
-        anbs_panel_write_colored(panel, status_line, color);
-
-        line++;
-
-        /* Add detailed info if space allows */
-        if (line < panel->height - (panel->has_border ? 3 : 1)) {
-            snprintf(status_line, sizeof(status_line),
+        status_icon = anbs_health_get_status_icon(health, now);
+        status_text = anbs_health_get_status_text(health, now);
+
+        /* Format the agent's rows again only once its data or state changed */
+        if (status_icon != display->health_drawn_icon[i] ||
+            status_text != display->health_drawn_text[i] ||
+            memcmp(health, &display->health_drawn[i], sizeof(health_data_t)) != 0) {
+            snprintf(display->health_agent_rows[i][0], sizeof(display->health_agent_rows[i][0]),
+                    "%s %-12s %s %3dms Load:%2.0f%%",
+                    status_icon,
+                    health->agent_id,
+                    status_text,
+                    health->latency_ms,
+                    health->cpu_load);
+
+            snprintf(display->health_agent_rows[i][1], sizeof(display->health_agent_rows[i][1]),
                     "  Mem:%3.0f%% Cmds:%d Success:%3.1f%%",
                     health->memory_usage,
                     health->commands_processed,
                     health->success_rate);
 
-            anbs_panel_set_cursor(panel, 0, line);
-            anbs_panel_write_text(panel, status_line);
-            line++;
+            display->health_agent_color[i] = anbs_health_get_status_color(health, now);
+            memcpy(&display->health_drawn[i], health, sizeof(health_data_t));
+            display->health_drawn_icon[i] = status_icon;
+            display->health_drawn_text[i] = status_text;
+        }
+
+        /* Status line with appropriate color */
+        anbs_health_put_row(display, panel, line++, display->health_agent_rows[i][0],
+                            display->health_agent_color[i]);
+
+        /* Add detailed info if space allows */
+        if (line < panel->height - (panel->has_border ? 3 : 1)) {
+            anbs_health_put_row(display, panel, line++, display->health_agent_rows[i][1], 0);
         }
 
         /* Add spacing between agents */
-        line++;
+        anbs_health_put_row(display, panel, line++, "", 0);
     }
 
     /* Add summary information */
     if (line < panel->height - (panel->has_border ? 4 : 2)) {
-        line++; /* Add space */
+        anbs_health_put_row(display, panel, line++, "", 0); /* Add space */
 
         /* Overall statistics */
         int online_count = 0;
@@ -148,24 +235,43 @@ int anbs_health_refresh_display(anbs_display_t *display)
         snprintf(status_line, sizeof(status_line),
                 "📊 Summary: %d/%d online",
                 online_count, display->health_agent_count);
-        anbs_panel_set_cursor(panel, 0, line++);
-        anbs_panel_write_colored(panel, status_line, ANBS_COLOR_STATUS);
+        anbs_health_put_row(display, panel, line++, status_line, ANBS_COLOR_STATUS);
 
         snprintf(status_line, sizeof(status_line),
                 "Commands: %d Success: %.1f%%",
                 total_commands, avg_success_rate);
-        anbs_panel_set_cursor(panel, 0, line++);
-        anbs_panel_write_text(panel, status_line);
+        anbs_health_put_row(display, panel, line++, status_line, 0);
 
         /* Last update timestamp */
         snprintf(status_line, sizeof(status_line),
                 "🔄 Last update: %s", anbs_format_timestamp(now));
-        anbs_panel_set_cursor(panel, 0, line++);
-        anbs_panel_write_text(panel, status_line);
+        anbs_health_put_row(display, panel, line++, status_line, 0);
+    }
+
+    /* Blank rows left over from a longer list */
+    for (row = line; row < display->health_row_count; row++) {
+        anbs_health_put_row(display, panel, row, "", 0);
+    }
+    if (display->health_row_count > line) {
+        display->health_row_count = line;
+    }
+
+    return 0;
+}
+
+/**
+ * Refresh the health monitoring display
+ */
+int anbs_health_refresh_display(anbs_display_t *display)
+{
+    if (anbs_health_draw(display) != 0) {
+        return -1;
     }
 
-    /* Refresh panel */
-    wrefresh(panel->window);
+    /* Refresh panel with the next frame */
+    if (display->panels[ANBS_PANEL_HEALTH].dirty) {
+        anbs_display_tick(display);
+    }
 
     return 0;
 }
@@ -8,315 +8,3950 @@
 #include <pthread.h>
 #include <sqlite3.h>
 #include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined (__x86_64__) || defined (__i386__)
+#  include <immintrin.h>
+#elif defined (__aarch64__)
+#  include <arm_neon.h>
+#endif
 
 #define MAX_MEMORY_ENTRIES 10000
-#define EMBEDDING_DIMENSION 1536  /* OpenAI ada-002 dimension */
+#define EMBEDDING_DIMENSION 1536  /* OpenAI ada-002 dimension; size of legacy rows */
+#define MEMORY_DIMENSION g_memory_dimension  /* the embedder's, padded to 16 floats */
 #define MEMORY_DB_PATH "/tmp/anbs_memory.db"
+#define MEMORY_VEC_PATH "/tmp/anbs_memory.vec"  /* embeddings by id, matrix layout */
+#define VEC_MAGIC "ANBSVEC1"
+#define VEC_HEADER_BYTES 64
+#define EMBEDDING_ALIGN 64        /* rows start on a cache line */
+#define IVF_MIN_ENTRIES 2048      /* below this a full scan is cheaper */
+#define IVF_MIN_LISTS 16
+#define IVF_MAX_LISTS 1024
+#define IVF_TRAIN_SAMPLES 32      /* training rows per list */
+#define IVF_TRAIN_ROUNDS 8
+#define IVF_DEFAULT_NPROBE 8
+#define ROW_BYTES (MEMORY_DIMENSION * sizeof(float))
+#define WRITE_BYTES (sizeof(memory_write_t) + ROW_BYTES)
+#define RESCORE_CANDIDATES 256    /* int8 hits rescored in full precision */
+#define LEX_BUCKETS 16384
+#define LEX_MAX_TOKEN 64
+#define LEX_MAX_TERMS 32          /* distinct query terms considered */
+#define LEX_MAX_DOC_TERMS 256     /* distinct terms indexed per entry */
+#define FUSION_DEPTH 50           /* hits taken from each ranking */
+#define RRF_K 60.0                /* reciprocal rank fusion damping */
+#define BM25_K1 1.2
+#define BM25_B 0.75
+#define SCAN_MIN_ENTRIES 65536    /* smaller stores are scanned on one core */
+#define SCAN_MIN_ROWS 8192        /* rows per partition of a parallel scan */
+#define SCAN_MAX_THREADS 64
+#define HISTORY_SEEN_SLOTS 4096   /* recent history commands remembered for dedup */
+#define HISTORY_PENDING_MAX 256   /* history commands held while the store opens */
+#define COLD_DEFAULT_THRESHOLD 0.9  /* best hot cosine below which cold rows are searched */
+#define DECAY_DEFAULT_DAYS 30     /* half-life of a memory's weight in the ranking */
+#define DECAY_FLOOR 0.5           /* weight left to arbitrarily old memories */
+#define REPLICA_BATCH_ROWS 64     /* rows read per origin for one delta */
+#define SUGGEST_SCAN_MAX 512      /* commands sharing a prefix looked at per suggestion */
+#define SUGGEST_CLOCK_EVERY 32    /* candidates between checks of a suggestion's time budget */
+#define PACK_CANDIDATES 32        /* search hits considered for a packed context */
+#define PACK_MIN_PIECE 16         /* fewest tokens worth packing of a cut-down hit */
+#define PACK_SIMILAR 0.8          /* share of words that makes two hits duplicates */
+#define PACK_WORDS 64             /* words of a hit compared for that */
+#define PACK_LINE_MAX 4096
+#define REEMBED_BATCH_ROWS 256    /* rows read per step of re-embedding the store */
+
+/* Queued rows come from the slabs in performance/optimize.c */
+extern void *anbs_optimize_calloc(size_t count, size_t size);
+extern void anbs_optimize_free(void *ptr, size_t size);
+
+/* Text embedders from embedder.c */
+typedef struct anbs_embedder anbs_embedder_t;
+extern anbs_embedder_t *anbs_embedder_open(const char *spec);
+extern const char *anbs_embedder_id(const anbs_embedder_t *e);
+extern int anbs_embedder_dimension(const anbs_embedder_t *e);
+extern bool anbs_embedder_normalized(const anbs_embedder_t *e);
+extern int anbs_embedder_embed(anbs_embedder_t *e, const char *const *texts, int count, float *out, int stride);
+
+/* The strings of an entry are shared, read-only, between the store, the
+   write queue and search results; each holder owns one reference */
+typedef struct {
+    int refs;
+    int evicted;         /* the entry owning it has left the ring */
+    sqlite3_int64 id;    /* database row of an entry's content, once saved */
+    char text[];
+} memory_text_t;
 
 typedef struct {
     char *content;
-    float *embedding;
+    float *embedding;    /* unit-length row of the embedding matrix */
     time_t timestamp;
     char *context;
     char *source;
     float relevance_score;
+    int seen;            /* times added; repeats refresh the entry */
 } memory_entry_t;
 
+/* Slots whose embeddings are nearest to one IVF centroid */
+typedef struct {
+    int *members;
+    int count;
+    int capacity;
+} ivf_list_t;
+
+/* One entry containing a term.  Evicting an entry only bumps the
+   generation of its slot; stale postings are dropped when a list grows. */
+typedef struct {
+    int slot;
+    unsigned gen;
+    int tf;
+} lex_posting_t;
+
+typedef struct lex_term {
+    struct lex_term *next;
+    char *text;
+    lex_posting_t *postings;
+    int count;
+    int capacity;
+    int df;              /* live entries containing the term */
+} lex_term_t;
+
+/* A row waiting to be embedded and inserted, or for the background writer.
+   An UPDATE row records another sighting of the already saved row whose
+   content it shares. */
+typedef struct memory_write {
+    struct memory_write *next;
+    int update;
+    char *content;
+    char *context;
+    char *source;
+    time_t timestamp;
+    float relevance_score;
+    char *origin;        /* replica that first recorded the row, NULL for ours */
+    sqlite3_int64 origin_seq;
+    float embedding[];   /* MEMORY_DIMENSION floats; rows are WRITE_BYTES */
+} memory_write_t;
+
+/* The last row applied from one origin's log */
+typedef struct {
+    char origin[64];
+    sqlite3_int64 seq;
+} replica_clock_t;
+
+/* Entries live in a ring: slot I of ENTRIES owns row I of MATRIX, the
+   oldest entry is at HEAD, and a new entry reuses the slot (and row) of the
+   one it evicts.  Until the ring first fills, HEAD is 0 and slots
+   0..count-1 are the live ones; afterwards every slot is live. */
 typedef struct {
     memory_entry_t *entries;
+    float *matrix;       /* capacity x MEMORY_DIMENSION, inside MATRIX_MAP */
+    void *matrix_map;
+    size_t matrix_map_length;
+    int head;
     int count;
     int capacity;
     sqlite3 *db;
-    pthread_mutex_t mutex;
+    pthread_rwlock_t lock;   /* searches share it, changes take it alone */
+    char db_path[PATH_MAX];  /* MEMORY_DB_PATH unless ANBS_MEMORY_DB is set */
+    char vec_path[PATH_MAX];
+
+    /* Rows up to COLD_LAST_ID have aged out of the ring but stay in the
+       database and sidecar; searches scan them from the sidecar when the
+       ring's best hit is below COLD_THRESHOLD */
+    sqlite3_int64 cold_last_id;
+    float cold_threshold;
+    double half_life;    /* seconds; 0 turns time decay off */
+
+    /* The store loads in the background after init; callers wait on
+       LOADED_COND until LOADING clears */
+    int loading;
+    int loader_running;
+    pthread_t loader;
+    pthread_mutex_t load_mutex;
+    pthread_cond_t loaded_cond;
+    int vec_fd;          /* VEC_PATH, or -1 */
+
+    /* The database's embeddings came from another embedder; the loader
+       re-embeds every row, stopping early if REEMBED_STOP is set */
+    int embeddings_stale;
+    int reembed_stop;
+
+    /* Inverted-file index: each slot sits in the list of its nearest
+       centroid and a search scans only the NPROBE closest lists */
+    float *centroids;    /* nlist x MEMORY_DIMENSION, NULL until trained */
+    ivf_list_t *lists;
+    int nlist;
+    int nprobe;
+    int trained_count;   /* entries when the centroids were trained */
+    int *slot_list;      /* list holding each slot, or -1 */
+    int *slot_pos;       /* position of each slot within its list */
+
+    /* With ANBS_MEMORY_QUANTIZE=int8, searches scan these codes and only
+       rescore the best candidates against the float rows */
+    int8_t *codes;       /* capacity x MEMORY_DIMENSION, or NULL */
+    float *code_scales;  /* per-row dequantization factor */
+
+    /* Inverted index over entry tokens for BM25 */
+    lex_term_t **lex_buckets;
+    unsigned *slot_gen;
+    int *slot_terms;     /* token count of each slot */
+    long lex_total_terms;
+
+    /* Slots chained by the hash of their normalized content, so a repeat
+       finds the entry it repeats */
+    uint64_t *slot_hash;
+    int *dedup_next;     /* next slot in the same bucket, or -1 */
+    int *dedup_buckets;  /* DEDUP_MASK + 1 chain heads, or -1 */
+    int dedup_mask;
+
+    /* Background writer: rows queue up here and are committed in group
+       transactions on a connection of its own */
+    pthread_t writer;
+    int writer_running;
+    int writer_stop;
+    sqlite3 *writer_db;
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *update_stmt;
+    memory_write_t *write_head;
+    memory_write_t *write_tail;
+    int write_pending;   /* queued or being committed */
+    pthread_mutex_t write_mutex;
+    pthread_cond_t write_cond;
+    pthread_cond_t flushed_cond;
+
+    /* Ingestion: adds queue raw rows here and a worker embeds and inserts
+       them in batches.  Lookups wait until INGEST_DONE reaches the
+       INGEST_QUEUED they saw, so they see every add made before them. */
+    pthread_t ingester;
+    int ingest_running;
+    int ingest_stop;
+    memory_write_t *ingest_head;
+    memory_write_t *ingest_tail;
+    unsigned long ingest_queued;
+    unsigned long ingest_done;
+    pthread_mutex_t ingest_mutex;
+    pthread_cond_t ingest_cond;
+    pthread_cond_t ingested_cond;
+
+    /* Scan workers, started by the first search large enough to split;
+       SCAN_JOBS holds the scans with partitions left to claim */
+    pthread_t *scan_threads;
+    int scan_nthreads;
+    int scan_workers;    /* workers to start: ANBS_MEMORY_THREADS - 1 */
+    int scan_stop;
+    struct scan_job *scan_jobs;
+    pthread_mutex_t scan_mutex;
+    pthread_cond_t scan_cond;
+    pthread_cond_t scan_done_cond;
+
+    /* Replication: every store's own rows form an append-only log
+       numbered by row id, copied verbatim into the others with ORIGIN
+       and ORIGIN_SEQ set.  REPLICA_CLOCK is the version vector of what
+       has been applied here, so merging a delta twice or out of turn is
+       harmless. */
+    char replica_id[64];
+    replica_clock_t *replica_clock;
+    int replica_origins;
+    pthread_mutex_t replica_mutex;
 } memory_system_t;
 
 static memory_system_t *g_memory = NULL;
 
-/* Simple text embedding using character frequency analysis */
-static void generate_simple_embedding(const char *text, float *embedding) {
-    /* Clear embedding */
-    memset(embedding, 0, EMBEDDING_DIMENSION * sizeof(float));
+static int memory_insert_locked(const memory_write_t *row);
+static int memory_save_new(const memory_entry_t *entry, const char *origin, sqlite3_int64 origin_seq);
+static void replica_open(void);
+
+/* Set once anbs_memory_init() has finished.  G_MEMORY is set while the
+   store is still being opened on another thread, so the entry points
+   check this instead. */
+static int g_memory_ready = 0;
+static pthread_mutex_t g_memory_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The embedder, opened on first use and kept for the life of the
+   process; the semantic cache embeds through it without a store */
+static anbs_embedder_t *g_embedder;
+static int g_memory_dimension;
+static pthread_once_t g_embedder_once = PTHREAD_ONCE_INIT;
+
+#define MEMORY_READY() __atomic_load_n(&g_memory_ready, __ATOMIC_ACQUIRE)
+
+/* Hashes of the history commands already handed to the store */
+static uint64_t g_history_seen[HISTORY_SEEN_SLOTS];
+static int g_history_disabled = 0;
+
+/* The shell doesn't open the store itself: the first history command, or
+   ANBS_PREWARM, starts a thread to open it, and commands run meanwhile
+   wait here in order until it has */
+typedef struct history_pending {
+    struct history_pending *next;
+    char *command;
+    char *context;
+} history_pending_t;
+
+enum { HISTORY_CLOSED, HISTORY_OPENING, HISTORY_OPEN };
+
+static pthread_mutex_t g_history_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_history_state = HISTORY_CLOSED;
+static history_pending_t *g_history_head, **g_history_tail = &g_history_head;
+static int g_history_pending;
+static pthread_t g_history_opener;
+static pid_t g_history_opener_pid;
+
+/* Prefix index of shell commands for inline suggestions, sorted so the
+   commands starting with a prefix are one run.  It holds the shell's
+   history and the store's history entries once the shell asks for
+   suggestions.  Lookups only try the mutex, so a keystroke never waits
+   behind a merge. */
+typedef struct {
+    char *command;
+    time_t last;         /* when it last ran */
+    int count;           /* times it was added */
+} suggest_item_t;
+
+static pthread_mutex_t g_suggest_mutex = PTHREAD_MUTEX_INITIALIZER;
+static suggest_item_t *g_suggest;
+static int g_suggest_count;
+static int g_suggest_capacity;
+static int g_suggest_active;
+
+static void suggest_merge(suggest_item_t *items, int n);
+
+/* One scored candidate during a search */
+typedef struct {
+    int index;
+    float score;
+} memory_hit_t;
+
+/* A full scan split into PARTS row ranges, each kept in its own heap of
+   LIMIT hits.  It scores either the store's slots or the plain matrix of
+   unit rows at BASE.  Partitions are claimed and completed under SCAN_MUTEX. */
+typedef struct scan_job {
+    struct scan_job *next;
+    const float *base;   /* rows to scan, or NULL for the store's slots */
+    const float *query;
+    const int8_t *code;
+    float scale;
+    int rows;
+    int limit;
+    int parts;
+    int claimed;
+    int done;
+    memory_hit_t *heaps;
+    int *sizes;
+} scan_job_t;
 
-    int len = strlen(text);
-    if (len == 0) return;
+/* Dot product kernels.  The widest one the CPU supports is picked on first
+   use; all of them accept unaligned input and any length. */
+static float dot_scalar(const float *a, const float *b, int n) {
+    float sum = 0.0;
 
-    /* Character frequency analysis */
-    int char_freq[256] = {0};
-    for (int i = 0; i < len; i++) {
-        char_freq[(unsigned char)text[i]]++;
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * b[i];
     }
+    return sum;
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
 
-    /* Normalize frequencies and map to embedding space */
-    for (int i = 0; i < 256 && i < EMBEDDING_DIMENSION; i++) {
-        embedding[i] = (float)char_freq[i] / len;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
     }
 
-    /* Add word length features */
-    int word_count = 1;
-    int total_word_len = 0;
-    int current_word_len = 0;
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    sum4 = _mm_hadd_ps(sum4, sum4);
+    sum4 = _mm_hadd_ps(sum4, sum4);
 
-    for (int i = 0; i < len; i++) {
-        if (isspace(text[i])) {
-            if (current_word_len > 0) {
-                total_word_len += current_word_len;
-                word_count++;
-                current_word_len = 0;
-            }
-        } else {
-            current_word_len++;
-        }
+    float sum = _mm_cvtss_f32(sum4);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float dot_avx512(const float *a, const float *b, int n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+#elif defined (__aarch64__)
+static float dot_neon(const float *a, const float *b, int n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0);
+    float32x4_t acc1 = vdupq_n_f32(0.0);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
     }
-    if (current_word_len > 0) {
-        total_word_len += current_word_len;
+    return sum;
+}
+#endif
+
+/* Integer dot product kernels for quantized rows */
+static int32_t dot8_scalar(const int8_t *a, const int8_t *b, int n) {
+    int32_t sum = 0;
+
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+__attribute__((target("avx2")))
+static int32_t dot8_avx2(const int8_t *a, const int8_t *b, int n) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i alo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(va));
+        __m256i ahi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(va, 1));
+        __m256i blo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(vb));
+        __m256i bhi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(vb, 1));
+
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(alo, blo));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(ahi, bhi));
+    }
+
+    __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum4 = _mm_hadd_epi32(sum4, sum4);
+    sum4 = _mm_hadd_epi32(sum4, sum4);
+
+    int32_t sum = _mm_cvtsi128_si32(sum4);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+#elif defined (__aarch64__)
+static int32_t dot8_neon(const int8_t *a, const int8_t *b, int n) {
+    int32x4_t acc = vdupq_n_s32(0);
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        int8x16_t va = vld1q_s8(a + i);
+        int8x16_t vb = vld1q_s8(b + i);
+
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+        acc = vpadalq_s16(acc, vmull_high_s8(va, vb));
+    }
+
+    int32_t sum = vaddvq_s32(acc);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+#endif
+
+static float (*g_dot_kernel)(const float *, const float *, int) = NULL;
+static int32_t (*g_dot8_kernel)(const int8_t *, const int8_t *, int) = dot8_scalar;
+
+/* Pick the dot product kernels for this CPU */
+static void select_dot_kernel(void) {
+    float (*kernel)(const float *, const float *, int) = dot_scalar;
+
+#if defined (__x86_64__) || defined (__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernel = dot_avx512;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernel = dot_avx2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        g_dot8_kernel = dot8_avx2;
+    }
+#elif defined (__aarch64__)
+    kernel = dot_neon;
+    g_dot8_kernel = dot8_neon;
+#endif
+
+    /* Publishing the float kernel also publishes the integer one */
+    __atomic_store_n(&g_dot_kernel, kernel, __ATOMIC_RELEASE);
+}
+
+/* Dot product of two embeddings */
+static float dot_product(const float *a, const float *b) {
+    float (*kernel)(const float *, const float *, int) = __atomic_load_n(&g_dot_kernel, __ATOMIC_ACQUIRE);
+
+    if (!kernel) {
+        select_dot_kernel();
+        kernel = g_dot_kernel;
+    }
+    return kernel(a, b, MEMORY_DIMENSION);
+}
+
+/* Dot product of two quantized rows */
+static int32_t dot8_product(const int8_t *a, const int8_t *b) {
+    if (!__atomic_load_n(&g_dot_kernel, __ATOMIC_ACQUIRE)) {
+        select_dot_kernel();
+    }
+    return g_dot8_kernel(a, b, MEMORY_DIMENSION);
+}
+
+/* Quantize a unit vector to int8 with a per-vector scale */
+static void quantize_embedding(const float *embedding, int8_t *code, float *scale) {
+    float max = 0.0;
+
+    for (int i = 0; i < MEMORY_DIMENSION; i++) {
+        float v = fabsf(embedding[i]);
+        if (v > max) {
+            max = v;
+        }
     }
 
-    /* Add statistical features to embedding */
-    if (EMBEDDING_DIMENSION > 256) {
-        embedding[256] = (float)word_count / len;  /* Word density */
-        embedding[257] = (float)total_word_len / word_count;  /* Average word length */
-        embedding[258] = len > 100 ? 1.0 : (float)len / 100;  /* Text length feature */
+    *scale = max > 0.0 ? max / 127.0 : 1.0;
+    for (int i = 0; i < MEMORY_DIMENSION; i++) {
+        code[i] = (int8_t)lrintf(embedding[i] / *scale);
     }
+}
 
-    /* Add semantic features based on common programming terms */
-    const char *prog_keywords[] = {
-        "function", "class", "variable", "loop", "if", "else", "return",
-        "import", "export", "const", "let", "var", "async", "await",
-        "bash", "shell", "command", "script", "file", "directory",
-        "error", "debug", "fix", "issue", "problem", "solution"
-    };
+/* Scale EMBEDDING to unit length, so similarity is a plain dot product */
+static void normalize_embedding(float *embedding) {
+    float norm = sqrt(dot_product(embedding, embedding));
 
-    int prog_keyword_count = sizeof(prog_keywords) / sizeof(prog_keywords[0]);
-    for (int i = 0; i < prog_keyword_count && (259 + i) < EMBEDDING_DIMENSION; i++) {
-        if (strstr(text, prog_keywords[i])) {
-            embedding[259 + i] = 1.0;
+    if (norm > 0.0) {
+        for (int i = 0; i < MEMORY_DIMENSION; i++) {
+            embedding[i] /= norm;
         }
     }
 }
 
-/* Calculate cosine similarity between two embeddings */
+/* Cosine similarity between two unit-length embeddings */
 static float calculate_similarity(const float *embedding1, const float *embedding2) {
-    float dot_product = 0.0;
-    float norm1 = 0.0;
-    float norm2 = 0.0;
+    return dot_product(embedding1, embedding2);
+}
+
+/* Open the embedder ANBS_EMBEDDER names, which fixes the width of every
+   row.  Rows are padded to a multiple of 16 floats so each starts on a
+   cache line; the padding is zero and adds nothing to a dot product. */
+static void memory_embedder_open(void) {
+    g_embedder = anbs_embedder_open(getenv("ANBS_EMBEDDER"));
+    if (g_embedder) {
+        g_memory_dimension = (anbs_embedder_dimension(g_embedder) + 15) & ~15;
+    }
+}
+
+static anbs_embedder_t *memory_embedder(void) {
+    pthread_once(&g_embedder_once, memory_embedder_open);
+    return g_embedder;
+}
+
+/* Embed COUNT texts into rows of OUT, MEMORY_DIMENSION floats apart, at
+   unit length.  Rows the embedder failed on are zero and match nothing
+   but lexically.  Returns 0, or -1 if any row failed. */
+static int memory_embed_texts(const char *const *texts, int count, float *out) {
+    anbs_embedder_t *embedder = memory_embedder();
+    int rc = anbs_embedder_embed(embedder, texts, count, out, MEMORY_DIMENSION);
+
+    if (!anbs_embedder_normalized(embedder)) {
+        for (int i = 0; i < count; i++) {
+            normalize_embedding(out + (size_t)i * MEMORY_DIMENSION);
+        }
+    }
+    return rc;
+}
 
-    for (int i = 0; i < EMBEDDING_DIMENSION; i++) {
-        dot_product += embedding1[i] * embedding2[i];
-        norm1 += embedding1[i] * embedding1[i];
-        norm2 += embedding2[i] * embedding2[i];
+/* Embed TEXT with the memory system's model; returns a malloc'd, unit-length
+   vector of anbs_memory_embedding_dimension() floats, or NULL */
+float *anbs_memory_embed(const char *text) {
+    float *embedding;
+
+    if (!text || !memory_embedder()) {
+        return NULL;
+    }
+
+    embedding = aligned_alloc(EMBEDDING_ALIGN, MEMORY_DIMENSION * sizeof(float));
+    if (embedding && memory_embed_texts(&text, 1, embedding) != 0) {
+        free(embedding);
+        embedding = NULL;
     }
+    return embedding;
+}
 
-    if (norm1 == 0.0 || norm2 == 0.0) {
+/* Cosine similarity between two vectors produced by anbs_memory_embed() */
+float anbs_memory_similarity(const float *embedding1, const float *embedding2) {
+    if (!embedding1 || !embedding2) {
         return 0.0;
     }
+    return calculate_similarity(embedding1, embedding2);
+}
 
-    return dot_product / (sqrt(norm1) * sqrt(norm2));
+/* Number of floats in an embedding vector */
+int anbs_memory_embedding_dimension(void) {
+    return memory_embedder() ? MEMORY_DIMENSION : 0;
 }
 
-/* Initialize memory system */
-int anbs_memory_init(void) {
-    if (g_memory) {
-        return 0; /* Already initialized */
+/* Map room for CAPACITY rows plus a page of slack, so the rows can later
+   be shifted to line up with a file mapping */
+static float *matrix_alloc(int capacity, void **map, size_t *length) {
+    *length = (size_t)capacity * ROW_BYTES + sysconf(_SC_PAGESIZE);
+    *map = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (*map == MAP_FAILED) {
+        *map = NULL;
+        return NULL;
     }
+    return *map;
+}
 
-    g_memory = calloc(1, sizeof(memory_system_t));
-    if (!g_memory) {
+static void matrix_free(void *map, size_t length) {
+    if (map) {
+        munmap(map, length);
+    }
+}
+
+/* Byte offset of memory row ID in the sidecar */
+static off_t vec_offset(sqlite3_int64 id) {
+    return VEC_HEADER_BYTES + (off_t)(id - 1) * ROW_BYTES;
+}
+
+/* Open the embedding sidecar, starting it afresh if it was written for
+   another embedder.  The header holds the row width and, after it, the
+   embedder's id; the built-in embedder leaves the id out, so sidecars
+   from before there was a choice still match. */
+static int vec_open(void) {
+    char header[VEC_HEADER_BYTES], expected[VEC_HEADER_BYTES];
+    const char *id = anbs_embedder_id(memory_embedder());
+    int fd = open(g_memory->vec_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
         return -1;
     }
 
-    g_memory->capacity = MAX_MEMORY_ENTRIES;
-    g_memory->entries = calloc(g_memory->capacity, sizeof(memory_entry_t));
-    if (!g_memory->entries) {
-        free(g_memory);
-        g_memory = NULL;
+    memset(expected, 0, sizeof(expected));
+    memcpy(expected, VEC_MAGIC, 8);
+    *(int *)(expected + 8) = MEMORY_DIMENSION;
+    if (strcmp(id, "features") != 0) {
+        strncpy(expected + 12, id, VEC_HEADER_BYTES - 13);
+    }
+
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header, expected, sizeof(header)) != 0) {
+        memcpy(header, expected, sizeof(header));
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* Record the embedding of memory row ID in the sidecar */
+static void vec_store(sqlite3_int64 id, const float *embedding) {
+    if (g_memory->vec_fd >= 0 &&
+        pwrite(g_memory->vec_fd, embedding, ROW_BYTES, vec_offset(id)) != (ssize_t)ROW_BYTES) {
+        ANBS_DEBUG_LOG("Failed to write memory row %lld to the sidecar", (long long)id);
+    }
+}
+
+/* Map sidecar rows FIRST_ID..FIRST_ID+COUNT-1 copy-on-write as the first
+   rows of the matrix in MAP; the kernel pages them in as searches touch
+   them */
+static float *vec_map(void *map, sqlite3_int64 first_id, int count) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t offset = vec_offset(first_id);
+    size_t delta = offset % page;
+    size_t length = (delta + (size_t)count * ROW_BYTES + page - 1) / page * page;
+
+    if (mmap(map, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             g_memory->vec_fd, offset - delta) == MAP_FAILED) {
+        return NULL;
+    }
+    return (float *)((char *)map + delta);
+}
+
+/* A new shared string holding a copy of S */
+static char *text_new(const char *s) {
+    size_t len = strlen(s);
+    memory_text_t *text = malloc(sizeof(memory_text_t) + len + 1);
+
+    if (!text) {
+        return NULL;
+    }
+    text->refs = 1;
+    text->evicted = 0;
+    text->id = 0;
+    memcpy(text->text, s, len + 1);
+    return text->text;
+}
+
+/* Move the cold tier's boundary up to row ID */
+static void cold_extend(sqlite3_int64 id) {
+    sqlite3_int64 last = __atomic_load_n(&g_memory->cold_last_id, __ATOMIC_RELAXED);
+
+    while (id > last &&
+           !__atomic_compare_exchange_n(&g_memory->cold_last_id, &last, id, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Note that shared string S is the content of database row ID.  An entry
+   can leave the ring before the writer has saved it; whichever of the two
+   comes second moves the cold boundary. */
+static void text_set_id(char *s, sqlite3_int64 id) {
+    memory_text_t *text = (memory_text_t *)(s - offsetof(memory_text_t, text));
+
+    __atomic_store_n(&text->id, id, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&text->evicted, __ATOMIC_SEQ_CST)) {
+        cold_extend(id);
+    }
+}
+
+/* Another reference to shared string S */
+static char *text_ref(char *s) {
+    if (s) {
+        __atomic_add_fetch(&((memory_text_t *)(s - offsetof(memory_text_t, text)))->refs, 1, __ATOMIC_RELAXED);
+    }
+    return s;
+}
+
+static void text_unref(char *s) {
+    if (s) {
+        memory_text_t *text = (memory_text_t *)(s - offsetof(memory_text_t, text));
+        if (__atomic_sub_fetch(&text->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+            free(text);
+        }
+    }
+}
+
+/* Drop the store's references to ENTRY's strings */
+static void entry_release(memory_entry_t *entry) {
+    text_unref(entry->content);
+    text_unref(entry->context);
+    text_unref(entry->source);
+    entry->content = entry->context = entry->source = NULL;
+}
+
+/* Drop ENTRY from the ring; its row joins the cold tier */
+static void entry_evict(memory_entry_t *entry) {
+    if (entry->content) {
+        memory_text_t *text = (memory_text_t *)(entry->content - offsetof(memory_text_t, text));
+
+        __atomic_store_n(&text->evicted, 1, __ATOMIC_SEQ_CST);
+        sqlite3_int64 id = __atomic_load_n(&text->id, __ATOMIC_SEQ_CST);
+        if (id > 0) {
+            cold_extend(id);
+        }
+    }
+    entry_release(entry);
+}
+
+/* Ranking weight of a memory saved at TIMESTAMP: halves every half-life
+   down towards DECAY_FLOOR */
+static double memory_decay(time_t timestamp, time_t now) {
+    if (g_memory->half_life <= 0 || timestamp >= now) {
+        return 1.0;
+    }
+    return DECAY_FLOOR + (1.0 - DECAY_FLOOR) * exp2(-(double)(now - timestamp) / g_memory->half_life);
+}
+
+/* Wait for the background load to finish */
+static void memory_wait_loaded(void) {
+    pthread_mutex_lock(&g_memory->load_mutex);
+    while (g_memory->loading) {
+        pthread_cond_wait(&g_memory->loaded_cond, &g_memory->load_mutex);
+    }
+    pthread_mutex_unlock(&g_memory->load_mutex);
+}
+
+/* Wait until memories added so far are in the store */
+static void memory_wait_ingested(void) {
+    pthread_mutex_lock(&g_memory->ingest_mutex);
+    unsigned long target = g_memory->ingest_queued;
+    while (g_memory->ingest_done < target) {
+        pthread_cond_wait(&g_memory->ingested_cond, &g_memory->ingest_mutex);
+    }
+    pthread_mutex_unlock(&g_memory->ingest_mutex);
+}
+
+/* Take the store lock shared, for lookups */
+static void memory_read_lock(void) {
+    memory_wait_loaded();
+    memory_wait_ingested();
+    pthread_rwlock_rdlock(&g_memory->lock);
+}
+
+/* Take the store lock exclusively, for changes */
+static void memory_write_lock(void) {
+    memory_wait_loaded();
+    pthread_rwlock_wrlock(&g_memory->lock);
+}
+
+/* Restore the min-heap property below position I */
+static void hit_sift_down(memory_hit_t *heap, int size, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+
+        if (left < size && heap[left].score < heap[smallest].score) {
+            smallest = left;
+        }
+        if (right < size && heap[right].score < heap[smallest].score) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+
+        memory_hit_t temp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = temp;
+        i = smallest;
+    }
+}
+
+/* Offer candidate INDEX with SCORE to a min-heap of at most LIMIT hits */
+static void hit_offer(memory_hit_t *heap, int *size, int limit, int index, float score) {
+    if (*size < limit) {
+        heap[*size].index = index;
+        heap[*size].score = score;
+        if (++*size == limit) {
+            for (int j = limit / 2 - 1; j >= 0; j--) {
+                hit_sift_down(heap, limit, j);
+            }
+        }
+    } else if (limit > 0 && score > heap[0].score) {
+        heap[0].index = index;
+        heap[0].score = score;
+        hit_sift_down(heap, limit, 0);
+    }
+}
+
+/* Centroid closest to the unit vector V */
+static int ivf_nearest(const float *centroids, int nlist, const float *v) {
+    int best = 0;
+    float best_score = -2.0;
+
+    for (int c = 0; c < nlist; c++) {
+        float score = dot_product(centroids + (size_t)c * MEMORY_DIMENSION, v);
+        if (score > best_score) {
+            best_score = score;
+            best = c;
+        }
+    }
+    return best;
+}
+
+/* File SLOT under its nearest centroid */
+static int ivf_assign(int slot) {
+    int c = ivf_nearest(g_memory->centroids, g_memory->nlist, g_memory->entries[slot].embedding);
+    ivf_list_t *list = &g_memory->lists[c];
+
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        int *members = realloc(list->members, capacity * sizeof(int));
+        if (!members) {
+            return -1;
+        }
+        list->members = members;
+        list->capacity = capacity;
+    }
+
+    g_memory->slot_list[slot] = c;
+    g_memory->slot_pos[slot] = list->count;
+    list->members[list->count++] = slot;
+    return 0;
+}
+
+/* Take SLOT out of its list, if it is in one */
+static void ivf_unassign(int slot) {
+    int c = g_memory->slot_list[slot];
+
+    if (c < 0) {
+        return;
+    }
+
+    ivf_list_t *list = &g_memory->lists[c];
+    int pos = g_memory->slot_pos[slot];
+    int last = list->members[--list->count];
+
+    list->members[pos] = last;
+    g_memory->slot_pos[last] = pos;
+    g_memory->slot_list[slot] = -1;
+}
+
+/* Drop the index, keeping the entries */
+static void ivf_reset(void) {
+    if (g_memory->lists) {
+        for (int c = 0; c < g_memory->nlist; c++) {
+            free(g_memory->lists[c].members);
+        }
+    }
+    free(g_memory->lists);
+    free(g_memory->centroids);
+    g_memory->lists = NULL;
+    g_memory->centroids = NULL;
+    g_memory->nlist = 0;
+
+    for (int i = 0; i < g_memory->capacity; i++) {
+        g_memory->slot_list[i] = -1;
+    }
+}
+
+/* Install CENTROIDS (takes ownership) and file every live slot */
+static int ivf_build(float *centroids, int nlist) {
+    ivf_reset();
+
+    g_memory->lists = calloc(nlist, sizeof(ivf_list_t));
+    if (!g_memory->lists) {
+        free(centroids);
         return -1;
     }
+    g_memory->centroids = centroids;
+    g_memory->nlist = nlist;
+    g_memory->trained_count = g_memory->count;
 
-    pthread_mutex_init(&g_memory->mutex, NULL);
+    for (int i = 0; i < g_memory->count; i++) {
+        if (ivf_assign(i) != 0) {
+            ivf_reset();
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    /* Initialize SQLite database */
-    int rc = sqlite3_open(MEMORY_DB_PATH, &g_memory->db);
-    if (rc != SQLITE_OK) {
-        ANBS_DEBUG_LOG("Failed to open memory database: %s", sqlite3_errmsg(g_memory->db));
-        anbs_memory_cleanup();
+/* Persist the centroids next to the memories */
+static void ivf_save(void) {
+    sqlite3_stmt *stmt;
+
+    sqlite3_exec(g_memory->db, "BEGIN; DELETE FROM memory_index;", NULL, NULL, NULL);
+    if (sqlite3_prepare_v2(g_memory->db,
+                           "INSERT INTO memory_index (list, centroid) VALUES (?, ?)",
+                           -1, &stmt, NULL) == SQLITE_OK) {
+        for (int c = 0; c < g_memory->nlist; c++) {
+            sqlite3_bind_int(stmt, 1, c);
+            sqlite3_bind_blob(stmt, 2, g_memory->centroids + (size_t)c * MEMORY_DIMENSION,
+                              MEMORY_DIMENSION * sizeof(float), SQLITE_STATIC);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_exec(g_memory->db, "COMMIT;", NULL, NULL, NULL);
+}
+
+/* Load persisted centroids; returns the list count, or 0 if there are none */
+static int ivf_load(float **centroids) {
+    sqlite3_stmt *stmt;
+    int nlist = 0;
+
+    *centroids = NULL;
+    if (sqlite3_prepare_v2(g_memory->db, "SELECT centroid FROM memory_index ORDER BY list",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+
+    float *rows = aligned_alloc(EMBEDDING_ALIGN, (size_t)IVF_MAX_LISTS * MEMORY_DIMENSION * sizeof(float));
+    while (rows && nlist < IVF_MAX_LISTS && sqlite3_step(stmt) == SQLITE_ROW) {
+        if ((size_t)sqlite3_column_bytes(stmt, 0) != ROW_BYTES) {
+            nlist = 0;      /* trained for another embedder */
+            break;
+        }
+        memcpy(rows + (size_t)nlist * MEMORY_DIMENSION, sqlite3_column_blob(stmt, 0),
+               MEMORY_DIMENSION * sizeof(float));
+        nlist++;
+    }
+    sqlite3_finalize(stmt);
+
+    if (nlist == 0) {
+        free(rows);
+        return 0;
+    }
+    *centroids = rows;
+    return nlist;
+}
+
+/* Train sqrt(count) centroids with spherical k-means over a strided sample */
+static int ivf_train(void) {
+    int nlist = (int)sqrt((double)g_memory->count);
+    nlist = nlist < IVF_MIN_LISTS ? IVF_MIN_LISTS : nlist > IVF_MAX_LISTS ? IVF_MAX_LISTS : nlist;
+
+    int samples = nlist * IVF_TRAIN_SAMPLES;
+    if (samples > g_memory->count) {
+        samples = g_memory->count;
+    }
+    int stride = g_memory->count / samples;
+
+    size_t bytes = (size_t)nlist * MEMORY_DIMENSION * sizeof(float);
+    float *centroids = aligned_alloc(EMBEDDING_ALIGN, bytes);
+    float *sums = aligned_alloc(EMBEDDING_ALIGN, bytes);
+    int *sizes = malloc(nlist * sizeof(int));
+    if (!centroids || !sums || !sizes) {
+        free(centroids);
+        free(sums);
+        free(sizes);
+        return -1;
+    }
+
+    /* Seed with evenly spaced entries */
+    for (int c = 0; c < nlist; c++) {
+        memcpy(centroids + (size_t)c * MEMORY_DIMENSION,
+               g_memory->entries[(size_t)c * g_memory->count / nlist].embedding,
+               MEMORY_DIMENSION * sizeof(float));
+    }
+
+    for (int round = 0; round < IVF_TRAIN_ROUNDS; round++) {
+        memset(sums, 0, bytes);
+        memset(sizes, 0, nlist * sizeof(int));
+
+        for (int s = 0; s < samples; s++) {
+            const float *v = g_memory->entries[s * stride].embedding;
+            int c = ivf_nearest(centroids, nlist, v);
+            float *sum = sums + (size_t)c * MEMORY_DIMENSION;
+
+            for (int d = 0; d < MEMORY_DIMENSION; d++) {
+                sum[d] += v[d];
+            }
+            sizes[c]++;
+        }
+
+        /* Empty lists keep their old centroid */
+        for (int c = 0; c < nlist; c++) {
+            if (sizes[c] > 0) {
+                float *centroid = centroids + (size_t)c * MEMORY_DIMENSION;
+                memcpy(centroid, sums + (size_t)c * MEMORY_DIMENSION, MEMORY_DIMENSION * sizeof(float));
+                normalize_embedding(centroid);
+            }
+        }
+    }
+
+    free(sums);
+    free(sizes);
+
+    if (ivf_build(centroids, nlist) != 0) {
+        return -1;
+    }
+    ivf_save();
+
+    ANBS_DEBUG_LOG("Memory index trained: %d lists over %d entries", nlist, g_memory->count);
+    return 0;
+}
+
+/* Train the index once the store is big enough, and again each time it
+   has doubled since the last training */
+static void ivf_maybe_train(void) {
+    if (g_memory->count < IVF_MIN_ENTRIES) {
+        return;
+    }
+    if (!g_memory->centroids || g_memory->count >= 2 * g_memory->trained_count) {
+        ivf_train();
+    }
+}
+
+/* Copy the next token at *CURSOR into TOKEN, lowercased.  Tokens keep the
+   punctuation of hostnames, paths, flags and error codes; returns the
+   token length, or 0 at the end of the text. */
+static int lex_next_token(const char **cursor, char *token) {
+    const char *p = *cursor;
+
+    for (;;) {
+        int len = 0, alnum = 0;
+
+        while (*p && !isalnum((unsigned char)*p) && !strchr("-_./", *p)) {
+            p++;
+        }
+        if (!*p) {
+            *cursor = p;
+            return 0;
+        }
+        while (*p && (isalnum((unsigned char)*p) || strchr("-_./:@=+", *p))) {
+            alnum |= isalnum((unsigned char)*p);
+            if (len < LEX_MAX_TOKEN - 1) {
+                token[len++] = tolower((unsigned char)*p);
+            }
+            p++;
+        }
+        while (len > 0 && strchr(".:", token[len - 1])) {
+            len--;      /* sentence punctuation */
+        }
+        token[len] = '\0';
+
+        if (len > 0 && alnum) {
+            *cursor = p;
+            return len;
+        }
+    }
+}
+
+/* Distinct tokens of TEXT with their counts; returns how many */
+static int lex_tokenize(const char *text, char (*tokens)[LEX_MAX_TOKEN], int *tf, int max, int *total) {
+    char token[LEX_MAX_TOKEN];
+    int distinct = 0;
+
+    *total = 0;
+    while (lex_next_token(&text, token) > 0) {
+        int i;
+        (*total)++;
+        for (i = 0; i < distinct && strcmp(tokens[i], token) != 0; i++)
+            ;
+        if (i < distinct) {
+            tf[i]++;
+        } else if (distinct < max) {
+            strcpy(tokens[distinct], token);
+            tf[distinct++] = 1;
+        }
+    }
+    return distinct;
+}
+
+static unsigned lex_hash(const char *text) {
+    unsigned hash = 2166136261u;
+
+    while (*text) {
+        hash = (hash ^ (unsigned char)*text++) * 16777619u;
+    }
+    return hash % LEX_BUCKETS;
+}
+
+static lex_term_t *lex_find(const char *text, int create) {
+    unsigned bucket = lex_hash(text);
+    lex_term_t *term;
+
+    for (term = g_memory->lex_buckets[bucket]; term; term = term->next) {
+        if (strcmp(term->text, text) == 0) {
+            return term;
+        }
+    }
+    if (!create || !(term = calloc(1, sizeof(lex_term_t))) || !(term->text = strdup(text))) {
+        free(term);
+        return NULL;
+    }
+    term->next = g_memory->lex_buckets[bucket];
+    g_memory->lex_buckets[bucket] = term;
+    return term;
+}
+
+static int lex_posting_live(const lex_posting_t *posting) {
+    return g_memory->slot_gen[posting->slot] == posting->gen;
+}
+
+/* The next character of text at *CURSOR with case folded and runs of
+   white space read as one blank, or 0 at the (trimmed) end */
+static int dedup_char(const char **cursor) {
+    const char *p = *cursor;
+
+    if (isspace((unsigned char)*p)) {
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        *cursor = p;
+        return *p ? ' ' : 0;
+    }
+    if (*p == '\0') {
+        return 0;
+    }
+    *cursor = p + 1;
+    return tolower((unsigned char)*p);
+}
+
+/* FNV-1a over the normalized TEXT */
+static uint64_t dedup_hash(const char *text) {
+    uint64_t hash = 14695981039346656037ULL;
+    int c;
+
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+    while ((c = dedup_char(&text)) != 0) {
+        hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Whether A and B are the same text once normalized */
+static int dedup_equal(const char *a, const char *b) {
+    int ca, cb;
+
+    while (isspace((unsigned char)*a)) {
+        a++;
+    }
+    while (isspace((unsigned char)*b)) {
+        b++;
+    }
+    do {
+        ca = dedup_char(&a);
+        cb = dedup_char(&b);
+    } while (ca == cb && ca != 0);
+    return ca == cb;
+}
+
+/* The newest live slot whose content repeats TEXT, or -1 */
+static int dedup_find(const char *text) {
+    uint64_t hash = dedup_hash(text);
+
+    for (int slot = g_memory->dedup_buckets[hash & g_memory->dedup_mask]; slot >= 0;
+         slot = g_memory->dedup_next[slot]) {
+        if (g_memory->slot_hash[slot] == hash && dedup_equal(g_memory->entries[slot].content, text)) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static void dedup_unlink(int slot) {
+    int *link = &g_memory->dedup_buckets[g_memory->slot_hash[slot] & g_memory->dedup_mask];
+
+    while (*link >= 0 && *link != slot) {
+        link = &g_memory->dedup_next[*link];
+    }
+    if (*link == slot) {
+        *link = g_memory->dedup_next[slot];
+    }
+}
+
+/* Index the tokens of TEXT under SLOT, and its content hash */
+static void lex_add(int slot, const char *text) {
+    char tokens[LEX_MAX_DOC_TERMS][LEX_MAX_TOKEN];
+    int tf[LEX_MAX_DOC_TERMS];
+    int total;
+    int distinct = lex_tokenize(text, tokens, tf, LEX_MAX_DOC_TERMS, &total);
+
+    for (int i = 0; i < distinct; i++) {
+        lex_term_t *term = lex_find(tokens[i], 1);
+        if (!term) {
+            continue;
+        }
+
+        if (term->count == term->capacity) {
+            /* Drop stale postings before growing the list */
+            int live = 0;
+            for (int p = 0; p < term->count; p++) {
+                if (lex_posting_live(&term->postings[p])) {
+                    term->postings[live++] = term->postings[p];
+                }
+            }
+            term->count = live;
+        }
+        if (term->count == term->capacity) {
+            int capacity = term->capacity ? term->capacity * 2 : 4;
+            lex_posting_t *postings = realloc(term->postings, capacity * sizeof(lex_posting_t));
+            if (!postings) {
+                continue;
+            }
+            term->postings = postings;
+            term->capacity = capacity;
+        }
+
+        term->postings[term->count].slot = slot;
+        term->postings[term->count].gen = g_memory->slot_gen[slot];
+        term->postings[term->count].tf = tf[i];
+        term->count++;
+        term->df++;
+    }
+
+    g_memory->slot_terms[slot] = total;
+    g_memory->lex_total_terms += total;
+
+    uint64_t hash = dedup_hash(text);
+    g_memory->slot_hash[slot] = hash;
+    g_memory->dedup_next[slot] = g_memory->dedup_buckets[hash & g_memory->dedup_mask];
+    g_memory->dedup_buckets[hash & g_memory->dedup_mask] = slot;
+}
+
+/* Forget SLOT, whose entry held TEXT */
+static void lex_remove(int slot, const char *text) {
+    char tokens[LEX_MAX_DOC_TERMS][LEX_MAX_TOKEN];
+    int tf[LEX_MAX_DOC_TERMS];
+    int total;
+    int distinct = lex_tokenize(text, tokens, tf, LEX_MAX_DOC_TERMS, &total);
+
+    for (int i = 0; i < distinct; i++) {
+        lex_term_t *term = lex_find(tokens[i], 0);
+        if (term && term->df > 0) {
+            term->df--;
+        }
+    }
+
+    g_memory->slot_gen[slot]++;
+    g_memory->lex_total_terms -= g_memory->slot_terms[slot];
+    g_memory->slot_terms[slot] = 0;
+    dedup_unlink(slot);
+}
+
+/* Empty the index */
+static void lex_clear(void) {
+    for (int b = 0; b < LEX_BUCKETS; b++) {
+        lex_term_t *term = g_memory->lex_buckets[b];
+        while (term) {
+            lex_term_t *next = term->next;
+            free(term->text);
+            free(term->postings);
+            free(term);
+            term = next;
+        }
+        g_memory->lex_buckets[b] = NULL;
+    }
+    for (int i = 0; i < g_memory->capacity; i++) {
+        g_memory->slot_gen[i]++;
+        g_memory->slot_terms[i] = 0;
+    }
+    g_memory->lex_total_terms = 0;
+    for (int b = 0; b <= g_memory->dedup_mask; b++) {
+        g_memory->dedup_buckets[b] = -1;
+    }
+}
+
+/* Size the per-slot arrays for CAPACITY slots; the caller clears the
+   index first and re-adds the entries afterwards */
+static int lex_resize(int capacity) {
+    int buckets = 1;
+    while (buckets < capacity) {
+        buckets *= 2;
+    }
+
+    unsigned *slot_gen = calloc(capacity, sizeof(unsigned));
+    int *slot_terms = calloc(capacity, sizeof(int));
+    uint64_t *slot_hash = calloc(capacity, sizeof(uint64_t));
+    int *dedup_next = malloc(capacity * sizeof(int));
+    int *dedup_buckets = malloc(buckets * sizeof(int));
+
+    if (!g_memory->lex_buckets) {
+        g_memory->lex_buckets = calloc(LEX_BUCKETS, sizeof(lex_term_t *));
+    }
+    if (!slot_gen || !slot_terms || !slot_hash || !dedup_next || !dedup_buckets || !g_memory->lex_buckets) {
+        free(slot_gen);
+        free(slot_terms);
+        free(slot_hash);
+        free(dedup_next);
+        free(dedup_buckets);
+        return -1;
+    }
+    for (int b = 0; b < buckets; b++) {
+        dedup_buckets[b] = -1;
+    }
+
+    free(g_memory->slot_gen);
+    free(g_memory->slot_terms);
+    free(g_memory->slot_hash);
+    free(g_memory->dedup_next);
+    free(g_memory->dedup_buckets);
+    g_memory->slot_gen = slot_gen;
+    g_memory->slot_terms = slot_terms;
+    g_memory->slot_hash = slot_hash;
+    g_memory->dedup_next = dedup_next;
+    g_memory->dedup_buckets = dedup_buckets;
+    g_memory->dedup_mask = buckets - 1;
+    return 0;
+}
+
+/* Per-thread BM25 accumulators, so searches can run side by side; the
+   scores and match counts are zero between searches */
+static __thread struct {
+    float *scores;
+    unsigned char *matched;
+    int *touched;
+    int capacity;
+} t_lex;
+
+static pthread_key_t g_lex_key;
+static pthread_once_t g_lex_once = PTHREAD_ONCE_INIT;
+
+/* Free a thread's scratch when it exits */
+static void lex_scratch_free(void *unused) {
+    (void)unused;
+    free(t_lex.scores);
+    free(t_lex.matched);
+    free(t_lex.touched);
+    memset(&t_lex, 0, sizeof(t_lex));
+}
+
+static void lex_key_create(void) {
+    pthread_key_create(&g_lex_key, lex_scratch_free);
+}
+
+/* Make the scratch cover CAPACITY slots */
+static int lex_scratch(int capacity) {
+    if (t_lex.capacity >= capacity) {
+        return 0;
+    }
+
+    pthread_once(&g_lex_once, lex_key_create);
+    pthread_setspecific(g_lex_key, &t_lex);
+
+    free(t_lex.scores);
+    free(t_lex.matched);
+    free(t_lex.touched);
+    t_lex.scores = calloc(capacity, sizeof(float));
+    t_lex.matched = calloc(capacity, 1);
+    t_lex.touched = malloc(capacity * sizeof(int));
+    t_lex.capacity = capacity;
+
+    if (!t_lex.scores || !t_lex.matched || !t_lex.touched) {
+        free(t_lex.scores);
+        free(t_lex.matched);
+        free(t_lex.touched);
+        memset(&t_lex, 0, sizeof(t_lex));
+        return -1;
+    }
+    return 0;
+}
+
+/* BM25 over the entries containing any term of QUERY.  Leaves the scores
+   in T_LEX.SCORES for the returned number of slots listed in T_LEX.TOUCHED
+   (the caller resets them) and sets *FULL_MATCHES to how many contain
+   every term. */
+static int lex_score(const char *query, int *full_matches) {
+    char tokens[LEX_MAX_TERMS][LEX_MAX_TOKEN];
+    int tf[LEX_MAX_TERMS];
+    int total;
+    int terms = lex_tokenize(query, tokens, tf, LEX_MAX_TERMS, &total);
+    int touched = 0;
+
+    *full_matches = 0;
+    if (terms == 0 || g_memory->count == 0 || lex_scratch(g_memory->capacity) != 0) {
+        return 0;
+    }
+
+    double avgdl = (double)g_memory->lex_total_terms / g_memory->count;
+    if (avgdl <= 0.0) {
+        avgdl = 1.0;
+    }
+
+    for (int t = 0; t < terms; t++) {
+        lex_term_t *term = lex_find(tokens[t], 0);
+        if (!term || term->df == 0) {
+            continue;
+        }
+
+        double idf = log(1.0 + (g_memory->count - term->df + 0.5) / (term->df + 0.5));
+        for (int p = 0; p < term->count; p++) {
+            lex_posting_t *posting = &term->postings[p];
+            if (!lex_posting_live(posting)) {
+                continue;
+            }
+
+            int slot = posting->slot;
+            double norm = BM25_K1 * (1.0 - BM25_B + BM25_B * g_memory->slot_terms[slot] / avgdl);
+            if (t_lex.matched[slot] == 0) {
+                t_lex.touched[touched++] = slot;
+            }
+            t_lex.scores[slot] += idf * posting->tf * (BM25_K1 + 1.0) / (posting->tf + norm);
+            if (++t_lex.matched[slot] == terms) {
+                (*full_matches)++;
+            }
+        }
+    }
+    return touched;
+}
+
+/* Bind ROW to the prepared INSERT and run it */
+static int memory_write_row(sqlite3_stmt *stmt, const memory_write_t *row) {
+    sqlite3_bind_text(stmt, 1, row->content, -1, SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 2, row->embedding, MEMORY_DIMENSION * sizeof(float), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, row->timestamp);
+    sqlite3_bind_text(stmt, 4, row->context, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, row->source, -1, SQLITE_STATIC);
+    sqlite3_bind_double(stmt, 6, row->relevance_score);
+    if (row->origin) {
+        sqlite3_bind_text(stmt, 7, row->origin, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 8, row->origin_seq);
+    }
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE) {
+        return -1;
+    }
+
+    /* Another shell on this host saved the same replicated row first */
+    if (sqlite3_changes(sqlite3_db_handle(stmt)) == 0) {
+        return 0;
+    }
+
+    sqlite3_int64 id = sqlite3_last_insert_rowid(sqlite3_db_handle(stmt));
+    text_set_id(row->content, id);
+    vec_store(id, row->embedding);
+    return 0;
+}
+
+/* Bind the UPDATE of ROW's saved row and run it */
+static int memory_update_row(sqlite3_stmt *stmt, const memory_write_t *row) {
+    sqlite3_int64 id = __atomic_load_n(&((memory_text_t *)(row->content - offsetof(memory_text_t, text)))->id,
+                                       __ATOMIC_SEQ_CST);
+    if (id <= 0) {
+        return -1;
+    }
+
+    sqlite3_bind_int64(stmt, 1, row->timestamp);
+    sqlite3_bind_text(stmt, 2, row->context, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, id);
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+static void memory_write_free(memory_write_t *row) {
+    text_unref(row->content);
+    text_unref(row->context);
+    text_unref(row->source);
+    text_unref(row->origin);
+    anbs_optimize_free(row, WRITE_BYTES);
+}
+
+/* Drain the write queue, one transaction per batch */
+static void *memory_writer_thread(void *arg) {
+    (void)arg;
+    anbs_thread_name("anbs-mem-write");
+
+    pthread_mutex_lock(&g_memory->write_mutex);
+    for (;;) {
+        while (!g_memory->write_head && !g_memory->writer_stop) {
+            pthread_cond_wait(&g_memory->write_cond, &g_memory->write_mutex);
+        }
+        if (!g_memory->write_head) {
+            break;
+        }
+
+        memory_write_t *batch = g_memory->write_head;
+        g_memory->write_head = g_memory->write_tail = NULL;
+        pthread_mutex_unlock(&g_memory->write_mutex);
+
+        int rows = 0;
+        sqlite3_exec(g_memory->writer_db, "BEGIN", NULL, NULL, NULL);
+        while (batch) {
+            memory_write_t *next = batch->next;
+            int rc = batch->update ? memory_update_row(g_memory->update_stmt, batch)
+                                   : memory_write_row(g_memory->insert_stmt, batch);
+            if (rc != 0) {
+                ANBS_DEBUG_LOG("Failed to save memory: %s", sqlite3_errmsg(g_memory->writer_db));
+            }
+            memory_write_free(batch);
+            batch = next;
+            rows++;
+        }
+        sqlite3_exec(g_memory->writer_db, "COMMIT", NULL, NULL, NULL);
+
+        pthread_mutex_lock(&g_memory->write_mutex);
+        g_memory->write_pending -= rows;
+        if (g_memory->write_pending == 0) {
+            pthread_cond_broadcast(&g_memory->flushed_cond);
+        }
+    }
+    pthread_mutex_unlock(&g_memory->write_mutex);
+
+    return NULL;
+}
+
+/* Open the writer's connection and start it; on failure saves stay synchronous */
+static void memory_writer_start(void) {
+    const char *sql =
+        "INSERT OR IGNORE INTO memories (content, embedding, timestamp, context, source, relevance_score, "
+        "origin, origin_seq) VALUES (?, ?, ?, ?, ?, ?, ?, ?)";
+    const char *update_sql =
+        "UPDATE memories SET timestamp = ?, context = ?, seen = seen + 1 WHERE id = ?";
+
+    if (sqlite3_open(g_memory->db_path, &g_memory->writer_db) != SQLITE_OK ||
+        sqlite3_busy_timeout(g_memory->writer_db, 5000) != SQLITE_OK ||
+        sqlite3_exec(g_memory->writer_db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(g_memory->writer_db, sql, -1, &g_memory->insert_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(g_memory->writer_db, update_sql, -1, &g_memory->update_stmt, NULL) != SQLITE_OK ||
+        pthread_create(&g_memory->writer, NULL, memory_writer_thread, NULL) != 0) {
+        ANBS_DEBUG_LOG("Memory writer unavailable, saving synchronously");
+        sqlite3_finalize(g_memory->insert_stmt);
+        sqlite3_finalize(g_memory->update_stmt);
+        sqlite3_close(g_memory->writer_db);
+        g_memory->insert_stmt = NULL;
+        g_memory->update_stmt = NULL;
+        g_memory->writer_db = NULL;
+        return;
+    }
+    g_memory->writer_running = 1;
+}
+
+/* Stop the writer after it has committed everything queued */
+static void memory_writer_stop(void) {
+    if (!g_memory->writer_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_memory->write_mutex);
+    g_memory->writer_stop = 1;
+    pthread_cond_signal(&g_memory->write_cond);
+    pthread_mutex_unlock(&g_memory->write_mutex);
+
+    pthread_join(g_memory->writer, NULL);
+    g_memory->writer_running = 0;
+
+    sqlite3_finalize(g_memory->insert_stmt);
+    sqlite3_finalize(g_memory->update_stmt);
+    sqlite3_close(g_memory->writer_db);
+    g_memory->insert_stmt = NULL;
+    g_memory->update_stmt = NULL;
+    g_memory->writer_db = NULL;
+}
+
+/* Embed a batch of queued rows with as few inference calls as the
+   embedder's batch size allows */
+static void memory_embed_batch(memory_write_t *batch) {
+    int count = 0;
+
+    for (memory_write_t *row = batch; row; row = row->next) {
+        count++;
+    }
+
+    const char **texts = malloc(count * sizeof(char *));
+    float *rows = texts ? aligned_alloc(EMBEDDING_ALIGN, (size_t)count * ROW_BYTES) : NULL;
+    if (!rows) {
+        free(texts);
+        for (memory_write_t *row = batch; row; row = row->next) {
+            memory_embed_texts((const char *const *)&row->content, 1, row->embedding);
+        }
+        return;
+    }
+
+    int i = 0;
+    for (memory_write_t *row = batch; row; row = row->next) {
+        texts[i++] = row->content;
+    }
+    memory_embed_texts(texts, count, rows);
+
+    i = 0;
+    for (memory_write_t *row = batch; row; row = row->next) {
+        memcpy(row->embedding, rows + (size_t)i++ * MEMORY_DIMENSION, ROW_BYTES);
+    }
+    free(rows);
+    free(texts);
+}
+
+/* Embed and insert queued rows, a batch per lock hold */
+static void *memory_ingest_thread(void *arg) {
+    (void)arg;
+    anbs_thread_name("anbs-mem-ingest");
+
+    pthread_mutex_lock(&g_memory->ingest_mutex);
+    for (;;) {
+        while (!g_memory->ingest_head && !g_memory->ingest_stop) {
+            pthread_cond_wait(&g_memory->ingest_cond, &g_memory->ingest_mutex);
+        }
+        if (!g_memory->ingest_head) {
+            break;
+        }
+
+        memory_write_t *batch = g_memory->ingest_head;
+        g_memory->ingest_head = g_memory->ingest_tail = NULL;
+        pthread_mutex_unlock(&g_memory->ingest_mutex);
+
+        memory_embed_batch(batch);
+
+        int rows = 0;
+        memory_write_lock();
+        for (memory_write_t *row = batch; row; row = row->next) {
+            memory_insert_locked(row);
+            rows++;
+        }
+        pthread_rwlock_unlock(&g_memory->lock);
+
+        while (batch) {
+            memory_write_t *next = batch->next;
+            memory_write_free(batch);
+            batch = next;
+        }
+
+        pthread_mutex_lock(&g_memory->ingest_mutex);
+        g_memory->ingest_done += rows;
+        pthread_cond_broadcast(&g_memory->ingested_cond);
+    }
+    pthread_mutex_unlock(&g_memory->ingest_mutex);
+
+    return NULL;
+}
+
+/* Stop the ingest worker after it has inserted everything queued */
+static void memory_ingest_stop(void) {
+    if (!g_memory->ingest_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_memory->ingest_mutex);
+    g_memory->ingest_stop = 1;
+    pthread_cond_signal(&g_memory->ingest_cond);
+    pthread_mutex_unlock(&g_memory->ingest_mutex);
+
+    pthread_join(g_memory->ingester, NULL);
+    g_memory->ingest_running = 0;
+}
+
+/* Wait until every added memory is inserted and committed */
+int anbs_memory_flush(void) {
+    if (!MEMORY_READY()) {
+        return -1;
+    }
+
+    memory_wait_ingested();
+    pthread_mutex_lock(&g_memory->write_mutex);
+    while (g_memory->write_pending > 0) {
+        pthread_cond_wait(&g_memory->flushed_cond, &g_memory->write_mutex);
+    }
+    pthread_mutex_unlock(&g_memory->write_mutex);
+    return 0;
+}
+
+/* Don't lose queued memories when the shell exits */
+static void memory_atexit(void) {
+    anbs_memory_flush();
+}
+
+/* A forked subshell has no writer or ingest thread and leaves the
+   parent's queues to the parent; its own adds and saves become
+   synchronous.  If the background load
+   was still running it starts from an empty store instead. */
+static void memory_atfork_child(void) {
+    if (!g_memory) {
+        return;
+    }
+
+    pthread_rwlock_init(&g_memory->lock, NULL);
+    pthread_mutex_init(&g_memory->load_mutex, NULL);
+    pthread_cond_init(&g_memory->loaded_cond, NULL);
+    if (g_memory->loading) {
+        g_memory->head = 0;
+        g_memory->count = 0;
+        g_memory->centroids = NULL;
+        g_memory->lists = NULL;
+        g_memory->nlist = 0;
+        for (int i = 0; i < g_memory->capacity; i++) {
+            g_memory->slot_list[i] = -1;
+        }
+        memset(g_memory->lex_buckets, 0, LEX_BUCKETS * sizeof(lex_term_t *));
+        g_memory->lex_total_terms = 0;
+        for (int b = 0; b <= g_memory->dedup_mask; b++) {
+            g_memory->dedup_buckets[b] = -1;
+        }
+        g_memory->loading = 0;
+    }
+    g_memory->loader_running = 0;
+
+    pthread_mutex_init(&g_memory->write_mutex, NULL);
+    pthread_cond_init(&g_memory->write_cond, NULL);
+    pthread_cond_init(&g_memory->flushed_cond, NULL);
+    g_memory->write_head = g_memory->write_tail = NULL;
+    g_memory->write_pending = 0;
+    g_memory->writer_running = 0;
+    g_memory->insert_stmt = NULL;
+    g_memory->update_stmt = NULL;
+    g_memory->writer_db = NULL;
+
+    /* Rows the parent had yet to ingest are the parent's; adds made here
+       are embedded and inserted by the caller */
+    pthread_mutex_init(&g_memory->ingest_mutex, NULL);
+    pthread_cond_init(&g_memory->ingest_cond, NULL);
+    pthread_cond_init(&g_memory->ingested_cond, NULL);
+    g_memory->ingest_head = g_memory->ingest_tail = NULL;
+    g_memory->ingest_done = g_memory->ingest_queued;
+    g_memory->ingest_running = 0;
+
+    /* The scan workers stayed in the parent; start new ones on demand */
+    pthread_mutex_init(&g_memory->scan_mutex, NULL);
+    pthread_cond_init(&g_memory->scan_cond, NULL);
+    pthread_cond_init(&g_memory->scan_done_cond, NULL);
+    free(g_memory->scan_threads);
+    g_memory->scan_threads = NULL;
+    g_memory->scan_nthreads = 0;
+    g_memory->scan_jobs = NULL;
+
+    pthread_mutex_init(&g_memory->replica_mutex, NULL);
+}
+
+/* Embed the loaded entries in SLOTS in one go, then save and quantize
+   them as memory_load_locked() does the rest.  Called with the store
+   locked. */
+static void memory_load_embed(const int *slots, int count) {
+    const char **texts = malloc(count * sizeof(char *));
+    float *rows = texts ? aligned_alloc(EMBEDDING_ALIGN, (size_t)count * ROW_BYTES) : NULL;
+
+    if (rows) {
+        for (int i = 0; i < count; i++) {
+            texts[i] = g_memory->entries[slots[i]].content;
+        }
+        memory_embed_texts(texts, count, rows);
+    }
+
+    for (int i = 0; i < count; i++) {
+        memory_entry_t *entry = &g_memory->entries[slots[i]];
+        memory_text_t *text = (memory_text_t *)(entry->content - offsetof(memory_text_t, text));
+
+        if (rows) {
+            memcpy(entry->embedding, rows + (size_t)i * MEMORY_DIMENSION, ROW_BYTES);
+        } else {
+            memory_embed_texts((const char *const *)&entry->content, 1, entry->embedding);
+        }
+        vec_store(text->id, entry->embedding);
+        if (g_memory->codes) {
+            quantize_embedding(entry->embedding, g_memory->codes + (size_t)slots[i] * MEMORY_DIMENSION,
+                               &g_memory->code_scales[slots[i]]);
+        }
+    }
+    free(rows);
+    free(texts);
+}
+
+/* Load the newest CAPACITY memories, oldest first to match the ring
+   order.  When the sidecar holds all of their rows they are mapped rather
+   than read; otherwise the rows come from the database and the sidecar is
+   repaired.  Rows whose saved embedding is unusable are embedded afresh,
+   together, once the rest are in.  Called with the store locked. */
+static int memory_load_locked(void) {
+    sqlite3_stmt *stmt;
+    sqlite3_int64 first_id = 0, last_id = 0;
+    int rows = 0;
+    int *stale = NULL, nstale = 0;
+
+    for (int i = 0; i < g_memory->count; i++) {
+        entry_release(&g_memory->entries[(g_memory->head + i) % g_memory->capacity]);
+    }
+    ivf_reset();
+    lex_clear();
+    g_memory->head = 0;
+    g_memory->count = 0;
+
+    if (sqlite3_prepare_v2(g_memory->db,
+                           "SELECT MIN(id), MAX(id), COUNT(*) FROM "
+                           "(SELECT id FROM memories ORDER BY id DESC LIMIT ?)",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, g_memory->capacity);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        first_id = sqlite3_column_int64(stmt, 0);
+        last_id = sqlite3_column_int64(stmt, 1);
+        rows = sqlite3_column_int(stmt, 2);
+    }
+    sqlite3_finalize(stmt);
+    __atomic_store_n(&g_memory->cold_last_id, first_id > 0 ? first_id - 1 : 0, __ATOMIC_RELAXED);
+
+    /* Start from a fresh matrix; the old one may be a file mapping */
+    void *map;
+    size_t map_length;
+    float *matrix = matrix_alloc(g_memory->capacity, &map, &map_length);
+    if (!matrix) {
+        return -1;
+    }
+    matrix_free(g_memory->matrix_map, g_memory->matrix_map_length);
+    g_memory->matrix = matrix;
+    g_memory->matrix_map = map;
+    g_memory->matrix_map_length = map_length;
+
+    struct stat st;
+    int mapped = 0;
+    if (rows > 0 && last_id - first_id + 1 == rows && g_memory->vec_fd >= 0 &&
+        fstat(g_memory->vec_fd, &st) == 0 && st.st_size >= vec_offset(last_id + 1)) {
+        matrix = vec_map(map, first_id, rows);
+        if (matrix) {
+            g_memory->matrix = matrix;
+            mapped = 1;
+        }
+    }
+
+    const char *sql =
+        "SELECT id, content, embedding, timestamp, context, source, seen FROM "
+        "(SELECT * FROM memories ORDER BY id DESC LIMIT ?) ORDER BY id";
+    suggest_item_t *suggest = NULL;
+    int nsuggest = 0;
+
+    if (__atomic_load_n(&g_suggest_active, __ATOMIC_ACQUIRE)) {
+        suggest = malloc(g_memory->capacity * sizeof(suggest_item_t));
+    }
+
+    if (!mapped) {
+        stale = malloc(g_memory->capacity * sizeof(int));
+    }
+
+    if (sqlite3_prepare_v2(g_memory->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        free(stale);
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, g_memory->capacity);
+
+    int features = strcmp(anbs_embedder_id(memory_embedder()), "features") == 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW && g_memory->count < g_memory->capacity) {
+        memory_entry_t *entry = &g_memory->entries[g_memory->count];
+
+        const char *content = (const char*)sqlite3_column_text(stmt, 1);
+        int pending = 0;
+
+        entry->content = text_new(content);
+        entry->embedding = g_memory->matrix + (size_t)g_memory->count * MEMORY_DIMENSION;
+        if (entry->content) {
+            text_set_id(entry->content, sqlite3_column_int64(stmt, 0));
+        }
+
+        if (!mapped) {
+            const void *embedding_blob = sqlite3_column_blob(stmt, 2);
+            int embedding_size = sqlite3_column_bytes(stmt, 2);
+
+            if (__atomic_load_n(&g_memory->embeddings_stale, __ATOMIC_RELAXED)) {
+                embedding_size = 0;
+            }
+            if (embedding_size == (int)ROW_BYTES) {
+                memcpy(entry->embedding, embedding_blob, embedding_size);
+            } else if (features && embedding_size == EMBEDDING_DIMENSION * sizeof(float)) {
+                /* Legacy full-width row: everything past MEMORY_DIMENSION is zero */
+                memcpy(entry->embedding, embedding_blob, ROW_BYTES);
+            } else if (stale && entry->content) {
+                stale[nstale++] = g_memory->count;  /* embedded with the others below */
+                pending = 1;
+            } else {
+                memory_embed_texts((const char *const *)&entry->content, 1, entry->embedding);
+            }
+            if (!pending) {
+                normalize_embedding(entry->embedding);  /* rows saved before normalization */
+                vec_store(sqlite3_column_int64(stmt, 0), entry->embedding);
+            }
+        }
+        if (g_memory->codes && !pending) {
+            quantize_embedding(entry->embedding, g_memory->codes + (size_t)g_memory->count * MEMORY_DIMENSION,
+                               &g_memory->code_scales[g_memory->count]);
+        }
+
+        entry->timestamp = sqlite3_column_int64(stmt, 3);
+
+        const char *context = (const char*)sqlite3_column_text(stmt, 4);
+        entry->context = context ? text_new(context) : NULL;
+
+        const char *source = (const char*)sqlite3_column_text(stmt, 5);
+        entry->source = text_new(source ? source : "unknown");
+
+        entry->relevance_score = 0.0;
+        entry->seen = sqlite3_column_int(stmt, 6);
+
+        if (suggest && entry->content && entry->source && strcmp(entry->source, "history") == 0 &&
+            (suggest[nsuggest].command = strdup(entry->content))) {
+            suggest[nsuggest].last = entry->timestamp;
+            suggest[nsuggest].count = entry->seen > 0 ? entry->seen : 1;
+            nsuggest++;
+        }
+
+        lex_add(g_memory->count, entry->content);
+        g_memory->count++;
+    }
+    sqlite3_finalize(stmt);
+
+    if (nstale > 0) {
+        memory_load_embed(stale, nstale);
+    }
+    free(stale);
+
+    if (suggest) {
+        suggest_merge(suggest, nsuggest);
+    }
+
+    /* Reuse the persisted centroids rather than retraining at startup,
+       unless they were trained on another embedder's vectors */
+    float *centroids;
+    int nlist = g_memory->count >= IVF_MIN_ENTRIES &&
+                !__atomic_load_n(&g_memory->embeddings_stale, __ATOMIC_RELAXED) ? ivf_load(&centroids) : 0;
+    if (nlist > 0) {
+        ivf_build(centroids, nlist);
+    } else {
+        ivf_maybe_train();
+    }
+
+    return g_memory->count;
+}
+
+/* Bring every saved embedding over to the current embedder.  Rows the
+   sidecar already holds, the ring's among them, are copied from it; the
+   rest are embedded a batch at a time and written to both.  The sidecar
+   was started afresh for this embedder, so a zero row there is one still
+   to do, and a pass cut short resumes where it stopped.  memory_meta
+   records the embedder only once every row is done.  Runs on its own
+   connection, without the store lock. */
+static void memory_reembed(void) {
+    const char *id = anbs_embedder_id(memory_embedder());
+    const char *texts[REEMBED_BATCH_ROWS];
+    sqlite3_int64 ids[REEMBED_BATCH_ROWS];
+    int todo[REEMBED_BATCH_ROWS];
+    float *rows = aligned_alloc(EMBEDDING_ALIGN, REEMBED_BATCH_ROWS * ROW_BYTES);
+    float *fresh = aligned_alloc(EMBEDDING_ALIGN, REEMBED_BATCH_ROWS * ROW_BYTES);
+    sqlite3 *db = NULL;
+    sqlite3_stmt *select = NULL, *update = NULL;
+    sqlite3_int64 after = 0;
+    int complete = 0, embedded = 0;
+
+    if (!rows || !fresh || g_memory->vec_fd < 0 ||
+        sqlite3_open(g_memory->db_path, &db) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT id, content FROM memories WHERE id > ? ORDER BY id LIMIT ?",
+                           -1, &select, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "UPDATE memories SET embedding = ? WHERE id = ?",
+                           -1, &update, NULL) != SQLITE_OK) {
+        goto out;
+    }
+    sqlite3_busy_timeout(db, 5000);
+
+    while (!__atomic_load_n(&g_memory->reembed_stop, __ATOMIC_RELAXED)) {
+        int n = 0, ntodo = 0;
+
+        sqlite3_bind_int64(select, 1, after);
+        sqlite3_bind_int(select, 2, REEMBED_BATCH_ROWS);
+        while (n < REEMBED_BATCH_ROWS && sqlite3_step(select) == SQLITE_ROW) {
+            const char *content = (const char *)sqlite3_column_text(select, 1);
+            float *row = rows + (size_t)n * MEMORY_DIMENSION;
+
+            ids[n] = sqlite3_column_int64(select, 0);
+            if (pread(g_memory->vec_fd, row, ROW_BYTES, vec_offset(ids[n])) != (ssize_t)ROW_BYTES ||
+                dot_product(row, row) == 0.0) {
+                texts[ntodo] = strdup(content ? content : "");
+                if (!texts[ntodo]) {
+                    break;
+                }
+                todo[ntodo++] = n;
+            }
+            n++;
+        }
+        sqlite3_reset(select);
+        if (n == 0) {
+            complete = 1;
+            break;
+        }
+        after = ids[n - 1];
+
+        if (ntodo > 0) {
+            /* An embedder that is down now leaves the rest for next time */
+            int rc = memory_embed_texts(texts, ntodo, fresh);
+            for (int i = 0; i < ntodo; i++) {
+                free((char *)texts[i]);
+            }
+            if (rc != 0) {
+                break;
+            }
+            for (int i = 0; i < ntodo; i++) {
+                memcpy(rows + (size_t)todo[i] * MEMORY_DIMENSION, fresh + (size_t)i * MEMORY_DIMENSION, ROW_BYTES);
+                vec_store(ids[todo[i]], fresh + (size_t)i * MEMORY_DIMENSION);
+            }
+            embedded += ntodo;
+        }
+
+        sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+        for (int i = 0; i < n; i++) {
+            sqlite3_bind_blob(update, 1, rows + (size_t)i * MEMORY_DIMENSION, ROW_BYTES, SQLITE_STATIC);
+            sqlite3_bind_int64(update, 2, ids[i]);
+            sqlite3_step(update);
+            sqlite3_reset(update);
+        }
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+
+    if (complete) {
+        sqlite3_stmt *meta;
+        if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO memory_meta VALUES ('embedder', ?)",
+                               -1, &meta, NULL) == SQLITE_OK) {
+            sqlite3_bind_text(meta, 1, id, -1, SQLITE_STATIC);
+            if (sqlite3_step(meta) == SQLITE_DONE) {
+                __atomic_store_n(&g_memory->embeddings_stale, 0, __ATOMIC_RELAXED);
+            }
+            sqlite3_finalize(meta);
+        }
+    }
+    ANBS_DEBUG_LOG("Re-embedded %d memories with %s%s", embedded, id, complete ? "" : ", stopped early");
+
+out:
+    sqlite3_finalize(select);
+    sqlite3_finalize(update);
+    sqlite3_close(db);
+    free(rows);
+    free(fresh);
+}
+
+/* Load the store, then let waiting callers in */
+static void *memory_loader_thread(void *arg) {
+    int startup_slot = anbs_startup_enter("ai_core", "memory load");
+
+    (void)arg;
+    anbs_thread_name("anbs-mem-load");
+
+    pthread_rwlock_wrlock(&g_memory->lock);
+    memory_load_locked();
+    pthread_rwlock_unlock(&g_memory->lock);
+    anbs_startup_leave(startup_slot, -1);
+
+    pthread_mutex_lock(&g_memory->load_mutex);
+    g_memory->loading = 0;
+    pthread_cond_broadcast(&g_memory->loaded_cond);
+    pthread_mutex_unlock(&g_memory->load_mutex);
+
+    ANBS_DEBUG_LOG("Memory system loaded %d entries", g_memory->count);
+
+    if (__atomic_load_n(&g_memory->embeddings_stale, __ATOMIC_RELAXED)) {
+        memory_reembed();
+    }
+    return NULL;
+}
+
+/* Open the store; the caller holds g_memory_init_mutex */
+static int memory_init_locked(void) {
+    if (g_memory) {
+        return 0; /* Already initialized */
+    }
+    int startup_slot = anbs_startup_enter("ai_core", "memory");
+
+    /* The embedder fixes the row width everything below is sized by */
+    if (!memory_embedder()) {
+        return -1;
+    }
+
+    g_memory = calloc(1, sizeof(memory_system_t));
+    if (!g_memory) {
+        return -1;
+    }
+
+    /* ANBS_MEMORY_DB moves the store, and its sidecar alongside */
+    const char *db_path = getenv("ANBS_MEMORY_DB");
+    if (db_path && *db_path) {
+        snprintf(g_memory->db_path, sizeof(g_memory->db_path), "%s", db_path);
+        snprintf(g_memory->vec_path, sizeof(g_memory->vec_path), "%s.vec", db_path);
+    } else {
+        strcpy(g_memory->db_path, MEMORY_DB_PATH);
+        strcpy(g_memory->vec_path, MEMORY_VEC_PATH);
+    }
+
+    const char *capacity = getenv("ANBS_MEMORY_CAPACITY");
+    g_memory->capacity = capacity && atoi(capacity) > 0 ? atoi(capacity) : MAX_MEMORY_ENTRIES;
+    g_memory->entries = calloc(g_memory->capacity, sizeof(memory_entry_t));
+    g_memory->matrix = matrix_alloc(g_memory->capacity, &g_memory->matrix_map, &g_memory->matrix_map_length);
+    g_memory->slot_list = malloc(g_memory->capacity * sizeof(int));
+    g_memory->slot_pos = malloc(g_memory->capacity * sizeof(int));
+    if (!g_memory->entries || !g_memory->matrix || !g_memory->slot_list || !g_memory->slot_pos) {
+        free(g_memory->entries);
+        matrix_free(g_memory->matrix_map, g_memory->matrix_map_length);
+        free(g_memory->slot_list);
+        free(g_memory->slot_pos);
+        free(g_memory);
+        g_memory = NULL;
+        return -1;
+    }
+    g_memory->vec_fd = -1;
+    for (int i = 0; i < g_memory->capacity; i++) {
+        g_memory->slot_list[i] = -1;
+    }
+    if (lex_resize(g_memory->capacity) != 0) {
+        free(g_memory->lex_buckets);
+        free(g_memory->entries);
+        matrix_free(g_memory->matrix_map, g_memory->matrix_map_length);
+        free(g_memory->slot_list);
+        free(g_memory->slot_pos);
+        free(g_memory);
+        g_memory = NULL;
+        return -1;
+    }
+
+    const char *quantize = getenv("ANBS_MEMORY_QUANTIZE");
+    if (quantize && strcmp(quantize, "int8") == 0) {
+        g_memory->codes = aligned_alloc(EMBEDDING_ALIGN, (size_t)g_memory->capacity * MEMORY_DIMENSION);
+        g_memory->code_scales = malloc(g_memory->capacity * sizeof(float));
+        if (!g_memory->codes || !g_memory->code_scales) {
+            free(g_memory->codes);
+            free(g_memory->code_scales);
+            g_memory->codes = NULL;
+            g_memory->code_scales = NULL;
+        }
+    }
+
+    /* More probed lists find more true neighbours and cost more time */
+    const char *nprobe = getenv("ANBS_MEMORY_NPROBE");
+    g_memory->nprobe = nprobe && atoi(nprobe) > 0 ? atoi(nprobe) : IVF_DEFAULT_NPROBE;
+
+    /* Older memories count for less, and the cold tier is only searched
+       when the ring has nothing close */
+    const char *threshold = getenv("ANBS_MEMORY_COLD_THRESHOLD");
+    g_memory->cold_threshold = threshold ? atof(threshold) : COLD_DEFAULT_THRESHOLD;
+    const char *half_life = getenv("ANBS_MEMORY_HALF_LIFE_DAYS");
+    g_memory->half_life = (half_life ? atof(half_life) : DECAY_DEFAULT_DAYS) * 86400.0;
+
+    /* Full scans of large stores use every core unless told otherwise */
+    const char *threads = getenv("ANBS_MEMORY_THREADS");
+    long scan_threads = threads ? atol(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (scan_threads > SCAN_MAX_THREADS) {
+        scan_threads = SCAN_MAX_THREADS;
+    }
+    g_memory->scan_workers = scan_threads > 1 ? (int)scan_threads - 1 : 0;
+
+    /* Prefer writers, so a stream of searches can't hold off an add */
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&g_memory->lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+    pthread_mutex_init(&g_memory->load_mutex, NULL);
+    pthread_cond_init(&g_memory->loaded_cond, NULL);
+    pthread_mutex_init(&g_memory->write_mutex, NULL);
+    pthread_cond_init(&g_memory->write_cond, NULL);
+    pthread_cond_init(&g_memory->flushed_cond, NULL);
+    pthread_mutex_init(&g_memory->ingest_mutex, NULL);
+    pthread_cond_init(&g_memory->ingest_cond, NULL);
+    pthread_cond_init(&g_memory->ingested_cond, NULL);
+    pthread_mutex_init(&g_memory->scan_mutex, NULL);
+    pthread_cond_init(&g_memory->scan_cond, NULL);
+    pthread_cond_init(&g_memory->scan_done_cond, NULL);
+    pthread_mutex_init(&g_memory->replica_mutex, NULL);
+
+    /* Initialize SQLite database */
+    int rc = sqlite3_open(g_memory->db_path, &g_memory->db);
+    if (rc != SQLITE_OK) {
+        ANBS_DEBUG_LOG("Failed to open memory database: %s", sqlite3_errmsg(g_memory->db));
+        anbs_memory_cleanup();
+        return -1;
+    }
+
+    /* Create tables */
+    const char *create_table_sql =
+        "CREATE TABLE IF NOT EXISTS memories ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "content TEXT NOT NULL,"
+        "embedding BLOB,"
+        "timestamp INTEGER,"
+        "context TEXT,"
+        "source TEXT,"
+        "relevance_score REAL DEFAULT 0.0,"
+        "seen INTEGER DEFAULT 1,"
+        "origin TEXT,"
+        "origin_seq INTEGER"
+        ");"
+        "CREATE TABLE IF NOT EXISTS memory_index ("
+        "list INTEGER PRIMARY KEY,"
+        "centroid BLOB NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS memory_meta ("
+        "key TEXT PRIMARY KEY,"
+        "value TEXT"
+        ");";
+
+    rc = sqlite3_exec(g_memory->db, create_table_sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        ANBS_DEBUG_LOG("Failed to create memory table: %s", sqlite3_errmsg(g_memory->db));
+        anbs_memory_cleanup();
+        return -1;
+    }
+
+    /* Databases from before repeats were collapsed lack the counter; this
+       fails harmlessly on the others */
+    sqlite3_exec(g_memory->db, "ALTER TABLE memories ADD COLUMN seen INTEGER DEFAULT 1", NULL, NULL, NULL);
+    sqlite3_exec(g_memory->db, "ALTER TABLE memories ADD COLUMN origin TEXT", NULL, NULL, NULL);
+    sqlite3_exec(g_memory->db, "ALTER TABLE memories ADD COLUMN origin_seq INTEGER", NULL, NULL, NULL);
+    sqlite3_exec(g_memory->db, "CREATE UNIQUE INDEX IF NOT EXISTS memories_origin ON memories (origin, origin_seq)",
+                 NULL, NULL, NULL);
+
+    /* Saved embeddings are only any use to the embedder that made them;
+       databases from before the choice were all made by features */
+    sqlite3_stmt *meta;
+    char saved[64] = "features";
+    if (sqlite3_prepare_v2(g_memory->db, "SELECT value FROM memory_meta WHERE key = 'embedder'",
+                           -1, &meta, NULL) == SQLITE_OK) {
+        if (sqlite3_step(meta) == SQLITE_ROW && sqlite3_column_text(meta, 0)) {
+            snprintf(saved, sizeof(saved), "%s", (const char *)sqlite3_column_text(meta, 0));
+        }
+        sqlite3_finalize(meta);
+    }
+    g_memory->embeddings_stale = strcmp(saved, anbs_embedder_id(memory_embedder())) != 0;
+
+    /* WAL lets the writer commit while searches and stats read, and
+       NORMAL syncs only at checkpoints instead of on every commit */
+    sqlite3_busy_timeout(g_memory->db, 5000);
+    sqlite3_exec(g_memory->db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;", NULL, NULL, NULL);
+
+    replica_open();
+
+    g_memory->vec_fd = vec_open();
+    memory_writer_start();
+    if (pthread_create(&g_memory->ingester, NULL, memory_ingest_thread, NULL) == 0) {
+        g_memory->ingest_running = 1;
+    } else {
+        ANBS_DEBUG_LOG("Memory ingest worker unavailable, adding synchronously");
+    }
+
+    /* Load existing memories in the background; the first call that
+       needs them waits */
+    g_memory->loading = 1;
+    if (pthread_create(&g_memory->loader, NULL, memory_loader_thread, NULL) == 0) {
+        g_memory->loader_running = 1;
+    } else {
+        pthread_rwlock_wrlock(&g_memory->lock);
+        memory_load_locked();
+        g_memory->loading = 0;
+        pthread_rwlock_unlock(&g_memory->lock);
+    }
+
+    static int hooks_registered = 0;
+    if (!hooks_registered) {
+        atexit(memory_atexit);
+        pthread_atfork(NULL, NULL, memory_atfork_child);
+        hooks_registered = 1;
+    }
+
+    ANBS_DEBUG_LOG("Memory system initialized");
+    anbs_startup_leave(startup_slot, -1);
+    return 0;
+}
+
+/* Initialize memory system */
+int anbs_memory_init(void) {
+    int result;
+
+    if (MEMORY_READY()) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_memory_init_mutex);
+    result = memory_init_locked();
+    if (result == 0) {
+        __atomic_store_n(&g_memory_ready, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_memory_init_mutex);
+    return result;
+}
+
+/* Record another sighting of ENTRY in its database row */
+static int memory_save_seen(const memory_entry_t *entry) {
+    if (g_memory->writer_running) {
+        memory_write_t *row = anbs_optimize_calloc(1, WRITE_BYTES);
+        if (!row) {
+            return -1;
+        }
+        row->update = 1;
+        row->content = text_ref(entry->content);
+        row->context = text_ref(entry->context);
+        row->timestamp = entry->timestamp;
+
+        pthread_mutex_lock(&g_memory->write_mutex);
+        if (g_memory->write_tail) {
+            g_memory->write_tail->next = row;
+        } else {
+            g_memory->write_head = row;
+        }
+        g_memory->write_tail = row;
+        g_memory->write_pending++;
+        pthread_cond_signal(&g_memory->write_cond);
+        pthread_mutex_unlock(&g_memory->write_mutex);
+        return 0;
+    }
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(g_memory->db,
+                           "UPDATE memories SET timestamp = ?, context = ?, seen = seen + 1 WHERE id = ?",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    memory_write_t row = {0};
+    row.content = entry->content;
+    row.context = entry->context;
+    row.timestamp = entry->timestamp;
+    int rc = memory_update_row(stmt, &row);
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+/* Insert ROW, already embedded, as the newest entry.  Called with the
+   store write-locked. */
+static int memory_insert_locked(const memory_write_t *row) {
+    /* A repeat of a remembered entry refreshes it instead of taking a slot */
+    int twin = dedup_find(row->content);
+    if (twin >= 0) {
+        memory_entry_t *entry = &g_memory->entries[twin];
+
+        entry->seen++;
+        entry->timestamp = row->timestamp;
+        if (row->context) {
+            text_unref(entry->context);
+            entry->context = text_ref(row->context);
+        }
+        return memory_save_seen(entry);
+    }
+
+    /* Check if we need to remove old entries */
+    if (g_memory->count >= g_memory->capacity) {
+        /* Remove oldest entry; its slot and row are reused below */
+        memory_entry_t *oldest = &g_memory->entries[g_memory->head];
+        lex_remove(g_memory->head, oldest->content);
+        entry_evict(oldest);
+        if (g_memory->centroids) {
+            ivf_unassign(g_memory->head);
+        }
+
+        g_memory->head = (g_memory->head + 1) % g_memory->capacity;
+        g_memory->count--;
+    }
+
+    /* Add new entry */
+    int slot = (g_memory->head + g_memory->count) % g_memory->capacity;
+    memory_entry_t *entry = &g_memory->entries[slot];
+
+    entry->content = text_ref(row->content);
+    entry->embedding = g_memory->matrix + (size_t)slot * MEMORY_DIMENSION;
+    entry->timestamp = row->timestamp;
+    entry->context = text_ref(row->context);
+    entry->source = text_ref(row->source);
+    entry->relevance_score = 0.0;
+    entry->seen = 1;
+
+    memcpy(entry->embedding, row->embedding, ROW_BYTES);
+    if (g_memory->codes) {
+        quantize_embedding(entry->embedding, g_memory->codes + (size_t)slot * MEMORY_DIMENSION,
+                           &g_memory->code_scales[slot]);
+    }
+
+    g_memory->count++;
+    lex_add(slot, entry->content);
+    if (g_memory->centroids) {
+        ivf_assign(slot);
+    }
+    ivf_maybe_train();
+
+    /* Save to database */
+    return memory_save_new(entry, row->origin, row->origin_seq);
+}
+
+/* Hand ROW to the ingest worker, or embed and insert it here when there
+   is none; ROW is consumed either way */
+static void memory_queue(memory_write_t *row) {
+    if (g_memory->ingest_running) {
+        pthread_mutex_lock(&g_memory->ingest_mutex);
+        if (g_memory->ingest_tail) {
+            g_memory->ingest_tail->next = row;
+        } else {
+            g_memory->ingest_head = row;
+        }
+        g_memory->ingest_tail = row;
+        g_memory->ingest_queued++;
+        pthread_cond_signal(&g_memory->ingest_cond);
+        pthread_mutex_unlock(&g_memory->ingest_mutex);
+        return;
+    }
+
+    /* No ingest worker: embed here, outside the store lock */
+    memory_embed_batch(row);
+    memory_write_lock();
+    memory_insert_locked(row);
+    pthread_rwlock_unlock(&g_memory->lock);
+    memory_write_free(row);
+}
+
+/* Add memory entry.  The content is queued for the ingest worker, so the
+   caller never waits for embedding or indexing. */
+int anbs_memory_add(const char *content, const char *context, const char *source) {
+    if (!MEMORY_READY() || !content) {
+        return -1;
+    }
+
+    memory_write_t *row = anbs_optimize_calloc(1, WRITE_BYTES);
+    if (!row) {
+        return -1;
+    }
+    row->content = text_new(content);
+    row->context = context ? text_new(context) : NULL;
+    row->source = text_new(source ? source : "terminal");
+    row->timestamp = time(NULL);
+
+    if (!row->content || (context && !row->context) || !row->source) {
+        memory_write_free(row);
+        return -1;
+    }
+
+    memory_queue(row);
+
+    ANBS_DEBUG_LOG("Added memory entry: %.50s...", content);
+    return 0;
+}
+
+/* Open the store, then hand it the history commands that came in
+   meanwhile.  Commands keep queueing behind these until none are left,
+   so the store sees them in order. */
+static void *history_opener_thread(void *arg) {
+    history_pending_t *list, *next;
+    int opened;
+
+    (void)arg;
+    anbs_thread_name("anbs-history");
+
+    opened = anbs_memory_init() == 0;
+    if (!opened) {
+        g_history_disabled = 1;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&g_history_mutex);
+        list = g_history_head;
+        g_history_head = NULL;
+        g_history_tail = &g_history_head;
+        g_history_pending = 0;
+        if (!list) {
+            g_history_state = HISTORY_OPEN;
+        }
+        pthread_mutex_unlock(&g_history_mutex);
+        if (!list) {
+            break;
+        }
+
+        for (; list; list = next) {
+            next = list->next;
+            if (opened) {
+                anbs_memory_add(list->command, list->context, "history");
+            }
+            free(list->command);
+            free(list->context);
+            free(list);
+        }
+    }
+    return NULL;
+}
+
+/* An exiting shell waits for the store to open so the commands held for
+   it aren't lost, then for them to be written */
+static void history_opener_atexit(void) {
+    if (g_history_opener_pid != getpid()) {
+        return;
+    }
+    pthread_join(g_history_opener, NULL);
+    g_history_opener_pid = 0;
+    anbs_memory_flush();
+}
+
+/* A child forked while the store was opening gets none of it */
+static void history_atfork_child(void) {
+    pthread_mutex_init(&g_history_mutex, NULL);
+    pthread_mutex_init(&g_memory_init_mutex, NULL);
+    if (!MEMORY_READY()) {
+        g_memory = NULL;
+        g_history_disabled = 1;
+    }
+}
+
+/* Start opening the store on its own thread; called with g_history_mutex
+   held */
+static void history_open_locked(void) {
+    static int hooks_registered = 0;
+
+    if (g_history_state != HISTORY_CLOSED) {
+        return;
+    }
+    if (!hooks_registered) {
+        atexit(history_opener_atexit);
+        pthread_atfork(NULL, NULL, history_atfork_child);
+        hooks_registered = 1;
+    }
+    if (pthread_create(&g_history_opener, NULL, history_opener_thread, NULL) != 0) {
+        g_history_disabled = 1;
+        return;
+    }
+    g_history_opener_pid = getpid();
+    g_history_state = HISTORY_OPENING;
+}
+
+/* Open the store in the background before the first command needs it;
+   interactive shells call this when ANBS_PREWARM is set */
+void anbs_memory_prewarm(void) {
+    if (g_history_disabled) {
+        return;
+    }
+    pthread_mutex_lock(&g_history_mutex);
+    history_open_locked();
+    pthread_mutex_unlock(&g_history_mutex);
+}
+
+/* Record an executed shell command from the history.  Repeats of a
+   command with the same directory and exit status are dropped.  The
+   first command starts the store opening on another thread, and until
+   it has, commands are held for it; otherwise the add only queues the
+   row. */
+int anbs_memory_history_add(const char *command, const char *cwd, int status, long duration_ms) {
+    if (!command || !*command || g_history_disabled) {
+        return -1;
+    }
+
+    /* FNV-1a over the command, directory and status */
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *p = command; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    for (const char *p = cwd ? cwd : ""; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    hash = (hash ^ (unsigned)status) * 1099511628211ULL;
+
+    uint64_t *seen = &g_history_seen[hash % HISTORY_SEEN_SLOTS];
+    if (*seen == hash) {
+        return 0;
+    }
+
+    *seen = hash;
+
+    char context[512];
+    snprintf(context, sizeof(context), "exit %d, %ld ms, in %s", status, duration_ms, cwd ? cwd : "?");
+
+    pthread_mutex_lock(&g_history_mutex);
+    if (g_history_state != HISTORY_OPEN) {
+        history_pending_t *row = NULL;
+
+        history_open_locked();
+        if (g_history_state == HISTORY_OPENING && g_history_pending < HISTORY_PENDING_MAX) {
+            row = malloc(sizeof(history_pending_t));
+        }
+        if (row) {
+            row->next = NULL;
+            row->command = strdup(command);
+            row->context = strdup(context);
+            if (!row->command || !row->context) {
+                free(row->command);
+                free(row->context);
+                free(row);
+                row = NULL;
+            }
+        }
+        if (row) {
+            *g_history_tail = row;
+            g_history_tail = &row->next;
+            g_history_pending++;
+        }
+        pthread_mutex_unlock(&g_history_mutex);
+        return row ? 0 : -1;
+    }
+    pthread_mutex_unlock(&g_history_mutex);
+
+    return anbs_memory_add(command, context, "history");
+}
+
+/* Inline suggestions.  The shell looks up the command line typed so far
+   on every redisplay, so lookups stay within a time budget and never wait
+   for the index. */
+
+static int suggest_compare(const void *a, const void *b) {
+    return strcmp(((const suggest_item_t *)a)->command, ((const suggest_item_t *)b)->command);
+}
+
+/* Fold ITEM, a repeat of KEPT's command, into KEPT */
+static void suggest_combine(suggest_item_t *kept, suggest_item_t *item) {
+    if (item->last > kept->last) {
+        kept->last = item->last;
+    }
+    kept->count += item->count;
+    free(item->command);
+}
+
+/* Index of the first command not sorting before PREFIX's run; called with
+   g_suggest_mutex held */
+static int suggest_lower_bound(const char *prefix, size_t len) {
+    int lo = 0, hi = g_suggest_count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (strncmp(g_suggest[mid].command, prefix, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Merge the N commands in ITEMS, which the index takes over, into the
+   index.  They're sorted before the mutex is taken, so lookups are shut
+   out only while the two sorted runs are merged. */
+static void suggest_merge(suggest_item_t *items, int n) {
+    suggest_item_t *merged = NULL;
+    int i, j, k, kept = 0;
+
+    if (n > 1) {
+        qsort(items, n, sizeof(suggest_item_t), suggest_compare);
+    }
+    for (i = 0; i < n; i++) {
+        if (kept > 0 && strcmp(items[kept - 1].command, items[i].command) == 0) {
+            suggest_combine(&items[kept - 1], &items[i]);
+        } else {
+            items[kept++] = items[i];
+        }
+    }
+    n = kept;
+
+    pthread_mutex_lock(&g_suggest_mutex);
+    if (n > 0) {
+        merged = malloc((size_t)(g_suggest_count + n) * sizeof(suggest_item_t));
+    }
+    if (!merged) {
+        pthread_mutex_unlock(&g_suggest_mutex);
+        for (i = 0; i < n; i++) {
+            free(items[i].command);
+        }
+        free(items);
+        return;
+    }
+
+    for (i = j = k = 0; i < g_suggest_count || j < n;) {
+        int cmp = i == g_suggest_count ? 1 : j == n ? -1 : strcmp(g_suggest[i].command, items[j].command);
+
+        if (cmp < 0) {
+            merged[k++] = g_suggest[i++];
+        } else if (cmp > 0) {
+            merged[k++] = items[j++];
+        } else {
+            merged[k] = g_suggest[i++];
+            suggest_combine(&merged[k++], &items[j++]);
+        }
+    }
+    free(g_suggest);
+    g_suggest = merged;
+    g_suggest_capacity = g_suggest_count + n;
+    g_suggest_count = k;
+    pthread_mutex_unlock(&g_suggest_mutex);
+    free(items);
+}
+
+/* Sort the shell's history into the index, then add the store's history
+   entries if it's open */
+static void *suggest_seed_thread(void *arg) {
+    suggest_item_t *items = arg;
+    int n = 0;
+
+    anbs_thread_name("anbs-suggest");
+    while (items[n].command) {
+        n++;
+    }
+    suggest_merge(items, n);
+
+    if (!MEMORY_READY()) {
+        return NULL;
+    }
+    memory_read_lock();
+    items = malloc((g_memory->count + 1) * sizeof(suggest_item_t));
+    n = 0;
+    for (int i = 0; items && i < g_memory->count; i++) {
+        memory_entry_t *entry = &g_memory->entries[(g_memory->head + i) % g_memory->capacity];
+
+        if (entry->content && entry->source && strcmp(entry->source, "history") == 0 &&
+            (items[n].command = strdup(entry->content))) {
+            items[n].last = entry->timestamp;
+            items[n].count = entry->seen > 0 ? entry->seen : 1;
+            n++;
+        }
+    }
+    pthread_rwlock_unlock(&g_memory->lock);
+    if (items) {
+        suggest_merge(items, n);
+    }
+    return NULL;
+}
+
+/* Build the suggestion index from the N commands in COMMANDS, which ran
+   at TIMES, and from the store's history entries, now and whenever it
+   loads.  The commands are copied; sorting them happens on another
+   thread, and lookups find nothing until it has. */
+int anbs_memory_suggest_seed(const char *const *commands, const time_t *times, int n) {
+    suggest_item_t *items;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int kept = 0;
+
+    items = malloc((size_t)(n + 1) * sizeof(suggest_item_t));
+    if (!items) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (commands[i] && *commands[i] && (items[kept].command = strdup(commands[i]))) {
+            items[kept].last = times ? times[i] : 0;
+            items[kept].count = 1;
+            kept++;
+        }
+    }
+    items[kept].command = NULL;
+    __atomic_store_n(&g_suggest_active, 1, __ATOMIC_RELEASE);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, suggest_seed_thread, items) != 0) {
+        suggest_seed_thread(items);
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+/* Add COMMAND, which just ran, to the suggestion index, if there is one */
+int anbs_memory_suggest_add(const char *command) {
+    size_t len;
+    int i;
+
+    if (!command || !*command) {
+        return -1;
+    }
+    if (!__atomic_load_n(&g_suggest_active, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    len = strlen(command) + 1;
+
+    pthread_mutex_lock(&g_suggest_mutex);
+    i = suggest_lower_bound(command, len);
+    if (i < g_suggest_count && strcmp(g_suggest[i].command, command) == 0) {
+        g_suggest[i].last = time(NULL);
+        g_suggest[i].count++;
+        pthread_mutex_unlock(&g_suggest_mutex);
+        return 0;
+    }
+
+    if (g_suggest_count == g_suggest_capacity) {
+        int capacity = g_suggest_capacity ? g_suggest_capacity * 2 : 256;
+        suggest_item_t *grown = realloc(g_suggest, (size_t)capacity * sizeof(suggest_item_t));
+
+        if (!grown) {
+            pthread_mutex_unlock(&g_suggest_mutex);
+            return -1;
+        }
+        g_suggest = grown;
+        g_suggest_capacity = capacity;
+    }
+    char *copy = strdup(command);
+    if (!copy) {
+        pthread_mutex_unlock(&g_suggest_mutex);
+        return -1;
+    }
+    memmove(&g_suggest[i + 1], &g_suggest[i], (size_t)(g_suggest_count - i) * sizeof(suggest_item_t));
+    g_suggest[i].command = copy;
+    g_suggest[i].last = time(NULL);
+    g_suggest[i].count = 1;
+    g_suggest_count++;
+    pthread_mutex_unlock(&g_suggest_mutex);
+    return 0;
+}
+
+static long suggest_elapsed_us(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Put in OUT the rest of the indexed command that best continues PREFIX,
+   up to its first newline: the most recently run of the commands starting
+   with PREFIX, the more frequent of two that ran at the same time.
+   Returns its length, or 0 if nothing continues PREFIX, the index is
+   being merged, or the lookup took more than BUDGET_US microseconds. */
+int anbs_memory_suggest(const char *prefix, char *out, size_t size, long budget_us) {
+    struct timespec start;
+    size_t len, n = 0;
+    int best = -1, scanned = 0, expired = 0;
+
+    if (!out || size == 0) {
+        return 0;
+    }
+    out[0] = '\0';
+    if (!prefix || !*prefix) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pthread_mutex_trylock(&g_suggest_mutex) != 0) {
+        return 0;
+    }
+
+    len = strlen(prefix);
+    for (int i = suggest_lower_bound(prefix, len);
+         i < g_suggest_count && scanned < SUGGEST_SCAN_MAX && strncmp(g_suggest[i].command, prefix, len) == 0;
+         i++, scanned++) {
+        const suggest_item_t *item = &g_suggest[i];
+
+        if (scanned % SUGGEST_CLOCK_EVERY == SUGGEST_CLOCK_EVERY - 1 && suggest_elapsed_us(&start) > budget_us) {
+            expired = 1;
+            break;
+        }
+        if (item->command[len] == '\0' || item->command[len] == '\n') {
+            continue;
+        }
+        if (best < 0 || item->last > g_suggest[best].last ||
+            (item->last == g_suggest[best].last && item->count > g_suggest[best].count)) {
+            best = i;
+        }
+    }
+
+    if (best >= 0 && !expired) {
+        const char *rest = g_suggest[best].command + len;
+
+        while (rest[n] && rest[n] != '\n' && n < size - 1) {
+            out[n] = rest[n];
+            n++;
+        }
+        out[n] = '\0';
+    }
+    pthread_mutex_unlock(&g_suggest_mutex);
+
+    if (n > 0 && suggest_elapsed_us(&start) > budget_us) {
+        out[0] = '\0';
+        n = 0;
+    }
+    return (int)n;
+}
+
+/* Replication.  Stores exchange version vectors and answer with deltas:
+   the rows of each origin's log past the other side's position, oldest
+   first.  Applying a delta is idempotent, so any peer may serve any
+   origin and the stores converge whatever order deltas arrive in. */
+
+/* Read this store's replica id from the database; 0 if it has one */
+static int replica_read_id(void) {
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(g_memory->db, "SELECT value FROM memory_meta WHERE key = 'replica'",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0)) {
+        snprintf(g_memory->replica_id, sizeof(g_memory->replica_id), "%s",
+                 (const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return g_memory->replica_id[0] ? 0 : -1;
+}
+
+/* The clock entry for ORIGIN, added if CREATE, with REPLICA_MUTEX held */
+static replica_clock_t *replica_clock_find(const char *origin, int create) {
+    replica_clock_t *grown;
+
+    for (int i = 0; i < g_memory->replica_origins; i++) {
+        if (strcmp(g_memory->replica_clock[i].origin, origin) == 0) {
+            return &g_memory->replica_clock[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    grown = realloc(g_memory->replica_clock, (g_memory->replica_origins + 1) * sizeof(replica_clock_t));
+    if (!grown) {
+        return NULL;
+    }
+    g_memory->replica_clock = grown;
+    grown = &g_memory->replica_clock[g_memory->replica_origins++];
+    memset(grown, 0, sizeof(*grown));
+    snprintf(grown->origin, sizeof(grown->origin), "%s", origin);
+    return grown;
+}
+
+/* Catch the version vector up with rows that other shells sharing the
+   database copied in, with REPLICA_MUTEX held */
+static void replica_refresh_locked(void) {
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(g_memory->db,
+                           "SELECT origin, MAX(origin_seq) FROM memories WHERE origin IS NOT NULL GROUP BY origin",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        replica_clock_t *clock = replica_clock_find((const char *)sqlite3_column_text(stmt, 0), 1);
+        if (clock && sqlite3_column_int64(stmt, 1) > clock->seq) {
+            clock->seq = sqlite3_column_int64(stmt, 1);
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+/* Load this store's replica id, naming it on first use, and the version
+   vector of the rows already copied into it.  Shells sharing the
+   database share the id; the first one to name it wins. */
+static void replica_open(void) {
+    char host[64] = "anbs";
+    unsigned char bytes[8] = { 0 };
+    sqlite3_stmt *stmt;
+    int fd;
+
+    if (replica_read_id() != 0) {
+        gethostname(host, sizeof(host) - 1);
+        fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || read(fd, bytes, sizeof(bytes)) != (ssize_t)sizeof(bytes)) {
+            uint64_t fallback = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+            memcpy(bytes, &fallback, sizeof(bytes));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        char id[64];
+        snprintf(id, sizeof(id), "%.40s-%02x%02x%02x%02x%02x%02x%02x%02x", host, bytes[0], bytes[1],
+                 bytes[2], bytes[3], bytes[4], bytes[5], bytes[6], bytes[7]);
+        if (sqlite3_prepare_v2(g_memory->db, "INSERT OR IGNORE INTO memory_meta VALUES ('replica', ?)",
+                               -1, &stmt, NULL) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+            sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+        }
+        if (replica_read_id() != 0) {
+            snprintf(g_memory->replica_id, sizeof(g_memory->replica_id), "%s", id);
+        }
+    }
+
+    pthread_mutex_lock(&g_memory->replica_mutex);
+    replica_refresh_locked();
+    pthread_mutex_unlock(&g_memory->replica_mutex);
+}
+
+/* Write our version vector to OUT: a "replica ID" line, then one
+   "origin seq" line per origin, ours included.  Other shells sharing
+   the database may have copied rows in, so the vector is refreshed from
+   it first.  A vector too long for SIZE is cut short.  Returns 0, or -1
+   if the store is closed. */
+int anbs_memory_replica_digest(char *out, size_t size) {
+    sqlite3_stmt *stmt;
+    sqlite3_int64 own = 0;
+    size_t offset;
+
+    if (!MEMORY_READY() || !out || size == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_memory->replica_mutex);
+    replica_refresh_locked();
+    if (sqlite3_prepare_v2(g_memory->db, "SELECT MAX(id) FROM memories WHERE origin IS NULL",
+                           -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            own = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    offset = snprintf(out, size, "replica %s\n%s %lld\n", g_memory->replica_id,
+                      g_memory->replica_id, (long long)own);
+    if (offset >= size) {
+        pthread_mutex_unlock(&g_memory->replica_mutex);
+        return -1;
+    }
+
+    /* Origins left out just come back in full, and are skipped */
+    for (int i = 0; i < g_memory->replica_origins; i++) {
+        int n = snprintf(out + offset, size - offset, "%s %lld\n", g_memory->replica_clock[i].origin,
+                         (long long)g_memory->replica_clock[i].seq);
+        if (n < 0 || offset + n >= size) {
+            out[offset] = '\0';
+            break;
+        }
+        offset += n;
+    }
+    pthread_mutex_unlock(&g_memory->replica_mutex);
+
+    return 0;
+}
+
+/* Append TEXT to OUT at *OFFSET with tabs, newlines and backslashes
+   escaped, stopping at LIMIT.  Returns 0, or -1 if it did not all fit. */
+static int replica_escape(char *out, size_t *offset, size_t limit, const char *text) {
+    for (const char *p = text ? text : ""; *p; p++) {
+        const char *escaped = *p == '\t' ? "\\t" : *p == '\n' ? "\\n" : *p == '\\' ? "\\\\" : NULL;
+        size_t need = escaped ? 2 : 1;
+
+        if (*offset + need >= limit) {
+            return -1;
+        }
+        if (escaped) {
+            memcpy(out + *offset, escaped, 2);
+        } else {
+            out[*offset] = *p;
+        }
+        *offset += need;
+    }
+    return 0;
+}
+
+/* Undo replica_escape() in place */
+static void replica_unescape(char *text) {
+    char *w = text;
+
+    for (char *r = text; *r; r++) {
+        if (*r == '\\' && r[1]) {
+            r++;
+            *w++ = *r == 't' ? '\t' : *r == 'n' ? '\n' : *r;
+        } else {
+            *w++ = *r;
+        }
+    }
+    *w = '\0';
+}
+
+/* The position DIGEST gives for ORIGIN, 0 if it has none of its rows */
+static sqlite3_int64 replica_digest_seq(const char *digest, const char *origin) {
+    char name[64];
+    long long seq;
+
+    for (const char *line = strchr(digest, '\n'); line; line = strchr(line + 1, '\n')) {
+        if (sscanf(line + 1, "%63s %lld", name, &seq) == 2 && strcmp(name, origin) == 0) {
+            return seq;
+        }
+    }
+    return 0;
+}
+
+/* Append ORIGIN's rows past HAVE to a delta being built in OUT.  A row
+   too large for an empty delta goes out truncated rather than blocking
+   the log behind it.  Returns the rows added; *FULL is set when OUT ran
+   out of room. */
+static int replica_delta_origin(const char *origin, int own, sqlite3_int64 have,
+                                char *out, size_t *offset, size_t size, int *full) {
+    const char *sql = own ?
+        "SELECT id, timestamp, source, context, content FROM memories "
+        "WHERE origin IS NULL AND id > ? ORDER BY id LIMIT ?" :
+        "SELECT origin_seq, timestamp, source, context, content FROM memories "
+        "WHERE origin = ? AND origin_seq > ? ORDER BY origin_seq LIMIT ?";
+    sqlite3_stmt *stmt;
+    int rows = 0, param = 1;
+
+    if (sqlite3_prepare_v2(g_memory->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        return 0;
+    }
+    if (!own) {
+        sqlite3_bind_text(stmt, param++, origin, -1, SQLITE_STATIC);
+    }
+    sqlite3_bind_int64(stmt, param++, have);
+    sqlite3_bind_int(stmt, param, REPLICA_BATCH_ROWS);
+
+    while (!*full && sqlite3_step(stmt) == SQLITE_ROW) {
+        size_t start = *offset;
+        int fit = 1;
+        int header = snprintf(out + start, size - start, "%s %lld %lld\t", origin,
+                              (long long)sqlite3_column_int64(stmt, 0),
+                              (long long)sqlite3_column_int64(stmt, 1));
+
+        if (header < 0 || start + header + 4 >= size) {
+            out[start] = '\0';
+            *full = 1;
+            break;
+        }
+        *offset += header;
+
+        /* Leave room for the separators and the terminator */
+        for (int column = 2; column <= 4; column++) {
+            if (column > 2) {
+                out[(*offset)++] = '\t';
+            }
+            if (fit && replica_escape(out, offset, size - 4, (const char *)sqlite3_column_text(stmt, column)) != 0) {
+                fit = 0;
+            }
+        }
+        if (!fit) {
+            *full = 1;
+            if (start > 0) {
+                *offset = start;
+                out[start] = '\0';
+                break;
+            }
+        }
+        out[(*offset)++] = '\n';
+        out[*offset] = '\0';
+        rows++;
+    }
+    sqlite3_finalize(stmt);
+    return rows;
+}
+
+/* Write to OUT the rows that the peer whose DIGEST this is lacks, as
+   many as fit in SIZE bytes.  Each line is "origin seq timestamp", then
+   the source, context and content, tab-separated and escaped.  Returns
+   the number of rows, or -1; *MORE is set if some did not fit. */
+int anbs_memory_replica_delta(const char *digest, char *out, size_t size, int *more) {
+    char peer[64] = "";
+    size_t offset = 0;
+    int rows, full = 0;
+    sqlite3_stmt *stmt;
+
+    if (!MEMORY_READY() || !digest || !out || size < 64 || sscanf(digest, "replica %63s", peer) != 1) {
+        return -1;
+    }
+    out[0] = '\0';
+
+    /* Ours first, then every origin copied in; peers need nothing of
+       their own */
+    rows = replica_delta_origin(g_memory->replica_id, 1, replica_digest_seq(digest, g_memory->replica_id),
+                                out, &offset, size, &full);
+    if (!full && sqlite3_prepare_v2(g_memory->db, "SELECT DISTINCT origin FROM memories WHERE origin IS NOT NULL",
+                                    -1, &stmt, NULL) == SQLITE_OK) {
+        while (!full && sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *origin = (const char *)sqlite3_column_text(stmt, 0);
+
+            if (strcmp(origin, peer) != 0) {
+                rows += replica_delta_origin(origin, 0, replica_digest_seq(digest, origin),
+                                             out, &offset, size, &full);
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    if (more) {
+        *more = full;
+    }
+    return rows;
+}
+
+/* Queue the rows of DELTA that are new here, keeping their origin and
+   time.  Rows at or behind our version vector are skipped, so repeats
+   and overlapping deltas change nothing.  Returns the rows queued. */
+int anbs_memory_replica_apply(const char *delta) {
+    char *copy, *save = NULL;
+    int queued = 0;
+
+    if (!MEMORY_READY() || !delta || !(copy = strdup(delta))) {
+        return -1;
+    }
+
+    for (char *line = strtok_r(copy, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *source = strchr(line, '\t'), *context, *content;
+        char origin[64];
+        long long seq, timestamp;
+        replica_clock_t *clock;
+
+        if (!source || !(context = strchr(source + 1, '\t')) || !(content = strchr(context + 1, '\t')) ||
+            sscanf(line, "%63s %lld %lld", origin, &seq, &timestamp) != 3 ||
+            strcmp(origin, g_memory->replica_id) == 0) {
+            continue;
+        }
+        *source++ = *context++ = *content++ = '\0';
+
+        pthread_mutex_lock(&g_memory->replica_mutex);
+        clock = replica_clock_find(origin, 1);
+        if (!clock || seq <= clock->seq) {
+            pthread_mutex_unlock(&g_memory->replica_mutex);
+            continue;
+        }
+        clock->seq = seq;
+        pthread_mutex_unlock(&g_memory->replica_mutex);
+
+        replica_unescape(source);
+        replica_unescape(context);
+        replica_unescape(content);
+
+        memory_write_t *row = anbs_optimize_calloc(1, WRITE_BYTES);
+        if (!row) {
+            break;
+        }
+        row->content = text_new(content);
+        row->context = *context ? text_new(context) : NULL;
+        row->source = text_new(*source ? source : "terminal");
+        row->origin = text_new(origin);
+        row->origin_seq = seq;
+        row->timestamp = (time_t)timestamp;
+        if (!row->content || (*context && !row->context) || !row->source || !row->origin) {
+            memory_write_free(row);
+            continue;
+        }
+        memory_queue(row);
+        queued++;
+    }
+
+    free(copy);
+    if (queued) {
+        ANBS_DEBUG_LOG("Applied %d replicated memory entries", queued);
+    }
+    return queued;
+}
+
+/* Resize the in-memory store to CAPACITY entries, dropping the oldest ones
+   if it shrinks; the database keeps everything */
+int anbs_memory_set_capacity(int capacity) {
+    if (!MEMORY_READY() || capacity <= 0) {
+        return -1;
+    }
+
+    memory_write_lock();
+
+    if (capacity == g_memory->capacity) {
+        pthread_rwlock_unlock(&g_memory->lock);
+        return 0;
+    }
+
+    memory_entry_t *entries = calloc(capacity, sizeof(memory_entry_t));
+    void *matrix_map;
+    size_t matrix_map_length;
+    float *matrix = matrix_alloc(capacity, &matrix_map, &matrix_map_length);
+    int *slot_list = malloc(capacity * sizeof(int));
+    int *slot_pos = malloc(capacity * sizeof(int));
+    int8_t *codes = g_memory->codes ? aligned_alloc(EMBEDDING_ALIGN, (size_t)capacity * MEMORY_DIMENSION) : NULL;
+    float *code_scales = g_memory->codes ? malloc(capacity * sizeof(float)) : NULL;
+    if (!entries || !matrix || !slot_list || !slot_pos ||
+        (g_memory->codes && (!codes || !code_scales))) {
+        free(entries);
+        matrix_free(matrix_map, matrix_map_length);
+        free(slot_list);
+        free(slot_pos);
+        free(codes);
+        free(code_scales);
+        pthread_rwlock_unlock(&g_memory->lock);
+        return -1;
+    }
+
+    /* The lexical index is rebuilt for the new slots below */
+    lex_clear();
+    if (lex_resize(capacity) != 0) {
+        for (int i = 0; i < g_memory->count; i++) {
+            int slot = (g_memory->head + i) % g_memory->capacity;
+            lex_add(slot, g_memory->entries[slot].content);
+        }
+        free(entries);
+        matrix_free(matrix_map, matrix_map_length);
+        free(slot_list);
+        free(slot_pos);
+        free(codes);
+        free(code_scales);
+        pthread_rwlock_unlock(&g_memory->lock);
+        return -1;
+    }
+
+    /* Keep the centroids; only the list membership depends on slots */
+    float *centroids = g_memory->centroids;
+    int nlist = g_memory->nlist;
+    g_memory->centroids = NULL;
+    ivf_reset();
+
+    int keep = g_memory->count < capacity ? g_memory->count : capacity;
+    int drop = g_memory->count - keep;
+
+    for (int i = 0; i < drop; i++) {
+        entry_evict(&g_memory->entries[(g_memory->head + i) % g_memory->capacity]);
+    }
+
+    /* Lay the survivors out oldest first from slot 0 */
+    for (int i = 0; i < keep; i++) {
+        int slot = (g_memory->head + drop + i) % g_memory->capacity;
+        memory_entry_t *old = &g_memory->entries[slot];
+        entries[i] = *old;
+        entries[i].embedding = matrix + (size_t)i * MEMORY_DIMENSION;
+        memcpy(entries[i].embedding, old->embedding, MEMORY_DIMENSION * sizeof(float));
+        if (codes) {
+            memcpy(codes + (size_t)i * MEMORY_DIMENSION,
+                   g_memory->codes + (size_t)slot * MEMORY_DIMENSION, MEMORY_DIMENSION);
+            code_scales[i] = g_memory->code_scales[slot];
+        }
+        slot_list[i] = -1;
+    }
+    for (int i = keep; i < capacity; i++) {
+        slot_list[i] = -1;
+    }
+
+    free(g_memory->entries);
+    matrix_free(g_memory->matrix_map, g_memory->matrix_map_length);
+    free(g_memory->slot_list);
+    free(g_memory->slot_pos);
+    g_memory->entries = entries;
+    g_memory->matrix = matrix;
+    g_memory->matrix_map = matrix_map;
+    g_memory->matrix_map_length = matrix_map_length;
+    if (codes) {
+        free(g_memory->codes);
+        free(g_memory->code_scales);
+        g_memory->codes = codes;
+        g_memory->code_scales = code_scales;
+    }
+    g_memory->slot_list = slot_list;
+    g_memory->slot_pos = slot_pos;
+    g_memory->capacity = capacity;
+    g_memory->head = 0;
+    g_memory->count = keep;
+
+    for (int i = 0; i < keep; i++) {
+        lex_add(i, entries[i].content);
+    }
+
+    if (centroids && (ivf_build(centroids, nlist) != 0 || g_memory->count < IVF_MIN_ENTRIES)) {
+        ivf_reset();
+    }
+    ivf_maybe_train();
+
+    pthread_rwlock_unlock(&g_memory->lock);
+
+    ANBS_DEBUG_LOG("Memory capacity set to %d entries", capacity);
+    return 0;
+}
+
+/* Score SLOT against the query: from its int8 code when QUERY_CODE is
+   given, otherwise exactly */
+static float slot_score(const float *query, const int8_t *query_code, float query_scale, int slot) {
+    if (query_code) {
+        return dot8_product(query_code, g_memory->codes + (size_t)slot * MEMORY_DIMENSION) *
+               query_scale * g_memory->code_scales[slot];
+    }
+    return calculate_similarity(query, g_memory->entries[slot].embedding);
+}
+
+/* Claim the next partition of JOB, unlisting it once all are claimed.
+   Called with SCAN_MUTEX held. */
+static int scan_claim(scan_job_t *job) {
+    int part = job->claimed++;
+
+    if (job->claimed == job->parts) {
+        scan_job_t **link = &g_memory->scan_jobs;
+        while (*link != job) {
+            link = &(*link)->next;
+        }
+        *link = job->next;
+    }
+    return part;
+}
+
+/* Score the rows of one partition into its heap */
+static void scan_partition(scan_job_t *job, int part) {
+    int lo = (int)((long)job->rows * part / job->parts);
+    int hi = (int)((long)job->rows * (part + 1) / job->parts);
+    memory_hit_t *heap = job->heaps + (size_t)part * job->limit;
+    int size = 0;
+
+    for (int i = lo; i < hi; i++) {
+        float score = job->base ? dot_product(job->query, job->base + (size_t)i * MEMORY_DIMENSION)
+                                : slot_score(job->query, job->code, job->scale, i);
+        hit_offer(heap, &size, job->limit, i, score);
+    }
+    job->sizes[part] = size;
+}
+
+/* Scan worker: take partitions from listed jobs until stopped */
+static void *memory_scan_thread(void *arg) {
+    (void)arg;
+    anbs_thread_name("anbs-mem-scan");
+
+    pthread_mutex_lock(&g_memory->scan_mutex);
+    for (;;) {
+        while (!g_memory->scan_jobs && !g_memory->scan_stop) {
+            pthread_cond_wait(&g_memory->scan_cond, &g_memory->scan_mutex);
+        }
+        if (!g_memory->scan_jobs) {
+            break;
+        }
+
+        /* The searcher waits for every partition, so JOB stays valid
+           until this one is counted as done */
+        scan_job_t *job = g_memory->scan_jobs;
+        int part = scan_claim(job);
+        pthread_mutex_unlock(&g_memory->scan_mutex);
+
+        scan_partition(job, part);
+
+        pthread_mutex_lock(&g_memory->scan_mutex);
+        if (++job->done == job->parts) {
+            pthread_cond_broadcast(&g_memory->scan_done_cond);
+        }
+    }
+    pthread_mutex_unlock(&g_memory->scan_mutex);
+    return NULL;
+}
+
+/* Start the scan workers if they aren't running.  Called with
+   SCAN_MUTEX held. */
+static void memory_scan_start(void) {
+    if (g_memory->scan_threads || g_memory->scan_workers <= 0) {
+        return;
+    }
+
+    g_memory->scan_threads = malloc(g_memory->scan_workers * sizeof(pthread_t));
+    if (!g_memory->scan_threads) {
+        return;
+    }
+    g_memory->scan_stop = 0;
+    while (g_memory->scan_nthreads < g_memory->scan_workers &&
+           pthread_create(&g_memory->scan_threads[g_memory->scan_nthreads], NULL,
+                          memory_scan_thread, NULL) == 0) {
+        g_memory->scan_nthreads++;
+    }
+    ANBS_DEBUG_LOG("Memory scan pool started %d workers", g_memory->scan_nthreads);
+}
+
+/* Stop and join the scan workers */
+static void memory_scan_stop(void) {
+    pthread_mutex_lock(&g_memory->scan_mutex);
+    g_memory->scan_stop = 1;
+    pthread_cond_broadcast(&g_memory->scan_cond);
+    pthread_mutex_unlock(&g_memory->scan_mutex);
+
+    for (int t = 0; t < g_memory->scan_nthreads; t++) {
+        pthread_join(g_memory->scan_threads[t], NULL);
+    }
+    free(g_memory->scan_threads);
+    g_memory->scan_threads = NULL;
+    g_memory->scan_nthreads = 0;
+}
+
+/* Scan the first ROWS slots, or rows of BASE, across the worker pool,
+   the calling thread included, and merge the partition heaps into HEAP.  Returns -1, having
+   scanned nothing, when the store is too small to be worth splitting or
+   no workers are available.  Called with the store read-locked. */
+static int memory_scan_parallel(const float *query, const int8_t *code, float scale,
+                                const float *base, int rows,
+                                memory_hit_t *heap, int *heap_size, int limit) {
+    if (rows < SCAN_MIN_ENTRIES || g_memory->scan_workers <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_memory->scan_mutex);
+    memory_scan_start();
+    int threads = g_memory->scan_nthreads + 1;
+    pthread_mutex_unlock(&g_memory->scan_mutex);
+
+    /* A couple of partitions per thread evens out uneven progress */
+    int parts = rows / SCAN_MIN_ROWS;
+    if (parts > threads * 2) {
+        parts = threads * 2;
+    }
+    if (threads < 2 || parts < 2) {
         return -1;
     }
 
-    /* Create tables */
-    const char *create_table_sql =
-        "CREATE TABLE IF NOT EXISTS memories ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "content TEXT NOT NULL,"
-        "embedding BLOB,"
-        "timestamp INTEGER,"
-        "context TEXT,"
-        "source TEXT,"
-        "relevance_score REAL DEFAULT 0.0"
-        ");";
-
-    rc = sqlite3_exec(g_memory->db, create_table_sql, NULL, NULL, NULL);
-    if (rc != SQLITE_OK) {
-        ANBS_DEBUG_LOG("Failed to create memory table: %s", sqlite3_errmsg(g_memory->db));
-        anbs_memory_cleanup();
+    scan_job_t job = {0};
+    job.base = base;
+    job.query = query;
+    job.code = code;
+    job.scale = scale;
+    job.rows = rows;
+    job.limit = limit;
+    job.parts = parts;
+    job.heaps = malloc((size_t)parts * limit * sizeof(memory_hit_t));
+    job.sizes = malloc(parts * sizeof(int));
+    if (!job.heaps || !job.sizes) {
+        free(job.heaps);
+        free(job.sizes);
         return -1;
     }
 
-    /* Load existing memories from database */
-    anbs_memory_load_from_db();
+    pthread_mutex_lock(&g_memory->scan_mutex);
+    scan_job_t **link = &g_memory->scan_jobs;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = &job;
+    pthread_cond_broadcast(&g_memory->scan_cond);
+
+    while (job.claimed < job.parts) {
+        int part = scan_claim(&job);
+        pthread_mutex_unlock(&g_memory->scan_mutex);
+        scan_partition(&job, part);
+        pthread_mutex_lock(&g_memory->scan_mutex);
+        job.done++;
+    }
+    while (job.done < job.parts) {
+        pthread_cond_wait(&g_memory->scan_done_cond, &g_memory->scan_mutex);
+    }
+    pthread_mutex_unlock(&g_memory->scan_mutex);
 
-    ANBS_DEBUG_LOG("Memory system initialized with %d entries", g_memory->count);
+    for (int p = 0; p < parts; p++) {
+        const memory_hit_t *part_heap = job.heaps + (size_t)p * limit;
+        for (int j = 0; j < job.sizes[p]; j++) {
+            hit_offer(heap, heap_size, limit, part_heap[j].index, part_heap[j].score);
+        }
+    }
+    free(job.heaps);
+    free(job.sizes);
     return 0;
 }
 
-/* Add memory entry */
-int anbs_memory_add(const char *content, const char *context, const char *source) {
-    if (!g_memory || !content) {
-        return -1;
+/* Order a hit heap of SIZE entries (a heap only once it reached LIMIT)
+   best first */
+static void hits_sort(memory_hit_t *heap, int size, int limit) {
+    if (size < limit) {
+        for (int j = size / 2 - 1; j >= 0; j--) {
+            hit_sift_down(heap, size, j);
+        }
     }
 
-    pthread_mutex_lock(&g_memory->mutex);
+    /* Pop the heap from the back so hits come out best first */
+    for (int n = size; n > 1; n--) {
+        memory_hit_t temp = heap[0];
+        heap[0] = heap[n - 1];
+        heap[n - 1] = temp;
+        hit_sift_down(heap, n - 1, 0);
+    }
+}
 
-    /* Check if we need to remove old entries */
-    if (g_memory->count >= g_memory->capacity) {
-        /* Remove oldest entry */
-        free(g_memory->entries[0].content);
-        free(g_memory->entries[0].embedding);
-        free(g_memory->entries[0].context);
-        free(g_memory->entries[0].source);
-
-        /* Shift entries */
-        memmove(&g_memory->entries[0], &g_memory->entries[1],
-                (g_memory->count - 1) * sizeof(memory_entry_t));
-        g_memory->count--;
+/* Add the reciprocal rank of SIZE ranked HITS to the FUSED scores */
+static void rrf_accumulate(memory_hit_t *fused, int *fused_count, const memory_hit_t *hits, int size) {
+    for (int r = 0; r < size; r++) {
+        int f;
+        for (f = 0; f < *fused_count && fused[f].index != hits[r].index; f++)
+            ;
+        if (f == *fused_count) {
+            fused[f].index = hits[r].index;
+            fused[f].score = 0.0;
+            (*fused_count)++;
+        }
+        fused[f].score += 1.0 / (RRF_K + r + 1);
     }
+}
 
-    /* Add new entry */
-    memory_entry_t *entry = &g_memory->entries[g_memory->count];
+/* Scan the rows that aged out of the ring, straight from the sidecar, for
+   the DEPTH nearest QUERY, and read those back from the database.  Sets
+   *HITS, best first and indexing *ENTRIES, and returns their number.
+   Called with the store read-locked. */
+static int memory_cold_search(const float *query, int depth, memory_hit_t **hits, memory_entry_t **entries) {
+    struct stat st;
 
-    entry->content = strdup(content);
-    entry->embedding = malloc(EMBEDDING_DIMENSION * sizeof(float));
-    entry->timestamp = time(NULL);
-    entry->context = context ? strdup(context) : NULL;
-    entry->source = source ? strdup(source) : strdup("terminal");
-    entry->relevance_score = 0.0;
+    *hits = NULL;
+    *entries = NULL;
+    if (g_memory->vec_fd < 0 || fstat(g_memory->vec_fd, &st) != 0 || st.st_size < vec_offset(2)) {
+        return 0;
+    }
 
-    if (!entry->content || !entry->embedding) {
-        pthread_mutex_unlock(&g_memory->mutex);
-        return -1;
+    /* Rows never written read as zeros and score nothing */
+    sqlite3_int64 rows = (st.st_size - VEC_HEADER_BYTES) / ROW_BYTES;
+    sqlite3_int64 cold_last_id = __atomic_load_n(&g_memory->cold_last_id, __ATOMIC_RELAXED);
+    if (rows > cold_last_id) {
+        rows = cold_last_id;
+    }
+    if (rows > INT_MAX) {
+        rows = INT_MAX;
     }
 
-    /* Generate embedding */
-    generate_simple_embedding(content, entry->embedding);
+    size_t length = vec_offset(rows + 1);
+    void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, g_memory->vec_fd, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    const float *base = (const float *)((char *)map + VEC_HEADER_BYTES);
 
-    g_memory->count++;
+    memory_hit_t *heap = malloc(depth * sizeof(memory_hit_t));
+    memory_entry_t *found = calloc(depth, sizeof(memory_entry_t));
+    sqlite3_stmt *stmt = NULL;
+    if (!heap || !found ||
+        sqlite3_prepare_v2(g_memory->db,
+                           "SELECT content, timestamp, context, source, seen FROM memories WHERE id = ?",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        munmap(map, length);
+        free(heap);
+        free(found);
+        return 0;
+    }
 
-    /* Save to database */
-    anbs_memory_save_to_db(entry);
+    int size = 0;
+    if (memory_scan_parallel(query, NULL, 1.0, base, (int)rows, heap, &size, depth) != 0) {
+        for (int i = 0; i < rows; i++) {
+            hit_offer(heap, &size, depth, i, dot_product(query, base + (size_t)i * MEMORY_DIMENSION));
+        }
+    }
+    munmap(map, length);
+    hits_sort(heap, size, depth);
 
-    pthread_mutex_unlock(&g_memory->mutex);
+    /* Hits are compacted in place as their rows are read */
+    int count = 0;
+    for (int h = 0; h < size; h++) {
+        if (heap[h].score <= 0.0) {
+            continue;
+        }
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)heap[h].index + 1);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *content = (const char *)sqlite3_column_text(stmt, 0);
+            const char *context = (const char *)sqlite3_column_text(stmt, 2);
+            const char *source = (const char *)sqlite3_column_text(stmt, 3);
+            memory_entry_t *entry = &found[count];
 
-    ANBS_DEBUG_LOG("Added memory entry: %.50s...", content);
-    return 0;
+            entry->content = text_new(content ? content : "");
+            entry->timestamp = sqlite3_column_int64(stmt, 1);
+            entry->context = context ? text_new(context) : NULL;
+            entry->source = text_new(source ? source : "unknown");
+            entry->relevance_score = heap[h].score;
+            entry->seen = sqlite3_column_int(stmt, 4);
+            if (entry->content && entry->source) {
+                heap[count].index = count;
+                heap[count].score = heap[h].score;
+                count++;
+            } else {
+                entry_release(entry);
+            }
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    *hits = heap;
+    *entries = found;
+    return count;
 }
 
-/* Search memories by similarity */
-int anbs_memory_search(const char *query, memory_entry_t **results, int max_results) {
-    if (!g_memory || !query || !results) {
+/* Search memories by similarity to QUERY, already embedded as
+   QUERY_EMBEDDING.  The vector ranking is fused with a BM25 ranking of
+   the query's tokens, so exact hostnames, flags and error codes surface
+   even when their embeddings are unremarkable; results report their
+   cosine similarity. */
+static int memory_search_embedded(const char *query, const float *query_embedding,
+                                  memory_entry_t **results, int max_results) {
+    PROBE2(anbs, memory__search__start, query, max_results);
+    memory_read_lock();
+
+    /* The ring supplies at most COUNT results; the cold tier may add more */
+    int want = max_results > 0 ? max_results : 0;
+    int result_count = want < g_memory->count ? want : g_memory->count;
+    int depth = want > FUSION_DEPTH ? want : FUSION_DEPTH;
+
+    /* A quantized scan keeps more candidates than it ranks, to rescore */
+    int8_t query_code[MEMORY_DIMENSION] __attribute__((aligned(EMBEDDING_ALIGN)));
+    float query_scale = 1.0;
+    int8_t *code = NULL;
+    int candidates = depth;
+
+    if (g_memory->codes && result_count > 0) {
+        quantize_embedding(query_embedding, query_code, &query_scale);
+        code = query_code;
+        candidates = depth > RESCORE_CANDIDATES ? depth : RESCORE_CANDIDATES;
+    }
+
+    /* Keep the best CANDIDATES scores in a min-heap while scanning the
+       matrix front to back, so the store itself is never reordered */
+    memory_hit_t *heap = malloc(candidates * sizeof(memory_hit_t));
+    memory_hit_t *lexical = malloc(depth * sizeof(memory_hit_t));
+    memory_hit_t *fused = malloc(3 * depth * sizeof(memory_hit_t));
+    *results = NULL;
+
+    if (!heap || !lexical || !fused) {
+        free(heap);
+        free(lexical);
+        free(fused);
+        pthread_rwlock_unlock(&g_memory->lock);
+        PROBE1(anbs, memory__search__done, -1);
         return -1;
     }
 
-    float query_embedding[EMBEDDING_DIMENSION];
-    generate_simple_embedding(query, query_embedding);
+    int full_matches = 0;
+    int touched = result_count > 0 ? lex_score(query, &full_matches) : 0;
+    int heap_size = 0;
+    /* Probing every list would visit every row: scan the matrix instead */
+    int nprobe = g_memory->nprobe;
+    memory_hit_t *probes = g_memory->centroids && nprobe < g_memory->nlist ?
+                           malloc(nprobe * sizeof(memory_hit_t)) : NULL;
 
-    pthread_mutex_lock(&g_memory->mutex);
+    if (result_count > 0 && full_matches >= result_count && touched <= g_memory->count / 4) {
+        /* Enough entries contain every query term: rank just those
+           instead of scanning the matrix */
+        for (int t = 0; t < touched; t++) {
+            int slot = t_lex.touched[t];
+            hit_offer(heap, &heap_size, depth,
+                      slot, calculate_similarity(query_embedding, g_memory->entries[slot].embedding));
+        }
+        code = NULL;
+        candidates = depth;
+    } else if (probes) {
+        /* Score only the members of the lists nearest the query */
+        int probe_count = 0;
+        for (int c = 0; c < g_memory->nlist; c++) {
+            hit_offer(probes, &probe_count, nprobe,
+                      c, dot_product(query_embedding, g_memory->centroids + (size_t)c * MEMORY_DIMENSION));
+        }
+        for (int p = 0; p < probe_count; p++) {
+            ivf_list_t *list = &g_memory->lists[probes[p].index];
+            for (int m = 0; m < list->count; m++) {
+                int slot = list->members[m];
+                hit_offer(heap, &heap_size, candidates,
+                          slot, slot_score(query_embedding, code, query_scale, slot));
+            }
+        }
+    } else if (result_count > 0 &&
+               memory_scan_parallel(query_embedding, code, query_scale, NULL, g_memory->count,
+                                    heap, &heap_size, candidates) == 0) {
+        /* Large store: the partitions were scanned across cores */
+    } else {
+        for (int i = 0; i < g_memory->count && result_count > 0; i++) {
+            hit_offer(heap, &heap_size, candidates,
+                      i, slot_score(query_embedding, code, query_scale, i));
+        }
+    }
+    free(probes);
 
-    /* Calculate similarities */
-    for (int i = 0; i < g_memory->count; i++) {
-        g_memory->entries[i].relevance_score =
-            calculate_similarity(query_embedding, g_memory->entries[i].embedding);
+    /* Rescore the quantized candidates against the float rows, keeping
+       the best DEPTH in place; hit_offer() only touches slots the loop
+       has already read */
+    if (code) {
+        int scanned = heap_size;
+        heap_size = 0;
+        for (int j = 0; j < scanned; j++) {
+            int slot = heap[j].index;
+            hit_offer(heap, &heap_size, depth,
+                      slot, calculate_similarity(query_embedding, g_memory->entries[slot].embedding));
+        }
+        candidates = depth;
     }
+    hits_sort(heap, heap_size, candidates);
 
-    /* Sort by relevance (bubble sort for simplicity) */
-    for (int i = 0; i < g_memory->count - 1; i++) {
-        for (int j = 0; j < g_memory->count - 1 - i; j++) {
-            if (g_memory->entries[j].relevance_score < g_memory->entries[j + 1].relevance_score) {
-                memory_entry_t temp = g_memory->entries[j];
-                g_memory->entries[j] = g_memory->entries[j + 1];
-                g_memory->entries[j + 1] = temp;
-            }
+    /* Nothing close in the ring: also scan the rows that aged out of it */
+    memory_hit_t *cold_hits = NULL;
+    memory_entry_t *cold = NULL;
+    int cold_size = 0;
+    if (want > 0 && __atomic_load_n(&g_memory->cold_last_id, __ATOMIC_RELAXED) > 0 &&
+        (heap_size < want || heap[0].score < g_memory->cold_threshold)) {
+        cold_size = memory_cold_search(query_embedding, depth, &cold_hits, &cold);
+        for (int c = 0; c < cold_size; c++) {
+            cold_hits[c].index += g_memory->capacity;
         }
     }
 
-    /* Return top results */
-    int result_count = (max_results < g_memory->count) ? max_results : g_memory->count;
-    *results = malloc(result_count * sizeof(memory_entry_t));
+    /* Rank the lexical matches, then clear the scratch for the next search */
+    int lexical_size = 0;
+    for (int t = 0; t < touched; t++) {
+        int slot = t_lex.touched[t];
+        hit_offer(lexical, &lexical_size, depth, slot, t_lex.scores[slot]);
+        t_lex.scores[slot] = 0.0;
+        t_lex.matched[slot] = 0;
+    }
+    hits_sort(lexical, lexical_size, depth);
 
+    /* Reciprocal rank fusion of the rankings, weighted by age; cold hits
+       are numbered after the ring's slots */
+    int fused_count = 0;
+    rrf_accumulate(fused, &fused_count, heap, heap_size);
+    rrf_accumulate(fused, &fused_count, lexical, lexical_size);
+    rrf_accumulate(fused, &fused_count, cold_hits, cold_size);
+
+    time_t now = time(NULL);
+    int best_size = 0;
+    for (int f = 0; f < fused_count; f++) {
+        int index = fused[f].index;
+        time_t timestamp = index < g_memory->capacity ? g_memory->entries[index].timestamp
+                                                      : cold[index - g_memory->capacity].timestamp;
+        hit_offer(heap, &best_size, want, index, fused[f].score * memory_decay(timestamp, now));
+    }
+    hits_sort(heap, best_size, want);
+    result_count = best_size;
+
+    *results = malloc((result_count > 0 ? result_count : 1) * sizeof(memory_entry_t));
     if (!*results) {
-        pthread_mutex_unlock(&g_memory->mutex);
-        return -1;
+        result_count = -1;
     }
 
     for (int i = 0; i < result_count; i++) {
-        memory_entry_t *src = &g_memory->entries[i];
+        int index = heap[i].index;
+        memory_entry_t *src = index < g_memory->capacity ? &g_memory->entries[index]
+                                                         : &cold[index - g_memory->capacity];
         memory_entry_t *dst = &(*results)[i];
 
-        dst->content = strdup(src->content);
+        dst->content = text_ref(src->content);
         dst->embedding = NULL; /* Don't copy embedding for results */
         dst->timestamp = src->timestamp;
-        dst->context = src->context ? strdup(src->context) : NULL;
-        dst->source = src->source ? strdup(src->source) : NULL;
-        dst->relevance_score = src->relevance_score;
+        dst->context = text_ref(src->context);
+        dst->source = text_ref(src->source);
+        dst->relevance_score = index < g_memory->capacity ?
+                               calculate_similarity(query_embedding, src->embedding) : src->relevance_score;
+        dst->seen = src->seen;
     }
 
-    pthread_mutex_unlock(&g_memory->mutex);
+    pthread_rwlock_unlock(&g_memory->lock);
+    for (int c = 0; c < cold_size; c++) {
+        entry_release(&cold[c]);
+    }
+    free(cold);
+    free(cold_hits);
+    free(heap);
+    free(lexical);
+    free(fused);
 
     ANBS_DEBUG_LOG("Memory search for '%s' returned %d results", query, result_count);
+    PROBE1(anbs, memory__search__done, result_count);
     return result_count;
 }
 
+/* Search memories by similarity; see memory_search_embedded() */
+int anbs_memory_search(const char *query, memory_entry_t **results, int max_results) {
+    if (!MEMORY_READY() || !query || !results) {
+        return -1;
+    }
+
+    float query_embedding[MEMORY_DIMENSION] __attribute__((aligned(EMBEDDING_ALIGN)));
+    memory_embed_texts(&query, 1, query_embedding);
+    return memory_search_embedded(query, query_embedding, results, max_results);
+}
+
 /* Get recent memories */
 int anbs_memory_get_recent(memory_entry_t **results, int max_results) {
-    if (!g_memory || !results) {
+    if (!MEMORY_READY() || !results) {
         return -1;
     }
 
-    pthread_mutex_lock(&g_memory->mutex);
+    memory_read_lock();
 
     int result_count = (max_results < g_memory->count) ? max_results : g_memory->count;
     *results = malloc(result_count * sizeof(memory_entry_t));
 
     if (!*results) {
-        pthread_mutex_unlock(&g_memory->mutex);
+        pthread_rwlock_unlock(&g_memory->lock);
         return -1;
     }
 
     /* Copy most recent entries */
     for (int i = 0; i < result_count; i++) {
-        memory_entry_t *src = &g_memory->entries[g_memory->count - 1 - i];
+        int slot = (g_memory->head + g_memory->count - 1 - i) % g_memory->capacity;
+        memory_entry_t *src = &g_memory->entries[slot];
         memory_entry_t *dst = &(*results)[i];
 
-        dst->content = strdup(src->content);
+        dst->content = text_ref(src->content);
         dst->embedding = NULL;
         dst->timestamp = src->timestamp;
-        dst->context = src->context ? strdup(src->context) : NULL;
-        dst->source = src->source ? strdup(src->source) : NULL;
+        dst->context = text_ref(src->context);
+        dst->source = text_ref(src->source);
         dst->relevance_score = src->relevance_score;
+        dst->seen = src->seen;
     }
 
-    pthread_mutex_unlock(&g_memory->mutex);
+    pthread_rwlock_unlock(&g_memory->lock);
 
     return result_count;
 }
 
-/* Save memory entry to database */
-int anbs_memory_save_to_db(const memory_entry_t *entry) {
+/* Save a new ENTRY to the database, recording the replica log position
+   it was copied from, if any */
+static int memory_save_new(const memory_entry_t *entry, const char *origin, sqlite3_int64 origin_seq) {
     if (!g_memory || !entry) {
         return -1;
     }
 
+    /* Hand the row to the background writer */
+    if (g_memory->writer_running) {
+        memory_write_t *row = anbs_optimize_calloc(1, WRITE_BYTES);
+        if (!row) {
+            return -1;
+        }
+        row->content = text_ref(entry->content);
+        row->context = text_ref(entry->context);
+        row->source = text_ref(entry->source);
+        row->timestamp = entry->timestamp;
+        row->relevance_score = entry->relevance_score;
+        row->origin = origin ? text_new(origin) : NULL;
+        row->origin_seq = origin_seq;
+        memcpy(row->embedding, entry->embedding, MEMORY_DIMENSION * sizeof(float));
+
+        pthread_mutex_lock(&g_memory->write_mutex);
+        if (g_memory->write_tail) {
+            g_memory->write_tail->next = row;
+        } else {
+            g_memory->write_head = row;
+        }
+        g_memory->write_tail = row;
+        g_memory->write_pending++;
+        pthread_cond_signal(&g_memory->write_cond);
+        pthread_mutex_unlock(&g_memory->write_mutex);
+        return 0;
+    }
+
     const char *sql =
-        "INSERT INTO memories (content, embedding, timestamp, context, source, relevance_score) "
-        "VALUES (?, ?, ?, ?, ?, ?)";
+        "INSERT OR IGNORE INTO memories (content, embedding, timestamp, context, source, relevance_score, "
+        "origin, origin_seq) VALUES (?, ?, ?, ?, ?, ?, ?, ?)";
 
     sqlite3_stmt *stmt;
     int rc = sqlite3_prepare_v2(g_memory->db, sql, -1, &stmt, NULL);
@@ -326,96 +3961,558 @@ int anbs_memory_save_to_db(const memory_entry_t *entry) {
     }
 
     sqlite3_bind_text(stmt, 1, entry->content, -1, SQLITE_STATIC);
-    sqlite3_bind_blob(stmt, 2, entry->embedding, EMBEDDING_DIMENSION * sizeof(float), SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 2, entry->embedding, MEMORY_DIMENSION * sizeof(float), SQLITE_STATIC);
     sqlite3_bind_int64(stmt, 3, entry->timestamp);
     sqlite3_bind_text(stmt, 4, entry->context, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 5, entry->source, -1, SQLITE_STATIC);
     sqlite3_bind_double(stmt, 6, entry->relevance_score);
+    if (origin) {
+        sqlite3_bind_text(stmt, 7, origin, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 8, origin_seq);
+    }
 
     rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        return -1;
+    }
+    if (sqlite3_changes(g_memory->db) == 0) {
+        return 0;
+    }
 
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    sqlite3_int64 id = sqlite3_last_insert_rowid(g_memory->db);
+    text_set_id(entry->content, id);
+    vec_store(id, entry->embedding);
+    return 0;
+}
+
+/* Save memory entry to database */
+int anbs_memory_save_to_db(const memory_entry_t *entry) {
+    return memory_save_new(entry, NULL, 0);
 }
 
 /* Load memories from database */
 int anbs_memory_load_from_db(void) {
-    if (!g_memory) {
+    if (!MEMORY_READY()) {
         return -1;
     }
 
-    const char *sql =
-        "SELECT content, embedding, timestamp, context, source FROM memories "
-        "ORDER BY timestamp DESC LIMIT ?";
+    memory_write_lock();
+    int count = memory_load_locked();
+    pthread_rwlock_unlock(&g_memory->lock);
 
-    sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(g_memory->db, sql, -1, &stmt, NULL);
+    return count;
+}
 
-    if (rc != SQLITE_OK) {
+/* Release memory results; their strings are shared with the store */
+void anbs_memory_free_results(memory_entry_t *results, int count) {
+    if (!results) return;
+
+    for (int i = 0; i < count; i++) {
+        text_unref(results[i].content);
+        text_unref(results[i].context);
+        text_unref(results[i].source);
+    }
+
+    free(results);
+}
+
+/* Cursors page through a search, or through the store newest first,
+   without working out more than has been asked for.  A search cursor
+   embeds its query once and ranks PAGE results to start with; reading
+   past them ranks again twice as deep.  A deeper ranking can move hits
+   about, so entries already returned are remembered by content and
+   skipped.  A recent cursor copies the ring a page at a time; entries
+   added meanwhile push older ones along, and the same memory of what
+   was returned keeps them from coming out twice. */
+#define CURSOR_DEFAULT_PAGE 16
+
+typedef struct {
+    uint64_t hash;
+    char *content;       /* a reference held by the cursor, or NULL */
+} cursor_seen_t;
+
+struct anbs_memory_cursor {
+    char *query;         /* NULL walks the store newest first */
+    float *embedding;
+    memory_entry_t *page;
+    int page_count;
+    int page_next;
+    int depth;           /* results ranked for PAGE, or ring entries passed */
+    int page_size;
+    int exhausted;       /* PAGE holds everything left */
+    memory_entry_t current;  /* last returned; its strings are held */
+    cursor_seen_t *seen;
+    int seen_mask;
+    int seen_count;
+};
+
+typedef struct anbs_memory_cursor anbs_memory_cursor_t;
+
+static uint64_t cursor_hash(const char *text) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*text) {
+        h = (h ^ (unsigned char)*text++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Record CONTENT as returned; 0 if it already was */
+static int cursor_mark_seen(anbs_memory_cursor_t *cursor, char *content) {
+    uint64_t hash = cursor_hash(content);
+    int i;
+
+    if (!cursor->seen || cursor->seen_count * 2 >= cursor->seen_mask + 1) {
+        int mask = cursor->seen_mask ? cursor->seen_mask * 2 + 1 : 63;
+        cursor_seen_t *seen = calloc(mask + 1, sizeof(cursor_seen_t));
+
+        if (!seen) {
+            return 1;   /* a repeat is better than nothing */
+        }
+        for (i = 0; cursor->seen && i <= cursor->seen_mask; i++) {
+            if (cursor->seen[i].content) {
+                int j = cursor->seen[i].hash & mask;
+                while (seen[j].content) {
+                    j = (j + 1) & mask;
+                }
+                seen[j] = cursor->seen[i];
+            }
+        }
+        free(cursor->seen);
+        cursor->seen = seen;
+        cursor->seen_mask = mask;
+    }
+
+    for (i = hash & cursor->seen_mask; cursor->seen[i].content; i = (i + 1) & cursor->seen_mask) {
+        if (cursor->seen[i].hash == hash && strcmp(cursor->seen[i].content, content) == 0) {
+            return 0;
+        }
+    }
+    cursor->seen[i].hash = hash;
+    cursor->seen[i].content = text_ref(content);
+    cursor->seen_count++;
+    return 1;
+}
+
+/* Copy the next page of the ring, newest first.  Entries are counted
+   back from the newest, so ones added since the last page only bring
+   already returned entries round again. */
+static int cursor_fill_recent(anbs_memory_cursor_t *cursor) {
+    memory_read_lock();
+
+    int available = g_memory->count - cursor->depth;
+    int n = available < cursor->page_size ? available : cursor->page_size;
+
+    cursor->page = n > 0 ? malloc(n * sizeof(memory_entry_t)) : NULL;
+    if (!cursor->page) {
+        pthread_rwlock_unlock(&g_memory->lock);
+        return n > 0 ? -1 : 0;
+    }
+    for (int i = 0; i < n; i++) {
+        int slot = (g_memory->head + g_memory->count - 1 - cursor->depth - i) % g_memory->capacity;
+        memory_entry_t *src = &g_memory->entries[slot];
+        memory_entry_t *dst = &cursor->page[i];
+
+        dst->content = text_ref(src->content);
+        dst->embedding = NULL;
+        dst->timestamp = src->timestamp;
+        dst->context = text_ref(src->context);
+        dst->source = text_ref(src->source);
+        dst->relevance_score = src->relevance_score;
+        dst->seen = src->seen;
+    }
+    cursor->depth += n;
+    cursor->exhausted = n == available;
+    pthread_rwlock_unlock(&g_memory->lock);
+
+    cursor->page_size *= 2;
+    return n;
+}
+
+/* Rank the search PAGE_SIZE deep, then twice as deep next time */
+static int cursor_fill_search(anbs_memory_cursor_t *cursor) {
+    int n = memory_search_embedded(cursor->query, cursor->embedding, &cursor->page, cursor->page_size);
+
+    if (n < 0) {
+        cursor->page = NULL;
         return -1;
     }
+    cursor->depth = cursor->page_size;
+    cursor->exhausted = n < cursor->page_size;
+    cursor->page_size *= 2;
+    return n;
+}
 
-    sqlite3_bind_int(stmt, 1, g_memory->capacity);
+/* Open a cursor over the memories matching QUERY, best first, or over
+   the whole store newest first when QUERY is NULL.  PAGE is how many
+   results to work out before the first is returned; 0 picks a default.
+   Returns NULL when the store can't be opened. */
+anbs_memory_cursor_t *anbs_memory_cursor_open(const char *query, int page) {
+    anbs_memory_cursor_t *cursor;
 
-    pthread_mutex_lock(&g_memory->mutex);
-    g_memory->count = 0;
+    if (!MEMORY_READY() && anbs_memory_init() != 0) {
+        return NULL;
+    }
 
-    while (sqlite3_step(stmt) == SQLITE_ROW && g_memory->count < g_memory->capacity) {
-        memory_entry_t *entry = &g_memory->entries[g_memory->count];
+    cursor = calloc(1, sizeof(*cursor));
+    if (!cursor) {
+        return NULL;
+    }
+    cursor->page_size = page > 0 ? page : CURSOR_DEFAULT_PAGE;
+    if (query) {
+        cursor->query = strdup(query);
+        cursor->embedding = aligned_alloc(EMBEDDING_ALIGN, ROW_BYTES);
+        if (!cursor->query || !cursor->embedding ||
+            memory_embed_texts((const char *const *)&cursor->query, 1, cursor->embedding) != 0) {
+            free(cursor->query);
+            free(cursor->embedding);
+            free(cursor);
+            return NULL;
+        }
+    }
+    return cursor;
+}
+
+/* Advance CURSOR to its next memory.  Returns 1 and sets whichever of
+   CONTENT, CONTEXT, SOURCE, TIMESTAMP and SCORE are not NULL, 0 at the
+   end, or -1 on error.  The strings stay valid until the next call or
+   anbs_memory_cursor_close(); SCORE is the cosine similarity of a search
+   hit and the stored relevance of a recent entry. */
+int anbs_memory_cursor_next(anbs_memory_cursor_t *cursor, const char **content, const char **context,
+                            const char **source, time_t *timestamp, float *score) {
+    if (!cursor) {
+        return -1;
+    }
+    entry_release(&cursor->current);
+
+    for (;;) {
+        if (cursor->page_next == cursor->page_count) {
+            anbs_memory_free_results(cursor->page, cursor->page_count);
+            cursor->page = NULL;
+            cursor->page_count = cursor->page_next = 0;
+            if (cursor->exhausted) {
+                return 0;
+            }
+            int n = cursor->query ? cursor_fill_search(cursor) : cursor_fill_recent(cursor);
+            if (n < 0) {
+                return -1;
+            }
+            cursor->page_count = n;
+            if (n == 0) {
+                cursor->exhausted = 1;
+                return 0;
+            }
+        }
+
+        /* The page's references pass to CURRENT */
+        memory_entry_t *entry = &cursor->page[cursor->page_next];
+        cursor->current = *entry;
+        entry->content = entry->context = entry->source = NULL;
+        cursor->page_next++;
+        if (cursor->current.content && cursor_mark_seen(cursor, cursor->current.content)) {
+            break;
+        }
+        entry_release(&cursor->current);
+    }
+
+    if (content) {
+        *content = cursor->current.content;
+    }
+    if (context) {
+        *context = cursor->current.context;
+    }
+    if (source) {
+        *source = cursor->current.source;
+    }
+    if (timestamp) {
+        *timestamp = cursor->current.timestamp;
+    }
+    if (score) {
+        *score = cursor->current.relevance_score;
+    }
+    return 1;
+}
+
+/* Pass over the next COUNT memories; returns how many there were */
+int anbs_memory_cursor_skip(anbs_memory_cursor_t *cursor, int count) {
+    int skipped = 0;
+
+    while (skipped < count && anbs_memory_cursor_next(cursor, NULL, NULL, NULL, NULL, NULL) == 1) {
+        skipped++;
+    }
+    return skipped;
+}
+
+void anbs_memory_cursor_close(anbs_memory_cursor_t *cursor) {
+    if (!cursor) {
+        return;
+    }
+    entry_release(&cursor->current);
+    anbs_memory_free_results(cursor->page, cursor->page_count);
+    for (int i = 0; cursor->seen && i <= cursor->seen_mask; i++) {
+        text_unref(cursor->seen[i].content);
+    }
+    free(cursor->seen);
+    free(cursor->embedding);
+    free(cursor->query);
+    free(cursor);
+}
 
-        const char *content = (const char*)sqlite3_column_text(stmt, 0);
-        const void *embedding_blob = sqlite3_column_blob(stmt, 1);
-        int embedding_size = sqlite3_column_bytes(stmt, 1);
+/* Estimate the tokens LEN bytes of TEXT cost, erring high, without a
+   tokenizer round trip.  BPE vocabularies take a short word together with
+   its leading space as one token and split longer ones into pieces of
+   about four letters; digits go in groups of up to three, punctuation
+   alone, and every character outside ASCII costs a token. */
+int anbs_memory_estimate_tokens(const char *text, size_t len) {
+    size_t i = 0, run;
+    int tokens = 0;
 
-        entry->content = strdup(content);
-        entry->embedding = malloc(EMBEDDING_DIMENSION * sizeof(float));
+    while (i < len) {
+        unsigned char c = (unsigned char)text[i];
 
-        if (embedding_size == EMBEDDING_DIMENSION * sizeof(float)) {
-            memcpy(entry->embedding, embedding_blob, embedding_size);
+        if (isalpha(c)) {
+            for (run = 0; i < len && isalpha((unsigned char)text[i]); i++) {
+                run++;
+            }
+            tokens += run <= 4 ? 1 : (int)((run + 3) / 4);
+        } else if (isdigit(c)) {
+            for (run = 0; i < len && isdigit((unsigned char)text[i]); i++) {
+                run++;
+            }
+            tokens += (int)((run + 2) / 3);
+        } else if (c == ' ') {
+            i++;
+        } else if (c >= 0x80) {
+            for (i++; i < len && ((unsigned char)text[i] & 0xc0) == 0x80; i++) {
+                ;
+            }
+            tokens++;
         } else {
-            /* Regenerate embedding if size mismatch */
-            generate_simple_embedding(content, entry->embedding);
+            i++;
+            tokens++;
         }
+    }
+    return tokens;
+}
+
+/* Words of a packed memory, for spotting near duplicates */
+typedef struct {
+    uint32_t words[PACK_WORDS];   /* sorted hashes of distinct words */
+    int count;
+} pack_words_t;
 
-        entry->timestamp = sqlite3_column_int64(stmt, 2);
+static int pack_word_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
 
-        const char *context = (const char*)sqlite3_column_text(stmt, 3);
-        entry->context = context ? strdup(context) : NULL;
+static void pack_words(const char *text, pack_words_t *set) {
+    char token[LEX_MAX_TOKEN];
+    int i, n = 0;
 
-        const char *source = (const char*)sqlite3_column_text(stmt, 4);
-        entry->source = source ? strdup(source) : strdup("unknown");
+    set->count = 0;
+    while (n < PACK_WORDS && lex_next_token(&text, token) > 0) {
+        uint32_t hash = 2166136261u;
+        for (const char *p = token; *p; p++) {
+            hash = (hash ^ (unsigned char)*p) * 16777619u;
+        }
+        set->words[n++] = hash;
+    }
+    qsort(set->words, n, sizeof(uint32_t), pack_word_cmp);
+    for (i = 0; i < n; i++) {
+        if (set->count == 0 || set->words[set->count - 1] != set->words[i]) {
+            set->words[set->count++] = set->words[i];
+        }
+    }
+}
 
-        entry->relevance_score = 0.0;
+/* Words A and B share, and how many there are between them */
+static int pack_overlap(const pack_words_t *a, const pack_words_t *b, int *total) {
+    int i = 0, j = 0, shared = 0;
 
-        g_memory->count++;
+    while (i < a->count && j < b->count) {
+        if (a->words[i] == b->words[j]) {
+            shared++;
+            i++;
+            j++;
+        } else if (a->words[i] < b->words[j]) {
+            i++;
+        } else {
+            j++;
+        }
     }
+    *total = a->count + b->count - shared;
+    return shared;
+}
 
-    pthread_mutex_unlock(&g_memory->mutex);
-    sqlite3_finalize(stmt);
+/* Copy TEXT to OUT with each run of whitespace squeezed to one space;
+   returns the length */
+static size_t pack_squeeze(const char *text, char *out, size_t size) {
+    size_t n = 0;
+    int space = 0;
 
-    return g_memory->count;
+    for (; *text && n + 1 < size; text++) {
+        if (isspace((unsigned char)*text)) {
+            space = n > 0;
+            continue;
+        }
+        if (space && n + 2 < size) {
+            out[n++] = ' ';
+        }
+        space = 0;
+        out[n++] = *text;
+    }
+    if (*text) {
+        while (n > 0 && ((unsigned char)out[n - 1] & 0xc0) == 0x80) {
+            n--;            /* drop a character cut short */
+        }
+        if (n > 0 && ((unsigned char)out[n - 1] & 0xc0) == 0xc0) {
+            n--;
+        }
+    }
+    out[n] = '\0';
+    return n;
 }
 
-/* Free memory results */
-void anbs_memory_free_results(memory_entry_t *results, int count) {
-    if (!results) return;
+/* Cut LINE, LEN bytes long, at a word boundary so it costs at most MAX
+   tokens, ellipsis included; returns the new length */
+static size_t pack_truncate(char *line, size_t len, int max) {
+    int tokens;
 
-    for (int i = 0; i < count; i++) {
-        free(results[i].content);
-        free(results[i].context);
-        free(results[i].source);
+    while (len > 0 && (tokens = anbs_memory_estimate_tokens(line, len) + 1) > max) {
+        size_t cut = (size_t)((double)len * max / tokens);
+
+        if (cut >= len) {
+            cut = len - 1;
+        }
+        while (cut > 0 && line[cut] != ' ') {
+            cut--;
+        }
+        while (cut > 0 && ((unsigned char)line[cut] & 0xc0) == 0x80) {
+            cut--;          /* never split a character */
+        }
+        len = cut;
     }
+    if (len == 0) {
+        return 0;
+    }
+    memcpy(line + len, "…", sizeof("…"));
+    return len + sizeof("…") - 1;
+}
 
-    free(results);
+/* Pack the memories most relevant to QUERY into at most BUDGET tokens,
+   as one "- " line each, for a prompt: the best PACK_CANDIDATES search
+   hits, less those sharing no word with the query and those repeating
+   one already packed (PACK_SIMILAR of their words in common), with
+   whitespace squeezed and each cut to a quarter of the budget.  *CONTEXT
+   receives the malloc'd lines, or NULL if nothing fits.  Returns the
+   tokens used, or -1 when the store can't be searched. */
+int anbs_memory_pack(const char *query, int budget, char **context) {
+    memory_entry_t *results = NULL;
+    pack_words_t *packed, wanted, words;
+    char line[PACK_LINE_MAX];
+    char *out;
+    size_t used = 0, len, room;
+    int count, kept = 0, tokens = 0, cap, i, k;
+
+    *context = NULL;
+    if (!query || budget <= 0 || (!MEMORY_READY() && anbs_memory_init() != 0)) {
+        return -1;
+    }
+
+    count = anbs_memory_search(query, &results, PACK_CANDIDATES);
+    if (count <= 0) {
+        anbs_memory_free_results(results, count > 0 ? count : 0);
+        return count < 0 ? -1 : 0;
+    }
+
+    room = (size_t)budget * 8 + 1;      /* no token is longer than that */
+    out = malloc(room);
+    packed = malloc(count * sizeof(pack_words_t));
+    if (!out || !packed) {
+        free(out);
+        free(packed);
+        anbs_memory_free_results(results, count);
+        return -1;
+    }
+
+    pack_words(query, &wanted);
+    cap = budget / 4 > PACK_MIN_PIECE ? budget / 4 : PACK_MIN_PIECE;
+
+    for (i = 0; i < count && budget - tokens >= PACK_MIN_PIECE; i++) {
+        const memory_entry_t *entry = &results[i];
+        int shared, total, cost, duplicate = 0;
+
+        if (!entry->content) {
+            continue;
+        }
+
+        pack_words(entry->content, &words);
+        if (wanted.count > 0 && pack_overlap(&words, &wanted, &total) == 0) {
+            continue;
+        }
+
+        /* "- [source] content (context)" */
+        len = snprintf(line, sizeof(line), "- [%s] ", entry->source ? entry->source : "note");
+        len += pack_squeeze(entry->content, line + len, sizeof(line) - len);
+        if (entry->context && *entry->context && len + 4 < sizeof(line)) {
+            len += snprintf(line + len, sizeof(line) - len, " (");
+            len += pack_squeeze(entry->context, line + len, sizeof(line) - len - 1);
+            line[len++] = ')';
+            line[len] = '\0';
+        }
+
+        cost = anbs_memory_estimate_tokens(line, len) + 1;     /* and the newline */
+        if (cost > cap || cost > budget - tokens) {
+            int max = (cap < budget - tokens ? cap : budget - tokens) - 1;
+            len = pack_truncate(line, len, max);
+            if (len == 0) {
+                continue;
+            }
+            cost = anbs_memory_estimate_tokens(line, len) + 1;
+        }
+
+        /* Compare what would be sent, so hits cut down to the same
+           words count as the same */
+        pack_words(line, &words);
+        for (k = 0; k < kept && !duplicate; k++) {
+            shared = pack_overlap(&words, &packed[k], &total);
+            duplicate = total == 0 || shared >= PACK_SIMILAR * total;
+        }
+        if (duplicate) {
+            continue;
+        }
+        if (used + len + 2 > room) {
+            break;
+        }
+
+        memcpy(out + used, line, len);
+        used += len;
+        out[used++] = '\n';
+        out[used] = '\0';
+        tokens += cost;
+        packed[kept++] = words;
+    }
+
+    free(packed);
+    anbs_memory_free_results(results, count);
+    if (kept == 0) {
+        free(out);
+        return 0;
+    }
+
+    *context = out;
+    return tokens;
 }
 
 /* Get memory statistics */
 int anbs_memory_get_stats(int *total_entries, int *db_entries, size_t *memory_usage) {
-    if (!g_memory) {
+    if (!MEMORY_READY()) {
         return -1;
     }
 
-    pthread_mutex_lock(&g_memory->mutex);
+    memory_read_lock();
 
     if (total_entries) {
         *total_entries = g_memory->count;
@@ -431,14 +4528,16 @@ int anbs_memory_get_stats(int *total_entries, int *db_entries, size_t *memory_us
             if (g_memory->entries[i].source) {
                 *memory_usage += strlen(g_memory->entries[i].source);
             }
-            *memory_usage += EMBEDDING_DIMENSION * sizeof(float);
+            *memory_usage += MEMORY_DIMENSION * sizeof(float);
         }
     }
 
-    pthread_mutex_unlock(&g_memory->mutex);
+    pthread_rwlock_unlock(&g_memory->lock);
 
     if (db_entries) {
         const char *sql = "SELECT COUNT(*) FROM memories";
+
+        anbs_memory_flush();   /* count what the writer still holds */
         sqlite3_stmt *stmt;
 
         if (sqlite3_prepare_v2(g_memory->db, sql, -1, &stmt, NULL) == SQLITE_OK) {
@@ -461,26 +4560,61 @@ void anbs_memory_cleanup(void) {
     if (!g_memory) {
         return;
     }
+    __atomic_store_n(&g_memory_ready, 0, __ATOMIC_RELEASE);
+
+    if (g_memory->loader_running) {
+        __atomic_store_n(&g_memory->reembed_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(g_memory->loader, NULL);
+    }
+    memory_ingest_stop();
+    memory_writer_stop();
 
-    pthread_mutex_lock(&g_memory->mutex);
+    pthread_rwlock_wrlock(&g_memory->lock);
+    memory_scan_stop();
 
-    /* Free all entries */
+    /* Free all entries; the embeddings go with the matrix */
     for (int i = 0; i < g_memory->count; i++) {
-        free(g_memory->entries[i].content);
-        free(g_memory->entries[i].embedding);
-        free(g_memory->entries[i].context);
-        free(g_memory->entries[i].source);
+        entry_release(&g_memory->entries[i]);
     }
 
+    ivf_reset();
+    lex_clear();
+    free(g_memory->lex_buckets);
+    free(g_memory->slot_gen);
+    free(g_memory->slot_terms);
+    free(g_memory->slot_hash);
+    free(g_memory->dedup_next);
+    free(g_memory->dedup_buckets);
     free(g_memory->entries);
+    matrix_free(g_memory->matrix_map, g_memory->matrix_map_length);
+    free(g_memory->slot_list);
+    free(g_memory->slot_pos);
+    free(g_memory->codes);
+    free(g_memory->code_scales);
+    if (g_memory->vec_fd >= 0) {
+        close(g_memory->vec_fd);
+    }
 
     /* Close database */
     if (g_memory->db) {
         sqlite3_close(g_memory->db);
     }
 
-    pthread_mutex_unlock(&g_memory->mutex);
-    pthread_mutex_destroy(&g_memory->mutex);
+    pthread_rwlock_unlock(&g_memory->lock);
+    pthread_rwlock_destroy(&g_memory->lock);
+    pthread_mutex_destroy(&g_memory->load_mutex);
+    pthread_cond_destroy(&g_memory->loaded_cond);
+    pthread_mutex_destroy(&g_memory->write_mutex);
+    pthread_cond_destroy(&g_memory->write_cond);
+    pthread_cond_destroy(&g_memory->flushed_cond);
+    pthread_mutex_destroy(&g_memory->ingest_mutex);
+    pthread_cond_destroy(&g_memory->ingest_cond);
+    pthread_cond_destroy(&g_memory->ingested_cond);
+    pthread_mutex_destroy(&g_memory->scan_mutex);
+    pthread_cond_destroy(&g_memory->scan_cond);
+    pthread_cond_destroy(&g_memory->scan_done_cond);
+    pthread_mutex_destroy(&g_memory->replica_mutex);
+    free(g_memory->replica_clock);
 
     free(g_memory);
     g_memory = NULL;
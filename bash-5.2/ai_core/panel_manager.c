@@ -89,12 +89,16 @@ int anbs_panel_write_text(panel_t *panel, const char *text)
             line_buffer[line_pos++] = *p;
         }
 
-        /* Check for word boundary and line length */
-        if (line_pos >= max_width || isspace(*p)) {
+        /* Check for word boundary and line length; a line can only be
+           as wide as it is long in bytes, so measure it only then */
+        bool full = line_pos >= max_width &&
+                    anbs_text_width(line_buffer, line_pos) >= max_width;
+
+        if (full || isspace(*p)) {
             line_buffer[line_pos] = '\0';
 
             /* Find last space for word wrapping */
-            if (line_pos >= max_width && !isspace(*p)) {
+            if (full && !isspace(*p)) {
                 int last_space = line_pos - 1;
                 while (last_space > 0 && !isspace(line_buffer[last_space])) {
                     last_space--;
@@ -333,7 +337,10 @@ int anbs_panel_highlight(panel_t *panel, bool highlight)
         }
     }
 
-    wrefresh(panel->window);
+    panel->dirty = true;
+    if (g_anbs_display) {
+        anbs_display_tick(g_anbs_display);
+    }
     return 0;
 }
 
@@ -399,11 +406,13 @@ int anbs_panel_refresh_if_dirty(panel_t *panel)
     }
 
     if (is_dirty) {
-        wrefresh(panel->window);
+        panel->dirty = true;
         if (panel->buffer) {
             anbs_text_buffer_mark_clean(panel->buffer);
         }
-        panel->last_refresh = time(NULL);
+        if (g_anbs_display) {
+            anbs_display_tick(g_anbs_display);
+        }
     }
 
     return 0;
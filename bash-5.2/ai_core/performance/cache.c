@@ -5,33 +5,201 @@
 #include <string.h>
 #include <stdio.h>
 #include <pthread.h>
-#include <openssl/sha.h>
+#if defined (ANBS_CACHE_XXHASH)
+#  include <xxhash.h>
+#else
+#  include <openssl/sha.h>
+#endif
+#if defined (ANBS_CACHE_ZSTD)
+#  include <zstd.h>
+#  define CACHE_CODEC "zstd"
+#elif defined (ANBS_CACHE_LZ4)
+#  include <lz4.h>
+#  define CACHE_CODEC "lz4"
+#endif
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
 
 #define CACHE_SIZE 10000
 #define HASH_BUCKETS 1024
+#define CACHE_SHARDS 16
+#define SHARD_BUCKETS (HASH_BUCKETS / CACHE_SHARDS)
+#define CACHE_KEY_BYTES 16      /* 128-bit digest */
 #define MAX_RESPONSE_SIZE 16384
+#define COMPRESS_MIN_BYTES 1024  /* smaller responses are stored as-is */
 #define DEFAULT_TTL 300  /* 5 minutes */
+#define SEMANTIC_SLOTS 256
+#define WHEEL_SLOTS 256         /* one-second expiry slots per shard */
+#define FLIGHT_LOCK_NAME "inflight.lock"
+#define FLIGHT_LOCK_RANGE 65536 /* byte-range locks, one byte per key hash */
+#define FLIGHT_WAIT_SECONDS 60
+#define DISK_INDEX_BUCKETS 4096
+#define DISK_RECORD_MAGIC 0x31424341u  /* "ACB1" */
+#define DISK_SEGMENT_NAME "responses.seg"
+#define DISK_COMPACT_MIN_BYTES (4 * 1024 * 1024)
+#define SHM_SLOTS 1024
+#define SHM_SLOT_BYTES 8192     /* larger responses stay process-local */
+#define SHM_PROBE 8
+#define SHM_MAGIC 0x31534341u   /* "ACS1" */
+
+/* Eviction policies, chosen at init from ANBS_CACHE_POLICY.  Strict LRU
+   reorders the list on every hit; SIEVE only marks the entry visited, so
+   hits run under the shard's read lock and only eviction writes. */
+#define CACHE_POLICY_LRU 0
+#define CACHE_POLICY_SIEVE 1
+
+/* TinyLFU admission (ANBS_CACHE_ADMISSION=tinylfu): a count-min sketch of
+   recent lookups per shard decides whether a new key is worth evicting for */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024       /* power of two */
+#define SKETCH_SAMPLE_FACTOR 10 /* halve counters every 10x capacity lookups */
+
+/* Embedding helpers from memory_system.c */
+extern float *anbs_memory_embed(const char *text);
+extern float anbs_memory_similarity(const float *embedding1, const float *embedding2);
+
+/* Ownership checks from security/permissions.c */
+extern bool anbs_permissions_check_shared(uid_t owner_uid, gid_t owner_gid, mode_t mode, mode_t want);
+
+/* Shared worker pool from optimize.c */
+extern int anbs_optimize_submit(void (*run)(void *arg), void *arg);
+
+/* OpenMetrics writers from metrics.c */
+extern void anbs_metrics_export_family(FILE *out, const char *name, const char *type, const char *help);
+extern void anbs_metrics_export_sample(FILE *out, const char *name, const char *labels, double value);
 
 typedef struct cache_entry {
-    char command_hash[65];  /* SHA256 hex string */
-    char *response;
-    size_t response_length;
+    unsigned char key[CACHE_KEY_BYTES];  /* binary key digest */
+    char *response;            /* NUL-terminated text, or codec output */
+    size_t response_length;    /* uncompressed length */
+    size_t stored_length;      /* bytes allocated for response */
+    int compressed;
     time_t timestamp;
     time_t expires_at;
     int hit_count;
     int ttl_seconds;
+    int visited;  /* SIEVE reference bit, set atomically on hit */
+    int refreshing;  /* a stale-while-revalidate refresh was handed out */
     struct cache_entry *next;  /* Hash collision chain */
     struct cache_entry *lru_prev;  /* LRU doubly-linked list */
     struct cache_entry *lru_next;
+    struct cache_entry *wheel_prev;  /* Expiry wheel slot list */
+    struct cache_entry *wheel_next;
 } cache_entry_t;
 
+/* Semantic tier: prompt embeddings matched by cosine similarity within a
+   scope (provider/model), so paraphrased prompts can share a response */
+typedef struct {
+    unsigned char scope_key[CACHE_KEY_BYTES];
+    float *embedding;
+    char *response;
+    time_t expires_at;
+    uint64_t last_used;
+} semantic_entry_t;
+
+/* Persistent tier: an append-only segment file of records keyed by digest,
+   memory-mapped and indexed lazily.  Newer records for a key supersede older
+   ones and a zero expiry is a tombstone.  Shells sharing ANBS_CACHE_DIR
+   append to the same file; compaction rewrites it under an exclusive flock
+   and renames it into place, and other shells notice the new inode. */
+typedef struct {
+    uint32_t magic;
+    uint32_t length;       /* response bytes following the header */
+    int64_t expires_at;    /* 0 = tombstone */
+    uint32_t checksum;
+    uint32_t reserved;
+    unsigned char key[CACHE_KEY_BYTES];
+} disk_record_t;
+
+#define disk_record_span(len) (sizeof(disk_record_t) + (len))
+
+typedef struct disk_slot {
+    unsigned char key[CACHE_KEY_BYTES];
+    off_t offset;          /* of the payload within the segment */
+    uint32_t length;
+    time_t expires_at;
+    struct disk_slot *next;
+} disk_slot_t;
+
+typedef struct {
+    disk_slot_t *buckets[DISK_INDEX_BUCKETS];
+    int entries;
+    size_t live_bytes;
+} disk_index_t;
+
+typedef struct {
+    char *path;            /* NULL = tier disabled */
+    int fd;
+    ino_t ino;
+    char *map;
+    size_t map_size;
+    off_t scanned;         /* segment bytes already indexed */
+    disk_index_t index;
+    uint64_t hits;
+    pthread_mutex_t mutex;
+} disk_tier_t;
+
+/* Host-wide tier: a fixed slab of slots in POSIX shared memory, mapped by
+   every ANBS process of the same user (or group) and guarded by a robust
+   process-shared mutex.  Each slot records who wrote it and with what mode,
+   and readers are checked against that before an entry is served. */
+typedef struct {
+    unsigned char key[CACHE_KEY_BYTES];
+    uid_t owner_uid;
+    gid_t owner_gid;
+    mode_t mode;
+    uint32_t length;
+    int64_t stored_at;
+    int64_t expires_at;    /* 0 = free slot */
+    char data[SHM_SLOT_BYTES];
+} shm_slot_t;
+
 typedef struct {
-    cache_entry_t *buckets[HASH_BUCKETS];
+    uint32_t magic;        /* set last by the creator */
+    uint32_t reserved;
+    pthread_mutex_t mutex;
+    uint64_t hits;         /* across all attached processes */
+    shm_slot_t slots[SHM_SLOTS];
+} shm_segment_t;
+
+typedef struct {
+    shm_segment_t *segment;  /* NULL = tier disabled */
+    mode_t entry_mode;
+    uint64_t hits;
+} shm_tier_t;
+
+/* A fetch some thread has claimed.  Other threads asking for the same key
+   wait on COND until the claimant releases it. */
+typedef struct in_flight {
+    unsigned char key[CACHE_KEY_BYTES];
+    int waiters;
+    int done;
+    pthread_cond_t cond;
+    struct in_flight *next;
+} in_flight_t;
+
+/* One independently locked partition of the cache.  Keys are spread over
+   the shards by hash, so threads touching different keys rarely contend. */
+typedef struct {
+    cache_entry_t *buckets[SHARD_BUCKETS];
     cache_entry_t *lru_head;
     cache_entry_t *lru_tail;
+    cache_entry_t *hand;  /* SIEVE eviction hand */
     int entry_count;
     int max_entries;
+    cache_entry_t *wheel[WHEEL_SLOTS];
+    time_t wheel_cursor;  /* Last second whose slot has been expired */
+    size_t bytes;      /* Accounted footprint of the entries */
+    size_t max_bytes;  /* 0 = bounded by entry count only */
+    int compressed_entries;
+    size_t compressed_raw_bytes;
+    size_t compressed_stored_bytes;
     pthread_rwlock_t rwlock;
 
     /* Performance metrics */
@@ -39,42 +207,216 @@ typedef struct {
     uint64_t cache_hits;
     uint64_t cache_misses;
     uint64_t evictions;
-    double average_response_time_ms;
+    uint64_t expirations;
+
+    /* Admission filter */
+    uint8_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    uint32_t sketch_samples;
+    uint64_t admission_rejections;
+} cache_shard_t;
+
+typedef struct {
+    cache_shard_t shards[CACHE_SHARDS];
+    int max_entries;
+    size_t max_bytes;
+    int policy;
+    int tinylfu;
+
+    /* Semantic tier */
+    semantic_entry_t semantic[SEMANTIC_SLOTS];
+    int semantic_count;
+    uint64_t semantic_clock;
+    uint64_t semantic_lookups;
+    uint64_t semantic_hits;
+    pthread_mutex_t semantic_mutex;
+
+    /* Persistent tier */
+    disk_tier_t disk;
+
+    /* Shared-memory tier */
+    shm_tier_t shm;
+
+    /* Request coalescing */
+    in_flight_t *flights;
+    pthread_mutex_t flight_mutex;
+    int flight_fd;           /* byte-range locks shared with other shells */
+    int stale_seconds;       /* stale-while-revalidate window */
+    uint64_t coalesced;
+    uint64_t stale_served;
 } response_cache_t;
 
 static response_cache_t *g_cache = NULL;
+static int g_disk_compacting = 0;
+static pthread_t g_tick_thread;
+static int g_tick_running = 0;
+
+/* Derive the binary key for COMMAND.  By default this is SHA-256 truncated
+   to 128 bits; building with ANBS_CACHE_XXHASH uses XXH3-128 instead, which
+   is much cheaper but not collision resistant against crafted input. */
+static void derive_key(const char *command, unsigned char *key) {
+#if defined (ANBS_CACHE_XXHASH)
+    XXH128_hash_t hash = XXH3_128bits(command, strlen(command));
+    XXH128_canonical_t canonical;
+
+    XXH128_canonicalFromHash(&canonical, hash);
+    memcpy(key, canonical.digest, CACHE_KEY_BYTES);
+#else
+    unsigned char hash[SHA256_DIGEST_LENGTH];
 
-/* Hash function for cache keys */
-static unsigned int hash_command(const char *command) {
-    unsigned int hash = 5381;
-    int c;
+    SHA256((const unsigned char *)command, strlen(command), hash);
+    memcpy(key, hash, CACHE_KEY_BYTES);
+#endif
+}
 
-    while ((c = *command++)) {
-        hash = ((hash << 5) + hash) + c;
+/* Pick the shard and in-shard bucket straight from the digest bits */
+static cache_shard_t *shard_for(const unsigned char *key, unsigned int *bucket) {
+    uint64_t bits;
+
+    memcpy(&bits, key, sizeof(bits));
+    *bucket = (unsigned int)((bits / CACHE_SHARDS) % SHARD_BUCKETS);
+    return &g_cache->shards[bits % CACHE_SHARDS];
+}
+
+/* Bytes charged to the budget for one entry storing STORED response bytes */
+#define entry_size(stored) (sizeof(cache_entry_t) + (stored))
+
+#define key_equal(a, b) (memcmp((a), (b), CACHE_KEY_BYTES) == 0)
+
+/* Counters bumped by concurrent readers under a shared lock */
+#define stat_inc(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+/* Fill ENTRY's stored form of RESPONSE.  With a codec built in, responses
+   of COMPRESS_MIN_BYTES or more are compressed when that actually saves
+   space; everything else is kept as a plain string. */
+static int entry_encode(cache_entry_t *entry, const char *response, size_t length) {
+    entry->response_length = length;
+    entry->compressed = 0;
+
+#if defined (CACHE_CODEC)
+    if (length >= COMPRESS_MIN_BYTES) {
+#  if defined (ANBS_CACHE_ZSTD)
+        size_t bound = ZSTD_compressBound(length);
+#  else
+        size_t bound = LZ4_compressBound((int)length);
+#  endif
+        char *packed = malloc(bound);
+        size_t packed_length = 0;
+
+        if (packed) {
+#  if defined (ANBS_CACHE_ZSTD)
+            packed_length = ZSTD_compress(packed, bound, response, length, 1);
+            if (ZSTD_isError(packed_length)) {
+                packed_length = 0;
+            }
+#  else
+            packed_length = LZ4_compress_default(response, packed, (int)length, (int)bound);
+#  endif
+        }
+
+        if (packed_length > 0 && packed_length < length) {
+            char *shrunk = realloc(packed, packed_length);
+            entry->response = shrunk ? shrunk : packed;
+            entry->stored_length = packed_length;
+            entry->compressed = 1;
+            return 0;
+        }
+        free(packed);
     }
+#endif
 
-    return hash % HASH_BUCKETS;
+    entry->response = malloc(length + 1);
+    if (!entry->response) {
+        return -1;
+    }
+    memcpy(entry->response, response, length + 1);
+    entry->stored_length = length + 1;
+    return 0;
 }
 
-/* Generate SHA256 hash for command */
-static void generate_command_hash(const char *command, char *hash_output) {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
+/* Return a malloc'd plain-text copy of ENTRY's response */
+static char *entry_decode(const cache_entry_t *entry) {
+    char *text = malloc(entry->response_length + 1);
+
+    if (!text) {
+        return NULL;
+    }
 
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, command, strlen(command));
-    SHA256_Final(hash, &sha256);
+    if (!entry->compressed) {
+        memcpy(text, entry->response, entry->response_length + 1);
+        return text;
+    }
 
-    /* Convert to hex string */
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(hash_output + (i * 2), "%02x", hash[i]);
+#if defined (ANBS_CACHE_ZSTD)
+    if (ZSTD_decompress(text, entry->response_length,
+                        entry->response, entry->stored_length) != entry->response_length) {
+        free(text);
+        return NULL;
+    }
+#elif defined (ANBS_CACHE_LZ4)
+    if (LZ4_decompress_safe(entry->response, text, (int)entry->stored_length,
+                            (int)entry->response_length) != (int)entry->response_length) {
+        free(text);
+        return NULL;
     }
-    hash_output[64] = '\0';
+#endif
+    text[entry->response_length] = '\0';
+    return text;
+}
+
+/* Add (SIGN > 0) or remove ENTRY's footprint from SHARD's accounting */
+static void entry_account(cache_shard_t *shard, const cache_entry_t *entry, int sign) {
+    if (sign > 0) {
+        shard->bytes += entry_size(entry->stored_length);
+    } else {
+        shard->bytes -= entry_size(entry->stored_length);
+    }
+
+    if (entry->compressed) {
+        shard->compressed_entries += sign > 0 ? 1 : -1;
+        if (sign > 0) {
+            shard->compressed_raw_bytes += entry->response_length;
+            shard->compressed_stored_bytes += entry->stored_length;
+        } else {
+            shard->compressed_raw_bytes -= entry->response_length;
+            shard->compressed_stored_bytes -= entry->stored_length;
+        }
+    }
+}
+
+/* Entries are kept past expiry for the stale-while-revalidate window */
+#define entry_deadline(entry) ((entry)->expires_at + g_cache->stale_seconds)
+
+/* Hashed timing wheel: an entry sits in the slot for its expiry second, so
+   expiring is a walk over the slots for the seconds that have passed.  TTLs
+   longer than WHEEL_SLOTS seconds wrap around and are skipped until their
+   lap comes up. */
+static void wheel_insert(cache_shard_t *shard, cache_entry_t *entry) {
+    cache_entry_t **slot = &shard->wheel[entry_deadline(entry) % WHEEL_SLOTS];
+
+    entry->wheel_prev = NULL;
+    entry->wheel_next = *slot;
+    if (*slot) {
+        (*slot)->wheel_prev = entry;
+    }
+    *slot = entry;
+}
+
+/* Take ENTRY out of its wheel slot */
+static void wheel_remove(cache_shard_t *shard, cache_entry_t *entry) {
+    if (entry->wheel_prev) {
+        entry->wheel_prev->wheel_next = entry->wheel_next;
+    } else {
+        shard->wheel[entry_deadline(entry) % WHEEL_SLOTS] = entry->wheel_next;
+    }
+    if (entry->wheel_next) {
+        entry->wheel_next->wheel_prev = entry->wheel_prev;
+    }
+    entry->wheel_prev = entry->wheel_next = NULL;
 }
 
 /* Move entry to front of LRU list */
-static void move_to_front(cache_entry_t *entry) {
-    if (!entry || entry == g_cache->lru_head) {
+static void move_to_front(cache_shard_t *shard, cache_entry_t *entry) {
+    if (!entry || entry == shard->lru_head) {
         return;
     }
 
@@ -85,67 +427,830 @@ static void move_to_front(cache_entry_t *entry) {
     if (entry->lru_next) {
         entry->lru_next->lru_prev = entry->lru_prev;
     }
-    if (entry == g_cache->lru_tail) {
-        g_cache->lru_tail = entry->lru_prev;
+    if (entry == shard->lru_tail) {
+        shard->lru_tail = entry->lru_prev;
     }
 
     /* Add to front */
     entry->lru_prev = NULL;
-    entry->lru_next = g_cache->lru_head;
-    if (g_cache->lru_head) {
-        g_cache->lru_head->lru_prev = entry;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    }
+    shard->lru_head = entry;
+
+    if (!shard->lru_tail) {
+        shard->lru_tail = entry;
+    }
+}
+
+/* Remove entry from LRU list */
+static void remove_from_lru(cache_shard_t *shard, cache_entry_t *entry) {
+    if (shard->hand == entry) {
+        shard->hand = entry->lru_prev;
+    }
+
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+/* Unlink VICTIM from its bucket, the LRU list and the wheel, then free it */
+static void unlink_entry(cache_shard_t *shard, cache_entry_t *victim) {
+    unsigned int bucket;
+    shard_for(victim->key, &bucket);
+
+    /* Remove from hash bucket */
+    cache_entry_t **current = &shard->buckets[bucket];
+    while (*current && *current != victim) {
+        current = &(*current)->next;
+    }
+    if (*current) {
+        *current = victim->next;
+    }
+
+    /* Remove from LRU list and expiry wheel */
+    remove_from_lru(shard, victim);
+    wheel_remove(shard, victim);
+
+    /* Free memory */
+    entry_account(shard, victim, -1);
+    free(victim->response);
+    free(victim);
+
+    shard->entry_count--;
+}
+
+/* Expire everything in SHARD's wheel slots for the seconds before NOW.
+   Caller holds the shard's write lock. */
+static int wheel_advance(cache_shard_t *shard, time_t now) {
+    int expired = 0;
+    time_t steps = now - 1 - shard->wheel_cursor;
+
+    if (steps > WHEEL_SLOTS) {
+        steps = WHEEL_SLOTS;
+    }
+
+    for (time_t t = now - steps; t < now; t++) {
+        cache_entry_t *entry = shard->wheel[t % WHEEL_SLOTS];
+        while (entry) {
+            cache_entry_t *next = entry->wheel_next;
+            if (entry_deadline(entry) < now) {
+                unlink_entry(shard, entry);
+                expired++;
+            }
+            entry = next;
+        }
+    }
+
+    if (now - 1 > shard->wheel_cursor) {
+        shard->wheel_cursor = now - 1;
+    }
+    shard->expirations += expired;
+    return expired;
+}
+
+/* Evict least recently used entry */
+static void evict_lru_entry(cache_shard_t *shard) {
+    if (!shard->lru_tail) {
+        return;
+    }
+
+    unlink_entry(shard, shard->lru_tail);
+    shard->evictions++;
+
+    ANBS_DEBUG_LOG("Evicted LRU cache entry, shard count now: %d", shard->entry_count);
+}
+
+/* SIEVE: sweep the hand from tail toward head, clearing visited bits, and
+   evict the first unvisited entry.  New entries are inserted at the head and
+   hits never move anything. */
+static void evict_sieve_entry(cache_shard_t *shard) {
+    cache_entry_t *victim = shard->hand ? shard->hand : shard->lru_tail;
+
+    if (!victim) {
+        return;
+    }
+
+    while (__atomic_load_n(&victim->visited, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&victim->visited, 0, __ATOMIC_RELAXED);
+        victim = victim->lru_prev ? victim->lru_prev : shard->lru_tail;
+    }
+
+    shard->hand = victim->lru_prev;
+    unlink_entry(shard, victim);
+    shard->evictions++;
+
+    ANBS_DEBUG_LOG("Evicted SIEVE cache entry, shard count now: %d", shard->entry_count);
+}
+
+/* Evict one entry from SHARD under the configured policy */
+static void evict_one(cache_shard_t *shard) {
+    if (g_cache->policy == CACHE_POLICY_SIEVE) {
+        evict_sieve_entry(shard);
+    } else {
+        evict_lru_entry(shard);
+    }
+}
+
+/* Non-zero if adding INCOMING bytes would take SHARD past its budget */
+static int shard_over_budget(cache_shard_t *shard, size_t incoming) {
+    return shard->max_bytes && shard->bytes + incoming > shard->max_bytes;
+}
+
+/* Column of KEY in sketch row ROW.  The upper digest half is used, since
+   the lower bits already picked the shard. */
+static unsigned int sketch_column(const unsigned char *key, int row) {
+    uint64_t bits;
+
+    memcpy(&bits, key + 8, sizeof(bits));
+    return (unsigned int)(bits >> (row * 16)) & (SKETCH_WIDTH - 1);
+}
+
+/* Count a lookup of KEY.  Lookups may hold only the read lock, so the
+   counters are bumped atomically and saturate at 255. */
+static void sketch_record(cache_shard_t *shard, const unsigned char *key) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t *counter = &shard->sketch[row][sketch_column(key, row)];
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) < UINT8_MAX) {
+            __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+        }
+    }
+    stat_inc(shard->sketch_samples);
+}
+
+/* Estimated recent lookups of KEY: the smallest of its counters */
+static unsigned int sketch_estimate(cache_shard_t *shard, const unsigned char *key) {
+    unsigned int estimate = UINT8_MAX;
+
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned int count = __atomic_load_n(&shard->sketch[row][sketch_column(key, row)],
+                                             __ATOMIC_RELAXED);
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/* Age the sketch once enough samples have been seen, so the filter follows
+   shifts in the workload.  Caller holds the write lock. */
+static void sketch_age(cache_shard_t *shard) {
+    if (shard->sketch_samples < (uint32_t)shard->max_entries * SKETCH_SAMPLE_FACTOR) {
+        return;
+    }
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        for (int col = 0; col < SKETCH_WIDTH; col++) {
+            shard->sketch[row][col] >>= 1;
+        }
+    }
+    shard->sketch_samples /= 2;
+}
+
+/* The entry the configured policy would evict next, without evicting it */
+static cache_entry_t *eviction_candidate(cache_shard_t *shard) {
+    if (g_cache->policy == CACHE_POLICY_SIEVE && shard->hand) {
+        return shard->hand;
+    }
+    return shard->lru_tail;
+}
+
+/* Record a hit on ENTRY.  Under SIEVE this is safe with only the read lock. */
+static void touch_entry(cache_shard_t *shard, cache_entry_t *entry) {
+    if (g_cache->policy == CACHE_POLICY_SIEVE) {
+        __atomic_store_n(&entry->visited, 1, __ATOMIC_RELAXED);
+    } else {
+        move_to_front(shard, entry);
+    }
+}
+
+/* Slot in the bucket index; the key's upper digest bits pick the bucket,
+   since the lower ones already chose the RAM shard */
+static unsigned int disk_bucket(const unsigned char *key) {
+    uint32_t bits;
+
+    memcpy(&bits, key + 8, sizeof(bits));
+    return bits % DISK_INDEX_BUCKETS;
+}
+
+/* FNV-1a over the record's identity and payload, to reject torn writes */
+static uint32_t disk_checksum(const disk_record_t *record, const char *payload) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *p;
+
+    for (p = record->key; p < record->key + CACHE_KEY_BYTES; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    for (p = (const unsigned char *)&record->expires_at;
+         p < (const unsigned char *)&record->expires_at + sizeof(record->expires_at); p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    for (p = (const unsigned char *)payload; p < (const unsigned char *)payload + record->length; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+/* Note in INDEX that RECORD, whose payload starts at OFFSET, is now the
+   latest for its key */
+static int disk_index_add(disk_index_t *index, const disk_record_t *record, off_t offset) {
+    disk_slot_t **slot, *found;
+
+    for (slot = &index->buckets[disk_bucket(record->key)]; *slot; slot = &(*slot)->next) {
+        if (key_equal((*slot)->key, record->key)) {
+            break;
+        }
+    }
+
+    found = *slot;
+    if (found) {
+        index->live_bytes -= disk_record_span(found->length);
+        if (record->expires_at == 0) {
+            *slot = found->next;
+            free(found);
+            index->entries--;
+            return 0;
+        }
+    } else {
+        if (record->expires_at == 0) {
+            return 0;
+        }
+        found = calloc(1, sizeof(disk_slot_t));
+        if (!found) {
+            return -1;
+        }
+        memcpy(found->key, record->key, CACHE_KEY_BYTES);
+        *slot = found;
+        index->entries++;
+    }
+
+    found->offset = offset;
+    found->length = record->length;
+    found->expires_at = (time_t)record->expires_at;
+    index->live_bytes += disk_record_span(record->length);
+    return 0;
+}
+
+/* Find KEY in INDEX */
+static disk_slot_t *disk_index_find(disk_index_t *index, const unsigned char *key) {
+    disk_slot_t *slot;
+
+    for (slot = index->buckets[disk_bucket(key)]; slot; slot = slot->next) {
+        if (key_equal(slot->key, key)) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/* Drop every slot in INDEX */
+static void disk_index_free(disk_index_t *index) {
+    for (int i = 0; i < DISK_INDEX_BUCKETS; i++) {
+        disk_slot_t *slot = index->buckets[i];
+        while (slot) {
+            disk_slot_t *next = slot->next;
+            free(slot);
+            slot = next;
+        }
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+/* Index the records in MAP between FROM and SIZE.  A record that fails its
+   checksum is skipped by resynchronizing on the next magic number; a record
+   cut off at the end of the file is left for a later pass.  Returns the
+   offset up to which the map has been consumed. */
+static off_t disk_index_scan(disk_index_t *index, const char *map, off_t from, off_t size) {
+    off_t pos = from;
+    disk_record_t record;
+
+    while (pos + (off_t)sizeof(record) <= size) {
+        memcpy(&record, map + pos, sizeof(record));
+
+        if (record.magic != DISK_RECORD_MAGIC || record.length > MAX_RESPONSE_SIZE) {
+            pos++;
+            continue;
+        }
+        if (pos + (off_t)disk_record_span(record.length) > size) {
+            break;
+        }
+        if (disk_checksum(&record, map + pos + sizeof(record)) != record.checksum) {
+            pos++;
+            continue;
+        }
+
+        disk_index_add(index, &record, pos + sizeof(record));
+        pos += disk_record_span(record.length);
+    }
+    return pos;
+}
+
+/* Close the segment and forget its index.  Caller holds the disk mutex. */
+static void disk_close(disk_tier_t *disk) {
+    if (disk->map) {
+        munmap(disk->map, disk->map_size);
+    }
+    if (disk->fd >= 0) {
+        close(disk->fd);
+    }
+    disk_index_free(&disk->index);
+    disk->map = NULL;
+    disk->map_size = 0;
+    disk->scanned = 0;
+    disk->fd = -1;
+}
+
+/* Open the segment on first use, or reopen it after another shell compacted
+   it.  The file must belong to us and not be writable by anyone else, since
+   its contents are replayed as AI responses.  Caller holds the disk mutex. */
+static int disk_open(disk_tier_t *disk) {
+    struct stat st;
+
+    if (!disk->path) {
+        return -1;
+    }
+
+    if (disk->fd >= 0) {
+        if (stat(disk->path, &st) == 0 && st.st_ino == disk->ino) {
+            return 0;
+        }
+        disk_close(disk);
+    }
+
+    disk->fd = open(disk->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (disk->fd < 0) {
+        return -1;
+    }
+
+    if (fstat(disk->fd, &st) != 0 || st.st_uid != geteuid() || (st.st_mode & 022)) {
+        ANBS_DEBUG_LOG("Ignoring cache segment with unsafe ownership: %s", disk->path);
+        close(disk->fd);
+        disk->fd = -1;
+        free(disk->path);
+        disk->path = NULL;
+        return -1;
+    }
+
+    disk->ino = st.st_ino;
+    return 0;
+}
+
+/* Write live records from the segment at PATH to a fresh file and rename it
+   over the original.  Runs on the worker pool; appenders in every shell are
+   held off by the exclusive flock while the copy is made. */
+static void disk_compact_task(void *arg) {
+    char *path = arg;
+    char tmp_path[PATH_MAX];
+    disk_index_t index;
+    struct stat st;
+    char *map = NULL;
+    int fd, out = -1;
+    time_t now = time(NULL);
+
+    memset(&index, 0, sizeof(index));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        goto done;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        goto done;
+    }
+
+    disk_index_scan(&index, map, 0, st.st_size);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long)getpid());
+    out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out < 0) {
+        goto done;
+    }
+
+    for (int i = 0; i < DISK_INDEX_BUCKETS; i++) {
+        for (disk_slot_t *slot = index.buckets[i]; slot; slot = slot->next) {
+            if (slot->expires_at < now) {
+                continue;
+            }
+            const char *record = map + slot->offset - sizeof(disk_record_t);
+            if (write(out, record, disk_record_span(slot->length)) < 0) {
+                unlink(tmp_path);
+                goto done;
+            }
+        }
+    }
+
+    if (fsync(out) == 0 && rename(tmp_path, path) == 0) {
+        ANBS_DEBUG_LOG("Compacted cache segment to %d live entries", index.entries);
+    } else {
+        unlink(tmp_path);
+    }
+
+done:
+    if (out >= 0) {
+        close(out);
+    }
+    if (map) {
+        munmap(map, st.st_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    disk_index_free(&index);
+    free(path);
+    __atomic_store_n(&g_disk_compacting, 0, __ATOMIC_RELEASE);
+}
+
+/* Map and index whatever has been appended since the last pass, then kick
+   off compaction if most of the file is dead.  Caller holds the disk mutex. */
+static int disk_catch_up(disk_tier_t *disk) {
+    struct stat st;
+
+    if (disk_open(disk) != 0 || fstat(disk->fd, &st) != 0) {
+        return -1;
+    }
+
+    if ((size_t)st.st_size > disk->map_size) {
+        if (disk->map) {
+            munmap(disk->map, disk->map_size);
+        }
+        disk->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, disk->fd, 0);
+        if (disk->map == MAP_FAILED) {
+            disk->map = NULL;
+            disk->map_size = 0;
+            return -1;
+        }
+        disk->map_size = st.st_size;
+        disk->scanned = disk_index_scan(&disk->index, disk->map, disk->scanned, st.st_size);
+    }
+
+    if (st.st_size > DISK_COMPACT_MIN_BYTES &&
+        (size_t)st.st_size > disk->index.live_bytes * 2 &&
+        !__atomic_exchange_n(&g_disk_compacting, 1, __ATOMIC_ACQ_REL)) {
+        char *path = strdup(disk->path);
+
+        if (!path || anbs_optimize_submit(disk_compact_task, path) != 0) {
+            free(path);
+            __atomic_store_n(&g_disk_compacting, 0, __ATOMIC_RELEASE);
+        }
+    }
+    return 0;
+}
+
+/* Look KEY up in the persistent tier.  Returns a malloc'd response and its
+   expiry, or NULL. */
+static char *disk_lookup(const unsigned char *key, time_t now, time_t *expires_at) {
+    disk_tier_t *disk = &g_cache->disk;
+    char *response = NULL;
+
+    if (!disk->path) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&disk->mutex);
+
+    if (disk_catch_up(disk) == 0) {
+        disk_slot_t *slot = disk_index_find(&disk->index, key);
+        if (slot && slot->expires_at >= now &&
+            slot->offset + slot->length <= (off_t)disk->map_size) {
+            response = strndup(disk->map + slot->offset, slot->length);
+            if (response) {
+                *expires_at = slot->expires_at;
+                disk->hits++;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&disk->mutex);
+    return response;
+}
+
+/* Append a record for KEY.  EXPIRES_AT of 0 writes a tombstone. */
+static void disk_append(const unsigned char *key, const char *response, size_t length, time_t expires_at) {
+    disk_tier_t *disk = &g_cache->disk;
+    disk_record_t record;
+    char *buffer;
+
+    if (!disk->path) {
+        return;
+    }
+
+    buffer = malloc(disk_record_span(length));
+    if (!buffer) {
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.magic = DISK_RECORD_MAGIC;
+    record.length = (uint32_t)length;
+    record.expires_at = (int64_t)expires_at;
+    memcpy(record.key, key, CACHE_KEY_BYTES);
+    record.checksum = disk_checksum(&record, response);
+
+    memcpy(buffer, &record, sizeof(record));
+    if (length) {
+        memcpy(buffer + sizeof(record), response, length);
+    }
+
+    pthread_mutex_lock(&disk->mutex);
+
+    /* A single O_APPEND write keeps records from concurrent shells whole;
+       the shared flock only waits out a compaction in progress */
+    for (int attempt = 0; attempt < 2 && disk_open(disk) == 0; attempt++) {
+        struct stat st;
+
+        flock(disk->fd, LOCK_SH);
+        if (stat(disk->path, &st) != 0 || st.st_ino != disk->ino) {
+            flock(disk->fd, LOCK_UN);
+            continue;  /* Compacted underneath us; reopen and retry */
+        }
+        if (write(disk->fd, buffer, disk_record_span(length)) < 0) {
+            ANBS_DEBUG_LOG("Cache segment append failed: %s", strerror(errno));
+        }
+        flock(disk->fd, LOCK_UN);
+        break;
+    }
+
+    pthread_mutex_unlock(&disk->mutex);
+    free(buffer);
+}
+
+/* Open addressing home slot for KEY in the shared index */
+static unsigned int shm_home(const unsigned char *key) {
+    uint32_t bits;
+
+    memcpy(&bits, key + 12, sizeof(bits));
+    return bits % SHM_SLOTS;
+}
+
+/* Take the segment's robust mutex, repairing it if a holder died */
+static int shm_lock(shm_segment_t *segment) {
+    int rc = pthread_mutex_lock(&segment->mutex);
+
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(&segment->mutex);
+        rc = 0;
+    }
+    return rc;
+}
+
+/* Map the host-wide segment selected by ANBS_SHARED_CACHE ("user" or
+   "group").  The first process to open it initializes the header; the
+   segment must belong to us (user scope) or to our group and not be open to
+   others (group scope), otherwise the tier stays off. */
+static void shm_attach(shm_tier_t *shm) {
+    const char *scope = getenv("ANBS_SHARED_CACHE");
+    char name[64];
+    mode_t mode;
+    struct stat st;
+    int fd, created = 0;
+
+    if (!scope || !*scope) {
+        return;
+    }
+
+    if (strcmp(scope, "group") == 0) {
+        snprintf(name, sizeof(name), "/anbs-cache-g%ld", (long)getegid());
+        mode = 0660;
+    } else {
+        snprintf(name, sizeof(name), "/anbs-cache-u%ld", (long)geteuid());
+        mode = 0600;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+    if (fd >= 0) {
+        created = 1;
+        if (fchmod(fd, mode) != 0 || ftruncate(fd, sizeof(shm_segment_t)) != 0) {
+            close(fd);
+            shm_unlink(name);
+            return;
+        }
+    } else if (errno == EEXIST) {
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        return;
+    }
+
+    if (fstat(fd, &st) != 0 || (st.st_mode & 07) ||
+        (mode == 0600 ? st.st_uid != geteuid() : st.st_gid != getegid())) {
+        ANBS_DEBUG_LOG("Ignoring shared cache %s with unsafe ownership", name);
+        close(fd);
+        return;
+    }
+
+    shm_segment_t *segment = NULL;
+    if ((size_t)st.st_size >= sizeof(shm_segment_t) || created) {
+        segment = mmap(NULL, sizeof(shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (!segment || segment == MAP_FAILED) {
+        return;
+    }
+
+    if (created) {
+        pthread_mutexattr_t attr;
+
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&segment->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        __atomic_store_n(&segment->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        /* Give a concurrent creator a moment to finish the header */
+        for (int i = 0; i < 100 && __atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC; i++) {
+            usleep(1000);
+        }
+        if (segment->magic != SHM_MAGIC) {
+            munmap(segment, sizeof(shm_segment_t));
+            return;
+        }
+    }
+
+    shm->segment = segment;
+    shm->entry_mode = mode == 0660 ? 0640 : 0600;
+    ANBS_DEBUG_LOG("Attached %s shared cache %s", mode == 0660 ? "group" : "user", name);
+}
+
+/* Look KEY up in the shared segment.  Only entries whose owner and mode let
+   us read them count.  Returns a malloc'd response and its expiry, or NULL. */
+static char *shm_lookup(const unsigned char *key, time_t now, time_t *expires_at) {
+    shm_tier_t *shm = &g_cache->shm;
+    shm_segment_t *segment = shm->segment;
+    char *response = NULL;
+
+    if (!segment || shm_lock(segment) != 0) {
+        return NULL;
+    }
+
+    unsigned int home = shm_home(key);
+    for (int probe = 0; probe < SHM_PROBE; probe++) {
+        shm_slot_t *slot = &segment->slots[(home + probe) % SHM_SLOTS];
+
+        if (!slot->expires_at || !key_equal(slot->key, key)) {
+            continue;
+        }
+        if (slot->expires_at >= now &&
+            anbs_permissions_check_shared(slot->owner_uid, slot->owner_gid, slot->mode, S_IROTH)) {
+            response = strndup(slot->data, slot->length);
+            if (response) {
+                *expires_at = (time_t)slot->expires_at;
+                segment->hits++;
+                shm->hits++;
+            }
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&segment->mutex);
+    return response;
+}
+
+/* Publish RESPONSE for KEY.  An existing entry is only replaced if we may
+   write it; otherwise a free or expired slot in the probe window is used,
+   falling back to the oldest entry we may overwrite. */
+static void shm_store(const unsigned char *key, const char *response, size_t length, time_t expires_at) {
+    shm_tier_t *shm = &g_cache->shm;
+    shm_segment_t *segment = shm->segment;
+    time_t now = time(NULL);
+
+    if (!segment || length >= SHM_SLOT_BYTES || shm_lock(segment) != 0) {
+        return;
+    }
+
+    shm_slot_t *target = NULL;
+    unsigned int home = shm_home(key);
+    for (int probe = 0; probe < SHM_PROBE; probe++) {
+        shm_slot_t *slot = &segment->slots[(home + probe) % SHM_SLOTS];
+        int writable = !slot->expires_at || slot->expires_at < now ||
+            anbs_permissions_check_shared(slot->owner_uid, slot->owner_gid, slot->mode, S_IWOTH);
+
+        if (slot->expires_at && key_equal(slot->key, key)) {
+            target = writable ? slot : NULL;
+            break;
+        }
+        if (!writable) {
+            continue;
+        }
+        if (!target || !slot->expires_at || slot->expires_at < now ||
+            (target->expires_at >= now && slot->stored_at < target->stored_at)) {
+            target = slot;
+        }
+    }
+
+    if (target) {
+        memcpy(target->key, key, CACHE_KEY_BYTES);
+        memcpy(target->data, response, length);
+        target->length = (uint32_t)length;
+        target->owner_uid = geteuid();
+        target->owner_gid = getegid();
+        target->mode = shm->entry_mode;
+        target->stored_at = now;
+        target->expires_at = expires_at;
+    }
+
+    pthread_mutex_unlock(&segment->mutex);
+}
+
+/* Drop KEY from the shared segment if we own that entry */
+static void shm_remove(const unsigned char *key) {
+    shm_segment_t *segment = g_cache->shm.segment;
+
+    if (!segment || shm_lock(segment) != 0) {
+        return;
+    }
+
+    unsigned int home = shm_home(key);
+    for (int probe = 0; probe < SHM_PROBE; probe++) {
+        shm_slot_t *slot = &segment->slots[(home + probe) % SHM_SLOTS];
+        if (slot->expires_at && key_equal(slot->key, key)) {
+            if (slot->owner_uid == geteuid()) {
+                slot->expires_at = 0;
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&segment->mutex);
+}
+
+/* Drop every shared entry we own */
+static void shm_clear_own(void) {
+    shm_segment_t *segment = g_cache->shm.segment;
+
+    if (!segment || shm_lock(segment) != 0) {
+        return;
+    }
+    for (int i = 0; i < SHM_SLOTS; i++) {
+        if (segment->slots[i].owner_uid == geteuid()) {
+            segment->slots[i].expires_at = 0;
+        }
     }
-    g_cache->lru_head = entry;
+    pthread_mutex_unlock(&segment->mutex);
+}
+
+/* Background expiry tick.  Once a second each shard's wheel is advanced if
+   its lock is free; a busy shard just catches up on the next tick or put. */
+static void *cache_tick_thread(void *arg) {
+    (void)arg;
+
+    while (__atomic_load_n(&g_tick_running, __ATOMIC_ACQUIRE)) {
+        sleep(1);
 
-    if (!g_cache->lru_tail) {
-        g_cache->lru_tail = entry;
+        time_t now = time(NULL);
+        for (int s = 0; s < CACHE_SHARDS; s++) {
+            cache_shard_t *shard = &g_cache->shards[s];
+
+            if (pthread_rwlock_trywrlock(&shard->rwlock) == 0) {
+                wheel_advance(shard, now);
+                pthread_rwlock_unlock(&shard->rwlock);
+            }
+        }
     }
+    return NULL;
 }
 
-/* Remove entry from LRU list */
-static void remove_from_lru(cache_entry_t *entry) {
-    if (entry->lru_prev) {
-        entry->lru_prev->lru_next = entry->lru_next;
-    } else {
-        g_cache->lru_head = entry->lru_next;
+/* Hold every shard lock across fork(), so a child (e.g. @vertex --async)
+   never inherits a shard locked by the tick thread */
+static void cache_atfork_prepare(void) {
+    if (!g_cache) {
+        return;
     }
-
-    if (entry->lru_next) {
-        entry->lru_next->lru_prev = entry->lru_prev;
-    } else {
-        g_cache->lru_tail = entry->lru_prev;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        pthread_rwlock_wrlock(&g_cache->shards[s].rwlock);
     }
 }
 
-/* Evict least recently used entry */
-static void evict_lru_entry(void) {
-    if (!g_cache->lru_tail) {
+/* Release the locks taken by cache_atfork_prepare() */
+static void cache_atfork_parent(void) {
+    if (!g_cache) {
         return;
     }
+    for (int s = CACHE_SHARDS - 1; s >= 0; s--) {
+        pthread_rwlock_unlock(&g_cache->shards[s].rwlock);
+    }
+}
 
-    cache_entry_t *victim = g_cache->lru_tail;
-    unsigned int bucket = hash_command(victim->command_hash);
-
-    /* Remove from hash bucket */
-    cache_entry_t **current = &g_cache->buckets[bucket];
-    while (*current && *current != victim) {
-        current = &(*current)->next;
+/* The child has a new thread id, so it cannot unlock the parent's write
+   locks; it starts over with fresh ones, and without the tick thread */
+static void cache_atfork_child(void) {
+    if (!g_cache) {
+        return;
     }
-    if (*current) {
-        *current = victim->next;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        pthread_rwlock_init(&g_cache->shards[s].rwlock, NULL);
     }
-
-    /* Remove from LRU list */
-    remove_from_lru(victim);
-
-    /* Free memory */
-    free(victim->response);
-    free(victim);
-
-    g_cache->entry_count--;
-    g_cache->evictions++;
-
-    ANBS_DEBUG_LOG("Evicted LRU cache entry, count now: %d", g_cache->entry_count);
+    g_tick_running = 0;
 }
 
 /* Initialize response cache */
@@ -153,6 +1258,7 @@ int anbs_cache_init(int max_entries) {
     if (g_cache) {
         return 0; /* Already initialized */
     }
+    int startup_slot = anbs_startup_enter("ai_core", "response cache");
 
     g_cache = calloc(1, sizeof(response_cache_t));
     if (!g_cache) {
@@ -161,86 +1267,227 @@ int anbs_cache_init(int max_entries) {
 
     g_cache->max_entries = max_entries > 0 ? max_entries : CACHE_SIZE;
 
-    if (pthread_rwlock_init(&g_cache->rwlock, NULL) != 0) {
-        free(g_cache);
-        g_cache = NULL;
-        return -1;
+    const char *policy = getenv("ANBS_CACHE_POLICY");
+    g_cache->policy = (policy && strcmp(policy, "sieve") == 0) ?
+                      CACHE_POLICY_SIEVE : CACHE_POLICY_LRU;
+
+    const char *admission = getenv("ANBS_CACHE_ADMISSION");
+    g_cache->tinylfu = admission && strcmp(admission, "tinylfu") == 0;
+
+    /* Optional memory budget, e.g. ANBS_CACHE_MAX_BYTES=8388608 */
+    const char *max_bytes = getenv("ANBS_CACHE_MAX_BYTES");
+    if (max_bytes && *max_bytes) {
+        g_cache->max_bytes = strtoull(max_bytes, NULL, 10);
+    }
+
+    time_t now = time(NULL);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &g_cache->shards[i];
+
+        shard->max_entries = (g_cache->max_entries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+        shard->max_bytes = g_cache->max_bytes / CACHE_SHARDS;
+        shard->wheel_cursor = now - 1;
+        if (pthread_rwlock_init(&shard->rwlock, NULL) != 0) {
+            while (--i >= 0) {
+                pthread_rwlock_destroy(&g_cache->shards[i].rwlock);
+            }
+            free(g_cache);
+            g_cache = NULL;
+            return -1;
+        }
+    }
+    pthread_mutex_init(&g_cache->semantic_mutex, NULL);
+
+    /* Persistent tier, opened on first use */
+    g_cache->disk.fd = -1;
+    pthread_mutex_init(&g_cache->disk.mutex, NULL);
+
+    const char *cache_dir = getenv("ANBS_CACHE_DIR");
+    if (cache_dir && *cache_dir) {
+        size_t len = strlen(cache_dir) + sizeof(DISK_SEGMENT_NAME) + 1;
+        g_cache->disk.path = malloc(len);
+        if (g_cache->disk.path) {
+            snprintf(g_cache->disk.path, len, "%s/%s", cache_dir, DISK_SEGMENT_NAME);
+        }
+    }
+
+    /* Request coalescing; with a cache directory it spans shells too */
+    pthread_mutex_init(&g_cache->flight_mutex, NULL);
+    g_cache->flight_fd = -1;
+    if (cache_dir && *cache_dir) {
+        char lock_path[PATH_MAX];
+        struct stat st;
+
+        snprintf(lock_path, sizeof(lock_path), "%s/%s", cache_dir, FLIGHT_LOCK_NAME);
+        g_cache->flight_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (g_cache->flight_fd >= 0 &&
+            (fstat(g_cache->flight_fd, &st) != 0 || st.st_uid != geteuid())) {
+            close(g_cache->flight_fd);
+            g_cache->flight_fd = -1;
+        }
+    }
+
+    const char *stale = getenv("ANBS_CACHE_STALE_SECONDS");
+    if (stale && *stale) {
+        g_cache->stale_seconds = atoi(stale) > 0 ? atoi(stale) : 0;
+    }
+
+    static int atfork_registered = 0;
+    if (!atfork_registered) {
+        pthread_atfork(cache_atfork_prepare, cache_atfork_parent, cache_atfork_child);
+        atfork_registered = 1;
+    }
+
+    g_tick_running = 1;
+    if (pthread_create(&g_tick_thread, NULL, cache_tick_thread, NULL) != 0) {
+        g_tick_running = 0;  /* Puts still advance the wheel */
     }
 
-    ANBS_DEBUG_LOG("Response cache initialized with %d max entries", g_cache->max_entries);
+    shm_attach(&g_cache->shm);
+
+    ANBS_DEBUG_LOG("Response cache initialized with %d max entries in %d shards (%s)",
+                   g_cache->max_entries, CACHE_SHARDS,
+                   g_cache->policy == CACHE_POLICY_SIEVE ? "sieve" : "lru");
+    anbs_startup_leave(startup_slot, -1);
     return 0;
 }
 
-/* Store response in cache */
-int anbs_cache_put(const char *command, const char *response, int ttl_seconds) {
-    if (!g_cache || !command || !response) {
+/* Insert or replace KEY in the in-memory tier.  Returns 0 on success, 1 if
+   the admission filter turned it away, and -1 on error. */
+static int cache_insert(const unsigned char *key, const char *response,
+                        size_t response_length, int ttl_seconds) {
+    unsigned int bucket;
+    cache_shard_t *shard = shard_for(key, &bucket);
+    time_t now = time(NULL);
+
+    /* Compress outside the lock; the stored form is swapped in below */
+    cache_entry_t encoded;
+    if (entry_encode(&encoded, response, response_length) != 0) {
         return -1;
     }
 
-    if (strlen(response) > MAX_RESPONSE_SIZE) {
-        return -1; /* Response too large to cache */
+    size_t size = entry_size(encoded.stored_length);
+    if (shard->max_bytes && size > shard->max_bytes) {
+        free(encoded.response);
+        return -1; /* Larger than the shard's whole budget */
     }
 
-    char command_hash[65];
-    generate_command_hash(command, command_hash);
+    pthread_rwlock_wrlock(&shard->rwlock);
 
-    unsigned int bucket = hash_command(command_hash);
-    time_t now = time(NULL);
-
-    pthread_rwlock_wrlock(&g_cache->rwlock);
+    /* Already holding the write lock, so catch up on expiry here too */
+    wheel_advance(shard, now);
 
     /* Check if entry already exists */
-    cache_entry_t *existing = g_cache->buckets[bucket];
+    cache_entry_t *existing = shard->buckets[bucket];
     while (existing) {
-        if (strcmp(existing->command_hash, command_hash) == 0) {
+        if (key_equal(existing->key, key)) {
             /* Update existing entry */
+            entry_account(shard, existing, -1);
             free(existing->response);
-            existing->response = strdup(response);
-            existing->response_length = strlen(response);
+            existing->response = encoded.response;
+            existing->response_length = encoded.response_length;
+            existing->stored_length = encoded.stored_length;
+            existing->compressed = encoded.compressed;
             existing->timestamp = now;
             existing->ttl_seconds = ttl_seconds > 0 ? ttl_seconds : DEFAULT_TTL;
+            wheel_remove(shard, existing);
             existing->expires_at = now + existing->ttl_seconds;
+            existing->refreshing = 0;
+            wheel_insert(shard, existing);
+
+            /* Touch first so a larger response evicts others, not itself */
+            touch_entry(shard, existing);
+            while (shard->entry_count > 1 && shard_over_budget(shard, size)) {
+                evict_one(shard);
+            }
+            entry_account(shard, existing, 1);
 
-            move_to_front(existing);
-            pthread_rwlock_unlock(&g_cache->rwlock);
+            pthread_rwlock_unlock(&shard->rwlock);
             return 0;
         }
         existing = existing->next;
     }
 
+    /* A full shard only takes a new key that has been looked up more often
+       than the entry it would displace; one-off prompts stay out */
+    if (g_cache->tinylfu) {
+        sketch_age(shard);
+
+        cache_entry_t *victim = eviction_candidate(shard);
+        if (victim && shard->entry_count >= shard->max_entries &&
+            sketch_estimate(shard, key) <= sketch_estimate(shard, victim->key)) {
+            shard->admission_rejections++;
+            pthread_rwlock_unlock(&shard->rwlock);
+            free(encoded.response);
+            return 1;
+        }
+    }
+
     /* Create new entry */
     cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
     if (!entry) {
-        pthread_rwlock_unlock(&g_cache->rwlock);
+        pthread_rwlock_unlock(&shard->rwlock);
+        free(encoded.response);
         return -1;
     }
 
-    strcpy(entry->command_hash, command_hash);
-    entry->response = strdup(response);
-    entry->response_length = strlen(response);
+    memcpy(entry->key, key, CACHE_KEY_BYTES);
+    entry->response = encoded.response;
+    entry->response_length = encoded.response_length;
+    entry->stored_length = encoded.stored_length;
+    entry->compressed = encoded.compressed;
     entry->timestamp = now;
     entry->ttl_seconds = ttl_seconds > 0 ? ttl_seconds : DEFAULT_TTL;
     entry->expires_at = now + entry->ttl_seconds;
     entry->hit_count = 0;
 
-    /* Evict entries if cache is full */
-    while (g_cache->entry_count >= g_cache->max_entries) {
-        evict_lru_entry();
+    /* Evict entries if this shard is full or over its byte budget */
+    while (shard->entry_count > 0 &&
+           (shard->entry_count >= shard->max_entries || shard_over_budget(shard, size))) {
+        evict_one(shard);
     }
 
     /* Add to hash bucket */
-    entry->next = g_cache->buckets[bucket];
-    g_cache->buckets[bucket] = entry;
+    entry->next = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+
+    /* Add to front of LRU list and to the expiry wheel */
+    move_to_front(shard, entry);
+    wheel_insert(shard, entry);
+
+    shard->entry_count++;
+    entry_account(shard, entry, 1);
+
+    pthread_rwlock_unlock(&shard->rwlock);
+    return 0;
+}
+
+/* Store response in cache */
+int anbs_cache_put(const char *command, const char *response, int ttl_seconds) {
+    if (!g_cache || !command || !response) {
+        return -1;
+    }
+
+    size_t response_length = strlen(response);
+    if (response_length > MAX_RESPONSE_SIZE) {
+        return -1; /* Response too large to cache */
+    }
 
-    /* Add to front of LRU list */
-    move_to_front(entry);
+    unsigned char key[CACHE_KEY_BYTES];
+    derive_key(command, key);
 
-    g_cache->entry_count++;
+    if (ttl_seconds <= 0) {
+        ttl_seconds = DEFAULT_TTL;
+    }
 
-    pthread_rwlock_unlock(&g_cache->rwlock);
+    if (cache_insert(key, response, response_length, ttl_seconds) < 0) {
+        return -1;
+    }
+    shm_store(key, response, response_length, time(NULL) + ttl_seconds);
+    disk_append(key, response, response_length, time(NULL) + ttl_seconds);
 
-    ANBS_DEBUG_LOG("Cached response for command hash: %.16s... (TTL: %ds)",
-                   command_hash, entry->ttl_seconds);
+    ANBS_DEBUG_LOG("Cached response for command: %.50s... (TTL: %ds)",
+                   command, ttl_seconds);
     return 0;
 }
 
@@ -253,42 +1500,50 @@ char *anbs_cache_get(const char *command, double *cache_age_ms) {
     struct timeval start_time, end_time;
     gettimeofday(&start_time, NULL);
 
-    char command_hash[65];
-    generate_command_hash(command, command_hash);
+    unsigned char key[CACHE_KEY_BYTES];
+    derive_key(command, key);
 
-    unsigned int bucket = hash_command(command_hash);
+    unsigned int bucket;
+    cache_shard_t *shard = shard_for(key, &bucket);
     time_t now = time(NULL);
 
-    pthread_rwlock_rdlock(&g_cache->rwlock);
+    /* Under LRU a hit reorders the shard's list, so the lookup takes the
+       shard's write lock; SIEVE hits only set a bit and share the lock */
+    int sieve = g_cache->policy == CACHE_POLICY_SIEVE;
+    if (sieve) {
+        pthread_rwlock_rdlock(&shard->rwlock);
+    } else {
+        pthread_rwlock_wrlock(&shard->rwlock);
+    }
 
-    g_cache->total_requests++;
+    stat_inc(shard->total_requests);
+    if (g_cache->tinylfu) {
+        sketch_record(shard, key);
+    }
 
-    cache_entry_t *entry = g_cache->buckets[bucket];
+    cache_entry_t *entry = shard->buckets[bucket];
     while (entry) {
-        if (strcmp(entry->command_hash, command_hash) == 0) {
+        if (key_equal(entry->key, key)) {
             /* Check if entry has expired */
             if (entry->expires_at < now) {
-                pthread_rwlock_unlock(&g_cache->rwlock);
-                g_cache->cache_misses++;
-                return NULL; /* Expired */
+                break; /* Expired; another shell may have a fresher copy */
             }
 
             /* Entry found and valid */
-            char *response = strdup(entry->response);
-            entry->hit_count++;
+            char *response = entry_decode(entry);
+            if (!response) {
+                break;
+            }
+            stat_inc(entry->hit_count);
 
             if (cache_age_ms) {
                 *cache_age_ms = (now - entry->timestamp) * 1000.0;
             }
 
-            pthread_rwlock_unlock(&g_cache->rwlock);
+            touch_entry(shard, entry);
+            stat_inc(shard->cache_hits);
 
-            /* Update LRU (requires write lock) */
-            pthread_rwlock_wrlock(&g_cache->rwlock);
-            move_to_front(entry);
-            pthread_rwlock_unlock(&g_cache->rwlock);
-
-            g_cache->cache_hits++;
+            pthread_rwlock_unlock(&shard->rwlock);
 
             gettimeofday(&end_time, NULL);
             double lookup_time = (end_time.tv_sec - start_time.tv_sec) * 1000.0 +
@@ -296,100 +1551,484 @@ char *anbs_cache_get(const char *command, double *cache_age_ms) {
 
             ANBS_DEBUG_LOG("Cache HIT for command (%.2fms lookup): %.50s...",
                            lookup_time, command);
+            PROBE2(anbs, cache__hit, command, 0);
             return response;
         }
         entry = entry->next;
     }
 
-    pthread_rwlock_unlock(&g_cache->rwlock);
-    g_cache->cache_misses++;
+    stat_inc(shard->cache_misses);
+    pthread_rwlock_unlock(&shard->rwlock);
+
+    /* Fall back to the shared, then the persistent tier, and promote what
+       they find */
+    time_t expires_at;
+    char *response = shm_lookup(key, now, &expires_at);
+    if (response) {
+        cache_insert(key, response, strlen(response), (int)(expires_at - now) + 1);
+        if (cache_age_ms) {
+            *cache_age_ms = 0;
+        }
+        ANBS_DEBUG_LOG("Cache SHARED HIT for command: %.50s...", command);
+        PROBE2(anbs, cache__hit, command, 1);
+        return response;
+    }
+
+    response = disk_lookup(key, now, &expires_at);
+    if (response) {
+        cache_insert(key, response, strlen(response), (int)(expires_at - now) + 1);
+        if (cache_age_ms) {
+            *cache_age_ms = 0;
+        }
+        ANBS_DEBUG_LOG("Cache DISK HIT for command: %.50s...", command);
+        PROBE2(anbs, cache__hit, command, 2);
+        return response;
+    }
 
     ANBS_DEBUG_LOG("Cache MISS for command: %.50s...", command);
+    PROBE1(anbs, cache__miss, command);
     return NULL;
 }
 
-/* Remove specific entry from cache */
-int anbs_cache_remove(const char *command) {
+/* Release one semantic slot */
+static void semantic_entry_free(semantic_entry_t *slot) {
+    free(slot->embedding);
+    free(slot->response);
+    memset(slot, 0, sizeof(*slot));
+}
+
+/* Store a response in the semantic tier under SCOPE */
+int anbs_cache_semantic_put(const char *scope, const char *prompt, const char *response, int ttl_seconds) {
+    if (!g_cache || !scope || !prompt || !response) {
+        return -1;
+    }
+
+    if (strlen(response) > MAX_RESPONSE_SIZE) {
+        return -1;
+    }
+
+    unsigned char scope_key[CACHE_KEY_BYTES];
+    derive_key(scope, scope_key);
+
+    float *embedding = anbs_memory_embed(prompt);
+    if (!embedding) {
+        return -1;
+    }
+
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&g_cache->semantic_mutex);
+
+    /* Prefer an empty or expired slot, else the least recently used one */
+    semantic_entry_t *victim = NULL;
+    for (int i = 0; i < SEMANTIC_SLOTS; i++) {
+        semantic_entry_t *slot = &g_cache->semantic[i];
+        if (!slot->response || slot->expires_at < now) {
+            victim = slot;
+            break;
+        }
+        if (!victim || slot->last_used < victim->last_used) {
+            victim = slot;
+        }
+    }
+
+    if (victim->response) {
+        semantic_entry_free(victim);
+    } else {
+        g_cache->semantic_count++;
+    }
+
+    memcpy(victim->scope_key, scope_key, CACHE_KEY_BYTES);
+    victim->embedding = embedding;
+    victim->response = strdup(response);
+    victim->expires_at = now + (ttl_seconds > 0 ? ttl_seconds : DEFAULT_TTL);
+    victim->last_used = ++g_cache->semantic_clock;
+
+    pthread_mutex_unlock(&g_cache->semantic_mutex);
+    return 0;
+}
+
+/* Find the closest cached prompt in SCOPE whose similarity to PROMPT is at
+   least THRESHOLD.  Returns a malloc'd copy of its response, or NULL. */
+char *anbs_cache_semantic_get(const char *scope, const char *prompt, float threshold, float *similarity) {
+    if (!g_cache || !scope || !prompt) {
+        return NULL;
+    }
+
+    unsigned char scope_key[CACHE_KEY_BYTES];
+    derive_key(scope, scope_key);
+
+    float *embedding = anbs_memory_embed(prompt);
+    if (!embedding) {
+        return NULL;
+    }
+
+    time_t now = time(NULL);
+    semantic_entry_t *best = NULL;
+    float best_score = threshold;
+    char *response = NULL;
+
+    pthread_mutex_lock(&g_cache->semantic_mutex);
+
+    g_cache->semantic_lookups++;
+
+    for (int i = 0; i < SEMANTIC_SLOTS; i++) {
+        semantic_entry_t *slot = &g_cache->semantic[i];
+        if (!slot->response || slot->expires_at < now ||
+            !key_equal(slot->scope_key, scope_key)) {
+            continue;
+        }
+
+        float score = anbs_memory_similarity(embedding, slot->embedding);
+        if (score >= best_score) {
+            best = slot;
+            best_score = score;
+        }
+    }
+
+    if (best) {
+        best->last_used = ++g_cache->semantic_clock;
+        response = strdup(best->response);
+        g_cache->semantic_hits++;
+        if (similarity) {
+            *similarity = best_score;
+        }
+    }
+
+    pthread_mutex_unlock(&g_cache->semantic_mutex);
+    free(embedding);
+
+    if (response) {
+        ANBS_DEBUG_LOG("Semantic cache HIT (similarity %.3f): %.50s...", best_score, prompt);
+    }
+    return response;
+}
+
+/* Return an expired response for COMMAND that is still inside the
+   stale-while-revalidate window, or NULL.  *REFRESH is set for exactly one
+   caller per stale entry, which should fetch a fresh copy and put it. */
+char *anbs_cache_get_stale(const char *command, double *cache_age_ms, int *refresh) {
+    if (!g_cache || !command || g_cache->stale_seconds <= 0) {
+        return NULL;
+    }
+
+    unsigned char key[CACHE_KEY_BYTES];
+    derive_key(command, key);
+
+    unsigned int bucket;
+    cache_shard_t *shard = shard_for(key, &bucket);
+    time_t now = time(NULL);
+    char *response = NULL;
+
+    /* Nothing is reordered, so the shared lock does under either policy */
+    pthread_rwlock_rdlock(&shard->rwlock);
+
+    for (cache_entry_t *entry = shard->buckets[bucket]; entry; entry = entry->next) {
+        if (!key_equal(entry->key, key)) {
+            continue;
+        }
+        if (entry_deadline(entry) >= now && (response = entry_decode(entry)) != NULL) {
+            if (cache_age_ms) {
+                *cache_age_ms = (now - entry->timestamp) * 1000.0;
+            }
+            if (refresh) {
+                *refresh = entry->expires_at < now &&
+                           !__atomic_exchange_n(&entry->refreshing, 1, __ATOMIC_ACQ_REL);
+            }
+            stat_inc(g_cache->stale_served);
+        }
+        break;
+    }
+
+    pthread_rwlock_unlock(&shard->rwlock);
+    return response;
+}
+
+/* Byte-range lock standing for KEY in the shared in-flight lock file */
+static int flight_lock(const unsigned char *key, short type, int wait) {
+    struct flock fl;
+    uint32_t bits;
+
+    if (g_cache->flight_fd < 0) {
+        return 0;
+    }
+
+    memcpy(&bits, key + 4, sizeof(bits));
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = bits % FLIGHT_LOCK_RANGE;
+    fl.l_len = 1;
+
+    /* Poll rather than F_SETLKW, so a wedged shell cannot hold us forever */
+    for (int waited = 0; fcntl(g_cache->flight_fd, F_SETLK, &fl) != 0; waited += 20) {
+        if (!wait || waited >= FLIGHT_WAIT_SECONDS * 1000) {
+            return -1;
+        }
+        usleep(20000);
+    }
+    return 0;
+}
+
+/* Claim the fetch for COMMAND.  Returns 1 if the caller now owns it and
+   must call anbs_cache_release() once the response is stored (or the fetch
+   failed), and 0 if it waited for another thread's fetch instead.  Either
+   way the caller should look in the cache again before going out. */
+int anbs_cache_claim(const char *command) {
     if (!g_cache || !command) {
         return -1;
     }
 
-    char command_hash[65];
-    generate_command_hash(command, command_hash);
+    unsigned char key[CACHE_KEY_BYTES];
+    derive_key(command, key);
+
+    pthread_mutex_lock(&g_cache->flight_mutex);
+
+    in_flight_t *flight;
+    for (flight = g_cache->flights; flight; flight = flight->next) {
+        if (key_equal(flight->key, key)) {
+            break;
+        }
+    }
+
+    if (flight) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLIGHT_WAIT_SECONDS;
+
+        flight->waiters++;
+        g_cache->coalesced++;
+        while (!flight->done &&
+               pthread_cond_timedwait(&flight->cond, &g_cache->flight_mutex, &deadline) == 0) {
+            ;
+        }
+        flight->waiters--;
+        if (flight->done && flight->waiters == 0) {
+            pthread_cond_destroy(&flight->cond);
+            free(flight);
+        }
+        pthread_mutex_unlock(&g_cache->flight_mutex);
+        return 0;
+    }
+
+    flight = calloc(1, sizeof(in_flight_t));
+    if (flight) {
+        memcpy(flight->key, key, CACHE_KEY_BYTES);
+        pthread_cond_init(&flight->cond, NULL);
+        flight->next = g_cache->flights;
+        g_cache->flights = flight;
+    }
+    pthread_mutex_unlock(&g_cache->flight_mutex);
+
+    /* Another shell may be fetching the same thing; waiting on its lock
+       means the response is usually on disk by the time we get it */
+    flight_lock(key, F_WRLCK, 1);
+    return 1;
+}
+
+/* Finish a fetch claimed with anbs_cache_claim() and wake its waiters */
+void anbs_cache_release(const char *command) {
+    if (!g_cache || !command) {
+        return;
+    }
+
+    unsigned char key[CACHE_KEY_BYTES];
+    derive_key(command, key);
+
+    flight_lock(key, F_UNLCK, 0);
+
+    pthread_mutex_lock(&g_cache->flight_mutex);
+
+    for (in_flight_t **link = &g_cache->flights; *link; link = &(*link)->next) {
+        in_flight_t *flight = *link;
+        if (key_equal(flight->key, key)) {
+            *link = flight->next;
+            flight->done = 1;
+            if (flight->waiters > 0) {
+                pthread_cond_broadcast(&flight->cond);
+            } else {
+                pthread_cond_destroy(&flight->cond);
+                free(flight);
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&g_cache->flight_mutex);
+}
 
-    unsigned int bucket = hash_command(command_hash);
+/* Remove specific entry from cache */
+int anbs_cache_remove(const char *command) {
+    if (!g_cache || !command) {
+        return -1;
+    }
 
-    pthread_rwlock_wrlock(&g_cache->rwlock);
+    unsigned char key[CACHE_KEY_BYTES];
+    derive_key(command, key);
 
-    cache_entry_t **current = &g_cache->buckets[bucket];
-    while (*current) {
-        if (strcmp((*current)->command_hash, command_hash) == 0) {
-            cache_entry_t *to_remove = *current;
-            *current = to_remove->next;
+    unsigned int bucket;
+    cache_shard_t *shard = shard_for(key, &bucket);
 
-            remove_from_lru(to_remove);
-            free(to_remove->response);
-            free(to_remove);
+    pthread_rwlock_wrlock(&shard->rwlock);
 
-            g_cache->entry_count--;
-            pthread_rwlock_unlock(&g_cache->rwlock);
+    for (cache_entry_t *entry = shard->buckets[bucket]; entry; entry = entry->next) {
+        if (key_equal(entry->key, key)) {
+            unlink_entry(shard, entry);
+            pthread_rwlock_unlock(&shard->rwlock);
 
+            shm_remove(key);
+            disk_append(key, NULL, 0, 0);
             ANBS_DEBUG_LOG("Removed cache entry for: %.50s...", command);
             return 0;
         }
-        current = &(*current)->next;
     }
 
-    pthread_rwlock_unlock(&g_cache->rwlock);
+    pthread_rwlock_unlock(&shard->rwlock);
+
+    /* Not in memory, but it may still be shared or persisted */
+    shm_remove(key);
+    disk_append(key, NULL, 0, 0);
     return -1; /* Not found */
 }
 
-/* Clear all cache entries */
+/* Drop every in-memory entry, leaving the persistent tier alone */
+static void cache_clear_memory(void) {
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &g_cache->shards[s];
+
+        pthread_rwlock_wrlock(&shard->rwlock);
+
+        for (int i = 0; i < SHARD_BUCKETS; i++) {
+            cache_entry_t *entry = shard->buckets[i];
+            while (entry) {
+                cache_entry_t *next = entry->next;
+                free(entry->response);
+                free(entry);
+                entry = next;
+            }
+            shard->buckets[i] = NULL;
+        }
+
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+        shard->hand = NULL;
+        memset(shard->wheel, 0, sizeof(shard->wheel));
+        shard->entry_count = 0;
+        shard->bytes = 0;
+        shard->compressed_entries = 0;
+        shard->compressed_raw_bytes = 0;
+        shard->compressed_stored_bytes = 0;
+
+        pthread_rwlock_unlock(&shard->rwlock);
+    }
+
+    pthread_mutex_lock(&g_cache->semantic_mutex);
+    for (int i = 0; i < SEMANTIC_SLOTS; i++) {
+        if (g_cache->semantic[i].response) {
+            semantic_entry_free(&g_cache->semantic[i]);
+        }
+    }
+    g_cache->semantic_count = 0;
+    pthread_mutex_unlock(&g_cache->semantic_mutex);
+}
+
+/* Clear all cache entries, including the persistent tier and our entries
+   in the shared one */
 void anbs_cache_clear(void) {
     if (!g_cache) {
         return;
     }
 
-    pthread_rwlock_wrlock(&g_cache->rwlock);
+    cache_clear_memory();
+    shm_clear_own();
 
-    for (int i = 0; i < HASH_BUCKETS; i++) {
-        cache_entry_t *entry = g_cache->buckets[i];
-        while (entry) {
-            cache_entry_t *next = entry->next;
-            free(entry->response);
-            free(entry);
-            entry = next;
+    disk_tier_t *disk = &g_cache->disk;
+    pthread_mutex_lock(&disk->mutex);
+    if (disk_open(disk) == 0) {
+        flock(disk->fd, LOCK_EX);
+        if (ftruncate(disk->fd, 0) != 0) {
+            ANBS_DEBUG_LOG("Could not truncate cache segment: %s", strerror(errno));
         }
-        g_cache->buckets[i] = NULL;
+        flock(disk->fd, LOCK_UN);
+        disk_close(disk);
     }
+    pthread_mutex_unlock(&disk->mutex);
 
-    g_cache->lru_head = NULL;
-    g_cache->lru_tail = NULL;
-    g_cache->entry_count = 0;
+    ANBS_DEBUG_LOG("Cache cleared");
+}
 
-    pthread_rwlock_unlock(&g_cache->rwlock);
+/* Counters of all shards and the disk tier, added up */
+typedef struct {
+    uint64_t total_requests;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t evictions;
+    uint64_t expirations;
+    uint64_t rejections;
+    int entry_count;
+    int busiest_shard;
+    size_t bytes_used;
+    int compressed_entries;
+    size_t compressed_raw;
+    size_t compressed_stored;
+    int disk_entries;
+    size_t disk_bytes;
+    uint64_t disk_hits;
+} cache_totals_t;
+
+/* Add up the shards' and disk tier's counters, one lock at a time */
+static void cache_collect_totals(cache_totals_t *totals) {
+    memset(totals, 0, sizeof(*totals));
+
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &g_cache->shards[s];
+
+        pthread_rwlock_rdlock(&shard->rwlock);
+        totals->total_requests += shard->total_requests;
+        totals->cache_hits += shard->cache_hits;
+        totals->cache_misses += shard->cache_misses;
+        totals->evictions += shard->evictions;
+        totals->expirations += shard->expirations;
+        totals->rejections += shard->admission_rejections;
+        totals->entry_count += shard->entry_count;
+        totals->bytes_used += shard->bytes;
+        totals->compressed_entries += shard->compressed_entries;
+        totals->compressed_raw += shard->compressed_raw_bytes;
+        totals->compressed_stored += shard->compressed_stored_bytes;
+        if (shard->entry_count > totals->busiest_shard) {
+            totals->busiest_shard = shard->entry_count;
+        }
+        pthread_rwlock_unlock(&shard->rwlock);
+    }
 
-    ANBS_DEBUG_LOG("Cache cleared");
+    disk_tier_t *disk = &g_cache->disk;
+    pthread_mutex_lock(&disk->mutex);
+    totals->disk_entries = disk->index.entries;
+    totals->disk_bytes = disk->map_size;
+    totals->disk_hits = disk->hits;
+    pthread_mutex_unlock(&disk->mutex);
 }
 
-/* Get cache statistics */
+/* Get cache statistics, aggregated over all shards */
 int anbs_cache_get_stats(char **stats_json) {
     if (!g_cache || !stats_json) {
         return -1;
     }
 
-    pthread_rwlock_rdlock(&g_cache->rwlock);
+    cache_totals_t totals;
+    cache_collect_totals(&totals);
 
-    double hit_rate = g_cache->total_requests > 0 ?
-                     (double)g_cache->cache_hits / g_cache->total_requests * 100.0 : 0.0;
+    double hit_rate = totals.total_requests > 0 ?
+                     (double)totals.cache_hits / totals.total_requests * 100.0 : 0.0;
 
-    char *stats = malloc(1024);
+    char *stats = malloc(2048);
     if (!stats) {
-        pthread_rwlock_unlock(&g_cache->rwlock);
         return -1;
     }
 
-    snprintf(stats, 1024,
+    pthread_mutex_lock(&g_cache->semantic_mutex);
+
+    snprintf(stats, 2048,
              "{"
              "\"total_requests\": %lu,"
              "\"cache_hits\": %lu,"
@@ -397,21 +2036,106 @@ int anbs_cache_get_stats(char **stats_json) {
              "\"hit_rate_percent\": %.2f,"
              "\"entry_count\": %d,"
              "\"max_entries\": %d,"
+             "\"shards\": %d,"
+             "\"busiest_shard_entries\": %d,"
              "\"evictions\": %lu,"
-             "\"memory_usage_estimate_kb\": %d"
+             "\"expirations\": %lu,"
+             "\"coalesced_requests\": %lu,"
+             "\"stale_served\": %lu,"
+             "\"eviction_policy\": \"%s\","
+             "\"admission\": \"%s\","
+             "\"admission_rejections\": %lu,"
+             "\"semantic_entries\": %d,"
+             "\"semantic_lookups\": %lu,"
+             "\"semantic_hits\": %lu,"
+             "\"disk_entries\": %d,"
+             "\"disk_bytes\": %zu,"
+             "\"disk_hits\": %lu,"
+             "\"shared_cache\": %s,"
+             "\"shared_hits\": %lu,"
+             "\"bytes_used\": %zu,"
+             "\"max_bytes\": %zu,"
+             "\"compression\": \"%s\","
+             "\"compressed_entries\": %d,"
+             "\"compression_ratio\": %.2f,"
+             "\"memory_usage_estimate_kb\": %zu"
              "}",
-             g_cache->total_requests,
-             g_cache->cache_hits,
-             g_cache->cache_misses,
+             totals.total_requests,
+             totals.cache_hits,
+             totals.cache_misses,
              hit_rate,
-             g_cache->entry_count,
+             totals.entry_count,
              g_cache->max_entries,
-             g_cache->evictions,
-             g_cache->entry_count * (sizeof(cache_entry_t) + MAX_RESPONSE_SIZE / 2) / 1024);
+             CACHE_SHARDS,
+             totals.busiest_shard,
+             totals.evictions,
+             totals.expirations,
+             g_cache->coalesced,
+             g_cache->stale_served,
+             g_cache->policy == CACHE_POLICY_SIEVE ? "sieve" : "lru",
+             g_cache->tinylfu ? "tinylfu" : "always",
+             totals.rejections,
+             g_cache->semantic_count,
+             g_cache->semantic_lookups,
+             g_cache->semantic_hits,
+             totals.disk_entries,
+             totals.disk_bytes,
+             totals.disk_hits,
+             g_cache->shm.segment ? "true" : "false",
+             g_cache->shm.hits,
+             totals.bytes_used,
+             g_cache->max_bytes,
+#if defined (CACHE_CODEC)
+             CACHE_CODEC,
+#else
+             "none",
+#endif
+             totals.compressed_entries,
+             totals.compressed_stored > 0 ? (double)totals.compressed_raw / totals.compressed_stored : 1.0,
+             totals.bytes_used / 1024);
+
+    pthread_mutex_unlock(&g_cache->semantic_mutex);
 
     *stats_json = stats;
+    return 0;
+}
+
+/* Write the cache's OpenMetrics families to OUT */
+int anbs_cache_export_metrics(FILE *out) {
+    cache_totals_t totals;
+
+    if (!g_cache || !out) {
+        return -1;
+    }
 
-    pthread_rwlock_unlock(&g_cache->rwlock);
+    cache_collect_totals(&totals);
+
+    anbs_metrics_export_family(out, "anbs_cache_lookups", "counter", "Response cache lookups by result");
+    anbs_metrics_export_sample(out, "anbs_cache_lookups_total", "result=\"hit\"", (double)totals.cache_hits);
+    anbs_metrics_export_sample(out, "anbs_cache_lookups_total", "result=\"miss\"", (double)totals.cache_misses);
+    anbs_metrics_export_sample(out, "anbs_cache_lookups_total", "result=\"disk_hit\"", (double)totals.disk_hits);
+    pthread_mutex_lock(&g_cache->semantic_mutex);
+    anbs_metrics_export_sample(out, "anbs_cache_lookups_total", "result=\"semantic_hit\"",
+                               (double)g_cache->semantic_hits);
+    anbs_metrics_export_sample(out, "anbs_cache_lookups_total", "result=\"shared_hit\"",
+                               (double)g_cache->shm.hits);
+    anbs_metrics_export_sample(out, "anbs_cache_lookups_total", "result=\"stale\"",
+                               (double)g_cache->stale_served);
+    anbs_metrics_export_sample(out, "anbs_cache_lookups_total", "result=\"coalesced\"",
+                               (double)g_cache->coalesced);
+    pthread_mutex_unlock(&g_cache->semantic_mutex);
+
+    anbs_metrics_export_family(out, "anbs_cache_removals", "counter", "Entries the cache dropped, by cause");
+    anbs_metrics_export_sample(out, "anbs_cache_removals_total", "cause=\"eviction\"", (double)totals.evictions);
+    anbs_metrics_export_sample(out, "anbs_cache_removals_total", "cause=\"expiration\"", (double)totals.expirations);
+    anbs_metrics_export_sample(out, "anbs_cache_removals_total", "cause=\"admission\"", (double)totals.rejections);
+
+    anbs_metrics_export_family(out, "anbs_cache_entries", "gauge", "Entries held, by tier");
+    anbs_metrics_export_sample(out, "anbs_cache_entries", "tier=\"memory\"", totals.entry_count);
+    anbs_metrics_export_sample(out, "anbs_cache_entries", "tier=\"disk\"", totals.disk_entries);
+    anbs_metrics_export_family(out, "anbs_cache_bytes", "gauge", "Bytes held, by tier");
+    anbs_metrics_export_sample(out, "anbs_cache_bytes", "tier=\"memory\"", (double)totals.bytes_used);
+    anbs_metrics_export_sample(out, "anbs_cache_bytes", "tier=\"disk\"", (double)totals.disk_bytes);
     return 0;
 }
 
@@ -424,29 +2148,15 @@ int anbs_cache_cleanup_expired(void) {
     time_t now = time(NULL);
     int removed_count = 0;
 
-    pthread_rwlock_wrlock(&g_cache->rwlock);
-
-    for (int i = 0; i < HASH_BUCKETS; i++) {
-        cache_entry_t **current = &g_cache->buckets[i];
-        while (*current) {
-            if ((*current)->expires_at < now) {
-                cache_entry_t *to_remove = *current;
-                *current = to_remove->next;
-
-                remove_from_lru(to_remove);
-                free(to_remove->response);
-                free(to_remove);
+    /* One shard at a time, touching only the wheel slots that came due */
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &g_cache->shards[s];
 
-                g_cache->entry_count--;
-                removed_count++;
-            } else {
-                current = &(*current)->next;
-            }
-        }
+        pthread_rwlock_wrlock(&shard->rwlock);
+        removed_count += wheel_advance(shard, now);
+        pthread_rwlock_unlock(&shard->rwlock);
     }
 
-    pthread_rwlock_unlock(&g_cache->rwlock);
-
     if (removed_count > 0) {
         ANBS_DEBUG_LOG("Cleaned up %d expired cache entries", removed_count);
     }
@@ -508,8 +2218,33 @@ void anbs_cache_cleanup(void) {
         return;
     }
 
-    anbs_cache_clear();
-    pthread_rwlock_destroy(&g_cache->rwlock);
+    if (g_tick_running) {
+        __atomic_store_n(&g_tick_running, 0, __ATOMIC_RELEASE);
+        pthread_join(g_tick_thread, NULL);
+    }
+
+    cache_clear_memory();
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_destroy(&g_cache->shards[i].rwlock);
+    }
+    pthread_mutex_destroy(&g_cache->semantic_mutex);
+
+    /* The shared segment outlives us for the other sessions */
+    if (g_cache->shm.segment) {
+        munmap(g_cache->shm.segment, sizeof(shm_segment_t));
+    }
+
+    /* The segment stays on disk for the next shell */
+    pthread_mutex_lock(&g_cache->disk.mutex);
+    disk_close(&g_cache->disk);
+    free(g_cache->disk.path);
+    pthread_mutex_unlock(&g_cache->disk.mutex);
+    pthread_mutex_destroy(&g_cache->disk.mutex);
+
+    if (g_cache->flight_fd >= 0) {
+        close(g_cache->flight_fd);
+    }
+    pthread_mutex_destroy(&g_cache->flight_mutex);
     free(g_cache);
     g_cache = NULL;
 
@@ -4,14 +4,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
-#define MAX_METRICS 1000
 #define MAX_COMMAND_TYPES 50
-#define METRIC_HISTORY_SIZE 100
+#define METRIC_SERIES_INITIAL 4     /* series slots a family starts with */
+#define METRIC_CONTEXT_SLOTS 1024   /* distinct contexts interned; a power of 2 */
+#define METRIC_SHARDS 64            /* per-thread shards of a series; more threads share */
+#define METRIC_UNITS 1000.0         /* histograms count thousandths of the metric's unit */
+#define METRIC_SUB_BITS 5
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BITS)  /* buckets per power of 2 */
+#define METRIC_UNIT_BITS 48         /* histograms cover values up to 2^48 units */
+#define METRIC_OCTAVES (METRIC_UNIT_BITS - METRIC_SUB_BITS + 1)
+#define METRIC_MAX_UNITS ((UINT64_C(1) << METRIC_UNIT_BITS) - 1)
+#define METRIC_MIN_SAMPLES 10       /* percentiles need this many samples */
+#define METRIC_SLICES 10            /* the sliding window moves a tenth at a time */
+#define METRIC_WINDOW_DEFAULT 60    /* seconds of samples windowed percentiles see */
+#define METRIC_SLICE_CLAIMED UINT64_MAX  /* epoch of a slice being cleared */
+#define METRIC_EXPORT_INTERVAL 15   /* seconds between rewrites of the export file */
+#define METRIC_SLO_MAX 16           /* latency objectives, defaults and ANBS_SLO's */
+#define METRIC_SLO_OBJECTIVE 99.0   /* default percent of samples within target */
+#define METRIC_SLO_STATUS_NS 1000000000ULL  /* status line refreshes at most this often */
 
 typedef enum {
     METRIC_RESPONSE_TIME = 1,
@@ -21,60 +42,198 @@ typedef enum {
     METRIC_NETWORK_LATENCY,
     METRIC_ERROR_RATE,
     METRIC_THROUGHPUT,
-    METRIC_QUEUE_DEPTH
+    METRIC_QUEUE_DEPTH,
+    METRIC_OPTIMIZATION_COST,
+    METRIC_SLO_LATENCY,
+    METRIC_TYPE_COUNT
 } metric_type_t;
 
+typedef enum {
+    METRIC_ALERT_NONE = 0,
+    METRIC_ALERT_ABOVE,         /* alert while values exceed the threshold */
+    METRIC_ALERT_BELOW          /* alert while values fall under it */
+} metric_alert_t;
+
+/* Counters and log-linear histogram of a run of samples.  Only atomic
+   adds and stores touch one, so the threads that share a shard, and
+   readers, need no lock.  Each OCTAVES entry holds the buckets of one
+   power of 2 and is allocated the first time a value lands in it. */
 typedef struct {
-    double value;
-    time_t timestamp;
-    char context[128];
-} metric_sample_t;
+    uint64_t count;
+    uint64_t sum;               /* in METRIC_UNITS */
+    uint64_t min;               /* UINT64_MAX until the first value */
+    uint64_t max;
+    uint64_t *octaves[METRIC_OCTAVES];
+} metric_hist_t;
+
+/* The samples of one tick of the sliding window */
+typedef struct {
+    uint64_t epoch;             /* the tick's number; 0 while unused */
+    metric_hist_t hist;
+} metric_slice_t;
 
+/* One thread's share of a series */
 typedef struct {
-    char command_type[64];
-    metric_sample_t samples[METRIC_HISTORY_SIZE];
-    int sample_count;
-    int sample_index;
-    double min_value;
-    double max_value;
-    double avg_value;
-    double p95_value;
-    double p99_value;
-    uint64_t total_samples;
+    metric_hist_t total;        /* every sample since the last reset */
+    metric_slice_t slices[METRIC_SLICES];  /* the window's ticks, a ring */
+    uint64_t last;              /* latest value, as the bits of a double */
+    uint64_t last_ns;           /* coarse monotonic time of LAST */
+    uint32_t last_context;
+} metric_shard_t;
+
+struct performance_metric;
+
+/* A series: one command type within a family.  Handles returned by
+   anbs_metrics_handle() point at these and stay valid until
+   anbs_metrics_cleanup(). */
+typedef struct command_metrics {
+    char *command_type;
+    struct performance_metric *family;
+    metric_shard_t *shards[METRIC_SHARDS];  /* each allocated on its thread's first sample */
 } command_metrics_t;
 
-typedef struct {
+typedef struct performance_metric {
     metric_type_t type;
-    char name[64];
-    char description[256];
-    command_metrics_t command_metrics[MAX_COMMAND_TYPES];
+    const char *name;
+    const char *description;
+    command_metrics_t **command_metrics;  /* each allocated on its first sample */
     int command_count;
-    metric_sample_t global_samples[METRIC_HISTORY_SIZE];
-    int global_sample_count;
-    int global_sample_index;
+    int command_capacity;
     double target_value;
     double alert_threshold;
+    metric_alert_t alert;
     bool alert_active;
 } performance_metric_t;
 
+/* A metric family the registry knows how to create */
+typedef struct {
+    metric_type_t type;
+    const char *name;
+    const char *description;
+    double target_value;
+    double alert_threshold;
+    metric_alert_t alert;
+} metric_definition_t;
+
+/* Shards of one or more series merged for reading.  Snapshots of any
+   series, window or process add up with anbs_metrics_snapshot_merge(). */
+typedef struct metric_snapshot {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    double last;
+    uint64_t last_ns;
+    uint64_t buckets[METRIC_OCTAVES][METRIC_SUB_BUCKETS];
+} metric_snapshot_t;
+
+/* A latency objective: OBJECTIVE percent of a command class's samples
+   should take at most TARGET_MS.  The samples go to the class's series
+   of the slo_latency_ms family; TOTAL and VIOLATIONS count them exactly
+   since the last reset. */
+typedef struct {
+    char name[32];
+    double target_ms;
+    double objective;
+    command_metrics_t *series;
+    uint64_t total;
+    uint64_t violations;
+    bool burning;               /* the window is spending budget too fast */
+} metric_slo_t;
+
 typedef struct {
-    performance_metric_t metrics[MAX_METRICS];
+    /* Families by type, allocated on their first sample */
+    performance_metric_t *metrics[METRIC_TYPE_COUNT];
     int metric_count;
+
+    /* Interned sample contexts: id N is contexts[N - 1]; SLOTS is an open
+       addressing table of ids */
+    char *contexts[METRIC_CONTEXT_SLOTS];
+    uint32_t context_slots[METRIC_CONTEXT_SLOTS * 2];
+    int context_count;
+
+    /* Guards the registry: families, series arrays and contexts.  Samples
+       themselves are recorded without it. */
     pthread_mutex_t mutex;
     time_t start_time;
+    int window_seconds;
+    uint64_t slice_ns;              /* length of a window tick */
     uint64_t total_commands;
     uint64_t failed_commands;
-    double total_response_time;
+    uint64_t total_response_time;   /* in METRIC_UNITS */
     bool monitoring_enabled;
+
+    /* OpenMetrics textfile exporter, when ANBS_METRICS_EXPORT is set;
+       EXPORTING and EXPORT_WAKE are used under the mutex */
+    char *export_path;
+    int export_interval;
+    pid_t export_pid;
+    bool exporting;
+    pthread_t export_thread;
+    pthread_cond_t export_wake;
+
+    /* Chrome trace-event file, when ANBS_TRACE is set */
+    FILE *trace;
+    pthread_mutex_t trace_mutex;
+
+    /* Latency objectives, fixed at initialization */
+    metric_slo_t slos[METRIC_SLO_MAX];
+    int slo_count;
+    uint64_t slo_status_ns;         /* when the status line last showed them */
+    bool slo_shown;                 /* the status line shows a burning budget */
 } metrics_system_t;
 
 static metrics_system_t *g_metrics = NULL;
+static __thread int t_metric_shard = -1;    /* this thread's shard slot */
+static unsigned int g_metric_shard_next;
+
+static const metric_definition_t metric_definitions[] = {
+    { METRIC_RESPONSE_TIME, "response_time_ms",
+      "AI command response time in milliseconds", 50.0, 100.0, METRIC_ALERT_ABOVE },
+    { METRIC_CACHE_HIT_RATE, "cache_hit_rate",
+      "Response cache hit rate percentage", 80.0, 50.0, METRIC_ALERT_BELOW },
+    { METRIC_MEMORY_USAGE, "memory_usage_mb",
+      "Memory usage in megabytes", 512.0, 1024.0, METRIC_ALERT_ABOVE },
+    { METRIC_CPU_USAGE, "cpu_usage_percent",
+      "CPU usage percentage", 50.0, 80.0, METRIC_ALERT_ABOVE },
+    { METRIC_ERROR_RATE, "error_rate_percent",
+      "Command error rate percentage", 1.0, 5.0, METRIC_ALERT_ABOVE },
+    { METRIC_THROUGHPUT, "throughput_cmd_per_sec",
+      "Commands processed per second", 10.0, 2.0, METRIC_ALERT_BELOW },
+    /* What an operation cost with and without each optimization */
+    { METRIC_OPTIMIZATION_COST, "optimization_cost_ms",
+      "Measured cost of optimized and unoptimized operations", 0.0, 0.0, METRIC_ALERT_NONE },
+    /* Latency of each command class with an objective; see metric_slos */
+    { METRIC_SLO_LATENCY, "slo_latency_ms",
+      "Latency of command classes with an objective, in milliseconds", 0.0, 0.0, METRIC_ALERT_NONE },
+};
+
+/* Default latency objectives; ANBS_SLO overrides them and adds more */
+static const struct {
+    const char *name;
+    double target_ms;
+} metric_slos[] = {
+    { "vertex.cached", 10.0 },      /* @vertex answered from the cache */
+    { "vertex.uncached", 2000.0 },  /* @vertex answered by the provider */
+    { "memory", 2000.0 },
+    { "analyze", 10000.0 },         /* per request; large files take several */
+    { "prompt", 20.0 },             /* decoding PS1 and PS2 */
+    { "completion", 100.0 },        /* one press of TAB */
+};
+
+#define METRIC_DEFINITIONS ((int)(sizeof(metric_definitions) / sizeof(metric_definitions[0])))
+
+static void metrics_export_start(void);
+static void metrics_trace_start(void);
+static void metrics_atfork_child(void);
+static void metrics_slo_configure(void);
 
 /* Initialize metrics system */
 int anbs_metrics_init(void) {
     if (g_metrics) {
         return 0; /* Already initialized */
     }
+    int startup_slot = anbs_startup_enter("ai_core", "metrics");
 
     g_metrics = calloc(1, sizeof(metrics_system_t));
     if (!g_metrics) {
@@ -85,213 +244,417 @@ int anbs_metrics_init(void) {
     g_metrics->start_time = time(NULL);
     g_metrics->monitoring_enabled = true;
 
+    /* Windowed percentiles see the last ANBS_METRICS_WINDOW seconds */
+    const char *window = getenv("ANBS_METRICS_WINDOW");
+    g_metrics->window_seconds = window && atoi(window) > 0 ? atoi(window) : METRIC_WINDOW_DEFAULT;
+    g_metrics->slice_ns = (uint64_t)g_metrics->window_seconds * 1000000000ULL / METRIC_SLICES;
+
     /* Initialize default metrics */
     anbs_metrics_create_default_metrics();
+    metrics_slo_configure();
+
+    metrics_export_start();
+    metrics_trace_start();
+
+    static int fork_hook_registered = 0;
+    if (!fork_hook_registered) {
+        pthread_atfork(NULL, NULL, metrics_atfork_child);
+        fork_hook_registered = 1;
+    }
 
     ANBS_DEBUG_LOG("Performance metrics system initialized");
+    anbs_startup_leave(startup_slot, -1);
     return 0;
 }
 
-/* Create default performance metrics */
+/* Create default performance metrics.  Families are described by
+   metric_definitions and allocated on their first sample, so this only
+   checks the table. */
 int anbs_metrics_create_default_metrics(void) {
     if (!g_metrics) {
         return -1;
     }
 
-    pthread_mutex_lock(&g_metrics->mutex);
+    for (int i = 0; i < METRIC_DEFINITIONS; i++) {
+        if (metric_definitions[i].type <= 0 || metric_definitions[i].type >= METRIC_TYPE_COUNT) {
+            return -1;
+        }
+    }
 
-    /* Response time metric */
-    performance_metric_t *response_time = &g_metrics->metrics[g_metrics->metric_count++];
-    response_time->type = METRIC_RESPONSE_TIME;
-    strcpy(response_time->name, "response_time_ms");
-    strcpy(response_time->description, "AI command response time in milliseconds");
-    response_time->target_value = 50.0;  /* Target: <50ms */
-    response_time->alert_threshold = 100.0;  /* Alert: >100ms */
-
-    /* Cache hit rate metric */
-    performance_metric_t *cache_hit = &g_metrics->metrics[g_metrics->metric_count++];
-    cache_hit->type = METRIC_CACHE_HIT_RATE;
-    strcpy(cache_hit->name, "cache_hit_rate");
-    strcpy(cache_hit->description, "Response cache hit rate percentage");
-    cache_hit->target_value = 80.0;  /* Target: >80% */
-    cache_hit->alert_threshold = 50.0;  /* Alert: <50% */
-
-    /* Memory usage metric */
-    performance_metric_t *memory = &g_metrics->metrics[g_metrics->metric_count++];
-    memory->type = METRIC_MEMORY_USAGE;
-    strcpy(memory->name, "memory_usage_mb");
-    strcpy(memory->description, "Memory usage in megabytes");
-    memory->target_value = 512.0;  /* Target: <512MB */
-    memory->alert_threshold = 1024.0;  /* Alert: >1GB */
-
-    /* CPU usage metric */
-    performance_metric_t *cpu = &g_metrics->metrics[g_metrics->metric_count++];
-    cpu->type = METRIC_CPU_USAGE;
-    strcpy(cpu->name, "cpu_usage_percent");
-    strcpy(cpu->description, "CPU usage percentage");
-    cpu->target_value = 50.0;  /* Target: <50% */
-    cpu->alert_threshold = 80.0;  /* Alert: >80% */
-
-    /* Error rate metric */
-    performance_metric_t *error_rate = &g_metrics->metrics[g_metrics->metric_count++];
-    error_rate->type = METRIC_ERROR_RATE;
-    strcpy(error_rate->name, "error_rate_percent");
-    strcpy(error_rate->description, "Command error rate percentage");
-    error_rate->target_value = 1.0;  /* Target: <1% */
-    error_rate->alert_threshold = 5.0;  /* Alert: >5% */
-
-    /* Throughput metric */
-    performance_metric_t *throughput = &g_metrics->metrics[g_metrics->metric_count++];
-    throughput->type = METRIC_THROUGHPUT;
-    strcpy(throughput->name, "throughput_cmd_per_sec");
-    strcpy(throughput->description, "Commands processed per second");
-    throughput->target_value = 10.0;  /* Target: >10 cmd/s */
-    throughput->alert_threshold = 2.0;  /* Alert: <2 cmd/s */
+    ANBS_DEBUG_LOG("Registered %d default metrics", METRIC_DEFINITIONS);
+    return 0;
+}
 
-    pthread_mutex_unlock(&g_metrics->mutex);
+/* The family of TYPE, allocated from its definition when CREATE is set;
+   NULL for a type without one.  Called with the mutex held. */
+static performance_metric_t *metrics_family(metric_type_t type, bool create) {
+    performance_metric_t *metric;
 
-    ANBS_DEBUG_LOG("Created %d default metrics", g_metrics->metric_count);
-    return 0;
+    if (type <= 0 || type >= METRIC_TYPE_COUNT) {
+        return NULL;
+    }
+    if (g_metrics->metrics[type] || !create) {
+        return g_metrics->metrics[type];
+    }
+
+    for (int i = 0; i < METRIC_DEFINITIONS; i++) {
+        if (metric_definitions[i].type != type) {
+            continue;
+        }
+        metric = calloc(1, sizeof(performance_metric_t));
+        if (!metric) {
+            return NULL;
+        }
+        metric->type = type;
+        metric->name = metric_definitions[i].name;
+        metric->description = metric_definitions[i].description;
+        metric->target_value = metric_definitions[i].target_value;
+        metric->alert_threshold = metric_definitions[i].alert_threshold;
+        metric->alert = metric_definitions[i].alert;
+        g_metrics->metrics[type] = metric;
+        g_metrics->metric_count++;
+        return metric;
+    }
+
+    return NULL;
 }
 
-/* Record a metric sample */
-int anbs_metrics_record(metric_type_t type, const char *command_type, double value, const char *context) {
-    if (!g_metrics || !g_metrics->monitoring_enabled) {
-        return -1;
+/* The series of COMMAND_TYPE in METRIC, allocated when CREATE is set and
+   the family has room.  Called with the mutex held. */
+static command_metrics_t *metrics_series(performance_metric_t *metric, const char *command_type, bool create) {
+    command_metrics_t *cmd_metric, **grown;
+    int capacity;
+
+    for (int i = 0; i < metric->command_count; i++) {
+        if (strcmp(metric->command_metrics[i]->command_type, command_type) == 0) {
+            return metric->command_metrics[i];
+        }
+    }
+    if (!create || metric->command_count >= MAX_COMMAND_TYPES) {
+        return NULL;
     }
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
+    if (metric->command_count == metric->command_capacity) {
+        capacity = metric->command_capacity ? metric->command_capacity * 2 : METRIC_SERIES_INITIAL;
+        grown = realloc(metric->command_metrics, capacity * sizeof(command_metrics_t *));
+        if (!grown) {
+            return NULL;
+        }
+        metric->command_metrics = grown;
+        metric->command_capacity = capacity;
+    }
 
-    pthread_mutex_lock(&g_metrics->mutex);
+    cmd_metric = calloc(1, sizeof(command_metrics_t));
+    if (!cmd_metric) {
+        return NULL;
+    }
+    cmd_metric->command_type = strdup(command_type);
+    if (!cmd_metric->command_type) {
+        free(cmd_metric);
+        return NULL;
+    }
+    cmd_metric->family = metric;
+    metric->command_metrics[metric->command_count++] = cmd_metric;
+    return cmd_metric;
+}
+
+/* Id of CONTEXT in the intern table, adding it if there is room; 0 for
+   NULL, an empty string or a full table.  Called with the mutex held. */
+static uint32_t metrics_intern(const char *context) {
+    uint32_t hash = 2166136261u, slot, id;
+    const char *p;
+
+    if (!context || !*context) {
+        return 0;
+    }
+    for (p = context; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
 
-    /* Find metric */
-    performance_metric_t *metric = NULL;
-    for (int i = 0; i < g_metrics->metric_count; i++) {
-        if (g_metrics->metrics[i].type == type) {
-            metric = &g_metrics->metrics[i];
+    for (slot = hash & (METRIC_CONTEXT_SLOTS * 2 - 1); ; slot = (slot + 1) & (METRIC_CONTEXT_SLOTS * 2 - 1)) {
+        id = g_metrics->context_slots[slot];
+        if (id == 0) {
             break;
         }
+        if (strcmp(g_metrics->contexts[id - 1], context) == 0) {
+            return id;
+        }
     }
 
-    if (!metric) {
-        pthread_mutex_unlock(&g_metrics->mutex);
-        return -1;
+    if (g_metrics->context_count == METRIC_CONTEXT_SLOTS) {
+        return 0;
+    }
+    g_metrics->contexts[g_metrics->context_count] = strdup(context);
+    if (!g_metrics->contexts[g_metrics->context_count]) {
+        return 0;
     }
+    id = ++g_metrics->context_count;
+    g_metrics->context_slots[slot] = id;
+    return id;
+}
 
-    /* Record global sample */
-    metric_sample_t *global_sample = &metric->global_samples[metric->global_sample_index];
-    global_sample->value = value;
-    global_sample->timestamp = tv.tv_sec;
-    if (context) {
-        strncpy(global_sample->context, context, sizeof(global_sample->context) - 1);
-    } else {
-        global_sample->context[0] = '\0';
+/* VALUE in histogram units, clamped to the range the buckets cover */
+static uint64_t metrics_units(double value) {
+    if (!(value > 0.0)) {
+        return 0;
     }
+    if (value * METRIC_UNITS >= (double)METRIC_MAX_UNITS) {
+        return METRIC_MAX_UNITS;
+    }
+    return (uint64_t)(value * METRIC_UNITS + 0.5);
+}
 
-    metric->global_sample_index = (metric->global_sample_index + 1) % METRIC_HISTORY_SIZE;
-    if (metric->global_sample_count < METRIC_HISTORY_SIZE) {
-        metric->global_sample_count++;
+/* Octave and sub-bucket of UNITS.  Values under METRIC_SUB_BUCKETS are
+   counted exactly; above that each power of 2 is split into
+   METRIC_SUB_BUCKETS equal buckets, so a bucket's midpoint is within
+   1/64 of its values. */
+static void metrics_bucket_of(uint64_t units, int *octave, int *sub) {
+    int msb;
+
+    if (units < METRIC_SUB_BUCKETS) {
+        *octave = 0;
+        *sub = (int)units;
+        return;
     }
+    msb = 63 - __builtin_clzll(units);
+    *octave = msb - METRIC_SUB_BITS + 1;
+    *sub = (int)(units >> (*octave - 1)) - METRIC_SUB_BUCKETS;
+}
 
-    /* Record command-specific sample if command_type provided */
-    if (command_type) {
-        command_metrics_t *cmd_metric = NULL;
+/* Midpoint of bucket SUB of OCTAVE, in units */
+static double metrics_bucket_value(int octave, int sub) {
+    uint64_t width, lower;
 
-        /* Find existing command metric */
-        for (int i = 0; i < metric->command_count; i++) {
-            if (strcmp(metric->command_metrics[i].command_type, command_type) == 0) {
-                cmd_metric = &metric->command_metrics[i];
-                break;
-            }
-        }
+    if (octave == 0) {
+        return (double)sub;
+    }
+    width = UINT64_C(1) << (octave - 1);
+    lower = (uint64_t)(sub + METRIC_SUB_BUCKETS) << (octave - 1);
+    return (double)lower + (double)(width - 1) / 2.0;
+}
 
-        /* Create new command metric if not found */
-        if (!cmd_metric && metric->command_count < MAX_COMMAND_TYPES) {
-            cmd_metric = &metric->command_metrics[metric->command_count++];
-            strncpy(cmd_metric->command_type, command_type, sizeof(cmd_metric->command_type) - 1);
-            cmd_metric->min_value = value;
-            cmd_metric->max_value = value;
-            cmd_metric->avg_value = value;
-        }
+/* Exclusive upper bound of bucket SUB of OCTAVE, in units */
+static uint64_t metrics_bucket_limit(int octave, int sub) {
+    if (octave == 0) {
+        return (uint64_t)sub + 1;
+    }
+    return (uint64_t)(sub + METRIC_SUB_BUCKETS + 1) << (octave - 1);
+}
 
-        if (cmd_metric) {
-            metric_sample_t *cmd_sample = &cmd_metric->samples[cmd_metric->sample_index];
-            cmd_sample->value = value;
-            cmd_sample->timestamp = tv.tv_sec;
-            if (context) {
-                strncpy(cmd_sample->context, context, sizeof(cmd_sample->context) - 1);
-            } else {
-                cmd_sample->context[0] = '\0';
-            }
+/* Publish a zeroed block of SIZE bytes in *SLOT unless another thread got
+   there first; returns whichever block is there */
+static void *metrics_publish(void **slot, size_t size) {
+    void *block = __atomic_load_n(slot, __ATOMIC_ACQUIRE), *expected = NULL;
 
-            cmd_metric->sample_index = (cmd_metric->sample_index + 1) % METRIC_HISTORY_SIZE;
-            if (cmd_metric->sample_count < METRIC_HISTORY_SIZE) {
-                cmd_metric->sample_count++;
-            }
+    if (block) {
+        return block;
+    }
+    block = calloc(1, size);
+    if (!block) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(slot, &expected, block, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(block);
+        return expected;
+    }
+    return block;
+}
 
-            /* Update statistics */
-            cmd_metric->total_samples++;
-            if (value < cmd_metric->min_value) {
-                cmd_metric->min_value = value;
-            }
-            if (value > cmd_metric->max_value) {
-                cmd_metric->max_value = value;
-            }
+/* The calling thread's shard of SERIES */
+static metric_shard_t *metrics_shard(command_metrics_t *series) {
+    metric_shard_t *shard, *expected = NULL;
 
-            /* Recalculate average */
-            double sum = 0.0;
-            int count = cmd_metric->sample_count;
-            for (int i = 0; i < count; i++) {
-                sum += cmd_metric->samples[i].value;
-            }
-            cmd_metric->avg_value = sum / count;
+    if (t_metric_shard < 0) {
+        t_metric_shard = (int)(__atomic_fetch_add(&g_metric_shard_next, 1, __ATOMIC_RELAXED) % METRIC_SHARDS);
+    }
 
-            /* Calculate percentiles (simple sorting approach) */
-            if (count >= 10) {
-                double sorted_values[METRIC_HISTORY_SIZE];
-                for (int i = 0; i < count; i++) {
-                    sorted_values[i] = cmd_metric->samples[i].value;
-                }
+    shard = __atomic_load_n(&series->shards[t_metric_shard], __ATOMIC_ACQUIRE);
+    if (shard) {
+        return shard;
+    }
 
-                /* Simple bubble sort */
-                for (int i = 0; i < count - 1; i++) {
-                    for (int j = 0; j < count - 1 - i; j++) {
-                        if (sorted_values[j] > sorted_values[j + 1]) {
-                            double temp = sorted_values[j];
-                            sorted_values[j] = sorted_values[j + 1];
-                            sorted_values[j + 1] = temp;
-                        }
-                    }
-                }
+    shard = calloc(1, sizeof(metric_shard_t));
+    if (!shard) {
+        return NULL;
+    }
+    shard->total.min = UINT64_MAX;
+    for (int i = 0; i < METRIC_SLICES; i++) {
+        shard->slices[i].hist.min = UINT64_MAX;
+    }
+    if (!__atomic_compare_exchange_n(&series->shards[t_metric_shard], &expected, shard, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(shard);
+        return expected;
+    }
+    return shard;
+}
 
-                cmd_metric->p95_value = sorted_values[(int)(count * 0.95)];
-                cmd_metric->p99_value = sorted_values[(int)(count * 0.99)];
-            }
+/* Current coarse monotonic time in nanoseconds */
+static uint64_t metrics_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Number of the window tick NOW_NS falls in; never 0 */
+static uint64_t metrics_epoch(uint64_t now_ns) {
+    return now_ns / __atomic_load_n(&g_metrics->slice_ns, __ATOMIC_RELAXED) + 1;
+}
+
+/* Count UNITS, which falls in bucket SUB of OCTAVE, in HIST */
+static void metrics_hist_add(metric_hist_t *hist, uint64_t units, int octave, int sub) {
+    uint64_t *buckets, old;
+
+    buckets = metrics_publish((void **)&hist->octaves[octave], METRIC_SUB_BUCKETS * sizeof(uint64_t));
+    if (buckets) {
+        __atomic_add_fetch(&buckets[sub], 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&hist->sum, units, __ATOMIC_RELAXED);
+    old = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+    while (units < old && !__atomic_compare_exchange_n(&hist->min, &old, units, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    old = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (units > old && !__atomic_compare_exchange_n(&hist->max, &old, units, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELEASE);
+}
+
+/* Zero HIST, keeping its buckets allocated.  Samples added meanwhile may
+   survive it. */
+static void metrics_hist_clear(metric_hist_t *hist) {
+    __atomic_store_n(&hist->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->min, UINT64_MAX, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->max, 0, __ATOMIC_RELAXED);
+    for (int octave = 0; octave < METRIC_OCTAVES; octave++) {
+        uint64_t *buckets = __atomic_load_n(&hist->octaves[octave], __ATOMIC_ACQUIRE);
+        for (int sub = 0; buckets && sub < METRIC_SUB_BUCKETS; sub++) {
+            __atomic_store_n(&buckets[sub], 0, __ATOMIC_RELAXED);
         }
     }
+}
+
+/* The slice of SHARD for tick EPOCH, cleared first when it still holds
+   an older tick.  NULL while another thread is clearing it; that sample
+   then only counts towards the totals. */
+static metric_hist_t *metrics_slice(metric_shard_t *shard, uint64_t epoch) {
+    metric_slice_t *slice = &shard->slices[epoch % METRIC_SLICES];
+    uint64_t seen = __atomic_load_n(&slice->epoch, __ATOMIC_ACQUIRE);
+
+    if (seen == epoch) {
+        return &slice->hist;
+    }
+    if (seen == METRIC_SLICE_CLAIMED ||
+        !__atomic_compare_exchange_n(&slice->epoch, &seen, METRIC_SLICE_CLAIMED, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return seen == epoch ? &slice->hist : NULL;
+    }
+
+    /* Readers skip the slice until it is relabelled */
+    metrics_hist_clear(&slice->hist);
+    __atomic_store_n(&slice->epoch, epoch, __ATOMIC_RELEASE);
+    return &slice->hist;
+}
+
+/* Add VALUE to SERIES from the calling thread.  Costs a handful of
+   uncontended atomic adds unless VALUE is a new extreme, lands in an
+   untouched power of 2, starts a window tick or flips the family's
+   alert. */
+static void metrics_observe(command_metrics_t *series, double value, uint32_t context) {
+    performance_metric_t *metric = series->family;
+    metric_shard_t *shard;
+    metric_hist_t *slice;
+    uint64_t units, bits, now_ns;
+    int octave, sub;
+    bool should_alert;
+
+    shard = metrics_shard(series);
+    if (!shard) {
+        return;
+    }
+
+    units = metrics_units(value);
+    metrics_bucket_of(units, &octave, &sub);
+    now_ns = metrics_now_ns();
+    metrics_hist_add(&shard->total, units, octave, sub);
+    slice = metrics_slice(shard, metrics_epoch(now_ns));
+    if (slice) {
+        metrics_hist_add(slice, units, octave, sub);
+    }
+
+    memcpy(&bits, &value, sizeof(bits));
+    __atomic_store_n(&shard->last, bits, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->last_context, context, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->last_ns, now_ns, __ATOMIC_RELEASE);
 
     /* Check alert threshold */
-    bool should_alert = false;
-    if ((type == METRIC_RESPONSE_TIME || type == METRIC_MEMORY_USAGE ||
-         type == METRIC_CPU_USAGE || type == METRIC_ERROR_RATE) &&
-        value > metric->alert_threshold) {
-        should_alert = true;
-    } else if ((type == METRIC_CACHE_HIT_RATE || type == METRIC_THROUGHPUT) &&
-               value < metric->alert_threshold) {
-        should_alert = true;
+    should_alert = (metric->alert == METRIC_ALERT_ABOVE && value > metric->alert_threshold) ||
+                   (metric->alert == METRIC_ALERT_BELOW && value < metric->alert_threshold);
+    if (should_alert != __atomic_load_n(&metric->alert_active, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&metric->alert_active, should_alert, __ATOMIC_RELAXED) != should_alert) {
+        if (should_alert) {
+            ANBS_DEBUG_LOG("PERFORMANCE ALERT: %s = %.2f (threshold: %.2f)",
+                           metric->name, value, metric->alert_threshold);
+        } else {
+            ANBS_DEBUG_LOG("Performance alert cleared: %s = %.2f", metric->name, value);
+        }
+    }
+}
+
+/* Handle for recording COMMAND_TYPE (NULL for none) under the metric of
+   TYPE with anbs_metrics_observe(), creating the series if needed.  Look
+   handles up once, e.g. at startup; recording through one takes no lock.
+   Returns NULL for an unknown type or a family with no room. */
+command_metrics_t *anbs_metrics_handle(metric_type_t type, const char *command_type) {
+    performance_metric_t *metric;
+    command_metrics_t *series = NULL;
+
+    if (!g_metrics) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_metrics->mutex);
+    metric = metrics_family(type, true);
+    if (metric) {
+        series = metrics_series(metric, command_type ? command_type : "", true);
+    }
+    pthread_mutex_unlock(&g_metrics->mutex);
+
+    return series;
+}
+
+/* Record VALUE through HANDLE */
+void anbs_metrics_observe(command_metrics_t *handle, double value) {
+    if (handle && g_metrics && __atomic_load_n(&g_metrics->monitoring_enabled, __ATOMIC_RELAXED)) {
+        metrics_observe(handle, value, 0);
     }
+}
+
+/* Record a metric sample.  Looks the series up by name on every call;
+   hot paths should hold a handle instead. */
+int anbs_metrics_record(metric_type_t type, const char *command_type, double value, const char *context) {
+    performance_metric_t *metric;
+    command_metrics_t *series = NULL;
+    uint32_t context_id = 0;
 
-    if (should_alert && !metric->alert_active) {
-        metric->alert_active = true;
-        ANBS_DEBUG_LOG("PERFORMANCE ALERT: %s = %.2f (threshold: %.2f)",
-                       metric->name, value, metric->alert_threshold);
-    } else if (!should_alert && metric->alert_active) {
-        metric->alert_active = false;
-        ANBS_DEBUG_LOG("Performance alert cleared: %s = %.2f", metric->name, value);
+    if (!g_metrics || !__atomic_load_n(&g_metrics->monitoring_enabled, __ATOMIC_RELAXED)) {
+        return -1;
     }
 
+    pthread_mutex_lock(&g_metrics->mutex);
+    metric = metrics_family(type, true);
+    if (metric) {
+        series = metrics_series(metric, command_type ? command_type : "", true);
+        context_id = metrics_intern(context);
+    }
     pthread_mutex_unlock(&g_metrics->mutex);
+
+    if (!series) {
+        return -1;
+    }
+    metrics_observe(series, value, context_id);
     return 0;
 }
 
@@ -327,21 +690,35 @@ int anbs_metrics_collect_system_stats(void) {
     }
 
     /* Calculate error rate */
-    if (g_metrics->total_commands > 0) {
-        double error_rate = (double)g_metrics->failed_commands / g_metrics->total_commands * 100.0;
+    uint64_t total_commands = __atomic_load_n(&g_metrics->total_commands, __ATOMIC_RELAXED);
+    if (total_commands > 0) {
+        double error_rate = (double)__atomic_load_n(&g_metrics->failed_commands, __ATOMIC_RELAXED) /
+                            total_commands * 100.0;
         anbs_metrics_record(METRIC_ERROR_RATE, "system", error_rate, "calculated");
     }
 
     /* Calculate throughput */
     time_t uptime = time(NULL) - g_metrics->start_time;
     if (uptime > 0) {
-        double throughput = (double)g_metrics->total_commands / uptime;
+        double throughput = (double)total_commands / uptime;
         anbs_metrics_record(METRIC_THROUGHPUT, "system", throughput, "calculated");
     }
 
     return 0;
 }
 
+/* Record one AI request latency under COMMAND_TYPE */
+int anbs_metrics_record_response_time(const char *command_type, double elapsed_ms, const char *context) {
+    if (!g_metrics) {
+        return -1;
+    }
+
+    __atomic_add_fetch(&g_metrics->total_commands, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_metrics->total_response_time, metrics_units(elapsed_ms), __ATOMIC_RELAXED);
+
+    return anbs_metrics_record(METRIC_RESPONSE_TIME, command_type, elapsed_ms, context);
+}
+
 /* Start performance measurement */
 struct timeval *anbs_metrics_start_timer(void) {
     struct timeval *start_time = malloc(sizeof(struct timeval));
@@ -366,50 +743,287 @@ double anbs_metrics_end_timer(struct timeval *start_time, const char *command_ty
     free(start_time);
 
     if (g_metrics) {
-        pthread_mutex_lock(&g_metrics->mutex);
-        g_metrics->total_commands++;
-        g_metrics->total_response_time += elapsed_ms;
-        pthread_mutex_unlock(&g_metrics->mutex);
-
-        anbs_metrics_record(METRIC_RESPONSE_TIME, command_type, elapsed_ms, context);
+        anbs_metrics_record_response_time(command_type, elapsed_ms, context);
     }
 
     return elapsed_ms;
 }
 
+/* Fold HIST into SNAPSHOT.  Writers may be adding meanwhile; each
+   counter is read once, so the snapshot is at worst a few samples
+   behind. */
+static void metrics_hist_merge(const metric_hist_t *hist, metric_snapshot_t *snapshot) {
+    uint64_t count, value;
+
+    if ((count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE)) == 0) {
+        return;
+    }
+    snapshot->count += count;
+    snapshot->sum += __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+    value = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+    if (value < snapshot->min) snapshot->min = value;
+    value = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    if (value > snapshot->max) snapshot->max = value;
+
+    for (int octave = 0; octave < METRIC_OCTAVES; octave++) {
+        uint64_t *buckets = __atomic_load_n(&hist->octaves[octave], __ATOMIC_ACQUIRE);
+        if (!buckets) {
+            continue;
+        }
+        for (int sub = 0; sub < METRIC_SUB_BUCKETS; sub++) {
+            snapshot->buckets[octave][sub] += __atomic_load_n(&buckets[sub], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Fold every shard of SERIES into SNAPSHOT, which starts zeroed with MIN
+   at UINT64_MAX: all samples since the last reset, or with WINDOW set
+   only those of the sliding window's ticks. */
+static void metrics_merge(const command_metrics_t *series, metric_snapshot_t *snapshot, bool window) {
+    uint64_t current = window ? metrics_epoch(metrics_now_ns()) : 0;
+
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        metric_shard_t *shard = __atomic_load_n(&series->shards[i], __ATOMIC_ACQUIRE);
+        uint64_t value, last_ns;
+
+        if (!shard) {
+            continue;
+        }
+        if (!window) {
+            metrics_hist_merge(&shard->total, snapshot);
+        }
+        for (int j = 0; window && j < METRIC_SLICES; j++) {
+            uint64_t epoch = __atomic_load_n(&shard->slices[j].epoch, __ATOMIC_ACQUIRE);
+            if (epoch != 0 && epoch <= current && epoch + METRIC_SLICES > current) {
+                metrics_hist_merge(&shard->slices[j].hist, snapshot);
+            }
+        }
+
+        last_ns = __atomic_load_n(&shard->last_ns, __ATOMIC_ACQUIRE);
+        if (last_ns != 0 && last_ns >= snapshot->last_ns) {
+            value = __atomic_load_n(&shard->last, __ATOMIC_RELAXED);
+            memcpy(&snapshot->last, &value, sizeof(value));
+            snapshot->last_ns = last_ns;
+        }
+    }
+}
+
+/* A zeroed snapshot ready for metrics_merge(), or NULL */
+static metric_snapshot_t *metrics_snapshot_new(void) {
+    metric_snapshot_t *snapshot = calloc(1, sizeof(metric_snapshot_t));
+
+    if (snapshot) {
+        snapshot->min = UINT64_MAX;
+    }
+    return snapshot;
+}
+
+/* Snapshot of COMMAND_TYPE under the metric of TYPE, or of all of the
+   metric's series when COMMAND_TYPE is NULL: every sample since the last
+   reset, or with WINDOW set those of the last ANBS_METRICS_WINDOW
+   seconds.  An unknown series gives an empty snapshot.  Free it with
+   anbs_metrics_snapshot_free(); NULL on failure. */
+metric_snapshot_t *anbs_metrics_snapshot(metric_type_t type, const char *command_type, bool window) {
+    metric_snapshot_t *snapshot;
+    performance_metric_t *metric;
+
+    if (!g_metrics || (snapshot = metrics_snapshot_new()) == NULL) {
+        return NULL;
+    }
+
+    /* The mutex keeps the family's series array in place; merging
+       itself only reads counters */
+    pthread_mutex_lock(&g_metrics->mutex);
+    metric = metrics_family(type, false);
+    for (int i = 0; metric && i < metric->command_count; i++) {
+        if (!command_type || strcmp(metric->command_metrics[i]->command_type, command_type) == 0) {
+            metrics_merge(metric->command_metrics[i], snapshot, window);
+        }
+    }
+    pthread_mutex_unlock(&g_metrics->mutex);
+
+    return snapshot;
+}
+
+/* Add the samples of FROM to INTO */
+int anbs_metrics_snapshot_merge(metric_snapshot_t *into, const metric_snapshot_t *from) {
+    if (!into || !from) {
+        return -1;
+    }
+
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->min < into->min) into->min = from->min;
+    if (from->max > into->max) into->max = from->max;
+    if (from->last_ns >= into->last_ns && from->count > 0) {
+        into->last = from->last;
+        into->last_ns = from->last_ns;
+    }
+    for (int octave = 0; octave < METRIC_OCTAVES; octave++) {
+        for (int sub = 0; sub < METRIC_SUB_BUCKETS; sub++) {
+            into->buckets[octave][sub] += from->buckets[octave][sub];
+        }
+    }
+    return 0;
+}
+
+/* Number of samples in SNAPSHOT */
+uint64_t anbs_metrics_snapshot_count(const metric_snapshot_t *snapshot) {
+    return snapshot ? snapshot->count : 0;
+}
+
+/* Percentile (0-100) of SNAPSHOT in the metric's unit, or -1 with fewer
+   than METRIC_MIN_SAMPLES samples */
+double anbs_metrics_snapshot_percentile(const metric_snapshot_t *snapshot, double percentile) {
+    uint64_t total = 0, rank, seen = 0;
+    double value;
+
+    if (!snapshot) {
+        return -1.0;
+    }
+    for (int octave = 0; octave < METRIC_OCTAVES; octave++) {
+        for (int sub = 0; sub < METRIC_SUB_BUCKETS; sub++) {
+            total += snapshot->buckets[octave][sub];
+        }
+    }
+    if (total < METRIC_MIN_SAMPLES) {
+        return -1.0;
+    }
+
+    rank = (uint64_t)(total * percentile / 100.0);
+    if (rank >= total) {
+        rank = total - 1;
+    }
+
+    for (int octave = 0; octave < METRIC_OCTAVES; octave++) {
+        for (int sub = 0; sub < METRIC_SUB_BUCKETS; sub++) {
+            seen += snapshot->buckets[octave][sub];
+            if (seen > rank) {
+                /* The extremes are known exactly */
+                value = metrics_bucket_value(octave, sub);
+                if (value < (double)snapshot->min) value = (double)snapshot->min;
+                if (value > (double)snapshot->max) value = (double)snapshot->max;
+                return value / METRIC_UNITS;
+            }
+        }
+    }
+    return (double)snapshot->max / METRIC_UNITS;
+}
+
+/* Free a snapshot from anbs_metrics_snapshot() */
+void anbs_metrics_snapshot_free(metric_snapshot_t *snapshot) {
+    free(snapshot);
+}
+
+/* Percentile (0-100) of COMMAND_TYPE under the metric of TYPE, over the
+   window or every sample; *TOTAL receives how many samples that covers.
+   Returns -1 when there is no metric or fewer than METRIC_MIN_SAMPLES
+   samples. */
+static double metrics_percentile(metric_type_t type, const char *command_type, double percentile,
+                                 bool window, uint64_t *total) {
+    metric_snapshot_t *snapshot;
+    double result = -1.0;
+
+    if (total) {
+        *total = 0;
+    }
+    if (!g_metrics || !command_type) {
+        return -1.0;
+    }
+
+    pthread_mutex_lock(&g_metrics->mutex);
+    performance_metric_t *metric = metrics_family(type, false);
+    command_metrics_t *cmd_metric = metric ? metrics_series(metric, command_type, false) : NULL;
+    pthread_mutex_unlock(&g_metrics->mutex);
+
+    /* Series are never freed before cleanup, so reading needs no lock */
+    if (cmd_metric && (snapshot = metrics_snapshot_new()) != NULL) {
+        metrics_merge(cmd_metric, snapshot, window);
+        result = anbs_metrics_snapshot_percentile(snapshot, percentile);
+        if (total) {
+            *total = snapshot->count;
+        }
+        free(snapshot);
+    }
+
+    return result;
+}
+
+/* Response-time percentile (0-100) of COMMAND_TYPE over the sliding
+   window, or over every sample while the window holds fewer than 10.
+   Returns -1 when there is no metric or fewer than 10 samples. */
+double anbs_metrics_get_response_percentile(const char *command_type, double percentile) {
+    double result = metrics_percentile(METRIC_RESPONSE_TIME, command_type, percentile, true, NULL);
+
+    if (result < 0.0) {
+        result = metrics_percentile(METRIC_RESPONSE_TIME, command_type, percentile, false, NULL);
+    }
+    return result;
+}
+
+/* Record what one operation cost under NAME, e.g. a cache hit or a fresh
+   connection's handshake.  Kept apart from command response times. */
+int anbs_metrics_record_cost(const char *name, double elapsed_ms) {
+    return anbs_metrics_record(METRIC_OPTIMIZATION_COST, name, elapsed_ms, NULL);
+}
+
+/* Median cost under NAME (-1 with fewer than 10 samples); *TOTAL
+   receives the number of operations recorded */
+double anbs_metrics_get_cost_median(const char *name, uint64_t *total) {
+    return metrics_percentile(METRIC_OPTIMIZATION_COST, name, 50.0, false, total);
+}
+
 /* Record command failure */
 void anbs_metrics_record_failure(const char *command_type, const char *error_context) {
     if (!g_metrics) {
         return;
     }
 
-    pthread_mutex_lock(&g_metrics->mutex);
-    g_metrics->failed_commands++;
-    pthread_mutex_unlock(&g_metrics->mutex);
+    __atomic_add_fetch(&g_metrics->failed_commands, 1, __ATOMIC_RELAXED);
 
     ANBS_DEBUG_LOG("Command failure recorded: %s (%s)", command_type, error_context);
 }
 
+/* PERCENTILE of SNAPSHOT as a JSON number in BUFFER, or null without
+   enough samples */
+static const char *metrics_json_percentile(const metric_snapshot_t *snapshot, double percentile,
+                                           char *buffer, size_t size) {
+    double value = anbs_metrics_snapshot_percentile(snapshot, percentile);
+
+    if (value < 0.0) {
+        return "null";
+    }
+    snprintf(buffer, size, "%.2f", value);
+    return buffer;
+}
+
 /* Get performance dashboard data */
 int anbs_metrics_get_dashboard(char **dashboard_json) {
     if (!g_metrics || !dashboard_json) {
         return -1;
     }
 
-    pthread_mutex_lock(&g_metrics->mutex);
-
-    /* Collect current system stats */
+    /* Collect current system stats; recording takes the mutex */
     anbs_metrics_collect_system_stats();
 
     char *dashboard = malloc(8192);
-    if (!dashboard) {
-        pthread_mutex_unlock(&g_metrics->mutex);
+    metric_snapshot_t *snapshot = metrics_snapshot_new();
+    metric_snapshot_t *recent = metrics_snapshot_new();
+    char p99[32];
+    if (!dashboard || !snapshot || !recent) {
+        free(dashboard);
+        free(snapshot);
+        free(recent);
         return -1;
     }
 
+    pthread_mutex_lock(&g_metrics->mutex);
+
     time_t uptime = time(NULL) - g_metrics->start_time;
-    double avg_response_time = g_metrics->total_commands > 0 ?
-                              g_metrics->total_response_time / g_metrics->total_commands : 0.0;
+    uint64_t total_commands = __atomic_load_n(&g_metrics->total_commands, __ATOMIC_RELAXED);
+    double avg_response_time = total_commands > 0 ?
+                              __atomic_load_n(&g_metrics->total_response_time, __ATOMIC_RELAXED) /
+                              METRIC_UNITS / total_commands : 0.0;
 
     int offset = snprintf(dashboard, 8192,
                          "{"
@@ -417,17 +1031,25 @@ int anbs_metrics_get_dashboard(char **dashboard_json) {
                          "\"total_commands\": %lu,"
                          "\"failed_commands\": %lu,"
                          "\"average_response_time_ms\": %.2f,"
+                         "\"window_seconds\": %d,"
                          "\"metrics\": [",
-                         uptime, g_metrics->total_commands, g_metrics->failed_commands, avg_response_time);
-
-    /* Add metrics */
-    for (int i = 0; i < g_metrics->metric_count; i++) {
-        performance_metric_t *metric = &g_metrics->metrics[i];
-
-        double current_value = 0.0;
-        if (metric->global_sample_count > 0) {
-            int latest_index = (metric->global_sample_index - 1 + METRIC_HISTORY_SIZE) % METRIC_HISTORY_SIZE;
-            current_value = metric->global_samples[latest_index].value;
+                         uptime, total_commands, __atomic_load_n(&g_metrics->failed_commands, __ATOMIC_RELAXED),
+                         avg_response_time, g_metrics->window_seconds);
+
+    /* Add metrics; a family without samples reports its definition */
+    for (int i = 0; i < METRIC_DEFINITIONS; i++) {
+        const metric_definition_t *definition = &metric_definitions[i];
+        performance_metric_t *metric = g_metrics->metrics[definition->type];
+
+        /* The family's latest value and recent tail across all of its
+           series */
+        memset(snapshot, 0, sizeof(*snapshot));
+        snapshot->min = UINT64_MAX;
+        memset(recent, 0, sizeof(*recent));
+        recent->min = UINT64_MAX;
+        for (int j = 0; metric && j < metric->command_count; j++) {
+            metrics_merge(metric->command_metrics[j], snapshot, false);
+            metrics_merge(metric->command_metrics[j], recent, true);
         }
 
         offset += snprintf(dashboard + offset, 8192 - offset,
@@ -437,15 +1059,19 @@ int anbs_metrics_get_dashboard(char **dashboard_json) {
                           "\"target_value\": %.2f,"
                           "\"alert_threshold\": %.2f,"
                           "\"alert_active\": %s,"
-                          "\"samples_count\": %d"
+                          "\"samples_count\": %lu,"
+                          "\"window_samples\": %lu,"
+                          "\"window_p99\": %s"
                           "}",
                           i > 0 ? "," : "",
-                          metric->name,
-                          current_value,
-                          metric->target_value,
-                          metric->alert_threshold,
-                          metric->alert_active ? "true" : "false",
-                          metric->global_sample_count);
+                          definition->name,
+                          snapshot->count > 0 ? snapshot->last : 0.0,
+                          definition->target_value,
+                          definition->alert_threshold,
+                          metric && __atomic_load_n(&metric->alert_active, __ATOMIC_RELAXED) ? "true" : "false",
+                          snapshot->count,
+                          recent->count,
+                          metrics_json_percentile(recent, 99.0, p99, sizeof(p99)));
     }
 
     offset += snprintf(dashboard + offset, 8192 - offset, "]}");
@@ -453,6 +1079,8 @@ int anbs_metrics_get_dashboard(char **dashboard_json) {
     *dashboard_json = dashboard;
 
     pthread_mutex_unlock(&g_metrics->mutex);
+    free(snapshot);
+    free(recent);
     return 0;
 }
 
@@ -462,38 +1090,28 @@ int anbs_metrics_get_command_stats(const char *command_type, char **stats_json)
         return -1;
     }
 
+    /* Find command metrics under the response time metric */
     pthread_mutex_lock(&g_metrics->mutex);
-
-    /* Find response time metric */
-    performance_metric_t *response_metric = NULL;
-    for (int i = 0; i < g_metrics->metric_count; i++) {
-        if (g_metrics->metrics[i].type == METRIC_RESPONSE_TIME) {
-            response_metric = &g_metrics->metrics[i];
-            break;
-        }
-    }
-
-    if (!response_metric) {
-        pthread_mutex_unlock(&g_metrics->mutex);
-        return -1;
-    }
-
-    /* Find command metrics */
-    command_metrics_t *cmd_metrics = NULL;
-    for (int i = 0; i < response_metric->command_count; i++) {
-        if (strcmp(response_metric->command_metrics[i].command_type, command_type) == 0) {
-            cmd_metrics = &response_metric->command_metrics[i];
-            break;
-        }
-    }
+    performance_metric_t *response_metric = metrics_family(METRIC_RESPONSE_TIME, false);
+    command_metrics_t *cmd_metrics = response_metric ? metrics_series(response_metric, command_type, false) : NULL;
+    pthread_mutex_unlock(&g_metrics->mutex);
 
     char *stats = malloc(1024);
-    if (!stats) {
-        pthread_mutex_unlock(&g_metrics->mutex);
+    metric_snapshot_t *snapshot = metrics_snapshot_new();
+    metric_snapshot_t *recent = metrics_snapshot_new();
+    char p95[32], p99[32];
+    if (!stats || !snapshot || !recent) {
+        free(stats);
+        free(snapshot);
+        free(recent);
         return -1;
     }
-
     if (cmd_metrics) {
+        metrics_merge(cmd_metrics, snapshot, false);
+        metrics_merge(cmd_metrics, recent, true);
+    }
+
+    if (snapshot->count > 0) {
         snprintf(stats, 1024,
                 "{"
                 "\"command_type\": \"%s\","
@@ -502,15 +1120,23 @@ int anbs_metrics_get_command_stats(const char *command_type, char **stats_json)
                 "\"max_response_time_ms\": %.2f,"
                 "\"avg_response_time_ms\": %.2f,"
                 "\"p95_response_time_ms\": %.2f,"
-                "\"p99_response_time_ms\": %.2f"
+                "\"p99_response_time_ms\": %.2f,"
+                "\"window_seconds\": %d,"
+                "\"window_samples\": %lu,"
+                "\"window_p95_response_time_ms\": %s,"
+                "\"window_p99_response_time_ms\": %s"
                 "}",
                 cmd_metrics->command_type,
-                cmd_metrics->total_samples,
-                cmd_metrics->min_value,
-                cmd_metrics->max_value,
-                cmd_metrics->avg_value,
-                cmd_metrics->p95_value,
-                cmd_metrics->p99_value);
+                snapshot->count,
+                snapshot->min / METRIC_UNITS,
+                snapshot->max / METRIC_UNITS,
+                snapshot->sum / METRIC_UNITS / snapshot->count,
+                anbs_metrics_snapshot_percentile(snapshot, 95.0),
+                anbs_metrics_snapshot_percentile(snapshot, 99.0),
+                g_metrics->window_seconds,
+                recent->count,
+                metrics_json_percentile(recent, 95.0, p95, sizeof(p95)),
+                metrics_json_percentile(recent, 99.0, p99, sizeof(p99)));
     } else {
         snprintf(stats, 1024,
                 "{"
@@ -522,22 +1148,782 @@ int anbs_metrics_get_command_stats(const char *command_type, char **stats_json)
     }
 
     *stats_json = stats;
+    free(snapshot);
+    free(recent);
+    return 0;
+}
+
+/* VALUE as a JSON string; series names come from the commands timed */
+static void metrics_json_string(FILE *out, const char *value) {
+    fputc('"', out);
+    for (; *value; value++) {
+        unsigned char c = (unsigned char)*value;
+
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/* Write one series' histogram as a JSON object */
+static void metrics_json_histogram(FILE *out, const char *command_type, const metric_snapshot_t *snapshot) {
+    char p50[32], p90[32], p99[32];
+    bool first = true;
+
+    fputs("{\"command_type\": ", out);
+    metrics_json_string(out, command_type);
+    fprintf(out, ", \"count\": %lu, \"sum_ms\": %.3f", (unsigned long)snapshot->count, snapshot->sum / METRIC_UNITS);
+    if (snapshot->count > 0) {
+        fprintf(out, ", \"min_ms\": %.3f, \"max_ms\": %.3f",
+                snapshot->min / METRIC_UNITS, snapshot->max / METRIC_UNITS);
+    }
+    fprintf(out, ", \"p50_ms\": %s, \"p90_ms\": %s, \"p99_ms\": %s, \"buckets\": [",
+            metrics_json_percentile(snapshot, 50.0, p50, sizeof(p50)),
+            metrics_json_percentile(snapshot, 90.0, p90, sizeof(p90)),
+            metrics_json_percentile(snapshot, 99.0, p99, sizeof(p99)));
+
+    /* Only occupied buckets, as [upper bound in ms, count] */
+    for (int octave = 0; octave < METRIC_OCTAVES; octave++) {
+        for (int sub = 0; sub < METRIC_SUB_BUCKETS; sub++) {
+            if (snapshot->buckets[octave][sub] == 0) {
+                continue;
+            }
+            fprintf(out, "%s[%.3f, %lu]", first ? "" : ", ",
+                    metrics_bucket_limit(octave, sub) / METRIC_UNITS,
+                    (unsigned long)snapshot->buckets[octave][sub]);
+            first = false;
+        }
+    }
+    fputs("]}", out);
+}
+
+/* Latency histograms as JSON: one object per response time series, or
+   only COMMAND_TYPE's when it isn't NULL, covering the sliding window
+   when WINDOW is set and every sample otherwise.  The caller frees
+   *HISTOGRAMS_JSON. */
+int anbs_metrics_get_histograms(const char *command_type, bool window, char **histograms_json) {
+    metric_snapshot_t *snapshot;
+    performance_metric_t *metric;
+    size_t length;
+    FILE *out;
+    int written = 0;
+
+    if (!g_metrics || !histograms_json) {
+        return -1;
+    }
+    snapshot = metrics_snapshot_new();
+    out = snapshot ? open_memstream(histograms_json, &length) : NULL;
+    if (!out) {
+        free(snapshot);
+        return -1;
+    }
+
+    fprintf(out, "{\"window_seconds\": %d, \"scope\": \"%s\", \"series\": [",
+            g_metrics->window_seconds, window ? "window" : "lifetime");
+
+    pthread_mutex_lock(&g_metrics->mutex);
+    metric = g_metrics->metrics[METRIC_RESPONSE_TIME];
+    for (int i = 0; metric && i < metric->command_count; i++) {
+        command_metrics_t *cmd_metrics = metric->command_metrics[i];
+
+        if (command_type && strcmp(cmd_metrics->command_type, command_type) != 0) {
+            continue;
+        }
+        memset(snapshot, 0, sizeof(*snapshot));
+        snapshot->min = UINT64_MAX;
+        metrics_merge(cmd_metrics, snapshot, window);
 
+        if (written++ > 0) {
+            fputs(", ", out);
+        }
+        metrics_json_histogram(out, cmd_metrics->command_type, snapshot);
+    }
     pthread_mutex_unlock(&g_metrics->mutex);
+
+    fputs("]}", out);
+    free(snapshot);
+    if (fclose(out) != 0) {
+        free(*histograms_json);
+        *histograms_json = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Add objective NAME, or retarget it when it exists.  Called while
+   initializing, before any thread can record. */
+static void metrics_slo_define(const char *name, double target_ms, double objective) {
+    metric_slo_t *slo = NULL;
+
+    for (int i = 0; i < g_metrics->slo_count; i++) {
+        if (strcmp(g_metrics->slos[i].name, name) == 0) {
+            slo = &g_metrics->slos[i];
+        }
+    }
+    if (!slo) {
+        if (g_metrics->slo_count == METRIC_SLO_MAX || strlen(name) >= sizeof(slo->name)) {
+            return;
+        }
+        slo = &g_metrics->slos[g_metrics->slo_count];
+        snprintf(slo->name, sizeof(slo->name), "%s", name);
+        if ((slo->series = anbs_metrics_handle(METRIC_SLO_LATENCY, name)) == NULL) {
+            return;
+        }
+        g_metrics->slo_count++;
+    }
+    slo->target_ms = target_ms;
+    slo->objective = objective;
+}
+
+/* The default objectives, then those of ANBS_SLO: a comma-separated list
+   of class=ms[:percent], e.g. "prompt=10,vertex.uncached=1500:99.9" */
+static void metrics_slo_configure(void) {
+    const char *spec = getenv("ANBS_SLO");
+    char *copy, *item, *save = NULL, *value, *end;
+    double target, objective;
+
+    for (size_t i = 0; i < sizeof(metric_slos) / sizeof(metric_slos[0]); i++) {
+        metrics_slo_define(metric_slos[i].name, metric_slos[i].target_ms, METRIC_SLO_OBJECTIVE);
+    }
+    if (!spec || !*spec || (copy = strdup(spec)) == NULL) {
+        return;
+    }
+
+    for (item = strtok_r(copy, ", ", &save); item; item = strtok_r(NULL, ", ", &save)) {
+        if ((value = strchr(item, '=')) == NULL || value == item) {
+            ANBS_DEBUG_LOG("ANBS_SLO: ignoring '%s'", item);
+            continue;
+        }
+        *value++ = '\0';
+        target = strtod(value, &end);
+        objective = METRIC_SLO_OBJECTIVE;
+        if (*end == ':') {
+            objective = strtod(end + 1, &end);
+        }
+        if (*end != '\0' || !(target > 0.0) || !(objective > 0.0 && objective < 100.0)) {
+            ANBS_DEBUG_LOG("ANBS_SLO: ignoring '%s'", item);
+            continue;
+        }
+        metrics_slo_define(item, target, objective);
+    }
+    free(copy);
+}
+
+/* The objective of class NAME, or NULL */
+static metric_slo_t *metrics_slo_find(const char *name) {
+    for (int i = 0; name && i < g_metrics->slo_count; i++) {
+        if (strcmp(g_metrics->slos[i].name, name) == 0) {
+            return &g_metrics->slos[i];
+        }
+    }
+    return NULL;
+}
+
+/* Samples of SNAPSHOT over TARGET_MS, by the midpoint of their bucket */
+static uint64_t metrics_snapshot_over(const metric_snapshot_t *snapshot, double target_ms) {
+    double limit = target_ms * METRIC_UNITS;
+    uint64_t over = 0;
+
+    for (int octave = 0; octave < METRIC_OCTAVES; octave++) {
+        for (int sub = 0; sub < METRIC_SUB_BUCKETS; sub++) {
+            if (snapshot->buckets[octave][sub] && metrics_bucket_value(octave, sub) > limit) {
+                over += snapshot->buckets[octave][sub];
+            }
+        }
+    }
+    return over;
+}
+
+/* How fast SLO's window spends its error budget: the share of samples
+   over target divided by the share the objective allows, so 1 spends it
+   exactly.  -1 with fewer than METRIC_MIN_SAMPLES samples in the window.
+   *OVER receives the samples over target and SNAPSHOT, if not NULL, all
+   of the window's. */
+static double metrics_slo_burn(const metric_slo_t *slo, metric_snapshot_t *snapshot, uint64_t *over) {
+    metric_snapshot_t *window = snapshot ? snapshot : metrics_snapshot_new();
+    double burn = -1.0;
+
+    *over = 0;
+    if (!window) {
+        return -1.0;
+    }
+    memset(window, 0, sizeof(*window));
+    window->min = UINT64_MAX;
+    metrics_merge(slo->series, window, true);
+
+    *over = metrics_snapshot_over(window, slo->target_ms);
+    if (window->count >= METRIC_MIN_SAMPLES) {
+        burn = ((double)*over / window->count) / (1.0 - slo->objective / 100.0);
+    }
+    if (window != snapshot) {
+        free(window);
+    }
+    return burn;
+}
+
+/* A compact status-line indicator of the classes burning their error
+   budget, worst first, e.g. "SLO ▲ prompt 4.2x, vertex.uncached 1.3x".
+   Returns the number of such classes; BUFFER is empty when there are
+   none. */
+int anbs_metrics_slo_status(char *buffer, size_t size) {
+    double burn[METRIC_SLO_MAX];
+    int order[METRIC_SLO_MAX], count = 0;
+    size_t used;
+    uint64_t over;
+
+    if (!buffer || size == 0) {
+        return -1;
+    }
+    buffer[0] = '\0';
+    if (!g_metrics) {
+        return 0;
+    }
+
+    for (int i = 0; i < g_metrics->slo_count; i++) {
+        if (!__atomic_load_n(&g_metrics->slos[i].burning, __ATOMIC_RELAXED) ||
+            (burn[i] = metrics_slo_burn(&g_metrics->slos[i], NULL, &over)) <= 1.0) {
+            continue;
+        }
+        int j = count++;
+        for (; j > 0 && burn[order[j - 1]] < burn[i]; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    used = count > 0 ? (size_t)snprintf(buffer, size, "SLO ▲") : 0;
+    for (int j = 0; j < count && used < size; j++) {
+        used += snprintf(buffer + used, size - used, "%s %s %.1fx", j ? "," : "",
+                         g_metrics->slos[order[j]].name, burn[order[j]]);
+    }
+    return count;
+}
+
+/* Show the burning budgets on the status line, or that they recovered,
+   when that changed or the last update is a second old */
+static void metrics_slo_display(bool changed) {
+    char status[256];
+    uint64_t now_ns = metrics_now_ns(), last_ns;
+    bool burning;
+
+    if (!g_anbs_display) {
+        return;
+    }
+    last_ns = __atomic_load_n(&g_metrics->slo_status_ns, __ATOMIC_RELAXED);
+    if (!changed && now_ns - last_ns < METRIC_SLO_STATUS_NS) {
+        return;
+    }
+    if (!__atomic_compare_exchange_n(&g_metrics->slo_status_ns, &last_ns, now_ns, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;     /* another thread is updating it */
+    }
+
+    burning = anbs_metrics_slo_status(status, sizeof(status)) > 0;
+    if (burning) {
+        anbs_status_write(g_anbs_display, status);
+    } else if (__atomic_load_n(&g_metrics->slo_shown, __ATOMIC_RELAXED)) {
+        anbs_status_write(g_anbs_display, "SLO: all latency budgets within objective");
+    }
+    __atomic_store_n(&g_metrics->slo_shown, burning, __ATOMIC_RELAXED);
+}
+
+/* Record that one command of class SLO took ELAPSED_MS, for classes
+   with an objective.  Returns 1 while the class's window burns its error
+   budget faster than the objective allows, 0 otherwise and -1 for a
+   class without one.  Burning budgets show on the status line. */
+int anbs_metrics_slo_observe(const char *slo_name, double elapsed_ms) {
+    metric_slo_t *slo;
+    uint64_t over;
+    bool burning;
+
+    if (anbs_metrics_init() != 0 || (slo = metrics_slo_find(slo_name)) == NULL ||
+        !__atomic_load_n(&g_metrics->monitoring_enabled, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+
+    metrics_observe(slo->series, elapsed_ms, 0);
+    __atomic_add_fetch(&slo->total, 1, __ATOMIC_RELAXED);
+    if (elapsed_ms > slo->target_ms) {
+        __atomic_add_fetch(&slo->violations, 1, __ATOMIC_RELAXED);
+    }
+
+    /* Within target and not burning, the window can only have improved */
+    if (elapsed_ms <= slo->target_ms && !__atomic_load_n(&slo->burning, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    burning = metrics_slo_burn(slo, NULL, &over) > 1.0;
+    metrics_slo_display(__atomic_exchange_n(&slo->burning, burning, __ATOMIC_RELAXED) != burning);
+    return burning;
+}
+
+/* Target of class SLO in milliseconds, or -1 without an objective */
+double anbs_metrics_slo_target(const char *slo_name) {
+    metric_slo_t *slo;
+
+    if (!g_metrics || (slo = metrics_slo_find(slo_name)) == NULL) {
+        return -1.0;
+    }
+    return slo->target_ms;
+}
+
+/* The latency objectives as JSON: each class's target, exact counts
+   since the last reset, and the sliding window's percentiles, samples
+   over target and burn rate (null with too few samples).  The caller
+   frees *SLO_JSON. */
+int anbs_metrics_get_slo(char **slo_json) {
+    metric_snapshot_t *snapshot;
+    size_t length;
+    FILE *out;
+    char p50[32], p99[32], rate[32];
+    uint64_t over;
+    double burn;
+
+    if (!g_metrics || !slo_json) {
+        return -1;
+    }
+    snapshot = metrics_snapshot_new();
+    out = snapshot ? open_memstream(slo_json, &length) : NULL;
+    if (!out) {
+        free(snapshot);
+        return -1;
+    }
+
+    fprintf(out, "{\"window_seconds\": %d, \"slos\": [", g_metrics->window_seconds);
+    for (int i = 0; i < g_metrics->slo_count; i++) {
+        metric_slo_t *slo = &g_metrics->slos[i];
+
+        burn = metrics_slo_burn(slo, snapshot, &over);
+        if (burn >= 0.0) {
+            snprintf(rate, sizeof(rate), "%.2f", burn);
+        }
+        fprintf(out, "%s{\"class\": ", i ? ", " : "");
+        metrics_json_string(out, slo->name);
+        fprintf(out, ", \"target_ms\": %g, \"objective_percent\": %g, \"count\": %lu, \"violations\": %lu",
+                slo->target_ms, slo->objective,
+                (unsigned long)__atomic_load_n(&slo->total, __ATOMIC_RELAXED),
+                (unsigned long)__atomic_load_n(&slo->violations, __ATOMIC_RELAXED));
+        fprintf(out, ", \"window\": {\"count\": %lu, \"over_target\": %lu, \"p50_ms\": %s, \"p99_ms\": %s, "
+                "\"burn_rate\": %s, \"burning\": %s}}",
+                (unsigned long)snapshot->count, (unsigned long)over,
+                metrics_json_percentile(snapshot, 50.0, p50, sizeof(p50)),
+                metrics_json_percentile(snapshot, 99.0, p99, sizeof(p99)),
+                burn >= 0.0 ? rate : "null", burn > 1.0 ? "true" : "false");
+    }
+    fputs("]}", out);
+
+    free(snapshot);
+    if (fclose(out) != 0) {
+        free(*slo_json);
+        *slo_json = NULL;
+        return -1;
+    }
     return 0;
 }
 
+/* Other modules write their own families; memory only has numbers */
+extern int anbs_cache_export_metrics(FILE *out);
+extern int anbs_optimize_export_metrics(FILE *out);
+extern int anbs_websocket_export_metrics(FILE *out);
+extern int anbs_distributed_ai_export_metrics(FILE *out);
+extern int anbs_memory_get_stats(int *total_entries, int *db_entries, size_t *memory_usage);
+
+/* Start the OpenMetrics family NAME of TYPE: counter, gauge or summary.
+   Counter samples are then written as NAME_total. */
+void anbs_metrics_export_family(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+/* Write one sample of NAME with LABELS, e.g. state="online", or NULL.
+   Every sample carries the shell's pid, so the files of all of a host's
+   shells can be collected side by side. */
+void anbs_metrics_export_sample(FILE *out, const char *name, const char *labels, double value) {
+    fprintf(out, "%s{shell=\"%d\"%s%s} ", name, (int)getpid(), labels ? "," : "", labels ? labels : "");
+    if (value == (double)(long long)value && value > -1e15 && value < 1e15) {
+        fprintf(out, "%lld\n", (long long)value);
+    } else {
+        fprintf(out, "%g\n", value);
+    }
+}
+
+/* NAME="VALUE" in BUFFER, with VALUE escaped for a label */
+static const char *metrics_export_label(const char *name, const char *value, char *buffer, size_t size) {
+    size_t used = snprintf(buffer, size, "%s=\"", name);
+
+    for (; *value && used + 3 < size; value++) {
+        if (*value == '\\' || *value == '"') {
+            buffer[used++] = '\\';
+            buffer[used++] = *value;
+        } else if (*value == '\n') {
+            buffer[used++] = '\\';
+            buffer[used++] = 'n';
+        } else {
+            buffer[used++] = *value;
+        }
+    }
+    buffer[used++] = '"';
+    buffer[used] = '\0';
+    return buffer;
+}
+
+/* Write every family of the metrics system.  Latency families become
+   summaries whose quantiles cover the sliding window and whose count and
+   sum cover every sample; the others are gauges of their latest value.
+   Called with the mutex held. */
+static void metrics_export_own(FILE *out, metric_snapshot_t *lifetime, metric_snapshot_t *recent) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+    char family[128], sample[160], series[256], labels[320];
+
+    anbs_metrics_export_family(out, "anbs_commands", "counter", "AI commands timed");
+    anbs_metrics_export_sample(out, "anbs_commands_total", NULL,
+                               (double)__atomic_load_n(&g_metrics->total_commands, __ATOMIC_RELAXED));
+    anbs_metrics_export_family(out, "anbs_command_failures", "counter", "AI commands that failed");
+    anbs_metrics_export_sample(out, "anbs_command_failures_total", NULL,
+                               (double)__atomic_load_n(&g_metrics->failed_commands, __ATOMIC_RELAXED));
+
+    for (int i = 0; i < METRIC_DEFINITIONS; i++) {
+        const metric_definition_t *definition = &metric_definitions[i];
+        performance_metric_t *metric = g_metrics->metrics[definition->type];
+        bool summary = definition->type == METRIC_RESPONSE_TIME || definition->type == METRIC_OPTIMIZATION_COST ||
+                       definition->type == METRIC_SLO_LATENCY;
+
+        if (!metric || metric->command_count == 0) {
+            continue;
+        }
+        snprintf(family, sizeof(family), "anbs_%s", definition->name);
+        anbs_metrics_export_family(out, family, summary ? "summary" : "gauge", definition->description);
+
+        for (int j = 0; j < metric->command_count; j++) {
+            command_metrics_t *cmd_metric = metric->command_metrics[j];
+
+            memset(lifetime, 0, sizeof(*lifetime));
+            lifetime->min = UINT64_MAX;
+            metrics_merge(cmd_metric, lifetime, false);
+            if (lifetime->count == 0) {
+                continue;
+            }
+            metrics_export_label("series", cmd_metric->command_type, series, sizeof(series));
+            if (!summary) {
+                anbs_metrics_export_sample(out, family, series, lifetime->last);
+                continue;
+            }
+
+            memset(recent, 0, sizeof(*recent));
+            recent->min = UINT64_MAX;
+            metrics_merge(cmd_metric, recent, true);
+            for (int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++) {
+                double value = anbs_metrics_snapshot_percentile(recent, quantiles[q] * 100.0);
+                if (value >= 0.0) {
+                    snprintf(labels, sizeof(labels), "%s,quantile=\"%g\"", series, quantiles[q]);
+                    anbs_metrics_export_sample(out, family, labels, value);
+                }
+            }
+            snprintf(sample, sizeof(sample), "%s_count", family);
+            anbs_metrics_export_sample(out, sample, series, (double)lifetime->count);
+            snprintf(sample, sizeof(sample), "%s_sum", family);
+            anbs_metrics_export_sample(out, sample, series, lifetime->sum / METRIC_UNITS);
+        }
+    }
+}
+
+/* Every ANBS metric in OpenMetrics text format, ending in "# EOF".  The
+   metrics mutex is only held for this module's own families; the caller
+   frees *TEXT. */
+int anbs_metrics_get_openmetrics(char **text) {
+    metric_snapshot_t *lifetime, *recent;
+    size_t length;
+    int entries;
+    size_t memory_bytes;
+    FILE *out;
+
+    if (!g_metrics || !text) {
+        return -1;
+    }
+
+    lifetime = metrics_snapshot_new();
+    recent = metrics_snapshot_new();
+    out = lifetime && recent ? open_memstream(text, &length) : NULL;
+    if (!out) {
+        free(lifetime);
+        free(recent);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_metrics->mutex);
+    metrics_export_own(out, lifetime, recent);
+    pthread_mutex_unlock(&g_metrics->mutex);
+    free(lifetime);
+    free(recent);
+
+    anbs_cache_export_metrics(out);
+    anbs_optimize_export_metrics(out);
+    if (anbs_memory_get_stats(&entries, NULL, &memory_bytes) == 0) {
+        anbs_metrics_export_family(out, "anbs_memory_entries", "gauge", "Memories held in RAM");
+        anbs_metrics_export_sample(out, "anbs_memory_entries", NULL, entries);
+        anbs_metrics_export_family(out, "anbs_memory_bytes", "gauge", "Estimated RAM used by memories");
+        anbs_metrics_export_sample(out, "anbs_memory_bytes", NULL, (double)memory_bytes);
+    }
+    anbs_websocket_export_metrics(out);
+    anbs_distributed_ai_export_metrics(out);
+
+    fputs("# EOF\n", out);
+    if (fclose(out) != 0) {
+        free(*text);
+        *text = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Replace the export file with TEXT.  The rename keeps a collector from
+   reading half a file. */
+static int metrics_export_write(const char *path, const char *text) {
+    char temp[4096];
+    FILE *file;
+    int status;
+
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+    file = fopen(temp, "w");
+    if (!file) {
+        return -1;
+    }
+    status = fputs(text, file) < 0 ? -1 : 0;
+    if (fclose(file) != 0 || status != 0 || rename(temp, path) != 0) {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Rewrite the export file every export_interval seconds until
+   anbs_metrics_cleanup() */
+static void *metrics_export_thread(void *arg) {
+    struct timespec deadline;
+    sigset_t signals;
+    char *text;
+
+    (void)arg;
+
+    /* The shell's signal handlers must run on its own thread */
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_mutex_lock(&g_metrics->mutex);
+    while (g_metrics->exporting) {
+        pthread_mutex_unlock(&g_metrics->mutex);
+        if (anbs_metrics_get_openmetrics(&text) == 0) {
+            if (metrics_export_write(g_metrics->export_path, text) != 0) {
+                ANBS_DEBUG_LOG("Could not write metrics to %s", g_metrics->export_path);
+            }
+            free(text);
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += g_metrics->export_interval;
+        pthread_mutex_lock(&g_metrics->mutex);
+        while (g_metrics->exporting &&
+               pthread_cond_timedwait(&g_metrics->export_wake, &g_metrics->mutex, &deadline) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&g_metrics->mutex);
+
+    return NULL;
+}
+
+/* A forked subshell has no exporter thread, which may have held the
+   mutex, and leaves the export file to its parent.  It keeps tracing. */
+static void metrics_atfork_child(void) {
+    if (!g_metrics) {
+        return;
+    }
+
+    pthread_mutex_init(&g_metrics->mutex, NULL);
+    if (g_metrics->trace) {
+        pthread_mutex_init(&g_metrics->trace_mutex, NULL);
+    }
+    if (g_metrics->export_path) {
+        g_metrics->exporting = false;
+        pthread_cond_init(&g_metrics->export_wake, NULL);
+        free(g_metrics->export_path);
+        g_metrics->export_path = NULL;
+    }
+}
+
+/* A collector would keep reporting an exited shell's last numbers */
+static void metrics_export_atexit(void) {
+    if (g_metrics && g_metrics->export_path && g_metrics->export_pid == getpid()) {
+        unlink(g_metrics->export_path);
+    }
+}
+
+/* Start exporting when ANBS_METRICS_EXPORT names a file, or a directory
+   to write anbs_<pid>.prom in, e.g. node_exporter's textfile collector
+   directory */
+static void metrics_export_start(void) {
+    const char *target = getenv("ANBS_METRICS_EXPORT");
+    const char *interval = getenv("ANBS_METRICS_EXPORT_INTERVAL");
+    struct stat st;
+    char path[4096];
+    static int hooks_registered = 0;
+
+    if (!target || !*target) {
+        return;
+    }
+    if (stat(target, &st) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(path, sizeof(path), "%s/anbs_%d.prom", target, (int)getpid());
+    } else {
+        snprintf(path, sizeof(path), "%s", target);
+    }
+
+    g_metrics->export_path = strdup(path);
+    if (!g_metrics->export_path) {
+        return;
+    }
+    g_metrics->export_interval = interval && atoi(interval) > 0 ? atoi(interval) : METRIC_EXPORT_INTERVAL;
+    g_metrics->export_pid = getpid();
+    pthread_cond_init(&g_metrics->export_wake, NULL);
+
+    g_metrics->exporting = true;
+    if (pthread_create(&g_metrics->export_thread, NULL, metrics_export_thread, NULL) != 0) {
+        g_metrics->exporting = false;
+        pthread_cond_destroy(&g_metrics->export_wake);
+        free(g_metrics->export_path);
+        g_metrics->export_path = NULL;
+        return;
+    }
+    if (!hooks_registered) {
+        atexit(metrics_export_atexit);
+        hooks_registered = 1;
+    }
+
+    ANBS_DEBUG_LOG("Exporting metrics to %s every %ds", path, g_metrics->export_interval);
+}
+
+/* Stop the exporter and remove its file */
+static void metrics_export_stop(void) {
+    if (!g_metrics->export_path) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_metrics->mutex);
+    g_metrics->exporting = false;
+    pthread_cond_signal(&g_metrics->export_wake);
+    pthread_mutex_unlock(&g_metrics->mutex);
+    pthread_join(g_metrics->export_thread, NULL);
+    pthread_cond_destroy(&g_metrics->export_wake);
+
+    metrics_export_atexit();
+    free(g_metrics->export_path);
+    g_metrics->export_path = NULL;
+}
+
+/* Open ANBS_TRACE for spans.  The file is a Chrome trace-event array
+   that spans are appended to and is never closed with "]", which
+   chrome://tracing and Perfetto accept, so runs of several shells can
+   share one file. */
+static void metrics_trace_start(void) {
+    const char *path = getenv("ANBS_TRACE");
+
+    if (!path || !*path) {
+        return;
+    }
+    g_metrics->trace = fopen(path, "a");
+    if (!g_metrics->trace) {
+        ANBS_DEBUG_LOG("Could not open trace file %s", path);
+        return;
+    }
+    pthread_mutex_init(&g_metrics->trace_mutex, NULL);
+    if (ftell(g_metrics->trace) == 0) {
+        fputs("[\n", g_metrics->trace);
+        fflush(g_metrics->trace);
+    }
+}
+
+/* Whether spans are being written; callers skip collecting spans
+   otherwise */
+bool anbs_metrics_tracing(void) {
+    return g_metrics && g_metrics->trace;
+}
+
+/* Write a span NAME in CATEGORY that began at START and lasted
+   DURATION_MS, on the calling thread.  ARGS is a JSON object shown with
+   the span, or NULL. */
+void anbs_metrics_trace_span(const char *name, const char *category, const struct timeval *start,
+                             double duration_ms, const char *args) {
+    if (!anbs_metrics_tracing() || !start) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_metrics->trace_mutex);
+    fprintf(g_metrics->trace,
+            "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, "
+            "\"pid\": %d, \"tid\": %ld, \"args\": %s},\n",
+            name, category, (long long)start->tv_sec * 1000000LL + start->tv_usec,
+            (long long)(duration_ms * 1000.0 + 0.5), (int)getpid(), (long)syscall(SYS_gettid),
+            args ? args : "{}");
+    fflush(g_metrics->trace);
+    pthread_mutex_unlock(&g_metrics->trace_mutex);
+}
+
 /* Enable/disable monitoring */
 void anbs_metrics_set_enabled(bool enabled) {
     if (g_metrics) {
-        pthread_mutex_lock(&g_metrics->mutex);
-        g_metrics->monitoring_enabled = enabled;
-        pthread_mutex_unlock(&g_metrics->mutex);
+        __atomic_store_n(&g_metrics->monitoring_enabled, enabled, __ATOMIC_RELAXED);
 
         ANBS_DEBUG_LOG("Performance monitoring %s", enabled ? "enabled" : "disabled");
     }
 }
 
+/* Empty SERIES's window ticks.  Samples recorded while this runs may
+   survive it. */
+static void metrics_series_clear_window(command_metrics_t *series) {
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        metric_shard_t *shard = __atomic_load_n(&series->shards[i], __ATOMIC_ACQUIRE);
+        for (int j = 0; shard && j < METRIC_SLICES; j++) {
+            __atomic_store_n(&shard->slices[j].epoch, 0, __ATOMIC_RELEASE);
+            metrics_hist_clear(&shard->slices[j].hist);
+        }
+    }
+}
+
+/* Zero every shard of SERIES.  Samples recorded while this runs may
+   survive it. */
+static void metrics_series_reset(command_metrics_t *series) {
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        metric_shard_t *shard = __atomic_load_n(&series->shards[i], __ATOMIC_ACQUIRE);
+        if (shard) {
+            metrics_hist_clear(&shard->total);
+        }
+    }
+    metrics_series_clear_window(series);
+}
+
+/* Make windowed percentiles cover the last SECONDS seconds.  The window
+   starts out empty. */
+int anbs_metrics_set_window(int seconds) {
+    if (!g_metrics || seconds <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_metrics->mutex);
+    g_metrics->window_seconds = seconds;
+    __atomic_store_n(&g_metrics->slice_ns, (uint64_t)seconds * 1000000000ULL / METRIC_SLICES, __ATOMIC_RELAXED);
+    for (int i = 0; i < METRIC_TYPE_COUNT; i++) {
+        performance_metric_t *metric = g_metrics->metrics[i];
+        for (int j = 0; metric && j < metric->command_count; j++) {
+            metrics_series_clear_window(metric->command_metrics[j]);
+        }
+    }
+    pthread_mutex_unlock(&g_metrics->mutex);
+
+    ANBS_DEBUG_LOG("Metrics window set to %d seconds", seconds);
+    return 0;
+}
+
 /* Reset all metrics */
 void anbs_metrics_reset(void) {
     if (!g_metrics) {
@@ -547,39 +1933,80 @@ void anbs_metrics_reset(void) {
     pthread_mutex_lock(&g_metrics->mutex);
 
     /* Reset all metrics */
-    for (int i = 0; i < g_metrics->metric_count; i++) {
-        performance_metric_t *metric = &g_metrics->metrics[i];
-        metric->global_sample_count = 0;
-        metric->global_sample_index = 0;
-        metric->alert_active = false;
+    for (int i = 0; i < METRIC_TYPE_COUNT; i++) {
+        performance_metric_t *metric = g_metrics->metrics[i];
+        if (!metric) {
+            continue;
+        }
+        __atomic_store_n(&metric->alert_active, false, __ATOMIC_RELAXED);
 
         for (int j = 0; j < metric->command_count; j++) {
-            command_metrics_t *cmd_metric = &metric->command_metrics[j];
-            cmd_metric->sample_count = 0;
-            cmd_metric->sample_index = 0;
-            cmd_metric->total_samples = 0;
+            metrics_series_reset(metric->command_metrics[j]);
         }
     }
 
+    for (int i = 0; i < g_metrics->slo_count; i++) {
+        __atomic_store_n(&g_metrics->slos[i].total, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_metrics->slos[i].violations, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_metrics->slos[i].burning, false, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&g_metrics->slo_shown, false, __ATOMIC_RELAXED);
+
     g_metrics->start_time = time(NULL);
-    g_metrics->total_commands = 0;
-    g_metrics->failed_commands = 0;
-    g_metrics->total_response_time = 0.0;
+    __atomic_store_n(&g_metrics->total_commands, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_metrics->failed_commands, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_metrics->total_response_time, 0, __ATOMIC_RELAXED);
 
     pthread_mutex_unlock(&g_metrics->mutex);
 
     ANBS_DEBUG_LOG("Performance metrics reset");
 }
 
-/* Cleanup metrics system */
+/* Cleanup metrics system.  No thread may still be recording. */
 void anbs_metrics_cleanup(void) {
     if (!g_metrics) {
         return;
     }
 
+    metrics_export_stop();
+    if (g_metrics->trace) {
+        fclose(g_metrics->trace);
+        pthread_mutex_destroy(&g_metrics->trace_mutex);
+    }
+
+    for (int i = 0; i < METRIC_TYPE_COUNT; i++) {
+        performance_metric_t *metric = g_metrics->metrics[i];
+        if (!metric) {
+            continue;
+        }
+        for (int j = 0; j < metric->command_count; j++) {
+            command_metrics_t *series = metric->command_metrics[j];
+            for (int k = 0; k < METRIC_SHARDS; k++) {
+                if (!series->shards[k]) {
+                    continue;
+                }
+                metric_shard_t *shard = series->shards[k];
+                for (int octave = 0; octave < METRIC_OCTAVES; octave++) {
+                    free(shard->total.octaves[octave]);
+                    for (int slice = 0; slice < METRIC_SLICES; slice++) {
+                        free(shard->slices[slice].hist.octaves[octave]);
+                    }
+                }
+                free(shard);
+            }
+            free(series->command_type);
+            free(series);
+        }
+        free(metric->command_metrics);
+        free(metric);
+    }
+    for (int i = 0; i < g_metrics->context_count; i++) {
+        free(g_metrics->contexts[i]);
+    }
+
     pthread_mutex_destroy(&g_metrics->mutex);
     free(g_metrics);
     g_metrics = NULL;
 
     ANBS_DEBUG_LOG("Performance metrics system cleaned up");
-}
\ No newline at end of file
+}
@@ -5,13 +5,28 @@
 #include <string.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/time.h>
 #include <unistd.h>
 
 #define MAX_OPTIMIZATIONS 100
-#define OPTIMIZATION_BUFFER_SIZE 64
-#define WORKER_THREAD_COUNT 4
-#define BATCH_SIZE 10
+#define MAX_PENDING_REQUESTS 4096 /* queued or running before requests are refused */
+#define OPT_CLASSES 3             /* request priorities: interactive, normal, background */
+#define POOL_MAX_WORKERS 64
+#define POOL_DEQUE_SIZE 256       /* tasks a worker holds for thieves; a power of 2 */
+#define POOL_INJECT_BATCH 8       /* submitted tasks a worker takes at once */
+#define POOL_SPIN_ROUNDS 64       /* searches for work before a worker parks */
+#define SLAB_CLASSES 13           /* 16 bytes doubling to 64KB; larger goes to malloc */
+#define SLAB_BYTES (256 * 1024)   /* memory carved into blocks per depot refill */
+#define SLAB_MAGAZINE_BYTES (64 * 1024) /* block bytes in one magazine */
+#define SLAB_MAGAZINE_MAX 64
+#define SLAB_LARGE 0xffffffffu
+#define PREDICT_STATES 4096       /* previous commands the model remembers; a power of 2 */
+#define PREDICT_SUCCESSORS 4      /* next commands kept per previous command */
+#define PREDICT_MIN_COUNT 3       /* sightings before a transition is predicted */
+#define PREDICT_MAX_TOTAL 255     /* counts halve past this so old habits fade */
 
 typedef enum {
     OPT_TYPE_RESPONSE_CACHING = 1,
@@ -24,69 +39,167 @@ typedef enum {
     OPT_TYPE_COMPRESSION
 } optimization_type_t;
 
-typedef enum {
-    BUFFER_STATE_EMPTY = 0,
-    BUFFER_STATE_FILLING,
-    BUFFER_STATE_PROCESSING,
-    BUFFER_STATE_READY
-} buffer_state_t;
-
 typedef struct {
     char command[512];
     char context[256];
     time_t timestamp;
     int priority;
+    long long deadline_ms;       /* monotonic; LLONG_MAX for none */
+    uint64_t seq;                /* arrival order among equal deadlines */
     void *callback_data;
     int (*callback)(const char *response, void *data);
 } optimization_request_t;
 
+/* Requests of one priority, earliest deadline first */
+typedef struct {
+    optimization_request_t **heap;
+    int count;
+    int capacity;
+} request_queue_t;
+
+/* A unit of work for the pool */
+typedef struct pool_task {
+    struct pool_task *next;      /* in the submission queue */
+    void (*run)(void *arg);
+    void *arg;
+} pool_task_t;
+
+/* Chase-Lev deque: its worker pushes and pops at BOTTOM while idle
+   workers steal from TOP */
+typedef struct {
+    long top;
+    long bottom;
+    pool_task_t *tasks[POOL_DEQUE_SIZE];
+} __attribute__((aligned(64))) pool_deque_t;
+
+/* Precedes every block anbs_optimize_malloc hands out */
+typedef struct {
+    uint32_t size_class;         /* or SLAB_LARGE */
+    uint32_t reserved;
+    size_t size;                 /* bytes requested */
+} slab_header_t;
+
+/* A free block.  Blocks travel between threads in magazines: chains of
+   ROUNDS blocks, stacked in the depot through NEXT_MAGAZINE. */
+typedef struct slab_free {
+    struct slab_free *next;
+    struct slab_free *next_magazine;
+    size_t rounds;
+} slab_free_t;
+
+/* Depot for one size class */
+typedef struct {
+    pthread_mutex_t lock;
+    slab_free_t *magazines;
+    size_t block_size;           /* header included */
+    int rounds;                  /* blocks per magazine */
+
+    /* Accounting, folded in from the thread caches at each exchange */
+    uint64_t allocs;
+    uint64_t frees;
+    size_t slab_bytes;
+} __attribute__((aligned(64))) slab_class_t;
+
+/* One thread's cache of a size class: up to two magazines of blocks */
 typedef struct {
-    optimization_request_t requests[OPTIMIZATION_BUFFER_SIZE];
+    void *blocks[SLAB_MAGAZINE_MAX * 2];
     int count;
-    buffer_state_t state;
-    pthread_mutex_t mutex;
-    pthread_cond_t ready_cond;
-} request_buffer_t;
+    uint64_t allocs;
+    uint64_t frees;
+} slab_cache_t;
+
+/* One observed "previous command -> next command" transition */
+typedef struct {
+    uint64_t hash;
+    uint32_t count;
+    char *command;
+} predict_edge_t;
+
+/* Commands seen after one previous command; slots are direct-mapped by
+   KEY, and a colliding command takes the slot over */
+typedef struct {
+    uint64_t key;                /* 0 for an empty slot */
+    uint32_t total;
+    predict_edge_t next[PREDICT_SUCCESSORS];
+} predict_state_t;
 
 typedef struct {
     optimization_type_t type;
     char name[64];
     bool enabled;
-    double efficiency_gain;
     uint64_t invocation_count;
-    double total_time_saved_ms;
+    /* Cost metrics (metrics.c) of operations with and without it; NULL
+       when it isn't measured */
+    const char *with_cost;
+    const char *without_cost;
     int (*optimize_func)(void *data);
     void *config_data;
 } optimization_strategy_t;
 
 typedef struct {
-    pthread_t worker_threads[WORKER_THREAD_COUNT];
-    request_buffer_t request_buffers[WORKER_THREAD_COUNT];
     optimization_strategy_t strategies[MAX_OPTIMIZATIONS];
     int strategy_count;
-    bool workers_running;
     pthread_mutex_t global_mutex;
 
+    /* Work-stealing pool, one deque per worker.  Tasks submitted from
+       outside the pool go on the shared INJECT queue; idle workers park on
+       WORK_COND until QUEUED says there is something to take. */
+    pthread_t *worker_threads;
+    pool_deque_t *deques;
+    int worker_count;
+    int workers_created;
+    int workers_started;
+    bool workers_running;
+    pool_task_t *inject_head;
+    pool_task_t *inject_tail;
+    long queued;                 /* tasks waiting in deques or INJECT */
+    long active;                 /* tasks queued or running */
+    int sleepers;
+    pthread_mutex_t work_mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t idle_cond;    /* ACTIVE dropped to 0 */
+
+    /* Scheduler: each queued request has one dispatch task on the pool,
+       which runs whichever request is most urgent when it starts */
+    request_queue_t queues[OPT_CLASSES];
+    uint64_t request_seq;
+    pthread_mutex_t sched_mutex;
+
     /* Performance tracking */
     uint64_t total_requests;
     uint64_t optimized_requests;
-    double total_optimization_time_ms;
+    uint64_t shed_requests;
 
     /* Connection pool */
     void **connection_pool;
     int pool_size;
     int active_connections;
     pthread_mutex_t pool_mutex;
-
-    /* Memory pool */
-    void **memory_pool;
-    size_t *memory_sizes;
-    int memory_pool_size;
-    int memory_pool_index;
-    pthread_mutex_t memory_mutex;
 } optimization_engine_t;
 
 static optimization_engine_t *g_optimizer = NULL;
+static pthread_mutex_t g_optimizer_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int t_worker = -1;   /* deque of the calling pool worker */
+
+/* The slab allocator outlives the engine: blocks may be held across
+   anbs_optimize_cleanup, so its memory stays for the life of the process */
+static slab_class_t g_slab[SLAB_CLASSES];
+static pthread_once_t g_slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_slab_key;
+static __thread slab_cache_t *t_slab_cache;
+static size_t g_slab_large_bytes;
+static uint64_t g_slab_large_allocs;
+
+/* Next-command model for predictive loading.  It learns from the shell's
+   history whether or not the engine is running, and like the slabs it
+   lasts for the life of the process. */
+static struct {
+    predict_state_t *states;
+    uint64_t last;               /* hash of the last observed command */
+    uint64_t observed;
+    uint64_t predicted;
+    pthread_mutex_t lock;
+} g_predict = { NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
 
 /* Forward declarations */
 static int optimize_response_caching(void *data);
@@ -94,55 +207,64 @@ static int optimize_connection_pooling(void *data);
 static int optimize_request_batching(void *data);
 static int optimize_async_processing(void *data);
 static int optimize_memory_pooling(void *data);
+static int optimize_predictive_loading(void *data);
+static int optimize_compression(void *data);
 static void *worker_thread(void *arg);
+static int pool_start(void);
+static void optimize_atfork_child(void);
+static int slab_class_of(size_t size);
+int anbs_optimize_register_strategies(void);
+void anbs_optimize_cleanup(void);
+void *anbs_optimize_malloc(size_t size);
+void *anbs_optimize_calloc(size_t count, size_t size);
+void anbs_optimize_free(void *ptr, size_t size);
+char *anbs_optimize_predict(const char *command, double *confidence);
 
 /* Initialize optimization engine */
 int anbs_optimize_init(void) {
+    pthread_mutex_lock(&g_optimizer_init_mutex);
     if (g_optimizer) {
+        pthread_mutex_unlock(&g_optimizer_init_mutex);
         return 0; /* Already initialized */
     }
+    int startup_slot = anbs_startup_enter("ai_core", "optimizer");
 
     g_optimizer = calloc(1, sizeof(optimization_engine_t));
     if (!g_optimizer) {
+        pthread_mutex_unlock(&g_optimizer_init_mutex);
         return -1;
     }
 
     pthread_mutex_init(&g_optimizer->global_mutex, NULL);
     pthread_mutex_init(&g_optimizer->pool_mutex, NULL);
-    pthread_mutex_init(&g_optimizer->memory_mutex, NULL);
-
-    /* Initialize request buffers */
-    for (int i = 0; i < WORKER_THREAD_COUNT; i++) {
-        request_buffer_t *buffer = &g_optimizer->request_buffers[i];
-        pthread_mutex_init(&buffer->mutex, NULL);
-        pthread_cond_init(&buffer->ready_cond, NULL);
-        buffer->state = BUFFER_STATE_EMPTY;
-    }
+    pthread_mutex_init(&g_optimizer->work_mutex, NULL);
+    pthread_mutex_init(&g_optimizer->sched_mutex, NULL);
+    pthread_cond_init(&g_optimizer->work_cond, NULL);
+    pthread_cond_init(&g_optimizer->idle_cond, NULL);
 
     /* Initialize connection pool */
     g_optimizer->pool_size = 20;
     g_optimizer->connection_pool = calloc(g_optimizer->pool_size, sizeof(void*));
 
-    /* Initialize memory pool */
-    g_optimizer->memory_pool_size = 100;
-    g_optimizer->memory_pool = calloc(g_optimizer->memory_pool_size, sizeof(void*));
-    g_optimizer->memory_sizes = calloc(g_optimizer->memory_pool_size, sizeof(size_t));
-
     /* Register optimization strategies */
     anbs_optimize_register_strategies();
 
+    static int hooks_registered = 0;
+    if (!hooks_registered) {
+        pthread_atfork(NULL, NULL, optimize_atfork_child);
+        hooks_registered = 1;
+    }
+    pthread_mutex_unlock(&g_optimizer_init_mutex);
+
     /* Start worker threads */
-    g_optimizer->workers_running = true;
-    for (int i = 0; i < WORKER_THREAD_COUNT; i++) {
-        if (pthread_create(&g_optimizer->worker_threads[i], NULL, worker_thread,
-                          &g_optimizer->request_buffers[i]) != 0) {
-            ANBS_DEBUG_LOG("Failed to create worker thread %d", i);
-            anbs_optimize_cleanup();
-            return -1;
-        }
+    if (pool_start() != 0) {
+        ANBS_DEBUG_LOG("Failed to create optimization workers");
+        anbs_optimize_cleanup();
+        return -1;
     }
 
-    ANBS_DEBUG_LOG("Optimization engine initialized with %d workers", WORKER_THREAD_COUNT);
+    ANBS_DEBUG_LOG("Optimization engine initialized with %d workers", g_optimizer->workers_created);
+    anbs_startup_leave(startup_slot, -1);
     return 0;
 }
 
@@ -159,7 +281,8 @@ int anbs_optimize_register_strategies(void) {
     strategy->type = OPT_TYPE_RESPONSE_CACHING;
     strcpy(strategy->name, "response_caching");
     strategy->enabled = true;
-    strategy->efficiency_gain = 0.85; /* 85% time reduction for cache hits */
+    strategy->with_cost = "optimize:cache_hit";
+    strategy->without_cost = "optimize:cache_miss";
     strategy->optimize_func = optimize_response_caching;
 
     /* Connection pooling optimization */
@@ -167,7 +290,8 @@ int anbs_optimize_register_strategies(void) {
     strategy->type = OPT_TYPE_CONNECTION_POOLING;
     strcpy(strategy->name, "connection_pooling");
     strategy->enabled = true;
-    strategy->efficiency_gain = 0.30; /* 30% time reduction */
+    strategy->with_cost = "optimize:connect_reused";
+    strategy->without_cost = "optimize:connect_fresh";
     strategy->optimize_func = optimize_connection_pooling;
 
     /* Request batching optimization */
@@ -175,7 +299,8 @@ int anbs_optimize_register_strategies(void) {
     strategy->type = OPT_TYPE_REQUEST_BATCHING;
     strcpy(strategy->name, "request_batching");
     strategy->enabled = true;
-    strategy->efficiency_gain = 0.40; /* 40% time reduction for batched requests */
+    strategy->with_cost = "optimize:batch_combined";
+    strategy->without_cost = "optimize:batch_single";
     strategy->optimize_func = optimize_request_batching;
 
     /* Async processing optimization */
@@ -183,7 +308,6 @@ int anbs_optimize_register_strategies(void) {
     strategy->type = OPT_TYPE_ASYNC_PROCESSING;
     strcpy(strategy->name, "async_processing");
     strategy->enabled = true;
-    strategy->efficiency_gain = 0.60; /* 60% perceived time reduction */
     strategy->optimize_func = optimize_async_processing;
 
     /* Memory pooling optimization */
@@ -191,140 +315,467 @@ int anbs_optimize_register_strategies(void) {
     strategy->type = OPT_TYPE_MEMORY_POOLING;
     strcpy(strategy->name, "memory_pooling");
     strategy->enabled = true;
-    strategy->efficiency_gain = 0.15; /* 15% time reduction */
     strategy->optimize_func = optimize_memory_pooling;
 
+    /* Predictive loading optimization */
+    strategy = &g_optimizer->strategies[g_optimizer->strategy_count++];
+    strategy->type = OPT_TYPE_PREDICTIVE_LOADING;
+    strcpy(strategy->name, "predictive_loading");
+    strategy->enabled = true;
+    strategy->optimize_func = optimize_predictive_loading;
+
+    /* Compression optimization */
+    strategy = &g_optimizer->strategies[g_optimizer->strategy_count++];
+    strategy->type = OPT_TYPE_COMPRESSION;
+    strcpy(strategy->name, "compression");
+    strategy->enabled = true;
+    strategy->optimize_func = optimize_compression;
+
     pthread_mutex_unlock(&g_optimizer->global_mutex);
 
     ANBS_DEBUG_LOG("Registered %d optimization strategies", g_optimizer->strategy_count);
     return 0;
 }
 
-/* Submit request for optimization */
-int anbs_optimize_request(const char *command, const char *context, int priority,
-                         int (*callback)(const char *response, void *data), void *callback_data) {
-    if (!g_optimizer || !command) {
+/* Push TASK on the bottom of deque D; only its worker calls this */
+static int deque_push(pool_deque_t *d, pool_task_t *task) {
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+    if (bottom - top >= POOL_DEQUE_SIZE) {
+        return -1; /* Full */
+    }
+    __atomic_store_n(&d->tasks[bottom & (POOL_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Pop the newest task of deque D; only its worker calls this */
+static pool_task_t *deque_pop(pool_deque_t *d) {
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL; /* Empty */
+    }
+
+    pool_task_t *task = __atomic_load_n(&d->tasks[bottom & (POOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        /* Last task: race the thieves for it */
+        if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/* Take the oldest task of deque D from another worker, or NULL */
+static pool_task_t *deque_steal(pool_deque_t *d) {
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    pool_task_t *task = __atomic_load_n(&d->tasks[top & (POOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL; /* Lost the race */
+    }
+    return task;
+}
+
+/* Find a task for worker SELF: its own deque first, then the submission
+   queue (moving a few more onto its deque for others to steal), then the
+   other workers' deques */
+static pool_task_t *pool_find_work(int self) {
+    pool_deque_t *own = &g_optimizer->deques[self];
+    pool_task_t *task = deque_pop(own);
+
+    if (task) {
+        return task;
+    }
+
+    if (__atomic_load_n(&g_optimizer->inject_head, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&g_optimizer->work_mutex);
+        task = g_optimizer->inject_head;
+        if (task) {
+            __atomic_store_n(&g_optimizer->inject_head, task->next, __ATOMIC_RELAXED);
+            for (int i = 1; i < POOL_INJECT_BATCH && g_optimizer->inject_head; i++) {
+                pool_task_t *extra = g_optimizer->inject_head;
+                if (deque_push(own, extra) != 0) {
+                    break;
+                }
+                __atomic_store_n(&g_optimizer->inject_head, extra->next, __ATOMIC_RELAXED);
+            }
+            if (!g_optimizer->inject_head) {
+                g_optimizer->inject_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&g_optimizer->work_mutex);
+        if (task) {
+            return task;
+        }
+    }
+
+    for (int i = 1; i < g_optimizer->worker_count; i++) {
+        task = deque_steal(&g_optimizer->deques[(self + i) % g_optimizer->worker_count]);
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/* Queue RUN(ARG) on the pool.  From a worker it lands on that worker's
+   deque, from anywhere else on the submission queue. */
+int anbs_optimize_submit(void (*run)(void *arg), void *arg) {
+    if (!run || anbs_optimize_init() != 0 || pool_start() != 0) {
+        return -1;
+    }
+
+    pool_task_t *task = anbs_optimize_malloc(sizeof(pool_task_t));
+    if (!task) {
         return -1;
     }
+    task->next = NULL;
+    task->run = run;
+    task->arg = arg;
+
+    __atomic_add_fetch(&g_optimizer->active, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_optimizer->queued, 1, __ATOMIC_SEQ_CST);
+    PROBE3(anbs, pool__submit, run, arg, t_worker);
+
+    if (t_worker < 0 || deque_push(&g_optimizer->deques[t_worker], task) != 0) {
+        pthread_mutex_lock(&g_optimizer->work_mutex);
+        if (g_optimizer->inject_tail) {
+            g_optimizer->inject_tail->next = task;
+        } else {
+            __atomic_store_n(&g_optimizer->inject_head, task, __ATOMIC_RELAXED);
+        }
+        g_optimizer->inject_tail = task;
+        pthread_mutex_unlock(&g_optimizer->work_mutex);
+    }
+
+    /* A parking worker counts itself before it rechecks QUEUED, so one of
+       the two sides always sees the other */
+    if (__atomic_load_n(&g_optimizer->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&g_optimizer->work_mutex);
+        pthread_cond_signal(&g_optimizer->work_cond);
+        pthread_mutex_unlock(&g_optimizer->work_mutex);
+    }
+    return 0;
+}
+
+/* Run the strategies over one request */
+static void optimize_run_request(void *arg) {
+    optimization_request_t *request = arg;
+
+    /* Apply optimizations */
+    bool optimized = false;
+    for (int j = 0; j < g_optimizer->strategy_count; j++) {
+        optimization_strategy_t *strategy = &g_optimizer->strategies[j];
+        if (strategy->enabled && strategy->optimize_func) {
+            if (strategy->optimize_func(request) == 0) {
+                __atomic_add_fetch(&strategy->invocation_count, 1, __ATOMIC_RELAXED);
+                optimized = true;
+                break; /* Apply only first matching optimization */
+            }
+        }
+    }
+
+    if (optimized) {
+        __atomic_add_fetch(&g_optimizer->optimized_requests, 1, __ATOMIC_RELAXED);
+    }
+
+    /* Execute callback if provided */
+    if (request->callback) {
+        request->callback("Optimization applied", request->callback_data);
+    }
+    anbs_optimize_free(request, sizeof(optimization_request_t));
+}
+
+/* Milliseconds on the monotonic clock */
+static long long optimize_now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Whether request A is due before B */
+static bool request_before(const optimization_request_t *a, const optimization_request_t *b) {
+    return a->deadline_ms != b->deadline_ms ? a->deadline_ms < b->deadline_ms : a->seq < b->seq;
+}
+
+static void queue_sift_up(request_queue_t *queue, int i) {
+    while (i > 0 && request_before(queue->heap[i], queue->heap[(i - 1) / 2])) {
+        optimization_request_t *parent = queue->heap[(i - 1) / 2];
+        queue->heap[(i - 1) / 2] = queue->heap[i];
+        queue->heap[i] = parent;
+        i = (i - 1) / 2;
+    }
+}
+
+static void queue_sift_down(request_queue_t *queue, int i) {
+    for (;;) {
+        int first = i, child = 2 * i + 1;
+        if (child < queue->count && request_before(queue->heap[child], queue->heap[first])) {
+            first = child;
+        }
+        if (child + 1 < queue->count && request_before(queue->heap[child + 1], queue->heap[first])) {
+            first = child + 1;
+        }
+        if (first == i) {
+            return;
+        }
+        optimization_request_t *swap = queue->heap[first];
+        queue->heap[first] = queue->heap[i];
+        queue->heap[i] = swap;
+        i = first;
+    }
+}
 
-    /* Find least loaded buffer */
-    int target_buffer = 0;
-    int min_count = g_optimizer->request_buffers[0].count;
+/* Queue REQUEST; the caller holds sched_mutex */
+static int queue_push(request_queue_t *queue, optimization_request_t *request) {
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 64;
+        optimization_request_t **heap = realloc(queue->heap, capacity * sizeof(*heap));
+        if (!heap) {
+            return -1;
+        }
+        queue->heap = heap;
+        queue->capacity = capacity;
+    }
+    queue->heap[queue->count++] = request;
+    queue_sift_up(queue, queue->count - 1);
+    return 0;
+}
 
-    for (int i = 1; i < WORKER_THREAD_COUNT; i++) {
-        if (g_optimizer->request_buffers[i].count < min_count) {
-            min_count = g_optimizer->request_buffers[i].count;
-            target_buffer = i;
+/* Take REQUEST back out of its queue; the caller holds sched_mutex */
+static void queue_remove(request_queue_t *queue, optimization_request_t *request) {
+    for (int i = 0; i < queue->count; i++) {
+        if (queue->heap[i] == request) {
+            queue->heap[i] = queue->heap[--queue->count];
+            if (i < queue->count) {
+                queue_sift_down(queue, i);
+                queue_sift_up(queue, i);
+            }
+            return;
         }
     }
+}
+
+/* Dispatch task: run the most urgent queued request.  Interactive requests
+   go before normal ones and those before background work; within a
+   priority the earliest deadline wins.  Requests already past their
+   deadline are shed, their callback getting a NULL response. */
+static void optimize_dispatch(void *arg) {
+    optimization_request_t *request = NULL;
+    long long now = optimize_now_ms();
+
+    (void)arg;
+
+    while (!request) {
+        pthread_mutex_lock(&g_optimizer->sched_mutex);
+        for (int c = 0; c < OPT_CLASSES && !request; c++) {
+            request_queue_t *queue = &g_optimizer->queues[c];
+            if (queue->count > 0) {
+                request = queue->heap[0];
+                queue->heap[0] = queue->heap[--queue->count];
+                queue_sift_down(queue, 0);
+            }
+        }
+        pthread_mutex_unlock(&g_optimizer->sched_mutex);
 
-    request_buffer_t *buffer = &g_optimizer->request_buffers[target_buffer];
+        if (!request) {
+            return; /* Another dispatch shed ours */
+        }
+        if (request->deadline_ms >= now) {
+            break;
+        }
+
+        __atomic_add_fetch(&g_optimizer->shed_requests, 1, __ATOMIC_RELAXED);
+        ANBS_DEBUG_LOG("Optimization request missed its deadline: %.50s...", request->command);
+        if (request->callback) {
+            request->callback(NULL, request->callback_data);
+        }
+        anbs_optimize_free(request, sizeof(optimization_request_t));
+        request = NULL;
+    }
 
-    pthread_mutex_lock(&buffer->mutex);
+    optimize_run_request(request);
+}
 
-    if (buffer->count >= OPTIMIZATION_BUFFER_SIZE) {
-        pthread_mutex_unlock(&buffer->mutex);
-        return -1; /* Buffer full */
+/* Submit request for optimization with PRIORITY 0 (interactive), 1
+   (normal) or 2 (background), to start within DEADLINE_MS milliseconds
+   (0 for no deadline) */
+int anbs_optimize_request_within(const char *command, const char *context, int priority, long deadline_ms,
+                                 int (*callback)(const char *response, void *data), void *callback_data) {
+    if (!g_optimizer || !command) {
+        return -1;
     }
 
-    /* Add request to buffer */
-    optimization_request_t *request = &buffer->requests[buffer->count++];
+    if (__atomic_load_n(&g_optimizer->active, __ATOMIC_RELAXED) >= MAX_PENDING_REQUESTS) {
+        return -1; /* Queue full */
+    }
+
+    optimization_request_t *request = anbs_optimize_calloc(1, sizeof(optimization_request_t));
+    if (!request) {
+        return -1;
+    }
     strncpy(request->command, command, sizeof(request->command) - 1);
     if (context) {
         strncpy(request->context, context, sizeof(request->context) - 1);
-    } else {
-        request->context[0] = '\0';
     }
     request->timestamp = time(NULL);
-    request->priority = priority;
+    request->priority = priority < 0 ? 0 : priority >= OPT_CLASSES ? OPT_CLASSES - 1 : priority;
+    request->deadline_ms = deadline_ms > 0 ? optimize_now_ms() + deadline_ms : LLONG_MAX;
     request->callback = callback;
     request->callback_data = callback_data;
 
-    /* Signal worker if buffer is ready for processing */
-    if (buffer->count >= BATCH_SIZE || buffer->state == BUFFER_STATE_EMPTY) {
-        buffer->state = BUFFER_STATE_READY;
-        pthread_cond_signal(&buffer->ready_cond);
+    request_queue_t *queue = &g_optimizer->queues[request->priority];
+    pthread_mutex_lock(&g_optimizer->sched_mutex);
+    request->seq = g_optimizer->request_seq++;
+    int queued = queue_push(queue, request);
+    pthread_mutex_unlock(&g_optimizer->sched_mutex);
+
+    if (queued != 0 || anbs_optimize_submit(optimize_dispatch, NULL) != 0) {
+        if (queued == 0) {
+            pthread_mutex_lock(&g_optimizer->sched_mutex);
+            queue_remove(queue, request);
+            pthread_mutex_unlock(&g_optimizer->sched_mutex);
+        }
+        anbs_optimize_free(request, sizeof(optimization_request_t));
+        return -1;
     }
 
-    g_optimizer->total_requests++;
-
-    pthread_mutex_unlock(&buffer->mutex);
+    __atomic_add_fetch(&g_optimizer->total_requests, 1, __ATOMIC_RELAXED);
 
-    ANBS_DEBUG_LOG("Optimization request queued: %.50s... (buffer %d, count %d)",
-                   command, target_buffer, buffer->count);
+    ANBS_DEBUG_LOG("Optimization request queued: %.50s...", command);
     return 0;
 }
 
-/* Worker thread function */
-static void *worker_thread(void *arg) {
-    request_buffer_t *buffer = (request_buffer_t*)arg;
+/* Submit request for optimization */
+int anbs_optimize_request(const char *command, const char *context, int priority,
+                         int (*callback)(const char *response, void *data), void *callback_data) {
+    return anbs_optimize_request_within(command, context, priority, 0, callback, callback_data);
+}
 
-    while (g_optimizer && g_optimizer->workers_running) {
-        pthread_mutex_lock(&buffer->mutex);
+/* Worker thread function: run tasks until stopped and drained, parking
+   when there is nothing to take */
+static void *worker_thread(void *arg) {
+    int self = (int)(intptr_t)arg;
 
-        /* Wait for work */
-        while (buffer->state != BUFFER_STATE_READY && g_optimizer->workers_running) {
-            pthread_cond_wait(&buffer->ready_cond, &buffer->mutex);
-        }
+    t_worker = self;
 
-        if (!g_optimizer->workers_running) {
-            pthread_mutex_unlock(&buffer->mutex);
-            break;
+    for (;;) {
+        pool_task_t *task = NULL;
+        for (int spin = 0; spin < POOL_SPIN_ROUNDS && !task; spin++) {
+            task = pool_find_work(self);
+            if (!task && __atomic_load_n(&g_optimizer->queued, __ATOMIC_SEQ_CST) <= 0) {
+                break;
+            }
         }
 
-        buffer->state = BUFFER_STATE_PROCESSING;
-
-        /* Process all requests in buffer */
-        for (int i = 0; i < buffer->count; i++) {
-            optimization_request_t *request = &buffer->requests[i];
+        if (task) {
+            __atomic_sub_fetch(&g_optimizer->queued, 1, __ATOMIC_SEQ_CST);
+            PROBE3(anbs, pool__run, task->run, task->arg, self);
+            task->run(task->arg);
+            anbs_optimize_free(task, sizeof(pool_task_t));
 
-            struct timeval start_time;
-            gettimeofday(&start_time, NULL);
+            if (__atomic_sub_fetch(&g_optimizer->active, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&g_optimizer->work_mutex);
+                pthread_cond_broadcast(&g_optimizer->idle_cond);
+                pthread_mutex_unlock(&g_optimizer->work_mutex);
+            }
+            continue;
+        }
 
-            /* Apply optimizations */
-            bool optimized = false;
-            for (int j = 0; j < g_optimizer->strategy_count; j++) {
-                optimization_strategy_t *strategy = &g_optimizer->strategies[j];
-                if (strategy->enabled && strategy->optimize_func) {
-                    if (strategy->optimize_func(request) == 0) {
-                        strategy->invocation_count++;
-                        optimized = true;
+        pthread_mutex_lock(&g_optimizer->work_mutex);
+        __atomic_add_fetch(&g_optimizer->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&g_optimizer->queued, __ATOMIC_SEQ_CST) <= 0 && g_optimizer->workers_running) {
+            pthread_cond_wait(&g_optimizer->work_cond, &g_optimizer->work_mutex);
+        }
+        __atomic_sub_fetch(&g_optimizer->sleepers, 1, __ATOMIC_SEQ_CST);
+        bool done = !g_optimizer->workers_running &&
+                    __atomic_load_n(&g_optimizer->queued, __ATOMIC_SEQ_CST) <= 0;
+        pthread_mutex_unlock(&g_optimizer->work_mutex);
 
-                        struct timeval end_time;
-                        gettimeofday(&end_time, NULL);
-                        double elapsed_ms = (end_time.tv_sec - start_time.tv_sec) * 1000.0 +
-                                          (end_time.tv_usec - start_time.tv_usec) / 1000.0;
+        if (done) {
+            break;
+        }
+    }
 
-                        double time_saved = elapsed_ms * strategy->efficiency_gain;
-                        strategy->total_time_saved_ms += time_saved;
-                        g_optimizer->total_optimization_time_ms += time_saved;
+    return NULL;
+}
 
-                        break; /* Apply only first matching optimization */
-                    }
-                }
-            }
+/* Start the workers if they aren't running: one per CPU, or
+   ANBS_THREAD_POOL_SIZE */
+static int pool_start(void) {
+    if (__atomic_load_n(&g_optimizer->workers_started, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
 
-            if (optimized) {
-                g_optimizer->optimized_requests++;
-            }
+    pthread_mutex_lock(&g_optimizer->work_mutex);
+    if (!g_optimizer->workers_started) {
+        const char *size = getenv("ANBS_THREAD_POOL_SIZE");
+        long count = size && atol(size) > 0 ? atol(size) : sysconf(_SC_NPROCESSORS_ONLN);
+        count = count < 1 ? 1 : count > POOL_MAX_WORKERS ? POOL_MAX_WORKERS : count;
 
-            /* Execute callback if provided */
-            if (request->callback) {
-                request->callback("Optimization applied", request->callback_data);
+        if (!g_optimizer->deques) {
+            g_optimizer->deques = aligned_alloc(64, count * sizeof(pool_deque_t));
+            g_optimizer->worker_threads = calloc(count, sizeof(pthread_t));
+            g_optimizer->worker_count = (int)count;
+        }
+        if (g_optimizer->deques && g_optimizer->worker_threads) {
+            memset(g_optimizer->deques, 0, g_optimizer->worker_count * sizeof(pool_deque_t));
+            g_optimizer->workers_running = true;
+            g_optimizer->workers_created = 0;
+            while (g_optimizer->workers_created < g_optimizer->worker_count &&
+                   pthread_create(&g_optimizer->worker_threads[g_optimizer->workers_created], NULL,
+                                  worker_thread, (void *)(intptr_t)g_optimizer->workers_created) == 0) {
+                g_optimizer->workers_created++;
             }
         }
+        if (g_optimizer->workers_created > 0) {
+            __atomic_store_n(&g_optimizer->workers_started, 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&g_optimizer->work_mutex);
 
-        /* Reset buffer */
-        buffer->count = 0;
-        buffer->state = BUFFER_STATE_EMPTY;
-
-        pthread_mutex_unlock(&buffer->mutex);
+    return g_optimizer->workers_created > 0 ? 0 : -1;
+}
 
-        /* Small delay to prevent busy waiting */
-        usleep(1000); /* 1ms */
+/* A forked child has none of the parent's workers and leaves its queued
+   work to the parent; the pool restarts on the child's first submit */
+static void optimize_atfork_child(void) {
+    pthread_mutex_init(&g_predict.lock, NULL);
+    if (!g_optimizer) {
+        return;
     }
 
-    return NULL;
+    pthread_mutex_init(&g_optimizer->global_mutex, NULL);
+    pthread_mutex_init(&g_optimizer->pool_mutex, NULL);
+    pthread_mutex_init(&g_optimizer->work_mutex, NULL);
+    pthread_mutex_init(&g_optimizer->sched_mutex, NULL);
+    pthread_cond_init(&g_optimizer->work_cond, NULL);
+    pthread_cond_init(&g_optimizer->idle_cond, NULL);
+    g_optimizer->workers_started = 0;
+    g_optimizer->workers_created = 0;
+    g_optimizer->workers_running = false;
+    g_optimizer->inject_head = g_optimizer->inject_tail = NULL;
+    g_optimizer->queued = 0;
+    g_optimizer->active = 0;
+    g_optimizer->sleepers = 0;
+    t_worker = -1;
 }
 
 /* Response caching optimization */
@@ -350,30 +801,41 @@ static int optimize_response_caching(void *data) {
 /* Connection pooling optimization */
 static int optimize_connection_pooling(void *data) {
     optimization_request_t *request = (optimization_request_t*)data;
+    extern int anbs_ai_pool_get_stats(int *pooled_handles, int *busy_handles,
+                                      unsigned long *reuses, unsigned long *creates);
+    int pooled = 0, busy = 0;
+
+    if (!strstr(request->command, "@vertex") && !strstr(request->command, "@memory") &&
+        !strstr(request->command, "@analyze")) {
+        return -1; /* Not a network request */
+    }
+
+    /* Mirror the live curl pool held by the AI builtins */
+    anbs_ai_pool_get_stats(&pooled, &busy, NULL, NULL);
 
-    /* Check if we can reuse an existing connection */
     pthread_mutex_lock(&g_optimizer->pool_mutex);
+    g_optimizer->active_connections = busy;
 
-    if (g_optimizer->active_connections < g_optimizer->pool_size) {
-        g_optimizer->active_connections++;
+    if (pooled > busy) {
         pthread_mutex_unlock(&g_optimizer->pool_mutex);
 
-        ANBS_DEBUG_LOG("Connection pool optimization applied for: %.50s...", request->command);
-        return 0; /* Optimization applied */
+        ANBS_DEBUG_LOG("Connection pool optimization applied for: %.50s... (%d warm)",
+                       request->command, pooled - busy);
+        return 0; /* A warm connection will be reused */
     }
 
     pthread_mutex_unlock(&g_optimizer->pool_mutex);
-    return -1; /* No connections available */
+    return -1; /* Request will open a new connection */
 }
 
 /* Request batching optimization */
 static int optimize_request_batching(void *data) {
     optimization_request_t *request = (optimization_request_t*)data;
 
-    /* Check if this request can be batched with similar requests */
-    if (strstr(request->command, "@vertex") || strstr(request->command, "@memory")) {
+    /* Only @vertex --batch runs are multiplexed on a curl multi handle */
+    if (strstr(request->command, "@vertex") && strstr(request->command, "--batch")) {
         ANBS_DEBUG_LOG("Batching optimization applied for: %.50s...", request->command);
-        return 0; /* Can be batched */
+        return 0; /* Dispatched concurrently */
     }
 
     return -1; /* Cannot batch this request */
@@ -392,26 +854,49 @@ static int optimize_async_processing(void *data) {
     return -1; /* Must process synchronously */
 }
 
-/* Memory pooling optimization */
+/* Memory pooling optimization: the request's buffers can come straight
+   from this thread's slab cache */
 static int optimize_memory_pooling(void *data) {
     optimization_request_t *request = (optimization_request_t*)data;
+    int size_class = slab_class_of(sizeof(optimization_request_t));
 
-    pthread_mutex_lock(&g_optimizer->memory_mutex);
+    if (t_slab_cache && t_slab_cache[size_class].count > 0) {
+        ANBS_DEBUG_LOG("Memory pool optimization applied for: %.50s...", request->command);
+        return 0; /* Memory reused */
+    }
 
-    /* Try to reuse memory from pool */
-    if (g_optimizer->memory_pool_index > 0) {
-        g_optimizer->memory_pool_index--;
-        void *reused_memory = g_optimizer->memory_pool[g_optimizer->memory_pool_index];
+    return -1; /* No memory available for reuse */
+}
 
-        if (reused_memory) {
-            pthread_mutex_unlock(&g_optimizer->memory_mutex);
-            ANBS_DEBUG_LOG("Memory pool optimization applied for: %.50s...", request->command);
-            return 0; /* Memory reused */
-        }
+/* Predictive loading optimization: the command is usually followed by one
+   the model can name, so that one can be fetched ahead of time */
+static int optimize_predictive_loading(void *data) {
+    optimization_request_t *request = (optimization_request_t*)data;
+    double confidence = 0.0;
+    char *next = anbs_optimize_predict(request->command, &confidence);
+
+    if (next) {
+        ANBS_DEBUG_LOG("Predictive loading applied for: %.50s... (next %.0f%%: %.50s...)",
+                       request->command, confidence * 100.0, next);
+        free(next);
+        return 0; /* Next command can be preloaded */
     }
 
-    pthread_mutex_unlock(&g_optimizer->memory_mutex);
-    return -1; /* No memory available for reuse */
+    return -1; /* No confident prediction */
+}
+
+/* Compression optimization: AI builtins offer gzip, br and zstd for
+   responses, so a provider answer crosses the wire compressed */
+static int optimize_compression(void *data) {
+    optimization_request_t *request = (optimization_request_t*)data;
+
+    if (strstr(request->command, "@vertex") || strstr(request->command, "@memory") ||
+        strstr(request->command, "@analyze")) {
+        ANBS_DEBUG_LOG("Compression optimization applied for: %.50s...", request->command);
+        return 0; /* Response may arrive compressed */
+    }
+
+    return -1; /* Not a network request */
 }
 
 /* Get optimization statistics */
@@ -431,19 +916,71 @@ int anbs_optimize_get_stats(char **stats_json) {
     double optimization_rate = g_optimizer->total_requests > 0 ?
                               (double)g_optimizer->optimized_requests / g_optimizer->total_requests * 100.0 : 0.0;
 
+    /* Savings are measured: each optimized operation is credited with the
+       difference between the median costs without and with the strategy */
+    extern double anbs_metrics_get_cost_median(const char *name, uint64_t *total);
+    double with_ms[MAX_OPTIMIZATIONS], without_ms[MAX_OPTIMIZATIONS], saved_ms[MAX_OPTIMIZATIONS];
+    uint64_t measured[MAX_OPTIMIZATIONS];
+    double total_saved_ms = 0.0;
+
+    for (int i = 0; i < g_optimizer->strategy_count; i++) {
+        optimization_strategy_t *strategy = &g_optimizer->strategies[i];
+        uint64_t unoptimized = 0;
+
+        with_ms[i] = without_ms[i] = -1.0;
+        measured[i] = 0;
+        saved_ms[i] = 0.0;
+        if (strategy->with_cost && strategy->without_cost) {
+            with_ms[i] = anbs_metrics_get_cost_median(strategy->with_cost, &measured[i]);
+            without_ms[i] = anbs_metrics_get_cost_median(strategy->without_cost, &unoptimized);
+        }
+        if (with_ms[i] >= 0.0 && without_ms[i] >= 0.0) {
+            saved_ms[i] = measured[i] * (without_ms[i] - with_ms[i]);
+            total_saved_ms += saved_ms[i];
+        }
+    }
+
     int offset = snprintf(stats, 4096,
                          "{"
                          "\"total_requests\": %lu,"
                          "\"optimized_requests\": %lu,"
+                         "\"shed_requests\": %lu,"
                          "\"optimization_rate_percent\": %.2f,"
                          "\"total_time_saved_ms\": %.2f,"
-                         "\"worker_threads\": %d,"
-                         "\"strategies\": [",
+                         "\"worker_threads\": %d,",
                          g_optimizer->total_requests,
                          g_optimizer->optimized_requests,
+                         g_optimizer->shed_requests,
                          optimization_rate,
-                         g_optimizer->total_optimization_time_ms,
-                         WORKER_THREAD_COUNT);
+                         total_saved_ms,
+                         g_optimizer->workers_created);
+
+    /* Add allocator statistics */
+    uint64_t slab_allocs = 0, slab_frees = 0;
+    size_t slab_bytes = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_lock(&g_slab[i].lock);
+        slab_allocs += g_slab[i].allocs;
+        slab_frees += g_slab[i].frees;
+        slab_bytes += g_slab[i].slab_bytes;
+        pthread_mutex_unlock(&g_slab[i].lock);
+    }
+    offset += snprintf(stats + offset, 4096 - offset,
+                      "\"slab_bytes\": %zu,"
+                      "\"slab_allocations\": %lu,"
+                      "\"slab_blocks_in_use\": %ld,"
+                      "\"large_allocations\": %lu,"
+                      "\"large_bytes_in_use\": %zu,"
+                      "\"observed_commands\": %lu,"
+                      "\"predictions\": %lu,"
+                      "\"strategies\": [",
+                      slab_bytes,
+                      slab_allocs,
+                      (long)(slab_allocs - slab_frees),
+                      __atomic_load_n(&g_slab_large_allocs, __ATOMIC_RELAXED),
+                      __atomic_load_n(&g_slab_large_bytes, __ATOMIC_RELAXED),
+                      __atomic_load_n(&g_predict.observed, __ATOMIC_RELAXED),
+                      __atomic_load_n(&g_predict.predicted, __ATOMIC_RELAXED));
 
     /* Add strategy statistics */
     for (int i = 0; i < g_optimizer->strategy_count; i++) {
@@ -453,16 +990,22 @@ int anbs_optimize_get_stats(char **stats_json) {
                           "%s{"
                           "\"name\": \"%s\","
                           "\"enabled\": %s,"
-                          "\"efficiency_gain\": %.2f,"
                           "\"invocation_count\": %lu,"
+                          "\"measured_operations\": %lu,"
+                          "\"median_cost_ms\": %.3f,"
+                          "\"median_cost_without_ms\": %.3f,"
+                          "\"efficiency_gain\": %.2f,"
                           "\"total_time_saved_ms\": %.2f"
                           "}",
                           i > 0 ? "," : "",
                           strategy->name,
                           strategy->enabled ? "true" : "false",
-                          strategy->efficiency_gain,
                           strategy->invocation_count,
-                          strategy->total_time_saved_ms);
+                          measured[i],
+                          with_ms[i],
+                          without_ms[i],
+                          without_ms[i] > 0.0 && with_ms[i] >= 0.0 ? 1.0 - with_ms[i] / without_ms[i] : 0.0,
+                          saved_ms[i]);
     }
 
     offset += snprintf(stats + offset, 4096 - offset, "]}");
@@ -473,6 +1016,56 @@ int anbs_optimize_get_stats(char **stats_json) {
     return 0;
 }
 
+/* Write the optimizer's OpenMetrics families to OUT */
+int anbs_optimize_export_metrics(FILE *out) {
+    extern void anbs_metrics_export_family(FILE *out, const char *name, const char *type, const char *help);
+    extern void anbs_metrics_export_sample(FILE *out, const char *name, const char *labels, double value);
+    char labels[128];
+    size_t slab_bytes = 0;
+
+    if (!g_optimizer || !out) {
+        return -1;
+    }
+
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_lock(&g_slab[i].lock);
+        slab_bytes += g_slab[i].slab_bytes;
+        pthread_mutex_unlock(&g_slab[i].lock);
+    }
+
+    pthread_mutex_lock(&g_optimizer->global_mutex);
+
+    anbs_metrics_export_family(out, "anbs_optimizer_requests", "counter", "Requests the optimizer handled, by outcome");
+    anbs_metrics_export_sample(out, "anbs_optimizer_requests_total", "outcome=\"optimized\"",
+                               (double)g_optimizer->optimized_requests);
+    anbs_metrics_export_sample(out, "anbs_optimizer_requests_total", "outcome=\"shed\"",
+                               (double)g_optimizer->shed_requests);
+    anbs_metrics_export_sample(out, "anbs_optimizer_requests_total", "outcome=\"plain\"",
+                               (double)(g_optimizer->total_requests - g_optimizer->optimized_requests));
+
+    anbs_metrics_export_family(out, "anbs_optimizer_strategy_invocations", "counter", "Times each strategy was applied");
+    for (int i = 0; i < g_optimizer->strategy_count; i++) {
+        snprintf(labels, sizeof(labels), "strategy=\"%s\"", g_optimizer->strategies[i].name);
+        anbs_metrics_export_sample(out, "anbs_optimizer_strategy_invocations_total", labels,
+                                   (double)g_optimizer->strategies[i].invocation_count);
+    }
+
+    anbs_metrics_export_family(out, "anbs_optimizer_queued", "gauge", "Tasks waiting for a pool worker");
+    anbs_metrics_export_sample(out, "anbs_optimizer_queued", NULL,
+                               (double)__atomic_load_n(&g_optimizer->queued, __ATOMIC_RELAXED));
+    anbs_metrics_export_family(out, "anbs_optimizer_workers", "gauge", "Pool worker threads");
+    anbs_metrics_export_sample(out, "anbs_optimizer_workers", NULL, g_optimizer->workers_created);
+
+    pthread_mutex_unlock(&g_optimizer->global_mutex);
+
+    anbs_metrics_export_family(out, "anbs_optimizer_slab_bytes", "gauge", "Bytes held by the slab allocator");
+    anbs_metrics_export_sample(out, "anbs_optimizer_slab_bytes", NULL, (double)slab_bytes);
+    anbs_metrics_export_family(out, "anbs_optimizer_predictions", "counter", "Follow-up queries prefetched");
+    anbs_metrics_export_sample(out, "anbs_optimizer_predictions_total", NULL,
+                               (double)__atomic_load_n(&g_predict.predicted, __ATOMIC_RELAXED));
+    return 0;
+}
+
 /* Enable/disable specific optimization */
 int anbs_optimize_set_strategy_enabled(const char *strategy_name, bool enabled) {
     if (!g_optimizer || !strategy_name) {
@@ -497,79 +1090,417 @@ int anbs_optimize_set_strategy_enabled(const char *strategy_name, bool enabled)
     return -1; /* Strategy not found */
 }
 
-/* Allocate memory from pool */
-void *anbs_optimize_malloc(size_t size) {
-    if (!g_optimizer) {
-        return malloc(size);
+/* Smallest size class holding SIZE bytes, or -1 when it needs malloc */
+static int slab_class_of(size_t size) {
+    int size_class = 0;
+
+    while (size_class < SLAB_CLASSES && ((size_t)16 << size_class) < size) {
+        size_class++;
+    }
+    return size_class < SLAB_CLASSES ? size_class : -1;
+}
+
+/* Hand a thread's cached blocks back to the depot when it exits */
+static void slab_cache_release(void *arg) {
+    slab_cache_t *cache = arg;
+
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        slab_free_t *magazine = NULL;
+        for (int j = 0; j < cache[i].count; j++) {
+            slab_free_t *block = cache[i].blocks[j];
+            block->next = magazine;
+            magazine = block;
+        }
+
+        pthread_mutex_lock(&g_slab[i].lock);
+        if (magazine) {
+            magazine->rounds = cache[i].count;
+            magazine->next_magazine = g_slab[i].magazines;
+            g_slab[i].magazines = magazine;
+        }
+        g_slab[i].allocs += cache[i].allocs;
+        g_slab[i].frees += cache[i].frees;
+        pthread_mutex_unlock(&g_slab[i].lock);
     }
+    free(cache);
+    t_slab_cache = NULL;
+}
 
-    pthread_mutex_lock(&g_optimizer->memory_mutex);
+/* Hold every depot across fork so the child's are consistent */
+static void slab_atfork_prepare(void) {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_lock(&g_slab[i].lock);
+    }
+}
 
-    /* Try to find reusable memory */
-    for (int i = 0; i < g_optimizer->memory_pool_index; i++) {
-        if (g_optimizer->memory_sizes[i] >= size) {
-            void *memory = g_optimizer->memory_pool[i];
+static void slab_atfork_release(void) {
+    for (int i = SLAB_CLASSES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&g_slab[i].lock);
+    }
+}
 
-            /* Remove from pool */
-            for (int j = i; j < g_optimizer->memory_pool_index - 1; j++) {
-                g_optimizer->memory_pool[j] = g_optimizer->memory_pool[j + 1];
-                g_optimizer->memory_sizes[j] = g_optimizer->memory_sizes[j + 1];
+static void slab_init_once(void) {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        size_t block_size = sizeof(slab_header_t) + ((size_t)16 << i);
+        size_t rounds = SLAB_MAGAZINE_BYTES / block_size;
+
+        pthread_mutex_init(&g_slab[i].lock, NULL);
+        g_slab[i].block_size = block_size;
+        g_slab[i].rounds = rounds < 2 ? 2 : rounds > SLAB_MAGAZINE_MAX ? SLAB_MAGAZINE_MAX : (int)rounds;
+    }
+    pthread_key_create(&g_slab_key, slab_cache_release);
+    pthread_atfork(slab_atfork_prepare, slab_atfork_release, slab_atfork_release);
+}
+
+/* The calling thread's caches, created on first use */
+static slab_cache_t *slab_cache(void) {
+    if (!t_slab_cache) {
+        pthread_once(&g_slab_once, slab_init_once);
+        t_slab_cache = calloc(SLAB_CLASSES, sizeof(slab_cache_t));
+        if (t_slab_cache) {
+            pthread_setspecific(g_slab_key, t_slab_cache);
+        }
+    }
+    return t_slab_cache;
+}
+
+/* Load a magazine into an empty CACHE of SIZE_CLASS, carving a fresh slab
+   into magazines when the depot has none */
+static int slab_refill(int size_class, slab_cache_t *cache) {
+    slab_class_t *depot = &g_slab[size_class];
+    slab_free_t *magazine;
+
+    pthread_mutex_lock(&depot->lock);
+    depot->allocs += cache->allocs;
+    depot->frees += cache->frees;
+    cache->allocs = cache->frees = 0;
+
+    magazine = depot->magazines;
+    if (magazine) {
+        depot->magazines = magazine->next_magazine;
+    } else {
+        size_t magazine_bytes = depot->block_size * depot->rounds;
+        size_t bytes = magazine_bytes > SLAB_BYTES ? magazine_bytes : SLAB_BYTES;
+        char *slab = malloc(bytes);
+        if (!slab) {
+            pthread_mutex_unlock(&depot->lock);
+            return -1;
+        }
+        depot->slab_bytes += bytes;
+
+        /* Chain the blocks into magazines; the first is returned */
+        size_t blocks = bytes / depot->block_size;
+        for (size_t first = 0; first < blocks; first += depot->rounds) {
+            size_t rounds = blocks - first < (size_t)depot->rounds ? blocks - first : (size_t)depot->rounds;
+            slab_free_t *chain = NULL;
+            for (size_t j = first + rounds; j > first; j--) {
+                slab_free_t *block = (slab_free_t *)(slab + (j - 1) * depot->block_size);
+                block->next = chain;
+                chain = block;
             }
-            g_optimizer->memory_pool_index--;
+            chain->rounds = rounds;
+            chain->next_magazine = depot->magazines;
+            depot->magazines = chain;
+        }
+        magazine = depot->magazines;
+        depot->magazines = magazine->next_magazine;
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    for (slab_free_t *block = magazine; block; block = block->next) {
+        cache->blocks[cache->count++] = block;
+    }
+    return 0;
+}
 
-            pthread_mutex_unlock(&g_optimizer->memory_mutex);
-            return memory;
+/* Move one magazine of blocks from a full CACHE to the depot */
+static void slab_flush(int size_class, slab_cache_t *cache) {
+    slab_class_t *depot = &g_slab[size_class];
+    slab_free_t *magazine = NULL;
+
+    for (int i = 0; i < depot->rounds; i++) {
+        slab_free_t *block = cache->blocks[--cache->count];
+        block->next = magazine;
+        magazine = block;
+    }
+    magazine->rounds = depot->rounds;
+
+    pthread_mutex_lock(&depot->lock);
+    magazine->next_magazine = depot->magazines;
+    depot->magazines = magazine;
+    depot->allocs += cache->allocs;
+    depot->frees += cache->frees;
+    cache->allocs = cache->frees = 0;
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/* Allocate memory from the size-class slabs.  Blocks come from the calling
+   thread's cache, which trades whole magazines with a per-class depot. */
+void *anbs_optimize_malloc(size_t size) {
+    int size_class = slab_class_of(size);
+    slab_cache_t *cache = size_class >= 0 ? slab_cache() : NULL;
+    slab_header_t *header;
+
+    if (!cache) {
+        header = malloc(sizeof(slab_header_t) + size);
+        if (!header) {
+            return NULL;
         }
+        header->size_class = SLAB_LARGE;
+        header->size = size;
+        __atomic_add_fetch(&g_slab_large_allocs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&g_slab_large_bytes, size, __ATOMIC_RELAXED);
+        return header + 1;
+    }
+
+    cache += size_class;
+    if (cache->count == 0 && slab_refill(size_class, cache) != 0) {
+        return NULL;
+    }
+
+    header = cache->blocks[--cache->count];
+    header->size_class = size_class;
+    header->size = size;
+    cache->allocs++;
+    return header + 1;
+}
+
+/* Allocate zeroed memory from the slabs */
+void *anbs_optimize_calloc(size_t count, size_t size) {
+    if (size && count > (size_t)-1 / size) {
+        return NULL;
+    }
+
+    void *ptr = anbs_optimize_malloc(count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+/* Resize a slab allocation, in place while it fits its block */
+void *anbs_optimize_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return anbs_optimize_malloc(size);
     }
 
-    pthread_mutex_unlock(&g_optimizer->memory_mutex);
+    slab_header_t *header = (slab_header_t *)ptr - 1;
+    if (header->size_class != SLAB_LARGE && ((size_t)16 << header->size_class) >= size) {
+        header->size = size;
+        return ptr;
+    }
 
-    /* Allocate new memory */
-    return malloc(size);
+    void *resized = anbs_optimize_malloc(size);
+    if (resized) {
+        memcpy(resized, ptr, header->size < size ? header->size : size);
+        anbs_optimize_free(ptr, header->size);
+    }
+    return resized;
 }
 
-/* Return memory to pool */
+/* Return memory to the slabs.  SIZE is accepted for callers that know it;
+   the block header is what's used. */
 void anbs_optimize_free(void *ptr, size_t size) {
-    if (!g_optimizer || !ptr) {
-        free(ptr);
+    (void)size;
+
+    if (!ptr) {
         return;
     }
 
-    pthread_mutex_lock(&g_optimizer->memory_mutex);
-
-    /* Add to pool if there's space */
-    if (g_optimizer->memory_pool_index < g_optimizer->memory_pool_size) {
-        g_optimizer->memory_pool[g_optimizer->memory_pool_index] = ptr;
-        g_optimizer->memory_sizes[g_optimizer->memory_pool_index] = size;
-        g_optimizer->memory_pool_index++;
+    slab_header_t *header = (slab_header_t *)ptr - 1;
+    if (header->size_class == SLAB_LARGE) {
+        __atomic_sub_fetch(&g_slab_large_bytes, header->size, __ATOMIC_RELAXED);
+        free(header);
+        return;
+    }
 
-        pthread_mutex_unlock(&g_optimizer->memory_mutex);
+    int size_class = header->size_class;
+    slab_cache_t *cache = slab_cache();
+    if (!cache) {
+        /* No cache to take it; give it to the depot alone */
+        slab_free_t *block = (slab_free_t *)header;
+        block->next = NULL;
+        block->rounds = 1;
+        pthread_mutex_lock(&g_slab[size_class].lock);
+        block->next_magazine = g_slab[size_class].magazines;
+        g_slab[size_class].magazines = block;
+        g_slab[size_class].frees++;
+        pthread_mutex_unlock(&g_slab[size_class].lock);
         return;
     }
 
-    pthread_mutex_unlock(&g_optimizer->memory_mutex);
+    cache += size_class;
+    if (cache->count == g_slab[size_class].rounds * 2) {
+        slab_flush(size_class, cache);
+    }
+    cache->blocks[cache->count++] = header;
+    cache->frees++;
+}
+
+/* FNV-1a hash of COMMAND without trailing blanks; never 0 */
+static uint64_t predict_hash(const char *command, size_t *length) {
+    size_t len = strlen(command);
+    uint64_t hash = 14695981039346656037ULL;
 
-    /* Pool full, free normally */
-    free(ptr);
+    while (len > 0 && (command[len - 1] == ' ' || command[len - 1] == '\t' || command[len - 1] == '\n')) {
+        len--;
+    }
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)command[i]) * 1099511628211ULL;
+    }
+    if (length) {
+        *length = len;
+    }
+    return hash ? hash : 1;
 }
 
-/* Flush optimization buffers */
-void anbs_optimize_flush_buffers(void) {
-    if (!g_optimizer) {
+/* Empty a model slot */
+static void predict_state_reset(predict_state_t *state, uint64_t key) {
+    for (int i = 0; i < PREDICT_SUCCESSORS; i++) {
+        free(state->next[i].command);
+    }
+    memset(state, 0, sizeof(*state));
+    state->key = key;
+}
+
+/* Record that COMMAND ran, following the last command observed */
+void anbs_optimize_observe(const char *command) {
+    predict_state_t *state;
+    predict_edge_t *edge = NULL, *victim;
+    uint64_t hash;
+    size_t len;
+
+    if (!command || !*command) {
+        return;
+    }
+    hash = predict_hash(command, &len);
+    if (len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_predict.lock);
+    if (!g_predict.states) {
+        g_predict.states = calloc(PREDICT_STATES, sizeof(predict_state_t));
+    }
+    if (!g_predict.states || g_predict.last == 0) {
+        g_predict.last = hash;
+        pthread_mutex_unlock(&g_predict.lock);
         return;
     }
 
-    for (int i = 0; i < WORKER_THREAD_COUNT; i++) {
-        request_buffer_t *buffer = &g_optimizer->request_buffers[i];
+    state = &g_predict.states[g_predict.last & (PREDICT_STATES - 1)];
+    if (state->key != g_predict.last) {
+        predict_state_reset(state, g_predict.last);
+    }
+
+    victim = &state->next[0];
+    for (int i = 0; i < PREDICT_SUCCESSORS && !edge; i++) {
+        predict_edge_t *candidate = &state->next[i];
+        if (candidate->command && candidate->hash == hash &&
+            strncmp(candidate->command, command, len) == 0 && candidate->command[len] == '\0') {
+            edge = candidate;
+        } else if (candidate->count < victim->count) {
+            victim = candidate;
+        }
+    }
+
+    /* A new successor replaces the least seen one */
+    if (!edge) {
+        char *copy = strndup(command, len);
+        if (copy) {
+            state->total -= victim->count;
+            free(victim->command);
+            victim->command = copy;
+            victim->hash = hash;
+            victim->count = 0;
+            edge = victim;
+        }
+    }
+    if (edge) {
+        edge->count++;
+        state->total++;
+    }
+
+    if (state->total > PREDICT_MAX_TOTAL) {
+        state->total = 0;
+        for (int i = 0; i < PREDICT_SUCCESSORS; i++) {
+            state->next[i].count /= 2;
+            state->total += state->next[i].count;
+        }
+    }
+
+    g_predict.last = hash;
+    __atomic_add_fetch(&g_predict.observed, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_predict.lock);
+}
+
+/* The command most likely to follow COMMAND, or NULL when no successor
+   has been seen PREDICT_MIN_COUNT times or predictive loading is disabled.
+   Sets *CONFIDENCE to the share of COMMAND's successors it accounts for.
+   The caller frees the result. */
+char *anbs_optimize_predict(const char *command, double *confidence) {
+    predict_state_t *state;
+    predict_edge_t *best = NULL;
+    char *next = NULL;
+    uint64_t hash;
+
+    if (!command || !*command) {
+        return NULL;
+    }
 
-        pthread_mutex_lock(&buffer->mutex);
-        if (buffer->count > 0) {
-            buffer->state = BUFFER_STATE_READY;
-            pthread_cond_signal(&buffer->ready_cond);
+    if (g_optimizer) {
+        for (int i = 0; i < g_optimizer->strategy_count; i++) {
+            if (g_optimizer->strategies[i].type == OPT_TYPE_PREDICTIVE_LOADING &&
+                !g_optimizer->strategies[i].enabled) {
+                return NULL;
+            }
         }
-        pthread_mutex_unlock(&buffer->mutex);
     }
 
+    hash = predict_hash(command, NULL);
+
+    pthread_mutex_lock(&g_predict.lock);
+    state = g_predict.states ? &g_predict.states[hash & (PREDICT_STATES - 1)] : NULL;
+    if (state && state->key == hash) {
+        for (int i = 0; i < PREDICT_SUCCESSORS; i++) {
+            if (state->next[i].command && (!best || state->next[i].count > best->count)) {
+                best = &state->next[i];
+            }
+        }
+    }
+    if (best && best->count >= PREDICT_MIN_COUNT) {
+        next = strdup(best->command);
+        if (next && confidence) {
+            *confidence = (double)best->count / state->total;
+        }
+    }
+    pthread_mutex_unlock(&g_predict.lock);
+
+    if (next) {
+        __atomic_add_fetch(&g_predict.predicted, 1, __ATOMIC_RELAXED);
+    }
+    return next;
+}
+
+/* True when the pool has nothing queued or running, so speculative work
+   won't delay anything the user asked for */
+int anbs_optimize_idle(void) {
+    return !g_optimizer || __atomic_load_n(&g_optimizer->active, __ATOMIC_ACQUIRE) == 0;
+}
+
+/* Wait for queued optimization work to finish.  A task can't wait for
+   itself, so from a worker this returns at once. */
+void anbs_optimize_flush_buffers(void) {
+    if (!g_optimizer || t_worker >= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_optimizer->work_mutex);
+    while (__atomic_load_n(&g_optimizer->active, __ATOMIC_ACQUIRE) > 0 && g_optimizer->workers_created > 0) {
+        pthread_cond_wait(&g_optimizer->idle_cond, &g_optimizer->work_mutex);
+    }
+    pthread_mutex_unlock(&g_optimizer->work_mutex);
+
     ANBS_DEBUG_LOG("Optimization buffers flushed");
 }
 
@@ -579,44 +1510,43 @@ void anbs_optimize_cleanup(void) {
         return;
     }
 
-    /* Stop worker threads */
+    /* Stop worker threads once they have drained the queues */
+    pthread_mutex_lock(&g_optimizer->work_mutex);
     g_optimizer->workers_running = false;
-
-    /* Signal all workers to wake up */
-    for (int i = 0; i < WORKER_THREAD_COUNT; i++) {
-        request_buffer_t *buffer = &g_optimizer->request_buffers[i];
-        pthread_mutex_lock(&buffer->mutex);
-        pthread_cond_broadcast(&buffer->ready_cond);
-        pthread_mutex_unlock(&buffer->mutex);
-    }
+    pthread_cond_broadcast(&g_optimizer->work_cond);
+    pthread_mutex_unlock(&g_optimizer->work_mutex);
 
     /* Wait for workers to finish */
-    for (int i = 0; i < WORKER_THREAD_COUNT; i++) {
+    for (int i = 0; i < g_optimizer->workers_created; i++) {
         pthread_join(g_optimizer->worker_threads[i], NULL);
     }
 
-    /* Cleanup request buffers */
-    for (int i = 0; i < WORKER_THREAD_COUNT; i++) {
-        request_buffer_t *buffer = &g_optimizer->request_buffers[i];
-        pthread_mutex_destroy(&buffer->mutex);
-        pthread_cond_destroy(&buffer->ready_cond);
+    /* Without workers nothing ran the submitted tasks */
+    while (g_optimizer->inject_head) {
+        pool_task_t *next = g_optimizer->inject_head->next;
+        anbs_optimize_free(g_optimizer->inject_head, sizeof(pool_task_t));
+        g_optimizer->inject_head = next;
     }
+    free(g_optimizer->worker_threads);
+    free(g_optimizer->deques);
 
-    /* Free memory pool */
-    pthread_mutex_lock(&g_optimizer->memory_mutex);
-    for (int i = 0; i < g_optimizer->memory_pool_index; i++) {
-        free(g_optimizer->memory_pool[i]);
+    /* Requests whose dispatch never ran */
+    for (int c = 0; c < OPT_CLASSES; c++) {
+        for (int i = 0; i < g_optimizer->queues[c].count; i++) {
+            anbs_optimize_free(g_optimizer->queues[c].heap[i], sizeof(optimization_request_t));
+        }
+        free(g_optimizer->queues[c].heap);
     }
-    free(g_optimizer->memory_pool);
-    free(g_optimizer->memory_sizes);
-    pthread_mutex_unlock(&g_optimizer->memory_mutex);
 
     /* Free connection pool */
     free(g_optimizer->connection_pool);
 
     pthread_mutex_destroy(&g_optimizer->global_mutex);
     pthread_mutex_destroy(&g_optimizer->pool_mutex);
-    pthread_mutex_destroy(&g_optimizer->memory_mutex);
+    pthread_mutex_destroy(&g_optimizer->work_mutex);
+    pthread_mutex_destroy(&g_optimizer->sched_mutex);
+    pthread_cond_destroy(&g_optimizer->work_cond);
+    pthread_cond_destroy(&g_optimizer->idle_cond);
 
     free(g_optimizer);
     g_optimizer = NULL;
@@ -0,0 +1,298 @@
+/* profiler.c - Shell execution profiler for ANBS */
+
+#include "../ai_display.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define PROFILE_LABEL_MAX 64        /* longest command or function name kept */
+#define PROFILE_STACK_INITIAL 64
+#define PROFILE_DEFAULT_DIR "/tmp"
+
+/* A node of the calling context tree: one distinct stack of frames.  Time
+   is charged to the innermost frame as it passes, so SELF_NS excludes the
+   frames called from it. */
+typedef struct profile_node {
+    char *label;
+    uint64_t self_ns;
+    struct profile_node *parent;
+    struct profile_node *child;     /* most recently entered first */
+    struct profile_node *sibling;
+} profile_node_t;
+
+typedef struct {
+    char *path;
+    pid_t pid;                      /* the shell profiling; children don't write */
+    profile_node_t *root;
+    profile_node_t **stack;         /* stack[0] is ROOT */
+    int depth;                      /* frames above ROOT */
+    int capacity;
+    bool running;                   /* a command is executing, so time counts */
+    uint64_t last_ns;
+} profile_state_t;
+
+/* Hot checks in execute_cmd.c and subst.c test this before calling in */
+int anbs_profiling = 0;
+
+static profile_state_t g_profile;
+
+static uint64_t profile_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Charge the time since the last frame change to the innermost frame */
+static void profile_charge(void) {
+    uint64_t now = profile_now_ns();
+
+    if (g_profile.running) {
+        g_profile.stack[g_profile.depth]->self_ns += now - g_profile.last_ns;
+    }
+    g_profile.last_ns = now;
+}
+
+/* Copy NAME into a frame label; folded stacks separate frames with ';'
+   and the count with a space */
+static void profile_label(char *label, size_t size, const char *name, int line) {
+    size_t i;
+
+    for (i = 0; name[i] && i < PROFILE_LABEL_MAX && i + 1 < size; i++) {
+        label[i] = (name[i] == ';' || name[i] == ' ' || name[i] == '\t' || name[i] == '\n') ? '_' : name[i];
+    }
+    label[i] = '\0';
+    if (line > 0) {
+        snprintf(label + i, size - i, ":%d", line);
+    }
+}
+
+static profile_node_t *profile_node_create(const char *label, profile_node_t *parent) {
+    profile_node_t *node = calloc(1, sizeof(profile_node_t));
+
+    if (!node) {
+        return NULL;
+    }
+    node->label = strdup(label);
+    if (!node->label) {
+        free(node);
+        return NULL;
+    }
+    node->parent = parent;
+    return node;
+}
+
+static void profile_node_free(profile_node_t *node) {
+    while (node) {
+        profile_node_t *sibling = node->sibling;
+
+        profile_node_free(node->child);
+        free(node->label);
+        free(node);
+        node = sibling;
+    }
+}
+
+/* The child of PARENT labelled LABEL, moved to the front of its siblings
+   since loops enter the same frames over and over */
+static profile_node_t *profile_child(profile_node_t *parent, const char *label) {
+    profile_node_t **link = &parent->child;
+    profile_node_t *node;
+
+    for (node = parent->child; node; link = &node->sibling, node = node->sibling) {
+        if (strcmp(node->label, label) == 0) {
+            *link = node->sibling;
+            node->sibling = parent->child;
+            parent->child = node;
+            return node;
+        }
+    }
+
+    node = profile_node_create(label, parent);
+    if (node) {
+        node->sibling = parent->child;
+        parent->child = node;
+    }
+    return node;
+}
+
+/* Write NODE and its descendants as folded stacks, PATH holding the
+   labels above NODE */
+static void profile_write_node(FILE *out, profile_node_t *node, char *path, size_t length, size_t size) {
+    for (; node; node = node->sibling) {
+        size_t label_length = strlen(node->label);
+
+        if (length + label_length + 2 >= size) {
+            continue;
+        }
+        if (length > 0) {
+            path[length] = ';';
+        }
+        memcpy(path + length + (length > 0), node->label, label_length + 1);
+
+        if (node->self_ns >= 1000) {
+            fprintf(out, "%s %llu\n", path, (unsigned long long)(node->self_ns / 1000));
+        }
+        profile_write_node(out, node->child, path, length + (length > 0) + label_length, size);
+        path[length] = '\0';
+    }
+}
+
+/* Write the profile to its file and forget it */
+static void profile_finish(void) {
+    char path[8192];
+    FILE *out;
+
+    if (!g_profile.root) {
+        return;
+    }
+    profile_charge();
+
+    if (g_profile.pid == getpid()) {
+        out = fopen(g_profile.path, "w");
+        if (out) {
+            path[0] = '\0';
+            profile_write_node(out, g_profile.root, path, 0, sizeof(path));
+            fclose(out);
+        }
+    }
+
+    profile_node_free(g_profile.root);
+    free(g_profile.stack);
+    free(g_profile.path);
+    memset(&g_profile, 0, sizeof(g_profile));
+    anbs_profiling = 0;
+}
+
+/* A forked subshell or command leaves the profile to its parent, which
+   counts the time it spends waiting for the child */
+static void profile_atfork_child(void) {
+    anbs_profiling = 0;
+    g_profile.running = false;
+}
+
+/* Start profiling into TARGET, a file or a directory to write
+   anbs_profile_<pid>.folded in; "1" picks /tmp.  ROOT_NAME, usually $0,
+   labels the bottom frame.  Returns 0, or -1 if TARGET can't be written. */
+int anbs_profile_start(const char *target, const char *root_name) {
+    static int hooks_registered = 0;
+    char path[4096];
+    char label[PROFILE_LABEL_MAX + 16];
+    const char *base;
+    struct stat st;
+    FILE *probe;
+
+    if (strcmp(target, "1") == 0) {
+        target = PROFILE_DEFAULT_DIR;
+    }
+    if (stat(target, &st) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(path, sizeof(path), "%s/anbs_profile_%d.folded", target, (int)getpid());
+    } else {
+        snprintf(path, sizeof(path), "%s", target);
+    }
+
+    /* Assigning ANBS_PROFILE its current value keeps the profile going */
+    if (g_profile.root) {
+        if (strcmp(g_profile.path, path) == 0) {
+            return 0;
+        }
+        profile_finish();
+    }
+
+    probe = fopen(path, "a");
+    if (!probe) {
+        return -1;
+    }
+    fclose(probe);
+
+    base = root_name ? strrchr(root_name, '/') : NULL;
+    base = base ? base + 1 : (root_name && *root_name ? root_name : "bash");
+    profile_label(label, sizeof(label), base, 0);
+
+    g_profile.path = strdup(path);
+    g_profile.root = profile_node_create(label, NULL);
+    g_profile.stack = malloc(PROFILE_STACK_INITIAL * sizeof(profile_node_t *));
+    if (!g_profile.path || !g_profile.root || !g_profile.stack) {
+        free(g_profile.stack);
+        profile_node_free(g_profile.root);
+        free(g_profile.path);
+        memset(&g_profile, 0, sizeof(g_profile));
+        return -1;
+    }
+    g_profile.capacity = PROFILE_STACK_INITIAL;
+    g_profile.stack[0] = g_profile.root;
+    g_profile.pid = getpid();
+    g_profile.running = true;
+    g_profile.last_ns = profile_now_ns();
+
+    if (!hooks_registered) {
+        atexit(profile_finish);
+        pthread_atfork(NULL, NULL, profile_atfork_child);
+        hooks_registered = 1;
+    }
+
+    anbs_profiling = 1;
+    return 0;
+}
+
+/* Write the profile now; the shell calls this when ANBS_PROFILE is unset */
+void anbs_profile_stop(void) {
+    profile_finish();
+}
+
+/* The reader loop stops the clock while it reads a command, so time at
+   the prompt isn't charged, and restarts it to execute the command.  Any
+   frames a longjmp skipped leaving are dropped. */
+void anbs_profile_run(int running) {
+    if (!anbs_profiling) {
+        return;
+    }
+    profile_charge();
+    g_profile.depth = 0;
+    g_profile.running = running != 0;
+}
+
+/* Push a frame for NAME, with LINE appended when it is positive.  Returns
+   the depth to hand anbs_profile_leave(), or -1 if nothing was pushed. */
+int anbs_profile_enter(const char *name, int line) {
+    char label[PROFILE_LABEL_MAX + 16];
+    profile_node_t *node;
+
+    if (!anbs_profiling || !g_profile.running) {
+        return -1;
+    }
+    profile_charge();
+
+    if (g_profile.depth + 1 >= g_profile.capacity) {
+        profile_node_t **stack = realloc(g_profile.stack, g_profile.capacity * 2 * sizeof(profile_node_t *));
+
+        if (!stack) {
+            return -1;
+        }
+        g_profile.stack = stack;
+        g_profile.capacity *= 2;
+    }
+
+    profile_label(label, sizeof(label), name && *name ? name : "[unknown]", line);
+    node = profile_child(g_profile.stack[g_profile.depth], label);
+    if (!node) {
+        return -1;
+    }
+    g_profile.stack[++g_profile.depth] = node;
+    return g_profile.depth - 1;
+}
+
+/* Pop back to DEPTH frames, including any that a longjmp past their
+   callers left behind */
+void anbs_profile_leave(int depth) {
+    if (!anbs_profiling || depth < 0 || depth >= g_profile.depth) {
+        return;
+    }
+    profile_charge();
+    g_profile.depth = depth;
+}
@@ -0,0 +1,203 @@
+/* startup.c - Startup-time profile for ANBS */
+
+#include "../ai_display.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STARTUP_ENTRIES_INITIAL 32
+#define STARTUP_LABEL_MAX 256
+#define STARTUP_REPORT_MIN_NS 100000ULL  /* shorter spans are only counted */
+
+/* One timed span of startup: a phase of main(), a sourced file or an AI
+   subsystem coming up.  Spans nest, so a file's time includes the files
+   it sources. */
+typedef struct {
+    const char *kind;
+    char *label;
+    uint64_t start_ns;
+    uint64_t ns;
+    int functions;                  /* defined by a sourced file, or -1 */
+    bool done;
+} startup_entry_t;
+
+typedef struct {
+    pid_t pid;                      /* the shell starting up; children don't record */
+    uint64_t origin_ns;
+    startup_entry_t *entries;
+    int count;
+    int capacity;
+} startup_state_t;
+
+/* Checked by STARTUP_ENTER before calling in */
+int anbs_startup_profiling = 0;
+
+static startup_state_t g_startup;
+
+/* Subsystems can come up on the prewarm threads */
+static pthread_mutex_t g_startup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t startup_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void startup_atfork_child(void) {
+    anbs_startup_profiling = 0;
+}
+
+static void startup_forget(void) {
+    for (int i = 0; i < g_startup.count; i++) {
+        free(g_startup.entries[i].label);
+    }
+    free(g_startup.entries);
+    memset(&g_startup, 0, sizeof(g_startup));
+    anbs_startup_profiling = 0;
+}
+
+/* Longest spans first; spans still running on another thread, or left
+   by a longjmp or an error, go last */
+static int startup_compare(const void *a, const void *b) {
+    const startup_entry_t *x = a;
+    const startup_entry_t *y = b;
+
+    if (x->done != y->done) {
+        return x->done ? -1 : 1;
+    }
+    if (x->ns != y->ns) {
+        return x->ns > y->ns ? -1 : 1;
+    }
+    return x->start_ns < y->start_ns ? -1 : x->start_ns > y->start_ns;
+}
+
+/* Start timing the shell's startup; set by --startup-profile or
+   ANBS_STARTUP_PROFILE in the environment */
+void anbs_startup_profile_begin(void) {
+    static int hooks_registered = 0;
+
+    if (anbs_startup_profiling) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_startup_mutex);
+    g_startup.pid = getpid();
+    g_startup.origin_ns = startup_now_ns();
+    pthread_mutex_unlock(&g_startup_mutex);
+
+    if (!hooks_registered) {
+        pthread_atfork(NULL, NULL, startup_atfork_child);
+        hooks_registered = 1;
+    }
+    anbs_startup_profiling = 1;
+}
+
+/* Open a span of KIND for LABEL.  Returns the slot to hand
+   anbs_startup_leave(), or -1 if nothing is being recorded. */
+int anbs_startup_enter(const char *kind, const char *label) {
+    startup_entry_t *entry;
+    int slot = -1;
+
+    if (!anbs_startup_profiling || g_startup.pid != getpid()) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_startup_mutex);
+    if (!anbs_startup_profiling) {
+        goto out;
+    }
+    if (g_startup.count == g_startup.capacity) {
+        int capacity = g_startup.capacity ? g_startup.capacity * 2 : STARTUP_ENTRIES_INITIAL;
+        startup_entry_t *entries = realloc(g_startup.entries, capacity * sizeof(startup_entry_t));
+
+        if (!entries) {
+            goto out;
+        }
+        g_startup.entries = entries;
+        g_startup.capacity = capacity;
+    }
+
+    entry = &g_startup.entries[g_startup.count];
+    memset(entry, 0, sizeof(*entry));
+    entry->label = strndup(label && *label ? label : "[unknown]", STARTUP_LABEL_MAX);
+    if (!entry->label) {
+        goto out;
+    }
+    entry->kind = kind;
+    entry->functions = -1;
+    entry->start_ns = startup_now_ns();
+    slot = g_startup.count++;
+
+out:
+    pthread_mutex_unlock(&g_startup_mutex);
+    return slot;
+}
+
+/* Close the span in SLOT.  FUNCTIONS, when not negative, is the number of
+   shell functions it defined. */
+void anbs_startup_leave(int slot, int functions) {
+    pthread_mutex_lock(&g_startup_mutex);
+    if (anbs_startup_profiling && slot >= 0 && slot < g_startup.count) {
+        startup_entry_t *entry = &g_startup.entries[slot];
+
+        entry->ns = startup_now_ns() - entry->start_ns;
+        entry->functions = functions;
+        entry->done = true;
+    }
+    pthread_mutex_unlock(&g_startup_mutex);
+}
+
+/* Print the spans to stderr, longest first, and stop recording.  The
+   shell calls this just before it reads its first command. */
+void anbs_startup_report(void) {
+    uint64_t total, brief_ns = 0;
+    int brief = 0;
+
+    if (!anbs_startup_profiling) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_startup_mutex);
+    if (g_startup.pid != getpid()) {
+        startup_forget();
+        pthread_mutex_unlock(&g_startup_mutex);
+        return;
+    }
+
+    total = startup_now_ns() - g_startup.origin_ns;
+    qsort(g_startup.entries, g_startup.count, sizeof(startup_entry_t), startup_compare);
+
+    fprintf(stderr, "startup profile: %.3f ms to first command\n", total / 1e6);
+    fprintf(stderr, "%10s %6s %10s  %-8s %s\n", "ms", "%", "start ms", "kind", "what");
+    for (int i = 0; i < g_startup.count; i++) {
+        startup_entry_t *entry = &g_startup.entries[i];
+        double start = (entry->start_ns - g_startup.origin_ns) / 1e6;
+
+        if (entry->done && entry->ns < STARTUP_REPORT_MIN_NS) {
+            brief++;
+            brief_ns += entry->ns;
+        } else if (!entry->done) {
+            fprintf(stderr, "%10s %6s %10.3f  %-8s %s (unfinished)\n", "-", "-", start, entry->kind, entry->label);
+        } else if (entry->functions > 0) {
+            fprintf(stderr, "%10.3f %6.1f %10.3f  %-8s %s (%d function%s)\n", entry->ns / 1e6,
+                    total ? 100.0 * entry->ns / total : 0.0, start, entry->kind, entry->label,
+                    entry->functions, entry->functions == 1 ? "" : "s");
+        } else {
+            fprintf(stderr, "%10.3f %6.1f %10.3f  %-8s %s\n", entry->ns / 1e6,
+                    total ? 100.0 * entry->ns / total : 0.0, start, entry->kind, entry->label);
+        }
+    }
+    if (brief > 0) {
+        fprintf(stderr, "%10.3f %6s %10s  %-8s %d spans under %.1f ms each\n", brief_ns / 1e6, "-", "-", "", brief,
+                STARTUP_REPORT_MIN_NS / 1e6);
+    }
+    fflush(stderr);
+
+    startup_forget();
+    pthread_mutex_unlock(&g_startup_mutex);
+}
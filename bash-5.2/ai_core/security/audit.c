@@ -0,0 +1,324 @@
+/* audit.c - Security audit trail for ANBS permission and sandbox decisions */
+
+#include "../ai_display.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Each thread deciding access queues fixed-size events in a ring of its
+   own; a writer thread, started with the first event, drains every ring
+   into ANBS_AUDIT_LOG as JSON lines, one batch per write().  Recording an
+   event takes no lock and makes no system call beyond waking the writer.
+   Allowed events may be sampled (ANBS_AUDIT_SAMPLE_ALLOW=N keeps one in
+   N) and are dropped, and counted, if a ring is full.  Denials are never
+   dropped: a full ring is drained by the thread itself, a denial wakes
+   the writer without waiting for the batch to fill, and the file is
+   synced after every batch holding one. */
+#define AUDIT_RING_SLOTS 256        /* events pending per thread; a power of 2 */
+#define AUDIT_SUBJECT_MAX 64
+#define AUDIT_OBJECT_MAX 256
+#define AUDIT_BATCH_DELAY_US 50000  /* gather allowed events this long */
+#define AUDIT_WRITE_BUFFER 65536
+#define AUDIT_DEFAULT_FILE "/tmp/anbs_audit.log"
+
+typedef struct {
+    struct timespec at;
+    const char *event;          /* Static string naming the decision */
+    int detail;                 /* Permission type or access flags asked for */
+    bool allowed;
+    char subject[AUDIT_SUBJECT_MAX];    /* Agent or sandbox */
+    char object[AUDIT_OBJECT_MAX];      /* Resource or path */
+} audit_event_t;
+
+/* Single producer (the owning thread), single consumer (whoever holds
+   the lock and drains) */
+typedef struct audit_ring {
+    uint64_t head;              /* next slot the owner fills */
+    uint64_t tail;              /* next slot drained */
+    bool orphaned;              /* the owner exited; freed once drained */
+    unsigned long allowed_seen; /* for sampling, owner only */
+    struct audit_ring *next;
+    audit_event_t events[AUDIT_RING_SLOTS];
+} audit_ring_t;
+
+static struct {
+    pthread_mutex_t lock;       /* guards RINGS, draining and starting the writer */
+    audit_ring_t *rings;
+    bool writer_started;
+    sem_t wake;
+    int pending;                /* the writer has been woken for new events */
+    int urgent;                 /* a denial is pending; don't wait to batch */
+    int fd;                     /* -1 if auditing is off */
+    unsigned long sample_allow; /* keep one allowed event in this many, 0 for none */
+    uint64_t dropped;
+    uint64_t dropped_reported;
+} g_audit = { PTHREAD_MUTEX_INITIALIZER, NULL, false };
+
+static pthread_once_t g_audit_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_audit_key;
+static __thread audit_ring_t *t_audit_ring;
+
+/* Append TEXT to BUFFER as the body of a JSON string */
+static size_t audit_escape(char *buffer, size_t size, const char *text) {
+    size_t used = 0;
+
+    for (const unsigned char *p = (const unsigned char *)text; *p && used + 7 < size; p++) {
+        if (*p == '"' || *p == '\\') {
+            buffer[used++] = '\\';
+            buffer[used++] = *p;
+        } else if (*p < 0x20) {
+            used += snprintf(buffer + used, size - used, "\\u%04x", *p);
+        } else {
+            buffer[used++] = *p;
+        }
+    }
+    return used;
+}
+
+/* Write out every pending event and free the rings of exited threads.
+   Called with the lock held. */
+static void audit_drain_locked(void) {
+    char buffer[AUDIT_WRITE_BUFFER];
+    size_t used = 0;
+    audit_ring_t **link = &g_audit.rings;
+    bool denied = false;
+    uint64_t dropped;
+    struct tm tm;
+
+    while (*link) {
+        audit_ring_t *ring = *link;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        for (; tail != head; tail++) {
+            audit_event_t *event = &ring->events[tail & (AUDIT_RING_SLOTS - 1)];
+
+            if (used + 2 * (AUDIT_SUBJECT_MAX + AUDIT_OBJECT_MAX) * 3 + 160 > sizeof(buffer)) {
+                (void)!write(g_audit.fd, buffer, used);
+                used = 0;
+            }
+            gmtime_r(&event->at.tv_sec, &tm);
+            used += snprintf(buffer + used, sizeof(buffer) - used,
+                             "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ\",\"pid\":%ld,"
+                             "\"event\":\"%s\",\"decision\":\"%s\",\"subject\":\"",
+                             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                             tm.tm_hour, tm.tm_min, tm.tm_sec, event->at.tv_nsec / 1000000,
+                             (long)getpid(), event->event, event->allowed ? "allow" : "deny");
+            used += audit_escape(buffer + used, sizeof(buffer) - used, event->subject);
+            used += snprintf(buffer + used, sizeof(buffer) - used, "\",\"object\":\"");
+            used += audit_escape(buffer + used, sizeof(buffer) - used, event->object);
+            used += snprintf(buffer + used, sizeof(buffer) - used, "\",\"detail\":%d}\n",
+                             event->detail);
+            denied |= !event->allowed;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    dropped = __atomic_load_n(&g_audit.dropped, __ATOMIC_RELAXED);
+    if (dropped != g_audit.dropped_reported) {
+        used += snprintf(buffer + used, sizeof(buffer) - used,
+                         "{\"pid\":%ld,\"event\":\"audit_dropped\",\"count\":%lu}\n",
+                         (long)getpid(), (unsigned long)(dropped - g_audit.dropped_reported));
+        g_audit.dropped_reported = dropped;
+    }
+    if (used > 0) {
+        (void)!write(g_audit.fd, buffer, used);
+    }
+    if (denied) {
+        fdatasync(g_audit.fd);
+    }
+}
+
+static void *audit_writer(void *arg) {
+    sigset_t signals;
+
+    (void)arg;
+
+    /* The shell's signal handlers must run on its own thread */
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    for (;;) {
+        while (sem_wait(&g_audit.wake) != 0 && errno == EINTR) {
+        }
+        if (!__atomic_load_n(&g_audit.urgent, __ATOMIC_ACQUIRE)) {
+            usleep(AUDIT_BATCH_DELAY_US);
+        }
+        __atomic_store_n(&g_audit.pending, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&g_audit.urgent, 0, __ATOMIC_RELEASE);
+
+        pthread_mutex_lock(&g_audit.lock);
+        audit_drain_locked();
+        pthread_mutex_unlock(&g_audit.lock);
+    }
+
+    return NULL;
+}
+
+/* Start the writer unless it is running.  Called with the lock held. */
+static void audit_start_writer_locked(void) {
+    pthread_t thread;
+
+    if (g_audit.writer_started || g_audit.fd < 0) {
+        return;
+    }
+    if (pthread_create(&thread, NULL, audit_writer, NULL) == 0) {
+        pthread_detach(thread);
+        g_audit.writer_started = true;
+    }
+}
+
+/* A thread's ring outlives it until its events have been written */
+static void audit_thread_exit(void *ring) {
+    __atomic_store_n(&((audit_ring_t *)ring)->orphaned, true, __ATOMIC_RELEASE);
+}
+
+/* Nothing queued is lost when the shell exits */
+static void audit_atexit(void) {
+    pthread_mutex_lock(&g_audit.lock);
+    audit_drain_locked();
+    pthread_mutex_unlock(&g_audit.lock);
+}
+
+/* A forked child has no writer, and the parent's writes out whatever was
+   pending at the fork; the child keeps only its own ring, emptied, and
+   starts a writer with its next event */
+static void audit_atfork_child(void) {
+    pthread_mutex_init(&g_audit.lock, NULL);
+    sem_init(&g_audit.wake, 0, 0);
+    g_audit.pending = 0;
+    g_audit.urgent = 0;
+    g_audit.writer_started = false;
+    g_audit.dropped_reported = g_audit.dropped;
+    g_audit.rings = t_audit_ring;
+    if (t_audit_ring) {
+        t_audit_ring->next = NULL;
+        t_audit_ring->tail = t_audit_ring->head;
+    }
+}
+
+static void audit_init(void) {
+    const char *file = getenv("ANBS_AUDIT_LOG");
+    const char *sample = getenv("ANBS_AUDIT_SAMPLE_ALLOW");
+
+    g_audit.sample_allow = sample && *sample ? strtoul(sample, NULL, 10) : 1;
+
+    /* Set but empty turns auditing off */
+    g_audit.fd = -1;
+    if (!file || *file) {
+        g_audit.fd = open(file ? file : AUDIT_DEFAULT_FILE,
+                          O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    }
+    sem_init(&g_audit.wake, 0, 0);
+    pthread_key_create(&g_audit_key, audit_thread_exit);
+    atexit(audit_atexit);
+    pthread_atfork(NULL, NULL, audit_atfork_child);
+}
+
+/* The calling thread's ring, registered on its first event */
+static audit_ring_t *audit_ring(void) {
+    audit_ring_t *ring = t_audit_ring;
+
+    if (ring) {
+        return ring;
+    }
+    ring = calloc(1, sizeof(audit_ring_t));
+    if (!ring) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_audit.lock);
+    ring->next = g_audit.rings;
+    g_audit.rings = ring;
+    audit_start_writer_locked();
+    pthread_mutex_unlock(&g_audit.lock);
+
+    pthread_setspecific(g_audit_key, ring);
+    t_audit_ring = ring;
+    return ring;
+}
+
+/* Record that SUBJECT was ALLOWED or denied OBJECT.  EVENT must be a
+   string constant; DETAIL is the permission type or access asked for. */
+void anbs_audit_record(const char *event, const char *subject, const char *object,
+                       int detail, bool allowed) {
+    audit_ring_t *ring;
+    audit_event_t *slot;
+    uint64_t head;
+
+    pthread_once(&g_audit_once, audit_init);
+    if (g_audit.fd < 0) {
+        return;
+    }
+
+    ring = audit_ring();
+    if (!ring) {
+        __atomic_add_fetch(&g_audit.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (allowed && (g_audit.sample_allow == 0 || ring->allowed_seen++ % g_audit.sample_allow != 0)) {
+        return;
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= AUDIT_RING_SLOTS) {
+        if (allowed) {
+            __atomic_add_fetch(&g_audit.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        /* Make room rather than lose a denial */
+        pthread_mutex_lock(&g_audit.lock);
+        audit_drain_locked();
+        pthread_mutex_unlock(&g_audit.lock);
+    }
+
+    slot = &ring->events[head & (AUDIT_RING_SLOTS - 1)];
+    clock_gettime(CLOCK_REALTIME_COARSE, &slot->at);
+    slot->event = event;
+    slot->detail = detail;
+    slot->allowed = allowed;
+    snprintf(slot->subject, sizeof(slot->subject), "%s", subject ? subject : "");
+    snprintf(slot->object, sizeof(slot->object), "%s", object ? object : "");
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    /* A child of a fork starts its own writer */
+    if (!__atomic_load_n(&g_audit.writer_started, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&g_audit.lock);
+        audit_start_writer_locked();
+        pthread_mutex_unlock(&g_audit.lock);
+    }
+    if (!allowed) {
+        __atomic_store_n(&g_audit.urgent, 1, __ATOMIC_RELEASE);
+    }
+    if (__atomic_exchange_n(&g_audit.pending, 1, __ATOMIC_ACQ_REL) == 0 || !allowed) {
+        sem_post(&g_audit.wake);
+    }
+}
+
+/* Write out and sync everything recorded so far */
+void anbs_audit_flush(void) {
+    pthread_once(&g_audit_once, audit_init);
+    if (g_audit.fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_audit.lock);
+    audit_drain_locked();
+    fdatasync(g_audit.fd);
+    pthread_mutex_unlock(&g_audit.lock);
+}
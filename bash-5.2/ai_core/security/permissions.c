@@ -6,6 +6,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <fnmatch.h>
 #include <json-c/json.h>
 
@@ -13,6 +18,11 @@
 #define MAX_ROLES 100
 #define MAX_AGENT_PERMISSIONS 500
 
+/* Decisions each thread remembers, and the longest resource name
+   remembered */
+#define PERMISSION_CACHE_SLOTS 256
+#define PERMISSION_CACHE_RESOURCE 256
+
 typedef enum {
     PERM_TYPE_FILE_READ = 1,
     PERM_TYPE_FILE_WRITE = 2,
@@ -49,17 +59,78 @@ typedef struct {
     bool inheritable;
 } role_t;
 
+/* A node of a rule index's prefix trie: the rules whose pattern starts
+   with the literal text spelled out on the way here */
+typedef struct {
+    unsigned char byte;
+    int child;                  /* First child, -1 if none */
+    int sibling;                /* Next child of the same parent, -1 if none */
+    int *rules;                 /* Positions in the sorted rules, ascending */
+    int rule_count;
+    int rule_capacity;
+} permission_trie_node_t;
+
+/* An agent's custom and role rules, compiled for one policy epoch */
+typedef struct {
+    const permission_rule_t **rules;    /* Highest priority first */
+    int rule_count;
+    permission_trie_node_t *nodes;      /* nodes[0] is the root */
+    int node_count;
+    int node_capacity;
+} permission_index_t;
+
 typedef struct {
     char agent_id[64];
     char role_names[MAX_ROLES][64];
     int role_count;
     permission_rule_t custom_rules[MAX_AGENT_PERMISSIONS];
     int custom_rule_count;
-    time_t last_access_check;
-    int denied_operations_count;
+    time_t last_access_check;           /* Of threads that have exited; */
+    int denied_operations_count;        /* live ones keep their own */
     int allowed_operations_count;
 } agent_permissions_t;
 
+/* Every agent's rules compiled for one policy epoch: what checks read.
+   Never changed once built, and freed when the last thread using it
+   moves on.  The indexes point into role and custom rule slots, which
+   are only ever appended to. */
+typedef struct {
+    uint64_t epoch;
+    int refs;                   /* The manager's and threads', under the mutex */
+    int agent_count;
+    struct {
+        char agent_id[64];
+        permission_index_t *index;      /* NULL if it could not be compiled */
+    } agents[];
+} permission_view_t;
+
+/* A decision anbs_permissions_check() made, good while the policy epoch
+   is unchanged and until EXPIRES, when a rule it saw starts or ends */
+typedef struct {
+    uint64_t epoch;             /* Policy epoch it was made in, 0 if empty */
+    uint64_t hash;
+    int agent;                  /* Index into the view and agent_perms */
+    permission_type_t permission_type;
+    time_t expires;             /* 0 if no rule it saw is time-limited */
+    bool granted;
+    char agent_id[64];
+    char resource[PERMISSION_CACHE_RESOURCE];
+} permission_decision_t;
+
+/* What one thread checking permissions keeps to itself, so checks share
+   nothing writable.  Counters are indexed like agent_perms, written only
+   by their thread and summed when statistics are asked for. */
+typedef struct permission_thread {
+    struct permission_thread *next;
+    permission_view_t *view;    /* Referenced while this thread uses it */
+    permission_decision_t decisions[PERMISSION_CACHE_SLOTS];
+    unsigned long allowed[MAX_AGENTS];
+    unsigned long denied[MAX_AGENTS];
+    time_t last_check[MAX_AGENTS];
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+} permission_thread_t;
+
 typedef struct {
     role_t roles[MAX_ROLES];
     int role_count;
@@ -67,10 +138,71 @@ typedef struct {
     int agent_count;
     pthread_mutex_t mutex;
     char policy_file_path[512];
+
+    /* Rules and roles change rarely.  A change moves the epoch on under
+       the mutex, and the next check publishes a new view; until then
+       checks read the view they hold without taking any lock. */
+    uint64_t policy_epoch;
+    permission_view_t *view;
+    permission_thread_t *threads;
+    pthread_key_t thread_key;
+    unsigned long cache_hits;   /* Of threads that have exited */
+    unsigned long cache_misses;
 } permission_manager_t;
 
 static permission_manager_t *g_perm_manager = NULL;
 
+/* Audit trail from audit.c */
+extern void anbs_audit_record(const char *event, const char *subject, const char *object,
+                              int detail, bool allowed);
+extern void anbs_audit_flush(void);
+
+/* Compiled policy snapshots: the policy file's roles, rules and agent
+   assignments as fixed-size records, taken when the file is parsed and
+   copied straight in while the file is unchanged.  The layout is this
+   build's own, so a snapshot is only good on the machine that wrote it. */
+#define POLICY_SNAPSHOT_MAGIC 0x4c4f504e53424e41ULL   /* "ANBSNPOL" */
+#define POLICY_SNAPSHOT_VERSION 1
+#define POLICY_SNAPSHOT_NAME 64
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t rule_size;         /* sizeof(permission_rule_t) when written */
+    uint64_t source_dev;        /* Policy file it was taken of */
+    uint64_t source_ino;
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint32_t role_count;        /* Records of each kind that follow */
+    uint32_t rule_count;
+    uint32_t agent_count;
+    uint32_t name_count;
+    uint64_t checksum;          /* FNV-1a over everything after the header */
+} policy_snapshot_header_t;
+
+typedef struct {
+    char role_name[64];
+    char description[256];
+    uint32_t first_rule;
+    uint32_t rule_count;
+} policy_snapshot_role_t;
+
+typedef struct {
+    char agent_id[64];
+    uint32_t first_name;        /* Role names assigned */
+    uint32_t name_count;
+} policy_snapshot_agent_t;
+
+/* A snapshot in memory: header, roles, rules, agents, role names */
+typedef struct {
+    void *data;
+    size_t size;
+} policy_snapshot_t;
+
+
+static void anbs_permissions_thread_exit(void *arg);
+
 /* Initialize permission manager */
 int anbs_permissions_init(const char *policy_file) {
     if (g_perm_manager) {
@@ -82,7 +214,14 @@ int anbs_permissions_init(const char *policy_file) {
         return -1;
     }
 
+    if (pthread_key_create(&g_perm_manager->thread_key, anbs_permissions_thread_exit) != 0) {
+        free(g_perm_manager);
+        g_perm_manager = NULL;
+        return -1;
+    }
+
     pthread_mutex_init(&g_perm_manager->mutex, NULL);
+    g_perm_manager->policy_epoch = 1;
 
     if (policy_file) {
         strncpy(g_perm_manager->policy_file_path, policy_file,
@@ -102,6 +241,12 @@ int anbs_permissions_init(const char *policy_file) {
     return 0;
 }
 
+/* Move the policy epoch on after changing rules or roles, with the
+   mutex held.  Checks see the new epoch and pick up a new view. */
+static void anbs_permissions_changed(void) {
+    __atomic_add_fetch(&g_perm_manager->policy_epoch, 1, __ATOMIC_RELEASE);
+}
+
 /* Create default roles */
 int anbs_permissions_create_default_roles(void) {
     if (!g_perm_manager) {
@@ -176,20 +321,15 @@ int anbs_permissions_create_default_roles(void) {
     rule->priority = 1000;
     rule->active = true;
 
+    anbs_permissions_changed();
     pthread_mutex_unlock(&g_perm_manager->mutex);
 
     ANBS_DEBUG_LOG("Created %d default roles", g_perm_manager->role_count);
     return 0;
 }
 
-/* Assign role to agent */
-int anbs_permissions_assign_role(const char *agent_id, const char *role_name) {
-    if (!g_perm_manager || !agent_id || !role_name) {
-        return -1;
-    }
-
-    pthread_mutex_lock(&g_perm_manager->mutex);
-
+/* Assign role to agent, with the manager's mutex held */
+static int anbs_permissions_assign_role_locked(const char *agent_id, const char *role_name) {
     /* Find or create agent permissions */
     agent_permissions_t *agent_perms = NULL;
     for (int i = 0; i < g_perm_manager->agent_count; i++) {
@@ -205,14 +345,12 @@ int anbs_permissions_assign_role(const char *agent_id, const char *role_name) {
     }
 
     if (!agent_perms) {
-        pthread_mutex_unlock(&g_perm_manager->mutex);
         return -1;
     }
 
     /* Check if role already assigned */
     for (int i = 0; i < agent_perms->role_count; i++) {
         if (strcmp(agent_perms->role_names[i], role_name) == 0) {
-            pthread_mutex_unlock(&g_perm_manager->mutex);
             return 0; /* Already assigned */
         }
     }
@@ -222,68 +360,179 @@ int anbs_permissions_assign_role(const char *agent_id, const char *role_name) {
         strncpy(agent_perms->role_names[agent_perms->role_count],
                 role_name, sizeof(agent_perms->role_names[0]) - 1);
         agent_perms->role_count++;
+        anbs_permissions_changed();
     }
 
-    pthread_mutex_unlock(&g_perm_manager->mutex);
-
-    ANBS_DEBUG_LOG("Assigned role '%s' to agent '%s'", role_name, agent_id);
     return 0;
 }
 
-/* Check if agent has permission for operation */
-bool anbs_permissions_check(const char *agent_id, const char *resource,
-                           permission_type_t permission_type) {
-    if (!g_perm_manager || !agent_id || !resource) {
-        return false;
+/* Assign role to agent */
+int anbs_permissions_assign_role(const char *agent_id, const char *role_name) {
+    if (!g_perm_manager || !agent_id || !role_name) {
+        return -1;
     }
 
     pthread_mutex_lock(&g_perm_manager->mutex);
+    int result = anbs_permissions_assign_role_locked(agent_id, role_name);
+    pthread_mutex_unlock(&g_perm_manager->mutex);
 
-    /* Find agent permissions */
-    agent_permissions_t *agent_perms = NULL;
-    for (int i = 0; i < g_perm_manager->agent_count; i++) {
-        if (strcmp(g_perm_manager->agent_perms[i].agent_id, agent_id) == 0) {
-            agent_perms = &g_perm_manager->agent_perms[i];
-            break;
+    if (result == 0) {
+        ANBS_DEBUG_LOG("Assigned role '%s' to agent '%s'", role_name, agent_id);
+    }
+    return result;
+}
+
+/* Hash of a check's key, FNV-1a over agent, resource and type */
+static uint64_t anbs_permissions_hash(const char *agent_id, const char *resource,
+                                      permission_type_t permission_type) {
+    uint64_t hash = 14695981039346656037ULL;
+    const char *parts[2] = { agent_id, resource };
+
+    for (int i = 0; i < 2; i++) {
+        for (const unsigned char *p = (const unsigned char *)parts[i]; *p; p++) {
+            hash = (hash ^ *p) * 1099511628211ULL;
         }
+        hash = (hash ^ 0xff) * 1099511628211ULL;
     }
+    return (hash ^ (uint64_t)permission_type) * 1099511628211ULL;
+}
 
-    if (!agent_perms) {
-        pthread_mutex_unlock(&g_perm_manager->mutex);
-        ANBS_DEBUG_LOG("Permission denied: agent '%s' not found", agent_id);
-        return false;
+/* Checksum of a snapshot's records, FNV-1a */
+static uint64_t policy_snapshot_checksum(const void *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const unsigned char *p = data; p < (const unsigned char *)data + size; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
     }
+    return hash;
+}
 
-    /* Update access check time */
-    agent_perms->last_access_check = time(NULL);
+/* Note in *EXPIRES the next time RULE's validity changes, if sooner */
+static void anbs_permissions_note_expiry(const permission_rule_t *rule, time_t now,
+                                         time_t *expires) {
+    time_t change = 0;
 
-    /* Collect all applicable rules */
-    permission_rule_t applicable_rules[MAX_PERMISSION_RULES];
-    int applicable_count = 0;
+    if (rule->valid_from > 0 && now < rule->valid_from) {
+        change = rule->valid_from;
+    } else if (rule->valid_until > 0 && now <= rule->valid_until) {
+        change = rule->valid_until + 1;
+    }
 
-    /* Check custom rules first (highest priority) */
-    for (int i = 0; i < agent_perms->custom_rule_count; i++) {
-        permission_rule_t *rule = &agent_perms->custom_rules[i];
-        if (rule->active && (rule->permission_type & permission_type) &&
-            fnmatch(rule->resource_pattern, resource, FNM_PATHNAME) == 0) {
-            applicable_rules[applicable_count++] = *rule;
+    if (change > 0 && (*expires == 0 || change < *expires)) {
+        *expires = change;
+    }
+}
+
+/* A rule and where it was found, for a stable sort by priority */
+typedef struct {
+    const permission_rule_t *rule;
+    int order;
+} permission_ranked_t;
+
+static int anbs_permissions_rank_compare(const void *a, const void *b) {
+    const permission_ranked_t *x = a, *y = b;
+
+    if (x->rule->priority != y->rule->priority) {
+        return x->rule->priority < y->rule->priority ? 1 : -1;
+    }
+    return x->order - y->order;
+}
+
+static void anbs_permissions_index_free(permission_index_t *index) {
+    if (!index) {
+        return;
+    }
+    for (int i = 0; i < index->node_count; i++) {
+        free(index->nodes[i].rules);
+    }
+    free(index->nodes);
+    free(index->rules);
+    free(index);
+}
+
+/* Child of node PARENT for BYTE, made if missing; -1 if out of memory */
+static int anbs_permissions_trie_child(permission_index_t *index, int parent, unsigned char byte) {
+    int node;
+
+    for (node = index->nodes[parent].child; node >= 0; node = index->nodes[node].sibling) {
+        if (index->nodes[node].byte == byte) {
+            return node;
+        }
+    }
+
+    if (index->node_count == index->node_capacity) {
+        int capacity = index->node_capacity * 2;
+        permission_trie_node_t *nodes = realloc(index->nodes, capacity * sizeof(*nodes));
+
+        if (!nodes) {
+            return -1;
         }
+        index->nodes = nodes;
+        index->node_capacity = capacity;
+    }
+
+    node = index->node_count++;
+    memset(&index->nodes[node], 0, sizeof(index->nodes[node]));
+    index->nodes[node].byte = byte;
+    index->nodes[node].child = -1;
+    index->nodes[node].sibling = index->nodes[parent].child;
+    index->nodes[parent].child = node;
+    return node;
+}
+
+/* Compile AGENT_PERMS' active rules into a list sorted by priority, with
+   each rule hung off the trie node for its pattern's literal prefix: the
+   text before the first wildcard, which any resource it matches begins
+   with */
+static permission_index_t *anbs_permissions_compile(const agent_permissions_t *agent_perms) {
+    permission_index_t *index = calloc(1, sizeof(permission_index_t));
+    permission_ranked_t *ranked;
+    int count = agent_perms->custom_rule_count;
+
+    if (!index) {
+        return NULL;
     }
 
-    /* Check role-based rules */
     for (int r = 0; r < agent_perms->role_count; r++) {
-        const char *role_name = agent_perms->role_names[r];
+        for (int i = 0; i < g_perm_manager->role_count; i++) {
+            if (strcmp(g_perm_manager->roles[i].role_name, agent_perms->role_names[r]) == 0) {
+                count += g_perm_manager->roles[i].rule_count;
+                break;
+            }
+        }
+    }
 
-        /* Find role */
+    ranked = malloc((count > 0 ? count : 1) * sizeof(*ranked));
+    index->rules = malloc((count > 0 ? count : 1) * sizeof(*index->rules));
+    index->node_capacity = 64;
+    index->nodes = malloc(index->node_capacity * sizeof(*index->nodes));
+    if (!ranked || !index->rules || !index->nodes) {
+        free(ranked);
+        anbs_permissions_index_free(index);
+        return NULL;
+    }
+    memset(&index->nodes[0], 0, sizeof(index->nodes[0]));
+    index->nodes[0].child = -1;
+    index->nodes[0].sibling = -1;
+    index->node_count = 1;
+
+    /* Custom rules first, then each role's in the order assigned */
+    for (int i = 0; i < agent_perms->custom_rule_count; i++) {
+        if (agent_perms->custom_rules[i].active) {
+            ranked[index->rule_count].rule = &agent_perms->custom_rules[i];
+            ranked[index->rule_count].order = index->rule_count;
+            index->rule_count++;
+        }
+    }
+    for (int r = 0; r < agent_perms->role_count; r++) {
         for (int i = 0; i < g_perm_manager->role_count; i++) {
-            role_t *role = &g_perm_manager->roles[i];
-            if (strcmp(role->role_name, role_name) == 0) {
-                /* Check rules in this role */
+            const role_t *role = &g_perm_manager->roles[i];
+            if (strcmp(role->role_name, agent_perms->role_names[r]) == 0) {
                 for (int j = 0; j < role->rule_count; j++) {
-                    permission_rule_t *rule = &role->rules[j];
-                    if (rule->active && (rule->permission_type & permission_type) &&
-                        fnmatch(rule->resource_pattern, resource, FNM_PATHNAME) == 0) {
-                        applicable_rules[applicable_count++] = *rule;
+                    if (role->rules[j].active) {
+                        ranked[index->rule_count].rule = &role->rules[j];
+                        ranked[index->rule_count].order = index->rule_count;
+                        index->rule_count++;
                     }
                 }
                 break;
@@ -291,24 +540,102 @@ bool anbs_permissions_check(const char *agent_id, const char *resource,
         }
     }
 
-    /* Sort rules by priority (higher priority first) */
-    for (int i = 0; i < applicable_count - 1; i++) {
-        for (int j = i + 1; j < applicable_count; j++) {
-            if (applicable_rules[i].priority < applicable_rules[j].priority) {
-                permission_rule_t temp = applicable_rules[i];
-                applicable_rules[i] = applicable_rules[j];
-                applicable_rules[j] = temp;
+    qsort(ranked, index->rule_count, sizeof(*ranked), anbs_permissions_rank_compare);
+
+    for (int i = 0; i < index->rule_count; i++) {
+        const char *p = ranked[i].rule->resource_pattern;
+        permission_trie_node_t *node;
+        int at = 0;
+
+        index->rules[i] = ranked[i].rule;
+        for (; *p && !strchr("*?[\\", *p); p++) {
+            at = anbs_permissions_trie_child(index, at, (unsigned char)*p);
+            if (at < 0) {
+                free(ranked);
+                anbs_permissions_index_free(index);
+                return NULL;
+            }
+        }
+
+        node = &index->nodes[at];
+        if (node->rule_count == node->rule_capacity) {
+            int capacity = node->rule_capacity ? node->rule_capacity * 2 : 4;
+            int *rules = realloc(node->rules, capacity * sizeof(int));
+
+            if (!rules) {
+                free(ranked);
+                anbs_permissions_index_free(index);
+                return NULL;
             }
+            node->rules = rules;
+            node->rule_capacity = capacity;
         }
+        node->rules[node->rule_count++] = i;
     }
 
-    /* Evaluate rules (first match wins) */
-    bool access_granted = false;
-    for (int i = 0; i < applicable_count; i++) {
-        permission_rule_t *rule = &applicable_rules[i];
+    free(ranked);
+    return index;
+}
+
+/* Evaluate the rules compiled into INDEX for RESOURCE at NOW.  *EXPIRES
+   is set to when the answer could next change, or 0 if only a policy
+   change can.  Only rules whose literal prefix RESOURCE begins with are
+   visited, in priority order, stopping at the first that applies. */
+static bool anbs_permissions_evaluate(const permission_index_t *index, const char *resource,
+                                      permission_type_t permission_type, time_t now,
+                                      time_t *expires) {
+    int lists = 0, node = 0;
+
+    *expires = 0;
+
+    /* The rule lists along RESOURCE's path down the trie, at most one
+       per byte and one per rule */
+    size_t most = strlen(resource) + 1;
+    if (most > (size_t)index->rule_count) {
+        most = index->rule_count;
+    }
+    int *cursor[most + 1], *end[most + 1];
+
+    for (const char *p = resource; node >= 0; p++) {
+        if (index->nodes[node].rule_count > 0) {
+            cursor[lists] = index->nodes[node].rules;
+            end[lists] = index->nodes[node].rules + index->nodes[node].rule_count;
+            lists++;
+        }
+        if (!*p) {
+            break;
+        }
+        for (node = index->nodes[node].child; node >= 0; node = index->nodes[node].sibling) {
+            if (index->nodes[node].byte == (unsigned char)*p) {
+                break;
+            }
+        }
+    }
+
+    /* Merge them by position, which is priority order; every rule looked
+       at up to the winner could change the answer when its validity does */
+    for (;;) {
+        const permission_rule_t *rule;
+        int best = -1;
+
+        for (int i = 0; i < lists; i++) {
+            if (cursor[i] < end[i] && (best < 0 || *cursor[i] < *cursor[best])) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            return false;
+        }
+        rule = index->rules[*cursor[best]++];
+
+        if (!rule->active || !(rule->permission_type & permission_type) ||
+            fnmatch(rule->resource_pattern, resource, FNM_PATHNAME) != 0) {
+            continue;
+        }
+
+        anbs_permissions_note_expiry(rule, now, expires);
 
         /* Check time constraints */
-        time_t now = time(NULL);
         if (rule->valid_from > 0 && now < rule->valid_from) {
             continue;
         }
@@ -318,29 +645,247 @@ bool anbs_permissions_check(const char *agent_id, const char *resource,
 
         /* Apply rule effect */
         if (rule->effect == EFFECT_ALLOW) {
-            access_granted = true;
-            agent_perms->allowed_operations_count++;
-            break;
+            return true;
         } else if (rule->effect == EFFECT_DENY) {
-            access_granted = false;
-            agent_perms->denied_operations_count++;
+            return false;
+        }
+    }
+}
+
+/* Drop a reference to VIEW, with the mutex held */
+static void anbs_permissions_view_release(permission_view_t *view) {
+    if (!view || --view->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < view->agent_count; i++) {
+        anbs_permissions_index_free(view->agents[i].index);
+    }
+    free(view);
+}
+
+/* Compile every agent's rules as of the current epoch, with the mutex
+   held */
+static permission_view_t *anbs_permissions_view_build(void) {
+    permission_view_t *view;
+
+    view = calloc(1, sizeof(*view) + g_perm_manager->agent_count * sizeof(view->agents[0]));
+    if (!view) {
+        return NULL;
+    }
+
+    view->epoch = g_perm_manager->policy_epoch;
+    view->refs = 1;
+    view->agent_count = g_perm_manager->agent_count;
+    for (int i = 0; i < view->agent_count; i++) {
+        memcpy(view->agents[i].agent_id, g_perm_manager->agent_perms[i].agent_id,
+               sizeof(view->agents[i].agent_id));
+        view->agents[i].index = anbs_permissions_compile(&g_perm_manager->agent_perms[i]);
+    }
+    return view;
+}
+
+/* The calling thread's state, made on its first check */
+static permission_thread_t *anbs_permissions_thread(void) {
+    permission_thread_t *thread = pthread_getspecific(g_perm_manager->thread_key);
+
+    if (thread) {
+        return thread;
+    }
+
+    thread = calloc(1, sizeof(*thread));
+    if (!thread || pthread_setspecific(g_perm_manager->thread_key, thread) != 0) {
+        free(thread);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_perm_manager->mutex);
+    thread->next = g_perm_manager->threads;
+    g_perm_manager->threads = thread;
+    pthread_mutex_unlock(&g_perm_manager->mutex);
+    return thread;
+}
+
+/* Fold an exiting thread's counters into the manager's and let go of
+   its view */
+static void anbs_permissions_thread_exit(void *arg) {
+    permission_thread_t *thread = arg;
+
+    if (!g_perm_manager) {
+        free(thread);
+        return;
+    }
+
+    pthread_mutex_lock(&g_perm_manager->mutex);
+
+    for (permission_thread_t **link = &g_perm_manager->threads; *link; link = &(*link)->next) {
+        if (*link == thread) {
+            *link = thread->next;
             break;
         }
     }
 
-    if (!access_granted) {
-        agent_perms->denied_operations_count++;
+    for (int i = 0; i < g_perm_manager->agent_count; i++) {
+        agent_permissions_t *agent_perms = &g_perm_manager->agent_perms[i];
+
+        agent_perms->allowed_operations_count += thread->allowed[i];
+        agent_perms->denied_operations_count += thread->denied[i];
+        if (thread->last_check[i] > agent_perms->last_access_check) {
+            agent_perms->last_access_check = thread->last_check[i];
+        }
+    }
+    g_perm_manager->cache_hits += thread->cache_hits;
+    g_perm_manager->cache_misses += thread->cache_misses;
+    anbs_permissions_view_release(thread->view);
+
+    pthread_mutex_unlock(&g_perm_manager->mutex);
+    free(thread);
+}
+
+/* The view THREAD should check against.  While the epoch is unchanged
+   that is the one it already holds, found without a lock; after a
+   change the first thread to check publishes a new one, and each thread
+   swaps its reference over once. */
+static permission_view_t *anbs_permissions_view(permission_thread_t *thread) {
+    uint64_t epoch = __atomic_load_n(&g_perm_manager->policy_epoch, __ATOMIC_ACQUIRE);
+    permission_view_t *view;
+
+    if (thread->view && thread->view->epoch == epoch) {
+        return thread->view;
+    }
+
+    pthread_mutex_lock(&g_perm_manager->mutex);
+
+    view = g_perm_manager->view;
+    if (!view || view->epoch != g_perm_manager->policy_epoch) {
+        permission_view_t *fresh = anbs_permissions_view_build();
+
+        if (fresh) {
+            anbs_permissions_view_release(view);
+            g_perm_manager->view = view = fresh;
+        }
+    }
+
+    if (view && view != thread->view) {
+        view->refs++;
+        anbs_permissions_view_release(thread->view);
+        thread->view = view;
     }
 
     pthread_mutex_unlock(&g_perm_manager->mutex);
+    return thread->view;
+}
+
+/* Check if agent has permission for operation.  Repeated checks are
+   answered from the thread's decision cache without walking the rules,
+   and no check takes a lock unless the policy has just changed. */
+bool anbs_permissions_check(const char *agent_id, const char *resource,
+                           permission_type_t permission_type) {
+    if (!g_perm_manager || !agent_id || !resource) {
+        return false;
+    }
+
+    permission_thread_t *thread = anbs_permissions_thread();
+    permission_view_t *view = thread ? anbs_permissions_view(thread) : NULL;
+    if (!view) {
+        return false;
+    }
+
+    uint64_t hash = anbs_permissions_hash(agent_id, resource, permission_type);
+    time_t now = time(NULL);
+    bool cacheable = strlen(resource) < PERMISSION_CACHE_RESOURCE &&
+                     strlen(agent_id) < sizeof(((permission_decision_t *)0)->agent_id);
+    bool access_granted;
+    int agent = -1;
+
+    permission_decision_t *decision = &thread->decisions[hash % PERMISSION_CACHE_SLOTS];
+    if (cacheable && decision->epoch == view->epoch &&
+        decision->hash == hash && decision->permission_type == permission_type &&
+        (decision->expires == 0 || now < decision->expires) &&
+        strcmp(decision->resource, resource) == 0 &&
+        strcmp(decision->agent_id, agent_id) == 0) {
+        agent = decision->agent;
+        access_granted = decision->granted;
+        __atomic_store_n(&thread->cache_hits, thread->cache_hits + 1, __ATOMIC_RELAXED);
+    } else {
+        time_t expires;
+
+        /* Find agent permissions */
+        for (int i = 0; i < view->agent_count; i++) {
+            if (strcmp(view->agents[i].agent_id, agent_id) == 0) {
+                agent = i;
+                break;
+            }
+        }
+
+        if (agent < 0) {
+            ANBS_DEBUG_LOG("Permission denied: agent '%s' not found", agent_id);
+            anbs_audit_record("permission", agent_id, resource, permission_type, false);
+            return false;
+        }
+
+        access_granted = view->agents[agent].index &&
+                         anbs_permissions_evaluate(view->agents[agent].index, resource,
+                                                   permission_type, now, &expires);
+        __atomic_store_n(&thread->cache_misses, thread->cache_misses + 1, __ATOMIC_RELAXED);
+
+        if (cacheable && view->agents[agent].index) {
+            decision->epoch = view->epoch;
+            decision->hash = hash;
+            decision->agent = agent;
+            decision->permission_type = permission_type;
+            decision->expires = expires;
+            decision->granted = access_granted;
+            strcpy(decision->agent_id, agent_id);
+            strcpy(decision->resource, resource);
+        }
+    }
+
+    /* Update access check time and counters; only this thread writes
+       them, so plain stores do */
+    __atomic_store_n(&thread->last_check[agent], now, __ATOMIC_RELAXED);
+
+    if (access_granted) {
+        __atomic_store_n(&thread->allowed[agent], thread->allowed[agent] + 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&thread->denied[agent], thread->denied[agent] + 1, __ATOMIC_RELAXED);
+    }
 
     ANBS_DEBUG_LOG("Permission check for agent '%s', resource '%s', type %d: %s",
                    agent_id, resource, permission_type,
                    access_granted ? "GRANTED" : "DENIED");
+    anbs_audit_record("permission", agent_id, resource, permission_type, access_granted);
 
     return access_granted;
 }
 
+/* Check whether this process may access an object shared between local
+   sessions (e.g. a shared cache entry) owned by OWNER_UID/OWNER_GID with
+   permission bits MODE.  WANT is S_IROTH and/or S_IWOTH; the owner, group
+   (including supplementary groups) and other classes apply as for files. */
+bool anbs_permissions_check_shared(uid_t owner_uid, gid_t owner_gid, mode_t mode, mode_t want) {
+    mode_t granted;
+
+    if (geteuid() == owner_uid) {
+        granted = (mode >> 6) & 07;
+    } else {
+        bool member = (getegid() == owner_gid);
+
+        if (!member) {
+            gid_t groups[64];
+            int count = getgroups(64, groups);
+            for (int i = 0; i < count; i++) {
+                if (groups[i] == owner_gid) {
+                    member = true;
+                    break;
+                }
+            }
+        }
+        granted = member ? (mode >> 3) & 07 : mode & 07;
+    }
+
+    return (granted & want) == want;
+}
+
 /* Add custom permission rule to agent */
 int anbs_permissions_add_custom_rule(const char *agent_id, const char *resource_pattern,
                                     permission_type_t permission_type,
@@ -378,6 +923,7 @@ int anbs_permissions_add_custom_rule(const char *agent_id, const char *resource_
     rule->priority = priority;
     rule->active = true;
 
+    anbs_permissions_changed();
     pthread_mutex_unlock(&g_perm_manager->mutex);
 
     ANBS_DEBUG_LOG("Added custom rule for agent '%s': %s (%s)",
@@ -386,7 +932,345 @@ int anbs_permissions_add_custom_rule(const char *agent_id, const char *resource_
     return 0;
 }
 
-/* Load permission policy from JSON file */
+/* Fill SNAPSHOT from the policy JSON in ROOT, stamped with SOURCE, the
+   stat of the file it came from */
+static int policy_snapshot_build(json_object *root, const struct stat *source,
+                                 policy_snapshot_t *snapshot) {
+    json_object *roles_obj = NULL, *agents_obj = NULL;
+    size_t roles_len = 0, rules_len = 0, agents_len = 0, names_len = 0;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    /* Size everything first; records skipped below just leave room unused */
+    if (json_object_object_get_ex(root, "roles", &roles_obj)) {
+        roles_len = json_object_array_length(roles_obj);
+        for (size_t i = 0; i < roles_len; i++) {
+            json_object *rules_obj;
+            if (json_object_object_get_ex(json_object_array_get_idx(roles_obj, i), "rules", &rules_obj)) {
+                rules_len += json_object_array_length(rules_obj);
+            }
+        }
+    }
+    if (json_object_object_get_ex(root, "agents", &agents_obj)) {
+        agents_len = json_object_array_length(agents_obj);
+        for (size_t i = 0; i < agents_len; i++) {
+            json_object *names_obj;
+            if (json_object_object_get_ex(json_object_array_get_idx(agents_obj, i), "roles", &names_obj)) {
+                names_len += json_object_array_length(names_obj);
+            }
+        }
+    }
+
+    policy_snapshot_role_t *roles = calloc(roles_len + 1, sizeof(*roles));
+    permission_rule_t *rules = calloc(rules_len + 1, sizeof(*rules));
+    policy_snapshot_agent_t *agents = calloc(agents_len + 1, sizeof(*agents));
+    char (*names)[POLICY_SNAPSHOT_NAME] = calloc(names_len + 1, POLICY_SNAPSHOT_NAME);
+    uint32_t role_count = 0, rule_count = 0, agent_count = 0, name_count = 0;
+
+    if (!roles || !rules || !agents || !names) {
+        free(roles);
+        free(rules);
+        free(agents);
+        free(names);
+        return -1;
+    }
+
+    /* Load roles */
+    for (size_t i = 0; i < roles_len; i++) {
+        json_object *role_obj = json_object_array_get_idx(roles_obj, i);
+        json_object *name_obj, *desc_obj, *rules_obj;
+
+        if (json_object_object_get_ex(role_obj, "name", &name_obj) &&
+            json_object_object_get_ex(role_obj, "description", &desc_obj) &&
+            json_object_object_get_ex(role_obj, "rules", &rules_obj)) {
+
+            policy_snapshot_role_t *role = &roles[role_count++];
+            strncpy(role->role_name, json_object_get_string(name_obj),
+                   sizeof(role->role_name) - 1);
+            strncpy(role->description, json_object_get_string(desc_obj),
+                   sizeof(role->description) - 1);
+            role->first_rule = rule_count;
+
+            /* Load rules for this role */
+            size_t role_rules_len = json_object_array_length(rules_obj);
+            for (size_t j = 0; j < role_rules_len && role->rule_count < MAX_PERMISSION_RULES; j++) {
+                json_object *rule_obj = json_object_array_get_idx(rules_obj, j);
+                json_object *pattern_obj, *type_obj, *effect_obj, *priority_obj;
+
+                if (json_object_object_get_ex(rule_obj, "resource", &pattern_obj) &&
+                    json_object_object_get_ex(rule_obj, "permission", &type_obj) &&
+                    json_object_object_get_ex(rule_obj, "effect", &effect_obj) &&
+                    json_object_object_get_ex(rule_obj, "priority", &priority_obj)) {
+
+                    permission_rule_t *rule = &rules[rule_count++];
+                    strncpy(rule->resource_pattern, json_object_get_string(pattern_obj),
+                           sizeof(rule->resource_pattern) - 1);
+                    rule->permission_type = json_object_get_int(type_obj);
+                    rule->effect = json_object_get_int(effect_obj);
+                    rule->priority = json_object_get_int(priority_obj);
+                    rule->active = true;
+                    role->rule_count++;
+                }
+            }
+        }
+    }
+
+    /* Load agent assignments */
+    for (size_t i = 0; i < agents_len; i++) {
+        json_object *agent_obj = json_object_array_get_idx(agents_obj, i);
+        json_object *id_obj, *roles_array_obj;
+
+        if (json_object_object_get_ex(agent_obj, "agent_id", &id_obj) &&
+            json_object_object_get_ex(agent_obj, "roles", &roles_array_obj)) {
+
+            policy_snapshot_agent_t *agent = &agents[agent_count++];
+            strncpy(agent->agent_id, json_object_get_string(id_obj),
+                   sizeof(agent->agent_id) - 1);
+            agent->first_name = name_count;
+
+            size_t roles_array_len = json_object_array_length(roles_array_obj);
+            for (size_t j = 0; j < roles_array_len; j++) {
+                const char *role_name = json_object_get_string(json_object_array_get_idx(roles_array_obj, j));
+                if (role_name) {
+                    strncpy(names[name_count++], role_name, POLICY_SNAPSHOT_NAME - 1);
+                    agent->name_count++;
+                }
+            }
+        }
+    }
+
+    snapshot->size = sizeof(policy_snapshot_header_t) +
+                     role_count * sizeof(*roles) + rule_count * sizeof(*rules) +
+                     agent_count * sizeof(*agents) + name_count * POLICY_SNAPSHOT_NAME;
+    snapshot->data = calloc(1, snapshot->size);
+    if (snapshot->data) {
+        char *p = (char *)snapshot->data + sizeof(policy_snapshot_header_t);
+
+        memcpy(p, roles, role_count * sizeof(*roles));
+        p += role_count * sizeof(*roles);
+        memcpy(p, rules, rule_count * sizeof(*rules));
+        p += rule_count * sizeof(*rules);
+        memcpy(p, agents, agent_count * sizeof(*agents));
+        p += agent_count * sizeof(*agents);
+        memcpy(p, names, name_count * POLICY_SNAPSHOT_NAME);
+    }
+    free(roles);
+    free(rules);
+    free(agents);
+    free(names);
+    if (!snapshot->data) {
+        return -1;
+    }
+
+    policy_snapshot_header_t *header = (policy_snapshot_header_t *)snapshot->data;
+    header->magic = POLICY_SNAPSHOT_MAGIC;
+    header->version = POLICY_SNAPSHOT_VERSION;
+    header->rule_size = sizeof(permission_rule_t);
+    header->source_dev = source->st_dev;
+    header->source_ino = source->st_ino;
+    header->source_size = source->st_size;
+    header->source_mtime_sec = source->st_mtim.tv_sec;
+    header->source_mtime_nsec = source->st_mtim.tv_nsec;
+    header->role_count = role_count;
+    header->rule_count = rule_count;
+    header->agent_count = agent_count;
+    header->name_count = name_count;
+    header->checksum = policy_snapshot_checksum(header + 1,
+                                                snapshot->size - sizeof(policy_snapshot_header_t));
+    return 0;
+}
+
+/* Check that DATA, SIZE bytes, is a whole snapshot of the policy file
+   SOURCE describes, with every record in bounds */
+static bool policy_snapshot_valid(const void *data, size_t size, const struct stat *source) {
+    const policy_snapshot_header_t *header = data;
+
+    if (size < sizeof(*header) ||
+        header->magic != POLICY_SNAPSHOT_MAGIC ||
+        header->version != POLICY_SNAPSHOT_VERSION ||
+        header->rule_size != sizeof(permission_rule_t) ||
+        header->source_dev != (uint64_t)source->st_dev ||
+        header->source_ino != (uint64_t)source->st_ino ||
+        header->source_size != (uint64_t)source->st_size ||
+        header->source_mtime_sec != (int64_t)source->st_mtim.tv_sec ||
+        header->source_mtime_nsec != (int64_t)source->st_mtim.tv_nsec) {
+        return false;
+    }
+
+    if (size != sizeof(*header) +
+                (uint64_t)header->role_count * sizeof(policy_snapshot_role_t) +
+                (uint64_t)header->rule_count * sizeof(permission_rule_t) +
+                (uint64_t)header->agent_count * sizeof(policy_snapshot_agent_t) +
+                (uint64_t)header->name_count * POLICY_SNAPSHOT_NAME) {
+        return false;
+    }
+
+    const policy_snapshot_role_t *roles = (const policy_snapshot_role_t *)(header + 1);
+    const permission_rule_t *rules = (const permission_rule_t *)(roles + header->role_count);
+    const policy_snapshot_agent_t *agents = (const policy_snapshot_agent_t *)(rules + header->rule_count);
+
+    for (uint32_t i = 0; i < header->role_count; i++) {
+        if (roles[i].rule_count > MAX_PERMISSION_RULES ||
+            roles[i].first_rule > header->rule_count ||
+            roles[i].rule_count > header->rule_count - roles[i].first_rule) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->agent_count; i++) {
+        if (agents[i].first_name > header->name_count ||
+            agents[i].name_count > header->name_count - agents[i].first_name) {
+            return false;
+        }
+    }
+
+    return policy_snapshot_checksum(header + 1, size - sizeof(*header)) == header->checksum;
+}
+
+/* Add the roles and agent assignments of a valid snapshot to the policy */
+static void policy_snapshot_apply(const void *data) {
+    const policy_snapshot_header_t *header = data;
+    const policy_snapshot_role_t *roles = (const policy_snapshot_role_t *)(header + 1);
+    const permission_rule_t *rules = (const permission_rule_t *)(roles + header->role_count);
+    const policy_snapshot_agent_t *agents = (const policy_snapshot_agent_t *)(rules + header->rule_count);
+    const char (*names)[POLICY_SNAPSHOT_NAME] =
+        (const char (*)[POLICY_SNAPSHOT_NAME])(agents + header->agent_count);
+
+    pthread_mutex_lock(&g_perm_manager->mutex);
+
+    for (uint32_t i = 0; i < header->role_count && g_perm_manager->role_count < MAX_ROLES; i++) {
+        role_t *role = &g_perm_manager->roles[g_perm_manager->role_count++];
+
+        memset(role, 0, sizeof(*role));
+        memcpy(role->role_name, roles[i].role_name, sizeof(role->role_name) - 1);
+        memcpy(role->description, roles[i].description, sizeof(role->description) - 1);
+        memcpy(role->rules, rules + roles[i].first_rule,
+               roles[i].rule_count * sizeof(permission_rule_t));
+        role->rule_count = roles[i].rule_count;
+
+        for (int j = 0; j < role->rule_count; j++) {
+            role->rules[j].resource_pattern[sizeof(role->rules[j].resource_pattern) - 1] = '\0';
+            role->rules[j].conditions[sizeof(role->rules[j].conditions) - 1] = '\0';
+        }
+    }
+
+    for (uint32_t i = 0; i < header->agent_count; i++) {
+        char agent_id[sizeof(agents[i].agent_id)];
+
+        memcpy(agent_id, agents[i].agent_id, sizeof(agent_id) - 1);
+        agent_id[sizeof(agent_id) - 1] = '\0';
+
+        for (uint32_t j = 0; j < agents[i].name_count; j++) {
+            char role_name[POLICY_SNAPSHOT_NAME];
+
+            memcpy(role_name, names[agents[i].first_name + j], sizeof(role_name) - 1);
+            role_name[sizeof(role_name) - 1] = '\0';
+            anbs_permissions_assign_role_locked(agent_id, role_name);
+        }
+    }
+
+    anbs_permissions_changed();
+    pthread_mutex_unlock(&g_perm_manager->mutex);
+}
+
+/* Path of the policy's snapshot: ANBS_POLICY_SNAPSHOT, or the policy
+   file's with ".snap" added */
+static int policy_snapshot_path(char *path, size_t size) {
+    const char *configured = getenv("ANBS_POLICY_SNAPSHOT");
+    int written;
+
+    if (configured && *configured) {
+        written = snprintf(path, size, "%s", configured);
+    } else {
+        written = snprintf(path, size, "%s.snap", g_perm_manager->policy_file_path);
+    }
+    return written > 0 && (size_t)written < size ? 0 : -1;
+}
+
+/* Load the policy from its snapshot, if there is one for SOURCE that
+   nobody but the policy file's owner or root could have written */
+static int policy_snapshot_load(const struct stat *source) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    if (policy_snapshot_path(path, sizeof(path)) != 0) {
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (st.st_uid != source->st_uid && st.st_uid != 0) || (st.st_mode & 022) ||
+        st.st_size < (off_t)sizeof(policy_snapshot_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    int result = -1;
+    if (policy_snapshot_valid(map, st.st_size, source)) {
+        policy_snapshot_apply(map);
+        result = 0;
+    }
+    munmap(map, st.st_size);
+    return result;
+}
+
+/* Write SNAPSHOT next to the policy, to a temporary file renamed into
+   place so a reader never sees half of one */
+static void policy_snapshot_save(const policy_snapshot_t *snapshot) {
+    char path[PATH_MAX], tmp_path[PATH_MAX + 8];
+    const char *data = snapshot->data;
+    size_t left = snapshot->size;
+    int fd;
+
+    if (policy_snapshot_path(path, sizeof(path)) != 0) {
+        return;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+
+    fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        ANBS_DEBUG_LOG("Cannot write policy snapshot %s", path);
+        return;
+    }
+
+    while (left > 0) {
+        ssize_t n = write(fd, data, left);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        data += n;
+        left -= n;
+    }
+
+    if (left == 0 && fchmod(fd, 0644) == 0 && fsync(fd) == 0 && close(fd) == 0) {
+        fd = -1;
+        if (rename(tmp_path, path) == 0) {
+            ANBS_DEBUG_LOG("Wrote policy snapshot %s", path);
+            return;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(tmp_path);
+}
+
+/* Load permission policy from its snapshot, or from the JSON file when
+   the snapshot is missing or was taken of another version of it */
 int anbs_permissions_load_policy(void) {
     if (!g_perm_manager) {
         return -1;
@@ -398,10 +1282,21 @@ int anbs_permissions_load_policy(void) {
         return 0; /* Not an error - use defaults */
     }
 
+    struct stat source;
+    if (fstat(fileno(file), &source) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    if (policy_snapshot_load(&source) == 0) {
+        fclose(file);
+        ANBS_DEBUG_LOG("Loaded permission policy snapshot with %d roles and %d agents",
+                       g_perm_manager->role_count, g_perm_manager->agent_count);
+        return 0;
+    }
+
     /* Read file content */
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    long file_size = source.st_size;
 
     char *content = malloc(file_size + 1);
     if (!content) {
@@ -409,8 +1304,8 @@ int anbs_permissions_load_policy(void) {
         return -1;
     }
 
-    fread(content, 1, file_size, file);
-    content[file_size] = '\0';
+    size_t content_len = fread(content, 1, file_size, file);
+    content[content_len] = '\0';
     fclose(file);
 
     /* Parse JSON */
@@ -422,76 +1317,18 @@ int anbs_permissions_load_policy(void) {
         return -1;
     }
 
-    pthread_mutex_lock(&g_perm_manager->mutex);
-
-    /* Load roles */
-    json_object *roles_obj;
-    if (json_object_object_get_ex(root, "roles", &roles_obj)) {
-        int roles_len = json_object_array_length(roles_obj);
-        for (int i = 0; i < roles_len && g_perm_manager->role_count < MAX_ROLES; i++) {
-            json_object *role_obj = json_object_array_get_idx(roles_obj, i);
-            json_object *name_obj, *desc_obj, *rules_obj;
-
-            if (json_object_object_get_ex(role_obj, "name", &name_obj) &&
-                json_object_object_get_ex(role_obj, "description", &desc_obj) &&
-                json_object_object_get_ex(role_obj, "rules", &rules_obj)) {
-
-                role_t *role = &g_perm_manager->roles[g_perm_manager->role_count++];
-                strncpy(role->role_name, json_object_get_string(name_obj),
-                       sizeof(role->role_name) - 1);
-                strncpy(role->description, json_object_get_string(desc_obj),
-                       sizeof(role->description) - 1);
-
-                /* Load rules for this role */
-                int rules_len = json_object_array_length(rules_obj);
-                for (int j = 0; j < rules_len && role->rule_count < MAX_PERMISSION_RULES; j++) {
-                    json_object *rule_obj = json_object_array_get_idx(rules_obj, j);
-                    json_object *pattern_obj, *type_obj, *effect_obj, *priority_obj;
-
-                    if (json_object_object_get_ex(rule_obj, "resource", &pattern_obj) &&
-                        json_object_object_get_ex(rule_obj, "permission", &type_obj) &&
-                        json_object_object_get_ex(rule_obj, "effect", &effect_obj) &&
-                        json_object_object_get_ex(rule_obj, "priority", &priority_obj)) {
-
-                        permission_rule_t *rule = &role->rules[role->rule_count++];
-                        strncpy(rule->resource_pattern, json_object_get_string(pattern_obj),
-                               sizeof(rule->resource_pattern) - 1);
-                        rule->permission_type = json_object_get_int(type_obj);
-                        rule->effect = json_object_get_int(effect_obj);
-                        rule->priority = json_object_get_int(priority_obj);
-                        rule->active = true;
-                    }
-                }
-            }
-        }
+    policy_snapshot_t snapshot;
+    int result = policy_snapshot_build(root, &source, &snapshot);
+    json_object_put(root);
+    if (result != 0) {
+        return -1;
     }
 
-    /* Load agent assignments */
-    json_object *agents_obj;
-    if (json_object_object_get_ex(root, "agents", &agents_obj)) {
-        int agents_len = json_object_array_length(agents_obj);
-        for (int i = 0; i < agents_len && g_perm_manager->agent_count < MAX_AGENTS; i++) {
-            json_object *agent_obj = json_object_array_get_idx(agents_obj, i);
-            json_object *id_obj, *roles_array_obj;
-
-            if (json_object_object_get_ex(agent_obj, "agent_id", &id_obj) &&
-                json_object_object_get_ex(agent_obj, "roles", &roles_array_obj)) {
-
-                const char *agent_id = json_object_get_string(id_obj);
-                int roles_array_len = json_object_array_length(roles_array_obj);
-
-                for (int j = 0; j < roles_array_len; j++) {
-                    json_object *role_name_obj = json_object_array_get_idx(roles_array_obj, j);
-                    const char *role_name = json_object_get_string(role_name_obj);
-                    anbs_permissions_assign_role(agent_id, role_name);
-                }
-            }
-        }
+    policy_snapshot_apply(snapshot.data);
+    if (content_len == (size_t)file_size) {
+        policy_snapshot_save(&snapshot);
     }
-
-    pthread_mutex_unlock(&g_perm_manager->mutex);
-
-    json_object_put(root);
+    free(snapshot.data);
 
     ANBS_DEBUG_LOG("Loaded permission policy with %d roles and %d agents",
                    g_perm_manager->role_count, g_perm_manager->agent_count);
@@ -558,6 +1395,15 @@ int anbs_permissions_save_policy(void) {
     FILE *file = fopen(g_perm_manager->policy_file_path, "w");
     if (file) {
         fprintf(file, "%s\n", json_string);
+
+        /* The snapshot of what was there is stale now; take one of this */
+        struct stat source;
+        policy_snapshot_t snapshot;
+        if (fflush(file) == 0 && fstat(fileno(file), &source) == 0 &&
+            policy_snapshot_build(root, &source, &snapshot) == 0) {
+            policy_snapshot_save(&snapshot);
+            free(snapshot.data);
+        }
         fclose(file);
     }
 
@@ -579,9 +1425,11 @@ int anbs_permissions_get_stats(const char *agent_id, char **stats_json) {
 
     /* Find agent permissions */
     agent_permissions_t *agent_perms = NULL;
+    int agent = -1;
     for (int i = 0; i < g_perm_manager->agent_count; i++) {
         if (strcmp(g_perm_manager->agent_perms[i].agent_id, agent_id) == 0) {
             agent_perms = &g_perm_manager->agent_perms[i];
+            agent = i;
             break;
         }
     }
@@ -591,6 +1439,20 @@ int anbs_permissions_get_stats(const char *agent_id, char **stats_json) {
         return -1;
     }
 
+    /* Exited threads' counts, plus what each live thread has counted */
+    unsigned long allowed = agent_perms->allowed_operations_count;
+    unsigned long denied = agent_perms->denied_operations_count;
+    time_t last_access_check = agent_perms->last_access_check;
+    for (permission_thread_t *thread = g_perm_manager->threads; thread; thread = thread->next) {
+        time_t last = __atomic_load_n(&thread->last_check[agent], __ATOMIC_RELAXED);
+
+        allowed += __atomic_load_n(&thread->allowed[agent], __ATOMIC_RELAXED);
+        denied += __atomic_load_n(&thread->denied[agent], __ATOMIC_RELAXED);
+        if (last > last_access_check) {
+            last_access_check = last;
+        }
+    }
+
     char *stats = malloc(1024);
     if (!stats) {
         pthread_mutex_unlock(&g_perm_manager->mutex);
@@ -602,20 +1464,18 @@ int anbs_permissions_get_stats(const char *agent_id, char **stats_json) {
              "\"agent_id\": \"%s\","
              "\"roles_count\": %d,"
              "\"custom_rules_count\": %d,"
-             "\"allowed_operations\": %d,"
-             "\"denied_operations\": %d,"
+             "\"allowed_operations\": %lu,"
+             "\"denied_operations\": %lu,"
              "\"last_access_check\": %ld,"
              "\"success_rate\": %.2f"
              "}",
              agent_perms->agent_id,
              agent_perms->role_count,
              agent_perms->custom_rule_count,
-             agent_perms->allowed_operations_count,
-             agent_perms->denied_operations_count,
-             agent_perms->last_access_check,
-             agent_perms->allowed_operations_count > 0 ?
-             (float)agent_perms->allowed_operations_count /
-             (agent_perms->allowed_operations_count + agent_perms->denied_operations_count) * 100.0 : 0.0);
+             allowed,
+             denied,
+             last_access_check,
+             allowed > 0 ? (float)allowed / (allowed + denied) * 100.0 : 0.0);
 
     *stats_json = stats;
 
@@ -631,6 +1491,19 @@ void anbs_permissions_cleanup(void) {
 
     /* Save current policy */
     anbs_permissions_save_policy();
+    anbs_audit_flush();
+
+    /* Threads still running keep no reference past this: with the key
+       gone their states are never looked up or destructed again */
+    pthread_key_delete(g_perm_manager->thread_key);
+    while (g_perm_manager->threads) {
+        permission_thread_t *thread = g_perm_manager->threads;
+
+        g_perm_manager->threads = thread->next;
+        anbs_permissions_view_release(thread->view);
+        free(thread);
+    }
+    anbs_permissions_view_release(g_perm_manager->view);
 
     pthread_mutex_destroy(&g_perm_manager->mutex);
 
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
@@ -13,12 +14,23 @@
 #include <pwd.h>
 #include <grp.h>
 #include <linux/limits.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 
 #define MAX_AGENTS 50
 #define MAX_POLICIES 100
 #define SANDBOX_UID_BASE 10000
 #define SANDBOX_GID_BASE 10000
 
+/* Zygotes kept ready per sandbox, and the largest command one accepts */
+#define SANDBOX_DEFAULT_ZYGOTES 2
+#define SANDBOX_MAX_ZYGOTES 8
+#define SANDBOX_ZYGOTE_MESSAGE 65536
+#define SANDBOX_ZYGOTE_ARGS 1024
+
 typedef enum {
     PERM_READ = 1,
     PERM_WRITE = 2,
@@ -33,6 +45,17 @@ typedef struct {
     bool recursive;
 } access_rule_t;
 
+/* A node of a sandbox's access rules, one per path component.  A
+   non-recursive rule grants its directory and the entries directly in
+   it; a recursive rule grants everything below too. */
+typedef struct sandbox_path_node {
+    char *name;                 /* Component, NULL for the root */
+    struct sandbox_path_node **children;    /* Sorted by name */
+    int child_count;
+    permission_flags_t exact;   /* From non-recursive rules for this path */
+    permission_flags_t recursive;   /* From recursive rules for this path */
+} sandbox_path_node_t;
+
 typedef struct {
     size_t max_memory_mb;
     double max_cpu_percent;
@@ -42,6 +65,13 @@ typedef struct {
     int max_network_connections;
 } resource_limits_t;
 
+/* A process already chrooted, unprivileged and limited, waiting on SOCK
+   for a command to run */
+typedef struct {
+    pid_t pid;
+    int sock;
+} sandbox_zygote_t;
+
 typedef struct {
     char agent_id[64];
     uid_t sandbox_uid;
@@ -49,6 +79,8 @@ typedef struct {
     char sandbox_root[PATH_MAX];
     access_rule_t access_rules[MAX_POLICIES];
     int rule_count;
+    sandbox_path_node_t *rule_tree; /* access_rules compiled by path */
+    pthread_rwlock_t rules_lock;    /* Checks share it, new rules take it alone */
     resource_limits_t limits;
     bool network_enabled;
     char allowed_networks[256];
@@ -56,6 +88,11 @@ typedef struct {
     pid_t sandbox_pid;
     time_t created;
     time_t last_activity;
+
+    /* anbs_sandbox_run() hands commands to these instead of setting up
+       a sandbox per command */
+    sandbox_zygote_t zygotes[SANDBOX_MAX_ZYGOTES];
+    int zygote_count;
 } sandbox_t;
 
 typedef struct {
@@ -63,10 +100,22 @@ typedef struct {
     int sandbox_count;
     pthread_mutex_t mutex;
     char sandbox_base_dir[PATH_MAX];
+    int zygotes_per_sandbox;    /* ANBS_SANDBOX_ZYGOTES */
+
+    /* Seccomp filters compiled to BPF, by network_enabled */
+    struct sock_fprog filters[2];
 } sandbox_manager_t;
 
 static sandbox_manager_t *g_sandbox_manager = NULL;
 
+/* Audit trail from audit.c */
+extern void anbs_audit_record(const char *event, const char *subject, const char *object,
+                              int detail, bool allowed);
+extern void anbs_audit_flush(void);
+
+static int sandbox_add_rule(sandbox_t *sandbox, const char *path_pattern,
+                            permission_flags_t permissions, bool recursive);
+
 /* Initialize sandbox manager */
 int anbs_sandbox_init(const char *base_dir) {
     if (g_sandbox_manager) {
@@ -81,6 +130,14 @@ int anbs_sandbox_init(const char *base_dir) {
     strncpy(g_sandbox_manager->sandbox_base_dir, base_dir, sizeof(g_sandbox_manager->sandbox_base_dir) - 1);
     pthread_mutex_init(&g_sandbox_manager->mutex, NULL);
 
+    const char *zygotes = getenv("ANBS_SANDBOX_ZYGOTES");
+    g_sandbox_manager->zygotes_per_sandbox = zygotes ? atoi(zygotes) : SANDBOX_DEFAULT_ZYGOTES;
+    if (g_sandbox_manager->zygotes_per_sandbox < 0) {
+        g_sandbox_manager->zygotes_per_sandbox = 0;
+    } else if (g_sandbox_manager->zygotes_per_sandbox > SANDBOX_MAX_ZYGOTES) {
+        g_sandbox_manager->zygotes_per_sandbox = SANDBOX_MAX_ZYGOTES;
+    }
+
     /* Create base sandbox directory */
     if (mkdir(base_dir, 0755) != 0 && errno != EEXIST) {
         ANBS_DEBUG_LOG("Failed to create sandbox base directory: %s", base_dir);
@@ -137,6 +194,7 @@ int anbs_sandbox_create(const char *agent_id, const resource_limits_t *limits) {
 
     sandbox->created = time(NULL);
     sandbox->active = false;
+    pthread_rwlock_init(&sandbox->rules_lock, NULL);
 
     /* Create sandbox directory structure */
     if (mkdir(sandbox->sandbox_root, 0755) != 0 && errno != EEXIST) {
@@ -155,12 +213,9 @@ int anbs_sandbox_create(const char *agent_id, const resource_limits_t *limits) {
     }
 
     /* Set default access rules */
-    anbs_sandbox_add_access_rule(g_sandbox_manager->sandbox_count,
-                                sandbox->sandbox_root, PERM_READ | PERM_WRITE, true);
-    anbs_sandbox_add_access_rule(g_sandbox_manager->sandbox_count,
-                                "/usr/bin", PERM_READ | PERM_EXECUTE, false);
-    anbs_sandbox_add_access_rule(g_sandbox_manager->sandbox_count,
-                                "/bin", PERM_READ | PERM_EXECUTE, false);
+    sandbox_add_rule(sandbox, sandbox->sandbox_root, PERM_READ | PERM_WRITE, true);
+    sandbox_add_rule(sandbox, "/usr/bin", PERM_READ | PERM_EXECUTE, false);
+    sandbox_add_rule(sandbox, "/bin", PERM_READ | PERM_EXECUTE, false);
 
     int sandbox_id = g_sandbox_manager->sandbox_count++;
 
@@ -170,83 +225,240 @@ int anbs_sandbox_create(const char *agent_id, const resource_limits_t *limits) {
     return sandbox_id;
 }
 
-/* Add access rule to sandbox */
-int anbs_sandbox_add_access_rule(int sandbox_id, const char *path_pattern,
-                                 permission_flags_t permissions, bool recursive) {
-    if (!g_sandbox_manager || sandbox_id < 0 || sandbox_id >= g_sandbox_manager->sandbox_count) {
-        return -1;
+/* Next component of the path at *PATH, skipping slashes and "."; sets
+   *LENGTH and advances *PATH past it.  NULL at the end of the path. */
+static const char *sandbox_path_next(const char **path, size_t *length) {
+    const char *p = *path;
+
+    for (;;) {
+        while (*p == '/') {
+            p++;
+        }
+        if (!*p) {
+            *path = p;
+            return NULL;
+        }
+
+        const char *start = p;
+        while (*p && *p != '/') {
+            p++;
+        }
+        if (p - start == 1 && start[0] == '.') {
+            continue;
+        }
+
+        *length = p - start;
+        *path = p;
+        return start;
     }
+}
 
-    pthread_mutex_lock(&g_sandbox_manager->mutex);
+/* Child of NODE named by the LENGTH bytes at NAME, or NULL.  *AT is set
+   to where it is or would go. */
+static sandbox_path_node_t *sandbox_path_find(const sandbox_path_node_t *node, const char *name,
+                                              size_t length, int *at) {
+    int low = 0, high = node->child_count;
 
-    sandbox_t *sandbox = &g_sandbox_manager->sandboxes[sandbox_id];
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        const char *child = node->children[mid]->name;
+        int cmp = strncmp(child, name, length);
+
+        if (cmp == 0 && child[length] != '\0') {
+            cmp = 1;
+        }
+        if (cmp == 0) {
+            if (at) {
+                *at = mid;
+            }
+            return node->children[mid];
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (at) {
+        *at = low;
+    }
+    return NULL;
+}
+
+static void sandbox_path_free(sandbox_path_node_t *node) {
+    if (!node) {
+        return;
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        sandbox_path_free(node->children[i]);
+    }
+    free(node->children);
+    free(node->name);
+    free(node);
+}
+
+/* Add a rule to SANDBOX, whose rules_lock the caller must not hold */
+static int sandbox_add_rule(sandbox_t *sandbox, const char *path_pattern,
+                            permission_flags_t permissions, bool recursive) {
+    const char *p = path_pattern, *name;
+    size_t length;
+    int status = 0;
+
+    pthread_rwlock_wrlock(&sandbox->rules_lock);
 
     if (sandbox->rule_count >= MAX_POLICIES) {
-        pthread_mutex_unlock(&g_sandbox_manager->mutex);
+        pthread_rwlock_unlock(&sandbox->rules_lock);
         return -1;
     }
 
-    access_rule_t *rule = &sandbox->access_rules[sandbox->rule_count];
-    strncpy(rule->path_pattern, path_pattern, sizeof(rule->path_pattern) - 1);
-    rule->permissions = permissions;
-    rule->recursive = recursive;
+    if (!sandbox->rule_tree) {
+        sandbox->rule_tree = calloc(1, sizeof(sandbox_path_node_t));
+    }
+    sandbox_path_node_t *node = sandbox->rule_tree;
+
+    /* Make the nodes down to the rule's path */
+    while (node && (name = sandbox_path_next(&p, &length)) != NULL) {
+        sandbox_path_node_t *child;
+        int at;
+
+        child = sandbox_path_find(node, name, length, &at);
+        if (!child) {
+            sandbox_path_node_t **children = realloc(node->children,
+                                                     (node->child_count + 1) * sizeof(*children));
+            child = calloc(1, sizeof(sandbox_path_node_t));
+            if (children) {
+                node->children = children;
+            }
+            if (!children || !child || !(child->name = strndup(name, length))) {
+                free(child);
+                node = NULL;
+                break;
+            }
+            memmove(&node->children[at + 1], &node->children[at],
+                    (node->child_count - at) * sizeof(*children));
+            node->children[at] = child;
+            node->child_count++;
+        }
+        node = child;
+    }
 
-    sandbox->rule_count++;
+    if (node) {
+        access_rule_t *rule = &sandbox->access_rules[sandbox->rule_count++];
+        strncpy(rule->path_pattern, path_pattern, sizeof(rule->path_pattern) - 1);
+        rule->permissions = permissions;
+        rule->recursive = recursive;
 
-    pthread_mutex_unlock(&g_sandbox_manager->mutex);
+        if (recursive) {
+            node->recursive |= permissions;
+        } else {
+            node->exact |= permissions;
+        }
+    } else {
+        status = -1;
+    }
+
+    pthread_rwlock_unlock(&sandbox->rules_lock);
+    return status;
+}
+
+/* Add access rule to sandbox */
+int anbs_sandbox_add_access_rule(int sandbox_id, const char *path_pattern,
+                                 permission_flags_t permissions, bool recursive) {
+    if (!g_sandbox_manager || !path_pattern ||
+        sandbox_id < 0 || sandbox_id >= g_sandbox_manager->sandbox_count) {
+        return -1;
+    }
+
+    if (sandbox_add_rule(&g_sandbox_manager->sandboxes[sandbox_id], path_pattern,
+                         permissions, recursive) != 0) {
+        return -1;
+    }
 
     ANBS_DEBUG_LOG("Added access rule to sandbox %d: %s (permissions: %d)",
                    sandbox_id, path_pattern, permissions);
     return 0;
 }
 
-/* Check if path access is allowed */
+/* Check if path access is allowed: one walk down the sandbox's rule
+   tree, under a lock other checks share */
 bool anbs_sandbox_check_access(int sandbox_id, const char *path, permission_flags_t required_perm) {
-    if (!g_sandbox_manager || sandbox_id < 0 || sandbox_id >= g_sandbox_manager->sandbox_count) {
+    if (!g_sandbox_manager || !path || sandbox_id < 0 ||
+        sandbox_id >= g_sandbox_manager->sandbox_count) {
         return false;
     }
 
-    pthread_mutex_lock(&g_sandbox_manager->mutex);
-
     sandbox_t *sandbox = &g_sandbox_manager->sandboxes[sandbox_id];
 
-    for (int i = 0; i < sandbox->rule_count; i++) {
-        access_rule_t *rule = &sandbox->access_rules[i];
+    /* Rules are absolute, and ".." could climb out of the one matched */
+    if (path[0] != '/') {
+        anbs_audit_record("sandbox_access", sandbox->agent_id, path, required_perm, false);
+        return false;
+    }
 
-        /* Check if path matches pattern */
-        bool matches = false;
-        if (rule->recursive) {
-            /* Check if path starts with pattern */
-            matches = strncmp(path, rule->path_pattern, strlen(rule->path_pattern)) == 0;
-        } else {
-            /* Exact match or parent directory */
-            matches = strcmp(path, rule->path_pattern) == 0;
-            if (!matches) {
-                /* Check if it's in the directory */
-                char pattern_with_slash[PATH_MAX];
-                snprintf(pattern_with_slash, sizeof(pattern_with_slash), "%s/", rule->path_pattern);
-                matches = strncmp(path, pattern_with_slash, strlen(pattern_with_slash)) == 0;
-            }
+    permission_flags_t granted = 0;
+    const char *p = path, *name, *next;
+    size_t length, next_length;
+
+    pthread_rwlock_rdlock(&sandbox->rules_lock);
+
+    sandbox_path_node_t *node = sandbox->rule_tree;
+    if (node) {
+        granted = node->recursive;
+        name = sandbox_path_next(&p, &length);
+        if (!name) {
+            granted |= node->exact;
         }
 
-        if (matches && (rule->permissions & required_perm)) {
-            pthread_mutex_unlock(&g_sandbox_manager->mutex);
-            return true;
+        while (name) {
+            if (length == 2 && name[0] == '.' && name[1] == '.') {
+                granted = 0;
+                break;
+            }
+            next = sandbox_path_next(&p, &next_length);
+
+            /* The last component is an entry directly in NODE */
+            if (!next) {
+                granted |= node->exact;
+            }
+
+            node = sandbox_path_find(node, name, length, NULL);
+            if (!node) {
+                /* Nothing more specific; ".." further on still counts */
+                while (next) {
+                    if (next_length == 2 && next[0] == '.' && next[1] == '.') {
+                        granted = 0;
+                        break;
+                    }
+                    next = sandbox_path_next(&p, &next_length);
+                }
+                break;
+            }
+            granted |= node->recursive;
+            if (!next) {
+                granted |= node->exact;
+            }
+
+            name = next;
+            length = next_length;
         }
     }
 
-    pthread_mutex_unlock(&g_sandbox_manager->mutex);
-    return false;
+    pthread_rwlock_unlock(&sandbox->rules_lock);
+
+    bool allowed = (granted & required_perm) != 0;
+    anbs_audit_record("sandbox_access", sandbox->agent_id, path, required_perm, allowed);
+    return allowed;
 }
 
-/* Setup seccomp filter for system call restrictions */
-static int setup_seccomp_filter(sandbox_t *sandbox) {
+/* Build the seccomp filter for system call restrictions */
+static scmp_filter_ctx build_seccomp_filter(sandbox_t *sandbox) {
     scmp_filter_ctx ctx;
 
     /* Create filter context (default deny) */
     ctx = seccomp_init(SCMP_ACT_KILL);
     if (!ctx) {
-        return -1;
+        return NULL;
     }
 
     /* Allow basic system calls */
@@ -264,7 +476,7 @@ static int setup_seccomp_filter(sandbox_t *sandbox) {
     for (size_t i = 0; i < sizeof(allowed_syscalls) / sizeof(allowed_syscalls[0]); i++) {
         if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, allowed_syscalls[i], 0) < 0) {
             seccomp_release(ctx);
-            return -1;
+            return NULL;
         }
     }
 
@@ -279,18 +491,59 @@ static int setup_seccomp_filter(sandbox_t *sandbox) {
         for (size_t i = 0; i < sizeof(network_syscalls) / sizeof(network_syscalls[0]); i++) {
             if (seccomp_rule_add(ctx, SCMP_ACT_ALLOW, network_syscalls[i], 0) < 0) {
                 seccomp_release(ctx);
-                return -1;
+                return NULL;
             }
         }
     }
 
-    /* Load the filter */
-    if (seccomp_load(ctx) < 0) {
-        seccomp_release(ctx);
-        return -1;
+    return ctx;
+}
+
+/* SANDBOX's seccomp filter as BPF.  It only depends on whether the
+   sandbox may use the network, so each kind is compiled once and reused
+   by every entry; the caller holds the manager mutex. */
+static int sandbox_filter(sandbox_t *sandbox, struct sock_fprog *prog) {
+    struct sock_fprog *cached = &g_sandbox_manager->filters[sandbox->network_enabled ? 1 : 0];
+
+    if (!cached->filter) {
+        scmp_filter_ctx ctx = build_seccomp_filter(sandbox);
+        FILE *bpf = tmpfile();
+        off_t length;
+
+        if (ctx && bpf && seccomp_export_bpf(ctx, fileno(bpf)) == 0 &&
+            (length = lseek(fileno(bpf), 0, SEEK_END)) > 0 &&
+            length % sizeof(struct sock_filter) == 0 &&
+            length / sizeof(struct sock_filter) <= BPF_MAXINSNS) {
+            cached->filter = malloc(length);
+            if (cached->filter && pread(fileno(bpf), cached->filter, length, 0) == length) {
+                cached->len = length / sizeof(struct sock_filter);
+            } else {
+                free(cached->filter);
+                cached->filter = NULL;
+            }
+        }
+
+        if (bpf) {
+            fclose(bpf);
+        }
+        if (ctx) {
+            seccomp_release(ctx);
+        }
+        if (!cached->filter) {
+            return -1;
+        }
     }
 
-    seccomp_release(ctx);
+    *prog = *cached;
+    return 0;
+}
+
+/* Load a compiled seccomp filter, as seccomp_load() would */
+static int load_seccomp_filter(const struct sock_fprog *prog) {
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 ||
+        prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, prog) != 0) {
+        return -1;
+    }
     return 0;
 }
 
@@ -326,6 +579,36 @@ static int set_resource_limits(const resource_limits_t *limits) {
     return 0;
 }
 
+/* In a child: chroot into SANDBOX, drop to its user and apply its
+   resource limits */
+static int sandbox_confine(sandbox_t *sandbox) {
+    /* Change to sandbox directory */
+    if (chdir(sandbox->sandbox_root) != 0) {
+        ANBS_DEBUG_LOG("Failed to chdir to sandbox root");
+        return -1;
+    }
+
+    /* Change root to sandbox (chroot) */
+    if (chroot(sandbox->sandbox_root) != 0) {
+        ANBS_DEBUG_LOG("Failed to chroot to sandbox");
+        return -1;
+    }
+
+    /* Drop privileges */
+    if (setgid(sandbox->sandbox_gid) != 0 || setuid(sandbox->sandbox_uid) != 0) {
+        ANBS_DEBUG_LOG("Failed to drop privileges");
+        return -1;
+    }
+
+    /* Set resource limits */
+    if (set_resource_limits(&sandbox->limits) != 0) {
+        ANBS_DEBUG_LOG("Failed to set resource limits");
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Enter sandbox environment */
 int anbs_sandbox_enter(int sandbox_id, pid_t *child_pid) {
     if (!g_sandbox_manager || sandbox_id < 0 || sandbox_id >= g_sandbox_manager->sandbox_count) {
@@ -333,6 +616,16 @@ int anbs_sandbox_enter(int sandbox_id, pid_t *child_pid) {
     }
 
     sandbox_t *sandbox = &g_sandbox_manager->sandboxes[sandbox_id];
+    struct sock_fprog prog;
+
+    /* Compiled here, once, so the child only loads it */
+    pthread_mutex_lock(&g_sandbox_manager->mutex);
+    int filtered = sandbox_filter(sandbox, &prog);
+    pthread_mutex_unlock(&g_sandbox_manager->mutex);
+    if (filtered != 0) {
+        ANBS_DEBUG_LOG("Failed to build seccomp filter");
+        return -1;
+    }
 
     pid_t pid = fork();
     if (pid == -1) {
@@ -341,38 +634,11 @@ int anbs_sandbox_enter(int sandbox_id, pid_t *child_pid) {
 
     if (pid == 0) {
         /* Child process - enter sandbox */
-
-        /* Change to sandbox directory */
-        if (chdir(sandbox->sandbox_root) != 0) {
-            ANBS_DEBUG_LOG("Failed to chdir to sandbox root");
+        if (sandbox_confine(sandbox) != 0) {
             exit(1);
         }
 
-        /* Change root to sandbox (chroot) */
-        if (chroot(sandbox->sandbox_root) != 0) {
-            ANBS_DEBUG_LOG("Failed to chroot to sandbox");
-            exit(1);
-        }
-
-        /* Drop privileges */
-        if (setgid(sandbox->sandbox_gid) != 0 || setuid(sandbox->sandbox_uid) != 0) {
-            ANBS_DEBUG_LOG("Failed to drop privileges");
-            exit(1);
-        }
-
-        /* Set resource limits */
-        if (set_resource_limits(&sandbox->limits) != 0) {
-            ANBS_DEBUG_LOG("Failed to set resource limits");
-            exit(1);
-        }
-
-        /* Apply seccomp filter */
-        if (setup_seccomp_filter(sandbox) != 0) {
-            ANBS_DEBUG_LOG("Failed to apply seccomp filter");
-            exit(1);
-        }
-
-        /* Clear capabilities */
+        /* Clear capabilities; the filter does not allow it afterwards */
         cap_t caps = cap_init();
         if (cap_set_proc(caps) != 0) {
             ANBS_DEBUG_LOG("Failed to drop capabilities");
@@ -381,6 +647,12 @@ int anbs_sandbox_enter(int sandbox_id, pid_t *child_pid) {
         }
         cap_free(caps);
 
+        /* Apply seccomp filter */
+        if (load_seccomp_filter(&prog) != 0) {
+            ANBS_DEBUG_LOG("Failed to apply seccomp filter");
+            exit(1);
+        }
+
         /* Sandbox is now active */
         return 0;
     } else {
@@ -401,6 +673,193 @@ int anbs_sandbox_enter(int sandbox_id, pid_t *child_pid) {
     }
 }
 
+/* Zygote body: confine, then wait for one command and become it.  The
+   message is the argument vector, NUL-separated, with stdin, stdout and
+   stderr passed alongside. */
+static void sandbox_zygote_main(sandbox_t *sandbox, int sock, const struct sock_fprog *prog) {
+    static char message[SANDBOX_ZYGOTE_MESSAGE];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    char *argv[SANDBOX_ZYGOTE_ARGS + 1];
+    struct iovec iov = { message, sizeof(message) - 1 };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    int fds[3] = { -1, -1, -1 };
+    int argc = 0;
+    ssize_t n;
+
+    if (sandbox_confine(sandbox) != 0) {
+        _exit(1);
+    }
+
+    /* Clear capabilities now; the filter would not allow it later */
+    cap_t caps = cap_init();
+    if (cap_set_proc(caps) != 0) {
+        _exit(1);
+    }
+    cap_free(caps);
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    /* The pool was closed */
+    if (n <= 0) {
+        _exit(0);
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+    }
+
+    message[n] = '\0';
+    for (char *p = message; p < message + n && argc < SANDBOX_ZYGOTE_ARGS; p += strlen(p) + 1) {
+        argv[argc++] = p;
+    }
+    argv[argc] = NULL;
+
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] < 0 || dup2(fds[i], i) < 0) {
+            _exit(126);
+        }
+    }
+    close(sock);
+
+    /* Apply seccomp filter */
+    if (argc == 0 || load_seccomp_filter(prog) != 0) {
+        _exit(126);
+    }
+
+    execv(argv[0], argv);
+    _exit(127);
+}
+
+/* Start a zygote for SANDBOX; the caller holds the manager mutex */
+static int sandbox_zygote_spawn(sandbox_t *sandbox) {
+    struct sock_fprog prog;
+    int sv[2];
+
+    if (sandbox->zygote_count >= SANDBOX_MAX_ZYGOTES || sandbox_filter(sandbox, &prog) != 0 ||
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(sv[0]);
+        sandbox_zygote_main(sandbox, sv[1], &prog);
+    }
+
+    close(sv[1]);
+    sandbox->zygotes[sandbox->zygote_count].pid = pid;
+    sandbox->zygotes[sandbox->zygote_count].sock = sv[0];
+    sandbox->zygote_count++;
+    return 0;
+}
+
+/* Stop SANDBOX's idle zygotes; the caller holds the manager mutex */
+static void sandbox_zygotes_drain(sandbox_t *sandbox) {
+    for (int i = 0; i < sandbox->zygote_count; i++) {
+        close(sandbox->zygotes[i].sock);
+        kill(sandbox->zygotes[i].pid, SIGKILL);
+        waitpid(sandbox->zygotes[i].pid, NULL, 0);
+    }
+    sandbox->zygote_count = 0;
+}
+
+/* Run ARGV in the sandbox with FDS as its stdin, stdout and stderr.  A
+   zygote that is already confined takes the command, so the cost is a
+   message rather than a sandbox setup; the pool is topped up again
+   afterwards.  *CHILD_PID is the command's process, ours to wait for. */
+int anbs_sandbox_run(int sandbox_id, char *const argv[], const int fds[3], pid_t *child_pid) {
+    char message[SANDBOX_ZYGOTE_MESSAGE];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    size_t length = 0;
+
+    if (!g_sandbox_manager || !argv || !argv[0] || !fds ||
+        sandbox_id < 0 || sandbox_id >= g_sandbox_manager->sandbox_count) {
+        return -1;
+    }
+
+    for (int i = 0; argv[i]; i++) {
+        size_t size = strlen(argv[i]) + 1;
+
+        if (i >= SANDBOX_ZYGOTE_ARGS || length + size >= sizeof(message)) {
+            return -1;
+        }
+        memcpy(message + length, argv[i], size);
+        length += size;
+    }
+
+    pthread_mutex_lock(&g_sandbox_manager->mutex);
+
+    sandbox_t *sandbox = &g_sandbox_manager->sandboxes[sandbox_id];
+
+    if (sandbox->zygote_count == 0 && sandbox_zygote_spawn(sandbox) != 0) {
+        pthread_mutex_unlock(&g_sandbox_manager->mutex);
+        return -1;
+    }
+    sandbox_zygote_t zygote = sandbox->zygotes[--sandbox->zygote_count];
+
+    struct iovec iov = { message, length };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(zygote.sock, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    close(zygote.sock);
+
+    if (sent != (ssize_t)length) {
+        /* It died before taking the command */
+        kill(zygote.pid, SIGKILL);
+        waitpid(zygote.pid, NULL, 0);
+        pthread_mutex_unlock(&g_sandbox_manager->mutex);
+        return -1;
+    }
+
+    sandbox->last_activity = time(NULL);
+
+    /* Top the pool up while the command starts */
+    while (sandbox->zygote_count < g_sandbox_manager->zygotes_per_sandbox &&
+           sandbox_zygote_spawn(sandbox) == 0) {
+    }
+
+    pthread_mutex_unlock(&g_sandbox_manager->mutex);
+
+    if (child_pid) {
+        *child_pid = zygote.pid;
+    }
+
+    ANBS_DEBUG_LOG("Agent %s ran %s in sandbox %d (PID: %d)",
+                   sandbox->agent_id, argv[0], sandbox_id, zygote.pid);
+    anbs_audit_record("sandbox_run", sandbox->agent_id, argv[0], sandbox_id, true);
+    return sandbox_id;
+}
+
 /* Exit sandbox environment */
 int anbs_sandbox_exit(int sandbox_id) {
     if (!g_sandbox_manager || sandbox_id < 0 || sandbox_id >= g_sandbox_manager->sandbox_count) {
@@ -500,11 +959,21 @@ void anbs_sandbox_cleanup(void) {
         }
     }
 
+    for (int i = 0; i < g_sandbox_manager->sandbox_count; i++) {
+        sandbox_zygotes_drain(&g_sandbox_manager->sandboxes[i]);
+        sandbox_path_free(g_sandbox_manager->sandboxes[i].rule_tree);
+        pthread_rwlock_destroy(&g_sandbox_manager->sandboxes[i].rules_lock);
+    }
+
+    free(g_sandbox_manager->filters[0].filter);
+    free(g_sandbox_manager->filters[1].filter);
+
     pthread_mutex_unlock(&g_sandbox_manager->mutex);
     pthread_mutex_destroy(&g_sandbox_manager->mutex);
 
     free(g_sandbox_manager);
     g_sandbox_manager = NULL;
+    anbs_audit_flush();
 
     ANBS_DEBUG_LOG("Sandbox manager cleaned up");
 }
\ No newline at end of file
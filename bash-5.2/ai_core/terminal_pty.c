@@ -0,0 +1,403 @@
+/* terminal_pty.c - Pseudo-terminal capture for the ANBS terminal panel */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE            /* ptsname_r */
+#endif
+
+#include "ai_display.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+/* Bytes taken from the master per read(), and per drain at most so a
+   flood of output still leaves the render thread time for frames */
+#define ANBS_PTY_READ_BYTES   (64 * 1024)
+#define ANBS_PTY_DRAIN_BYTES  (1024 * 1024)
+
+/* Longest line kept whole; longer output is split */
+#define ANBS_PTY_LINE_BYTES   4096
+
+/* Where the VT parser is within an escape sequence */
+typedef enum {
+    ANBS_VT_GROUND = 0,        /* Plain text */
+    ANBS_VT_ESCAPE,            /* After ESC */
+    ANBS_VT_CSI,               /* ESC [ parameters */
+    ANBS_VT_OSC,               /* ESC ] string, up to BEL or ST */
+    ANBS_VT_OSC_ESCAPE         /* ESC inside an OSC string */
+} anbs_vt_state_t;
+
+struct anbs_pty {
+    int master;                /* Read by the render thread, non-blocking */
+    int slave;                 /* Kept open for children to inherit */
+    dev_t tty;                 /* The shell's own terminal */
+
+    /* VT parser */
+    anbs_vt_state_t state;
+    int params[8];             /* CSI parameters so far */
+    int param_count;
+    char line[ANBS_PTY_LINE_BYTES];    /* Line being assembled */
+    int length;                /* Bytes in line */
+    int column;                /* Where the next byte goes; CR moves it back */
+
+    /* Partial line drawn at the bottom of the panel */
+    bool partial_drawn;
+    int partial_y, partial_x;
+
+    char input[ANBS_PTY_READ_BYTES];
+};
+
+/**
+ * Give the pseudo-terminal the size of the terminal panel's content
+ */
+void anbs_pty_resize(anbs_display_t *display)
+{
+    panel_t *panel;
+    struct winsize size;
+
+    if (!display || !display->pty) {
+        return;
+    }
+
+    panel = &display->panels[ANBS_PANEL_TERMINAL];
+    memset(&size, 0, sizeof(size));
+    size.ws_col = panel->width - (panel->has_border ? 2 : 0);
+    size.ws_row = panel->height - (panel->has_border ? 2 : 0);
+    ioctl(display->pty->master, TIOCSWINSZ, &size);
+}
+
+/**
+ * Open the pseudo-terminal that external commands write into instead of
+ * the shell's terminal, so their output lands in the terminal panel
+ */
+int anbs_pty_open(anbs_display_t *display)
+{
+    struct anbs_pty *pty;
+    struct termios modes;
+    struct stat tty;
+    char name[128];
+
+    if (!display || display->pty) {
+        return -1;
+    }
+
+    if (fstat(STDOUT_FILENO, &tty) != 0 || !isatty(STDOUT_FILENO)) {
+        return -1;
+    }
+
+    pty = (struct anbs_pty *)calloc(1, sizeof(struct anbs_pty));
+    if (!pty) {
+        return -1;
+    }
+    pty->tty = tty.st_rdev;
+    pty->slave = -1;
+
+    pty->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty->master < 0 || grantpt(pty->master) != 0 || unlockpt(pty->master) != 0 ||
+        ptsname_r(pty->master, name, sizeof(name)) != 0) {
+        goto fail;
+    }
+
+    pty->slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (pty->slave < 0) {
+        goto fail;
+    }
+
+    fcntl(pty->master, F_SETFL, fcntl(pty->master, F_GETFL) | O_NONBLOCK);
+    fcntl(pty->master, F_SETFD, FD_CLOEXEC);
+
+    /* Children should see the same line discipline as on the real terminal */
+    if (tcgetattr(STDOUT_FILENO, &modes) == 0) {
+        tcsetattr(pty->slave, TCSANOW, &modes);
+    }
+
+    display->pty = pty;
+    anbs_pty_resize(display);
+    return 0;
+
+fail:
+    if (pty->master >= 0) {
+        close(pty->master);
+    }
+    if (pty->slave >= 0) {
+        close(pty->slave);
+    }
+    free(pty);
+    return -1;
+}
+
+/**
+ * Close the pseudo-terminal
+ */
+void anbs_pty_close(anbs_display_t *display)
+{
+    if (!display || !display->pty) {
+        return;
+    }
+
+    close(display->pty->master);
+    close(display->pty->slave);
+    free(display->pty);
+    display->pty = NULL;
+}
+
+/**
+ * The master side, for the render thread to poll, or -1
+ */
+int anbs_pty_fd(anbs_display_t *display)
+{
+    return display && display->pty ? display->pty->master : -1;
+}
+
+/**
+ * In a child about to exec, point stdout and stderr at the
+ * pseudo-terminal if they are still the shell's terminal; redirections
+ * and pipes are left alone
+ */
+void anbs_pty_attach_child(void)
+{
+    anbs_display_t *display = g_anbs_display;
+    struct stat st;
+    int fd;
+
+    if (!display || !display->pty) {
+        return;
+    }
+
+    for (fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+        if (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) && st.st_rdev == display->pty->tty) {
+            dup2(display->pty->slave, fd);
+        }
+    }
+}
+
+/**
+ * Add a finished line to the terminal panel's buffer
+ */
+static void anbs_pty_commit(struct anbs_pty *pty, text_buffer_t *buffer)
+{
+    pty->line[pty->length++] = '\n';
+    pty->line[pty->length] = '\0';
+    anbs_text_buffer_append(buffer, pty->line);
+    pty->length = 0;
+    pty->column = 0;
+}
+
+/**
+ * Put a printable byte where the cursor is in the current line
+ */
+static void anbs_pty_put(struct anbs_pty *pty, text_buffer_t *buffer, char c)
+{
+    if (pty->column >= ANBS_PTY_LINE_BYTES - 2) {
+        pty->column = pty->length;
+        anbs_pty_commit(pty, buffer);
+    }
+
+    pty->line[pty->column++] = c;
+    if (pty->column > pty->length) {
+        pty->length = pty->column;
+    }
+}
+
+/**
+ * Apply a CSI sequence ending in FINAL.  Only what changes the text of
+ * the current line matters to the panel; colors and cursor addressing
+ * are dropped.
+ */
+static void anbs_pty_csi(struct anbs_pty *pty, char final)
+{
+    int n = pty->param_count > 0 ? pty->params[0] : 0;
+
+    switch (final) {
+        case 'K':
+            /* Erase in line */
+            if (n == 0) {
+                pty->length = pty->column;
+            } else if (n == 2) {
+                pty->length = 0;
+                pty->column = 0;
+            }
+            break;
+        case 'D':
+            /* Cursor back */
+            pty->column -= n > 0 ? n : 1;
+            if (pty->column < 0) {
+                pty->column = 0;
+            }
+            break;
+        case 'G':
+            /* Cursor to column */
+            pty->column = n > 1 ? n - 1 : 0;
+            if (pty->column > pty->length) {
+                pty->column = pty->length;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Run BYTES of child output through the VT parser, appending every line
+ * it completes to the terminal panel's buffer
+ */
+static void anbs_pty_parse(struct anbs_pty *pty, text_buffer_t *buffer,
+                           const char *bytes, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        unsigned char c = (unsigned char)bytes[i];
+
+        switch (pty->state) {
+            case ANBS_VT_GROUND:
+                if (c == '\n') {
+                    pty->column = pty->length;
+                    anbs_pty_commit(pty, buffer);
+                } else if (c == '\r') {
+                    pty->column = 0;
+                } else if (c == '\b') {
+                    if (pty->column > 0) {
+                        pty->column--;
+                    }
+                } else if (c == '\t') {
+                    do {
+                        anbs_pty_put(pty, buffer, ' ');
+                    } while (pty->column % 8 != 0);
+                } else if (c == 0x1b) {
+                    pty->state = ANBS_VT_ESCAPE;
+                } else if (c >= 0x20 && c != 0x7f) {
+                    /* UTF-8 bytes go through as they are */
+                    anbs_pty_put(pty, buffer, (char)c);
+                }
+                break;
+
+            case ANBS_VT_ESCAPE:
+                if (c == '[') {
+                    pty->state = ANBS_VT_CSI;
+                    pty->param_count = 0;
+                    memset(pty->params, 0, sizeof(pty->params));
+                } else if (c == ']') {
+                    pty->state = ANBS_VT_OSC;
+                } else {
+                    pty->state = ANBS_VT_GROUND;
+                }
+                break;
+
+            case ANBS_VT_CSI:
+                if (c >= '0' && c <= '9') {
+                    if (pty->param_count == 0) {
+                        pty->param_count = 1;
+                    }
+                    if (pty->param_count <= 8) {
+                        int *param = &pty->params[pty->param_count - 1];
+
+                        *param = *param < 10000 ? *param * 10 + (c - '0') : *param;
+                    }
+                } else if (c == ';') {
+                    pty->param_count = (pty->param_count == 0 ? 1 : pty->param_count) + 1;
+                } else if (c >= 0x40 && c <= 0x7e) {
+                    anbs_pty_csi(pty, (char)c);
+                    pty->state = ANBS_VT_GROUND;
+                }
+                break;
+
+            case ANBS_VT_OSC:
+                if (c == 0x07) {
+                    pty->state = ANBS_VT_GROUND;
+                } else if (c == 0x1b) {
+                    pty->state = ANBS_VT_OSC_ESCAPE;
+                }
+                break;
+
+            case ANBS_VT_OSC_ESCAPE:
+                pty->state = c == '\\' ? ANBS_VT_GROUND : ANBS_VT_OSC;
+                break;
+        }
+    }
+}
+
+/**
+ * Read what children wrote and show it in the terminal panel.  Called
+ * by the render thread whenever the master is readable.  Output outrunning
+ * the screen is only stored: once a drain completes more lines than the
+ * panel shows, the panel is redrawn from the buffer's tail rather than
+ * drawing every line.
+ */
+int anbs_pty_drain(anbs_display_t *display)
+{
+    struct anbs_pty *pty;
+    panel_t *panel;
+    unsigned long before, added;
+    size_t total = 0;
+    int height, i;
+
+    if (!display || !display->pty) {
+        return -1;
+    }
+
+    pty = display->pty;
+    panel = &display->panels[ANBS_PANEL_TERMINAL];
+    before = panel->buffer->appended;
+
+    while (total < ANBS_PTY_DRAIN_BYTES) {
+        ssize_t n = read(pty->master, pty->input, sizeof(pty->input));
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        anbs_pty_parse(pty, panel->buffer, pty->input, n);
+        total += n;
+    }
+
+    if (!panel->window || !panel->visible) {
+        return 0;
+    }
+
+    /* A scrolled-back view stays where it is */
+    added = panel->buffer->appended - before;
+    if (panel->scroll_offset > 0) {
+        panel->scroll_offset += added;
+        return 0;
+    }
+
+    /* Take back the partial line drawn last time; it may have changed */
+    if (pty->partial_drawn) {
+        wmove(panel->window, pty->partial_y, pty->partial_x);
+        wclrtoeol(panel->window);
+        pty->partial_drawn = false;
+    }
+
+    height = panel->height - (panel->has_border ? 2 : 0);
+    if (added > (unsigned long)height || added > (unsigned long)panel->buffer->line_count) {
+        anbs_display_scroll(display, ANBS_PANEL_TERMINAL, 0);
+        waddch(panel->window, '\n');
+    } else {
+        for (i = panel->buffer->line_count - (int)added; i < panel->buffer->line_count; i++) {
+            waddstr(panel->window, anbs_text_buffer_get_line(panel->buffer, i));
+        }
+    }
+
+    /* A line still being written shows as far as the row reaches, and
+       without scrolling, so the next drain can wipe it */
+    if (pty->length > 0) {
+        int room;
+
+        getyx(panel->window, pty->partial_y, pty->partial_x);
+        room = panel->width - (panel->has_border ? 1 : 0) - pty->partial_x - 1;
+        if (room > 0) {
+            waddnstr(panel->window, pty->line, pty->length < room ? pty->length : room);
+            pty->partial_drawn = true;
+        }
+    }
+
+    anbs_display_mark_dirty(display, ANBS_PANEL_TERMINAL);
+    return 0;
+}
@@ -1,18 +1,107 @@
 /* text_buffer.c - Text buffer management for ANBS display system */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE            /* memmem, strcasestr */
+#endif
+
 #include "ai_display.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+/* Trigram buckets in a scrollback index */
+#define ANBS_TRIGRAM_BUCKETS 4096
+
+/* Lines holding a hashed trigram, by sequence number, oldest first */
+typedef struct {
+    unsigned long *seqs;
+    int count;
+    int capacity;
+} anbs_trigram_list_t;
+
+struct anbs_trigram_index {
+    anbs_trigram_list_t lists[ANBS_TRIGRAM_BUCKETS];
+};
+
+struct anbs_search {
+    text_buffer_t *buffer;
+    int flags;                 /* ANBS_SEARCH_* */
+    char query[256];           /* Query the matches are for */
+    bool compiled;             /* regex holds query */
+    regex_t regex;
+    unsigned long *matches;    /* Matching lines by sequence number, oldest first */
+    int match_count;
+    int match_capacity;
+    unsigned long scanned;     /* Lines numbered below this have been searched */
+};
+
+/* How a line wraps, worked out the first time it is drawn */
+struct anbs_line_layout {
+    uint32_t width;            /* Screen columns, valid once measured */
+    uint16_t columns;          /* Panel width rows was found for, 0 if none */
+    uint16_t rows;
+    bool measured;
+    bool ascii;                /* One byte per column: rows follow from width */
+};
+
+/* Spilled lines are packed into blocks of about this size, or this many lines */
+#define ANBS_SPILL_BLOCK_BYTES (64 * 1024)
+#define ANBS_SPILL_BLOCK_LINES 1024
+
+/* A compressed block of spilled lines */
+typedef struct {
+    off_t offset;              /* Where it starts in the spill file */
+    uint32_t size;             /* Compressed bytes */
+    uint32_t raw_size;         /* Bytes once inflated */
+    unsigned long first;       /* History index of its first line */
+    int line_count;
+} anbs_spill_block_t;
+
+/* Lines dropped from the byte ring, kept in a file */
+struct anbs_spill {
+    int fd;                    /* Unlinked spill file */
+    off_t file_size;
+    char *map;                 /* The file, mapped for reads */
+    size_t map_size;
+    anbs_spill_block_t *blocks;    /* Line index: one entry per block */
+    int block_count;
+    int block_capacity;
+    char *pending;             /* Block being filled, not yet compressed */
+    size_t pending_size;
+    size_t pending_capacity;
+    uint32_t pending_offsets[ANBS_SPILL_BLOCK_LINES];
+    int pending_lines;
+    unsigned long lines;       /* Lines spilled, pending ones included */
+    int cached;                /* Block inflated into cache, or -1 */
+    char *cache;
+    size_t cache_capacity;
+    uint32_t cache_offsets[ANBS_SPILL_BLOCK_LINES];
+};
+
+static void anbs_text_buffer_index_line(text_buffer_t *buffer, unsigned long seq,
+                                        const char *line, size_t length);
+static void anbs_text_buffer_free_index(text_buffer_t *buffer);
+static void anbs_text_buffer_spill_line(text_buffer_t *buffer, const char *line);
+static void anbs_text_buffer_free_spill(text_buffer_t *buffer);
+static void anbs_spill_reset(struct anbs_spill *spill);
 
 /**
- * Initialize a text buffer
+ * Initialize a text buffer holding up to MAX_LINES lines and MAX_BYTES
+ * bytes of text
  */
-int anbs_text_buffer_init(text_buffer_t **buffer, int max_lines)
+int anbs_text_buffer_init(text_buffer_t **buffer, int max_lines, size_t max_bytes)
 {
     text_buffer_t *buf;
-    int i;
 
-    if (!buffer || max_lines <= 0) {
+    if (!buffer || max_lines <= 0 || max_bytes < 2) {
         return -1;
     }
 
@@ -22,19 +111,20 @@ int anbs_text_buffer_init(text_buffer_t **buffer, int max_lines)
         return -1;
     }
 
-    /* Allocate line array */
-    buf->lines = (char **)calloc(max_lines, sizeof(char *));
-    if (!buf->lines) {
+    /* Allocate the byte ring and the line index */
+    buf->bytes = (char *)malloc(max_bytes);
+    buf->offsets = (size_t *)calloc(max_lines, sizeof(size_t));
+    buf->layouts = (struct anbs_line_layout *)calloc(max_lines, sizeof(struct anbs_line_layout));
+    if (!buf->bytes || !buf->offsets || !buf->layouts) {
+        free(buf->bytes);
+        free(buf->offsets);
+        free(buf->layouts);
         free(buf);
         return -1;
     }
 
-    /* Initialize line pointers to NULL */
-    for (i = 0; i < max_lines; i++) {
-        buf->lines[i] = NULL;
-    }
-
     /* Set buffer parameters */
+    buf->byte_capacity = max_bytes;
     buf->max_lines = max_lines;
     buf->current_line = 0;
     buf->display_start = 0;
@@ -45,40 +135,92 @@ int anbs_text_buffer_init(text_buffer_t **buffer, int max_lines)
     return 0;
 }
 
+/**
+ * Drop the oldest line
+ */
+static void anbs_text_buffer_evict(text_buffer_t *buffer)
+{
+    size_t tail = buffer->offsets[buffer->display_start];
+
+    if (buffer->spill) {
+        anbs_text_buffer_spill_line(buffer, buffer->bytes + tail);
+    }
+
+    buffer->display_start = (buffer->display_start + 1) % buffer->max_lines;
+    buffer->line_count--;
+
+    if (buffer->line_count == 0) {
+        buffer->byte_head = 0;
+        buffer->byte_wrapped = false;
+    } else if (buffer->offsets[buffer->display_start] < tail) {
+        /* The oldest line is now at the start of the ring too */
+        buffer->byte_wrapped = false;
+    }
+}
+
+/**
+ * Find room for SIZE contiguous bytes, dropping old lines until there
+ * is; a line never wraps, so the ring's unused tail is skipped instead
+ */
+static size_t anbs_text_buffer_reserve(text_buffer_t *buffer, size_t size)
+{
+    for (;;) {
+        size_t tail = buffer->offsets[buffer->display_start];
+
+        if (buffer->line_count == 0) {
+            return 0;
+        }
+
+        if (buffer->line_count < buffer->max_lines) {
+            if (!buffer->byte_wrapped) {
+                if (buffer->byte_capacity - buffer->byte_head >= size) {
+                    return buffer->byte_head;
+                }
+                if (tail >= size) {
+                    buffer->byte_wrapped = true;
+                    return 0;
+                }
+            } else if (tail - buffer->byte_head >= size) {
+                return buffer->byte_head;
+            }
+        }
+
+        anbs_text_buffer_evict(buffer);
+    }
+}
+
 /**
  * Append a line to the text buffer
  */
 int anbs_text_buffer_append(text_buffer_t *buffer, const char *line)
 {
-    char *line_copy;
+    size_t length, offset;
 
     if (!buffer || !line) {
         return -1;
     }
 
-    /* Create copy of the line */
-    line_copy = strdup(line);
-    if (!line_copy) {
-        return -1;
+    /* A line longer than the whole ring keeps its beginning */
+    length = strlen(line);
+    if (length >= buffer->byte_capacity) {
+        length = buffer->byte_capacity - 1;
     }
 
-    /* If we're at capacity, free the oldest line */
-    if (buffer->lines[buffer->current_line] != NULL) {
-        free(buffer->lines[buffer->current_line]);
-    } else {
-        /* First time filling this slot */
-        buffer->line_count++;
-    }
+    offset = anbs_text_buffer_reserve(buffer, length + 1);
+    memcpy(buffer->bytes + offset, line, length);
+    buffer->bytes[offset + length] = '\0';
+    buffer->byte_head = offset + length + 1;
 
-    /* Store the new line */
-    buffer->lines[buffer->current_line] = line_copy;
-
-    /* Advance to next position (circular buffer) */
+    /* Index it (circular buffer) */
+    buffer->offsets[buffer->current_line] = offset;
+    buffer->layouts[buffer->current_line].measured = false;
     buffer->current_line = (buffer->current_line + 1) % buffer->max_lines;
+    buffer->line_count++;
+    buffer->appended++;
 
-    /* Update display start if buffer is full */
-    if (buffer->line_count >= buffer->max_lines) {
-        buffer->display_start = buffer->current_line;
+    if (buffer->index) {
+        anbs_text_buffer_index_line(buffer, buffer->appended - 1,
+                                    buffer->bytes + offset, length);
     }
 
     /* Mark as dirty for refresh */
@@ -88,12 +230,23 @@ int anbs_text_buffer_append(text_buffer_t *buffer, const char *line)
 }
 
 /**
- * Get lines from buffer for display
+ * The line DISPLAY_INDEX lines after the oldest
+ */
+static char *anbs_text_buffer_line_at(text_buffer_t *buffer, int display_index)
+{
+    int slot = (buffer->display_start + display_index) % buffer->max_lines;
+
+    return buffer->bytes + buffer->offsets[slot];
+}
+
+/**
+ * Get lines from buffer for display.  The pointers stay valid until
+ * their lines are dropped for newer ones.
  */
 int anbs_text_buffer_get_lines(text_buffer_t *buffer, char ***lines, int start, int count)
 {
     char **result;
-    int i, line_index;
+    int i;
     int available_lines;
 
     if (!buffer || !lines || count <= 0) {
@@ -101,8 +254,7 @@ int anbs_text_buffer_get_lines(text_buffer_t *buffer, char ***lines, int start,
     }
 
     /* Calculate available lines */
-    available_lines = (buffer->line_count < buffer->max_lines) ?
-                     buffer->line_count : buffer->max_lines;
+    available_lines = buffer->line_count;
 
     /* Adjust count if requesting more than available */
     if (count > available_lines) {
@@ -125,16 +277,8 @@ int anbs_text_buffer_get_lines(text_buffer_t *buffer, char ***lines, int start,
 
     /* Copy line pointers */
     for (i = 0; i < count; i++) {
-        if (buffer->line_count < buffer->max_lines) {
-            /* Buffer not full yet, simple indexing */
-            line_index = start + i;
-        } else {
-            /* Buffer is full, use circular indexing */
-            line_index = (buffer->display_start + start + i) % buffer->max_lines;
-        }
-
-        if (line_index < available_lines && buffer->lines[line_index] != NULL) {
-            result[i] = buffer->lines[line_index];
+        if (start + i < available_lines) {
+            result[i] = anbs_text_buffer_line_at(buffer, start + i);
         } else {
             result[i] = "";
         }
@@ -156,8 +300,7 @@ int anbs_text_buffer_get_recent_lines(text_buffer_t *buffer, char ***lines, int
         return -1;
     }
 
-    available_lines = (buffer->line_count < buffer->max_lines) ?
-                     buffer->line_count : buffer->max_lines;
+    available_lines = buffer->line_count;
 
     if (count > available_lines) {
         count = available_lines;
@@ -177,25 +320,27 @@ int anbs_text_buffer_get_recent_lines(text_buffer_t *buffer, char ***lines, int
  */
 void anbs_text_buffer_clear(text_buffer_t *buffer)
 {
-    int i;
-
     if (!buffer) {
         return;
     }
 
-    /* Free all line strings */
-    for (i = 0; i < buffer->max_lines; i++) {
-        if (buffer->lines[i]) {
-            free(buffer->lines[i]);
-            buffer->lines[i] = NULL;
-        }
-    }
-
     /* Reset counters */
+    buffer->byte_head = 0;
+    buffer->byte_wrapped = false;
     buffer->current_line = 0;
     buffer->display_start = 0;
     buffer->line_count = 0;
     buffer->dirty = true;
+
+    if (buffer->index) {
+        for (int i = 0; i < ANBS_TRIGRAM_BUCKETS; i++) {
+            buffer->index->lists[i].count = 0;
+        }
+    }
+
+    if (buffer->spill) {
+        anbs_spill_reset(buffer->spill);
+    }
 }
 
 /**
@@ -207,13 +352,12 @@ void anbs_text_buffer_cleanup(text_buffer_t *buffer)
         return;
     }
 
-    /* Clear all lines */
-    anbs_text_buffer_clear(buffer);
-
-    /* Free line array */
-    if (buffer->lines) {
-        free(buffer->lines);
-    }
+    /* Free both rings and the index */
+    free(buffer->bytes);
+    free(buffer->offsets);
+    free(buffer->layouts);
+    anbs_text_buffer_free_index(buffer);
+    anbs_text_buffer_free_spill(buffer);
 
     /* Free buffer structure */
     free(buffer);
@@ -234,8 +378,7 @@ int anbs_text_buffer_get_stats(text_buffer_t *buffer, int *total_lines,
     }
 
     if (used_lines) {
-        *used_lines = (buffer->line_count < buffer->max_lines) ?
-                     buffer->line_count : buffer->max_lines;
+        *used_lines = buffer->line_count;
     }
 
     if (is_dirty) {
@@ -255,80 +398,853 @@ void anbs_text_buffer_mark_clean(text_buffer_t *buffer)
     }
 }
 
+/**
+ * Fold and hash the trigram at P
+ */
+static unsigned int anbs_trigram_hash(const char *p)
+{
+    unsigned int key = ((unsigned int)tolower((unsigned char)p[0]) << 16) |
+                       ((unsigned int)tolower((unsigned char)p[1]) << 8) |
+                       (unsigned int)tolower((unsigned char)p[2]);
+
+    return (key * 2654435761u) >> 20;
+}
+
+/**
+ * Free the trigram index
+ */
+static void anbs_text_buffer_free_index(text_buffer_t *buffer)
+{
+    int i;
+
+    if (!buffer->index) {
+        return;
+    }
+
+    for (i = 0; i < ANBS_TRIGRAM_BUCKETS; i++) {
+        free(buffer->index->lists[i].seqs);
+    }
+    free(buffer->index);
+    buffer->index = NULL;
+}
+
+/**
+ * Add line SEQ to the trigram index.  Postings for dropped lines are
+ * trimmed once they make up half of a full list.
+ */
+static void anbs_text_buffer_index_line(text_buffer_t *buffer, unsigned long seq,
+                                        const char *line, size_t length)
+{
+    unsigned long oldest = buffer->appended - buffer->line_count;
+    size_t i;
+
+    for (i = 0; i + 2 < length; i++) {
+        anbs_trigram_list_t *list = &buffer->index->lists[anbs_trigram_hash(line + i)];
+
+        if (list->count > 0 && list->seqs[list->count - 1] == seq) {
+            continue;
+        }
+
+        if (list->count == list->capacity) {
+            int dead = 0;
+
+            while (dead < list->count && list->seqs[dead] < oldest) {
+                dead++;
+            }
+            if (dead > 0 && dead * 2 >= list->count) {
+                memmove(list->seqs, list->seqs + dead,
+                        (list->count - dead) * sizeof(unsigned long));
+                list->count -= dead;
+            }
+        }
+
+        if (list->count == list->capacity) {
+            int capacity = list->capacity ? list->capacity * 2 : 16;
+            unsigned long *seqs = (unsigned long *)realloc(list->seqs,
+                                                           capacity * sizeof(unsigned long));
+
+            if (!seqs) {
+                /* An incomplete index would miss lines; search without one */
+                anbs_text_buffer_free_index(buffer);
+                return;
+            }
+            list->seqs = seqs;
+            list->capacity = capacity;
+        }
+
+        list->seqs[list->count++] = seq;
+    }
+}
+
+/**
+ * Keep a trigram index of the buffer, so that a full search only
+ * verifies the lines sharing the query's rarest trigram
+ */
+int anbs_text_buffer_enable_index(text_buffer_t *buffer)
+{
+    unsigned long oldest;
+    int i;
+
+    if (!buffer) {
+        return -1;
+    }
+
+    if (buffer->index) {
+        return 0;
+    }
+
+    buffer->index = (struct anbs_trigram_index *)calloc(1, sizeof(struct anbs_trigram_index));
+    if (!buffer->index) {
+        return -1;
+    }
+
+    /* Index what is already there */
+    oldest = buffer->appended - buffer->line_count;
+    for (i = 0; i < buffer->line_count && buffer->index; i++) {
+        const char *line = anbs_text_buffer_line_at(buffer, i);
+
+        anbs_text_buffer_index_line(buffer, oldest + i, line, strlen(line));
+    }
+
+    return buffer->index ? 0 : -1;
+}
+
+/**
+ * Record line SEQ as a match
+ */
+static int anbs_search_add(anbs_search_t *search, unsigned long seq)
+{
+    if (search->match_count == search->match_capacity) {
+        int capacity = search->match_capacity ? search->match_capacity * 2 : 64;
+        unsigned long *matches = (unsigned long *)realloc(search->matches,
+                                                          capacity * sizeof(unsigned long));
+
+        if (!matches) {
+            return -1;
+        }
+        search->matches = matches;
+        search->match_capacity = capacity;
+    }
+
+    search->matches[search->match_count++] = seq;
+    return 0;
+}
+
+/**
+ * Check LINE against the search's query
+ */
+static bool anbs_search_matches(anbs_search_t *search, const char *line)
+{
+    if (search->flags & ANBS_SEARCH_REGEX) {
+        return regexec(&search->regex, line, 0, NULL, 0) == 0;
+    }
+
+    if (search->flags & ANBS_SEARCH_IGNORE_CASE) {
+        return strcasestr(line, search->query) != NULL;
+    }
+
+    return strstr(line, search->query) != NULL;
+}
+
+/**
+ * The last line from display index FIRST on that is stored before the
+ * byte ring wraps
+ */
+static int anbs_search_run_end(text_buffer_t *buffer, int first)
+{
+    const char *start = anbs_text_buffer_line_at(buffer, first);
+    int low = first;
+    int high = buffer->line_count - 1;
+
+    /* Offsets rise until the ring wraps, which happens at most once */
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+
+        if (anbs_text_buffer_line_at(buffer, mid) >= start) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Record each line from display index FIRST on that contains the query,
+ * handing memmem() a whole run of lines at a time rather than testing
+ * them one by one
+ */
+static int anbs_search_scan_bytes(anbs_search_t *search, int first)
+{
+    text_buffer_t *buffer = search->buffer;
+    unsigned long oldest = buffer->appended - buffer->line_count;
+    size_t needle = strlen(search->query);
+
+    while (first < buffer->line_count) {
+        int last = anbs_search_run_end(buffer, first);
+        const char *pos = anbs_text_buffer_line_at(buffer, first);
+        const char *end = anbs_text_buffer_line_at(buffer, last);
+        int line = first;
+
+        /* The query holds no NUL, so a hit never spans two lines */
+        end += strlen(end) + 1;
+        while (line <= last) {
+            const char *hit = memmem(pos, end - pos, search->query, needle);
+            int low, high;
+
+            if (!hit) {
+                break;
+            }
+
+            /* Find the line holding the hit, then go on after it */
+            low = line;
+            high = last;
+            while (low < high) {
+                int mid = low + (high - low + 1) / 2;
+
+                if (anbs_text_buffer_line_at(buffer, mid) <= hit) {
+                    low = mid;
+                } else {
+                    high = mid - 1;
+                }
+            }
+
+            if (anbs_search_add(search, oldest + low) < 0) {
+                return -1;
+            }
+
+            line = low + 1;
+            if (line <= last) {
+                pos = anbs_text_buffer_line_at(buffer, line);
+            }
+        }
+
+        first = last + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Record each line from display index FIRST on that matches the query
+ */
+static int anbs_search_scan_lines(anbs_search_t *search, int first)
+{
+    text_buffer_t *buffer = search->buffer;
+    unsigned long oldest = buffer->appended - buffer->line_count;
+    int i;
+
+    if (!(search->flags & (ANBS_SEARCH_IGNORE_CASE | ANBS_SEARCH_REGEX))) {
+        return anbs_search_scan_bytes(search, first);
+    }
+
+    for (i = first; i < buffer->line_count; i++) {
+        if (anbs_search_matches(search, anbs_text_buffer_line_at(buffer, i)) &&
+            anbs_search_add(search, oldest + i) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Record each line that contains the query, verifying only the lines
+ * indexed under its rarest trigram
+ */
+static int anbs_search_scan_index(anbs_search_t *search)
+{
+    text_buffer_t *buffer = search->buffer;
+    unsigned long oldest = buffer->appended - buffer->line_count;
+    anbs_trigram_list_t *rarest = NULL;
+    size_t i, length = strlen(search->query);
+    int j;
+
+    for (i = 0; i + 2 < length; i++) {
+        anbs_trigram_list_t *list = &buffer->index->lists[anbs_trigram_hash(search->query + i)];
+
+        if (!rarest || list->count < rarest->count) {
+            rarest = list;
+        }
+    }
+
+    for (j = 0; j < rarest->count; j++) {
+        unsigned long seq = rarest->seqs[j];
+
+        if (seq < oldest) {
+            continue;
+        }
+
+        if (anbs_search_matches(search, anbs_text_buffer_line_at(buffer, seq - oldest)) &&
+            anbs_search_add(search, seq) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Open a search over BUFFER.  FLAGS are ANBS_SEARCH_* and hold for the
+ * whole search.
+ */
+int anbs_text_buffer_search_begin(text_buffer_t *buffer, int flags, anbs_search_t **search)
+{
+    anbs_search_t *s;
+
+    if (!buffer || !search) {
+        return -1;
+    }
+
+    s = (anbs_search_t *)calloc(1, sizeof(anbs_search_t));
+    if (!s) {
+        return -1;
+    }
+
+    s->buffer = buffer;
+    s->flags = flags;
+    s->scanned = buffer->appended;
+
+    *search = s;
+    return 0;
+}
+
+/**
+ * Search for QUERY.  When QUERY extends the previous query only the
+ * previous matches are checked again, and lines appended since the last
+ * update are the only ones scanned.  Returns the number of matches.
+ */
+int anbs_text_buffer_search_update(anbs_search_t *search, const char *query)
+{
+    text_buffer_t *buffer;
+    unsigned long oldest;
+    size_t length;
+    bool refine;
+    int rc, i;
+
+    if (!search || !query) {
+        return -1;
+    }
+
+    length = strlen(query);
+    if (length >= sizeof(search->query)) {
+        return -1;
+    }
+
+    buffer = search->buffer;
+    oldest = buffer->appended - buffer->line_count;
+    refine = !(search->flags & ANBS_SEARCH_REGEX) && search->query[0] &&
+             strncmp(query, search->query, strlen(search->query)) == 0;
+
+    if (search->compiled) {
+        regfree(&search->regex);
+        search->compiled = false;
+    }
+
+    memcpy(search->query, query, length + 1);
+
+    if (length == 0) {
+        search->match_count = 0;
+        search->scanned = buffer->appended;
+        return 0;
+    }
+
+    if (search->flags & ANBS_SEARCH_REGEX) {
+        int cflags = REG_EXTENDED | REG_NOSUB;
+
+        if (search->flags & ANBS_SEARCH_IGNORE_CASE) {
+            cflags |= REG_ICASE;
+        }
+
+        if (regcomp(&search->regex, query, cflags) != 0) {
+            /* Likely still being typed */
+            search->query[0] = '\0';
+            search->match_count = 0;
+            return -1;
+        }
+        search->compiled = true;
+    }
+
+    if (refine) {
+        int kept = 0;
+
+        /* Narrow the previous matches, then look at what is new */
+        for (i = 0; i < search->match_count; i++) {
+            unsigned long seq = search->matches[i];
+
+            if (seq >= oldest &&
+                anbs_search_matches(search, anbs_text_buffer_line_at(buffer, seq - oldest))) {
+                search->matches[kept++] = seq;
+            }
+        }
+        search->match_count = kept;
+
+        rc = anbs_search_scan_lines(search, search->scanned > oldest ?
+                                            (int)(search->scanned - oldest) : 0);
+    } else if (buffer->index && !(search->flags & ANBS_SEARCH_REGEX) && length >= 3) {
+        search->match_count = 0;
+        rc = anbs_search_scan_index(search);
+    } else {
+        search->match_count = 0;
+        rc = anbs_search_scan_lines(search, 0);
+    }
+
+    search->scanned = buffer->appended;
+    return rc < 0 ? -1 : search->match_count;
+}
+
+/**
+ * Number of matches found by the last update
+ */
+int anbs_text_buffer_search_count(const anbs_search_t *search)
+{
+    return search ? search->match_count : 0;
+}
+
+/**
+ * Display index of match MATCH, oldest first, or -1 if its line has
+ * since been dropped
+ */
+int anbs_text_buffer_search_line(const anbs_search_t *search, int match)
+{
+    unsigned long oldest;
+
+    if (!search || match < 0 || match >= search->match_count) {
+        return -1;
+    }
+
+    oldest = search->buffer->appended - search->buffer->line_count;
+    if (search->matches[match] < oldest) {
+        return -1;
+    }
+
+    return (int)(search->matches[match] - oldest);
+}
+
+/**
+ * Close a search
+ */
+void anbs_text_buffer_search_end(anbs_search_t *search)
+{
+    if (!search) {
+        return;
+    }
+
+    if (search->compiled) {
+        regfree(&search->regex);
+    }
+    free(search->matches);
+    free(search);
+}
+
 /**
  * Search for text in buffer
  */
 int anbs_text_buffer_search(text_buffer_t *buffer, const char *search_term,
                            int **matching_lines, int max_matches)
 {
-    int i, matches = 0;
+    anbs_search_t *search;
+    int i, matches;
     int *results;
-    int available_lines;
 
     if (!buffer || !search_term || !matching_lines || max_matches <= 0) {
         return -1;
     }
 
-    available_lines = (buffer->line_count < buffer->max_lines) ?
-                     buffer->line_count : buffer->max_lines;
+    if (anbs_text_buffer_search_begin(buffer, 0, &search) < 0) {
+        return -1;
+    }
+
+    matches = anbs_text_buffer_search_update(search, search_term);
+    if (matches > max_matches) {
+        matches = max_matches;
+    }
+
+    if (matches <= 0) {
+        anbs_text_buffer_search_end(search);
+        *matching_lines = NULL;
+        return matches;
+    }
 
     /* Allocate results array */
-    results = (int *)calloc(max_matches, sizeof(int));
+    results = (int *)calloc(matches, sizeof(int));
     if (!results) {
+        anbs_text_buffer_search_end(search);
         return -1;
     }
 
-    /* Search through all lines */
-    for (i = 0; i < available_lines && matches < max_matches; i++) {
-        int line_index;
+    for (i = 0; i < matches; i++) {
+        results[i] = anbs_text_buffer_search_line(search, i);  /* Display index */
+    }
 
-        if (buffer->line_count < buffer->max_lines) {
-            line_index = i;
-        } else {
-            line_index = (buffer->display_start + i) % buffer->max_lines;
+    anbs_text_buffer_search_end(search);
+    *matching_lines = results;
+    return matches;
+}
+
+/**
+ * Get a specific line by display index
+ */
+const char *anbs_text_buffer_get_line(text_buffer_t *buffer, int display_index)
+{
+    if (!buffer || display_index < 0 || display_index >= buffer->line_count) {
+        return NULL;
+    }
+
+    return anbs_text_buffer_line_at(buffer, display_index);
+}
+
+/**
+ * Reset the spill file to empty
+ */
+static void anbs_spill_reset(struct anbs_spill *spill)
+{
+    if (spill->map) {
+        munmap(spill->map, spill->map_size);
+        spill->map = NULL;
+        spill->map_size = 0;
+    }
+
+    /* Blocks are written at file_size, so stale bytes would be harmless */
+    if (ftruncate(spill->fd, 0) != 0) {
+        ANBS_DEBUG_LOG("Could not truncate scrollback spill file: %s", strerror(errno));
+    }
+
+    spill->file_size = 0;
+    spill->block_count = 0;
+    spill->pending_size = 0;
+    spill->pending_lines = 0;
+    spill->lines = 0;
+    spill->cached = -1;
+}
+
+/**
+ * Free the spill store
+ */
+static void anbs_text_buffer_free_spill(text_buffer_t *buffer)
+{
+    struct anbs_spill *spill = buffer->spill;
+
+    if (!spill) {
+        return;
+    }
+
+    if (spill->map) {
+        munmap(spill->map, spill->map_size);
+    }
+    close(spill->fd);
+    free(spill->blocks);
+    free(spill->pending);
+    free(spill->cache);
+    free(spill);
+    buffer->spill = NULL;
+}
+
+/**
+ * Compress the block being filled and append it to the spill file
+ */
+static int anbs_spill_write_block(struct anbs_spill *spill)
+{
+    anbs_spill_block_t *block;
+    uLongf size = compressBound(spill->pending_size);
+    Bytef *compressed;
+    size_t written = 0;
+
+    if (spill->block_count == spill->block_capacity) {
+        int capacity = spill->block_capacity ? spill->block_capacity * 2 : 64;
+        anbs_spill_block_t *blocks = (anbs_spill_block_t *)realloc(spill->blocks,
+                                                                   capacity * sizeof(anbs_spill_block_t));
+
+        if (!blocks) {
+            return -1;
         }
+        spill->blocks = blocks;
+        spill->block_capacity = capacity;
+    }
+
+    compressed = (Bytef *)malloc(size);
+    if (!compressed) {
+        return -1;
+    }
+
+    if (compress2(compressed, &size, (const Bytef *)spill->pending,
+                  spill->pending_size, Z_BEST_SPEED) != Z_OK) {
+        free(compressed);
+        return -1;
+    }
+
+    while (written < size) {
+        ssize_t n = pwrite(spill->fd, compressed + written, size - written,
+                           spill->file_size + written);
 
-        if (buffer->lines[line_index] &&
-            strstr(buffer->lines[line_index], search_term) != NULL) {
-            results[matches] = i;  /* Store display index, not buffer index */
-            matches++;
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
+        if (n <= 0) {
+            free(compressed);
+            return -1;
+        }
+        written += n;
     }
+    free(compressed);
 
-    if (matches == 0) {
-        free(results);
-        *matching_lines = NULL;
+    block = &spill->blocks[spill->block_count++];
+    block->offset = spill->file_size;
+    block->size = size;
+    block->raw_size = spill->pending_size;
+    block->first = spill->lines - spill->pending_lines;
+    block->line_count = spill->pending_lines;
+
+    spill->file_size += size;
+    spill->pending_size = 0;
+    spill->pending_lines = 0;
+    return 0;
+}
+
+/**
+ * Move LINE, about to be dropped from the byte ring, to the spill store
+ */
+static void anbs_text_buffer_spill_line(text_buffer_t *buffer, const char *line)
+{
+    struct anbs_spill *spill = buffer->spill;
+    size_t length = strlen(line) + 1;
+
+    if (spill->pending_size + length > spill->pending_capacity) {
+        size_t capacity = spill->pending_size + length;
+        char *pending;
+
+        if (capacity < ANBS_SPILL_BLOCK_BYTES) {
+            capacity = ANBS_SPILL_BLOCK_BYTES;
+        }
+        pending = (char *)realloc(spill->pending, capacity);
+        if (!pending) {
+            /* Out of memory: older lines are dropped as before */
+            anbs_text_buffer_free_spill(buffer);
+            return;
+        }
+        spill->pending = pending;
+        spill->pending_capacity = capacity;
+    }
+
+    spill->pending_offsets[spill->pending_lines++] = (uint32_t)spill->pending_size;
+    memcpy(spill->pending + spill->pending_size, line, length);
+    spill->pending_size += length;
+    spill->lines++;
+
+    if ((spill->pending_size >= ANBS_SPILL_BLOCK_BYTES ||
+         spill->pending_lines == ANBS_SPILL_BLOCK_LINES) &&
+        anbs_spill_write_block(spill) != 0) {
+        anbs_text_buffer_free_spill(buffer);
+    }
+}
+
+/**
+ * Spill lines dropped from the byte ring to a zlib-compressed file in
+ * DIR ($TMPDIR or /tmp when NULL) instead of losing them.  The file is
+ * unlinked at once, so it goes away with the shell.
+ */
+int anbs_text_buffer_enable_spill(text_buffer_t *buffer, const char *dir)
+{
+    struct anbs_spill *spill;
+    char path[4096];
+
+    if (!buffer) {
+        return -1;
+    }
+
+    if (buffer->spill) {
         return 0;
     }
 
-    *matching_lines = results;
-    return matches;
+    if (!dir) {
+        dir = getenv("TMPDIR");
+    }
+    if (!dir || !*dir) {
+        dir = "/tmp";
+    }
+    if (snprintf(path, sizeof(path), "%s/anbs-scrollback-XXXXXX", dir) >= (int)sizeof(path)) {
+        return -1;
+    }
+
+    spill = (struct anbs_spill *)calloc(1, sizeof(struct anbs_spill));
+    if (!spill) {
+        return -1;
+    }
+
+    spill->fd = mkstemp(path);
+    if (spill->fd < 0) {
+        free(spill);
+        return -1;
+    }
+    unlink(path);
+    fcntl(spill->fd, F_SETFD, FD_CLOEXEC);
+
+    spill->cached = -1;
+    buffer->spill = spill;
+    return 0;
 }
 
 /**
- * Get a specific line by display index
+ * Number of lines that can be read back, spilled ones included
  */
-const char *anbs_text_buffer_get_line(text_buffer_t *buffer, int display_index)
+unsigned long anbs_text_buffer_history_lines(text_buffer_t *buffer)
 {
-    int line_index;
-    int available_lines;
+    if (!buffer) {
+        return 0;
+    }
 
-    if (!buffer || display_index < 0) {
-        return NULL;
+    return (buffer->spill ? buffer->spill->lines : 0) + buffer->line_count;
+}
+
+/**
+ * Inflate spilled block INDEX into the read cache
+ */
+static int anbs_spill_load_block(struct anbs_spill *spill, int index)
+{
+    anbs_spill_block_t *block = &spill->blocks[index];
+    uLongf raw_size = block->raw_size;
+    size_t offset = 0;
+    int line;
+
+    if (spill->cached == index) {
+        return 0;
+    }
+
+    /* Map the file again once it has outgrown the mapping */
+    if ((size_t)(block->offset + block->size) > spill->map_size) {
+        void *map;
+
+        if (spill->map) {
+            munmap(spill->map, spill->map_size);
+            spill->map = NULL;
+            spill->map_size = 0;
+        }
+        map = mmap(NULL, spill->file_size, PROT_READ, MAP_SHARED, spill->fd, 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        spill->map = (char *)map;
+        spill->map_size = spill->file_size;
     }
 
-    available_lines = (buffer->line_count < buffer->max_lines) ?
-                     buffer->line_count : buffer->max_lines;
+    if (block->raw_size > spill->cache_capacity) {
+        char *cache = (char *)realloc(spill->cache, block->raw_size);
 
-    if (display_index >= available_lines) {
+        if (!cache) {
+            return -1;
+        }
+        spill->cache = cache;
+        spill->cache_capacity = block->raw_size;
+    }
+
+    spill->cached = -1;
+    if (uncompress((Bytef *)spill->cache, &raw_size,
+                   (const Bytef *)spill->map + block->offset, block->size) != Z_OK ||
+        raw_size != block->raw_size) {
+        return -1;
+    }
+
+    for (line = 0; line < block->line_count; line++) {
+        spill->cache_offsets[line] = (uint32_t)offset;
+        offset += strlen(spill->cache + offset) + 1;
+    }
+
+    spill->cached = index;
+    return 0;
+}
+
+/**
+ * Rows history line INDEX takes in a panel COLUMNS wide.  For lines
+ * still in RAM the answer is cached with the line: its width is measured
+ * once, an ASCII line rewraps at any width by arithmetic alone, and any
+ * other line is decoded again only when the width changes.
+ */
+int anbs_text_buffer_line_rows(text_buffer_t *buffer, unsigned long index, int columns)
+{
+    unsigned long spilled;
+    struct anbs_line_layout *layout;
+    const char *text;
+    size_t length;
+
+    if (!buffer || columns <= 0 || index >= anbs_text_buffer_history_lines(buffer)) {
+        return 1;
+    }
+
+    spilled = buffer->spill ? buffer->spill->lines : 0;
+    text = anbs_text_buffer_history_line(buffer, index);
+    if (!text) {
+        return 1;
+    }
+    length = strcspn(text, "\n");
+
+    if (index < spilled) {
+        return anbs_text_rows(text, length, columns);
+    }
+
+    layout = &buffer->layouts[(buffer->display_start + (int)(index - spilled)) % buffer->max_lines];
+    if (!layout->measured) {
+        layout->width = (uint32_t)anbs_text_width(text, length);
+        layout->ascii = layout->width == length;
+        layout->columns = 0;
+        layout->measured = true;
+    }
+
+    if (layout->ascii || layout->width <= (uint32_t)columns) {
+        return layout->width == 0 ? 1 : (int)((layout->width + columns - 1) / columns);
+    }
+
+    if (layout->columns != columns) {
+        int rows = anbs_text_rows(text, length, columns);
+
+        layout->rows = rows < UINT16_MAX ? rows : UINT16_MAX;
+        layout->columns = columns < UINT16_MAX ? columns : 0;
+    }
+    return layout->rows;
+}
+
+/**
+ * Get line INDEX of the whole history, 0 being the oldest line kept on
+ * disk or in RAM.  A spilled line is read into a cache and its pointer
+ * is only valid until the next call.
+ */
+const char *anbs_text_buffer_history_line(text_buffer_t *buffer, unsigned long index)
+{
+    struct anbs_spill *spill;
+    int low, high;
+
+    if (!buffer || index >= anbs_text_buffer_history_lines(buffer)) {
         return NULL;
     }
 
-    if (buffer->line_count < buffer->max_lines) {
-        line_index = display_index;
-    } else {
-        line_index = (buffer->display_start + display_index) % buffer->max_lines;
+    spill = buffer->spill;
+    if (!spill || index >= spill->lines) {
+        return anbs_text_buffer_line_at(buffer, (int)(index - (spill ? spill->lines : 0)));
+    }
+
+    /* Not compressed yet */
+    if (index >= spill->lines - spill->pending_lines) {
+        int line = (int)(index - (spill->lines - spill->pending_lines));
+
+        return spill->pending + spill->pending_offsets[line];
     }
 
-    return buffer->lines[line_index];
-}
\ No newline at end of file
+    /* The block holding it */
+    low = 0;
+    high = spill->block_count - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+
+        if (spill->blocks[mid].first <= index) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    if (anbs_spill_load_block(spill, low) != 0) {
+        return NULL;
+    }
+
+    return spill->cache + spill->cache_offsets[index - spill->blocks[low].first];
+}
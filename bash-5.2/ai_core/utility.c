@@ -1,10 +1,24 @@
 /* utility.c - Utility functions for ANBS display system */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE            /* wcwidth */
+#endif
+
 #include "ai_display.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <strings.h>
+#include <wchar.h>
 
 /**
  * Check if terminal supports color
@@ -55,6 +69,133 @@ bool anbs_terminal_supports_unicode(void)
     return false;
 }
 
+/**
+ * Bytes at the start of TEXT that are printable ASCII, each one column
+ * wide.  Whole words are tested at a time, which the compiler turns
+ * into vector compares; panel text is mostly ASCII.
+ */
+static size_t anbs_ascii_run(const char *text, size_t length)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    size_t i = 0;
+
+    while (i + sizeof(uint64_t) <= length) {
+        uint64_t word, del;
+
+        memcpy(&word, text + i, sizeof(word));
+        del = word ^ (ones * 0x7f);
+
+        /* A byte with the high bit set, below 0x20, or DEL */
+        if ((word | ((word - ones * 0x20) & ~word) | ((del - ones) & ~del)) & highs) {
+            break;
+        }
+        i += sizeof(uint64_t);
+    }
+
+    while (i < length && (unsigned char)text[i] >= 0x20 && (unsigned char)text[i] < 0x7f) {
+        i++;
+    }
+
+    return i;
+}
+
+/**
+ * Bytes of the first LENGTH of TEXT that fit in COLUMNS screen columns,
+ * stopping before a character that would not fit.  *USED, if given, is
+ * set to the columns they take.  Multibyte characters are decoded in
+ * the current locale and measured with wcwidth(), as lib/sh/wcswidth.c
+ * does; bytes that do not decode count one column each.
+ */
+size_t anbs_text_fit(const char *text, size_t length, int columns, int *used)
+{
+    mbstate_t state;
+    size_t i = 0;
+    int width = 0;
+
+    memset(&state, 0, sizeof(state));
+
+    while (i < length && width < columns) {
+        size_t run = anbs_ascii_run(text + i, length - i);
+        wchar_t wc;
+        size_t n;
+        int w;
+
+        if (run > 0) {
+            if (run > (size_t)(columns - width)) {
+                run = columns - width;
+            }
+            i += run;
+            width += (int)run;
+            continue;
+        }
+
+        n = mbrtowc(&wc, text + i, length - i, &state);
+        if (n == 0 || n == (size_t)-1 || n == (size_t)-2) {
+            memset(&state, 0, sizeof(state));
+            n = 1;
+            w = 1;
+        } else {
+            w = wcwidth(wc);
+            if (w < 0) {
+                w = 1;
+            }
+        }
+
+        if (width + w > columns) {
+            break;
+        }
+        i += n;
+        width += w;
+    }
+
+    if (used) {
+        *used = width;
+    }
+    return i;
+}
+
+/**
+ * Screen columns the first LENGTH bytes of TEXT take
+ */
+int anbs_text_width(const char *text, size_t length)
+{
+    int width;
+
+    if (anbs_ascii_run(text, length) == length) {
+        return length < INT_MAX ? (int)length : INT_MAX;
+    }
+
+    anbs_text_fit(text, length, INT_MAX, &width);
+    return width;
+}
+
+/**
+ * Rows the first LENGTH bytes of TEXT take when wrapped at COLUMNS
+ */
+int anbs_text_rows(const char *text, size_t length, int columns)
+{
+    int rows = 0;
+
+    if (columns <= 0) {
+        return 1;
+    }
+
+    while (length > 0) {
+        size_t n = anbs_text_fit(text, length, columns, NULL);
+
+        /* A character wider than the panel still gets its own row */
+        if (n == 0) {
+            n = 1;
+        }
+        text += n;
+        length -= n;
+        rows++;
+    }
+
+    return rows > 0 ? rows : 1;
+}
+
 /**
  * Calculate panel dimensions based on current terminal size
  */
@@ -124,6 +265,22 @@ char *anbs_safe_strncpy(char *dest, const char *src, size_t dest_size)
     return dest;
 }
 
+/**
+ * Name the calling thread, so ps, debuggers and the heap profiler can
+ * tell the background threads apart.  Names are cut to 15 characters.
+ */
+void anbs_thread_name(const char *name)
+{
+    char buf[16];
+
+    anbs_safe_strncpy(buf, name, sizeof(buf));
+#if defined(__APPLE__)
+    pthread_setname_np(buf);
+#elif defined(__linux__)
+    pthread_setname_np(pthread_self(), buf);
+#endif
+}
+
 /**
  * Duplicate string with error checking
  */
@@ -354,32 +511,308 @@ bool anbs_validate_panel_config(anbs_display_t *display)
     return true;
 }
 
+#ifdef ANBS_DEBUG
+/* Debug logging.  Each thread formats its messages into its own ring of
+   fixed-size lines; a flusher thread, started with the first message,
+   drains every ring into the log file, which it keeps open.  The logging
+   path takes no lock and makes no system call beyond waking the flusher
+   once per batch, so the locks callers hold stay as short as they are
+   with logging off.  A full ring drops the message and counts it. */
+#define LOG_RING_SLOTS 128          /* lines pending per thread; a power of 2 */
+#define LOG_LINE_MAX 240
+#define LOG_FLUSH_DELAY_US 20000    /* gather lines this long after a wakeup */
+#define LOG_WRITE_BUFFER 16384
+#define LOG_DEFAULT_RATE 100
+#define LOG_DEFAULT_FILE "/tmp/anbs_debug.log"
+
+typedef struct {
+    struct timespec at;
+    int level;
+    char text[LOG_LINE_MAX];
+} log_line_t;
+
+/* Single producer (the owning thread), single consumer (the flusher) */
+typedef struct log_ring {
+    uint64_t head;              /* next slot the owner fills */
+    uint64_t tail;              /* next slot the flusher writes out */
+    bool orphaned;              /* the owner exited; freed once drained */
+    struct log_ring *next;
+    log_line_t lines[LOG_RING_SLOTS];
+} log_ring_t;
+
+static struct {
+    pthread_mutex_t lock;       /* guards RINGS, draining and starting the flusher */
+    log_ring_t *rings;
+    bool flusher_started;
+    sem_t wake;
+    int pending;                /* the flusher has been woken for new lines */
+    int fd;
+    unsigned int rate;
+    uint64_t dropped;
+    uint64_t dropped_reported;
+} g_log = { PTHREAD_MUTEX_INITIALIZER, NULL, false };
+
+int anbs_log_threshold = INT_MAX;   /* until the first message reads ANBS_LOG_LEVEL */
+
+static pthread_once_t g_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_log_key;
+static __thread log_ring_t *t_log_ring;
+
+static const char *const log_level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+/* Write out every pending line and free the rings of exited threads.
+   Called with the lock held. */
+static void log_drain_locked(void) {
+    char buffer[LOG_WRITE_BUFFER];
+    size_t used = 0;
+    log_ring_t **link = &g_log.rings;
+    uint64_t dropped;
+    struct tm tm;
+
+    while (*link) {
+        log_ring_t *ring = *link;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        for (; tail != head; tail++) {
+            log_line_t *line = &ring->lines[tail & (LOG_RING_SLOTS - 1)];
+
+            if (used + LOG_LINE_MAX + 64 > sizeof(buffer)) {
+                (void)!write(g_log.fd, buffer, used);
+                used = 0;
+            }
+            localtime_r(&line->at.tv_sec, &tm);
+            used += snprintf(buffer + used, sizeof(buffer) - used, "[%02d:%02d:%02d.%03ld] %s %s\n",
+                             tm.tm_hour, tm.tm_min, tm.tm_sec, line->at.tv_nsec / 1000000,
+                             log_level_names[line->level], line->text);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    dropped = __atomic_load_n(&g_log.dropped, __ATOMIC_RELAXED);
+    if (dropped != g_log.dropped_reported) {
+        used += snprintf(buffer + used, sizeof(buffer) - used, "[anbs] %lu log messages dropped\n",
+                         (unsigned long)(dropped - g_log.dropped_reported));
+        g_log.dropped_reported = dropped;
+    }
+    if (used > 0) {
+        (void)!write(g_log.fd, buffer, used);
+    }
+}
+
+static void *log_flusher(void *arg) {
+    sigset_t signals;
+
+    (void)arg;
+    anbs_thread_name("anbs-log");
+
+    /* The shell's signal handlers must run on its own thread */
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    for (;;) {
+        while (sem_wait(&g_log.wake) != 0 && errno == EINTR) {
+        }
+        usleep(LOG_FLUSH_DELAY_US);
+        __atomic_store_n(&g_log.pending, 0, __ATOMIC_RELEASE);
+
+        pthread_mutex_lock(&g_log.lock);
+        log_drain_locked();
+        pthread_mutex_unlock(&g_log.lock);
+    }
+
+    return NULL;
+}
+
+/* Start the flusher unless it is running.  Called with the lock held. */
+static void log_start_flusher_locked(void) {
+    pthread_t thread;
+
+    if (g_log.flusher_started || g_log.fd < 0) {
+        return;
+    }
+    if (pthread_create(&thread, NULL, log_flusher, NULL) == 0) {
+        pthread_detach(thread);
+        g_log.flusher_started = true;
+    }
+}
+
+/* A thread's ring outlives it until the flusher has written it out */
+static void log_thread_exit(void *ring) {
+    __atomic_store_n(&((log_ring_t *)ring)->orphaned, true, __ATOMIC_RELEASE);
+}
+
+/* Don't lose the last messages when the shell exits */
+static void log_atexit(void) {
+    pthread_mutex_lock(&g_log.lock);
+    log_drain_locked();
+    pthread_mutex_unlock(&g_log.lock);
+}
+
+/* A forked child has no flusher, and the parent's flusher writes out
+   whatever was pending at the fork; the child keeps only its own ring,
+   emptied, and starts a flusher with its next message */
+static void log_atfork_child(void) {
+    pthread_mutex_init(&g_log.lock, NULL);
+    sem_init(&g_log.wake, 0, 0);
+    g_log.pending = 0;
+    g_log.flusher_started = false;
+    g_log.dropped_reported = g_log.dropped;
+    g_log.rings = t_log_ring;
+    if (t_log_ring) {
+        t_log_ring->next = NULL;
+        t_log_ring->tail = t_log_ring->head;
+    }
+}
+
+static void log_init(void) {
+    const char *level = getenv("ANBS_LOG_LEVEL");
+    const char *rate = getenv("ANBS_LOG_RATE");
+    const char *file = getenv("ANBS_LOG_FILE");
+    int threshold = ANBS_LOG_DEBUG;
+
+    if (level && *level) {
+        for (int i = 0; i <= ANBS_LOG_DEBUG; i++) {
+            if (strcasecmp(level, log_level_names[i]) == 0) {
+                threshold = i;
+            }
+        }
+        if (strcasecmp(level, "WARNING") == 0) {
+            threshold = ANBS_LOG_WARN;
+        } else if (*level >= '0' && *level <= '9') {
+            threshold = atoi(level) < ANBS_LOG_DEBUG ? atoi(level) : ANBS_LOG_DEBUG;
+        }
+    }
+    g_log.rate = rate && atoi(rate) > 0 ? (unsigned int)atoi(rate) : LOG_DEFAULT_RATE;
+    g_log.fd = open(file && *file ? file : LOG_DEFAULT_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    sem_init(&g_log.wake, 0, 0);
+    pthread_key_create(&g_log_key, log_thread_exit);
+    atexit(log_atexit);
+    pthread_atfork(NULL, NULL, log_atfork_child);
+
+    __atomic_store_n(&anbs_log_threshold, g_log.fd >= 0 ? threshold : -1, __ATOMIC_RELEASE);
+}
+
+/* Whether a LEVEL message from SITE should be logged: its level is on
+   and the site is under its rate for the current second */
+bool anbs_log_admit(anbs_log_site_t *site, int level) {
+    struct timespec now;
+    unsigned int second;
+
+    pthread_once(&g_log_once, log_init);
+    if (level > __atomic_load_n(&anbs_log_threshold, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    second = (unsigned int)now.tv_sec;
+    if (__atomic_load_n(&site->second, __ATOMIC_RELAXED) != second) {
+        __atomic_store_n(&site->second, second, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > g_log.rate) {
+        __atomic_add_fetch(&g_log.dropped, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+/* The calling thread's ring, registered on its first message */
+static log_ring_t *log_ring(void) {
+    log_ring_t *ring = t_log_ring;
+
+    if (ring) {
+        return ring;
+    }
+    ring = calloc(1, sizeof(log_ring_t));
+    if (!ring) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_log.lock);
+    ring->next = g_log.rings;
+    g_log.rings = ring;
+    log_start_flusher_locked();
+    pthread_mutex_unlock(&g_log.lock);
+
+    pthread_setspecific(g_log_key, ring);
+    t_log_ring = ring;
+    return ring;
+}
+
+static void log_vwrite(int level, const char *file, int line, const char *fmt, va_list args) {
+    log_ring_t *ring = log_ring();
+    log_line_t *slot;
+    uint64_t head;
+    int used = 0;
+
+    if (!ring) {
+        __atomic_add_fetch(&g_log.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        __atomic_add_fetch(&g_log.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    slot = &ring->lines[head & (LOG_RING_SLOTS - 1)];
+    clock_gettime(CLOCK_REALTIME_COARSE, &slot->at);
+    slot->level = level;
+    if (file) {
+        used = snprintf(slot->text, sizeof(slot->text), "[%s:%d] ", file, line);
+        if (used < 0 || used >= (int)sizeof(slot->text)) {
+            used = 0;
+        }
+    }
+    vsnprintf(slot->text + used, sizeof(slot->text) - used, fmt, args);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    /* A child of a fork starts its own flusher */
+    if (!__atomic_load_n(&g_log.flusher_started, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&g_log.lock);
+        log_start_flusher_locked();
+        pthread_mutex_unlock(&g_log.lock);
+    }
+    if (__atomic_exchange_n(&g_log.pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        sem_post(&g_log.wake);
+    }
+}
+
+/* Queue one message from FILE:LINE; the ANBS_LOG macro has already
+   checked its level and rate */
+void anbs_log_write(int level, const char *file, int line, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    log_vwrite(level, file, line, fmt, args);
+    va_end(args);
+}
+#endif
+
 /**
  * Log debug message with timestamp
  */
 void anbs_debug_log(const char *format, ...)
 {
 #ifdef ANBS_DEBUG
-    FILE *debug_file;
+    static anbs_log_site_t site;
     va_list args;
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
 
-    debug_file = fopen("/tmp/anbs_debug.log", "a");
-    if (!debug_file) {
+    if (!anbs_log_admit(&site, ANBS_LOG_DEBUG)) {
         return;
     }
 
-    /* Write timestamp */
-    fprintf(debug_file, "[%02d:%02d:%02d] ",
-            tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec);
-
-    /* Write formatted message */
     va_start(args, format);
-    vfprintf(debug_file, format, args);
+    log_vwrite(ANBS_LOG_DEBUG, NULL, 0, format, args);
     va_end(args);
-
-    fprintf(debug_file, "\n");
-    fclose(debug_file);
 #endif
-}
\ No newline at end of file
+}
@@ -6,6 +6,12 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -15,9 +21,72 @@
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 #include <base64.h>
+#include <zlib.h>
+#include <json-c/json.h>
+#if defined (__x86_64__) || defined (__i386__)
+#  include <emmintrin.h>
+#elif defined (__aarch64__)
+#  include <arm_neon.h>
+#endif
 
 #define WS_MAGIC_STRING "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
-#define WS_BUFFER_SIZE 8192
+#define WS_BUFFER_SIZE 8192        /* free room the reader asks each read for */
+#define WS_DEFLATE_MIN 64          /* shorter messages are sent uncompressed */
+#define WS_RSV1 0x40               /* frame bit marking a compressed message */
+#define WS_RSV23 0x30              /* frame bits no extension we use defines */
+#define WS_MAX_MESSAGE (64 * 1024 * 1024)  /* larger messages close the link */
+#define WS_CONTROL_MAX 125         /* longest control frame payload */
+#define WS_WRITE_TIMEOUT_MS 5000   /* longest wait for room to send */
+#define WS_DIAL_TIMEOUT_S 10       /* longest connect, TLS or upgrade step */
+#define WS_TX_INITIAL 16384        /* send queue room allocated up front */
+#define WS_FRAME_HEADER_MAX 14     /* 64-bit length and mask */
+#define WS_PENDING_BUCKETS 64      /* request table; a power of two */
+#define WS_RECONNECT_BASE_MS 250   /* first redial delay, doubled per failure */
+#define WS_RECONNECT_MAX_MS 30000  /* longest redial delay by default */
+#define WS_RECONNECT_QUEUE_MAX (1024 * 1024)  /* bytes of sends held while redialling */
+
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_TOO_BIG 1009
+
+/* Frames and payloads come from the slabs in performance/optimize.c */
+extern void *anbs_optimize_malloc(size_t size);
+extern void *anbs_optimize_realloc(void *ptr, size_t size);
+extern void anbs_optimize_free(void *ptr, size_t size);
+
+/* Shared I/O loop (event_loop.c) */
+extern int anbs_event_add(int fd, uint32_t events, void (*handler)(int fd, uint32_t events, void *arg), void *arg);
+extern int anbs_event_remove(int fd);
+
+/* OpenMetrics writers from performance/metrics.c */
+extern void anbs_metrics_export_family(FILE *out, const char *name, const char *type, const char *help);
+extern void anbs_metrics_export_sample(FILE *out, const char *name, const char *labels, double value);
+
+/* A request waiting for its reply.  CALLBACK gets the reply text, or NULL
+   when the request times out or the connection drops. */
+typedef struct ws_pending {
+    uint64_t id;
+    uint64_t deadline_ns;       /* CLOCK_MONOTONIC; 0 waits indefinitely */
+    void (*callback)(const char *reply, void *arg);
+    void *arg;
+    char *message;              /* kept to send again after a reconnect */
+    int sent;                   /* on the current connection */
+    struct ws_pending *next;
+} ws_pending_t;
+
+/* What anbs_websocket_request_wait() blocks on */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    char *reply;
+} ws_future_t;
 
 typedef struct {
     int socket_fd;
@@ -27,11 +96,94 @@ typedef struct {
     int port;
     char *path;
     int connected;
-    pthread_t thread;
-    pthread_mutex_t write_mutex;
+    pthread_mutex_t ssl_mutex;      /* one SSL call at a time */
     anbs_display_t *display;
+
+    /* Send queue.  Senders build their frames in place at the end of TX,
+       and whichever one finds no write in progress swaps TX with TX_OUT
+       and writes everything queued in one call, repeating until the queue
+       is empty.  Bursts of small messages go out together, and neither
+       buffer is reallocated once it is big enough. */
+    pthread_mutex_t write_mutex;    /* guards the queue and the deflater */
+    unsigned char *tx;
+    size_t tx_len;
+    size_t tx_capacity;
+    unsigned char *tx_out;
+    size_t tx_out_capacity;
+    int tx_flushing;
+
+    /* permessage-deflate (RFC 7692), when the server accepts it.  The
+       deflate stream is used under WRITE_MUTEX, the inflate stream only by
+       the event loop; each is reset per message when the server asks
+       for no context takeover on that side. */
+    int deflate;
+    int client_no_context;
+    int server_no_context;
+    z_stream deflater;
+    z_stream inflater;
+
+    /* Traffic counters, updated atomically by the sender and the event
+       loop.  Message bytes are payloads before compression; wire
+       bytes are what crossed the socket. */
+    uint64_t connects;
+    uint64_t messages_sent;
+    uint64_t messages_received;
+    uint64_t message_bytes_sent;
+    uint64_t message_bytes_received;
+    uint64_t wire_bytes_sent;
+    uint64_t wire_bytes_received;
+    uint64_t wire_writes;
+
+    /* Receive state, owned by the event loop: bytes read but not yet
+       parsed, and the fragments of a message still arriving.  Both
+       buffers keep a spare byte past their contents for a terminating
+       NUL. */
+    unsigned char *rx;
+    size_t rx_len;
+    size_t rx_capacity;
+    char *fragments;
+    size_t fragments_len;
+    size_t fragments_capacity;
+    int fragment_opcode;        /* WS_OP_TEXT or WS_OP_BINARY while a message is open */
+    int fragment_compressed;
+
+    /* Requests in flight, by ID.  Replies are JSON objects carrying the
+       ID of their request and may come back in any order; messages that
+       match no request go to the chat panel.  TIMER_FD fires at the
+       earliest deadline. */
+    pthread_mutex_t pending_mutex;
+    ws_pending_t *pending[WS_PENDING_BUCKETS];
+    int pending_count;
+    uint64_t next_request_id;
+    int timer_fd;
+    uint64_t timer_deadline_ns;     /* what TIMER_FD is armed for, or 0 */
+
+    /* Reconnection.  When the link drops by itself a thread redials with
+       jittered exponential backoff.  Meanwhile sends queue, up to
+       WS_RECONNECT_QUEUE_MAX bytes, and requests in flight wait to go out
+       again on the new connection. */
+    pthread_mutex_t reconnect_mutex;
+    pthread_cond_t reconnect_cond;  /* wakes the redial backoff early */
+    pthread_t reconnect_thread;
+    int reconnect_started;          /* RECONNECT_THREAD wants joining */
+    int reconnecting;
+    int closing;                    /* a deliberate disconnect: don't redial */
+    int reconnect_enabled;          /* ANBS_WS_RECONNECT */
+    int reconnect_max_ms;           /* ANBS_WS_RECONNECT_MAX_MS */
 } websocket_client_t;
 
+/* A decoded frame header */
+typedef struct {
+    int fin;
+    int compressed;             /* RSV1, on the first frame of a message */
+    int reserved;               /* RSV2 or RSV3 */
+    int opcode;
+    int masked;
+    unsigned char mask[4];
+    size_t header_len;
+    uint64_t payload_len;
+} websocket_frame_t;
+
 static websocket_client_t *g_ws_client = NULL;
 
 /* Base64 encoding for WebSocket handshake */
@@ -86,98 +238,247 @@ static char *calculate_accept_key(const char *client_key) {
     return base64_encode(hash, SHA_DIGEST_LENGTH);
 }
 
-/* Create WebSocket frame */
-static int create_websocket_frame(const char *payload, unsigned char **frame, size_t *frame_len) {
-    size_t payload_len = strlen(payload);
-    size_t header_len;
-    unsigned char *result;
+/* XOR LEN bytes of SRC with the 4-byte MASK into DST, 16 bytes at a
+   time where the CPU has vector registers (SSE2 is part of x86-64) */
+static void websocket_mask(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char mask[4]) {
+    size_t i = 0;
 
-    /* Determine header length */
-    if (payload_len < 126) {
-        header_len = 2 + 4; /* Basic header + mask */
-    } else if (payload_len < 65536) {
-        header_len = 4 + 4; /* Extended 16-bit length + mask */
-    } else {
-        header_len = 10 + 4; /* Extended 64-bit length + mask */
+#if defined (__x86_64__) || defined (__i386__) && defined (__SSE2__)
+    uint32_t word;
+    memcpy(&word, mask, 4);
+    __m128i key = _mm_set1_epi32((int)word);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(block, key));
     }
+#elif defined (__aarch64__)
+    uint32_t word;
+    memcpy(&word, mask, 4);
+    uint8x16_t key = vreinterpretq_u8_u32(vdupq_n_u32(word));
 
-    *frame_len = header_len + payload_len;
-    result = malloc(*frame_len);
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), key));
+    }
+#endif
 
-    /* FIN + opcode (text frame) */
-    result[0] = 0x81;
+    /* Blocks are a multiple of 4, so the key lines up for the tail */
+    for (; i < len; i++) {
+        dst[i] = src[i] ^ mask[i & 3];
+    }
+}
+
+/* Write the header of a final, masked frame of OPCODE carrying
+   PAYLOAD_LEN bytes to OUT, which has room for WS_FRAME_HEADER_MAX;
+   COMPRESSED sets RSV1 to say they are deflated.  Returns its length. */
+static size_t websocket_frame_header(unsigned char *out, int opcode, size_t payload_len, int compressed,
+                                     const unsigned char mask[4]) {
+    size_t header_len;
+
+    /* FIN + opcode */
+    out[0] = 0x80 | opcode | (compressed ? WS_RSV1 : 0);
 
     /* Payload length and mask bit */
     if (payload_len < 126) {
-        result[1] = 0x80 | payload_len; /* Mask bit + length */
+        out[1] = 0x80 | payload_len; /* Mask bit + length */
+        header_len = 2;
     } else if (payload_len < 65536) {
-        result[1] = 0x80 | 126;
-        result[2] = (payload_len >> 8) & 0xFF;
-        result[3] = payload_len & 0xFF;
+        out[1] = 0x80 | 126;
+        out[2] = (payload_len >> 8) & 0xFF;
+        out[3] = payload_len & 0xFF;
+        header_len = 4;
     } else {
-        result[1] = 0x80 | 127;
+        out[1] = 0x80 | 127;
         /* 64-bit length (big endian) */
         for (int i = 0; i < 8; i++) {
-            result[2 + i] = (payload_len >> (8 * (7 - i))) & 0xFF;
+            out[2 + i] = ((uint64_t)payload_len >> (8 * (7 - i))) & 0xFF;
         }
+        header_len = 10;
     }
 
-    /* Masking key (simple XOR pattern) */
-    unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
-    memcpy(result + header_len - 4, mask, 4);
-
-    /* Masked payload */
-    for (size_t i = 0; i < payload_len; i++) {
-        result[header_len + i] = payload[i] ^ mask[i % 4];
-    }
-
-    *frame = result;
-    return 0;
+    memcpy(out + header_len, mask, 4);
+    return header_len + 4;
 }
 
-/* Parse WebSocket frame */
-static int parse_websocket_frame(const unsigned char *data, size_t len, char **payload) {
-    if (len < 2) return -1;
+/* Decode the frame header at the start of the LEN bytes at DATA.
+   Returns 1 when the header is complete, 0 when more bytes are needed. */
+static int parse_websocket_frame(const unsigned char *data, size_t len, websocket_frame_t *frame) {
+    size_t offset = 2;
 
-    int fin = (data[0] & 0x80) != 0;
-    int opcode = data[0] & 0x0F;
-    int masked = (data[1] & 0x80) != 0;
-    uint64_t payload_len = data[1] & 0x7F;
+    if (len < 2) {
+        return 0;
+    }
 
-    size_t offset = 2;
+    frame->fin = (data[0] & 0x80) != 0;
+    frame->compressed = (data[0] & WS_RSV1) != 0;
+    frame->reserved = (data[0] & WS_RSV23) != 0;
+    frame->opcode = data[0] & 0x0F;
+    frame->masked = (data[1] & 0x80) != 0;
+    frame->payload_len = data[1] & 0x7F;
 
     /* Extended payload length */
-    if (payload_len == 126) {
-        if (len < offset + 2) return -1;
-        payload_len = (data[offset] << 8) | data[offset + 1];
+    if (frame->payload_len == 126) {
+        if (len < offset + 2) return 0;
+        frame->payload_len = (data[offset] << 8) | data[offset + 1];
         offset += 2;
-    } else if (payload_len == 127) {
-        if (len < offset + 8) return -1;
-        payload_len = 0;
+    } else if (frame->payload_len == 127) {
+        if (len < offset + 8) return 0;
+        frame->payload_len = 0;
         for (int i = 0; i < 8; i++) {
-            payload_len = (payload_len << 8) | data[offset + i];
+            frame->payload_len = (frame->payload_len << 8) | data[offset + i];
         }
         offset += 8;
     }
 
-    /* Masking key */
-    unsigned char mask[4] = {0};
-    if (masked) {
-        if (len < offset + 4) return -1;
-        memcpy(mask, data + offset, 4);
+    /* Masking key; servers shouldn't mask, but a masked frame is still
+       readable */
+    if (frame->masked) {
+        if (len < offset + 4) return 0;
+        memcpy(frame->mask, data + offset, 4);
         offset += 4;
     }
 
-    /* Payload */
-    if (len < offset + payload_len) return -1;
+    frame->header_len = offset;
+    return 1;
+}
+
+/* Deflate LEN bytes of MESSAGE as one permessage-deflate message: raw
+   deflate ending in a sync flush, without the flush's 00 00 ff ff tail.
+   Returns a slab block holding *OUT_LEN bytes, or NULL. */
+static unsigned char *websocket_deflate(websocket_client_t *client, const char *message, size_t len,
+                                        size_t *out_len) {
+    size_t capacity = deflateBound(&client->deflater, len) + 16;
+    unsigned char *out = anbs_optimize_malloc(capacity);
+    int status;
+
+    if (!out) {
+        return NULL;
+    }
 
-    *payload = malloc(payload_len + 1);
-    for (uint64_t i = 0; i < payload_len; i++) {
-        (*payload)[i] = masked ? data[offset + i] ^ mask[i % 4] : data[offset + i];
+    client->deflater.next_in = (unsigned char *)message;
+    client->deflater.avail_in = len;
+    client->deflater.next_out = out;
+    client->deflater.avail_out = capacity;
+    status = deflate(&client->deflater, Z_SYNC_FLUSH);
+    *out_len = capacity - client->deflater.avail_out;
+
+    if (status != Z_OK || client->deflater.avail_in != 0 || *out_len < 4) {
+        anbs_optimize_free(out, capacity);
+        deflateReset(&client->deflater);
+        return NULL;
     }
-    (*payload)[payload_len] = '\0';
+    *out_len -= 4;
 
-    return fin ? 1 : 0; /* Return 1 if this is the final frame */
+    if (client->client_no_context) {
+        deflateReset(&client->deflater);
+    }
+    return out;
+}
+
+/* Inflate one compressed message of LEN bytes into a NUL-terminated slab
+   block, or NULL */
+static char *websocket_inflate(websocket_client_t *client, const unsigned char *data, size_t len) {
+    static const unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+    size_t capacity = len * 4 + 256, used = 0;
+    char *out = anbs_optimize_malloc(capacity), *grown;
+    int status = Z_OK;
+
+    for (int part = 0; out && part < 2; part++) {
+        client->inflater.next_in = (unsigned char *)(part == 0 ? data : tail);
+        client->inflater.avail_in = part == 0 ? len : sizeof(tail);
+
+        while (client->inflater.avail_in > 0 && status == Z_OK) {
+            if (capacity - used < 2) {
+                grown = anbs_optimize_malloc(capacity * 2);
+                if (!grown) {
+                    status = Z_MEM_ERROR;
+                    break;
+                }
+                memcpy(grown, out, used);
+                anbs_optimize_free(out, capacity);
+                out = grown;
+                capacity *= 2;
+            }
+            client->inflater.next_out = (unsigned char *)out + used;
+            client->inflater.avail_out = capacity - used - 1;
+            status = inflate(&client->inflater, Z_SYNC_FLUSH);
+            used = capacity - 1 - client->inflater.avail_out;
+            if (status == Z_BUF_ERROR && client->inflater.avail_out == 0) {
+                status = Z_OK; /* Only needed more room */
+            }
+        }
+        if (status == Z_BUF_ERROR) {
+            status = Z_OK; /* All input consumed */
+        } else if (status == Z_STREAM_END) {
+            inflateReset(&client->inflater); /* Final block; the next message starts afresh */
+            status = Z_OK;
+        }
+    }
+
+    if (client->server_no_context || status != Z_OK) {
+        inflateReset(&client->inflater);
+    }
+    if (!out || status != Z_OK) {
+        if (out) {
+            anbs_optimize_free(out, capacity);
+        }
+        return NULL;
+    }
+    out[used] = '\0';
+    return out;
+}
+
+/* Set up permessage-deflate from the extensions the server accepted */
+static void websocket_negotiate_deflate(websocket_client_t *client, const char *response) {
+    const char *ext = strcasestr(response, "\r\nSec-WebSocket-Extensions:");
+    const char *end;
+    char params[256];
+    size_t len;
+
+    if (!ext || !strstr(ext, "permessage-deflate")) {
+        return;
+    }
+    ext += 2;
+    end = strstr(ext, "\r\n");
+    len = end ? (size_t)(end - ext) : strlen(ext);
+    if (len >= sizeof(params)) {
+        len = sizeof(params) - 1;
+    }
+    memcpy(params, ext, len);
+    params[len] = '\0';
+
+    if (deflateInit2(&client->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return;
+    }
+    if (inflateInit2(&client->inflater, -15) != Z_OK) {
+        deflateEnd(&client->deflater);
+        return;
+    }
+
+    client->client_no_context = strstr(params, "client_no_context_takeover") != NULL;
+    client->server_no_context = strstr(params, "server_no_context_takeover") != NULL;
+    client->deflate = 1;
+    ANBS_DEBUG_LOG("WebSocket permessage-deflate enabled");
+}
+
+/* Grow *BUFFER so it holds NEEDED bytes plus a spare one */
+static int websocket_reserve(void **buffer, size_t *capacity, size_t needed) {
+    size_t grown = *capacity ? *capacity : WS_BUFFER_SIZE;
+    void *resized;
+
+    if (needed + 1 <= *capacity) {
+        return 0;
+    }
+    while (grown < needed + 1) {
+        grown *= 2;
+    }
+    resized = anbs_optimize_realloc(*buffer, grown);
+    if (!resized) {
+        return -1;
+    }
+    *buffer = resized;
+    *capacity = grown;
+    return 0;
 }
 
 /* WebSocket handshake */
@@ -195,6 +496,7 @@ static int websocket_handshake(websocket_client_t *client) {
         "Connection: Upgrade\r\n"
         "Sec-WebSocket-Key: %s\r\n"
         "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
         "User-Agent: ANBS-WebSocket/1.0\r\n"
         "\r\n",
         client->path, client->host, client->port, key);
@@ -227,6 +529,25 @@ static int websocket_handshake(websocket_client_t *client) {
     snprintf(accept_line, sizeof(accept_line), "Sec-WebSocket-Accept: %s", expected_accept);
 
     int handshake_ok = strstr(response, accept_line) != NULL;
+    if (handshake_ok) {
+        /* Senders queueing while a reconnect is under way check DEFLATE */
+        pthread_mutex_lock(&client->write_mutex);
+        websocket_negotiate_deflate(client, response);
+        pthread_mutex_unlock(&client->write_mutex);
+    }
+
+    /* Frames the server sent right behind its response came in the same
+       read; they are the start of the receive buffer */
+    char *body = strstr(response, "\r\n\r\n");
+    if (handshake_ok && body && (body += 4) < response + bytes_read) {
+        size_t extra = response + bytes_read - body;
+
+        client->rx_len = 0;
+        if (websocket_reserve((void **)&client->rx, &client->rx_capacity, extra) == 0) {
+            memcpy(client->rx, body, extra);
+            client->rx_len = extra;
+        }
+    }
 
     free(key);
     free(expected_accept);
@@ -234,48 +555,725 @@ static int websocket_handshake(websocket_client_t *client) {
     return handshake_ok ? 0 : -1;
 }
 
-/* WebSocket message handler thread */
-static void *websocket_thread(void *arg) {
-    websocket_client_t *client = (websocket_client_t*)arg;
-    unsigned char buffer[WS_BUFFER_SIZE];
-    int bytes_received;
-    char *payload;
+/* Write all LEN bytes at DATA to the non-blocking socket, waiting for
+   room when it is full.  Only the sender flushing the queue calls this. */
+static int websocket_write_all(websocket_client_t *client, const unsigned char *data, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        struct pollfd pfd = { .fd = client->socket_fd, .events = POLLOUT };
+        int result, again;
 
-    while (client->connected) {
-        /* Read WebSocket frame */
         if (client->ssl) {
-            bytes_received = SSL_read(client->ssl, buffer, sizeof(buffer));
+            /* A retry after WANT_WRITE must repeat the same buffer, which
+               it does since DONE hasn't moved */
+            pthread_mutex_lock(&client->ssl_mutex);
+            result = SSL_write(client->ssl, data + done, len - done);
+            if (result <= 0) {
+                int error = SSL_get_error(client->ssl, result);
+
+                again = error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ;
+                if (error == SSL_ERROR_WANT_READ) {
+                    pfd.events = POLLIN;
+                }
+            }
+            pthread_mutex_unlock(&client->ssl_mutex);
         } else {
-            bytes_received = recv(client->socket_fd, buffer, sizeof(buffer), 0);
+            result = send(client->socket_fd, data + done, len - done, MSG_NOSIGNAL);
+            again = result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
         }
 
-        if (bytes_received <= 0) {
-            ANBS_DEBUG_LOG("WebSocket connection lost");
+        if (result > 0) {
+            done += result;
+        } else if (!again || (poll(&pfd, 1, WS_WRITE_TIMEOUT_MS) == 0)) {
+            return -1;
+        }
+    }
+
+    __atomic_add_fetch(&client->wire_bytes_sent, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&client->wire_writes, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Append a frame of OPCODE carrying LEN bytes of PAYLOAD to the send
+   queue, masking the payload straight into it.  Callers hold
+   WRITE_MUTEX. */
+static int websocket_queue_locked(websocket_client_t *client, int opcode, const unsigned char *payload,
+                                  size_t len, int compressed) {
+    /* Client frames must be masked (RFC 6455 5.3) */
+    static const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    unsigned char *out;
+
+    if (websocket_reserve((void **)&client->tx, &client->tx_capacity,
+                          client->tx_len + WS_FRAME_HEADER_MAX + len) != 0) {
+        return -1;
+    }
+
+    out = client->tx + client->tx_len;
+    out += websocket_frame_header(out, opcode, len, compressed, mask);
+    websocket_mask(out, payload, len, mask);
+    client->tx_len = out + len - client->tx;
+    PROBE3(anbs, ws__frame__out, opcode, len, compressed);
+    return 0;
+}
+
+/* Write out the send queue unless another sender already is, in which
+   case that one picks up what was just queued.  Returns -1 if a write
+   this call made failed. */
+static int websocket_flush(websocket_client_t *client) {
+    unsigned char *batch;
+    size_t batch_len, capacity;
+    int status = 0;
+
+    pthread_mutex_lock(&client->write_mutex);
+    if (client->tx_flushing || !client->connected) {
+        /* While the link is down the queue waits for the reconnect */
+        pthread_mutex_unlock(&client->write_mutex);
+        return 0;
+    }
+    client->tx_flushing = 1;
+
+    while (client->tx_len > 0 && status == 0 && client->connected) {
+        /* Take the queue and leave the spare buffer for new frames */
+        batch = client->tx;
+        batch_len = client->tx_len;
+        capacity = client->tx_capacity;
+        client->tx = client->tx_out;
+        client->tx_capacity = client->tx_out_capacity;
+        client->tx_len = 0;
+        client->tx_out = batch;
+        client->tx_out_capacity = capacity;
+        pthread_mutex_unlock(&client->write_mutex);
+
+        status = websocket_write_all(client, batch, batch_len);
+
+        pthread_mutex_lock(&client->write_mutex);
+    }
+
+    /* Frames queued behind a failed write would be cut off mid-stream */
+    if (status != 0) {
+        client->tx_len = 0;
+    }
+    client->tx_flushing = 0;
+    pthread_mutex_unlock(&client->write_mutex);
+    return status;
+}
+
+/* Send a control frame of OPCODE with LEN bytes of PAYLOAD */
+static int websocket_send_control(websocket_client_t *client, int opcode, const unsigned char *payload, size_t len) {
+    int result;
+
+    pthread_mutex_lock(&client->write_mutex);
+    result = websocket_queue_locked(client, opcode, payload, len, 0);
+    pthread_mutex_unlock(&client->write_mutex);
+
+    return result == 0 ? websocket_flush(client) : -1;
+}
+
+/* Close the link with a close frame carrying CODE */
+static void websocket_fail(websocket_client_t *client, int code) {
+    unsigned char status[2] = { (code >> 8) & 0xFF, code & 0xFF };
+
+    ANBS_DEBUG_LOG("Closing WebSocket with status %d", code);
+    websocket_send_control(client, WS_OP_CLOSE, status, sizeof(status));
+    client->connected = 0;
+}
+
+static uint64_t websocket_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void websocket_pending_free(ws_pending_t *entry) {
+    free(entry->message);
+    free(entry);
+}
+
+/* Unlink and return the request with ID, or NULL */
+static ws_pending_t *websocket_pending_take(websocket_client_t *client, uint64_t id) {
+    ws_pending_t **link, *entry = NULL;
+
+    pthread_mutex_lock(&client->pending_mutex);
+    for (link = &client->pending[id & (WS_PENDING_BUCKETS - 1)]; *link; link = &(*link)->next) {
+        if ((*link)->id == id) {
+            entry = *link;
+            *link = entry->next;
+            client->pending_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client->pending_mutex);
+    return entry;
+}
+
+/* Make sure the timer fires by DEADLINE, with PENDING_MUTEX held */
+static void websocket_timer_arm_locked(websocket_client_t *client, uint64_t deadline) {
+    struct itimerspec when = {0};
+
+    if (!deadline || client->timer_fd < 0 ||
+        (client->timer_deadline_ns && client->timer_deadline_ns <= deadline)) {
+        return;
+    }
+    when.it_value.tv_sec = deadline / 1000000000ULL;
+    when.it_value.tv_nsec = deadline % 1000000000ULL;
+    if (timerfd_settime(client->timer_fd, TFD_TIMER_ABSTIME, &when, NULL) == 0) {
+        client->timer_deadline_ns = deadline;
+    }
+}
+
+/* Event loop handler for the request timer: fail the requests whose
+   deadline has passed and rearm for the next one */
+static void websocket_on_timer(int fd, uint32_t events, void *arg) {
+    websocket_client_t *client = (websocket_client_t*)arg;
+    ws_pending_t *expired = NULL, **link, *entry;
+    uint64_t now = websocket_now_ns(), next = 0, ticks;
+    ssize_t ignored = read(fd, &ticks, sizeof(ticks));
+    (void)ignored;
+    (void)events;
+
+    pthread_mutex_lock(&client->pending_mutex);
+    for (int b = 0; b < WS_PENDING_BUCKETS; b++) {
+        for (link = &client->pending[b]; (entry = *link) != NULL; ) {
+            if (entry->deadline_ns && entry->deadline_ns <= now) {
+                *link = entry->next;
+                entry->next = expired;
+                expired = entry;
+                client->pending_count--;
+            } else {
+                if (entry->deadline_ns && (!next || entry->deadline_ns < next)) {
+                    next = entry->deadline_ns;
+                }
+                link = &entry->next;
+            }
+        }
+    }
+    client->timer_deadline_ns = 0;
+    websocket_timer_arm_locked(client, next);
+    pthread_mutex_unlock(&client->pending_mutex);
+
+    while ((entry = expired) != NULL) {
+        expired = entry->next;
+        ANBS_DEBUG_LOG("WebSocket request %llu timed out", (unsigned long long)entry->id);
+        entry->callback(NULL, entry->arg);
+        websocket_pending_free(entry);
+    }
+}
+
+/* Fail every request in flight; the connection they went out on is gone */
+static void websocket_fail_pending(websocket_client_t *client) {
+    ws_pending_t *failed = NULL, *entry;
+
+    pthread_mutex_lock(&client->pending_mutex);
+    for (int b = 0; b < WS_PENDING_BUCKETS; b++) {
+        while ((entry = client->pending[b]) != NULL) {
+            client->pending[b] = entry->next;
+            entry->next = failed;
+            failed = entry;
+        }
+    }
+    client->pending_count = 0;
+    pthread_mutex_unlock(&client->pending_mutex);
+
+    while ((entry = failed) != NULL) {
+        failed = entry->next;
+        entry->callback(NULL, entry->arg);
+        websocket_pending_free(entry);
+    }
+}
+
+/* If TEXT is the reply to a request in flight, complete the request and
+   return 1 */
+static int websocket_complete_request(websocket_client_t *client, const char *text) {
+    json_object *root, *id;
+    ws_pending_t *entry = NULL;
+
+    text += strspn(text, " \t\r\n");
+    if (*text != '{' || !strstr(text, "\"id\"")) {
+        return 0;
+    }
+
+    root = json_tokener_parse(text);
+    if (root && json_object_object_get_ex(root, "id", &id) && json_object_is_type(id, json_type_int)) {
+        entry = websocket_pending_take(client, (uint64_t)json_object_get_int64(id));
+    }
+    json_object_put(root);
+
+    if (!entry) {
+        return 0;
+    }
+    entry->callback(text, entry->arg);
+    websocket_pending_free(entry);
+    return 1;
+}
+
+/* Hand one complete message of LEN bytes at TEXT to the display.  TEXT
+   has a spare byte past its end, borrowed for a terminating NUL. */
+static void websocket_deliver(websocket_client_t *client, char *text, size_t len, int compressed) {
+    char *message = NULL, saved;
+
+    if (compressed) {
+        message = client->deflate ? websocket_inflate(client, (unsigned char *)text, len) : NULL;
+        if (!message) {
+            ANBS_DEBUG_LOG("Dropped a WebSocket message that would not inflate");
+            return;
+        }
+        text = message;
+        len = strlen(message);
+    }
+    saved = text[len];
+    text[len] = '\0';
+
+    __atomic_add_fetch(&client->messages_received, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&client->message_bytes_received, len, __ATOMIC_RELAXED);
+    ANBS_DEBUG_LOG("Received WebSocket message: %s", text);
+
+    /* Handle AI response */
+    if (__atomic_load_n(&client->pending_count, __ATOMIC_RELAXED) > 0 &&
+        websocket_complete_request(client, text)) {
+        /* Its caller has it */
+    } else if (client->display) {
+        char formatted_msg[4096];
+        snprintf(formatted_msg, sizeof(formatted_msg), "🌐 AI: %s\n", text);
+        anbs_ai_chat_write(client->display, formatted_msg);
+        anbs_display_refresh_panel(client->display, ANBS_PANEL_AI_CHAT);
+    }
+
+    text[len] = saved;
+    if (message) {
+        anbs_optimize_free(message, 0);
+    }
+}
+
+/* Act on one complete frame whose unmasked payload is at PAYLOAD.
+   Returns 0, or a close status code when the frame breaks the protocol. */
+static int websocket_handle_frame(websocket_client_t *client, const websocket_frame_t *frame, unsigned char *payload) {
+    size_t len = frame->payload_len;
+
+    PROBE3(anbs, ws__frame__in, frame->opcode, len, frame->compressed);
+    if (frame->reserved || (frame->compressed && !client->deflate)) {
+        return WS_CLOSE_PROTOCOL_ERROR;
+    }
+
+    switch (frame->opcode) {
+    case WS_OP_PING:
+    case WS_OP_PONG:
+    case WS_OP_CLOSE:
+        /* Control frames may come between the fragments of a message */
+        if (!frame->fin || frame->compressed || len > WS_CONTROL_MAX) {
+            return WS_CLOSE_PROTOCOL_ERROR;
+        }
+        if (frame->opcode == WS_OP_PING) {
+            websocket_send_control(client, WS_OP_PONG, payload, len);
+        } else if (frame->opcode == WS_OP_CLOSE) {
+            ANBS_DEBUG_LOG("WebSocket closed by server");
+            websocket_send_control(client, WS_OP_CLOSE, payload, len >= 2 ? 2 : 0);
             client->connected = 0;
+        }
+        return 0;
+
+    case WS_OP_TEXT:
+    case WS_OP_BINARY:
+        if (client->fragment_opcode) {
+            return WS_CLOSE_PROTOCOL_ERROR;
+        }
+        if (frame->fin) {
+            /* The common case: deliver straight from the receive buffer */
+            websocket_deliver(client, (char *)payload, len, frame->compressed);
+            return 0;
+        }
+        client->fragment_opcode = frame->opcode;
+        client->fragment_compressed = frame->compressed;
+        client->fragments_len = 0;
+        break;
+
+    case WS_OP_CONTINUATION:
+        if (!client->fragment_opcode || frame->compressed) {
+            return WS_CLOSE_PROTOCOL_ERROR;
+        }
+        break;
+
+    default:
+        return WS_CLOSE_PROTOCOL_ERROR;
+    }
+
+    if (client->fragments_len + len > WS_MAX_MESSAGE) {
+        return WS_CLOSE_TOO_BIG;
+    }
+    if (websocket_reserve((void **)&client->fragments, &client->fragments_capacity,
+                          client->fragments_len + len) != 0) {
+        return WS_CLOSE_TOO_BIG;
+    }
+    memcpy(client->fragments + client->fragments_len, payload, len);
+    client->fragments_len += len;
+
+    if (frame->fin) {
+        websocket_deliver(client, client->fragments, client->fragments_len, client->fragment_compressed);
+        client->fragment_opcode = 0;
+        client->fragments_len = 0;
+    }
+    return 0;
+}
+
+/* Handle every complete frame in the receive buffer and keep the partial
+   one that may follow, making sure the buffer can hold all of it.
+   Returns 0, or a close status code. */
+static int websocket_process(websocket_client_t *client) {
+    websocket_frame_t frame;
+    size_t offset = 0, needed = 0;
+    int status = 0;
+
+    while (client->connected && parse_websocket_frame(client->rx + offset, client->rx_len - offset, &frame) > 0) {
+        unsigned char *payload;
+
+        if (frame.payload_len > WS_MAX_MESSAGE) {
+            status = WS_CLOSE_TOO_BIG;
+            break;
+        }
+        if (client->rx_len - offset < frame.header_len + frame.payload_len) {
+            needed = frame.header_len + frame.payload_len;
+            break;
+        }
+
+        payload = client->rx + offset + frame.header_len;
+        if (frame.masked) {
+            for (uint64_t i = 0; i < frame.payload_len; i++) {
+                payload[i] ^= frame.mask[i & 3];
+            }
+        }
+        offset += frame.header_len + frame.payload_len;
+
+        status = websocket_handle_frame(client, &frame, payload);
+        if (status != 0) {
             break;
         }
+    }
+
+    if (offset > 0) {
+        memmove(client->rx, client->rx + offset, client->rx_len - offset);
+        client->rx_len -= offset;
+    }
+    if (status == 0 && needed > 0 &&
+        websocket_reserve((void **)&client->rx, &client->rx_capacity, needed) != 0) {
+        status = WS_CLOSE_TOO_BIG;
+    }
+    return status;
+}
 
-        /* Parse frame */
-        if (parse_websocket_frame(buffer, bytes_received, &payload) > 0) {
-            ANBS_DEBUG_LOG("Received WebSocket message: %s", payload);
+/* Close the connection and drop its receive and compression state.
+   Frames queued to send and requests in flight are kept. */
+static void websocket_teardown(websocket_client_t *client) {
+    /* Wait for the event loop to let go of the connection */
+    if (client->socket_fd >= 0) {
+        anbs_event_remove(client->socket_fd);
+    }
 
-            /* Handle AI response */
-            if (client->display) {
-                char formatted_msg[4096];
-                snprintf(formatted_msg, sizeof(formatted_msg), "🌐 AI: %s\n", payload);
-                anbs_ai_chat_write(client->display, formatted_msg);
-                anbs_display_refresh_panel(client->display, ANBS_PANEL_AI_CHAT);
+    /* Close SSL */
+    if (client->ssl) {
+        SSL_shutdown(client->ssl);
+        SSL_free(client->ssl);
+        client->ssl = NULL;
+    }
+
+    /* Close socket */
+    if (client->socket_fd >= 0) {
+        close(client->socket_fd);
+        client->socket_fd = -1;
+    }
+
+    pthread_mutex_lock(&client->write_mutex);
+    if (client->deflate) {
+        deflateEnd(&client->deflater);
+        inflateEnd(&client->inflater);
+        client->deflate = 0;
+    }
+    pthread_mutex_unlock(&client->write_mutex);
+
+    /* The next connection starts with no partial frame or message */
+    anbs_optimize_free(client->rx, client->rx_capacity);
+    anbs_optimize_free(client->fragments, client->fragments_capacity);
+    client->rx = NULL;
+    client->fragments = NULL;
+    client->rx_len = client->rx_capacity = 0;
+    client->fragments_len = client->fragments_capacity = 0;
+    client->fragment_opcode = 0;
+}
+
+static void websocket_on_event(int fd, uint32_t events, void *arg);
+
+/* Dial, secure and upgrade a connection and hand it to the event loop */
+static int websocket_open(websocket_client_t *client) {
+    struct sockaddr_in server_addr;
+    struct hostent *server;
+    struct timeval dial_timeout = { .tv_sec = WS_DIAL_TIMEOUT_S };
+
+    /* Create socket */
+    client->socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->socket_fd < 0) {
+        return -1;
+    }
+
+    /* A server that accepts but never answers mustn't hang the redial
+       or a disconnect waiting for it */
+    setsockopt(client->socket_fd, SOL_SOCKET, SO_RCVTIMEO, &dial_timeout, sizeof(dial_timeout));
+    setsockopt(client->socket_fd, SOL_SOCKET, SO_SNDTIMEO, &dial_timeout, sizeof(dial_timeout));
+
+    /* Resolve hostname */
+    server = gethostbyname(client->host);
+    if (!server) {
+        websocket_teardown(client);
+        return -1;
+    }
+
+    /* Connect to server */
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(client->port);
+    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+
+    if (connect(client->socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        websocket_teardown(client);
+        return -1;
+    }
+
+    /* Set up SSL if needed */
+    if (client->ssl_ctx) {
+        client->ssl = SSL_new(client->ssl_ctx);
+        SSL_set_fd(client->ssl, client->socket_fd);
+
+        if (SSL_connect(client->ssl) <= 0) {
+            ERR_print_errors_fp(stderr);
+            websocket_teardown(client);
+            return -1;
+        }
+    }
+
+    /* Perform WebSocket handshake */
+    if (websocket_handshake(client) != 0) {
+        websocket_teardown(client);
+        return -1;
+    }
+
+    client->connected = 1;
+    __atomic_add_fetch(&client->connects, 1, __ATOMIC_RELAXED);
+
+    /* From here the event loop reads as data arrives, and sends wait in
+       poll() when the socket is full */
+    fcntl(client->socket_fd, F_SETFL, fcntl(client->socket_fd, F_GETFL) | O_NONBLOCK);
+
+    /* Frames that arrived with the handshake response go first */
+    int status = client->rx_len > 0 ? websocket_process(client) : 0;
+    if (status != 0) {
+        websocket_fail(client, status);
+    }
+    if (!client->connected ||
+        anbs_event_add(client->socket_fd, EPOLLIN, websocket_on_event, client) != 0) {
+        client->connected = 0;
+        websocket_teardown(client);
+        return -1;
+    }
+
+    ANBS_DEBUG_LOG("WebSocket connected to %s:%d%s", client->host, client->port, client->path);
+    return 0;
+}
+
+/* Mark the next request not yet sent on this connection as sent and
+   return a copy of its message, or NULL */
+static char *websocket_pending_claim(websocket_client_t *client, uint64_t id) {
+    char *message = NULL;
+
+    pthread_mutex_lock(&client->pending_mutex);
+    for (int b = 0; b < WS_PENDING_BUCKETS && !message && client->connected; b++) {
+        for (ws_pending_t *entry = client->pending[b]; entry; entry = entry->next) {
+            if (!entry->sent && (!id || entry->id == id)) {
+                entry->sent = 1;
+                message = strdup(entry->message);
+                break;
             }
+        }
+    }
+    pthread_mutex_unlock(&client->pending_mutex);
+    return message;
+}
+
+static int websocket_send_message(websocket_client_t *client, const char *message, int may_queue);
+
+/* On a fresh connection, send again the requests the last one took down
+   with it, then whatever queued while redialling */
+static void websocket_resume(websocket_client_t *client) {
+    char *message;
 
-            free(payload);
+    while ((message = websocket_pending_claim(client, 0)) != NULL) {
+        websocket_send_message(client, message, 0);
+        free(message);
+    }
+    websocket_flush(client);
+}
+
+/* Redial until a connection is up or the client is closing.  The delay
+   doubles per failure up to RECONNECT_MAX_MS; each wait takes half of it
+   plus a random part of the other half, so shells that lost the same
+   server don't all come back at once. */
+static void *websocket_reconnect_thread(void *arg) {
+    websocket_client_t *client = (websocket_client_t*)arg;
+    uint64_t seed = websocket_now_ns() ^ ((uint64_t)getpid() << 32);
+    int delay_ms = WS_RECONNECT_BASE_MS, opened = 0;
+    struct timespec until;
+
+    anbs_thread_name("anbs-ws-reconn");
+    pthread_mutex_lock(&client->reconnect_mutex);
+    while (!client->closing) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        uint64_t wait_ns = ((uint64_t)delay_ms / 2 + seed % ((uint64_t)delay_ms / 2 + 1)) * 1000000ULL;
+
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        wait_ns += (uint64_t)until.tv_nsec;
+        until.tv_sec += wait_ns / 1000000000ULL;
+        until.tv_nsec = wait_ns % 1000000000ULL;
+        while (!client->closing &&
+               pthread_cond_timedwait(&client->reconnect_cond, &client->reconnect_mutex, &until) == 0) {
+            /* Woken early; the loop rechecks CLOSING */
+        }
+        if (client->closing) {
+            break;
         }
+        pthread_mutex_unlock(&client->reconnect_mutex);
 
-        usleep(10000); /* 10ms delay */
+        websocket_teardown(client);
+        opened = websocket_open(client) == 0;
+
+        pthread_mutex_lock(&client->reconnect_mutex);
+        if (opened && client->connected) {
+            break;
+        }
+        opened = 0;
+        ANBS_DEBUG_LOG("WebSocket reconnect failed, next try within %d ms", delay_ms);
+        delay_ms = delay_ms >= client->reconnect_max_ms / 2 ? client->reconnect_max_ms : delay_ms * 2;
     }
+    __atomic_store_n(&client->reconnecting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&client->reconnect_mutex);
 
+    if (opened) {
+        websocket_resume(client);
+    }
     return NULL;
 }
 
+/* The connection dropped by itself.  Called on the event loop thread. */
+static void websocket_connection_lost(websocket_client_t *client) {
+    int redial;
+
+    /* Frames queued for the old connection may be compressed with its
+       deflate context, which dies with it */
+    pthread_mutex_lock(&client->write_mutex);
+    if (client->deflate) {
+        deflateEnd(&client->deflater);
+        inflateEnd(&client->inflater);
+        client->deflate = 0;
+    }
+    client->tx_len = 0;
+    pthread_mutex_unlock(&client->write_mutex);
+
+    pthread_mutex_lock(&client->reconnect_mutex);
+    redial = client->reconnect_enabled && !client->closing;
+    if (redial && !client->reconnecting) {
+        /* A finished redialler no longer takes the mutex, so it can be
+           reaped while holding it */
+        if (client->reconnect_started) {
+            pthread_join(client->reconnect_thread, NULL);
+        }
+        __atomic_store_n(&client->reconnecting, 1, __ATOMIC_RELAXED);
+        client->reconnect_started =
+            pthread_create(&client->reconnect_thread, NULL, websocket_reconnect_thread, client) == 0;
+        if (!client->reconnect_started) {
+            __atomic_store_n(&client->reconnecting, 0, __ATOMIC_RELAXED);
+            redial = 0;
+        }
+    }
+    pthread_mutex_unlock(&client->reconnect_mutex);
+
+    if (!redial) {
+        if (!client->closing) {
+            websocket_fail_pending(client);
+        }
+        return;
+    }
+
+    ANBS_DEBUG_LOG("WebSocket reconnecting to %s:%d", client->host, client->port);
+
+    /* Requests in flight go out again on the next connection */
+    pthread_mutex_lock(&client->pending_mutex);
+    for (int b = 0; b < WS_PENDING_BUCKETS; b++) {
+        for (ws_pending_t *entry = client->pending[b]; entry; entry = entry->next) {
+            entry->sent = 0;
+        }
+    }
+    pthread_mutex_unlock(&client->pending_mutex);
+}
+
+/* Event loop handler for the connection: read everything the socket
+   has into the receive buffer, which grows to fit the largest frame, and
+   handle each frame as soon as it is complete.  Frames split across reads
+   and several frames in one read are both parsed whole. */
+static void websocket_on_event(int fd, uint32_t events, void *arg) {
+    websocket_client_t *client = (websocket_client_t*)arg;
+    int bytes_received, status, lost = 0;
+    (void)events;
+
+    while (client->connected) {
+        if (websocket_reserve((void **)&client->rx, &client->rx_capacity, client->rx_len + WS_BUFFER_SIZE) != 0) {
+            websocket_fail(client, WS_CLOSE_TOO_BIG);
+            break;
+        }
+
+        /* Leave the spare byte free */
+        if (client->ssl) {
+            pthread_mutex_lock(&client->ssl_mutex);
+            bytes_received = SSL_read(client->ssl, client->rx + client->rx_len,
+                                      client->rx_capacity - client->rx_len - 1);
+            if (bytes_received <= 0) {
+                int error = SSL_get_error(client->ssl, bytes_received);
+                lost = error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE;
+            }
+            pthread_mutex_unlock(&client->ssl_mutex);
+        } else {
+            bytes_received = recv(fd, client->rx + client->rx_len,
+                                  client->rx_capacity - client->rx_len - 1, 0);
+            if (bytes_received < 0) {
+                lost = errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+            } else if (bytes_received == 0) {
+                lost = 1;
+            }
+        }
+
+        if (bytes_received <= 0) {
+            if (lost) {
+                ANBS_DEBUG_LOG("WebSocket connection lost");
+                client->connected = 0;
+            }
+            break;
+        }
+        __atomic_add_fetch(&client->wire_bytes_received, bytes_received, __ATOMIC_RELAXED);
+        client->rx_len += bytes_received;
+
+        status = websocket_process(client);
+        if (status != 0) {
+            websocket_fail(client, status);
+            break;
+        }
+    }
+
+    /* The socket stays open until it is torn down for a redial or by
+       anbs_websocket_disconnect() */
+    if (!client->connected) {
+        anbs_event_remove(fd);
+        websocket_connection_lost(client);
+    }
+}
+
 /* Initialize WebSocket client */
 int anbs_websocket_init(anbs_display_t *display, const char *host, int port, const char *path, int use_ssl) {
     if (g_ws_client) {
@@ -293,6 +1291,39 @@ int anbs_websocket_init(anbs_display_t *display, const char *host, int port, con
     g_ws_client->display = display;
 
     pthread_mutex_init(&g_ws_client->write_mutex, NULL);
+    pthread_mutex_init(&g_ws_client->ssl_mutex, NULL);
+    pthread_mutex_init(&g_ws_client->pending_mutex, NULL);
+    g_ws_client->socket_fd = -1;
+
+    /* Redial delays are measured on the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&g_ws_client->reconnect_mutex, NULL);
+    pthread_cond_init(&g_ws_client->reconnect_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    const char *reconnect = getenv("ANBS_WS_RECONNECT");
+    const char *reconnect_max = getenv("ANBS_WS_RECONNECT_MAX_MS");
+    g_ws_client->reconnect_enabled = !(reconnect && strcmp(reconnect, "0") == 0);
+    g_ws_client->reconnect_max_ms = reconnect_max ? atoi(reconnect_max) : WS_RECONNECT_MAX_MS;
+    if (g_ws_client->reconnect_max_ms < WS_RECONNECT_BASE_MS) {
+        g_ws_client->reconnect_max_ms = WS_RECONNECT_BASE_MS;
+    }
+
+    /* Request deadlines; without the timer requests wait indefinitely */
+    g_ws_client->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_ws_client->timer_fd >= 0 &&
+        anbs_event_add(g_ws_client->timer_fd, EPOLLIN, websocket_on_timer, g_ws_client) != 0) {
+        close(g_ws_client->timer_fd);
+        g_ws_client->timer_fd = -1;
+    }
+
+    /* Room for a burst of small messages before the queue has to grow */
+    g_ws_client->tx = anbs_optimize_malloc(WS_TX_INITIAL);
+    g_ws_client->tx_out = anbs_optimize_malloc(WS_TX_INITIAL);
+    g_ws_client->tx_capacity = g_ws_client->tx ? WS_TX_INITIAL : 0;
+    g_ws_client->tx_out_capacity = g_ws_client->tx_out ? WS_TX_INITIAL : 0;
 
     /* Initialize SSL if needed */
     if (use_ssl) {
@@ -316,116 +1347,215 @@ int anbs_websocket_connect(void) {
     if (!g_ws_client) {
         return -1;
     }
-
-    struct sockaddr_in server_addr;
-    struct hostent *server;
-
-    /* Create socket */
-    g_ws_client->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (g_ws_client->socket_fd < 0) {
-        return -1;
+    if (g_ws_client->connected) {
+        return 0;
     }
 
-    /* Resolve hostname */
-    server = gethostbyname(g_ws_client->host);
-    if (!server) {
-        close(g_ws_client->socket_fd);
+    /* While a redial is under way the reconnect thread owns the link */
+    if (__atomic_load_n(&g_ws_client->reconnecting, __ATOMIC_RELAXED) || websocket_open(g_ws_client) != 0) {
         return -1;
     }
 
-    /* Connect to server */
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(g_ws_client->port);
-    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    websocket_resume(g_ws_client);
+    return 0;
+}
+
+/* Queue MESSAGE as a text frame and write the queue out.  While a
+   reconnect is under way the frame waits in the queue if MAY_QUEUE. */
+static int websocket_send_message(websocket_client_t *client, const char *message, int may_queue) {
+    unsigned char *deflated = NULL;
+    size_t message_len = strlen(message), deflated_len = 0;
+    int status;
 
-    if (connect(g_ws_client->socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        close(g_ws_client->socket_fd);
+    if (!client->connected &&
+        (!may_queue || !__atomic_load_n(&client->reconnecting, __ATOMIC_RELAXED))) {
         return -1;
     }
 
-    /* Set up SSL if needed */
-    if (g_ws_client->ssl_ctx) {
-        g_ws_client->ssl = SSL_new(g_ws_client->ssl_ctx);
-        SSL_set_fd(g_ws_client->ssl, g_ws_client->socket_fd);
-
-        if (SSL_connect(g_ws_client->ssl) <= 0) {
-            ERR_print_errors_fp(stderr);
-            close(g_ws_client->socket_fd);
-            return -1;
+    /* Deflate and queue together, so frames leave in the order the
+       deflate context saw them */
+    pthread_mutex_lock(&client->write_mutex);
+    if (!client->connected && client->tx_len + WS_FRAME_HEADER_MAX + message_len > WS_RECONNECT_QUEUE_MAX) {
+        status = -1;
+    } else {
+        if (client->deflate && message_len >= WS_DEFLATE_MIN) {
+            deflated = websocket_deflate(client, message, message_len, &deflated_len);
+        }
+        if (deflated && deflated_len < message_len) {
+            status = websocket_queue_locked(client, WS_OP_TEXT, deflated, deflated_len, 1);
+        } else {
+            status = websocket_queue_locked(client, WS_OP_TEXT, (const unsigned char *)message, message_len, 0);
         }
     }
+    pthread_mutex_unlock(&client->write_mutex);
 
-    /* Perform WebSocket handshake */
-    if (websocket_handshake(g_ws_client) != 0) {
-        anbs_websocket_disconnect();
-        return -1;
+    if (deflated) {
+        anbs_optimize_free(deflated, 0);
     }
-
-    g_ws_client->connected = 1;
-
-    /* Start message handler thread */
-    if (pthread_create(&g_ws_client->thread, NULL, websocket_thread, g_ws_client) != 0) {
-        anbs_websocket_disconnect();
+    if (status != 0) {
         return -1;
     }
 
-    ANBS_DEBUG_LOG("WebSocket connected to %s:%d%s", g_ws_client->host, g_ws_client->port, g_ws_client->path);
-    return 0;
+    __atomic_add_fetch(&client->messages_sent, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&client->message_bytes_sent, message_len, __ATOMIC_RELAXED);
+    return websocket_flush(client);
 }
 
-/* Send message via WebSocket */
+/* Send message via WebSocket.  While the client is reconnecting the
+   message is held and sent once the link is back. */
 int anbs_websocket_send(const char *message) {
-    if (!g_ws_client || !g_ws_client->connected) {
+    if (!g_ws_client || !message) {
         return -1;
     }
 
-    pthread_mutex_lock(&g_ws_client->write_mutex);
+    return websocket_send_message(g_ws_client, message, 1);
+}
+
+/* Send REQUEST, a JSON object, with an ID added and call CALLBACK on the
+   event loop thread with the reply carrying that ID, or with NULL if none
+   comes within TIMEOUT_MS (0 waits indefinitely) or the client
+   disconnects.  Many requests may be in flight at once, and a request
+   survives a reconnect: it is sent again on the new connection.  Returns
+   the request ID, or 0 if it could not be sent, in which case CALLBACK is
+   never called. */
+uint64_t anbs_websocket_request(const char *request, int timeout_ms,
+                                void (*callback)(const char *reply, void *arg), void *arg) {
+    websocket_client_t *client = g_ws_client;
+    ws_pending_t *entry, **bucket;
+    char *message;
+    size_t len;
+    const char *body;
+    uint64_t id;
+
+    if (!client || !request || !callback ||
+        (!client->connected && !__atomic_load_n(&client->reconnecting, __ATOMIC_RELAXED))) {
+        return 0;
+    }
+    body = request + strspn(request, " \t\r\n");
+    if (*body++ != '{') {
+        return 0;
+    }
+    body += strspn(body, " \t\r\n");
+
+    entry = calloc(1, sizeof(ws_pending_t));
+    len = strlen(body) + 32;
+    message = malloc(len);
+    if (!entry || !message) {
+        free(entry);
+        free(message);
+        return 0;
+    }
+    id = entry->id = __atomic_add_fetch(&client->next_request_id, 1, __ATOMIC_RELAXED);
+    entry->deadline_ns = timeout_ms > 0 ? websocket_now_ns() + (uint64_t)timeout_ms * 1000000ULL : 0;
+    entry->callback = callback;
+    entry->arg = arg;
+    snprintf(message, len, "{\"id\":%llu%s%s", (unsigned long long)id, *body == '}' ? "" : ",", body);
+    entry->message = message;
+
+    /* In the table before it is sent, since the reply can beat us back */
+    pthread_mutex_lock(&client->pending_mutex);
+    bucket = &client->pending[id & (WS_PENDING_BUCKETS - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    client->pending_count++;
+    websocket_timer_arm_locked(client, entry->deadline_ns);
+    pthread_mutex_unlock(&client->pending_mutex);
+
+    /* If the link is down the reconnect sends it */
+    message = websocket_pending_claim(client, id);
+    if (message) {
+        if (websocket_send_message(client, message, 0) != 0 && client->connected &&
+            (entry = websocket_pending_take(client, id)) != NULL) {
+            websocket_pending_free(entry);
+            id = 0;
+        }
+        free(message);
+    }
+    return id;
+}
 
-    unsigned char *frame;
-    size_t frame_len;
+/* Forget request ID.  Returns 0 if its callback will not be called, -1 if
+   it has run or is running. */
+int anbs_websocket_cancel(uint64_t id) {
+    ws_pending_t *entry;
 
-    if (create_websocket_frame(message, &frame, &frame_len) != 0) {
-        pthread_mutex_unlock(&g_ws_client->write_mutex);
+    if (!g_ws_client || !(entry = websocket_pending_take(g_ws_client, id))) {
         return -1;
     }
+    websocket_pending_free(entry);
+    return 0;
+}
 
-    int result;
-    if (g_ws_client->ssl) {
-        result = SSL_write(g_ws_client->ssl, frame, frame_len);
-    } else {
-        result = send(g_ws_client->socket_fd, frame, frame_len, 0);
-    }
+/* Complete the future in ARG */
+static void websocket_future_complete(const char *reply, void *arg) {
+    ws_future_t *future = arg;
 
-    free(frame);
-    pthread_mutex_unlock(&g_ws_client->write_mutex);
+    pthread_mutex_lock(&future->mutex);
+    future->reply = reply ? strdup(reply) : NULL;
+    future->done = 1;
+    pthread_cond_signal(&future->cond);
+    pthread_mutex_unlock(&future->mutex);
+}
+
+/* Send REQUEST and wait up to TIMEOUT_MS for its reply, which is stored
+   in *REPLY for the caller to free.  Returns 0, or -1 on failure or
+   timeout. */
+int anbs_websocket_request_wait(const char *request, int timeout_ms, char **reply) {
+    ws_future_t future = { .done = 0, .reply = NULL };
+
+    *reply = NULL;
+    pthread_mutex_init(&future.mutex, NULL);
+    pthread_cond_init(&future.cond, NULL);
+
+    if (anbs_websocket_request(request, timeout_ms, websocket_future_complete, &future) != 0) {
+        /* The timer or a disconnect completes it if the reply never comes */
+        pthread_mutex_lock(&future.mutex);
+        while (!future.done) {
+            pthread_cond_wait(&future.cond, &future.mutex);
+        }
+        pthread_mutex_unlock(&future.mutex);
+    }
 
-    return result > 0 ? 0 : -1;
+    pthread_cond_destroy(&future.cond);
+    pthread_mutex_destroy(&future.mutex);
+    *reply = future.reply;
+    return *reply ? 0 : -1;
 }
 
-/* Disconnect WebSocket */
+/* Disconnect WebSocket.  Nothing redials afterwards; queued sends are
+   dropped and requests in flight fail. */
 void anbs_websocket_disconnect(void) {
+    pthread_t redialler;
+    int joinable;
+
     if (!g_ws_client) {
         return;
     }
 
+    /* Stop any redial first, or it could bring the link back */
+    pthread_mutex_lock(&g_ws_client->reconnect_mutex);
+    g_ws_client->closing = 1;
+    pthread_cond_broadcast(&g_ws_client->reconnect_cond);
+    joinable = g_ws_client->reconnect_started;
+    redialler = g_ws_client->reconnect_thread;
+    g_ws_client->reconnect_started = 0;
+    pthread_mutex_unlock(&g_ws_client->reconnect_mutex);
+    if (joinable) {
+        pthread_join(redialler, NULL);
+    }
+
     g_ws_client->connected = 0;
+    websocket_teardown(g_ws_client);
 
-    /* Wait for thread to finish */
-    if (g_ws_client->thread) {
-        pthread_join(g_ws_client->thread, NULL);
-    }
+    pthread_mutex_lock(&g_ws_client->write_mutex);
+    g_ws_client->tx_len = 0;
+    pthread_mutex_unlock(&g_ws_client->write_mutex);
 
-    /* Close SSL */
-    if (g_ws_client->ssl) {
-        SSL_shutdown(g_ws_client->ssl);
-        SSL_free(g_ws_client->ssl);
-    }
+    websocket_fail_pending(g_ws_client);
 
-    /* Close socket */
-    if (g_ws_client->socket_fd >= 0) {
-        close(g_ws_client->socket_fd);
-    }
+    pthread_mutex_lock(&g_ws_client->reconnect_mutex);
+    g_ws_client->closing = 0;
+    pthread_mutex_unlock(&g_ws_client->reconnect_mutex);
 }
 
 /* Cleanup WebSocket client */
@@ -436,6 +1566,11 @@ void anbs_websocket_cleanup(void) {
 
     anbs_websocket_disconnect();
 
+    if (g_ws_client->timer_fd >= 0) {
+        anbs_event_remove(g_ws_client->timer_fd);
+        close(g_ws_client->timer_fd);
+    }
+
     if (g_ws_client->ssl_ctx) {
         SSL_CTX_free(g_ws_client->ssl_ctx);
     }
@@ -448,7 +1583,13 @@ void anbs_websocket_cleanup(void) {
         free(g_ws_client->path);
     }
 
+    anbs_optimize_free(g_ws_client->tx, g_ws_client->tx_capacity);
+    anbs_optimize_free(g_ws_client->tx_out, g_ws_client->tx_out_capacity);
     pthread_mutex_destroy(&g_ws_client->write_mutex);
+    pthread_mutex_destroy(&g_ws_client->ssl_mutex);
+    pthread_mutex_destroy(&g_ws_client->pending_mutex);
+    pthread_mutex_destroy(&g_ws_client->reconnect_mutex);
+    pthread_cond_destroy(&g_ws_client->reconnect_cond);
 
     free(g_ws_client);
     g_ws_client = NULL;
@@ -459,25 +1600,49 @@ int anbs_websocket_is_connected(void) {
     return g_ws_client && g_ws_client->connected;
 }
 
-/* Send ping frame */
-int anbs_websocket_ping(void) {
-    if (!g_ws_client || !g_ws_client->connected) {
+/* Write the WebSocket client's OpenMetrics families to OUT */
+int anbs_websocket_export_metrics(FILE *out) {
+    websocket_client_t *client = g_ws_client;
+
+    if (!client || !out) {
         return -1;
     }
 
-    /* Create ping frame (opcode 0x9) */
-    unsigned char ping_frame[] = {0x89, 0x80, 0x12, 0x34, 0x56, 0x78}; /* Masked ping */
-
-    pthread_mutex_lock(&g_ws_client->write_mutex);
+    anbs_metrics_export_family(out, "anbs_websocket_connected", "gauge", "Whether the WebSocket link is up");
+    anbs_metrics_export_sample(out, "anbs_websocket_connected", NULL, client->connected ? 1 : 0);
+    anbs_metrics_export_family(out, "anbs_websocket_connects", "counter", "WebSocket connections established");
+    anbs_metrics_export_sample(out, "anbs_websocket_connects_total", NULL,
+                               (double)__atomic_load_n(&client->connects, __ATOMIC_RELAXED));
+
+    anbs_metrics_export_family(out, "anbs_websocket_messages", "counter", "WebSocket messages, by direction");
+    anbs_metrics_export_sample(out, "anbs_websocket_messages_total", "direction=\"sent\"",
+                               (double)__atomic_load_n(&client->messages_sent, __ATOMIC_RELAXED));
+    anbs_metrics_export_sample(out, "anbs_websocket_messages_total", "direction=\"received\"",
+                               (double)__atomic_load_n(&client->messages_received, __ATOMIC_RELAXED));
+
+    anbs_metrics_export_family(out, "anbs_websocket_bytes", "counter",
+                               "WebSocket bytes, by direction; layer message is before compression");
+    anbs_metrics_export_sample(out, "anbs_websocket_bytes_total", "direction=\"sent\",layer=\"message\"",
+                               (double)__atomic_load_n(&client->message_bytes_sent, __ATOMIC_RELAXED));
+    anbs_metrics_export_sample(out, "anbs_websocket_bytes_total", "direction=\"sent\",layer=\"wire\"",
+                               (double)__atomic_load_n(&client->wire_bytes_sent, __ATOMIC_RELAXED));
+    anbs_metrics_export_sample(out, "anbs_websocket_bytes_total", "direction=\"received\",layer=\"message\"",
+                               (double)__atomic_load_n(&client->message_bytes_received, __ATOMIC_RELAXED));
+    anbs_metrics_export_sample(out, "anbs_websocket_bytes_total", "direction=\"received\",layer=\"wire\"",
+                               (double)__atomic_load_n(&client->wire_bytes_received, __ATOMIC_RELAXED));
+
+    anbs_metrics_export_family(out, "anbs_websocket_writes", "counter",
+                               "Socket writes carrying queued WebSocket frames");
+    anbs_metrics_export_sample(out, "anbs_websocket_writes_total", NULL,
+                               (double)__atomic_load_n(&client->wire_writes, __ATOMIC_RELAXED));
+    return 0;
+}
 
-    int result;
-    if (g_ws_client->ssl) {
-        result = SSL_write(g_ws_client->ssl, ping_frame, sizeof(ping_frame));
-    } else {
-        result = send(g_ws_client->socket_fd, ping_frame, sizeof(ping_frame), 0);
+/* Send ping frame */
+int anbs_websocket_ping(void) {
+    if (!g_ws_client || !g_ws_client->connected) {
+        return -1;
     }
 
-    pthread_mutex_unlock(&g_ws_client->write_mutex);
-
-    return result > 0 ? 0 : -1;
-}
\ No newline at end of file
+    return websocket_send_control(g_ws_client, WS_OP_PING, NULL, 0);
+}
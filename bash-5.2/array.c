@@ -77,6 +77,311 @@ static char *spacesep = " ";
 #define SET_LASTREF(a, e)	a->lastref = (e)
 #define UNSET_LASTREF(a)	a->lastref = 0;
 
+/*
+ * The element list is the array: everything walks it in index order.  A
+ * big array whose indices are mostly contiguous (what mapfile and
+ * a=( ... ) produce) also gets a direct index, DENSE, so a[i] anywhere
+ * is found without walking from LASTREF.  The index is built the first
+ * time a lookup needs it, kept up to date by insertions and removals,
+ * and dropped when the array gets too sparse for it to pay or when its
+ * indices are renumbered; a sparse array is left to the list and LASTREF.
+ */
+#define DENSE_MIN_ELEMENTS	64
+
+/* Build an index for A when at least half of its index range is set... */
+#define DENSE_WORTHWHILE(a) \
+	((a)->num_elements >= DENSE_MIN_ELEMENTS && \
+	 (a)->num_elements >= (array_max_index(a) - array_first_index(a) + 1) / 2)
+
+/* ...and keep one that covers N slots while at least a quarter is set */
+#define DENSE_KEEP(a, n)	((a)->num_elements >= (n) / 4)
+
+#define DENSE_SLOT(a, i)	((a)->dense[(i) - (a)->dense_base])
+#define DENSE_COVERS(a, i) \
+	((a)->dense && (i) >= (a)->dense_base && (i) - (a)->dense_base < (a)->dense_size)
+
+static int array_dense_build PARAMS((ARRAY *));
+static int array_dense_grow PARAMS((ARRAY *, arrayind_t));
+static int array_dense_lookup PARAMS((ARRAY *, arrayind_t, ARRAY_ELEMENT **));
+
+void
+array_dense_invalidate(a)
+ARRAY	*a;
+{
+	if (a->dense) {
+		free(a->dense);
+		a->dense = (ARRAY_ELEMENT **)NULL;
+	}
+	a->dense_base = a->dense_size = 0;
+}
+
+/*
+ * Index A's elements, if it's dense enough.  Returns 1 if A has an index.
+ */
+static int
+array_dense_build(a)
+ARRAY	*a;
+{
+	ARRAY_ELEMENT	*ae;
+	arrayind_t	span;
+
+	if (a->dense)
+		return 1;
+	if (array_empty(a) || DENSE_WORTHWHILE(a) == 0)
+		return 0;
+
+	span = array_max_index(a) - array_first_index(a) + 1;
+	a->dense_base = array_first_index(a);
+	a->dense_size = span + span / 4;	/* room for appends */
+	a->dense = (ARRAY_ELEMENT **)xmalloc(a->dense_size * sizeof(ARRAY_ELEMENT *));
+	memset(a->dense, 0, a->dense_size * sizeof(ARRAY_ELEMENT *));
+	for (ae = element_forw(a->head); ae != a->head; ae = element_forw(ae))
+		DENSE_SLOT(a, element_index(ae)) = ae;
+	return 1;
+}
+
+/*
+ * Make A's index reach index I past its end, or drop the index if the
+ * array would be too sparse for it.  Returns 1 if A still has an index.
+ */
+static int
+array_dense_grow(a, i)
+ARRAY	*a;
+arrayind_t	i;
+{
+	arrayind_t	need, nsize;
+
+	need = i - a->dense_base + 1;
+	if (need <= a->dense_size)
+		return 1;
+	if (DENSE_KEEP(a, need) == 0) {
+		array_dense_invalidate(a);
+		return 0;
+	}
+	nsize = a->dense_size * 2;
+	if (nsize < need)
+		nsize = need;
+	a->dense = (ARRAY_ELEMENT **)xrealloc(a->dense, nsize * sizeof(ARRAY_ELEMENT *));
+	memset(a->dense + a->dense_size, 0, (nsize - a->dense_size) * sizeof(ARRAY_ELEMENT *));
+	a->dense_size = nsize;
+	return 1;
+}
+
+/*
+ * Look up index I, which is between A's first and last indices, in A's
+ * index, building it if worthwhile.  Returns 0 if A has no usable index,
+ * and the caller should search the list; otherwise 1, with the element,
+ * or NULL if I is unset, in *AEP.
+ */
+static int
+array_dense_lookup(a, i, aep)
+ARRAY	*a;
+arrayind_t	i;
+ARRAY_ELEMENT	**aep;
+{
+	ARRAY_ELEMENT	*ae;
+
+	if (a->dense == 0 && array_dense_build(a) == 0)
+		return 0;
+	if (DENSE_COVERS(a, i) == 0) {
+		array_dense_invalidate(a);	/* shouldn't happen */
+		return 0;
+	}
+	ae = DENSE_SLOT(a, i);
+	if (ae && element_index(ae) != i) {
+		array_dense_invalidate(a);	/* renumbered behind our back */
+		return 0;
+	}
+	*aep = ae;
+	return 1;
+}
+
+/*
+ * Filling a big array -- mapfile, a=( ... ), a+=(x) in a loop -- would
+ * otherwise cost two mallocs per element and two frees to get rid of
+ * it.  Once an array reaches ARENA_MIN_ELEMENTS, the elements appended
+ * to it and their values are carved out of chunks belonging to the array,
+ * which array_flush() frees all at once.  An element that's removed, or
+ * a value that's replaced, is counted as released and the new value
+ * comes from malloc; when most of an arena has been released it gets no
+ * more allocations, and it's freed as soon as nothing in it is in use.
+ * Elements are never handed out of the array still in its arena.
+ */
+#define ARENA_MIN_ELEMENTS	256
+#define ARENA_CHUNK_MIN		(16 * 1024)
+#define ARENA_CHUNK_MAX		(1024 * 1024)
+#define ARENA_VALUE_MAX		1024	/* longer values get their own malloc */
+#define ARENA_ALIGN		sizeof(arrayind_t)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	arrayind_t	data[1];	/* for alignment; the chunk goes on */
+};
+
+struct array_arena {
+	struct arena_chunk *chunks;
+	char	*free;			/* unused part of the newest chunk */
+	size_t	avail;
+	size_t	chunk_size;		/* size of the next chunk */
+	size_t	allocated;		/* bytes handed out... */
+	size_t	released;		/* ...and no longer in use */
+	int	retired;		/* mostly released; allocate no more */
+};
+
+#define ARENA_WANTED(a, i) \
+	((i) > array_max_index(a) && (a)->num_elements >= ARENA_MIN_ELEMENTS && \
+	 ((a)->arena == 0 || (a)->arena->retired == 0))
+
+static void *arena_alloc PARAMS((ARRAY *, size_t, int));
+static void arena_release PARAMS((ARRAY *, size_t));
+static void arena_dispose PARAMS((ARRAY *));
+static ARRAY_ELEMENT *arena_create_element PARAMS((ARRAY *, arrayind_t, char *));
+static void array_free_value PARAMS((ARRAY *, ARRAY_ELEMENT *));
+static void array_free_element PARAMS((ARRAY *, ARRAY_ELEMENT *));
+static ARRAY_ELEMENT *array_detach_element PARAMS((ARRAY *, ARRAY_ELEMENT *));
+static ARRAY_ELEMENT *array_detach_list PARAMS((ARRAY *, ARRAY_ELEMENT *));
+
+static void *
+arena_alloc(a, n, align)
+ARRAY	*a;
+size_t	n;
+int	align;
+{
+	struct array_arena *ar;
+	struct arena_chunk *c;
+	size_t	pad, size;
+	void	*r;
+
+	if ((ar = a->arena) == 0) {
+		ar = a->arena = (struct array_arena *)xmalloc(sizeof(struct array_arena));
+		ar->chunks = (struct arena_chunk *)NULL;
+		ar->free = (char *)NULL;
+		ar->avail = ar->allocated = ar->released = 0;
+		ar->chunk_size = ARENA_CHUNK_MIN;
+		ar->retired = 0;
+	}
+
+	pad = align ? (ARENA_ALIGN - ((size_t)ar->free % ARENA_ALIGN)) % ARENA_ALIGN : 0;
+	if (ar->avail < n + pad) {
+		size = ar->chunk_size;
+		if (ar->chunk_size < ARENA_CHUNK_MAX)
+			ar->chunk_size *= 2;
+		c = (struct arena_chunk *)xmalloc(sizeof(struct arena_chunk) + size);
+		c->next = ar->chunks;
+		ar->chunks = c;
+		ar->free = (char *)c->data;
+		ar->avail = size;
+		pad = 0;
+	}
+
+	r = ar->free + pad;
+	ar->free += n + pad;
+	ar->avail -= n + pad;
+	ar->allocated += n;
+	return r;
+}
+
+static void
+arena_release(a, n)
+ARRAY	*a;
+size_t	n;
+{
+	struct array_arena *ar;
+
+	ar = a->arena;
+	ar->released += n;
+	if (ar->released >= ar->allocated)
+		arena_dispose(a);		/* nothing left in it */
+	else if (ar->released > ar->allocated / 2)
+		ar->retired = 1;
+}
+
+static void
+arena_dispose(a)
+ARRAY	*a;
+{
+	struct arena_chunk *c, *next;
+
+	if (a->arena == 0)
+		return;
+	for (c = a->arena->chunks; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	free(a->arena);
+	a->arena = (struct array_arena *)NULL;
+}
+
+static ARRAY_ELEMENT *
+arena_create_element(a, indx, value)
+ARRAY	*a;
+arrayind_t	indx;
+char	*value;
+{
+	ARRAY_ELEMENT *r;
+	size_t	len;
+
+	r = (ARRAY_ELEMENT *)arena_alloc(a, sizeof(ARRAY_ELEMENT), 1);
+	r->ind = indx;
+	r->next = r->prev = (ARRAY_ELEMENT *) NULL;
+	r->flags = AE_ARENA;
+	len = value ? strlen(value) + 1 : 0;
+	if (value == 0)
+		r->value = (char *)NULL;
+	else if (len > ARENA_VALUE_MAX)
+		r->value = savestring(value);
+	else {
+		r->value = (char *)arena_alloc(a, len, 0);
+		memcpy(r->value, value, len);
+		r->flags |= AE_ARENAVAL;
+	}
+	return(r);
+}
+
+/* Free AE's value, wherever it came from */
+static void
+array_free_value(a, ae)
+ARRAY	*a;
+ARRAY_ELEMENT	*ae;
+{
+	if (ae->flags & AE_ARENAVAL) {
+		ae->flags &= ~AE_ARENAVAL;
+		arena_release(a, strlen(ae->value) + 1);
+	} else
+		FREE(ae->value);
+	ae->value = (char *)NULL;
+}
+
+static void
+array_free_element(a, ae)
+ARRAY	*a;
+ARRAY_ELEMENT	*ae;
+{
+	if (ae->flags & AE_ARENA) {
+		if (ae->value)
+			array_free_value(a, ae);
+		arena_release(a, sizeof(ARRAY_ELEMENT));
+	} else
+		array_dispose_element(ae);
+}
+
+/* AE is leaving A; make sure it doesn't take A's arena with it */
+static ARRAY_ELEMENT *
+array_detach_element(a, ae)
+ARRAY	*a;
+ARRAY_ELEMENT	*ae;
+{
+	ARRAY_ELEMENT *new;
+
+	if ((ae->flags & AE_ARENA) == 0)
+		return ae;
+	new = array_create_element(element_index(ae), element_value(ae));
+	new->next = ae->next;
+	new->prev = ae->prev;
+	array_free_element(a, ae);
+	return new;
+}
+
 ARRAY *
 array_create()
 {
@@ -87,6 +392,9 @@ array_create()
 	r->max_index = -1;
 	r->num_elements = 0;
 	r->lastref = (ARRAY_ELEMENT *)0;
+	r->dense = (ARRAY_ELEMENT **)0;
+	r->dense_base = r->dense_size = 0;
+	r->arena = (struct array_arena *)NULL;
 	head = array_create_element(-1, (char *)NULL);	/* dummy head */
 	head->prev = head->next = head;
 	r->head = head;
@@ -103,13 +411,18 @@ ARRAY	*a;
 		return;
 	for (r = element_forw(a->head); r != a->head; ) {
 		r1 = element_forw(r);
-		array_dispose_element(r);
+		if ((r->flags & AE_ARENAVAL) == 0)
+			FREE(r->value);
+		if ((r->flags & AE_ARENA) == 0)
+			free(r);
 		r = r1;
 	}
+	arena_dispose(a);
 	a->head->next = a->head->prev = a->head;
 	a->max_index = -1;
 	a->num_elements = 0;
 	INVALIDATE_LASTREF(a);
+	array_dense_invalidate(a);
 }
 
 void
@@ -209,6 +522,7 @@ int	n, flags;
 		return ((ARRAY_ELEMENT *)NULL);
 
 	INVALIDATE_LASTREF(a);
+	array_dense_invalidate(a);
 	for (i = 0, ret = ae = element_forw(a->head); ae != a->head && i < n; ae = element_forw(ae), i++)
 		;
 	if (ae == a->head) {
@@ -223,7 +537,7 @@ int	n, flags;
 		a->head->next = a->head->prev = a->head;
 		a->max_index = -1;
 		a->num_elements = 0;
-		return ret;
+		return (array_detach_list(a, ret));
 	}
 	/*
 	 * ae now points to the list of elements we want to retain.
@@ -243,12 +557,34 @@ int	n, flags;
 	if (flags & AS_DISPOSE) {
 		for (ae = ret; ae; ) {
 			ret = element_forw(ae);
-			array_dispose_element(ae);
+			array_free_element(a, ae);
 			ae = ret;
 		}
 		return ((ARRAY_ELEMENT *)NULL);
 	}
 
+	return (array_detach_list(a, ret));
+}
+
+/*
+ * Detach each of the elements in LIST, which have been shifted out of A.
+ */
+static ARRAY_ELEMENT *
+array_detach_list(a, list)
+ARRAY	*a;
+ARRAY_ELEMENT	*list;
+{
+	ARRAY_ELEMENT	*ae, *prev, *ret;
+
+	for (ret = prev = (ARRAY_ELEMENT *)NULL, ae = list; ae; ae = element_forw(ae)) {
+		ae = array_detach_element(a, ae);
+		if (prev)
+			prev->next = ae;
+		else
+			ret = ae;
+		ae->prev = prev;
+		prev = ae;
+	}
 	return ret;
 }
 
@@ -270,6 +606,7 @@ char	*s;
 	else if (n <= 0)
 		return (a->num_elements);
 
+	array_dense_invalidate(a);	/* every index changes */
 	ae = element_forw(a->head);
 	if (s) {
 		new = array_create_element(0, s);
@@ -319,7 +656,7 @@ ARRAY	*array;
 		return (ARRAY *)NULL;
 	for (a = element_forw(array->head); a != array->head; a = element_forw(a)) {
 		t = quote_string (a->value);
-		FREE(a->value);
+		array_free_value(array, a);
 		a->value = t;
 	}
 	return array;
@@ -336,7 +673,7 @@ ARRAY	*array;
 		return (ARRAY *)NULL;
 	for (a = element_forw(array->head); a != array->head; a = element_forw(a)) {
 		t = quote_escapes (a->value);
-		FREE(a->value);
+		array_free_value(array, a);
 		a->value = t;
 	}
 	return array;
@@ -353,7 +690,7 @@ ARRAY	*array;
 		return (ARRAY *)NULL;
 	for (a = element_forw(array->head); a != array->head; a = element_forw(a)) {
 		t = dequote_string (a->value);
-		FREE(a->value);
+		array_free_value(array, a);
 		a->value = t;
 	}
 	return array;
@@ -370,7 +707,7 @@ ARRAY	*array;
 		return (ARRAY *)NULL;
 	for (a = element_forw(array->head); a != array->head; a = element_forw(a)) {
 		t = dequote_escapes (a->value);
-		FREE(a->value);
+		array_free_value(array, a);
 		a->value = t;
 	}
 	return array;
@@ -521,6 +858,7 @@ char	*value;
 	r->ind = indx;
 	r->value = value ? savestring(value) : (char *)NULL;
 	r->next = r->prev = (ARRAY_ELEMENT *) NULL;
+	r->flags = 0;
 	return(r);
 }
 
@@ -539,8 +877,10 @@ array_dispose_element(ae)
 ARRAY_ELEMENT	*ae;
 {
 	if (ae) {
-		FREE(ae->value);
-		free(ae);
+		if ((ae->flags & AE_ARENAVAL) == 0)
+			FREE(ae->value);
+		if ((ae->flags & AE_ARENA) == 0)
+			free(ae);
 	}
 }
 
@@ -553,13 +893,13 @@ ARRAY	*a;
 arrayind_t	i;
 char	*v;
 {
-	register ARRAY_ELEMENT *new, *ae, *start;
+	ARRAY_ELEMENT *new, *ae, *start;
 	arrayind_t startind;
 	int direction;
 
 	if (a == 0)
 		return(-1);
-	new = array_create_element(i, v);
+	new = ARENA_WANTED(a, i) ? arena_create_element(a, i, v) : array_create_element(i, v);
 	if (i > array_max_index(a)) {
 		/*
 		 * Hook onto the end.  This also works for an empty array.
@@ -570,12 +910,39 @@ char	*v;
 		a->max_index = i;
 		a->num_elements++;
 		SET_LASTREF(a, new);
+		if (a->dense && array_dense_grow(a, i))
+			DENSE_SLOT(a, i) = new;
 		return(0);
 	} else if (i < array_first_index(a)) {
 		/* Hook at the beginning */
 		ADD_AFTER(a->head, new);
 		a->num_elements++;
 		SET_LASTREF(a, new);
+		if (DENSE_COVERS(a, i))
+			DENSE_SLOT(a, i) = new;
+		else if (a->dense)
+			array_dense_invalidate(a);
+		return(0);
+	}
+
+	/* A dense array can find I, or the element I goes before, directly */
+	if (array_dense_lookup(a, i, &ae)) {
+		if (ae) {
+			/* Replacing an existing element. */
+			array_free_value(a, ae);
+			ae->value = new->value;
+			new->value = 0;
+			array_dispose_element(new);
+			SET_LASTREF(a, ae);
+			return(0);
+		}
+		/* I is below the last index, so some later slot is set */
+		for (start = (ARRAY_ELEMENT *)NULL, startind = i + 1; start == 0; startind++)
+			start = DENSE_SLOT(a, startind);
+		ADD_BEFORE(start, new);
+		a->num_elements++;
+		DENSE_SLOT(a, i) = new;
+		SET_LASTREF(a, new);
 		return(0);
 	}
 #if OPTIMIZE_SEQUENTIAL_ARRAY_ASSIGNMENT
@@ -607,7 +974,7 @@ char	*v;
 			/*
 			 * Replacing an existing element.
 			 */
-			free(element_value(ae));
+			array_free_value(a, ae);
 			/* Just swap in the new value */
 			ae->value = new->value;
 			new->value = 0;
@@ -641,7 +1008,7 @@ array_remove(a, i)
 ARRAY	*a;
 arrayind_t	i;
 {
-	register ARRAY_ELEMENT *ae, *start;
+	ARRAY_ELEMENT *ae, *start;
 	arrayind_t startind;
 	int direction;
 
@@ -649,6 +1016,25 @@ arrayind_t	i;
 		return((ARRAY_ELEMENT *) NULL);
 	if (i > array_max_index(a) || i < array_first_index(a))
 		return((ARRAY_ELEMENT *)NULL);	/* Keep roving pointer into array to optimize sequential access */
+	if (array_dense_lookup(a, i, &ae)) {
+		if (ae == 0)
+			return((ARRAY_ELEMENT *)NULL);
+		ae->next->prev = ae->prev;
+		ae->prev->next = ae->next;
+		a->num_elements--;
+		DENSE_SLOT(a, i) = (ARRAY_ELEMENT *)NULL;
+		if (i == array_max_index(a))
+			a->max_index = element_index(ae->prev);
+		if (ae->next != a->head)
+			SET_LASTREF(a, ae->next);
+		else if (ae->prev != a->head)
+			SET_LASTREF(a, ae->prev);
+		else
+			INVALIDATE_LASTREF(a);
+		if (array_empty(a) || DENSE_KEEP(a, array_max_index(a) - a->dense_base + 1) == 0)
+			array_dense_invalidate(a);
+		return(array_detach_element(a, ae));
+	}
 	start = LASTREF(a);
 	/* Use same strategy as array_reference to avoid paying large penalty
 	   for semi-random assignment pattern. */
@@ -679,7 +1065,7 @@ arrayind_t	i;
 			else
 				INVALIDATE_LASTREF(a);
 #endif
-			return(ae);
+			return(array_detach_element(a, ae));
 		}
 		ae = (direction == 1) ? element_forw(ae) : element_back(ae);
 		if (direction == 1 && element_index(ae) > i)
@@ -698,7 +1084,7 @@ array_reference(a, i)
 ARRAY	*a;
 arrayind_t	i;
 {
-	register ARRAY_ELEMENT *ae, *start;
+	ARRAY_ELEMENT *ae, *start;
 	arrayind_t startind;
 	int direction;
 
@@ -706,6 +1092,12 @@ arrayind_t	i;
 		return((char *) NULL);
 	if (i > array_max_index(a) || i < array_first_index(a))
 		return((char *)NULL);	/* Keep roving pointer into array to optimize sequential access */
+	if (array_dense_lookup(a, i, &ae)) {
+		if (ae == 0)
+			return((char *)NULL);
+		SET_LASTREF(a, ae);
+		return(element_value(ae));
+	}
 	start = LASTREF(a);	/* lastref pointer */
 	startind = element_index(start);
 	if (i < startind/2) {	/* XXX - guess */
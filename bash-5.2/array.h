@@ -37,6 +37,13 @@ typedef struct array {
 #else
 	struct array_element *head;
 	struct array_element *lastref;
+	/* Direct index kept while the array is mostly contiguous:
+	   dense[i - dense_base] is the element with index i, or NULL. */
+	struct array_element **dense;
+	arrayind_t	dense_base;
+	arrayind_t	dense_size;
+	/* Storage for the elements a big array gets by appending */
+	struct array_arena *arena;
 #endif
 } ARRAY;
 
@@ -45,9 +52,16 @@ typedef struct array_element {
 	char	*value;
 #ifndef ALT_ARRAY_IMPLEMENTATION
 	struct array_element *next, *prev;
+	int	flags;
 #endif
 } ARRAY_ELEMENT;
 
+#ifndef ALT_ARRAY_IMPLEMENTATION
+/* Values for ARRAY_ELEMENT flags */
+#define AE_ARENA	0x01	/* element is in its array's arena */
+#define AE_ARENAVAL	0x02	/* and so is its value */
+#endif
+
 #define ARRAY_DEFAULT_SIZE	1024
 
 typedef int sh_ae_map_func_t PARAMS((ARRAY_ELEMENT *, void *));
@@ -65,6 +79,7 @@ extern void	array_dispose PARAMS((ARRAY *));
 extern ARRAY	*array_copy PARAMS((ARRAY *));
 #ifndef ALT_ARRAY_IMPLEMENTATION
 extern ARRAY	*array_slice PARAMS((ARRAY *, ARRAY_ELEMENT *, ARRAY_ELEMENT *));
+extern void	array_dense_invalidate PARAMS((ARRAY *));
 #else
 extern ARRAY	*array_slice PARAMS((ARRAY *, arrayind_t, arrayind_t));
 #endif
@@ -163,11 +178,21 @@ extern arrayind_t element_back PARAMS((ARRAY *, arrayind_t));
     (a) = ((v) && array_p ((v))) ? array_cell (v) : (ARRAY *)0; \
   } while (0)
 
+#ifndef ALT_ARRAY_IMPLEMENTATION
+#define ARRAY_ELEMENT_REPLACE(ae, v) \
+  do { \
+    if (((ae)->flags & AE_ARENAVAL) == 0) \
+      free ((ae)->value); \
+    (ae)->flags &= ~AE_ARENAVAL; \
+    (ae)->value = (v); \
+  } while (0)
+#else
 #define ARRAY_ELEMENT_REPLACE(ae, v) \
   do { \
     free ((ae)->value); \
     (ae)->value = (v); \
   } while (0)
+#endif
 
 #ifdef ALT_ARRAY_IMPLEMENTATION
 #define ARRAY_VALUE_REPLACE(a, i, v) \
@@ -30,7 +30,12 @@
 #define assoc_empty(h)		((h)->nentries == 0)
 #define assoc_num_elements(h)	((h)->nentries)
 
-#define assoc_create(n)		(hash_create((n)))
+#if defined (ANBS_AI_ENABLED)
+extern int open_hash_tables;
+#  define assoc_create(n)	(open_hash_tables ? hash_create_open((n)) : hash_create((n)))
+#else
+#  define assoc_create(n)	(hash_create((n)))
+#endif
 
 #define assoc_copy(h)		(hash_copy((h), 0))
 
@@ -0,0 +1,376 @@
+/* asyncprompt.c -- prompt segments computed by background commands. */
+
+/* Copyright (C) 2024 Free Software Foundation, Inc.
+
+   This file is part of GNU Bash, the Bourne Again SHell.
+
+   Bash is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Bash is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Bash.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#if defined (ANBS_AI_ENABLED)
+
+#include "bashtypes.h"
+
+#if defined (HAVE_UNISTD_H)
+#  include <unistd.h>
+#endif
+
+#include "filecntl.h"
+#include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "bashansi.h"
+
+#include "shell.h"
+#include "jobs.h"
+#include "execute_cmd.h"
+#include "trap.h"
+#include "sig.h"
+#include "asyncprompt.h"
+
+#include "builtins/common.h"
+
+#if defined (READLINE)
+#  include <readline/readline.h>
+#endif
+
+#if !defined (errno)
+extern int errno;
+#endif
+
+/* A prompt escape \Q{command} stands for the output of COMMAND, which
+   runs in the background.  Until it finishes the prompt shows what the
+   command printed last time, or $ANBS_PROMPT_PLACEHOLDER the first time,
+   and when it does, readline's event hook redraws the prompt with the new
+   output.  A command runs once for each command number, so pressing
+   Enter on an empty line or redrawing the prompt doesn't start it again,
+   and never while its last run is still going. */
+
+#define SEGMENT_MAX		32	/* distinct commands remembered */
+#define SEGMENT_OUTPUT_MAX	4096	/* output kept from each run */
+
+struct prompt_segment
+{
+  struct prompt_segment *next;
+  char *command;
+  char *value;		/* output of the last run that finished */
+  int generation;	/* command number VALUE was computed for */
+  int used;		/* command number the prompt last showed it */
+  int started;		/* command number the running command was started for */
+  pid_t pid;
+  int fd;		/* our end of its output pipe, or -1 if not running */
+  char *buf;		/* output collected from the running command */
+  size_t len;
+};
+
+static struct prompt_segment *segments;
+static int nsegments;
+static int redraw_pending;
+
+static struct prompt_segment *segment_find PARAMS((const char *));
+static void segment_evict PARAMS((void));
+static int segment_start PARAMS((struct prompt_segment *));
+static void segment_finish PARAMS((struct prompt_segment *));
+static int segment_read PARAMS((struct prompt_segment *));
+static int segments_running PARAMS((void));
+static int segments_poll PARAMS((void));
+#if defined (READLINE)
+static int segment_event_hook PARAMS((void));
+#endif
+
+static struct prompt_segment *
+segment_find (command)
+     const char *command;
+{
+  struct prompt_segment *seg;
+
+  for (seg = segments; seg; seg = seg->next)
+    if (STREQ (seg->command, command))
+      return seg;
+  return ((struct prompt_segment *)NULL);
+}
+
+/* Forget the least recently shown segment that isn't running, to make
+   room for another */
+static void
+segment_evict ()
+{
+  struct prompt_segment *seg, *prev, *victim, *vprev;
+
+  victim = vprev = (struct prompt_segment *)NULL;
+  for (prev = 0, seg = segments; seg; prev = seg, seg = seg->next)
+    if (seg->fd < 0 && (victim == 0 || seg->used < victim->used))
+      {
+	victim = seg;
+	vprev = prev;
+      }
+
+  if (victim == 0)
+    return;
+
+  if (vprev)
+    vprev->next = victim->next;
+  else
+    segments = victim->next;
+  free (victim->command);
+  FREE (victim->value);
+  free (victim);
+  nsegments--;
+}
+
+/* Run SEG's command in a child with its output on a pipe.  The child
+   isn't a job and isn't waited for: the SIGCHLD handler reaps it, and we
+   know it's done when the pipe reaches EOF. */
+static int
+segment_start (seg)
+     struct prompt_segment *seg;
+{
+  int fildes[2], fd;
+  pid_t pid, old_pid, old_async_pid;
+#if defined (JOB_CONTROL)
+  pid_t old_pipeline_pgrp;
+#endif
+
+  if (pipe (fildes) < 0)
+    return -1;
+
+  old_pid = last_made_pid;
+  old_async_pid = last_asynchronous_pid;
+
+#if defined (JOB_CONTROL)
+  old_pipeline_pgrp = pipeline_pgrp;
+  pipeline_pgrp = 0;
+  save_pipeline (1);
+#endif
+
+  fflush (stdout);
+  fflush (stderr);
+
+  pid = make_child ((char *)NULL, FORK_ASYNC|FORK_NOTERM);
+  if (pid == 0)
+    {
+      interactive = 0;
+      reset_terminating_signals ();
+      restore_original_signals ();
+      subshell_environment |= SUBSHELL_COMSUB|SUBSHELL_ASYNC;
+      setup_async_signals ();
+
+      /* Keep the command away from the terminal readline is using */
+      if (dup2 (fildes[1], 1) < 0)
+	exit (EXECUTION_FAILURE);
+      close (fildes[0]);
+      close (fildes[1]);
+      fd = open ("/dev/null", O_RDWR);
+      if (fd >= 0)
+	{
+	  dup2 (fd, 0);
+	  dup2 (fd, 2);
+	  if (fd > 2)
+	    close (fd);
+	}
+
+      /* Errors and `return' mustn't take the child back into the shell */
+      if (setjmp_nosigs (top_level))
+	exit (last_command_exit_value);
+      if (return_catch_flag && setjmp_nosigs (return_catch))
+	exit (return_catch_value);
+
+      exit (parse_and_execute (savestring (seg->command), "prompt", SEVAL_NONINT|SEVAL_NOHIST));
+    }
+
+#if defined (JOB_CONTROL)
+  set_sigchld_handler ();
+  stop_making_children ();
+  pipeline_pgrp = old_pipeline_pgrp;
+  restore_pipeline (1);
+#else
+  stop_making_children ();
+#endif
+
+  last_made_pid = old_pid;
+  last_asynchronous_pid = old_async_pid;
+  close (fildes[1]);
+
+  if (pid < 0)
+    {
+      close (fildes[0]);
+      return -1;
+    }
+
+  fd = move_to_high_fd (fildes[0], 1, -1);
+  SET_CLOSE_ON_EXEC (fd);
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK);
+
+  seg->pid = pid;
+  seg->fd = fd;
+  seg->buf = (char *)xmalloc (SEGMENT_OUTPUT_MAX + 1);
+  seg->len = 0;
+  seg->started = current_command_number;
+
+#if defined (READLINE)
+  if (interactive_shell && no_line_editing == 0)
+    rl_event_hook = segment_event_hook;
+#endif
+  return 0;
+}
+
+/* The command finished: its output, less trailing newlines, becomes the
+   segment's value */
+static void
+segment_finish (seg)
+     struct prompt_segment *seg;
+{
+  close (seg->fd);
+  seg->fd = -1;
+  seg->pid = NO_PID;
+
+  while (seg->len > 0 && seg->buf[seg->len - 1] == '\n')
+    seg->len--;
+  seg->buf[seg->len] = '\0';
+
+  FREE (seg->value);
+  seg->value = seg->buf;
+  seg->buf = (char *)NULL;
+  seg->generation = seg->started;
+}
+
+/* Read what SEG's command has written so far.  Returns 1 if it has
+   finished, 0 if not. */
+static int
+segment_read (seg)
+     struct prompt_segment *seg;
+{
+  char discard[512];
+  ssize_t n;
+
+  for (;;)
+    {
+      if (seg->len < SEGMENT_OUTPUT_MAX)
+	n = read (seg->fd, seg->buf + seg->len, SEGMENT_OUTPUT_MAX - seg->len);
+      else
+	n = read (seg->fd, discard, sizeof (discard));
+
+      if (n > 0)
+	{
+	  if (seg->len < SEGMENT_OUTPUT_MAX)
+	    seg->len += n;
+	  continue;
+	}
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return 0;
+
+      segment_finish (seg);
+      return 1;
+    }
+}
+
+static int
+segments_running ()
+{
+  struct prompt_segment *seg;
+
+  for (seg = segments; seg; seg = seg->next)
+    if (seg->fd >= 0)
+      return 1;
+  return 0;
+}
+
+/* Collect output from the running segment commands.  Returns the number
+   that finished. */
+static int
+segments_poll ()
+{
+  struct prompt_segment *seg;
+  int done;
+
+  for (done = 0, seg = segments; seg; seg = seg->next)
+    if (seg->fd >= 0)
+      done += segment_read (seg);
+  return done;
+}
+
+#if defined (READLINE)
+/* Readline calls this every tenth of a second while it waits for a key.
+   Redraw the prompt when a segment has new output, unless readline is
+   searching or completing, and stop polling when nothing is running. */
+static int
+segment_event_hook ()
+{
+  if (segments_poll ())
+    redraw_pending = 1;
+
+  if (redraw_pending && RL_ISSTATE (RL_STATE_ISEARCH|RL_STATE_NSEARCH|RL_STATE_SEARCH|RL_STATE_COMPLETING|RL_STATE_NUMERICARG|RL_STATE_MOREINPUT) == 0)
+    {
+      redraw_pending = 0;
+      prompt_redisplay ();
+    }
+
+  if (redraw_pending == 0 && segments_running () == 0)
+    rl_event_hook = 0;
+  return 0;
+}
+#endif
+
+/* The text to show for \Q{COMMAND}, in newly-allocated memory, starting
+   COMMAND if this prompt hasn't run it yet.  A non-interactive shell,
+   which has no prompt to redraw, waits for it. */
+char *
+prompt_segment_value (command)
+     const char *command;
+{
+  struct prompt_segment *seg;
+  char *placeholder;
+
+  seg = segment_find (command);
+  if (seg == 0)
+    {
+      if (nsegments >= SEGMENT_MAX)
+	segment_evict ();
+      seg = (struct prompt_segment *)xmalloc (sizeof (struct prompt_segment));
+      seg->command = savestring (command);
+      seg->value = seg->buf = (char *)NULL;
+      seg->generation = seg->started = -1;
+      seg->pid = NO_PID;
+      seg->fd = -1;
+      seg->len = 0;
+      seg->next = segments;
+      segments = seg;
+      nsegments++;
+    }
+  seg->used = current_command_number;
+
+  if (seg->fd >= 0)
+    segment_read (seg);
+  if (seg->fd < 0 && seg->generation != current_command_number)
+    segment_start (seg);
+
+  if (seg->fd >= 0 && interactive_shell == 0)
+    {
+      fcntl (seg->fd, F_SETFL, fcntl (seg->fd, F_GETFL, 0) & ~O_NONBLOCK);
+      segment_read (seg);
+    }
+
+  if (seg->value)
+    return (savestring (seg->value));
+
+  placeholder = get_string_value ("ANBS_PROMPT_PLACEHOLDER");
+  return (savestring (placeholder ? placeholder : ""));
+}
+
+#endif /* ANBS_AI_ENABLED */
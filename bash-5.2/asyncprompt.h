@@ -0,0 +1,35 @@
+/* asyncprompt.h -- declarations for prompt segments computed by background
+   commands. */
+
+/* Copyright (C) 2024 Free Software Foundation, Inc.
+
+   This file is part of GNU Bash, the Bourne Again SHell.
+
+   Bash is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Bash is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Bash.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined (_ASYNCPROMPT_H_)
+#define _ASYNCPROMPT_H_
+
+#include "stdc.h"
+
+#if defined (ANBS_AI_ENABLED)
+/* Functions from asyncprompt.c */
+
+/* The text to show for the prompt escape \Q{COMMAND}: COMMAND's output
+   from its last run, starting another in the background if it's due. */
+extern char *prompt_segment_value PARAMS((const char *));
+#endif
+
+#endif /* _ASYNCPROMPT_H_ */
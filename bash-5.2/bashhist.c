@@ -42,6 +42,10 @@
 #  include <syslog.h>
 #endif
 
+#if defined (ANBS_AI_ENABLED)
+#  include "posixtime.h"
+#endif
+
 #include "shell.h"
 #include "flags.h"
 #include "parser.h"
@@ -55,6 +59,12 @@
 #include <glob/glob.h>
 #include <glob/strmatch.h>
 
+#if defined (ANBS_AI_ENABLED)
+extern int anbs_memory_history_add PARAMS((const char *, const char *, int, long));
+extern void anbs_ai_prefetch_next PARAMS((const char *));
+extern int anbs_memory_suggest_add PARAMS((const char *));
+#endif
+
 #if defined (READLINE)
 #  include "bashline.h"
 extern int rl_done, rl_dispatching;	/* should really include readline.h */
@@ -1029,6 +1039,57 @@ last_history_line ()
   return he->line;
 }
 
+#if defined (ANBS_AI_ENABLED)
+/* When and where the interactive command now executing started. */
+static struct timeval command_start;
+static char *command_cwd;
+
+/* Called by reader_loop just before an interactive command runs. */
+void
+bash_history_command_start ()
+{
+  char *pwd;
+
+  gettimeofday (&command_start, (void *)NULL);
+  pwd = get_string_value ("PWD");
+  FREE (command_cwd);
+  command_cwd = pwd ? savestring (pwd) : (char *)NULL;
+}
+
+/* Called by reader_loop after an interactive command finishes.  If the
+   command was saved in the history, hand it to the AI memory along with
+   its exit status, directory and running time; the memory queues it and
+   indexes it on its own thread.  Setting ANBS_MEMORY_HISTORY to 0 turns
+   this off.  The line also goes to the AI prefetcher, which acts on it
+   only when ANBS_PREFETCH is set, and to the index of inline suggestions. */
+void
+bash_history_command_done (status)
+     int status;
+{
+  struct timeval now;
+  char *line, *value;
+  long msec;
+
+  if (remember_on_history == 0 || current_command_first_line_saved == 0)
+    return;
+
+  line = last_history_line ();
+  if (line == 0 || *line == '\0')
+    return;
+
+  value = get_string_value ("ANBS_MEMORY_HISTORY");
+  if (value == 0 || STREQ (value, "0") == 0)
+    {
+      gettimeofday (&now, (void *)NULL);
+      msec = (now.tv_sec - command_start.tv_sec) * 1000 + (now.tv_usec - command_start.tv_usec) / 1000;
+      anbs_memory_history_add (line, command_cwd, status, msec);
+    }
+
+  anbs_ai_prefetch_next (line);
+  anbs_memory_suggest_add (line);
+}
+#endif /* ANBS_AI_ENABLED */
+
 static char *
 expand_histignore_pattern (pat)
      char *pat;
@@ -86,4 +86,9 @@ extern void setup_history_ignore PARAMS((char *));
 
 extern char *last_history_line PARAMS((void));
 
+#if defined (ANBS_AI_ENABLED)
+extern void bash_history_command_start PARAMS((void));
+extern void bash_history_command_done PARAMS((int));
+#endif
+
 #endif /* _BASHHIST_H_ */
@@ -80,6 +80,10 @@
 #  include "pcomplete.h"
 #endif
 
+#if defined (ANBS_AI_ENABLED)
+#  include "posixtime.h"
+#endif
+
 /* These should agree with the defines for emacs_mode and vi_mode in
    rldefs.h, even though that's not a public readline header file. */
 #ifndef EMACS_EDITING_MODE
@@ -219,6 +223,26 @@ static int posix_edit_macros PARAMS((int, int));
 
 static int bash_event_hook PARAMS((void));
 
+#if defined (ANBS_AI_ENABLED)
+static void bash_suggest_seed PARAMS((void));
+static char *bash_suggest_hint PARAMS((void));
+static int bash_forward_char_or_suggestion PARAMS((int, int));
+static char **attempt_timed_completion PARAMS((const char *, int, int));
+static int bash_speculate_pause PARAMS((void));
+static int bash_speculate_hook PARAMS((void));
+
+extern int anbs_memory_suggest_seed PARAMS((const char * const *, const time_t *, int));
+extern int anbs_memory_suggest PARAMS((const char *, char *, size_t, long));
+extern time_t shell_start_time;
+extern int anbs_metrics_slo_observe PARAMS((const char *, double));
+extern void anbs_ai_speculate PARAMS((const char *));
+extern void anbs_ai_speculate_cancel PARAMS((const char *));
+
+#  define SHELL_COMPLETION_FUNCTION attempt_timed_completion
+#else
+#  define SHELL_COMPLETION_FUNCTION attempt_shell_completion
+#endif
+
 #if defined (PROGRAMMABLE_COMPLETION)
 static int find_cmd_start PARAMS((int));
 static int find_cmd_end PARAMS((int));
@@ -517,6 +541,10 @@ initialize_readline ()
   rl_add_defun ("dynamic-complete-history", dynamic_complete_history, -1);
   rl_add_defun ("dabbrev-expand", bash_dabbrev_expand, -1);
 
+#if defined (ANBS_AI_ENABLED)
+  rl_add_defun ("forward-char-or-suggestion", bash_forward_char_or_suggestion, -1);
+#endif
+
   /* Bind defaults before binding our custom shell keybindings. */
   if (RL_ISSTATE(RL_STATE_INITIALIZED) == 0)
     rl_initialize ();
@@ -589,7 +617,7 @@ initialize_readline ()
     rl_bind_key_in_map (TAB, dynamic_complete_history, emacs_meta_keymap);
 
   /* Tell the completer that we want a crack first. */
-  rl_attempted_completion_function = attempt_shell_completion;
+  rl_attempted_completion_function = SHELL_COMPLETION_FUNCTION;
 
   /* Tell the completer that we might want to follow symbolic links or
      do other expansion on directory names. */
@@ -637,6 +665,20 @@ initialize_readline ()
   rl_bind_key_if_unbound_in_map (CTRL('F'), bash_forward_shellword, emacs_meta_keymap);
   rl_bind_key_if_unbound_in_map (CTRL('T'), bash_transpose_shellwords, emacs_meta_keymap);
 
+#if defined (ANBS_AI_ENABLED)
+  /* Suggestions show as readline hints.  Right arrow and C-f accept one,
+     unless they've been bound to something other than forward-char. */
+  rl_hint_function = bash_suggest_hint;
+  if (rl_function_of_keyseq ("\033[C", emacs_standard_keymap, (int *)NULL) == rl_forward_char)
+    rl_bind_keyseq_in_map ("\033[C", bash_forward_char_or_suggestion, emacs_standard_keymap);
+  if (rl_function_of_keyseq ("\033OC", emacs_standard_keymap, (int *)NULL) == rl_forward_char)
+    rl_bind_keyseq_in_map ("\033OC", bash_forward_char_or_suggestion, emacs_standard_keymap);
+  kseq[0] = CTRL('F');
+  kseq[1] = '\0';
+  if (rl_function_of_keyseq (kseq, emacs_standard_keymap, (int *)NULL) == rl_forward_char)
+    rl_bind_key_in_map (CTRL('F'), bash_forward_char_or_suggestion, emacs_standard_keymap);
+#endif
+
 #if 0
   /* This is superfluous and makes it impossible to use tab completion in
      vi mode even when explicitly binding it in ~/.inputrc.  sv_strict_posix()
@@ -676,7 +718,7 @@ void
 bashline_reset ()
 {
   tilde_initialize ();
-  rl_attempted_completion_function = attempt_shell_completion;
+  rl_attempted_completion_function = SHELL_COMPLETION_FUNCTION;
   rl_completion_entry_function = NULL;
   rl_ignore_some_completions_function = filename_completion_ignore;
 
@@ -688,6 +730,9 @@ bashline_reset ()
   rl_filename_stat_hook = bash_filename_stat_hook;
 
   bashline_reset_event_hook ();
+#if defined (ANBS_AI_ENABLED)
+  bashline_speculate_end ((char *)NULL);
+#endif
 
   rl_sort_completion_matches = 1;
 }
@@ -4836,4 +4881,205 @@ bash_event_hook ()
   return 0;
 }
 
+#if defined (ANBS_AI_ENABLED)
+/* Inline suggestions.  With ANBS_SUGGEST set, the rest of the most recent
+   command that starts with the line typed so far is shown dimmed after
+   the cursor, and right arrow or C-f at the end of the line accepts it.
+   The lookup runs on every redisplay against the prefix index the AI
+   memory keeps of the history, and shows nothing rather than take more
+   than SUGGEST_BUDGET_USEC. */
+
+#define SUGGEST_BUDGET_USEC	2000
+#define SUGGEST_MAX		512
+
+static char suggest_text[SUGGEST_MAX];
+static char *suggest_line;		/* the line SUGGEST_TEXT continues */
+static int suggest_seeded;
+
+/* Hand the history list to the suggestion index the first time a
+   suggestion is wanted.  Entries without a timestamp count as having run
+   in order just before the shell started. */
+static void
+bash_suggest_seed ()
+{
+#if defined (HISTORY)
+  HIST_ENTRY **hlist;
+  const char **lines;
+  time_t *times;
+  int i, n;
+
+  hlist = history_list ();
+  for (n = 0; hlist && hlist[n]; n++)
+    ;
+  lines = (const char **)xmalloc ((n + 1) * sizeof (char *));
+  times = (time_t *)xmalloc ((n + 1) * sizeof (time_t));
+  for (i = 0; i < n; i++)
+    {
+      lines[i] = hlist[i]->line;
+      times[i] = history_get_time (hlist[i]);
+      if (times[i] == 0)
+	times[i] = shell_start_time - (n - i);
+    }
+  anbs_memory_suggest_seed (lines, times, n);
+  free (lines);
+  free (times);
+#else
+  anbs_memory_suggest_seed ((const char * const *)NULL, (time_t *)NULL, 0);
+#endif
+  suggest_seeded = 1;
+}
+
+/* Readline's hint function: what to show after the line typed so far */
+static char *
+bash_suggest_hint ()
+{
+  char *value;
+
+  value = get_string_value ("ANBS_SUGGEST");
+  if (value == 0 || *value == '\0' || STREQ (value, "0") || rl_end == 0 ||
+      RL_ISSTATE (RL_STATE_ISEARCH|RL_STATE_NSEARCH|RL_STATE_SEARCH|RL_STATE_NUMERICARG|RL_STATE_MOREINPUT))
+    return ((char *)NULL);
+
+  if (suggest_seeded == 0)
+    bash_suggest_seed ();
+  if (suggest_line == 0 || STREQ (suggest_line, rl_line_buffer) == 0)
+    {
+      FREE (suggest_line);
+      suggest_line = savestring (rl_line_buffer);
+      anbs_memory_suggest (rl_line_buffer, suggest_text, sizeof (suggest_text), SUGGEST_BUDGET_USEC);
+    }
+  return (suggest_text[0] ? suggest_text : (char *)NULL);
+}
+
+/* At the end of the line with a suggestion showing, insert it; otherwise
+   move forward a character */
+static int
+bash_forward_char_or_suggestion (count, key)
+     int count, key;
+{
+  if (rl_point == rl_end && rl_display_hint && *rl_display_hint)
+    {
+      rl_insert_text (rl_display_hint);
+      return 0;
+    }
+  return (rl_forward_char (count, key));
+}
+
+/* Speculative @vertex queries.  With ANBS_SPECULATE set, an @vertex line
+   left alone for SPECULATE_PAUSE_MSEC (or for ANBS_SPECULATE milliseconds,
+   if that is more than 1) is sent in the background.  Enter on the same
+   line waits for that answer instead of asking again; an edit cancels it.
+   Readline's event hook, which it calls every tenth of a second while
+   waiting for a key, notices the pause. */
+
+#define SPECULATE_PAUSE_MSEC	500
+
+static char *speculate_line;		/* the line at the last tick */
+static struct timeval speculate_changed;	/* when it last changed */
+static int speculate_sent;
+static rl_hook_func_t *speculate_next_hook;	/* the hook it displaced */
+
+/* How long a pause starts a speculative query, or 0 if none should */
+static int
+bash_speculate_pause ()
+{
+  char *value;
+  int msec;
+
+  value = get_string_value ("ANBS_SPECULATE");
+  if (value == 0 || *value == '\0' || STREQ (value, "0"))
+    return 0;
+  msec = atoi (value);
+  return (msec > 1 ? msec : SPECULATE_PAUSE_MSEC);
+}
+
+static int
+bash_speculate_hook ()
+{
+  rl_hook_func_t *next;
+  struct timeval now;
+  int pause;
+
+  /* Prompt segments also use the event hook.  Run theirs as if it were
+     installed alone, and keep whatever it leaves in its place. */
+  next = speculate_next_hook;
+  if (next)
+    {
+      rl_event_hook = next;
+      (*next) ();
+      speculate_next_hook = rl_event_hook;
+      rl_event_hook = bash_speculate_hook;
+    }
+
+  if (RL_ISSTATE (RL_STATE_ISEARCH|RL_STATE_NSEARCH|RL_STATE_SEARCH|RL_STATE_COMPLETING|RL_STATE_NUMERICARG|RL_STATE_MOREINPUT))
+    return 0;
+
+  if (speculate_line == 0 || STREQ (speculate_line, rl_line_buffer) == 0)
+    {
+      FREE (speculate_line);
+      speculate_line = savestring (rl_line_buffer);
+      gettimeofday (&speculate_changed, (void *)NULL);
+      speculate_sent = 0;
+      anbs_ai_speculate_cancel (rl_line_buffer);
+      return 0;
+    }
+
+  pause = bash_speculate_pause ();
+  gettimeofday (&now, (void *)NULL);
+  if (speculate_sent == 0 && pause > 0 &&
+      (now.tv_sec - speculate_changed.tv_sec) * 1000 + (now.tv_usec - speculate_changed.tv_usec) / 1000 >= pause)
+    {
+      speculate_sent = 1;
+      anbs_ai_speculate (rl_line_buffer);
+    }
+  return 0;
+}
+
+/* Called before readline reads a line: watch it for pauses if
+   speculation is on */
+void
+bashline_speculate_begin ()
+{
+  if (bash_speculate_pause () == 0)
+    return;
+
+  FREE (speculate_line);
+  speculate_line = (char *)NULL;
+  if (rl_event_hook != bash_speculate_hook)
+    speculate_next_hook = rl_event_hook;
+  rl_event_hook = bash_speculate_hook;
+}
+
+/* Called with the line readline returned, or NULL if it returned none:
+   keep a speculative query for that line for the command to take, and
+   cancel any other */
+void
+bashline_speculate_end (line)
+     const char *line;
+{
+  if (rl_event_hook == bash_speculate_hook)
+    rl_event_hook = speculate_next_hook;
+  speculate_next_hook = 0;
+  anbs_ai_speculate_cancel (line);
+}
+
+/* attempt_shell_completion, timed against the completion latency
+   objective; see @perf slo */
+static char **
+attempt_timed_completion (text, start, end)
+     const char *text;
+     int start, end;
+{
+  struct timeval before, after;
+  char **matches;
+
+  gettimeofday (&before, (void *)NULL);
+  matches = attempt_shell_completion (text, start, end);
+  gettimeofday (&after, (void *)NULL);
+  anbs_metrics_slo_observe ("completion", (after.tv_sec - before.tv_sec) * 1000.0 + (after.tv_usec - before.tv_usec) / 1000.0);
+  return (matches);
+}
+#endif /* ANBS_AI_ENABLED */
+
 #endif /* READLINE */
+
@@ -46,6 +46,11 @@ extern int bash_re_edit PARAMS((char *));
 extern void bashline_set_event_hook PARAMS((void));
 extern void bashline_reset_event_hook PARAMS((void));
 
+#if defined (ANBS_AI_ENABLED)
+extern void bashline_speculate_begin PARAMS((void));
+extern void bashline_speculate_end PARAMS((const char *));
+#endif
+
 extern int bind_keyseq_to_unix_command PARAMS((char *));
 extern int bash_execute_unix_command PARAMS((int, int));
 extern int print_unix_command_map PARAMS((void));
@@ -13,418 +13,5797 @@
 #include "../bashintl.h"
 
 #include "../shell.h"
+#include "../execute_cmd.h"
+#include "../jobs.h"
 #include "../builtins.h"
-#include "../common.h"
-#include "../builtext.h"
+#include "common.h"
+#include "builtext.h"
+#if defined (HISTORY)
+#  include "../bashhist.h"
+#  include <readline/history.h>
+#endif
 #include "../ai_core/ai_display.h"
+#if defined (USING_BASH_MALLOC)
+#  include <malloc/profile.h>
+#endif
+#if defined (HAVE_DLFCN_H)
+#  include <dlfcn.h>
+#endif
 
 #include <curl/curl.h>
 #include <json-c/json.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <glob/strmatch.h>
 
 extern anbs_display_t *g_anbs_display;
 
-/* Response data structure for curl */
+/* Response cache (ai_core/performance/cache.c) */
+extern int anbs_cache_init(int max_entries);
+extern int anbs_cache_put(const char *command, const char *response, int ttl_seconds);
+extern char *anbs_cache_get(const char *command, double *cache_age_ms);
+extern int anbs_cache_semantic_put(const char *scope, const char *prompt, const char *response, int ttl_seconds);
+extern char *anbs_cache_semantic_get(const char *scope, const char *prompt, float threshold, float *similarity);
+extern char *anbs_cache_get_stale(const char *command, double *cache_age_ms, int *refresh);
+extern int anbs_cache_claim(const char *command);
+extern void anbs_cache_release(const char *command);
+extern int anbs_cache_get_stats(char **stats_json);
+
+/* Latency metrics (ai_core/performance/metrics.c) */
+extern int anbs_metrics_init(void);
+extern int anbs_metrics_record_response_time(const char *command_type, double elapsed_ms, const char *context);
+extern double anbs_metrics_get_response_percentile(const char *command_type, double percentile);
+extern int anbs_metrics_record_cost(const char *name, double elapsed_ms);
+extern bool anbs_metrics_tracing(void);
+extern void anbs_metrics_trace_span(const char *name, const char *category, const struct timeval *start,
+                                    double duration_ms, const char *args);
+extern int anbs_metrics_get_dashboard(char **dashboard_json);
+extern int anbs_metrics_get_histograms(const char *command_type, bool window, char **histograms_json);
+extern int anbs_metrics_get_openmetrics(char **text);
+extern int anbs_metrics_slo_observe(const char *slo, double elapsed_ms);
+extern double anbs_metrics_slo_target(const char *slo);
+extern int anbs_metrics_slo_status(char *buffer, size_t size);
+extern int anbs_metrics_get_slo(char **slo_json);
+extern void anbs_metrics_reset(void);
+
+/* Shared worker pool (ai_core/performance/optimize.c) */
+extern int anbs_optimize_submit(void (*run)(void *arg), void *arg);
+extern void anbs_optimize_observe(const char *command);
+extern char *anbs_optimize_predict(const char *command, double *confidence);
+extern int anbs_optimize_idle(void);
+extern int anbs_optimize_get_stats(char **stats_json);
+
+/* Memory store (ai_core/memory_system.c) */
+extern int anbs_memory_get_stats(int *total_entries, int *db_entries, size_t *memory_usage);
+extern void anbs_memory_prewarm(void);
+extern int anbs_memory_pack(const char *query, int budget, char **context);
+typedef struct anbs_memory_cursor anbs_memory_cursor_t;
+extern anbs_memory_cursor_t *anbs_memory_cursor_open(const char *query, int page);
+extern int anbs_memory_cursor_next(anbs_memory_cursor_t *cursor, const char **content, const char **context,
+                                   const char **source, time_t *timestamp, float *score);
+extern int anbs_memory_cursor_skip(anbs_memory_cursor_t *cursor, int count);
+extern void anbs_memory_cursor_close(anbs_memory_cursor_t *cursor);
+
+/* WebSocket gateway (ai_core/websocket_client.c) */
+extern int anbs_websocket_init(anbs_display_t *display, const char *host, int port, const char *path, int use_ssl);
+extern int anbs_websocket_connect(void);
+extern int anbs_websocket_is_connected(void);
+extern int anbs_websocket_request_wait(const char *request, int timeout_ms, char **reply);
+
+#define AI_DEFAULT_MODEL "claude-3-sonnet-20240229"
+#define AI_MAX_TOKENS 1000
+
+/* Response data structure for curl.  The buffer grows geometrically and
+   is always NUL-terminated. */
 struct ai_response {
     char *memory;
     size_t size;
+    size_t capacity;
+};
+
+#define AI_RESPONSE_INITIAL 4096
+
+/* AI providers @vertex can talk to.  URL_ENV names a variable that
+   replaces the endpoint, e.g. to point @vertex at a local mock server.
+   TEXT_PATH says where the assistant text is in a response body (see
+   ai_scan_path()). */
+struct ai_provider {
+    const char *name;
+    const char *key_env;
+    const char *url;
+    const char *url_env;
+    const char *auth_format;
+    const char *default_model;
+    const char *text_path;
 };
 
+static const struct ai_provider ai_providers[] = {
+    { "anthropic", "ANTHROPIC_API_KEY", "https://api.anthropic.com/v1/messages",
+      "ANBS_ANTHROPIC_URL", "x-api-key: %s", AI_DEFAULT_MODEL, "content[].text" },
+    { "openai", "OPENAI_API_KEY", "https://api.openai.com/v1/chat/completions",
+      "ANBS_OPENAI_URL", "Authorization: Bearer %s", "gpt-4o-mini", "choices[0].message.content" },
+    { NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+#define AI_PROVIDER_AUTO -1
+
+/* Endpoint requests to PROVIDER go to */
+static const char *ai_provider_url(const struct ai_provider *provider) {
+    const char *url = getenv(provider->url_env);
+
+    return (url && *url) ? url : provider->url;
+}
+
 /* AI command options */
 struct ai_options {
     int health_check;
     int stream_mode;
+    int async_mode;
+    int batch_mode;
+    int unordered;
+    int parallel;       /* fixed in-flight batch requests; 0 adapts */
     int timeout;
+    int no_cache;
+    int cache_ttl;      /* seconds; 0 selects the cache default */
+    int provider;       /* index into ai_providers, or AI_PROVIDER_AUTO */
+    int hedge_ms;       /* 0 off, -1 derive the delay from metrics */
+    int combine;        /* short batch queries sent per provider call */
+    int max_tokens;     /* 0 selects AI_MAX_TOKENS */
+    int context_tokens; /* budget for memories packed ahead of the query; 0 none */
+    char *context;      /* those memories, malloc'd, once packed */
     char *model;
+    char *batch_file;
     char *query;
+    const char *slo;    /* latency objective class; NULL for @vertex's own */
 };
 
-/* Write callback for curl responses */
-static size_t write_response_callback(void *contents, size_t size, size_t nmemb, struct ai_response *response) {
-    size_t realsize = size * nmemb;
-    char *ptr = realloc(response->memory, response->size + realsize + 1);
+/* One line of an @vertex --batch run */
+struct ai_batch_item {
+    char *query;
+    char *response;
+    int status;         /* 0 success, 1 failure */
+    int done;
+    const char *label;  /* printed instead of the index, if set */
+};
 
-    if (!ptr) {
-        /* Out of memory */
-        printf("Not enough memory (realloc returned NULL)\n");
-        return 0;
-    }
+#define AI_HEDGE_DEFAULT_MS 1500
+#define AI_CONNECT_TIMEOUT 10   /* seconds of a query's timeout it may spend connecting */
 
-    response->memory = ptr;
-    memcpy(&(response->memory[response->size]), contents, realsize);
-    response->size += realsize;
-    response->memory[response->size] = 0;
+/* --context without a budget packs ANBS_CONTEXT_TOKENS, or this many */
+#define AI_CONTEXT_DEFAULT_TOKENS 1500
+#define AI_CONTEXT_INTRO "Context from my shell, most relevant first (commands I ran, notes, earlier answers):\n"
 
-    return realsize;
-}
+#define AI_BATCH_DEFAULT_PARALLEL 4
+#define AI_BATCH_MAX_PARALLEL 64
 
-/* Parse JSON response from AI API */
-static int parse_ai_response(const char *json_response, char **ai_text) {
-    json_object *root, *content, *message;
-    const char *response_text;
+/* Without --parallel the batch window adapts per provider (AIMD): it grows
+   by one per window of clean responses and shrinks on 429 and 5xx
+   responses, failed transfers, or latency well past the recent median */
+#define AI_LIMIT_BACKOFF_MS 1000     /* at most one decrease per interval */
+#define AI_LIMIT_LATENCY_FACTOR 2.0  /* times the median that counts as congestion */
+#define AI_LIMIT_LATENCY_DECREASE 0.8
+#define AI_LIMIT_ERROR_DECREASE 0.5
 
-    root = json_tokener_parse(json_response);
-    if (!root) {
-        return -1;
-    }
+/* @vertex --batch --combine: short queries share one provider call that
+   answers them all as a JSON array */
+#define AI_COMBINE_DEFAULT 8
+#define AI_COMBINE_MAX 32
+#define AI_COMBINE_MAX_QUERY 1024   /* longer queries are sent alone */
+#define AI_COMBINE_MAX_TOKENS 4096
 
-    /* Try different JSON structures based on AI provider */
-    if (json_object_object_get_ex(root, "content", &content)) {
-        /* Anthropic Claude API structure */
-        response_text = json_object_get_string(content);
-    } else if (json_object_object_get_ex(root, "message", &message)) {
-        /* OpenAI API structure */
-        response_text = json_object_get_string(message);
-    } else if (json_object_object_get_ex(root, "response", &content)) {
-        /* Generic response structure */
-        response_text = json_object_get_string(content);
-    } else {
-        /* Fallback: use whole response as text */
-        response_text = json_object_get_string(root);
-    }
+/* How ai_run_concurrent() reports finished items */
+#define AI_EMIT_NONE 0
+#define AI_EMIT_ORDERED 1
+#define AI_EMIT_TAGGED 2
 
-    if (response_text) {
-        *ai_text = strdup(response_text);
-        json_object_put(root);
-        return 0;
-    }
+/* Shell-lifetime connection pool.  One reusable easy handle per provider
+   endpoint, all attached to a share object so the DNS cache, TLS session
+   cache and live connections survive between @vertex invocations. */
+#define AI_POOL_SLOTS 4
+#define AI_POOL_DNS_TTL 600     /* seconds */
+#define AI_POOL_KEEPIDLE 60
+#define AI_POOL_KEEPINTVL 30
 
-    json_object_put(root);
-    return -1;
-}
+struct ai_pool_slot {
+    char *url;                  /* endpoint this handle is bound to */
+    CURL *handle;
+    int in_use;
+    unsigned long requests;
+};
 
-/* Send query to AI service */
-static int send_ai_query(const char *query, const char *model, int timeout, char **response) {
-    CURL *curl;
-    CURLcode res;
-    struct ai_response chunk = {0};
-    struct curl_slist *headers = NULL;
-    char *json_data;
-    char auth_header[512];
-    const char *api_key;
-    const char *api_url;
-    struct timeval start_time, end_time;
-    double elapsed_ms;
+static struct ai_pool_slot ai_pool[AI_POOL_SLOTS];
+static CURLSH *ai_share;
+static pthread_mutex_t ai_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ai_share_locks[CURL_LOCK_DATA_LAST];
+static pthread_once_t ai_pool_once = PTHREAD_ONCE_INIT;
+static unsigned long ai_pool_reuses;
+static unsigned long ai_pool_creates;
 
-    /* Get timing */
-    gettimeofday(&start_time, NULL);
+static void ai_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void)handle; (void)access; (void)userptr;
+    pthread_mutex_lock(&ai_share_locks[data]);
+}
 
-    /* Initialize curl */
-    curl = curl_easy_init();
-    if (!curl) {
-        return -1;
-    }
+static void ai_share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    (void)handle; (void)userptr;
+    pthread_mutex_unlock(&ai_share_locks[data]);
+}
 
-    /* Prepare API credentials and URL */
-    api_key = getenv("ANTHROPIC_API_KEY");
-    if (!api_key) {
-        api_key = getenv("OPENAI_API_KEY");
-        api_url = "https://api.openai.com/v1/chat/completions";
-        snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", api_key);
-    } else {
-        api_url = "https://api.anthropic.com/v1/messages";
-        snprintf(auth_header, sizeof(auth_header), "x-api-key: %s", api_key);
-    }
+/* Release every pooled handle; registered with atexit() */
+static void ai_pool_cleanup(void) {
+    int i;
 
-    if (!api_key) {
-        curl_easy_cleanup(curl);
-        *response = strdup("Error: No API key found. Set ANTHROPIC_API_KEY or OPENAI_API_KEY environment variable.");
-        return -1;
+    pthread_mutex_lock(&ai_pool_mutex);
+    for (i = 0; i < AI_POOL_SLOTS; i++) {
+        if (ai_pool[i].handle && !ai_pool[i].in_use) {
+            curl_easy_cleanup(ai_pool[i].handle);
+            free(ai_pool[i].url);
+            ai_pool[i].handle = NULL;
+            ai_pool[i].url = NULL;
+        }
     }
+    if (ai_share) {
+        curl_share_cleanup(ai_share);
+        ai_share = NULL;
+    }
+    pthread_mutex_unlock(&ai_pool_mutex);
+}
 
-    /* Prepare JSON payload */
-    json_object *root = json_object_new_object();
-    json_object *model_obj = json_object_new_string(model ? model : "claude-3-sonnet-20240229");
-    json_object *max_tokens = json_object_new_int(1000);
-    json_object *messages = json_object_new_array();
-    json_object *message = json_object_new_object();
-    json_object *role = json_object_new_string("user");
-    json_object *content = json_object_new_string(query);
-
-    json_object_object_add(message, "role", role);
-    json_object_object_add(message, "content", content);
-    json_object_array_add(messages, message);
+static void ai_pool_init_once(void) {
+    int i;
 
-    json_object_object_add(root, "model", model_obj);
-    json_object_object_add(root, "max_tokens", max_tokens);
-    json_object_object_add(root, "messages", messages);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
 
-    json_data = (char*)json_object_to_json_string(root);
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&ai_share_locks[i], NULL);
+    }
 
-    /* Set curl options */
-    curl_easy_setopt(curl, CURLOPT_URL, api_url);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "ANBS/1.0");
+    ai_share = curl_share_init();
+    if (ai_share) {
+        curl_share_setopt(ai_share, CURLSHOPT_LOCKFUNC, ai_share_lock);
+        curl_share_setopt(ai_share, CURLSHOPT_UNLOCKFUNC, ai_share_unlock);
+        curl_share_setopt(ai_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(ai_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        curl_share_setopt(ai_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
 
-    /* Set headers */
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, auth_header);
-    headers = curl_slist_append(headers, "anthropic-version: 2023-06-01");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    atexit(ai_pool_cleanup);
+}
 
-    /* Update display with processing status */
-    if (g_anbs_display) {
-        anbs_status_write(g_anbs_display, "Processing AI query...");
-        anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_STATUS);
+/* Options every pooled handle carries; reapplied after curl_easy_reset() */
+static void ai_pool_apply_defaults(CURL *curl) {
+    if (ai_share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, ai_share);
     }
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, (long)AI_POOL_KEEPIDLE);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, (long)AI_POOL_KEEPINTVL);
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, (long)AI_POOL_DNS_TTL);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+}
 
-    /* Perform the request */
-    res = curl_easy_perform(curl);
-
-    /* Calculate response time */
-    gettimeofday(&end_time, NULL);
-    elapsed_ms = (end_time.tv_sec - start_time.tv_sec) * 1000.0 +
-                 (end_time.tv_usec - start_time.tv_usec) / 1000.0;
+/* Get a warm handle for URL.  Falls back to a throwaway handle when every
+   slot for the endpoint is busy. */
+static CURL *ai_pool_acquire(const char *url) {
+    CURL *curl = NULL;
+    int i, free_slot = -1;
 
-    /* Clean up */
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-    json_object_put(root);
+    pthread_once(&ai_pool_once, ai_pool_init_once);
 
-    if (res != CURLE_OK) {
-        if (chunk.memory) {
-            free(chunk.memory);
+    pthread_mutex_lock(&ai_pool_mutex);
+    for (i = 0; i < AI_POOL_SLOTS; i++) {
+        if (ai_pool[i].in_use) {
+            continue;
+        }
+        if (ai_pool[i].handle && ai_pool[i].url && strcmp(ai_pool[i].url, url) == 0) {
+            /* Reset clears per-request options but keeps the connection
+               cache, so the next perform reuses the open socket. */
+            curl_easy_reset(ai_pool[i].handle);
+            ai_pool[i].in_use = 1;
+            ai_pool[i].requests++;
+            ai_pool_reuses++;
+            curl = ai_pool[i].handle;
+            break;
+        }
+        if (free_slot < 0 && !ai_pool[i].handle) {
+            free_slot = i;
         }
-        *response = strdup(curl_easy_strerror(res));
-        return -1;
     }
 
-    /* Parse response */
-    char *ai_text = NULL;
-    if (parse_ai_response(chunk.memory, &ai_text) == 0 && ai_text) {
-        *response = ai_text;
-
-        /* Update health monitoring with response time */
-        if (g_anbs_display && elapsed_ms < 50.0) {
-            char status_msg[256];
-            snprintf(status_msg, sizeof(status_msg), "AI response: %.1fms (target: <50ms)", elapsed_ms);
-            anbs_status_write(g_anbs_display, status_msg);
+    if (!curl) {
+        curl = curl_easy_init();
+        /* The URL may come from a shell variable that changes later, so
+           the slot keeps its own copy */
+        if (curl && free_slot >= 0 && (ai_pool[free_slot].url = strdup(url))) {
+            ai_pool[free_slot].handle = curl;
+            ai_pool[free_slot].in_use = 1;
+            ai_pool[free_slot].requests = 1;
+        }
+        if (curl) {
+            ai_pool_creates++;
         }
+    }
+    pthread_mutex_unlock(&ai_pool_mutex);
 
-        free(chunk.memory);
-        return 0;
-    } else {
-        *response = chunk.memory ? chunk.memory : strdup("Error: Could not parse AI response");
-        return -1;
+    if (curl) {
+        ai_pool_apply_defaults(curl);
     }
+    return curl;
 }
 
-/* Health check for AI service */
-static int ai_health_check(void) {
-    char *response = NULL;
-    int result = send_ai_query("ping", NULL, 5, &response);
+/* Hand a handle back to the pool, or destroy it if it was a spare */
+static void ai_pool_release(CURL *curl) {
+    int i;
 
-    if (g_anbs_display) {
-        if (result == 0) {
-            anbs_status_write(g_anbs_display, "AI service: Online ✅");
-        } else {
-            anbs_status_write(g_anbs_display, "AI service: Offline ❌");
+    pthread_mutex_lock(&ai_pool_mutex);
+    for (i = 0; i < AI_POOL_SLOTS; i++) {
+        if (ai_pool[i].handle == curl) {
+            ai_pool[i].in_use = 0;
+            pthread_mutex_unlock(&ai_pool_mutex);
+            return;
         }
-        anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_STATUS);
     }
+    pthread_mutex_unlock(&ai_pool_mutex);
 
-    if (response) {
-        printf("AI Health Check: %s\n", result == 0 ? "ONLINE" : "OFFLINE");
-        if (result != 0) {
-            printf("Error: %s\n", response);
+    curl_easy_cleanup(curl);
+}
+
+/* Drop every pooled handle without closing it.  Used in a forked child,
+   where tearing down the connections would also end the parent's TLS
+   sessions. */
+static void ai_pool_forget(void) {
+    memset(ai_pool, 0, sizeof(ai_pool));
+    ai_share = NULL;
+}
+
+/* Background connection warm-up (ANBS_PREWARM) */
+#define AI_PREWARM_WINDOW 300       /* seconds to keep warmed connections hot */
+#define AI_PREWARM_INTERVAL 30      /* seconds between keep-alive touches */
+
+static volatile int ai_prewarm_stop;
+
+/* Touch every configured provider endpoint with a HEAD request.  That
+   resolves the host, completes the TCP and TLS handshakes and leaves the
+   connection in the shared cache for the next real query. */
+static void ai_prewarm_touch(void) {
+    char *urls[8];
+    CURL *curl;
+    int i, n = 0;
+
+    for (i = 0; ai_providers[i].name && n < 8; i++) {
+        if (getenv(ai_providers[i].key_env) && (urls[n] = strdup(ai_provider_url(&ai_providers[i])))) {
+            n++;
         }
-        free(response);
     }
 
-    return result;
+    for (i = 0; i < n; i++) {
+        curl = ai_prewarm_stop ? NULL : ai_pool_acquire(urls[i]);
+        if (!curl) {
+            free(urls[i]);
+            continue;
+        }
+        curl_easy_setopt(curl, CURLOPT_URL, urls[i]);
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+        curl_easy_setopt(curl, CURLOPT_USERAGENT, "ANBS/1.0");
+        curl_easy_perform(curl);     /* the status code is irrelevant */
+        ai_pool_release(curl);
+        free(urls[i]);
+    }
 }
 
-/* Parse command line options for @vertex */
-static int parse_ai_options(WORD_LIST *list, struct ai_options *opts) {
-    WORD_LIST *l;
+static void *ai_prewarm_thread(void *arg) {
+    long window = (long)(intptr_t)arg;
+    time_t until = time(NULL) + window;
 
-    /* Initialize options */
-    memset(opts, 0, sizeof(struct ai_options));
-    opts->timeout = 30; /* Default timeout */
+    anbs_thread_name("anbs-prewarm");
+    ai_prewarm_touch();
 
-    for (l = list; l; l = l->next) {
-        if (STREQ(l->word->word, "--health")) {
-            opts->health_check = 1;
-        } else if (STREQ(l->word->word, "--stream")) {
-            opts->stream_mode = 1;
-        } else if (strncmp(l->word->word, "--timeout=", 10) == 0) {
-            opts->timeout = atoi(l->word->word + 10);
-            if (opts->timeout <= 0) opts->timeout = 30;
-        } else if (strncmp(l->word->word, "--model=", 8) == 0) {
-            opts->model = l->word->word + 8;
-        } else if (l->word->word[0] != '-') {
-            /* This is the query text */
-            opts->query = l->word->word;
-            break;
+    while (!ai_prewarm_stop && time(NULL) + AI_PREWARM_INTERVAL < until) {
+        sleep(AI_PREWARM_INTERVAL);
+        if (!ai_prewarm_stop) {
+            ai_prewarm_touch();
         }
     }
 
-    return 0;
+    return NULL;
 }
 
-/* Main @vertex command implementation */
-int vertex_builtin(WORD_LIST *list) {
-    struct ai_options opts;
-    char *response = NULL;
-    int result;
+static void ai_prewarm_atexit(void) {
+    ai_prewarm_stop = 1;
+}
 
-    /* Parse options */
-    if (parse_ai_options(list, &opts) != 0) {
-        builtin_usage();
-        return EX_USAGE;
+/* Called once at shell startup, after the startup files.  When the shell
+   variable ANBS_PREWARM is set to a non-zero value, warm the provider
+   connections on a detached thread and keep them alive for
+   ANBS_PREWARM_WINDOW seconds (default 300), and start opening the AI
+   memory the command history goes to.  Otherwise nothing in ai_core
+   starts until something uses it. */
+void anbs_ai_prewarm(void) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    char *value;
+    long window = AI_PREWARM_WINDOW;
+
+    value = get_string_value("ANBS_PREWARM");
+    if (!value || !*value || STREQ(value, "0")) {
+        return;
     }
 
-    /* Handle health check */
-    if (opts.health_check) {
-        return ai_health_check() == 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+    value = get_string_value("ANBS_PREWARM_WINDOW");
+    if (value && *value && atol(value) > 0) {
+        window = atol(value);
     }
 
-    /* Validate query */
-    if (!opts.query || strlen(opts.query) == 0) {
-        builtin_error("@vertex: missing query text");
-        return EX_USAGE;
+    value = get_string_value("ANBS_MEMORY_HISTORY");
+    if (!value || !STREQ(value, "0")) {
+        anbs_memory_prewarm();
     }
 
-    /* Send query to AI */
-    result = send_ai_query(opts.query, opts.model, opts.timeout, &response);
+    pthread_once(&ai_pool_once, ai_pool_init_once);
+    atexit(ai_prewarm_atexit);
 
-    if (result == 0 && response) {
-        /* Display response in terminal */
-        printf("🤖 Vertex: %s\n", response);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, ai_prewarm_thread, (void *)(intptr_t)window) != 0) {
+        ANBS_DEBUG_LOG("Could not start connection prewarm thread");
+    }
+    pthread_attr_destroy(&attr);
+}
 
-        /* Also display in AI chat panel if available */
-        if (g_anbs_display) {
-            char formatted_response[4096];
-            snprintf(formatted_response, sizeof(formatted_response), "🤖 Vertex: %s\n", response);
-            anbs_ai_chat_write(g_anbs_display, formatted_response);
-            anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_AI_CHAT);
-        }
+/* Pool counters for the optimizer and stats reporting */
+int anbs_ai_pool_get_stats(int *pooled_handles, int *busy_handles, unsigned long *reuses, unsigned long *creates) {
+    int i, pooled = 0, busy = 0;
 
-        free(response);
-        return EXECUTION_SUCCESS;
-    } else {
-        /* Handle error */
-        if (response) {
-            builtin_error("@vertex: %s", response);
-            free(response);
-        } else {
-            builtin_error("@vertex: failed to get AI response");
+    pthread_mutex_lock(&ai_pool_mutex);
+    for (i = 0; i < AI_POOL_SLOTS; i++) {
+        if (ai_pool[i].handle) {
+            pooled++;
+            if (ai_pool[i].in_use) {
+                busy++;
+            }
         }
-        return EXECUTION_FAILURE;
     }
-}
+    if (pooled_handles) *pooled_handles = pooled;
+    if (busy_handles) *busy_handles = busy;
+    if (reuses) *reuses = ai_pool_reuses;
+    if (creates) *creates = ai_pool_creates;
+    pthread_mutex_unlock(&ai_pool_mutex);
 
-/* @vertex command structure */
-struct builtin vertex_struct = {
-    "vertex",           /* builtin name */
-    vertex_builtin,     /* function implementing the builtin */
-    BUILTIN_ENABLED,    /* initial flags for builtin */
-    (char **)0,         /* array of long documentation strings */
-    "@vertex query [options] - Send query to AI assistant",  /* short doc */
-    0                   /* reserved for internal use */
-};
+    return 0;
+}
 
-/* Alternative @memory command implementation */
-int memory_builtin(WORD_LIST *list) {
-    char *query = NULL;
+/* Append LEN bytes to a response buffer, doubling its capacity as needed
+   so a large body costs O(n) copying rather than one realloc per chunk */
+static int ai_response_append(struct ai_response *buf, const char *data, size_t len) {
+    size_t need = buf->size + len + 1;
+    size_t capacity;
+    char *ptr;
 
-    if (list && list->word) {
-        query = list->word->word;
+    if (need > buf->capacity) {
+        capacity = buf->capacity ? buf->capacity : AI_RESPONSE_INITIAL;
+        while (capacity < need) {
+            capacity *= 2;
+        }
+        ptr = realloc(buf->memory, capacity);
+        if (!ptr) {
+            return -1;
+        }
+        buf->memory = ptr;
+        buf->capacity = capacity;
     }
 
-    if (!query || strlen(query) == 0) {
-        builtin_error("@memory: missing search query");
-        return EX_USAGE;
-    }
+    memcpy(buf->memory + buf->size, data, len);
+    buf->size += len;
+    buf->memory[buf->size] = 0;
 
-    /* For now, pass to vertex with memory context */
-    char memory_query[2048];
-    snprintf(memory_query, sizeof(memory_query),
-             "Search my command history and conversation memory for: %s", query);
+    return 0;
+}
+
+/* Write callback for curl responses */
+static size_t write_response_callback(void *contents, size_t size, size_t nmemb, struct ai_response *response) {
+    size_t realsize = size * nmemb;
 
-    /* Update word list with new query */
-    WORD_LIST new_list;
-    WORD_DESC new_word;
-    new_word.word = memory_query;
-    new_word.flags = 0;
-    new_list.word = &new_word;
-    new_list.next = NULL;
+    if (ai_response_append(response, contents, realsize) != 0) {
+        /* Out of memory */
+        printf("Not enough memory (realloc returned NULL)\n");
+        return 0;
+    }
 
-    return vertex_builtin(&new_list);
+    return realsize;
 }
 
-struct builtin memory_struct = {
-    "memory",
-    memory_builtin,
-    BUILTIN_ENABLED,
-    (char **)0,
-    "@memory query - Search conversation history and memory",
-    0
+/* Streamed text is drawn by a thread of its own, so a slow terminal (a
+   long SSH hop, a tty stopped with ^S) never holds up the socket.  The
+   transfer decodes each event and appends its text to QUEUED; the drawing
+   thread swaps QUEUED out and writes it with the lock dropped, at most
+   once a frame, so deltas that arrive while the terminal is busy coalesce
+   into one write.  QUEUED is bounded: once it holds LIMIT bytes the write
+   callback pauses the transfer instead of waiting, and ai_stream_perform()
+   resumes it when the terminal has drawn half of that. */
+#define AI_STREAM_BUFFER_DEFAULT (64 * 1024)
+
+struct ai_stream_render {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int running;                    /* thread started; otherwise draw inline */
+    int inline_only;                /* thread disabled or could not start */
+    int done;                       /* transfer over, draw what is left */
+    int paused;                     /* transfer paused on a full buffer (transfer side only) */
+    int drawn;                      /* something is on the terminal */
+    size_t limit;                   /* bytes QUEUED may hold before pausing */
+    long frame_ms;                  /* shortest gap between two writes */
+    struct ai_response queued;      /* decoded text not yet drawn */
+    struct ai_response frame;       /* text being drawn, drawing side only */
+    struct ai_response line;        /* partial line not yet in the chat panel */
 };
 
-/* @analyze command implementation */
-int analyze_builtin(WORD_LIST *list) {
-    char *filename = NULL;
+/* Incremental state for server-sent-event streaming */
+struct ai_stream {
+    struct ai_response pending;     /* bytes not yet terminated by a newline */
+    struct ai_response text;        /* assistant text accumulated so far */
+    struct ai_stream_render render;
+};
 
-    if (list && list->word) {
-        filename = list->word->word;
-    }
+/* Pull the text delta out of one SSE data payload.  Handles the Anthropic
+   content_block_delta event and the OpenAI chat.completion.chunk shape. */
+static const char *ai_stream_delta(json_object *event) {
+    json_object *delta, *text, *choices, *choice;
 
-    if (!filename || strlen(filename) == 0) {
-        builtin_error("@analyze: missing filename");
-        return EX_USAGE;
+    if (json_object_object_get_ex(event, "delta", &delta) &&
+        json_object_object_get_ex(delta, "text", &text)) {
+        return json_object_get_string(text);
     }
 
-    /* Read file and analyze */
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        builtin_error("@analyze: cannot open file '%s'", filename);
-        return EXECUTION_FAILURE;
+    if (json_object_object_get_ex(event, "choices", &choices) &&
+        json_object_is_type(choices, json_type_array) &&
+        json_object_array_length(choices) > 0) {
+        choice = json_object_array_get_idx(choices, 0);
+        if (json_object_object_get_ex(choice, "delta", &delta) &&
+            json_object_object_get_ex(delta, "content", &text)) {
+            return json_object_get_string(text);
+        }
     }
 
-    /* Read file content */
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    return NULL;
+}
 
-    if (file_size > 100000) {  /* 100KB limit */
-        fclose(file);
-        builtin_error("@analyze: file too large (max 100KB)");
-        return EXECUTION_FAILURE;
-    }
+/* Write TEXT to the terminal and its completed lines to the AI chat
+   panel; FINAL sends the last partial line too */
+static void ai_stream_draw(struct ai_stream_render *render, const char *text, size_t len, int final) {
+    char *start, *nl;
 
-    char *file_content = malloc(file_size + 1);
-    if (!file_content) {
-        fclose(file);
-        builtin_error("@analyze: out of memory");
-        return EXECUTION_FAILURE;
+    if (len) {
+        if (!render->drawn) {
+            fputs("🤖 Vertex: ", stdout);
+            render->drawn = 1;
+        }
+        fwrite(text, 1, len, stdout);
+        fflush(stdout);
     }
 
-    fread(file_content, 1, file_size, file);
-    file_content[file_size] = '\0';
-    fclose(file);
+    if (!g_anbs_display || (len && ai_response_append(&render->line, text, len) != 0) ||
+        !render->line.memory) {
+        return;
+    }
 
-    /* Create analysis query */
-    char analysis_query[file_size + 512];
-    snprintf(analysis_query, sizeof(analysis_query),
-             "Analyze this file (%s):\n\n%s\n\nProvide insights about structure, purpose, and potential improvements.",
-             filename, file_content);
+    start = render->line.memory;
+    while ((nl = strchr(start, '\n')) != NULL) {
+        *nl = '\0';
+        anbs_ai_chat_write(g_anbs_display, start);
+        start = nl + 1;
+    }
+    if (final && *start) {
+        anbs_ai_chat_write(g_anbs_display, start);
+        start += strlen(start);
+    }
+    render->line.size -= start - render->line.memory;
+    memmove(render->line.memory, start, render->line.size + 1);
+}
+
+/* The drawing thread: waits for text, then writes everything queued at
+   once, no more than once a frame */
+static void *ai_stream_render_main(void *arg) {
+    struct ai_stream_render *render = (struct ai_stream_render *)arg;
+    struct ai_response swap;
+    struct timespec until;
+    long long now, last = 0;
+    long wait_ms;
+
+    pthread_mutex_lock(&render->lock);
+    for (;;) {
+        while (render->queued.size == 0 && !render->done) {
+            pthread_cond_wait(&render->wake, &render->lock);
+        }
+        if (render->queued.size == 0) {
+            break;
+        }
+
+        /* Hold the frame back until the last one is a frame old, unless
+           the transfer is paused waiting for us or has finished; the
+           first frame goes straight out */
+        now = anbs_display_now_ms();
+        wait_ms = render->frame_ms - (long)(now - last);
+        if (wait_ms > 0 && !render->done && render->queued.size < render->limit) {
+            clock_gettime(CLOCK_MONOTONIC, &until);
+            until.tv_sec += wait_ms / 1000;
+            until.tv_nsec += (wait_ms % 1000) * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&render->wake, &render->lock, &until);
+            continue;
+        }
+
+        swap = render->frame;
+        render->frame = render->queued;
+        render->queued = swap;
+        render->queued.size = 0;
+        pthread_mutex_unlock(&render->lock);
+
+        PROBE2(anbs, stream__frame, render->frame.size, (long)(now - last));
+        ai_stream_draw(render, render->frame.memory, render->frame.size, 0);
+        last = now;
+
+        pthread_mutex_lock(&render->lock);
+    }
+    pthread_mutex_unlock(&render->lock);
+
+    return NULL;
+}
+
+/* Start the drawing thread, or settle for drawing from the transfer when
+   ANBS_STREAM_BUFFER=0 or the thread cannot start */
+static void ai_stream_render_start(struct ai_stream_render *render) {
+    pthread_condattr_t attr;
+    const char *value;
+    long n;
+
+    value = getenv("ANBS_STREAM_BUFFER");
+    n = value && *value ? strtol(value, NULL, 10) : AI_STREAM_BUFFER_DEFAULT;
+    value = getenv("ANBS_REFRESH_INTERVAL_MS");
+    render->frame_ms = value && atoi(value) > 0 ? atoi(value) : ANBS_REFRESH_INTERVAL_MS;
+    if (n <= 0) {
+        render->inline_only = 1;
+        return;
+    }
+    render->limit = (size_t)n;
+
+    pthread_mutex_init(&render->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&render->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&render->thread, NULL, ai_stream_render_main, render) != 0) {
+        pthread_cond_destroy(&render->wake);
+        pthread_mutex_destroy(&render->lock);
+        render->inline_only = 1;
+        return;
+    }
+    render->running = 1;
+}
+
+/* Hand LEN bytes of decoded text to the terminal.  Never waits for it:
+   the drawing thread is woken only when it may be asleep on an empty
+   buffer or the buffer has filled, otherwise the text rides along with
+   the next frame. */
+static void ai_stream_emit(struct ai_stream_render *render, const char *text, size_t len) {
+    int wake;
+
+    if (!render->running && !render->inline_only) {
+        ai_stream_render_start(render);
+    }
+    if (!render->running) {
+        ai_stream_draw(render, text, len, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&render->lock);
+    wake = render->queued.size == 0;
+    if (ai_response_append(&render->queued, text, len) == 0 && render->queued.size >= render->limit) {
+        wake = 1;
+    }
+    if (wake) {
+        pthread_cond_signal(&render->wake);
+    }
+    pthread_mutex_unlock(&render->lock);
+}
+
+/* Bytes of text waiting for the drawing thread */
+static size_t ai_stream_queued(struct ai_stream_render *render) {
+    size_t queued;
+
+    if (!render->running) {
+        return 0;
+    }
+    pthread_mutex_lock(&render->lock);
+    queued = render->queued.size;
+    pthread_mutex_unlock(&render->lock);
+
+    return queued;
+}
+
+/* Draw whatever is still queued, then stop the drawing thread */
+static void ai_stream_render_finish(struct ai_stream_render *render) {
+    if (render->running) {
+        pthread_mutex_lock(&render->lock);
+        render->done = 1;
+        pthread_cond_signal(&render->wake);
+        pthread_mutex_unlock(&render->lock);
+        pthread_join(render->thread, NULL);
+        pthread_cond_destroy(&render->wake);
+        pthread_mutex_destroy(&render->lock);
+        render->running = 0;
+    }
+    ai_stream_draw(render, NULL, 0, 1);
+    if (render->drawn) {
+        putchar('\n');
+        fflush(stdout);
+    }
+
+    free(render->queued.memory);
+    free(render->frame.memory);
+    free(render->line.memory);
+}
+
+/* Handle one complete SSE line */
+static void ai_stream_line(struct ai_stream *stream, char *line) {
+    json_object *event;
+    const char *delta;
+    size_t len;
+
+    len = strlen(line);
+    if (len && line[len - 1] == '\r') {
+        line[--len] = '\0';
+    }
+
+    /* Only data fields carry payload; event names and comments are skipped */
+    if (strncmp(line, "data:", 5) != 0) {
+        return;
+    }
+    line += 5;
+    while (*line == ' ') {
+        line++;
+    }
+    if (*line == '\0' || strcmp(line, "[DONE]") == 0) {
+        return;
+    }
+
+    event = json_tokener_parse(line);
+    if (!event) {
+        return;
+    }
+
+    delta = ai_stream_delta(event);
+    if (delta && *delta) {
+        len = strlen(delta);
+        ai_response_append(&stream->text, delta, len);
+        ai_stream_emit(&stream->render, delta, len);
+    }
+
+    json_object_put(event);
+}
+
+/* Write callback for streaming responses; splits the body into SSE lines */
+static size_t write_stream_callback(void *contents, size_t size, size_t nmemb, struct ai_stream *stream) {
+    size_t realsize = size * nmemb;
+    char *line, *nl;
+    size_t consumed;
+
+    /* The terminal is a full buffer behind: stop reading, so TCP pushes
+       back on the sender, rather than wait here.  libcurl hands these
+       bytes over again once ai_stream_perform() resumes the transfer. */
+    if (stream->render.running && ai_stream_queued(&stream->render) >= stream->render.limit) {
+        stream->render.paused = 1;
+        PROBE1(anbs, stream__pause, stream->render.limit);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    if (ai_response_append(&stream->pending, contents, realsize) != 0) {
+        return 0;
+    }
+
+    line = stream->pending.memory;
+    while ((nl = memchr(line, '\n', stream->pending.size - (line - stream->pending.memory))) != NULL) {
+        *nl = '\0';
+        ai_stream_line(stream, line);
+        line = nl + 1;
+    }
+
+    /* Keep the unterminated tail for the next chunk */
+    consumed = line - stream->pending.memory;
+    if (consumed) {
+        memmove(stream->pending.memory, line, stream->pending.size - consumed + 1);
+        stream->pending.size -= consumed;
+    }
+
+    return realsize;
+}
+
+/* Lazy extraction of the assistant text.  Each provider names the path
+   to its text in PATH syntax: members joined by `.', `[0]' for the first
+   element of an array and `[]' for every element, whose strings are
+   joined.  The scanner walks only that path through the body, skipping
+   every other value without looking inside it, and unescapes the one
+   string it lands on; usage, metadata and the rest of the document are
+   never parsed.  A body that doesn't have the path, or that goes wrong
+   on the way, is left to parse_ai_response() and a full parse. */
+static const char *ai_scan_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+/* Past the closing quote of the string whose opening quote is at P */
+static const char *ai_scan_skip_string(const char *p, const char *end) {
+    const char *q, *b;
+
+    for (p++; p < end; p = q + 1) {
+        q = memchr(p, '"', end - p);
+        if (!q) {
+            return NULL;
+        }
+        /* The quote closes the string unless an odd run of
+           backslashes escapes it */
+        for (b = q; b > p && b[-1] == '\\'; b--)
+            ;
+        if (((q - b) & 1) == 0) {
+            return q + 1;
+        }
+    }
+    return NULL;
+}
+
+/* Past the value starting at P */
+static const char *ai_scan_skip(const char *p, const char *end) {
+    int depth = 0;
+
+    if (p < end && *p != '"' && *p != '{' && *p != '[') {
+        while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+               *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t') {
+            p++;
+        }
+        return p;
+    }
+    while (p < end) {
+        if (*p == '"') {
+            if (!(p = ai_scan_skip_string(p, end))) {
+                return NULL;
+            }
+        } else {
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if (*p == '}' || *p == ']') {
+                depth--;
+            }
+            p++;
+        }
+        if (depth == 0) {
+            return p;
+        }
+        /* Only quotes and brackets matter inside a container; the body
+           is NUL-terminated, so strcspn stops at END at the latest */
+        p += strcspn(p, "\"{}[]");
+    }
+    return NULL;
+}
+
+/* The value of member NAME, LEN bytes, of the object at P */
+static const char *ai_scan_member(const char *p, const char *end, const char *name, size_t len) {
+    const char *key;
+    int match;
+
+    if (p >= end || *p != '{') {
+        return NULL;
+    }
+    for (p = ai_scan_ws(p + 1, end); p < end && *p == '"'; p = ai_scan_ws(p + 1, end)) {
+        key = p + 1;
+        if (!(p = ai_scan_skip_string(p, end))) {
+            return NULL;
+        }
+        match = (size_t)(p - 1 - key) == len && memcmp(key, name, len) == 0;
+        p = ai_scan_ws(p, end);
+        if (p >= end || *p != ':') {
+            return NULL;
+        }
+        p = ai_scan_ws(p + 1, end);
+        if (match) {
+            return p;
+        }
+        if (!(p = ai_scan_skip(p, end))) {
+            return NULL;
+        }
+        p = ai_scan_ws(p, end);
+        if (p >= end || *p != ',') {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static int ai_scan_hex4(const char *p, const char *end, unsigned int *value) {
+    int i;
+
+    if (end - p < 4) {
+        return -1;
+    }
+    for (*value = 0, i = 0; i < 4; i++) {
+        char c = p[i];
+
+        *value <<= 4;
+        if (c >= '0' && c <= '9') {
+            *value |= c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            *value |= (c | 0x20) - 'a' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Append the string at P, unescaped, to OUT */
+static int ai_scan_string(const char *p, const char *end, struct ai_response *out) {
+    const char *close = ai_scan_skip_string(p, end), *bs;
+    unsigned int cp, low;
+    char utf8[4];
+    int n;
+
+    if (!close) {
+        return -1;
+    }
+    for (p++, close--; p < close; ) {
+        /* Runs between escapes go over whole */
+        bs = memchr(p, '\\', close - p);
+        if (!bs) {
+            bs = close;
+        }
+        if (bs > p && ai_response_append(out, p, bs - p) != 0) {
+            return -1;
+        }
+        if (bs == close) {
+            break;
+        }
+        p = bs + 2;
+        switch (bs[1]) {
+        case 'n': n = 1; utf8[0] = '\n'; break;
+        case 't': n = 1; utf8[0] = '\t'; break;
+        case 'r': n = 1; utf8[0] = '\r'; break;
+        case 'b': n = 1; utf8[0] = '\b'; break;
+        case 'f': n = 1; utf8[0] = '\f'; break;
+        case '"': case '\\': case '/': n = 1; utf8[0] = bs[1]; break;
+        case 'u':
+            if (ai_scan_hex4(p, close, &cp) != 0) {
+                return -1;
+            }
+            p += 4;
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                /* A surrogate pair spells one code point past U+FFFF */
+                if (close - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+                    ai_scan_hex4(p + 2, close, &low) != 0 || low < 0xdc00 || low >= 0xe000) {
+                    return -1;
+                }
+                p += 6;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            } else if (cp >= 0xdc00 && cp < 0xe000) {
+                return -1;
+            }
+            if (cp < 0x80) {
+                n = 1;
+                utf8[0] = cp;
+            } else if (cp < 0x800) {
+                n = 2;
+                utf8[0] = 0xc0 | (cp >> 6);
+                utf8[1] = 0x80 | (cp & 0x3f);
+            } else if (cp < 0x10000) {
+                n = 3;
+                utf8[0] = 0xe0 | (cp >> 12);
+                utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+                utf8[2] = 0x80 | (cp & 0x3f);
+            } else {
+                n = 4;
+                utf8[0] = 0xf0 | (cp >> 18);
+                utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+                utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+                utf8[3] = 0x80 | (cp & 0x3f);
+            }
+            break;
+        default:
+            return -1;
+        }
+        if (ai_response_append(out, utf8, n) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Follow PATH from the value at P, appending the strings it reaches to
+   OUT.  Returns 1 when at least one was found, 0 when none, -1 when the
+   body is malformed along the way. */
+static int ai_scan_path(const char *p, const char *end, const char *path, struct ai_response *out) {
+    size_t len;
+    int found, r;
+
+    if (*path == '\0') {
+        if (p >= end || *p != '"') {
+            return 0;
+        }
+        return ai_scan_string(p, end, out) == 0 ? 1 : -1;
+    }
+
+    if (*path == '[') {
+        int every = path[1] == ']';
+
+        path += every ? 2 : 3;      /* only [] and [0] are spelled */
+        path += *path == '.';
+        if (p >= end || *p != '[') {
+            return 0;
+        }
+        p = ai_scan_ws(p + 1, end);
+        if (p < end && *p == ']') {
+            return 0;
+        }
+        for (found = 0; p < end; p = ai_scan_ws(p + 1, end)) {
+            r = ai_scan_path(p, end, path, out);
+            if (r < 0 || (r > 0 && !every)) {
+                return r;
+            }
+            found |= r;
+            if (!every) {
+                return 0;
+            }
+            if (!(p = ai_scan_skip(p, end))) {
+                return -1;
+            }
+            p = ai_scan_ws(p, end);
+            if (p < end && *p == ']') {
+                return found;
+            }
+            if (p >= end || *p != ',') {
+                return -1;
+            }
+        }
+        return -1;
+    }
+
+    len = strcspn(path, ".[");
+    p = ai_scan_member(p, end, path, len);
+    if (!p) {
+        return 0;
+    }
+    path += len;
+    path += *path == '.';
+    return ai_scan_path(p, end, path, out);
+}
+
+/* Pull PROVIDER's assistant text out of BODY, LEN bytes and
+   NUL-terminated, into malloc'd *AI_TEXT without parsing the rest */
+static int ai_extract_text(const struct ai_provider *provider, const char *body, size_t len, char **ai_text) {
+    struct ai_response text = {0};
+    const char *end = body + len;
+
+    if (!provider || !provider->text_path ||
+        ai_scan_path(ai_scan_ws(body, end), end, provider->text_path, &text) <= 0 ||
+        !text.memory) {
+        free(text.memory);
+        return -1;
+    }
+    *ai_text = text.memory;
+    return 0;
+}
+
+/* Pull the assistant text out of a parsed AI API response */
+static int parse_ai_response(json_object *root, char **ai_text) {
+    json_object *content, *choices, *message, *block, *text;
+    const char *response_text = NULL;
+    struct ai_response joined = {0};
+    size_t i, n;
+
+    if (!root) {
+        return -1;
+    }
+
+    /* Try different JSON structures based on AI provider */
+    if (json_object_object_get_ex(root, "content", &content)) {
+        /* Anthropic Claude API structure: an array of content blocks */
+        if (json_object_is_type(content, json_type_array)) {
+            n = json_object_array_length(content);
+            for (i = 0; i < n; i++) {
+                block = json_object_array_get_idx(content, i);
+                if (json_object_object_get_ex(block, "text", &text)) {
+                    response_text = json_object_get_string(text);
+                    ai_response_append(&joined, response_text, strlen(response_text));
+                }
+            }
+            if (joined.memory) {
+                *ai_text = joined.memory;
+                return 0;
+            }
+        }
+        response_text = json_object_get_string(content);
+    } else if (json_object_object_get_ex(root, "choices", &choices) &&
+               json_object_is_type(choices, json_type_array) &&
+               json_object_array_length(choices) > 0) {
+        /* OpenAI API structure */
+        block = json_object_array_get_idx(choices, 0);
+        if (json_object_object_get_ex(block, "message", &message) &&
+            json_object_object_get_ex(message, "content", &text)) {
+            response_text = json_object_get_string(text);
+        }
+    } else if (json_object_object_get_ex(root, "message", &message)) {
+        response_text = json_object_get_string(message);
+    } else if (json_object_object_get_ex(root, "response", &content)) {
+        /* Generic response structure */
+        response_text = json_object_get_string(content);
+    } else {
+        /* Fallback: use whole response as text */
+        response_text = json_object_get_string(root);
+    }
+
+    if (response_text) {
+        *ai_text = strdup(response_text);
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Default options for a query */
+static void ai_options_init(struct ai_options *opts) {
+    memset(opts, 0, sizeof(struct ai_options));
+    opts->timeout = 30; /* Default timeout */
+    opts->provider = AI_PROVIDER_AUTO;
+}
+
+/* Resolve the provider for OPTS: an explicit choice, else the first one
+   with an API key in the environment (Anthropic preferred).  Returns NULL
+   when no key is available. */
+static const struct ai_provider *ai_provider_select(const struct ai_options *opts) {
+    int i;
+
+    if (opts->provider >= 0) {
+        return &ai_providers[opts->provider];
+    }
+    for (i = 0; ai_providers[i].name; i++) {
+        if (getenv(ai_providers[i].key_env)) {
+            return &ai_providers[i];
+        }
+    }
+    return NULL;
+}
+
+/* Model to request from PROVIDER */
+static const char *ai_model_for(const struct ai_provider *provider, const struct ai_options *opts) {
+    return opts->model ? opts->model : (provider ? provider->default_model : AI_DEFAULT_MODEL);
+}
+
+/* Scope part of the cache key: provider, model and max_tokens.  Responses
+   are only ever shared between prompts with the same scope. */
+static void ai_cache_scope(const struct ai_options *opts, char *scope, size_t size) {
+    const struct ai_provider *provider = ai_provider_select(opts);
+
+    snprintf(scope, size, "%s\x1f%s\x1f%d\x1f", provider ? provider->name : "none",
+             ai_model_for(provider, opts), AI_MAX_TOKENS);
+}
+
+/* Build the cache key for QUERY: the scope followed by the prompt with
+   whitespace runs collapsed, so trivially different spellings of the same
+   question share an entry.  Returns malloc'd storage; *prompt_offset
+   receives the index where the normalized prompt starts. */
+static char *ai_cache_key(const char *query, const struct ai_options *opts, size_t *prompt_offset) {
+    char scope[256];
+    char *key, *p;
+    size_t len;
+    int space = 0;
+
+    ai_cache_scope(opts, scope, sizeof(scope));
+    len = strlen(scope);
+
+    key = malloc(len + strlen(query) + 1);
+    if (!key) {
+        return NULL;
+    }
+
+    memcpy(key, scope, len);
+    p = key + len;
+    if (prompt_offset) {
+        *prompt_offset = len;
+    }
+
+    while (*query && whitespace(*query)) {
+        query++;
+    }
+    for (; *query; query++) {
+        if (whitespace(*query) || *query == '\n') {
+            space = 1;
+            continue;
+        }
+        if (space) {
+            *p++ = ' ';
+            space = 0;
+        }
+        *p++ = *query;
+    }
+    *p = '\0';
+
+    return key;
+}
+
+/* Similarity threshold for the semantic cache tier, from
+   ANBS_SEMANTIC_CACHE_THRESHOLD; 0 when the tier is disabled */
+static float ai_semantic_threshold(void) {
+    const char *value = getenv("ANBS_SEMANTIC_CACHE_THRESHOLD");
+    float threshold;
+
+    if (!value || !*value) {
+        return 0.0;
+    }
+    threshold = strtof(value, NULL);
+    return (threshold > 0.0 && threshold <= 1.0) ? threshold : 0.0;
+}
+
+/* Return a cached response for QUERY, or NULL.  Exact matches are tried
+   first, then (if enabled) the nearest paraphrase in the semantic tier. */
+static char *ai_cache_lookup(const char *query, const struct ai_options *opts) {
+    char *key, *cached;
+    char scope[256], status_msg[256];
+    double age_ms = 0.0;
+    float threshold, similarity = 0.0;
+    size_t prompt_at;
+
+    if (opts->no_cache || anbs_cache_init(0) != 0) {
+        return NULL;
+    }
+
+    key = ai_cache_key(query, opts, &prompt_at);
+    if (!key) {
+        return NULL;
+    }
+    cached = anbs_cache_get(key, &age_ms);
+
+    if (cached) {
+        snprintf(status_msg, sizeof(status_msg), "AI response: cached (age %.0fms)", age_ms);
+    } else if ((threshold = ai_semantic_threshold()) > 0.0) {
+        ai_cache_scope(opts, scope, sizeof(scope));
+        cached = anbs_cache_semantic_get(scope, key + prompt_at, threshold, &similarity);
+        snprintf(status_msg, sizeof(status_msg), "AI response: semantic cache (similarity %.2f)", similarity);
+    }
+    free(key);
+
+    if (cached && g_anbs_display) {
+        anbs_status_write(g_anbs_display, status_msg);
+    }
+
+    return cached;
+}
+
+/* Remember a successful response for QUERY */
+static void ai_cache_store(const char *query, const struct ai_options *opts, const char *response) {
+    char *key;
+    char scope[256];
+    size_t prompt_at;
+
+    if (opts->no_cache || anbs_cache_init(0) != 0) {
+        return;
+    }
+
+    key = ai_cache_key(query, opts, &prompt_at);
+    if (!key) {
+        return;
+    }
+
+    anbs_cache_put(key, response, opts->cache_ttl);
+
+    if (ai_semantic_threshold() > 0.0) {
+        ai_cache_scope(opts, scope, sizeof(scope));
+        anbs_cache_semantic_put(scope, key + prompt_at, response, opts->cache_ttl);
+    }
+    free(key);
+}
+
+/* Claim the fetch for QUERY so concurrent identical requests wait for this
+   one.  Returns the claimed key for ai_flight_end(), or NULL if another
+   fetch was waited on (or caching is off); look in the cache again either
+   way. */
+static char *ai_flight_begin(const char *query, const struct ai_options *opts) {
+    char *key;
+
+    if (opts->no_cache || anbs_cache_init(0) != 0) {
+        return NULL;
+    }
+
+    key = ai_cache_key(query, opts, NULL);
+    if (key && anbs_cache_claim(key) != 1) {
+        free(key);
+        key = NULL;
+    }
+    return key;
+}
+
+/* Release a fetch claimed by ai_flight_begin() */
+static void ai_flight_end(char *key) {
+    if (key) {
+        anbs_cache_release(key);
+        free(key);
+    }
+}
+
+/* Rate limit state a provider reports in its response headers; -1 where
+   a header was absent */
+struct ai_rate_headers {
+    long requests_limit;
+    long requests_remaining;
+    long tokens_limit;
+    long tokens_remaining;
+    double retry_after_ms;
+};
+
+/* Anthropic's and OpenAI's names for the same numbers */
+static const struct {
+    const char *name;
+    size_t offset;
+} ai_rate_fields[] = {
+    { "anthropic-ratelimit-requests-limit", offsetof(struct ai_rate_headers, requests_limit) },
+    { "anthropic-ratelimit-requests-remaining", offsetof(struct ai_rate_headers, requests_remaining) },
+    { "anthropic-ratelimit-tokens-limit", offsetof(struct ai_rate_headers, tokens_limit) },
+    { "anthropic-ratelimit-tokens-remaining", offsetof(struct ai_rate_headers, tokens_remaining) },
+    { "x-ratelimit-limit-requests", offsetof(struct ai_rate_headers, requests_limit) },
+    { "x-ratelimit-remaining-requests", offsetof(struct ai_rate_headers, requests_remaining) },
+    { "x-ratelimit-limit-tokens", offsetof(struct ai_rate_headers, tokens_limit) },
+    { "x-ratelimit-remaining-tokens", offsetof(struct ai_rate_headers, tokens_remaining) },
+    { NULL, 0 }
+};
+
+static void ai_rate_headers_init(struct ai_rate_headers *rate) {
+    rate->requests_limit = rate->requests_remaining = -1;
+    rate->tokens_limit = rate->tokens_remaining = -1;
+    rate->retry_after_ms = -1.0;
+}
+
+/* CURLOPT_HEADERFUNCTION: pick the rate limit headers out of a response */
+static size_t ai_rate_header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+    struct ai_rate_headers *rate = userdata;
+    size_t len = size * nitems, name_len;
+    char value[32];
+    const char *colon = memchr(buffer, ':', len);
+    int i;
+
+    if (!colon) {
+        return len;
+    }
+    name_len = colon - buffer;
+    for (colon++; colon < buffer + len && *colon == ' '; colon++)
+        ;
+    snprintf(value, sizeof(value), "%.*s", (int)(buffer + len - colon), colon);
+
+    if (name_len == 11 && strncasecmp(buffer, "retry-after", 11) == 0) {
+        rate->retry_after_ms = atof(value) * 1000.0;    /* an HTTP date reads as 0 */
+    } else if (name_len == 14 && strncasecmp(buffer, "retry-after-ms", 14) == 0) {
+        rate->retry_after_ms = atof(value);
+    } else {
+        for (i = 0; ai_rate_fields[i].name; i++) {
+            if (strlen(ai_rate_fields[i].name) == name_len &&
+                strncasecmp(buffer, ai_rate_fields[i].name, name_len) == 0) {
+                *(long *)((char *)rate + ai_rate_fields[i].offset) = atol(value);
+                break;
+            }
+        }
+    }
+    return len;
+}
+
+/* Request templates.  Every request to one provider with the same model,
+   max_tokens and stream setting has the same JSON body apart from the
+   prompt, and the same headers.  A template holds the body split around
+   the prompt, already serialized, and the header list, so preparing a
+   request is one escape of the prompt into a recycled buffer.  Templates
+   are reference counted: one that goes stale (a new model or key) while
+   a request still points at its headers is freed by the last release. */
+#define AI_TEMPLATE_SLOTS 8
+#define AI_PAYLOAD_FREE_SLOTS 8
+#define AI_PAYLOAD_KEEP (64 * 1024)     /* larger buffers are not recycled */
+
+struct ai_request_template {
+    const struct ai_provider *provider;
+    char *model;
+    char *api_key;
+    int max_tokens;
+    int stream_mode;
+    char *prefix;               /* body up to the opening quote of the prompt */
+    size_t prefix_len;
+    char *suffix;               /* and from its closing quote on */
+    size_t suffix_len;
+    struct curl_slist *headers;
+    int refs;                   /* the cache's own plus one per request */
+};
+
+static struct ai_request_template *ai_templates[AI_TEMPLATE_SLOTS];
+static unsigned int ai_template_next;   /* slot to replace when all are taken */
+static char *ai_payload_free[AI_PAYLOAD_FREE_SLOTS];
+static size_t ai_payload_free_size[AI_PAYLOAD_FREE_SLOTS];
+static int ai_payload_nfree;
+static pthread_mutex_t ai_template_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes a JSON string can't hold as they are: '"', '\\' and controls */
+#define AI_JSON_ONES ((uint64_t)0x0101010101010101ULL)
+#define AI_JSON_HIGHS ((uint64_t)0x8080808080808080ULL)
+#define AI_JSON_HASZERO(v) (((v) - AI_JSON_ONES) & ~(v) & AI_JSON_HIGHS)
+
+static int ai_json_special_word(uint64_t v) {
+    return (AI_JSON_HASZERO(v ^ (AI_JSON_ONES * '"')) |
+            AI_JSON_HASZERO(v ^ (AI_JSON_ONES * '\\')) |
+            ((v - AI_JSON_ONES * 0x20) & ~v & AI_JSON_HIGHS)) != 0;
+}
+
+/* Longest escape of LEN bytes, for sizing the output */
+#define AI_JSON_ESCAPED_MAX(len) ((len) * 6)
+
+/* Write S, LEN bytes, to OUT as the inside of a JSON string and return
+   the bytes written.  Clean text, nearly all of a prompt, is checked and
+   copied eight bytes at a time; a word holding anything to escape is done
+   byte by byte.  UTF-8 passes through untouched, as json-c leaves it. */
+static size_t ai_json_escape(char *out, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    char *o = out;
+    size_t i = 0, end;
+    uint64_t v;
+
+    while (i < len) {
+        while (i + 8 <= len) {
+            memcpy(&v, s + i, 8);
+            if (ai_json_special_word(v)) {
+                break;
+            }
+            memcpy(o, &v, 8);
+            o += 8;
+            i += 8;
+        }
+        for (end = (i + 8 <= len) ? i + 8 : len; i < end; i++) {
+            unsigned char c = s[i];
+
+            if (c == '"' || c == '\\') {
+                *o++ = '\\';
+                *o++ = c;
+            } else if (c >= 0x20) {
+                *o++ = c;
+            } else if (c == '\n') {
+                *o++ = '\\';
+                *o++ = 'n';
+            } else if (c == '\t') {
+                *o++ = '\\';
+                *o++ = 't';
+            } else if (c == '\r') {
+                *o++ = '\\';
+                *o++ = 'r';
+            } else {
+                memcpy(o, "\\u00", 4);
+                o[4] = hex[c >> 4];
+                o[5] = hex[c & 15];
+                o += 6;
+            }
+        }
+    }
+    return o - out;
+}
+
+static void ai_template_free(struct ai_request_template *tmpl) {
+    curl_slist_free_all(tmpl->headers);
+    free(tmpl->model);
+    free(tmpl->api_key);
+    free(tmpl->prefix);
+    free(tmpl->suffix);
+    free(tmpl);
+}
+
+/* Serialize the fixed parts of a request once */
+static struct ai_request_template *ai_template_build(const struct ai_provider *provider, const char *model,
+                                                     const char *api_key, int max_tokens, int stream_mode) {
+    static const char prefix_format[] = "{\"model\":\"%s\",\"max_tokens\":%d,"
+                                        "\"messages\":[{\"role\":\"user\",\"content\":\"";
+    struct ai_request_template *tmpl = calloc(1, sizeof(*tmpl));
+    char auth_header[512];
+    size_t model_len = strlen(model), size;
+    char *escaped_model = malloc(AI_JSON_ESCAPED_MAX(model_len) + 1);
+
+    if (!tmpl || !escaped_model) {
+        free(tmpl);
+        free(escaped_model);
+        return NULL;
+    }
+    escaped_model[ai_json_escape(escaped_model, model, model_len)] = '\0';
+    size = sizeof(prefix_format) + strlen(escaped_model) + 16;
+    if ((tmpl->prefix = malloc(size))) {
+        tmpl->prefix_len = snprintf(tmpl->prefix, size, prefix_format, escaped_model, max_tokens);
+    }
+    free(escaped_model);
+    tmpl->suffix = strdup(stream_mode ? "\"}],\"stream\":true}" : "\"}]}");
+    tmpl->suffix_len = tmpl->suffix ? strlen(tmpl->suffix) : 0;
+    tmpl->provider = provider;
+    tmpl->model = strdup(model);
+    tmpl->api_key = strdup(api_key);
+    tmpl->max_tokens = max_tokens;
+    tmpl->stream_mode = stream_mode;
+    tmpl->refs = 1;
+
+    snprintf(auth_header, sizeof(auth_header), provider->auth_format, api_key);
+    tmpl->headers = curl_slist_append(tmpl->headers, "Content-Type: application/json");
+    tmpl->headers = curl_slist_append(tmpl->headers, auth_header);
+    tmpl->headers = curl_slist_append(tmpl->headers, "anthropic-version: 2023-06-01");
+    if (stream_mode) {
+        tmpl->headers = curl_slist_append(tmpl->headers, "Accept: text/event-stream");
+    }
+
+    if (!tmpl->prefix || !tmpl->suffix || !tmpl->model || !tmpl->api_key || !tmpl->headers) {
+        ai_template_free(tmpl);
+        return NULL;
+    }
+    return tmpl;
+}
+
+/* Template for a request with these fixed fields, with a reference taken */
+static struct ai_request_template *ai_template_acquire(const struct ai_provider *provider, const char *model,
+                                                       const char *api_key, int max_tokens, int stream_mode) {
+    struct ai_request_template *tmpl = NULL;
+    int i, slot = -1;
+
+    pthread_mutex_lock(&ai_template_mutex);
+    for (i = 0; i < AI_TEMPLATE_SLOTS; i++) {
+        struct ai_request_template *t = ai_templates[i];
+
+        if (!t) {
+            if (slot < 0) {
+                slot = i;
+            }
+            continue;
+        }
+        if (t->provider == provider && t->stream_mode == stream_mode) {
+            if (t->max_tokens == max_tokens && strcmp(t->model, model) == 0 &&
+                strcmp(t->api_key, api_key) == 0) {
+                tmpl = t;
+                break;
+            }
+            /* Same provider, new key: the old one won't be asked for again */
+            if (strcmp(t->api_key, api_key) != 0) {
+                slot = i;
+            }
+        }
+    }
+    if (!tmpl && (tmpl = ai_template_build(provider, model, api_key, max_tokens, stream_mode))) {
+        if (slot < 0) {
+            slot = ai_template_next++ % AI_TEMPLATE_SLOTS;
+        }
+        if (ai_templates[slot] && --ai_templates[slot]->refs == 0) {
+            ai_template_free(ai_templates[slot]);
+        }
+        ai_templates[slot] = tmpl;
+    }
+    if (tmpl) {
+        tmpl->refs++;
+    }
+    pthread_mutex_unlock(&ai_template_mutex);
+    return tmpl;
+}
+
+static void ai_template_release(struct ai_request_template *tmpl) {
+    if (!tmpl) {
+        return;
+    }
+    pthread_mutex_lock(&ai_template_mutex);
+    if (--tmpl->refs == 0) {
+        ai_template_free(tmpl);
+    }
+    pthread_mutex_unlock(&ai_template_mutex);
+}
+
+/* A payload buffer of at least SIZE bytes, recycled when one is free.
+   *CAPACITY receives its real size. */
+static char *ai_payload_alloc(size_t size, size_t *capacity) {
+    char *buf = NULL;
+    int i;
+
+    pthread_mutex_lock(&ai_template_mutex);
+    for (i = ai_payload_nfree - 1; i >= 0; i--) {
+        if (ai_payload_free_size[i] >= size) {
+            buf = ai_payload_free[i];
+            *capacity = ai_payload_free_size[i];
+            ai_payload_nfree--;
+            ai_payload_free[i] = ai_payload_free[ai_payload_nfree];
+            ai_payload_free_size[i] = ai_payload_free_size[ai_payload_nfree];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ai_template_mutex);
+
+    if (!buf) {
+        /* Round up so the next prompt of about this size fits as well */
+        *capacity = size < 4096 ? 4096 : size + size / 4;
+        buf = malloc(*capacity);
+    }
+    return buf;
+}
+
+static void ai_payload_recycle(char *buf, size_t capacity) {
+    if (!buf) {
+        return;
+    }
+    pthread_mutex_lock(&ai_template_mutex);
+    if (capacity <= AI_PAYLOAD_KEEP && ai_payload_nfree < AI_PAYLOAD_FREE_SLOTS) {
+        ai_payload_free[ai_payload_nfree] = buf;
+        ai_payload_free_size[ai_payload_nfree++] = capacity;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&ai_template_mutex);
+    free(buf);
+}
+
+/* One in-flight AI request.  Owns the payload and headers until the
+   transfer finishes, so it can be driven by curl_easy_perform() or a
+   multi handle alike. */
+struct ai_request {
+    CURL *curl;
+    struct ai_request_template *tmpl;   /* supplies the headers */
+    char *payload;
+    size_t payload_capacity;
+    struct ai_response chunk;
+    struct ai_stream stream;
+    int stream_mode;
+    const struct ai_provider *provider;
+    struct timeval start_time;
+    struct ai_rate_headers rate;
+    CURLcode result;            /* how the transfer ended, once finished */
+    long http_code;
+};
+
+/* Build the payload and configure a pooled handle for QUERY.  On failure
+   *error receives a malloc'd message. */
+static int ai_request_prepare(struct ai_request *req, const char *query, const struct ai_options *opts, char **error) {
+    const struct ai_provider *provider;
+    const char *api_key;
+    const char *api_url;
+    size_t query_len = strlen(query), len;
+
+    memset(req, 0, sizeof(*req));
+    req->stream_mode = opts->stream_mode;
+
+    /* Get timing */
+    gettimeofday(&req->start_time, NULL);
+
+    /* Prepare API credentials and URL */
+    provider = ai_provider_select(opts);
+    api_key = provider ? getenv(provider->key_env) : NULL;
+
+    if (!api_key) {
+        *error = strdup("Error: No API key found. Set ANTHROPIC_API_KEY or OPENAI_API_KEY environment variable.");
+        return -1;
+    }
+
+    api_url = ai_provider_url(provider);
+    req->provider = provider;
+    req->tmpl = ai_template_acquire(provider, ai_model_for(provider, opts), api_key,
+                                    opts->max_tokens > 0 ? opts->max_tokens : AI_MAX_TOKENS,
+                                    opts->stream_mode);
+    if (req->tmpl) {
+        req->payload = ai_payload_alloc(req->tmpl->prefix_len + AI_JSON_ESCAPED_MAX(query_len) +
+                                        req->tmpl->suffix_len + 1, &req->payload_capacity);
+    }
+    if (!req->payload) {
+        if (req->tmpl) {
+            ai_template_release(req->tmpl);
+            req->tmpl = NULL;
+        }
+        *error = strdup("Error: out of memory building the request");
+        return -1;
+    }
+
+    /* Borrow a warm handle for this endpoint */
+    req->curl = ai_pool_acquire(api_url);
+    if (!req->curl) {
+        ai_payload_recycle(req->payload, req->payload_capacity);
+        ai_template_release(req->tmpl);
+        req->payload = NULL;
+        req->tmpl = NULL;
+        *error = strdup("Error: could not allocate connection");
+        return -1;
+    }
+
+    /* Splice the escaped prompt into the provider's template */
+    memcpy(req->payload, req->tmpl->prefix, req->tmpl->prefix_len);
+    len = req->tmpl->prefix_len;
+    len += ai_json_escape(req->payload + len, query, query_len);
+    memcpy(req->payload + len, req->tmpl->suffix, req->tmpl->suffix_len + 1);
+    len += req->tmpl->suffix_len;
+
+    /* Set curl options */
+    curl_easy_setopt(req->curl, CURLOPT_URL, api_url);
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, req->payload);
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)len);
+    if (opts->stream_mode) {
+        curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, write_stream_callback);
+        curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, (void *)&req->stream);
+    } else {
+        curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, write_response_callback);
+        curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, (void *)&req->chunk);
+    }
+    curl_easy_setopt(req->curl, CURLOPT_TIMEOUT, opts->timeout);
+    curl_easy_setopt(req->curl, CURLOPT_CONNECTTIMEOUT,
+                     (long)(opts->timeout > AI_CONNECT_TIMEOUT ? AI_CONNECT_TIMEOUT : opts->timeout));
+    curl_easy_setopt(req->curl, CURLOPT_USERAGENT, "ANBS/1.0");
+    curl_easy_setopt(req->curl, CURLOPT_PRIVATE, (void *)req);
+    /* Offer every encoding libcurl was built with (gzip, br, zstd); the
+       body reaches the write callbacks already decoded */
+    curl_easy_setopt(req->curl, CURLOPT_ACCEPT_ENCODING, "");
+
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->tmpl->headers);
+    ai_rate_headers_init(&req->rate);
+    curl_easy_setopt(req->curl, CURLOPT_HEADERFUNCTION, ai_rate_header_callback);
+    curl_easy_setopt(req->curl, CURLOPT_HEADERDATA, (void *)&req->rate);
+
+    PROBE3(anbs, http__start, req, provider->name, api_url);
+    return 0;
+}
+
+static double ai_elapsed_ms(const struct timeval *since) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_usec - since->tv_usec) / 1000.0;
+}
+
+/* Client-side rate limits.  Each provider has two token buckets, one of
+   requests and one of tokens per minute, refilled continuously.  They
+   start from ANBS_RATE_RPM and ANBS_RATE_TPM (unlimited when unset) and
+   follow the provider's own rate limit headers after every response, so
+   a query waits for room here instead of going out to be refused with
+   429.  A 429 with Retry-After holds every query to that provider back
+   for as long as it asks. */
+#define AI_RATE_MAX_WAIT_MS 60000   /* longest a query waits before giving up */
+#define AI_RATE_RETRY_MS 1000       /* hold after a 429 without Retry-After */
+
+struct ai_bucket {
+    double limit;               /* per minute; 0 for no limit */
+    double level;
+};
+
+struct ai_rate {
+    int initialized;
+    struct ai_bucket requests, tokens;
+    struct timeval refilled;
+    struct timeval blocked_until;
+    unsigned long waits, refusals;
+};
+
+static struct ai_rate ai_rates[sizeof(ai_providers) / sizeof(ai_providers[0])];
+static pthread_mutex_t ai_rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void ai_bucket_refill(struct ai_bucket *bucket, double elapsed_ms) {
+    if (bucket->limit > 0.0) {
+        bucket->level += bucket->limit * elapsed_ms / 60000.0;
+        if (bucket->level > bucket->limit) {
+            bucket->level = bucket->limit;
+        }
+    }
+}
+
+/* Milliseconds until BUCKET holds NEED, never more than it can hold */
+static double ai_bucket_wait(const struct ai_bucket *bucket, double need) {
+    if (bucket->limit <= 0.0) {
+        return 0.0;
+    }
+    if (need > bucket->limit) {
+        need = bucket->limit;
+    }
+    return bucket->level >= need ? 0.0 : (need - bucket->level) * 60000.0 / bucket->limit;
+}
+
+/* PROVIDER's limiter, refilled up to now.  Called with ai_rate_mutex held. */
+static struct ai_rate *ai_rate_for(const struct ai_provider *provider) {
+    struct ai_rate *rate = &ai_rates[provider - ai_providers];
+    const char *value;
+
+    if (!rate->initialized) {
+        value = getenv("ANBS_RATE_RPM");
+        rate->requests.limit = rate->requests.level = value && atof(value) > 0 ? atof(value) : 0.0;
+        value = getenv("ANBS_RATE_TPM");
+        rate->tokens.limit = rate->tokens.level = value && atof(value) > 0 ? atof(value) : 0.0;
+        gettimeofday(&rate->refilled, NULL);
+        rate->initialized = 1;
+    } else {
+        double elapsed = ai_elapsed_ms(&rate->refilled);
+
+        ai_bucket_refill(&rate->requests, elapsed);
+        ai_bucket_refill(&rate->tokens, elapsed);
+        gettimeofday(&rate->refilled, NULL);
+    }
+    return rate;
+}
+
+/* Tokens a request for QUERY may use: the prompt at about four bytes a
+   token, plus every token it may generate */
+static double ai_rate_tokens(const char *query, int max_tokens) {
+    return strlen(query) / 4.0 + (max_tokens > 0 ? max_tokens : AI_MAX_TOKENS);
+}
+
+/* Take room for one request of TOKENS tokens to PROVIDER.  Returns 0 when
+   it may go now, else the milliseconds until it may, taking nothing. */
+static long ai_rate_take(const struct ai_provider *provider, double tokens) {
+    struct ai_rate *rate;
+    double wait, blocked;
+
+    if (!provider) {
+        return 0;
+    }
+    pthread_mutex_lock(&ai_rate_mutex);
+    rate = ai_rate_for(provider);
+    blocked = -ai_elapsed_ms(&rate->blocked_until);
+    wait = ai_bucket_wait(&rate->requests, 1.0);
+    if (ai_bucket_wait(&rate->tokens, tokens) > wait) {
+        wait = ai_bucket_wait(&rate->tokens, tokens);
+    }
+    if (blocked > wait) {
+        wait = blocked;
+    }
+    if (wait <= 0.0) {
+        rate->requests.level -= 1.0;
+        rate->tokens.level -= tokens;
+    }
+    pthread_mutex_unlock(&ai_rate_mutex);
+
+    return wait > 0.0 ? (long)wait + 1 : 0;
+}
+
+/* Count a request PROVIDER's limits held back */
+static void ai_rate_count_wait(const struct ai_provider *provider) {
+    pthread_mutex_lock(&ai_rate_mutex);
+    ai_rates[provider - ai_providers].waits++;
+    pthread_mutex_unlock(&ai_rate_mutex);
+}
+
+/* Wait until PROVIDER has room for TOKENS, showing the wait in the status
+   panel.  Returns -1, with *error set, when the wait would be longer than
+   ANBS_RATE_MAX_WAIT_MS or is interrupted. */
+static int ai_rate_wait(const struct ai_provider *provider, double tokens, char **error) {
+    const char *value = getenv("ANBS_RATE_MAX_WAIT_MS");
+    long max_wait = value && atol(value) >= 0 && *value ? atol(value) : AI_RATE_MAX_WAIT_MS;
+    long wait, waited = 0;
+    char message[160];
+
+    while ((wait = ai_rate_take(provider, tokens)) > 0) {
+        if (waited + wait > max_wait || interrupt_state) {
+            snprintf(message, sizeof(message),
+                     "Error: %s rate limit reached; the next request fits in %.1fs", provider->name,
+                     wait / 1000.0);
+            *error = strdup(message);
+            return -1;
+        }
+        if (waited == 0) {
+            ai_rate_count_wait(provider);
+            if (g_anbs_display) {
+                snprintf(message, sizeof(message), "Waiting %.1fs for the %s rate limit...",
+                         wait / 1000.0, provider->name);
+                anbs_status_write(g_anbs_display, message);
+                anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_STATUS);
+            }
+        }
+        if (wait > 100) {
+            wait = 100;     /* stay responsive to interrupts */
+        }
+        usleep(wait * 1000);
+        waited += wait;
+    }
+    return 0;
+}
+
+/* Bring PROVIDER's buckets in line with what a response with HTTP_CODE
+   and rate limit headers RATE said */
+static void ai_rate_observe(const struct ai_provider *provider, long http_code, const struct ai_rate_headers *hdrs) {
+    struct ai_rate *rate;
+    double hold;
+
+    if (!provider) {
+        return;
+    }
+    pthread_mutex_lock(&ai_rate_mutex);
+    rate = ai_rate_for(provider);
+    if (hdrs->requests_limit > 0) {
+        rate->requests.limit = hdrs->requests_limit;
+    }
+    if (hdrs->requests_remaining >= 0 && rate->requests.limit > 0.0) {
+        rate->requests.level = hdrs->requests_remaining;
+    }
+    if (hdrs->tokens_limit > 0) {
+        rate->tokens.limit = hdrs->tokens_limit;
+    }
+    if (hdrs->tokens_remaining >= 0 && rate->tokens.limit > 0.0) {
+        rate->tokens.level = hdrs->tokens_remaining;
+    }
+    if (http_code == 429) {
+        hold = hdrs->retry_after_ms > 0.0 ? hdrs->retry_after_ms : AI_RATE_RETRY_MS;
+        gettimeofday(&rate->blocked_until, NULL);
+        rate->blocked_until.tv_sec += (time_t)(hold / 1000.0);
+        rate->blocked_until.tv_usec += (suseconds_t)((long)hold % 1000 * 1000);
+        if (rate->blocked_until.tv_usec >= 1000000) {
+            rate->blocked_until.tv_sec++;
+            rate->blocked_until.tv_usec -= 1000000;
+        }
+        rate->refusals++;
+        ANBS_DEBUG_LOG("%s refused a request (429); holding for %.0f ms", provider->name, hold);
+    }
+    pthread_mutex_unlock(&ai_rate_mutex);
+}
+
+/* Retries and circuit breakers, per provider endpoint.  A query that
+   fails for a reason a second try could fix (the endpoint unreachable,
+   a 5xx, a 429) is sent again after a jittered, exponentially growing
+   pause, while the provider's retry budget lasts: retries are earned by
+   successful requests, so an outage doesn't double the load on it.  After
+   ANBS_BREAKER_FAILURES failures in a row the endpoint's breaker opens
+   and queries to it fail at once; once the cooldown has passed one query
+   goes through as a trial, and its outcome closes the breaker or opens
+   it for twice as long. */
+#define AI_RETRY_MAX 2                  /* retries of one query */
+#define AI_RETRY_BASE_MS 250
+#define AI_RETRY_CAP_MS 4000
+#define AI_RETRY_BUDGET 10.0            /* retries a provider can bank */
+#define AI_RETRY_EARN 0.1               /* earned by each successful request */
+#define AI_BREAKER_FAILURES 5
+#define AI_BREAKER_COOLDOWN_MS 5000
+#define AI_BREAKER_COOLDOWN_MAX_MS 120000
+
+enum ai_breaker_state { AI_BREAKER_CLOSED, AI_BREAKER_OPEN, AI_BREAKER_HALF_OPEN };
+
+struct ai_breaker {
+    enum ai_breaker_state state;
+    int failures;                       /* in a row */
+    long cooldown_ms;
+    struct timeval changed;             /* opened, or sent the trial */
+    int initialized;
+    double retry_budget;
+    unsigned long opens, fast_failures, retries;
+};
+
+static struct ai_breaker ai_breakers[sizeof(ai_providers) / sizeof(ai_providers[0])];
+static pthread_mutex_t ai_breaker_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const ai_breaker_names[] = { "closed", "open", "half-open" };
+
+static long ai_env_long(const char *name, long fallback) {
+    const char *value = getenv(name);
+
+    return value && atol(value) > 0 ? atol(value) : fallback;
+}
+
+/* PROVIDER's breaker.  Called with ai_breaker_mutex held. */
+static struct ai_breaker *ai_breaker_for(const struct ai_provider *provider) {
+    struct ai_breaker *breaker = &ai_breakers[provider - ai_providers];
+
+    if (!breaker->initialized) {
+        breaker->retry_budget = AI_RETRY_BUDGET;
+        breaker->cooldown_ms = ai_env_long("ANBS_BREAKER_COOLDOWN_MS", AI_BREAKER_COOLDOWN_MS);
+        breaker->initialized = 1;
+    }
+    return breaker;
+}
+
+/* Whether a transfer that ended with RES and HTTP_CODE says the endpoint
+   is failing, rather than busy (429) or fine.  An abandoned transfer
+   says nothing: -1. */
+static int ai_endpoint_failed(CURLcode res, long http_code) {
+    if (res == CURLE_ABORTED_BY_CALLBACK) {
+        return -1;
+    }
+    return res != CURLE_OK || http_code >= 500;
+}
+
+/* Let a request to PROVIDER through its breaker, or fail it with *ERROR
+   (when ERROR is non-NULL) while the breaker is open */
+static int ai_breaker_admit(const struct ai_provider *provider, char **error) {
+    struct ai_breaker *breaker;
+    char message[160];
+    double left;
+
+    if (!provider) {
+        return 0;
+    }
+    pthread_mutex_lock(&ai_breaker_mutex);
+    breaker = ai_breaker_for(provider);
+    left = breaker->cooldown_ms - ai_elapsed_ms(&breaker->changed);
+    if (breaker->state == AI_BREAKER_CLOSED) {
+        pthread_mutex_unlock(&ai_breaker_mutex);
+        return 0;
+    }
+    if (left <= 0.0) {
+        /* This request is the trial; one that never reports back is
+           replaced after another cooldown */
+        breaker->state = AI_BREAKER_HALF_OPEN;
+        gettimeofday(&breaker->changed, NULL);
+        pthread_mutex_unlock(&ai_breaker_mutex);
+        ANBS_DEBUG_LOG("%s breaker half-open; sending a trial request", provider->name);
+        return 0;
+    }
+    breaker->fast_failures++;
+    snprintf(message, sizeof(message), "Error: %s is failing (%d errors in a row); next try in %.1fs",
+             provider->name, breaker->failures, left / 1000.0);
+    pthread_mutex_unlock(&ai_breaker_mutex);
+
+    if (error) {
+        *error = strdup(message);
+    }
+    return -1;
+}
+
+/* Whether PROVIDER's breaker would turn a request away now */
+static int ai_breaker_blocked(const struct ai_provider *provider) {
+    struct ai_breaker *breaker;
+    int blocked;
+
+    pthread_mutex_lock(&ai_breaker_mutex);
+    breaker = ai_breaker_for(provider);
+    blocked = breaker->state != AI_BREAKER_CLOSED && ai_elapsed_ms(&breaker->changed) < breaker->cooldown_ms;
+    pthread_mutex_unlock(&ai_breaker_mutex);
+    return blocked;
+}
+
+/* Feed the outcome of one transfer to PROVIDER's breaker */
+static void ai_breaker_observe(const struct ai_provider *provider, CURLcode res, long http_code) {
+    struct ai_breaker *breaker;
+    long base, threshold;
+    int failed = ai_endpoint_failed(res, http_code);
+
+    if (!provider || failed < 0) {
+        return;
+    }
+    base = ai_env_long("ANBS_BREAKER_COOLDOWN_MS", AI_BREAKER_COOLDOWN_MS);
+    threshold = ai_env_long("ANBS_BREAKER_FAILURES", AI_BREAKER_FAILURES);
+
+    pthread_mutex_lock(&ai_breaker_mutex);
+    breaker = ai_breaker_for(provider);
+    if (!failed) {
+        if (breaker->state != AI_BREAKER_CLOSED) {
+            ANBS_DEBUG_LOG("%s breaker closed; the endpoint recovered", provider->name);
+        }
+        breaker->state = AI_BREAKER_CLOSED;
+        breaker->failures = 0;
+        breaker->cooldown_ms = base;
+        breaker->retry_budget += AI_RETRY_EARN;
+        if (breaker->retry_budget > AI_RETRY_BUDGET) {
+            breaker->retry_budget = AI_RETRY_BUDGET;
+        }
+    } else {
+        breaker->failures++;
+        if (breaker->state == AI_BREAKER_HALF_OPEN) {
+            breaker->cooldown_ms *= 2;
+            if (breaker->cooldown_ms > AI_BREAKER_COOLDOWN_MAX_MS) {
+                breaker->cooldown_ms = AI_BREAKER_COOLDOWN_MAX_MS;
+            }
+        }
+        if (breaker->state == AI_BREAKER_HALF_OPEN ||
+            (breaker->state == AI_BREAKER_CLOSED && breaker->failures >= threshold)) {
+            breaker->state = AI_BREAKER_OPEN;
+            breaker->opens++;
+            gettimeofday(&breaker->changed, NULL);
+            ANBS_DEBUG_LOG("%s breaker open for %ld ms after %d failures (HTTP %ld, %s)", provider->name,
+                           breaker->cooldown_ms, breaker->failures, http_code, curl_easy_strerror(res));
+        }
+    }
+    pthread_mutex_unlock(&ai_breaker_mutex);
+}
+
+/* Spend one of PROVIDER's banked retries; 0 when there are none left */
+static int ai_retry_take(const struct ai_provider *provider) {
+    struct ai_breaker *breaker;
+    int granted = 0;
+
+    if (!provider) {
+        return 0;
+    }
+    pthread_mutex_lock(&ai_breaker_mutex);
+    breaker = ai_breaker_for(provider);
+    if (breaker->retry_budget >= 1.0) {
+        breaker->retry_budget -= 1.0;
+        breaker->retries++;
+        granted = 1;
+    }
+    pthread_mutex_unlock(&ai_breaker_mutex);
+    return granted;
+}
+
+/* Pause before retry ATTEMPT (0 for the first): anywhere up to an
+   exponentially growing ceiling, so clients that failed together don't
+   come back together */
+static long ai_retry_backoff_ms(int attempt) {
+    static __thread uint64_t state;
+    long ceiling = AI_RETRY_BASE_MS << (attempt < 4 ? attempt : 4);
+
+    if (state == 0) {
+        struct timeval now;
+
+        gettimeofday(&now, NULL);
+        state = ((uint64_t)now.tv_sec * 1000000 + now.tv_usec) ^ ((uint64_t)getpid() << 32) ^ 0x9e3779b97f4a7c15ULL;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    if (ceiling > AI_RETRY_CAP_MS) {
+        ceiling = AI_RETRY_CAP_MS;
+    }
+    return (long)(state % (uint64_t)ceiling) + 1;
+}
+
+/* Whether the failed request REQ may be sent again: nothing it did can
+   have reached the terminal, and the failure is one a second try could
+   fix.  A streamed answer is only retried when it never connected. */
+static int ai_retryable(const struct ai_request *req) {
+    switch (req->result) {
+    case CURLE_OK:
+        return !req->stream_mode && (req->http_code == 408 || req->http_code == 429 ||
+                                     req->http_code == 500 || req->http_code == 502 ||
+                                     req->http_code == 503 || req->http_code == 504 ||
+                                     req->http_code == 529);
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SSL_CONNECT_ERROR:
+        return 1;
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_RECV_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+        return !req->stream_mode;
+    default:
+        return 0;
+    }
+}
+
+/* Sleep MS milliseconds unless interrupted; returns -1 if it was */
+static int ai_sleep_ms(long ms) {
+    long slice;
+
+    while (ms > 0 && interrupt_state == 0) {
+        slice = ms < 100 ? ms : 100;
+        usleep(slice * 1000);
+        ms -= slice;
+    }
+    return interrupt_state ? -1 : 0;
+}
+
+/* Record what an operation cost under NAME, so the optimizer can compare
+   its strategies against the operations they avoid */
+static void ai_record_cost(const char *name, double elapsed_ms) {
+    if (anbs_metrics_init() == 0) {
+        anbs_metrics_record_cost(name, elapsed_ms);
+    }
+}
+
+/* Span NAME of REQ's transfer, FROM_S to TO_S seconds into it */
+static void ai_trace_phase(const char *name, const struct ai_request *req, double from_s, double to_s,
+                           const char *args) {
+    struct timeval at = req->start_time;
+    long offset_us = (long)(from_s * 1000000.0);
+
+    if (to_s <= from_s) {
+        return;
+    }
+    at.tv_sec += (at.tv_usec + offset_us) / 1000000;
+    at.tv_usec = (at.tv_usec + offset_us) % 1000000;
+    anbs_metrics_trace_span(name, "http", &at, (to_s - from_s) * 1000.0, args);
+}
+
+/* Trace one finished transfer from libcurl's phase timings: name lookup,
+   connect, TLS handshake, waiting for the first byte, then the rest of
+   the body.  libcurl reports each as time since the transfer began. */
+static void ai_trace_transfer(const struct ai_request *req, CURLcode res) {
+    double lookup_s = 0.0, connect_s = 0.0, handshake_s = 0.0, pretransfer_s = 0.0;
+    double first_byte_s = 0.0, total_s = 0.0;
+    long status = 0, connects = 0;
+    char args[256];
+
+    curl_easy_getinfo(req->curl, CURLINFO_NAMELOOKUP_TIME, &lookup_s);
+    curl_easy_getinfo(req->curl, CURLINFO_CONNECT_TIME, &connect_s);
+    curl_easy_getinfo(req->curl, CURLINFO_APPCONNECT_TIME, &handshake_s);
+    curl_easy_getinfo(req->curl, CURLINFO_PRETRANSFER_TIME, &pretransfer_s);
+    curl_easy_getinfo(req->curl, CURLINFO_STARTTRANSFER_TIME, &first_byte_s);
+    curl_easy_getinfo(req->curl, CURLINFO_TOTAL_TIME, &total_s);
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(req->curl, CURLINFO_NUM_CONNECTS, &connects);
+
+    snprintf(args, sizeof(args), "{\"provider\": \"%s\", \"http_status\": %ld, \"curl_code\": %d, "
+             "\"new_connections\": %ld}", req->provider ? req->provider->name : "none",
+             status, (int)res, connects);
+    ai_trace_phase("http", req, 0.0, total_s, args);
+    ai_trace_phase("dns", req, 0.0, lookup_s, NULL);
+    ai_trace_phase("connect", req, lookup_s, connect_s, NULL);
+    ai_trace_phase("tls", req, connect_s, handshake_s, NULL);
+    ai_trace_phase("first_byte", req, pretransfer_s, first_byte_s, NULL);
+    ai_trace_phase("transfer", req, first_byte_s, total_s, NULL);
+}
+
+#if HAVE_PROBES
+/* Fire the http__done and http__phases probes for REQ's transfer, with
+   libcurl's phase timings in microseconds since it began */
+static void ai_probe_transfer(const struct ai_request *req, CURLcode res) {
+    double lookup_s = 0.0, connect_s = 0.0, handshake_s = 0.0, first_byte_s = 0.0, total_s = 0.0;
+    long status = 0;
+
+    curl_easy_getinfo(req->curl, CURLINFO_NAMELOOKUP_TIME, &lookup_s);
+    curl_easy_getinfo(req->curl, CURLINFO_CONNECT_TIME, &connect_s);
+    curl_easy_getinfo(req->curl, CURLINFO_APPCONNECT_TIME, &handshake_s);
+    curl_easy_getinfo(req->curl, CURLINFO_STARTTRANSFER_TIME, &first_byte_s);
+    curl_easy_getinfo(req->curl, CURLINFO_TOTAL_TIME, &total_s);
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &status);
+
+    PROBE5(anbs, http__phases, req, (long)(lookup_s * 1e6), (long)(connect_s * 1e6),
+           (long)(handshake_s * 1e6), (long)(first_byte_s * 1e6));
+    PROBE4(anbs, http__done, req, status, (int)res, (long)(total_s * 1e6));
+}
+#endif
+
+/* Release the transfer and turn its body into *response.  RES is the
+   transfer result; ELAPSED_MS receives the request latency if non-NULL. */
+static int ai_request_finish(struct ai_request *req, CURLcode res, char **response, double *elapsed_ms) {
+    struct timeval end_time;
+    double elapsed;
+    struct ai_stream *stream = &req->stream;
+
+    /* Calculate response time */
+    gettimeofday(&end_time, NULL);
+    elapsed = (end_time.tv_sec - req->start_time.tv_sec) * 1000.0 +
+              (end_time.tv_usec - req->start_time.tv_usec) / 1000.0;
+    if (elapsed_ms) {
+        *elapsed_ms = elapsed;
+    }
+    if (anbs_metrics_tracing()) {
+        ai_trace_transfer(req, res);
+    }
+#if HAVE_PROBES
+    ai_probe_transfer(req, res);
+#endif
+
+    req->result = res;
+    req->http_code = 0;
+
+    /* Connection setup, paid in full only when the pool had nothing warm */
+    if (res == CURLE_OK) {
+        long connects = 0, http_code = 0;
+        double connect_s = 0.0, handshake_s = 0.0;
+
+        curl_easy_getinfo(req->curl, CURLINFO_NUM_CONNECTS, &connects);
+        curl_easy_getinfo(req->curl, CURLINFO_CONNECT_TIME, &connect_s);
+        curl_easy_getinfo(req->curl, CURLINFO_APPCONNECT_TIME, &handshake_s);
+        ai_record_cost(connects > 0 ? "optimize:connect_fresh" : "optimize:connect_reused",
+                       (handshake_s > connect_s ? handshake_s : connect_s) * 1000.0);
+
+        curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &http_code);
+        ai_rate_observe(req->provider, http_code, &req->rate);
+        req->http_code = http_code;
+    }
+    ai_breaker_observe(req->provider, res, req->http_code);
+
+    /* Clean up */
+    ai_pool_release(req->curl);
+    ai_template_release(req->tmpl);
+    ai_payload_recycle(req->payload, req->payload_capacity);
+    req->tmpl = NULL;
+    req->curl = NULL;
+    req->payload = NULL;
+
+    if (req->stream_mode) {
+        /* Deltas went to the terminal as they arrived; draw the rest
+           and finish the line */
+        ai_stream_render_finish(&stream->render);
+        free(stream->pending.memory);
+
+        if (res != CURLE_OK || !stream->text.memory) {
+            free(stream->text.memory);
+            *response = strdup(res != CURLE_OK ? curl_easy_strerror(res) : "Error: empty AI stream");
+            return -1;
+        }
+
+        *response = stream->text.memory;
+        return 0;
+    }
+
+    if (res != CURLE_OK) {
+        if (req->chunk.memory) {
+            free(req->chunk.memory);
+        }
+        *response = strdup(curl_easy_strerror(res));
+        return -1;
+    }
+
+    /* Go straight to the provider's text; only a body without it (an
+       error, an unexpected shape) is parsed in full */
+    struct timeval parse_start;
+    char *ai_text = NULL;
+    json_object *root;
+    int parsed = -1;
+
+    gettimeofday(&parse_start, NULL);
+    if (req->chunk.memory) {
+        parsed = ai_extract_text(req->provider, req->chunk.memory, req->chunk.size, &ai_text);
+        if (parsed != 0 && (root = json_tokener_parse(req->chunk.memory))) {
+            parsed = parse_ai_response(root, &ai_text);
+            json_object_put(root);
+        }
+    }
+    anbs_metrics_trace_span("parse", "vertex", &parse_start, ai_elapsed_ms(&parse_start), NULL);
+
+    if (parsed == 0 && ai_text) {
+        *response = ai_text;
+        free(req->chunk.memory);
+        return 0;
+    } else {
+        *response = req->chunk.memory ? req->chunk.memory : strdup("Error: Could not parse AI response");
+        return -1;
+    }
+}
+
+/* Provider health.  A probe is a HEAD request for the provider's model
+   list: it proves DNS, TLS, the key and the front end without running
+   the model.  Results are kept for ANBS_HEALTH_TTL seconds, and shared
+   with other shells through the response cache; past half of that a
+   check answers from the cache and refreshes it on a detached thread.
+   Successful queries count as probes too. */
+#define AI_HEALTH_TTL 30            /* seconds a probe result is trusted */
+#define AI_HEALTH_TIMEOUT 5
+
+struct ai_health {
+    time_t checked;             /* 0 when never probed */
+    int online;
+    long http_code;             /* of the last probe; 0 when none answered */
+    int latency_ms;             /* of the last probe */
+    int refreshing;             /* a background probe is on its way */
+    unsigned long ok, failed;
+    char error[160];
+};
+
+static struct ai_health ai_health_state[sizeof(ai_providers) / sizeof(ai_providers[0])];
+static pthread_mutex_t ai_health_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int ai_health_ttl(void) {
+    const char *value = getenv("ANBS_HEALTH_TTL");
+
+    return value && atoi(value) > 0 ? atoi(value) : AI_HEALTH_TTL;
+}
+
+/* Record a health observation of PROVIDER and show it in the health
+   panel.  LATENCY_MS below 0 keeps the last probe's. */
+static void ai_health_note(const struct ai_provider *provider, int online, long http_code,
+                           int latency_ms, const char *error) {
+    struct ai_health *state = &ai_health_state[provider - ai_providers];
+    health_data_t panel;
+
+    pthread_mutex_lock(&ai_health_mutex);
+    state->checked = time(NULL);
+    state->online = online;
+    if (latency_ms >= 0) {
+        state->http_code = http_code;
+        state->latency_ms = latency_ms;
+    }
+    snprintf(state->error, sizeof(state->error), "%s", error ? error : "");
+    if (online) {
+        state->ok++;
+    } else {
+        state->failed++;
+    }
+
+    memset(&panel, 0, sizeof(panel));
+    snprintf(panel.agent_id, sizeof(panel.agent_id), "%s", provider->name);
+    panel.online = online;
+    panel.latency_ms = state->latency_ms;
+    panel.commands_processed = (int)(state->ok + state->failed);
+    panel.success_rate = 100.0f * state->ok / (state->ok + state->failed);
+    panel.last_update = state->checked;
+    pthread_mutex_unlock(&ai_health_mutex);
+
+    if (g_anbs_display) {
+        anbs_health_update(g_anbs_display, &panel);
+    }
+}
+
+/* Key under which shells share PROVIDER's last probe in the response cache */
+static void ai_health_key(const struct ai_provider *provider, char *key, size_t size) {
+    snprintf(key, size, "health\x1f%s\x1f%s", provider->name, ai_provider_url(provider));
+}
+
+/* Take PROVIDER's health from a probe another shell made less than TTL
+   seconds ago; returns 0 when there was one */
+static int ai_health_shared(const struct ai_provider *provider, int ttl) {
+    struct ai_health *state = &ai_health_state[provider - ai_providers];
+    char key[600], error[160], *value;
+    double age_ms = 0;
+    long http_code;
+    int online, latency_ms, n;
+
+    if (anbs_cache_init(0) != 0) {
+        return -1;
+    }
+    ai_health_key(provider, key, sizeof(key));
+    value = anbs_cache_get(key, &age_ms);
+    if (!value) {
+        return -1;
+    }
+    error[0] = '\0';
+    n = sscanf(value, "%d %ld %d %159[^\n]", &online, &http_code, &latency_ms, error);
+    free(value);
+    if (n < 3 || age_ms >= ttl * 1000.0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ai_health_mutex);
+    state->checked = time(NULL) - (time_t)(age_ms / 1000);
+    state->online = online;
+    state->http_code = http_code;
+    state->latency_ms = latency_ms;
+    snprintf(state->error, sizeof(state->error), "%s", error);
+    pthread_mutex_unlock(&ai_health_mutex);
+    return 0;
+}
+
+/* Probe PROVIDER once and record the result */
+static void ai_health_probe(const struct ai_provider *provider) {
+    const char *api_url = ai_provider_url(provider), *api_key = getenv(provider->key_env), *v1;
+    char url[512], auth_header[512], error[160];
+    struct curl_slist *headers = NULL;
+    struct timeval start;
+    CURLcode res;
+    CURL *curl;
+    long http_code = 0;
+    int online, latency_ms;
+
+    if (!api_key) {
+        ai_health_note(provider, 0, 0, 0, "No API key found");
+        return;
+    }
+
+    /* The model list sits next to the completion endpoint; an endpoint
+       without a /v1/ in it is probed as it is */
+    v1 = strstr(api_url, "/v1/");
+    if (v1) {
+        snprintf(url, sizeof(url), "%.*smodels", (int)(v1 + 4 - api_url), api_url);
+    } else {
+        snprintf(url, sizeof(url), "%s", api_url);
+    }
+    snprintf(auth_header, sizeof(auth_header), provider->auth_format, api_key);
+
+    /* Borrowed under the completion URL, so the probe warms the
+       connection the next query takes */
+    curl = ai_pool_acquire(api_url);
+    if (!curl) {
+        ai_health_note(provider, 0, 0, 0, "could not allocate connection");
+        return;
+    }
+    headers = curl_slist_append(headers, auth_header);
+    headers = curl_slist_append(headers, "anthropic-version: 2023-06-01");
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)AI_HEALTH_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "ANBS/1.0");
+
+    gettimeofday(&start, NULL);
+    res = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    ai_pool_release(curl);
+    curl_slist_free_all(headers);
+
+    /* Any answer short of a server error or a refused key means the
+       service is up; some front ends answer HEAD with 404 or 405 */
+    error[0] = '\0';
+    if (res != CURLE_OK) {
+        snprintf(error, sizeof(error), "%s", curl_easy_strerror(res));
+    } else if (http_code == 401 || http_code == 403) {
+        snprintf(error, sizeof(error), "API key rejected (HTTP %ld)", http_code);
+    } else if (http_code >= 500) {
+        snprintf(error, sizeof(error), "HTTP %ld", http_code);
+    }
+    online = error[0] == '\0';
+    latency_ms = (int)ai_elapsed_ms(&start);
+    ai_health_note(provider, online, http_code, latency_ms, online ? NULL : error);
+
+    if (anbs_cache_init(0) == 0) {
+        char key[600], value[200];
+
+        ai_health_key(provider, key, sizeof(key));
+        snprintf(value, sizeof(value), "%d %ld %d %s", online, http_code, latency_ms, error);
+        anbs_cache_put(key, value, ai_health_ttl());
+    }
+}
+
+static void *ai_health_refresh_thread(void *arg) {
+    const struct ai_provider *provider = arg;
+
+    anbs_thread_name("anbs-health");
+    ai_health_probe(provider);
+    pthread_mutex_lock(&ai_health_mutex);
+    ai_health_state[provider - ai_providers].refreshing = 0;
+    pthread_mutex_unlock(&ai_health_mutex);
+    return NULL;
+}
+
+/* Health of PROVIDER, probing first when the cached result is missing,
+   expired or FRESH is set, and in the background when it is aging */
+static struct ai_health ai_health_get(const struct ai_provider *provider, int fresh) {
+    struct ai_health *state = &ai_health_state[provider - ai_providers];
+    struct ai_health copy;
+    pthread_t thread;
+    pthread_attr_t attr;
+    time_t age;
+    int ttl = ai_health_ttl(), refresh = 0;
+
+    pthread_mutex_lock(&ai_health_mutex);
+    age = time(NULL) - state->checked;
+    if (fresh || !state->checked || age >= ttl) {
+        pthread_mutex_unlock(&ai_health_mutex);
+        if (fresh || ai_health_shared(provider, ttl) != 0) {
+            ai_health_probe(provider);
+        }
+        pthread_mutex_lock(&ai_health_mutex);
+    } else if (age >= ttl / 2 && !state->refreshing) {
+        state->refreshing = refresh = 1;
+    }
+    copy = *state;
+    pthread_mutex_unlock(&ai_health_mutex);
+
+    if (refresh) {
+        pthread_once(&ai_pool_once, ai_pool_init_once);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, ai_health_refresh_thread, (void *)provider) != 0) {
+            pthread_mutex_lock(&ai_health_mutex);
+            state->refreshing = 0;
+            pthread_mutex_unlock(&ai_health_mutex);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return copy;
+}
+
+/* Name under which request latencies for PROVIDER are recorded */
+static void ai_metric_name(const struct ai_provider *provider, char *name, size_t size) {
+    snprintf(name, size, "vertex:%s", provider ? provider->name : "none");
+}
+
+/* Feed one successful request latency into the metrics system */
+static void ai_record_latency(const struct ai_provider *provider, double elapsed_ms) {
+    char name[64];
+
+    if (anbs_metrics_init() == 0) {
+        ai_metric_name(provider, name, sizeof(name));
+        anbs_metrics_record_response_time(name, elapsed_ms, NULL);
+    }
+    if (provider) {
+        ai_health_note(provider, 1, 0, -1, NULL);
+    }
+}
+
+/* Options for the backup request of a hedged query: the other provider
+   when its key is set (ANBS_HEDGE_MODEL overrides its model), else a
+   second connection to the same one */
+static void ai_hedge_options(const struct ai_options *opts, const struct ai_provider *primary,
+                             struct ai_options *backup) {
+    const char *model = getenv("ANBS_HEDGE_MODEL");
+    int i;
+
+    *backup = *opts;
+    for (i = 0; ai_providers[i].name; i++) {
+        if (&ai_providers[i] != primary && getenv(ai_providers[i].key_env) && !ai_breaker_blocked(&ai_providers[i])) {
+            backup->provider = i;
+            backup->model = (model && *model) ? (char *)model : NULL;
+            return;
+        }
+    }
+    backup->provider = primary - ai_providers;
+}
+
+/* Options for a query past PROVIDER's breaker into ROUTE: OPTS as they
+   are while the breaker is closed, else, unless the caller chose the
+   provider, the hedge's other provider.  Returns -1 with *error set when
+   every way is shut. */
+static int ai_breaker_route(const struct ai_options *opts, struct ai_options *route, char **error) {
+    const struct ai_provider *primary = ai_provider_select(opts), *other;
+
+    *route = *opts;
+    if (!primary || ai_breaker_admit(primary, error) == 0) {
+        return 0;
+    }
+    if (opts->provider == AI_PROVIDER_AUTO) {
+        ai_hedge_options(opts, primary, route);
+        other = ai_provider_select(route);
+        if (other != primary && ai_breaker_admit(other, NULL) == 0) {
+            ANBS_DEBUG_LOG("%s is failing; sending the query to %s", primary->name, other->name);
+            free(*error);
+            *error = NULL;
+            return 0;
+        }
+        *route = *opts;
+    }
+    return -1;
+}
+
+/* Hedge delay in milliseconds: the explicit --hedge=MS value, else the
+   primary's recent p90 latency, else a fixed default */
+static long ai_hedge_delay(const struct ai_options *opts, const struct ai_provider *primary) {
+    char name[64];
+    double p90;
+
+    if (opts->hedge_ms > 0) {
+        return opts->hedge_ms;
+    }
+    ai_metric_name(primary, name, sizeof(name));
+    p90 = anbs_metrics_get_response_percentile(name, 90.0);
+    return p90 > 0.0 ? (long)p90 : AI_HEDGE_DEFAULT_MS;
+}
+
+/* Adaptive in-flight limit of each provider; batch runs drive it from the
+   main thread only */
+struct ai_limiter {
+    double limit;
+    struct timeval last_decrease;
+};
+
+static struct ai_limiter ai_limiters[sizeof(ai_providers) / sizeof(ai_providers[0])];
+
+static struct ai_limiter *ai_limiter_for(const struct ai_provider *provider) {
+    struct ai_limiter *limiter = &ai_limiters[provider - ai_providers];
+
+    if (limiter->limit < 1.0) {
+        limiter->limit = AI_BATCH_DEFAULT_PARALLEL;
+    }
+    return limiter;
+}
+
+/* Transfers a batch may have in flight: the fixed --parallel value, else
+   PROVIDER's current limit */
+static int ai_limit_window(const struct ai_options *opts, const struct ai_provider *provider) {
+    if (opts->parallel > 0) {
+        return opts->parallel;
+    }
+    return provider ? (int)ai_limiter_for(provider)->limit : AI_BATCH_DEFAULT_PARALLEL;
+}
+
+/* Adjust PROVIDER's limit for one finished transfer.  ELAPSED_MS of 0
+   skips the latency check, for replies that are expected to be slow. */
+static void ai_limit_observe(const struct ai_provider *provider, CURLcode res, long http_code, double elapsed_ms) {
+    struct ai_limiter *limiter;
+    double decrease = AI_LIMIT_ERROR_DECREASE;
+    double median;
+    char name[64];
+
+    if (!provider) {
+        return;
+    }
+    limiter = ai_limiter_for(provider);
+
+    if (res == CURLE_OK && http_code != 429 && http_code < 500) {
+        ai_metric_name(provider, name, sizeof(name));
+        median = elapsed_ms > 0.0 ? anbs_metrics_get_response_percentile(name, 50.0) : -1.0;
+        if (median <= 0.0 || elapsed_ms <= median * AI_LIMIT_LATENCY_FACTOR) {
+            limiter->limit += 1.0 / limiter->limit;
+            if (limiter->limit > AI_BATCH_MAX_PARALLEL) {
+                limiter->limit = AI_BATCH_MAX_PARALLEL;
+            }
+            return;
+        }
+        decrease = AI_LIMIT_LATENCY_DECREASE;
+    }
+
+    /* One window's worth of bad news counts once */
+    if (ai_elapsed_ms(&limiter->last_decrease) < AI_LIMIT_BACKOFF_MS) {
+        return;
+    }
+    gettimeofday(&limiter->last_decrease, NULL);
+    limiter->limit *= decrease;
+    if (limiter->limit < 1.0) {
+        limiter->limit = 1.0;
+    }
+    ANBS_DEBUG_LOG("%s concurrency limit now %.1f (HTTP %ld)", provider->name, limiter->limit, http_code);
+}
+
+/* Run a streaming transfer to completion, like curl_easy_perform(), but
+   on a multi handle so a transfer paused on a full buffer can be resumed
+   from here: while paused, the loop looks at the buffer once a frame.  An
+   interrupt abandons the transfer. */
+static CURLcode ai_stream_perform(struct ai_request *req) {
+    struct ai_stream_render *render = &req->stream.render;
+    CURLcode res = CURLE_ABORTED_BY_CALLBACK;
+    CURLM *multi;
+    CURLMsg *msg;
+    int running = 1, pending;
+
+    multi = curl_multi_init();
+    if (!multi) {
+        return CURLE_OUT_OF_MEMORY;
+    }
+    curl_multi_add_handle(multi, req->curl);
+
+    while (running && interrupt_state == 0) {
+        if (render->paused && ai_stream_queued(render) <= render->limit / 2) {
+            render->paused = 0;
+            curl_easy_pause(req->curl, CURLPAUSE_CONT);
+        }
+
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &pending)) != NULL) {
+            if (msg->msg == CURLMSG_DONE) {
+                res = msg->data.result;
+            }
+        }
+
+        if (running) {
+            int timeout = render->paused ? (int)render->frame_ms : 1000;
+#if LIBCURL_VERSION_NUM >= 0x074200
+            curl_multi_poll(multi, NULL, 0, timeout, NULL);
+#else
+            curl_multi_wait(multi, NULL, 0, timeout, NULL);
+#endif
+        }
+    }
+
+    curl_multi_remove_handle(multi, req->curl);
+    curl_multi_cleanup(multi);
+    return res;
+}
+
+/* Race the primary request against a backup started once the primary has
+   gone HEDGE-delay milliseconds without a first byte, or as soon as it
+   fails.  The first successful response wins; the other transfer is
+   cancelled.  PRIMARY must already be prepared. */
+static int ai_hedged_perform(struct ai_request *primary, const char *query, const struct ai_options *opts,
+                             char **response, double *elapsed_ms) {
+    struct ai_request backup;
+    struct ai_request *reqs[2] = { primary, NULL };
+    struct ai_options backup_opts;
+    CURLM *multi;
+    CURLMsg *msg;
+    CURLcode results[2] = { CURLE_OK, CURLE_OK };
+    char *errors[2] = { NULL, NULL };
+    int done[2] = { 0, 0 };
+    int running, pending, winner = -1, i;
+    long delay;
+    double waited;
+
+    multi = curl_multi_init();
+    if (!multi) {
+        return ai_request_finish(primary, curl_easy_perform(primary->curl), response, elapsed_ms);
+    }
+
+    delay = ai_hedge_delay(opts, primary->provider);
+    curl_multi_add_handle(multi, primary->curl);
+
+    while (winner < 0 && interrupt_state == 0) {
+        curl_multi_perform(multi, &running);
+
+        while ((msg = curl_multi_info_read(multi, &pending)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            i = (reqs[1] && msg->easy_handle == reqs[1]->curl) ? 1 : 0;
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            results[i] = msg->data.result;
+            done[i] = 1;
+
+            if (results[i] == CURLE_OK && ai_request_finish(reqs[i], CURLE_OK, response, elapsed_ms) == 0) {
+                winner = i;
+                break;
+            }
+            if (results[i] == CURLE_OK) {
+                errors[i] = *response;      /* finished, but unusable body */
+            } else {
+                ai_request_finish(reqs[i], results[i], &errors[i], NULL);
+            }
+        }
+
+        /* Both sides finished without a usable answer */
+        if (winner < 0 && done[0] && reqs[1] && done[1]) {
+            break;
+        }
+
+        /* Launch the backup once the primary is late or has failed */
+        waited = ai_elapsed_ms(&primary->start_time);
+        if (winner < 0 && !reqs[1] && (done[0] || (waited >= delay && primary->chunk.size == 0))) {
+            ai_hedge_options(opts, primary->provider, &backup_opts);
+            if (ai_request_prepare(&backup, query, &backup_opts, &errors[1]) == 0) {
+                reqs[1] = &backup;
+                curl_multi_add_handle(multi, backup.curl);
+                ANBS_DEBUG_LOG("Hedging @vertex after %.0fms on %s", waited, backup.provider->name);
+                continue;
+            }
+            if (done[0]) {
+                break;
+            }
+            delay = LONG_MAX;           /* backup unavailable; stop trying */
+        }
+
+        if (winner < 0) {
+            long timeout = 1000;
+            if (!reqs[1] && delay != LONG_MAX && delay - (long)waited < timeout) {
+                timeout = delay - (long)waited > 0 ? delay - (long)waited : 1;
+            }
+#if LIBCURL_VERSION_NUM >= 0x074200
+            curl_multi_poll(multi, NULL, 0, (int)timeout, NULL);
+#else
+            curl_multi_wait(multi, NULL, 0, (int)timeout, NULL);
+#endif
+        }
+    }
+
+    /* Cancel the loser, or both sides on interrupt */
+    for (i = 0; i < 2; i++) {
+        if (reqs[i] && !done[i]) {
+            char *discard = NULL;
+            curl_multi_remove_handle(multi, reqs[i]->curl);
+            ai_request_finish(reqs[i], CURLE_ABORTED_BY_CALLBACK, &discard, NULL);
+            free(discard);
+        }
+    }
+    curl_multi_cleanup(multi);
+
+    if (winner >= 0) {
+        if (winner == 1) {
+            primary->provider = backup.provider;
+        }
+        free(errors[0]);
+        free(errors[1]);
+        return 0;
+    }
+
+    /* Report the primary's failure; it is usually the more meaningful one */
+    *response = errors[0] ? errors[0] : (errors[1] ? errors[1] : strdup("Error: request interrupted"));
+    if (errors[0]) {
+        free(errors[1]);
+    }
+    return -1;
+}
+
+/* Background refresh of a stale cache entry */
+struct ai_refresh {
+    char *query;
+    char *model;
+    struct ai_options opts;
+    struct timeval queued;
+};
+
+static void ai_refresh_task(void *arg) {
+    struct ai_refresh *refresh = arg;
+    struct ai_request req;
+    struct timeval started;
+    char *response = NULL;
+    double elapsed_ms;
+
+    gettimeofday(&started, NULL);
+    anbs_metrics_trace_span("queue_wait", "vertex", &refresh->queued, ai_elapsed_ms(&refresh->queued), NULL);
+
+    if (ai_request_prepare(&req, refresh->query, &refresh->opts, &response) == 0 &&
+        ai_request_finish(&req, curl_easy_perform(req.curl), &response, &elapsed_ms) == 0) {
+        ai_cache_store(refresh->query, &refresh->opts, response);
+        ai_record_latency(req.provider, elapsed_ms);
+    }
+    anbs_metrics_trace_span("refresh", "vertex", &started, ai_elapsed_ms(&started), NULL);
+
+    free(response);
+    free(refresh->query);
+    free(refresh->model);
+    free(refresh);
+}
+
+/* Fetch QUERY on the worker pool and store the answer in the cache.
+   Nothing is printed, whether it succeeds or not. */
+static int ai_refresh_start(const char *query, const struct ai_options *opts) {
+    struct ai_refresh *refresh;
+
+    refresh = calloc(1, sizeof(*refresh));
+    if (!refresh) {
+        return -1;
+    }
+    refresh->opts = *opts;
+    refresh->opts.stream_mode = 0;
+    refresh->opts.hedge_ms = 0;
+    refresh->query = strdup(query);
+    refresh->model = opts->model ? strdup(opts->model) : NULL;
+    refresh->opts.model = refresh->model;
+    refresh->opts.query = refresh->query;
+    refresh->opts.batch_file = NULL;
+    gettimeofday(&refresh->queued, NULL);
+
+    if (!refresh->query || anbs_optimize_submit(ai_refresh_task, refresh) != 0) {
+        free(refresh->query);
+        free(refresh->model);
+        free(refresh);
+        return -1;
+    }
+    return 0;
+}
+
+/* Serve QUERY from an expired entry still inside ANBS_CACHE_STALE_SECONDS,
+   kicking off one quiet background refresh.  Returns the stale response, or
+   NULL. */
+static char *ai_cache_revalidate(const char *query, const struct ai_options *opts) {
+    char *key, *stale;
+    int needs_refresh = 0;
+
+    if (opts->no_cache || anbs_cache_init(0) != 0) {
+        return NULL;
+    }
+
+    key = ai_cache_key(query, opts, NULL);
+    stale = key ? anbs_cache_get_stale(key, NULL, &needs_refresh) : NULL;
+    free(key);
+
+    if (!stale || !needs_refresh) {
+        return stale;
+    }
+
+    ai_refresh_start(query, opts);
+
+    if (g_anbs_display) {
+        anbs_status_write(g_anbs_display, "AI response: stale cache, refreshing in background");
+    }
+    return stale;
+}
+
+/* Show a response that came from the cache the way a live one would be */
+static void ai_serve_cached(const char *cached, const struct ai_options *opts) {
+    if (opts->stream_mode) {
+        /* Callers expect streamed output to be on the terminal already */
+        printf("🤖 Vertex: %s\n", cached);
+        fflush(stdout);
+        if (g_anbs_display) {
+            anbs_ai_chat_write(g_anbs_display, cached);
+        }
+    }
+}
+
+#define AI_GATEWAY_UNAVAILABLE 1
+
+/* Connect to the gateway at URL, ws://host[:port][/path] or wss://...,
+   unless the connection is up already */
+static int ai_gateway_connect(const char *url) {
+    char host[256];
+    const char *rest, *path, *colon;
+    size_t host_len;
+    int use_ssl, port;
+
+    if (anbs_websocket_is_connected()) {
+        return 0;
+    }
+    if (strncmp(url, "wss://", 6) == 0) {
+        use_ssl = 1;
+        port = 443;
+        rest = url + 6;
+    } else if (strncmp(url, "ws://", 5) == 0) {
+        use_ssl = 0;
+        port = 80;
+        rest = url + 5;
+    } else {
+        return -1;
+    }
+
+    path = strchr(rest, '/');
+    host_len = path ? (size_t)(path - rest) : strlen(rest);
+    colon = memchr(rest, ':', host_len);
+    if (colon) {
+        port = atoi(colon + 1);
+        host_len = colon - rest;
+    }
+    if (host_len == 0 || host_len >= sizeof(host) || port <= 0) {
+        return -1;
+    }
+    memcpy(host, rest, host_len);
+    host[host_len] = '\0';
+
+    /* After the first call this fails harmlessly and the client is reused */
+    anbs_websocket_init(g_anbs_display, host, port, path ? path : "/", use_ssl);
+    return anbs_websocket_connect();
+}
+
+/* Ask the gateway at URL (ANBS_WS_GATEWAY), which answers
+   {"type": "query", ...} requests with {"response": ...} or
+   {"error": ...}.  Queries from every thread share its one connection.
+   Returns 0 with the answer in *RESPONSE, -1 with an error there, or
+   AI_GATEWAY_UNAVAILABLE if the gateway can't be reached and the query
+   should go straight to the provider. */
+static int ai_gateway_query(const char *url, const char *query, const struct ai_options *opts, char **response,
+                            double *elapsed_ms) {
+    json_object *request, *reply, *field;
+    struct timeval start;
+    char *text = NULL, message[512];
+    int result = -1;
+
+    gettimeofday(&start, NULL);
+    if (ai_gateway_connect(url) != 0) {
+        return AI_GATEWAY_UNAVAILABLE;
+    }
+
+    request = json_object_new_object();
+    json_object_object_add(request, "type", json_object_new_string("query"));
+    json_object_object_add(request, "query", json_object_new_string(query));
+    if (opts->model) {
+        json_object_object_add(request, "model", json_object_new_string(opts->model));
+    }
+    json_object_object_add(request, "max_tokens",
+                           json_object_new_int(opts->max_tokens > 0 ? opts->max_tokens : AI_MAX_TOKENS));
+
+    if (anbs_websocket_request_wait(json_object_to_json_string(request), opts->timeout * 1000, &text) != 0) {
+        *response = strdup("Error: AI gateway did not answer");
+    } else if ((reply = json_tokener_parse(text)) != NULL &&
+               json_object_object_get_ex(reply, "response", &field)) {
+        *response = strdup(json_object_get_string(field));
+        result = 0;
+        json_object_put(reply);
+    } else {
+        snprintf(message, sizeof(message), "Error: AI gateway: %s",
+                 reply && json_object_object_get_ex(reply, "error", &field) ?
+                 json_object_get_string(field) : "malformed reply");
+        *response = strdup(message);
+        json_object_put(reply);
+    }
+
+    free(text);
+    json_object_put(request);
+    *elapsed_ms = ai_elapsed_ms(&start);
+    return result;
+}
+
+/* Shared daemon (ANBS_DAEMON).  A shell started with `@daemon start'
+   answers the @vertex queries of the user's other shells over a Unix
+   socket, so they share its response cache, warm connections, rate
+   limits and breakers instead of each keeping its own.  Each query is
+   one connection carrying a request frame and a reply frame: a 32-bit
+   big-endian length, then a type byte and the body.  A shell that can't
+   reach the daemon answers in-process as it would without one. */
+#define AI_DAEMON_UNAVAILABLE 1
+#define AI_DAEMON_FRAME_MAX (16 * 1024 * 1024)
+#define AI_DAEMON_QUERY_HEAD 20     /* fixed fields ahead of the model */
+
+enum {
+    AI_DAEMON_QUERY = 'Q',          /* flags, provider, timeout, max_tokens, cache_ttl, hedge,
+                                       model length, model, then the query */
+    AI_DAEMON_STATUS = 'S',
+    AI_DAEMON_STOP = 'X',
+    AI_DAEMON_ANSWER = 'A',
+    AI_DAEMON_CACHED = 'C',         /* an answer from the daemon's cache */
+    AI_DAEMON_ERROR = 'E'
+};
+
+#define AI_DAEMON_NO_CACHE 0x1
+
+static int ai_daemon_serving;       /* set in the daemon, which answers its own queries */
+static __thread int ai_cache_served; /* the last send_ai_query() was a cache hit */
+
+/* The daemon's socket into PATH: ANBS_DAEMON when it is a path, else
+   anbsd.sock in $XDG_RUNTIME_DIR or in a private directory under /tmp.
+   VALUE is the setting to use; NULL, empty or 0 means no daemon. */
+static int ai_daemon_path(const char *value, char *path, size_t size) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char private_dir[64];
+    struct stat st;
+
+    if (!value || !*value || strcmp(value, "0") == 0) {
+        return -1;
+    }
+    if (value[0] == '/') {
+        return snprintf(path, size, "%s", value) < (int)size ? 0 : -1;
+    }
+    if (!dir || !*dir) {
+        /* Refuse a directory someone else made to catch our queries */
+        snprintf(private_dir, sizeof(private_dir), "/tmp/anbsd-%ld", (long)getuid());
+        if ((mkdir(private_dir, 0700) != 0 && errno != EEXIST) || lstat(private_dir, &st) != 0 ||
+            !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+            return -1;
+        }
+        dir = private_dir;
+    }
+    return snprintf(path, size, "%s/anbsd.sock", dir) < (int)size ? 0 : -1;
+}
+
+static void ai_wire_put32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static uint32_t ai_wire_get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Move LEN bytes to or from FD, polling so that C-c, *CANCEL or
+   DEADLINE_MS (if not negative) can end the wait.  Returns 0, or -1 on
+   error, end of file, interrupt or timeout. */
+static int ai_daemon_io(int fd, void *buf, size_t len, int writing, long deadline_ms, volatile int *cancel) {
+    struct pollfd pfd;
+    struct timeval start;
+    char *p = buf;
+    ssize_t n;
+
+    gettimeofday(&start, NULL);
+    while (len > 0) {
+        if ((interrupt_state && !ai_daemon_serving) || (cancel && *cancel) ||
+            (deadline_ms >= 0 && ai_elapsed_ms(&start) > deadline_ms)) {
+            return -1;
+        }
+        pfd.fd = fd;
+        pfd.events = writing ? POLLOUT : POLLIN;
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        n = writing ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+        if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+            return -1;
+        }
+        if (n > 0) {
+            p += n;
+            len -= n;
+        }
+    }
+    return 0;
+}
+
+static int ai_daemon_send(int fd, int type, const void *body, size_t len, long deadline_ms, volatile int *cancel) {
+    unsigned char head[5];
+
+    ai_wire_put32(head, len + 1);
+    head[4] = type;
+    if (ai_daemon_io(fd, head, sizeof(head), 1, deadline_ms, cancel) != 0 ||
+        ai_daemon_io(fd, (void *)body, len, 1, deadline_ms, cancel) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a frame.  Returns its type with the body, NUL-terminated, in
+   *BODY and its length in *LEN, or -1. */
+static int ai_daemon_recv(int fd, char **body, size_t *len, long deadline_ms, volatile int *cancel) {
+    unsigned char head[5];
+    uint32_t size;
+
+    *body = NULL;
+    if (ai_daemon_io(fd, head, sizeof(head), 0, deadline_ms, cancel) != 0) {
+        return -1;
+    }
+    size = ai_wire_get32(head);
+    if (size < 1 || size > AI_DAEMON_FRAME_MAX || !(*body = malloc(size))) {
+        return -1;
+    }
+    *len = size - 1;
+    if (ai_daemon_io(fd, *body, *len, 0, deadline_ms, cancel) != 0) {
+        free(*body);
+        *body = NULL;
+        return -1;
+    }
+    (*body)[*len] = '\0';
+    return head[4];
+}
+
+static int ai_daemon_connect(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Ask the daemon for QUERY.  Returns 0 with the answer in *RESPONSE, -1
+   with an error there, or AI_DAEMON_UNAVAILABLE if no daemon took the
+   query and it should be answered in-process.  *CACHED tells whether the
+   answer came from the daemon's cache. */
+static int ai_daemon_query(const char *query, const struct ai_options *opts, char **response, int *cached,
+                           double *elapsed_ms, volatile int *cancel) {
+    struct timeval start;
+    unsigned char *body;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)], *reply;
+    size_t model_len, query_len, len;
+    long deadline_ms;
+    int fd, type;
+
+    /* Streamed answers are drawn as they arrive, so stay in-process */
+    if (ai_daemon_serving || opts->stream_mode || ai_daemon_path(getenv("ANBS_DAEMON"), path, sizeof(path)) != 0 ||
+        (fd = ai_daemon_connect(path)) < 0) {
+        return AI_DAEMON_UNAVAILABLE;
+    }
+    gettimeofday(&start, NULL);
+
+    model_len = opts->model ? strlen(opts->model) : 0;
+    query_len = strlen(query);
+    if (model_len > 0xffff) {
+        close(fd);
+        return AI_DAEMON_UNAVAILABLE;
+    }
+    body = malloc(AI_DAEMON_QUERY_HEAD + model_len + query_len);
+    if (!body) {
+        close(fd);
+        return AI_DAEMON_UNAVAILABLE;
+    }
+    body[0] = opts->no_cache ? AI_DAEMON_NO_CACHE : 0;
+    body[1] = (unsigned char)(signed char)opts->provider;
+    ai_wire_put32(body + 2, opts->timeout);
+    ai_wire_put32(body + 6, opts->max_tokens);
+    ai_wire_put32(body + 10, opts->cache_ttl);
+    ai_wire_put32(body + 14, (uint32_t)opts->hedge_ms);
+    body[18] = model_len >> 8;
+    body[19] = model_len;
+    memcpy(body + AI_DAEMON_QUERY_HEAD, opts->model ? opts->model : "", model_len);
+    memcpy(body + AI_DAEMON_QUERY_HEAD + model_len, query, query_len);
+
+    /* Room for the daemon's retries and a wait on the rate limit */
+    deadline_ms = (opts->timeout * 1000L + AI_RETRY_CAP_MS) * (AI_RETRY_MAX + 1) + AI_RATE_MAX_WAIT_MS;
+    if (ai_daemon_send(fd, AI_DAEMON_QUERY, body, AI_DAEMON_QUERY_HEAD + model_len + query_len, 5000, cancel) != 0) {
+        /* It never had the query; answering here costs nothing twice */
+        free(body);
+        close(fd);
+        return AI_DAEMON_UNAVAILABLE;
+    }
+    free(body);
+    type = ai_daemon_recv(fd, &reply, &len, deadline_ms, cancel);
+    close(fd);
+
+    *elapsed_ms = ai_elapsed_ms(&start);
+    *cached = type == AI_DAEMON_CACHED;
+    if (type == AI_DAEMON_ANSWER || type == AI_DAEMON_CACHED) {
+        *response = reply;
+        return 0;
+    }
+    if (type == AI_DAEMON_ERROR) {
+        *response = reply;
+    } else {
+        free(reply);
+        *response = strdup(interrupt_state ? "Error: request interrupted" : "Error: AI daemon did not answer");
+    }
+    return -1;
+}
+
+/* Record one answered query against its latency objective: OPTS's class,
+   or CLASS for a plain @vertex.  With SHOW set the status line reports
+   the response time; it always does while a budget is burning. */
+static void ai_slo_record(const struct ai_options *opts, const char *class, double elapsed_ms, int show) {
+    const char *slo = opts->slo ? opts->slo : class;
+    char status[256], burning[192];
+    int burns;
+
+    burns = anbs_metrics_slo_observe(slo, elapsed_ms);
+    if (!g_anbs_display || (!show && burns <= 0)) {
+        return;
+    }
+    if (burns > 0 && anbs_metrics_slo_status(burning, sizeof(burning)) > 0) {
+        snprintf(status, sizeof(status), "AI response: %.1fms | %s", elapsed_ms, burning);
+    } else {
+        snprintf(status, sizeof(status), "AI response: %.1fms (%s target: <%gms)",
+                 elapsed_ms, slo, anbs_metrics_slo_target(slo));
+    }
+    anbs_status_write(g_anbs_display, status);
+}
+
+/* Speculative queries (ANBS_SPECULATE).  When the user pauses on an
+   @vertex line, the line editor has it answered on the worker pool while
+   they decide whether to press Enter; the command then takes the answer
+   from the cache instead of asking again.  Any edit to the line cancels
+   the request.  There is at most one at a time. */
+struct ai_speculation {
+    char *line;             /* the command line being answered */
+    char *key;              /* its cache key, to recognize the query that runs */
+    char *query;
+    char *model;
+    struct ai_options opts;
+    volatile int cancelled;
+    int done;
+    int refs;               /* the shell's and the worker's */
+};
+
+static struct ai_speculation *ai_speculation;  /* the shell's current one */
+static pthread_mutex_t ai_speculation_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ai_speculation_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long ai_speculation_started, ai_speculation_adopted, ai_speculation_cancelled;
+
+static void ai_speculation_unref(struct ai_speculation *spec) {
+    int refs;
+
+    pthread_mutex_lock(&ai_speculation_mutex);
+    refs = --spec->refs;
+    pthread_mutex_unlock(&ai_speculation_mutex);
+    if (refs == 0) {
+        free(spec->line);
+        free(spec->key);
+        free(spec->query);
+        free(spec->model);
+        free(spec);
+    }
+}
+
+/* Aborts the transfer once the speculation is cancelled */
+static int ai_speculation_progress(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                                   curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    return ((struct ai_speculation *)clientp)->cancelled;
+}
+
+static void ai_speculation_task(void *arg) {
+    struct ai_speculation *spec = arg;
+    const struct ai_provider *provider = ai_provider_select(&spec->opts);
+    struct ai_request req;
+    char *flight, *cached, *response = NULL;
+    double elapsed_ms;
+    int hit;
+
+    /* Guesses don't spend a failing provider's trial request or the
+       rate limit the query itself may need; with a daemon, its cache
+       keeps the answer for the query that runs */
+    if (ai_daemon_query(spec->query, &spec->opts, &response, &hit, &elapsed_ms, &spec->cancelled) ==
+        AI_DAEMON_UNAVAILABLE && !spec->cancelled && provider && !ai_breaker_blocked(provider) &&
+        ai_rate_take(provider, ai_rate_tokens(spec->query, spec->opts.max_tokens)) == 0) {
+        flight = ai_flight_begin(spec->query, &spec->opts);
+        cached = anbs_cache_get(spec->key, NULL);
+        if (!cached && !spec->cancelled && ai_request_prepare(&req, spec->query, &spec->opts, &response) == 0) {
+            curl_easy_setopt(req.curl, CURLOPT_XFERINFOFUNCTION, ai_speculation_progress);
+            curl_easy_setopt(req.curl, CURLOPT_XFERINFODATA, (void *)spec);
+            curl_easy_setopt(req.curl, CURLOPT_NOPROGRESS, 0L);
+            if (ai_request_finish(&req, curl_easy_perform(req.curl), &response, &elapsed_ms) == 0) {
+                ai_cache_store(spec->query, &spec->opts, response);
+                ai_record_latency(req.provider, elapsed_ms);
+            }
+        }
+        ai_flight_end(flight);
+        free(cached);
+    }
+    free(response);
+
+    pthread_mutex_lock(&ai_speculation_mutex);
+    spec->done = 1;
+    pthread_cond_broadcast(&ai_speculation_cond);
+    pthread_mutex_unlock(&ai_speculation_mutex);
+    ai_speculation_unref(spec);
+}
+
+/* If QUERY is being answered speculatively, wait for that answer to reach
+   the cache rather than send the query again.  C-c stops the wait. */
+static void ai_speculation_adopt(const char *query, const struct ai_options *opts) {
+    struct ai_speculation *spec = ai_speculation;
+    struct timespec deadline;
+    struct timeval start;
+    char *key;
+
+    if (!spec || opts->no_cache || !(key = ai_cache_key(query, opts, NULL))) {
+        return;
+    }
+    if (strcmp(key, spec->key) == 0) {
+        gettimeofday(&start, NULL);
+        pthread_mutex_lock(&ai_speculation_mutex);
+        ai_speculation_adopted++;
+        while (!spec->done && interrupt_state == 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100 * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&ai_speculation_cond, &ai_speculation_mutex, &deadline);
+        }
+        pthread_mutex_unlock(&ai_speculation_mutex);
+        anbs_metrics_trace_span("speculation_wait", "vertex", &start, ai_elapsed_ms(&start), NULL);
+        ai_speculation = NULL;
+        ai_speculation_unref(spec);
+    }
+    free(key);
+}
+
+/* Send query to AI service */
+static int send_ai_query(const char *query, const struct ai_options *opts, char **response) {
+    struct ai_request req;
+    struct ai_options route;
+    struct timeval lookup_start, flight_start;
+    CURLcode res;
+    double elapsed_ms, lookup_ms;
+    int result, attempt, max_retries, hit;
+    char *cached, *flight = NULL, *failure = NULL;
+    const char *gateway, *retries;
+    long backoff;
+
+    gettimeofday(&lookup_start, NULL);
+    ai_cache_served = 0;
+    ai_speculation_adopt(query, opts);
+
+    /* A shared daemon answers from its own cache and connections */
+    if ((result = ai_daemon_query(query, opts, response, &hit, &elapsed_ms, NULL)) != AI_DAEMON_UNAVAILABLE) {
+        if (result == 0 && anbs_metrics_init() == 0) {
+            anbs_metrics_record_response_time("vertex:daemon", elapsed_ms, NULL);
+        }
+        if (result == 0) {
+            ai_slo_record(opts, hit ? "vertex.cached" : "vertex.uncached", elapsed_ms, !hit);
+        }
+        return result;
+    }
+
+    cached = ai_cache_lookup(query, opts);
+    if (!cached) {
+        cached = ai_cache_revalidate(query, opts);
+    }
+    gettimeofday(&flight_start, NULL);
+    lookup_ms = (flight_start.tv_sec - lookup_start.tv_sec) * 1000.0 +
+                (flight_start.tv_usec - lookup_start.tv_usec) / 1000.0;
+    anbs_metrics_trace_span("cache_lookup", "vertex", &lookup_start, lookup_ms,
+                            cached ? "{\"hit\": true}" : "{\"hit\": false}");
+    if (!cached) {
+        /* Coalesce with an identical request already on its way out */
+        flight = ai_flight_begin(query, opts);
+        if ((cached = ai_cache_lookup(query, opts)) != NULL) {
+            ai_flight_end(flight);
+        }
+        anbs_metrics_trace_span("coalesce_wait", "vertex", &flight_start, ai_elapsed_ms(&flight_start),
+                                cached ? "{\"hit\": true}" : "{\"hit\": false}");
+    }
+    if (cached) {
+        ai_record_cost("optimize:cache_hit", ai_elapsed_ms(&lookup_start));
+        ai_slo_record(opts, "vertex.cached", ai_elapsed_ms(&lookup_start), 0);
+        ai_serve_cached(cached, opts);
+        ai_cache_served = 1;
+        *response = cached;
+        return 0;
+    }
+
+    /* A configured gateway carries the query over its shared WebSocket */
+    gateway = getenv("ANBS_WS_GATEWAY");
+    if (gateway && *gateway &&
+        (result = ai_gateway_query(gateway, query, opts, response, &elapsed_ms)) != AI_GATEWAY_UNAVAILABLE) {
+        if (result == 0) {
+            ai_serve_cached(*response, opts);
+            ai_cache_store(query, opts, *response);
+            if (anbs_metrics_init() == 0) {
+                anbs_metrics_record_response_time("vertex:gateway", elapsed_ms, NULL);
+            }
+            ai_record_cost("optimize:cache_miss", ai_elapsed_ms(&lookup_start));
+            ai_slo_record(opts, "vertex.uncached", ai_elapsed_ms(&lookup_start), 1);
+        }
+        ai_flight_end(flight);
+        return result;
+    }
+
+    retries = getenv("ANBS_RETRY_MAX");
+    max_retries = retries ? atoi(retries) : AI_RETRY_MAX;
+
+    for (attempt = 0; ; attempt++) {
+        /* Past an open breaker, or a failover around it; then hold the
+           query back rather than send one the provider will refuse */
+        if (ai_breaker_route(opts, &route, response) != 0 ||
+            ai_rate_wait(ai_provider_select(&route), ai_rate_tokens(query, route.max_tokens), response) != 0 ||
+            ai_request_prepare(&req, query, &route, response) != 0) {
+            result = -1;
+            break;
+        }
+        free(failure);      /* the retry went out; its own outcome counts */
+        failure = NULL;
+
+        /* Update display with processing status */
+        if (g_anbs_display) {
+            anbs_status_write(g_anbs_display, attempt ? "Retrying AI query..." : "Processing AI query...");
+            anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_STATUS);
+        }
+
+        /* Perform the request */
+        if (route.hedge_ms && !route.stream_mode) {
+            result = ai_hedged_perform(&req, query, &route, response, &elapsed_ms);
+        } else {
+            res = route.stream_mode ? ai_stream_perform(&req) : curl_easy_perform(req.curl);
+            result = ai_request_finish(&req, res, response, &elapsed_ms);
+        }
+
+        if (result == 0 || attempt >= max_retries || !ai_retryable(&req) || !ai_retry_take(req.provider)) {
+            break;
+        }
+        backoff = ai_retry_backoff_ms(attempt);
+        ANBS_DEBUG_LOG("@vertex retry %d on %s in %ld ms: %s", attempt + 1, req.provider->name, backoff,
+                       *response ? *response : "no response");
+        failure = *response;
+        *response = NULL;
+        if (ai_sleep_ms(backoff) != 0) {
+            break;
+        }
+    }
+
+    /* A retry that never went out reports the failure that prompted it */
+    if (failure) {
+        free(*response);
+        *response = failure;
+    }
+
+    if (result == 0) {
+        ai_cache_store(query, &route, *response);
+        ai_record_latency(req.provider, elapsed_ms);
+        ai_record_cost("optimize:cache_miss", ai_elapsed_ms(&lookup_start));
+        ai_slo_record(opts, "vertex.uncached", ai_elapsed_ms(&lookup_start), 1);
+    }
+    ai_flight_end(flight);
+
+    return result;
+}
+
+/* Health check for AI service: the selected provider's cached health,
+   probed again when stale or with --no-cache.  Costs no completion. */
+static int ai_health_check(const struct ai_options *opts) {
+    const struct ai_provider *provider = ai_provider_select(opts);
+    struct ai_health health;
+
+    if (!provider) {
+        printf("AI Health Check: OFFLINE\n");
+        printf("Error: No API key found. Set ANTHROPIC_API_KEY or OPENAI_API_KEY environment variable.\n");
+        return 1;
+    }
+    health = ai_health_get(provider, opts->no_cache);
+
+    if (g_anbs_display) {
+        if (health.online) {
+            anbs_status_write(g_anbs_display, "AI service: Online ✅");
+        } else {
+            anbs_status_write(g_anbs_display, "AI service: Offline ❌");
+        }
+        anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_STATUS);
+    }
+
+    printf("AI Health Check: %s\n", health.online ? "ONLINE" : "OFFLINE");
+    if (!health.online) {
+        printf("Error: %s\n", health.error);
+    }
+    printf("Provider: %s, %d ms, checked %lds ago\n", provider->name, health.latency_ms,
+           (long)(time(NULL) - health.checked));
+
+    return health.online ? 0 : 1;
+}
+
+/* Token budget of a bare --context */
+static int ai_context_budget(void) {
+    const char *value = getenv("ANBS_CONTEXT_TOKENS");
+
+    return value && atoi(value) > 0 ? atoi(value) : AI_CONTEXT_DEFAULT_TOKENS;
+}
+
+/* Pack the memories most relevant to the query into opts->context, within
+   opts->context_tokens.  Leaves it NULL when nothing relevant fits or the
+   store can't be opened; the query then goes alone. */
+static void ai_context_pack(struct ai_options *opts) {
+    struct timeval start;
+    char args[64];
+    int tokens;
+
+    anbs_metrics_init();
+    gettimeofday(&start, NULL);
+    tokens = anbs_memory_pack(opts->query, opts->context_tokens, &opts->context);
+    snprintf(args, sizeof(args), "{\"budget\": %d, \"tokens\": %d}", opts->context_tokens, tokens);
+    anbs_metrics_trace_span("context", "vertex", &start, ai_elapsed_ms(&start), args);
+}
+
+/* Parse command line options for @vertex */
+static int parse_ai_options(WORD_LIST *list, struct ai_options *opts) {
+    WORD_LIST *l;
+
+    /* Initialize options */
+    ai_options_init(opts);
+
+    for (l = list; l; l = l->next) {
+        if (STREQ(l->word->word, "--health")) {
+            opts->health_check = 1;
+        } else if (STREQ(l->word->word, "--stream")) {
+            opts->stream_mode = 1;
+        } else if (STREQ(l->word->word, "--async")) {
+            opts->async_mode = 1;
+        } else if (STREQ(l->word->word, "--batch")) {
+            opts->batch_mode = 1;
+            opts->batch_file = "-";
+        } else if (strncmp(l->word->word, "--batch=", 8) == 0) {
+            opts->batch_mode = 1;
+            opts->batch_file = l->word->word + 8;
+        } else if (strncmp(l->word->word, "--parallel=", 11) == 0) {
+            opts->parallel = atoi(l->word->word + 11);
+            if (opts->parallel < 0) opts->parallel = 0;
+            if (opts->parallel > AI_BATCH_MAX_PARALLEL) opts->parallel = AI_BATCH_MAX_PARALLEL;
+        } else if (STREQ(l->word->word, "--unordered")) {
+            opts->unordered = 1;
+        } else if (STREQ(l->word->word, "--combine")) {
+            opts->combine = AI_COMBINE_DEFAULT;
+        } else if (strncmp(l->word->word, "--combine=", 10) == 0) {
+            opts->combine = atoi(l->word->word + 10);
+            if (opts->combine < 0) opts->combine = 0;
+            if (opts->combine > AI_COMBINE_MAX) opts->combine = AI_COMBINE_MAX;
+        } else if (STREQ(l->word->word, "--hedge")) {
+            opts->hedge_ms = -1;
+        } else if (strncmp(l->word->word, "--hedge=", 8) == 0) {
+            opts->hedge_ms = atoi(l->word->word + 8);
+            if (opts->hedge_ms <= 0) opts->hedge_ms = -1;
+        } else if (STREQ(l->word->word, "--context")) {
+            opts->context_tokens = ai_context_budget();
+        } else if (strncmp(l->word->word, "--context=", 10) == 0) {
+            opts->context_tokens = atoi(l->word->word + 10);
+            if (opts->context_tokens < 0) opts->context_tokens = 0;
+        } else if (STREQ(l->word->word, "--no-cache")) {
+            opts->no_cache = 1;
+        } else if (strncmp(l->word->word, "--cache-ttl=", 12) == 0) {
+            opts->cache_ttl = atoi(l->word->word + 12);
+            if (opts->cache_ttl < 0) opts->cache_ttl = 0;
+        } else if (strncmp(l->word->word, "--timeout=", 10) == 0) {
+            opts->timeout = atoi(l->word->word + 10);
+            if (opts->timeout <= 0) opts->timeout = 30;
+        } else if (strncmp(l->word->word, "--model=", 8) == 0) {
+            opts->model = l->word->word + 8;
+        } else if (l->word->word[0] != '-') {
+            /* This is the query text */
+            opts->query = l->word->word;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Send one query and report the result; returns a builtin exit status */
+static int vertex_run(struct ai_options *opts) {
+    struct timeval start, render_start;
+    char *response = NULL, *query = NULL;
+    int result;
+
+    /* Opens the ANBS_TRACE file before the first span */
+    anbs_metrics_init();
+    gettimeofday(&start, NULL);
+
+    /* Packed memories go ahead of the question */
+    if (opts->context) {
+        query = malloc(sizeof(AI_CONTEXT_INTRO) + strlen(opts->context) + strlen(opts->query) + 1);
+        if (query) {
+            sprintf(query, "%s%s\n%s", AI_CONTEXT_INTRO, opts->context, opts->query);
+        }
+    }
+
+    /* Send query to AI */
+    result = send_ai_query(query ? query : opts->query, opts, &response);
+    free(query);
+
+    if (result == 0 && response && opts->stream_mode) {
+        /* Already rendered to stdout and the chat panel while streaming */
+        free(response);
+        anbs_metrics_trace_span("@vertex", "vertex", &start, ai_elapsed_ms(&start), "{\"stream\": true}");
+        return EXECUTION_SUCCESS;
+    } else if (result == 0 && response) {
+        /* Display response in terminal */
+        gettimeofday(&render_start, NULL);
+        printf("🤖 Vertex: %s\n", response);
+
+        /* Also display in AI chat panel if available */
+        if (g_anbs_display) {
+            char formatted_response[4096];
+            snprintf(formatted_response, sizeof(formatted_response), "🤖 Vertex: %s\n", response);
+            anbs_ai_chat_write(g_anbs_display, formatted_response);
+            anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_AI_CHAT);
+        }
+        anbs_metrics_trace_span("render", "vertex", &render_start, ai_elapsed_ms(&render_start), NULL);
+
+        free(response);
+        anbs_metrics_trace_span("@vertex", "vertex", &start, ai_elapsed_ms(&start), NULL);
+        return EXECUTION_SUCCESS;
+    } else {
+        /* Handle error */
+        if (response) {
+            builtin_error("@vertex: %s", response);
+            free(response);
+        } else {
+            builtin_error("@vertex: failed to get AI response");
+        }
+        anbs_metrics_trace_span("@vertex", "vertex", &start, ai_elapsed_ms(&start), "{\"failed\": true}");
+        return EXECUTION_FAILURE;
+    }
+}
+
+/* Read one query per line from PATH ("-" for standard input), skipping
+   blank lines.  Returns the number of queries or -1. */
+static int ai_batch_read(const char *path, struct ai_batch_item **items) {
+    FILE *fp;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int count = 0, size = 0;
+    struct ai_batch_item *list = NULL, *grown;
+
+    fp = (path == NULL || STREQ(path, "-")) ? stdin : fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (count == size) {
+            size = size ? size * 2 : 16;
+            grown = realloc(list, size * sizeof(*list));
+            if (!grown) {
+                break;
+            }
+            list = grown;
+        }
+        memset(&list[count], 0, sizeof(list[count]));
+        list[count].query = strdup(line);
+        count++;
+    }
+
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    *items = list;
+    return count;
+}
+
+/* Print one finished batch entry */
+static void ai_batch_emit(struct ai_batch_item *item, int index, int tagged) {
+    if (item->status == 0) {
+        if (item->label) {
+            printf("[%s] 🤖 Vertex: %s\n", item->label, item->response);
+        } else if (tagged) {
+            printf("[%d] 🤖 Vertex: %s\n", index + 1, item->response);
+        } else {
+            printf("🤖 Vertex: %s\n", item->response);
+        }
+    } else if (item->label) {
+        builtin_error("%s: %s", item->label, item->response ? item->response : "failed to get AI response");
+    } else {
+        builtin_error("@vertex: query %d: %s", index + 1,
+                      item->response ? item->response : "failed to get AI response");
+    }
+    fflush(stdout);
+}
+
+/* Resolve ITEM from the response cache if it is there; returns ITEM->done.
+   Items the caller finished beforehand are left as they are. */
+static int ai_batch_cached(struct ai_batch_item *item, const struct ai_options *opts) {
+    if (!item->done && (item->response = ai_cache_lookup(item->query, opts)) != NULL) {
+        item->status = 0;
+        item->done = 1;
+    }
+    return item->done;
+}
+
+/* One prompt asking for the answers to the MEMBERS unfinished items of
+   ITEMS[first..first+span) as a JSON array */
+static char *ai_combine_prompt(struct ai_batch_item *items, int first, int span, int members) {
+    json_object *questions = json_object_new_array();
+    const char *list;
+    char *prompt;
+    int i;
+
+    for (i = first; i < first + span; i++) {
+        if (!items[i].done) {
+            json_object_array_add(questions, json_object_new_string(items[i].query));
+        }
+    }
+    list = json_object_to_json_string_ext(questions, JSON_C_TO_STRING_PLAIN);
+
+    prompt = malloc(strlen(list) + 256);
+    if (prompt) {
+        sprintf(prompt, "Answer each of the %d questions in this JSON array independently. "
+                "Reply with only a JSON array of %d strings, the answers in the same order.\n\n%s",
+                members, members, list);
+    }
+    json_object_put(questions);
+    return prompt;
+}
+
+/* Hand the answers in RESPONSE, a JSON array, to the unfinished items of
+   ITEMS[first..first+span).  Returns 0 when each one got an answer. */
+static int ai_combine_split(struct ai_batch_item *items, int first, int span, const char *response) {
+    const char *start = strchr(response, '[');
+    const char *end = strrchr(response, ']');
+    json_object *answers;
+    char *array;
+    int i, k = 0, members = 0;
+
+    /* Models sometimes wrap the array in prose or a code fence */
+    if (!start || !end || end < start) {
+        return -1;
+    }
+    array = strndup(start, end - start + 1);
+    answers = array ? json_tokener_parse(array) : NULL;
+    free(array);
+
+    for (i = first; i < first + span; i++) {
+        members += !items[i].done;
+    }
+    if (!answers || !json_object_is_type(answers, json_type_array) ||
+        (int)json_object_array_length(answers) != members) {
+        if (answers) {
+            json_object_put(answers);
+        }
+        return -1;
+    }
+
+    for (i = first; i < first + span; i++) {
+        if (!items[i].done) {
+            items[i].response = strdup(json_object_get_string(json_object_array_get_idx(answers, k++)));
+        }
+    }
+    json_object_put(answers);
+    return 0;
+}
+
+/* Drive ITEMS[0..COUNT) concurrently on one multi handle, keeping at most
+   ai_limit_window() transfers in flight.  With opts->combine, runs of short
+   queries go out together, one call per run, and a reply that doesn't
+   split cleanly is retried query by query.  EMIT selects whether results print
+   in input order, tagged as they complete, or not at all; when LABEL is
+   set, progress goes to the status panel.  Returns the number of failed
+   items (items left undone by an interrupt count as failed), or -1. */
+static int ai_run_concurrent(struct ai_batch_item *items, int count, const struct ai_options *opts, int emit, const char *label) {
+    struct ai_request *reqs;
+    struct ai_options item_opts, combined_opts;
+    const struct ai_provider *provider;
+    CURLM *multi;
+    CURLMsg *msg;
+    char status_msg[128];
+    int *spans;
+    int next = 0, emitted = 0, in_flight = 0, running = 0, pending;
+    int failures = 0, completed = 0, held = -1, i, j;
+    long rate_wait;
+
+    reqs = calloc(count, sizeof(*reqs));
+    spans = calloc(count, sizeof(*spans));
+    multi = curl_multi_init();
+    if (!reqs || !spans || !multi) {
+        free(reqs);
+        free(spans);
+        if (multi) {
+            curl_multi_cleanup(multi);
+        }
+        return -1;
+    }
+
+    /* Batched transfers are collected whole; streaming makes no sense here */
+    item_opts = *opts;
+    item_opts.stream_mode = 0;
+    combined_opts = item_opts;
+    provider = ai_provider_select(&item_opts);
+
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                      (long)(opts->parallel > 0 ? opts->parallel : AI_BATCH_MAX_PARALLEL));
+
+    if (g_anbs_display && label) {
+        snprintf(status_msg, sizeof(status_msg), "%s: 0/%d (%d parallel)...",
+                 label, count, ai_limit_window(opts, provider));
+        anbs_status_write(g_anbs_display, status_msg);
+        anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_STATUS);
+    }
+
+    while ((next < count || in_flight > 0) && interrupt_state == 0) {
+        /* Top up the in-flight window, as far as the rate limits allow */
+        rate_wait = 0;
+        while (next < count && in_flight < ai_limit_window(opts, provider)) {
+            int span = 1, members = 1, shut;
+            char *prompt = NULL, *error = NULL;
+
+            if (ai_batch_cached(&items[next], &item_opts)) {
+                members = 0;
+            } else if (opts->combine > 1 && strlen(items[next].query) <= AI_COMBINE_MAX_QUERY) {
+                /* Fold the short queries that follow into the same call */
+                while (next + span < count && members < opts->combine &&
+                       strlen(items[next + span].query) <= AI_COMBINE_MAX_QUERY) {
+                    members += !ai_batch_cached(&items[next + span], &item_opts);
+                    span++;
+                }
+                if (members > 1) {
+                    prompt = ai_combine_prompt(items, next, span, members);
+                    combined_opts.max_tokens = AI_MAX_TOKENS * members < AI_COMBINE_MAX_TOKENS ?
+                                               AI_MAX_TOKENS * members : AI_COMBINE_MAX_TOKENS;
+                }
+            }
+
+            /* An endpoint whose breaker is open fails the rest at once */
+            shut = members > 0 && ai_breaker_admit(provider, &error) != 0;
+            if (!shut && members > 0 && (members == 1 || prompt) &&
+                (rate_wait = ai_rate_take(provider, ai_rate_tokens(prompt ? prompt : items[next].query,
+                                                                   prompt ? combined_opts.max_tokens :
+                                                                            item_opts.max_tokens))) > 0) {
+                free(prompt);
+                if (held != next) {
+                    ai_rate_count_wait(provider);
+                    held = next;
+                }
+                break;      /* the rest wait for room */
+            }
+            if (!shut && members > 0 && (members == 1 || prompt) &&
+                ai_request_prepare(&reqs[next], prompt ? prompt : items[next].query,
+                                   prompt ? &combined_opts : &item_opts, &error) == 0) {
+                curl_multi_add_handle(multi, reqs[next].curl);
+                spans[next] = prompt ? span : 1;
+                in_flight++;
+            } else if (members > 0) {
+                for (j = next; j < next + span; j++) {
+                    if (!items[j].done) {
+                        items[j].response = error ? strdup(error) : NULL;
+                        items[j].status = 1;
+                        items[j].done = 1;
+                    }
+                }
+            }
+            free(prompt);
+            free(error);
+
+            for (j = next; j < next + span; j++) {
+                if (items[j].done) {
+                    completed++;
+                    if (emit == AI_EMIT_TAGGED) {
+                        ai_batch_emit(&items[j], j, 1);
+                    }
+                }
+            }
+            next += span;
+        }
+
+        curl_multi_perform(multi, &running);
+
+        while ((msg = curl_multi_info_read(multi, &pending)) != NULL) {
+            struct ai_request *req = NULL;
+            long http_code = 0;
+            double elapsed_ms;
+
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &http_code);
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            in_flight--;
+
+            i = req - reqs;
+            elapsed_ms = ai_elapsed_ms(&req->start_time);
+            ai_limit_observe(req->provider, msg->data.result, http_code, spans[i] > 1 ? 0.0 : elapsed_ms);
+            if (spans[i] > 1) {
+                char *answer = NULL;
+                int status = ai_request_finish(req, msg->data.result, &answer, NULL) == 0 ? 0 : 1;
+
+                if (status == 0 && ai_combine_split(items, i, spans[i], answer) != 0) {
+                    /* The reply didn't split into one answer per query;
+                       resend them separately */
+                    for (j = i; j < i + spans[i]; j++) {
+                        if (!items[j].done && ai_request_prepare(&reqs[j], items[j].query, &item_opts, &items[j].response) == 0) {
+                            curl_multi_add_handle(multi, reqs[j].curl);
+                            spans[j] = 1;
+                            in_flight++;
+                        } else if (!items[j].done) {
+                            items[j].status = 1;
+                            items[j].done = 1;
+                            completed++;
+                            if (emit == AI_EMIT_TAGGED) {
+                                ai_batch_emit(&items[j], j, 1);
+                            }
+                        }
+                    }
+                } else {
+                    if (status == 0) {
+                        int members = 0;
+                        for (j = i; j < i + spans[i]; j++) {
+                            members += !items[j].done;
+                        }
+                        for (j = 0; j < members; j++) {
+                            ai_record_cost("optimize:batch_combined", elapsed_ms / members);
+                        }
+                    }
+                    for (j = i; j < i + spans[i]; j++) {
+                        if (items[j].done) {
+                            continue;
+                        }
+                        if (status != 0) {
+                            items[j].response = answer ? strdup(answer) : NULL;
+                        }
+                        items[j].status = status;
+                        items[j].done = 1;
+                        completed++;
+                        if (status == 0) {
+                            ai_cache_store(items[j].query, &item_opts, items[j].response);
+                        }
+                        if (emit == AI_EMIT_TAGGED) {
+                            ai_batch_emit(&items[j], j, 1);
+                        }
+                    }
+                }
+                free(answer);
+            } else {
+                const struct ai_provider *served = req->provider;
+
+                items[i].status = ai_request_finish(req, msg->data.result, &items[i].response, NULL) == 0 ? 0 : 1;
+                items[i].done = 1;
+                completed++;
+                if (items[i].status == 0) {
+                    ai_cache_store(items[i].query, &item_opts, items[i].response);
+                    ai_record_latency(served, elapsed_ms);
+                    ai_record_cost("optimize:batch_single", elapsed_ms);
+                }
+
+                if (emit == AI_EMIT_TAGGED) {
+                    ai_batch_emit(&items[i], i, 1);
+                }
+            }
+            if (g_anbs_display && label) {
+                snprintf(status_msg, sizeof(status_msg), "%s: %d/%d", label, completed, count);
+                anbs_status_write(g_anbs_display, status_msg);
+                anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_STATUS);
+            }
+        }
+
+        /* Release the completed prefix in input order */
+        while (emitted < next && items[emitted].done) {
+            if (emit == AI_EMIT_ORDERED) {
+                ai_batch_emit(&items[emitted], emitted, 0);
+            }
+            if (items[emitted].status != 0) {
+                failures++;
+            }
+            emitted++;
+        }
+
+        if (in_flight > 0 || rate_wait > 0) {
+            int timeout = rate_wait > 0 && rate_wait < 1000 ? (int)rate_wait : 1000;
+
+            if (g_anbs_display && label && rate_wait > 0 && in_flight == 0) {
+                snprintf(status_msg, sizeof(status_msg), "%s: %d/%d (waiting for the rate limit)",
+                         label, completed, count);
+                anbs_status_write(g_anbs_display, status_msg);
+                anbs_display_refresh_panel(g_anbs_display, ANBS_PANEL_STATUS);
+            }
+#if LIBCURL_VERSION_NUM >= 0x074200
+            curl_multi_poll(multi, NULL, 0, timeout, NULL);
+#else
+            if (in_flight > 0) {
+                curl_multi_wait(multi, NULL, 0, timeout, NULL);
+            } else {
+                usleep(timeout * 1000);
+            }
+#endif
+        }
+    }
+
+    /* Interrupted: abandon whatever is still on the wire */
+    for (i = 0; i < next; i++) {
+        if (!items[i].done && reqs[i].curl) {
+            curl_multi_remove_handle(multi, reqs[i].curl);
+            ai_request_finish(&reqs[i], CURLE_ABORTED_BY_CALLBACK, &items[i].response, NULL);
+        }
+    }
+
+    curl_multi_cleanup(multi);
+    free(reqs);
+    free(spans);
+
+    return failures + (count - emitted);
+}
+
+/* Free the queries and responses of a batch */
+static void ai_batch_free(struct ai_batch_item *items, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(items[i].query);
+        free(items[i].response);
+    }
+    free(items);
+}
+
+/* Run every query from the batch source concurrently.  Results print in
+   input order unless --unordered asks for them as they complete. */
+static int vertex_batch(struct ai_options *opts) {
+    struct ai_batch_item *items = NULL;
+    int count, failures;
+
+    count = ai_batch_read(opts->batch_file, &items);
+    if (count < 0) {
+        builtin_error("@vertex: cannot open batch file '%s'", opts->batch_file);
+        return EXECUTION_FAILURE;
+    }
+    if (count == 0) {
+        free(items);
+        return EXECUTION_SUCCESS;
+    }
+
+    failures = ai_run_concurrent(items, count, opts,
+                                 opts->unordered ? AI_EMIT_TAGGED : AI_EMIT_ORDERED,
+                                 "Processing AI queries");
+    ai_batch_free(items, count);
+
+    if (failures < 0) {
+        builtin_error("@vertex: out of memory");
+        return EXECUTION_FAILURE;
+    }
+
+    QUIT;
+
+    return failures ? EXECUTION_FAILURE : EXECUTION_SUCCESS;
+}
+
+/* Run the query in a background child entered in the job table, so
+   `jobs', `wait' and $! treat it like any other asynchronous command. */
+static int vertex_async(struct ai_options *opts) {
+    char *command;
+    pid_t pid;
+    int result;
+
+    command = xmalloc(strlen(opts->query) + 10);
+    sprintf(command, "@vertex %s", opts->query);
+
+    pid = make_child(command, FORK_ASYNC);
+
+    if (pid == 0) {
+#if defined (JOB_CONTROL)
+        FREE(command);
+#endif
+        /* The child must not write on the parent's pooled TLS connections
+           or its curses screen; results go to stdout like any background job. */
+        ai_pool_forget();
+        g_anbs_display = NULL;
+
+        result = vertex_run(opts);
+
+        fflush(stdout);
+        fflush(stderr);
+        exit(result);
+    }
+
+    stop_pipeline(1, (COMMAND *)NULL);
+    if (interactive) {
+        describe_pid(pid);
+    }
+
+    return EXECUTION_SUCCESS;
+}
+
+/* Predictive prefetch (ANBS_PREFETCH) */
+#define AI_PREFETCH_CONFIDENCE 0.6  /* share of past successors the prediction needs */
+
+static int ai_prefetch_trained;
+
+/* Split LINE into words the way the shell would if it performed no
+   expansions, removing quotes.  Returns NULL for anything that would expand
+   (globs, tildes, unbalanced quotes) so a replay could differ from what the
+   user will run; $, backquotes and operators are rejected by the caller. */
+static WORD_LIST *ai_prefetch_words(const char *line) {
+    WORD_LIST *words = NULL;
+    char *word;
+    const char *p = line;
+    size_t n;
+    int quote;
+
+    word = malloc(strlen(line) + 1);
+    if (!word) {
+        return NULL;
+    }
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            break;
+        }
+        if (*p == '~') {
+            goto fail;
+        }
+
+        for (n = 0, quote = 0; *p && (quote || (*p != ' ' && *p != '\t')); p++) {
+            if (quote == '\'') {
+                if (*p == '\'') quote = 0; else word[n++] = *p;
+            } else if (*p == '\\' && p[1] && (quote == 0 || strchr("\"\\", p[1]))) {
+                word[n++] = *++p;
+            } else if (quote == '"') {
+                if (*p == '"') quote = 0; else word[n++] = *p;
+            } else if (*p == '\'' || *p == '"') {
+                quote = *p;
+            } else if (strchr("*?[", *p)) {
+                goto fail;
+            } else {
+                word[n++] = *p;
+            }
+        }
+        if (quote) {
+            goto fail;
+        }
+        word[n] = '\0';
+        words = make_word_list(make_word(word), words);
+    }
+
+    free(word);
+    return REVERSE_LIST(words, WORD_LIST *);
+
+fail:
+    free(word);
+    dispose_words(words);
+    return NULL;
+}
+
+/* Parse LINE as an @vertex command that could be answered ahead of time:
+   a plain query, since the others print as they run or aren't cached.
+   Returns the cache key of an answer not yet cached, with OPTS pointing
+   into *WORDS, which the caller disposes of; or NULL. */
+static char *ai_prefetch_parse(const char *line, struct ai_options *opts, WORD_LIST **words) {
+    char *key, *cached;
+
+    *words = NULL;
+    if (strncmp(line, "@vertex ", 8) != 0 || strpbrk(line, "$`;&|<>()\n") != NULL) {
+        return NULL;
+    }
+    *words = ai_prefetch_words(line + 8);
+    if (!*words) {
+        return NULL;
+    }
+
+    if (parse_ai_options(*words, opts) != 0 || !opts->query || !*opts->query ||
+        opts->health_check || opts->batch_mode || opts->async_mode || opts->stream_mode ||
+        opts->no_cache || anbs_cache_init(0) != 0) {
+        return NULL;
+    }
+    key = ai_cache_key(opts->query, opts, NULL);
+    cached = key ? anbs_cache_get(key, NULL) : NULL;
+    if (cached) {
+        free(cached);
+        free(key);
+        key = NULL;
+    }
+    return key;
+}
+
+/* Answer LINE, an @vertex command the user is expected to run, into the
+   cache on the worker pool */
+static void ai_prefetch_query(const char *line) {
+    struct ai_options opts;
+    WORD_LIST *words;
+    char *key;
+
+    key = ai_prefetch_parse(line, &opts, &words);
+    if (key && ai_refresh_start(opts.query, &opts) == 0) {
+        ANBS_DEBUG_LOG("Prefetching likely next query: %.50s...", opts.query);
+    }
+    free(key);
+    dispose_words(words);
+}
+
+/* Called after each interactive command saved in the history.  When the
+   shell variable ANBS_PREFETCH is set to a non-zero value, feed LINE to the
+   optimizer's next-command model and, if it confidently expects an @vertex
+   query next and the worker pool is idle, fetch that query into the cache
+   so it is answered at once. */
+void anbs_ai_prefetch_next(const char *line) {
+    char *value, *next;
+    double confidence = 0.0;
+
+    value = get_string_value("ANBS_PREFETCH");
+    if (!value || !*value || STREQ(value, "0") || !line || !*line) {
+        return;
+    }
+
+#if defined (HISTORY)
+    /* Learn from the saved history once, up to the line just added */
+    if (!ai_prefetch_trained) {
+        HIST_ENTRY **list = history_list();
+        int i;
+
+        for (i = 0; list && list[i] && list[i + 1]; i++) {
+            anbs_optimize_observe(list[i]->line);
+        }
+    }
+#endif
+    ai_prefetch_trained = 1;
+    anbs_optimize_observe(line);
+
+    next = anbs_optimize_predict(line, &confidence);
+    if (next && confidence >= AI_PREFETCH_CONFIDENCE && anbs_optimize_idle()) {
+        ai_prefetch_query(next);
+    }
+    free(next);
+}
+
+/* Cancel the speculative query, unless it is for LINE.  A NULL LINE
+   cancels it whatever it is for. */
+void anbs_ai_speculate_cancel(const char *line) {
+    struct ai_speculation *spec = ai_speculation;
+
+    if (!spec || (line && STREQ(spec->line, line))) {
+        return;
+    }
+    ai_speculation = NULL;
+    pthread_mutex_lock(&ai_speculation_mutex);
+    if (!spec->done) {
+        spec->cancelled = 1;
+        ai_speculation_cancelled++;
+    }
+    pthread_mutex_unlock(&ai_speculation_mutex);
+    ai_speculation_unref(spec);
+}
+
+/* Called by the line editor when the user pauses on LINE.  If it is a
+   complete @vertex query whose answer isn't cached, start fetching it,
+   cancelling the fetch for any earlier line. */
+void anbs_ai_speculate(const char *line) {
+    struct ai_speculation *spec;
+    struct ai_options opts;
+    WORD_LIST *words;
+    char *key;
+    size_t len;
+
+    if (ai_speculation && STREQ(ai_speculation->line, line)) {
+        return;
+    }
+    anbs_ai_speculate_cancel(NULL);
+
+    /* A trailing backslash means more is coming; packed context would
+       give the query that runs a different key */
+    len = strlen(line);
+    if (len == 0 || line[len - 1] == '\\') {
+        return;
+    }
+    key = ai_prefetch_parse(line, &opts, &words);
+    if (!key || opts.context_tokens > 0 || !(spec = calloc(1, sizeof(*spec)))) {
+        free(key);
+        dispose_words(words);
+        return;
+    }
+
+    spec->line = strdup(line);
+    spec->key = key;
+    spec->query = strdup(opts.query);
+    spec->model = opts.model ? strdup(opts.model) : NULL;
+    spec->opts = opts;
+    spec->opts.query = spec->query;
+    spec->opts.model = spec->model;
+    spec->refs = 2;
+    dispose_words(words);
+
+    if (!spec->line || !spec->query || anbs_optimize_submit(ai_speculation_task, spec) != 0) {
+        spec->refs = 1;
+        ai_speculation_unref(spec);
+        return;
+    }
+    ai_speculation = spec;
+    ai_speculation_started++;
+    ANBS_DEBUG_LOG("Speculatively sending: %.50s...", spec->query);
+}
+
+/* Main @vertex command implementation */
+int vertex_builtin(WORD_LIST *list) {
+    struct ai_options opts;
+    int result;
+
+    /* Parse options */
+    if (parse_ai_options(list, &opts) != 0) {
+        builtin_usage();
+        return EX_USAGE;
+    }
+
+    /* Handle health check */
+    if (opts.health_check) {
+        return ai_health_check(&opts) == 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+    }
+
+    if (opts.batch_mode) {
+        return vertex_batch(&opts);
+    }
+
+    /* Validate query */
+    if (!opts.query || strlen(opts.query) == 0) {
+        builtin_error("@vertex: missing query text");
+        return EX_USAGE;
+    }
+
+    /* Packed here so an --async job's child only sends */
+    if (opts.context_tokens > 0) {
+        ai_context_pack(&opts);
+    }
+
+    result = opts.async_mode ? vertex_async(&opts) : vertex_run(&opts);
+    free(opts.context);
+    return result;
+}
+
+/* @vertex command structure */
+struct builtin vertex_struct = {
+    "vertex",           /* builtin name */
+    vertex_builtin,     /* function implementing the builtin */
+    BUILTIN_ENABLED,    /* initial flags for builtin */
+    (char **)0,         /* array of long documentation strings */
+    "@vertex query [options] - Send query to AI assistant",  /* short doc */
+    0                   /* reserved for internal use */
+};
+
+#define MEMORY_LIST_DEFAULT 10
+
+/* Print TEXT on one line, its newlines as spaces */
+static void memory_list_put(const char *text) {
+    size_t run;
+
+    while (*text) {
+        run = strcspn(text, "\n");
+        fwrite(text, 1, run, stdout);
+        text += run;
+        if (*text) {
+            putchar(' ');
+            text++;
+        }
+    }
+}
+
+/* @memory search and @memory recent: list memories from the store, best
+   match or newest first, a line each.  They come off a cursor, so the
+   first are printed before deeper ones have been ranked.  --limit=N
+   stops after N (default 10), --offset=N starts N in, and --stream goes
+   on until the store runs out unless --limit is given, flushing every
+   line, so `@memory search --stream ... | less' pages through all of it
+   and only ranks as deep as was read. */
+static int memory_list(WORD_LIST *list, int recent) {
+    anbs_memory_cursor_t *cursor;
+    const char *content, *context, *source;
+    char *query = NULL, when[32];
+    struct tm tm;
+    time_t timestamp;
+    float score;
+    int limit = -1, offset = 0, stream = 0, shown = 0;
+    WORD_LIST *l;
+
+    for (l = list; l; l = l->next) {
+        if (strncmp(l->word->word, "--limit=", 8) == 0) {
+            limit = atoi(l->word->word + 8);
+            if (limit < 0) limit = 0;
+        } else if (strncmp(l->word->word, "--offset=", 9) == 0) {
+            offset = atoi(l->word->word + 9);
+            if (offset < 0) offset = 0;
+        } else if (STREQ(l->word->word, "--stream")) {
+            stream = 1;
+        } else {
+            break;
+        }
+    }
+    if (limit < 0) {
+        limit = stream ? INT_MAX : MEMORY_LIST_DEFAULT;
+    }
+
+    if (!recent) {
+        query = l ? string_list(l) : NULL;
+        if (!query || !*query) {
+            free(query);
+            builtin_error("@memory: missing search query");
+            return EX_USAGE;
+        }
+    }
+
+    /* Rank no deeper than the first page needs */
+    cursor = anbs_memory_cursor_open(query, stream || limit == INT_MAX ? 0 : offset + limit);
+    free(query);
+    if (!cursor) {
+        builtin_error("@memory: cannot open the memory store");
+        return EXECUTION_FAILURE;
+    }
+
+    anbs_memory_cursor_skip(cursor, offset);
+    while (shown < limit &&
+           anbs_memory_cursor_next(cursor, &content, &context, &source, &timestamp, &score) == 1) {
+        if (recent) {
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime_r(&timestamp, &tm));
+            printf("%s  [%s] ", when, source ? source : "note");
+        } else {
+            printf("%.3f  [%s] ", score, source ? source : "note");
+        }
+        memory_list_put(content);
+        if (context && *context) {
+            fputs(" (", stdout);
+            memory_list_put(context);
+            putchar(')');
+        }
+        putchar('\n');
+        if (stream) {
+            fflush(stdout);
+        }
+        shown++;
+    }
+    anbs_memory_cursor_close(cursor);
+    fflush(stdout);
+
+    return shown > 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+}
+
+/* Alternative @memory command implementation */
+int memory_builtin(WORD_LIST *list) {
+    char *query = NULL;
+
+    if (list && list->word) {
+        query = list->word->word;
+    }
+
+    if (query && (STREQ(query, "search") || STREQ(query, "recent"))) {
+        return memory_list(list->next, query[0] == 'r');
+    }
+
+    if (!query || strlen(query) == 0) {
+        builtin_error("@memory: missing search query");
+        return EX_USAGE;
+    }
+
+    /* Ask with the memories that match attached, packed into the
+       --context budget */
+    char memory_query[2048];
+    struct ai_options opts;
+    int result;
+
+    ai_options_init(&opts);
+    opts.query = query;
+    opts.context_tokens = ai_context_budget();
+    ai_context_pack(&opts);
+
+    snprintf(memory_query, sizeof(memory_query),
+             "Search my command history and conversation memory for: %s", query);
+    opts.query = memory_query;
+    opts.slo = "memory";
+
+    result = vertex_run(&opts);
+    free(opts.context);
+    return result;
+}
+
+struct builtin memory_struct = {
+    "memory",
+    memory_builtin,
+    BUILTIN_ENABLED,
+    (char **)0,
+    "@memory [search|recent [--limit=N] [--offset=N] [--stream]] query - Search conversation history and memory",
+    0
+};
+
+/* @perf command implementation */
+
+/* Print the JSON or text a getter allocated, or an empty object when its
+   subsystem hasn't started in this shell */
+static int perf_print(int result, char *text) {
+    if (result != 0 || !text) {
+        printf("{}\n");
+        return EXECUTION_SUCCESS;
+    }
+    fputs(text, stdout);
+    if (*text && text[strlen(text) - 1] != '\n') {
+        putchar('\n');
+    }
+    free(text);
+    fflush(stdout);
+    return EXECUTION_SUCCESS;
+}
+
+static int perf_memory(void) {
+    int entries = 0, db_entries = 0;
+    size_t bytes = 0;
+
+    if (anbs_memory_get_stats(&entries, &db_entries, &bytes) != 0) {
+        printf("{}\n");
+        return EXECUTION_SUCCESS;
+    }
+    printf("{\"entries\": %d, \"db_entries\": %d, \"memory_bytes\": %zu}\n", entries, db_entries, bytes);
+    fflush(stdout);
+    return EXECUTION_SUCCESS;
+}
+
+/* Each provider's rate limits as the limiter last saw them, and its
+   circuit breaker and retries */
+static int perf_rate(void) {
+    struct ai_rate *rate;
+    struct ai_breaker *breaker;
+    double held;
+    int i, first = 1;
+
+    printf("{");
+    for (i = 0; ai_providers[i].name; i++) {
+        if (!ai_rates[i].initialized && !ai_breakers[i].initialized) {
+            continue;
+        }
+        pthread_mutex_lock(&ai_rate_mutex);
+        rate = ai_rate_for(&ai_providers[i]);
+        held = -ai_elapsed_ms(&rate->blocked_until);
+        printf("%s\"%s\": {\"rpm\": %.0f, \"requests_left\": %.0f, \"tpm\": %.0f, \"tokens_left\": %.0f, "
+               "\"held_ms\": %.0f, \"waits\": %lu, \"refusals\": %lu, ",
+               first ? "" : ", ", ai_providers[i].name, rate->requests.limit, rate->requests.level,
+               rate->tokens.limit, rate->tokens.level, held > 0.0 ? held : 0.0, rate->waits, rate->refusals);
+        pthread_mutex_unlock(&ai_rate_mutex);
+
+        pthread_mutex_lock(&ai_breaker_mutex);
+        breaker = ai_breaker_for(&ai_providers[i]);
+        printf("\"breaker\": \"%s\", \"failures\": %d, \"opens\": %lu, \"fast_failures\": %lu, "
+               "\"retries\": %lu, \"retry_budget\": %.1f}",
+               ai_breaker_names[breaker->state], breaker->failures, breaker->opens, breaker->fast_failures,
+               breaker->retries, breaker->retry_budget);
+        pthread_mutex_unlock(&ai_breaker_mutex);
+        first = 0;
+    }
+    printf("}\n");
+    fflush(stdout);
+    return EXECUTION_SUCCESS;
+}
+
+/* How often a speculative query was started, taken by the query that
+   ran, or cancelled by an edit */
+static int perf_speculate(void) {
+    pthread_mutex_lock(&ai_speculation_mutex);
+    printf("{\"started\": %lu, \"adopted\": %lu, \"cancelled\": %lu, \"pending\": %s}\n",
+           ai_speculation_started, ai_speculation_adopted, ai_speculation_cancelled,
+           ai_speculation && !ai_speculation->done ? "true" : "false");
+    pthread_mutex_unlock(&ai_speculation_mutex);
+    fflush(stdout);
+    return EXECUTION_SUCCESS;
+}
+
+#if defined (USING_BASH_MALLOC)
+#define PERF_HEAP_TOP 20
+
+static pthread_t perf_heap_main;
+static __thread char perf_heap_context[MPROFILE_CONTEXT_MAX];
+
+/* Describe what the allocating thread is doing, for the heap profiler.
+   It's called from inside malloc, so it must not allocate. */
+static const char *perf_heap_context_hook(void) {
+    if (!pthread_equal(pthread_self(), perf_heap_main)) {
+        char name[16] = "";
+
+#if defined (__GLIBC__) || defined (__APPLE__)
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+#endif
+        snprintf(perf_heap_context, sizeof(perf_heap_context), "thread:%s", name);
+    } else if (executing_builtin && this_command_name) {
+        snprintf(perf_heap_context, sizeof(perf_heap_context), "builtin:%s", this_command_name);
+    } else if (expanding_command_words) {
+        return "expansion";
+    } else if (this_shell_function) {
+        snprintf(perf_heap_context, sizeof(perf_heap_context), "function:%s", this_shell_function->name);
+    } else {
+        return "shell";
+    }
+    return perf_heap_context;
+}
+
+static int perf_heap_by_live(const void *a, const void *b) {
+    const struct mprofile_site *x = a, *y = b;
+    return (x->blive < y->blive) - (x->blive > y->blive);
+}
+
+static int perf_heap_by_churn(const void *a, const void *b) {
+    const struct mprofile_site *x = a, *y = b;
+    unsigned long cx = x->balloc - x->blive, cy = y->balloc - y->blive;
+    return (cx < cy) - (cx > cy);
+}
+
+/* The shell's own allocations are named by file and line; anything else
+   by the symbol, or the object and offset addr2line wants, it returns to */
+static void perf_heap_site_name(const struct mprofile_site *site, char *buf, size_t size) {
+#if defined (HAVE_DLFCN_H) && defined (RTLD_DEFAULT)
+    Dl_info info;
+#endif
+
+    if (site->file) {
+        snprintf(buf, size, "%s:%d", site->file, site->line);
+        return;
+    }
+    if (!site->caller) {
+        snprintf(buf, size, "%s", site->context[0] == '[' ? site->context : "unknown");
+        return;
+    }
+#if defined (HAVE_DLFCN_H) && defined (RTLD_DEFAULT)
+    if (dladdr(site->caller, &info) && info.dli_fname) {
+        const char *base = strrchr(info.dli_fname, '/');
+
+        if (info.dli_sname) {
+            snprintf(buf, size, "%s+0x%lx", info.dli_sname,
+                     (unsigned long)((char *)site->caller - (char *)info.dli_saddr));
+        } else {
+            snprintf(buf, size, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+                     (unsigned long)((char *)site->caller - (char *)info.dli_fbase));
+        }
+        return;
+    }
+#endif
+    snprintf(buf, size, "%p", site->caller);
+}
+
+/* @perf heap [start [INTERVAL]|stop|reset] [--churn] [N]: sampled
+   allocation sites, by the bytes they still hold or, with --churn, by
+   the bytes they allocated and freed again */
+static int perf_heap(WORD_LIST *list) {
+    struct mprofile_site *sites;
+    json_object *root, *array;
+    unsigned long live_bytes = 0;
+    int nsites, n, i, top = PERF_HEAP_TOP, churn = 0;
+    char name[256];
+
+    if (list && strcmp(list->word->word, "start") == 0) {
+        long interval = list->next ? atol(list->next->word->word) : 0;
+
+        if (malloc_profile_context == 0) {
+            perf_heap_main = pthread_self();
+            malloc_profile_context = perf_heap_context_hook;
+        }
+        malloc_profile_start(interval);
+        return EXECUTION_SUCCESS;
+    } else if (list && strcmp(list->word->word, "stop") == 0) {
+        malloc_profile_stop();
+        return EXECUTION_SUCCESS;
+    } else if (list && strcmp(list->word->word, "reset") == 0) {
+        malloc_profile_reset();
+        return EXECUTION_SUCCESS;
+    }
+    for (; list; list = list->next) {
+        if (strcmp(list->word->word, "--churn") == 0) {
+            churn = 1;
+        } else if ((top = atoi(list->word->word)) <= 0) {
+            builtin_usage();
+            return EX_USAGE;
+        }
+    }
+
+    /* Copy the sites out first: sorting them and building the report
+       allocate, and mustn't happen under the profiler's lock */
+    n = malloc_profile_sites(NULL, 0) + 16;
+    sites = xmalloc(n * sizeof(*sites));
+    nsites = malloc_profile_sites(sites, n);
+    qsort(sites, nsites, sizeof(*sites), churn ? perf_heap_by_churn : perf_heap_by_live);
+
+    array = json_object_new_array();
+    for (i = 0; i < nsites; i++) {
+        json_object *site;
+
+        live_bytes += sites[i].blive;
+        if (i >= top) {
+            continue;
+        }
+        perf_heap_site_name(&sites[i], name, sizeof(name));
+        site = json_object_new_object();
+        json_object_object_add(site, "site", json_object_new_string(name));
+        json_object_object_add(site, "context", json_object_new_string(sites[i].context));
+        json_object_object_add(site, "samples", json_object_new_int64(sites[i].samples));
+        json_object_object_add(site, "allocs", json_object_new_int64(sites[i].nalloc));
+        json_object_object_add(site, "bytes", json_object_new_int64(sites[i].balloc));
+        json_object_object_add(site, "live_blocks", json_object_new_int64(sites[i].nlive));
+        json_object_object_add(site, "live_bytes", json_object_new_int64(sites[i].blive));
+        json_object_array_add(array, site);
+    }
+    free(sites);
+
+    root = json_object_new_object();
+    json_object_object_add(root, "sampling", json_object_new_boolean(malloc_profile_interval != 0));
+    json_object_object_add(root, "interval", json_object_new_int64(malloc_profile_interval));
+    json_object_object_add(root, "dropped", json_object_new_int64(malloc_profile_dropped()));
+    json_object_object_add(root, "live_bytes", json_object_new_int64(live_bytes));
+    json_object_object_add(root, "sites", array);
+    printf("%s\n", json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN));
+    json_object_put(root);
+    fflush(stdout);
+    return EXECUTION_SUCCESS;
+}
+#else
+static int perf_heap(WORD_LIST *list) {
+    (void)list;
+    builtin_error("@perf: heap: profiling needs the shell's own malloc (configure --with-bash-malloc)");
+    return EXECUTION_FAILURE;
+}
+#endif
+
+/* @perf [summary|latency [--lifetime] [COMMAND]|slo|cache|memory|heap [...]|optimize|openmetrics|reset]:
+   the shell's own performance data, as JSON unless asked for OpenMetrics */
+int perf_builtin(WORD_LIST *list) {
+    const char *subcommand = list ? list->word->word : "summary";
+    char *text = NULL;
+    int result;
+
+    anbs_metrics_init();
+
+    if (strcmp(subcommand, "summary") == 0) {
+        result = anbs_metrics_get_dashboard(&text);
+        return perf_print(result, text);
+    } else if (strcmp(subcommand, "latency") == 0) {
+        const char *command_type = NULL;
+        bool window = true;
+        WORD_LIST *l;
+
+        for (l = list->next; l; l = l->next) {
+            if (strcmp(l->word->word, "--lifetime") == 0) {
+                window = false;
+            } else if (!command_type) {
+                command_type = l->word->word;
+            } else {
+                builtin_usage();
+                return EX_USAGE;
+            }
+        }
+        result = anbs_metrics_get_histograms(command_type, window, &text);
+        return perf_print(result, text);
+    } else if (strcmp(subcommand, "slo") == 0) {
+        result = anbs_metrics_get_slo(&text);
+        return perf_print(result, text);
+    } else if (strcmp(subcommand, "cache") == 0) {
+        result = anbs_cache_get_stats(&text);
+        return perf_print(result, text);
+    } else if (strcmp(subcommand, "memory") == 0) {
+        return perf_memory();
+    } else if (strcmp(subcommand, "rate") == 0) {
+        return perf_rate();
+    } else if (strcmp(subcommand, "speculate") == 0) {
+        return perf_speculate();
+    } else if (strcmp(subcommand, "heap") == 0) {
+        return perf_heap(list->next);
+    } else if (strcmp(subcommand, "optimize") == 0) {
+        result = anbs_optimize_get_stats(&text);
+        return perf_print(result, text);
+    } else if (strcmp(subcommand, "openmetrics") == 0) {
+        result = anbs_metrics_get_openmetrics(&text);
+        return perf_print(result, text);
+    } else if (strcmp(subcommand, "reset") == 0) {
+        anbs_metrics_reset();
+        return EXECUTION_SUCCESS;
+    }
+
+    builtin_error("@perf: %s: unknown subcommand", subcommand);
+    builtin_usage();
+    return EX_USAGE;
+}
+
+struct builtin perf_struct = {
+    "perf",
+    perf_builtin,
+    BUILTIN_ENABLED,
+    (char **)0,
+    "@perf [summary|latency [--lifetime] [command]|slo|cache|memory|rate|speculate|heap [start [interval]|stop|reset] [--churn] [n]|optimize|openmetrics|reset] - Show shell performance data",
+    0
+};
+
+/* @analyze command implementation */
+
+#define ANALYZE_INLINE_LIMIT 100000     /* bytes sent as a single request */
+#define ANALYZE_CHUNK_TOKENS 6000       /* default per-chunk token budget */
+#define ANALYZE_BYTES_PER_TOKEN 4
+#define ANALYZE_CACHE_TTL 86400         /* seconds a chunk's analysis is kept */
+#define ANALYZE_GEAR_WINDOW 64          /* bytes the boundary hash depends on */
+
+/* One chunk of a file being analyzed */
+struct analyze_chunk {
+    size_t start, end;
+    long first_line, last_line;
+    uint64_t digest;            /* of the chunk's bytes */
+    uint64_t prompt;            /* of the query around them */
+};
+
+/* Random values for the gear hash, the same in every shell */
+static uint64_t analyze_gear[256];
+
+static void analyze_gear_init(void) {
+    uint64_t x = 0x616e62735f676561ULL;
+
+    if (analyze_gear[0]) {
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        analyze_gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* 64-bit digest of P[0..N), a word at a time.  Not cryptographic, only
+   fast; the cache key pairs it with the length. */
+static uint64_t analyze_digest(const char *p, size_t n, uint64_t h) {
+    uint64_t w;
+
+    h ^= n * 0x9e3779b97f4a7c15ULL;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    w = 0;
+    memcpy(&w, p, n);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+/* Split MAP[0..SIZE) into chunks of at most BUDGET bytes, cut on line
+   boundaries where possible, and build one analysis query per chunk.
+   Cuts are content-defined: past a quarter of the budget, a gear hash
+   of the last 64 bytes hitting zero under a mask marks the next newline
+   as the end of the chunk.  An edit only moves the cuts near it, so the
+   chunks after it come out byte for byte as before and their analyses
+   can be reused.  A chunk's query doesn't say where in the file it is,
+   for the same reason.  Returns the number of chunks or -1. */
+static int analyze_split(const char *filename, const char *map, size_t size, size_t budget,
+                         struct ai_batch_item **items, struct analyze_chunk **chunks) {
+    struct ai_batch_item *list;
+    struct analyze_chunk *parts;
+    size_t start, end, limit, min, mask, i, hlen;
+    const char *nl;
+    uint64_t h;
+    int count, max, c;
+    long line = 1, lines;
+
+    analyze_gear_init();
+    min = budget / 4;
+    for (mask = 1; mask * 2 <= min; mask *= 2)
+        ;
+    mask--;
+
+    /* First pass: chunk boundaries.  Every chunk but the last holds at
+       least MIN bytes. */
+    max = (int)(size / (min ? min : 1)) + 2;
+    parts = calloc(max, sizeof(*parts));
+    if (!parts) {
+        return -1;
+    }
+    for (count = 0, start = 0; start < size && count < max; count++) {
+        limit = start + budget < size ? start + budget : size;
+        end = limit;
+        nl = NULL;
+
+        h = 0;
+        i = start + min > start + ANALYZE_GEAR_WINDOW ? start + min - ANALYZE_GEAR_WINDOW : start;
+        for (; i < limit; i++) {
+            h = (h << 1) + analyze_gear[(unsigned char)map[i]];
+            if (i >= start + min && (h & mask) == 0) {
+                nl = memchr(map + i, '\n', limit - i);
+                break;
+            }
+        }
+        if (nl) {
+            end = nl - map + 1;
+        } else if (end < size) {
+            /* Back up to the last newline in the second half of the chunk */
+            nl = memrchr(map + start + budget / 2, '\n', end - start - budget / 2);
+            if (nl) {
+                end = nl - map + 1;
+            }
+        }
+
+        parts[count].start = start;
+        parts[count].end = end;
+        start = end;
+    }
+
+    list = calloc(count, sizeof(*list));
+    if (!list) {
+        free(parts);
+        return -1;
+    }
+
+    /* Second pass: one prompt per chunk, with its line numbers and digest */
+    for (c = 0; c < count; c++) {
+        start = parts[c].start;
+        end = parts[c].end;
+
+        lines = 0;
+        for (nl = map + start; (nl = memchr(nl, '\n', map + end - nl)) != NULL; nl++) {
+            lines++;
+        }
+        parts[c].first_line = line;
+        parts[c].last_line = line + (lines ? lines - 1 : 0);
+        parts[c].digest = analyze_digest(map + start, end - start, 0);
+        line += lines;
+
+        list[c].query = malloc(end - start + strlen(filename) + 256);
+        if (!list[c].query) {
+            ai_batch_free(list, c);
+            free(parts);
+            return -1;
+        }
+        hlen = sprintf(list[c].query,
+                       "This is a section of a large file (%s). "
+                       "Summarize its structure and content and note any errors, anomalies or problems:\n\n",
+                       filename);
+        memcpy(list[c].query + hlen, map + start, end - start);
+        list[c].query[hlen + end - start] = '\0';
+        parts[c].prompt = analyze_digest(list[c].query, hlen, 1);
+    }
+
+    *items = list;
+    *chunks = parts;
+    return count;
+}
+
+/* Cache key of CHUNK's analysis: the scope, then digests of the chunk and
+   of the prompt around it, so changing either, the model or the
+   provider asks again */
+static void analyze_cache_key(const struct analyze_chunk *chunk, const struct ai_options *opts,
+                              char *key, size_t size) {
+    char scope[256];
+
+    ai_cache_scope(opts, scope, sizeof(scope));
+    snprintf(key, size, "%sanalyze\x1f%016llx\x1f%zu\x1f%016llx", scope,
+             (unsigned long long)chunk->digest, chunk->end - chunk->start,
+             (unsigned long long)chunk->prompt);
+}
+
+/* Fill in the analyses of chunks seen before; returns how many there were */
+static int analyze_cache_lookup(struct ai_batch_item *items, const struct analyze_chunk *chunks, int count,
+                                const struct ai_options *opts) {
+    char key[512];
+    int hits = 0;
+
+    if (opts->no_cache || anbs_cache_init(0) != 0) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        analyze_cache_key(&chunks[i], opts, key, sizeof(key));
+        if ((items[i].response = anbs_cache_get(key, NULL)) != NULL) {
+            items[i].status = 0;
+            items[i].done = 1;
+            hits++;
+        }
+    }
+    return hits;
+}
+
+/* Remember the analyses of the chunks just sent */
+static void analyze_cache_store(struct ai_batch_item *items, const struct analyze_chunk *chunks, int count,
+                                const char *cached, const struct ai_options *opts) {
+    char key[512];
+
+    if (opts->no_cache || anbs_cache_init(0) != 0) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!cached[i] && items[i].status == 0 && items[i].response) {
+            analyze_cache_key(&chunks[i], opts, key, sizeof(key));
+            anbs_cache_put(key, items[i].response, opts->cache_ttl);
+        }
+    }
+}
+
+/* Combine partial analyses until they fit in one request, then return the
+   final prompt (malloc'd).  When the partials overflow BUDGET they are
+   packed into budget-sized groups and summarized in another concurrent
+   round first.  CHUNKS, when the partials are still one per chunk, give
+   each section its lines. */
+static char *analyze_reduce(const char *filename, struct ai_batch_item *parts, int count,
+                            const struct analyze_chunk *chunks, size_t budget, const struct ai_options *opts) {
+    struct ai_response prompt = {0};
+    struct ai_batch_item *groups;
+    char header[512];
+    size_t total, len;
+    int i, g, ngroups;
+
+    for (;;) {
+        total = 0;
+        for (i = 0; i < count; i++) {
+            total += parts[i].response ? strlen(parts[i].response) : 0;
+        }
+        if (total <= budget || count <= 1) {
+            break;
+        }
+
+        groups = calloc(count, sizeof(*groups));
+        if (!groups) {
+            break;
+        }
+        snprintf(header, sizeof(header),
+                 "Merge these partial analyses of consecutive sections of %s into one concise summary:\n",
+                 filename);
+        for (i = 0, ngroups = 0; i < count; ngroups++) {
+            struct ai_response group = {0};
+
+            ai_response_append(&group, header, strlen(header));
+            for (g = 0; i < count; i++, g++) {
+                len = parts[i].response ? strlen(parts[i].response) : 0;
+                if (g > 0 && group.size + len > budget) {
+                    break;
+                }
+                if (len) {
+                    ai_response_append(&group, "\n---\n", 5);
+                    ai_response_append(&group, parts[i].response, len);
+                }
+            }
+            groups[ngroups].query = group.memory;
+        }
+
+        /* No progress possible, or the round failed: reduce what we have */
+        if (ngroups >= count || ai_run_concurrent(groups, ngroups, opts, AI_EMIT_NONE, "Combining analyses") < 0) {
+            ai_batch_free(groups, ngroups);
+            break;
+        }
+
+        for (i = 0; i < count; i++) {
+            free(parts[i].response);
+            parts[i].response = NULL;
+        }
+        for (i = 0; i < ngroups; i++) {
+            if (groups[i].status == 0) {
+                parts[i].response = groups[i].response;
+                groups[i].response = NULL;
+            }
+        }
+        count = ngroups;
+        chunks = NULL;
+        ai_batch_free(groups, ngroups);
+    }
+
+    snprintf(header, sizeof(header),
+             "These are analyses of consecutive sections of the file %s. Combine them into a single analysis "
+             "covering structure, purpose, notable problems and potential improvements:\n", filename);
+    ai_response_append(&prompt, header, strlen(header));
+    for (i = 0; i < count; i++) {
+        if (parts[i].response) {
+            if (chunks) {
+                snprintf(header, sizeof(header), "\n### Section %d (lines %ld-%ld)\n", i + 1,
+                         chunks[i].first_line, chunks[i].last_line);
+            } else {
+                snprintf(header, sizeof(header), "\n### Section %d\n", i + 1);
+            }
+            ai_response_append(&prompt, header, strlen(header));
+            ai_response_append(&prompt, parts[i].response, strlen(parts[i].response));
+        }
+    }
+
+    return prompt.memory;
+}
+
+/* Map-reduce analysis of a file too large for one request.  Chunks
+   analyzed before, in this file or any other, are served from the cache
+   and only the rest are sent; an unchanged file costs no request at all,
+   as the merge is cached too. */
+static int analyze_chunked(const char *filename, const char *map, size_t size, struct ai_options *opts, int chunk_tokens) {
+    struct ai_batch_item *items = NULL;
+    struct analyze_chunk *chunks = NULL;
+    struct ai_options chunk_opts;
+    size_t budget = (size_t)chunk_tokens * ANALYZE_BYTES_PER_TOKEN;
+    char *final_query, *cached, status_msg[128];
+    int count, hits, failures, result;
+
+    count = analyze_split(filename, map, size, budget, &items, &chunks);
+    cached = count > 0 ? malloc(count) : NULL;
+    if (count < 0 || !cached) {
+        if (count >= 0) {
+            ai_batch_free(items, count);
+            free(chunks);
+        }
+        builtin_error("@analyze: out of memory");
+        return EXECUTION_FAILURE;
+    }
+
+    hits = analyze_cache_lookup(items, chunks, count, opts);
+    for (int i = 0; i < count; i++) {
+        cached[i] = items[i].done;
+    }
+    if (hits && g_anbs_display) {
+        snprintf(status_msg, sizeof(status_msg), "Analyzing chunks: %d of %d unchanged", hits, count);
+        anbs_status_write(g_anbs_display, status_msg);
+    }
+    ANBS_DEBUG_LOG("@analyze %s: %d chunks, %d cached", filename, count, hits);
+
+    /* Map: every other chunk is analyzed concurrently.  They are cached
+       by digest below, not by their whole text. */
+    chunk_opts = *opts;
+    chunk_opts.no_cache = 1;
+    failures = hits < count ? ai_run_concurrent(items, count, &chunk_opts, AI_EMIT_NONE, "Analyzing chunks") : 0;
+    if (failures < 0) {
+        ai_batch_free(items, count);
+        free(chunks);
+        free(cached);
+        builtin_error("@analyze: out of memory");
+        return EXECUTION_FAILURE;
+    }
+    analyze_cache_store(items, chunks, count, cached, opts);
+    free(cached);
+    if (interrupt_state) {
+        ai_batch_free(items, count);
+        free(chunks);
+        return EXECUTION_FAILURE;   /* caller unmaps, then honors the interrupt */
+    }
+    if (failures == count) {
+        builtin_error("@analyze: %s", items[0].response ? items[0].response : "failed to get AI response");
+        ai_batch_free(items, count);
+        free(chunks);
+        return EXECUTION_FAILURE;
+    }
+    if (failures) {
+        builtin_warning("@analyze: %d of %d chunks failed; the summary is partial", failures, count);
+    }
+
+    /* Failed chunks keep their error text out of the reduction */
+    for (int i = 0; i < count; i++) {
+        if (items[i].status != 0) {
+            free(items[i].response);
+            items[i].response = NULL;
+        }
+    }
+
+    /* Reduce: merge the partial results into one answer */
+    final_query = analyze_reduce(filename, items, count, chunks, budget, opts);
+    ai_batch_free(items, count);
+    free(chunks);
+
+    if (interrupt_state) {
+        free(final_query);
+        return EXECUTION_FAILURE;
+    }
+    if (!final_query) {
+        builtin_error("@analyze: out of memory");
+        return EXECUTION_FAILURE;
+    }
+
+    opts->query = final_query;
+    result = vertex_run(opts);
+    free(final_query);
+
+    return result;
+}
+
+/* The single-request prompt for a whole file */
+static char *analyze_inline_query(const char *filename, const char *data, size_t size) {
+    size_t len = size + strlen(filename) + 512;
+    char *query = malloc(len);
+
+    if (query) {
+        snprintf(query, len,
+                 "Analyze this file (%s):\n\n%.*s\n\nProvide insights about structure, purpose, and potential improvements.",
+                 filename, (int)size, data ? data : "");
+    }
+    return query;
+}
+
+/* @analyze over directories and several files */
+
+#define ANALYZE_TREE_MAX_FILES 500      /* default cap on files per run */
+#define ANALYZE_BINARY_PROBE 8192       /* bytes searched for a NUL */
+
+/* One line of a .gitignore or .anbsignore */
+struct analyze_ignore {
+    char *pattern;
+    size_t base;        /* length of the directory it was read in, with the slash */
+    int negate;
+    int dir_only;
+    int anchored;       /* matched against the path below BASE, not the name */
+};
+
+/* A directory walk: the files it found and the filters it applies */
+struct analyze_walk {
+    char **files;
+    int count, size;
+    struct analyze_ignore *rules;
+    int nrules, rules_size;
+    WORD_LIST *include, *exclude;
+    off_t max_size;
+    int max_files;
+    int ignored, too_big, dropped, binary;
+};
+
+/* Add the rules in DIR's ignore files; BASE is the length of DIR plus its slash */
+static void analyze_ignore_load(struct analyze_walk *walk, const char *dir, size_t base) {
+    static const char *const names[] = { ".gitignore", ".anbsignore" };
+    char path[PATH_MAX], *line = NULL, *p;
+    size_t cap = 0;
+    ssize_t len;
+    FILE *fp;
+
+    for (size_t n = 0; n < sizeof(names) / sizeof(names[0]); n++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[n]);
+        if ((fp = fopen(path, "r")) == NULL) {
+            continue;
+        }
+        while ((len = getline(&line, &cap, fp)) != -1) {
+            struct analyze_ignore rule = { NULL, base, 0, 0, 0 };
+
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ')) {
+                line[--len] = '\0';
+            }
+            p = line;
+            if (*p == '\0' || *p == '#') {
+                continue;
+            }
+            if (*p == '!') {
+                rule.negate = 1;
+                p++;
+            }
+            if (len > 0 && line[len - 1] == '/') {
+                rule.dir_only = 1;
+                line[--len] = '\0';
+            }
+            if (strncmp(p, "**/", 3) == 0) {
+                p += 3;
+            } else if (*p == '/') {
+                rule.anchored = 1;
+                p++;
+            }
+            rule.anchored |= strchr(p, '/') != NULL;
+            if (*p == '\0') {
+                continue;
+            }
+
+            if (walk->nrules == walk->rules_size) {
+                int size = walk->rules_size ? walk->rules_size * 2 : 32;
+                struct analyze_ignore *grown = realloc(walk->rules, size * sizeof(*grown));
+
+                if (!grown) {
+                    break;
+                }
+                walk->rules = grown;
+                walk->rules_size = size;
+            }
+            if ((rule.pattern = strdup(p)) != NULL) {
+                walk->rules[walk->nrules++] = rule;
+            }
+        }
+        fclose(fp);
+    }
+    free(line);
+}
+
+/* Drop the rules read below the first KEEP */
+static void analyze_ignore_pop(struct analyze_walk *walk, int keep) {
+    while (walk->nrules > keep) {
+        free(walk->rules[--walk->nrules].pattern);
+    }
+}
+
+/* Whether PATH, named NAME, is ignored; as in git, the last rule that
+   matches decides */
+static int analyze_ignored(const struct analyze_walk *walk, const char *path, const char *name, int is_dir) {
+    int ignored = 0;
+
+    for (int i = 0; i < walk->nrules; i++) {
+        const struct analyze_ignore *rule = &walk->rules[i];
+        const char *subject = rule->anchored ? path + rule->base : name;
+
+        if (rule->dir_only && !is_dir) {
+            continue;
+        }
+        if (strmatch(rule->pattern, (char *)subject, rule->anchored ? FNM_PATHNAME : 0) == 0) {
+            ignored = !rule->negate;
+        }
+    }
+    return ignored;
+}
+
+/* Whether NAME matches one of the patterns in LIST */
+static int analyze_name_matches(WORD_LIST *list, const char *name) {
+    for (; list; list = list->next) {
+        if (strmatch(list->word->word, (char *)name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Add the file PATH, named NAME, if the filters let it through.
+   Returns -1 when out of memory. */
+static int analyze_walk_file(struct analyze_walk *walk, const char *path, const char *name, off_t size) {
+    if ((walk->include && !analyze_name_matches(walk->include, name)) ||
+        analyze_name_matches(walk->exclude, name)) {
+        walk->ignored++;
+        return 0;
+    }
+    if (size > walk->max_size) {
+        walk->too_big++;
+        return 0;
+    }
+    if (walk->count >= walk->max_files) {
+        walk->dropped++;
+        return 0;
+    }
+    if (walk->count == walk->size) {
+        int grown_size = walk->size ? walk->size * 2 : 64;
+        char **grown = realloc(walk->files, grown_size * sizeof(*grown));
+
+        if (!grown) {
+            return -1;
+        }
+        walk->files = grown;
+        walk->size = grown_size;
+    }
+    if ((walk->files[walk->count] = strdup(path)) == NULL) {
+        return -1;
+    }
+    walk->count++;
+    return 0;
+}
+
+/* Collect the files under DIR in name order.  Version control metadata,
+   ignored paths and symbolic links to directories (which could loop)
+   are not entered.  Returns -1 when out of memory. */
+static int analyze_walk_dir(struct analyze_walk *walk, const char *dir) {
+    struct dirent **names;
+    struct stat st;
+    char path[PATH_MAX];
+    size_t base;
+    int n, keep, result = 0;
+
+    n = scandir(dir, &names, NULL, alphasort);
+    if (n < 0) {
+        builtin_warning("@analyze: %s: %s", dir, strerror(errno));
+        return 0;
+    }
+    keep = walk->nrules;
+    base = strlen(dir) + 1;
+    analyze_ignore_load(walk, dir, base);
+
+    for (int i = 0; i < n; i++) {
+        const char *name = names[i]->d_name;
+        int is_dir, is_link;
+
+        if (result == 0 && interrupt_state == 0 &&
+            !STREQ(name, ".") && !STREQ(name, "..") && !STREQ(name, ".git") &&
+            (size_t)snprintf(path, sizeof(path), "%s/%s", dir, name) < sizeof(path) &&
+            lstat(path, &st) == 0) {
+            is_link = S_ISLNK(st.st_mode);
+            if (is_link && stat(path, &st) != 0) {
+                is_link = -1;   /* dangling */
+            }
+            is_dir = S_ISDIR(st.st_mode);
+            if (is_link < 0 || (is_dir && is_link)) {
+                /* skip */
+            } else if (analyze_ignored(walk, path, name, is_dir)) {
+                walk->ignored++;
+            } else if (is_dir) {
+                result = analyze_walk_dir(walk, path);
+            } else if (S_ISREG(st.st_mode)) {
+                result = analyze_walk_file(walk, path, name, st.st_size);
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+    analyze_ignore_pop(walk, keep);
+    return result;
+}
+
+/* Build the per-file prompts for the files WALK found, skipping binary
+   files.  Returns the number of items or -1. */
+static int analyze_tree_items(struct analyze_walk *walk, struct ai_batch_item **items) {
+    struct ai_batch_item *list;
+    char *data;
+    ssize_t got;
+    int fd, count = 0;
+
+    list = calloc(walk->count ? walk->count : 1, sizeof(*list));
+    if (!list) {
+        return -1;
+    }
+    for (int i = 0; i < walk->count && interrupt_state == 0; i++) {
+        struct stat st;
+        size_t len = 0;
+
+        fd = open(walk->files[i], O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0 || st.st_size > walk->max_size) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            builtin_warning("@analyze: %s: cannot read file", walk->files[i]);
+            continue;
+        }
+        data = malloc(st.st_size + 1);
+        if (!data) {
+            close(fd);
+            ai_batch_free(list, count);
+            return -1;
+        }
+        while (len < (size_t)st.st_size && (got = read(fd, data + len, st.st_size - len)) > 0) {
+            len += got;
+        }
+        close(fd);
+
+        if (memchr(data, '\0', len < ANALYZE_BINARY_PROBE ? len : ANALYZE_BINARY_PROBE)) {
+            walk->binary++;
+        } else if ((list[count].query = analyze_inline_query(walk->files[i], data, len)) != NULL) {
+            list[count].label = walk->files[i];
+            count++;
+        }
+        free(data);
+    }
+
+    *items = list;
+    return count;
+}
+
+/* The prompt for an overview of the analyses in ITEMS, each cut to its
+   share of BUDGET so that one request covers them all */
+static char *analyze_tree_summary(struct ai_batch_item *items, int count, size_t budget) {
+    struct ai_response prompt = {0};
+    char header[PATH_MAX + 64];
+    size_t share, len;
+    const char *nl;
+    int analyzed = 0;
+
+    for (int i = 0; i < count; i++) {
+        analyzed += items[i].status == 0 && items[i].response;
+    }
+    share = budget / (analyzed ? analyzed : 1);
+    if (share < 256) {
+        share = 256;
+    }
+
+    snprintf(header, sizeof(header),
+             "These are analyses of %d files from one project. Write an overview of the project as a whole: "
+             "its structure, how the parts fit together, the most important problems and the improvements "
+             "most worth making:\n", analyzed);
+    ai_response_append(&prompt, header, strlen(header));
+    for (int i = 0; i < count; i++) {
+        if (items[i].status != 0 || !items[i].response) {
+            continue;
+        }
+        len = strlen(items[i].response);
+        if (len > share) {
+            nl = memrchr(items[i].response, '\n', share);
+            len = nl && nl > items[i].response + share / 2 ? (size_t)(nl - items[i].response) : share;
+        }
+        snprintf(header, sizeof(header), "\n### %s\n", items[i].label);
+        ai_response_append(&prompt, header, strlen(header));
+        ai_response_append(&prompt, items[i].response, len);
+    }
+    return prompt.memory;
+}
+
+/* Analyze every file named in OPERANDS or found under the directories
+   among them, concurrently within the batch window.  Each result prints
+   as it arrives, tagged with its file; an overview of them all follows
+   unless SUMMARY is 0. */
+static int analyze_tree(WORD_LIST *operands, struct analyze_walk *walk, struct ai_options *opts,
+                        int chunk_tokens, int summary) {
+    struct ai_batch_item *items = NULL;
+    struct stat st;
+    char status_msg[160], *query;
+    int count, failures, result = EXECUTION_SUCCESS;
+
+    for (WORD_LIST *l = operands; l && interrupt_state == 0; l = l->next) {
+        const char *operand = l->word->word;
+        char *dir;
+        size_t len;
+
+        if (stat(operand, &st) != 0) {
+            builtin_error("@analyze: cannot open file '%s'", operand);
+            result = EXECUTION_FAILURE;
+        } else if (S_ISDIR(st.st_mode)) {
+            len = strlen(operand);
+            while (len > 1 && operand[len - 1] == '/') {
+                len--;
+            }
+            dir = savestring(operand);
+            dir[len] = '\0';
+            if (analyze_walk_dir(walk, dir) < 0) {
+                free(dir);
+                builtin_error("@analyze: out of memory");
+                return EXECUTION_FAILURE;
+            }
+            free(dir);
+        } else {
+            const char *name = strrchr(operand, '/');
+
+            if (analyze_walk_file(walk, operand, name ? name + 1 : operand, st.st_size) < 0) {
+                builtin_error("@analyze: out of memory");
+                return EXECUTION_FAILURE;
+            }
+        }
+    }
+    if (interrupt_state) {
+        return EXECUTION_FAILURE;   /* caller frees the walk, then honors the interrupt */
+    }
+
+    count = analyze_tree_items(walk, &items);
+    if (count < 0) {
+        builtin_error("@analyze: out of memory");
+        return EXECUTION_FAILURE;
+    }
+    if (interrupt_state) {
+        ai_batch_free(items, count);
+        return EXECUTION_FAILURE;
+    }
+
+    ANBS_DEBUG_LOG("@analyze: %d files, %d ignored, %d binary, %d too big, %d over the limit",
+                   count, walk->ignored, walk->binary, walk->too_big, walk->dropped);
+    if (walk->too_big) {
+        builtin_warning("@analyze: skipped %d files over %lld bytes; analyze them one at a time or raise --max-size",
+                        walk->too_big, (long long)walk->max_size);
+    }
+    if (walk->dropped) {
+        builtin_warning("@analyze: skipped %d files past the first %d; raise --max-files to include them",
+                        walk->dropped, walk->max_files);
+    }
+    if (count == 0) {
+        free(items);
+        if (result == EXECUTION_SUCCESS) {
+            builtin_error("@analyze: no files to analyze");
+        }
+        return EXECUTION_FAILURE;
+    }
+    if (g_anbs_display) {
+        snprintf(status_msg, sizeof(status_msg), "Analyzing %d files (%d ignored, %d binary)",
+                 count, walk->ignored, walk->binary);
+        anbs_status_write(g_anbs_display, status_msg);
+    }
+
+    failures = ai_run_concurrent(items, count, opts, AI_EMIT_TAGGED, "Analyzing files");
+    if (failures < 0) {
+        ai_batch_free(items, count);
+        builtin_error("@analyze: out of memory");
+        return EXECUTION_FAILURE;
+    }
+    if (interrupt_state) {
+        ai_batch_free(items, count);
+        return EXECUTION_FAILURE;
+    }
+    if (failures) {
+        builtin_warning("@analyze: %d of %d files failed", failures, count);
+        result = EXECUTION_FAILURE;
+    }
+
+    if (summary && count - failures > 1) {
+        query = analyze_tree_summary(items, count, (size_t)chunk_tokens * ANALYZE_BYTES_PER_TOKEN);
+        ai_batch_free(items, count);
+        if (!query) {
+            builtin_error("@analyze: out of memory");
+            return EXECUTION_FAILURE;
+        }
+        printf("\n");
+        opts->query = query;
+        if (vertex_run(opts) != EXECUTION_SUCCESS) {
+            result = EXECUTION_FAILURE;
+        }
+        free(query);
+    } else {
+        ai_batch_free(items, count);
+    }
+
+    return result;
+}
+
+int analyze_builtin(WORD_LIST *list) {
+    struct ai_options opts;
+    struct analyze_walk walk;
+    WORD_LIST *operands = NULL;
+    char *filename = NULL;
+    char *analysis_query;
+    char *map;
+    const char *ttl;
+    struct stat st;
+    int fd, result, summary = 1, chunk_tokens = ANALYZE_CHUNK_TOKENS;
+    WORD_LIST *l;
+
+    ai_options_init(&opts);
+    opts.slo = "analyze";
+    memset(&walk, 0, sizeof(walk));
+    walk.max_size = ANALYZE_INLINE_LIMIT;
+    walk.max_files = ANALYZE_TREE_MAX_FILES;
+
+    /* Files are analyzed again and again as they grow; keep the results
+       longer than a conversation's */
+    ttl = getenv("ANBS_ANALYZE_CACHE_TTL");
+    opts.cache_ttl = ttl && atoi(ttl) > 0 ? atoi(ttl) : ANALYZE_CACHE_TTL;
+
+    for (l = list; l; l = l->next) {
+        if (strncmp(l->word->word, "--chunk-tokens=", 15) == 0) {
+            chunk_tokens = atoi(l->word->word + 15);
+            if (chunk_tokens < 256) chunk_tokens = ANALYZE_CHUNK_TOKENS;
+        } else if (strncmp(l->word->word, "--parallel=", 11) == 0) {
+            opts.parallel = atoi(l->word->word + 11);
+            if (opts.parallel < 0) opts.parallel = 0;
+            if (opts.parallel > AI_BATCH_MAX_PARALLEL) opts.parallel = AI_BATCH_MAX_PARALLEL;
+        } else if (strncmp(l->word->word, "--model=", 8) == 0) {
+            opts.model = l->word->word + 8;
+        } else if (STREQ(l->word->word, "--no-cache")) {
+            opts.no_cache = 1;
+        } else if (strncmp(l->word->word, "--include=", 10) == 0) {
+            walk.include = make_word_list(make_bare_word(l->word->word + 10), walk.include);
+        } else if (strncmp(l->word->word, "--exclude=", 10) == 0) {
+            walk.exclude = make_word_list(make_bare_word(l->word->word + 10), walk.exclude);
+        } else if (strncmp(l->word->word, "--max-size=", 11) == 0) {
+            walk.max_size = atoll(l->word->word + 11);
+            if (walk.max_size <= 0) walk.max_size = ANALYZE_INLINE_LIMIT;
+        } else if (strncmp(l->word->word, "--max-files=", 12) == 0) {
+            walk.max_files = atoi(l->word->word + 12);
+            if (walk.max_files <= 0) walk.max_files = ANALYZE_TREE_MAX_FILES;
+        } else if (STREQ(l->word->word, "--no-summary")) {
+            summary = 0;
+        } else if (*l->word->word) {
+            operands = make_word_list(make_bare_word(l->word->word), operands);
+        }
+    }
+    operands = REVERSE_LIST(operands, WORD_LIST *);
+
+    if (!operands) {
+        dispose_words(walk.include);
+        dispose_words(walk.exclude);
+        builtin_error("@analyze: missing filename");
+        return EX_USAGE;
+    }
+
+    /* Directories and lists of files are analyzed a file per request */
+    if (operands->next || (stat(operands->word->word, &st) == 0 && S_ISDIR(st.st_mode))) {
+        result = analyze_tree(operands, &walk, &opts, chunk_tokens, summary);
+        for (int i = 0; i < walk.count; i++) {
+            free(walk.files[i]);
+        }
+        free(walk.files);
+        analyze_ignore_pop(&walk, 0);
+        free(walk.rules);
+        dispose_words(walk.include);
+        dispose_words(walk.exclude);
+        dispose_words(operands);
+        QUIT;
+        return result;
+    }
+    dispose_words(walk.include);
+    dispose_words(walk.exclude);
+    filename = operands->word->word;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        builtin_error("@analyze: cannot open file '%s'", filename);
+        dispose_words(operands);
+        return EXECUTION_FAILURE;
+    }
+
+    /* Map the file instead of copying it; large files are never resident
+       all at once beyond what the kernel pages in per chunk */
+    map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            builtin_error("@analyze: cannot map file '%s': %s", filename, strerror(errno));
+            dispose_words(operands);
+            return EXECUTION_FAILURE;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    if (st.st_size > ANALYZE_INLINE_LIMIT) {
+        result = analyze_chunked(filename, map, st.st_size, &opts, chunk_tokens);
+        munmap(map, st.st_size);
+        dispose_words(operands);
+        QUIT;
+        return result;
+    }
 
-    free(file_content);
+    /* Create analysis query */
+    analysis_query = analyze_inline_query(filename, map, st.st_size);
+    if (map) {
+        munmap(map, st.st_size);
+    }
+    if (!analysis_query) {
+        builtin_error("@analyze: out of memory");
+        dispose_words(operands);
+        return EXECUTION_FAILURE;
+    }
 
     /* Send to AI for analysis */
-    WORD_LIST new_list;
-    WORD_DESC new_word;
-    new_word.word = analysis_query;
-    new_word.flags = 0;
-    new_list.word = &new_word;
-    new_list.next = NULL;
+    opts.query = analysis_query;
+    result = vertex_run(&opts);
+    free(analysis_query);
+    dispose_words(operands);
 
-    return vertex_builtin(&new_list);
+    return result;
 }
 
 struct builtin analyze_struct = {
@@ -432,6 +5811,329 @@ struct builtin analyze_struct = {
     analyze_builtin,
     BUILTIN_ENABLED,
     (char **)0,
-    "@analyze filename - Analyze file content with AI",
+    "@analyze file|dir ... [--include=GLOB] [--exclude=GLOB] [--max-size=N] [--max-files=N] [--no-summary] [--chunk-tokens=N] [--parallel=N] [--no-cache] - Analyze files with AI",
+    0
+};
+
+/* The daemon side of ANBS_DAEMON */
+#define AI_DAEMON_START_MS 2000     /* how long @daemon start waits for the socket */
+#define AI_DAEMON_DRAIN_MS 5000     /* how long a stopping daemon lets queries finish */
+
+static time_t ai_daemon_started;
+static unsigned long ai_daemon_connections, ai_daemon_queries, ai_daemon_hits, ai_daemon_failures;
+static int ai_daemon_clients;       /* connections being served */
+static pthread_mutex_t ai_daemon_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t ai_daemon_stop;
+
+static void ai_daemon_sigterm(int sig) {
+    (void)sig;
+    ai_daemon_stop = 1;
+}
+
+/* Unpack a query frame into OPTS and *QUERY, which point into BODY.  The
+   model's length is overwritten to terminate it. */
+static int ai_daemon_decode(char *body, size_t len, struct ai_options *opts, char **query) {
+    unsigned char *p = (unsigned char *)body;
+    size_t model_len;
+
+    if (len < AI_DAEMON_QUERY_HEAD) {
+        return -1;
+    }
+    model_len = (size_t)p[18] << 8 | p[19];
+    if (model_len > len - AI_DAEMON_QUERY_HEAD) {
+        return -1;
+    }
+
+    ai_options_init(opts);
+    opts->no_cache = (p[0] & AI_DAEMON_NO_CACHE) != 0;
+    opts->provider = (signed char)p[1];
+    if (opts->provider < AI_PROVIDER_AUTO || opts->provider >= (int)(sizeof(ai_providers) / sizeof(ai_providers[0])) - 1) {
+        return -1;
+    }
+    opts->timeout = ai_wire_get32(p + 2);
+    opts->max_tokens = ai_wire_get32(p + 6);
+    opts->cache_ttl = ai_wire_get32(p + 10);
+    opts->hedge_ms = (int32_t)ai_wire_get32(p + 14);
+
+    /* Slide the model down over its length to make room for the NUL */
+    if (model_len > 0) {
+        memmove(body + 18, body + AI_DAEMON_QUERY_HEAD, model_len);
+        body[18 + model_len] = '\0';
+        opts->model = body + 18;
+    }
+    *query = body + AI_DAEMON_QUERY_HEAD + model_len;
+    return **query ? 0 : -1;
+}
+
+/* What @daemon status prints */
+static char *ai_daemon_status(void) {
+    char text[512];
+
+    pthread_mutex_lock(&ai_daemon_mutex);
+    snprintf(text, sizeof(text), "{\"pid\": %ld, \"uptime_s\": %ld, \"clients\": %d, \"connections\": %lu, "
+             "\"queries\": %lu, \"cache_hits\": %lu, \"failures\": %lu, \"pool_reuses\": %lu, "
+             "\"pool_creates\": %lu}",
+             (long)getpid(), (long)(time(NULL) - ai_daemon_started), ai_daemon_clients,
+             ai_daemon_connections, ai_daemon_queries, ai_daemon_hits, ai_daemon_failures,
+             ai_pool_reuses, ai_pool_creates);
+    pthread_mutex_unlock(&ai_daemon_mutex);
+    return strdup(text);
+}
+
+/* Serve the one request on the connection ARG */
+static void *ai_daemon_client(void *arg) {
+    struct ai_options opts;
+    char *body, *query, *response = NULL;
+    size_t len;
+    int fd = (int)(intptr_t)arg, type, reply = AI_DAEMON_ERROR;
+
+    type = ai_daemon_recv(fd, &body, &len, 5000, NULL);
+    if (type == AI_DAEMON_QUERY && ai_daemon_decode(body, len, &opts, &query) == 0) {
+        if (send_ai_query(query, &opts, &response) == 0) {
+            reply = ai_cache_served ? AI_DAEMON_CACHED : AI_DAEMON_ANSWER;
+        }
+        pthread_mutex_lock(&ai_daemon_mutex);
+        ai_daemon_queries++;
+        ai_daemon_hits += reply == AI_DAEMON_CACHED;
+        ai_daemon_failures += reply == AI_DAEMON_ERROR;
+        pthread_mutex_unlock(&ai_daemon_mutex);
+    } else if (type == AI_DAEMON_STATUS) {
+        response = ai_daemon_status();
+        reply = AI_DAEMON_ANSWER;
+    } else if (type == AI_DAEMON_STOP) {
+        ai_daemon_stop = 1;
+        response = strdup("stopping");
+        reply = AI_DAEMON_ANSWER;
+    }
+    if (!response) {
+        response = strdup("Error: malformed request to the AI daemon");
+        reply = AI_DAEMON_ERROR;
+    }
+    if (response) {
+        ai_daemon_send(fd, reply, response, strlen(response), 5000, NULL);
+    }
+
+    free(response);
+    free(body);
+    close(fd);
+    pthread_mutex_lock(&ai_daemon_mutex);
+    ai_daemon_clients--;
+    pthread_mutex_unlock(&ai_daemon_mutex);
+    return NULL;
+}
+
+/* Answer queries on PATH until stopped.  Only the user's own processes
+   may connect: the socket is private to them, and on Linux each peer's
+   credentials are checked as well. */
+static int ai_daemon_serve(const char *path) {
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    pthread_attr_t attr;
+    pthread_t thread;
+    mode_t mask;
+    int listener, fd, waited;
+#if defined (SO_PEERCRED)
+    struct ucred cred;
+    socklen_t cred_len;
+#endif
+
+    /* A socket nothing answers on was left by a daemon that died */
+    if ((fd = ai_daemon_connect(path)) >= 0) {
+        close(fd);
+        builtin_error("%s: a daemon is already serving this socket", path);
+        return -1;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path) || (listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        builtin_error("%s: cannot create socket", path);
+        return -1;
+    }
+    unlink(path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    mask = umask(077);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        umask(mask);
+        builtin_error("%s: %s", path, strerror(errno));
+        close(listener);
+        return -1;
+    }
+    umask(mask);
+
+    ai_daemon_serving = 1;
+    ai_daemon_started = time(NULL);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (!ai_daemon_stop) {
+        pfd.fd = listener;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) <= 0 || (fd = accept(listener, NULL, NULL)) < 0) {
+            continue;
+        }
+#if defined (SO_PEERCRED)
+        cred_len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != getuid()) {
+            close(fd);
+            continue;
+        }
+#endif
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        pthread_mutex_lock(&ai_daemon_mutex);
+        ai_daemon_clients++;
+        ai_daemon_connections++;
+        pthread_mutex_unlock(&ai_daemon_mutex);
+        if (pthread_create(&thread, &attr, ai_daemon_client, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            pthread_mutex_lock(&ai_daemon_mutex);
+            ai_daemon_clients--;
+            pthread_mutex_unlock(&ai_daemon_mutex);
+        }
+    }
+
+    /* Stop taking queries, and give the ones in flight time to finish */
+    close(listener);
+    unlink(path);
+    pthread_attr_destroy(&attr);
+    for (waited = 0; waited < AI_DAEMON_DRAIN_MS; waited += 50) {
+        pthread_mutex_lock(&ai_daemon_mutex);
+        fd = ai_daemon_clients;
+        pthread_mutex_unlock(&ai_daemon_mutex);
+        if (fd == 0) {
+            break;
+        }
+        usleep(50 * 1000);
+    }
+    return 0;
+}
+
+/* Start a daemon on PATH in the background, detached from the terminal
+   and from the job table.  Returns once it answers, or -1. */
+static int ai_daemon_spawn(const char *path) {
+    pid_t pid;
+    int fd, waited;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        /* Fork again so the daemon isn't this shell's child */
+        setsid();
+        if (fork() != 0) {
+            _exit(0);
+        }
+        if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+            dup2(fd, 0);
+            dup2(fd, 1);
+            dup2(fd, 2);
+            if (fd > 2) {
+                close(fd);
+            }
+        }
+        if (chdir("/") != 0) {
+            _exit(1);
+        }
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTERM, ai_daemon_sigterm);
+
+        /* The parent's TLS sessions and screen stay the parent's */
+        ai_pool_forget();
+        g_anbs_display = NULL;
+        _exit(ai_daemon_serve(path) == 0 ? 0 : 1);
+    }
+    waitpid(pid, NULL, 0);
+
+    for (waited = 0; waited < AI_DAEMON_START_MS; waited += 20) {
+        if ((fd = ai_daemon_connect(path)) >= 0) {
+            close(fd);
+            return 0;
+        }
+        usleep(20 * 1000);
+    }
+    return -1;
+}
+
+/* Send the daemon on PATH a TYPE request with no body and print the
+   reply.  Returns a builtin exit status. */
+static int ai_daemon_request(const char *path, int type) {
+    char *reply = NULL;
+    size_t len;
+    int fd, result;
+
+    if ((fd = ai_daemon_connect(path)) < 0) {
+        printf("anbsd: not running on %s\n", path);
+        return EXECUTION_FAILURE;
+    }
+    result = ai_daemon_send(fd, type, "", 0, 5000, NULL) == 0 ? ai_daemon_recv(fd, &reply, &len, 5000, NULL) : -1;
+    close(fd);
+    if (result != AI_DAEMON_ANSWER) {
+        free(reply);
+        builtin_error("%s: the AI daemon did not answer", path);
+        return EXECUTION_FAILURE;
+    }
+    printf("%s\n", reply);
+    free(reply);
+    fflush(stdout);
+    return EXECUTION_SUCCESS;
+}
+
+/* @daemon command implementation */
+int daemon_builtin(WORD_LIST *list) {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    const char *subcommand = list ? list->word->word : "status";
+    const char *value = getenv("ANBS_DAEMON");
+
+    /* The shells only use the daemon with ANBS_DAEMON set, but it can be
+       run and asked about on the default socket regardless */
+    if (ai_daemon_path(value && *value && strcmp(value, "0") != 0 ? value : "1", path, sizeof(path)) != 0) {
+        builtin_error("cannot find a private directory for the daemon's socket");
+        return EXECUTION_FAILURE;
+    }
+
+    if (strcmp(subcommand, "status") == 0) {
+        return ai_daemon_request(path, AI_DAEMON_STATUS);
+    } else if (strcmp(subcommand, "stop") == 0) {
+        return ai_daemon_request(path, AI_DAEMON_STOP);
+    } else if (strcmp(subcommand, "start") == 0) {
+        int fd = ai_daemon_connect(path);
+
+        if (fd >= 0) {
+            close(fd);
+            printf("anbsd: already running on %s\n", path);
+            return EXECUTION_SUCCESS;
+        }
+        if (ai_daemon_spawn(path) != 0) {
+            builtin_error("%s: the AI daemon did not start", path);
+            return EXECUTION_FAILURE;
+        }
+        printf("anbsd: serving on %s\n", path);
+        return EXECUTION_SUCCESS;
+    } else if (strcmp(subcommand, "run") == 0) {
+        /* In the foreground, for a service manager */
+        signal(SIGTERM, ai_daemon_sigterm);
+        return ai_daemon_serve(path) == 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+    }
+
+    builtin_error("%s: unknown subcommand", subcommand);
+    builtin_usage();
+    return EX_USAGE;
+}
+
+struct builtin daemon_struct = {
+    "daemon",
+    daemon_builtin,
+    BUILTIN_ENABLED,
+    (char **)0,
+    "@daemon [start|stop|status|run] - Share one AI cache and connection pool between shells",
     0
 };
\ No newline at end of file
@@ -0,0 +1,454 @@
+/* ai_json.c - the json builtin: read and write JSON without running jq */
+
+#include "config.h"
+
+#if defined (HAVE_UNISTD_H)
+#  include <unistd.h>
+#endif
+
+#include "../bashansi.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "../bashintl.h"
+
+#include "../shell.h"
+#include "../builtins.h"
+#include "common.h"
+#include "bashgetopt.h"
+
+#include <json-c/json.h>
+
+#define JSON_PRINT_FLAGS (JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE)
+
+/* The last document parsed and the text it came from.  Scripts usually
+   pull several fields out of one response in a row, so only the first
+   call pays for parsing it. */
+static char *json_last_text;
+static size_t json_last_len;
+static json_object *json_last_doc;
+static bool json_last_valid;
+
+/* Parse LEN bytes of TEXT into *DOC, which stays owned by the cache */
+static int json_parse(const char *text, size_t len, json_object **doc) {
+    json_tokener *tok;
+    enum json_tokener_error err;
+    json_object *parsed;
+
+    if (json_last_valid && len == json_last_len && memcmp(text, json_last_text, len) == 0) {
+        *doc = json_last_doc;
+        return 0;
+    }
+
+    tok = json_tokener_new();
+    if (!tok) {
+        builtin_error("%s", strerror(ENOMEM));
+        return -1;
+    }
+    parsed = json_tokener_parse_ex(tok, text, (int)len);
+    err = json_tokener_get_error(tok);
+    json_tokener_free(tok);
+    if (err == json_tokener_continue) {
+        builtin_error(_("unexpected end of JSON input"));
+        return -1;
+    } else if (err != json_tokener_success) {
+        builtin_error("%s", json_tokener_error_desc(err));
+        return -1;
+    }
+
+    json_object_put(json_last_doc);
+    free(json_last_text);
+    json_last_text = xmalloc(len + 1);
+    memcpy(json_last_text, text, len);
+    json_last_text[len] = '\0';
+    json_last_len = len;
+    json_last_doc = parsed;
+    json_last_valid = true;
+
+    *doc = parsed;
+    return 0;
+}
+
+/* Read all of FD, which is called NAME in error messages */
+static char *json_read_fd(int fd, const char *name, size_t *len) {
+    char *text;
+    int n;
+
+    n = zmapfd(fd, &text, (char *)name);
+    if (n < 0) {
+        builtin_error("%s: %s", name, strerror(errno));
+        return NULL;
+    }
+    *len = n;
+    return text;
+}
+
+/* Follow PATH from DOC into *RESULT.  PATH is a series of jq-style steps:
+   .name, ["name"] and [index], where a negative index counts from the
+   end; "." or an empty PATH is the whole document.  Returns false if
+   there's nothing there. */
+static bool json_lookup(json_object *doc, const char *path, json_object **result) {
+    json_object *cur = doc;
+    const char *p = path, *q;
+    char *key;
+    bool found;
+
+    while (*p) {
+        if (*p == '.') {
+            p++;
+            if (*p == '\0' || *p == '[') {
+                continue;
+            }
+        }
+        if (*p == '[' && p[1] == '"') {
+            /* A quoted member name, for names that aren't plain words */
+            size_t n = 0;
+
+            key = xmalloc(strlen(p));
+            for (q = p + 2; *q && *q != '"'; q++) {
+                if (*q == '\\' && q[1]) {
+                    q++;
+                }
+                key[n++] = *q;
+            }
+            key[n] = '\0';
+            if (q[0] != '"' || q[1] != ']') {
+                free(key);
+                return false;
+            }
+            p = q + 2;
+        } else if (*p == '[') {
+            char *end;
+            long index = strtol(p + 1, &end, 10);
+            int length;
+
+            if (end == p + 1 || *end != ']' || !json_object_is_type(cur, json_type_array)) {
+                return false;
+            }
+            length = (int)json_object_array_length(cur);
+            if (index < 0) {
+                index += length;
+            }
+            if (index < 0 || index >= length) {
+                return false;
+            }
+            cur = json_object_array_get_idx(cur, (size_t)index);
+            p = end + 1;
+            continue;
+        } else {
+            for (q = p; *q && *q != '.' && *q != '['; q++) {
+                ;
+            }
+            key = substring(p, 0, q - p);
+            p = q;
+        }
+
+        found = json_object_is_type(cur, json_type_object) && json_object_object_get_ex(cur, key, &cur);
+        free(key);
+        if (!found) {
+            return false;
+        }
+    }
+
+    *result = cur;
+    return true;
+}
+
+/* The shell's view of VALUE: strings without their quotes if RAW, and
+   JSON text for everything else */
+static char *json_value_string(json_object *value, bool raw) {
+    if (raw && json_object_is_type(value, json_type_string)) {
+        return savestring(json_object_get_string(value));
+    }
+    return savestring(json_object_to_json_string_ext(value, JSON_PRINT_FLAGS));
+}
+
+static const char *json_type_name(json_object *value) {
+    switch (json_object_get_type(value)) {
+    case json_type_null:
+        return "null";
+    case json_type_boolean:
+        return "boolean";
+    case json_type_double:
+    case json_type_int:
+        return "number";
+    case json_type_string:
+        return "string";
+    case json_type_array:
+        return "array";
+    case json_type_object:
+        return "object";
+    }
+    return "unknown";
+}
+
+/* Print VALUE, or assign it to the variable OUTVAR */
+static int json_output(char *value, const char *outvar) {
+    int result = EXECUTION_SUCCESS;
+
+    if (outvar) {
+        if (builtin_bind_variable((char *)outvar, value, 0) == 0) {
+            result = EXECUTION_FAILURE;
+        }
+    } else {
+        printf("%s\n", value);
+        result = sh_chkwrite(EXECUTION_SUCCESS);
+    }
+    free(value);
+    return result;
+}
+
+/* Store the members of the array or object VALUE in the shell array NAME,
+   an associative one if ASSOC: their keys if KEYS, otherwise their values */
+static int json_store_array(json_object *value, const char *name, bool assoc, bool keys) {
+    SHELL_VAR *var;
+    char *key, *element;
+    size_t i, length;
+
+    if (!json_object_is_type(value, json_type_array) && !json_object_is_type(value, json_type_object)) {
+        builtin_error(_("%s: not an array or object"), json_type_name(value));
+        return EXECUTION_FAILURE;
+    }
+    if (legal_identifier((char *)name) == 0) {
+        sh_invalidid((char *)name);
+        return EXECUTION_FAILURE;
+    }
+    var = find_or_make_array_variable((char *)name, assoc ? 3 : 1);
+    if (var == 0) {
+        return EXECUTION_FAILURE;
+    }
+    if (assoc) {
+        assoc_flush(assoc_cell(var));
+    } else {
+        array_flush(array_cell(var));
+    }
+
+    if (json_object_is_type(value, json_type_array)) {
+        length = json_object_array_length(value);
+        for (i = 0; i < length; i++) {
+            key = itos((intmax_t)i);
+            element = keys ? savestring(key) : json_value_string(json_object_array_get_idx(value, i), true);
+            if (assoc) {
+                bind_assoc_variable(var, (char *)name, key, element, 0);
+            } else {
+                bind_array_element(var, (arrayind_t)i, element, 0);
+                free(key);
+            }
+            free(element);
+        }
+    } else {
+        i = 0;
+        json_object_object_foreach(value, member, member_value) {
+            element = keys ? savestring(member) : json_value_string(member_value, true);
+            if (assoc) {
+                bind_assoc_variable(var, (char *)name, savestring(member), element, 0);
+            } else {
+                bind_array_element(var, (arrayind_t)i++, element, 0);
+            }
+            free(element);
+        }
+    }
+    return EXECUTION_SUCCESS;
+}
+
+/* json -o NAME=STRING|NAME:=JSON ... builds an object, and json -l WORD ...
+   an array of strings */
+static int json_build(WORD_LIST *list, bool object, const char *outvar) {
+    json_object *result, *value;
+    enum json_tokener_error err;
+    char *word, *eq, *name;
+
+    result = object ? json_object_new_object() : json_object_new_array();
+    for (; list; list = list->next) {
+        word = list->word->word;
+        if (!object) {
+            json_object_array_add(result, json_object_new_string(word));
+            continue;
+        }
+
+        eq = strchr(word, '=');
+        if (eq == 0 || eq == word || (eq == word + 1 && *word == ':')) {
+            builtin_error(_("%s: expected NAME=STRING or NAME:=JSON"), word);
+            json_object_put(result);
+            return EX_USAGE;
+        }
+        if (eq[-1] == ':') {
+            value = json_tokener_parse_verbose(eq + 1, &err);
+            if (err != json_tokener_success) {
+                builtin_error(_("%s: %s"), word, json_tokener_error_desc(err));
+                json_object_put(result);
+                return EXECUTION_FAILURE;
+            }
+            name = substring(word, 0, eq - 1 - word);
+        } else {
+            value = json_object_new_string(eq + 1);
+            name = substring(word, 0, eq - word);
+        }
+        json_object_object_add(result, name, value);
+        free(name);
+    }
+
+    word = savestring(json_object_to_json_string_ext(result, JSON_PRINT_FLAGS));
+    json_object_put(result);
+    return json_output(word, outvar);
+}
+
+/* json [-rtk] [-f FILE|-s VAR] [-v VAR|-a ARRAY|-A ASSOC] [PATH]
+   json [-v VAR] -o NAME=STRING|NAME:=JSON ...
+   json [-v VAR] -l WORD ... */
+int json_builtin(WORD_LIST *list) {
+    char *file = NULL, *invar = NULL, *outvar = NULL, *array = NULL, *text;
+    bool raw = false, type = false, keys = false, assoc = false, build = false, object = false;
+    json_object *doc, *value;
+    const char *path;
+    size_t len;
+    int opt, fd, result;
+
+    reset_internal_getopt();
+    while ((opt = internal_getopt(list, "a:A:f:klors:tv:")) != -1) {
+        switch (opt) {
+        case 'a':
+        case 'A':
+            array = list_optarg;
+            assoc = opt == 'A';
+            break;
+        case 'f':
+            file = list_optarg;
+            break;
+        case 'k':
+            keys = true;
+            break;
+        case 'l':
+        case 'o':
+            build = true;
+            object = opt == 'o';
+            break;
+        case 'r':
+            raw = true;
+            break;
+        case 's':
+            invar = list_optarg;
+            break;
+        case 't':
+            type = true;
+            break;
+        case 'v':
+            outvar = list_optarg;
+            break;
+        CASE_HELPOPT;
+        default:
+            builtin_usage();
+            return EX_USAGE;
+        }
+    }
+    list = loptend;
+
+    if (outvar && legal_identifier(outvar) == 0 && valid_array_reference(outvar, 0) == 0) {
+        sh_invalidid(outvar);
+        return EXECUTION_FAILURE;
+    }
+    if (build) {
+        return json_build(list, object, outvar);
+    }
+    if ((list && list->next) || (file && invar) || (array && outvar) || (keys && outvar && !array)) {
+        builtin_usage();
+        return EX_USAGE;
+    }
+    path = list ? list->word->word : ".";
+
+    if (invar) {
+        text = get_string_value(invar);
+        if (text == 0) {
+            builtin_error(_("%s: variable not set"), invar);
+            return EXECUTION_FAILURE;
+        }
+        result = json_parse(text, strlen(text), &doc);
+    } else {
+        fd = file ? open(file, O_RDONLY) : 0;
+        if (fd < 0) {
+            file_error(file);
+            return EXECUTION_FAILURE;
+        }
+        text = json_read_fd(fd, file ? file : _("standard input"), &len);
+        if (fd != 0) {
+            close(fd);
+        }
+        if (text == 0) {
+            return EXECUTION_FAILURE;
+        }
+        result = json_parse(text, len, &doc);
+        free(text);
+    }
+    if (result != 0) {
+        return EXECUTION_FAILURE;
+    }
+
+    if (!json_lookup(doc, path, &value)) {
+        return EXECUTION_FAILURE;
+    }
+
+    if (array) {
+        return json_store_array(value, array, assoc, keys);
+    } else if (type) {
+        return json_output(savestring(json_type_name(value)), outvar);
+    } else if (keys) {
+        if (json_object_is_type(value, json_type_object)) {
+            json_object_object_foreach(value, member, member_value) {
+                (void)member_value;
+                printf("%s\n", member);
+            }
+        } else if (json_object_is_type(value, json_type_array)) {
+            for (len = 0; len < json_object_array_length(value); len++) {
+                printf("%zu\n", len);
+            }
+        } else {
+            builtin_error(_("%s: not an array or object"), json_type_name(value));
+            return EXECUTION_FAILURE;
+        }
+        return sh_chkwrite(EXECUTION_SUCCESS);
+    }
+    return json_output(json_value_string(value, raw), outvar);
+}
+
+static char *json_doc[] = {
+    "Query and build JSON without running an external program.",
+    "",
+    "Reads a JSON document from standard input, FILE or the variable VAR,",
+    "and prints the value at PATH, by default the whole document.  PATH",
+    "is a series of .name, [\"name\"] and [index] steps, as in jq;",
+    "negative indexes count from the end of an array.  A document read",
+    "again unchanged is not parsed again.",
+    "",
+    "Options:",
+    "  -f FILE\tread the document from FILE",
+    "  -s VAR\tread the document from the shell variable VAR",
+    "  -r\t\tprint strings without quotes",
+    "  -t\t\tprint the type of the value: null, boolean, number,",
+    "\t\tstring, array or object",
+    "  -k\t\tprint the keys of an object or the indexes of an array",
+    "  -a ARRAY\tstore the elements of an array, or the values of an",
+    "\t\tobject, in the indexed array ARRAY; strings are stored",
+    "\t\twithout quotes.  With -k, store the keys instead",
+    "  -A ASSOC\tstore the members of an object, or the elements of an",
+    "\t\tarray, in the associative array ASSOC",
+    "  -v VAR\tassign the result to VAR instead of printing it",
+    "  -o\t\tprint an object built from the remaining arguments:",
+    "\t\tNAME=STRING adds a string, NAME:=JSON any JSON value",
+    "  -l\t\tprint an array of the remaining arguments, as strings",
+    "",
+    "Exit Status:",
+    "Returns success unless PATH does not exist, the document cannot be",
+    "parsed, or an invalid option is given.",
+    (char *)NULL
+};
+
+struct builtin json_struct = {
+    "json",
+    json_builtin,
+    BUILTIN_ENABLED,
+    json_doc,
+    "json [-rtk] [-f file|-s var] [-v var|-a array|-A assoc] [path] or json [-v var] -o|-l word ...",
+    0
+};
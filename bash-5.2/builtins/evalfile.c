@@ -43,6 +43,7 @@
 #include "../input.h"
 #include "../execute_cmd.h"
 #include "../trap.h"
+#include "../cmdcache.h"
 
 #include <y.tab.h>
 
@@ -85,6 +86,8 @@ _evalfile (filename, flags)
   struct stat finfo;
   size_t file_size;
   sh_vmsg_func_t *errfunc;
+  SOURCE_CACHE *cache;
+  int startup_slot, startup_functions;
 #if defined (ARRAY_VARS)
   SHELL_VAR *funcname_v, *bash_source_v, *bash_lineno_v;
   ARRAY *funcname_a, *bash_source_a, *bash_lineno_a;
@@ -98,6 +101,11 @@ _evalfile (filename, flags)
 
   USE_VAR(pflags);
 
+  /* Time the file, and count the functions it defines, for the startup
+     profile */
+  startup_slot = STARTUP_ENTER ("file", filename);
+  startup_functions = (startup_slot >= 0 && shell_functions) ? HASH_ENTRIES (shell_functions) : 0;
+
 #if defined (ARRAY_VARS)
   GET_ARRAY_FROM_VAR ("FUNCNAME", funcname_v, funcname_a);
   GET_ARRAY_FROM_VAR ("BASH_SOURCE", bash_source_v, bash_source_a);
@@ -272,6 +280,13 @@ file_error_and_exit:
   if (flags & FEVAL_BUILTIN)
     result = EXECUTION_SUCCESS;
 
+  /* Commands that go into the history have to be parsed from the text */
+#if defined (ANBS_AI_ENABLED)
+  cache = (flags & FEVAL_HISTORY) ? (SOURCE_CACHE *)NULL : source_cache_open (filename, &finfo, string);
+#else
+  cache = (SOURCE_CACHE *)NULL;
+#endif
+
   return_val = setjmp_nosigs (return_catch);
 
   /* If `return' was seen outside of a function, but in the script, then
@@ -282,7 +297,7 @@ file_error_and_exit:
       result = return_catch_value;
     }
   else
-    result = parse_and_execute (string, filename, pflags);
+    result = parse_and_execute_cached (string, filename, pflags, cache);
 
   if (flags & FEVAL_UNWINDPROT)
     run_unwind_frame ("_evalfile");
@@ -312,6 +327,8 @@ file_error_and_exit:
   if (current_token == yacc_EOF)
     push_token ('\n');		/* XXX */
 
+  STARTUP_LEAVE (startup_slot, (shell_functions ? HASH_ENTRIES (shell_functions) : 0) - startup_functions);
+
   return ((flags & FEVAL_BUILTIN) ? result : 1);
 }
 
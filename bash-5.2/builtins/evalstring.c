@@ -45,6 +45,7 @@
 #include "../redir.h"
 #include "../trap.h"
 #include "../bashintl.h"
+#include "../cmdcache.h"
 
 #include <y.tab.h>
 
@@ -297,6 +298,19 @@ parse_and_execute (string, from_file, flags)
      char *string;
      const char *from_file;
      int flags;
+{
+  return (parse_and_execute_cached (string, from_file, flags, (SOURCE_CACHE *)NULL));
+}
+
+/* Like parse_and_execute, but if CACHE is non-null, take the commands
+   from it instead of parsing STRING where it can.  STRING must be the
+   string CACHE was opened for; CACHE is closed before returning. */
+int
+parse_and_execute_cached (string, from_file, flags, cache)
+     char *string;
+     const char *from_file;
+     int flags;
+     SOURCE_CACHE *cache;
 {
   int code, lreset;
   volatile int should_jump_to_top_level, last_result;
@@ -304,6 +318,10 @@ parse_and_execute (string, from_file, flags)
   volatile sigset_t pe_sigmask;
 
   parse_prologue (string, flags, PE_TAG);
+#if defined (ANBS_AI_ENABLED)
+  if (cache)
+    add_unwind_protect (source_cache_close, cache);
+#endif
 
   parse_and_execute_level++;
 
@@ -429,7 +447,11 @@ parse_and_execute (string, from_file, flags)
 	    }
 	}
 
+#if defined (ANBS_AI_ENABLED)
+      if (cache ? source_cache_parse (cache) == 0 : parse_command () == 0)
+#else
       if (parse_command () == 0)
+#endif
 	{
 	  if ((flags & SEVAL_PARSEONLY) || (interactive_shell == 0 && read_but_dont_execute))
 	    {
@@ -0,0 +1,1101 @@
+/* cmdcache.c -- cache the parsed commands of sourced files between shells. */
+
+/* Copyright (C) 2024 Free Software Foundation, Inc.
+
+   This file is part of GNU Bash, the Bourne Again SHell.
+
+   Bash is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Bash is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Bash.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#if defined (ANBS_AI_ENABLED)
+
+#include "bashtypes.h"
+
+#if defined (HAVE_UNISTD_H)
+#  include <unistd.h>
+#endif
+
+#include "filecntl.h"
+#include "posixstat.h"
+#include "posixtime.h"
+#include <stat-time.h>
+
+#include <stdio.h>
+#include <errno.h>
+
+#include "bashansi.h"
+#include <typemax.h>
+
+#include "shell.h"
+#include "parser.h"
+#include "input.h"
+#include "trap.h"
+#include "flags.h"
+#include "pathexp.h"
+#include "cmdcache.h"
+
+#if defined (ALIAS)
+#  include "alias.h"
+#endif
+
+#if !defined (errno)
+extern int errno;
+#endif
+
+/* The cache lives in the directory named by ANBS_SOURCE_CACHE, one file
+   per sourced file, named for its device and inode.  A cache file holds
+   a header identifying the bash version and the sourced file's name, size
+   and modification time, followed by a series of records.  Each record
+   covers the commands parsed from a run of complete input lines: where the
+   run starts and ends in the file, the line number at its start, the
+   parser state it was parsed in, and the commands themselves, serialized
+   in the shape of copy_cmd.c.
+
+   Sourcing replays the records in order.  Since commands can change the
+   way later lines parse (by defining aliases or turning on extglob), a
+   record is only replayed if the parser state matches the one it was
+   recorded in, and not while set -v wants to echo the lines it reads.
+   Otherwise, or when the records run out, the rest of the file is parsed
+   from the start of the record as usual. */
+
+#define SOURCE_CACHE_MAGIC	"anbs-source-cache 1"
+
+/* Nesting deeper than this is treated as a damaged cache file */
+#define SOURCE_CACHE_MAXDEPTH	10000
+
+#define SC_RECORD	1	/* parsing and recording the commands */
+#define SC_REPLAY	2	/* handing out commands from the cache file */
+#define SC_PARSE	3	/* parsing without recording */
+
+struct source_cache {
+  int mode;
+  char *base;			/* the contents of the sourced file */
+  size_t base_len;
+  char *cache_file;
+  char *header;
+
+  /* SC_REPLAY */
+  char *data;			/* the records from the cache file */
+  size_t data_len, pos;
+  int bad, depth;
+  COMMAND **commands;		/* the current record */
+  int *lines;			/* line_number after each command */
+  int ncommands, next;
+  int rec_end;
+
+  /* SC_RECORD */
+  char *buf;
+  size_t buf_len, buf_size;
+  size_t rec_start;		/* where the open record begins in buf */
+  int rec_count;		/* commands in the open record */
+};
+
+/* Offsets of the fields in a record header */
+#define REC_OFFSET	0
+#define REC_LINE	1
+#define REC_STATE	2
+#define REC_COUNT	3
+#define REC_END		4
+#define REC_NFIELDS	5
+
+static unsigned int source_cache_state PARAMS((void));
+static int source_cache_dir_ok PARAMS((const char *));
+static void source_cache_load PARAMS((SOURCE_CACHE *));
+static void source_cache_save PARAMS((SOURCE_CACHE *));
+static void source_cache_fallback PARAMS((SOURCE_CACHE *, int, int));
+static int source_cache_next_record PARAMS((SOURCE_CACHE *));
+static void source_cache_boundary PARAMS((SOURCE_CACHE *));
+static void source_cache_free_record PARAMS((SOURCE_CACHE *));
+
+static void put_bytes PARAMS((SOURCE_CACHE *, const char *, size_t));
+static void put_int PARAMS((SOURCE_CACHE *, int));
+static void put_string PARAMS((SOURCE_CACHE *, const char *));
+static void put_word PARAMS((SOURCE_CACHE *, WORD_DESC *));
+static void put_words PARAMS((SOURCE_CACHE *, WORD_LIST *));
+static void put_redirects PARAMS((SOURCE_CACHE *, REDIRECT *));
+#if defined (COND_COMMAND)
+static void put_cond PARAMS((SOURCE_CACHE *, COND_COM *));
+#endif
+static void put_command PARAMS((SOURCE_CACHE *, COMMAND *));
+
+static int get_int PARAMS((SOURCE_CACHE *));
+static char *get_string PARAMS((SOURCE_CACHE *, int));
+static WORD_DESC *get_word PARAMS((SOURCE_CACHE *));
+static WORD_LIST *get_words PARAMS((SOURCE_CACHE *));
+static REDIRECT *get_redirects PARAMS((SOURCE_CACHE *));
+#if defined (COND_COMMAND)
+static COND_COM *get_cond PARAMS((SOURCE_CACHE *));
+#endif
+static COMMAND *get_command PARAMS((SOURCE_CACHE *));
+
+/* **************************************************************** */
+/*								    */
+/*			Writing Commands			    */
+/*								    */
+/* **************************************************************** */
+
+static void
+put_bytes (sc, s, n)
+     SOURCE_CACHE *sc;
+     const char *s;
+     size_t n;
+{
+  if (sc->buf_len + n > sc->buf_size)
+    {
+      while (sc->buf_len + n > sc->buf_size)
+	sc->buf_size = sc->buf_size ? sc->buf_size * 2 : 4096;
+      sc->buf = (char *)xrealloc (sc->buf, sc->buf_size);
+    }
+  memcpy (sc->buf + sc->buf_len, s, n);
+  sc->buf_len += n;
+}
+
+static void
+put_int (sc, i)
+     SOURCE_CACHE *sc;
+     int i;
+{
+  put_bytes (sc, (char *)&i, sizeof (int));
+}
+
+static void
+put_string (sc, s)
+     SOURCE_CACHE *sc;
+     const char *s;
+{
+  int len;
+
+  len = s ? strlen (s) : -1;
+  put_int (sc, len);
+  if (len > 0)
+    put_bytes (sc, s, len);
+}
+
+static void
+put_word (sc, w)
+     SOURCE_CACHE *sc;
+     WORD_DESC *w;
+{
+  put_int (sc, w->flags);
+  put_string (sc, w->word);
+}
+
+static void
+put_words (sc, list)
+     SOURCE_CACHE *sc;
+     WORD_LIST *list;
+{
+  put_int (sc, list_length ((GENERIC_LIST *)list));
+  for ( ; list; list = list->next)
+    put_word (sc, list->word);
+}
+
+static void
+put_redirects (sc, list)
+     SOURCE_CACHE *sc;
+     REDIRECT *list;
+{
+  put_int (sc, list_length ((GENERIC_LIST *)list));
+  for ( ; list; list = list->next)
+    {
+      put_int (sc, list->rflags);
+      put_int (sc, list->flags);
+      put_int (sc, (int)list->instruction);
+      if (list->rflags & REDIR_VARASSIGN)
+	put_word (sc, list->redirector.filename);
+      else
+	put_int (sc, list->redirector.dest);
+
+      switch (list->instruction)
+	{
+	case r_reading_until:
+	case r_deblank_reading_until:
+	  put_string (sc, list->here_doc_eof);
+	  /*FALLTHROUGH*/
+	case r_reading_string:
+	case r_appending_to:
+	case r_output_direction:
+	case r_input_direction:
+	case r_inputa_direction:
+	case r_err_and_out:
+	case r_append_err_and_out:
+	case r_input_output:
+	case r_output_force:
+	case r_duplicating_input_word:
+	case r_duplicating_output_word:
+	case r_move_input_word:
+	case r_move_output_word:
+	  put_word (sc, list->redirectee.filename);
+	  break;
+	case r_duplicating_input:
+	case r_duplicating_output:
+	case r_move_input:
+	case r_move_output:
+	case r_close_this:
+	  put_int (sc, list->redirectee.dest);
+	  break;
+	}
+    }
+}
+
+#if defined (COND_COMMAND)
+static void
+put_cond (sc, cond)
+     SOURCE_CACHE *sc;
+     COND_COM *cond;
+{
+  if (cond == 0)
+    {
+      put_int (sc, -1);
+      return;
+    }
+
+  put_int (sc, cond->type);
+  put_int (sc, cond->flags);
+  put_int (sc, cond->line);
+  put_int (sc, cond->op != 0);
+  if (cond->op)
+    put_word (sc, cond->op);
+  put_cond (sc, cond->left);
+  put_cond (sc, cond->right);
+}
+#endif
+
+static void
+put_command (sc, command)
+     SOURCE_CACHE *sc;
+     COMMAND *command;
+{
+  PATTERN_LIST *clause;
+
+  if (command == 0)
+    {
+      put_int (sc, -1);
+      return;
+    }
+
+  put_int (sc, (int)command->type);
+  put_int (sc, command->flags);
+  put_int (sc, command->line);
+  put_redirects (sc, command->redirects);
+
+  switch (command->type)
+    {
+    case cm_for:
+#if defined (SELECT_COMMAND)
+    case cm_select:
+#endif
+      /* A SELECT_COM has the same layout as a FOR_COM */
+      put_int (sc, command->value.For->flags);
+      put_int (sc, command->value.For->line);
+      put_word (sc, command->value.For->name);
+      put_words (sc, command->value.For->map_list);
+      put_command (sc, command->value.For->action);
+      break;
+
+#if defined (ARITH_FOR_COMMAND)
+    case cm_arith_for:
+      put_int (sc, command->value.ArithFor->flags);
+      put_int (sc, command->value.ArithFor->line);
+      put_words (sc, command->value.ArithFor->init);
+      put_words (sc, command->value.ArithFor->test);
+      put_words (sc, command->value.ArithFor->step);
+      put_command (sc, command->value.ArithFor->action);
+      break;
+#endif
+
+    case cm_group:
+      put_command (sc, command->value.Group->command);
+      break;
+
+    case cm_subshell:
+      put_int (sc, command->value.Subshell->flags);
+      put_int (sc, command->value.Subshell->line);
+      put_command (sc, command->value.Subshell->command);
+      break;
+
+    case cm_coproc:
+      put_int (sc, command->value.Coproc->flags);
+      put_string (sc, command->value.Coproc->name);
+      put_command (sc, command->value.Coproc->command);
+      break;
+
+    case cm_case:
+      put_int (sc, command->value.Case->flags);
+      put_int (sc, command->value.Case->line);
+      put_word (sc, command->value.Case->word);
+      put_int (sc, list_length ((GENERIC_LIST *)command->value.Case->clauses));
+      for (clause = command->value.Case->clauses; clause; clause = clause->next)
+	{
+	  put_int (sc, clause->flags);
+	  put_words (sc, clause->patterns);
+	  put_command (sc, clause->action);
+	}
+      break;
+
+    case cm_until:
+    case cm_while:
+      put_int (sc, command->value.While->flags);
+      put_command (sc, command->value.While->test);
+      put_command (sc, command->value.While->action);
+      break;
+
+    case cm_if:
+      put_int (sc, command->value.If->flags);
+      put_command (sc, command->value.If->test);
+      put_command (sc, command->value.If->true_case);
+      put_command (sc, command->value.If->false_case);
+      break;
+
+#if defined (DPAREN_ARITHMETIC)
+    case cm_arith:
+      put_int (sc, command->value.Arith->flags);
+      put_int (sc, command->value.Arith->line);
+      put_words (sc, command->value.Arith->exp);
+      break;
+#endif
+
+#if defined (COND_COMMAND)
+    case cm_cond:
+      put_cond (sc, command->value.Cond);
+      break;
+#endif
+
+    case cm_simple:
+      put_int (sc, command->value.Simple->flags);
+      put_int (sc, command->value.Simple->line);
+      put_words (sc, command->value.Simple->words);
+      put_redirects (sc, command->value.Simple->redirects);
+      break;
+
+    case cm_connection:
+      put_int (sc, command->value.Connection->connector);
+      put_command (sc, command->value.Connection->first);
+      put_command (sc, command->value.Connection->second);
+      break;
+
+    case cm_function_def:
+      put_int (sc, command->value.Function_def->flags);
+      put_int (sc, command->value.Function_def->line);
+      put_word (sc, command->value.Function_def->name);
+      put_command (sc, command->value.Function_def->command);
+      put_string (sc, command->value.Function_def->source_file);
+      break;
+    }
+}
+
+/* **************************************************************** */
+/*								    */
+/*			Reading Commands			    */
+/*								    */
+/* **************************************************************** */
+
+/* The readers never fail outright.  When the data runs short or makes no
+   sense they set sc->bad and return something well-formed enough to pass
+   to dispose_command (), so the caller only has to check once. */
+
+static int
+get_int (sc)
+     SOURCE_CACHE *sc;
+{
+  int i;
+
+  if (sc->bad || sc->data_len - sc->pos < sizeof (int))
+    {
+      sc->bad = 1;
+      return 0;
+    }
+  memcpy ((char *)&i, sc->data + sc->pos, sizeof (int));
+  sc->pos += sizeof (int);
+  return i;
+}
+
+/* Return a newly-allocated string.  If NULLOK is zero, never return NULL. */
+static char *
+get_string (sc, nullok)
+     SOURCE_CACHE *sc;
+     int nullok;
+{
+  char *s;
+  int len;
+
+  len = get_int (sc);
+  if (len < -1 || (len > 0 && sc->data_len - sc->pos < (size_t)len))
+    sc->bad = 1;
+  if (sc->bad)
+    return (nullok ? (char *)NULL : savestring (""));
+  if (len == -1)
+    return (nullok ? (char *)NULL : savestring (""));
+
+  s = (char *)xmalloc (len + 1);
+  if (len > 0)
+    memcpy (s, sc->data + sc->pos, len);
+  s[len] = '\0';
+  sc->pos += len;
+  return s;
+}
+
+static WORD_DESC *
+get_word (sc)
+     SOURCE_CACHE *sc;
+{
+  WORD_DESC *w;
+  int flags;
+
+  flags = get_int (sc);
+  w = alloc_word_desc ();
+  w->word = get_string (sc, 0);
+  w->flags = flags;
+  return w;
+}
+
+static WORD_LIST *
+get_words (sc)
+     SOURCE_CACHE *sc;
+{
+  WORD_LIST *list;
+  int n;
+
+  n = get_int (sc);
+  for (list = (WORD_LIST *)NULL; n > 0 && sc->bad == 0; n--)
+    list = make_word_list (get_word (sc), list);
+  if (n < 0)
+    sc->bad = 1;
+  return (REVERSE_LIST (list, WORD_LIST *));
+}
+
+static REDIRECT *
+get_redirects (sc)
+     SOURCE_CACHE *sc;
+{
+  REDIRECT *list, *r;
+  int n;
+
+  n = get_int (sc);
+  if (n < 0)
+    sc->bad = 1;
+  for (list = (REDIRECT *)NULL; n > 0 && sc->bad == 0; n--)
+    {
+      r = (REDIRECT *)xmalloc (sizeof (REDIRECT));
+      r->rflags = get_int (sc);
+      r->flags = get_int (sc);
+      r->instruction = (enum r_instruction)get_int (sc);
+      r->here_doc_eof = (char *)NULL;
+      if (r->rflags & REDIR_VARASSIGN)
+	r->redirector.filename = get_word (sc);
+      else
+	r->redirector.dest = get_int (sc);
+
+      switch (r->instruction)
+	{
+	case r_reading_until:
+	case r_deblank_reading_until:
+	  r->here_doc_eof = get_string (sc, 1);
+	  /*FALLTHROUGH*/
+	case r_reading_string:
+	case r_appending_to:
+	case r_output_direction:
+	case r_input_direction:
+	case r_inputa_direction:
+	case r_err_and_out:
+	case r_append_err_and_out:
+	case r_input_output:
+	case r_output_force:
+	case r_duplicating_input_word:
+	case r_duplicating_output_word:
+	case r_move_input_word:
+	case r_move_output_word:
+	  r->redirectee.filename = get_word (sc);
+	  break;
+	case r_duplicating_input:
+	case r_duplicating_output:
+	case r_move_input:
+	case r_move_output:
+	case r_close_this:
+	  r->redirectee.dest = get_int (sc);
+	  break;
+	default:
+	  /* Make it something dispose_redirects can free */
+	  sc->bad = 1;
+	  r->instruction = r_close_this;
+	  r->redirectee.dest = 0;
+	  break;
+	}
+
+      r->next = list;
+      list = r;
+    }
+  return (REVERSE_LIST (list, REDIRECT *));
+}
+
+#if defined (COND_COMMAND)
+static COND_COM *
+get_cond (sc)
+     SOURCE_CACHE *sc;
+{
+  COND_COM *cond;
+  int type;
+
+  type = get_int (sc);
+  if (type == -1 || sc->bad)
+    return ((COND_COM *)NULL);
+  if (++sc->depth > SOURCE_CACHE_MAXDEPTH)
+    {
+      sc->bad = 1;
+      sc->depth--;
+      return ((COND_COM *)NULL);
+    }
+
+  cond = (COND_COM *)xmalloc (sizeof (COND_COM));
+  cond->type = type;
+  cond->flags = get_int (sc);
+  cond->line = get_int (sc);
+  cond->op = get_int (sc) ? get_word (sc) : (WORD_DESC *)NULL;
+  cond->left = get_cond (sc);
+  cond->right = get_cond (sc);
+
+  sc->depth--;
+  return (cond);
+}
+#endif
+
+static COMMAND *
+get_command (sc)
+     SOURCE_CACHE *sc;
+{
+  COMMAND *command;
+  PATTERN_LIST *clauses, *clause;
+  int type, n;
+
+  type = get_int (sc);
+  if (type == -1 || sc->bad)
+    return ((COMMAND *)NULL);
+  if (++sc->depth > SOURCE_CACHE_MAXDEPTH)
+    {
+      sc->bad = 1;
+      sc->depth--;
+      return ((COMMAND *)NULL);
+    }
+
+  command = (COMMAND *)xmalloc (sizeof (COMMAND));
+  command->type = (enum command_type)type;
+  command->flags = get_int (sc);
+  command->line = get_int (sc);
+  command->redirects = get_redirects (sc);
+
+  switch (command->type)
+    {
+    case cm_for:
+#if defined (SELECT_COMMAND)
+    case cm_select:
+#endif
+      command->value.For = (FOR_COM *)xmalloc (sizeof (FOR_COM));
+      command->value.For->flags = get_int (sc);
+      command->value.For->line = get_int (sc);
+      command->value.For->name = get_word (sc);
+      command->value.For->map_list = get_words (sc);
+      command->value.For->action = get_command (sc);
+      break;
+
+#if defined (ARITH_FOR_COMMAND)
+    case cm_arith_for:
+      command->value.ArithFor = (ARITH_FOR_COM *)xmalloc (sizeof (ARITH_FOR_COM));
+      command->value.ArithFor->flags = get_int (sc);
+      command->value.ArithFor->line = get_int (sc);
+      command->value.ArithFor->init = get_words (sc);
+      command->value.ArithFor->test = get_words (sc);
+      command->value.ArithFor->step = get_words (sc);
+      command->value.ArithFor->action = get_command (sc);
+      break;
+#endif
+
+    case cm_group:
+      command->value.Group = (GROUP_COM *)xmalloc (sizeof (GROUP_COM));
+      command->value.Group->ignore = 0;
+      command->value.Group->command = get_command (sc);
+      break;
+
+    case cm_subshell:
+      command->value.Subshell = (SUBSHELL_COM *)xmalloc (sizeof (SUBSHELL_COM));
+      command->value.Subshell->flags = get_int (sc);
+      command->value.Subshell->line = get_int (sc);
+      command->value.Subshell->command = get_command (sc);
+      break;
+
+    case cm_coproc:
+      command->value.Coproc = (COPROC_COM *)xmalloc (sizeof (COPROC_COM));
+      command->value.Coproc->flags = get_int (sc);
+      command->value.Coproc->name = get_string (sc, 0);
+      command->value.Coproc->command = get_command (sc);
+      break;
+
+    case cm_case:
+      command->value.Case = (CASE_COM *)xmalloc (sizeof (CASE_COM));
+      command->value.Case->flags = get_int (sc);
+      command->value.Case->line = get_int (sc);
+      command->value.Case->word = get_word (sc);
+      n = get_int (sc);
+      if (n < 0)
+	sc->bad = 1;
+      for (clauses = (PATTERN_LIST *)NULL; n > 0 && sc->bad == 0; n--)
+	{
+	  clause = (PATTERN_LIST *)xmalloc (sizeof (PATTERN_LIST));
+	  clause->flags = get_int (sc);
+	  clause->patterns = get_words (sc);
+	  clause->action = get_command (sc);
+	  clause->next = clauses;
+	  clauses = clause;
+	}
+      command->value.Case->clauses = REVERSE_LIST (clauses, PATTERN_LIST *);
+      break;
+
+    case cm_until:
+    case cm_while:
+      command->value.While = (WHILE_COM *)xmalloc (sizeof (WHILE_COM));
+      command->value.While->flags = get_int (sc);
+      command->value.While->test = get_command (sc);
+      command->value.While->action = get_command (sc);
+      break;
+
+    case cm_if:
+      command->value.If = (IF_COM *)xmalloc (sizeof (IF_COM));
+      command->value.If->flags = get_int (sc);
+      command->value.If->test = get_command (sc);
+      command->value.If->true_case = get_command (sc);
+      command->value.If->false_case = get_command (sc);
+      break;
+
+#if defined (DPAREN_ARITHMETIC)
+    case cm_arith:
+      command->value.Arith = (ARITH_COM *)xmalloc (sizeof (ARITH_COM));
+      command->value.Arith->flags = get_int (sc);
+      command->value.Arith->line = get_int (sc);
+      command->value.Arith->exp = get_words (sc);
+      break;
+#endif
+
+#if defined (COND_COMMAND)
+    case cm_cond:
+      command->value.Cond = get_cond (sc);
+      if (command->value.Cond == 0)
+	{
+	  /* dispose_command can't free a cm_cond without a node */
+	  sc->bad = 1;
+	  command->type = cm_group;
+	  command->value.Group = (GROUP_COM *)xmalloc (sizeof (GROUP_COM));
+	  command->value.Group->command = (COMMAND *)NULL;
+	}
+      break;
+#endif
+
+    case cm_simple:
+      command->value.Simple = (SIMPLE_COM *)xmalloc (sizeof (SIMPLE_COM));
+      command->value.Simple->flags = get_int (sc);
+      command->value.Simple->line = get_int (sc);
+      command->value.Simple->words = get_words (sc);
+      command->value.Simple->redirects = get_redirects (sc);
+      break;
+
+    case cm_connection:
+      command->value.Connection = (CONNECTION *)xmalloc (sizeof (CONNECTION));
+      command->value.Connection->ignore = 0;
+      command->value.Connection->connector = get_int (sc);
+      command->value.Connection->first = get_command (sc);
+      command->value.Connection->second = get_command (sc);
+      break;
+
+    case cm_function_def:
+      command->value.Function_def = (FUNCTION_DEF *)xmalloc (sizeof (FUNCTION_DEF));
+      command->value.Function_def->flags = get_int (sc);
+      command->value.Function_def->line = get_int (sc);
+      command->value.Function_def->name = get_word (sc);
+      command->value.Function_def->command = get_command (sc);
+      command->value.Function_def->source_file = get_string (sc, 1);
+      break;
+
+    default:
+      sc->bad = 1;
+      command->type = cm_group;
+      command->value.Group = (GROUP_COM *)xmalloc (sizeof (GROUP_COM));
+      command->value.Group->command = (COMMAND *)NULL;
+      break;
+    }
+
+  sc->depth--;
+  return (command);
+}
+
+/* **************************************************************** */
+/*								    */
+/*			Managing the Cache			    */
+/*								    */
+/* **************************************************************** */
+
+/* A summary of the state that decides how a line parses: the alias
+   definitions, if aliases are being expanded, and the options that the
+   lexer consults. */
+static unsigned int
+source_cache_state ()
+{
+  unsigned int state, h;
+#if defined (ALIAS)
+  BUCKET_CONTENTS *item;
+  alias_t *alias;
+  char *s;
+  int i;
+#endif
+
+  state = (posixly_correct != 0) | ((extended_glob != 0) << 1) |
+	  ((expand_aliases != 0) << 2) |
+	  ((interactive && interactive_comments == 0) << 3) |
+	  ((unsigned int)shell_compatibility_level << 4);
+
+#if defined (ALIAS)
+  /* Sum the hashes so the order of the table doesn't matter */
+  if (expand_aliases && aliases)
+    for (i = 0; i < aliases->nbuckets; i++)
+      for (item = aliases->bucket_array[i]; item; item = item->next)
+	{
+	  alias = (alias_t *)item->data;
+	  h = alias->flags;
+	  for (s = alias->name; *s; s++)
+	    h = h * 31 + (unsigned char)*s;
+	  h = h * 31 + '=';
+	  for (s = alias->value; *s; s++)
+	    h = h * 31 + (unsigned char)*s;
+	  state += h * 0x9e370001U;
+	}
+#endif
+
+  return state;
+}
+
+/* The cache directory has to belong to this user and be writable by no one
+   else, since what is in it gets executed. */
+static int
+source_cache_dir_ok (dir)
+     const char *dir;
+{
+  struct stat finfo;
+
+  return (stat (dir, &finfo) == 0 && S_ISDIR (finfo.st_mode) &&
+	  finfo.st_uid == geteuid () && (finfo.st_mode & (S_IWGRP|S_IWOTH)) == 0);
+}
+
+SOURCE_CACHE *
+source_cache_open (filename, finfo, string)
+     const char *filename;
+     struct stat *finfo;
+     char *string;
+{
+  SOURCE_CACHE *sc;
+  char *dir;
+  size_t len;
+
+  dir = get_string_value ("ANBS_SOURCE_CACHE");
+  if (dir == 0 || *dir == '\0' || source_cache_dir_ok (dir) == 0)
+    return ((SOURCE_CACHE *)NULL);
+
+  /* A change later in the same second would leave the time the same */
+  if (S_ISREG (finfo->st_mode) == 0 || finfo->st_size > INT_MAX ||
+      finfo->st_mtime >= NOW || mbschr (filename, '\n'))
+    return ((SOURCE_CACHE *)NULL);
+
+  sc = (SOURCE_CACHE *)xmalloc (sizeof (SOURCE_CACHE));
+  memset ((char *)sc, 0, sizeof (SOURCE_CACHE));
+  sc->base = string;
+  sc->base_len = strlen (string);
+
+  sc->cache_file = (char *)xmalloc (strlen (dir) + 64);
+  sprintf (sc->cache_file, "%s/%lx-%lx", dir, (unsigned long)finfo->st_dev,
+	   (unsigned long)finfo->st_ino);
+
+  len = strlen (dist_version) + strlen (filename) + 128;
+  sc->header = (char *)xmalloc (len + sizeof (SOURCE_CACHE_MAGIC));
+  sprintf (sc->header, "%s\n%s.%d %d\n%lu %lu %ld %ld %ld\n%s\n",
+	   SOURCE_CACHE_MAGIC, dist_version, patch_level, (int)sizeof (int),
+	   (unsigned long)finfo->st_dev, (unsigned long)finfo->st_ino,
+	   (long)finfo->st_size, (long)finfo->st_mtime,
+	   (long)get_stat_mtime_ns (finfo), filename);
+
+  source_cache_load (sc);
+  sc->mode = sc->data ? SC_REPLAY : SC_RECORD;
+  return sc;
+}
+
+/* Read the cache file's records if its header matches the one we would
+   write.  It is only trusted if this user wrote it. */
+static void
+source_cache_load (sc)
+     SOURCE_CACHE *sc;
+{
+  struct stat finfo;
+  char *buf;
+  ssize_t nr;
+  size_t hlen;
+  int fd;
+
+  fd = open (sc->cache_file, O_RDONLY);
+  if (fd < 0)
+    return;
+  hlen = strlen (sc->header);
+  if (fstat (fd, &finfo) < 0 || S_ISREG (finfo.st_mode) == 0 ||
+      finfo.st_uid != geteuid () || (finfo.st_mode & (S_IWGRP|S_IWOTH)) ||
+      finfo.st_size <= hlen || finfo.st_size > INT_MAX)
+    {
+      close (fd);
+      return;
+    }
+
+  buf = (char *)xmalloc (finfo.st_size);
+  nr = read (fd, buf, finfo.st_size);
+  close (fd);
+  if (nr != finfo.st_size || memcmp (buf, sc->header, hlen) != 0)
+    {
+      free (buf);
+      return;
+    }
+
+  sc->data = buf;
+  sc->data_len = nr;
+  sc->pos = hlen;
+  sc->rec_end = 0;
+}
+
+static void
+source_cache_save (sc)
+     SOURCE_CACHE *sc;
+{
+  char *tmp;
+  FILE *fp;
+  int fd;
+
+  tmp = (char *)xmalloc (strlen (sc->cache_file) + 32);
+  sprintf (tmp, "%s.%ld", sc->cache_file, (long)getpid ());
+  fd = open (tmp, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0600);
+  if (fd < 0 || (fp = fdopen (fd, "w")) == 0)
+    {
+      if (fd >= 0)
+	{
+	  close (fd);
+	  unlink (tmp);
+	}
+      free (tmp);
+      return;
+    }
+
+  fputs (sc->header, fp);
+  fwrite (sc->buf, 1, sc->buf_len, fp);
+  if (fclose (fp) != 0 || rename (tmp, sc->cache_file) < 0)
+    unlink (tmp);
+  free (tmp);
+}
+
+static void
+source_cache_free_record (sc)
+     SOURCE_CACHE *sc;
+{
+  int i;
+
+  for (i = sc->next; i < sc->ncommands; i++)
+    dispose_command (sc->commands[i]);
+  FREE (sc->commands);
+  FREE (sc->lines);
+  sc->commands = (COMMAND **)NULL;
+  sc->lines = (int *)NULL;
+  sc->ncommands = sc->next = 0;
+}
+
+/* Stop replaying and parse the rest of the input from OFFSET, which starts
+   line LINE. */
+static void
+source_cache_fallback (sc, offset, line)
+     SOURCE_CACHE *sc;
+     int offset, line;
+{
+  source_cache_free_record (sc);
+  FREE (sc->data);
+  sc->data = (char *)NULL;
+  sc->mode = SC_PARSE;
+
+  bash_input.location.string = sc->base + offset;
+  clear_shell_input_line ();
+  line_number = line;
+}
+
+/* Read the next record into sc->commands.  Returns 0 if there isn't one
+   we can use, after arranging to parse the rest of the input. */
+static int
+source_cache_next_record (sc)
+     SOURCE_CACHE *sc;
+{
+  int rec[REC_NFIELDS];
+  int i;
+
+  if (sc->pos == sc->data_len)
+    {
+      /* Ran out of records; the rest wasn't recorded */
+      source_cache_fallback (sc, sc->rec_end, line_number);
+      return 0;
+    }
+
+  for (i = 0; i < REC_NFIELDS; i++)
+    rec[i] = get_int (sc);
+
+  if (sc->bad || rec[REC_OFFSET] < sc->rec_end || rec[REC_COUNT] <= 0 ||
+      rec[REC_END] <= rec[REC_OFFSET] || (size_t)rec[REC_END] > sc->base_len)
+    {
+      source_cache_fallback (sc, sc->rec_end, line_number);
+      return 0;
+    }
+
+  /* set -v has to see the lines as they are read */
+  if ((unsigned int)rec[REC_STATE] != source_cache_state () || echo_input_at_read)
+    {
+      source_cache_fallback (sc, rec[REC_OFFSET], rec[REC_LINE]);
+      return 0;
+    }
+
+  /* Read the whole record before executing any of it, so a damaged one
+     can still be parsed from its start instead. */
+  sc->commands = (COMMAND **)xmalloc (rec[REC_COUNT] * sizeof (COMMAND *));
+  sc->lines = (int *)xmalloc (rec[REC_COUNT] * sizeof (int));
+  for (i = 0; i < rec[REC_COUNT] && sc->bad == 0; i++)
+    {
+      sc->lines[i] = get_int (sc);
+      sc->commands[i] = get_command (sc);
+      sc->ncommands = i + 1;
+      if (sc->commands[i] == 0)
+	sc->bad = 1;
+    }
+
+  if (sc->bad)
+    {
+      source_cache_fallback (sc, rec[REC_OFFSET], rec[REC_LINE]);
+      return 0;
+    }
+
+  sc->next = 0;
+  sc->rec_end = rec[REC_END];
+  bash_input.location.string = sc->base + rec[REC_OFFSET];
+  return 1;
+}
+
+/* Called with the parser at the start of a line: close the open record
+   and start another one here. */
+static void
+source_cache_boundary (sc)
+     SOURCE_CACHE *sc;
+{
+  int offset;
+
+  offset = bash_input.location.string - sc->base;
+
+  if (sc->rec_count)
+    {
+      /* Fill in the open record's header; it may not be aligned */
+      memcpy (sc->buf + sc->rec_start + REC_COUNT * sizeof (int),
+	      (char *)&sc->rec_count, sizeof (int));
+      memcpy (sc->buf + sc->rec_start + REC_END * sizeof (int),
+	      (char *)&offset, sizeof (int));
+      sc->rec_start = sc->buf_len;
+      sc->rec_count = 0;
+    }
+  else
+    sc->buf_len = sc->rec_start;	/* nothing but blank lines and comments */
+
+  put_int (sc, offset);
+  put_int (sc, line_number);
+  put_int (sc, (int)source_cache_state ());
+  put_int (sc, 0);
+  put_int (sc, 0);
+}
+
+int
+source_cache_parse (sc)
+     SOURCE_CACHE *sc;
+{
+  COMMAND *command;
+  char *x;
+  int r;
+
+  if (sc->mode == SC_REPLAY && (sc->next < sc->ncommands || source_cache_next_record (sc)))
+    {
+      /* What parse_command () does besides parsing */
+      need_here_doc = 0;
+      RUN_PENDING_TRAPS;
+      current_command_line_count = 0;
+
+      command = sc->commands[sc->next];
+      line_number = sc->lines[sc->next];
+      if (++sc->next == sc->ncommands)
+	{
+	  source_cache_free_record (sc);
+	  bash_input.location.string = sc->base + sc->rec_end;
+	}
+      global_command = command;
+      return 0;
+    }
+
+  if (sc->mode == SC_RECORD)
+    {
+      x = parser_remaining_input ();
+      if ((x == 0 || *x == '\0') && parser_expanding_alias () == 0)
+	source_cache_boundary (sc);
+    }
+
+  r = parse_command ();
+
+  if (sc->mode == SC_RECORD)
+    {
+      if (r != 0)
+	sc->mode = SC_PARSE;	/* don't cache a syntax error */
+      else if (global_command)
+	{
+	  put_int (sc, line_number);
+	  put_command (sc, global_command);
+	  sc->rec_count++;
+	}
+    }
+
+  return r;
+}
+
+void
+source_cache_close (sc)
+     SOURCE_CACHE *sc;
+{
+  char *x;
+
+  if (sc->mode == SC_RECORD)
+    {
+      /* Keep the open record only if its last line was read completely */
+      x = parser_remaining_input ();
+      if (sc->rec_count && (x == 0 || *x == '\0') && parser_expanding_alias () == 0)
+	source_cache_boundary (sc);
+      sc->buf_len = sc->rec_start;
+      if (sc->buf_len)
+	source_cache_save (sc);
+    }
+
+  source_cache_free_record (sc);
+  FREE (sc->data);
+  FREE (sc->buf);
+  free (sc->cache_file);
+  free (sc->header);
+  free (sc);
+}
+#endif /* ANBS_AI_ENABLED */
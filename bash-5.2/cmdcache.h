@@ -0,0 +1,48 @@
+/* cmdcache.h -- declarations for the cache of parsed commands from sourced
+   files. */
+
+/* Copyright (C) 2024 Free Software Foundation, Inc.
+
+   This file is part of GNU Bash, the Bourne Again SHell.
+
+   Bash is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Bash is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Bash.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined (_CMDCACHE_H_)
+#define _CMDCACHE_H_
+
+#include "stdc.h"
+
+typedef struct source_cache SOURCE_CACHE;
+
+#if defined (ANBS_AI_ENABLED)
+/* Functions from cmdcache.c */
+
+/* Return a cache for the commands in STRING, the contents of FILENAME
+   whose status is FINFO, or NULL if there is none to be had. */
+extern SOURCE_CACHE *source_cache_open PARAMS((const char *, struct stat *, char *));
+
+/* Use in place of parse_command () while executing the string a cache
+   was opened for. */
+extern int source_cache_parse PARAMS((SOURCE_CACHE *));
+
+/* Save anything recorded and free the cache.  Suitable for use as an
+   unwind-protect. */
+extern void source_cache_close PARAMS((SOURCE_CACHE *));
+#endif
+
+/* Functions from builtins/evalstring.c */
+extern int parse_and_execute_cached PARAMS((char *, const char *, int, SOURCE_CACHE *));
+
+#endif /* _CMDCACHE_H_ */
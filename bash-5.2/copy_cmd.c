@@ -32,6 +32,8 @@
 
 #include "shell.h"
 
+extern sh_obj_cache_t comcache, simcache, concache;
+
 static PATTERN_LIST *copy_case_clause PARAMS((PATTERN_LIST *));
 static PATTERN_LIST *copy_case_clauses PARAMS((PATTERN_LIST *));
 static FOR_COM *copy_for_command PARAMS((FOR_COM *));
@@ -328,7 +330,7 @@ copy_simple_command (com)
 {
   SIMPLE_COM *new_simple;
 
-  new_simple = (SIMPLE_COM *)xmalloc (sizeof (SIMPLE_COM));
+  ocache_alloc (simcache, SIMPLE_COM, new_simple);
   new_simple->flags = com->flags;
   new_simple->words = copy_word_list (com->words);
   new_simple->redirects = com->redirects ? copy_redirects (com->redirects) : (REDIRECT *)NULL;
@@ -371,7 +373,7 @@ copy_command (command)
   if (command == NULL)
     return (command);
 
-  new_command = (COMMAND *)xmalloc (sizeof (COMMAND));
+  ocache_alloc (comcache, COMMAND, new_command);
   FASTCOPY ((char *)command, (char *)new_command, sizeof (COMMAND));
   new_command->flags = command->flags;
   new_command->line = command->line;
@@ -443,7 +445,7 @@ copy_command (command)
 	{
 	  CONNECTION *new_connection;
 
-	  new_connection = (CONNECTION *)xmalloc (sizeof (CONNECTION));
+	  ocache_alloc (concache, CONNECTION, new_connection);
 	  new_connection->connector = command->value.Connection->connector;
 	  new_connection->first = copy_command (command->value.Connection->first);
 	  new_connection->second = copy_command (command->value.Connection->second);
@@ -30,6 +30,7 @@
 #include "shell.h"
 
 extern sh_obj_cache_t wdcache, wlcache;
+extern sh_obj_cache_t comcache, simcache, concache;
 
 /* Dispose of the command structure passed. */
 void
@@ -151,7 +152,7 @@ dispose_command (command)
 	c = command->value.Simple;
 	dispose_words (c->words);
 	dispose_redirects (c->redirects);
-	free (c);
+	ocache_free (simcache, SIMPLE_COM, c);
 	break;
       }
 
@@ -162,7 +163,7 @@ dispose_command (command)
 	c = command->value.Connection;
 	dispose_command (c->first);
 	dispose_command (c->second);
-	free (c);
+	ocache_free (concache, CONNECTION, c);
 	break;
       }
 
@@ -202,7 +203,7 @@ dispose_command (command)
       command_error ("dispose_command", CMDERR_BADTYPE, command->type, 0);
       break;
     }
-  free (command);
+  ocache_free (comcache, COMMAND, command);
 }
 
 #if defined (COND_COMMAND)
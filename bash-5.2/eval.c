@@ -131,6 +131,11 @@ reader_loop ()
       if (temporary_env)
 	dispose_used_env_vars ();
 
+#if defined (ANBS_AI_ENABLED)
+      /* Don't charge the profile for the time spent reading the command */
+      anbs_profile_run (0);
+#endif
+
 #if (defined (ultrix) && defined (mips)) || defined (C_ALLOCA)
       /* Attempt to reclaim memory allocated with alloca (). */
       (void) alloca (0);
@@ -168,8 +173,21 @@ reader_loop ()
 	      executing = 1;
 	      stdin_redir = 0;
 
+#if defined (HISTORY) && defined (ANBS_AI_ENABLED)
+	      if (interactive)
+		bash_history_command_start ();
+#endif
+#if defined (ANBS_AI_ENABLED)
+	      anbs_profile_run (1);
+#endif
+
 	      execute_command (current_command);
 
+#if defined (HISTORY) && defined (ANBS_AI_ENABLED)
+	      if (interactive)
+		bash_history_command_done (last_command_exit_value);
+#endif
+
 	    exec_done:
 	      QUIT;
 
@@ -325,7 +343,7 @@ parse_command ()
   int r;
 
   need_here_doc = 0;
-  run_pending_traps ();
+  RUN_PENDING_TRAPS;
 
   /* Allow the execution of a random command just before the printing
      of each primary prompt.  If the shell variable PROMPT_COMMAND
@@ -14,9 +14,15 @@
    You should have received a copy of the GNU General Public License
    along with Bash.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <config.h>
+
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <signal.h>
+#if defined (HAVE_UNISTD_H)
+#  include <unistd.h>
+#endif
 
 #include "bashtypes.h"
 #include "shell.h"
@@ -25,35 +31,300 @@
 #include "xmalloc.h"
 #include "bashgetopt.h"
 
+// The worker threads call strcoll, which may allocate memory, so only
+// sort in parallel if malloc is thread-safe
+#if defined (MALLOC_THREADS) || !defined (USING_BASH_MALLOC)
+#  define PARALLEL_SORT
+#  include <pthread.h>
+#endif
+
+#define INSERTION_MAX   16          // merge sort runs shorter than this by insertion
+#define RADIX_MIN       256         // fewest numeric elements to radix sort
+#define RADIX_BITS      11
+#define RADIX_SIZE      (1 << RADIX_BITS)
+#define PARALLEL_MIN    65536       // fewest elements to sort in parallel
+#define PARALLEL_MAX    8           // most threads to use
+
 typedef struct sort_element {
     ARRAY_ELEMENT *v;   // used when sorting array in-place
     char *key;          // used when sorting assoc array
-    char *value;        // points to value of array element or assoc entry
+    char *value;        // points to value of array element or assoc entry,
+                        // or a copy of its key field with -k
     double num;         // used for numeric sort
+    uint64_t bits;      // num, ordered as an unsigned integer for radix sort
 } sort_element;
 
 static int reverse_flag;
 static int numeric_flag;
+static int key_field;   // sort on this field of each value, if non-zero
+static int key_sep;     // fields are separated by this, or by blanks if 0
 
 static int
 compare(const void *p1, const void *p2) {
-    const sort_element e1 = *(sort_element *) p1;
-    const sort_element e2 = *(sort_element *) p2;
+    const sort_element *e1 = p1;
+    const sort_element *e2 = p2;
 
     if (numeric_flag) {
         if (reverse_flag)
-            return (e2.num > e1.num) ? 1 : (e2.num < e1.num) ? -1 : 0;
+            return (e2->num > e1->num) ? 1 : (e2->num < e1->num) ? -1 : 0;
         else
-            return (e1.num > e2.num) ? 1 : (e1.num < e2.num) ? -1 : 0;
+            return (e1->num > e2->num) ? 1 : (e1->num < e2->num) ? -1 : 0;
     }
     else {
         if (reverse_flag)
-            return strcoll(e2.value, e1.value);
+            return strcoll(e2->value, e1->value);
+        else
+            return strcoll(e1->value, e2->value);
+    }
+}
+
+// Return the start of key field number KEY_FIELD in S, and its length in *LENP
+static char *
+key_start(char *s, size_t *lenp) {
+    char *e;
+    int f;
+
+    for (f = 1; ; f++) {
+        if (key_sep == 0)
+            while (*s == ' ' || *s == '\t')
+                s++;
+        if (key_sep)
+            e = strchr(s, key_sep);
+        else
+            e = s + strcspn(s, " \t");
+        if (f == key_field || e == NULL || *e == '\0')
+            break;
+        s = e + 1;
+    }
+    if (f < key_field) {    // not enough fields
+        *lenp = 0;
+        return "";
+    }
+    *lenp = e ? (size_t)(e - s) : strlen(s);
+    return s;
+}
+
+// Map a double onto an unsigned integer with the same order
+static uint64_t
+double_bits(double d) {
+    uint64_t u;
+
+    if (d == 0)
+        d = 0;              // -0.0 sorts with 0.0
+    memcpy(&u, &d, sizeof(u));
+    return (u & 0x8000000000000000ULL) ? ~u : u | 0x8000000000000000ULL;
+}
+
+static void
+set_value(sort_element *e, char *s) {
+    size_t len;
+
+    if (key_field)
+        s = key_start(s, &len);
+    if (numeric_flag) {
+        e->num = strtod(s, NULL);
+        e->bits = double_bits(e->num);
+        if (reverse_flag)
+            e->bits = ~e->bits;
+    }
+    else if (key_field) {
+        e->value = xmalloc(len + 1);
+        memcpy(e->value, s, len);
+        e->value[len] = '\0';
+    }
+    else
+        e->value = s;
+}
+
+static void
+free_values(sort_element *sa, size_t n) {
+    size_t i;
+
+    if (key_field && numeric_flag == 0)
+        for (i = 0; i < n; i++)
+            xfree(sa[i].value);
+}
+
+// Merge A and B into DST, taking from A first when elements compare equal
+static void
+merge(sort_element *dst, sort_element *a, size_t na, sort_element *b, size_t nb) {
+    while (na && nb) {
+        if (compare(a, b) <= 0)
+            *dst++ = *a++, na--;
+        else
+            *dst++ = *b++, nb--;
+    }
+    memcpy(dst, a, na * sizeof(sort_element));
+    memcpy(dst + na, b, nb * sizeof(sort_element));
+}
+
+// Stable merge sort of SA, using TMP, which is as long, as scratch space
+static void
+merge_sort(sort_element *sa, sort_element *tmp, size_t n) {
+    sort_element e;
+    size_t h, i, j;
+
+    if (n <= INSERTION_MAX) {
+        for (i = 1; i < n; i++) {
+            e = sa[i];
+            for (j = i; j > 0 && compare(&sa[j-1], &e) > 0; j--)
+                sa[j] = sa[j-1];
+            sa[j] = e;
+        }
+        return;
+    }
+
+    h = n / 2;
+    merge_sort(sa, tmp, h);
+    merge_sort(sa + h, tmp + h, n - h);
+    if (compare(&sa[h-1], &sa[h]) <= 0)
+        return;             // already in order
+    memcpy(tmp, sa, n * sizeof(sort_element));
+    merge(sa, tmp, h, tmp + h, n - h);
+}
+
+// LSD radix sort on the numeric keys, which is stable and doesn't compare
+static void
+radix_sort(sort_element *sa, sort_element *tmp, size_t n) {
+    size_t count[RADIX_SIZE];
+    sort_element *src, *dst, *t;
+    size_t i, sum, c;
+    int shift;
+
+    src = sa;
+    dst = tmp;
+    for (shift = 0; shift < 64; shift += RADIX_BITS) {
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < n; i++)
+            count[(src[i].bits >> shift) & (RADIX_SIZE - 1)]++;
+        if (count[(src[0].bits >> shift) & (RADIX_SIZE - 1)] == n)
+            continue;       // every key has the same digit
+        for (i = sum = 0; i < RADIX_SIZE; i++) {
+            c = count[i];
+            count[i] = sum;
+            sum += c;
+        }
+        for (i = 0; i < n; i++)
+            dst[count[(src[i].bits >> shift) & (RADIX_SIZE - 1)]++] = src[i];
+        t = src; src = dst; dst = t;
+    }
+    if (src != sa)
+        memcpy(sa, src, n * sizeof(sort_element));
+}
+
+#if defined (PARALLEL_SORT)
+typedef struct sort_job {
+    sort_element *sa, *tmp;
+    size_t n, h;            // merge sa[0..h) and sa[h..n) if h is non-zero
+} sort_job;
+
+static void *
+sort_thread(void *arg) {
+    sort_job *job = arg;
+
+    if (job->h == 0)
+        merge_sort(job->sa, job->tmp, job->n);
+    else if (compare(&job->sa[job->h-1], &job->sa[job->h]) > 0) {
+        memcpy(job->tmp, job->sa, job->n * sizeof(sort_element));
+        merge(job->sa, job->tmp, job->h, job->tmp + job->h, job->n - job->h);
+    }
+    return NULL;
+}
+
+// Run the NJOBS jobs at once, doing the first in this thread
+static void
+run_jobs(sort_job *jobs, int njobs) {
+    pthread_t tids[PARALLEL_MAX];
+    int started[PARALLEL_MAX];
+    int i;
+
+    for (i = 1; i < njobs; i++)
+        started[i] = pthread_create(&tids[i], NULL, sort_thread, &jobs[i]) == 0;
+    sort_thread(&jobs[0]);
+    for (i = 1; i < njobs; i++) {
+        if (started[i])
+            pthread_join(tids[i], NULL);
         else
-            return strcoll(e1.value, e2.value);
+            sort_thread(&jobs[i]);
     }
 }
 
+// Merge sort NTHREADS slices of SA at once, then merge them in pairs,
+// also in parallel, until there's one run left.  The workers leave
+// signals to this thread.
+static void
+parallel_sort(sort_element *sa, sort_element *tmp, size_t n, int nthreads) {
+    sort_job jobs[PARALLEL_MAX];
+    size_t bounds[PARALLEL_MAX + 1];
+    sigset_t set, oset;
+    int i, width, njobs, end;
+
+    for (i = 0; i <= nthreads; i++)
+        bounds[i] = n * i / nthreads;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+    for (i = 0; i < nthreads; i++) {
+        jobs[i].sa = sa + bounds[i];
+        jobs[i].tmp = tmp + bounds[i];
+        jobs[i].n = bounds[i+1] - bounds[i];
+        jobs[i].h = 0;
+    }
+    run_jobs(jobs, nthreads);
+
+    for (width = 1; width < nthreads; width *= 2) {
+        njobs = 0;
+        for (i = 0; i + width < nthreads; i += 2 * width) {
+            end = (i + 2 * width < nthreads) ? i + 2 * width : nthreads;
+            jobs[njobs].sa = sa + bounds[i];
+            jobs[njobs].tmp = tmp + bounds[i];
+            jobs[njobs].n = bounds[end] - bounds[i];
+            jobs[njobs].h = bounds[i + width] - bounds[i];
+            njobs++;
+        }
+        run_jobs(jobs, njobs);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+static int
+sort_threads(void) {
+    long n;
+
+#if defined (_SC_NPROCESSORS_ONLN)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    n = 1;
+#endif
+    return (n < 1) ? 1 : (n > PARALLEL_MAX) ? PARALLEL_MAX : (int)n;
+}
+#endif
+
+// Sort SA stably: numeric keys by radix, the rest by merge sort, with
+// large arrays split among threads
+static void
+sort_elements(sort_element *sa, size_t n) {
+    sort_element *tmp;
+#if defined (PARALLEL_SORT)
+    int nthreads;
+#endif
+
+    if (n < 2)
+        return;
+    tmp = xmalloc(n * sizeof(sort_element));
+    if (numeric_flag && n >= RADIX_MIN)
+        radix_sort(sa, tmp, n);
+#if defined (PARALLEL_SORT)
+    else if (n >= PARALLEL_MIN && (nthreads = sort_threads()) > 1)
+        parallel_sort(sa, tmp, n, nthreads);
+#endif
+    else
+        merge_sort(sa, tmp, n);
+    xfree(tmp);
+}
+
 static int
 sort_index(SHELL_VAR *dest, SHELL_VAR *source) {
     HASH_TABLE *hash;
@@ -77,10 +348,7 @@ sort_index(SHELL_VAR *dest, SHELL_VAR *source) {
             while ( bucket ) {
                 sa[i].v = NULL;
                 sa[i].key = bucket->key;
-                if ( numeric_flag )
-                    sa[i].num = strtod(bucket->data, NULL);
-                else
-                    sa[i].value = bucket->data;
+                set_value(&sa[i], bucket->data);
                 i++;
                 bucket = bucket->next;
             }
@@ -94,10 +362,7 @@ sort_index(SHELL_VAR *dest, SHELL_VAR *source) {
 
         for (ae = element_forw(array->head); ae != array->head; ae = element_forw(ae)) {
             sa[i].v = ae;
-            if (numeric_flag)
-                sa[i].num = strtod(element_value(ae), NULL);
-            else
-                sa[i].value = element_value(ae);
+            set_value(&sa[i], element_value(ae));
             i++;
         }
     }
@@ -108,7 +373,7 @@ sort_index(SHELL_VAR *dest, SHELL_VAR *source) {
         return EXECUTION_FAILURE;
     }
 
-    qsort(sa, n, sizeof(sort_element), compare);
+    sort_elements(sa, n);
 
     array_flush(dest_array);
 
@@ -121,6 +386,8 @@ sort_index(SHELL_VAR *dest, SHELL_VAR *source) {
         array_insert(dest_array, i, key);
     }
 
+    free_values(sa, n);
+    xfree(sa);
     return EXECUTION_SUCCESS;
 }
 
@@ -142,10 +409,7 @@ sort_inplace(SHELL_VAR *var) {
     i = 0;
     for (ae = element_forw(a->head); ae != a->head; ae = element_forw(ae)) {
         sa[i].v = ae;
-        if (numeric_flag)
-            sa[i].num = strtod(element_value(ae), NULL);
-        else
-            sa[i].value = element_value(ae);
+        set_value(&sa[i], element_value(ae));
         i++;
     }
 
@@ -155,13 +419,15 @@ sort_inplace(SHELL_VAR *var) {
         return EXECUTION_FAILURE;
     }
 
-    qsort(sa, n, sizeof(sort_element), compare);
+    sort_elements(sa, n);
+    free_values(sa, n);
 
     // for in-place sort, simply "rewire" the array elements
     sa[0].v->prev = sa[n-1].v->next = a->head;
     a->head->next = sa[0].v;
     a->head->prev = sa[n-1].v;
     a->max_index = n - 1;
+    array_dense_invalidate(a);
     for (i = 0; i < n; i++) {
         sa[i].v->ind = i;
         if (i > 0)
@@ -179,16 +445,33 @@ asort_builtin(WORD_LIST *list) {
     char *word;
     int opt, ret;
     int index_flag = 0;
+    intmax_t num;
 
     numeric_flag = 0;
     reverse_flag = 0;
+    key_field = 0;
+    key_sep = 0;
 
     reset_internal_getopt();
-    while ((opt = internal_getopt(list, "inr")) != -1) {
+    while ((opt = internal_getopt(list, "ik:nrt:")) != -1) {
         switch (opt) {
             case 'i': index_flag = 1; break;
             case 'n': numeric_flag = 1; break;
             case 'r': reverse_flag = 1; break;
+            case 'k':
+                if (legal_number(list_optarg, &num) == 0 || num <= 0 || num > INT_MAX) {
+                    builtin_error("%s: invalid field number", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                key_field = num;
+                break;
+            case 't':
+                if (list_optarg[0] == '\0' || list_optarg[1] != '\0') {
+                    builtin_error("%s: separator must be a single character", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                key_sep = (unsigned char)list_optarg[0];
+                break;
             CASE_HELPOPT;
             default:
                 builtin_usage();
@@ -256,6 +539,13 @@ char *asort_doc[] = {
     "  -n  compare according to string numerical value",
     "  -r  reverse the result of comparisons",
     "  -i  sort using indices/keys",
+    "  -k  sort on field number FIELD of each value, counting from 1",
+    "  -t  fields are separated by SEP instead of runs of blanks",
+    "",
+    "The sort is stable: elements that compare equal keep their order.",
+    "Numeric sorts use a radix sort, and large arrays are sorted by",
+    "several threads at once. In-place sorts move the existing elements",
+    "rather than copying their values.",
     "",
     "If -i is supplied, SOURCE is not sorted in-place, but the indices (or keys",
     "if associative) of SOURCE, after sorting it by its values, are placed as",
@@ -274,6 +564,6 @@ struct builtin asort_struct = {
     asort_builtin,
     BUILTIN_ENABLED,
     asort_doc,
-    "asort [-nr] array ...  or  asort [-nr] -i dest source",
+    "asort [-nr] [-k field [-t sep]] array ...  or  asort [-nr] [-k field [-t sep]] -i dest source",
     0
 };
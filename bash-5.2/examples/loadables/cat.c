@@ -40,9 +40,24 @@ fcopy(fd, fn)
 int	fd;
 char	*fn;
 {
-	char	buf[4096], *s;
+	char	buf[65536], *s;
 	int	n, w, e;
 
+	/* Let the kernel move the data if it can, and read and write
+	   whatever it can't */
+	if ((n = zcopyfd(fd, 1)) <= 0) {
+		if (n == 0)
+			return 0;
+		e = errno;
+		write(2, "cat: ", 5);
+		write(2, fn, strlen(fn));
+		write(2, ": ", 2);
+		s = strerror(e);
+		write(2, s, strlen(s));
+		write(2, "\n", 1);
+		return 1;
+	}
+
 	while (n = read(fd, buf, sizeof (buf))) {
 		if (n < 0) {
 			e = errno;
@@ -27,6 +27,8 @@
 #endif
 #include "bashansi.h"
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include "loadables.h"
 
@@ -162,22 +164,494 @@ dsvsplit (dsv, line, dstring, flags)
   return (rval = ind);				/* number of fields */
 }
 
+/* Streaming mode: parse a whole file of delimiter-separated records,
+   reading it in large blocks rather than a line at a time. */
+
+#define DSV_BUFSIZ	(1024 * 1024)
+#define DSV_QUANTUM_DEFAULT	5000
+
+/* One field of the record being parsed: LEN bytes at START, still
+   quoted if QUOTED is non-zero */
+struct dsvfield
+{
+  char *start;
+  size_t len;
+  int quoted;
+};
+
+struct dsvstream
+{
+  int fd;
+  int eof;
+  char *buf;			/* input; BUF[POS] through BUF[LEN-1] unparsed */
+  size_t bufsize, pos, len;
+  struct dsvfield *fields;	/* fields of the current record */
+  int nfields, fieldsize;
+  char *xbuf;			/* a field's value, unquoted */
+  size_t xbufsize;
+  SHELL_VAR **cols;		/* column arrays */
+  int ncols;
+  char *prefix;
+  int delim, flags;
+};
+
+/* Test a word at a time for the delimiter or a newline.  This is the
+   portable version of the SIMD scanners fast CSV parsers use: HASZERO
+   is non-zero if any byte of W is zero, and W ^ REPEAT(C) has a zero
+   byte wherever W has a C. */
+typedef unsigned long dsvword_t;
+
+#define ONES		((dsvword_t)-1 / 0xff)
+#define HIGHS		(ONES * 0x80)
+#define HASZERO(w)	(((w) - ONES) & ~(w) & HIGHS)
+
+/* Return a pointer to the first instance of C1 or C2 between S and END,
+   or END if there is none */
+static char *
+dsvscan (s, end, c1, c2)
+     char *s, *end;
+     int c1, c2;
+{
+  dsvword_t w, m1, m2;
+
+  m1 = ONES * (unsigned char)c1;
+  m2 = ONES * (unsigned char)c2;
+  while (s < end && ((unsigned long)s & (sizeof (dsvword_t) - 1)))
+    {
+      if (*s == c1 || *s == c2)
+	return s;
+      s++;
+    }
+  for ( ; end - s >= (long)sizeof (dsvword_t); s += sizeof (dsvword_t))
+    {
+      memcpy (&w, s, sizeof (w));
+      if (HASZERO (w ^ m1) | HASZERO (w ^ m2))
+	break;
+    }
+  for ( ; s < end; s++)
+    if (*s == c1 || *s == c2)
+      return s;
+  return end;
+}
+
+static void
+dsvaddfield (ds, start, len, quoted)
+     struct dsvstream *ds;
+     char *start;
+     size_t len;
+     int quoted;
+{
+  if (ds->nfields >= ds->fieldsize)
+    {
+      ds->fieldsize = ds->fieldsize ? ds->fieldsize * 2 : 32;
+      ds->fields = xrealloc (ds->fields, ds->fieldsize * sizeof (struct dsvfield));
+    }
+  ds->fields[ds->nfields].start = start;
+  ds->fields[ds->nfields].len = len;
+  ds->fields[ds->nfields].quoted = quoted;
+  ds->nfields++;
+}
+
+/* Parse the record at DS->buf + DS->pos into DS->fields.  Return 1 and
+   advance DS->pos past the record if it's complete, 0 if we need to read
+   more input first, and -1 at the end of the input.  A partial record is
+   parsed again from the start once there's more input, since a quoted
+   field can span lines and blocks. */
+static int
+dsvrecord (ds)
+     struct dsvstream *ds;
+{
+  char *s, *e, *q, *end;
+
+  s = ds->buf + ds->pos;
+  end = ds->buf + ds->len;
+  ds->nfields = 0;
+
+  if (s == end)
+    return (ds->eof ? -1 : 0);
+
+  for (;;)
+    {
+      if (s == end)
+	{
+	  /* a delimiter just before the end of the input */
+	  if (ds->eof == 0)
+	    return 0;
+	  dsvaddfield (ds, s, 0, 0);
+	  ds->pos = ds->len;
+	  return 1;
+	}
+      else if (*s == '"')
+	{
+	  for (q = s + 1; ; q += 2)
+	    {
+	      q = memchr (q, '"', end - q);
+	      if (q == 0)
+		{
+		  if (ds->eof == 0)
+		    return 0;
+		  q = end - 1;		/* unterminated; take the rest */
+		  break;
+		}
+	      else if (q + 1 == end && ds->eof == 0)
+		return 0;		/* can't tell if it's doubled yet */
+	      else if (q + 1 == end || q[1] != '"')
+		break;
+	    }
+	  /* Like dsvsplit, keep anything between the closing quote and the
+	     delimiter */
+	  e = dsvscan (q + 1, end, ds->delim, '\n');
+	  dsvaddfield (ds, s, e - s, 1);
+	}
+      else
+	{
+	  e = dsvscan (s, end, ds->delim, '\n');
+	  dsvaddfield (ds, s, e - s, 0);
+	}
+
+      if (e == end)
+	{
+	  if (ds->eof == 0)
+	    return 0;
+	  ds->pos = ds->len;
+	  return 1;
+	}
+      else if (*e == '\n')
+	{
+	  ds->pos = e + 1 - ds->buf;
+	  return 1;
+	}
+      s = e + 1;
+    }
+}
+
+/* Read more input, keeping the unparsed part of the buffer.  Returns -1
+   on a read error. */
+static int
+dsvfill (ds)
+     struct dsvstream *ds;
+{
+  ssize_t n;
+
+  if (ds->pos > 0)
+    {
+      memmove (ds->buf, ds->buf + ds->pos, ds->len - ds->pos);
+      ds->len -= ds->pos;
+      ds->pos = 0;
+    }
+  /* A record longer than the buffer */
+  if (ds->bufsize - ds->len < DSV_BUFSIZ / 2)
+    {
+      ds->bufsize *= 2;
+      ds->buf = xrealloc (ds->buf, ds->bufsize);
+    }
+
+  do
+    {
+      QUIT;
+      n = read (ds->fd, ds->buf + ds->len, ds->bufsize - ds->len);
+    }
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    return -1;
+  else if (n == 0)
+    ds->eof = 1;
+  else
+    ds->len += n;
+  return 0;
+}
+
+/* Return the value of field F of the current record, with the quotes
+   removed unless F_PRESERVE is set */
+static char *
+dsvvalue (ds, f)
+     struct dsvstream *ds;
+     struct dsvfield *f;
+{
+  char *s, *end;
+  size_t b;
+  int qstate;
+
+  if (f->len + 1 > ds->xbufsize)
+    {
+      ds->xbufsize = f->len + 1;
+      ds->xbuf = xrealloc (ds->xbuf, ds->xbufsize);
+    }
+
+  if (f->quoted == 0)
+    {
+      memcpy (ds->xbuf, f->start, f->len);
+      ds->xbuf[f->len] = '\0';
+      return ds->xbuf;
+    }
+
+  b = 0;
+  s = f->start;
+  end = f->start + f->len;
+  if (ds->flags & F_PRESERVE)
+    ds->xbuf[b++] = *s;
+  for (qstate = DQUOTE, s++; s < end; s++)
+    {
+      if (qstate == DQUOTE && *s == '"' && s + 1 < end && s[1] == '"')
+	ds->xbuf[b++] = *s++;	/* skip double quote */
+      else if (qstate == DQUOTE && *s == '"')
+	{
+	  qstate = NQUOTE;
+	  if (ds->flags & F_PRESERVE)
+	    ds->xbuf[b++] = *s;
+	}
+      else
+	ds->xbuf[b++] = *s;
+    }
+  ds->xbuf[b] = '\0';
+  return ds->xbuf;
+}
+
+/* Find or create the array variable NAME and empty it */
+static SHELL_VAR *
+dsvarray (name)
+     char *name;
+{
+  SHELL_VAR *v;
+
+  v = find_or_make_array_variable (name, 1);
+  if (v == 0 || readonly_p (v) || noassign_p (v))
+    {
+      if (v && readonly_p (v))
+	err_readonly (name);
+      return ((SHELL_VAR *)NULL);
+    }
+  else if (array_p (v) == 0)
+    {
+      builtin_error ("%s: not an indexed array", name);
+      return ((SHELL_VAR *)NULL);
+    }
+  if (invisible_p (v))
+    VUNSETATTR (v, att_invisible);
+  array_flush (array_cell (v));
+  return v;
+}
+
+static char *
+dsvcolname (prefix, n)
+     char *prefix;
+     int n;
+{
+  char *name, *ns;
+
+  ns = itos (n);
+  name = xmalloc (strlen (prefix) + strlen (ns) + 2);
+  sprintf (name, "%s_%s", prefix, ns);
+  free (ns);
+  return name;
+}
+
+/* The array for column N, PREFIX_N */
+static SHELL_VAR *
+dsvcolumn (ds, n)
+     struct dsvstream *ds;
+     int n;
+{
+  char *name;
+
+  if (n >= ds->ncols)
+    {
+      ds->cols = xrealloc (ds->cols, (n + 1) * sizeof (SHELL_VAR *));
+      memset (ds->cols + ds->ncols, 0, (n + 1 - ds->ncols) * sizeof (SHELL_VAR *));
+      ds->ncols = n + 1;
+    }
+  if (ds->cols[n] == 0)
+    {
+      name = dsvcolname (ds->prefix, n);
+      ds->cols[n] = dsvarray (name);
+      free (name);
+    }
+  return ds->cols[n];
+}
+
+/* Empty the column arrays left over from a previous file, which might
+   have had more columns than this one */
+static void
+dsvclear (prefix)
+     char *prefix;
+{
+  SHELL_VAR *v;
+  char *name;
+  int n;
+
+  for (n = 0; ; n++)
+    {
+      name = dsvcolname (prefix, n);
+      v = find_variable (name);
+      free (name);
+      if (v == 0 || array_p (v) == 0 || readonly_p (v) || noassign_p (v))
+	break;
+      array_flush (array_cell (v));
+    }
+}
+
+/* Store the fields of the current record into element IND of the column
+   arrays, or into HEADER if it's non-null.  Returns 0 if a column array
+   can't be assigned. */
+static int
+dsvstore (ds, ind, header)
+     struct dsvstream *ds;
+     arrayind_t ind;
+     SHELL_VAR *header;
+{
+  struct dsvfield *f;
+  SHELL_VAR *v;
+  char *value;
+  int i, col;
+
+  f = ds->fields;
+  /* Strip the carriage return from a CRLF line ending */
+  if (ds->nfields && f[ds->nfields - 1].len && f[ds->nfields - 1].start[f[ds->nfields - 1].len - 1] == '\r')
+    f[ds->nfields - 1].len--;
+
+  for (i = col = 0; i < ds->nfields; i++)
+    {
+      if ((ds->flags & F_GREEDY) && f[i].len == 0)
+	continue;
+      value = dsvvalue (ds, f + i);
+      if (header)
+	bind_array_element (header, col, value, 0);
+      else if (v = dsvcolumn (ds, col))
+	bind_array_element (v, ind, value, 0);
+      else
+	return 0;
+      col++;
+    }
+  return 1;
+}
+
+/* Run CALLBACK with the index of the first record in the batch and the
+   number of records in it, the way mapfile runs its callback */
+static int
+dsvcallback (callback, first, count)
+     char *callback;
+     intmax_t first, count;
+{
+  char *execstr;
+  size_t execlen;
+
+  execlen = strlen (callback) + 2 * (INT_STRLEN_BOUND (intmax_t) + 1) + 1;
+  execstr = xmalloc (execlen);
+  snprintf (execstr, execlen, "%s %jd %jd", callback, first, count);
+  return (evalstring (execstr, NULL, SEVAL_NOHIST));
+}
+
+/* Parse the file open on FD into the column arrays PREFIX_0, PREFIX_1,
+   and so on.  If HEADER is non-null, the first record goes there instead.
+   If CALLBACK is non-null, run it after each QUANTUM records and empty
+   the column arrays, so they only hold one batch at a time. */
+static int
+dsvstream (fd, prefix, header, delim, flags, callback, quantum)
+     int fd;
+     char *prefix;
+     SHELL_VAR *header;
+     int delim, flags;
+     char *callback;
+     intmax_t quantum;
+{
+  struct dsvstream ds;
+  intmax_t nrec, first;
+  arrayind_t ind;
+  int r, rval;
+
+  memset (&ds, 0, sizeof (ds));
+  ds.fd = fd;
+  ds.bufsize = DSV_BUFSIZ;
+  ds.buf = xmalloc (ds.bufsize);
+  ds.prefix = prefix;
+  ds.delim = delim;
+  ds.flags = flags;
+
+  dsvclear (prefix);
+
+  rval = EXECUTION_SUCCESS;
+  nrec = first = 0;
+  ind = 0;
+  for (;;)
+    {
+      r = dsvrecord (&ds);
+      if (r == 0)
+	{
+	  if (dsvfill (&ds) < 0)
+	    {
+	      builtin_error ("read error: %s", strerror (errno));
+	      rval = EXECUTION_FAILURE;
+	      break;
+	    }
+	  continue;
+	}
+      else if (r < 0)
+	break;
+
+      /* Skip empty lines */
+      if (ds.nfields == 1 && ds.fields[0].len == 0)
+	continue;
+      else if (ds.nfields == 1 && ds.fields[0].len == 1 && ds.fields[0].start[0] == '\r')
+	continue;
+
+      if (header)
+	{
+	  dsvstore (&ds, 0, header);
+	  header = 0;
+	  continue;
+	}
+
+      if (dsvstore (&ds, ind, (SHELL_VAR *)NULL) == 0)
+	{
+	  rval = EXECUTION_FAILURE;
+	  break;
+	}
+      nrec++;
+      ind++;
+
+      if (callback && ind == quantum)
+	{
+	  dsvcallback (callback, first, (intmax_t)ind);
+	  /* The callback can unset or change the column arrays, so look
+	     them up again */
+	  memset (ds.cols, 0, ds.ncols * sizeof (SHELL_VAR *));
+	  dsvclear (prefix);
+	  first = nrec;
+	  ind = 0;
+	}
+    }
+
+  if (callback && ind > 0 && rval == EXECUTION_SUCCESS)
+    dsvcallback (callback, first, (intmax_t)ind);
+
+  free (ds.buf);
+  FREE (ds.fields);
+  FREE (ds.xbuf);
+  FREE (ds.cols);
+
+  return (rval);
+}
+
 int
 dsv_builtin (list)
      WORD_LIST *list;
 {
-  int opt, rval, flags;
-  char *array_name, *dsvstring, *delims;
+  int opt, rval, flags, header, fd;
+  char *array_name, *dsvstring, *delims, *filename, *callback;
+  intmax_t quantum;
   SHELL_VAR *v;
 
   array_name = 0;
   rval = EXECUTION_SUCCESS;
 
   delims = ",";
-  flags = 0;
+  flags = header = 0;
+  filename = callback = 0;
+  quantum = DSV_QUANTUM_DEFAULT;
 
   reset_internal_getopt ();
-  while ((opt = internal_getopt (list, "a:d:Sgp")) != -1)
+  while ((opt = internal_getopt (list, "a:C:c:d:f:HSgp")) != -1)
     {
       switch (opt)
 	{
@@ -196,6 +670,22 @@ dsv_builtin (list)
 	case 'p':
 	  flags |= F_PRESERVE;
 	  break;
+	case 'f':
+	  filename = list_optarg;
+	  break;
+	case 'H':
+	  header = 1;
+	  break;
+	case 'C':
+	  callback = list_optarg;
+	  break;
+	case 'c':
+	  if (legal_number (list_optarg, &quantum) == 0 || quantum <= 0)
+	    {
+	      builtin_error ("%s: invalid callback quantum", list_optarg);
+	      return (EXECUTION_FAILURE);
+	    }
+	  break;
 	CASE_HELPOPT;
 	default:
 	  builtin_usage ();
@@ -213,6 +703,33 @@ dsv_builtin (list)
       return (EXECUTION_FAILURE);
     }
 
+  if (filename)
+    {
+      if (flags & F_SHELLQUOTE)
+	{
+	  builtin_error ("-S cannot be used with -f");
+	  return (EX_USAGE);
+	}
+
+      v = 0;
+      if (header && (v = dsvarray (array_name)) == 0)
+	return (EXECUTION_FAILURE);
+
+      if (filename[0] == '-' && filename[1] == '\0')
+	fd = 0;
+      else if ((fd = open (filename, O_RDONLY)) < 0)
+	{
+	  file_error (filename);
+	  return (EXECUTION_FAILURE);
+	}
+
+      rval = dsvstream (fd, array_name, v, *delims, flags, callback, quantum);
+
+      if (fd != 0)
+	close (fd);
+      return (rval);
+    }
+
   if (list == 0)
     {
       builtin_error ("dsv string argument required");
@@ -285,8 +802,25 @@ char *dsv_doc[] = {
 	"quote characters as part of the generated field; otherwise they are",
 	"removed.",
 	"",
-	"The return value is 0 unless an invalid option is supplied or the ARRAYNAME",
-	"argument is invalid or readonly.",
+	"With the -f option, dsv reads a whole file of records from FILE, or",
+	"the standard input if FILE is -, instead of parsing STRING. It reads",
+	"the file in large blocks, and a double-quoted field may contain",
+	"newlines. Field N of each record is stored into the indexed array",
+	"ARRAYNAME_N, so the column arrays hold the file's records at",
+	"consecutive indices starting at 0. Blank lines are skipped, and a",
+	"carriage return ending a line is removed. If the -H option is",
+	"supplied, the first record is a header, and its fields are stored",
+	"into ARRAYNAME instead. -S may not be used with -f.",
+	"",
+	"If the -C option is supplied with -f, CALLBACK is evaluated each",
+	"time QUANTUM records have been read, and once more for any remaining",
+	"records at the end of the file. It is supplied the index of the",
+	"first record in the batch and the number of records in the batch as",
+	"additional arguments, and the column arrays hold only that batch.",
+	"The -c option specifies QUANTUM; the default is 5000.",
+	"",
+	"The return value is 0 unless an invalid option is supplied, the ARRAYNAME",
+	"argument is invalid or readonly, or FILE cannot be read.",
 	(char *)NULL
 };
 
@@ -295,6 +829,6 @@ struct builtin dsv_struct = {
 	dsv_builtin,		/* function implementing the builtin */
 	BUILTIN_ENABLED,	/* initial flags for builtin */
 	dsv_doc,		/* array of long documentation strings. */
-	"dsv [-a ARRAYNAME] [-d DELIMS] [-Sgp] string",	/* usage synopsis; becomes short_doc */
+	"dsv [-a ARRAYNAME] [-d DELIMS] [-HSgp] [-C CALLBACK] [-c QUANTUM] [-f FILE | string]",	/* usage synopsis; becomes short_doc */
 	0			/* reserved for internal use */
 };
@@ -46,10 +46,23 @@
 extern int errno;
 #endif
 
+/* Duplicate the standard input in the kernel when it's a pipe: tee(2)
+   copies references to its pages into a pipe for each output, splice(2)
+   moves them on to the output, and the last output gets the original. */
+#if defined (HAVE_TEE) && defined (HAVE_SPLICE) && defined (F_GETPIPE_SZ)
+#  define TEE_SPLICE
+#endif
+
 typedef struct flist {
   struct flist *next;
   int fd;
   char *fname;
+#if defined (TEE_SPLICE)
+  int pfd[2];		/* pipe to duplicate the input into */
+  int nosplice;		/* can't splice to fd; copy through the buffer */
+  int failed;		/* a write error; discard the rest */
+  size_t owed;		/* bytes of this chunk tee didn't duplicate */
+#endif
 } FLIST;
 
 static FLIST *tee_flist;
@@ -60,6 +73,219 @@ extern int interrupt_immediately;
 
 extern char *strerror ();
 
+#if defined (TEE_SPLICE)
+/* Write N bytes from BUF to FL's file, unless writing has already failed */
+static int
+tee_write (fl, buf, n)
+     FLIST *fl;
+     char *buf;
+     size_t n;
+{
+  ssize_t nw;
+
+  while (n > 0 && fl->failed == 0)
+    {
+      if ((nw = write (fl->fd, buf, n)) == -1)
+	{
+	  if (errno == EINTR)
+	    {
+	      QUIT;
+	      continue;
+	    }
+	  builtin_error ("%s: write error: %s", fl->fname, strerror (errno));
+	  fl->failed = 1;
+	  return -1;
+	}
+      buf += nw;
+      n -= nw;
+    }
+  return (fl->failed ? -1 : 0);
+}
+
+/* Move exactly N bytes from the pipe IN to FL's file: with splice if we
+   can, otherwise through BUF, which holds BUFSIZE bytes.  After a write
+   error the rest is read and discarded, so IN keeps in step with the
+   other outputs.  Returns -1 if IN ends first or can't be read. */
+static int
+tee_move (in, fl, n, buf, bufsize)
+     int in;
+     FLIST *fl;
+     size_t n;
+     char *buf;
+     size_t bufsize;
+{
+  ssize_t nr;
+
+  while (n > 0)
+    {
+      if (fl->nosplice == 0 && fl->failed == 0)
+	{
+	  nr = splice (in, (loff_t *)0, fl->fd, (loff_t *)0, n, SPLICE_F_MOVE);
+	  if (nr > 0)
+	    {
+	      n -= nr;
+	      continue;
+	    }
+	  else if (nr == 0)
+	    return -1;		/* end of input */
+	  else if (nr < 0 && errno == EINTR)
+	    {
+	      QUIT;
+	      continue;
+	    }
+	  /* ttys and files opened for appending can't be spliced to */
+	  else if (nr < 0 && (errno == EINVAL || errno == ENOSYS))
+	    fl->nosplice = 1;
+	  else
+	    {
+	      builtin_error ("%s: write error: %s", fl->fname, strerror (errno));
+	      fl->failed = 1;
+	    }
+	  continue;
+	}
+
+      nr = read (in, buf, n < bufsize ? n : bufsize);
+      if (nr < 0 && errno == EINTR)
+	{
+	  QUIT;
+	  continue;
+	}
+      else if (nr < 0)
+	builtin_error ("read error: %s", strerror (errno));
+      if (nr <= 0)
+	return -1;
+      tee_write (fl, buf, nr);
+      n -= nr;
+    }
+  return 0;
+}
+
+/* Copy the standard input, which must be a pipe, to every file in FLIST
+   without reading it into user space.  Returns -1 without consuming any
+   input if that's not possible. */
+static int
+tee_splice (flist)
+     FLIST *flist;
+{
+  FLIST *fl, *last;
+  struct stat sb;
+  char *buf;
+  size_t bufsize, got;
+  ssize_t n, t;
+  int psize, rval, short_tee;
+
+  if (fstat (0, &sb) < 0 || S_ISFIFO (sb.st_mode) == 0)
+    return -1;
+  if ((psize = fcntl (0, F_GETPIPE_SZ)) <= 0)
+    return -1;
+
+  /* Every output but the last gets a pipe as large as the input's, so a
+     tee of whatever the input holds always fits */
+  for (last = flist; last->next; last = last->next)
+    ;
+  for (fl = flist; fl; fl = fl->next)
+    {
+      fl->pfd[0] = fl->pfd[1] = -1;
+      fl->nosplice = fl->failed = 0;
+      fl->owed = 0;
+    }
+  for (fl = flist; fl != last; fl = fl->next)
+    {
+      if (pipe (fl->pfd) < 0)
+	break;
+      if (fcntl (fl->pfd[1], F_SETPIPE_SZ, psize) < psize)
+	break;
+    }
+
+  rval = -1;
+  if (fl != last)
+    goto done;
+
+  bufsize = (psize > TEE_BUFSIZE) ? psize : TEE_BUFSIZE;
+  buf = xmalloc (bufsize);
+  rval = EXECUTION_SUCCESS;
+
+  for (;;)
+    {
+      QUIT;
+
+      if (flist == last)
+	{
+	  /* Only one output: move whatever arrives */
+	  if (tee_move (0, last, bufsize, buf, bufsize) < 0)
+	    break;
+	  continue;
+	}
+
+      /* Wait for input and find out how much there is */
+      t = tee (0, flist->pfd[1], bufsize, 0);
+      if (t < 0 && errno == EINTR)
+	continue;
+      else if (t < 0)
+	{
+	  builtin_error ("read error: %s", strerror (errno));
+	  rval = EXECUTION_FAILURE;
+	  break;
+	}
+      else if (t == 0)
+	break;
+
+      short_tee = 0;
+      for (fl = flist; fl != last; fl = fl->next)
+	{
+	  if (fl == flist)
+	    got = t;
+	  else
+	    {
+	      while ((n = tee (0, fl->pfd[1], t, 0)) < 0 && errno == EINTR)
+		QUIT;
+	      got = (n > 0) ? n : 0;
+	    }
+	  /* tee always starts at the front of the input, so whatever it
+	     missed has to go through the buffer below */
+	  if ((fl->owed = t - got) > 0)
+	    short_tee = 1;
+	  tee_move (fl->pfd[0], fl, got, buf, bufsize);
+	}
+
+      if (short_tee == 0)
+	{
+	  if (tee_move (0, last, t, buf, bufsize) < 0)
+	    break;
+	  continue;
+	}
+
+      /* Consume the chunk and finish the outputs the tee shortchanged */
+      for (got = 0; got < t; got += n)
+	if ((n = read (0, buf + got, t - got)) < 0 && errno == EINTR)
+	  n = 0;
+	else if (n <= 0)
+	  break;
+      for (fl = flist; fl != last; fl = fl->next)
+	if (fl->owed)
+	  tee_write (fl, buf + t - fl->owed, fl->owed);
+      tee_write (last, buf, got);
+      if (got < t)
+	break;
+    }
+
+  for (fl = flist; fl; fl = fl->next)
+    if (fl->failed)
+      rval = EXECUTION_FAILURE;
+  free (buf);
+
+done:
+  for (fl = flist; fl; fl = fl->next)
+    {
+      if (fl->pfd[0] >= 0)
+	close (fl->pfd[0]);
+      if (fl->pfd[1] >= 0)
+	close (fl->pfd[1]);
+    }
+  return rval;
+}
+#endif
+
 int
 tee_builtin (list)
      WORD_LIST *list;
@@ -124,6 +350,15 @@ tee_builtin (list)
       QUIT;
     }
 
+#if defined (TEE_SPLICE)
+  if ((n = tee_splice (tee_flist)) >= 0)
+    {
+      if (n != EXECUTION_SUCCESS)
+	rval = n;
+      nr = 0;
+    }
+  else
+#endif
   while ((nr = read(0, buf, TEE_BUFSIZE)) > 0)
     for (fl = tee_flist; fl; fl = fl->next)
       {
@@ -170,6 +405,10 @@ char *tee_doc[] = {
 	"filename argument.  If the `-a' option is given, the specified",
 	"files are appended to, otherwise they are overwritten.  If the",
 	"`-i' option is supplied, tee ignores interrupts.",
+	"",
+	"When standard input is a pipe, the data is duplicated with tee(2)",
+	"and splice(2) where the system supports them, without being copied",
+	"into the shell.",
 	(char *)NULL
 };
 
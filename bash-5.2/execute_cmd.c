@@ -76,11 +76,11 @@ extern int errno;
 #include "redir.h"
 #include "trap.h"
 #include "pathexp.h"
+#include "patmatch.h"
 #include "hashcmd.h"
+#include "probes.h"
 
-#if defined (COND_COMMAND)
-#  include "test.h"
-#endif
+#include "test.h"
 
 #include "builtins/common.h"
 #include "builtins/builtext.h"	/* list of builtins */
@@ -121,7 +121,15 @@ extern int close PARAMS((int));
 /* Static functions defined and used in this file. */
 static void close_pipes PARAMS((int, int));
 static void do_piping PARAMS((int, int));
+#if defined (HAVE_POSIX_SPAWN) && defined (JOB_CONTROL)
+static int spawn_literal_filename PARAMS((WORD_DESC *));
+static int spawn_file_actions PARAMS((posix_spawn_file_actions_t *, REDIRECT *, int, int, struct fd_bitmap *));
+#endif
 static void bind_lastarg PARAMS((char *));
+static int quiet_redirects PARAMS((REDIRECT *));
+static int quiet_simple_command PARAMS((SIMPLE_COM *));
+static int quiet_command PARAMS((COMMAND *));
+static int execute_subshell_in_process PARAMS((COMMAND *, struct fd_bitmap *));
 static int shell_control_structure PARAMS((enum command_type));
 static void cleanup_redirects PARAMS((REDIRECT *));
 
@@ -168,6 +176,9 @@ static void fix_assignment_words PARAMS((WORD_LIST *));
 static void fix_arrayref_words PARAMS((WORD_LIST *));
 static int execute_simple_command PARAMS((SIMPLE_COM *, int, int, int, struct fd_bitmap *));
 static int execute_builtin PARAMS((sh_builtin_func_t *, WORD_LIST *, int, int));
+static int find_function_body PARAMS((COMMAND *));
+static void hold_function_body PARAMS((COMMAND *));
+static void release_function_body PARAMS((COMMAND *));
 static int execute_function PARAMS((SHELL_VAR *, WORD_LIST *, int, struct fd_bitmap *, int, int));
 static int execute_builtin_or_function PARAMS((WORD_LIST *, sh_builtin_func_t *,
 					    SHELL_VAR *,
@@ -183,7 +194,6 @@ static int execute_disk_command PARAMS((WORD_LIST *, REDIRECT *, char *,
 
 static char *getinterp PARAMS((char *, int, int *));
 static void initialize_subshell PARAMS((void));
-static int execute_in_subshell PARAMS((COMMAND *, int, int, int, struct fd_bitmap *));
 #if defined (COPROCESS_SUPPORT)
 static void coproc_setstatus PARAMS((struct coproc *, int));
 static int execute_coproc PARAMS((COMMAND *, int, int, struct fd_bitmap *));
@@ -195,6 +205,10 @@ static int execute_connection PARAMS((COMMAND *, int, int, int, struct fd_bitmap
 
 static int execute_intern_function PARAMS((WORD_DESC *, FUNCTION_DEF *));
 
+#if defined (ANBS_AI_ENABLED) || HAVE_PROBES
+static const char *profile_command_name PARAMS((SIMPLE_COM *));
+#endif
+
 /* Set to 1 if fd 0 was the subject of redirection to a subshell.  Global
    so that reader_loop can set it to zero before executing a command. */
 int stdin_redir;
@@ -245,6 +259,10 @@ int executing_list = 0;
    commands run in command substitutions by parse_and_execute. */
 int comsub_ignore_return = 0;
 
+/* Non-zero while a simple command's words are being expanded.  The heap
+   profiler reports allocations made then as expansion. */
+int expanding_command_words = 0;
+
 /* Non-zero if we have just forked and are currently running in a subshell
    environment. */
 int subshell_environment;
@@ -578,6 +596,7 @@ execute_command_internal (command, asynchronous, pipe_in, pipe_out,
      struct fd_bitmap *fds_to_close;
 {
   int exec_result, user_subshell, invert, ignore_return, was_error_trap, fork_flags;
+  int profile_depth, wait_depth;
   REDIRECT *my_undo_list, *exec_undo_list;
   char *tcmd;
   volatile int save_line_number;
@@ -594,7 +613,7 @@ execute_command_internal (command, asynchronous, pipe_in, pipe_out,
     return (EXECUTION_SUCCESS);
 
   QUIT;
-  run_pending_traps ();
+  RUN_PENDING_TRAPS;
 
 #if 0
   if (running_trap == 0)
@@ -624,6 +643,14 @@ execute_command_internal (command, asynchronous, pipe_in, pipe_out,
 
   user_subshell = command->type == cm_subshell || ((command->flags & CMD_WANT_SUBSHELL) != 0);
 
+  /* A ( ... ) subshell that can't change the shell's state doesn't need a
+     child process to keep its changes out of this one. */
+  if (command->type == cm_subshell && asynchronous == 0 &&
+      pipe_in == NO_PIPE && pipe_out == NO_PIPE &&
+      (command->flags & (CMD_WANT_SUBSHELL|CMD_FORCE_SUBSHELL|CMD_TIME_PIPELINE|CMD_TIME_POSIX)) == 0 &&
+      quiet_command (command))
+    return (execute_subshell_in_process (command, fds_to_close));
+
 #if defined (TIME_BEFORE_SUBSHELL)
   if ((command->flags & CMD_TIME_PIPELINE) && user_subshell && asynchronous == 0)
     {
@@ -862,6 +889,10 @@ execute_command_internal (command, asynchronous, pipe_in, pipe_out,
 	  command->value.Simple->flags |= CMD_STDIN_REDIR;
 
 	SET_LINE_NUMBER (command->value.Simple->line);
+	profile_depth = PROFILE_ENTER (profile_command_name (command->value.Simple), line_number);
+#if HAVE_PROBES
+	PROBE2 (bash, command__start, profile_command_name (command->value.Simple), line_number);
+#endif
 	exec_result =
 	  execute_simple_command (command->value.Simple, pipe_in, pipe_out,
 				  asynchronous, fds_to_close);
@@ -908,8 +939,15 @@ execute_command_internal (command, asynchronous, pipe_in, pipe_out,
 	       the function to be waited for twice.  This also causes
 	       subshells forked to execute builtin commands (e.g., in
 	       pipelines) to be waited for twice. */
-	      exec_result = wait_for (last_made_pid, 0);
+	      {
+		wait_depth = PROFILE_ENTER ("[wait]", 0);
+		exec_result = wait_for (last_made_pid, 0);
+		PROFILE_LEAVE (wait_depth);
+	      }
 	  }
+
+	PROFILE_LEAVE (profile_depth);
+	PROBE1 (bash, command__done, exec_result);
       }
 
       /* 2009/02/13 -- pipeline failure is processed elsewhere.  This handles
@@ -1146,7 +1184,7 @@ execute_command_internal (command, asynchronous, pipe_in, pipe_out,
 #endif
 
   last_command_exit_value = exec_result;
-  run_pending_traps ();
+  RUN_PENDING_TRAPS;
   currently_executing_command = (COMMAND *)NULL;
 
   return (last_command_exit_value);
@@ -1473,7 +1511,7 @@ time_command (command, asynchronous, pipe_in, pipe_out, fds_to_close)
 /* Execute a command that's supposed to be in a subshell.  This must be
    called after make_child and we must be running in the child process.
    The caller will return or exit() immediately with the value this returns. */
-static int
+int
 execute_in_subshell (command, asynchronous, pipe_in, pipe_out, fds_to_close)
      COMMAND *command;
      int asynchronous;
@@ -1740,6 +1778,260 @@ execute_in_subshell (command, asynchronous, pipe_in, pipe_out, fds_to_close)
   /* NOTREACHED */
 }
 
+/* Return non-zero if performing REDIRECTS can't change the shell's state:
+   files named by words that expand quietly, fd duplication and closing,
+   but not here-documents or {var}>file. */
+static int
+quiet_redirects (redirects)
+     REDIRECT *redirects;
+{
+  REDIRECT *r;
+
+  for (r = redirects; r; r = r->next)
+    {
+      if (r->rflags & REDIR_VARASSIGN)
+	return 0;
+
+      switch (r->instruction)
+	{
+	case r_output_direction:
+	case r_appending_to:
+	case r_input_direction:
+	case r_inputa_direction:
+	case r_input_output:
+	case r_output_force:
+	case r_err_and_out:
+	case r_append_err_and_out:
+	case r_reading_string:
+	  if (r->redirectee.filename == 0 || expansion_is_quiet (r->redirectee.filename->word) == 0)
+	    return 0;
+	  break;
+
+	case r_duplicating_input:
+	case r_duplicating_output:
+	case r_close_this:
+	  break;
+
+	default:
+	  return 0;
+	}
+    }
+  return 1;
+}
+
+/* Return non-zero if the expansions in word S all sit inside double
+   quotes and none of them is $@, so S expands to exactly one word. */
+static int
+expands_to_one_word (s)
+     const char *s;
+{
+  int dquoted;
+
+  for (dquoted = 0; *s; s++)
+    {
+      if (*s == '\\' && s[1])
+	s++;
+      else if (*s == '"')
+	dquoted = !dquoted;
+      else if (*s == '\'' && dquoted == 0)
+	{
+	  s = strchr (s + 1, '\'');
+	  if (s == 0)
+	    return 0;
+	}
+      else if (*s == '$')
+	{
+	  if (dquoted == 0 || s[1] == '@' || (s[1] == '{' && s[2] == '@'))
+	    return 0;
+	}
+    }
+  return 1;
+}
+
+/* Return non-zero if running test or [ with the operands in LIST can't
+   change the shell's state.  -v and -R evaluate array subscripts, which
+   can assign, so they can't appear at all.  Since an expansion could
+   turn into one of them, operands that expand are only allowed where
+   test can't take them as an operator: a lone operand, the operand of a
+   literal unary operator, or either side of a literal binary one. */
+static int
+quiet_test_operands (name, list)
+     char *name;
+     WORD_LIST *list;
+{
+  WORD_LIST *w;
+  char *ops[3];
+  int n, expanded;
+
+  for (w = list, n = expanded = 0; w; w = w->next)
+    {
+      if (name[0] == '[' && w->next == 0 && STREQ (w->word->word, "]"))
+	break;
+      if (STREQ (w->word->word, "-v") || STREQ (w->word->word, "-R") ||
+	  strchr (w->word->word, '['))
+	return 0;
+      if (strpbrk (w->word->word, "$`"))
+	{
+	  if (expands_to_one_word (w->word->word) == 0)
+	    return 0;
+	  expanded = 1;
+	}
+      if (n < 3)
+	ops[n] = w->word->word;
+      n++;
+    }
+
+  if (expanded == 0 || n == 1)
+    return 1;
+  if (n == 2)
+    return (strpbrk (ops[0], "$`") == 0);
+  if (n == 3 && strpbrk (ops[1], "$`") == 0)
+    return (test_binop (ops[1]) || STREQ (ops[1], "-a") || STREQ (ops[1], "-o"));
+  return 0;
+}
+
+/* Return non-zero if SIMPLE runs one of the builtins that only read the
+   shell's state -- echo, printf without -v, test, [, true, false and : --
+   with words that expand quietly.  Functions and builtins loaded or
+   disabled with `enable' don't count. */
+static int
+quiet_simple_command (simple)
+     SIMPLE_COM *simple;
+{
+  sh_builtin_func_t *builtin;
+  WORD_LIST *w;
+  char *name;
+
+  if (simple->words == 0 || (simple->words->word->flags & W_ASSIGNMENT) ||
+      quiet_redirects (simple->redirects) == 0)
+    return 0;
+
+  name = simple->words->word->word;
+  builtin = find_shell_builtin (name);
+  if (builtin == 0 || find_function (name))
+    return 0;
+  if (builtin == test_builtin && (STREQ (name, "test") || STREQ (name, "[")))
+    {
+      if (quiet_test_operands (name, simple->words->next) == 0)
+	return 0;
+    }
+  else if ((builtin == echo_builtin && STREQ (name, "echo")) ||
+	   (builtin == colon_builtin && (STREQ (name, ":") || STREQ (name, "true"))) ||
+	   (builtin == false_builtin && STREQ (name, "false")))
+    ;
+  else if (builtin == printf_builtin && STREQ (name, "printf"))
+    {
+      /* printf -v would assign; the option can't come from an expansion */
+      w = simple->words->next;
+      if (w && (w->word->word[0] == '-' || strpbrk (w->word->word, "$`")))
+	return 0;
+    }
+  else
+    return 0;
+
+  for (w = simple->words->next; w; w = w->next)
+    if (expansion_is_quiet (w->word->word) == 0)
+      return 0;
+
+  return 1;
+}
+
+/* Return non-zero if running COMMAND in this shell can't change its state,
+   so a ( ... ) subshell of it doesn't need to fork:  quiet simple commands
+   joined by `;', `&&' and `||', possibly in groups, subshells and if
+   statements.  Options and traps that would let one of those commands
+   exit the shell, or behave differently in a subshell, rule it out. */
+static int
+quiet_command (command)
+     COMMAND *command;
+{
+  if (command == 0)
+    return 1;
+
+  if ((command->flags & (CMD_TIME_PIPELINE|CMD_TIME_POSIX)) ||
+      quiet_redirects (command->redirects) == 0)
+    return 0;
+
+  switch (command->type)
+    {
+    case cm_simple:
+      return (quiet_simple_command (command->value.Simple));
+
+    case cm_connection:
+      if (command->value.Connection->connector != ';' &&
+	  command->value.Connection->connector != AND_AND &&
+	  command->value.Connection->connector != OR_OR)
+	return 0;
+      return (quiet_command (command->value.Connection->first) &&
+	      quiet_command (command->value.Connection->second));
+
+    case cm_group:
+      return (quiet_command (command->value.Group->command));
+
+    case cm_subshell:
+      /* Checked once, for the outermost subshell */
+      if (exit_immediately_on_error || echo_command_at_execute ||
+	  unbound_vars_is_error || place_keywords_in_env || posixly_correct ||
+	  signal_is_trapped (DEBUG_TRAP) || signal_is_trapped (ERROR_TRAP) ||
+	  signal_is_trapped (RETURN_TRAP))
+	return 0;
+      return (quiet_command (command->value.Subshell->command));
+
+    case cm_if:
+      return (quiet_command (command->value.If->test) &&
+	      quiet_command (command->value.If->true_case) &&
+	      quiet_command (command->value.If->false_case));
+
+    default:
+      return 0;
+    }
+}
+
+/* Run the ( ... ) subshell COMMAND, which quiet_command accepted, in this
+   shell the way a { ...; } group with the same body and redirections
+   would run.  The only state its commands can change is $_, LINENO and
+   BASH_COMMAND; put those back as they'd be after waiting for a child. */
+static int
+execute_subshell_in_process (command, fds_to_close)
+     COMMAND *command;
+     struct fd_bitmap *fds_to_close;
+{
+  COMMAND group;
+  GROUP_COM group_com;
+  char *lastarg, *printed;
+  int save_line_number, result;
+
+  group_com.ignore = 0;
+  group_com.command = command->value.Subshell->command;
+  group = *command;
+  group.type = cm_group;
+  group.value.Group = &group_com;
+
+  lastarg = get_string_value ("_");
+  lastarg = lastarg ? savestring (lastarg) : (char *)NULL;
+  printed = the_printed_command_except_trap ? savestring (the_printed_command_except_trap) : (char *)NULL;
+  save_line_number = line_number;
+
+  begin_unwind_frame ("subshell-in-process");
+  add_unwind_protect (xfree, lastarg);
+  add_unwind_protect (xfree, printed);
+  unwind_protect_int (line_number);
+
+  SET_LINE_NUMBER (command->value.Subshell->line);
+
+  result = execute_command_internal (&group, 0, NO_PIPE, NO_PIPE, fds_to_close);
+
+  discard_unwind_frame ("subshell-in-process");
+
+  line_number = save_line_number;
+  bind_lastarg (lastarg);
+  FREE (lastarg);
+  FREE (the_printed_command_except_trap);
+  the_printed_command_except_trap = printed;
+
+  return (result);
+}
+
 #if defined (COPROCESS_SUPPORT)
 #define COPROC_MAX	16
 
@@ -2102,6 +2394,7 @@ coproc_close (cp)
 {
   if (cp->c_rfd >= 0)
     {
+      zradiscard (cp->c_rfd);
       close (cp->c_rfd);
       cp->c_rfd = -1;
     }
@@ -2144,6 +2437,7 @@ coproc_rclose (cp, fd)
 {
   if (cp->c_rfd >= 0 && cp->c_rfd == fd)
     {
+      zradiscard (cp->c_rfd);
       close (cp->c_rfd);
       cp->c_rfd = -1;
     }
@@ -2170,7 +2464,10 @@ coproc_checkfd (cp, fd)
 
   update = 0;
   if (cp->c_rfd >= 0 && cp->c_rfd == fd)
-    update = cp->c_rfd = -1;
+    {
+      zradiscard (fd);
+      update = cp->c_rfd = -1;
+    }
   if (cp->c_wfd >= 0 && cp->c_wfd == fd)
     update = cp->c_wfd = -1;
   if (update)
@@ -2250,6 +2547,31 @@ coproc_pidchk (pid, status)
     coproc_setstatus (cp, status);
 }
 
+/* Non-zero if `read' and `mapfile' may read ahead on FD: it is the read
+   end of a coprocess and BASH_COPROC_READAHEAD is set.  Only the shell
+   reads that end, so input past a line can wait for the next read. */
+int coproc_readahead = 0;
+
+int
+coproc_readahead_fd (fd)
+     int fd;
+{
+#if MULTIPLE_COPROCS
+  struct cpelement *cpe;
+#endif
+
+  if (coproc_readahead == 0 || fd < 0)
+    return 0;
+#if MULTIPLE_COPROCS
+  for (cpe = coproc_list.head; cpe; cpe = cpe->next)
+    if (cpe->coproc->c_rfd == fd)
+      return 1;
+  return 0;
+#else
+  return (sh_coproc.c_rfd == fd);
+#endif
+}
+
 pid_t
 coproc_active ()
 {
@@ -2414,6 +2736,8 @@ execute_coproc (command, pipe_in, pipe_out, fds_to_close)
 
   sh_openpipe ((int *)&rpipe);	/* 0 = parent read, 1 = child write */
   sh_openpipe ((int *)&wpipe); /* 0 = child read, 1 = parent write */
+  sh_sizepipe (rpipe);
+  sh_sizepipe (wpipe);
 
   BLOCK_SIGNAL (SIGCHLD, set, oset);
 
@@ -2443,6 +2767,7 @@ execute_coproc (command, pipe_in, pipe_out, fds_to_close)
   cp = coproc_alloc (command->value.Coproc->name, coproc_pid);
   cp->c_rfd = rpipe[0];
   cp->c_wfd = wpipe[1];
+  zradiscard (cp->c_rfd);	/* in case the descriptor was reused */
 
   cp->c_flags |= COPROC_RUNNING;
 
@@ -3620,7 +3945,9 @@ execute_case_command (case_command)
 	  /* Since the pattern does not undergo quote removal (as per
 	     Posix.2, section 3.9.4.3), the strmatch () call must be able
 	     to recognize backslashes as escape characters. */
-	  match = strmatch (pattern, word, FNMATCH_EXTFLAG|FNMATCH_IGNCASE) != FNM_NOMATCH;
+	  match = patmatch_full (word, pattern);
+	  if (match < 0)
+	    match = strmatch (pattern, word, FNMATCH_EXTFLAG|FNMATCH_IGNCASE) != FNM_NOMATCH;
 	  free (pattern);
 
 	  dispose_words (es);
@@ -4348,6 +4675,24 @@ is_dirname (pathname)
   return ret;
 }
 
+#if defined (ANBS_AI_ENABLED) || HAVE_PROBES
+/* The profiler's name for SIMPLE: its command word as written, before
+   expansion, or what it does when it has none.  The command__start
+   probe passes it too. */
+static const char *
+profile_command_name (simple)
+     SIMPLE_COM *simple;
+{
+  WORD_LIST *w;
+
+  for (w = simple->words; w && (w->word->flags & W_ASSIGNMENT); w = w->next)
+    ;
+  if (w)
+    return (w->word->word);
+  return (simple->words ? "[assign]" : "[redirect]");
+}
+#endif
+
 /* The meaty part of all the executions.  We have to start hacking the
    real execution of commands here.  Fork a process, set things up,
    execute the command. */
@@ -4360,7 +4705,7 @@ execute_simple_command (simple_command, pipe_in, pipe_out, async, fds_to_close)
   WORD_LIST *words, *lastword;
   char *command_line, *lastarg, *temp;
   int first_word_quoted, result, builtin_is_special, already_forked, dofork;
-  int fork_flags, cmdflags;
+  int fork_flags, cmdflags, profile_depth;
   pid_t old_last_async_pid;
   sh_builtin_func_t *builtin;
   SHELL_VAR *func;
@@ -4503,7 +4848,11 @@ execute_simple_command (simple_command, pipe_in, pipe_out, async, fds_to_close)
       /* Pass the ignore return flag down to command substitutions */
       if (cmdflags & CMD_IGNORE_RETURN)	/* XXX */
 	comsub_ignore_return++;
+      profile_depth = PROFILE_ENTER ("[expand]", 0);
+      expanding_command_words++;
       words = expand_words (simple_command->words);
+      expanding_command_words--;
+      PROFILE_LEAVE (profile_depth);
       if (cmdflags & CMD_IGNORE_RETURN)
 	comsub_ignore_return--;
       current_fds_to_close = (struct fd_bitmap *)NULL;
@@ -5007,6 +5356,80 @@ maybe_restore_getopt_state (gs)
     free (gs);
 }
 
+/* Shell functions run their bodies in place rather than a copy whenever
+   running them can't change the body for later calls.  A body in use is
+   recorded here with the number of calls running it, so one redefined or
+   unset meanwhile is disposed of only when the last of them returns. */
+struct func_body {
+  COMMAND *command;
+  int refs;
+  int unbound;
+};
+
+static struct func_body *func_bodies;
+static int nfunc_bodies, func_bodies_size;
+
+static int
+find_function_body (command)
+     COMMAND *command;
+{
+  register int i;
+
+  for (i = nfunc_bodies - 1; i >= 0; i--)
+    if (func_bodies[i].command == command)
+      return i;
+  return -1;
+}
+
+static void
+hold_function_body (command)
+     COMMAND *command;
+{
+  int i;
+
+  if ((i = find_function_body (command)) >= 0)
+    {
+      func_bodies[i].refs++;
+      return;
+    }
+  if (nfunc_bodies >= func_bodies_size)
+    {
+      func_bodies_size += 16;
+      func_bodies = (struct func_body *)xrealloc (func_bodies, func_bodies_size * sizeof (struct func_body));
+    }
+  func_bodies[nfunc_bodies].command = command;
+  func_bodies[nfunc_bodies].refs = 1;
+  func_bodies[nfunc_bodies].unbound = 0;
+  nfunc_bodies++;
+}
+
+static void
+release_function_body (command)
+     COMMAND *command;
+{
+  int i;
+
+  if ((i = find_function_body (command)) < 0 || --func_bodies[i].refs > 0)
+    return;
+  if (func_bodies[i].unbound)
+    dispose_command (command);
+  func_bodies[i] = func_bodies[--nfunc_bodies];
+}
+
+/* Called instead of dispose_command when a function's value is replaced
+   or the function is unset */
+void
+dispose_function_body (command)
+     COMMAND *command;
+{
+  int i;
+
+  if ((i = find_function_body (command)) >= 0)
+    func_bodies[i].unbound = 1;
+  else
+    dispose_command (command);
+}
+
 #if defined (ARRAY_VARS)
 void
 restore_funcarray_state (fa)
@@ -5034,7 +5457,7 @@ execute_function (var, words, flags, fds_to_close, async, subshell)
      struct fd_bitmap *fds_to_close;
      int async, subshell;
 {
-  int return_val, result, lineno;
+  int return_val, result, lineno, profile_depth, shared;
   COMMAND *tc, *fc, *save_current;
   char *debug_trap, *error_trap, *return_trap;
 #if defined (ARRAY_VARS)
@@ -5064,7 +5487,20 @@ execute_function (var, words, flags, fds_to_close, async, subshell)
   GET_ARRAY_FROM_VAR ("BASH_LINENO", bash_lineno_v, bash_lineno_a);
 #endif
 
-  tc = (COMMAND *)copy_command (function_cell (var));
+  /* Executing a command leaves flags on it that depend only on the command
+     itself, except that a caller ignoring the return status marks every
+     command in the body, and the command substitution optimization below
+     marks the last one.  Calls like that get a copy of the body; the rest
+     share it. */
+  shared = (flags & CMD_IGNORE_RETURN) == 0 &&
+	   ((flags & CMD_NO_FORK) == 0 || (subshell_environment & SUBSHELL_COMSUB) == 0);
+  if (shared)
+    {
+      tc = function_cell (var);
+      hold_function_body (tc);
+    }
+  else
+    tc = (COMMAND *)copy_command (function_cell (var));
   if (tc && (flags & CMD_IGNORE_RETURN))
     tc->flags |= CMD_IGNORE_RETURN;
 
@@ -5094,7 +5530,10 @@ execute_function (var, words, flags, fds_to_close, async, subshell)
       unwind_protect_int (function_line_number);
       unwind_protect_int (return_catch_flag);
       unwind_protect_jmp_buf (return_catch);
-      add_unwind_protect (dispose_command, (char *)tc);
+      if (shared)
+	add_unwind_protect (release_function_body, (char *)tc);
+      else
+	add_unwind_protect (dispose_command, (char *)tc);
       unwind_protect_pointer (this_shell_function);
       unwind_protect_int (funcnest);
       unwind_protect_int (loop_level);
@@ -5213,6 +5652,19 @@ execute_function (var, words, flags, fds_to_close, async, subshell)
 
   from_return_trap = 0;
 
+  /* Set before the setjmp, so still valid after a `return' */
+  profile_depth = -1;
+#if defined (ANBS_AI_ENABLED)
+  if (anbs_profiling)
+    {
+      char label[80];
+
+      snprintf (label, sizeof (label), "%.64s()", var->name);
+      profile_depth = anbs_profile_enter (label, 0);
+    }
+#endif
+  PROBE2 (bash, function__entry, var->name, funcnest);
+
   return_catch_flag++;
   return_val = setjmp_nosigs (return_catch);
 
@@ -5256,6 +5708,9 @@ execute_function (var, words, flags, fds_to_close, async, subshell)
       showing_function_line = 0;
     }
 
+  PROFILE_LEAVE (profile_depth);
+  PROBE2 (bash, function__return, result, funcnest);
+
   /* If we have a local copy of OPTIND, note it in the saved getopts state. */
   gv = find_variable ("OPTIND");
   if (gv && gv->context == variable_context)
@@ -5575,6 +6030,10 @@ setup_async_signals ()
    don't handle it, since that would require them to go through
    this gnarly hair, for no good reason.
 
+   Where posix_spawn is available and the shell isn't managing jobs, a
+   foreground command whose redirections are all literal is started with
+   posix_spawn instead, and steps 1-5 happen in the spawned child.
+
    NOTE: callers expect this to fork or exit(). */
 
 /* Name of a shell function to call when a command name is not found. */
@@ -5593,7 +6052,7 @@ execute_disk_command (words, redirects, command_line, pipe_in, pipe_out,
      int cmdflags;
 {
   char *pathname, *command, **args, *p;
-  int nofork, stdpath, result, fork_flags;
+  int nofork, stdpath, result, fork_flags, profile_depth;
   pid_t pid;
   SHELL_VAR *hookf;
   WORD_LIST *wl;
@@ -5648,8 +6107,44 @@ execute_disk_command (words, redirects, command_line, pipe_in, pipe_out,
     pid = 0;
   else
     {
+#if defined (HAVE_POSIX_SPAWN) && defined (JOB_CONTROL)
+      /* A foreground command in a script, with nothing for the child to do
+	 but rearrange descriptors and exec, doesn't need a copy of the
+	 shell.  Anything make_child_spawn or spawn_file_actions can't
+	 handle falls through to fork, which also reports the errors. */
+      if (command && async == 0 && job_control == 0 && interactive_shell == 0 &&
+#  if defined (RESTRICTED_SHELL)
+	  restricted == 0 &&
+#  endif
+	  (subshell_environment & SUBSHELL_ASYNC) == 0)
+	{
+	  posix_spawn_file_actions_t actions;
+
+	  pid = -1;
+	  if (posix_spawn_file_actions_init (&actions) == 0)
+	    {
+	      if (spawn_file_actions (&actions, redirects, pipe_in, pipe_out, fds_to_close) == 0)
+		{
+		  args = strvec_from_word_list (words, 0, 0, (int *)NULL);
+		  p = savestring (command_line);
+		  profile_depth = PROFILE_ENTER ("[spawn]", 0);
+		  pid = make_child_spawn (p, command, args, export_env, &actions);
+		  PROFILE_LEAVE (profile_depth);
+		  free (args);		/* the words still own the strings */
+		  if (pid < 0)
+		    FREE (p);
+		  p = 0;
+		}
+	      posix_spawn_file_actions_destroy (&actions);
+	    }
+	  if (pid > 0)
+	    goto parent_return;
+	}
+#endif
       fork_flags = async ? FORK_ASYNC : 0;
+      profile_depth = PROFILE_ENTER ("[fork]", 0);
       pid = make_child (p = savestring (command_line), fork_flags);
+      PROFILE_LEAVE (profile_depth);
     }
 
   if (pid == 0)
@@ -5687,6 +6182,11 @@ execute_disk_command (words, redirects, command_line, pipe_in, pipe_out,
 
       do_piping (pipe_in, pipe_out);
 
+#if defined (ANBS_AI_ENABLED)
+      /* Before the command's own redirections, which still win. */
+      anbs_pty_attach_child ();
+#endif
+
       old_interactive = interactive;
       if (async)
 	interactive = 0;
@@ -5903,7 +6403,10 @@ initialize_subshell ()
      testing with sh and ksh).  Just throw it away; don't worry about a
      memory leak. */
   if (vc_isbltnenv (shell_variables))
-    shell_variables = shell_variables->down;
+    {
+      shell_variables = shell_variables->down;
+      VARIABLES_CHANGED ();
+    }
 
   clear_unwind_protect_list (0);
   /* XXX -- are there other things we should be resetting here? */
@@ -5954,6 +6457,7 @@ shell_execve (command, args, env)
   int sample_len;
 
   SETOSTYPE (0);		/* Some systems use for USG/POSIX semantics */
+  PROBE2 (bash, exec, command, args);
   execve (command, args, env);
   i = errno;			/* error from execve() */
   CHECK_TERMSIG;
@@ -6227,3 +6731,121 @@ do_piping (pipe_in, pipe_out)
 #endif /* __CYGWIN__ */
     }
 }
+
+#if defined (HAVE_POSIX_SPAWN) && defined (JOB_CONTROL)
+/* Return non-zero if the redirection target W expands to itself, so the
+   child can open it without running any expansion first. */
+static int
+spawn_literal_filename (w)
+     WORD_DESC *w;
+{
+  char *s;
+
+  s = w ? w->word : (char *)NULL;
+  if (s == 0 || *s == 0)
+    return 0;
+  /* anything expand_word () could change, including <(...), >(...) and
+     extended glob patterns */
+  if (w->flags & (W_HASDOLLAR|W_QUOTED|W_TILDEEXP|W_HASQUOTEDNULL))
+    return 0;
+  if (strpbrk (s, "$`\\'\"~*?[{(") != 0 || unquoted_glob_pattern_p (s))
+    return 0;
+  /* redir.c emulates these itself */
+  if (STREQN (s, "/dev/fd/", 8) || STREQN (s, "/dev/std", 8) ||
+      STREQN (s, "/dev/tcp/", 9) || STREQN (s, "/dev/udp/", 9))
+    return 0;
+  return 1;
+}
+
+/* Describe what the forked child of execute_disk_command does to its file
+   descriptors -- close FDS_TO_CLOSE, do_piping (), do_redirections () --
+   as posix_spawn file actions.  Returns 0 on success, -1 if any of it
+   needs the shell's help in the child, in which case the caller forks. */
+static int
+spawn_file_actions (actions, redirects, pipe_in, pipe_out, fds_to_close)
+     posix_spawn_file_actions_t *actions;
+     REDIRECT *redirects;
+     int pipe_in, pipe_out;
+     struct fd_bitmap *fds_to_close;
+{
+  REDIRECT *r;
+  int i, fd, e;
+
+  e = 0;
+  if (fds_to_close)
+    {
+      for (i = 0; e == 0 && i < fds_to_close->size; i++)
+	if (fds_to_close->bitmap[i])
+	  e = posix_spawn_file_actions_addclose (actions, i);
+    }
+
+  if (e == 0 && pipe_in != NO_PIPE)
+    {
+      e = posix_spawn_file_actions_adddup2 (actions, pipe_in, 0);
+      if (e == 0 && pipe_in > 0)
+	e = posix_spawn_file_actions_addclose (actions, pipe_in);
+    }
+  if (e == 0 && pipe_out != NO_PIPE)
+    {
+      if (pipe_out != REDIRECT_BOTH)
+	{
+	  e = posix_spawn_file_actions_adddup2 (actions, pipe_out, 1);
+	  if (e == 0 && (pipe_out == 0 || pipe_out > 1))
+	    e = posix_spawn_file_actions_addclose (actions, pipe_out);
+	}
+      else
+	e = posix_spawn_file_actions_adddup2 (actions, 1, 2);
+    }
+
+  for (r = redirects; e == 0 && r; r = r->next)
+    {
+      if (r->rflags & REDIR_VARASSIGN)
+	return -1;
+      fd = r->redirector.dest;
+      if (fd < 0)
+	return -1;
+      /* noclobber's checks and error message are redir.c's */
+      if (noclobber && CLOBBERING_REDIRECT (r->instruction))
+	return -1;
+
+      switch (r->instruction)
+	{
+	case r_output_direction:
+	case r_appending_to:
+	case r_input_direction:
+	case r_inputa_direction:
+	case r_input_output:
+	case r_output_force:
+	  if (spawn_literal_filename (r->redirectee.filename) == 0)
+	    return -1;
+	  e = posix_spawn_file_actions_addopen (actions, fd, r->redirectee.filename->word, r->flags, 0666);
+	  break;
+
+	case r_err_and_out:
+	case r_append_err_and_out:
+	  if (spawn_literal_filename (r->redirectee.filename) == 0)
+	    return -1;
+	  e = posix_spawn_file_actions_addopen (actions, 1, r->redirectee.filename->word, r->flags, 0666);
+	  if (e == 0)
+	    e = posix_spawn_file_actions_adddup2 (actions, 1, 2);
+	  break;
+
+	case r_duplicating_input:
+	case r_duplicating_output:
+	  if (r->redirectee.dest == fd)
+	    break;
+	  e = posix_spawn_file_actions_adddup2 (actions, r->redirectee.dest, fd);
+	  break;
+
+	case r_close_this:
+	  e = posix_spawn_file_actions_addclose (actions, fd);
+	  break;
+
+	default:
+	  return -1;
+	}
+    }
+
+  return (e == 0 ? 0 : -1);
+}
+#endif /* HAVE_POSIX_SPAWN && JOB_CONTROL */
@@ -53,6 +53,7 @@ extern int builtin_ignoring_errexit;
 extern int executing_builtin;
 extern int executing_list;
 extern int comsub_ignore_return;
+extern int expanding_command_words;
 extern int subshell_level;
 extern int match_ignore_case;
 extern int executing_command_builtin;
@@ -75,6 +76,7 @@ extern void close_fd_bitmap PARAMS((struct fd_bitmap *));
 extern int executing_line_number PARAMS((void));
 extern int execute_command PARAMS((COMMAND *));
 extern int execute_command_internal PARAMS((COMMAND *, int, int, int, struct fd_bitmap *));
+extern int execute_in_subshell PARAMS((COMMAND *, int, int, int, struct fd_bitmap *));
 extern int shell_execve PARAMS((char *, char **, char **));
 extern void setup_async_signals PARAMS((void));
 extern void async_redirect_stdin PARAMS((void));
@@ -84,6 +86,7 @@ extern void dispose_partial_redirects PARAMS((void));
 extern void dispose_exec_redirects PARAMS((void));
 
 extern int execute_shell_function PARAMS((SHELL_VAR *, WORD_LIST *));
+extern void dispose_function_body PARAMS((COMMAND *));
 
 extern struct coproc *getcoprocbypid PARAMS((pid_t));
 extern struct coproc *getcoprocbyname PARAMS((const char *));
@@ -96,6 +99,8 @@ extern void coproc_close PARAMS((struct coproc *));
 extern void coproc_closeall PARAMS((void));
 extern void coproc_reap PARAMS((void));
 extern pid_t coproc_active PARAMS((void));
+extern int coproc_readahead;
+extern int coproc_readahead_fd PARAMS((int));
 
 extern void coproc_rclose PARAMS((struct coproc *, int));
 extern void coproc_wclose PARAMS((struct coproc *, int));
@@ -120,4 +125,39 @@ extern void close_all_files PARAMS((void));
 extern void restore_funcarray_state PARAMS((struct func_array_state *));
 #endif
 
+#if defined (ANBS_AI_ENABLED)
+/* The execution profiler turned on by ANBS_PROFILE, in
+   ai_core/performance/profiler.c.  PROFILE_ENTER pushes a frame and
+   returns the depth PROFILE_LEAVE pops back to. */
+extern int anbs_profiling;
+extern int anbs_profile_start PARAMS((const char *, const char *));
+extern void anbs_profile_stop PARAMS((void));
+extern void anbs_profile_run PARAMS((int));
+extern int anbs_profile_enter PARAMS((const char *, int));
+extern void anbs_profile_leave PARAMS((int));
+
+/* The startup profile turned on by --startup-profile or
+   ANBS_STARTUP_PROFILE, in ai_core/performance/startup.c.  STARTUP_ENTER
+   opens a timed span and returns the slot STARTUP_LEAVE closes. */
+extern int anbs_startup_profiling;
+extern void anbs_startup_profile_begin PARAMS((void));
+extern int anbs_startup_enter PARAMS((const char *, const char *));
+extern void anbs_startup_leave PARAMS((int, int));
+extern void anbs_startup_report PARAMS((void));
+
+/* Sends an external command's terminal output to the display's terminal
+   panel, in ai_core/terminal_pty.c. */
+extern void anbs_pty_attach_child PARAMS((void));
+
+#  define PROFILE_ENTER(name, line) (anbs_profiling ? anbs_profile_enter ((name), (line)) : -1)
+#  define PROFILE_LEAVE(depth) do { if ((depth) >= 0) anbs_profile_leave (depth); } while (0)
+#  define STARTUP_ENTER(kind, label) (anbs_startup_profiling ? anbs_startup_enter ((kind), (label)) : -1)
+#  define STARTUP_LEAVE(slot, functions) do { if ((slot) >= 0) anbs_startup_leave ((slot), (functions)); } while (0)
+#else
+#  define PROFILE_ENTER(name, line) (-1)
+#  define PROFILE_LEAVE(depth) ((void)(depth))
+#  define STARTUP_ENTER(kind, label) (-1)
+#  define STARTUP_LEAVE(slot, functions) ((void)(slot), (void)(functions))
+#endif
+
 #endif /* _EXECUTE_CMD_H_ */
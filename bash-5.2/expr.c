@@ -154,19 +154,48 @@ struct lvalue
   intmax_t ind;		/* array index if not -1 */
 };
 
+/* What readtok() found at one offset in an expression, so the next
+   evaluation of the same text can skip the scanning.  Only tokens that
+   don't depend on the tokens before them are remembered. */
+struct exptoken
+{
+  int type;		/* the token, or 0 if not known */
+  int start, end;	/* offsets of the token and of what follows it */
+  int peek;		/* for STR, the token after it */
+  int subscript;	/* for STR, `]' if it's an array reference */
+  int assign;		/* for OP_ASSIGN, the OP */
+  intmax_t val;		/* for NUM, its value */
+};
+
 /* A structure defining a single expression context. */
 typedef struct {
   int curtok, lasttok;
   char *expression, *tp, *lasttp;
+  struct exptoken *tokens;
   intmax_t tokval;
   char *tokstr;
   int noeval;
   struct lvalue lval;
 } EXPR_CONTEXT;
 
+/* Token tables for recently-evaluated expressions, looked up by text.
+   `for ((i = 0; i < n; i++))' evaluates the same three every time
+   around. */
+#define EXPCACHE_SIZE	64
+#define EXPCACHE_MAXLEN	256	/* longer expressions aren't worth it */
+
+struct expcache_entry
+{
+  char *text;
+  struct exptoken *tokens;
+};
+
+static struct expcache_entry expcache[EXPCACHE_SIZE];
+
 static char	*expression;	/* The current expression */
 static char	*tp;		/* token lexical position */
 static char	*lasttp;	/* pointer to last token position */
+static struct exptoken *exptokens;	/* the current expression's tokens */
 static int	curtok;		/* the current token */
 static int	lasttok;	/* the previous token */
 static int	assigntok;	/* the OP in OP= */
@@ -202,6 +231,10 @@ static void	expr_bind_array_element PARAMS((char *, arrayind_t, char *));
 
 static intmax_t subexpr PARAMS((char *));
 
+static int	expcache_busy PARAMS((struct exptoken *));
+static struct exptoken *expcache_lookup PARAMS((char *));
+static int	replaytok PARAMS((void));
+
 static intmax_t	expcomma PARAMS((void));
 static intmax_t expassign PARAMS((void));
 static intmax_t	expcond PARAMS((void));
@@ -271,6 +304,7 @@ pushexp ()
   context = (EXPR_CONTEXT *)xmalloc (sizeof (EXPR_CONTEXT));
 
   context->expression = expression;
+  context->tokens = exptokens;
   SAVETOK(context);
 
   expr_stack[expr_depth++] = context;
@@ -294,6 +328,7 @@ popexp ()
   context = expr_stack[--expr_depth];
 
   expression = context->expression;
+  exptokens = context->tokens;
   RESTORETOK (context);
 
   free (context);
@@ -428,6 +463,7 @@ evalexp (expr, flags, validp)
 
       expr_unwind ();
       expr_depth = 0;	/* XXX - make sure */
+      exptokens = (struct exptoken *)NULL;
 
       /* We copy in case we've called evalexp recursively */
       FASTCOPY (oevalbuf, evalbuf, sizeof (evalbuf));
@@ -461,6 +497,7 @@ subexpr (expr)
     return (0);
 
   pushexp ();
+  exptokens = expcache_lookup (expr);
   expression = savestring (expr);
   tp = expression;
 
@@ -486,6 +523,52 @@ subexpr (expr)
   return val;
 }
 
+/* Is TOKENS in use by an expression we're in the middle of? */
+static int
+expcache_busy (tokens)
+     struct exptoken *tokens;
+{
+  int i;
+
+  if (tokens == exptokens)
+    return 1;
+  for (i = 0; i < expr_depth; i++)
+    if (expr_stack[i]->tokens == tokens)
+      return 1;
+  return 0;
+}
+
+/* Return the token table for EXPR, starting an empty one if we haven't
+   seen it lately.  Returns NULL if EXPR shouldn't be cached. */
+static struct exptoken *
+expcache_lookup (expr)
+     char *expr;
+{
+  struct expcache_entry *ent;
+  unsigned int h;
+  size_t len;
+  char *p;
+
+  for (h = 0, p = expr; *p; p++)
+    h = h * 31 + (unsigned char)*p;
+  len = p - expr;
+  if (len > EXPCACHE_MAXLEN)
+    return ((struct exptoken *)NULL);
+
+  ent = expcache + (h % EXPCACHE_SIZE);
+  if (ent->text && STREQ (ent->text, expr))
+    return ent->tokens;
+  if (ent->text && expcache_busy (ent->tokens))
+    return ((struct exptoken *)NULL);
+
+  FREE (ent->text);
+  FREE (ent->tokens);
+  ent->text = savestring (expr);
+  ent->tokens = (struct exptoken *)xmalloc ((len + 1) * sizeof (struct exptoken));
+  memset (ent->tokens, 0, (len + 1) * sizeof (struct exptoken));
+  return ent->tokens;
+}
+
 static intmax_t
 expcomma ()
 {
@@ -1146,7 +1229,7 @@ expr_streval (tok, e, lvalue)
   SHELL_VAR *v;
   char *value;
   intmax_t tval;
-  int initial_depth;
+  int initial_depth, i;
 #if defined (ARRAY_VARS)
   arrayind_t ind;
   int tflag, aflag;
@@ -1226,7 +1309,14 @@ expr_streval (tok, e, lvalue)
       return (0);
     }
 
-  tval = (value && *value) ? subexpr (value) : 0;
+  /* Most variables used in arithmetic hold plain decimal numbers, which
+     don't need the whole evaluator */
+  for (i = 0, tval = 0; value && DIGIT (value[i]) && i < 18; i++)
+    tval = tval * 10 + TODIGIT (value[i]);
+  if (value == 0 || *value == 0)
+    tval = 0;
+  else if (value[i] || (value[0] == '0' && i > 1))
+    tval = subexpr (value);
 
   if (lvalue)
     {
@@ -1312,6 +1402,15 @@ readtok ()
   register unsigned char c, c1;
   register int e;
   struct lvalue lval;
+  struct exptoken *t;
+  int peektok, cacheable;
+
+  if (exptokens && tp && replaytok ())
+    return;
+
+  t = exptokens ? exptokens + (tp - expression) : (struct exptoken *)NULL;
+  cacheable = 1;
+  peektok = 0;
 
   /* Skip leading whitespace. */
   cp = tp;
@@ -1336,7 +1435,6 @@ readtok ()
       /* variable names not preceded with a dollar sign are shell variables. */
       char *savecp;
       EXPR_CONTEXT ec;
-      int peektok;
 
       while (legal_variable_char (c))
 	c = *cp++;
@@ -1346,6 +1444,9 @@ readtok ()
 #if defined (ARRAY_VARS)
       if (c == '[')
 	{
+	  /* Where the subscript ends can depend on the variable's type */
+	  if (assoc_expand_once & already_expanded)
+	    cacheable = 0;
 	  e = expr_skipsubscript (tp, cp);		/* XXX - was skipsubscript */
 	  if (cp[e] == ']')
 	    {
@@ -1409,6 +1510,10 @@ readtok ()
   else
     {
       c1 = *cp++;
+      /* Whether ++ and -- are pre- or post-increments, or errors, depends
+	 on what came before */
+      if ((c == '-' || c == '+') && c1 == c)
+	cacheable = 0;
       if ((c == EQ) && (c1 == EQ))
 	c = EQEQ;
       else if ((c == NOT) && (c1 == EQ))
@@ -1510,6 +1615,58 @@ readtok ()
       curtok = c;
     }
   tp = cp;
+
+  if (t && cacheable)
+    {
+      t->type = curtok;
+      t->start = lasttp - expression;
+      t->end = cp - expression;
+      t->peek = peektok;
+      t->subscript = e;
+      t->assign = (curtok == OP_ASSIGN) ? assigntok : 0;
+      t->val = (curtok == NUM) ? tokval : 0;
+    }
+}
+
+/* If we've seen the token at TP in this expression before, do what
+   readtok() did for it without scanning it again.  Returns 1 if so. */
+static int
+replaytok ()
+{
+  struct exptoken *t;
+
+  t = exptokens + (tp - expression);
+  if (t->type == 0 || (t->subscript && (assoc_expand_once & already_expanded)))
+    return 0;
+
+  lasttp = expression + t->start;
+  switch (t->type)
+    {
+    case STR:
+      if (curlval.tokstr && curlval.tokstr == tokstr)
+	init_lvalue (&curlval);
+      FREE (tokstr);
+      tokstr = substring (expression, t->start, t->end);
+      if (lasttok == PREINC || lasttok == PREDEC || t->peek != EQ)
+	{
+	  lastlval = curlval;
+	  tokval = expr_streval (tokstr, t->subscript, &curlval);
+	}
+      else
+	tokval = 0;
+      break;
+    case NUM:
+      tokval = t->val;
+      break;
+    case OP_ASSIGN:
+      assigntok = t->assign;
+      break;
+    }
+
+  lasttok = curtok;
+  curtok = t->type;
+  tp = expression + t->end;
+  return 1;
 }
 
 static void
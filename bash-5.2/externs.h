@@ -131,6 +131,10 @@ extern char *decode_prompt_string PARAMS((char *));
 extern int get_current_prompt_level PARAMS((void));
 extern void set_current_prompt_level PARAMS((int));
 
+#if defined (ANBS_AI_ENABLED) && defined (READLINE)
+extern void prompt_redisplay PARAMS((void));
+#endif
+
 #if defined (HISTORY)
 extern char *history_delimiting_chars PARAMS((const char *));
 #endif
@@ -521,6 +525,7 @@ extern int wcsnwidth PARAMS((const wchar_t *, size_t, int));
 extern void get_new_window_size PARAMS((int, int *, int *));
 
 /* declarations for functions defined in lib/sh/zcatfd.c */
+extern int zcopyfd PARAMS((int, int));
 extern int zcatfd PARAMS((int, int, char *));
 
 /* declarations for functions defined in lib/sh/zgetline.c */
@@ -536,6 +541,12 @@ extern ssize_t zreadintr PARAMS((int, char *, size_t));
 extern ssize_t zreadc PARAMS((int, char *));
 extern ssize_t zreadcintr PARAMS((int, char *));
 extern ssize_t zreadn PARAMS((int, char *, size_t));
+extern ssize_t zreaddelim PARAMS((int, char *, size_t, int));
+extern ssize_t zreadpc PARAMS((int, char *, int));
+extern void zpeekfd PARAMS((int));
+extern ssize_t zreadra PARAMS((int, char *));
+extern size_t zrapending PARAMS((int));
+extern void zradiscard PARAMS((int));
 extern void zreset PARAMS((void));
 extern void zsyncfd PARAMS((int));
 
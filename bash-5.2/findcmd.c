@@ -28,6 +28,9 @@
 #endif
 #include "filecntl.h"
 #include "posixstat.h"
+#include "posixtime.h"
+#include <posixdir.h>
+#include <stat-time.h>
 
 #if defined (HAVE_UNISTD_H)
 #  include <unistd.h>
@@ -57,6 +60,10 @@ static char *find_user_command_internal PARAMS((const char *, int));
 static char *find_user_command_in_path PARAMS((const char *, char *, int, int *));
 static char *find_in_path_element PARAMS((const char *, char *, int, int, struct stat *, int *));
 static char *find_absolute_program PARAMS((const char *, int));
+#if defined (ANBS_AI_ENABLED)
+static int path_cache_enabled PARAMS((void));
+static int path_cache_lacks PARAMS((const char *, const char *));
+#endif
 
 static char *get_next_path_element PARAMS((char *, int *));
 
@@ -497,6 +504,327 @@ user_command_matches (name, flags, state)
   return (match);
 }
 
+#if defined (ANBS_AI_ENABLED)
+/* A cache of the names in each $PATH directory, so that a search can skip
+   directories that don't have the command without a stat(2) in each.
+   It is kept in the file named by ANBS_PATH_CACHE, shared by every shell
+   that names the same file, and is off when that variable is unset.  A
+   directory's listing is trusted while the directory's device, inode and
+   modification time are what they were when it was read, compared at most
+   once a second.  Since the listings can only make a search skip a
+   directory, never find something that isn't there, a search that finds
+   nothing is repeated without them before the command is reported as not
+   found. */
+
+#define PATH_CACHE_MAGIC	"anbs-path-cache 1"
+
+typedef struct path_listing {
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;			/* -1 if changed too recently to trust */
+  long mtime_ns;
+  time_t checked;		/* when mtime was last compared */
+  HASH_TABLE *names;
+} PATH_LISTING;
+
+static HASH_TABLE *path_listings;
+static char *path_cache_file;
+
+/* Non-zero while find_user_command_in_path is using the listings */
+static int path_cache_active;
+
+static void
+path_listing_free (data)
+     PTR_T data;
+{
+  PATH_LISTING *listing;
+
+  listing = (PATH_LISTING *)data;
+  hash_flush (listing->names, (sh_free_func_t *)NULL);
+  hash_dispose (listing->names);
+  free (listing);
+}
+
+static PATH_LISTING *
+path_listing_create (finfo)
+     struct stat *finfo;
+{
+  PATH_LISTING *listing;
+
+  listing = (PATH_LISTING *)xmalloc (sizeof (PATH_LISTING));
+  listing->dev = finfo ? finfo->st_dev : 0;
+  listing->ino = finfo ? finfo->st_ino : 0;
+  listing->mtime = finfo ? finfo->st_mtime : -1;
+  listing->mtime_ns = finfo ? get_stat_mtime_ns (finfo) : 0;
+  listing->checked = 0;
+  listing->names = hash_create (64);
+  return (listing);
+}
+
+/* Replace DIR's listing with LISTING, or drop it if LISTING is NULL. */
+static void
+path_listing_set (dir, listing)
+     const char *dir;
+     PATH_LISTING *listing;
+{
+  BUCKET_CONTENTS *item;
+
+  if (listing == 0)
+    {
+      item = hash_remove (dir, path_listings, 0);
+      if (item)
+	{
+	  path_listing_free (item->data);
+	  free (item->key);
+	  free (item);
+	}
+      return;
+    }
+
+  item = hash_insert (savestring (dir), path_listings, 0);
+  if (item->data)
+    {
+      /* hash_insert kept the existing key */
+      path_listing_free (item->data);
+    }
+  item->data = (PTR_T)listing;
+}
+
+/* Read the names in DIR, whose status is FINFO. */
+static PATH_LISTING *
+path_listing_read (dir, finfo, now)
+     const char *dir;
+     struct stat *finfo;
+     time_t now;
+{
+  PATH_LISTING *listing;
+  DIR *dirp;
+  struct dirent *dp;
+
+  dirp = opendir (dir);
+  if (dirp == 0)
+    return ((PATH_LISTING *)NULL);
+
+  listing = path_listing_create (finfo);
+  /* A change later in the same second would leave the time the same */
+  if (finfo->st_mtime >= now)
+    listing->mtime = -1;
+
+  while (dp = readdir (dirp))
+    {
+      if (mbschr (dp->d_name, '\n'))
+	{
+	  /* The cache file couldn't hold it */
+	  closedir (dirp);
+	  path_listing_free (listing);
+	  return ((PATH_LISTING *)NULL);
+	}
+      hash_insert (savestring (dp->d_name), listing->names, HASH_NOSRCH);
+    }
+
+  closedir (dirp);
+  listing->checked = now;
+  return (listing);
+}
+
+/* Read the listings saved in the cache file.  It is only trusted if this
+   user wrote it. */
+static void
+path_cache_load ()
+{
+  struct stat finfo;
+  char *buf, *line, *next, *dir;
+  PATH_LISTING *listing;
+  unsigned long dev, ino;
+  long mtime, mtime_ns;
+  int fd, count, n;
+  ssize_t nr;
+
+  fd = open (path_cache_file, O_RDONLY);
+  if (fd < 0)
+    return;
+  if (fstat (fd, &finfo) < 0 || S_ISREG (finfo.st_mode) == 0 ||
+      finfo.st_uid != geteuid () || finfo.st_size == 0)
+    {
+      close (fd);
+      return;
+    }
+
+  buf = (char *)xmalloc (finfo.st_size + 1);
+  nr = read (fd, buf, finfo.st_size);
+  close (fd);
+  if (nr != finfo.st_size)
+    {
+      free (buf);
+      return;
+    }
+  buf[nr] = '\0';
+
+  line = buf;
+  next = strchr (line, '\n');
+  if (next == 0 || next - line != sizeof (PATH_CACHE_MAGIC) - 1 ||
+      STREQN (line, PATH_CACHE_MAGIC, next - line) == 0)
+    {
+      free (buf);
+      return;
+    }
+
+  for (line = next + 1; *line; )
+    {
+      next = strchr (line, '\n');
+      if (next == 0)
+	break;
+      *next = '\0';
+      n = 0;
+      if (sscanf (line, "D %lu %lu %ld %ld %d %n", &dev, &ino, &mtime, &mtime_ns, &count, &n) != 5 ||
+	  n == 0 || line[n] != '/' || count < 0)
+	break;
+      dir = line + n;
+
+      listing = path_listing_create ((struct stat *)NULL);
+      listing->dev = dev;
+      listing->ino = ino;
+      listing->mtime = mtime;
+      listing->mtime_ns = mtime_ns;
+
+      for (line = next + 1; count > 0 && *line; count--)
+	{
+	  next = strchr (line, '\n');
+	  if (next == 0)
+	    break;
+	  *next = '\0';
+	  hash_insert (savestring (line), listing->names, HASH_NOSRCH);
+	  line = next + 1;
+	}
+      if (count)
+	{
+	  /* Truncated */
+	  path_listing_free (listing);
+	  break;
+	}
+      path_listing_set (dir, listing);
+    }
+
+  free (buf);
+}
+
+/* Write all the listings to the cache file, replacing it atomically so
+   other shells reading it see the old file or the new one. */
+static void
+path_cache_save ()
+{
+  BUCKET_CONTENTS *item, *name;
+  PATH_LISTING *listing;
+  char *tmp;
+  FILE *fp;
+  int i, j, fd;
+
+  tmp = (char *)xmalloc (strlen (path_cache_file) + 32);
+  sprintf (tmp, "%s.%ld", path_cache_file, (long)getpid ());
+  fd = open (tmp, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0600);
+  if (fd < 0 || (fp = fdopen (fd, "w")) == 0)
+    {
+      if (fd >= 0)
+	{
+	  close (fd);
+	  unlink (tmp);
+	}
+      free (tmp);
+      return;
+    }
+
+  fprintf (fp, "%s\n", PATH_CACHE_MAGIC);
+  for (i = 0; i < path_listings->nbuckets; i++)
+    for (item = path_listings->bucket_array[i]; item; item = item->next)
+      {
+	listing = (PATH_LISTING *)item->data;
+	if (mbschr (item->key, '\n'))
+	  continue;
+	fprintf (fp, "D %lu %lu %ld %ld %d %s\n", (unsigned long)listing->dev,
+		 (unsigned long)listing->ino, (long)listing->mtime,
+		 listing->mtime_ns, listing->names->nentries, item->key);
+	for (j = 0; j < listing->names->nbuckets; j++)
+	  for (name = listing->names->bucket_array[j]; name; name = name->next)
+	    fprintf (fp, "%s\n", name->key);
+      }
+
+  if (fclose (fp) != 0 || rename (tmp, path_cache_file) < 0)
+    unlink (tmp);
+  free (tmp);
+}
+
+/* Return non-zero if ANBS_PATH_CACHE is set, loading the listings the
+   first time it names a file. */
+static int
+path_cache_enabled ()
+{
+  char *value;
+
+  value = get_string_value ("ANBS_PATH_CACHE");
+  if (value && *value && path_cache_file && STREQ (value, path_cache_file))
+    return 1;
+
+  if (path_listings)
+    {
+      hash_flush (path_listings, path_listing_free);
+      hash_dispose (path_listings);
+      path_listings = (HASH_TABLE *)NULL;
+    }
+  FREE (path_cache_file);
+  path_cache_file = (char *)NULL;
+
+  if (value == 0 || *value == '\0')
+    return 0;
+
+  path_cache_file = savestring (value);
+  path_listings = hash_create (32);
+  path_cache_load ();
+  return 1;
+}
+
+/* Return non-zero if DIR, an absolute pathname, is known not to contain
+   NAME. */
+static int
+path_cache_lacks (dir, name)
+     const char *dir, *name;
+{
+  BUCKET_CONTENTS *item;
+  PATH_LISTING *listing;
+  struct stat finfo;
+  time_t now;
+
+  now = NOW;
+  item = hash_search (dir, path_listings, 0);
+  listing = item ? (PATH_LISTING *)item->data : (PATH_LISTING *)NULL;
+
+  if (listing == 0 || listing->checked != now)
+    {
+      if (stat (dir, &finfo) < 0 || S_ISDIR (finfo.st_mode) == 0)
+	{
+	  /* Nothing to find here; let the search see that for itself */
+	  if (listing)
+	    path_listing_set (dir, (PATH_LISTING *)NULL);
+	  return 0;
+	}
+
+      if (listing && listing->mtime != -1 && listing->dev == finfo.st_dev &&
+	  listing->ino == finfo.st_ino && listing->mtime == finfo.st_mtime &&
+	  listing->mtime_ns == get_stat_mtime_ns (&finfo))
+	listing->checked = now;
+      else
+	{
+	  listing = path_listing_read (dir, &finfo, now);
+	  path_listing_set (dir, listing);
+	  path_cache_save ();
+	  if (listing == 0)
+	    return 0;
+	}
+    }
+
+  return (hash_search (name, listing->names, 0) == 0);
+}
+#endif /* ANBS_AI_ENABLED */
+
 static char *
 find_absolute_program (name, flags)
      const char *name;
@@ -539,6 +867,17 @@ find_in_path_element (name, path, flags, name_len, dotinfop, rflagsp)
   if (dot_found_in_search == 0 && *xpath == '.')
     dot_found_in_search = same_file (".", xpath, dotinfop, (struct stat *)NULL);
 
+#if defined (ANBS_AI_ENABLED)
+  if (path_cache_active && *xpath == '/' && path_cache_lacks (xpath, name))
+    {
+      if (xpath != path)
+	free (xpath);
+      if (rflagsp)
+	*rflagsp = 0;
+      return ((char *)NULL);
+    }
+#endif
+
   full_path = sh_makepath (xpath, name, 0);
 
   status = file_status (full_path);
@@ -636,6 +975,11 @@ find_user_command_in_path (name, path_list, flags, rflagsp)
   name_len = strlen (name);
   if (stat (".", &dotinfo) < 0)
     dotinfo.st_dev = dotinfo.st_ino = 0;
+#if defined (ANBS_AI_ENABLED)
+  path_cache_active = path_cache_enabled ();
+
+search_again:
+#endif
   path_index = 0;
 
   while (path_list[path_index])
@@ -665,6 +1009,9 @@ find_user_command_in_path (name, path_list, flags, rflagsp)
 	  if (rflagsp)
 	    *rflagsp = rflags;
 	  FREE (file_to_lose_on);
+#if defined (ANBS_AI_ENABLED)
+	  path_cache_active = 0;
+#endif
 	  return (full_path);
 	}
     }
@@ -681,6 +1028,17 @@ find_user_command_in_path (name, path_list, flags, rflagsp)
       file_to_lose_on = (char *)NULL;
     }
 
+#if defined (ANBS_AI_ENABLED)
+  /* The listings may be a second behind; look again without them before
+     giving up. */
+  if (path_cache_active && file_to_lose_on == 0)
+    {
+      path_cache_active = 0;
+      goto search_again;
+    }
+  path_cache_active = 0;
+#endif
+
   return (file_to_lose_on);
 }
 
@@ -739,6 +739,22 @@ sh_closepipe (pv)
   return 0;
 }
 
+/* The pipe buffer size BASH_PIPESIZE asks for; 0 leaves the default */
+int sh_pipesize = 0;
+
+/* Give the pipe PV the buffer BASH_PIPESIZE asks for, where the system
+   can.  A process substitution or coprocess with a larger buffer runs
+   further ahead of the shell before one of them has to block. */
+void
+sh_sizepipe (pv)
+     int *pv;
+{
+#if defined (F_SETPIPE_SZ)
+  if (sh_pipesize > 0)
+    fcntl (pv[0], F_SETPIPE_SZ, sh_pipesize);
+#endif
+}
+
 /* **************************************************************** */
 /*								    */
 /*		    Functions to inspect pathnames		    */
@@ -178,14 +178,16 @@ typedef struct {
    CIND is the current index into the string (int)
    ROOM is the amount of additional room we need in the string (int)
    CSIZE is the currently-allocated size of STR (int)
-   SINCR is how much to increment CSIZE before calling xrealloc (int) */
+   SINCR is how much to increment CSIZE before calling xrealloc (int)
+   Once CSIZE is past SINCR it grows by half instead, so filling a buffer
+   a little at a time doesn't copy it over and over. */
 
 #define RESIZE_MALLOCED_BUFFER(str, cind, room, csize, sincr) \
   do { \
     if ((cind) + (room) >= csize) \
       { \
 	while ((cind) + (room) >= csize) \
-	  csize += (sincr); \
+	  csize += ((csize) > (sincr)) ? (csize) / 2 : (sincr); \
 	str = xrealloc (str, csize); \
       } \
   } while (0)
@@ -341,6 +343,8 @@ extern int same_file PARAMS((const char *, const char *, struct stat *, struct s
 
 extern int sh_openpipe PARAMS((int *));
 extern int sh_closepipe PARAMS((int *));
+extern int sh_pipesize;
+extern void sh_sizepipe PARAMS((int *));
 
 extern int file_exists PARAMS((const char *));
 extern int file_isdir PARAMS((const char  *));
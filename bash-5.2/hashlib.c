@@ -34,6 +34,10 @@
 #include "shell.h"
 #include "hashlib.h"
 
+#if defined (__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 /* tunable constants for rehashing */
 #define HASH_REHASH_MULTIPLIER	4
 #define HASH_REHASH_FACTOR	2
@@ -50,12 +54,38 @@
    don't discard the upper 32 bits of the value, if present. */
 #define HASH_BUCKET(s, t, h) (((h) = hash_string (s)) & ((t)->nbuckets - 1))
 
+/* Open addressing.  A table made by hash_create_open keeps each item in
+   a bucket of its own and finds it by probing, the way Swiss tables do.
+   CTRL has a byte for each bucket: HASH_CTRL_EMPTY, HASH_CTRL_DELETED, or
+   the top seven bits of the hash of the item in it.  A probe compares a
+   group of HASH_GROUP control bytes at once (with SSE2 when we have it),
+   looks at the items only where the byte matches, and stops at the first
+   group with an empty bucket.  The table grows before live items and
+   tombstones fill 7/8 of the buckets. */
+#define HASH_GROUP		16
+#define HASH_CTRL_EMPTY		0x80
+#define HASH_CTRL_DELETED	0xfe
+#define HASH_CTRL_FULL(c)	(((c) & 0x80) == 0)
+#define HASH_H2(h)		((int)(((h) >> 25) & 0x7f))
+
+#define HASH_OPEN_SHOULDGROW(table) \
+  (((table)->nentries + (table)->ndeleted + 1) * 8 > (table)->nbuckets * 7)
+
 static BUCKET_CONTENTS *copy_bucket_array PARAMS((BUCKET_CONTENTS *, sh_string_func_t *));
 
 static void hash_rehash PARAMS((HASH_TABLE *, int));
 static void hash_grow PARAMS((HASH_TABLE *));
 static void hash_shrink PARAMS((HASH_TABLE *));
 
+static unsigned int hash_group_match PARAMS((const unsigned char *, int));
+static unsigned int hash_group_free PARAMS((const unsigned char *));
+static int hash_lowest_bit PARAMS((unsigned int));
+static int hash_open_find PARAMS((const char *, HASH_TABLE *, unsigned int));
+static int hash_open_slot PARAMS((HASH_TABLE *, unsigned int));
+static void hash_open_rehash PARAMS((HASH_TABLE *, int));
+static BUCKET_CONTENTS *hash_open_add PARAMS((char *, HASH_TABLE *, unsigned int));
+static BUCKET_CONTENTS *hash_open_remove PARAMS((const char *, HASH_TABLE *));
+
 /* Make a new hash table with BUCKETS number of buckets.  Initialize
    each slot in the table to NULL. */
 HASH_TABLE *
@@ -73,6 +103,8 @@ hash_create (buckets)
     (BUCKET_CONTENTS **)xmalloc (buckets * sizeof (BUCKET_CONTENTS *));
   new_table->nbuckets = buckets;
   new_table->nentries = 0;
+  new_table->ctrl = (unsigned char *)NULL;
+  new_table->ndeleted = 0;
 
   for (i = 0; i < buckets; i++)
     new_table->bucket_array[i] = (BUCKET_CONTENTS *)NULL;
@@ -80,6 +112,27 @@ hash_create (buckets)
   return (new_table);
 }
 
+/* Make a new open-addressing table with room for at least BUCKETS items
+   before it has to grow. */
+HASH_TABLE *
+hash_create_open (buckets)
+     int buckets;
+{
+  HASH_TABLE *new_table;
+  int nsize;
+
+  if (buckets == 0)
+    buckets = DEFAULT_HASH_BUCKETS;
+  for (nsize = HASH_GROUP; nsize < buckets; nsize <<= 1)
+    ;
+
+  new_table = hash_create (nsize);
+  new_table->ctrl = (unsigned char *)xmalloc (nsize);
+  memset (new_table->ctrl, HASH_CTRL_EMPTY, nsize);
+
+  return (new_table);
+}
+
 int
 hash_size (table)
      HASH_TABLE *table;
@@ -186,11 +239,19 @@ hash_copy (table, cpdata)
   if (table == 0)
     return ((HASH_TABLE *)NULL);
 
-  new_table = hash_create (table->nbuckets);
+  new_table = HASH_OPEN (table) ? hash_create_open (table->nbuckets)
+			       : hash_create (table->nbuckets);
 
   for (i = 0; i < table->nbuckets; i++)
     new_table->bucket_array[i] = copy_bucket_array (table->bucket_array[i], cpdata);
 
+  /* An open table's items stay in the same buckets */
+  if (HASH_OPEN (table))
+    {
+      memcpy (new_table->ctrl, table->ctrl, table->nbuckets);
+      new_table->ndeleted = table->ndeleted;
+    }
+
   new_table->nentries = table->nentries;
   return new_table;
 }
@@ -242,6 +303,206 @@ hash_bucket (string, table)
   return (HASH_BUCKET (string, table, h));
 }
 
+/* Return a bitmask of the bytes in the group of control bytes at CTRL
+   that equal BYTE. */
+static unsigned int
+hash_group_match (ctrl, byte)
+     const unsigned char *ctrl;
+     int byte;
+{
+#if defined (__SSE2__)
+  __m128i group;
+
+  group = _mm_loadu_si128 ((const __m128i *)ctrl);
+  return ((unsigned int)_mm_movemask_epi8 (_mm_cmpeq_epi8 (group, _mm_set1_epi8 ((char)byte))));
+#else
+  unsigned int mask;
+  int i;
+
+  for (mask = 0, i = 0; i < HASH_GROUP; i++)
+    if (ctrl[i] == byte)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
+
+/* Return a bitmask of the empty or deleted buckets in the group at CTRL */
+static unsigned int
+hash_group_free (ctrl)
+     const unsigned char *ctrl;
+{
+#if defined (__SSE2__)
+  return ((unsigned int)_mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)ctrl)));
+#else
+  unsigned int mask;
+  int i;
+
+  for (mask = 0, i = 0; i < HASH_GROUP; i++)
+    if (HASH_CTRL_FULL (ctrl[i]) == 0)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
+
+static int
+hash_lowest_bit (mask)
+     unsigned int mask;
+{
+#if defined (__GNUC__)
+  return (__builtin_ctz (mask));
+#else
+  int i;
+
+  for (i = 0; (mask & 1) == 0; i++)
+    mask >>= 1;
+  return i;
+#endif
+}
+
+/* Probe TABLE's groups for STRING, whose hash is HV.  Groups are visited
+   in triangular order, which reaches every group when there are a power
+   of two of them.  Returns the bucket, or -1 if STRING isn't there. */
+static int
+hash_open_find (string, table, hv)
+     const char *string;
+     HASH_TABLE *table;
+     unsigned int hv;
+{
+  unsigned int gmask, g, step, mask;
+  unsigned char *group;
+  BUCKET_CONTENTS *item;
+  int i;
+
+  gmask = table->nbuckets / HASH_GROUP - 1;
+  for (g = hv & gmask, step = 1; step <= gmask + 1; g = (g + step++) & gmask)
+    {
+      group = table->ctrl + g * HASH_GROUP;
+      for (mask = hash_group_match (group, HASH_H2 (hv)); mask; mask &= mask - 1)
+	{
+	  i = g * HASH_GROUP + hash_lowest_bit (mask);
+	  item = table->bucket_array[i];
+	  if (hv == item->khash && STREQ (item->key, string))
+	    return i;
+	}
+      if (hash_group_match (group, HASH_CTRL_EMPTY))
+	break;
+    }
+  return -1;
+}
+
+/* Return the first empty or deleted bucket on HV's probe sequence */
+static int
+hash_open_slot (table, hv)
+     HASH_TABLE *table;
+     unsigned int hv;
+{
+  unsigned int gmask, g, step, mask;
+
+  gmask = table->nbuckets / HASH_GROUP - 1;
+  for (g = hv & gmask, step = 1; ; g = (g + step++) & gmask)
+    if (mask = hash_group_free (table->ctrl + g * HASH_GROUP))
+      return (g * HASH_GROUP + hash_lowest_bit (mask));
+}
+
+/* Rebuild TABLE with NSIZE buckets, dropping its tombstones */
+static void
+hash_open_rehash (table, nsize)
+     HASH_TABLE *table;
+     int nsize;
+{
+  BUCKET_CONTENTS **old_bucket_array, *item;
+  unsigned char *old_ctrl;
+  int osize, i, j;
+
+  osize = table->nbuckets;
+  old_bucket_array = table->bucket_array;
+  old_ctrl = table->ctrl;
+
+  table->nbuckets = nsize;
+  table->ndeleted = 0;
+  table->bucket_array = (BUCKET_CONTENTS **)xmalloc (nsize * sizeof (BUCKET_CONTENTS *));
+  for (i = 0; i < nsize; i++)
+    table->bucket_array[i] = (BUCKET_CONTENTS *)NULL;
+  table->ctrl = (unsigned char *)xmalloc (nsize);
+  memset (table->ctrl, HASH_CTRL_EMPTY, nsize);
+
+  for (j = 0; j < osize; j++)
+    if (HASH_CTRL_FULL (old_ctrl[j]))
+      {
+	item = old_bucket_array[j];
+	i = hash_open_slot (table, item->khash);
+	table->bucket_array[i] = item;
+	table->ctrl[i] = HASH_H2 (item->khash);
+      }
+
+  free (old_bucket_array);
+  free (old_ctrl);
+}
+
+/* Add a new item for STRING, whose hash is HV, to open table TABLE.  The
+   caller has made sure it isn't already there. */
+static BUCKET_CONTENTS *
+hash_open_add (string, table, hv)
+     char *string;
+     HASH_TABLE *table;
+     unsigned int hv;
+{
+  BUCKET_CONTENTS *item;
+  int i;
+
+  if (HASH_OPEN_SHOULDGROW (table))
+    /* Double the table if it's at least half full; otherwise clearing the
+       tombstones makes enough room */
+    hash_open_rehash (table, (table->nentries + 1) * 2 > table->nbuckets
+				? table->nbuckets * 2 : table->nbuckets);
+
+  i = hash_open_slot (table, hv);
+  if (table->ctrl[i] == HASH_CTRL_DELETED)
+    table->ndeleted--;
+
+  item = (BUCKET_CONTENTS *)xmalloc (sizeof (BUCKET_CONTENTS));
+  item->next = (BUCKET_CONTENTS *)NULL;
+  item->data = NULL;
+  item->key = string;
+  item->khash = hv;
+  item->times_found = 0;
+
+  table->bucket_array[i] = item;
+  table->ctrl[i] = HASH_H2 (hv);
+  table->nentries++;
+  return (item);
+}
+
+static BUCKET_CONTENTS *
+hash_open_remove (string, table)
+     const char *string;
+     HASH_TABLE *table;
+{
+  BUCKET_CONTENTS *item;
+  int i;
+
+  i = hash_open_find (string, table, hash_string (string));
+  if (i < 0)
+    return ((BUCKET_CONTENTS *)NULL);
+
+  item = table->bucket_array[i];
+  table->bucket_array[i] = (BUCKET_CONTENTS *)NULL;
+
+  /* A probe stops at a group with an empty bucket before it gets past
+     this one, so the bucket can be empty again; otherwise leave a
+     tombstone so probes keep going. */
+  if (hash_group_match (table->ctrl + (i & ~(HASH_GROUP - 1)), HASH_CTRL_EMPTY))
+    table->ctrl[i] = HASH_CTRL_EMPTY;
+  else
+    {
+      table->ctrl[i] = HASH_CTRL_DELETED;
+      table->ndeleted++;
+    }
+
+  table->nentries--;
+  return (item);
+}
+
 /* Return a pointer to the hashed item.  If the HASH_CREATE flag is passed,
    create a new hash table entry for STRING, otherwise return NULL. */
 BUCKET_CONTENTS *
@@ -257,6 +518,20 @@ hash_search (string, table, flags)
   if (table == 0 || ((flags & HASH_CREATE) == 0 && HASH_ENTRIES (table) == 0))
     return (BUCKET_CONTENTS *)NULL;
 
+  if (HASH_OPEN (table))
+    {
+      hv = hash_string (string);
+      bucket = hash_open_find (string, table, hv);
+      if (bucket >= 0)
+	{
+	  list = table->bucket_array[bucket];
+	  list->times_found++;
+	  return (list);
+	}
+      return ((flags & HASH_CREATE) ? hash_open_add ((char *)string, table, hv)	/* XXX fix later */
+				    : (BUCKET_CONTENTS *)NULL);
+    }
+
   bucket = HASH_BUCKET (string, table, hv);
 
   for (list = table->bucket_array ? table->bucket_array[bucket] : 0; list; list = list->next)
@@ -309,6 +584,9 @@ hash_remove (string, table, flags)
   if (table == 0 || HASH_ENTRIES (table) == 0)
     return (BUCKET_CONTENTS *)NULL;
 
+  if (HASH_OPEN (table))
+    return (hash_open_remove (string, table));
+
   bucket = HASH_BUCKET (string, table, hv);
   prev = (BUCKET_CONTENTS *)NULL;
   for (temp = table->bucket_array[bucket]; temp; temp = temp->next)
@@ -346,7 +624,9 @@ hash_insert (string, table, flags)
   item = (flags & HASH_NOSRCH) ? (BUCKET_CONTENTS *)NULL
   			       : hash_search (string, table, 0);
 
-  if (item == 0)
+  if (item == 0 && HASH_OPEN (table))
+    item = hash_open_add (string, table, hash_string (string));
+  else if (item == 0)
     {
       if (HASH_SHOULDGROW (table))
 	hash_grow (table);
@@ -401,6 +681,11 @@ hash_flush (table, free_data)
       table->bucket_array[i] = (BUCKET_CONTENTS *)NULL;
     }
 
+  if (HASH_OPEN (table))
+    {
+      memset (table->ctrl, HASH_CTRL_EMPTY, table->nbuckets);
+      table->ndeleted = 0;
+    }
   table->nentries = 0;
 }
 
@@ -410,6 +695,7 @@ hash_dispose (table)
      HASH_TABLE *table;
 {
   free (table->bucket_array);
+  FREE (table->ctrl);
   free (table);
 }
 
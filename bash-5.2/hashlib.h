@@ -43,12 +43,15 @@ typedef struct hash_table {
   BUCKET_CONTENTS **bucket_array;	/* Where the data is kept. */
   int nbuckets;			/* How many buckets does this table have. */
   int nentries;			/* How many entries does this table have. */
+  unsigned char *ctrl;		/* Open addressing: one control byte per bucket */
+  int ndeleted;			/* Open addressing: buckets holding tombstones */
 } HASH_TABLE;
 
 typedef int hash_wfunc PARAMS((BUCKET_CONTENTS *));
 
 /* Operations on tables as a whole */
 extern HASH_TABLE *hash_create PARAMS((int));
+extern HASH_TABLE *hash_create_open PARAMS((int));
 extern HASH_TABLE *hash_copy PARAMS((HASH_TABLE *, sh_string_func_t *));
 extern void hash_flush PARAMS((HASH_TABLE *, sh_free_func_t *));
 extern void hash_dispose PARAMS((HASH_TABLE *));
@@ -72,6 +75,10 @@ extern unsigned int hash_string PARAMS((const char *));
 		table->bucket_array[bucket] : \
 		(BUCKET_CONTENTS *)NULL)
 
+/* True if TABLE uses open addressing.  Its buckets are slots holding at
+   most one item each, so code walking bucket chains works unchanged. */
+#define HASH_OPEN(table)	((table)->ctrl != 0)
+
 /* Default number of buckets in the hash table. */
 #define DEFAULT_HASH_BUCKETS 128	/* must be power of two */
 
@@ -68,4 +68,11 @@
 #  define D_FILENO_AVAILABLE 1
 #endif
 
+/* Systems that report the file type in struct dirent define DT_UNKNOWN.
+   Some filesystems always report DT_UNKNOWN, so callers have to be
+   prepared to stat anyway. */
+#if defined (DT_UNKNOWN) && defined (DT_DIR) && defined (DT_LNK) && !defined (BROKEN_DIRENT_D_TYPE)
+#  define D_TYPE_AVAILABLE 1
+#endif
+
 #endif /* !_POSIXDIR_H_ */
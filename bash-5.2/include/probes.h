@@ -0,0 +1,63 @@
+/* probes.h -- USDT probe points for bpftrace, perf and SystemTap. */
+
+/* Copyright (C) 2024 Free Software Foundation, Inc.
+
+   This file is part of GNU Bash, the Bourne Again SHell.
+
+   Bash is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Bash is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Bash.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined (_PROBES_H_)
+#define _PROBES_H_
+
+/* With <sys/sdt.h> each probe compiles to one nop plus an ELF note
+   naming it and where its arguments live.  A tracer attaching to the
+   probe swaps the nop for a breakpoint; until then the only cost is
+   having the arguments in registers, so pass values already at hand.
+   Without the header, or with NO_PROBES defined, probes compile to
+   nothing and HAVE_PROBES is 0.  Code that has to compute an argument
+   should do it under `#if HAVE_PROBES'.
+
+   The shell's probes are under the provider `bash' and ai_core's under
+   `anbs':  bpftrace -l 'usdt:/path/to/bash:*' lists them. */
+
+#if !defined (NO_PROBES) && !defined (HAVE_SYS_SDT_H) && defined (__has_include)
+#  if __has_include (<sys/sdt.h>)
+#    define HAVE_SYS_SDT_H 1
+#  endif
+#endif
+
+#if defined (HAVE_SYS_SDT_H) && !defined (NO_PROBES)
+#  include <sys/sdt.h>
+#  define HAVE_PROBES 1
+#  define PROBE(provider, name)				DTRACE_PROBE (provider, name)
+#  define PROBE1(provider, name, a1)			DTRACE_PROBE1 (provider, name, a1)
+#  define PROBE2(provider, name, a1, a2)		DTRACE_PROBE2 (provider, name, a1, a2)
+#  define PROBE3(provider, name, a1, a2, a3)		DTRACE_PROBE3 (provider, name, a1, a2, a3)
+#  define PROBE4(provider, name, a1, a2, a3, a4)	DTRACE_PROBE4 (provider, name, a1, a2, a3, a4)
+#  define PROBE5(provider, name, a1, a2, a3, a4, a5)	DTRACE_PROBE5 (provider, name, a1, a2, a3, a4, a5)
+#  define PROBE6(provider, name, a1, a2, a3, a4, a5, a6) \
+	DTRACE_PROBE6 (provider, name, a1, a2, a3, a4, a5, a6)
+#else
+#  define HAVE_PROBES 0
+#  define PROBE(provider, name)				do { } while (0)
+#  define PROBE1(provider, name, a1)			do { } while (0)
+#  define PROBE2(provider, name, a1, a2)		do { } while (0)
+#  define PROBE3(provider, name, a1, a2, a3)		do { } while (0)
+#  define PROBE4(provider, name, a1, a2, a3, a4)	do { } while (0)
+#  define PROBE5(provider, name, a1, a2, a3, a4, a5)	do { } while (0)
+#  define PROBE6(provider, name, a1, a2, a3, a4, a5, a6)	do { } while (0)
+#endif
+
+#endif /* _PROBES_H_ */
@@ -36,6 +36,16 @@
 #include "bashansi.h"
 #include "bashintl.h"
 
+#if defined (HAVE_MMAP) && defined (HAVE_SYS_MMAN_H)
+#  include <sys/mman.h>
+#  if !defined (MAP_ANONYMOUS) && defined (MAP_ANON)
+#    define MAP_ANONYMOUS MAP_ANON
+#  endif
+#  if defined (MAP_ANONYMOUS) && defined (MAP_FIXED)
+#    define MMAP_INPUT 1
+#  endif
+#endif
+
 #include "shell.h"
 #include "input.h"
 #include "externs.h"
@@ -137,6 +147,16 @@ ungetc_with_restart (c, stream)
 #  define MAX_INPUT_BUFFER_SIZE	8192
 #endif
 
+#if defined (MMAP_INPUT)
+static SigHandler *old_sigbus_handler;
+static int sigbus_handler_set;
+static long mmap_pagesize;
+
+static BUFFERED_STREAM *mmap_buffered_stream PARAMS((int, struct stat *));
+static void unmap_buffered_stream PARAMS((BUFFERED_STREAM *));
+static sighandler input_sigbus_handler PARAMS((int));
+#endif
+
 #if !defined (SEEK_CUR)
 #  define SEEK_CUR 1
 #endif /* !SEEK_CUR */
@@ -399,6 +419,17 @@ fd_to_buffered_stream (fd)
       return ((BUFFERED_STREAM *)NULL);
     }
 
+#if defined (MMAP_INPUT)
+  if (S_ISREG (sb.st_mode) && sb.st_size > MAX_INPUT_BUFFER_SIZE &&
+      (O_TEXT == 0 || (fcntl (fd, F_GETFL) & O_TEXT) == 0))
+    {
+      BUFFERED_STREAM *bp;
+
+      if (bp = mmap_buffered_stream (fd, &sb))
+	return bp;
+    }
+#endif
+
   size = (fd_is_seekable (fd)) ? min (sb.st_size, MAX_INPUT_BUFFER_SIZE) : 1;
   if (size == 0)
     size = 1;
@@ -407,6 +438,146 @@ fd_to_buffered_stream (fd)
   return (make_buffered_stream (fd, buffer, size));
 }
 
+#if defined (MMAP_INPUT)
+/* A script too big for one buffer is mapped instead of read:  the whole
+   file is the stream's buffer, the parser copies lines straight out of
+   the page cache, and b_fill_buffer only has to move the file offset.
+   The mapping is private and writable because bufstream_ungetc stores
+   into the buffer. */
+static BUFFERED_STREAM *
+mmap_buffered_stream (fd, sp)
+     int fd;
+     struct stat *sp;
+{
+  BUFFERED_STREAM *bp;
+  char *buffer;
+  size_t size;
+
+  /* A trap would run instead of input_sigbus_handler, and an ignored
+     SIGBUS kills the shell when the mapping faults */
+  if (signal_is_trapped (SIGBUS) || signal_is_ignored (SIGBUS))
+    return ((BUFFERED_STREAM *)NULL);
+
+  size = (size_t)sp->st_size;
+  if ((off_t)size != sp->st_size)
+    return ((BUFFERED_STREAM *)NULL);
+  buffer = mmap ((void *)0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (buffer == MAP_FAILED)
+    return ((BUFFERED_STREAM *)NULL);
+
+  if (mmap_pagesize == 0)
+    mmap_pagesize = getpagesize ();
+  if (sigbus_handler_set == 0)
+    {
+      old_sigbus_handler = set_signal_handler (SIGBUS, input_sigbus_handler);
+      sigbus_handler_set = 1;
+    }
+
+  bp = make_buffered_stream (fd, buffer, size);
+  bp->b_flag |= B_MMAP;
+  return (bp);
+}
+
+/* Turn BP back into an ordinary buffered stream, unmapping the file
+   unless a copy of the stream made for another fd still uses it. */
+static void
+unmap_buffered_stream (bp)
+     BUFFERED_STREAM *bp;
+{
+  int i;
+
+  for (i = 0; i < nbuffers; i++)
+    if (buffers[i] && buffers[i] != bp && buffers[i]->b_buffer == bp->b_buffer)
+      break;
+  if (i == nbuffers)
+    munmap (bp->b_buffer, bp->b_size);
+  else if ((bp->b_flag & B_SHAREDBUF) == 0)
+    buffers[i]->b_flag &= ~B_SHAREDBUF;	/* the copy owns the mapping now */
+
+  /* The new buffer belongs to BP alone, or nothing would free it */
+  bp->b_flag &= ~(B_MMAP|B_SHAREDBUF);
+  bp->b_size = MAX_INPUT_BUFFER_SIZE;
+  bp->b_buffer = (char *)xmalloc (bp->b_size);
+  bp->b_used = bp->b_inputp = 0;
+}
+
+/* Reading past the end of a file that has been truncated since it was
+   mapped raises SIGBUS.  If that is what happened to one of the mapped
+   streams, replace the part of its mapping past the new end of the file
+   with zeroed memory and return 1; the read is retried and gets NULs,
+   which shell_getc skips, and the next b_fill_buffer finds the end of
+   the file.  Called from signal handlers. */
+int
+buffered_input_sigbus ()
+{
+  BUFFERED_STREAM *bp;
+  struct stat sb;
+  size_t start;
+  int i, r;
+
+  for (i = r = 0; i < nbuffers; i++)
+    {
+      bp = buffers[i];
+      if (bp == 0 || (bp->b_flag & B_MMAP) == 0 ||
+	  fstat (bp->b_fd, &sb) < 0 || sb.st_size >= (off_t)bp->b_size)
+	continue;
+
+      start = (sb.st_size + mmap_pagesize - 1) & ~(mmap_pagesize - 1);
+      if (start < bp->b_size &&
+	  mmap (bp->b_buffer + start, bp->b_size - start, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) != MAP_FAILED)
+	r = 1;
+    }
+  return r;
+}
+
+static sighandler
+input_sigbus_handler (sig)
+     int sig;
+{
+  /* Not ours: put back the old handler and let the fault happen again */
+  if (buffered_input_sigbus () == 0)
+    {
+      set_signal_handler (sig, old_sigbus_handler);
+      sigbus_handler_set = 0;
+    }
+  SIGRETURN (0);
+}
+
+/* Called before a trap or an ignored disposition replaces the SIGBUS
+   handler.  Go back to reading each mapped stream from wherever it has
+   got to, since nothing would catch a fault in the mapping any more. */
+void
+unmap_buffered_streams ()
+{
+  BUFFERED_STREAM *bp;
+  int i;
+
+  for (i = 0; i < nbuffers; i++)
+    {
+      bp = buffers[i];
+      if (bp == 0 || (bp->b_flag & B_MMAP) == 0)
+	continue;
+      /* Before the first fill the file offset is already right */
+      if (bp->b_used && lseek (bp->b_fd, bp->b_inputp, SEEK_SET) < 0)
+	continue;
+      unmap_buffered_stream (bp);
+    }
+  sigbus_handler_set = 0;
+}
+#else
+int
+buffered_input_sigbus ()
+{
+  return 0;
+}
+
+void
+unmap_buffered_streams ()
+{
+}
+#endif /* MMAP_INPUT */
+
 /* Return a buffered stream corresponding to FILE, a file name. */
 BUFFERED_STREAM *
 open_buffered_stream (file)
@@ -430,6 +601,11 @@ free_buffered_stream (bp)
     return;
 
   n = bp->b_fd;
+#if defined (MMAP_INPUT)
+  if (bp->b_buffer && (bp->b_flag & B_MMAP))
+    munmap (bp->b_buffer, bp->b_size);
+  else
+#endif
   if (bp->b_buffer)
     free (bp->b_buffer);
   free (bp);
@@ -492,6 +668,25 @@ b_fill_buffer (bp)
   off_t o;
 
   CHECK_TERMSIG;
+
+#if defined (MMAP_INPUT)
+  /* The rest of a mapped file is already in the buffer; move the file
+     offset past it, as reading that much would have. */
+  if (bp->b_flag & B_MMAP)
+    {
+      o = lseek (bp->b_fd, 0, SEEK_CUR);
+      if (o >= 0 && o < (off_t)bp->b_size && lseek (bp->b_fd, bp->b_size, SEEK_SET) >= 0)
+	{
+	  bp->b_used = bp->b_size;
+	  bp->b_inputp = o;
+	  return (bp->b_buffer[bp->b_inputp++] & 0xFF);
+	}
+      /* At the end of the mapping.  Anything written to the file since it
+	 was mapped has to be read. */
+      unmap_buffered_stream (bp);
+    }
+#endif
+
   /* In an environment where text and binary files are treated differently,
      compensate for lseek() on text files returning an offset different from
      the count of characters read() returns.  Text-mode streams have to be
@@ -590,6 +785,32 @@ buffered_ungetchar (c)
   return (bufstream_ungetc (c, buffers[bash_input.location.buffered_fd]));
 }
 
+/* Point *BUFP at the characters already read into the buffer for the
+   shell's input and return how many there are, without consuming them.
+   The parser copies whole lines out of the buffer this way instead of
+   calling buffered_getchar for each character. */
+size_t
+buffered_input_peek (bufp)
+     char **bufp;
+{
+  BUFFERED_STREAM *bp;
+
+  if (bash_input.location.buffered_fd < 0 || (bp = buffers[bash_input.location.buffered_fd]) == 0 ||
+      bp->b_used == 0 || bp->b_inputp >= bp->b_used)
+    return 0;
+
+  *bufp = bp->b_buffer + bp->b_inputp;
+  return (bp->b_used - bp->b_inputp);
+}
+
+/* Consume N characters returned by buffered_input_peek */
+void
+buffered_input_consume (n)
+     size_t n;
+{
+  buffers[bash_input.location.buffered_fd]->b_inputp += n;
+}
+
 /* Make input come from file descriptor BFD through a buffered stream. */
 void
 with_input_from_buffered_stream (bfd, name)
@@ -50,6 +50,7 @@ enum stream_type {st_none, st_stdin, st_stream, st_string, st_bstream};
 #define B_WASBASHINPUT	0x08
 #define B_TEXT		0x10
 #define B_SHAREDBUF	0x20	/* shared input buffer */
+#define B_MMAP		0x40	/* b_buffer maps the whole file */
 
 /* A buffered stream.  Like a FILE *, but with our own buffering and
    synchronization.  Look in input.c for the implementation. */
@@ -129,6 +130,10 @@ extern int close_buffered_fd PARAMS((int));
 extern int sync_buffered_stream PARAMS((int));
 extern int buffered_getchar PARAMS((void));
 extern int buffered_ungetchar PARAMS((int));
+extern size_t buffered_input_peek PARAMS((char **));
+extern void buffered_input_consume PARAMS((size_t));
+extern int buffered_input_sigbus PARAMS((void));
+extern void unmap_buffered_streams PARAMS((void));
 extern void with_input_from_buffered_stream PARAMS((int, char *));
 #endif /* BUFFERED_INPUT */
 
@@ -53,6 +53,14 @@
 #  include "input.h"
 #endif
 
+#if defined (HAVE_SYS_EPOLL_H)
+#  include <sys/epoll.h>
+#  include <sys/syscall.h>
+#  if defined (SYS_pidfd_open) && defined (EPOLL_CLOEXEC)
+#    define PIDFD_WAIT
+#  endif
+#endif
+
 /* Need to include this up here for *_TTY_DRIVER definitions. */
 #include "shtty.h"
 
@@ -72,6 +80,7 @@
 #include "jobs.h"
 #include "execute_cmd.h"
 #include "flags.h"
+#include "probes.h"
 
 #include "typemax.h"
 
@@ -107,6 +116,7 @@ extern int killpg PARAMS((pid_t, int));
 /* XXX for now */
 #define PIDSTAT_TABLE_SZ 4096
 #define BGPIDS_TABLE_SZ 512
+#define JOBPID_TABLE_SZ 1024
 
 /* Flag values for second argument to delete_job */
 #define DEL_WARNSTOPPED		1	/* warn about deleting stopped jobs */
@@ -179,6 +189,18 @@ struct bgpids bgpids = { 0, 0, 0, 0 };
 
 struct procchain procsubs = { 0, 0, 0 };
 
+/* Index from a pid to the jobs that contain it, so find_job doesn't have
+   to walk every pipeline in the jobs list.  A pid can appear in more than
+   one job if it has been recycled. */
+struct jobpid {
+  struct jobpid *next;
+  PROCESS *proc;
+  pid_t pid;
+  int job;
+};
+
+static struct jobpid *jobpid_table[JOBPID_TABLE_SZ];
+
 /* The array of known jobs. */
 JOB **jobs = (JOB **)NULL;
 
@@ -248,6 +270,12 @@ static PROCESS *find_pid_in_pipeline PARAMS((pid_t, PROCESS *, int));
 static PROCESS *find_pipeline PARAMS((pid_t, int, int *));
 static PROCESS *find_process PARAMS((pid_t, int, int *));
 
+static struct jobpid **jobpid_getbucket PARAMS((pid_t));
+static void jobpid_add PARAMS((PROCESS *, int));
+static void jobpid_add_job PARAMS((int));
+static void jobpid_delete_job PARAMS((int));
+static void jobpid_rebuild PARAMS((void));
+
 static char *current_working_directory PARAMS((void));
 static char *job_working_directory PARAMS((void));
 static char *j_strsignal PARAMS((int));
@@ -307,6 +335,15 @@ static struct pipeline_saver *alloc_pipeline_saver PARAMS((void));
 static ps_index_t bgp_getindex PARAMS((void));
 static void bgp_resize PARAMS((void));	/* XXX */
 
+#if defined (PIDFD_WAIT)
+static int pidfd_start PARAMS((void));
+static void pidfd_stop PARAMS((void));
+static int pidfd_watch PARAMS((pid_t));
+static void pidfd_watch_job PARAMS((int));
+static int pidfd_wait PARAMS((pid_t *, int, int));
+#endif
+static long wait_remaining PARAMS((struct timeval *));
+
 #if defined (ARRAY_VARS)
 static int *pstatuses;		/* list of pipeline statuses */
 static int statsize;
@@ -676,6 +713,11 @@ stop_pipeline (async, deferred)
       newjob->cleanarg = (PTR_T) NULL;
 
       jobs[i] = newjob;
+      jobpid_add_job (i);
+#if defined (PIDFD_WAIT)
+      if (async && newjob->state == JRUNNING)
+	pidfd_watch_job (i);
+#endif
       if (newjob->state == JDEAD && (newjob->flags & J_FOREGROUND))
 	setjstatus (i);
       if (newjob->state == JDEAD)
@@ -987,6 +1029,100 @@ save_proc_status (pid, status)
   UNBLOCK_CHILD (oset);  
 }
 
+/* Functions to maintain the pid-to-job index in jobpid_table.  Every
+   PROCESS in jobs[N]->pipe has an entry with job == N; entries are added
+   when a job enters the list, removed when it is deleted, and rebuilt when
+   the list is compacted and job indices change.  All of these must be
+   called with SIGCHLD blocked. */
+
+static struct jobpid **
+jobpid_getbucket (pid)
+     pid_t pid;
+{
+  unsigned long hash;		/* XXX - u_bits32_t */
+
+  hash = pid * 0x9e370001UL;
+  return (&jobpid_table[hash % JOBPID_TABLE_SZ]);
+}
+
+static void
+jobpid_add (p, job)
+     PROCESS *p;
+     int job;
+{
+  struct jobpid **bucket, *jp;
+
+  bucket = jobpid_getbucket (p->pid);
+  jp = (struct jobpid *)xmalloc (sizeof (struct jobpid));
+  jp->proc = p;
+  jp->pid = p->pid;
+  jp->job = job;
+  jp->next = *bucket;
+  *bucket = jp;
+}
+
+static void
+jobpid_add_job (job)
+     int job;
+{
+  PROCESS *p;
+
+  p = jobs[job]->pipe;
+  do
+    {
+      jobpid_add (p, job);
+      p = p->next;
+    }
+  while (p != jobs[job]->pipe);
+}
+
+static void
+jobpid_delete_job (job)
+     int job;
+{
+  PROCESS *p;
+  struct jobpid **bucket, *jp, *prev;
+
+  p = jobs[job]->pipe;
+  do
+    {
+      bucket = jobpid_getbucket (p->pid);
+      for (prev = 0, jp = *bucket; jp; prev = jp, jp = jp->next)
+	if (jp->proc == p && jp->job == job)
+	  {
+	    if (prev)
+	      prev->next = jp->next;
+	    else
+	      *bucket = jp->next;
+	    free (jp);
+	    break;
+	  }
+      p = p->next;
+    }
+  while (p != jobs[job]->pipe);
+}
+
+static void
+jobpid_rebuild ()
+{
+  register int i;
+  struct jobpid *jp, *next;
+
+  for (i = 0; i < JOBPID_TABLE_SZ; i++)
+    {
+      for (jp = jobpid_table[i]; jp; jp = next)
+	{
+	  next = jp->next;
+	  free (jp);
+	}
+      jobpid_table[i] = (struct jobpid *)NULL;
+    }
+
+  for (i = 0; i < js.j_jobslots; i++)
+    if (jobs[i])
+      jobpid_add_job (i);
+}
+
 #if defined (PROCESS_SUBSTITUTION)
 /* Functions to add and remove PROCESS * children from the list of running
    asynchronous process substitutions. The list is currently a simple singly
@@ -1341,6 +1477,9 @@ realloc_jobs_list ()
       jobs = nlist;
     }
 
+  /* Jobs have moved to new indices */
+  jobpid_rebuild ();
+
   if (ncur != NO_JOB)
     js.j_current = ncur;
   if (nprev != NO_JOB)
@@ -1406,6 +1545,7 @@ delete_job (job_index, dflags)
 	bgp_add (proc->pid, process_exit_status (proc->status));
     }
 
+  jobpid_delete_job (job_index);
   jobs[job_index] = (JOB *)NULL;
   if (temp == js.j_lastmade)
     js.j_lastmade = 0;
@@ -1548,6 +1688,8 @@ append_process (name, pid, status, jid)
     ;
   p->next = t;
   t->next = jobs[jid]->pipe;
+
+  jobpid_add (t, jid);
 }
 
 #if 0
@@ -1759,44 +1901,35 @@ find_process (pid, alive_only, jobp)
 }
 
 /* Return the job index that PID belongs to, or NO_JOB if it doesn't
-   belong to any job.  Must be called with SIGCHLD blocked. */
+   belong to any job.  Must be called with SIGCHLD blocked.  If a recycled
+   PID is in more than one job, return the lowest-numbered one. */
 static int
 find_job (pid, alive_only, procp)
      pid_t pid;
      int alive_only;
      PROCESS **procp;
 {
-  register int i;
+  struct jobpid *jp;
   PROCESS *p;
+  int job;
 
-  /* XXX could use js.j_firstj here, and should check js.j_lastj */
-  for (i = 0; i < js.j_jobslots; i++)
+  job = NO_JOB;
+  p = (PROCESS *)NULL;
+  for (jp = *jobpid_getbucket (pid); jp; jp = jp->next)
     {
-      if (i < js.j_firstj && jobs[i])
-	INTERNAL_DEBUG (("find_job: job %d non-null before js.j_firstj (%d)", i, js.j_firstj));
-      if (i > js.j_lastj && jobs[i])
-	INTERNAL_DEBUG (("find_job: job %d non-null after js.j_lastj (%d)", i, js.j_lastj));
-
-      if (jobs[i])
+      /* Later processes in a pipeline are earlier in the chain */
+      if (jp->pid != pid || (job != NO_JOB && jp->job > job))
+	continue;
+      if ((alive_only == 0 && PRECYCLED(jp->proc) == 0) || PALIVE(jp->proc))
 	{
-	  p = jobs[i]->pipe;
-
-	  do
-	    {
-	      if (p->pid == pid && ((alive_only == 0 && PRECYCLED(p) == 0) || PALIVE(p)))
-		{
-		  if (procp)
-		    *procp = p;
-		  return (i);
-		}
-
-	      p = p->next;
-	    }
-	  while (p != jobs[i]->pipe);
+	  job = jp->job;
+	  p = jp->proc;
 	}
     }
 
-  return (NO_JOB);
+  if (job != NO_JOB && procp)
+    *procp = p;
+  return (job);
 }
 
 /* Find a job given a PID.  If BLOCK is non-zero, block SIGCHLD as
@@ -2199,6 +2332,8 @@ make_child (command, flags)
       set_exit_status (EX_NOEXEC);
       throw_to_top_level ();	/* Reset signals, etc. */
     }
+  else if (pid > 0)
+    PROBE2 (bash, fork, pid, command);
 
   if (pid == 0)
     {
@@ -2219,6 +2354,12 @@ make_child (command, flags)
       unset_bash_input (0);
 #endif /* BUFFERED_INPUT */
 
+#if defined (PIDFD_WAIT)
+      /* The parent's pidfds mean nothing here; drop them before any
+	 redirection in the child can reuse their descriptors. */
+      pidfd_stop ();
+#endif
+
       CLRINTERRUPT;	/* XXX - children have their own interrupt state */
 
       /* Restore top-level signal mask, including unblocking SIGTERM */
@@ -2353,6 +2494,104 @@ make_child (command, flags)
   return (pid);
 }
 
+#if defined (HAVE_POSIX_SPAWN)
+/* Start PATH with ARGV and ENVP as make_child () followed by an exec in
+   the child would, without copying the shell: posix_spawn needs neither
+   the shell's pages nor its page tables.  ACTIONS does to the child's
+   file descriptors what the child would have done.  Only for foreground
+   commands of a shell without job control, since there is no child to
+   set its process group or take the terminal.  Returns -1 with errno
+   set, having changed nothing, if the command could not be started; the
+   caller forks instead and reports the error the usual way. */
+pid_t
+make_child_spawn (command, path, argv, envp, actions)
+     char *command;
+     const char *path;
+     char **argv, **envp;
+     posix_spawn_file_actions_t *actions;
+{
+  posix_spawnattr_t attr;
+  sigset_t set, oset, defaults;
+  pid_t pid;
+  int r;
+
+  /* default_tty_job_signals () gets these right in a forked child, and
+     restore_original_signals () gets trapped ones right */
+  if (job_control || signal_is_trapped (SIGTSTP) || signal_is_trapped (SIGTTIN) || signal_is_trapped (SIGTTOU))
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  get_default_signals (&defaults);
+  if (signal_is_hard_ignored (SIGTSTP) == 0)
+    sigaddset (&defaults, SIGTSTP);
+  if (signal_is_hard_ignored (SIGTTIN) == 0)
+    sigaddset (&defaults, SIGTTIN);
+  if (signal_is_hard_ignored (SIGTTOU) == 0)
+    sigaddset (&defaults, SIGTTOU);
+
+  if ((r = posix_spawnattr_init (&attr)) != 0)
+    {
+      errno = r;
+      return -1;
+    }
+  posix_spawnattr_setsigdefault (&attr, &defaults);
+  posix_spawnattr_setsigmask (&attr, &top_level_mask);
+  posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETSIGMASK);
+
+  /* As in make_child (), and a failed child is reaped by posix_spawn
+     before the SIGCHLD handler can see it */
+  sigemptyset (&set);
+  sigaddset (&set, SIGCHLD);
+  sigaddset (&set, SIGINT);
+  sigaddset (&set, SIGTERM);
+
+  sigemptyset (&oset);
+  sigprocmask (SIG_BLOCK, &set, &oset);
+
+  making_children ();
+
+#if defined (BUFFERED_INPUT)
+  if (default_buffered_input != -1)
+    sync_buffered_stream (default_buffered_input);
+#endif /* BUFFERED_INPUT */
+
+  r = posix_spawn (&pid, path, actions, &attr, argv, envp);
+  posix_spawnattr_destroy (&attr);
+
+  if (r != 0)
+    {
+      sigprocmask (SIG_SETMASK, &oset, (sigset_t *)NULL);
+      errno = r;
+      return -1;
+    }
+
+  if (pipeline_pgrp == 0)
+    pipeline_pgrp = shell_pgrp;
+
+  PROBE3 (bash, spawn, pid, command, path);
+  add_process (command, pid);
+
+#if defined (RECYCLES_PIDS)
+  if (last_asynchronous_pid == pid)
+    last_asynchronous_pid = 1;
+#endif
+
+  delete_old_job (pid);
+  bgp_delete (pid);
+
+  last_made_pid = pid;
+
+  js.c_totforked++;
+  js.c_living++;
+
+  sigprocmask (SIG_SETMASK, &oset, (sigset_t *)NULL);
+
+  return (pid);
+}
+#endif /* HAVE_POSIX_SPAWN */
+
 /* These two functions are called only in child processes. */
 void
 ignore_tty_job_signals ()
@@ -3260,26 +3499,291 @@ wait_for_job (job, flags, ps)
   return r;
 }
 
+#if defined (PIDFD_WAIT)
+/* Once wait -n has been used, the shell watches its running background
+   processes with pidfds in an epoll set, so wait -n can sleep until one
+   of them exits, with a timeout, and learn which one did without calling
+   waitpid on each job.  A pidfd stays readable after its process exits,
+   whoever reaps it, so entries are removed when epoll reports them.  Each
+   entry's event data holds the pid and its slot in pidfd_fds; free slots
+   are chained through pidfd_fds as -2 - next. */
+
+#define PIDFD_MAX	512
+
+static int pidfd_epfd = -1;
+static pid_t pidfd_owner = NO_PID;
+static int pidfd_failed = 0;
+static int pidfd_dropped = 0;	/* exits drained without being reaped */
+static int *pidfd_fds;
+static int pidfd_size, pidfd_nslots, pidfd_nused;
+static int pidfd_free = -1;
+
+#define PIDFD_DATA(pid, slot)	(((uint64_t)(slot) << 32) | (uint32_t)(pid))
+#define PIDFD_PID(d)		((pid_t)(uint32_t)(d))
+#define PIDFD_SLOT(d)		((int)((d) >> 32))
+
+/* Start watching the running background jobs.  Returns 0 on success, -1
+   if pidfds can't be used; the caller falls back to waitpid. */
+static int
+pidfd_start ()
+{
+  int i, fd, nfd;
+
+  if (pidfd_epfd >= 0 && pidfd_owner != getpid ())
+    pidfd_stop ();		/* inherited by a subshell */
+  if (pidfd_epfd >= 0)
+    return 0;
+  if (pidfd_failed)
+    return -1;
+
+  if ((fd = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+    {
+      pidfd_failed = 1;
+      return -1;
+    }
+
+  /* Same as the pidfds: pidfd_stop closes this, so it can't sit on a
+     descriptor the user might redirect. */
+  if (fd < 10)
+    {
+      nfd = fcntl (fd, F_DUPFD, 10);
+      close (fd);
+      if (nfd < 0)
+	{
+	  pidfd_failed = 1;
+	  return -1;
+	}
+      fd = nfd;
+      SET_CLOSE_ON_EXEC (fd);
+    }
+  pidfd_epfd = fd;
+  pidfd_owner = getpid ();
+
+  for (i = 0; i < js.j_jobslots; i++)
+    if (jobs[i] && RUNNING (i) && IS_FOREGROUND (i) == 0)
+      pidfd_watch_job (i);
+
+  return (pidfd_epfd >= 0) ? 0 : -1;
+}
+
+static void
+pidfd_stop ()
+{
+  int i;
+
+  for (i = 0; i < pidfd_nslots; i++)
+    if (pidfd_fds[i] >= 0)
+      close (pidfd_fds[i]);
+  FREE (pidfd_fds);
+  pidfd_fds = (int *)NULL;
+  pidfd_size = pidfd_nslots = pidfd_nused = 0;
+  pidfd_free = -1;
+
+  if (pidfd_epfd >= 0)
+    close (pidfd_epfd);
+  pidfd_epfd = -1;
+  pidfd_owner = NO_PID;
+}
+
+/* Add PID to the epoll set.  If that fails, stop using pidfds for good,
+   since wait -n can't sleep in epoll_wait when some jobs aren't in it. */
+static int
+pidfd_watch (pid)
+     pid_t pid;
+{
+  struct epoll_event ev;
+  int fd, nfd, slot;
+  pid_t pids[16];
+
+  if (pidfd_epfd < 0)
+    return -1;
+  if (pidfd_owner != getpid ())
+    {
+      pidfd_stop ();
+      return -1;
+    }
+
+  /* Make room by dropping processes that have already exited */
+  if (pidfd_nused >= PIDFD_MAX)
+    while (pidfd_wait (pids, 16, 0) > 0)
+      pidfd_dropped = 1;
+  if (pidfd_nused >= PIDFD_MAX)
+    goto fail;
+
+  fd = syscall (SYS_pidfd_open, pid, 0);
+  if (fd < 0 && errno == ESRCH)
+    return 0;		/* already reaped; nothing to wait for */
+  if (fd < 0)
+    goto fail;
+
+  /* Keep it out of the way of user redirections, like other shell fds */
+  if (fd < 10)
+    {
+      nfd = fcntl (fd, F_DUPFD, 10);
+      close (fd);
+      if (nfd < 0)
+	goto fail;
+      fd = nfd;
+      SET_CLOSE_ON_EXEC (fd);
+    }
+
+  if (pidfd_free >= 0)
+    {
+      slot = pidfd_free;
+      pidfd_free = -2 - pidfd_fds[slot];
+    }
+  else
+    {
+      if (pidfd_nslots == pidfd_size)
+	pidfd_fds = (int *)xrealloc (pidfd_fds, (pidfd_size += 32) * sizeof (int));
+      slot = pidfd_nslots++;
+    }
+  pidfd_fds[slot] = fd;
+  pidfd_nused++;
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = PIDFD_DATA (pid, slot);
+  if (epoll_ctl (pidfd_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    goto fail;
+  return 0;
+
+fail:
+  pidfd_stop ();
+  pidfd_failed = 1;
+  return -1;
+}
+
+static void
+pidfd_watch_job (job)
+     int job;
+{
+  PROCESS *p;
+
+  if (pidfd_epfd < 0)
+    return;
+  p = jobs[job]->pipe;
+  do
+    {
+      if (PALIVE (p) && pidfd_watch (p->pid) < 0)
+	return;
+      p = p->next;
+    }
+  while (p != jobs[job]->pipe);
+}
+
+/* Wait up to TIMEOUT milliseconds (-1 means forever) for watched
+   processes to exit, and store up to N of their pids in PIDS.  Returns
+   the number stored, 0 on timeout, or -1 with errno set. */
+static int
+pidfd_wait (pids, n, timeout)
+     pid_t *pids;
+     int n, timeout;
+{
+  struct epoll_event ev[16];
+  int i, r, slot, old_waiting;
+
+  if (n > 16)
+    n = 16;
+
+  /* Let a trapped signal break out of the wait builtin while we sleep, as
+     wait_for does.  The set is level-triggered, so events we lose that
+     way are reported again next time. */
+  old_waiting = waiting_for_child;
+  if (timeout != 0)
+    waiting_for_child = 1;
+  CHECK_WAIT_INTR;
+  r = epoll_wait (pidfd_epfd, ev, n, timeout);
+  waiting_for_child = old_waiting;
+
+  for (i = 0; i < r; i++)
+    {
+      slot = PIDFD_SLOT (ev[i].data.u64);
+      pids[i] = PIDFD_PID (ev[i].data.u64);
+      /* Subshells share the pidfd, so closing it isn't enough */
+      epoll_ctl (pidfd_epfd, EPOLL_CTL_DEL, pidfd_fds[slot], (struct epoll_event *)NULL);
+      close (pidfd_fds[slot]);
+      pidfd_fds[slot] = -2 - pidfd_free;
+      pidfd_free = slot;
+      pidfd_nused--;
+    }
+  return r;
+}
+#endif /* PIDFD_WAIT */
+
+/* Return the number of milliseconds until DEADLINE, 0 if it has passed.
+   A null DEADLINE means no timeout and returns -1. */
+static long
+wait_remaining (deadline)
+     struct timeval *deadline;
+{
+  struct timeval now;
+  long ms;
+
+  if (deadline == 0)
+    return -1;
+  gettimeofday (&now, 0);
+  if (timercmp (&now, deadline, >=))
+    return 0;
+  ms = (deadline->tv_sec - now.tv_sec) * 1000L + (deadline->tv_usec - now.tv_usec + 999) / 1000;
+  return (ms > 0) ? ms : 0;
+}
+
 /* Wait for any background job started by this shell to finish.  Very
    similar to wait_for_background_pids().  Returns the exit status of
-   the next exiting job, -1 if there are no background jobs.  The caller
-   is responsible for translating -1 into the right return value. RPID,
-   if non-null, gets the pid of the job's process leader. */
+   the next exiting job, -1 if there are no background jobs, or -2 if
+   TIMEOUT milliseconds pass first; a TIMEOUT less than 0 means wait as
+   long as it takes.  The caller is responsible for translating -1 into
+   the right return value. PS, if non-null, gets the pid of the job's
+   process leader and its status. */
 int
-wait_for_any_job (flags, ps)
+wait_for_any_job (flags, ps, timeout)
      int flags;
      struct procstat *ps;
+     long timeout;
 {
   pid_t pid;
   int i, r;
   sigset_t set, oset;
+  struct timeval deadline, *dp;
+  long ms;
+#if defined (PIDFD_WAIT)
+  pid_t pids[16];
+  int n, k;
+#endif
 
   if (jobs_list_frozen)
     return -1;
 
-  /* First see if there are any unnotified dead jobs that we can report on */
+  dp = (struct timeval *)NULL;
+  if (timeout >= 0)
+    {
+      gettimeofday (&deadline, 0);
+      deadline.tv_sec += timeout / 1000;
+      deadline.tv_usec += (timeout % 1000) * 1000;
+      if (deadline.tv_usec >= 1000000)
+	{
+	  deadline.tv_sec++;
+	  deadline.tv_usec -= 1000000;
+	}
+      dp = &deadline;
+    }
+
+  /* First see if there are any unnotified dead jobs that we can report on.
+     Start watching the running ones first, so none can die unnoticed
+     between the two. */
   BLOCK_CHILD (set, oset);
-  for (i = 0; i < js.j_jobslots; i++)
+#if defined (PIDFD_WAIT)
+  pidfd_start ();
+  if (pidfd_dropped)
+    {
+      /* Their pidfds are gone, so reap them now or we'd never notice */
+      pidfd_dropped = 0;
+      errno = 0;
+      if (waitchld (ANY_PID, 0) == -1 && errno == ECHILD)
+	mark_all_jobs_as_dead ();
+    }
+#endif
+  for (i = 0; js.j_ndead > 0 && i < js.j_jobslots; i++)
     {
       if ((flags & JWAIT_WAITING) && jobs[i] && IS_WAITING (i) == 0)
 	continue;		/* if we don't want it, skip it */
@@ -3325,8 +3829,55 @@ return_job:
       CHECK_TERMSIG;
       CHECK_WAIT_INTR;
 
+#if defined (PIDFD_WAIT)
+      if (pidfd_start () == 0)
+	{
+	  /* SIGCHLD stays blocked while we sleep so the handler doesn't
+	     reap behind our back; the pidfds tell us who exited, and traps
+	     and interrupts still wake us up. */
+	  ms = wait_remaining (dp);
+	  BLOCK_CHILD (set, oset);
+	  n = pidfd_wait (pids, 16, (ms > INT_MAX) ? INT_MAX : (int)ms);
+	  if (n < 0 && errno != EINTR)
+	    pidfd_stop ();
+	  if (n > 0)
+	    {
+	      errno = 0;
+	      if (waitchld (ANY_PID, 0) == -1 && errno == ECHILD)
+		mark_all_jobs_as_dead ();
+	      for (k = 0; k < n; k++)
+		{
+		  i = find_job (pids[k], 0, NULL);
+		  if (i == NO_JOB || ((flags & JWAIT_WAITING) && IS_WAITING (i) == 0))
+		    continue;
+		  if (DEADJOB (i))
+		    goto return_job;
+		}
+	    }
+	  UNBLOCK_CHILD (oset);
+
+	  if (n == 0 && ms != -1 && wait_remaining (dp) == 0)
+	    return -2;
+	  if (pidfd_epfd >= 0)
+	    continue;
+	}
+#endif
+
       errno = 0;
-      r = wait_for (ANY_PID, 0);	/* special sentinel value for wait_for */
+      if (dp)
+	{
+	  /* Without a way to sleep until a child exits or time runs out,
+	     poll for exited children */
+	  BLOCK_CHILD (set, oset);
+	  r = waitchld (ANY_PID, 0);
+	  UNBLOCK_CHILD (oset);
+	  if (r == 0 && (ms = wait_remaining (dp)) == 0)
+	    return -2;
+	  if (r == 0)
+	    fsleep (0, (ms < 10) ? ms * 1000 : 10000);
+	}
+      else
+	r = wait_for (ANY_PID, 0);	/* special sentinel value for wait_for */
       if (r == -1 && errno == ECHILD)
 	mark_all_jobs_as_dead ();
 	
@@ -3345,6 +3896,54 @@ return_job:
   return -1;
 }
 
+/* Wait for one of the N processes in PIDS to finish.  Each was started
+   by make_child and made into a background job by stop_pipeline; entries
+   that are NO_PID are skipped.  Returns the index of the one that
+   finished, with its exit status in *STATUSP, after deleting its job
+   without notifying the user.  Returns -1 if none of them has a job. */
+int
+wait_for_any_pid (pids, n, statusp)
+     pid_t *pids;
+     int n, *statusp;
+{
+  sigset_t set, oset;
+  int i, job, running, r;
+
+  if (jobs_list_frozen)
+    return -1;
+
+  for (;;)
+    {
+      BLOCK_CHILD (set, oset);
+      for (i = running = 0; i < n; i++)
+	{
+	  if (pids[i] == NO_PID || (job = find_job (pids[i], 0, NULL)) == NO_JOB)
+	    continue;
+	  if (DEADJOB (job))
+	    {
+	      *statusp = job_exit_status (job);
+	      delete_job (job, DEL_NOBGPID);
+	      UNBLOCK_CHILD (oset);
+	      return i;
+	    }
+	  running++;
+	}
+      UNBLOCK_CHILD (oset);
+
+      if (running == 0)
+	return -1;
+
+      QUIT;
+      CHECK_TERMSIG;
+      CHECK_WAIT_INTR;
+
+      errno = 0;
+      r = wait_for (ANY_PID, 0);
+      if (r == -1 && errno == ECHILD)
+	mark_all_jobs_as_dead ();
+    }
+}
+
 /* Print info about dead jobs, and then delete them from the list
    of known jobs.  This does not actually delete jobs when the
    shell is not interactive, because the dead jobs are not marked
@@ -4743,6 +5342,7 @@ delete_all_jobs (running_only)
 	  free ((char *)jobs);
 	  js.j_jobslots = 0;
 	  js.j_firstj = js.j_lastj = js.j_njobs = 0;
+	  jobpid_rebuild ();
 	}
     }
 
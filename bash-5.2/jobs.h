@@ -28,6 +28,10 @@
 
 #include "posixwait.h"
 
+#if defined (HAVE_POSIX_SPAWN)
+#  include <spawn.h>
+#endif
+
 /* Defines controlling the fashion in which jobs are listed. */
 #define JLIST_STANDARD       0
 #define JLIST_LONG	     1
@@ -271,6 +275,9 @@ extern void list_stopped_jobs PARAMS((int));
 extern void list_running_jobs PARAMS((int));
 
 extern pid_t make_child PARAMS((char *, int));
+#if defined (HAVE_POSIX_SPAWN)
+extern pid_t make_child_spawn PARAMS((char *, const char *, char **, char **, posix_spawn_file_actions_t *));
+#endif
 
 extern int get_tty_state PARAMS((void));
 extern int set_tty_state PARAMS((void));
@@ -282,7 +289,8 @@ extern int wait_for_single_pid PARAMS((pid_t, int));
 extern int wait_for_background_pids PARAMS((struct procstat *));
 extern int wait_for PARAMS((pid_t, int));
 extern int wait_for_job PARAMS((int, int, struct procstat *));
-extern int wait_for_any_job PARAMS((int, struct procstat *));
+extern int wait_for_any_job PARAMS((int, struct procstat *, long));
+extern int wait_for_any_pid PARAMS((pid_t *, int, int *));
 
 extern void wait_sigint_cleanup PARAMS((void));
 
@@ -89,6 +89,7 @@ extern int sh_eaccess PARAMS((const char *, int));
 extern char *sh_makepath PARAMS((const char *, const char *, int));
 extern int signal_is_pending PARAMS((int));
 extern void run_pending_traps PARAMS((void));
+extern int patmatch_full PARAMS((char *, char *));
 
 extern int extended_glob;
 
@@ -110,6 +111,16 @@ char *glob_error_return;
 
 static struct globval finddirs_error_return;
 
+/* The literal text a pattern starts and ends with, which any name it
+   matches has to start and end with too */
+struct globlit
+  {
+    char *prefix;
+    int plen;
+    char *suffix;
+    int slen;
+  };
+
 /* Some forward declarations. */
 static int skipname PARAMS((char *, char *, int));
 #if HANDLE_MULTIBYTE
@@ -124,6 +135,9 @@ static void dequote_pathname PARAMS((char *));
 #  define dequote_pathname(p) udequote_pathname(p)
 #endif
 static int glob_testdir PARAMS((char *, int));
+static int glob_testdirent PARAMS((struct dirent *, char *, int));
+static void glob_literals PARAMS((char *, struct globlit *));
+static int glob_literal_reject PARAMS((struct globlit *, char *));
 static char **glob_dir_to_array PARAMS((char *, char **, int));
 
 /* Make sure these names continue to agree with what's in smatch.c */
@@ -589,6 +603,81 @@ glob_testdir (dir, flags)
   return (0);
 }
 
+/* Like glob_testdir, but DP is SUBDIR's entry in its directory, and its
+   file type saves a stat when the system reports one. */
+static int
+glob_testdirent (dp, subdir, flags)
+     struct dirent *dp;
+     char *subdir;
+     int flags;
+{
+#if defined (D_TYPE_AVAILABLE)
+  switch (dp->d_type)
+    {
+    case DT_UNKNOWN:
+      break;
+    case DT_DIR:
+      return (0);
+    case DT_LNK:
+#  if defined (HAVE_LSTAT)
+      if (flags & GX_ALLDIRS)
+	return (-2);
+#  endif
+      break;		/* stat follows the link */
+    default:
+      return (-1);
+    }
+#endif
+  return (glob_testdir (subdir, flags));
+}
+
+/* Find the literal prefix and suffix of PAT, stopping at anything that
+   might be special, and store them in LIT.  Case-insensitive matching
+   compares names differently, so it gets no literals. */
+static void
+glob_literals (pat, lit)
+     char *pat;
+     struct globlit *lit;
+{
+  char *p, *e;
+
+  lit->plen = lit->slen = 0;
+  if (pat == 0 || glob_ignore_case)
+    return;
+
+  for (p = pat; *p && strchr ("*?[\\+@!(", *p) == 0; p++)
+    ;
+  if (*p == 0)		/* no glob characters; not worth it */
+    return;
+  lit->prefix = pat;
+  lit->plen = p - pat;
+
+  for (e = pat + strlen (pat); e > p && strchr ("*?[]\\+@!()", e[-1]) == 0; e--)
+    ;
+  lit->suffix = e;
+  lit->slen = strlen (e);
+}
+
+/* Return 1 if NAME can't match the pattern LIT came from because it
+   doesn't have its literal prefix or suffix. */
+static int
+glob_literal_reject (lit, name)
+     struct globlit *lit;
+     char *name;
+{
+  size_t len;
+
+  if (lit->plen && strncmp (name, lit->prefix, lit->plen) != 0)
+    return 1;
+  if (lit->slen)
+    {
+      len = strlen (name);
+      if (len < lit->plen + lit->slen || memcmp (name + len - lit->slen, lit->suffix, lit->slen) != 0)
+	return 1;
+    }
+  return 0;
+}
+
 /* Recursively scan SDIR for directories matching PAT (PAT is always `**').
    FLAGS is simply passed down to the recursive call to glob_vector.  Returns
    a list of matching directory names.  EP, if non-null, is set to the last
@@ -685,7 +774,7 @@ glob_vector (pat, dir, flags)
   register struct globval *nextlink;
   register char *nextname, *npat, *subdir;
   unsigned int count;
-  int lose, skip, ndirs, isdir, sdlen, add_current, patlen;
+  int lose, skip, ndirs, isdir, sdlen, add_current, patlen, ismatch;
   register char **name_vector;
   register unsigned int i;
   int mflags;		/* Flags passed to strmatch (). */
@@ -694,6 +783,7 @@ glob_vector (pat, dir, flags)
   int nalloca;
   struct globval *firstmalloc, *tmplink;
   char *convfn;
+  struct globlit lit;
 
   lastlink = 0;
   count = lose = skip = add_current = 0;
@@ -818,6 +908,12 @@ glob_vector (pat, dir, flags)
 
       add_current = ((flags & (GX_ALLDIRS|GX_ADDCURDIR)) == (GX_ALLDIRS|GX_ADDCURDIR));
 
+      /* `**' takes every name, so there's nothing to filter with */
+      if (flags & GX_ALLDIRS)
+	lit.plen = lit.slen = 0;
+      else
+	glob_literals (pat, &lit);
+
       /* Scan the directory, finding all names that match	 For each name that matches, allocate a struct globval
 	 on the stack and store the name in it.
 	 Chain those structs together; lastlink is the front of the chain.  */
@@ -856,6 +952,15 @@ glob_vector (pat, dir, flags)
 	  if (skipname (pat, dp->d_name, flags))
 	    continue;
 
+	  /* Weed out names without the pattern's literal prefix or suffix
+	     before doing anything more expensive */
+	  if ((flags & GX_ALLDIRS) == 0)
+	    {
+	      convfn = fnx_fromfs (dp->d_name, D_NAMLEN (dp));
+	      if ((lit.plen || lit.slen) && glob_literal_reject (&lit, convfn))
+		continue;
+	    }
+
 	  /* If we're only interested in directories, don't bother with files */
 	  if (flags & (GX_MATCHDIRS|GX_ALLDIRS))
 	    {
@@ -863,7 +968,7 @@ glob_vector (pat, dir, flags)
 	      if (flags & GX_NULLDIR)
 		pflags |= MP_IGNDOT;
 	      subdir = sh_makepath (dir, dp->d_name, pflags);
-	      isdir = glob_testdir (subdir, flags);
+	      isdir = glob_testdirent (dp, subdir, flags);
 	      if (isdir < 0 && (flags & GX_MATCHDIRS))
 		{
 		  free (subdir);
@@ -920,8 +1025,12 @@ glob_vector (pat, dir, flags)
 	  else if (flags & GX_MATCHDIRS)
 	    free (subdir);
 
-	  convfn = fnx_fromfs (dp->d_name, D_NAMLEN (dp));
-	  if (strmatch (pat, convfn, mflags) != FNM_NOMATCH)
+	  /* Leading periods are all that FNM_PERIOD, FNM_DOTDOT and
+	     FNM_PATHNAME change for a name in a directory, so other names
+	     can use the shell's compiled matchers */
+	  if (glob_ignore_case || *convfn == '.' || (ismatch = patmatch_full (convfn, pat)) < 0)
+	    ismatch = strmatch (pat, convfn, mflags) != FNM_NOMATCH;
+	  if (ismatch)
 	    {
 	      if (nalloca < ALLOCA_MAX)
 		{
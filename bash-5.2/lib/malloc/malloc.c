@@ -60,6 +60,13 @@
 /* SCO 3.2v4 getcwd and possibly other libc routines fail with MEMSCRAMBLE;
    handled by configure. */
 
+/* Define MALLOC_THREADS if threads other than the shell's own call malloc.
+   The free lists are then protected by a single recursive mutex, and each
+   thread keeps a small cache of blocks of each of the smaller sizes that it
+   can allocate from and free to without taking it.  The statistics are
+   updated atomically, so mstats and the tracing and registering facilities
+   keep working. */
+
 #if defined (HAVE_CONFIG_H)
 #  include <config.h>
 #endif /* HAVE_CONFIG_H */
@@ -94,6 +101,10 @@
 #include <sys/mman.h>
 #endif
 
+#if defined (MALLOC_THREADS)
+#  include <pthread.h>
+#endif
+
 /* Define getpagesize () if the system does not.  */
 #ifndef HAVE_GETPAGESIZE
 #  include "getpagesize.h"
@@ -109,6 +120,7 @@
 #ifdef MALLOC_WATCH
 #  include "watch.h"
 #endif
+#include "profile.h"
 
 #ifdef powerof2
 #  undef powerof2
@@ -303,6 +315,51 @@ static const unsigned long binsizes[NBUCKETS] = {
 
 #define MAXALLOC_SIZE	binsizes[NBUCKETS-1]
 
+#if defined (MALLOC_THREADS)
+/* Each thread caches blocks from the buckets below TCACHE_NBUCKETS (up to
+   4096 bytes, none of which lesscore() gives back).  It takes TCACHE_FILL
+   blocks at a time from nextf[] and gives half of them back when it holds
+   more than TCACHE_MAX of a size. */
+#define TCACHE_NBUCKETS	8
+#define TCACHE_FILL	16
+#define TCACHE_MAX	64
+
+#define TCACHE_NONE	0	/* not set up yet */
+#define TCACHE_INIT	1	/* being set up */
+#define TCACHE_ACTIVE	2
+#define TCACHE_DEAD	3	/* thread is exiting */
+
+struct tcache {
+  union mhead *list[TCACHE_NBUCKETS];
+  int count[TCACHE_NBUCKETS];
+  char state;
+  char busy;		/* nonzero while the lists are being changed */
+};
+
+static __thread struct tcache tcache;
+
+/* Protects nextf[], busy[], and everything morecore() and lesscore()
+   change.  It's recursive so a signal handler can call malloc while the
+   thread it interrupted holds it; busy[] keeps them out of each other's
+   way as it always has. */
+static pthread_mutex_t malloc_mutex;
+static pthread_key_t tcache_key;
+static int tcache_keyed;	/* tcache_key exists */
+
+#ifdef MALLOC_STATS
+/* ncached[i] is the number of free blocks of size i in thread caches */
+static int ncached[NBUCKETS];
+#endif
+
+#  define MALLOC_LOCK()		pthread_mutex_lock (&malloc_mutex)
+#  define MALLOC_UNLOCK()	pthread_mutex_unlock (&malloc_mutex)
+#  define MALLOC_STAT_ADD(x, n)	__atomic_fetch_add (&(x), (n), __ATOMIC_RELAXED)
+#else
+#  define MALLOC_LOCK()
+#  define MALLOC_UNLOCK()
+#  define MALLOC_STAT_ADD(x, n)	((x) += (n))
+#endif /* !MALLOC_THREADS */
+
 #if !defined (errno)
 extern int errno;
 #endif
@@ -320,6 +377,9 @@ static void internal_cfree PARAMS((PTR_T, const char *, int, int));
 static PTR_T internal_valloc PARAMS((size_t, const char *, int, int));
 #endif
 static PTR_T internal_remap PARAMS((PTR_T, size_t, int, int));
+#if defined (MALLOC_THREADS)
+static void malloc_threads_init PARAMS((void));
+#endif
 
 #if defined (botch)
 extern void botch ();
@@ -615,7 +675,7 @@ lesscore (nu)			/* give system back some memory */
 #ifdef MALLOC_STATS
   _mstats.nsbrk++;
   _mstats.tsbrk -= siz;
-  _mstats.nlesscore[nu]++;
+  MALLOC_STAT_ADD (_mstats.nlesscore[nu], 1);
 #endif
 }
 #endif /* USE_LESSCORE */
@@ -821,9 +881,162 @@ pagealign ()
       break;
   pagebucket = nunits;
 
+#if defined (MALLOC_THREADS)
+  /* The first malloc happens before there are other threads */
+  malloc_threads_init ();
+#endif
+
   return 0;
 }
-    
+
+#if defined (MALLOC_THREADS)
+static void
+malloc_mutex_init ()
+{
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init (&attr);
+  pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init (&malloc_mutex, &attr);
+  pthread_mutexattr_destroy (&attr);
+}
+
+/* Give the blocks in thread cache TC of size NU back to nextf[NU], the N
+   most recently freed first.  Keeps them if an interrupted call is using
+   nextf[NU]. */
+static void
+tcache_flush (tc, nu, n)
+     struct tcache *tc;
+     int nu, n;
+{
+  union mhead *first, *last;
+  int i;
+
+  first = last = tc->list[nu];
+  for (i = 1; i < n; i++)
+    last = CHAIN (last);
+
+  MALLOC_LOCK ();
+  if (busy[nu] == 0)
+    {
+      busy[nu] = 1;
+      tc->list[nu] = CHAIN (last);
+      tc->count[nu] -= n;
+      CHAIN (last) = nextf[nu];
+      nextf[nu] = first;
+      busy[nu] = 0;
+#ifdef MALLOC_STATS
+      MALLOC_STAT_ADD (ncached[nu], -n);
+#endif
+    }
+  MALLOC_UNLOCK ();
+}
+
+/* Move up to TCACHE_FILL blocks from nextf[NU] to the empty list for NU in
+   thread cache TC, getting more core if there are none. */
+static void
+tcache_fill (tc, nu)
+     struct tcache *tc;
+     int nu;
+{
+  union mhead *p, *last;
+  int n;
+
+  MALLOC_LOCK ();
+  if (busy[nu] == 0)
+    {
+      busy[nu] = 1;
+      if (nu > maxbuck)
+	maxbuck = nu;
+      if (nextf[nu] == 0)
+	morecore (nu);
+
+      last = 0;
+      for (n = 0, p = nextf[nu]; p && n < TCACHE_FILL; n++)
+	{
+	  last = p;
+	  p = CHAIN (p);
+	}
+      if (n > 0)
+	{
+	  CHAIN (last) = 0;
+	  tc->list[nu] = nextf[nu];
+	  tc->count[nu] = n;
+	  nextf[nu] = p;
+#ifdef MALLOC_STATS
+	  MALLOC_STAT_ADD (ncached[nu], n);
+#endif
+	}
+      busy[nu] = 0;
+    }
+  MALLOC_UNLOCK ();
+}
+
+/* Destructor for tcache_key: an exiting thread gives its cache back */
+static void
+tcache_release (arg)
+     void *arg;
+{
+  struct tcache *tc;
+  int i;
+
+  tc = (struct tcache *)arg;
+  tc->state = TCACHE_DEAD;
+  for (i = 0; i < TCACHE_NBUCKETS; i++)
+    if (tc->count[i] > 0)
+      tcache_flush (tc, i, tc->count[i]);
+}
+
+/* Return the calling thread's cache, or NULL if it can't use one now:
+   while it's being changed, which means this is a signal handler calling
+   malloc, while it's being set up, and once the thread is exiting. */
+static struct tcache *
+tcache_get ()
+{
+  struct tcache *tc;
+
+  tc = &tcache;
+  if (tc->state == TCACHE_ACTIVE)
+    return (tc->busy ? (struct tcache *)NULL : tc);
+  if (tc->state != TCACHE_NONE || tcache_keyed == 0)
+    return ((struct tcache *)NULL);
+
+  tc->state = TCACHE_INIT;
+  tc->state = (pthread_setspecific (tcache_key, tc) == 0) ? TCACHE_ACTIVE : TCACHE_DEAD;
+  return (tc->state == TCACHE_ACTIVE ? tc : (struct tcache *)NULL);
+}
+
+static void
+malloc_atfork_prepare ()
+{
+  MALLOC_LOCK ();
+}
+
+static void
+malloc_atfork_parent ()
+{
+  MALLOC_UNLOCK ();
+}
+
+/* The child's only thread holds the lock, but under a thread id that no
+   longer exists, so start over with a new one.  The caches of the threads
+   that didn't come along are lost. */
+static void
+malloc_atfork_child ()
+{
+  malloc_mutex_init ();
+}
+
+/* The mutex has to work before anything here can call malloc again */
+static void
+malloc_threads_init ()
+{
+  malloc_mutex_init ();
+  pthread_atfork (malloc_atfork_prepare, malloc_atfork_parent, malloc_atfork_child);
+  tcache_keyed = pthread_key_create (&tcache_key, tcache_release) == 0;
+}
+#endif /* MALLOC_THREADS */
+
 static PTR_T
 internal_malloc (n, file, line, flags)		/* get a block */
      size_t n;
@@ -835,6 +1048,9 @@ internal_malloc (n, file, line, flags)		/* get a block */
   register char *m, *z;
   MALLOC_SIZE_T nbytes;
   mguard_t mg;
+#if defined (MALLOC_THREADS)
+  struct tcache *tc;
+#endif
 
   /* Get the system page size and align break pointer so future sbrks will
      be page-aligned.  The page size must be at least 1K -- anything
@@ -861,6 +1077,29 @@ internal_malloc (n, file, line, flags)		/* get a block */
   if (nunits >= NBUCKETS)
     return ((PTR_T) NULL);
 
+#if defined (MALLOC_THREADS)
+  /* Small blocks come from this thread's cache if it can use it */
+  if (nunits < TCACHE_NBUCKETS && (tc = tcache_get ()))
+    {
+      tc->busy = 1;
+      if (tc->list[nunits] == 0)
+	tcache_fill (tc, nunits);
+      if (p = tc->list[nunits])
+	{
+	  tc->list[nunits] = CHAIN (p);
+	  tc->count[nunits]--;
+#ifdef MALLOC_STATS
+	  MALLOC_STAT_ADD (ncached[nunits], -1);
+#endif
+	}
+      tc->busy = 0;
+      if (p)
+	goto got_block;
+    }
+#endif
+
+  MALLOC_LOCK ();
+
   /* In case this is reentrant use of malloc from signal handler,
      pick a block size that no other malloc level is currently
      trying to allocate.  That's the easiest harmless way not to
@@ -882,11 +1121,18 @@ internal_malloc (n, file, line, flags)		/* get a block */
   if ((p = nextf[nunits]) == NULL)
     {
       busy[nunits] = 0;
+      MALLOC_UNLOCK ();
       return NULL;
     }
   nextf[nunits] = CHAIN (p);
   busy[nunits] = 0;
 
+  MALLOC_UNLOCK ();
+
+#if defined (MALLOC_THREADS)
+got_block:
+#endif
+
   /* Check for free block clobbered */
   /* If not for this check, we would gobble a clobbered free chain ptr
      and bomb out on the NEXT allocate of this size block */
@@ -912,10 +1158,10 @@ internal_malloc (n, file, line, flags)		/* get a block */
     MALLOC_MEMSET ((char *)(p + 1), 0xdf, n);	/* scramble previous contents */
 #endif
 #ifdef MALLOC_STATS
-  _mstats.nmalloc[nunits]++;
-  _mstats.tmalloc[nunits]++;
-  _mstats.nmal++;
-  _mstats.bytesreq += n;
+  MALLOC_STAT_ADD (_mstats.nmalloc[nunits], 1);
+  MALLOC_STAT_ADD (_mstats.tmalloc[nunits], 1);
+  MALLOC_STAT_ADD (_mstats.nmal, 1);
+  MALLOC_STAT_ADD (_mstats.bytesreq, n);
 #endif /* MALLOC_STATS */
 
 #ifdef MALLOC_TRACE
@@ -927,14 +1173,25 @@ internal_malloc (n, file, line, flags)		/* get a block */
 
 #ifdef MALLOC_REGISTER
   if (malloc_register && (flags & MALLOC_NOREG) == 0)
-    mregister_alloc ("malloc", p + 1, n, file, line);
+    {
+      MALLOC_LOCK ();
+      mregister_alloc ("malloc", p + 1, n, file, line);
+      MALLOC_UNLOCK ();
+    }
 #endif
 
 #ifdef MALLOC_WATCH
   if (_malloc_nwatch > 0)
-    _malloc_ckwatch (p + 1, file, line, W_ALLOC, n);
+    {
+      MALLOC_LOCK ();
+      _malloc_ckwatch (p + 1, file, line, W_ALLOC, n);
+      MALLOC_UNLOCK ();
+    }
 #endif
 
+  if (malloc_profile_interval)
+    mprofile_alloc (p + 1, n, file, line);
+
 #if defined (MALLOC_DEBUG)
   z = (char *) (p + 1);
   /* Check alignment of returned pointer */
@@ -958,6 +1215,9 @@ internal_free (mem, file, line, flags)
   register MALLOC_SIZE_T nbytes;
   MALLOC_SIZE_T ubytes;		/* caller-requested size */
   mguard_t mg;
+#if defined (MALLOC_THREADS)
+  struct tcache *tc;
+#endif
 
   if ((ap = (char *)mem) == 0)
     return;
@@ -1015,17 +1275,45 @@ internal_free (mem, file, line, flags)
   if (mg.i != p->mh_nbytes)
     xbotch (mem, ERR_ASSERT_FAILED, _("free: start and end chunk sizes differ"), file, line);
 
+  /* Before another thread can be handed the block */
+  if (_mprofile_nlive)
+    mprofile_free ((PTR_T)(p + 1));
+
 #if defined (USE_MMAP)
   if (nunits > malloc_mmap_threshold)
     {
       munmap (p, binsize (nunits));
 #if defined (MALLOC_STATS)
-      _mstats.nlesscore[nunits]++;
+      MALLOC_STAT_ADD (_mstats.nlesscore[nunits], 1);
+#endif
+      goto free_return;
+    }
+#endif
+
+#if defined (MALLOC_THREADS)
+  /* Small blocks go back to this thread's cache if it can use it */
+  if (nunits < TCACHE_NBUCKETS && (tc = tcache_get ()))
+    {
+#ifdef MEMSCRAMBLE
+      if (p->mh_nbytes)
+	MALLOC_MEMSET (mem, 0xcf, p->mh_nbytes);
+#endif
+      tc->busy = 1;
+      p->mh_alloc = ISFREE;
+      CHAIN (p) = tc->list[nunits];
+      tc->list[nunits] = p;
+#ifdef MALLOC_STATS
+      MALLOC_STAT_ADD (ncached[nunits], 1);
 #endif
+      if (++tc->count[nunits] > TCACHE_MAX)
+	tcache_flush (tc, nunits, TCACHE_MAX / 2);
+      tc->busy = 0;
       goto free_return;
     }
 #endif
 
+  MALLOC_LOCK ();
+
 #if defined (USE_LESSCORE)
   /* We take care of the mmap case and munmap above */
   if (nunits >= LESSCORE_MIN && ((char *)p + binsize(nunits) == memtop))
@@ -1038,7 +1326,7 @@ internal_free (mem, file, line, flags)
 	{
 	  lesscore (nunits);
 	  /* keeps the tracing and registering code in one place */
-	  goto free_return;
+	  goto free_unlock;
 	}
     }
 #endif /* USE_LESSCORE */
@@ -1053,7 +1341,7 @@ internal_free (mem, file, line, flags)
   if (busy[nunits] == 1)
     {
       xsplit (p, nunits);	/* split block and add to different chain */
-      goto free_return;
+      goto free_unlock;
     }
 
   p->mh_alloc = ISFREE;
@@ -1064,12 +1352,15 @@ internal_free (mem, file, line, flags)
   nextf[nunits] = p;
   busy[nunits] = 0;
 
+free_unlock:
+  MALLOC_UNLOCK ();
+
 free_return:
   ;		/* Empty statement in case this is the end of the function */
 
 #ifdef MALLOC_STATS
-  _mstats.nmalloc[nunits]--;
-  _mstats.nfre++;
+  MALLOC_STAT_ADD (_mstats.nmalloc[nunits], -1);
+  MALLOC_STAT_ADD (_mstats.nfre, 1);
 #endif /* MALLOC_STATS */
 
 #ifdef MALLOC_TRACE
@@ -1081,12 +1372,20 @@ free_return:
 
 #ifdef MALLOC_REGISTER
   if (malloc_register && (flags & MALLOC_NOREG) == 0)
-    mregister_free (mem, ubytes, file, line);
+    {
+      MALLOC_LOCK ();
+      mregister_free (mem, ubytes, file, line);
+      MALLOC_UNLOCK ();
+    }
 #endif
 
 #ifdef MALLOC_WATCH
   if (_malloc_nwatch > 0)
-    _malloc_ckwatch (mem, file, line, W_FREE, ubytes);
+    {
+      MALLOC_LOCK ();
+      _malloc_ckwatch (mem, file, line, W_FREE, ubytes);
+      MALLOC_UNLOCK ();
+    }
 #endif
 }
 
@@ -1118,9 +1417,11 @@ internal_remap (mem, n, nunits, flags)
 
   nbytes = ALLOCATED_BYTES(n);
 
+  MALLOC_LOCK ();
   busy[nunits] = 1;
   np = (union mhead *)mremap (p, binsize (p->mh_index), binsize (nunits), MREMAP_MAYMOVE);
   busy[nunits] = 0;
+  MALLOC_UNLOCK ();
   if (np == MAP_FAILED)
     return (PTR_T)NULL;
 
@@ -1157,7 +1458,7 @@ internal_realloc (mem, n, file, line, flags)
   mguard_t mg;
 
 #ifdef MALLOC_STATS
-  _mstats.nrealloc++;
+  MALLOC_STAT_ADD (_mstats.nrealloc, 1);
 #endif
 
   if (n == 0)
@@ -1207,10 +1508,14 @@ internal_realloc (mem, n, file, line, flags)
 
 #ifdef MALLOC_WATCH
   if (_malloc_nwatch > 0)
-    _malloc_ckwatch (p + 1, file, line, W_REALLOC, n);
+    {
+      MALLOC_LOCK ();
+      _malloc_ckwatch (p + 1, file, line, W_REALLOC, n);
+      MALLOC_UNLOCK ();
+    }
 #endif
 #ifdef MALLOC_STATS
-  _mstats.bytesreq += (n < tocopy) ? 0 : n - tocopy;
+  MALLOC_STAT_ADD (_mstats.bytesreq, (n < tocopy) ? 0 : n - tocopy);
 #endif
 
   /* If we're reallocating to the same size as previously, return now */
@@ -1244,7 +1549,7 @@ internal_realloc (mem, n, file, line, flags)
     tocopy = n;
 
 #ifdef MALLOC_STATS
-  _mstats.nrcopy++;
+  MALLOC_STAT_ADD (_mstats.nrcopy, 1);
 #endif
 
 #if USE_MREMAP == 1
@@ -1263,6 +1568,8 @@ internal_realloc (mem, n, file, line, flags)
       m = internal_remap (mem, n, newunits, MALLOC_INTERNAL);
       if (m == 0)
         return 0;
+      if (m != mem && _mprofile_nlive)
+	mprofile_move (mem, m);
     }
   else
 #endif /* USE_MREMAP */
@@ -1282,12 +1589,20 @@ internal_realloc (mem, n, file, line, flags)
 
 #ifdef MALLOC_REGISTER
   if (malloc_register && (flags & MALLOC_NOREG) == 0)
-    mregister_alloc ("realloc", m, n, file, line);
+    {
+      MALLOC_LOCK ();
+      mregister_alloc ("realloc", m, n, file, line);
+      MALLOC_UNLOCK ();
+    }
 #endif
 
 #ifdef MALLOC_WATCH
   if (_malloc_nwatch > 0)
-    _malloc_ckwatch (m, file, line, W_RESIZED, n);
+    {
+      MALLOC_LOCK ();
+      _malloc_ckwatch (m, file, line, W_RESIZED, n);
+      MALLOC_UNLOCK ();
+    }
 #endif
 
   return m;
@@ -1336,6 +1651,7 @@ posix_memalign (memptr, alignment, size)
   else if (powerof2 (alignment) == 0)
     return EINVAL;
 
+  MPROFILE_CALLER ();
   mem = internal_memalign (alignment, size, (char *)0, 0, 0);
   if (mem != 0)
     {
@@ -1421,8 +1737,13 @@ malloc_free_blocks (size)
   register union mhead *p;
 
   nfree = 0;
+  MALLOC_LOCK ();
   for (p = nextf[size]; p; p = CHAIN (p))
     nfree++;
+  MALLOC_UNLOCK ();
+#if defined (MALLOC_THREADS)
+  nfree += __atomic_load_n (&ncached[size], __ATOMIC_RELAXED);
+#endif
 
   return nfree;
 }
@@ -1506,6 +1827,7 @@ PTR_T
 malloc (size)
      size_t size;
 {
+  MPROFILE_CALLER ();
   return internal_malloc (size, (char *)NULL, 0, 0);
 }
 
@@ -1514,6 +1836,7 @@ realloc (mem, nbytes)
      PTR_T mem;
      size_t nbytes;
 {
+  MPROFILE_CALLER ();
   return internal_realloc (mem, nbytes, (char *)NULL, 0, 0);
 }
 
@@ -1529,6 +1852,7 @@ memalign (alignment, size)
      size_t alignment;
      size_t size;
 {
+  MPROFILE_CALLER ();
   return internal_memalign (alignment, size, (char *)NULL, 0, 0);
 }
 
@@ -1537,6 +1861,7 @@ PTR_T
 valloc (size)
      size_t size;
 {
+  MPROFILE_CALLER ();
   return internal_valloc (size, (char *)NULL, 0, 0);
 }
 #endif
@@ -1546,6 +1871,7 @@ PTR_T
 calloc (n, s)
      size_t n, s;
 {
+  MPROFILE_CALLER ();
   return internal_calloc (n, s, (char *)NULL, 0, 0);
 }
 
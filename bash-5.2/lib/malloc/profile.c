@@ -0,0 +1,403 @@
+/* profile.c - sampling allocation profiler for malloc */
+
+/*  Copyright (C) 2024 Free Software Foundation, Inc.
+
+    This file is part of GNU Bash, the Bourne-Again SHell.
+
+   Bash is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Bash is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Bash.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined (MALLOC_THREADS)
+#  include <pthread.h>
+#endif
+
+#include "imalloc.h"
+#include "profile.h"
+
+/* Unlike the statistics and tables, this is cheap enough to be compiled
+   into every shell.  Each thread counts down the bytes it allocates and
+   samples the allocation that takes the count past zero, so a block of N
+   bytes is sampled with probability about N / malloc_profile_interval.
+   Samples are totalled by allocation site, and remembered by address
+   until they're freed so the site's live bytes go down again.  Nothing
+   here calls malloc: the tables are static, and only touched once
+   profiling starts. */
+
+#define MPROFILE_SITES	1024		/* power of 2 */
+#define MPROFILE_LIVE	16384		/* power of 2 */
+#define MPROFILE_FILTER	4096		/* power of 2 */
+
+/* Sampled blocks, by address */
+struct mprofile_live {
+  PTR_T mem;
+  int site;
+  unsigned long count;		/* blocks and bytes the sample stands for */
+  unsigned long bytes;
+};
+
+long malloc_profile_interval = 0;
+const char *(*malloc_profile_context) PARAMS((void)) = 0;
+
+int _mprofile_nlive = 0;
+MPROFILE_TLS PTR_T _mprofile_caller;
+
+/* The last entry collects sites that don't fit in the table */
+static struct mprofile_site sites[MPROFILE_SITES + 1];
+static int nsites;
+
+static struct mprofile_live live[MPROFILE_LIVE];
+static unsigned long dropped;	/* samples there was no room to remember */
+
+/* filter[i] counts the live samples whose addresses hash to I, so free
+   can tell without locking that a block wasn't sampled */
+static unsigned short filter[MPROFILE_FILTER];
+
+static MPROFILE_TLS long countdown;
+static MPROFILE_TLS unsigned int seed;
+static MPROFILE_TLS int busy;	/* a signal handler interrupted us */
+
+#if defined (MALLOC_THREADS)
+static pthread_mutex_t mprofile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define MPROFILE_LOCK()	pthread_mutex_lock (&mprofile_mutex)
+#  define MPROFILE_UNLOCK()	pthread_mutex_unlock (&mprofile_mutex)
+#  define MPROFILE_LOAD(x)	__atomic_load_n (&(x), __ATOMIC_RELAXED)
+#else
+#  define MPROFILE_LOCK()
+#  define MPROFILE_UNLOCK()
+#  define MPROFILE_LOAD(x)	(x)
+#endif
+
+#define ADDR_BITS(mem)		((unsigned long)(mem) >> 4)
+#define FILTER_INDEX(mem) \
+  ((ADDR_BITS (mem) ^ (ADDR_BITS (mem) >> 12)) & (MPROFILE_FILTER - 1))
+#define LIVE_INDEX(mem) \
+  ((unsigned int)(ADDR_BITS (mem) * 2654435761UL) & (MPROFILE_LIVE - 1))
+
+/* The number of bytes until the next sample: INTERVAL on average, but not
+   exactly, so allocation patterns that repeat with the same period aren't
+   always sampled at the same point */
+static long
+next_countdown (interval)
+     long interval;
+{
+  if (seed == 0)
+    seed = (unsigned int)(unsigned long)&seed | 1;
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return (interval / 2 + (long)(seed % (unsigned long)interval));
+}
+
+static int
+find_site (file, line, caller, context)
+     const char *file;
+     int line;
+     PTR_T caller;
+     const char *context;
+{
+  unsigned long h;
+  const char *s;
+  int i, n;
+
+  h = (unsigned long)file ^ ((unsigned long)line * 31) ^ (unsigned long)caller;
+  for (s = context; *s; s++)
+    h = h * 33 + (unsigned char)*s;
+  h ^= h >> 16;
+
+  for (n = 0, i = h & (MPROFILE_SITES - 1); n < MPROFILE_SITES; n++, i = (i + 1) & (MPROFILE_SITES - 1))
+    {
+      if (sites[i].samples == 0)
+	{
+	  /* Keep the table no more than 7/8 full so misses stay short */
+	  if (nsites >= MPROFILE_SITES - MPROFILE_SITES / 8)
+	    break;
+	  sites[i].file = file;
+	  sites[i].line = line;
+	  sites[i].caller = caller;
+	  strncpy (sites[i].context, context, MPROFILE_CONTEXT_MAX - 1);
+	  nsites++;
+	  return i;
+	}
+      if (sites[i].file == file && sites[i].line == line && sites[i].caller == caller &&
+	  strncmp (sites[i].context, context, MPROFILE_CONTEXT_MAX - 1) == 0)
+	return i;
+    }
+
+  if (sites[MPROFILE_SITES].samples == 0)
+    strcpy (sites[MPROFILE_SITES].context, "[other]");
+  return MPROFILE_SITES;
+}
+
+static int
+find_live (mem)
+     PTR_T mem;
+{
+  int i;
+
+  for (i = LIVE_INDEX (mem); live[i].mem; i = (i + 1) & (MPROFILE_LIVE - 1))
+    if (live[i].mem == mem)
+      return i;
+  return -1;
+}
+
+/* Remove live[I], moving later entries of its probe sequence up so no
+   search stops short at the hole */
+static void
+remove_live (i)
+     int i;
+{
+  int j, k;
+
+  filter[FILTER_INDEX (live[i].mem)]--;
+  _mprofile_nlive--;
+
+  j = i;
+  for (;;)
+    {
+      live[i].mem = 0;
+      do
+	{
+	  j = (j + 1) & (MPROFILE_LIVE - 1);
+	  if (live[j].mem == 0)
+	    return;
+	  k = LIVE_INDEX (live[j].mem);
+	}
+      while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+      live[i] = live[j];
+      i = j;
+    }
+}
+
+static int
+add_live (mem, site, count, bytes)
+     PTR_T mem;
+     int site;
+     unsigned long count, bytes;
+{
+  int i;
+
+  /* A block the profiler missed being freed, now handed out again */
+  if ((i = find_live (mem)) >= 0)
+    {
+      sites[live[i].site].nlive -= live[i].count;
+      sites[live[i].site].blive -= live[i].bytes;
+      remove_live (i);
+    }
+
+  if (_mprofile_nlive >= MPROFILE_LIVE - MPROFILE_LIVE / 4)
+    {
+      dropped++;
+      return 0;
+    }
+
+  for (i = LIVE_INDEX (mem); live[i].mem; i = (i + 1) & (MPROFILE_LIVE - 1))
+    ;
+  live[i].mem = mem;
+  live[i].site = site;
+  live[i].count = count;
+  live[i].bytes = bytes;
+  filter[FILTER_INDEX (mem)]++;
+  _mprofile_nlive++;
+  return 1;
+}
+
+/* Called by malloc for every block while profiling */
+void
+mprofile_alloc (mem, n, file, line)
+     PTR_T mem;
+     size_t n;
+     const char *file;
+     int line;
+{
+  struct mprofile_site *s;
+  const char *context;
+  PTR_T caller;
+  long interval;
+  unsigned long count, bytes;
+
+  caller = _mprofile_caller;
+  _mprofile_caller = 0;
+
+  interval = malloc_profile_interval;
+  if (interval <= 0 || busy)
+    return;
+  if (seed == 0)		/* this thread's first allocation */
+    countdown = next_countdown (interval);
+  if ((countdown -= (long)n) > 0)
+    return;
+
+  /* The sample stands for an interval's worth of bytes for each sampling
+     point the block covers, which makes the byte totals unbiased */
+  for (bytes = 0; countdown <= 0; bytes += interval)
+    countdown += next_countdown (interval);
+  count = (n && bytes > n) ? bytes / n : 1;
+
+  busy = 1;
+  context = malloc_profile_context ? (*malloc_profile_context) () : (const char *)0;
+  if (context == 0)
+    context = "";
+  if (file)
+    caller = 0;
+
+  MPROFILE_LOCK ();
+  s = sites + find_site (file, line, caller, context);
+  s->samples++;
+  s->nalloc += count;
+  s->balloc += bytes;
+  if (add_live (mem, s - sites, count, bytes))
+    {
+      s->nlive += count;
+      s->blive += bytes;
+    }
+  MPROFILE_UNLOCK ();
+  busy = 0;
+}
+
+/* Called by free, before MEM can be allocated again, while any sample is
+   live */
+void
+mprofile_free (mem)
+     PTR_T mem;
+{
+  struct mprofile_live *l;
+  int i;
+
+  if (MPROFILE_LOAD (filter[FILTER_INDEX (mem)]) == 0 || busy)
+    return;
+
+  busy = 1;
+  MPROFILE_LOCK ();
+  if ((i = find_live (mem)) >= 0)
+    {
+      l = live + i;
+      sites[l->site].nlive -= l->count;
+      sites[l->site].blive -= l->bytes;
+      remove_live (i);
+    }
+  MPROFILE_UNLOCK ();
+  busy = 0;
+}
+
+/* Realloc moved a block without going through malloc and free */
+void
+mprofile_move (mem, nmem)
+     PTR_T mem;
+     PTR_T nmem;
+{
+  struct mprofile_live l;
+  int i;
+
+  if (MPROFILE_LOAD (filter[FILTER_INDEX (mem)]) == 0 || busy)
+    return;
+
+  busy = 1;
+  MPROFILE_LOCK ();
+  if ((i = find_live (mem)) >= 0)
+    {
+      l = live[i];
+      remove_live (i);
+      if (add_live (nmem, l.site, l.count, l.bytes) == 0)
+	{
+	  sites[l.site].nlive -= l.count;
+	  sites[l.site].blive -= l.bytes;
+	}
+    }
+  MPROFILE_UNLOCK ();
+  busy = 0;
+}
+
+#if defined (MALLOC_THREADS)
+/* Another thread might have held the lock when this one forked */
+static void
+mprofile_atfork_child ()
+{
+  pthread_mutex_init (&mprofile_mutex, (pthread_mutexattr_t *)NULL);
+}
+#endif
+
+/* Start sampling an average of once every INTERVAL bytes, or
+   MPROFILE_INTERVAL if INTERVAL is 0 or less.  Sites already seen keep
+   their totals. */
+int
+malloc_profile_start (interval)
+     long interval;
+{
+#if defined (MALLOC_THREADS)
+  static int registered = 0;
+
+  if (registered == 0)
+    {
+      pthread_atfork ((void (*) PARAMS((void)))NULL, (void (*) PARAMS((void)))NULL, mprofile_atfork_child);
+      registered = 1;
+    }
+#endif
+
+  malloc_profile_interval = (interval > 0) ? interval : MPROFILE_INTERVAL;
+  return 0;
+}
+
+/* Stop taking samples.  Blocks already sampled are still followed, so
+   live bytes keep going down as they're freed. */
+void
+malloc_profile_stop ()
+{
+  malloc_profile_interval = 0;
+}
+
+void
+malloc_profile_reset ()
+{
+  MPROFILE_LOCK ();
+  memset (sites, 0, sizeof (sites));
+  memset (live, 0, sizeof (live));
+  memset (filter, 0, sizeof (filter));
+  nsites = 0;
+  _mprofile_nlive = 0;
+  dropped = 0;
+  MPROFILE_UNLOCK ();
+}
+
+/* Copy up to N sites with samples into SITEP, in no particular order, and
+   return how many were copied.  With a null SITEP, just count them. */
+int
+malloc_profile_sites (sitep, n)
+     struct mprofile_site *sitep;
+     int n;
+{
+  int i, r;
+
+  MPROFILE_LOCK ();
+  for (i = r = 0; i <= MPROFILE_SITES; i++)
+    if (sites[i].samples && (sitep == 0 || r < n))
+      {
+	if (sitep)
+	  sitep[r] = sites[i];
+	r++;
+      }
+  MPROFILE_UNLOCK ();
+  return r;
+}
+
+unsigned long
+malloc_profile_dropped ()
+{
+  return dropped;
+}
@@ -0,0 +1,99 @@
+/* profile.h - definitions for the sampling allocation profiler */
+
+/*  Copyright (C) 2024 Free Software Foundation, Inc.
+
+    This file is part of GNU Bash, the Bourne-Again SHell.
+
+   Bash is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Bash is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Bash.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Must be included *after* config.h */
+
+#ifndef _MPROFILE_H
+#define _MPROFILE_H
+
+#ifndef PARAMS
+#  if defined (__STDC__) || defined (__GNUC__) || defined (__cplusplus)
+#    define PARAMS(protos) protos
+#  else
+#    define PARAMS(protos) ()
+#  endif
+#endif
+
+#ifndef PTR_T
+#  if defined (__STDC__)
+#    define PTR_T void *
+#  else
+#    define PTR_T char *
+#  endif
+#endif
+
+#if defined (MALLOC_THREADS)
+#  define MPROFILE_TLS	__thread
+#else
+#  define MPROFILE_TLS
+#endif
+
+#define MPROFILE_INTERVAL	(512 * 1024)	/* default bytes between samples */
+#define MPROFILE_CONTEXT_MAX	32
+
+/* What the profiler knows about one allocation site: a FILE and LINE for
+   the shell's own allocations, which go through the sh_ wrappers, or the
+   CALLER's return address for everything else, in one shell CONTEXT.
+   NALLOC and BALLOC estimate the blocks and bytes allocated there since
+   profiling started, and NLIVE and BLIVE how many of them are still
+   allocated; each sample stands for an average of malloc_profile_interval
+   bytes of allocation. */
+struct mprofile_site {
+  const char *file;
+  int line;
+  PTR_T caller;
+  char context[MPROFILE_CONTEXT_MAX];
+  unsigned long samples;
+  unsigned long nalloc;
+  unsigned long balloc;
+  unsigned long nlive;
+  unsigned long blive;
+};
+
+/* Nonzero while sampling; the average number of bytes between samples */
+extern long malloc_profile_interval;
+
+/* If set, called when an allocation is sampled to describe what the
+   calling thread is doing.  It must not allocate memory. */
+extern const char *(*malloc_profile_context) PARAMS((void));
+
+extern int malloc_profile_start PARAMS((long));
+extern void malloc_profile_stop PARAMS((void));
+extern void malloc_profile_reset PARAMS((void));
+extern int malloc_profile_sites PARAMS((struct mprofile_site *, int));
+extern unsigned long malloc_profile_dropped PARAMS((void));
+
+/* The rest is for malloc.c */
+extern int _mprofile_nlive;
+extern MPROFILE_TLS PTR_T _mprofile_caller;
+
+extern void mprofile_alloc PARAMS((PTR_T, size_t, const char *, int));
+extern void mprofile_free PARAMS((PTR_T));
+extern void mprofile_move PARAMS((PTR_T, PTR_T));
+
+/* The public malloc entry points note who called them */
+#if defined (__GNUC__)
+#  define MPROFILE_CALLER() \
+  do { if (malloc_profile_interval) _mprofile_caller = __builtin_return_address (0); } while (0)
+#else
+#  define MPROFILE_CALLER()
+#endif
+
+#endif /* _MPROFILE_H */
@@ -1320,7 +1320,7 @@ compute_lcd_of_matches (char **match_list, int matches, const char *text)
   int lx;
   char *dtext;		/* dequoted TEXT, if needed */
 #if defined (HANDLE_MULTIBYTE)
-  int v;
+  int v, mb_cur_max;
   size_t v1, v2;
   mbstate_t ps1, ps2;
   WCHAR_T wc1, wc2;
@@ -1336,16 +1336,21 @@ compute_lcd_of_matches (char **match_list, int matches, const char *text)
       return 1;
     }
 
-  for (i = 1, low = 100000; i < matches; i++)
+  /* Nothing past the shortest common prefix found so far can matter, so
+     don't compare past it, and stop once there is no common prefix */
+#if defined (HANDLE_MULTIBYTE)
+  mb_cur_max = MB_CUR_MAX;
+#endif
+  for (i = 1, low = 100000; i < matches && low > 0; i++)
     {
 #if defined (HANDLE_MULTIBYTE)
-      if (MB_CUR_MAX > 1 && rl_byte_oriented == 0)
+      if (mb_cur_max > 1 && rl_byte_oriented == 0)
 	{
 	  memset (&ps1, 0, sizeof (mbstate_t));
 	  memset (&ps2, 0, sizeof (mbstate_t));
 	}
 #endif
-      for (si = 0; (c1 = match_list[i][si]) && (c2 = match_list[i + 1][si]); si++)
+      for (si = 0; si < low && (c1 = match_list[i][si]) && (c2 = match_list[i + 1][si]); si++)
 	{
 	    if (_rl_completion_case_fold)
 	      {
@@ -1353,10 +1358,10 @@ compute_lcd_of_matches (char **match_list, int matches, const char *text)
 	        c2 = _rl_to_lower (c2);
 	      }
 #if defined (HANDLE_MULTIBYTE)
-	    if (MB_CUR_MAX > 1 && rl_byte_oriented == 0)
+	    if (mb_cur_max > 1 && rl_byte_oriented == 0)
 	      {
-		v1 = MBRTOWC (&wc1, match_list[i]+si, strlen (match_list[i]+si), &ps1);
-		v2 = MBRTOWC (&wc2, match_list[i+1]+si, strlen (match_list[i+1]+si), &ps2);
+		v1 = MBRTOWC (&wc1, match_list[i]+si, mb_cur_max, &ps1);
+		v2 = MBRTOWC (&wc2, match_list[i+1]+si, mb_cur_max, &ps2);
 		if (MB_INVALIDCH (v1) || MB_INVALIDCH (v2))
 		  {
 		    if (c1 != c2)	/* do byte comparison */
@@ -1690,6 +1695,8 @@ display_matches (char **matches)
   int len, max, i;
   char *temp;
 
+  _rl_erase_hint ();
+
   /* Move to the last visible line of a possibly-multiple-line command. */
   _rl_move_vert (_rl_vis_botlin);
 
@@ -2236,9 +2243,11 @@ rl_completion_matches (const char *text, rl_compentry_func_t *entry_function)
 	  RL_CHECK_SIGNALS ();
 	}
 
+      /* Double the list so huge candidate sets don't take time
+	 quadratic in their size to collect */
       if (matches + 1 >= match_list_size)
 	match_list = (char **)xrealloc
-	  (match_list, ((match_list_size += 10) + 1) * sizeof (char *));
+	  (match_list, ((match_list_size *= 2) + 1) * sizeof (char *));
 
       if (match_list == 0)
 	return (match_list);
@@ -136,6 +136,7 @@ static int _rl_col_width (const char *, int, int, int);
 
 #define FACE_NORMAL	'0'
 #define FACE_STANDOUT	'1'
+#define FACE_DIM	'2'
 #define FACE_INVALID	((char)1)
   
 /* **************************************************************** */
@@ -176,6 +177,10 @@ int rl_display_fixed = 0;
    This is usually pointing to rl_prompt. */
 char *rl_display_prompt = (char *)NULL;
 
+/* Text shown dimmed after the end of the line; see readline.h */
+rl_cpvfunc_t *rl_hint_function = (rl_cpvfunc_t *)NULL;
+char *rl_display_hint = (char *)NULL;
+
 /* Variables used to include the editing mode in the prompt. */
 char *_rl_emacs_mode_str;
 int _rl_emacs_modestr_len;
@@ -780,6 +785,11 @@ rl_redisplay (void)
   if (_rl_echoing_p == 0)
     return;
 
+  if (rl_hint_function && rl_point == rl_end && RL_ISSTATE (RL_STATE_DONE|RL_STATE_COMPLETING) == 0)
+    rl_display_hint = (*rl_hint_function) ();
+  else
+    rl_display_hint = (char *)NULL;
+
   /* Block keyboard interrupts because this function manipulates global
      data structures. */
   _rl_block_sigint ();  
@@ -1052,6 +1062,48 @@ rl_redisplay (void)
 	  lb_linenum = newlines;
 	}
 
+      /* Most of a long line is usually printable ASCII, one byte and one
+	 column per character.  Copy a run of it that stops short of the
+	 end of the screen line, the cursor, and the region all at once,
+	 and leave the last character of the run to the code below. */
+      if (c >= ' ' && c < RUBOUT && (mb_cur_max == 1 || rl_byte_oriented || _rl_utf8locale))
+	{
+	  int run, lim;
+
+	  lim = rl_end;
+	  if (rl_point > in && rl_point < lim)
+	    lim = rl_point;
+	  if (hl_begin > in && hl_begin < lim)
+	    lim = hl_begin;
+	  if (hl_end > in && hl_end < lim)
+	    lim = hl_end;
+	  if (lim - in > _rl_screenwidth - lpos)
+	    lim = in + _rl_screenwidth - lpos;
+	  for (run = in + 1; run < lim && (unsigned char)rl_line_buffer[run] >= ' ' && (unsigned char)rl_line_buffer[run] < RUBOUT; run++)
+	    ;
+
+	  if (run - in > 1)
+	    {
+	      temp = run - in - 1;
+	      realloc_line (out + temp);
+	      memcpy (invisible_line + out, rl_line_buffer + in, temp);
+	      memset (inv_face + out, cur_face, temp);
+	      out += temp;
+	      lpos += temp;
+	      in += temp;
+	      c = (unsigned char)rl_line_buffer[in];
+#if defined (HANDLE_MULTIBYTE)
+	      if (mb_cur_max > 1 && rl_byte_oriented == 0)
+		{
+		  wc = (WCHAR_T)c;
+		  wc_bytes = 1;
+		  wc_width = 1;
+		  memset (&ps, 0, sizeof (mbstate_t));
+		}
+#endif
+	    }
+	}
+
 #if defined (HANDLE_MULTIBYTE)
       if (META_CHAR (c) && _rl_output_meta_chars == 0)	/* XXX - clean up */
 #else
@@ -1190,14 +1242,27 @@ rl_redisplay (void)
         in++;
 #endif
     }
-  invis_nul (&out);
-  line_totbytes = out;
   if (cpos_buffer_position < 0)
     {
       cpos_buffer_position = out;
       lb_linenum = newlines;
     }
 
+  /* The hint goes after the end of the line, as long as it's printable
+     and fits on the screen line the line ends on. */
+  if (rl_display_hint)
+    for (temp = 0; lpos < _rl_screenwidth - 1; temp++)
+      {
+	c = (unsigned char)rl_display_hint[temp];
+	if (c < ' ' || c >= RUBOUT)
+	  break;
+	invis_addc (&out, c, FACE_DIM);
+	lpos++;
+      }
+
+  invis_nul (&out);
+  line_totbytes = out;
+
   /* If we are switching from one line to multiple wrapped lines, we don't
      want to do a dumb update (or we want to make it smarter). */
   if (_rl_quick_redisplay && newlines > 0)
@@ -1598,14 +1663,18 @@ putc_face (int c, int face, char *cur_face)
   cf = *cur_face;
   if (cf != face)
     {
-      if (cf != FACE_NORMAL && cf != FACE_STANDOUT)
+      if (cf != FACE_NORMAL && cf != FACE_STANDOUT && cf != FACE_DIM)
 	return;
-      if (face != FACE_NORMAL && face != FACE_STANDOUT)
+      if (face != FACE_NORMAL && face != FACE_STANDOUT && face != FACE_DIM)
 	return;
-      if (face == FACE_STANDOUT && cf == FACE_NORMAL)
-	_rl_region_color_on ();
-      if (face == FACE_NORMAL && cf == FACE_STANDOUT)
+      if (cf == FACE_STANDOUT)
 	_rl_region_color_off ();
+      else if (cf == FACE_DIM)
+	_rl_dim_off ();
+      if (face == FACE_STANDOUT)
+	_rl_region_color_on ();
+      else if (face == FACE_DIM)
+	_rl_dim_on ();
       *cur_face = face;
     }
   if (c != EOF)
@@ -3303,6 +3372,17 @@ delete_chars (int count)
 #endif /* !__MSDOS__ && (!__MINGW32__ || NCURSES_VERSION)*/
 }
 
+/* Take the hint off the screen before the cursor moves below the line,
+   so it isn't left behind when the line is accepted or completions are
+   listed.  Readline is in RL_STATE_DONE or RL_STATE_COMPLETING then, so
+   redisplaying doesn't ask for another. */
+void
+_rl_erase_hint (void)
+{
+  if (rl_display_hint)
+    (*rl_redisplay_function) ();
+}
+
 void
 _rl_update_final (void)
 {
@@ -144,6 +144,8 @@ static char *history_tempfile (const char *);
 static int histfile_backup (const char *, const char *);
 static int histfile_restore (const char *, const char *);
 static int history_rename (const char *, const char *);
+static int history_lock_file (int, const char *);
+static char *history_skip_entries (char *, char *, int, int, int *, int *);
 
 /* Return the string that should be used in the place of this
    filename.  This only matters when you don't specify the
@@ -250,6 +252,95 @@ history_tempfile (const char *filename)
   return ret;
 }
   
+/* Is the line from S to the newline at E empty once read_history_range
+   strips a trailing CR?  Empty lines count as lines but not entries. */
+#define HIST_LINE_EMPTY(s, e)	((e) == (s) || ((e) == (s) + 1 && *(s) == '\r'))
+
+/* Find where the last KEEP entries in the history file in BUFFER begin,
+   so a stifled history doesn't parse, save, and throw away every entry
+   before them.  Entries are counted the way read_history_range adds
+   them: with MULTILINE, a line that doesn't follow a timestamp continues
+   the entry before it.  Returns BUFFER if the file has no more than KEEP
+   entries; otherwise the start of the line after the last line of the
+   entries skipped, with the number of lines and entries skipped in
+   *LINESP and *ENTRIESP. */
+static char *
+history_skip_entries (char *buffer, char *bufend, int keep, int multiline, int *linesp, int *entriesp)
+{
+  char *s, *e, *start, *next;
+  int found, pending, started, lines, entries;
+
+  if (keep <= 0)
+    return buffer;
+
+  /* A partial last line isn't read, so start at the last newline */
+  for (e = bufend; e > buffer && e[-1] != '\n'; e--)
+    ;
+  if (e == buffer)
+    return buffer;
+  e--;
+
+  /* Walk back a line at a time until we have seen KEEP entries and reach
+     the last line of the one before them */
+  start = (char *)NULL;
+  found = pending = 0;
+  for (;;)
+    {
+      for (s = e; s > buffer && s[-1] != '\n'; s--)
+	;
+      if (HIST_LINE_EMPTY (s, e) == 0)
+	{
+	  if (HIST_TIMESTAMP_START (s))
+	    {
+	      /* The line after it started an entry */
+	      found += pending;
+	      pending = 0;
+	    }
+	  else if (found == keep)
+	    {
+	      start = e + 1;
+	      break;
+	    }
+	  else if (multiline)
+	    pending = 1;
+	  else
+	    found++;
+	}
+      if (s == buffer)
+	break;
+      e = s - 1;
+    }
+
+  if (start == 0)
+    return buffer;
+
+  /* Count the lines and entries we're skipping, since the caller reports
+     them and the history numbering includes them */
+  lines = entries = 0;
+  pending = started = 0;
+  for (s = buffer; s < start; s = next)
+    {
+      e = (char *)memchr (s, '\n', start - s);
+      next = e + 1;
+      if (HIST_LINE_EMPTY (s, e))
+	lines++;
+      else if (HIST_TIMESTAMP_START (s))
+	pending = 1;
+      else
+	{
+	  if (multiline == 0 || pending || started == 0)
+	    entries++;
+	  started = 1;
+	  pending = 0;
+	  lines++;
+	}
+    }
+
+  *linesp = lines;
+  *entriesp = entries;
+  return start;
+}
+
 /* Add the contents of FILENAME to the history list, a line at a time.
    If FILENAME is NULL, then read from ~/.history.  Returns 0 if
    successful, or errno if not. */
@@ -269,7 +360,7 @@ read_history_range (const char *filename, int from, int to)
 {
   register char *line_start, *line_end, *p;
   char *input, *buffer, *bufend, *last_ts;
-  int file, current_line, chars_read, has_timestamps, reset_comment_char;
+  int file, current_line, chars_read, has_timestamps, reset_comment_char, skipped;
   struct stat finfo;
   size_t file_size;
 #if defined (EFBIG)
@@ -377,10 +468,21 @@ read_history_range (const char *filename, int from, int to)
   has_timestamps = HIST_TIMESTAMP_START (buffer);
   history_multiline_entries += has_timestamps && history_write_timestamps;
 
+  /* If the whole file is going into an empty stifled history, only the
+     last history_max_entries entries will stay, so start with them. */
+  line_start = buffer;
+  if (from == 0 && to >= chars_read && history_length == 0 && history_is_stifled ())
+    {
+      line_start = history_skip_entries (buffer, bufend, history_max_entries,
+					 history_multiline_entries, &current_line, &skipped);
+      if (line_start > buffer)
+	history_base += skipped;
+    }
+
   /* Skip lines until we are at FROM. */
-  if (has_timestamps)
+  if (has_timestamps && line_start == buffer)
     last_ts = buffer;
-  for (line_start = line_end = buffer; line_end < bufend && current_line < from; line_end++)
+  for (line_end = line_start; line_end < bufend && current_line < from; line_end++)
     if (*line_end == '\n')
       {
       	p = line_end + 1;
@@ -505,6 +607,37 @@ histfile_restore (const char *backup, const char *orig)
   return (history_rename (backup, orig));
 }
 
+/* How many times to open a history file again because another shell
+   replaced it while we waited for the lock */
+#define HISTORY_LOCK_TRIES	100
+
+/* Shells sharing a history file append to it and truncate it by writing a
+   new file and renaming it into place, so an append that lands in the old
+   file after another shell has read it is lost.  Take a write lock on the
+   file open on FD, which other shells doing the same wait for, and return
+   1 if FILENAME no longer names that file once we have it, so the caller
+   can open the new one.  The lock goes away when FD is closed.  If the
+   file can't be locked we carry on without it. */
+static int
+history_lock_file (int fd, const char *filename)
+{
+#if defined (F_SETLKW)
+  struct flock fl;
+  struct stat fs, ns;
+
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = fl.l_len = 0;
+  if (fcntl (fd, F_SETLKW, &fl) == -1)
+    return 0;
+
+  if (fstat (fd, &fs) == 0 && stat (filename, &ns) == 0 &&
+      (fs.st_dev != ns.st_dev || fs.st_ino != ns.st_ino))
+    return 1;
+#endif
+  return 0;
+}
+
 /* Should we call chown, based on whether finfo and nfinfo describe different
    files with different owners? */
 
@@ -518,7 +651,7 @@ int
 history_truncate_file (const char *fname, int lines)
 {
   char *buffer, *filename, *tempname, *bp, *bp1;		/* bp1 == bp+1 */
-  int file, chars_read, rv, orig_lines, exists, r;
+  int file, tfile, chars_read, rv, orig_lines, exists, r, tries;
   struct stat finfo, nfinfo;
   size_t file_size;
 
@@ -527,9 +660,19 @@ history_truncate_file (const char *fname, int lines)
   buffer = (char *)NULL;
   filename = history_filename (fname);
   tempname = 0;
-  file = filename ? open (filename, O_RDONLY|O_BINARY, 0666) : -1;
   rv = exists = 0;
 
+  /* Open the file for writing too so we can lock it for as long as it
+     takes to replace it */
+  file = filename ? open (filename, O_RDWR|O_BINARY, 0666) : -1;
+  for (tries = 0; file != -1 && tries < HISTORY_LOCK_TRIES && history_lock_file (file, filename); tries++)
+    {
+      close (file);
+      file = open (filename, O_RDWR|O_BINARY, 0666);
+    }
+  if (file == -1 && filename)
+    file = open (filename, O_RDONLY|O_BINARY, 0666);
+
   /* Don't try to truncate non-regular files. */
   if (file == -1 || fstat (file, &finfo) == -1)
     {
@@ -579,11 +722,11 @@ history_truncate_file (const char *fname, int lines)
     }
 
   chars_read = read (file, buffer, file_size);
-  close (file);
 
   if (chars_read <= 0)
     {
       rv = (chars_read < 0) ? errno : 0;
+      close (file);
       goto truncate_exit;
     }
 
@@ -621,33 +764,36 @@ history_truncate_file (const char *fname, int lines)
       rv = 0;
       /* No-op if LINES == 0 at this point */
       history_lines_written_to_file = orig_lines - lines;
+      close (file);
       goto truncate_exit;
     }
 
   tempname = history_tempfile (filename);
 
-  if ((file = open (tempname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0600)) != -1)
+  if ((tfile = open (tempname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0600)) != -1)
     {
-      if (write (file, bp, chars_read - (bp - buffer)) < 0)
+      if (write (tfile, bp, chars_read - (bp - buffer)) < 0)
 	rv = errno;
 
-      if (fstat (file, &nfinfo) < 0 && rv == 0)
+      if (fstat (tfile, &nfinfo) < 0 && rv == 0)
 	rv = errno;
 
-      if (close (file) < 0 && rv == 0)
+      if (close (tfile) < 0 && rv == 0)
 	rv = errno;
     }
   else
     rv = errno;
 
+  /* Replace the file before we let go of the lock on it */
+  if (rv == 0)
+    rv = histfile_restore (tempname, filename);
+  close (file);
+
  truncate_exit:
   FREE (buffer);
 
   history_lines_written_to_file = orig_lines - lines;
 
-  if (rv == 0 && filename && tempname)
-    rv = histfile_restore (tempname, filename);
-
   if (rv != 0)
     {
       rv = errno;
@@ -679,7 +825,7 @@ history_do_write (const char *filename, int nelements, int overwrite)
 {
   register int i;
   char *output, *tempname, *histname;
-  int file, mode, rv, exists;
+  int file, mode, rv, exists, tries;
   struct stat finfo, nfinfo;
 #ifdef HISTORY_USE_MMAP
   size_t cursize;
@@ -699,6 +845,14 @@ history_do_write (const char *filename, int nelements, int overwrite)
   file = output ? open (output, mode, 0600) : -1;
   rv = 0;
 
+  /* Appending is a single write, but don't let it land in a file another
+     shell is about to replace with a truncated copy. */
+  for (tries = 0; file != -1 && overwrite == 0 && tries < HISTORY_LOCK_TRIES && history_lock_file (file, output); tries++)
+    {
+      close (file);
+      file = open (output, mode, 0600);
+    }
+
   if (file == -1)
     {
       rv = errno;
@@ -70,6 +70,7 @@ history_search_internal (const char *string, int direction, int flags)
   register char *line;
   register int line_index;
   int string_len, anchored, patsearch;
+  char *p, *q;
   HIST_ENTRY **the_history; 	/* local */
 
   i = history_offset;
@@ -104,15 +105,35 @@ history_search_internal (const char *string, int direction, int flags)
 	return (-1);
 
       line = the_history[i]->line;
-      line_index = strlen (line);
 
-      /* If STRING is longer than line, no match. */
-      if (patsearch == 0 && (string_len > line_index))
+      /* Plain strings are found with strstr, which is much faster than
+	 trying each position in turn, and most lines don't match. */
+      if (patsearch == 0)
 	{
+	  if (anchored == ANCHORED_SEARCH)
+	    line_index = STREQN (string, line, string_len) ? 0 : -1;
+	  else if ((p = strstr (line, string)) == 0)
+	    line_index = -1;
+	  else
+	    {
+	      /* A reverse search wants the last occurrence */
+	      if (reverse)
+		while ((q = strstr (p + 1, string)) != 0)
+		  p = q;
+	      line_index = p - line;
+	    }
+
+	  if (line_index >= 0)
+	    {
+	      history_offset = i;
+	      return (line_index);
+	    }
 	  NEXT_LINE ();
 	  continue;
 	}
 
+      line_index = strlen (line);
+
       /* Handle anchored searches first. */
       if (anchored == ANCHORED_SEARCH)
 	{
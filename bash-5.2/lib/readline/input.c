@@ -348,6 +348,42 @@ rl_gather_tyi (void)
   return 1;
 }
 
+/* Move as much of the input that is already waiting as fits into IBUFFER
+   with a single read.  Reading the text of a bracketed paste uses this to
+   avoid a select and a read for every pasted character; unlike
+   rl_gather_tyi it doesn't stop at a newline, since the rest of the
+   paste up to the closing sequence is coming anyway.  Returns the number
+   of characters read. */
+int
+_rl_gather_pending_input (void)
+{
+  int tty, chars_avail, space, n, i;
+  unsigned char buf[sizeof (ibuffer)];
+
+  if (rl_getc_function != rl_getc || any_typein || rl_pending_input ||
+      RL_ISSTATE (RL_STATE_MACROINPUT))
+    return 0;
+
+  tty = fileno (rl_instream);
+  chars_avail = 0;
+#if defined (FIONREAD)
+  if (ioctl (tty, FIONREAD, &chars_avail) < 0)
+    return 0;
+#endif
+  if (chars_avail <= 0)
+    return 0;
+
+  space = ibuffer_space ();
+  if (chars_avail > space)
+    chars_avail = space;
+
+  n = read (tty, buf, chars_avail);
+  for (i = 0; i < n; i++)
+    rl_stuff_char (buf[i]);
+
+  return (n > 0 ? n : 0);
+}
+
 int
 rl_set_keyboard_input_timeout (int u)
 {
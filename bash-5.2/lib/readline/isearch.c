@@ -759,8 +759,9 @@ opcode_dispatch:
 	break;
 
       /* Move to the next line, but skip new copies of the line
-	 we just found and lines shorter than the string we're
-	 searching for. */
+	 we just found and lines that don't contain the string we're
+	 searching for.  strstr rejects those much faster than the
+	 position-by-position search below. */
       do
 	{
 	  /* Move to the next line. */
@@ -775,10 +776,10 @@ opcode_dispatch:
 
 	  /* We will need these later. */
 	  cxt->sline = cxt->lines[cxt->history_pos];
-	  cxt->sline_len = strlen (cxt->sline);
 	}
       while ((cxt->prev_line_found && STREQ (cxt->prev_line_found, cxt->lines[cxt->history_pos])) ||
-	     (cxt->search_string_index > cxt->sline_len));
+	     strstr (cxt->sline, cxt->search_string) == 0);
+      cxt->sline_len = strlen (cxt->sline);
 
       if (cxt->sflags & SF_FAILED)
 	{
@@ -716,7 +716,7 @@ _rl_bracketed_text (size_t *lenp)
   buf[0] = '\0';
 
   RL_SETSTATE (RL_STATE_MOREINPUT);
-  while ((c = rl_read_key ()) >= 0)
+  while (_rl_gather_pending_input (), (c = rl_read_key ()) >= 0)
     {
       if (RL_ISSTATE (RL_STATE_MACRODEF))
 	_rl_add_macro_char (c);
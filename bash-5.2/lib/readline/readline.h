@@ -548,6 +548,16 @@ extern char *rl_prompt;
    applications can more easily supply their own redisplay functions. */
 extern char *rl_display_prompt;
 
+/* If non-zero, rl_redisplay calls this when point is at the end of the
+   line, and shows the text it returns, if any, dimmed after the line as
+   far as the end of that screen line.  The text isn't part of the line;
+   it suggests how the line might continue.  It isn't called once the
+   line has been accepted or while completing. */
+extern rl_cpvfunc_t *rl_hint_function;
+
+/* The text rl_hint_function returned for the line on the screen, or NULL. */
+extern char *rl_display_hint;
+
 /* The line buffer that is in use. */
 extern char *rl_line_buffer;
 
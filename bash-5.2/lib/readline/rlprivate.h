@@ -291,6 +291,7 @@ extern void _rl_clean_up_for_exit (void);
 extern void _rl_erase_entire_line (void);
 extern int _rl_current_display_line (void);
 extern void _rl_refresh_line (void);
+extern void _rl_erase_hint (void);
 
 /* input.c */
 extern int _rl_any_typein (void);
@@ -300,6 +301,7 @@ extern int _rl_input_queued (int);
 extern void _rl_insert_typein (int);
 extern int _rl_unget_char (int);
 extern int _rl_pushed_input_available (void);
+extern int _rl_gather_pending_input (void);
 
 extern int _rl_timeout_init (void);
 extern int _rl_timeout_handle_sigalrm (void);
@@ -418,6 +420,8 @@ extern void _rl_control_keypad (int);
 extern void _rl_set_cursor (int, int);
 extern void _rl_standout_on (void);
 extern void _rl_standout_off (void);
+extern void _rl_dim_on (void);
+extern void _rl_dim_off (void);
 extern int _rl_reset_region_color (int, const char *);
 extern void _rl_region_color_on (void);
 extern void _rl_region_color_off (void);
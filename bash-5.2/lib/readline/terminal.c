@@ -156,6 +156,10 @@ static char *_rl_term_mo;
 static char *_rl_term_so;
 static char *_rl_term_se;
 
+/* The sequences to enter half-bright mode and to turn off all attributes. */
+static char *_rl_term_mh;
+static char *_rl_term_me;
+
 /* The key sequences output by the arrow keys, if this terminal has any. */
 static char *_rl_term_ku;
 static char *_rl_term_kd;
@@ -438,6 +442,8 @@ static const struct _tc_string tc_strings[] =
   { "ks", &_rl_term_ks },	/* start keypad mode */
   { "ku", &_rl_term_ku },
   { "le", &_rl_term_backspace },
+  { "me", &_rl_term_me },
+  { "mh", &_rl_term_mh },
   { "mm", &_rl_term_mm },
   { "mo", &_rl_term_mo },
   { "nd", &_rl_term_forward_char },
@@ -497,6 +503,7 @@ _rl_init_terminal_io (const char *terminal_name)
   _rl_term_kh = _rl_term_kH = _rl_term_at7 = _rl_term_kI = (char *)NULL;
   _rl_term_kN = _rl_term_kP = (char *)NULL;
   _rl_term_so = _rl_term_se = (char *)NULL;
+  _rl_term_mh = _rl_term_me = (char *)NULL;
 #if defined(HACK_TERMCAP_MOTION)
   _rl_term_forward_char = (char *)NULL;
 #endif
@@ -563,6 +570,7 @@ _rl_init_terminal_io (const char *terminal_name)
       _rl_term_ve = _rl_term_vs = (char *)NULL;
       _rl_term_forward_char = (char *)NULL;
       _rl_term_so = _rl_term_se = (char *)NULL;
+      _rl_term_mh = _rl_term_me = (char *)NULL;
       _rl_terminal_can_insert = term_has_meta = 0;
 
       /* Assume generic unknown terminal can't handle the enable/disable
@@ -807,6 +815,24 @@ _rl_standout_off (void)
 #endif
 }
 
+void
+_rl_dim_on (void)
+{
+#ifndef __MSDOS__
+  if (_rl_term_mh && _rl_term_me)
+    tputs (_rl_term_mh, 1, _rl_output_character_function);
+#endif
+}
+
+void
+_rl_dim_off (void)
+{
+#ifndef __MSDOS__
+  if (_rl_term_mh && _rl_term_me)
+    tputs (_rl_term_me, 1, _rl_output_character_function);
+#endif
+}
+
 /* **************************************************************** */
 /*								    */
 /*	     Controlling color for a portion of the line	    */
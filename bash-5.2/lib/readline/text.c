@@ -1109,6 +1109,7 @@ rl_newline (int count, int key)
     _rl_history_saved_point = (rl_point == rl_end) ? -1 : rl_point;
 
   RL_SETSTATE(RL_STATE_DONE);
+  _rl_erase_hint ();
 
 #if defined (VI_MODE)
   if (rl_editing_mode == vi_mode)
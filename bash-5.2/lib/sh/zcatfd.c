@@ -28,6 +28,13 @@
 
 #include <errno.h>
 
+#if defined (HAVE_COPY_FILE_RANGE) || defined (HAVE_SPLICE)
+#  include <fcntl.h>
+#endif
+#if defined (HAVE_SENDFILE) && defined (HAVE_SYS_SENDFILE_H)
+#  include <sys/sendfile.h>
+#endif
+
 #include <stdc.h>
 
 #if !defined (errno)
@@ -35,11 +42,84 @@ extern int errno;
 #endif
 
 #ifndef ZBUFSIZ
-#  define ZBUFSIZ 4096
+#  define ZBUFSIZ 65536
 #endif
 
+/* The most zcopyfd asks the kernel to copy at once, between checks for
+   signals */
+#define ZCOPYSIZ	(1024 * 1024)
+
+/* The ways zcopyfd tries, in order */
+#define ZC_RANGE	0
+#define ZC_SPLICE	1
+#define ZC_SENDFILE	2
+#define ZC_NONE		3
+
 extern ssize_t zread PARAMS((int, char *, size_t));
 extern int zwrite PARAMS((int, char *, ssize_t));
+extern void check_signals PARAMS((void));
+
+/* Copy the rest of FD to OFD without bringing it into user space:
+   copy_file_range between files, splice when either is a pipe, and
+   sendfile from a file to anything else, like a socket.  Returns 0 at end
+   of file and -1 on an error.  Returns 1 if the system can't copy between
+   these descriptors; the caller should carry on reading and writing from
+   wherever this stopped. */
+int
+zcopyfd (fd, ofd)
+     int fd, ofd;
+{
+  ssize_t n;
+  int how, copied;
+
+  for (how = ZC_RANGE, copied = 0; how != ZC_NONE; )
+    {
+      n = -1;
+      errno = ENOSYS;
+      switch (how)
+	{
+#if defined (HAVE_COPY_FILE_RANGE)
+	case ZC_RANGE:
+	  n = copy_file_range (fd, (off_t *)0, ofd, (off_t *)0, ZCOPYSIZ, 0);
+	  break;
+#endif
+#if defined (HAVE_SPLICE)
+	case ZC_SPLICE:
+	  n = splice (fd, (off_t *)0, ofd, (off_t *)0, ZCOPYSIZ, SPLICE_F_MOVE);
+	  break;
+#endif
+#if defined (HAVE_SENDFILE) && defined (HAVE_SYS_SENDFILE_H)
+	case ZC_SENDFILE:
+	  n = sendfile (ofd, fd, (off_t *)0, ZCOPYSIZ);
+	  break;
+#endif
+	default:
+	  break;
+	}
+
+      if (n > 0)
+	{
+	  copied = 1;
+	  check_signals ();
+	  continue;
+	}
+      /* Files in /proc and the like claim to be empty; let read decide */
+      else if (n == 0 && copied)
+	return 0;
+      else if (n < 0 && errno == EINTR)
+	{
+	  check_signals ();
+	  continue;
+	}
+      else if (n < 0 && errno != EINVAL && errno != EXDEV && errno != ENOSYS &&
+		errno != EOPNOTSUPP && errno != EBADF && errno != ESPIPE)
+	return -1;
+
+      how++;
+    }
+
+  return 1;
+}
 
 /* Dump contents of file descriptor FD to OFD.  FN is the filename for
    error messages (not used right now). */
@@ -52,6 +132,10 @@ zcatfd (fd, ofd, fn)
   int rval;
   char lbuf[ZBUFSIZ];
 
+  rval = zcopyfd (fd, ofd);
+  if (rval <= 0)
+    return rval;
+
   rval = 0;
   while (1)
     {
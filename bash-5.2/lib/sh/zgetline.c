@@ -38,6 +38,8 @@ extern ssize_t zread PARAMS((int, char *, size_t));
 extern ssize_t zreadc PARAMS((int, char *));
 extern ssize_t zreadintr PARAMS((int, char *, size_t));
 extern ssize_t zreadcintr PARAMS((int, char *));
+extern ssize_t zreadpc PARAMS((int, char *, int));
+extern ssize_t zreadra PARAMS((int, char *));
 
 typedef ssize_t breadfunc_t PARAMS((int, char *, size_t));
 typedef ssize_t creadfunc_t PARAMS((int, char *));
@@ -55,8 +57,10 @@ typedef ssize_t creadfunc_t PARAMS((int, char *));
 	    the next argument should be 1; and
 	(4) the addition of a fifth argument, UNBUFFERED_READ; this argument
 	    controls whether get_line uses buffering or not to get a byte data
-	    from FD. get_line uses zreadc if UNBUFFERED_READ is zero; and
-	    uses zread if UNBUFFERED_READ is non-zero.
+	    from FD. get_line uses zreadc if UNBUFFERED_READ is zero;
+	    zreadpc, which reads no further than DELIM, if it is 2;
+	    zreadra, which keeps what it reads ahead for FD, if it is 3;
+	    and zread otherwise.
 
    Returns number of bytes read or -1 on error. */
 
@@ -80,7 +84,12 @@ zgetline (fd, lineptr, n, delim, unbuffered_read)
   
   while (1)
     {
-      retval = unbuffered_read ? zread (fd, &c, 1) : zreadc(fd, &c);
+      if (unbuffered_read == 3)
+	retval = zreadra (fd, &c);
+      else if (unbuffered_read == 2)
+	retval = zreadpc (fd, &c, delim);
+      else
+	retval = unbuffered_read ? zread (fd, &c, 1) : zreadc(fd, &c);
 
       if (retval <= 0)
 	{
@@ -29,6 +29,15 @@
 #include <signal.h>
 #include <errno.h>
 
+#include <filecntl.h>
+#include <posixstat.h>
+
+#if defined (HAVE_SYS_SOCKET_H)
+#  include <sys/socket.h>
+#endif
+
+#include <bashansi.h>
+
 #if !defined (errno)
 extern int errno;
 #endif
@@ -47,6 +56,7 @@ extern void check_signals_and_traps (void);
 extern void check_signals (void);
 extern int signal_is_trapped (int);
 extern int read_builtin_timeout (int);
+extern int sh_openpipe (int *);
 
 /* Read LEN bytes from FD into BUF.  Retry the read on EINTR.  Any other
    error causes the loop to break. */
@@ -204,6 +214,325 @@ zreadn (fd, cp, len)
   return 1;
 }
 
+/* Reading lines from a pipe or socket.  Other processes can share the
+   descriptor -- `cmd | while read line; do ...; done' runs commands that
+   read the same pipe -- and we can't seek back past what we read, so we
+   mustn't take any input beyond the delimiter.  Rather than reading a
+   byte at a time, we look at what's waiting without consuming it, with
+   tee(2) for a pipe and MSG_PEEK for a socket, and then read exactly
+   the bytes up to and including the first delimiter. */
+
+#if defined (SPLICE_F_NONBLOCK)
+#  define HAVE_TEE_PEEK
+#endif
+
+#if defined (HAVE_SYS_SOCKET_H) && defined (MSG_PEEK) && defined (S_ISSOCK)
+#  define HAVE_RECV_PEEK
+#endif
+
+#define PEEK_UNKNOWN	0
+#define PEEK_PIPE	1
+#define PEEK_SOCKET	2
+#define PEEK_NONE	3
+
+static int peek_fd = -1;
+static int peek_kind = PEEK_UNKNOWN;
+static dev_t peek_dev;
+static ino_t peek_ino;
+
+#if defined (HAVE_TEE_PEEK)
+/* tee(2) copies FD's contents here without consuming them; each process
+   needs its own, since a subshell reading another pipe would mix its
+   input in with ours */
+static int peek_pipe[2] = { -1, -1 };
+static pid_t peek_pid = -1;
+
+static int
+zpeekpipe ()
+{
+  pid_t pid;
+
+  pid = getpid ();
+  if (peek_pid == pid)
+    return 0;
+
+  if (peek_pipe[0] >= 0)
+    {
+      close (peek_pipe[0]);
+      close (peek_pipe[1]);
+    }
+  peek_pid = -1;
+  /* Out of the way of the low descriptors users redirect */
+  if (sh_openpipe (peek_pipe) < 0)
+    {
+      peek_pipe[0] = peek_pipe[1] = -1;
+      return -1;
+    }
+  SET_CLOSE_ON_EXEC (peek_pipe[0]);
+  SET_CLOSE_ON_EXEC (peek_pipe[1]);
+  peek_pid = pid;
+  return 0;
+}
+#endif
+
+/* Copy up to LEN bytes waiting on FD into BUF, leaving them to be read.
+   Returns what read(2) would, or -2 if FD is something we can't peek at. */
+static ssize_t
+zpeek (fd, buf, len)
+     int fd;
+     char *buf;
+     size_t len;
+{
+  struct stat sb;
+  ssize_t r;
+
+  if (fd != peek_fd)
+    {
+      peek_fd = fd;
+      peek_kind = PEEK_NONE;
+      if (fstat (fd, &sb) == 0)
+	{
+	  peek_dev = sb.st_dev;
+	  peek_ino = sb.st_ino;
+#if defined (HAVE_TEE_PEEK)
+	  if (S_ISFIFO (sb.st_mode))
+	    peek_kind = PEEK_PIPE;
+#endif
+#if defined (HAVE_RECV_PEEK)
+	  if (S_ISSOCK (sb.st_mode))
+	    peek_kind = PEEK_SOCKET;
+#endif
+	}
+    }
+
+#if defined (HAVE_TEE_PEEK)
+  if (peek_kind == PEEK_PIPE && zpeekpipe () < 0)
+    return -2;
+#endif
+
+  check_signals ();
+  for (;;)
+    {
+      if ((r = read_builtin_timeout (fd)) >= 0)
+	switch (peek_kind)
+	  {
+#if defined (HAVE_TEE_PEEK)
+	  case PEEK_PIPE:
+	    r = tee (fd, peek_pipe[1], len, 0);
+	    if (r > 0)
+	      r = read (peek_pipe[0], buf, r);
+	    break;
+#endif
+#if defined (HAVE_RECV_PEEK)
+	  case PEEK_SOCKET:
+	    r = recv (fd, buf, len, MSG_PEEK);
+	    break;
+#endif
+	  default:
+	    return -2;
+	  }
+      if (r >= 0 || errno != EINTR)
+	break;
+      if (executing_builtin)
+	check_signals_and_traps ();
+      else
+	check_signals ();
+    }
+
+  /* The descriptor isn't what it was the last time we looked */
+  if (r < 0 && (errno == EINVAL || errno == ENOTSOCK || errno == EBADF))
+    {
+      peek_fd = -1;
+      return -2;
+    }
+  return r;
+}
+
+/* Read up to LEN bytes from FD into BUF, stopping after the first DELIM
+   and never consuming input past it. */
+ssize_t
+zreaddelim (fd, buf, len, delim)
+     int fd;
+     char *buf;
+     size_t len;
+     int delim;
+{
+  ssize_t r;
+  char *p;
+
+  r = zpeek (fd, buf, len);
+  if (r == -2)
+    return (zread (fd, buf, 1));
+  if (r <= 0)
+    return r;
+
+  p = memchr (buf, delim, r);
+  if (p)
+    r = p - buf + 1;
+  return (zread (fd, buf, r));
+}
+
+/* Like zreadc, for reading input ending with DELIM from a pipe or socket.
+   It has a buffer of its own, which holds at most the rest of the
+   current line. */
+
+static char pbuf[ZBUFSIZ];
+static size_t pind, pused;
+static int pfd = -1;
+
+ssize_t
+zreadpc (fd, cp, delim)
+     int fd;
+     char *cp;
+     int delim;
+{
+  ssize_t nr;
+
+  if (fd != pfd)
+    {
+      pfd = fd;
+      pind = pused = 0;
+    }
+
+  if (pind == pused || pused == 0)
+    {
+      nr = zreaddelim (fd, pbuf, sizeof (pbuf), delim);
+      pind = 0;
+      if (nr <= 0)
+	{
+	  pused = 0;
+	  return nr;
+	}
+      pused = nr;
+    }
+  if (cp)
+    *cp = pbuf[pind++];
+  return 1;
+}
+
+/* FD is about to be read with zreadpc.  The descriptor may have been
+   closed and the number reused since the last time, by a redirection or
+   a new pipe; if FD isn't the file it was, drop what we know about it. */
+void
+zpeekfd (fd)
+     int fd;
+{
+  struct stat sb;
+
+  if (fd == peek_fd && fstat (fd, &sb) == 0 &&
+      sb.st_dev == peek_dev && sb.st_ino == peek_ino)
+    return;
+
+  if (fd == peek_fd)
+    peek_fd = -1;
+  if (fd == pfd)
+    {
+      pfd = -1;
+      pind = pused = 0;
+    }
+}
+
+/* Read-ahead for descriptors only the shell itself reads, like the read
+   end of a coprocess.  Input past the delimiter stays in a buffer kept
+   for the descriptor, where the next `read' or `mapfile' on it finds it,
+   until zradiscard() drops it when the descriptor is closed.  A process
+   that reads the descriptor directly won't see what is buffered. */
+
+#define RA_SLOTS	4
+
+static struct rabuf
+{
+  int fd;
+  size_t ind, used;
+  char *buf;
+} rabufs[RA_SLOTS] = { { -1 }, { -1 }, { -1 }, { -1 } };
+
+static struct rabuf *
+zrafind (fd, create)
+     int fd, create;
+{
+  int i;
+  struct rabuf *free_slot;
+
+  free_slot = 0;
+  for (i = 0; i < RA_SLOTS; i++)
+    {
+      if (rabufs[i].fd == fd)
+	return &rabufs[i];
+      if (rabufs[i].fd < 0 && free_slot == 0)
+	free_slot = &rabufs[i];
+    }
+  if (create == 0 || free_slot == 0)
+    return 0;
+
+  if (free_slot->buf == 0)
+    free_slot->buf = (char *)malloc (ZBUFSIZ);
+  if (free_slot->buf == 0)
+    return 0;
+  free_slot->fd = fd;
+  free_slot->ind = free_slot->used = 0;
+  return free_slot;
+}
+
+/* Like zreadc, but what's left in the buffer is kept for FD alone and
+   survives calls reading other descriptors.  When every buffer is taken,
+   FD is read a byte at a time. */
+ssize_t
+zreadra (fd, cp)
+     int fd;
+     char *cp;
+{
+  struct rabuf *rb;
+  ssize_t nr;
+
+  rb = zrafind (fd, 1);
+  if (rb == 0)
+    return (zread (fd, cp, 1));
+
+  if (rb->ind == rb->used)
+    {
+      nr = zread (fd, rb->buf, ZBUFSIZ);
+      if (nr <= 0)
+	return nr;
+      rb->ind = 0;
+      rb->used = nr;
+    }
+  *cp = rb->buf[rb->ind++];
+  return 1;
+}
+
+/* Bytes read ahead from FD and not yet returned */
+size_t
+zrapending (fd)
+     int fd;
+{
+  struct rabuf *rb;
+
+  rb = zrafind (fd, 0);
+  return (rb ? rb->used - rb->ind : 0);
+}
+
+/* FD is being closed; forget what was read ahead or peeked from it */
+void
+zradiscard (fd)
+     int fd;
+{
+  struct rabuf *rb;
+
+  if (fd >= 0 && (rb = zrafind (fd, 0)))
+    {
+      rb->fd = -1;
+      rb->ind = rb->used = 0;
+    }
+  if (fd >= 0 && fd == peek_fd)
+    peek_fd = -1;
+  if (fd >= 0 && fd == pfd)
+    {
+      pfd = -1;
+      pind = pused = 0;
+    }
+}
+
 void
 zreset ()
 {
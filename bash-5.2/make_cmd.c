@@ -48,12 +48,20 @@
 
 int here_doc_first_line = 0;
 
-/* Object caching */
+/* Object caching.  Expansion makes and disposes of words and word lists
+   by the hundred, and every function call copies and disposes of the
+   function's body, so keep enough of each to cover a typical burst. */
 sh_obj_cache_t wdcache = {0, 0, 0};
 sh_obj_cache_t wlcache = {0, 0, 0};
+sh_obj_cache_t comcache = {0, 0, 0};
+sh_obj_cache_t simcache = {0, 0, 0};
+sh_obj_cache_t concache = {0, 0, 0};
 
-#define WDCACHESIZE	128
-#define WLCACHESIZE	128
+#define WDCACHESIZE	512
+#define WLCACHESIZE	512
+#define COMCACHESIZE	128
+#define SIMCACHESIZE	64
+#define CONCACHESIZE	64
 
 static COMMAND *make_for_or_select PARAMS((enum command_type, WORD_DESC *, WORD_LIST *, COMMAND *, int));
 #if defined (ARITH_FOR_COMMAND)
@@ -66,6 +74,9 @@ cmd_init ()
 {
   ocache_create (wdcache, WORD_DESC, WDCACHESIZE);
   ocache_create (wlcache, WORD_LIST, WLCACHESIZE);
+  ocache_create (comcache, COMMAND, COMCACHESIZE);
+  ocache_create (simcache, SIMPLE_COM, SIMCACHESIZE);
+  ocache_create (concache, CONNECTION, CONCACHESIZE);
 }
 
 WORD_DESC *
@@ -174,7 +185,7 @@ make_command (type, pointer)
 {
   COMMAND *temp;
 
-  temp = (COMMAND *)xmalloc (sizeof (COMMAND));
+  ocache_alloc (comcache, COMMAND, temp);
   temp->type = type;
   temp->value.Simple = pointer;
   temp->value.Simple->flags = temp->flags = 0;
@@ -189,7 +200,7 @@ command_connect (com1, com2, connector)
 {
   CONNECTION *temp;
 
-  temp = (CONNECTION *)xmalloc (sizeof (CONNECTION));
+  ocache_alloc (concache, CONNECTION, temp);
   temp->connector = connector;
   temp->first = com1;
   temp->second = com2;
@@ -431,7 +442,7 @@ make_arith_command (exp)
   COMMAND *command;
   ARITH_COM *temp;
 
-  command = (COMMAND *)xmalloc (sizeof (COMMAND));
+  ocache_alloc (comcache, COMMAND, command);
   command->value.Arith = temp = (ARITH_COM *)xmalloc (sizeof (ARITH_COM));
 
   temp->flags = 0;
@@ -477,7 +488,7 @@ make_cond_command (cond_node)
 #if defined (COND_COMMAND)
   COMMAND *command;
 
-  command = (COMMAND *)xmalloc (sizeof (COMMAND));
+  ocache_alloc (comcache, COMMAND, command);
   command->value.Cond = cond_node;
 
   command->type = cm_cond;
@@ -498,8 +509,9 @@ make_bare_simple_command ()
   COMMAND *command;
   SIMPLE_COM *temp;
 
-  command = (COMMAND *)xmalloc (sizeof (COMMAND));
-  command->value.Simple = temp = (SIMPLE_COM *)xmalloc (sizeof (SIMPLE_COM));
+  ocache_alloc (comcache, COMMAND, command);
+  ocache_alloc (simcache, SIMPLE_COM, temp);
+  command->value.Simple = temp;
 
   temp->flags = 0;
   temp->line = line_number;
@@ -47,6 +47,7 @@
 #include "jobs.h"
 #include "execute_cmd.h"
 #include "trap.h"
+#include "probes.h"
 
 #include "builtins/builtext.h"	/* for wait_builtin */
 #include "builtins/common.h"
@@ -557,6 +558,8 @@ make_child (command, flags)
       last_command_exit_value = EX_NOEXEC;
       throw_to_top_level ();
     }
+  else if (pid > 0)
+    PROBE2 (bash, fork, pid, command);
 
   if (pid == 0)
     {
@@ -58,6 +58,12 @@
 
 #include "shmbutil.h"
 
+#if defined (ANBS_AI_ENABLED)
+#  include "posixtime.h"
+#  include "asyncprompt.h"
+extern int anbs_metrics_slo_observe PARAMS((const char *, double));
+#endif
+
 #if defined (READLINE)
 #  include "bashline.h"
 #  include <readline/readline.h>
@@ -162,6 +168,8 @@ static int yy_stream_unget PARAMS((int));
 
 static int shell_getc PARAMS((int));
 static void shell_ungetc PARAMS((int));
+static int shell_input_direct PARAMS((void));
+static void shell_input_advance PARAMS((size_t));
 static void discard_until PARAMS((int));
 
 static void push_string PARAMS((char *, int, alias_t *));
@@ -1525,8 +1533,14 @@ yy_readline_get ()
 	}
 
       sh_unset_nodelay_mode (fileno (rl_instream));	/* just in case */
+#if defined (ANBS_AI_ENABLED)
+      bashline_speculate_begin ();
+#endif
       current_readline_line = readline (current_readline_prompt ?
       					  current_readline_prompt : "");
+#if defined (ANBS_AI_ENABLED)
+      bashline_speculate_end (current_readline_line);
+#endif
 
       CHECK_TERMSIG;
       if (signal_is_ignored (SIGINT) == 0)
@@ -2390,6 +2404,37 @@ shell_getc (remove_quoted_newline)
 
       while (1)
 	{
+#if defined (BUFFERED_INPUT) && !defined (DJGPP)
+	  /* Reading a script: copy as much of the line as is already
+	     buffered in one go.  The newline, a NUL, and refilling the
+	     buffer are left to yy_getc below. */
+	  if (bash_input.type == st_bstream && truncating == 0 &&
+	      shell_input_line_size < SIZE_MAX / 2)
+	    {
+	      char *chunk, *stop;
+	      size_t n, k;
+
+	      if ((n = buffered_input_peek (&chunk)) > 0)
+		{
+		  if (stop = memchr (chunk, '\n', n))
+		    n = stop - chunk;
+		  if (stop = memchr (chunk, '\0', n))
+		    n = stop - chunk;
+		}
+	      if (n > 0)
+		{
+		  RESIZE_MALLOCED_BUFFER (shell_input_line, i, n + 2, shell_input_line_size, n + 256);
+		  memcpy (shell_input_line + i, chunk, n);
+		  i += n;
+		  buffered_input_consume (n);
+
+		  for (k = 0; k < n && chunk[n - k - 1] == '\\'; k++)
+		    ;
+		  last_was_backslash = (k == n) ? (last_was_backslash ^ (k & 1)) : (k & 1);
+		}
+	    }
+#endif
+
 	  c = yy_getc ();
 
 	  /* Allow immediate exit if interrupted during input. */
@@ -2711,6 +2756,34 @@ pop_alias:
   return (uc);
 }
 
+/* Non-zero if the next shell_getc would simply return the character at
+   shell_input_line_index, so callers can scan the line directly */
+static int
+shell_input_direct ()
+{
+  return (shell_input_line && eol_ungetc_lookahead == 0 && sigwinch_received == 0);
+}
+
+/* Consume N characters of shell_input_line, none of them NUL, as N calls
+   to shell_getc would */
+static void
+shell_input_advance (n)
+     size_t n;
+{
+  char *s;
+  size_t k;
+
+  if (n == 0)
+    return;
+  if (shell_input_line_index == 0)
+    unquoted_backslash = 0;
+  s = shell_input_line + shell_input_line_index;
+  for (k = 0; k < n && s[n - k - 1] == '\\'; k++)
+    ;
+  unquoted_backslash = (k == n) ? (unquoted_backslash ^ (k & 1)) : (k & 1);
+  shell_input_line_index += n;
+}
+
 /* Put C back into the input for the shell.  This might need changes for
    HANDLE_MULTIBYTE around EOLs.  Since we (currently) never push back a
    character different than we read, shell_input_line_property doesn't need
@@ -2806,10 +2879,21 @@ static void
 discard_until (character)
      int character;
 {
+  char *s, *e;
   int c;
 
-  while ((c = shell_getc (0)) != EOF && c != character)
-    ;
+  do
+    {
+      /* Skip the rest of a comment without a call per character */
+      if (shell_input_direct ())
+	{
+	  s = shell_input_line + shell_input_line_index;
+	  if ((e = strchr (s, character)) == 0)
+	    e = s + strlen (s);
+	  shell_input_advance (e - s);
+	}
+    }
+  while ((c = shell_getc (0)) != EOF && c != character);
 
   if (c != EOF)
     shell_ungetc (c);
@@ -3396,7 +3480,15 @@ read_token (command)
  re_read_token:
 #endif /* ALIAS */
 
-  /* Read a single word from input.  Start by skipping blanks. */
+  /* Read a single word from input.  Start by skipping blanks, a run at a
+     time when they're in the current line. */
+  if (shell_input_direct ())
+    {
+      size_t n;
+
+      n = strspn (shell_input_line + shell_input_line_index, " \t");
+      shell_input_advance (n);
+    }
   while ((character = shell_getc (1)) != EOF && shellblank (character))
     ;
 
@@ -4827,6 +4919,11 @@ token_is_ident (t, i)
 }
 #endif
 
+/* Characters read_token_word only ever appends to the word it's building */
+#define WORD_PLAIN_CHAR(c) \
+  ((unsigned char)(c) < 0x80 && (c) != '\0' && (c) != '[' && (c) != '=' && \
+   notsyntype ((c), CSHBRK|CQUOTE|CXQUOTE|CEXP|CSPECL|CXGLOB))
+
 static int
 read_token_word (character)
      int character;
@@ -5187,6 +5284,31 @@ got_escaped_character:
       all_digit_token &= DIGIT (character);
       dollar_present |= character == '$';
 
+      /* Copy a run of ordinary characters that follows straight out of the
+	 input line.  None of them starts a quoted string, an expansion, an
+	 extended pattern, a subscript or an assignment, ends the word, or
+	 needs a CTLESC, so the loop would only have appended them. */
+      if (pass_next_character == 0 && character != '\n' && shell_input_direct ())
+	{
+	  char *s, *e;
+	  size_t n;
+
+	  s = e = shell_input_line + shell_input_line_index;
+	  while (WORD_PLAIN_CHAR (*e))
+	    e++;
+	  if (n = e - s)
+	    {
+	      RESIZE_MALLOCED_BUFFER (token, token_index, n + 1, token_buffer_size,
+				      TOKEN_DEFAULT_GROW_SIZE);
+	      memcpy (token + token_index, s, n);
+	      token_index += n;
+	      for ( ; all_digit_token && s < e; s++)
+		all_digit_token &= DIGIT (*s);
+	      shell_input_advance (n);
+	      character = e[-1];
+	    }
+	}
+
     next_character:
       if (character == '\n' && SHOULD_PROMPT ())
 	prompt_again (0);
@@ -5547,6 +5669,9 @@ prompt_again (force)
      int force;
 {
   char *temp_prompt;
+#if defined (ANBS_AI_ENABLED)
+  struct timeval start, now;
+#endif
 
   if (interactive == 0 || expanding_alias ())	/* XXX */
     return;
@@ -5559,9 +5684,17 @@ prompt_again (force)
   if (!prompt_string_pointer)
     prompt_string_pointer = &ps1_prompt;
 
+#if defined (ANBS_AI_ENABLED)
+  gettimeofday (&start, (void *)NULL);
+#endif
   temp_prompt = *prompt_string_pointer
 			? decode_prompt_string (*prompt_string_pointer)
 			: (char *)NULL;
+#if defined (ANBS_AI_ENABLED)
+  /* Prompt rendering has a latency objective; see @perf slo */
+  gettimeofday (&now, (void *)NULL);
+  anbs_metrics_slo_observe ("prompt", (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_usec - start.tv_usec) / 1000.0);
+#endif
 
   if (temp_prompt == 0)
     {
@@ -5586,6 +5719,45 @@ prompt_again (force)
     }
 }
 
+#if defined (ANBS_AI_ENABLED) && defined (READLINE)
+/* Decode the prompt readline is showing again and redraw it in place;
+   called when a \Q{...} prompt segment has new output.  The lines of a
+   multi-line prompt above the one being edited are redrawn too. */
+void
+prompt_redisplay ()
+{
+  char *temp_prompt, *t;
+  int lines;
+
+  if (no_line_editing || current_prompt_string == 0 || current_readline_prompt == 0 ||
+      rl_prompt == 0 || STREQ (rl_prompt, current_readline_prompt) == 0)
+    return;
+
+  temp_prompt = decode_prompt_string (current_prompt_string);
+  if (temp_prompt == 0 || STREQ (temp_prompt, current_readline_prompt))
+    {
+      FREE (temp_prompt);
+      return;
+    }
+
+  for (lines = 0, t = current_readline_prompt; *t; t++)
+    if (*t == '\n')
+      lines++;
+
+  rl_clear_visible_line ();
+  if (lines > 0)
+    {
+      fprintf (rl_outstream, "\033[%dA\033[J", lines);
+      fflush (rl_outstream);
+    }
+
+  free (current_readline_prompt);
+  current_readline_prompt = temp_prompt;
+  rl_set_prompt (current_readline_prompt);
+  rl_forced_update_display ();
+}
+#endif
+
 int
 get_current_prompt_level ()
 {
@@ -5815,6 +5987,46 @@ decode_prompt_string (string)
 	      else
 		temp = savestring (timebuf);
 	      goto add_string;
+
+#if defined (ANBS_AI_ENABLED)
+	    case 'Q':		/* output of a command run in the background */
+	      if (string[1] != '{')		/* } */
+		goto not_escape;
+
+	      string += 2;			/* skip { */
+	      for (t = string, n = 1; *string; string++)
+		{
+		  if (*string == '\\' && string[1])
+		    string++;
+		  else if (*string == '{')
+		    n++;
+		  else if (*string == '}' && --n == 0)
+		    break;
+		}
+	      timefmt = substring (t, 0, string - t);
+	      c = *string;	/* tested at add_string */
+	      t = prompt_segment_value (timefmt);
+	      free (timefmt);
+
+	      if (promptvars || posixly_correct)
+		temp = sh_backslash_quote_for_double_quotes (t, 0);
+	      else
+		{
+		  char *s, *r;
+
+		  /* Protect characters dequote_string would remove */
+		  temp = r = (char *)xmalloc (2 * strlen (t) + 1);
+		  for (s = t; *s; s++)
+		    {
+		      if (*s == CTLESC || *s == CTLNUL)
+			*r++ = CTLESC;
+		      *r++ = *s;
+		    }
+		  *r = '\0';
+		}
+	      free (t);
+	      goto add_string;
+#endif
 	      
 	    case 'n':
 	      temp = (char *)xmalloc (3);
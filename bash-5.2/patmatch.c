@@ -0,0 +1,1062 @@
+/* patmatch.c -- compiled matchers for simple shell patterns. */
+
+/* Copyright (C) 2024 Free Software Foundation, Inc.
+
+   This file is part of GNU Bash, the Bourne Again SHell.
+
+   Bash is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Bash is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Bash.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include "bashtypes.h"
+
+#if defined (HAVE_UNISTD_H)
+#  include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <ctype.h>
+
+#include "bashansi.h"
+#include "typemax.h"
+
+#include "shell.h"
+#include "pathexp.h"
+#include "patmatch.h"
+
+/* strmatch() walks the pattern and backtracks over the string on every
+   call, and ${var//pat/rep} calls it over the rest of the string once
+   for each match it finds.  Most patterns people write there and in
+   [[ ... == ... ]] are a run of fixed-width pieces -- literal characters,
+   `?' and bracket expressions -- possibly between a leading and a
+   trailing `*'.  We compile those once into a table of the bytes each
+   position accepts, keep the last few compiled, and match them in a
+   single pass.
+
+   Other patterns -- stars in the middle, and the extglob groups ?(...),
+   *(...), +(...) and @(...) -- are compiled into an NFA, which is run
+   over the string with every live state tracked at once, so there is no
+   backtracking however the pattern nests.  Whole-string matches, which
+   is what `case' and [[ ]] want, go through a DFA built from the NFA a
+   transition at a time as strings need them.  !(...) isn't a regular
+   construct, and it and anything else goes back to strmatch(). */
+
+#define PATCACHE_SIZE	16
+
+#define NFA_MAXLEN	4096	/* longer patterns aren't worth compiling */
+#define DFA_MAXSTATES	32	/* past this, simulate the NFA instead */
+
+/* One position in a compiled pattern */
+struct patatom
+{
+  int lit;			/* the byte it matches, or -1 to use SET */
+  unsigned char set[32];	/* bitmap of the bytes it matches */
+};
+
+/* A state in an NFA.  An NFA_ATOM state consumes a byte that ATOM
+   matches and moves to OUT; NFA_SPLIT moves to both OUT and OUT1 and
+   NFA_EMPTY to OUT without consuming anything. */
+struct nfastate
+{
+  int type;
+  int out, out1;
+  struct patatom atom;
+};
+
+#define NFA_ATOM	1
+#define NFA_SPLIT	2
+#define NFA_EMPTY	3
+#define NFA_MATCH	4
+
+/* A piece of an NFA under construction: START is where it's entered,
+   and END is an NFA_ATOM or NFA_EMPTY state whose OUT is still to be
+   filled in */
+struct nfafrag
+{
+  int start, end;
+};
+
+/* A state the NFA is in, and where in the string the attempt that
+   reached it began */
+struct nfathread
+{
+  int state;
+  int start;
+};
+
+/* A DFA state: the set of NFA states it stands for, and the DFA state
+   each byte takes it to */
+struct dfastate
+{
+  int *set;
+  int nset;
+  int accept;
+  short next[256];
+};
+
+#define DFA_UNKNOWN	-1	/* transition not computed yet */
+#define DFA_DEAD	-2	/* no NFA state survives the byte */
+#define DFA_FULL	-3	/* no room for another state */
+
+struct patnfa
+{
+  int nstates, size;
+  int start;
+  struct nfastate *states;
+  struct nfathread *clist, *nlist;
+  int *mark;			/* generation a state was last added in */
+  int gen;
+  struct dfastate *dfa;		/* DFA_MAXSTATES of them, allocated on first use */
+  int ndfa;
+};
+
+struct compiled_pattern
+{
+  char *source;
+  int settings;			/* shell options it was compiled under */
+  int usable;			/* 0 if it needs strmatch() */
+  int simple;			/* 1 if ATOMS below are usable */
+  int lead, trail;		/* starts or ends with `*' */
+  int natoms;
+  struct patatom *atoms;
+  char *literal;		/* the text to match, if every atom is literal */
+  struct patnfa *nfa;		/* for the rest, and for finding starred patterns */
+};
+
+#define SETTING_EXTGLOB		0x01
+#define SETTING_ASCIIRANGE	0x02
+#define SETTING_NOCASE		0x04
+
+#define SET_HAS(a, c)	((a)->set[(c) >> 3] & (1 << ((c) & 7)))
+#define SET_ADD(a, c)	((a)->set[(c) >> 3] |= (1 << ((c) & 7)))
+
+#define ATOM_MATCHES(a, c) \
+  ((a)->lit >= 0 ? (c) == (a)->lit : ((c) != 0 && SET_HAS (a, c)))
+
+extern int glob_asciirange;
+
+static struct compiled_pattern patcache[PATCACHE_SIZE];
+static int patcache_next;
+static int patcache_last;
+
+static int current_settings PARAMS((void));
+static int class_add PARAMS((struct patatom *, const char *, int));
+static char *bracket_compile PARAMS((struct patatom *, char *));
+static int pattern_compile PARAMS((struct compiled_pattern *, char *));
+static void pattern_dispose PARAMS((struct compiled_pattern *));
+static int nfa_state PARAMS((struct patnfa *, int, int, int));
+static int nfa_sequence PARAMS((struct patnfa *, char **, int, struct nfafrag *));
+static int nfa_group PARAMS((struct patnfa *, char **, int, struct nfafrag *));
+static struct patnfa *nfa_compile PARAMS((char *));
+static void nfa_dispose PARAMS((struct patnfa *));
+static int nfa_add PARAMS((struct patnfa *, struct nfathread *, int, int, int));
+static int nfa_run PARAMS((struct patnfa *, char *, int, int, char **, char **));
+static int dfa_state PARAMS((struct patnfa *, struct nfathread *, int));
+static int dfa_step PARAMS((struct patnfa *, int, int));
+static int dfa_match PARAMS((struct patnfa *, char *));
+static struct compiled_pattern *pattern_lookup PARAMS((char *));
+static int match_here PARAMS((struct compiled_pattern *, const char *));
+static char *match_first PARAMS((struct compiled_pattern *, char *));
+
+static int
+current_settings ()
+{
+  return ((extended_glob ? SETTING_EXTGLOB : 0) |
+	  (glob_asciirange ? SETTING_ASCIIRANGE : 0) |
+	  (match_ignore_case ? SETTING_NOCASE : 0));
+}
+
+/* Add the members of the character class NAME, LEN bytes long, to ATOM.
+   Returns 0 if NAME isn't a class we know. */
+static int
+class_add (atom, name, len)
+     struct patatom *atom;
+     const char *name;
+     int len;
+{
+  static const char * const classes[] =
+    {
+      "alnum", "alpha", "ascii", "blank", "cntrl", "digit", "graph",
+      "lower", "print", "punct", "space", "upper", "word", "xdigit", 0
+    };
+  int i, c, m;
+
+  for (i = 0; classes[i]; i++)
+    if (strlen (classes[i]) == len && strncmp (classes[i], name, len) == 0)
+      break;
+  if (classes[i] == 0)
+    return 0;
+
+  for (c = 1; c < 256; c++)
+    {
+      switch (i)
+	{
+	case 0: m = isalnum (c); break;
+	case 1: m = isalpha (c); break;
+	case 2: m = c < 128; break;
+	case 3: m = c == ' ' || c == '\t'; break;
+	case 4: m = iscntrl (c); break;
+	case 5: m = isdigit (c); break;
+	case 6: m = isgraph (c); break;
+	case 7: m = islower (c); break;
+	case 8: m = isprint (c); break;
+	case 9: m = ispunct (c); break;
+	case 10: m = isspace (c); break;
+	case 11: m = isupper (c); break;
+	case 12: m = isalnum (c) || c == '_'; break;
+	default: m = isxdigit (c); break;
+	}
+      if (m)
+	SET_ADD (atom, c);
+    }
+  return 1;
+}
+
+/* Compile the bracket expression starting just after the `[' at P into
+   ATOM.  Returns a pointer past the closing `]', or NULL if it's one we
+   leave to strmatch(): collating symbols, equivalence classes, ranges
+   that depend on the locale's collation order, and a `[' that isn't a
+   bracket expression at all. */
+static char *
+bracket_compile (atom, p)
+     struct patatom *atom;
+     char *p;
+{
+  int negate, first, lo, hi, c;
+  char *close;
+
+  memset (atom->set, 0, sizeof (atom->set));
+  atom->lit = -1;
+
+  negate = (*p == '!' || *p == '^');
+  if (negate)
+    p++;
+
+  for (first = 1; ; first = 0)
+    {
+      if (*p == '\0')
+	return ((char *)NULL);
+      if (*p == ']' && first == 0)
+	break;
+      if (*p == '[' && (p[1] == '=' || p[1] == '.'))
+	return ((char *)NULL);
+      if (*p == '[' && p[1] == ':')
+	{
+	  for (close = p + 2; *close && (close[0] != ':' || close[1] != ']'); close++)
+	    ;
+	  if (*close == '\0' || class_add (atom, p + 2, close - p - 2) == 0)
+	    return ((char *)NULL);
+	  p = close + 2;
+	  continue;
+	}
+
+      if (*p == '\\')
+	p++;
+      if (*p == '\0')
+	return ((char *)NULL);
+      lo = (unsigned char)*p++;
+
+      if (p[0] == '-' && p[1] != ']' && p[1] != '\0')
+	{
+	  p++;
+	  if (*p == '\\')
+	    p++;
+	  if (*p == '\0' || glob_asciirange == 0)
+	    return ((char *)NULL);
+	  hi = (unsigned char)*p++;
+	}
+      else
+	hi = lo;
+
+      for (c = lo; c <= hi; c++)
+	SET_ADD (atom, c);
+    }
+
+  if (negate)
+    for (c = 0; c < 32; c++)
+      atom->set[c] = ~atom->set[c];
+  atom->set[0] &= ~1;		/* never NUL */
+
+  return (p + 1);
+}
+
+/* Compile PAT into CP.  Returns 0 if it isn't a pattern we handle. */
+static int
+pattern_compile (cp, pat)
+     struct compiled_pattern *cp;
+     char *pat;
+{
+  char *p, *next;
+  int n, i, size, literal;
+  struct patatom *atom;
+
+  cp->lead = cp->trail = 0;
+  cp->natoms = 0;
+  cp->atoms = (struct patatom *)NULL;
+  cp->literal = (char *)NULL;
+
+  /* Case-insensitive matching and non-UTF-8 multibyte locales, where a
+     byte can look like an ASCII character in the middle of another
+     character, are strmatch()'s business. */
+  if (match_ignore_case || (locale_mb_cur_max > 1 && locale_utf8locale == 0))
+    return 0;
+
+  p = pat;
+  while (*p == '*')
+    {
+      if (extended_glob && p[1] == '(')
+	return 0;
+      cp->lead = 1;
+      p++;
+    }
+
+  size = strlen (p) + 1;
+  cp->atoms = (struct patatom *)xmalloc (size * sizeof (struct patatom));
+
+  for (literal = 1, n = 0; *p; n++)
+    {
+      atom = cp->atoms + n;
+      if (extended_glob && p[1] == '(' && (*p == '?' || *p == '+' || *p == '@' || *p == '!'))
+	return 0;
+
+      switch (*p)
+	{
+	case '*':
+	  /* Only trailing stars; anything else needs backtracking */
+	  for (next = p; *next == '*'; next++)
+	    ;
+	  if (*next || (extended_glob && p[1] == '('))
+	    return 0;
+	  cp->trail = 1;
+	  p = next;
+	  n--;
+	  continue;
+
+	case '?':
+	  memset (atom->set, 0xff, sizeof (atom->set));
+	  atom->set[0] &= ~1;
+	  atom->lit = -1;
+	  p++;
+	  break;
+
+	case '[':
+	  next = bracket_compile (atom, p + 1);
+	  if (next == 0)
+	    return 0;
+	  p = next;
+	  break;
+
+	case '\\':
+	  if (p[1] == '\0')
+	    return 0;
+	  p++;
+	  /* FALLTHROUGH */
+	default:
+	  atom->lit = (unsigned char)*p++;
+	  continue;
+	}
+
+      /* `?' and brackets match one byte, which is one character only in
+	 a single-byte locale */
+      if (locale_mb_cur_max > 1)
+	return 0;
+      literal = 0;
+    }
+  cp->natoms = n;
+
+  if (literal)
+    {
+      cp->literal = (char *)xmalloc (n + 1);
+      for (i = 0; i < n; i++)
+	cp->literal[i] = cp->atoms[i].lit;
+      cp->literal[n] = '\0';
+    }
+
+  return 1;
+}
+
+static void
+pattern_dispose (cp)
+     struct compiled_pattern *cp;
+{
+  FREE (cp->source);
+  FREE (cp->atoms);
+  FREE (cp->literal);
+  if (cp->nfa)
+    nfa_dispose (cp->nfa);
+  cp->source = cp->literal = (char *)NULL;
+  cp->atoms = (struct patatom *)NULL;
+  cp->nfa = (struct patnfa *)NULL;
+}
+
+/* Add a state to NFA.  Returns its index, or -1 if the NFA is full. */
+static int
+nfa_state (nfa, type, out, out1)
+     struct patnfa *nfa;
+     int type, out, out1;
+{
+  struct nfastate *st;
+
+  if (nfa->nstates == nfa->size)
+    return -1;
+  st = nfa->states + nfa->nstates;
+  st->type = type;
+  st->out = out;
+  st->out1 = out1;
+  return (nfa->nstates++);
+}
+
+/* Compile the pattern at *PP, up to its end or, if INGROUP is non-zero,
+   the `|' or `)' that ends an alternative in an extglob group, into
+   FRAG.  Leaves *PP at the character that stopped it.  Returns 0 if the
+   pattern is one strmatch() has to handle. */
+static int
+nfa_sequence (nfa, pp, ingroup, frag)
+     struct patnfa *nfa;
+     char **pp;
+     int ingroup;
+     struct nfafrag *frag;
+{
+  struct nfafrag piece;
+  struct nfastate *st;
+  char *p, *next;
+  int c, any;
+
+  frag->start = frag->end = nfa_state (nfa, NFA_EMPTY, -1, -1);
+  if (frag->start < 0)
+    return 0;
+
+  for (p = *pp; ; )
+    {
+      c = *p;
+      if (c == '\0')
+	{
+	  if (ingroup)
+	    return 0;		/* unterminated group */
+	  break;
+	}
+      if (ingroup && (c == '|' || c == ')'))
+	break;
+
+      if (extended_glob && p[1] == '(' && (c == '?' || c == '*' || c == '+' || c == '@' || c == '!'))
+	{
+	  if (c == '!')
+	    return 0;
+	  p += 2;
+	  if (nfa_group (nfa, &p, c, &piece) == 0)
+	    return 0;
+	}
+      else if (c == '*')
+	{
+	  while (p[1] == '*' && (extended_glob == 0 || p[2] != '('))
+	    p++;
+	  p++;
+	  /* strmatch() doesn't let a run of stars and question marks give
+	     up the rest of the string to a group that follows it, so such
+	     a group may not match the empty string there; leave those to
+	     it so we agree */
+	  for (next = p; *next == '*' || *next == '?'; next++)
+	    if (extended_glob && next[1] == '(')
+	      return 0;
+	  if (extended_glob && next[0] && next[1] == '(' && (*next == '+' || *next == '@' || *next == '!'))
+	    return 0;
+	  /* SPLIT -> (ANY -> SPLIT) | EMPTY */
+	  piece.start = nfa_state (nfa, NFA_SPLIT, -1, -1);
+	  any = nfa_state (nfa, NFA_ATOM, piece.start, -1);
+	  piece.end = nfa_state (nfa, NFA_EMPTY, -1, -1);
+	  if (piece.end < 0)
+	    return 0;
+	  st = nfa->states + any;
+	  memset (st->atom.set, 0xff, sizeof (st->atom.set));
+	  st->atom.set[0] &= ~1;
+	  st->atom.lit = -1;
+	  nfa->states[piece.start].out = any;
+	  nfa->states[piece.start].out1 = piece.end;
+	}
+      else
+	{
+	  piece.start = piece.end = nfa_state (nfa, NFA_ATOM, -1, -1);
+	  if (piece.start < 0)
+	    return 0;
+	  st = nfa->states + piece.start;
+	  if (c == '?' || c == '[')
+	    {
+	      /* These match one byte, which is one character only in a
+		 single-byte locale */
+	      if (locale_mb_cur_max > 1)
+		return 0;
+	      if (c == '?')
+		{
+		  memset (st->atom.set, 0xff, sizeof (st->atom.set));
+		  st->atom.set[0] &= ~1;
+		  st->atom.lit = -1;
+		  p++;
+		}
+	      else
+		{
+		  next = bracket_compile (&st->atom, p + 1);
+		  if (next == 0)
+		    return 0;
+		  p = next;
+		}
+	    }
+	  else
+	    {
+	      if (c == '\\')
+		{
+		  if (p[1] == '\0')
+		    return 0;
+		  p++;
+		}
+	      st->atom.lit = (unsigned char)*p++;
+	    }
+	}
+
+      nfa->states[frag->end].out = piece.start;
+      frag->end = piece.end;
+    }
+
+  *pp = p;
+  return 1;
+}
+
+/* Compile the extglob group whose alternatives start at *PP, just past
+   the `(', into FRAG.  OP is the character before the `('.  Leaves *PP
+   past the closing `)'. */
+static int
+nfa_group (nfa, pp, op, frag)
+     struct patnfa *nfa;
+     char **pp;
+     int op;
+     struct nfafrag *frag;
+{
+  struct nfafrag alt;
+  int entry, join, split;
+
+  join = nfa_state (nfa, NFA_EMPTY, -1, -1);
+  if (join < 0)
+    return 0;
+
+  /* Alternatives have no precedence; we want the longest match anyway */
+  for (entry = -1; ; )
+    {
+      /* strmatch() treats empty alternatives inconsistently; leave
+	 them to it so we agree */
+      if (nfa_sequence (nfa, pp, 1, &alt) == 0 || alt.start == alt.end)
+	return 0;
+      nfa->states[alt.end].out = join;
+      if (entry < 0)
+	entry = alt.start;
+      else
+	{
+	  entry = nfa_state (nfa, NFA_SPLIT, entry, alt.start);
+	  if (entry < 0)
+	    return 0;
+	}
+      if (**pp == ')')
+	break;
+      (*pp)++;			/* skip the `|' */
+    }
+  (*pp)++;
+
+  if (op == '@')
+    {
+      frag->start = entry;
+      frag->end = join;
+      return 1;
+    }
+
+  frag->end = nfa_state (nfa, NFA_EMPTY, -1, -1);
+  split = nfa_state (nfa, NFA_SPLIT, entry, frag->end);
+  if (split < 0)
+    return 0;
+
+  switch (op)
+    {
+    case '?':			/* zero or one */
+      frag->start = split;
+      nfa->states[join].out = frag->end;
+      break;
+    case '*':			/* zero or more */
+      frag->start = split;
+      nfa->states[join].out = split;
+      break;
+    default:			/* `+', one or more */
+      frag->start = entry;
+      nfa->states[join].out = split;
+      break;
+    }
+  return 1;
+}
+
+/* Compile PAT into an NFA, or return NULL if it's one strmatch() has to
+   handle. */
+static struct patnfa *
+nfa_compile (pat)
+     char *pat;
+{
+  struct patnfa *nfa;
+  struct nfafrag frag;
+  char *p;
+  size_t len;
+  int final;
+
+  len = strlen (pat);
+  if (len > NFA_MAXLEN)
+    return ((struct patnfa *)NULL);
+
+  nfa = (struct patnfa *)xmalloc (sizeof (struct patnfa));
+  nfa->nstates = 0;
+  nfa->size = 3 * len + 4;
+  nfa->states = (struct nfastate *)xmalloc (nfa->size * sizeof (struct nfastate));
+  nfa->clist = nfa->nlist = (struct nfathread *)NULL;
+  nfa->mark = (int *)NULL;
+  nfa->dfa = (struct dfastate *)NULL;
+  nfa->ndfa = 0;
+
+  p = pat;
+  if (nfa_sequence (nfa, &p, 0, &frag) == 0 ||
+      (final = nfa_state (nfa, NFA_MATCH, -1, -1)) < 0)
+    {
+      nfa_dispose (nfa);
+      return ((struct patnfa *)NULL);
+    }
+  nfa->states[frag.end].out = final;
+  nfa->start = frag.start;
+
+  nfa->clist = (struct nfathread *)xmalloc (nfa->nstates * sizeof (struct nfathread));
+  nfa->nlist = (struct nfathread *)xmalloc (nfa->nstates * sizeof (struct nfathread));
+  nfa->mark = (int *)xmalloc (nfa->nstates * sizeof (int));
+  memset (nfa->mark, 0, nfa->nstates * sizeof (int));
+  nfa->gen = 0;
+
+  return nfa;
+}
+
+static void
+nfa_dispose (nfa)
+     struct patnfa *nfa;
+{
+  int i;
+
+  for (i = 0; i < nfa->ndfa; i++)
+    free (nfa->dfa[i].set);
+  FREE (nfa->dfa);
+  FREE (nfa->states);
+  FREE (nfa->clist);
+  FREE (nfa->nlist);
+  FREE (nfa->mark);
+  free (nfa);
+}
+
+/* Add STATE, and every state reachable from it without consuming a
+   byte, to LIST, which has N threads, unless they're already there.
+   Threads are added in order of their START, so the first to reach a
+   state is the one that started leftmost.  Returns the new N. */
+static int
+nfa_add (nfa, list, n, state, start)
+     struct patnfa *nfa;
+     struct nfathread *list;
+     int n, state, start;
+{
+  struct nfastate *st;
+
+  for (;;)
+    {
+      if (state < 0 || nfa->mark[state] == nfa->gen)
+	return n;
+      nfa->mark[state] = nfa->gen;
+      st = nfa->states + state;
+      switch (st->type)
+	{
+	case NFA_SPLIT:
+	  n = nfa_add (nfa, list, n, st->out, start);
+	  state = st->out1;
+	  continue;
+	case NFA_EMPTY:
+	  state = st->out;
+	  continue;
+	default:
+	  list[n].state = state;
+	  list[n].start = start;
+	  return (n + 1);
+	}
+    }
+}
+
+/* Start a new generation of NFA's state marks */
+#define NFA_NEWGEN(nfa) \
+  do { \
+    if (++(nfa)->gen == INT_MAX) \
+      { \
+	memset ((nfa)->mark, 0, (nfa)->nstates * sizeof (int)); \
+	(nfa)->gen = 1; \
+      } \
+  } while (0)
+
+/* Run NFA over STRING.  With ANCHORED, a match has to start at the
+   beginning of STRING; with ATEND, it has to end at the end.  Finds the
+   leftmost match, and the longest match starting there, and sets *SP
+   and *EP to its bounds.  Returns 1 if there is one. */
+static int
+nfa_run (nfa, string, anchored, atend, sp, ep)
+     struct patnfa *nfa;
+     char *string;
+     int anchored, atend;
+     char **sp, **ep;
+{
+  struct nfathread *clist, *nlist, *t;
+  struct nfastate *st;
+  int n, nn, i, j, c, bstart, bend;
+
+  clist = nfa->clist;
+  nlist = nfa->nlist;
+  bstart = bend = -1;
+
+  NFA_NEWGEN (nfa);
+  n = nfa_add (nfa, clist, 0, nfa->start, 0);
+
+  for (i = 0; ; i++)
+    {
+      c = (unsigned char)string[i];
+
+      for (j = 0, t = clist; j < n; j++, t++)
+	if (nfa->states[t->state].type == NFA_MATCH && (atend == 0 || c == 0) &&
+	    (bstart < 0 || t->start < bstart || (t->start == bstart && i > bend)))
+	  {
+	    bstart = t->start;
+	    bend = i;
+	  }
+
+      if (c == 0)
+	break;
+
+      NFA_NEWGEN (nfa);
+      for (nn = j = 0, t = clist; j < n; j++, t++)
+	{
+	  /* Nothing that started right of the best match can beat it */
+	  if (bstart >= 0 && t->start > bstart)
+	    continue;
+	  st = nfa->states + t->state;
+	  if (st->type == NFA_ATOM && ATOM_MATCHES (&st->atom, c))
+	    nn = nfa_add (nfa, nlist, nn, st->out, t->start);
+	}
+      if (anchored == 0 && bstart < 0)
+	nn = nfa_add (nfa, nlist, nn, nfa->start, i + 1);
+
+      t = clist;
+      clist = nlist;
+      nlist = t;
+      n = nn;
+
+      if (n == 0 && (anchored || bstart >= 0))
+	break;
+    }
+
+  if (bstart < 0)
+    return 0;
+  *sp = string + bstart;
+  *ep = string + bend;
+  return 1;
+}
+
+/* Return the DFA state for the NFA states in the N threads in LIST,
+   adding it if it's new, or DFA_FULL if there's no room. */
+static int
+dfa_state (nfa, list, n)
+     struct patnfa *nfa;
+     struct nfathread *list;
+     int n;
+{
+  struct dfastate *d;
+  int *set, i, j, t;
+
+  /* Sort the states so the same set always looks the same */
+  set = (int *)xmalloc (n * sizeof (int));
+  for (i = 0; i < n; i++)
+    {
+      t = list[i].state;
+      for (j = i; j > 0 && set[j - 1] > t; j--)
+	set[j] = set[j - 1];
+      set[j] = t;
+    }
+
+  for (i = 0, d = nfa->dfa; i < nfa->ndfa; i++, d++)
+    if (d->nset == n && memcmp (d->set, set, n * sizeof (int)) == 0)
+      {
+	free (set);
+	return i;
+      }
+
+  if (nfa->ndfa == DFA_MAXSTATES)
+    {
+      free (set);
+      return DFA_FULL;
+    }
+
+  d = nfa->dfa + nfa->ndfa;
+  d->set = set;
+  d->nset = n;
+  for (d->accept = 0, i = 0; i < n; i++)
+    if (nfa->states[set[i]].type == NFA_MATCH)
+      d->accept = 1;
+  for (i = 0; i < 256; i++)
+    d->next[i] = DFA_UNKNOWN;
+  return (nfa->ndfa++);
+}
+
+/* Compute where byte C takes DFA state D */
+static int
+dfa_step (nfa, d, c)
+     struct patnfa *nfa;
+     int d, c;
+{
+  struct nfastate *st;
+  int i, n, next;
+
+  NFA_NEWGEN (nfa);
+  for (n = i = 0; i < nfa->dfa[d].nset; i++)
+    {
+      st = nfa->states + nfa->dfa[d].set[i];
+      if (st->type == NFA_ATOM && ATOM_MATCHES (&st->atom, c))
+	n = nfa_add (nfa, nfa->clist, n, st->out, 0);
+    }
+
+  next = (n == 0) ? DFA_DEAD : dfa_state (nfa, nfa->clist, n);
+  if (next != DFA_FULL)
+    nfa->dfa[d].next[c] = next;
+  return next;
+}
+
+/* Does all of STRING match NFA?  Returns -1 if the DFA ran out of room
+   and the caller should simulate the NFA. */
+static int
+dfa_match (nfa, string)
+     struct patnfa *nfa;
+     char *string;
+{
+  unsigned char *s;
+  int d, next, n;
+
+  if (nfa->dfa == 0)
+    {
+      nfa->dfa = (struct dfastate *)xmalloc (DFA_MAXSTATES * sizeof (struct dfastate));
+      NFA_NEWGEN (nfa);
+      n = nfa_add (nfa, nfa->clist, 0, nfa->start, 0);
+      dfa_state (nfa, nfa->clist, n);		/* always state 0 */
+    }
+
+  for (d = 0, s = (unsigned char *)string; *s; s++)
+    {
+      next = nfa->dfa[d].next[*s];
+      if (next == DFA_UNKNOWN)
+	next = dfa_step (nfa, d, *s);
+      if (next == DFA_DEAD)
+	return 0;
+      if (next == DFA_FULL)
+	return -1;
+      d = next;
+    }
+  return (nfa->dfa[d].accept);
+}
+
+/* Return PAT compiled for the current settings, or NULL if strmatch()
+   should handle it.  Patterns we can't compile are remembered too, so
+   we don't try every time. */
+static struct compiled_pattern *
+pattern_lookup (pat)
+     char *pat;
+{
+  struct compiled_pattern *cp;
+  int settings, i;
+
+  settings = current_settings ();
+
+  cp = patcache + patcache_last;
+  if (cp->source == 0 || cp->settings != settings || STREQ (cp->source, pat) == 0)
+    {
+      for (i = 0, cp = patcache; i < PATCACHE_SIZE; i++, cp++)
+	if (cp->source && cp->settings == settings && STREQ (cp->source, pat))
+	  break;
+
+      if (i == PATCACHE_SIZE)
+	{
+	  i = patcache_next;
+	  patcache_next = (patcache_next + 1) % PATCACHE_SIZE;
+	  cp = patcache + i;
+	  pattern_dispose (cp);
+
+	  cp->source = savestring (pat);
+	  cp->settings = settings;
+	  cp->simple = pattern_compile (cp, pat);
+	  if (cp->simple == 0)
+	    {
+	      FREE (cp->atoms);
+	      FREE (cp->literal);
+	      cp->atoms = (struct patatom *)NULL;
+	      cp->literal = (char *)NULL;
+	    }
+	  /* Finding the longest match for a starred pattern takes the NFA */
+	  if ((cp->simple == 0 && match_ignore_case == 0 && (locale_mb_cur_max == 1 || locale_utf8locale)) ||
+	      (cp->simple && (cp->lead || cp->trail)))
+	    cp->nfa = nfa_compile (pat);
+	  cp->usable = cp->simple || cp->nfa;
+	}
+      patcache_last = i;
+    }
+
+  return (cp->usable ? cp : (struct compiled_pattern *)NULL);
+}
+
+/* Does CP's sequence of atoms match at S? */
+static int
+match_here (cp, s)
+     struct compiled_pattern *cp;
+     const char *s;
+{
+  struct patatom *atom;
+  int i, c;
+
+  for (i = 0, atom = cp->atoms; i < cp->natoms; i++, atom++)
+    {
+      c = (unsigned char)s[i];
+      if (ATOM_MATCHES (atom, c) == 0)
+	return 0;
+    }
+  return 1;
+}
+
+/* The leftmost place in S where CP's atoms match, or NULL */
+static char *
+match_first (cp, s)
+     struct compiled_pattern *cp;
+     char *s;
+{
+  struct patatom *atom;
+
+  if (cp->literal)
+    return (strstr (s, cp->literal));
+
+  atom = cp->atoms;
+  for ( ; *s; s++)
+    {
+      if (atom->lit >= 0)
+	{
+	  s = strchr (s, atom->lit);
+	  if (s == 0)
+	    break;
+	}
+      if (match_here (cp, s))
+	return s;
+    }
+  return ((char *)NULL);
+}
+
+int
+patmatch_find (string, pat, mtype, sp, ep)
+     char *string, *pat;
+     int mtype;
+     char **sp, **ep;
+{
+  struct compiled_pattern *cp;
+  char *s;
+  size_t len;
+
+  cp = pattern_lookup (pat);
+  if (cp == 0)
+    return -1;
+
+  /* A pattern with a `*' matches as much as it can */
+  if (cp->simple == 0 || cp->lead || cp->trail || cp->natoms == 0)
+    {
+      if (cp->nfa == 0)
+	return -1;
+      switch (mtype & MATCH_TYPEMASK)
+	{
+	case MATCH_ANY:
+	  return (nfa_run (cp->nfa, string, 0, 0, sp, ep));
+	case MATCH_BEG:
+	  return (nfa_run (cp->nfa, string, 1, 0, sp, ep));
+	case MATCH_END:
+	  return (nfa_run (cp->nfa, string, 0, 1, sp, ep));
+	default:
+	  return -1;
+	}
+    }
+
+  switch (mtype & MATCH_TYPEMASK)
+    {
+    case MATCH_ANY:
+      s = match_first (cp, string);
+      break;
+    case MATCH_BEG:
+      s = match_here (cp, string) ? string : (char *)NULL;
+      break;
+    case MATCH_END:
+      len = strlen (string);
+      s = (len >= cp->natoms && match_here (cp, string + len - cp->natoms)) ? string + len - cp->natoms : (char *)NULL;
+      break;
+    default:
+      return -1;
+    }
+
+  if (s == 0)
+    return 0;
+  *sp = s;
+  *ep = s + cp->natoms;
+  return 1;
+}
+
+int
+patmatch_full (string, pat)
+     char *string, *pat;
+{
+  struct compiled_pattern *cp;
+  size_t len;
+  char *sp, *ep;
+  int r;
+
+  cp = pattern_lookup (pat);
+  if (cp == 0)
+    return -1;
+
+  if (cp->simple == 0)
+    {
+      r = dfa_match (cp->nfa, string);
+      return (r >= 0 ? r : nfa_run (cp->nfa, string, 1, 1, &sp, &ep));
+    }
+
+  if (cp->lead && cp->trail)
+    return (cp->natoms == 0 || match_first (cp, string) != 0);
+  else if (cp->lead)
+    {
+      len = strlen (string);
+      return (len >= cp->natoms && match_here (cp, string + len - cp->natoms));
+    }
+  else if (cp->trail)
+    return (match_here (cp, string));
+  else
+    return (match_here (cp, string) && string[cp->natoms] == '\0');
+}
+
+void
+patmatch_flush ()
+{
+  int i;
+
+  for (i = 0; i < PATCACHE_SIZE; i++)
+    pattern_dispose (patcache + i);
+  patcache_next = patcache_last = 0;
+}
@@ -0,0 +1,40 @@
+/* patmatch.h -- compiled matchers for simple shell patterns. */
+
+/* Copyright (C) 2024 Free Software Foundation, Inc.
+
+   This file is part of GNU Bash, the Bourne Again SHell.
+
+   Bash is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Bash is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Bash.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined (_PATMATCH_H_)
+#define _PATMATCH_H_
+
+#include "stdc.h"
+
+/* Functions from patmatch.c.  Both return -1 when the pattern is one
+   they don't handle, and the caller should use strmatch(). */
+
+/* Find PAT in STRING the way ${var/pat/rep} does, anchored as MTYPE
+   (MATCH_ANY, MATCH_BEG or MATCH_END) says. */
+extern int patmatch_find PARAMS((char *, char *, int, char **, char **));
+
+/* Does all of STRING match PAT, as for [[ string == pat ]], `case' and
+   pathname expansion? */
+extern int patmatch_full PARAMS((char *, char *));
+
+/* Forget compiled patterns; character classes depend on the locale. */
+extern void patmatch_flush PARAMS((void));
+
+#endif /* _PATMATCH_H_ */
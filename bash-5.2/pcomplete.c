@@ -130,6 +130,17 @@ static STRINGLIST *gen_command_matches PARAMS((COMPSPEC *, const char *,
 					    char *, int, WORD_LIST *,
 					    int, int));
 
+#if defined (ANBS_AI_ENABLED)
+struct compcache;
+
+static int compcache_ttl PARAMS((void));
+static void compcache_dispose PARAMS((struct compcache *));
+static struct compcache *compcache_find PARAMS((const char *, int));
+static void compcache_store PARAMS((char *, STRINGLIST *, int, int));
+static STRINGLIST *gen_cached_matches PARAMS((int, COMPSPEC *, const char *,
+					       const char *, char *, int,
+					       WORD_LIST *, int, int, int *));
+#endif
 static STRINGLIST *gen_progcomp_completions PARAMS((const char *, const char *,
 						 const char *,
 						 int, int, int *, int *,
@@ -1293,6 +1304,179 @@ gen_command_matches (cs, cmd, text, line, ind, lwords, nw, cw)
   return (sl);
 }
 
+#if defined (ANBS_AI_ENABLED)
+/* Setting ANBS_COMPLETION_CACHE to a number of seconds keeps what
+   `complete -F' functions and `complete -C' commands return for that long,
+   so completing the same command line in the same directory again doesn't
+   run a slow completer a second time.  Entries are keyed on the function
+   or command, the line and the cursor position within it, and the
+   current directory. */
+
+#define COMPCACHE_MAX	64
+
+struct compcache
+{
+  struct compcache *next;
+  char *key;
+  time_t stamp;
+  STRINGLIST *matches;
+  int found;		/* what a function returned in *FOUNDP */
+  int options;		/* the compspec's options, which compopt changes */
+};
+
+static struct compcache *compcache;
+static int compcache_count;
+
+static int
+compcache_ttl ()
+{
+  char *v;
+  intmax_t n;
+
+  v = get_string_value ("ANBS_COMPLETION_CACHE");
+  if (v == 0 || *v == 0 || legal_number (v, &n) == 0 || n <= 0)
+    return 0;
+  return (n > 86400 ? 86400 : n);
+}
+
+static void
+compcache_dispose (ce)
+     struct compcache *ce;
+{
+  free (ce->key);
+  strlist_dispose (ce->matches);
+  free (ce);
+  compcache_count--;
+}
+
+/* Return the unexpired entry for KEY, moving it to the front of the list,
+   and drop any expired entries we pass on the way */
+static struct compcache *
+compcache_find (key, ttl)
+     const char *key;
+     int ttl;
+{
+  struct compcache *ce, *prev, *next;
+  time_t now;
+
+  now = time ((time_t *)0);
+  for (prev = 0, ce = compcache; ce; ce = next)
+    {
+      next = ce->next;
+      if (now - ce->stamp >= ttl || now < ce->stamp)
+	{
+	  if (prev)
+	    prev->next = next;
+	  else
+	    compcache = next;
+	  compcache_dispose (ce);
+	  continue;
+	}
+      if (STREQ (ce->key, key))
+	{
+	  if (prev)
+	    {
+	      prev->next = next;
+	      ce->next = compcache;
+	      compcache = ce;
+	    }
+	  return ce;
+	}
+      prev = ce;
+    }
+  return ((struct compcache *)NULL);
+}
+
+/* Remember MATCHES under KEY, which the cache takes over, forgetting the
+   least recently used entry if the cache is full */
+static void
+compcache_store (key, matches, found, options)
+     char *key;
+     STRINGLIST *matches;
+     int found, options;
+{
+  struct compcache *ce, *prev;
+
+  ce = (struct compcache *)xmalloc (sizeof (struct compcache));
+  ce->key = key;
+  ce->stamp = time ((time_t *)0);
+  ce->matches = strlist_copy (matches);
+  ce->found = found;
+  ce->options = options;
+  ce->next = compcache;
+  compcache = ce;
+  compcache_count++;
+
+  if (compcache_count > COMPCACHE_MAX)
+    {
+      for (prev = compcache; prev->next->next; prev = prev->next)
+	;
+      compcache_dispose (prev->next);
+      prev->next = (struct compcache *)NULL;
+    }
+}
+
+/* Run the function (KIND 'F') or command (KIND 'C') in CS, or return what
+   it returned the last time it completed LINE with the cursor at IND in
+   this directory, if that was recent enough. */
+static STRINGLIST *
+gen_cached_matches (kind, cs, cmd, text, line, ind, lwords, nw, cw, foundp)
+     int kind;
+     COMPSPEC *cs;
+     const char *cmd;
+     const char *text;
+     char *line;
+     int ind;
+     WORD_LIST *lwords;
+     int nw, cw;
+     int *foundp;
+{
+  struct compcache *ce;
+  STRINGLIST *sl;
+  char *key, *name, *cwd, *indstr;
+  int ttl, found, klen;
+
+  ttl = compcache_ttl ();
+  key = (char *)NULL;
+  if (ttl > 0 && line)
+    {
+      name = (kind == 'F') ? cs->funcname : cs->command;
+      cwd = the_current_working_directory ? the_current_working_directory : "";
+      indstr = itos (ind);
+      klen = strlen (name) + strlen (cwd) + strlen (indstr) + strlen (line) + 5;
+      key = (char *)xmalloc (klen);
+      sprintf (key, "%c%s\001%s\001%s\001%s", kind, name, cwd, indstr, line);
+      free (indstr);
+
+      if (ce = compcache_find (key, ttl))
+	{
+	  free (key);
+	  if (foundp)
+	    *foundp = ce->found;
+	  cs->options = ce->options;
+	  return (strlist_copy (ce->matches));
+	}
+    }
+
+  found = 0;
+  if (kind == 'F')
+    sl = gen_shell_function_matches (cs, cmd, text, line, ind, lwords, nw, cw, &found);
+  else
+    sl = gen_command_matches (cs, cmd, text, line, ind, lwords, nw, cw);
+  if (foundp)
+    *foundp = found;
+
+  /* A function that isn't there or that loaded a new compspec and asked
+     us to retry didn't produce anything worth keeping */
+  if (key && (kind == 'C' || (found && (found & PCOMP_RETRYFAIL) == 0)))
+    compcache_store (key, sl, found, cs->options);
+  else
+    FREE (key);
+
+  return sl;
+}
+#endif /* ANBS_AI_ENABLED */
+
 static WORD_LIST *
 command_line_to_word_list (line, llen, sentinel, nwp, cwp)
      char *line;
@@ -1422,7 +1606,11 @@ gen_compspec_completions (cs, cmd, word, start, end, foundp)
   if (cs->funcname)
     {
       foundf = 0;
+#if defined (ANBS_AI_ENABLED)
+      tmatches = gen_cached_matches ('F', cs, cmd, word, line, pcomp_ind - start, lwords, nw, cw, &foundf);
+#else
       tmatches = gen_shell_function_matches (cs, cmd, word, line, pcomp_ind - start, lwords, nw, cw, &foundf);
+#endif
       if (foundf != 0)
 	found = foundf;
       if (tmatches)
@@ -1442,7 +1630,11 @@ gen_compspec_completions (cs, cmd, word, start, end, foundp)
 
   if (cs->command)
     {
+#if defined (ANBS_AI_ENABLED)
+      tmatches = gen_cached_matches ('C', cs, cmd, word, line, pcomp_ind - start, lwords, nw, cw, (int *)NULL);
+#else
       tmatches = gen_command_matches (cs, cmd, word, line, pcomp_ind - start, lwords, nw, cw);
+#endif
       if (tmatches)
 	{
 #ifdef DEBUG
@@ -27,6 +27,12 @@
 extern volatile sig_atomic_t interrupt_state;
 extern volatile sig_atomic_t terminating_signal;
 
+/* Non-zero if any of interrupt_state, terminating_signal or a pending trap
+   may need attention; the flags are only looked at when it is set. */
+extern volatile sig_atomic_t signal_pending;
+
+extern void check_pending_signals PARAMS((void));
+
 /* Macro to call a great deal.  SIGINT just sets the interrupt_state variable.
    When it is safe, put QUIT in the code, and the "interrupt" will take
    place.  The same scheme is used for terminating signals (e.g., SIGHUP)
@@ -34,14 +40,13 @@ extern volatile sig_atomic_t terminating_signal;
    end up exiting the shell. */
 #define QUIT \
   do { \
-    if (terminating_signal) termsig_handler (terminating_signal); \
-    if (interrupt_state) throw_to_top_level (); \
+    if (signal_pending) check_pending_signals (); \
   } while (0)
 
-#define SETINTERRUPT interrupt_state = 1
+#define SETINTERRUPT (interrupt_state = 1, signal_pending = 1)
 #define CLRINTERRUPT interrupt_state = 0
 
-#define ADDINTERRUPT interrupt_state++
+#define ADDINTERRUPT (interrupt_state++, signal_pending = 1)
 #define DELINTERRUPT interrupt_state--
 
 #define ISINTERRUPT interrupt_state != 0
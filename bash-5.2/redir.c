@@ -85,6 +85,19 @@ extern int errno;
 #  endif
 #endif
 
+/* On Linux, documents too big for a pipe go into an anonymous memory file
+   instead of a temporary file:  no directory entry to create and unlink,
+   and nothing written to a possibly slow $TMPDIR.  The file is sealed
+   after it's written and reopened read-only through /proc, so the reader
+   can seek in it but nobody can change it.  Define HEREDOC_NO_MEMFD to
+   always use temporary files. */
+#if defined (__linux__) && !defined (HEREDOC_NO_MEMFD)
+#  include <sys/mman.h>
+#  if defined (MFD_ALLOW_SEALING) && defined (F_ADD_SEALS)
+#    define HEREDOC_MEMFD 1
+#  endif
+#endif
+
 #define SHELL_FD_BASE	10
 
 int expanding_redir;
@@ -121,6 +134,11 @@ static REDIRECTEE rd;
    Used to print a reasonable error message. */
 static int heredoc_errno;
 
+#if HEREDOC_MEMFD
+/* Set once memfd_create fails with ENOSYS. */
+static int memfd_unsupported;
+#endif
+
 #define REDIRECTION_ERROR(r, e, fd) \
 do { \
   if ((r) < 0) \
@@ -481,7 +499,11 @@ here_document_to_fd (redirectee, ri)
 
 #if defined (F_GETPIPE_SZ)
       if (fcntl (herepipe[1], F_GETPIPE_SZ, 0) < document_len)
-	goto use_tempfile;
+	{
+	  close (herepipe[0]);
+	  close (herepipe[1]);
+	  goto use_memfd;
+	}
 #endif
 
       r = heredoc_write (herepipe[1], document, document_len);
@@ -498,6 +520,56 @@ here_document_to_fd (redirectee, ri)
     }
 #endif
 
+#if HEREDOC_PIPESIZE && defined (F_GETPIPE_SZ)
+use_memfd:
+#endif
+#if HEREDOC_MEMFD
+  /* Not close-on-exec, like the pipe above:  the caller may not need to
+     dup2 it onto the redirection target. Remember if the kernel doesn't
+     support memfd_create so we don't try again. */
+  if (memfd_unsupported == 0)
+    {
+      char memfd_path[32];
+
+      fd = memfd_create ("sh-thd", MFD_ALLOW_SEALING);
+      if (fd < 0)
+	{
+	  if (errno == ENOSYS)
+	    memfd_unsupported = 1;
+	  goto use_tempfile;
+	}
+
+      r = heredoc_write (fd, document, document_len);
+      if (r == 0 &&
+	  (fcntl (fd, F_ADD_SEALS, F_SEAL_WRITE|F_SEAL_GROW|F_SEAL_SHRINK|F_SEAL_SEAL) < 0 ||
+	   lseek (fd, 0L, SEEK_SET) < 0))
+	r = errno;
+      if (r)
+	{
+	  /* Try again with a temporary file; a short write to memory most
+	     likely means we're out of it, and the disk may have room. */
+	  close (fd);
+	  goto use_tempfile;
+	}
+
+      /* Hand back a read-only descriptor, as the temporary file case
+	 does; the one memfd_create returned can still be written to. */
+      sprintf (memfd_path, "/proc/self/fd/%d", fd);
+      fd2 = open (memfd_path, O_RDONLY);
+      r = errno;
+      close (fd);
+      if (fd2 < 0)
+	{
+	  errno = r;
+	  goto use_tempfile;
+	}
+
+      if (document != redirectee->word)
+	free (document);
+      return (fd2);
+    }
+#endif
+
 use_tempfile:
 
   fd = sh_mktmpfd ("sh-thd", MT_USERANDOM|MT_USETMPDIR, &filename);
@@ -66,6 +66,10 @@ extern int initialize_job_control PARAMS((int));
 extern int get_tty_state PARAMS((void));
 #endif /* JOB_CONTROL */
 
+#if defined (ANBS_AI_ENABLED)
+extern void anbs_ai_prewarm PARAMS((void));
+#endif
+
 #include "input.h"
 #include "execute_cmd.h"
 #include "findcmd.h"
@@ -215,6 +219,9 @@ static int no_profile;			/* Don't execute .profile */
 static int do_version;			/* Display interesting version info. */
 static int make_login_shell;		/* Make this shell be a `-bash' shell. */
 static int want_initial_help;		/* --help option */
+#if defined (ANBS_AI_ENABLED)
+static int startup_profile;		/* --startup-profile option */
+#endif
 
 int debugging_mode = 0;		/* In debugging mode with --debugger */
 #if defined (READLINE)
@@ -268,6 +275,9 @@ static const struct {
   { "rcfile", Charp, (int *)0x0, &bashrc_file },
 #if defined (RESTRICTED_SHELL)
   { "restricted", Int, &restricted, (char **)0x0 },
+#endif
+#if defined (ANBS_AI_ENABLED)
+  { "startup-profile", Int, &startup_profile, (char **)0x0 },
 #endif
   { "verbose", Int, &verbose_flag, (char **)0x0 },
   { "version", Int, &do_version, (char **)0x0 },
@@ -379,6 +389,7 @@ main (argc, argv, env)
 #endif
   volatile int locally_skip_execution;
   volatile int arg_index, top_level_arg_index;
+  int startup_slot;
 #ifdef __OPENNT
   char **env;
 
@@ -488,6 +499,17 @@ main (argc, argv, env)
 
   echo_input_at_read = verbose_flag;	/* --verbose given */
 
+#if defined (ANBS_AI_ENABLED)
+  {
+    char *t;
+
+    t = getenv ("ANBS_STARTUP_PROFILE");
+    if (startup_profile || (t && *t && STREQ (t, "0") == 0))
+      anbs_startup_profile_begin ();
+  }
+#endif
+  startup_slot = STARTUP_ENTER ("phase", "arguments");
+
   /* All done with full word options; do standard shell option parsing.*/
   this_command_name = shell_name;	/* for error reporting */
   arg_index = parse_shell_options (argv, arg_index, argc);
@@ -575,9 +597,13 @@ main (argc, argv, env)
   if (shopt_alist)
     run_shopt_alist ();
 
+  STARTUP_LEAVE (startup_slot, -1);
+
   /* From here on in, the shell must be a normal functioning shell.
      Variables from the environment are expected to be set, etc. */
+  startup_slot = STARTUP_ENTER ("phase", "shell_initialize");
   shell_initialize ();
+  STARTUP_LEAVE (startup_slot, -1);
 
   set_default_lang ();
   set_default_locale_vars ();
@@ -714,7 +740,9 @@ main (argc, argv, env)
 	  t = dollar_vars[0];
 	  dollar_vars[0] = exec_argv0 ? savestring (exec_argv0) : savestring (shell_script_filename);
 	}
+      startup_slot = STARTUP_ENTER ("phase", "startup files");
       run_startup_files ();
+      STARTUP_LEAVE (startup_slot, -1);
       if (shell_script_filename)
 	{
 	  free (dollar_vars[0]);
@@ -723,6 +751,17 @@ main (argc, argv, env)
       exit_immediately_on_error += old_errexit_flag;
     }
 
+#if defined (ANBS_AI_ENABLED)
+  /* Now that the startup files have had a chance to set ANBS_PREWARM,
+     start warming AI provider connections in the background. */
+  if (interactive_shell)
+    {
+      startup_slot = STARTUP_ENTER ("phase", "ai prewarm");
+      anbs_ai_prewarm ();
+      STARTUP_LEAVE (startup_slot, -1);
+    }
+#endif
+
   /* If we are invoked as `sh', turn on Posix mode. */
   if (act_like_sh)
     {
@@ -759,6 +798,9 @@ main (argc, argv, env)
 	start_debugger ();
 
 #if defined (ONESHOT)
+#  if defined (ANBS_AI_ENABLED)
+      anbs_startup_report ();
+#  endif
       executing = 1;
       run_one_command (command_execution_string);
       exit_shell (last_command_exit_value);
@@ -802,12 +844,14 @@ main (argc, argv, env)
 
 #if defined (HISTORY)
       /* Initialize the interactive history stuff. */
+      startup_slot = STARTUP_ENTER ("phase", "history");
       bash_initialize_history ();
       /* Don't load the history from the history file if we've already
 	 saved some lines in this session (e.g., by putting `history -s xx'
 	 into one of the startup files). */
       if (shell_initialized == 0 && history_lines_this_session == 0)
 	load_history ();
+      STARTUP_LEAVE (startup_slot, -1);
 #endif /* HISTORY */
 
       /* Initialize terminal state for interactive shells after the
@@ -829,6 +873,11 @@ main (argc, argv, env)
   if (pretty_print_mode)
     exit_shell (pretty_print_loop ());
 
+#if defined (ANBS_AI_ENABLED)
+  /* Startup is over once the shell is ready to read a command */
+  anbs_startup_report ();
+#endif
+
   /* Read commands until exit condition. */
   reader_loop ();
   exit_shell (last_command_exit_value);
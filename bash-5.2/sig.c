@@ -43,6 +43,10 @@
 #include "sig.h"
 #include "trap.h"
 
+#if defined (BUFFERED_INPUT)
+#  include "input.h"
+#endif
+
 #include "builtins/common.h"
 #include "builtins/builtext.h"
 
@@ -74,6 +78,11 @@ volatile sig_atomic_t sigterm_received = 0;
 /* Set to the value of any terminating signal received. */
 volatile sig_atomic_t terminating_signal = 0;
 
+/* Set after interrupt_state, terminating_signal or a trap's pending state,
+   so QUIT and RUN_PENDING_TRAPS test one word in the usual case where
+   nothing has arrived.  check_pending_signals () clears it. */
+volatile sig_atomic_t signal_pending = 0;
+
 /* The environment at the top-level R-E loop.  We use this in
    the case of error return. */
 procenv_t top_level;
@@ -393,6 +402,7 @@ top_level_cleanup ()
   run_unwind_protects ();
   loop_level = continuing = breaking = funcnest = 0;
   executing_list = comsub_ignore_return = return_catch_flag = wait_intr_flag = 0;
+  expanding_command_words = 0;
 }
 
 /* What to do when we've been interrupted, and it is safe to handle it. */
@@ -454,6 +464,7 @@ throw_to_top_level ()
   run_unwind_protects ();
   loop_level = continuing = breaking = funcnest = 0;
   executing_list = comsub_ignore_return = return_catch_flag = wait_intr_flag = 0;
+  expanding_command_words = 0;
 
   if (interactive && print_newline)
     {
@@ -490,6 +501,12 @@ sighandler
 termsig_sighandler (sig)
      int sig;
 {
+#if defined (SIGBUS) && defined (BUFFERED_INPUT)
+  /* A script being read through a mapping was truncated */
+  if (sig == SIGBUS && buffered_input_sigbus ())
+    SIGRETURN (0);
+#endif
+
   /* If we get called twice with the same signal before handling it,
      terminate right away. */
   if (
@@ -533,6 +550,7 @@ termsig_sighandler (sig)
     terminate_immediately = 1;
 
   terminating_signal = sig;
+  signal_pending = 1;
 
   if (terminate_immediately)
     {
@@ -610,6 +628,7 @@ termsig_handler (sig)
   /* Reset execution context */
   loop_level = continuing = breaking = funcnest = 0;
   executing_list = comsub_ignore_return = return_catch_flag = wait_intr_flag = 0;
+  expanding_command_words = 0;
 
   run_exit_trap ();	/* XXX - run exit trap possibly in signal context? */
 
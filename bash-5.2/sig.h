@@ -105,6 +105,10 @@ do { \
 extern volatile sig_atomic_t sigwinch_received;
 extern volatile sig_atomic_t sigterm_received;
 
+#if defined (JOB_CONTROL) || defined (HAVE_POSIX_SIGNALS)
+extern sigset_t top_level_mask;
+#endif
+
 extern int interrupt_immediately;	/* no longer used */
 extern int terminate_immediately;
 
@@ -133,4 +137,5 @@ extern sighandler trap_handler PARAMS((int));
 
 extern int block_trapped_signals PARAMS((sigset_t *, sigset_t *));
 extern int unblock_trapped_signals PARAMS((sigset_t *));
+extern void get_default_signals PARAMS((sigset_t *));
 #endif /* _SIG_H_ */
@@ -52,6 +52,7 @@
 #include "filecntl.h"
 #include "trap.h"
 #include "pathexp.h"
+#include "patmatch.h"
 #include "mailcheck.h"
 
 #include "shmbutil.h"
@@ -65,9 +66,17 @@
 
 #include "builtins/builtext.h"
 
+#if defined (ALIAS)
+#  include "alias.h"
+#endif
+
 #include <tilde/tilde.h>
 #include <glob/strmatch.h>
 
+#if defined (__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 #if !defined (errno)
 extern int errno;
 #endif /* !errno */
@@ -163,6 +172,14 @@ size_t ifs_firstc_len;
 unsigned char ifs_firstc;
 #endif
 
+/* The bytes that stop a scan for the end of a field: the distinct
+   characters of $IFS and CTLESC.  ifs_nstop is -1 if $IFS contains a
+   byte outside ASCII, which could be part of a multibyte character, and
+   0 if there are too many to compare against a block at a time. */
+#define IFS_STOP_MAX	8
+static unsigned char ifs_stop[IFS_STOP_MAX];
+static int ifs_nstop;
+
 /* If non-zero, command substitution inherits the value of errexit option */
 int inherit_errexit = 0;
 
@@ -261,6 +278,7 @@ static SHELL_VAR *do_compound_assignment PARAMS((char *, char *, int));
 #endif
 static int do_assignment_internal PARAMS((const WORD_DESC *, int));
 
+static int ifs_scan PARAMS((const char *, int, size_t));
 static char *string_extract_verbatim PARAMS((char *, size_t, int *, char *, int));
 static char *string_extract PARAMS((char *, int *, char *, int));
 static char *string_extract_double_quoted PARAMS((char *, int *, int));
@@ -314,6 +332,9 @@ static int valid_parameter_transform PARAMS((char *));
 static char *process_substitute PARAMS((char *, int));
 
 static char *optimize_cat_file PARAMS((REDIRECT *, int, int, int *));
+static int can_optimize_builtin_comsub PARAMS((COMMAND *));
+static void restore_comsub_stdout PARAMS((int));
+static int optimize_builtin_comsub PARAMS((COMMAND *, int, int, char **, int *));
 static char *read_comsub PARAMS((int, int, int, int *));
 
 #ifdef ARRAY_VARS
@@ -752,6 +773,9 @@ sub_append_string (source, target, indx, size)
 	{
 	  n = srclen + *indx;
 	  n = (n + DEFAULT_ARRAY_SIZE) - (n % DEFAULT_ARRAY_SIZE);
+	  /* Grow geometrically so appending piece by piece stays linear */
+	  if (n < *size + *size / 2)
+	    n = *size + *size / 2;
 	  target = (char *)xrealloc (target, (*size = n));
 	}
 
@@ -1160,6 +1184,45 @@ skip_single_quoted (string, slen, sind, flags)
   return c;
 }
 
+/* Return the index of the first $IFS character, CTLESC or NUL in STRING
+   at or after index I.  SLEN is the length of STRING.  Only valid when
+   ifs_nstop >= 0 and the locale is single-byte or UTF-8, where no byte of
+   a multibyte character can be one of those. */
+static int
+ifs_scan (string, i, slen)
+     const char *string;
+     int i;
+     size_t slen;
+{
+  register unsigned char c;
+
+#if defined (__SSE2__)
+  if (ifs_nstop > 0)
+    {
+      __m128i block, hit, zero;
+      unsigned int mask;
+      int n;
+
+      zero = _mm_setzero_si128 ();
+      while (i + 16 <= slen)
+	{
+	  block = _mm_loadu_si128 ((const __m128i *)(string + i));
+	  hit = _mm_cmpeq_epi8 (block, zero);
+	  for (n = 0; n < ifs_nstop; n++)
+	    hit = _mm_or_si128 (hit, _mm_cmpeq_epi8 (block, _mm_set1_epi8 ((char)ifs_stop[n])));
+	  mask = (unsigned int)_mm_movemask_epi8 (hit);
+	  if (mask)
+	    return (i + __builtin_ctz (mask));
+	  i += 16;
+	}
+    }
+#endif
+
+  while ((c = string[i]) && ifs_cmap[c] == 0 && c != CTLESC)
+    i++;
+  return i;
+}
+
 /* Just like string_extract, but doesn't hack backslashes or any of
    that other stuff.  Obeys CTLESC quoting.  Used to do splitting on $IFS. */
 static char *
@@ -1174,7 +1237,7 @@ string_extract_verbatim (string, slen, sindex, charlist, flags)
 #if defined (HANDLE_MULTIBYTE)
   wchar_t *wcharlist;
 #endif
-  int c;
+  int c, scan;
   char *temp;
   DECLARE_MBSTATE;
 
@@ -1197,6 +1260,11 @@ string_extract_verbatim (string, slen, sindex, charlist, flags)
       return temp;
     }
 
+  /* Splitting on $IFS can skip over runs of bytes that aren't separators
+     without decoding characters one at a time */
+  scan = ifs_nstop >= 0 && (locale_mb_cur_max == 1 || locale_utf8locale) &&
+	 ifs_value && (charlist == ifs_value || STREQ (charlist, ifs_value));
+
   i = *sindex;
 #if defined (HANDLE_MULTIBYTE)
   wcharlist = 0;
@@ -1206,6 +1274,12 @@ string_extract_verbatim (string, slen, sindex, charlist, flags)
 #if defined (HANDLE_MULTIBYTE)
       size_t mblength;
 #endif
+      if (scan && ifs_cmap[(unsigned char)c] == 0 && c != CTLESC)
+	{
+	  i = ifs_scan (string, i + 1, slen);
+	  continue;
+	}
+
       if ((flags & SX_NOCTLESC) == 0 && c == CTLESC)
 	{
 	  i += 2;
@@ -5661,10 +5735,15 @@ match_pattern (string, pat, mtype, sp, ep)
   wchar_t *wstring, *wpat;
   char **indices;
 #endif
+  int r;
 
   if (string == 0 || pat == 0 || *pat == 0)
     return (0);
 
+  /* Simple fixed-width patterns don't need strmatch's backtracking */
+  if ((r = patmatch_find (string, pat, mtype, sp, ep)) >= 0)
+    return (r);
+
 #if defined (HANDLE_MULTIBYTE)
   if (MB_CUR_MAX > 1)
     {
@@ -6495,6 +6574,7 @@ process_substitute (string, open_for_read_in_child)
       sys_error ("%s", _("cannot make pipe for process substitution"));
       return ((char *)NULL);
     }
+  sh_sizepipe (fildes);
   /* If OPEN_FOR_READ_IN_CHILD == 1, we want to use the write end of
      the pipe in the parent, otherwise the read end. */
   parent_pipe_fd = fildes[open_for_read_in_child];
@@ -6748,7 +6828,7 @@ process_substitute (string, open_for_read_in_child)
 /*				   */
 /***********************************/
 
-#define COMSUB_PIPEBUF	4096
+#define COMSUB_PIPEBUF	65536
 
 static char *
 optimize_cat_file (r, quoted, flags, flagp)
@@ -6773,11 +6853,12 @@ read_comsub (fd, quoted, flags, rflag)
      int fd, quoted, flags;
      int *rflag;
 {
-  char *istring, buf[COMSUB_PIPEBUF], *bufp;
-  int c, tflag, skip_ctlesc, skip_ctlnul;
+  char *istring, *buf, *bufp, *bufend, *run;
+  char special[256];
+  int c, tflag, skip_ctlesc, skip_ctlnul, quote_all;
   int mb_cur_max;
   size_t istring_index;
-  size_t istring_size;
+  size_t istring_size, need;
   ssize_t bufn;
   int nullbyte;
 #if defined (HANDLE_MULTIBYTE)
@@ -6796,70 +6877,112 @@ read_comsub (fd, quoted, flags, rflag)
   mb_cur_max = MB_CUR_MAX;
   nullbyte = 0;
 
+  /* Every character gets a CTLESC; otherwise only the ones marked in
+     SPECIAL need a look, and runs of the rest are copied as they are.
+     UTF-8 continuation bytes are never CTLESC or CTLNUL, so the
+     multibyte check below only matters in other multibyte locales. */
+  quote_all = (quoted & (Q_HERE_DOCUMENT|Q_DOUBLE_QUOTES)) != 0;
+  memset (special, 0, sizeof (special));
+  special[0] = special[CTLESC] = special[CTLNUL] = 1;
+  if (ifs_value && *ifs_value == 0)
+    special[' '] = 1;
+  if (locale_utf8locale == 0 && mb_cur_max > 1)
+    memset (special + 128, 1, 128);
+
+  buf = (fd >= 0) ? (char *)xmalloc (COMSUB_PIPEBUF) : (char *)NULL;
+  /* zread can jump out of here on an interrupt */
+  if (buf)
+    add_unwind_protect (xfree, buf);
+
   /* Read the output of the command through the pipe. */
-  while (1)
+  while (fd >= 0)
     {
-      if (fd < 0)
+      bufn = zread (fd, buf, COMSUB_PIPEBUF);
+      if (bufn <= 0)
 	break;
-      if (--bufn <= 0)
+
+      /* At worst every character gets a CTLESC in front of it.  Grow by
+	 doubling so megabytes of output aren't copied over and over. */
+      need = istring_index + 2 * bufn + 1;
+      if (need > istring_size)
 	{
-	  bufn = zread (fd, buf, sizeof (buf));
-	  if (bufn <= 0) 
-	    break;
-	  bufp = buf;
+	  if (istring_size == 0)
+	    istring_size = 512;
+	  while (istring_size < need)
+	    istring_size *= 2;
+	  istring = (char *)xrealloc (istring, istring_size);
 	}
-      c = *bufp++;
 
-      if (c == 0)
+      for (bufp = buf, bufend = buf + bufn; bufp < bufend; )
 	{
-#if 1
-	  if (nullbyte == 0)
+	  if (quote_all == 0)
 	    {
-	      internal_warning ("%s", _("command substitution: ignored null byte in input"));
-	      nullbyte = 1;
+	      for (run = bufp; run < bufend && special[(unsigned char)*run] == 0; run++)
+		;
+	      if (run > bufp)
+		{
+		  memcpy (istring + istring_index, bufp, run - bufp);
+		  istring_index += run - bufp;
+		  bufp = run;
+		  continue;
+		}
 	    }
-#endif
-	  continue;
-	}
 
-      /* Add the character to ISTRING, possibly after resizing it. */
-      RESIZE_MALLOCED_BUFFER (istring, istring_index, mb_cur_max+1, istring_size, 512);
+	  c = *bufp++;
 
-      /* This is essentially quote_string inline */
-      if ((quoted & (Q_HERE_DOCUMENT|Q_DOUBLE_QUOTES)) /* || c == CTLESC || c == CTLNUL */)
-	istring[istring_index++] = CTLESC;
-      else if ((flags & PF_ASSIGNRHS) && skip_ctlesc && c == CTLESC)
-	istring[istring_index++] = CTLESC;
-      /* Escape CTLESC and CTLNUL in the output to protect those characters
-	 from the rest of the word expansions (word splitting and globbing.)
-	 This is essentially quote_escapes inline. */
-      else if (skip_ctlesc == 0 && c == CTLESC)
-	istring[istring_index++] = CTLESC;
-      else if ((skip_ctlnul == 0 && c == CTLNUL) || (c == ' ' && (ifs_value && *ifs_value == 0)))
-	istring[istring_index++] = CTLESC;
+	  if (c == 0)
+	    {
+#if 1
+	      if (nullbyte == 0)
+		{
+		  internal_warning ("%s", _("command substitution: ignored null byte in input"));
+		  nullbyte = 1;
+		}
+#endif
+	      continue;
+	    }
+
+	  /* This is essentially quote_string inline */
+	  if (quote_all /* || c == CTLESC || c == CTLNUL */)
+	    istring[istring_index++] = CTLESC;
+	  else if ((flags & PF_ASSIGNRHS) && skip_ctlesc && c == CTLESC)
+	    istring[istring_index++] = CTLESC;
+	  /* Escape CTLESC and CTLNUL in the output to protect those characters
+	     from the rest of the word expansions (word splitting and globbing.)
+	     This is essentially quote_escapes inline. */
+	  else if (skip_ctlesc == 0 && c == CTLESC)
+	    istring[istring_index++] = CTLESC;
+	  else if ((skip_ctlnul == 0 && c == CTLNUL) || (c == ' ' && (ifs_value && *ifs_value == 0)))
+	    istring[istring_index++] = CTLESC;
 
 #if defined (HANDLE_MULTIBYTE)
-      if ((locale_utf8locale && (c & 0x80)) ||
-	  (locale_utf8locale == 0 && mb_cur_max > 1 && (unsigned char)c > 127))
-	{
-	  /* read a multibyte character from buf */
-	  /* punt on the hard case for now */
-	  memset (&ps, '\0', sizeof (mbstate_t));
-	  mblen = mbrtowc (&wc, bufp-1, bufn, &ps);
-	  if (MB_INVALIDCH (mblen) || mblen == 0 || mblen == 1)
-	    istring[istring_index++] = c;
-	  else
+	  if ((locale_utf8locale && (c & 0x80)) ||
+	      (locale_utf8locale == 0 && mb_cur_max > 1 && (unsigned char)c > 127))
 	    {
-	      istring[istring_index++] = c;
-	      for (i = 0; i < mblen-1; i++)
-		istring[istring_index++] = *bufp++;
-	      bufn -= mblen - 1;
+	      /* read a multibyte character from buf */
+	      /* punt on the hard case for now */
+	      memset (&ps, '\0', sizeof (mbstate_t));
+	      mblen = mbrtowc (&wc, bufp-1, bufend - (bufp-1), &ps);
+	      if (MB_INVALIDCH (mblen) || mblen == 0 || mblen == 1)
+		istring[istring_index++] = c;
+	      else
+		{
+		  istring[istring_index++] = c;
+		  for (i = 0; i < mblen-1; i++)
+		    istring[istring_index++] = *bufp++;
+		}
+	      continue;
 	    }
-	  continue;
-	}
 #endif
 
-      istring[istring_index++] = c;
+	  istring[istring_index++] = c;
+	}
+    }
+
+  if (buf)
+    {
+      remove_unwind_protect ();
+      free (buf);
     }
 
   if (istring)
@@ -6901,6 +7024,205 @@ read_comsub (fd, quoted, flags, rflag)
   return istring;
 }
 
+/* The file in-process command substitutions write to, and the process
+   that opened it; a forked child opens its own rather than share the
+   offset.  Its device and inode tell whether a user redirection has
+   since replaced the descriptor. */
+static int comsub_tmpfd = -1;
+static pid_t comsub_tmppid;
+static dev_t comsub_tmpdev;
+static ino_t comsub_tmpino;
+
+/* Return non-zero if expanding S can't change the shell's state, fail, or
+   expand differently than it would in a subshell: no command, process or
+   arithmetic substitution, no ${...} operators, no globbing, and none of
+   the variables whose values have side effects or depend on being in a
+   subshell. */
+int
+expansion_is_quiet (s)
+     const char *s;
+{
+  const char *name;
+  size_t len;
+  int braced;
+
+  for ( ; *s; s++)
+    {
+      switch (*s)
+	{
+	case '`':
+	case '(':
+	case '*':
+	case '?':
+	case '[':
+	  return 0;
+	case '$':
+	  braced = s[1] == '{';
+	  name = s + 1 + braced;
+	  if (*name == '(' || *name == '[')
+	    return 0;
+	  if (legal_variable_starter (*name) == 0)
+	    {
+	      /* $'...', $"...", a special parameter, or a literal `$' */
+	      if (braced && (name[0] == 0 || name[1] != '}'))
+		return 0;
+	      break;
+	    }
+	  for (len = 1; legal_variable_char (name[len]); len++)
+	    ;
+	  if (braced && name[len] != '}')
+	    return 0;
+	  if ((len == 6 && STREQN (name, "RANDOM", 6)) ||
+	      (len == 7 && (STREQN (name, "SRANDOM", 7) || STREQN (name, "BASHPID", 7))) ||
+	      (len == 12 && STREQN (name, "BASH_COMMAND", 12)) ||
+	      (len == 13 && STREQN (name, "BASH_SUBSHELL", 13)))
+	    return 0;
+	  s = name + len - 1 + braced;
+	  break;
+	}
+    }
+  return 1;
+}
+
+/* Return non-zero if COMMAND is a single `echo' or `printf' whose words
+   are all quiet, so the shell can run it itself with no subshell to keep
+   its effects out of this one.  Options that would make the subshell
+   behave differently (xtrace, nounset, DEBUG and ERR traps) rule it out. */
+static int
+can_optimize_builtin_comsub (command)
+     COMMAND *command;
+{
+  WORD_LIST *w;
+  char *name;
+
+  if (command->type != cm_simple || command->redirects ||
+      (command->flags & (CMD_INVERT_RETURN|CMD_TIME_PIPELINE|CMD_TIME_POSIX)) ||
+      command->value.Simple->redirects || command->value.Simple->words == 0)
+    return 0;
+
+  if (echo_command_at_execute || unbound_vars_is_error || place_keywords_in_env ||
+      signal_is_trapped (DEBUG_TRAP) || signal_is_trapped (ERROR_TRAP))
+    return 0;
+
+  name = command->value.Simple->words->word->word;
+  if (STREQ (name, "echo") == 0 && STREQ (name, "printf") == 0)
+    return 0;
+
+  for (w = command->value.Simple->words->next; w; w = w->next)
+    if (expansion_is_quiet (w->word->word) == 0)
+      return 0;
+
+  return 1;
+}
+
+static void
+restore_comsub_stdout (fd)
+     int fd;
+{
+  fflush (stdout);
+  dup2 (fd, 1);
+  close (fd);
+}
+
+/* Run COMMAND, which can_optimize_builtin_comsub accepted, in this shell
+   with its standard output going to a temporary file, and read the output
+   back as read_comsub would from the pipe.  Returns 0 with the output in
+   *ISTRINGP, or -1 if the command has to run in a child after all. */
+static int
+optimize_builtin_comsub (command, quoted, flags, istringp, flagp)
+     COMMAND *command;
+     int quoted, flags;
+     char **istringp;
+     int *flagp;
+{
+  sh_builtin_func_t *builtin;
+  WORD_LIST *words, *old_garglist;
+  char *name, *filename;
+  int fd, result, old_assign_error;
+  struct stat sb;
+
+  name = command->value.Simple->words->word->word;
+  builtin = find_shell_builtin (name);
+  if ((builtin != echo_builtin && builtin != printf_builtin) || find_function (name))
+    return -1;
+#if defined (ALIAS)
+  if (expand_aliases && find_alias (name))
+    return -1;
+#endif
+
+  if (comsub_tmpfd >= 0 && comsub_tmppid != getpid ())
+    {
+      close (comsub_tmpfd);
+      comsub_tmpfd = -1;
+    }
+  /* If the descriptor is no longer our file, it belongs to someone else
+     now; leave it alone */
+  if (comsub_tmpfd >= 0 && (fstat (comsub_tmpfd, &sb) < 0 ||
+			    sb.st_dev != comsub_tmpdev || sb.st_ino != comsub_tmpino))
+    comsub_tmpfd = -1;
+  if (comsub_tmpfd < 0)
+    {
+      fd = sh_mktmpfd ("sh-csub", MT_USERANDOM|MT_USETMPDIR|MT_READWRITE, &filename);
+      if (fd < 0)
+	return -1;
+      unlink (filename);
+      free (filename);
+      if (fstat (fd, &sb) < 0)
+	{
+	  close (fd);
+	  return -1;
+	}
+      comsub_tmpfd = move_to_high_fd (fd, 1, -1);
+      SET_CLOSE_ON_EXEC (comsub_tmpfd);
+      comsub_tmppid = getpid ();
+      comsub_tmpdev = sb.st_dev;
+      comsub_tmpino = sb.st_ino;
+    }
+
+  /* This may be part of expanding another command's words */
+  old_garglist = garglist;
+  old_assign_error = tempenv_assign_error;
+  words = expand_words_no_vars (command->value.Simple->words);
+  garglist = old_garglist;
+  tempenv_assign_error = old_assign_error;
+  if (words == 0)
+    return -1;
+
+  /* printf -v would assign in the subshell */
+  if (builtin == printf_builtin && words->next && words->next->word->word[0] == '-' && words->next->word->word[1] == 'v')
+    {
+      dispose_words (words);
+      return -1;
+    }
+
+  fflush (stdout);
+  clearerr (stdout);
+  fd = dup (1);
+  if (fd < 0 || ftruncate (comsub_tmpfd, 0) < 0 ||
+      lseek (comsub_tmpfd, 0, SEEK_SET) < 0 || dup2 (comsub_tmpfd, 1) < 0)
+    {
+      if (fd >= 0)
+	close (fd);
+      dispose_words (words);
+      return -1;
+    }
+
+  begin_unwind_frame ("builtin-comsub");
+  add_unwind_protect (restore_comsub_stdout, fd);
+  add_unwind_protect (dispose_words, words);
+  unwind_protect_pointer (this_command_name);
+
+  this_command_name = name;
+  result = (*builtin) (words->next);
+
+  run_unwind_frame ("builtin-comsub");
+
+  lseek (comsub_tmpfd, 0, SEEK_SET);
+  *istringp = read_comsub (comsub_tmpfd, quoted, flags, flagp);
+  last_command_exit_value = result;
+  return 0;
+}
+
 /* Perform command substitution on STRING.  This returns a WORD_DESC * with the
    contained string possibly quoted. */
 WORD_DESC *
@@ -6912,6 +7234,7 @@ command_substitute (string, quoted, flags)
   pid_t pid, old_pid, old_pipeline_pgrp, old_async_pid;
   char *istring, *s;
   int result, fildes[2], function_value, pflags, rc, tflag, fork_flags;
+  int profile_depth;
   WORD_DESC *ret;
   sigset_t set, oset;
 
@@ -6947,6 +7270,28 @@ command_substitute (string, quoted, flags)
 	  ret->word = istring;
 	  ret->flags = tflag;
 
+	  return ret;
+	}
+      dispose_command (cmd);
+    }
+  else if (strchr (s, CTLESC) == 0 && strchr (s, CTLNUL) == 0 &&
+	   ((*s == 'e' && STREQN (s, "echo", 4) && (s[4] == 0 || shellblank (s[4]))) ||
+	    (*s == 'p' && STREQN (s, "printf", 6) && (s[6] == 0 || shellblank (s[6])))))
+    {
+      COMMAND *cmd;
+
+      /* Output-only builtins don't need a subshell */
+      cmd = parse_string_to_command (string, SX_NOLONGJMP|SX_COMPLETE);
+      if (cmd && can_optimize_builtin_comsub (cmd) &&
+	  optimize_builtin_comsub (cmd, quoted, flags, &istring, &tflag) == 0)
+	{
+	  last_command_subst_pid = dollar_dollar_pid;
+
+	  dispose_command (cmd);
+	  ret = alloc_word_desc ();
+	  ret->word = istring;
+	  ret->flags = tflag;
+
 	  return ret;
 	}
       dispose_command (cmd);
@@ -6994,6 +7339,8 @@ command_substitute (string, quoted, flags)
 
   old_async_pid = last_asynchronous_pid;
   fork_flags = (subshell_environment&SUBSHELL_ASYNC) ? FORK_ASYNC : 0;
+  /* Charges forking, the child's run, and reading its output */
+  profile_depth = PROFILE_ENTER ("[comsub]", 0);
   pid = make_child ((char *)NULL, fork_flags|FORK_NOTERM);
   last_asynchronous_pid = old_async_pid;
 
@@ -7185,6 +7532,7 @@ command_substitute (string, quoted, flags)
       last_command_exit_value = wait_for (pid, JWAIT_NOTERM);
       last_command_subst_pid = pid;
       last_made_pid = old_pid;
+      PROFILE_LEAVE (profile_depth);
 
 #if defined (JOB_CONTROL)
       /* If last_command_exit_value > 128, then the substituted command
@@ -12001,9 +12349,20 @@ setifs (v)
   /* Should really merge ifs_cmap with sh_syntaxtab.  XXX - doesn't yet
      handle multibyte chars in IFS */
   memset (ifs_cmap, '\0', sizeof (ifs_cmap));
+  ifs_nstop = 0;
+  ifs_stop[ifs_nstop++] = CTLESC;
   for (t = ifs_value ; t && *t; t++)
     {
       uc = *t;
+      if (uc > 0x7f)
+	ifs_nstop = -1;
+      else if (ifs_nstop > 0 && ifs_cmap[uc] == 0 && uc != CTLESC)
+	{
+	  if (ifs_nstop < IFS_STOP_MAX)
+	    ifs_stop[ifs_nstop++] = uc;
+	  else
+	    ifs_nstop = 0;
+	}
       ifs_cmap[uc] = 1;
     }
 
@@ -12946,6 +13305,7 @@ expand_word_list_internal (list, eflags)
      int eflags;
 {
   WORD_LIST *new_list, *temp_list;
+  int profile_depth;
 
   tempenv_assign_error = 0;
   if (list == 0)
@@ -12987,8 +13347,12 @@ expand_word_list_internal (list, eflags)
   if (new_list)
     {
       if ((eflags & WEXP_PATHEXP) && disallow_filename_globbing == 0)
-	/* Glob expand the word list unless globbing has been disabled. */
-	new_list = glob_expand_word_list (new_list, eflags);
+	{
+	  /* Glob expand the word list unless globbing has been disabled. */
+	  profile_depth = PROFILE_ENTER ("[glob]", 0);
+	  new_list = glob_expand_word_list (new_list, eflags);
+	  PROFILE_LEAVE (profile_depth);
+	}
       else
 	/* Dequote the words, because we're not performing globbing. */
 	new_list = dequote_list (new_list);
@@ -319,6 +319,9 @@ extern char *cond_expand_word PARAMS((WORD_DESC *, int));
 
 extern int skip_to_delim PARAMS((char *, int, char *, int));
 
+/* Return non-zero if expanding a word can't change the shell's state. */
+extern int expansion_is_quiet PARAMS((const char *));
+
 #if defined (BANG_HISTORY)
 extern int skip_to_histexp PARAMS((char *, int, char *, int));
 #endif
@@ -56,6 +56,7 @@ extern int errno;
 
 #include "shell.h"
 #include "pathexp.h"
+#include "patmatch.h"
 #include "test.h"
 #include "builtins/common.h"
 
@@ -379,6 +380,10 @@ patcomp (string, pat, op)
 {
   int m;
 
+  m = patmatch_full (string, pat);
+  if (m >= 0)
+    return ((op == EQ) ? m : !m);
+
   m = strmatch (pat, string, FNMATCH_EXTFLAG|FNMATCH_IGNCASE);
   return ((op == EQ) ? (m == 0) : (m != 0));
 }
@@ -491,6 +491,7 @@ set_trap_state (sig)
   catch_flag = 1;
   pending_traps[sig]++;
   trapped_signal_received = sig;
+  signal_pending = 1;
 }
     
 sighandler
@@ -616,13 +617,30 @@ check_signals ()
   QUIT;
 }
 
+/* The slow half of QUIT.  signal_pending is cleared before the flags are
+   tested and set again if any of them is still on, so a signal arriving
+   in between is never lost: its handler sets signal_pending after its own
+   flag. */
+void
+check_pending_signals ()
+{
+  signal_pending = 0;
+  if (terminating_signal || interrupt_state || catch_flag)
+    signal_pending = 1;
+
+  if (terminating_signal)
+    termsig_handler (terminating_signal);
+  if (interrupt_state)
+    throw_to_top_level ();
+}
+
 /* Convenience functions the rest of the shell can use */
 void
 check_signals_and_traps ()
 {
   check_signals ();
 
-  run_pending_traps ();
+  RUN_PENDING_TRAPS;
 }
 
 #if defined (JOB_CONTROL) && defined (SIGCHLD)
@@ -673,6 +691,7 @@ queue_sigchld_trap (nchild)
       catch_flag = 1;
       pending_traps[SIGCHLD] += nchild;
       trapped_signal_received = SIGCHLD;
+      signal_pending = 1;
     }
 }
 #endif /* JOB_CONTROL && SIGCHLD */
@@ -813,6 +832,12 @@ set_signal (sig, string)
 	return;
     }
 
+#if defined (SIGBUS) && defined (BUFFERED_INPUT)
+  /* The trap would take over from the handler for mapped script files */
+  if (sig == SIGBUS)
+    unmap_buffered_streams ();
+#endif
+
   /* Only change the system signal handler if SIG_NO_TRAP is not set.
      The trap command string is changed in either case.  The shell signal
      handlers for SIGINT and SIGCHLD run the user specified traps in an
@@ -954,6 +979,11 @@ ignore_signal (sig)
   if (sigmodes[sig] & SIG_IGNORED)
     return;
 
+#if defined (SIGBUS) && defined (BUFFERED_INPUT)
+  if (sig == SIGBUS)
+    unmap_buffered_streams ();
+#endif
+
   /* Only change the signal handler for SIG if it allows it. */
   if ((sigmodes[sig] & SIG_NO_TRAP) == 0)
     set_signal_handler (sig, SIG_IGN);
@@ -1141,6 +1171,8 @@ _run_trap_internal (sig, tag)
 
       running_trap = old_running;
       interrupt_state = old_int;
+      if (old_int)
+	signal_pending = 1;
 
       if (sigmodes[sig] & SIG_CHANGED)
 	{
@@ -1390,6 +1422,30 @@ restore_original_signals ()
   reset_or_restore_signal_handlers (restore_signal);
 }
 
+/* Fill SET with the signals that restore_original_signals () and exec
+   would leave at SIG_DFL in a child: each one the shell ignores or
+   catches itself, unless it was ignored at shell entry or is trapped
+   with an empty command.  For a child started with posix_spawn. */
+void
+get_default_signals (set)
+     sigset_t *set;
+{
+  register int i;
+
+  sigemptyset (set);
+  for (i = 1; i < NSIG; i++)
+    {
+      if ((sigmodes[i] & (SIG_TRAPPED|SIG_SPECIAL)) == 0 &&
+	  original_signals[i] == IMPOSSIBLE_TRAP_HANDLER)
+	continue;		/* never changed by the shell */
+      if (sigmodes[i] & SIG_HARD_IGNORE)
+	continue;
+      if ((sigmodes[i] & SIG_TRAPPED) && trap_list[i] == (char *)IGNORE_SIG)
+	continue;
+      sigaddset (set, i);
+    }
+}
+
 /* Change the flags associated with signal SIG without changing the trap
    string. The string is TRAP_LIST[SIG] if we need it. */
 static void
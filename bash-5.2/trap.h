@@ -66,6 +66,12 @@ extern int running_trap;
 extern int trap_saved_exit_value;
 extern int suppress_debug_trap_verbose;
 
+/* Run the pending traps, if signal_pending says there may be any */
+#define RUN_PENDING_TRAPS \
+  do { \
+    if (signal_pending) run_pending_traps (); \
+  } while (0)
+
 /* Externally-visible functions declared in trap.c. */
 extern void initialize_traps PARAMS((void));
 
@@ -56,6 +56,7 @@
 #include "input.h"
 #include "hashcmd.h"
 #include "pathexp.h"
+#include "patmatch.h"
 #include "alias.h"
 #include "jobs.h"
 
@@ -170,6 +171,20 @@ int array_needs_making = 1;
    by initialize_variables (). */
 int shell_level = 0;
 
+/* Changed whenever a variable is added to or removed from a variable
+   table or a context is pushed onto or popped off shell_variables.  Every
+   var_lookup result cached under another value is stale. */
+unsigned long variable_generation = 1;
+
+#if defined (ANBS_AI_ENABLED)
+/* Non-zero means new associative arrays and function scopes use open
+   addressing hash tables; set from ANBS_HASH_TABLES. */
+int open_hash_tables = 0;
+#  define new_context_table(n)	(open_hash_tables ? hash_create_open (n) : hash_create (n))
+#else
+#  define new_context_table(n)	hash_create (n)
+#endif
+
 /* An array which is passed to commands as their environment.  It is
    manufactured from the union of the initial environment and the
    shell variables that are marked for export. */
@@ -177,6 +192,19 @@ char **export_env = (char **)NULL;
 static int export_env_index;
 static int export_env_size;
 
+/* The variable each of the first EXPORT_ENV_NVARS entries of export_env
+   was made from.  A variable's envslot indexes this array, so changing
+   the value of an exported variable can replace just its own entry. */
+static SHELL_VAR **export_env_vars;
+static int export_env_nvars;
+
+/* Names of exported variables whose values have changed since export_env
+   was made, waiting for maybe_make_export_env to replace their entries.
+   More than this many and it's as cheap to remake the whole array. */
+#define EXPORT_ENV_DIRTY_MAX	16
+static char *export_env_dirty[EXPORT_ENV_DIRTY_MAX];
+static int export_env_ndirty;
+
 #if defined (READLINE)
 static int winsize_assignment;		/* currently assigning to LINES or COLUMNS */
 #endif
@@ -318,10 +346,13 @@ static void propagate_temp_var PARAMS((PTR_T));
 static void dispose_temporary_env PARAMS((sh_free_func_t *));     
 
 static inline char *mk_env_string PARAMS((const char *, const char *, int));
-static char **make_env_array_from_var_list PARAMS((SHELL_VAR **));
+static char **make_env_array_from_var_list PARAMS((SHELL_VAR **, SHELL_VAR **));
 static char **make_var_export_array PARAMS((VAR_CONTEXT *));
 static char **make_func_export_array PARAMS((void));
 static void add_temp_array_to_env PARAMS((char **, int, int));
+static void export_env_changed PARAMS((SHELL_VAR *));
+static void flush_export_env_dirty PARAMS((void));
+static int update_export_env_slots PARAMS((void));
 
 static int n_shell_variables PARAMS((void));
 static int set_context PARAMS((SHELL_VAR *));
@@ -702,8 +733,20 @@ initialize_shell_variables (env, privmode)
   if (temp_var && imported_p (temp_var))
     sv_xtracefd (temp_var->name);
 
+#if defined (ANBS_AI_ENABLED)
+  temp_var = find_variable ("ANBS_PROFILE");
+  if (temp_var && imported_p (temp_var))
+    sv_anbs_profile (temp_var->name);
+  sv_anbs_hash_tables ("ANBS_HASH_TABLES");
+#endif
+
   sv_shcompat ("BASH_COMPAT");
 
+  sv_pipesize ("BASH_PIPESIZE");
+#if defined (COPROCESS_SUPPORT)
+  sv_coproc_readahead ("BASH_COPROC_READAHEAD");
+#endif
+
   /* Allow FUNCNEST to be inherited from the environment. */
   sv_funcnest ("FUNCNEST");
 
@@ -1999,6 +2042,24 @@ hash_lookup (name, hashed_vars)
   return (bucket ? (SHELL_VAR *)bucket->data : (SHELL_VAR *)NULL);
 }
 
+/* Lookups through the whole shell_variables chain are cached, so a
+   function nested deep in the call stack finds a global, or finds that a
+   name isn't set, without searching every context's table.  An entry is
+   good while VARIABLE_GENERATION hasn't changed; it records the table the
+   variable was found in for last_table_searched. */
+#define VARCACHE_SIZE	256	/* must be a power of two */
+
+struct varcache_entry
+{
+  char *name;
+  unsigned int hash;
+  unsigned long generation;
+  SHELL_VAR *var;		/* NULL if NAME isn't set */
+  HASH_TABLE *table;
+};
+
+static struct varcache_entry varcache[VARCACHE_SIZE];
+
 SHELL_VAR *
 var_lookup (name, vcontext)
      const char *name;
@@ -2006,12 +2067,40 @@ var_lookup (name, vcontext)
 {
   VAR_CONTEXT *vc;
   SHELL_VAR *v;
+  struct varcache_entry *ce;
+  unsigned int hv;
+
+  ce = (struct varcache_entry *)NULL;
+  if (vcontext && vcontext == shell_variables)
+    {
+      hv = hash_string (name);
+      ce = &varcache[hv & (VARCACHE_SIZE - 1)];
+      if (ce->generation == variable_generation && ce->hash == hv && STREQ (ce->name, name))
+	{
+	  if (ce->var)
+	    last_table_searched = ce->table;
+	  return (ce->var);
+	}
+    }
 
   v = (SHELL_VAR *)NULL;
   for (vc = vcontext; vc; vc = vc->down)
     if (v = hash_lookup (name, vc->table))
       break;
 
+  if (ce)
+    {
+      if (ce->name == 0 || STREQ (ce->name, name) == 0)
+	{
+	  FREE (ce->name);
+	  ce->name = savestring (name);
+	}
+      ce->hash = hv;
+      ce->generation = variable_generation;
+      ce->var = v;
+      ce->table = v ? vc->table : (HASH_TABLE *)NULL;
+    }
+
   return v;
 }
 
@@ -2672,7 +2761,7 @@ make_local_variable (name, flags)
       return ((SHELL_VAR *)NULL);
     }
   else if (vc->table == 0)
-    vc->table = hash_create (TEMPENV_HASH_BUCKETS);
+    vc->table = new_context_table (TEMPENV_HASH_BUCKETS);
 
   /* Since this is called only from the local/declare/typeset code, we can
      call builtin_error here without worry (of course, it will also work
@@ -2775,6 +2864,7 @@ new_shell_variable (name)
   entry->assign_func = (sh_var_assign_func_t *)NULL;
 
   entry->attributes = 0;
+  entry->envslot = -1;
 
   /* Always assume variables are to be made at toplevel!
      make_local_variable has the responsibility of changing the
@@ -2802,6 +2892,7 @@ make_new_variable (name, table)
 
   elt = hash_insert (savestring (name), table, HASH_NOSRCH);
   elt->data = (PTR_T)entry;
+  VARIABLES_CHANGED ();
 
   return entry;
 }
@@ -3048,29 +3139,52 @@ can_optimize_assignment (entry, value, aflags)
   return 1;
 }
 
-/* right now we optimize appends to string variables */
+/* right now we optimize appends to string variables.  The value keeps
+   its length and grows geometrically, so building a long string with
+   repeated `+=' takes linear time instead of copying and rescanning the
+   value each time. */
 static SHELL_VAR *
 optimized_assignment (entry, value, aflags)
      SHELL_VAR *entry;
      char *value;
      int aflags;
 {
-  size_t len, vlen;
+  size_t len, vlen, size;
   char *v, *new;
 
   v = value_cell (entry);
-  len = STRLEN (v);
+  if (v && entry->value_size && entry->value_len < entry->value_size && v[entry->value_len] == '\0')
+    {
+      len = entry->value_len;
+      size = entry->value_size;
+    }
+  else
+    {
+      len = STRLEN (v);
+      size = 0;			/* not allocated by us */
+    }
   vlen = STRLEN (value);
 
-  new = (char *)xrealloc (v, len + vlen + 8);	/* for now */
+  new = v;
+  if (len + vlen + 1 > size)
+    {
+      size = len + vlen + 1;
+      size += size / 2;
+      if (size < 16)
+	size = 16;
+      new = (char *)xrealloc (v, size);
+    }
   if (vlen == 1)
     {
       new[len] = *value;
       new[len+1] = '\0';
     }
   else
-    strcpy (new + len, value);
+    memcpy (new + len, value, vlen + 1);
+
   var_setvalue (entry, new);
+  entry->value_len = len + vlen;
+  entry->value_size = size;
   return entry;
 }
 
@@ -3201,7 +3315,7 @@ assign_value:
 	    VSETATTR (entry, att_exported);
 
 	  if (exported_p (entry))
-	    array_needs_making = 1;
+	    export_env_changed (entry);
 
 	  return (entry);
 	}
@@ -3243,7 +3357,7 @@ assign_value:
     VSETATTR (entry, att_exported);
 
   if (exported_p (entry))
-    array_needs_making = 1;
+    export_env_changed (entry);
 
   return (entry);
 }
@@ -3409,7 +3523,7 @@ bind_variable_value (var, value, aflags)
     VSETATTR (var, att_exported);
 
   if (exported_p (var))
-    array_needs_making = 1;
+    export_env_changed (var);
 
   return (var);
 }
@@ -3524,7 +3638,7 @@ bind_function (name, value)
     INVALIDATE_EXPORTSTR (entry);
 
   if (var_isset (entry))
-    dispose_command (function_cell (entry));
+    dispose_function_body (function_cell (entry));
 
   if (value)
     var_setfunc (entry, copy_command (value));
@@ -3750,6 +3864,7 @@ copy_variable (var)
       copy->exportstr = COPY_EXPORTSTR (var);
 
       copy->context = var->context;
+      copy->envslot = -1;
     }
   return (copy);
 }
@@ -3767,7 +3882,7 @@ dispose_variable_value (var)
      SHELL_VAR *var;
 {
   if (function_p (var))
-    dispose_command (function_cell (var));
+    dispose_function_body (function_cell (var));
 #if defined (ARRAY_VARS)
   else if (array_p (var))
     array_dispose (array_cell (var));
@@ -3961,6 +4076,7 @@ delete_var (name, vc)
   if (elt == 0)
     return (-1);
 
+  VARIABLES_CHANGED ();
   old_var = (SHELL_VAR *)elt->data;
   free (elt->key);
   free (elt);
@@ -3990,6 +4106,7 @@ makunbound (name, vc)
   if (elt == 0)
     return (-1);
 
+  VARIABLES_CHANGED ();
   old_var = (SHELL_VAR *)elt->data;
 
   if (old_var && exported_p (old_var))
@@ -4067,6 +4184,7 @@ kill_all_local_variables ()
       hash_dispose (vc->table);
     }
   vc->table = (HASH_TABLE *)NULL;
+  VARIABLES_CHANGED ();
 }
 
 static void
@@ -4085,6 +4203,7 @@ delete_all_variables (hashed_vars)
      HASH_TABLE *hashed_vars;
 {
   hash_flush (hashed_vars, free_variable_hash_data);
+  VARIABLES_CHANGED ();
 }
 
 /* **************************************************************** */
@@ -4619,7 +4738,7 @@ push_temp_var (data)
 	/* shouldn't happen */
 	binding_table = shell_variables->table = global_variables->table = hash_create (VARIABLES_HASH_BUCKETS);
       else
-	binding_table = shell_variables->table = hash_create (TEMPENV_HASH_BUCKETS);
+	binding_table = shell_variables->table = new_context_table (TEMPENV_HASH_BUCKETS);
     }
 
   v = bind_variable_internal (var->name, value_cell (var), binding_table, 0, ASS_FORCE|ASS_NOLONGJMP);
@@ -4689,6 +4808,7 @@ dispose_temporary_env (pushf)
 
   hash_flush (disposer, pushf);
   hash_dispose (disposer);
+  VARIABLES_CHANGED ();
 
   tempvar_list[tvlist_ind] = 0;
 
@@ -4741,6 +4861,7 @@ flush_temporary_env ()
       hash_flush (temporary_env, free_variable_hash_data);
       hash_dispose (temporary_env);
       temporary_env = (HASH_TABLE *)NULL;
+      VARIABLES_CHANGED ();
     }
 }
 
@@ -4883,9 +5004,11 @@ valid_exportstr (v)
 #  define USE_EXPORTSTR (value == var->exportstr)
 #endif
 
+/* Make the environment strings for VARS.  If SLOTS is non-null, store
+   the variable each string was made from in the corresponding element. */
 static char **
-make_env_array_from_var_list (vars)
-     SHELL_VAR **vars;
+make_env_array_from_var_list (vars, slots)
+     SHELL_VAR **vars, **slots;
 {
   register int i, list_index;
   register SHELL_VAR *var;
@@ -4938,6 +5061,8 @@ make_env_array_from_var_list (vars)
 	  if (USE_EXPORTSTR == 0)
 	    SAVE_EXPORTSTR (var, list[list_index]);
 
+	  if (slots)
+	    slots[list_index] = var;
 	  list_index++;
 #undef USE_EXPORTSTR
 
@@ -4971,7 +5096,12 @@ make_var_export_array (vcxt)
   if (vars == 0)
     return (char **)NULL;
 
-  list = make_env_array_from_var_list (vars);
+  /* These are the first entries in export_env; remember where each
+     variable's entry is. */
+  export_env_vars = (SHELL_VAR **)xrealloc (export_env_vars, (1 + strvec_len ((char **)vars)) * sizeof (SHELL_VAR *));
+  list = make_env_array_from_var_list (vars, export_env_vars);
+  for (export_env_nvars = 0; list[export_env_nvars]; export_env_nvars++)
+    export_env_vars[export_env_nvars]->envslot = export_env_nvars;
 
   free (vars);
   return (list);
@@ -4987,7 +5117,7 @@ make_func_export_array ()
   if (vars == 0)
     return (char **)NULL;
 
-  list = make_env_array_from_var_list (vars);
+  list = make_env_array_from_var_list (vars, (SHELL_VAR **)NULL);
 
   free (vars);
   return (list);
@@ -5105,6 +5235,97 @@ chkexport (name)
   return 0;
 }
 
+/* VAR, an exported variable, has a new value.  If VAR made an entry in
+   export_env, remember that the entry is out of date so the next
+   maybe_make_export_env can replace it without remaking the rest of the
+   array.  Otherwise the array needs making. */
+static void
+export_env_changed (var)
+     SHELL_VAR *var;
+{
+  int i;
+
+  if (array_needs_making)
+    return;
+
+  if (temporary_env || var->envslot < 0 || var->envslot >= export_env_nvars ||
+      export_env_vars[var->envslot] != var)
+    {
+      array_needs_making = 1;
+      return;
+    }
+
+  for (i = 0; i < export_env_ndirty; i++)
+    if (STREQ (export_env_dirty[i], var->name))
+      return;
+
+  if (export_env_ndirty == EXPORT_ENV_DIRTY_MAX)
+    array_needs_making = 1;
+  else
+    export_env_dirty[export_env_ndirty++] = savestring (var->name);
+}
+
+static void
+flush_export_env_dirty ()
+{
+  while (export_env_ndirty > 0)
+    free (export_env_dirty[--export_env_ndirty]);
+}
+
+/* Replace the export_env entries of the variables in export_env_dirty.
+   Each name is looked up again, since the variable could have been unset
+   or shadowed since its value changed; anything but a scalar variable
+   that still owns its entry means the whole array has to be remade.
+   Returns 0 if that's the case. */
+static int
+update_export_env_slots ()
+{
+  BUCKET_CONTENTS *b;
+  VAR_CONTEXT *vc;
+  SHELL_VAR *var;
+  char *value, *envstr;
+  int i, r;
+
+  r = 1;
+  for (i = 0; r && i < export_env_ndirty; i++)
+    {
+      var = (SHELL_VAR *)NULL;
+      for (vc = temporary_env ? (VAR_CONTEXT *)NULL : shell_variables; vc; vc = vc->down)
+	if ((b = hash_search (export_env_dirty[i], vc->table, 0)) &&
+	    export_environment_candidate ((SHELL_VAR *)b->data))
+	  {
+	    var = (SHELL_VAR *)b->data;
+	    break;
+	  }
+
+      if (var == 0 || var->envslot < 0 || var->envslot >= export_env_nvars ||
+	  export_env_vars[var->envslot] != var || function_p (var) ||
+	  array_p (var) || assoc_p (var) || regen_p (var) ||
+	  (value = value_cell (var)) == 0)
+	{
+	  r = 0;
+	  break;
+	}
+
+#if defined (__CYGWIN__)
+      INVALIDATE_EXPORTSTR (var);
+#endif
+      if (var->exportstr)
+	envstr = savestring (var->exportstr);
+      else
+	{
+	  envstr = mk_env_string (var->name, value, var->attributes);
+	  SAVE_EXPORTSTR (var, envstr);
+	}
+
+      free (export_env[var->envslot]);
+      export_env[var->envslot] = envstr;
+    }
+
+  flush_export_env_dirty ();
+  return r;
+}
+
 void
 maybe_make_export_env ()
 {
@@ -5112,8 +5333,14 @@ maybe_make_export_env ()
   int new_size;
   VAR_CONTEXT *tcxt, *icxt;
 
+  if (array_needs_making == 0 && export_env_ndirty && update_export_env_slots () == 0)
+    array_needs_making = 1;
+
   if (array_needs_making)
     {
+      flush_export_env_dirty ();
+      export_env_nvars = 0;
+
       if (export_env)
 	strvec_flush (export_env);
 
@@ -5294,6 +5521,7 @@ push_var_context (name, flags, tempvars)
     }
   vc->down = shell_variables;
   shell_variables->up = vc;
+  VARIABLES_CHANGED ();
 
   return (shell_variables = vc);
 }
@@ -5421,6 +5649,7 @@ pop_var_context ()
     {
       ret->up = (VAR_CONTEXT *)NULL;
       shell_variables = ret;
+      VARIABLES_CHANGED ();
       if (vcxt->table)
 	hash_flush (vcxt->table, push_func_var);
       dispose_var_context (vcxt);
@@ -5451,6 +5680,7 @@ delete_all_contexts (vcxt)
   delete_local_contexts (vcxt);
   delete_all_variables (global_variables->table);
   shell_variables = global_variables;
+  VARIABLES_CHANGED ();
 }
 
 /* Reset the context so we are not executing in a shell function. Only call
@@ -5461,6 +5691,7 @@ reset_local_contexts ()
   delete_local_contexts (shell_variables);
   shell_variables = global_variables;
   variable_context = 0;
+  VARIABLES_CHANGED ();
 }
 
 /* **************************************************************** */
@@ -5532,6 +5763,7 @@ pop_scope (is_special)
     ret->up = (VAR_CONTEXT *)NULL;
 
   shell_variables = ret;
+  VARIABLES_CHANGED ();
 
   /* Now we can take care of merging variables in VCXT into set of scopes
      whose head is RET (shell_variables). */
@@ -5803,7 +6035,16 @@ struct name_and_function {
 };
 
 static struct name_and_function special_vars[] = {
+#if defined (ANBS_AI_ENABLED)
+  { "ANBS_HASH_TABLES", sv_anbs_hash_tables },
+  { "ANBS_PROFILE", sv_anbs_profile },
+#endif
+
   { "BASH_COMPAT", sv_shcompat },
+#if defined (COPROCESS_SUPPORT)
+  { "BASH_COPROC_READAHEAD", sv_coproc_readahead },
+#endif
+  { "BASH_PIPESIZE", sv_pipesize },
   { "BASH_XTRACEFD", sv_xtracefd },
 
 #if defined (JOB_CONTROL)
@@ -6341,6 +6582,7 @@ sv_locale (name)
     r = set_lang (name, v);
   else
     r = set_locale_var (name, v);		/* LC_*, TEXTDOMAIN* */
+  patmatch_flush ();
 
 #if 1
   if (r == 0 && posixly_correct)
@@ -6521,6 +6763,66 @@ sv_xtracefd (name)
     }
 }
 
+/* BASH_PIPESIZE, if set to a positive number, is the capacity the shell
+   requests for the pipes it creates for process substitution and
+   coprocesses.  The kernel may round it up or refuse it. */
+void
+sv_pipesize (name)
+     char *name;
+{
+  char *val;
+  intmax_t n;
+
+  val = get_string_value (name);
+  sh_pipesize = 0;
+  if (val && *val && legal_number (val, &n) && n > 0 && n <= INT_MAX)
+    sh_pipesize = n;
+}
+
+#if defined (COPROCESS_SUPPORT)
+void
+sv_coproc_readahead (name)
+     char *name;
+{
+  char *val;
+
+  val = get_string_value (name);
+  coproc_readahead = val && *val && (val[0] != '0' || val[1] != '\0');
+}
+#endif
+
+#if defined (ANBS_AI_ENABLED)
+/* Setting ANBS_PROFILE to a file or directory profiles the commands the
+   shell executes from then on; unsetting it writes the profile out. */
+void
+sv_anbs_profile (name)
+     char *name;
+{
+  SHELL_VAR *v;
+  char *t;
+
+  v = find_variable (name);
+  t = v ? value_cell (v) : (char *)NULL;
+
+  if (t == 0 || *t == 0)
+    anbs_profile_stop ();
+  else if (anbs_profile_start (t, dollar_vars[0]) < 0)
+    internal_error (_("%s: %s: cannot write profile"), name, t);
+}
+
+/* ANBS_HASH_TABLES=open makes associative arrays and function scopes
+   created from then on use open addressing. */
+void
+sv_anbs_hash_tables (name)
+     char *name;
+{
+  char *t;
+
+  t = get_string_value (name);
+  open_hash_tables = t && STREQ (t, "open");
+}
+#endif
+
 #define MIN_COMPAT_LEVEL 31
 
 void
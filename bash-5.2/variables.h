@@ -59,6 +59,9 @@ typedef struct var_context {
 #define vc_haslocals(vc)	(((vc)->flags & VC_HASLOCAL) != 0)
 #define vc_hastmpvars(vc)	(((vc)->flags & VC_HASTMPVAR) != 0)
 
+/* Call when the set of variables visible through shell_variables changes */
+#define VARIABLES_CHANGED()	(variable_generation++)
+
 /* What a shell variable looks like. */
 
 typedef struct variable *sh_var_value_func_t PARAMS((struct variable *));
@@ -91,6 +94,9 @@ typedef struct variable {
 				   bind_variable. */
   int attributes;		/* export, readonly, array, invisible... */
   int context;			/* Which context this variable belongs to. */
+  size_t value_len;		/* Length of VALUE when VALUE_SIZE is non-zero */
+  size_t value_size;		/* Bytes allocated for VALUE by appends, or 0 */
+  int envslot;			/* Index of its entry in export_env, or -1 */
 } SHELL_VAR;
 
 typedef struct _vlist {
@@ -175,12 +181,13 @@ typedef struct _vlist {
 #define var_isunset(var)	((var)->value == 0)
 #define var_isnull(var)		((var)->value && *(var)->value == 0)
 
-/* Assigning variable values: lvalues */
-#define var_setvalue(var, str)	((var)->value = (str))
-#define var_setfunc(var, func)	((var)->value = (char *)(func))
-#define var_setarray(var, arr)	((var)->value = (char *)(arr))
-#define var_setassoc(var, arr)	((var)->value = (char *)(arr))
-#define var_setref(var, str)	((var)->value = (str))
+/* Assigning variable values: lvalues.  A new value forgets the length and
+   capacity `+=' keeps for the old one. */
+#define var_setvalue(var, str)	((var)->value_size = 0, (var)->value = (str))
+#define var_setfunc(var, func)	((var)->value_size = 0, (var)->value = (char *)(func))
+#define var_setarray(var, arr)	((var)->value_size = 0, (var)->value = (char *)(arr))
+#define var_setassoc(var, arr)	((var)->value_size = 0, (var)->value = (char *)(arr))
+#define var_setref(var, str)	((var)->value_size = 0, (var)->value = (str))
 
 /* Make VAR be auto-exported. */
 #define set_auto_export(var) \
@@ -246,7 +253,11 @@ extern char **export_env;
 
 extern int tempenv_assign_error;
 extern int array_needs_making;
+extern unsigned long variable_generation;
 extern int shell_level;
+#if defined (ANBS_AI_ENABLED)
+extern int open_hash_tables;
+#endif
 
 /* XXX */
 extern WORD_LIST *rest_of_args;
@@ -429,6 +440,15 @@ extern void sv_opterr PARAMS((char *));
 extern void sv_locale PARAMS((char *));
 extern void sv_xtracefd PARAMS((char *));
 extern void sv_shcompat PARAMS((char *));
+extern void sv_pipesize PARAMS((char *));
+#if defined (COPROCESS_SUPPORT)
+extern void sv_coproc_readahead PARAMS((char *));
+#endif
+
+#if defined (ANBS_AI_ENABLED)
+extern void sv_anbs_profile PARAMS((char *));
+extern void sv_anbs_hash_tables PARAMS((char *));
+#endif
 
 #if defined (READLINE)
 extern void sv_comp_wordbreaks PARAMS((char *));
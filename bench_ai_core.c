@@ -0,0 +1,736 @@
+/* bench_ai_core.c - Drive the ai_core subsystems directly and report
+   throughput and latency percentiles for regression tracking */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#include "bash-5.2/ai_core/ai_display.h"
+
+/* The subsystems keep their types to themselves; these match the
+   definitions in their sources, as builtins/ai_commands.c does */
+extern int anbs_cache_init(int max_entries);
+extern int anbs_cache_put(const char *command, const char *response, int ttl_seconds);
+extern char *anbs_cache_get(const char *command, double *cache_age_ms);
+extern void anbs_cache_cleanup(void);
+
+typedef struct memory_entry memory_entry_t;
+extern int anbs_memory_init(void);
+extern int anbs_memory_add(const char *content, const char *context, const char *source);
+extern int anbs_memory_flush(void);
+extern int anbs_memory_search(const char *query, memory_entry_t **results, int max_results);
+extern void anbs_memory_free_results(memory_entry_t *results, int count);
+extern void anbs_memory_cleanup(void);
+
+#define BENCH_METRIC_RESPONSE_TIME 1        /* METRIC_RESPONSE_TIME */
+typedef struct command_metrics command_metrics_t;
+extern int anbs_metrics_init(void);
+extern int anbs_metrics_record(int type, const char *command_type, double value, const char *context);
+extern command_metrics_t *anbs_metrics_handle(int type, const char *command_type);
+extern void anbs_metrics_observe(command_metrics_t *handle, double value);
+extern void anbs_metrics_cleanup(void);
+
+#define BENCH_PERM_FILE_READ 1              /* PERM_TYPE_FILE_READ */
+extern int anbs_permissions_init(const char *policy_file);
+extern int anbs_permissions_assign_role(const char *agent_id, const char *role_name);
+extern bool anbs_permissions_check(const char *agent_id, const char *resource, int permission_type);
+extern void anbs_permissions_cleanup(void);
+
+extern int anbs_websocket_init(anbs_display_t *display, const char *host, int port, const char *path, int use_ssl);
+extern int anbs_websocket_connect(void);
+extern int anbs_websocket_send(const char *message);
+extern void anbs_websocket_cleanup(void);
+
+#define CACHE_ENTRIES 65536        /* cache capacity */
+#define CACHE_KEYS 50000           /* keys loaded before the gets */
+#define SEARCH_RESULTS 10          /* results asked of each memory search */
+#define POOL_SIZE 4096             /* distinct texts the runs cycle through */
+#define WS_MAX_BYTES (256 << 20)   /* payload sent per websocket run */
+
+static const char *benchmarks = "cache,memory,text,metrics,permissions,websocket";
+static unsigned long opt_ops = 200000;
+static int opt_threads;
+static char *opt_sizes = "1000,10000,100000,1000000";
+static unsigned long opt_queries = 1000;
+static char scratch[PATH_MAX];
+
+static char *pool[POOL_SIZE];
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-b list] [-n ops] [-t threads] [-s sizes] [-q queries]\n"
+            "Runs each benchmark and prints one line of key=value pairs per run.\n"
+            "  -b  benchmarks to run (default %s)\n"
+            "  -n  operations per run (default 200000)\n"
+            "  -t  most threads for the multi-threaded runs (default: online CPUs, up to 16)\n"
+            "  -s  memory store sizes (default 1000,10000,100000,1000000)\n"
+            "  -q  memory searches per size (default 1000)\n",
+            prog, benchmarks);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static bool selected(const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = benchmarks;
+
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == benchmarks || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+            return true;
+        }
+        p += len;
+    }
+    return false;
+}
+
+/* Shell-like lines of 20 to 200 bytes, so embeddings, hashes and line
+   layouts see some variety */
+static void make_pool(void)
+{
+    static const char *words[] = {
+        "git", "commit", "-m", "push", "origin", "main", "docker", "run", "--rm",
+        "kubectl", "get", "pods", "-n", "prod", "make", "-j8", "install", "grep",
+        "-r", "ERROR", "/var/log/syslog", "ssh", "deploy@10.0.3.7", "tail", "-f",
+        "curl", "-s", "https://api.example.com/v1/status", "jq", ".items[]",
+        "find", ".", "-name", "*.c", "cargo", "build", "--release", "npm", "test",
+        "python3", "manage.py", "migrate", "terraform", "plan", "ls", "-la",
+        "systemctl", "restart", "nginx", "rsync", "-av", "build/", "host:/srv/",
+    };
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+    for (int i = 0; i < POOL_SIZE; i++) {
+        size_t target = 20 + next_random(&seed) % 181;
+        char *line = malloc(target + 64);
+        size_t len = 0;
+
+        while (len < target) {
+            const char *w = words[next_random(&seed) % (sizeof(words) / sizeof(words[0]))];
+
+            len += sprintf(line + len, len ? " %s" : "%s", w);
+        }
+        pool[i] = line;
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, unsigned long n, double p)
+{
+    unsigned long i = (unsigned long)(p * (n - 1) + 0.5);
+
+    return sorted[i] / 1000.0;
+}
+
+/* Print one run: NAME, the PARAMS it ran with, and the spread of the N
+   latencies in LATENCY (sorted here) over SECONDS of wall time */
+static void report(const char *name, const char *params, uint64_t *latency, unsigned long n, double seconds)
+{
+    if (n == 0) {
+        return;
+    }
+    qsort(latency, n, sizeof(uint64_t), compare_u64);
+    printf("bench=%s %s ops=%lu seconds=%.3f ops_per_sec=%.1f "
+           "p50_us=%.3f p90_us=%.3f p99_us=%.3f p999_us=%.3f max_us=%.3f\n",
+           name, params, n, seconds, seconds > 0 ? n / seconds : 0,
+           percentile_us(latency, n, 0.50), percentile_us(latency, n, 0.90),
+           percentile_us(latency, n, 0.99), percentile_us(latency, n, 0.999),
+           latency[n - 1] / 1000.0);
+    fflush(stdout);
+}
+
+/* One operation of a run: the Ith, with a per-thread random state */
+typedef void (*bench_op_t)(void *context, unsigned long i, uint64_t *random);
+
+typedef struct {
+    bench_op_t op;
+    void *context;
+    unsigned long first;
+    unsigned long count;
+    uint64_t *latency;
+    uint64_t random;
+    pthread_barrier_t *start;
+} bench_worker_t;
+
+static void *bench_worker(void *arg)
+{
+    bench_worker_t *w = arg;
+
+    if (w->start) {
+        pthread_barrier_wait(w->start);
+    }
+    for (unsigned long i = 0; i < w->count; i++) {
+        uint64_t t0 = now_ns();
+
+        w->op(w->context, w->first + i, &w->random);
+        w->latency[i] = now_ns() - t0;
+    }
+    return NULL;
+}
+
+/* Run OPS operations split over THREADS threads, report them, and
+   return the wall time they took */
+static double bench_run(const char *name, const char *params, bench_op_t op, void *context,
+                        unsigned long ops, int threads)
+{
+    uint64_t *latency = malloc((ops ? ops : 1) * sizeof(uint64_t));
+    bench_worker_t *workers = calloc(threads, sizeof(bench_worker_t));
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    pthread_barrier_t start;
+    uint64_t t0;
+    double seconds;
+    int started = 0;
+
+    if (!latency || !workers || !ids) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        exit(1);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        workers[t].op = op;
+        workers[t].context = context;
+        workers[t].first = ops / threads * t;
+        workers[t].count = (t == threads - 1) ? ops - workers[t].first : ops / threads;
+        workers[t].latency = latency + workers[t].first;
+        workers[t].random = 0x2545f4914f6cdd1dULL * (t + 1);
+    }
+
+    if (threads == 1) {
+        t0 = now_ns();
+        bench_worker(&workers[0]);
+    } else {
+        pthread_barrier_init(&start, NULL, threads + 1);
+        for (int t = 0; t < threads; t++) {
+            workers[t].start = &start;
+            if (pthread_create(&ids[t], NULL, bench_worker, &workers[t]) != 0) {
+                fprintf(stderr, "%s: cannot start thread\n", name);
+                exit(1);
+            }
+            started++;
+        }
+        pthread_barrier_wait(&start);
+        t0 = now_ns();
+        for (int t = 0; t < started; t++) {
+            pthread_join(ids[t], NULL);
+        }
+        pthread_barrier_destroy(&start);
+    }
+    seconds = (now_ns() - t0) / 1e9;
+
+    report(name, params, latency, ops, seconds);
+    free(latency);
+    free(workers);
+    free(ids);
+    return seconds;
+}
+
+/* Response cache */
+
+typedef struct {
+    int hit_percent;
+    char response[257];
+} cache_context_t;
+
+static void cache_put_op(void *context, unsigned long i, uint64_t *random)
+{
+    cache_context_t *c = context;
+    char key[64];
+
+    (void)random;
+    snprintf(key, sizeof(key), "bench-put-%lu", i);
+    anbs_cache_put(key, c->response, 3600);
+}
+
+static void cache_get_op(void *context, unsigned long i, uint64_t *random)
+{
+    cache_context_t *c = context;
+    uint64_t r = next_random(random);
+    char key[64];
+
+    if ((int)(r % 100) < c->hit_percent) {
+        snprintf(key, sizeof(key), "bench-key-%d", (int)((r >> 8) % CACHE_KEYS));
+    } else {
+        snprintf(key, sizeof(key), "bench-miss-%lu", i);
+    }
+    free(anbs_cache_get(key, NULL));
+}
+
+static void bench_cache(void)
+{
+    static const int mixes[] = { 100, 90, 50, 0 };
+    cache_context_t c;
+    char key[64], params[64];
+
+    if (anbs_cache_init(CACHE_ENTRIES) != 0) {
+        fprintf(stderr, "cache: init failed\n");
+        return;
+    }
+    memset(c.response, 'r', sizeof(c.response) - 1);
+    c.response[sizeof(c.response) - 1] = '\0';
+    for (int k = 0; k < CACHE_KEYS; k++) {
+        snprintf(key, sizeof(key), "bench-key-%d", k);
+        anbs_cache_put(key, c.response, 3600);
+    }
+
+    for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+        c.hit_percent = mixes[m];
+        snprintf(params, sizeof(params), "threads=1 hit_percent=%d", c.hit_percent);
+        bench_run("cache.get", params, cache_get_op, &c, opt_ops, 1);
+    }
+    c.hit_percent = 90;
+    for (int t = 2; t <= opt_threads; t *= 2) {
+        snprintf(params, sizeof(params), "threads=%d hit_percent=%d", t, c.hit_percent);
+        bench_run("cache.get", params, cache_get_op, &c, opt_ops, t);
+    }
+    bench_run("cache.put", "threads=1", cache_put_op, &c, opt_ops, 1);
+    if (opt_threads > 1) {
+        snprintf(params, sizeof(params), "threads=%d", opt_threads);
+        bench_run("cache.put", params, cache_put_op, &c, opt_ops, opt_threads);
+    }
+    anbs_cache_cleanup();
+}
+
+/* Memory store */
+
+static void memory_add_op(void *context, unsigned long i, uint64_t *random)
+{
+    char content[320];
+
+    (void)context;
+    (void)random;
+    snprintf(content, sizeof(content), "%s #%lu", pool[i % POOL_SIZE], i);
+    anbs_memory_add(content, "/srv/bench", "bench");
+}
+
+static void memory_search_op(void *context, unsigned long i, uint64_t *random)
+{
+    memory_entry_t *results = NULL;
+    int n;
+
+    (void)context;
+    (void)i;
+    n = anbs_memory_search(pool[next_random(random) % POOL_SIZE], &results, SEARCH_RESULTS);
+    anbs_memory_free_results(results, n > 0 ? n : 0);
+}
+
+static void bench_memory(void)
+{
+    char *sizes = strdup(opt_sizes), *size, *state = NULL;
+    char path[PATH_MAX], value[32], params[64];
+
+    for (size = strtok_r(sizes, ",", &state); size; size = strtok_r(NULL, ",", &state)) {
+        unsigned long entries = strtoul(size, NULL, 10);
+        uint64_t t0;
+        double seconds;
+
+        if (entries == 0) {
+            continue;
+        }
+
+        /* A fresh store each time, big enough to keep every entry in RAM */
+        snprintf(path, sizeof(path), "%s/memory-%lu.db", scratch, entries);
+        setenv("ANBS_MEMORY_DB", path, 1);
+        snprintf(value, sizeof(value), "%lu", entries);
+        setenv("ANBS_MEMORY_CAPACITY", value, 1);
+        if (anbs_memory_init() != 0) {
+            fprintf(stderr, "memory: init failed for %lu entries\n", entries);
+            continue;
+        }
+
+        /* Adds only queue their entry; the rate counts until the store
+           has indexed and committed them all */
+        snprintf(params, sizeof(params), "entries=%lu threads=1", entries);
+        t0 = now_ns();
+        bench_run("memory.add.queue", params, memory_add_op, NULL, entries, 1);
+        anbs_memory_flush();
+        seconds = (now_ns() - t0) / 1e9;
+        printf("bench=memory.add %s ops=%lu seconds=%.3f ops_per_sec=%.1f\n",
+               params, entries, seconds, seconds > 0 ? entries / seconds : 0);
+
+        snprintf(params, sizeof(params), "entries=%lu threads=1 results=%d", entries, SEARCH_RESULTS);
+        bench_run("memory.search", params, memory_search_op, NULL, opt_queries, 1);
+        if (opt_threads > 1) {
+            snprintf(params, sizeof(params), "entries=%lu threads=%d results=%d",
+                     entries, opt_threads, SEARCH_RESULTS);
+            bench_run("memory.search", params, memory_search_op, NULL, opt_queries, opt_threads);
+        }
+        anbs_memory_cleanup();
+    }
+    unsetenv("ANBS_MEMORY_DB");
+    free(sizes);
+}
+
+/* Scrollback */
+
+static void text_append_op(void *context, unsigned long i, uint64_t *random)
+{
+    (void)random;
+    anbs_text_buffer_append(context, pool[i % POOL_SIZE]);
+}
+
+static void bench_text(void)
+{
+    text_buffer_t *buffer = NULL;
+
+    if (anbs_text_buffer_init(&buffer, 10000, 4 << 20) != 0) {
+        fprintf(stderr, "text: init failed\n");
+        return;
+    }
+    bench_run("text.append", "threads=1 max_lines=10000", text_append_op, buffer, opt_ops, 1);
+    anbs_text_buffer_cleanup(buffer);
+}
+
+/* Metrics */
+
+static void metrics_record_op(void *context, unsigned long i, uint64_t *random)
+{
+    (void)context;
+    (void)i;
+    anbs_metrics_record(BENCH_METRIC_RESPONSE_TIME, "bench",
+                        (double)(next_random(random) % 5000) / 10.0, NULL);
+}
+
+static void metrics_observe_op(void *context, unsigned long i, uint64_t *random)
+{
+    (void)i;
+    anbs_metrics_observe(context, (double)(next_random(random) % 5000) / 10.0);
+}
+
+static void bench_metrics(void)
+{
+    command_metrics_t *handle;
+    char params[32];
+
+    if (anbs_metrics_init() != 0) {
+        fprintf(stderr, "metrics: init failed\n");
+        return;
+    }
+    bench_run("metrics.record", "threads=1", metrics_record_op, NULL, opt_ops, 1);
+    if (opt_threads > 1) {
+        snprintf(params, sizeof(params), "threads=%d", opt_threads);
+        bench_run("metrics.record", params, metrics_record_op, NULL, opt_ops, opt_threads);
+    }
+    handle = anbs_metrics_handle(BENCH_METRIC_RESPONSE_TIME, "bench");
+    if (handle) {
+        bench_run("metrics.observe", "threads=1", metrics_observe_op, handle, opt_ops, 1);
+        if (opt_threads > 1) {
+            bench_run("metrics.observe", params, metrics_observe_op, handle, opt_ops, opt_threads);
+        }
+    }
+    anbs_metrics_cleanup();
+}
+
+/* Permissions */
+
+static void permissions_repeat_op(void *context, unsigned long i, uint64_t *random)
+{
+    (void)context;
+    (void)i;
+    (void)random;
+    anbs_permissions_check("bench-agent", "/usr/src/bash/jobs.c", BENCH_PERM_FILE_READ);
+}
+
+static void permissions_distinct_op(void *context, unsigned long i, uint64_t *random)
+{
+    char resource[64];
+
+    (void)context;
+    (void)random;
+    snprintf(resource, sizeof(resource), "/usr/src/project%lu/main.c", i);
+    anbs_permissions_check("bench-agent", resource, BENCH_PERM_FILE_READ);
+}
+
+static void bench_permissions(void)
+{
+    char path[PATH_MAX], params[48];
+
+    /* No policy file there, so the built-in roles apply */
+    snprintf(path, sizeof(path), "%s/permissions.json", scratch);
+    if (anbs_permissions_init(path) != 0 ||
+        anbs_permissions_assign_role("bench-agent", "developer") != 0) {
+        fprintf(stderr, "permissions: init failed\n");
+        return;
+    }
+    bench_run("permissions.check", "threads=1 resources=repeated", permissions_repeat_op, NULL, opt_ops, 1);
+    bench_run("permissions.check", "threads=1 resources=distinct", permissions_distinct_op, NULL, opt_ops, 1);
+    if (opt_threads > 1) {
+        snprintf(params, sizeof(params), "threads=%d resources=distinct", opt_threads);
+        bench_run("permissions.check", params, permissions_distinct_op, NULL, opt_ops, opt_threads);
+    }
+    anbs_permissions_cleanup();
+}
+
+/* WebSocket framing, against a loopback server that completes the
+   upgrade and throws away whatever it is sent */
+
+typedef struct {
+    int listen_fd;
+    int port;
+    int deflate;                /* offer permessage-deflate */
+    pthread_t thread;
+} ws_server_t;
+
+static void ws_server_session(ws_server_t *server, int fd)
+{
+    char request[4096], response[512], accept[64];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    char *key, *end;
+    size_t len = 0;
+    ssize_t n;
+
+    while (len < sizeof(request) - 1 && (n = read(fd, request + len, sizeof(request) - 1 - len)) > 0) {
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n")) {
+            break;
+        }
+    }
+    request[len] = '\0';
+    key = strcasestr(request, "\r\nSec-WebSocket-Key:");
+    if (!key) {
+        return;
+    }
+    key += strlen("\r\nSec-WebSocket-Key:");
+    key += strspn(key, " ");
+    end = strstr(key, "\r\n");
+    if (!end) {
+        return;
+    }
+
+    /* The accept value is base64(SHA-1(key + the protocol's GUID)) */
+    snprintf(response, sizeof(response), "%.*s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", (int)(end - key), key);
+    SHA1((const unsigned char *)response, strlen(response), digest);
+    EVP_EncodeBlock((unsigned char *)accept, digest, sizeof(digest));
+
+    len = snprintf(response, sizeof(response),
+                   "HTTP/1.1 101 Switching Protocols\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: %s\r\n"
+                   "%s"
+                   "\r\n",
+                   accept,
+                   server->deflate ? "Sec-WebSocket-Extensions: permessage-deflate\r\n" : "");
+    if (write(fd, response, len) != (ssize_t)len) {
+        return;
+    }
+
+    while (read(fd, request, sizeof(request)) > 0)
+        ;
+}
+
+static void *ws_server_run(void *arg)
+{
+    ws_server_t *server = arg;
+    int fd;
+
+    while ((fd = accept(server->listen_fd, NULL, NULL)) >= 0) {
+        ws_server_session(server, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int ws_server_start(ws_server_t *server)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addrlen = sizeof(addr);
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0 ||
+        bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(server->listen_fd, 1) != 0 ||
+        getsockname(server->listen_fd, (struct sockaddr *)&addr, &addrlen) != 0 ||
+        pthread_create(&server->thread, NULL, ws_server_run, server) != 0) {
+        if (server->listen_fd >= 0) {
+            close(server->listen_fd);
+        }
+        return -1;
+    }
+    server->port = ntohs(addr.sin_port);
+    return 0;
+}
+
+static void ws_server_stop(ws_server_t *server)
+{
+    shutdown(server->listen_fd, SHUT_RDWR);
+    close(server->listen_fd);
+    pthread_join(server->thread, NULL);
+}
+
+static void websocket_send_op(void *context, unsigned long i, uint64_t *random)
+{
+    (void)i;
+    (void)random;
+    anbs_websocket_send(context);
+}
+
+static void bench_websocket(void)
+{
+    static const size_t sizes[] = { 64, 1024, 16384 };
+    char params[64];
+
+    /* A run ends with the server hanging up; don't redial it */
+    setenv("ANBS_WS_RECONNECT", "0", 1);
+
+    for (int deflate = 0; deflate <= 1; deflate++) {
+        ws_server_t server = { .deflate = deflate };
+
+        if (ws_server_start(&server) != 0) {
+            fprintf(stderr, "websocket: cannot start loopback server\n");
+            return;
+        }
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            unsigned long ops = opt_ops;
+            char *message = malloc(sizes[s] + 1);
+            size_t len = 0;
+
+            /* Pool text makes the payloads compress like real traffic */
+            for (int p = 0; len < sizes[s]; p++) {
+                size_t take = strlen(pool[p % POOL_SIZE]);
+
+                if (take > sizes[s] - len) {
+                    take = sizes[s] - len;
+                }
+                memcpy(message + len, pool[p % POOL_SIZE], take);
+                len += take;
+            }
+            message[len] = '\0';
+            if (ops > WS_MAX_BYTES / sizes[s]) {
+                ops = WS_MAX_BYTES / sizes[s];
+            }
+
+            if (anbs_websocket_init(NULL, "127.0.0.1", server.port, "/bench", 0) != 0 ||
+                anbs_websocket_connect() != 0) {
+                fprintf(stderr, "websocket: cannot connect to loopback server\n");
+                anbs_websocket_cleanup();
+                free(message);
+                break;
+            }
+            snprintf(params, sizeof(params), "threads=1 bytes=%zu deflate=%d", sizes[s], deflate);
+            bench_run("websocket.send", params, websocket_send_op, message, ops, 1);
+            anbs_websocket_cleanup();
+            free(message);
+        }
+        ws_server_stop(&server);
+    }
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+int main(int argc, char **argv)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    opt_threads = cpus > 16 ? 16 : cpus > 0 ? (int)cpus : 1;
+
+    while ((opt = getopt(argc, argv, "b:n:t:s:q:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                benchmarks = optarg;
+                break;
+            case 'n':
+                opt_ops = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                opt_threads = atoi(optarg);
+                break;
+            case 's':
+                opt_sizes = optarg;
+                break;
+            case 'q':
+                opt_queries = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (opt_ops == 0 || opt_threads < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    /* Stores and policy files go in a scratch directory, and nothing
+       touches the caches, exports or stores other shells share */
+    snprintf(scratch, sizeof(scratch), "%s/anbs-bench.XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+    if (!mkdtemp(scratch)) {
+        perror(scratch);
+        return 1;
+    }
+    unsetenv("ANBS_SHARED_CACHE");
+    unsetenv("ANBS_CACHE_DIR");
+    unsetenv("ANBS_METRICS_EXPORT");
+    unsetenv("ANBS_TRACE");
+
+    make_pool();
+
+    if (selected("cache")) {
+        bench_cache();
+    }
+    if (selected("memory")) {
+        bench_memory();
+    }
+    if (selected("text")) {
+        bench_text();
+    }
+    if (selected("metrics")) {
+        bench_metrics();
+    }
+    if (selected("permissions")) {
+        bench_permissions();
+    }
+    if (selected("websocket")) {
+        bench_websocket();
+    }
+
+    nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    for (int i = 0; i < POOL_SIZE; i++) {
+        free(pool[i]);
+    }
+    return 0;
+}
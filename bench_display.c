@@ -0,0 +1,191 @@
+/* bench_display.c - Replay output through a headless ANBS display and
+   report what it cost the renderer */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <locale.h>
+
+#include "bash-5.2/ai_core/ai_display.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r lines/sec] [-d seconds] [-p terminal|chat] [-s COLSxLINES] [file]\n"
+            "Replays FILE (or stdin) line by line into a panel of a headless display.\n"
+            "  -r  lines written per second (default 0: as fast as possible)\n"
+            "  -d  keep replaying the input for this long (default: once)\n"
+            "  -p  panel written to (default terminal)\n"
+            "  -s  screen size (default 120x40)\n",
+            prog);
+}
+
+static double now_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Read all of FP into a NUL-terminated buffer */
+static char *read_all(FILE *fp, size_t *length)
+{
+    size_t size = 64 * 1024, used = 0, n;
+    char *data = malloc(size);
+
+    while (data && (n = fread(data + used, 1, size - used - 1, fp)) > 0) {
+        used += n;
+        if (used + 1 == size) {
+            char *grown = realloc(data, size * 2);
+
+            if (!grown) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+            size *= 2;
+        }
+    }
+    if (data) {
+        data[used] = '\0';
+        *length = used;
+    }
+    return data;
+}
+
+int main(int argc, char **argv)
+{
+    anbs_display_t *display = NULL;
+    anbs_headless_stats_t before, after;
+    double rate = 0, duration = 0, start, elapsed;
+    unsigned long lines = 0;
+    bool chat = false;
+    char size[32];
+    char *data, *line;
+    size_t length;
+    FILE *fp = stdin;
+    int opt;
+
+    setlocale(LC_ALL, "");
+
+    while ((opt = getopt(argc, argv, "r:d:p:s:h")) != -1) {
+        switch (opt) {
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'p':
+                chat = strcmp(optarg, "chat") == 0;
+                break;
+            case 's': {
+                int columns, rows;
+
+                if (sscanf(optarg, "%dx%d", &columns, &rows) != 2) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                snprintf(size, sizeof(size), "%d", columns);
+                setenv("ANBS_HEADLESS_COLUMNS", size, 1);
+                snprintf(size, sizeof(size), "%d", rows);
+                setenv("ANBS_HEADLESS_LINES", size, 1);
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (optind < argc && !(fp = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+    data = read_all(fp, &length);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    if (!data || length == 0) {
+        fprintf(stderr, "Nothing to replay\n");
+        return 1;
+    }
+
+    /* Frames are counted on this thread, so draw from it */
+    setenv("ANBS_RENDER_THREAD", "0", 0);
+    setenv("ANBS_SCROLLBACK_SPILL", "0", 0);
+
+    if (anbs_display_init_backend(&display, &anbs_headless_backend) != 0) {
+        fprintf(stderr, "Failed to initialize headless display\n");
+        return 1;
+    }
+    anbs_headless_stats(display, &before);
+
+    start = now_seconds();
+    line = data;
+    for (;;) {
+        char *end = strchr(line, '\n');
+        char saved;
+
+        if (!end) {
+            end = data + length;
+        } else {
+            end++;
+        }
+
+        saved = *end;
+        *end = '\0';
+        if (chat) {
+            anbs_ai_chat_write(display, line);
+        } else {
+            anbs_terminal_write(display, line);
+        }
+        *end = saved;
+        lines++;
+
+        line = end;
+        if (line >= data + length) {
+            if (now_seconds() - start >= duration) {
+                break;
+            }
+            line = data;
+        }
+
+        /* Hold to the rate, idling the way the shell's event loop does */
+        if (rate > 0) {
+            double due = start + lines / rate;
+            double wait;
+
+            while ((wait = due - now_seconds()) > 0) {
+                usleep(wait > 0.001 ? 1000 : (useconds_t)(wait * 1e6));
+                anbs_display_tick(display);
+            }
+        }
+        if (duration > 0 && now_seconds() - start >= duration) {
+            break;
+        }
+    }
+    anbs_display_flush(display);
+    elapsed = now_seconds() - start;
+
+    anbs_headless_stats(display, &after);
+    anbs_display_cleanup(display);
+    free(data);
+
+    after.frames -= before.frames;
+    after.bytes -= before.bytes;
+    after.cells -= before.cells;
+
+    printf("lines=%lu\n", lines);
+    printf("seconds=%.3f\n", elapsed);
+    printf("lines_per_sec=%.1f\n", elapsed > 0 ? lines / elapsed : 0);
+    printf("frames=%lu\n", after.frames);
+    printf("frames_per_sec=%.1f\n", elapsed > 0 ? after.frames / elapsed : 0);
+    printf("bytes=%llu\n", after.bytes);
+    printf("bytes_per_frame=%.1f\n", after.frames ? (double)after.bytes / after.frames : 0);
+    printf("cells_per_frame=%.1f\n", after.frames ? (double)after.cells / after.frames : 0);
+    return 0;
+}
@@ -0,0 +1,495 @@
+/* loadgen_ai.c - Drive @vertex and @memory through a set of real shells at
+   a target rate and report throughput and latency percentiles */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEFAULT_SHELL "bash-5.2/bash"
+#define MAX_SHELLS 1024
+#define MAX_WORKLOADS 8
+#define DRAIN_SECONDS 30           /* wait this long for in-flight commands at the end */
+#define SENTINEL "__loadgen_done__ "
+
+/* A kind of command and its share of the load */
+struct workload {
+    const char *name;
+    const char *format;            /* printf format; %d is the prompt number */
+    int weight;
+    double *latency_us;            /* scheduled arrival to completion */
+    size_t count;
+    size_t capacity;
+    unsigned long errors;
+};
+
+/* Commands for -m; each query is one of -u distinct prompts, so the
+   response cache sees a realistic mix of repeats */
+static const struct {
+    const char *name;
+    const char *format;
+} known_workloads[] = {
+    { "vertex", "@vertex \"loadgen question %d: how do I list open ports?\"" },
+    { "vertex-nocache", "@vertex --no-cache \"loadgen question %d: how do I list open ports?\"" },
+    { "vertex-stream", "@vertex --stream \"loadgen question %d: how do I list open ports?\"" },
+    { "memory", "@memory \"loadgen memory %d\"" },
+    { NULL, NULL }
+};
+
+/* One shell and the command it is running */
+struct shell {
+    pid_t pid;
+    int in;                        /* its stdin */
+    int out;                       /* its stdout and stderr */
+    char *buf;
+    size_t used;
+    size_t capacity;
+    bool busy;
+    int workload;
+    double scheduled;              /* ms the command was due */
+    double started;                /* ms it was written to the shell */
+};
+
+/* Arrivals that found every shell busy; ms each was due and its workload */
+struct backlog {
+    double *due;
+    int *workload;
+    size_t head;
+    size_t count;
+    size_t capacity;
+};
+
+static struct workload workloads[MAX_WORKLOADS];
+static int nworkloads;
+static int total_weight;
+
+static double *service_us;         /* written to completion, all workloads */
+static size_t service_count, service_capacity;
+
+static uint64_t rng_state = 0x853c49e6748fea9bULL;
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* xorshift64*; returns [0, 1) */
+static double uniform(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int push_sample(double **array, size_t *count, size_t *capacity, double value) {
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 4096;
+        double *p = realloc(*array, grown * sizeof(double));
+
+        if (!p) {
+            return -1;
+        }
+        *array = p;
+        *capacity = grown;
+    }
+    (*array)[(*count)++] = value;
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    size_t i;
+
+    if (n == 0) {
+        return 0.0;
+    }
+    i = (size_t)(p * (double)(n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+/* One line in the format bench_ai_core uses, so the same tools read both */
+static void report(const char *name, int shells, double target_qps, double seconds, double *samples,
+                   size_t n, unsigned long errors) {
+    qsort(samples, n, sizeof(double), compare_double);
+    printf("load=%s shells=%d target_qps=%g ops=%zu errors=%lu seconds=%.3f ops_per_sec=%.1f "
+           "p50_us=%.0f p90_us=%.0f p99_us=%.0f p999_us=%.0f max_us=%.0f\n",
+           name, shells, target_qps, n, errors, seconds, seconds > 0 ? n / seconds : 0.0,
+           percentile(samples, n, 0.50), percentile(samples, n, 0.90), percentile(samples, n, 0.99),
+           percentile(samples, n, 0.999), n ? samples[n - 1] : 0.0);
+}
+
+static int add_workload(const char *spec) {
+    char name[64];
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    int i, weight = colon ? atoi(colon + 1) : 1;
+
+    if (len >= sizeof(name) || weight <= 0 || nworkloads == MAX_WORKLOADS) {
+        return -1;
+    }
+    memcpy(name, spec, len);
+    name[len] = '\0';
+    for (i = 0; known_workloads[i].name; i++) {
+        if (strcmp(known_workloads[i].name, name) == 0) {
+            workloads[nworkloads].name = known_workloads[i].name;
+            workloads[nworkloads].format = known_workloads[i].format;
+            workloads[nworkloads].weight = weight;
+            total_weight += weight;
+            nworkloads++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int parse_mix(char *mix) {
+    char *save = NULL, *spec;
+
+    for (spec = strtok_r(mix, ",", &save); spec; spec = strtok_r(NULL, ",", &save)) {
+        if (add_workload(spec) < 0) {
+            fprintf(stderr, "loadgen_ai: bad workload: %s\n", spec);
+            return -1;
+        }
+    }
+    return nworkloads > 0 ? 0 : -1;
+}
+
+static int pick_workload(void) {
+    int i, w = (int)(uniform() * total_weight);
+
+    for (i = 0; i < nworkloads - 1; i++) {
+        if ((w -= workloads[i].weight) < 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+static int start_shell(struct shell *sh, const char *path) {
+    int in[2], out[2];
+
+    if (pipe2(in, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    sh->pid = fork();
+    if (sh->pid < 0) {
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        return -1;
+    }
+    if (sh->pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(out[1], 2);
+        execl(path, path, "--norc", "--noprofile", (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    sh->in = in[1];
+    sh->out = out[0];
+    sh->capacity = 4096;
+    sh->buf = malloc(sh->capacity + 1);
+    sh->used = 0;
+    sh->busy = false;
+    return sh->buf ? 0 : -1;
+}
+
+/* Hand the command for WORKLOAD, due at SCHEDULED, to an idle shell */
+static int dispatch(struct shell *sh, int workload, double scheduled, int prompts) {
+    char command[1024];
+    int n;
+
+    n = snprintf(command, sizeof(command), workloads[workload].format, (int)(uniform() * prompts));
+    n += snprintf(command + n, sizeof(command) - (size_t)n, "\nprintf '\\n%s%%d\\n' $?\n", SENTINEL);
+    sh->busy = true;
+    sh->workload = workload;
+    sh->scheduled = scheduled;
+    sh->started = now_ms();
+    sh->used = 0;
+    return write(sh->in, command, (size_t)n) == n ? 0 : -1;
+}
+
+/* Read what the shell wrote; returns its command's exit status once the
+   sentinel arrives, -1 while it is still running, -2 if the shell died */
+static int collect(struct shell *sh) {
+    ssize_t n;
+    char *mark;
+
+    if (sh->used == sh->capacity) {
+        /* Only the tail can hold the sentinel; keep enough of it */
+        size_t keep = sizeof(SENTINEL) + 16;
+
+        memmove(sh->buf, sh->buf + sh->used - keep, keep);
+        sh->used = keep;
+    }
+    n = read(sh->out, sh->buf + sh->used, sh->capacity - sh->used);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return -1;
+    }
+    if (n <= 0) {
+        return -2;
+    }
+    sh->used += (size_t)n;
+    sh->buf[sh->used] = '\0';
+
+    mark = memmem(sh->buf, sh->used, "\n" SENTINEL, sizeof(SENTINEL));
+    if (!mark || !memchr(mark + sizeof(SENTINEL), '\n', sh->used - (size_t)(mark - sh->buf) - sizeof(SENTINEL))) {
+        return -1;
+    }
+    return atoi(mark + sizeof(SENTINEL));
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: loadgen_ai [-S shell] [-n shells] [-q qps] [-d seconds] [-w warmup]\n"
+            "                  [-m workload[:weight],...] [-u prompts] [-p mock-port] [-x]\n"
+            "  workloads: vertex, vertex-nocache, vertex-stream, memory (default vertex)\n"
+            "  -p points each shell at mock_ai_provider on this port\n"
+            "  -x spaces arrivals exponentially instead of evenly\n");
+}
+
+int main(int argc, char **argv) {
+    const char *shell_path = DEFAULT_SHELL;
+    char mix[256] = "vertex";
+    struct shell *shells;
+    struct pollfd *pfds;
+    struct backlog queue = { 0 };
+    double qps = 100.0, duration = 10.0, warmup = 2.0;
+    double start, measure_from, stop_at, next_arrival, last_done;
+    unsigned long issued = 0, dropped_shells = 0, unfinished = 0;
+    int nshells = 8, prompts = 1000, mock_port = 0, exponential = 0;
+    int opt, i, live;
+
+    while ((opt = getopt(argc, argv, "S:n:q:d:w:m:u:p:x")) != -1) {
+        switch (opt) {
+        case 'S': shell_path = optarg; break;
+        case 'n': nshells = atoi(optarg); break;
+        case 'q': qps = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'm': snprintf(mix, sizeof(mix), "%s", optarg); break;
+        case 'u': prompts = atoi(optarg); break;
+        case 'p': mock_port = atoi(optarg); break;
+        case 'x': exponential = 1; break;
+        default: usage(); return 2;
+        }
+    }
+    if (nshells < 1 || nshells > MAX_SHELLS || qps <= 0 || duration <= 0 || warmup < 0 || prompts < 1 ||
+        parse_mix(mix) < 0) {
+        usage();
+        return 2;
+    }
+    if (access(shell_path, X_OK) < 0) {
+        fprintf(stderr, "loadgen_ai: %s: %s\n", shell_path, strerror(errno));
+        return 2;
+    }
+
+    if (mock_port > 0) {
+        char url[128];
+
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/v1/messages", mock_port);
+        setenv("ANBS_ANTHROPIC_URL", url, 1);
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/v1/chat/completions", mock_port);
+        setenv("ANBS_OPENAI_URL", url, 1);
+        setenv("ANTHROPIC_API_KEY", "mock", 0);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    shells = calloc((size_t)nshells, sizeof(*shells));
+    pfds = calloc((size_t)nshells, sizeof(*pfds));
+    if (!shells || !pfds) {
+        return 1;
+    }
+    for (i = 0; i < nshells; i++) {
+        if (start_shell(&shells[i], shell_path) < 0) {
+            fprintf(stderr, "loadgen_ai: cannot start %s: %s\n", shell_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    start = now_ms();
+    measure_from = start + warmup * 1000.0;
+    stop_at = measure_from + duration * 1000.0;
+    next_arrival = start;
+    last_done = start;
+    live = nshells;
+
+    /* Open loop: arrivals keep their schedule however slowly the shells
+       answer, and latency counts from when each command was due, so a
+       stall shows up in the percentiles instead of lowering the rate */
+    for (;;) {
+        double now = now_ms();
+        int timeout, busy = 0;
+
+        while (next_arrival <= now && next_arrival < stop_at) {
+            int w = pick_workload();
+
+            for (i = 0; i < nshells && (shells[i].busy || shells[i].pid <= 0); i++)
+                ;
+            if (i < nshells) {
+                if (dispatch(&shells[i], w, next_arrival, prompts) < 0) {
+                    shells[i].pid = -shells[i].pid;
+                    live--;
+                }
+            } else {
+                if (queue.count == queue.capacity) {
+                    size_t grown = queue.capacity ? queue.capacity * 2 : 1024, k;
+                    double *due = malloc(grown * sizeof(double));
+                    int *work = malloc(grown * sizeof(int));
+
+                    if (!due || !work) {
+                        return 1;
+                    }
+                    for (k = 0; k < queue.count; k++) {
+                        due[k] = queue.due[(queue.head + k) % queue.capacity];
+                        work[k] = queue.workload[(queue.head + k) % queue.capacity];
+                    }
+                    free(queue.due);
+                    free(queue.workload);
+                    queue.due = due;
+                    queue.workload = work;
+                    queue.head = 0;
+                    queue.capacity = grown;
+                }
+                queue.due[(queue.head + queue.count) % queue.capacity] = next_arrival;
+                queue.workload[(queue.head + queue.count) % queue.capacity] = w;
+                queue.count++;
+            }
+            issued++;
+            next_arrival += (exponential ? -log(1.0 - uniform()) : 1.0) * 1000.0 / qps;
+        }
+
+        for (i = 0; i < nshells; i++) {
+            pfds[i].fd = shells[i].pid > 0 ? shells[i].out : -1;
+            pfds[i].events = POLLIN;
+            busy += shells[i].pid > 0 && shells[i].busy;
+        }
+        if (live == 0 || (now >= stop_at && ((busy == 0 && queue.count == 0) ||
+                                             now >= stop_at + DRAIN_SECONDS * 1000.0))) {
+            break;
+        }
+
+        timeout = now < stop_at ? (int)ceil(next_arrival - now) : 100;
+        if (timeout < 0) {
+            timeout = 0;
+        }
+        if (poll(pfds, (nfds_t)nshells, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+
+        for (i = 0; i < nshells; i++) {
+            struct shell *sh = &shells[i];
+            int status;
+
+            if (sh->pid <= 0 || !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            status = collect(sh);
+            if (status == -1) {
+                continue;
+            }
+            now = now_ms();
+            if (status == -2) {
+                /* The shell exited; its command never finished */
+                fprintf(stderr, "loadgen_ai: shell %d exited\n", (int)sh->pid);
+                sh->pid = -sh->pid;
+                live--;
+                dropped_shells++;
+                if (sh->busy && sh->scheduled >= measure_from) {
+                    workloads[sh->workload].errors++;
+                }
+                continue;
+            }
+            sh->busy = false;
+            last_done = now;
+            if (sh->scheduled >= measure_from) {
+                struct workload *w = &workloads[sh->workload];
+
+                push_sample(&w->latency_us, &w->count, &w->capacity, (now - sh->scheduled) * 1000.0);
+                push_sample(&service_us, &service_count, &service_capacity, (now - sh->started) * 1000.0);
+                if (status != 0) {
+                    w->errors++;
+                }
+            }
+            if (queue.count > 0) {
+                int w = queue.workload[queue.head];
+                double due = queue.due[queue.head];
+
+                queue.head = (queue.head + 1) % queue.capacity;
+                queue.count--;
+                if (dispatch(sh, w, due, prompts) < 0) {
+                    sh->pid = -sh->pid;
+                    live--;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < nshells; i++) {
+        unfinished += shells[i].pid > 0 && shells[i].busy;
+    }
+    unfinished += queue.count;
+
+    /* Throughput over the measured window, or until the last completion
+       if the shells fell behind */
+    {
+        double end = last_done > stop_at ? last_done : stop_at;
+        double seconds = (end - measure_from) / 1000.0;
+        double *all = NULL;
+        size_t all_count = 0, all_capacity = 0, k;
+        unsigned long errors = 0;
+
+        for (i = 0; i < nworkloads; i++) {
+            struct workload *w = &workloads[i];
+
+            for (k = 0; k < w->count; k++) {
+                push_sample(&all, &all_count, &all_capacity, w->latency_us[k]);
+            }
+            errors += w->errors;
+            if (nworkloads > 1) {
+                report(w->name, nshells, qps * w->weight / total_weight, seconds, w->latency_us, w->count, w->errors);
+            }
+        }
+        report("all", nshells, qps, seconds, all, all_count, errors);
+        report("service", nshells, qps, seconds, service_us, service_count, errors);
+        printf("issued=%lu unfinished=%lu shells_lost=%lu\n", issued, unfinished, dropped_shells);
+        free(all);
+    }
+
+    for (i = 0; i < nshells; i++) {
+        pid_t pid = shells[i].pid > 0 ? shells[i].pid : -shells[i].pid;
+
+        close(shells[i].in);
+        close(shells[i].out);
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+        free(shells[i].buf);
+    }
+    return unfinished > 0 || dropped_shells > 0;
+}
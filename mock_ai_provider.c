@@ -0,0 +1,606 @@
+/* mock_ai_provider.c - Answer Anthropic and OpenAI style requests locally
+   with configurable latency, streaming, rate limiting and failures, so
+   @vertex and the layers under it can be load tested without a paid API */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_PORT 8765
+#define REQUEST_MAX (1024 * 1024)  /* largest request head plus body accepted */
+#define PROMPT_ECHO 48             /* prompt bytes quoted back in each reply */
+#define WORD_BYTES 6               /* average bytes per reply word */
+
+/* How long each response takes before its first byte */
+enum latency_kind {
+    LATENCY_FIXED,
+    LATENCY_UNIFORM,
+    LATENCY_EXP,
+    LATENCY_LOGNORMAL
+};
+
+struct mock_config {
+    int port;
+    enum latency_kind latency;
+    double latency_a;              /* fixed or median ms, or the low bound */
+    double latency_b;              /* high bound, or lognormal sigma */
+    double rate_limit;             /* fraction answered 429 */
+    double failure;                /* fraction answered 500 */
+    double drop;                   /* fraction whose connection is closed unanswered */
+    double qps_limit;              /* answer 429 past this many requests a second; 0 off */
+    int words;                     /* words per reply */
+    int chunk_words;               /* words per streamed delta */
+    double chunk_ms;               /* pause between streamed deltas */
+    int quiet;
+};
+
+static struct mock_config config = {
+    DEFAULT_PORT, LATENCY_FIXED, 50.0, 0.0, 0.0, 0.0, 0.0, 0.0, 40, 4, 5.0, 0
+};
+
+/* Totals printed when the server stops */
+static struct {
+    unsigned long connections;
+    unsigned long requests;
+    unsigned long streamed;
+    unsigned long ok;
+    unsigned long limited;
+    unsigned long failed;
+    unsigned long dropped;
+    unsigned long bad;
+} stats;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Token bucket behind -Q */
+static double bucket_tokens;
+static double bucket_at;
+static pthread_mutex_t bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t stopping;
+
+#define COUNT(field) do { \
+    pthread_mutex_lock(&stats_mutex); stats.field++; pthread_mutex_unlock(&stats_mutex); \
+} while (0)
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void sleep_ms(double ms) {
+    struct timespec ts;
+
+    if (ms <= 0) {
+        return;
+    }
+    ts.tv_sec = (time_t)(ms / 1000.0);
+    ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1e6);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !stopping)
+        ;
+}
+
+/* xorshift64*, one state per connection thread; returns [0, 1) */
+static double uniform(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double normal(uint64_t *state) {
+    double u = uniform(state), v = uniform(state);
+
+    return sqrt(-2.0 * log(u > 0 ? u : 1e-300)) * cos(2.0 * M_PI * v);
+}
+
+static double sample_latency(uint64_t *state) {
+    switch (config.latency) {
+    case LATENCY_UNIFORM:
+        return config.latency_a + (config.latency_b - config.latency_a) * uniform(state);
+    case LATENCY_EXP:
+        return -config.latency_a * log(1.0 - uniform(state));
+    case LATENCY_LOGNORMAL:
+        return config.latency_a * exp(config.latency_b * normal(state));
+    default:
+        return config.latency_a;
+    }
+}
+
+/* Take one token from the -Q bucket; false when the request is over the limit */
+static bool bucket_take(void) {
+    double now;
+    bool ok;
+
+    if (config.qps_limit <= 0) {
+        return true;
+    }
+    pthread_mutex_lock(&bucket_mutex);
+    now = now_ms();
+    if (bucket_at == 0) {
+        bucket_tokens = config.qps_limit;
+    } else {
+        bucket_tokens += (now - bucket_at) * config.qps_limit / 1000.0;
+    }
+    if (bucket_tokens > config.qps_limit) {
+        bucket_tokens = config.qps_limit;
+    }
+    bucket_at = now;
+    ok = bucket_tokens >= 1.0;
+    if (ok) {
+        bucket_tokens -= 1.0;
+    }
+    pthread_mutex_unlock(&bucket_mutex);
+    return ok;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Send one HTTP/1.1 chunk; an empty one ends the body */
+static int write_chunk(int fd, const char *data, size_t len) {
+    char head[32];
+    int n = snprintf(head, sizeof(head), "%zx\r\n", len);
+
+    if (write_all(fd, head, (size_t)n) < 0 || write_all(fd, data, len) < 0) {
+        return -1;
+    }
+    return write_all(fd, "\r\n", 2);
+}
+
+/* Value of header NAME in the request head, or NULL; VALUE gets at most SIZE - 1 bytes */
+static char *header_value(const char *head, const char *name, char *value, size_t size) {
+    const char *p = head;
+    size_t namelen = strlen(name), i;
+
+    while ((p = strstr(p, "\r\n")) != NULL) {
+        p += 2;
+        if (strncasecmp(p, name, namelen) == 0 && p[namelen] == ':') {
+            p += namelen + 1;
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            for (i = 0; i + 1 < size && p[i] && p[i] != '\r'; i++) {
+                value[i] = p[i];
+            }
+            value[i] = '\0';
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/* Copy the first message's content out of a request body, JSON escapes
+   and all, as far as PROMPT_ECHO bytes.  Quotes the reply can echo as is. */
+static void find_prompt(const char *body, char *prompt, size_t size) {
+    const char *p = strstr(body, "\"content\"");
+    size_t i = 0, n;
+
+    prompt[0] = '\0';
+    if (!p || !(p = strchr(p + 9, '"'))) {
+        return;
+    }
+    for (p++; *p && *p != '"'; p += n) {
+        n = (*p != '\\') ? 1 : (p[1] == 'u') ? 6 : 2;
+        if (i + n >= size || strnlen(p, n) < n) {
+            break;
+        }
+        memcpy(prompt + i, p, n);
+        i += n;
+    }
+    prompt[i] = '\0';
+}
+
+/* Reply text of about WORDS words for PROMPT */
+static void make_reply(const char *prompt, int words, char *text, size_t size) {
+    static const char *vocab[] = {
+        "the", "shell", "command", "returns", "output", "from", "a", "pipeline",
+        "with", "status", "zero", "when", "every", "stage", "succeeds", "quickly"
+    };
+    size_t len;
+    int i;
+
+    len = (size_t)snprintf(text, size, "mock reply to \\\"%s\\\":", prompt);
+    for (i = 0; i < words && len + 12 < size; i++) {
+        len += (size_t)snprintf(text + len, size - len, " %s", vocab[i % 16]);
+    }
+}
+
+static int send_simple(int fd, int status, const char *reason, const char *extra, const char *body, bool keep) {
+    char head[512];
+    int n;
+
+    n = snprintf(head, sizeof(head),
+                 "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n%s%s\r\n",
+                 status, reason, strlen(body), extra ? extra : "", keep ? "" : "Connection: close\r\n");
+    if (write_all(fd, head, (size_t)n) < 0) {
+        return -1;
+    }
+    return write_all(fd, body, strlen(body));
+}
+
+/* Reply to a completed request; false when the connection should close */
+static bool answer(int fd, const char *head, const char *body, bool keep, uint64_t *rng) {
+    char method[16], path[256], prompt[PROMPT_ECHO * 2 + 4];
+    char *reply, *json;
+    bool openai, stream, ok;
+    size_t reply_size;
+    double roll;
+
+    if (sscanf(head, "%15s %255s", method, path) != 2) {
+        COUNT(bad);
+        send_simple(fd, 400, "Bad Request", NULL, "{\"error\": \"bad request line\"}", false);
+        return false;
+    }
+
+    /* @vertex prewarms connections with HEAD requests */
+    if (strcmp(method, "HEAD") == 0) {
+        return send_simple(fd, 200, "OK", NULL, "", keep) == 0 && keep;
+    }
+    if (strcmp(method, "GET") == 0 && strcmp(path, "/stats") == 0) {
+        char text[512];
+
+        pthread_mutex_lock(&stats_mutex);
+        snprintf(text, sizeof(text), "{\"connections\": %lu, \"requests\": %lu, \"streamed\": %lu, \"ok\": %lu, "
+                 "\"rate_limited\": %lu, \"failed\": %lu, \"dropped\": %lu, \"bad\": %lu}",
+                 stats.connections, stats.requests, stats.streamed, stats.ok, stats.limited,
+                 stats.failed, stats.dropped, stats.bad);
+        pthread_mutex_unlock(&stats_mutex);
+        return send_simple(fd, 200, "OK", NULL, text, keep) == 0 && keep;
+    }
+    if (strcmp(method, "POST") != 0 || (!strstr(path, "/messages") && !strstr(path, "/chat/completions"))) {
+        COUNT(bad);
+        return send_simple(fd, 404, "Not Found", NULL, "{\"error\": \"no such endpoint\"}", keep) == 0 && keep;
+    }
+
+    COUNT(requests);
+    openai = strstr(path, "/chat/completions") != NULL;
+    stream = strstr(body, "\"stream\": true") || strstr(body, "\"stream\":true");
+
+    roll = uniform(rng);
+    if (roll < config.drop) {
+        COUNT(dropped);
+        return false;
+    }
+    roll -= config.drop;
+    if (roll < config.rate_limit || !bucket_take()) {
+        COUNT(limited);
+        sleep_ms(sample_latency(rng) / 10.0);
+        return send_simple(fd, 429, "Too Many Requests", "Retry-After: 1\r\n",
+                           openai ? "{\"error\": {\"type\": \"rate_limit_error\", \"message\": \"mock rate limit\"}}"
+                                  : "{\"type\": \"error\", \"error\": {\"type\": \"rate_limit_error\", "
+                                    "\"message\": \"mock rate limit\"}}", keep) == 0 && keep;
+    }
+    roll -= config.rate_limit;
+    sleep_ms(sample_latency(rng));
+    if (roll < config.failure) {
+        COUNT(failed);
+        return send_simple(fd, 500, "Internal Server Error", NULL,
+                           "{\"type\": \"error\", \"error\": {\"type\": \"api_error\", \"message\": \"mock failure\"}}",
+                           keep) == 0 && keep;
+    }
+
+    find_prompt(body, prompt, sizeof(prompt));
+    reply_size = (size_t)config.words * (WORD_BYTES + 4) + sizeof(prompt) + 64;
+    reply = malloc(reply_size);
+    json = malloc(reply_size + 256);
+    if (!reply || !json) {
+        free(reply);
+        free(json);
+        return false;
+    }
+    make_reply(prompt, config.words, reply, reply_size);
+
+    if (!stream) {
+        if (openai) {
+            snprintf(json, reply_size + 256, "{\"id\": \"chatcmpl-mock\", \"object\": \"chat.completion\", "
+                     "\"choices\": [{\"index\": 0, \"message\": {\"role\": \"assistant\", \"content\": \"%s\"}, "
+                     "\"finish_reason\": \"stop\"}]}", reply);
+        } else {
+            snprintf(json, reply_size + 256, "{\"id\": \"msg_mock\", \"type\": \"message\", \"role\": \"assistant\", "
+                     "\"content\": [{\"type\": \"text\", \"text\": \"%s\"}], \"stop_reason\": \"end_turn\"}", reply);
+        }
+        ok = send_simple(fd, 200, "OK", NULL, json, keep) == 0;
+        COUNT(ok);
+        free(reply);
+        free(json);
+        return ok && keep;
+    }
+
+    /* Server-sent events in chunked encoding, CHUNK_WORDS words a delta */
+    COUNT(streamed);
+    {
+        const char *head = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nTransfer-Encoding: chunked\r\n\r\n";
+        ok = write_all(fd, head, strlen(head)) == 0;
+    }
+    if (ok && !openai) {
+        const char *start = "event: message_start\ndata: {\"type\": \"message_start\", \"message\": "
+                            "{\"id\": \"msg_mock\", \"role\": \"assistant\"}}\n\n";
+        ok = write_chunk(fd, start, strlen(start)) == 0;
+    }
+    {
+        char *p = reply, *end;
+        int words;
+
+        while (ok && *p) {
+            /* Deltas break before a space, which no JSON escape contains */
+            for (end = p, words = 0; *end; end++) {
+                if (*end == ' ' && end != p && ++words == config.chunk_words) {
+                    break;
+                }
+            }
+            int n = openai
+                ? snprintf(json, reply_size + 256, "data: {\"object\": \"chat.completion.chunk\", "
+                           "\"choices\": [{\"index\": 0, \"delta\": {\"content\": \"%.*s\"}}]}\n\n", (int)(end - p), p)
+                : snprintf(json, reply_size + 256, "event: content_block_delta\ndata: {\"type\": \"content_block_delta\", "
+                           "\"index\": 0, \"delta\": {\"type\": \"text_delta\", \"text\": \"%.*s\"}}\n\n",
+                           (int)(end - p), p);
+            ok = write_chunk(fd, json, (size_t)n) == 0;
+            p = end;
+            if (*p) {
+                sleep_ms(config.chunk_ms);
+            }
+        }
+    }
+    if (ok) {
+        const char *stop = openai ? "data: [DONE]\n\n"
+                                  : "event: message_stop\ndata: {\"type\": \"message_stop\"}\n\n";
+        ok = write_chunk(fd, stop, strlen(stop)) == 0 && write_chunk(fd, "", 0) == 0;
+    }
+    if (ok) {
+        COUNT(ok);
+    }
+    free(reply);
+    free(json);
+    return ok && keep;
+}
+
+/* Serve requests on one keep-alive connection until the client goes away */
+static void *serve_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    uint64_t rng = ((uint64_t)(uintptr_t)&rng ^ (uint64_t)now_ms() * 0x9E3779B97F4A7C15ULL) | 1;
+    size_t used = 0, cap = 16384;
+    char *buf = malloc(cap + 1);
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while (buf && !stopping) {
+        char *head_end, value[64];
+        size_t head_len, body_len = 0, total;
+        bool keep = true;
+        ssize_t n;
+
+        buf[used] = '\0';
+        head_end = strstr(buf, "\r\n\r\n");
+        if (!head_end) {
+            if (used >= REQUEST_MAX) {
+                break;
+            }
+            if (used == cap) {
+                char *grown = realloc(buf, cap * 2 + 1);
+
+                if (!grown) {
+                    break;
+                }
+                buf = grown;
+                cap *= 2;
+            }
+            n = recv(fd, buf + used, cap - used, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            used += (size_t)n;
+            continue;
+        }
+
+        head_len = (size_t)(head_end - buf) + 4;
+        *head_end = '\0';
+        if (header_value(buf, "Content-Length", value, sizeof(value))) {
+            body_len = strtoul(value, NULL, 10);
+        }
+        if (header_value(buf, "Connection", value, sizeof(value)) && strcasecmp(value, "close") == 0) {
+            keep = false;
+        }
+        if (header_value(buf, "Expect", value, sizeof(value)) && strcasecmp(value, "100-continue") == 0 &&
+            used == head_len) {
+            write_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+        }
+        total = head_len + body_len;
+        if (total > REQUEST_MAX) {
+            COUNT(bad);
+            send_simple(fd, 413, "Payload Too Large", NULL, "{\"error\": \"request too large\"}", false);
+            break;
+        }
+
+        /* Read the rest of the body */
+        if (total > cap) {
+            char *grown = realloc(buf, total + 1);
+
+            if (!grown) {
+                break;
+            }
+            buf = grown;
+            cap = total;
+        }
+        while (used < total) {
+            n = recv(fd, buf + used, cap - used, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                goto done;
+            }
+            used += (size_t)n;
+        }
+
+        {
+            char saved = buf[total];
+
+            buf[total] = '\0';
+            if (!answer(fd, buf, buf + head_len, keep, &rng)) {
+                break;
+            }
+            buf[total] = saved;
+        }
+
+        /* Pipelined bytes belong to the next request */
+        memmove(buf, buf + total, used - total);
+        used -= total;
+    }
+
+done:
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static int parse_latency(const char *spec) {
+    if (sscanf(spec, "uniform:%lf:%lf", &config.latency_a, &config.latency_b) == 2) {
+        config.latency = LATENCY_UNIFORM;
+    } else if (sscanf(spec, "exp:%lf", &config.latency_a) == 1) {
+        config.latency = LATENCY_EXP;
+    } else if (sscanf(spec, "lognormal:%lf:%lf", &config.latency_a, &config.latency_b) == 2) {
+        config.latency = LATENCY_LOGNORMAL;
+    } else if (sscanf(spec, "fixed:%lf", &config.latency_a) == 1 ||
+               sscanf(spec, "%lf", &config.latency_a) == 1) {
+        config.latency = LATENCY_FIXED;
+    } else {
+        return -1;
+    }
+    return config.latency_a >= 0 && config.latency_b >= 0 ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-p port] [-l latency] [-r 429-rate] [-f failure-rate] [-d drop-rate]\n"
+            "          [-Q qps] [-w words] [-c chunk-words] [-i chunk-ms] [-q]\n"
+            "  latency: MS, fixed:MS, uniform:LO:HI, exp:MEAN or lognormal:MEDIAN:SIGMA (default 50)\n"
+            "  -p 0 picks a free port; the port is printed on stdout either way\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_in addr;
+    struct sigaction sa;
+    socklen_t len;
+    pthread_attr_t attr;
+    int opt, lfd, one = 1;
+
+    while ((opt = getopt(argc, argv, "p:l:r:f:d:Q:w:c:i:q")) != -1) {
+        switch (opt) {
+        case 'p': config.port = atoi(optarg); break;
+        case 'l':
+            if (parse_latency(optarg) < 0) {
+                fprintf(stderr, "%s: bad latency: %s\n", argv[0], optarg);
+                return 2;
+            }
+            break;
+        case 'r': config.rate_limit = atof(optarg); break;
+        case 'f': config.failure = atof(optarg); break;
+        case 'd': config.drop = atof(optarg); break;
+        case 'Q': config.qps_limit = atof(optarg); break;
+        case 'w': config.words = atoi(optarg); break;
+        case 'c': config.chunk_words = atoi(optarg); break;
+        case 'i': config.chunk_ms = atof(optarg); break;
+        case 'q': config.quiet = 1; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (config.words < 0 || config.chunk_words < 1 || config.rate_limit + config.failure + config.drop > 1.0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)config.port);
+    len = sizeof(addr);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 1024) < 0 ||
+        getsockname(lfd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("bind");
+        return 1;
+    }
+    printf("%d\n", ntohs(addr.sin_port));
+    fflush(stdout);
+
+    /* accept() must see the signal, so no SA_RESTART */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+
+    while (!stopping) {
+        pthread_t thread;
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+                sleep_ms(10);
+            }
+            continue;
+        }
+        COUNT(connections);
+        if (pthread_create(&thread, &attr, serve_connection, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+        }
+    }
+
+    if (!config.quiet) {
+        pthread_mutex_lock(&stats_mutex);
+        fprintf(stderr, "connections=%lu requests=%lu streamed=%lu ok=%lu rate_limited=%lu failed=%lu "
+                "dropped=%lu bad=%lu\n", stats.connections, stats.requests, stats.streamed, stats.ok,
+                stats.limited, stats.failed, stats.dropped, stats.bad);
+        pthread_mutex_unlock(&stats_mutex);
+    }
+    close(lfd);
+    return 0;
+}
@@ -163,6 +163,28 @@ if pkg-config --exists libwebsockets; then
     export LDFLAGS="$LDFLAGS $(pkg-config --libs libwebsockets)"
 fi
 
+# Optional non-cryptographic cache keys (faster, not collision resistant)
+if [[ "${ANBS_FAST_CACHE_HASH:-0}" == 1 ]] && pkg-config --exists libxxhash; then
+    export CFLAGS="$CFLAGS $(pkg-config --cflags libxxhash) -DANBS_CACHE_XXHASH"
+    export LDFLAGS="$LDFLAGS $(pkg-config --libs libxxhash)"
+fi
+
+# Optional compression of large cached responses
+case "${ANBS_CACHE_COMPRESSION:-none}" in
+    zstd)
+        if pkg-config --exists libzstd; then
+            export CFLAGS="$CFLAGS $(pkg-config --cflags libzstd) -DANBS_CACHE_ZSTD"
+            export LDFLAGS="$LDFLAGS $(pkg-config --libs libzstd)"
+        fi
+        ;;
+    lz4)
+        if pkg-config --exists liblz4; then
+            export CFLAGS="$CFLAGS $(pkg-config --cflags liblz4) -DANBS_CACHE_LZ4"
+            export LDFLAGS="$LDFLAGS $(pkg-config --libs liblz4)"
+        fi
+        ;;
+esac
+
 # Add AI core module paths
 export CFLAGS="$CFLAGS -I./ai_core -I./ai_core/security -DANBS_AI_ENABLED"
 